@@ -0,0 +1,159 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <random>
+#include <stdexcept>
+#include <string>
+namespace redis {
+
+enum class key_distribution {
+    uniform,
+    zipfian,
+    hotset,
+};
+
+// Parses "uniform", "zipfian" or "hotset", throws std::invalid_argument on
+// other names.
+inline key_distribution to_key_distribution(const std::string& name)
+{
+    if (name == "uniform") {
+        return key_distribution::uniform;
+    }
+    if (name == "zipfian") {
+        return key_distribution::zipfian;
+    }
+    if (name == "hotset") {
+        return key_distribution::hotset;
+    }
+    throw std::invalid_argument("unknown key distribution: " + name);
+}
+
+// Draws key numbers in [0, keys):
+// - uniform: every key alike.
+// - zipfian: the key of rank r with a probability proportional to
+//   1 / r^theta, as the generator of YCSB (Gray et al., "Quickly generating
+//   billion-record synthetic databases"). The ranks are scattered over the
+//   key space by a hash, so the hot keys do not sit on one shard.
+// - hotset: `hot_probability` of the draws go to the first `hot_fraction`
+//   of the keys, the others to the rest.
+class key_generator {
+    key_distribution _distribution;
+    uint64_t _keys;
+    double _theta;
+    double _zeta_n = 0;
+    double _alpha = 0;
+    double _eta = 0;
+    uint64_t _hot_keys = 0;
+    double _hot_probability = 0;
+    std::mt19937_64 _random;
+    std::uniform_real_distribution<double> _unit { 0.0, 1.0 };
+
+    static double zeta(uint64_t n, double theta)
+    {
+        double sum = 0;
+        for (uint64_t i = 1; i <= n; ++i) {
+            sum += 1 / std::pow(double(i), theta);
+        }
+        return sum;
+    }
+
+    static inline uint64_t scatter(uint64_t v)
+    {
+        // FNV-1a over the bytes of the rank.
+        uint64_t h = 14695981039346656037ull;
+        for (int i = 0; i < 8; ++i) {
+            h ^= (v >> (i * 8)) & 0xff;
+            h *= 1099511628211ull;
+        }
+        return h;
+    }
+
+    uint64_t next_zipfian()
+    {
+        auto u = _unit(_random);
+        auto uz = u * _zeta_n;
+        uint64_t rank;
+        if (uz < 1) {
+            rank = 0;
+        }
+        else if (uz < 1 + std::pow(0.5, _theta)) {
+            rank = 1;
+        }
+        else {
+            rank = static_cast<uint64_t>(_keys * std::pow(_eta * u - _eta + 1, _alpha));
+        }
+        return scatter(std::min(rank, _keys - 1)) % _keys;
+    }
+public:
+    key_generator(key_distribution distribution, uint64_t keys, double theta, double hot_fraction, double hot_probability, uint64_t seed)
+        : _distribution(distribution)
+        , _keys(std::max<uint64_t>(1, keys))
+        , _theta(theta)
+        , _random(seed)
+    {
+        if (_distribution == key_distribution::zipfian) {
+            _zeta_n = zeta(_keys, _theta);
+            _alpha = 1 / (1 - _theta);
+            _eta = (1 - std::pow(2.0 / _keys, 1 - _theta)) / (1 - zeta(2, _theta) / _zeta_n);
+        }
+        _hot_keys = std::max<uint64_t>(1, static_cast<uint64_t>(_keys * hot_fraction));
+        _hot_probability = hot_probability;
+    }
+
+    // Starts another sequence, keeping the tables of the distribution: a
+    // generator is built once per shard and copied for each connection.
+    void reseed(uint64_t seed)
+    {
+        _random.seed(seed);
+    }
+
+    uint64_t next()
+    {
+        switch (_distribution) {
+        case key_distribution::zipfian:
+            return next_zipfian();
+        case key_distribution::hotset:
+            if (_unit(_random) < _hot_probability || _hot_keys >= _keys) {
+                return _random() % _hot_keys;
+            }
+            return _hot_keys + _random() % (_keys - _hot_keys);
+        default:
+            return _random() % _keys;
+        }
+    }
+
+    // A number in [min, max], uniformly: the size of the next value.
+    uint64_t next_in(uint64_t min, uint64_t max)
+    {
+        return min >= max ? min : min + _random() % (max - min + 1);
+    }
+
+    // Whether the next request is a write, with probability `ratio`.
+    bool next_is(double ratio)
+    {
+        return _unit(_random) < ratio;
+    }
+};
+
+}
@@ -0,0 +1,111 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+namespace redis {
+
+// A log-linear histogram of latencies in nanoseconds, in the manner of
+// HdrHistogram: values below 2^sub_bucket_bits are counted exactly, larger
+// ones in buckets of 2^(sub_bucket_bits - 1) sub-buckets per power of two,
+// which keeps every value within 1% of the bucket it is reported as.
+// Histograms of the shards are merged by adding their counts.
+class latency_histogram {
+    static constexpr unsigned sub_bucket_bits = 7;
+    static constexpr unsigned half_bucket = 1u << (sub_bucket_bits - 1);
+    static constexpr size_t bucket_count = (64 - sub_bucket_bits + 2) * half_bucket;
+    std::vector<uint64_t> _counts;
+    uint64_t _total = 0;
+    uint64_t _min = std::numeric_limits<uint64_t>::max();
+    uint64_t _max = 0;
+    double _sum = 0;
+
+    static inline size_t index_of(uint64_t v)
+    {
+        if (v < (uint64_t(1) << sub_bucket_bits)) {
+            return v;
+        }
+        unsigned msb = 63 - __builtin_clzll(v);
+        unsigned shift = msb - sub_bucket_bits + 1;
+        return (size_t(shift) << (sub_bucket_bits - 1)) + (v >> shift);
+    }
+
+    // The largest value counted in the bucket.
+    static inline uint64_t value_of(size_t index)
+    {
+        if (index < (size_t(1) << sub_bucket_bits)) {
+            return index;
+        }
+        unsigned shift = (index >> (sub_bucket_bits - 1)) - 1;
+        uint64_t sub = index - (size_t(shift) << (sub_bucket_bits - 1));
+        return ((sub + 1) << shift) - 1;
+    }
+public:
+    latency_histogram() : _counts(bucket_count, 0) {}
+
+    void record(uint64_t v)
+    {
+        ++_counts[index_of(v)];
+        ++_total;
+        _min = std::min(_min, v);
+        _max = std::max(_max, v);
+        _sum += v;
+    }
+
+    latency_histogram& operator += (const latency_histogram& o)
+    {
+        for (size_t i = 0; i < bucket_count; ++i) {
+            _counts[i] += o._counts[i];
+        }
+        _total += o._total;
+        _min = std::min(_min, o._min);
+        _max = std::max(_max, o._max);
+        _sum += o._sum;
+        return *this;
+    }
+
+    uint64_t count() const { return _total; }
+    uint64_t min() const { return _total ? _min : 0; }
+    uint64_t max() const { return _max; }
+    double mean() const { return _total ? _sum / _total : 0; }
+
+    // The value at or below which `p` percent of the values are.
+    uint64_t percentile(double p) const
+    {
+        if (_total == 0) {
+            return 0;
+        }
+        auto rank = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(p / 100 * _total)));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < bucket_count; ++i) {
+            seen += _counts[i];
+            if (seen >= rank) {
+                return std::min(value_of(i), _max);
+            }
+        }
+        return _max;
+    }
+};
+
+}
@@ -0,0 +1,384 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <vector>
+#include <boost/range/irange.hpp>
+#include "core/app-template.hh"
+#include "core/distributed.hh"
+#include "core/future-util.hh"
+#include "core/print.hh"
+#include "core/reactor.hh"
+#include "net/api.hh"
+#include "bench/key_generator.hh"
+#include "bench/latency_histogram.hh"
+#include "bench/resp_reply.hh"
+
+// A RESP load generator: every shard opens its connections to the server
+// and keeps `pipeline` GETs and SETs in flight on each of them, then the
+// latencies and the throughput of all shards are reported as JSON.
+
+using namespace redis;
+using clock_type = std::chrono::steady_clock;
+
+struct bench_config {
+    sstring _server_name;
+    ipv4_addr _server;
+    unsigned _connections = 4;
+    unsigned _pipeline = 1;
+    unsigned _duration = 10;
+    // The share of SETs among the requests.
+    double _set_ratio = 0.1;
+    uint64_t _keys = 100000;
+    sstring _key_prefix = "key:";
+    sstring _distribution_name = "uniform";
+    key_distribution _distribution = key_distribution::uniform;
+    double _zipfian_theta = 0.99;
+    double _hot_fraction = 0.01;
+    double _hot_probability = 0.9;
+    size_t _value_min = 64;
+    size_t _value_max = 64;
+    bool _preload = false;
+    uint64_t _seed = 1;
+};
+
+struct bench_result {
+    uint64_t _gets = 0;
+    uint64_t _sets = 0;
+    uint64_t _errors = 0;
+    latency_histogram _get_latency;
+    latency_histogram _set_latency;
+
+    bench_result& operator += (const bench_result& o)
+    {
+        _gets += o._gets;
+        _sets += o._sets;
+        _errors += o._errors;
+        _get_latency += o._get_latency;
+        _set_latency += o._set_latency;
+        return *this;
+    }
+};
+
+class bench_client {
+    class connection {
+        connected_socket _fd;
+        input_stream<char> _in;
+        output_stream<char> _out;
+        bench_client& _client;
+        key_generator _keys;
+        // The requests of the batch in flight, whether each is a SET.
+        sstring _request;
+        std::vector<bool> _sets;
+        size_t _answered = 0;
+        // Replies read but not consumed yet, from _offset.
+        std::string _buffer;
+        size_t _offset = 0;
+
+        void append_bulk(const char* data, size_t size)
+        {
+            _request += sprint("$%u\r\n", size);
+            _request.append(data, size);
+            _request += "\r\n";
+        }
+
+        void add_request(bool set, uint64_t key)
+        {
+            auto& config = _client._config;
+            auto name = config._key_prefix + to_sstring(key);
+            if (set) {
+                auto size = _keys.next_in(config._value_min, config._value_max);
+                _request += "*3\r\n$3\r\nSET\r\n";
+                append_bulk(name.data(), name.size());
+                append_bulk(_client._value.data(), size);
+            }
+            else {
+                _request += "*2\r\n$3\r\nGET\r\n";
+                append_bulk(name.data(), name.size());
+            }
+            _sets.push_back(set);
+        }
+
+        void consume(clock_type::time_point sent, bool record)
+        {
+            auto now = clock_type::now();
+            auto latency = std::chrono::duration_cast<std::chrono::nanoseconds>(now - sent).count();
+            while (_answered < _sets.size()) {
+                bool error = false;
+                auto size = reply_size(_buffer.data() + _offset, _buffer.size() - _offset, error);
+                if (size == 0) {
+                    break;
+                }
+                _offset += size;
+                if (record) {
+                    _client.record(_sets[_answered], latency, error);
+                }
+                ++_answered;
+            }
+            if (_offset == _buffer.size()) {
+                _buffer.clear();
+                _offset = 0;
+            }
+            else if (_offset >= 64 * 1024) {
+                _buffer.erase(0, _offset);
+                _offset = 0;
+            }
+        }
+
+        // Sends the batch built in _request, then reads a reply for each
+        // request: a reply is as late as the batch it came with.
+        future<> exchange(bool record)
+        {
+            auto sent = clock_type::now();
+            _answered = 0;
+            return _out.write(_request).then([this] {
+                return _out.flush();
+            }).then([this, sent, record] {
+                return repeat([this, sent, record] {
+                    consume(sent, record);
+                    if (_answered == _sets.size()) {
+                        return make_ready_future<stop_iteration>(stop_iteration::yes);
+                    }
+                    return _in.read().then([this] (temporary_buffer<char> buf) {
+                        if (buf.empty()) {
+                            throw std::runtime_error("connection closed by the server");
+                        }
+                        _buffer.append(buf.get(), buf.size());
+                        return stop_iteration::no;
+                    });
+                });
+            });
+        }
+    public:
+        connection(connected_socket&& fd, bench_client& client, key_generator keys)
+            : _fd(std::move(fd))
+            , _in(_fd.input())
+            , _out(_fd.output())
+            , _client(client)
+            , _keys(std::move(keys))
+        {
+        }
+
+        // SETs the keys from `first`, every `step`-th one, `pipeline` at a
+        // time, without recording them.
+        future<> preload(uint64_t first, uint64_t step)
+        {
+            return do_with(first, [this, step] (uint64_t& next) {
+                return do_until([this, &next] { return next >= _client._config._keys; }, [this, &next, step] {
+                    _request = {};
+                    _sets.clear();
+                    for (unsigned i = 0; i < _client._config._pipeline && next < _client._config._keys; ++i, next += step) {
+                        add_request(true, next);
+                    }
+                    return exchange(false);
+                });
+            });
+        }
+
+        future<> run()
+        {
+            return do_until([this] { return _client.done(); }, [this] {
+                _request = {};
+                _sets.clear();
+                for (unsigned i = 0; i < _client._config._pipeline; ++i) {
+                    add_request(_keys.next_is(_client._config._set_ratio), _keys.next());
+                }
+                return exchange(true);
+            });
+        }
+
+        future<> close()
+        {
+            return _out.close();
+        }
+    };
+
+    bench_config _config;
+    key_generator _keys;
+    // The largest value, SETs send a prefix of it.
+    sstring _value;
+    std::vector<std::unique_ptr<connection>> _connections;
+    clock_type::time_point _deadline;
+    clock_type::time_point _start;
+    clock_type::time_point _end;
+    bench_result _result;
+
+    inline bool done() const
+    {
+        return clock_type::now() >= _deadline;
+    }
+
+    inline void record(bool set, uint64_t latency, bool error)
+    {
+        if (error) {
+            ++_result._errors;
+        }
+        if (set) {
+            ++_result._sets;
+            _result._set_latency.record(latency);
+        }
+        else {
+            ++_result._gets;
+            _result._get_latency.record(latency);
+        }
+    }
+public:
+    explicit bench_client(bench_config config)
+        : _config(std::move(config))
+        , _keys(_config._distribution, _config._keys, _config._zipfian_theta, _config._hot_fraction, _config._hot_probability, _config._seed)
+        , _value(sstring::initialized_later(), _config._value_max)
+    {
+        std::fill(_value.begin(), _value.end(), 'x');
+    }
+
+    future<> connect()
+    {
+        return parallel_for_each(boost::irange<unsigned>(0, _config._connections), [this] (unsigned i) {
+            return engine().net().connect(make_ipv4_address(_config._server)).then([this, i] (connected_socket fd) {
+                auto keys = _keys;
+                keys.reseed(_config._seed + engine().cpu_id() * _config._connections + i + 1);
+                _connections.push_back(std::make_unique<connection>(std::move(fd), *this, std::move(keys)));
+            });
+        });
+    }
+
+    // The connections of all shards share the key space out between them.
+    future<> preload()
+    {
+        uint64_t step = smp::count * _connections.size();
+        return parallel_for_each(boost::irange<size_t>(0, _connections.size()), [this, step] (size_t i) {
+            return _connections[i]->preload(engine().cpu_id() * _connections.size() + i, step);
+        });
+    }
+
+    future<> run()
+    {
+        _start = clock_type::now();
+        _deadline = _start + std::chrono::seconds(_config._duration);
+        return parallel_for_each(_connections, [] (auto& c) {
+            return c->run();
+        }).then([this] {
+            _end = clock_type::now();
+        });
+    }
+
+    bench_result result() const
+    {
+        return _result;
+    }
+
+    double elapsed() const
+    {
+        return std::chrono::duration<double>(_end - _start).count();
+    }
+
+    future<> stop()
+    {
+        return parallel_for_each(_connections, [] (auto& c) {
+            return c->close();
+        });
+    }
+};
+
+int main(int ac, char** av) {
+    namespace bpo = boost::program_options;
+    app_template app;
+    app.add_options()
+        ("server", bpo::value<std::string>()->default_value("127.0.0.1:6379"), "Server address")
+        ("conn", bpo::value<unsigned>()->default_value(4), "Connections per shard")
+        ("pipeline", bpo::value<unsigned>()->default_value(1), "Requests in flight per connection")
+        ("duration", bpo::value<unsigned>()->default_value(10), "Seconds to run for")
+        ("set_ratio", bpo::value<double>()->default_value(0.1), "Share of SETs among the requests, the others are GETs")
+        ("keys", bpo::value<uint64_t>()->default_value(100000), "Number of keys")
+        ("key_prefix", bpo::value<std::string>()->default_value("key:"), "Prefix of the key names")
+        ("key_distribution", bpo::value<std::string>()->default_value("uniform"), "uniform, zipfian or hotset")
+        ("zipfian_theta", bpo::value<double>()->default_value(0.99), "Skew of the zipfian distribution, in (0, 1)")
+        ("hot_fraction", bpo::value<double>()->default_value(0.01), "Share of the keys in the hot set")
+        ("hot_probability", bpo::value<double>()->default_value(0.9), "Share of the requests going to the hot set")
+        ("value_size_min", bpo::value<size_t>()->default_value(64), "Smallest SET value")
+        ("value_size_max", bpo::value<size_t>()->default_value(64), "Largest SET value, sizes are uniform in between")
+        ("preload", bpo::value<bool>()->default_value(false), "SET every key once before running")
+        ("seed", bpo::value<uint64_t>()->default_value(1), "Seed of the generators, for reproducible runs")
+        ;
+    return app.run(ac, av, [&app] {
+        auto&& c = app.configuration();
+        bench_config config;
+        config._server_name = c["server"].as<std::string>();
+        config._server = ipv4_addr(c["server"].as<std::string>());
+        config._connections = c["conn"].as<unsigned>();
+        config._pipeline = std::max(1u, c["pipeline"].as<unsigned>());
+        config._duration = c["duration"].as<unsigned>();
+        config._set_ratio = c["set_ratio"].as<double>();
+        config._keys = c["keys"].as<uint64_t>();
+        config._key_prefix = c["key_prefix"].as<std::string>();
+        config._zipfian_theta = c["zipfian_theta"].as<double>();
+        config._hot_fraction = c["hot_fraction"].as<double>();
+        config._hot_probability = c["hot_probability"].as<double>();
+        config._value_min = c["value_size_min"].as<size_t>();
+        config._value_max = std::max(config._value_min, c["value_size_max"].as<size_t>());
+        config._preload = c["preload"].as<bool>();
+        config._seed = c["seed"].as<uint64_t>();
+        try {
+            config._distribution_name = c["key_distribution"].as<std::string>();
+            config._distribution = to_key_distribution(config._distribution_name);
+            if (config._zipfian_theta <= 0 || config._zipfian_theta >= 1) {
+                throw std::invalid_argument("zipfian_theta must be in (0, 1)");
+            }
+        } catch (const std::invalid_argument& e) {
+            std::cerr << e.what() << "\n";
+            return make_ready_future<int>(1);
+        }
+        auto clients = make_lw_shared<distributed<bench_client>>();
+        return clients->start(config).then([clients] {
+            return clients->invoke_on_all(&bench_client::connect);
+        }).then([clients, config] {
+            if (!config._preload) {
+                return make_ready_future<>();
+            }
+            return clients->invoke_on_all(&bench_client::preload);
+        }).then([clients] {
+            return clients->invoke_on_all(&bench_client::run);
+        }).then([clients] {
+            return clients->map_reduce0(std::mem_fn(&bench_client::result), bench_result(), [] (bench_result total, bench_result r) {
+                total += r;
+                return total;
+            });
+        }).then([clients, config] (bench_result total) {
+            auto elapsed = clients->local().elapsed();
+            auto requests = total._gets + total._sets;
+            std::cout << "{\n"
+                << sprint("  \"server\": \"%s\",\n", config._server_name)
+                << sprint("  \"shards\": %u,\n  \"connections\": %u,\n  \"pipeline\": %u,\n", smp::count, smp::count * config._connections, config._pipeline)
+                << sprint("  \"set_ratio\": %.3f,\n  \"keys\": %u,\n  \"key_distribution\": \"%s\",\n", config._set_ratio, config._keys, config._distribution_name)
+                << sprint("  \"value_size\": [%u, %u],\n", config._value_min, config._value_max)
+                << sprint("  \"duration_s\": %.3f,\n  \"requests\": %u,\n  \"errors\": %u,\n", elapsed, requests, total._errors)
+                << sprint("  \"throughput_rps\": %.1f,\n", elapsed > 0 ? requests / elapsed : 0)
+                << "  \"get\": " << latency_json(total._get_latency) << ",\n"
+                << "  \"set\": " << latency_json(total._set_latency) << "\n"
+                << "}\n";
+            return clients->stop();
+        }).then([clients] {
+            return 0;
+        });
+    });
+}
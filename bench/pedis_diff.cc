@@ -0,0 +1,656 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+#include <boost/range/irange.hpp>
+#include "core/app-template.hh"
+#include "core/distributed.hh"
+#include "core/future-util.hh"
+#include "core/print.hh"
+#include "core/reactor.hh"
+#include "net/api.hh"
+#include "bench/latency_histogram.hh"
+#include "bench/resp_reply.hh"
+
+// Sends the same generated commands to pedis and to a reference Redis and
+// compares their replies. Every connection of the tool works on keys of
+// its own, of every type, some kept to a few elements and some grown to
+// many, so that the small encodings, the large ones and the conversions
+// between them all run. Each batch of `pipeline` commands goes to both
+// servers at once. The replies which differ are counted by command and the
+// first ones printed; the latencies of both servers by command and their
+// throughputs are reported as JSON. The exit status is 1 if a reply
+// differed.
+
+using namespace redis;
+using clock_type = std::chrono::steady_clock;
+
+struct diff_config {
+    sstring _server_name;
+    ipv4_addr _server;
+    sstring _reference_name;
+    ipv4_addr _reference;
+    unsigned _connections = 4;
+    unsigned _pipeline = 1;
+    // Commands sent by each connection.
+    uint64_t _commands = 100000;
+    // Keys of each connection, of the types in turn.
+    unsigned _keys = 56;
+    size_t _value_max = 64;
+    uint64_t _seed = 1;
+    // The mismatches each shard prints.
+    unsigned _max_printed = 10;
+};
+
+struct command_result {
+    uint64_t _count = 0;
+    uint64_t _mismatches = 0;
+    latency_histogram _server;
+    latency_histogram _reference;
+
+    command_result& operator += (const command_result& o)
+    {
+        _count += o._count;
+        _mismatches += o._mismatches;
+        _server += o._server;
+        _reference += o._reference;
+        return *this;
+    }
+};
+
+struct diff_result {
+    uint64_t _commands = 0;
+    uint64_t _mismatches = 0;
+    // The time each server took to answer the batches, summed over the
+    // connections.
+    uint64_t _server_busy_ns = 0;
+    uint64_t _reference_busy_ns = 0;
+    std::map<sstring, command_result> _by_command;
+
+    diff_result& operator += (const diff_result& o)
+    {
+        _commands += o._commands;
+        _mismatches += o._mismatches;
+        _server_busy_ns += o._server_busy_ns;
+        _reference_busy_ns += o._reference_busy_ns;
+        for (auto& c : o._by_command) {
+            _by_command[c.first] += c.second;
+        }
+        return *this;
+    }
+};
+
+// A reply, parsed to be compared.
+struct resp_value {
+    char _type = '+';
+    bool _nil = false;
+    std::string _data;
+    std::vector<resp_value> _elements;
+};
+
+static resp_value parse_reply(const char*& p, const char* end)
+{
+    resp_value v;
+    v._type = *p;
+    auto eol = static_cast<const char*>(std::memchr(p, '\n', end - p));
+    auto line = std::string(p + 1, eol - 1 - (p + 1));
+    p = eol + 1;
+    switch (v._type) {
+    case '$': {
+        auto size = std::strtol(line.c_str(), nullptr, 10);
+        if (size < 0) {
+            v._nil = true;
+            break;
+        }
+        v._data.assign(p, size);
+        p += size + 2;
+        break;
+    }
+    case '*': {
+        auto count = std::strtol(line.c_str(), nullptr, 10);
+        if (count < 0) {
+            v._nil = true;
+            break;
+        }
+        for (long i = 0; i < count; ++i) {
+            v._elements.push_back(parse_reply(p, end));
+        }
+        break;
+    }
+    default:
+        v._data = std::move(line);
+    }
+    return v;
+}
+
+static std::string canonical(const resp_value& v)
+{
+    if (v._nil) {
+        return std::string(1, v._type) + "nil";
+    }
+    if (v._type != '*') {
+        return std::string(1, v._type) + v._data;
+    }
+    std::string s = "*[";
+    for (auto& e : v._elements) {
+        s += canonical(e);
+        s += ",";
+    }
+    return s + "]";
+}
+
+// Orders the elements of a reply whose order is the encoding's own, in
+// groups of `group`: the field and the value of HGETALL stay together.
+static void sort_elements(resp_value& v, size_t group)
+{
+    if (v._type != '*' || v._elements.size() % group != 0) {
+        return;
+    }
+    std::vector<std::vector<resp_value>> groups;
+    for (size_t i = 0; i < v._elements.size(); i += group) {
+        groups.emplace_back(v._elements.begin() + i, v._elements.begin() + i + group);
+    }
+    std::sort(groups.begin(), groups.end(), [] (const std::vector<resp_value>& a, const std::vector<resp_value>& b) {
+        return canonical(a[0]) < canonical(b[0]);
+    });
+    v._elements.clear();
+    for (auto& g : groups) {
+        v._elements.insert(v._elements.end(), g.begin(), g.end());
+    }
+}
+
+// Scores may be printed with more or fewer digits.
+static bool same_number(const std::string& a, const std::string& b)
+{
+    if (a.empty() || b.empty()) {
+        return false;
+    }
+    char* end_a = nullptr;
+    char* end_b = nullptr;
+    auto x = std::strtod(a.c_str(), &end_a);
+    auto y = std::strtod(b.c_str(), &end_b);
+    return *end_a == '\0' && *end_b == '\0' && x == y;
+}
+
+// Errors are the same when their codes are, the messages differ.
+static bool same(const resp_value& a, const resp_value& b)
+{
+    if (a._type != b._type || a._nil != b._nil) {
+        return false;
+    }
+    if (a._type == '-') {
+        return a._data.substr(0, a._data.find(' ')) == b._data.substr(0, b._data.find(' '));
+    }
+    if (a._type == '*') {
+        if (a._elements.size() != b._elements.size()) {
+            return false;
+        }
+        for (size_t i = 0; i < a._elements.size(); ++i) {
+            if (!same(a._elements[i], b._elements[i])) {
+                return false;
+            }
+        }
+        return true;
+    }
+    return a._data == b._data || (a._type == '$' && same_number(a._data, b._data));
+}
+
+static std::string printable(const std::string& reply)
+{
+    std::string s;
+    for (auto c : reply) {
+        if (c == '\r') {
+            s += "\\r";
+        } else if (c == '\n') {
+            s += "\\n";
+        } else {
+            s += c;
+        }
+    }
+    return s;
+}
+
+struct diff_command {
+    sstring _name;
+    std::vector<sstring> _args;
+    // The reply is sorted in groups of this many elements before it is
+    // compared, 0 keeps its order.
+    size_t _unordered = 0;
+};
+
+// The commands of one connection, the same for the same seed. Key n is of
+// type n % 7, and holds up to 16 elements when n / 7 is even, up to 1000
+// otherwise: past the sizes of the packed encodings, intsets and listpacks.
+class command_generator {
+    std::mt19937_64 _rng;
+    sstring _prefix;
+    unsigned _keys;
+    size_t _value_max;
+
+    unsigned below(unsigned n)
+    {
+        return std::uniform_int_distribution<unsigned>(0, n - 1)(_rng);
+    }
+    sstring value()
+    {
+        auto size = 1 + below(_value_max);
+        sstring v(sstring::initialized_later(), size);
+        for (auto& c : v) {
+            c = 'a' + below(26);
+        }
+        return v;
+    }
+    diff_command make(const char* name, std::vector<sstring> args, size_t unordered = 0)
+    {
+        return diff_command { name, std::move(args), unordered };
+    }
+public:
+    command_generator(uint64_t seed, sstring prefix, unsigned keys, size_t value_max)
+        : _rng(seed), _prefix(std::move(prefix)), _keys(std::max(keys, 1u)), _value_max(std::max<size_t>(value_max, 1))
+    {
+    }
+
+    sstring key(unsigned n) const
+    {
+        return _prefix + to_sstring(n);
+    }
+    unsigned keys() const { return _keys; }
+
+    diff_command next()
+    {
+        auto n = below(_keys);
+        auto k = key(n);
+        auto elements = (n / 7) % 2 ? 1000 : 16;
+        auto member = [this, elements] { return sstring("m") + to_sstring(below(elements)); };
+        auto number = [this, elements] { return to_sstring(below(elements)); };
+        auto delta = [this] { return to_sstring(int(below(201)) - 100); };
+        auto position = [this, elements] { return to_sstring(int(below(2 * elements)) - elements); };
+        auto score = [this] { return to_sstring(below(100)) + (below(2) ? ".5" : ""); };
+        switch (n % 7) {
+        case 0: // strings
+            switch (below(8)) {
+            case 0: return make("set", { k, value() });
+            case 1: return make("append", { k, value() });
+            case 2: return make("strlen", { k });
+            case 3: return make("getrange", { k, to_sstring(below(16)), to_sstring(int(below(48)) - 16) });
+            case 4: return make("mget", { k, key((n + 7) % _keys) });
+            case 5: return make("exists", { k });
+            case 6: return below(8) ? make("get", { k }) : make("del", { k });
+            default: return make("get", { k });
+            }
+        case 1: // counters
+            switch (below(4)) {
+            case 0: return make("incrby", { k, delta() });
+            case 1: return make("decrby", { k, delta() });
+            case 2: return make("incr", { k });
+            default: return make("get", { k });
+            }
+        case 2: // lists
+            switch (below(10)) {
+            case 0: return make("rpush", { k, value(), value() });
+            case 1: return make("lpush", { k, value() });
+            case 2: return make("lpop", { k });
+            case 3: return make("rpop", { k });
+            case 4: return make("llen", { k });
+            case 5: return make("lindex", { k, position() });
+            case 6: return make("lrange", { k, position(), position() });
+            case 7: return make("ltrim", { k, "0", to_sstring(elements - 1) });
+            case 8: return make("lrem", { k, "0", value() });
+            default: return make("rpush", { k, value() });
+            }
+        case 3: // hashes
+            switch (below(10)) {
+            case 0: return make("hset", { k, member(), value() });
+            case 1: return make("hset", { k, member(), value(), member(), value() });
+            case 2: return make("hget", { k, member() });
+            case 3: return make("hdel", { k, member() });
+            case 4: return make("hlen", { k });
+            case 5: return make("hexists", { k, member() });
+            case 6: return make("hincrby", { k, sstring("c") + number(), delta() });
+            case 7: return make("hmget", { k, member(), member() });
+            case 8: return make("hgetall", { k }, 2);
+            default: return make("hkeys", { k }, 1);
+            }
+        case 4: // sets
+        case 5: { // sets of integers, but for a rare member which is not
+            auto m = n % 7 == 5 && below(200) ? number() : member();
+            switch (below(8)) {
+            case 0:
+            case 1: return make("sadd", { k, m, n % 7 == 5 ? number() : member() });
+            case 2: return make("srem", { k, m });
+            case 3: return make("sismember", { k, m });
+            case 4: return make("scard", { k });
+            case 5: return make("smembers", { k }, 1);
+            default: return make("sadd", { k, m });
+            }
+        }
+        default: // sorted sets
+            switch (below(12)) {
+            case 0:
+            case 1: return make("zadd", { k, score(), member() });
+            case 2: return make("zrem", { k, member() });
+            case 3: return make("zscore", { k, member() });
+            case 4: return make("zrank", { k, member() });
+            case 5: return make("zrevrank", { k, member() });
+            case 6: return make("zcard", { k });
+            case 7: return make("zincrby", { k, score(), member() });
+            case 8: return make("zrange", { k, position(), position(), "withscores" });
+            case 9: return make("zrangebyscore", { k, to_sstring(below(50)), to_sstring(50 + below(50)) });
+            case 10: return make("zcount", { k, "-inf", to_sstring(below(100)) });
+            default: return make("zadd", { k, score(), member(), score(), member() });
+            }
+        }
+    }
+};
+
+static sstring encode(const diff_command& c)
+{
+    sstring out = sprint("*%u\r\n$%u\r\n", c._args.size() + 1, c._name.size()) + c._name + "\r\n";
+    for (auto& a : c._args) {
+        out += sprint("$%u\r\n", a.size()) + a + "\r\n";
+    }
+    return out;
+}
+
+// A connection to one of the servers, which answers a batch at a time.
+class endpoint {
+    connected_socket _fd;
+    input_stream<char> _in;
+    output_stream<char> _out;
+    std::string _buffer;
+    size_t _offset = 0;
+public:
+    explicit endpoint(connected_socket&& fd)
+        : _fd(std::move(fd))
+        , _in(_fd.input())
+        , _out(_fd.output())
+    {
+    }
+
+    // Sends the batch, then reads its n replies and when each one came.
+    future<> exchange(sstring batch, size_t n, std::vector<std::string>& replies, std::vector<clock_type::time_point>& received)
+    {
+        return _out.write(std::move(batch)).then([this] {
+            return _out.flush();
+        }).then([this, n, &replies, &received] {
+            return repeat([this, n, &replies, &received] {
+                auto now = clock_type::now();
+                while (replies.size() < n) {
+                    bool error = false;
+                    auto size = reply_size(_buffer.data() + _offset, _buffer.size() - _offset, error);
+                    if (size == 0) {
+                        break;
+                    }
+                    replies.emplace_back(_buffer.data() + _offset, size);
+                    received.push_back(now);
+                    _offset += size;
+                }
+                if (_offset == _buffer.size()) {
+                    _buffer.clear();
+                    _offset = 0;
+                }
+                if (replies.size() == n) {
+                    return make_ready_future<stop_iteration>(stop_iteration::yes);
+                }
+                return _in.read().then([this] (temporary_buffer<char> buf) {
+                    if (buf.empty()) {
+                        throw std::runtime_error("the server closed the connection");
+                    }
+                    _buffer.append(buf.get(), buf.size());
+                    return stop_iteration::no;
+                });
+            });
+        });
+    }
+
+    future<> close()
+    {
+        return _out.close().handle_exception([] (std::exception_ptr) {});
+    }
+};
+
+class diff_client {
+    class connection {
+        diff_client& _client;
+        endpoint _server;
+        endpoint _reference;
+        command_generator _generator;
+        uint64_t _sent = 0;
+        std::vector<diff_command> _batch;
+        std::vector<std::string> _server_replies;
+        std::vector<std::string> _reference_replies;
+        std::vector<clock_type::time_point> _server_received;
+        std::vector<clock_type::time_point> _reference_received;
+
+        future<> exchange(sstring batch, size_t n)
+        {
+            _server_replies.clear();
+            _reference_replies.clear();
+            _server_received.clear();
+            _reference_received.clear();
+            return when_all(_server.exchange(batch, n, _server_replies, _server_received),
+                            _reference.exchange(batch, n, _reference_replies, _reference_received)).then([] (std::tuple<future<>, future<>> joined) {
+                std::get<0>(joined).get();
+                std::get<1>(joined).get();
+            });
+        }
+
+        void compare(size_t i, clock_type::time_point start)
+        {
+            auto& c = _batch[i];
+            auto& result = _client._result;
+            auto& r = result._by_command[c._name];
+            ++result._commands;
+            ++r._count;
+            r._server.record(std::chrono::duration_cast<std::chrono::nanoseconds>(_server_received[i] - start).count());
+            r._reference.record(std::chrono::duration_cast<std::chrono::nanoseconds>(_reference_received[i] - start).count());
+            auto& a = _server_replies[i];
+            auto& b = _reference_replies[i];
+            if (a == b) {
+                return;
+            }
+            auto pa = a.data();
+            auto pb = b.data();
+            auto va = parse_reply(pa, a.data() + a.size());
+            auto vb = parse_reply(pb, b.data() + b.size());
+            if (c._unordered) {
+                sort_elements(va, c._unordered);
+                sort_elements(vb, c._unordered);
+            }
+            if (same(va, vb)) {
+                return;
+            }
+            ++result._mismatches;
+            ++r._mismatches;
+            if (_client._printed++ < _client._config._max_printed) {
+                auto text = c._name;
+                for (auto& arg : c._args) {
+                    text += " " + arg;
+                }
+                std::cerr << sprint("mismatch: %s\n  pedis:     %s\n  reference: %s\n", text, printable(a), printable(b));
+            }
+        }
+
+        future<> run_batch()
+        {
+            auto& config = _client._config;
+            auto n = std::min<uint64_t>(config._pipeline, config._commands - _sent);
+            _batch.clear();
+            sstring out;
+            for (uint64_t i = 0; i < n; ++i) {
+                _batch.push_back(_generator.next());
+                out += encode(_batch.back());
+            }
+            _sent += n;
+            auto start = clock_type::now();
+            return exchange(std::move(out), n).then([this, n, start] {
+                auto& result = _client._result;
+                result._server_busy_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(_server_received.back() - start).count();
+                result._reference_busy_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(_reference_received.back() - start).count();
+                for (size_t i = 0; i < n; ++i) {
+                    compare(i, start);
+                }
+            });
+        }
+    public:
+        connection(diff_client& client, unsigned id, connected_socket&& server, connected_socket&& reference)
+            : _client(client)
+            , _server(std::move(server))
+            , _reference(std::move(reference))
+            , _generator(client._config._seed * 1000003 + engine().cpu_id() * 1009 + id,
+                         sprint("diff:%u:%u:%u:", client._config._seed, engine().cpu_id(), id),
+                         client._config._keys, client._config._value_max)
+        {
+        }
+
+        // The keys left by an earlier run with the same seed go first.
+        future<> run()
+        {
+            diff_command del { "del", {} };
+            for (unsigned i = 0; i < _generator.keys(); ++i) {
+                del._args.push_back(_generator.key(i));
+            }
+            return exchange(encode(del), 1).then([this] {
+                return do_until([this] { return _sent >= _client._config._commands; }, [this] {
+                    return run_batch();
+                });
+            });
+        }
+
+        future<> close()
+        {
+            return when_all(_server.close(), _reference.close()).discard_result();
+        }
+    };
+
+    diff_config _config;
+    std::vector<std::unique_ptr<connection>> _connections;
+    diff_result _result;
+    unsigned _printed = 0;
+public:
+    explicit diff_client(diff_config config) : _config(std::move(config)) {}
+
+    future<> connect()
+    {
+        return parallel_for_each(boost::irange(0u, _config._connections), [this] (unsigned id) {
+            return engine().net().connect(make_ipv4_address(_config._server)).then([this, id] (connected_socket server) {
+                return engine().net().connect(make_ipv4_address(_config._reference)).then([this, id, server = std::move(server)] (connected_socket reference) mutable {
+                    _connections.push_back(std::make_unique<connection>(*this, id, std::move(server), std::move(reference)));
+                });
+            });
+        });
+    }
+
+    future<> run()
+    {
+        return parallel_for_each(_connections, [] (auto& c) {
+            return c->run();
+        });
+    }
+
+    diff_result result() const
+    {
+        return _result;
+    }
+
+    future<> stop()
+    {
+        return parallel_for_each(_connections, [] (auto& c) {
+            return c->close();
+        });
+    }
+};
+
+int main(int ac, char** av) {
+    namespace bpo = boost::program_options;
+    app_template app;
+    app.add_options()
+        ("server", bpo::value<std::string>()->default_value("127.0.0.1:6379"), "Address of pedis")
+        ("reference", bpo::value<std::string>()->default_value("127.0.0.1:6380"), "Address of the Redis the replies of pedis are compared to")
+        ("conn", bpo::value<unsigned>()->default_value(4), "Connections per core, each to both servers")
+        ("pipeline", bpo::value<unsigned>()->default_value(1), "Commands sent at once on each connection")
+        ("commands", bpo::value<uint64_t>()->default_value(100000), "Commands sent by each connection")
+        ("keys", bpo::value<unsigned>()->default_value(56), "Keys of each connection, of every type in turn")
+        ("value_size_max", bpo::value<size_t>()->default_value(64), "Largest value, the sizes are uniform from 1")
+        ("seed", bpo::value<uint64_t>()->default_value(1), "Seed of the commands, the keys of a seed are deleted before they run")
+        ("max_printed", bpo::value<unsigned>()->default_value(10), "Mismatching replies each core prints")
+        ;
+    return app.run(ac, av, [&app] {
+        auto&& c = app.configuration();
+        diff_config config;
+        config._server_name = c["server"].as<std::string>();
+        config._server = ipv4_addr(c["server"].as<std::string>());
+        config._reference_name = c["reference"].as<std::string>();
+        config._reference = ipv4_addr(c["reference"].as<std::string>());
+        config._connections = c["conn"].as<unsigned>();
+        config._pipeline = std::max(c["pipeline"].as<unsigned>(), 1u);
+        config._commands = c["commands"].as<uint64_t>();
+        config._keys = c["keys"].as<unsigned>();
+        config._value_max = c["value_size_max"].as<size_t>();
+        config._seed = c["seed"].as<uint64_t>();
+        config._max_printed = c["max_printed"].as<unsigned>();
+        auto clients = make_lw_shared<distributed<diff_client>>();
+        return clients->start(config).then([clients] {
+            return clients->invoke_on_all(&diff_client::connect);
+        }).then([clients] {
+            return clients->invoke_on_all(&diff_client::run);
+        }).then([clients] {
+            return clients->map_reduce0(std::mem_fn(&diff_client::result), diff_result(), [] (diff_result total, diff_result r) {
+                total += r;
+                return total;
+            });
+        }).then([clients, config] (diff_result total) {
+            // the throughputs are those of the connections, as if they
+            // were all busy at once.
+            auto connections = config._connections * smp::count;
+            auto rps = [&total, connections] (uint64_t busy_ns) {
+                return busy_ns ? total._commands * connections / (busy_ns / 1e9) : 0.0;
+            };
+            std::cout << "{\n"
+                << sprint("  \"server\": \"%s\",\n  \"reference\": \"%s\",\n", config._server_name, config._reference_name)
+                << sprint("  \"connections\": %u,\n  \"pipeline\": %u,\n  \"seed\": %u,\n", connections, config._pipeline, config._seed)
+                << sprint("  \"commands\": %u,\n  \"mismatches\": %u,\n", total._commands, total._mismatches)
+                << sprint("  \"server_throughput_rps\": %.1f,\n  \"reference_throughput_rps\": %.1f,\n", rps(total._server_busy_ns), rps(total._reference_busy_ns))
+                << "  \"by_command\": {";
+            const char* separator = "\n";
+            for (auto& cmd : total._by_command) {
+                auto& r = cmd.second;
+                std::cout << separator << sprint("    \"%s\": {\"count\": %u, \"mismatches\": %u, \"mean_ratio\": %.3f,\n", cmd.first, r._count, r._mismatches,
+                                                 r._reference.mean() > 0 ? r._server.mean() / r._reference.mean() : 0)
+                    << "      \"server\": " << latency_json(r._server) << ",\n"
+                    << "      \"reference\": " << latency_json(r._reference) << "}";
+                separator = ",\n";
+            }
+            std::cout << "\n  }\n}\n";
+            return clients->stop().then([mismatches = total._mismatches] {
+                return mismatches ? 1 : 0;
+            });
+        });
+    });
+}
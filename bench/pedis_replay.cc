@@ -0,0 +1,495 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include "core/app-template.hh"
+#include "core/distributed.hh"
+#include "core/future-util.hh"
+#include "core/print.hh"
+#include "core/reactor.hh"
+#include "core/sleep.hh"
+#include "net/api.hh"
+#include "store/util/coding.hh"
+#include "bench/latency_histogram.hh"
+#include "bench/resp_reply.hh"
+#include "traffic_capture.hh"
+
+// Replays the requests CAPTURE START wrote, see traffic_capture: every
+// captured connection gets a connection of its own, which sends its
+// requests at the offsets they arrived at, divided by --speed, whether or
+// not the replies of the earlier ones came back. The shards of the tool
+// take the files in turn, then the latencies per command are reported as
+// JSON, with how late the requests were sent.
+
+using namespace redis;
+using clock_type = std::chrono::steady_clock;
+
+struct replay_config {
+    sstring _server_name;
+    ipv4_addr _server;
+    std::vector<sstring> _traces;
+    double _speed = 1;
+    // The earliest start of the files, the offsets of all count from it.
+    uint64_t _base_us = 0;
+};
+
+struct replay_arg {
+    // A value of the capture is only its size, filled with 'x'.
+    bool _filler = false;
+    size_t _size = 0;
+    sstring _data;
+};
+
+struct replay_request {
+    uint64_t _at_us = 0;
+    sstring _command;
+    std::vector<replay_arg> _args;
+};
+
+struct replay_result {
+    uint64_t _requests = 0;
+    uint64_t _errors = 0;
+    // Connections the server closed before replying to all their requests.
+    uint64_t _broken = 0;
+    latency_histogram _latency;
+    // How much later than scheduled the requests were sent.
+    latency_histogram _lag;
+    std::map<sstring, latency_histogram> _commands;
+
+    replay_result& operator += (const replay_result& o)
+    {
+        _requests += o._requests;
+        _errors += o._errors;
+        _broken += o._broken;
+        _latency += o._latency;
+        _lag += o._lag;
+        for (auto& c : o._commands) {
+            _commands[c.first] += c.second;
+        }
+        return *this;
+    }
+};
+
+class trace_cursor {
+    const char* _p;
+    const char* _end;
+public:
+    struct truncated {};
+    trace_cursor(const char* p, const char* end) : _p(p), _end(end) {}
+    bool done() const { return _p == _end; }
+    uint64_t varint()
+    {
+        uint64_t value;
+        auto next = store::get_varint64_ptr(_p, _end, value);
+        if (next == nullptr) {
+            throw truncated();
+        }
+        _p = next;
+        return value;
+    }
+    const char* take(size_t n)
+    {
+        if (size_t(_end - _p) < n) {
+            throw truncated();
+        }
+        auto p = _p;
+        _p += n;
+        return p;
+    }
+    uint64_t fixed64() { return store::decode_fixed64(take(8)); }
+};
+
+// A key of the size of the one hashed, the same for the same hash.
+static sstring synthetic_key(uint64_t hash, size_t size)
+{
+    auto hex = sprint("%016x", hash);
+    sstring key(sstring::initialized_later(), std::max<size_t>(size, 1));
+    for (size_t i = 0; i < key.size(); ++i) {
+        key[i] = hex[i % hex.size()];
+    }
+    return key;
+}
+
+static std::string read_file(const sstring& name)
+{
+    std::ifstream in(name.c_str(), std::ios::binary);
+    if (!in) {
+        throw std::runtime_error(sprint("cannot open %s", name));
+    }
+    return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+static constexpr size_t capture_header_size = capture_magic_size + 4 + 1 + 8;
+
+// The start of the capture, in microseconds of the steady clock of the node.
+static uint64_t check_header(const char* data, size_t size, const sstring& name)
+{
+    if (size < capture_header_size || std::memcmp(data, capture_magic, capture_magic_size) != 0) {
+        throw std::runtime_error(sprint("%s is not a capture", name));
+    }
+    return store::decode_fixed64(data + capture_header_size - 8);
+}
+
+static uint64_t trace_start(const sstring& name)
+{
+    std::ifstream in(name.c_str(), std::ios::binary);
+    char header[capture_header_size];
+    if (!in.read(header, sizeof(header))) {
+        throw std::runtime_error(sprint("cannot read %s", name));
+    }
+    return check_header(header, sizeof(header), name);
+}
+
+class replay_client {
+    class connection {
+        connected_socket _fd;
+        input_stream<char> _in;
+        output_stream<char> _out;
+        replay_client& _client;
+        std::vector<replay_request> _requests;
+        // The requests sent and not answered yet, oldest first.
+        std::deque<std::pair<clock_type::time_point, const replay_request*>> _sent;
+        size_t _answered = 0;
+        std::string _buffer;
+        size_t _offset = 0;
+
+        sstring encode(const replay_request& r) const
+        {
+            sstring out = sprint("*%u\r\n$%u\r\n", r._args.size() + 1, r._command.size()) + r._command + "\r\n";
+            for (auto& a : r._args) {
+                out += sprint("$%u\r\n", a._size);
+                if (a._filler) {
+                    out.append(_client._filler.data(), a._size);
+                }
+                else {
+                    out += a._data;
+                }
+                out += "\r\n";
+            }
+            return out;
+        }
+
+        void consume()
+        {
+            auto now = clock_type::now();
+            for (;;) {
+                bool error = false;
+                auto p = _buffer.data() + _offset;
+                auto size = reply_size(p, _buffer.size() - _offset, error);
+                if (size == 0) {
+                    break;
+                }
+                _offset += size;
+                // the invalidations of RESP3 answer no request.
+                if (*p == '>' || _sent.empty()) {
+                    continue;
+                }
+                auto sent = _sent.front();
+                _sent.pop_front();
+                ++_answered;
+                _client.record(*sent.second, std::chrono::duration_cast<std::chrono::nanoseconds>(now - sent.first).count(), error);
+            }
+            if (_offset == _buffer.size()) {
+                _buffer.clear();
+                _offset = 0;
+            }
+            else if (_offset >= 64 * 1024) {
+                _buffer.erase(0, _offset);
+                _offset = 0;
+            }
+        }
+
+        future<> read_replies()
+        {
+            return repeat([this] {
+                consume();
+                if (_answered >= _requests.size()) {
+                    return make_ready_future<stop_iteration>(stop_iteration::yes);
+                }
+                return _in.read().then([this] (temporary_buffer<char> buf) {
+                    if (buf.empty()) {
+                        return stop_iteration::yes;
+                    }
+                    _buffer.append(buf.get(), buf.size());
+                    return stop_iteration::no;
+                });
+            });
+        }
+
+        // Sends each request once it is due, flushing those sent before
+        // whenever it waits.
+        future<> send_requests(clock_type::time_point start)
+        {
+            return do_for_each(_requests, [this, start] (const replay_request& r) {
+                auto due = start + std::chrono::microseconds(static_cast<uint64_t>(r._at_us / _client._config._speed));
+                auto now = clock_type::now();
+                auto wait = make_ready_future<>();
+                if (due > now) {
+                    wait = _out.flush().then([due, now] {
+                        return sleep(due - now);
+                    });
+                }
+                return wait.then([this, &r, due] {
+                    auto now = clock_type::now();
+                    _client._result._lag.record(now > due ? std::chrono::duration_cast<std::chrono::nanoseconds>(now - due).count() : 0);
+                    _sent.emplace_back(now, &r);
+                    return _out.write(encode(r));
+                });
+            }).then([this] {
+                return _out.flush();
+            });
+        }
+    public:
+        connection(connected_socket&& fd, replay_client& client, std::vector<replay_request> requests)
+            : _fd(std::move(fd))
+            , _in(_fd.input())
+            , _out(_fd.output())
+            , _client(client)
+            , _requests(std::move(requests))
+        {
+        }
+
+        future<> run(clock_type::time_point start)
+        {
+            return when_all(send_requests(start), read_replies()).then([this] (std::tuple<future<>, future<>> joined) {
+                auto& sent = std::get<0>(joined);
+                auto& read = std::get<1>(joined);
+                sent.ignore_ready_future();
+                read.ignore_ready_future();
+                if (_answered < _requests.size()) {
+                    ++_client._result._broken;
+                }
+            });
+        }
+
+        future<> close()
+        {
+            return _out.close().handle_exception([] (std::exception_ptr) {});
+        }
+    };
+
+    replay_config _config;
+    // The requests of each captured connection, by its file and its id, in
+    // order: the ids of the shards of the node overlap.
+    std::map<std::pair<size_t, uint64_t>, std::vector<replay_request>> _traces;
+    // The largest value, fillers send a prefix of it.
+    sstring _filler;
+    std::vector<std::unique_ptr<connection>> _connections;
+    clock_type::time_point _start;
+    clock_type::time_point _end;
+    replay_result _result;
+
+    void record(const replay_request& r, uint64_t latency, bool error)
+    {
+        ++_result._requests;
+        if (error) {
+            ++_result._errors;
+        }
+        _result._latency.record(latency);
+        _result._commands[r._command].record(latency);
+    }
+
+    void load(size_t file, const sstring& name)
+    {
+        auto data = read_file(name);
+        auto at = check_header(data.data(), data.size(), name) - _config._base_us;
+        bool anonymized = data[capture_magic_size + 4] != 0;
+        trace_cursor in(data.data() + capture_header_size, data.data() + data.size());
+        size_t largest = 0;
+        try {
+            while (!in.done()) {
+                replay_request r;
+                at += in.varint();
+                r._at_us = at;
+                auto id = in.varint();
+                auto size = in.varint();
+                r._command = sstring(in.take(size), size);
+                std::transform(r._command.begin(), r._command.end(), r._command.begin(), ::tolower);
+                auto count = in.varint();
+                for (uint64_t i = 0; i < count; ++i) {
+                    auto tag = in.varint();
+                    replay_arg a;
+                    a._size = tag >> 2;
+                    switch (static_cast<capture_arg>(tag & 3)) {
+                    case capture_arg::filler:
+                        a._filler = true;
+                        largest = std::max(largest, a._size);
+                        break;
+                    case capture_arg::verbatim:
+                    case capture_arg::key:
+                        a._data = sstring(in.take(a._size), a._size);
+                        break;
+                    case capture_arg::hashed_key:
+                        a._data = synthetic_key(in.fixed64(), a._size);
+                        a._size = a._data.size();
+                        break;
+                    }
+                    r._args.push_back(std::move(a));
+                }
+                _traces[std::make_pair(file, id)].push_back(std::move(r));
+            }
+        } catch (const trace_cursor::truncated&) {
+            // the last record, cut short as the node stopped.
+        }
+        if (_filler.size() < largest) {
+            _filler = sstring(sstring::initialized_later(), largest);
+            std::fill(_filler.begin(), _filler.end(), 'x');
+        }
+        std::cerr << sprint("shard %u: %s, %s keys\n", engine().cpu_id(), name, anonymized ? "hashed" : "plain");
+    }
+public:
+    explicit replay_client(replay_config config) : _config(std::move(config)) {}
+
+    // The files of the shard, then a connection for each captured one.
+    future<> connect()
+    {
+        for (size_t i = engine().cpu_id(); i < _config._traces.size(); i += smp::count) {
+            load(i, _config._traces[i]);
+        }
+        return parallel_for_each(_traces, [this] (auto& t) {
+            return engine().net().connect(make_ipv4_address(_config._server)).then([this, &t] (connected_socket fd) {
+                _connections.push_back(std::make_unique<connection>(std::move(fd), *this, std::move(t.second)));
+            });
+        });
+    }
+
+    future<> run(clock_type::time_point start)
+    {
+        _start = start;
+        return parallel_for_each(_connections, [start] (auto& c) {
+            return c->run(start);
+        }).then([this] {
+            _end = clock_type::now();
+        });
+    }
+
+    replay_result result() const
+    {
+        return _result;
+    }
+
+    size_t connections() const
+    {
+        return _connections.size();
+    }
+
+    double elapsed() const
+    {
+        return _end > _start ? std::chrono::duration<double>(_end - _start).count() : 0;
+    }
+
+    future<> stop()
+    {
+        return parallel_for_each(_connections, [] (auto& c) {
+            return c->close();
+        });
+    }
+};
+
+int main(int ac, char** av) {
+    namespace bpo = boost::program_options;
+    app_template app;
+    app.add_options()
+        ("server", bpo::value<std::string>()->default_value("127.0.0.1:6379"), "Server address")
+        ("traces", bpo::value<std::vector<std::string>>()->multitoken(), "Files written by CAPTURE START, capture-<shard>.trace")
+        ("speed", bpo::value<double>()->default_value(1), "How many times faster than captured the requests are sent")
+        ;
+    return app.run(ac, av, [&app] {
+        auto&& c = app.configuration();
+        replay_config config;
+        config._server_name = c["server"].as<std::string>();
+        config._server = ipv4_addr(c["server"].as<std::string>());
+        config._speed = c["speed"].as<double>();
+        if (c.count("traces")) {
+            for (auto& t : c["traces"].as<std::vector<std::string>>()) {
+                config._traces.emplace_back(t);
+            }
+        }
+        try {
+            if (config._traces.empty()) {
+                throw std::invalid_argument("no --traces to replay");
+            }
+            if (!(config._speed > 0)) {
+                throw std::invalid_argument("speed must be positive");
+            }
+            // the files of all shards keep their offsets to each other.
+            config._base_us = std::numeric_limits<uint64_t>::max();
+            for (auto& t : config._traces) {
+                config._base_us = std::min(config._base_us, trace_start(t));
+            }
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << "\n";
+            return make_ready_future<int>(1);
+        }
+        auto clients = make_lw_shared<distributed<replay_client>>();
+        return clients->start(config).then([clients] {
+            return clients->invoke_on_all(&replay_client::connect);
+        }).then([clients] {
+            // the shards start together, the clock is the same on all.
+            auto start = clock_type::now() + std::chrono::milliseconds(100);
+            return clients->invoke_on_all([start] (replay_client& r) {
+                return r.run(start);
+            });
+        }).then([clients] {
+            return clients->map_reduce0(std::mem_fn(&replay_client::result), replay_result(), [] (replay_result total, replay_result r) {
+                total += r;
+                return total;
+            });
+        }).then([clients, config] (replay_result total) {
+            return clients->map_reduce0(std::mem_fn(&replay_client::elapsed), 0.0, [] (double a, double b) {
+                return std::max(a, b);
+            }).then([clients] (double elapsed) {
+                return clients->map_reduce0(std::mem_fn(&replay_client::connections), size_t(0), std::plus<size_t>()).then([elapsed] (size_t connections) {
+                    return std::make_pair(elapsed, connections);
+                });
+            }).then([clients, config, total = std::move(total)] (std::pair<double, size_t> run) {
+                std::cout << "{\n"
+                    << sprint("  \"server\": \"%s\",\n", config._server_name)
+                    << sprint("  \"traces\": %u,\n  \"speed\": %.3f,\n  \"connections\": %u,\n", config._traces.size(), config._speed, run.second)
+                    << sprint("  \"duration_s\": %.3f,\n  \"requests\": %u,\n  \"errors\": %u,\n  \"broken_connections\": %u,\n", run.first, total._requests, total._errors, total._broken)
+                    << sprint("  \"throughput_rps\": %.1f,\n", run.first > 0 ? total._requests / run.first : 0)
+                    << "  \"send_lag\": " << latency_json(total._lag) << ",\n"
+                    << "  \"latency\": " << latency_json(total._latency) << ",\n"
+                    << "  \"commands\": {";
+                const char* separator = "\n";
+                for (auto& cmd : total._commands) {
+                    std::cout << separator << sprint("    \"%s\": ", cmd.first) << latency_json(cmd.second);
+                    separator = ",\n";
+                }
+                std::cout << "\n  }\n}\n";
+                return clients->stop();
+            });
+        }).then([clients] {
+            return 0;
+        });
+    });
+}
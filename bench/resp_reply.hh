@@ -0,0 +1,98 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#pragma once
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include "core/print.hh"
+#include "core/sstring.hh"
+#include "bench/latency_histogram.hh"
+namespace redis {
+
+// The size of the whole reply at p, 0 if it is not complete yet. An error
+// reply sets `error`. The types of RESP3 are read too, for the connections
+// which switch to it with HELLO.
+inline size_t reply_size(const char* p, size_t n, bool& error)
+{
+    if (n == 0) {
+        return 0;
+    }
+    auto eol = static_cast<const char*>(std::memchr(p, '\n', n));
+    if (!eol) {
+        return 0;
+    }
+    size_t line = eol - p + 1;
+    switch (p[0]) {
+    case '-':
+        error = true;
+        return line;
+    case '+':
+    case ':':
+    case '_':
+    case '#':
+    case ',':
+    case '(':
+        return line;
+    case '!':
+        error = true;
+        // fall through
+    case '$':
+    case '=': {
+        auto size = std::strtol(p + 1, nullptr, 10);
+        if (size < 0) {
+            return line;
+        }
+        size_t total = line + size + 2;
+        return total <= n ? total : 0;
+    }
+    case '*':
+    case '~':
+    case '>':
+    case '%': {
+        auto count = std::strtol(p + 1, nullptr, 10);
+        if (p[0] == '%') {
+            count *= 2;
+        }
+        size_t total = line;
+        for (long i = 0; i < count; ++i) {
+            auto size = reply_size(p + total, n - total, error);
+            if (size == 0) {
+                return 0;
+            }
+            total += size;
+        }
+        return total;
+    }
+    default:
+        throw std::runtime_error("malformed reply from the server");
+    }
+}
+
+inline sstring latency_json(const latency_histogram& h)
+{
+    auto us = [] (uint64_t ns) { return ns / 1000.0; };
+    return sprint("{\"count\": %u, \"min_us\": %.3f, \"mean_us\": %.3f, \"p50_us\": %.3f, \"p90_us\": %.3f, "
+                  "\"p99_us\": %.3f, \"p99.9_us\": %.3f, \"p99.99_us\": %.3f, \"max_us\": %.3f}",
+                  h.count(), us(h.min()), h.mean() / 1000.0, us(h.percentile(50)), us(h.percentile(90)),
+                  us(h.percentile(99)), us(h.percentile(99.9)), us(h.percentile(99.99)), us(h.max()));
+}
+
+}
@@ -1,13 +1,49 @@
 #include "cache.hh"
 #include <limits>
+#include <random>
+#include <stdexcept>
+#include <lz4.h>
 #include "column_family.hh"
+#include "utils/float_string.hh"
+#include "core/future-util.hh"
 namespace redis {
 cache_entry::cache_entry(cache_entry&& o) noexcept
     : _cache_link()
-    , _type(o._type)
-    , _key(std::move(_key))
     , _key_hash(std::move(o._key_hash))
+    , _type(o._type)
+    , _encoding(o._encoding)
+    , _inline_key(o._inline_key)
+    , _dirty(o._dirty)
+    , _expired(o._expired)
+    , _expires(o._expires)
+    , _copied(o._copied)
+    , _watched(o._watched)
+    , _tracked(o._tracked)
+    , _field_ttls(o._field_ttls)
+    , _volatile(o._volatile)
+    , _lfu_counter(o._lfu_counter)
+    , _size_bucket(o._size_bucket)
+    , _snapshot_epoch(o._snapshot_epoch)
+    , _last_touched(o._last_touched)
 {
+    // the entry stays counted once, as this one.
+    o._size_bucket = size_distribution::uncounted;
+    if (_resized == &o) {
+        _resized = this;
+    }
+    _lru_link.swap_nodes(o._lru_link);
+    _dirty_link.swap_nodes(o._dirty_link);
+    if (_expires) {
+        _local_expiries->moved(o, *this);
+        o._expires = false;
+        o._expired = false;
+    }
+    if (_inline_key) {
+        _key._inline = o._key._inline;
+    }
+    else {
+        new (&_key._ref) managed_ref<managed_bytes>(std::move(o._key._ref));
+    }
     switch (_type) {
         case data_type::numeric:
             _u._float_number = std::move(o._u._float_number);
@@ -17,18 +53,57 @@ cache_entry::cache_entry(cache_entry&& o) noexcept
             break;
         case data_type::bytes:
         case data_type::hll:
-            _u._bytes = std::move(o._u._bytes);
+            if (_encoding == encoding::shared) {
+                // the bytes stay accounted once, the moved from buffer is empty.
+                new (&_u._shared_bytes) temporary_buffer<char>(std::move(o._u._shared_bytes));
+            }
+            else if (_encoding == encoding::inlined) {
+                _u._inline_bytes = o._u._inline_bytes;
+            }
+            else if (_encoding == encoding::integer) {
+                _u._integer = o._u._integer;
+            }
+            else if (_encoding == encoding::paged) {
+                new (&_u._bitmap) managed_ref<bitmap_lsa>(std::move(o._u._bitmap));
+            }
+            else if (_encoding == encoding::compressed) {
+                new (&_u._compressed._block) managed_ref<managed_bytes>(std::move(o._u._compressed._block));
+                _u._compressed._size = o._u._compressed._size;
+            }
+            else {
+                _u._bytes = std::move(o._u._bytes);
+            }
             break;
         case data_type::list:
             _u._list = std::move(o._u._list);
             break;
         case data_type::dict:
         case data_type::set:
-            _u._dict = std::move(o._u._dict);
+            if (_encoding == encoding::packed) {
+                _u._bytes = std::move(o._u._bytes);
+            }
+            else {
+                _u._dict = std::move(o._u._dict);
+            }
             break;
         case data_type::sset:
             _u._sset = std::move(o._u._sset);
             break;
+        case data_type::stream:
+            _u._stream = std::move(o._u._stream);
+            break;
+        case data_type::timeseries:
+            _u._timeseries = std::move(o._u._timeseries);
+            break;
+        case data_type::bloom:
+            _u._bloom = std::move(o._u._bloom);
+            break;
+        case data_type::cms:
+            _u._cms = std::move(o._u._cms);
+            break;
+        case data_type::topk:
+            _u._topk = std::move(o._u._topk);
+            break;
         default:
             break;
     }
@@ -42,8 +117,359 @@ cache_entry::cache_entry(cache_entry&& o) noexcept
     */
 }
 
+thread_local size_t cache_entry::_shared_value_bytes = 0;
+thread_local compression_stats cache_entry::_compression_stats;
+thread_local expiry_index* cache_entry::_local_expiries = nullptr;
+thread_local size_distribution cache_entry::_size_distribution;
+thread_local cache_entry* cache_entry::_resized = nullptr;
+constexpr uint8_t size_distribution::uncounted;
+
+static thread_local std::mt19937_64 eviction_random_engine;
+
+void cache_entry::touch(clock_type::time_point now)
+{
+    auto counter = lfu_counter(now);
+    if (counter < std::numeric_limits<uint8_t>::max()) {
+        double base = counter > lfu_init_value ? counter - lfu_init_value : 0;
+        std::uniform_real_distribution<double> dist(0, 1);
+        if (dist(eviction_random_engine) < 1.0 / (base * lfu_log_factor + 1)) {
+            ++counter;
+        }
+    }
+    _lfu_counter = counter;
+    _last_touched = now;
+}
+
+bool cache_entry::construct_value_compressed(bytes_view data)
+{
+    if (data.size() > LZ4_MAX_INPUT_SIZE) {
+        return false;
+    }
+    auto start = std::chrono::steady_clock::now();
+    temporary_buffer<char> block(LZ4_compressBound(data.size()));
+    auto size = LZ4_compress_default(data.data(), block.get_write(), data.size(), block.size());
+    auto& stats = _compression_stats;
+    stats._compress_time_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    ++stats._compressions;
+    // as the sstable blocks, kept whole unless it saves an eighth.
+    if (size <= 0 || static_cast<size_t>(size) > data.size() - data.size() / 8) {
+        return false;
+    }
+    _encoding = encoding::compressed;
+    new (&_u._compressed._block) managed_ref<managed_bytes>(make_managed<managed_bytes>(bytes_view { block.get(), static_cast<size_t>(size) }));
+    _u._compressed._size = data.size();
+    stats._raw_bytes += data.size();
+    stats._compressed_bytes += size;
+    return true;
+}
+
+temporary_buffer<char> cache_entry::decompress_value() const
+{
+    assert(_encoding == encoding::compressed);
+    auto start = std::chrono::steady_clock::now();
+    temporary_buffer<char> data(_u._compressed._size);
+    auto& block = *_u._compressed._block;
+    auto size = with_linearized_managed_bytes([&] {
+        return LZ4_decompress_safe(block.data(), data.get_write(), block.size(), data.size());
+    });
+    assert(size == static_cast<int>(data.size()));
+    (void)size;
+    auto& stats = _compression_stats;
+    stats._decompress_time_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    ++stats._decompressions;
+    return data;
+}
+
+void cache_entry::unpack()
+{
+    assert(_encoding == encoding::packed);
+    auto dict = make_managed<dict_lsa>();
+    packed_dict(*_u._bytes, _type == data_type::dict).unpack_into(*dict);
+    _u._bytes.~managed_ref<managed_bytes>();
+    new (&_u._dict) managed_ref<dict_lsa>(std::move(dict));
+    _encoding = encoding::region;
+}
+
+size_t cache_entry::value_elements() const
+{
+    if (_encoding == encoding::packed) {
+        return 0;
+    }
+    switch (_type) {
+        case data_type::list:
+            return _u._list->size();
+        case data_type::dict:
+        case data_type::set:
+            return _u._dict->size();
+        case data_type::sset:
+            return _u._sset->size();
+        case data_type::stream:
+            return _u._stream->size();
+        case data_type::timeseries:
+            return _u._timeseries->size();
+        default:
+            return 0;
+    }
+}
+
+size_t cache_entry::value_size() const
+{
+    switch (_type) {
+        case data_type::bytes:
+            return value_bytes_size();
+        case data_type::dict:
+        case data_type::set:
+            return dict_size();
+        default:
+            return value_elements();
+    }
+}
+
+void cache_entry::settle_size()
+{
+    size_distribution::kind k;
+    if (!size_distribution::kind_of(_type, k)) {
+        return;
+    }
+    forget_size();
+    _size_bucket = _size_distribution.add(k, value_size());
+}
+
+void cache_entry::forget_size()
+{
+    size_distribution::kind k;
+    if (_size_bucket != size_distribution::uncounted && size_distribution::kind_of(_type, k)) {
+        _size_distribution.remove(k, _size_bucket);
+    }
+    _size_bucket = size_distribution::uncounted;
+}
+
+size_t cache_entry::flush_some(size_t count)
+{
+    if (_encoding == encoding::packed) {
+        return 0;
+    }
+    switch (_type) {
+        case data_type::list:
+            return _u._list->flush_some(count);
+        case data_type::dict:
+        case data_type::set:
+            return _u._dict->flush_some(count);
+        case data_type::sset:
+            return _u._sset->flush_some(count);
+        case data_type::stream:
+            return _u._stream->flush_some(count);
+        case data_type::timeseries:
+            return _u._timeseries->flush_some(count);
+        default:
+            return 0;
+    }
+}
+
+// What the object a managed_ref points to takes in the current allocator.
+template <typename T>
+static inline size_t allocated_size(const managed_ref<T>& ref)
+{
+    return current_allocator().object_memory_size_in_allocator(ref._ptr);
+}
+
+size_t cache_entry::memory_usage(size_t samples) const
+{
+    auto size = current_allocator().object_memory_size_in_allocator(this);
+    if (!_inline_key) {
+        size += allocated_size(_key._ref) + _key._ref->external_memory_usage();
+    }
+    switch (_encoding) {
+        case encoding::inlined:
+        case encoding::integer:
+            return size;
+        case encoding::shared:
+            return size + _u._shared_bytes.size();
+        case encoding::packed:
+            return size + allocated_size(_u._bytes) + _u._bytes->external_memory_usage();
+        case encoding::paged:
+            return size + allocated_size(_u._bitmap) + _u._bitmap->memory_usage();
+        case encoding::compressed:
+            return size + allocated_size(_u._compressed._block) + _u._compressed._block->external_memory_usage();
+        case encoding::region:
+            break;
+    }
+    switch (_type) {
+        case data_type::bytes:
+        case data_type::hll:
+            return size + allocated_size(_u._bytes) + _u._bytes->external_memory_usage();
+        case data_type::list:
+            return size + allocated_size(_u._list) + _u._list->memory_usage(samples);
+        case data_type::dict:
+        case data_type::set:
+            return size + allocated_size(_u._dict) + _u._dict->memory_usage(samples);
+        case data_type::sset:
+            return size + allocated_size(_u._sset) + _u._sset->memory_usage(samples);
+        case data_type::stream:
+            return size + allocated_size(_u._stream) + _u._stream->memory_usage();
+        case data_type::timeseries:
+            return size + allocated_size(_u._timeseries) + _u._timeseries->memory_usage();
+        case data_type::bloom:
+            return size + allocated_size(_u._bloom) + _u._bloom->memory_usage();
+        case data_type::cms:
+            return size + allocated_size(_u._cms) + _u._cms->memory_usage();
+        case data_type::topk:
+            return size + allocated_size(_u._topk) + _u._topk->memory_usage();
+        default:
+            return size;
+    }
+}
+
+size_t cache::random_bucket()
+{
+    return eviction_random_engine();
+}
+
+eviction_policy to_eviction_policy(const std::string& name)
+{
+    if (name == "noeviction") {
+        return eviction_policy::noeviction;
+    }
+    else if (name == "allkeys-lru") {
+        return eviction_policy::allkeys_lru;
+    }
+    else if (name == "allkeys-lfu") {
+        return eviction_policy::allkeys_lfu;
+    }
+    else if (name == "volatile-ttl") {
+        return eviction_policy::volatile_ttl;
+    }
+    throw std::invalid_argument("unknown maxmemory policy: " + name);
+}
+
+const char* to_eviction_policy_name(eviction_policy policy)
+{
+    switch (policy) {
+    case eviction_policy::allkeys_lru: return "allkeys-lru";
+    case eviction_policy::allkeys_lfu: return "allkeys-lfu";
+    case eviction_policy::volatile_ttl: return "volatile-ttl";
+    default: return "noeviction";
+    }
+}
+
+// The record of an entry in the store, null for the types it has no
+// record for yet, which stay in memory only. The expiry is kept as a unix
+// time, as the record may be read back long after, see FLAG_EXPIRE_AT.
+static lw_shared_ptr<mutation> make_flush_mutation(const cache_entry& e)
+{
+    bytes key { e.key().data(), e.key().size() };
+    long expire = 0;
+    int flag = 0;
+    if (e.ever_expires()) {
+        // an entry about to expire keeps the shortest ttl.
+        auto ttl = std::chrono::duration_cast<std::chrono::milliseconds>(e.get_timeout() - clock_type::now()).count();
+        auto now = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+        expire = now + std::max<long>(ttl, 1);
+        flag = FLAG_EXPIRE_AT;
+    }
+    switch (e.type()) {
+        case data_type::bytes: {
+            bytes value(bytes::initialized_later(), e.value_bytes_size());
+            auto p = value.begin();
+            e.for_each_value_fragment([&p] (bytes_view fragment) {
+                p = std::copy(fragment.begin(), fragment.end(), p);
+            });
+            return make_owned_bytes_mutation(key, std::move(value), expire, flag);
+        }
+        case data_type::int64:
+            return make_owned_bytes_mutation(key, to_sstring<bytes>(e.value_integer()), expire, flag);
+        case data_type::numeric: {
+            char value[max_float_string];
+            return make_owned_bytes_mutation(key, bytes { value, format_float_string(e.value_float(), value) }, expire, flag);
+        }
+        default:
+            return nullptr;
+    }
+}
+
+bool cache::demotable(const cache_entry& e)
+{
+    return e.type() == data_type::bytes || e.type() == data_type::int64 || e.type() == data_type::numeric;
+}
+
+void cache::demote(const cache_entry& e)
+{
+    auto key = bytes { e.key().data(), e.key().size() };
+    // a deletion still to be flushed would come after the record.
+    if (!_deleted_keys.empty()) {
+        _deleted_keys.erase(std::remove(_deleted_keys.begin(), _deleted_keys.end(), key), _deleted_keys.end());
+    }
+    auto m = make_flush_mutation(e);
+    _lower_tier->apply(*m);
+    _tier_hint.add(e.key_hash());
+    ++_demotions;
+}
+
+void tier_hint::resize(size_t bytes)
+{
+    _bits.assign(std::max<size_t>(bytes / sizeof(uint64_t), 1), 0);
+}
+
+// Three probes by double hashing of the hash of the key.
+void tier_hint::add(size_t hash)
+{
+    size_t bits = _bits.size() * 64;
+    auto step = (hash >> 32) | 1;
+    for (size_t i = 0; i < probes; ++i) {
+        auto bit = (hash + i * step) % bits;
+        _bits[bit / 64] |= uint64_t(1) << (bit % 64);
+    }
+}
+
+bool tier_hint::may_contain(size_t hash) const
+{
+    if (_all) {
+        return true;
+    }
+    if (_bits.empty()) {
+        return false;
+    }
+    size_t bits = _bits.size() * 64;
+    auto step = (hash >> 32) | 1;
+    for (size_t i = 0; i < probes; ++i) {
+        auto bit = (hash + i * step) % bits;
+        if ((_bits[bit / 64] & (uint64_t(1) << (bit % 64))) == 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
 future<> cache::flush_dirty_entry(store::column_family& cf)
 {
-    return make_ready_future<>();
+    auto deleted_keys = std::move(_deleted_keys);
+    _deleted_keys.clear();
+    if (!deleted_keys.empty()) {
+        ++_deletion_flushes;
+    }
+    for (auto& key : deleted_keys) {
+        auto m = make_deleted_mutation(key);
+        cf.apply(*m);
+    }
+    _flushing.splice(_flushing.end(), _dirty);
+    return repeat([this, &cf] {
+        for (size_t n = 0; n < dirty_entries_per_flush && !_flushing.empty(); ++n) {
+            auto& e = _flushing.front();
+            _flushing.pop_front();
+            e._dirty = false;
+            if (_digester) {
+                fold_digest(e, _digester(e));
+            }
+            auto m = make_flush_mutation(e);
+            if (m) {
+                cf.apply(*m);
+            }
+            ++_flushed_entries;
+        }
+        if (_flushing.empty()) {
+            return make_ready_future<stop_iteration>(stop_iteration::yes);
+        }
+        return later().then([] { return stop_iteration::no; });
+    });
 }
 }
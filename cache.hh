@@ -19,6 +19,13 @@
 *
 */
 #pragma once
+#include <memory>
+#include <algorithm>
+#include <array>
+#include <deque>
+#include <limits>
+#include <tuple>
+#include <unordered_map>
 #include <boost/intrusive/unordered_set.hpp>
 #include <boost/intrusive/list.hpp>
 #include <boost/intrusive/set.hpp>
@@ -31,20 +38,38 @@
 #include "utils/logalloc.hh"
 #include "structures/list_lsa.hh"
 #include "structures/dict_lsa.hh"
+#include "structures/packed_dict.hh"
 #include "structures/sset_lsa.hh"
+#include "structures/scan_cursor.hh"
 #include "structures/hll.hh"
+#include "structures/bits_operation.hh"
+#include "structures/bitmap_lsa.hh"
+#include "structures/stream_lsa.hh"
+#include "structures/timeseries_lsa.hh"
+#include "structures/bloom_lsa.hh"
+#include "structures/count_min_lsa.hh"
+#include "structures/topk_lsa.hh"
+#include "structures/key_index.hh"
 #include "core/timer-set.hh"
+#include "core/temporary_buffer.hh"
 #include "util/log.hh"
 #include "keys.hh"
 #include "utils/bytes.hh"
 #include "seastarx.hh"
 #include "column_family.hh"
 #include "types.hh"
+#include "hash_slot.hh"
+#include "utils/integer_string.hh"
+#include "utils/latency_monitor.hh"
+#include "utils/estimated_histogram.hh"
+#include "utils/work_scheduler.hh"
+#include "current_operation.hh"
 namespace bi = boost::intrusive;
 namespace redis {
 using clock_type = lowres_clock;
 static constexpr clock_type::time_point never_expire_timepoint = clock_type::time_point(clock_type::duration::min());
 class cache;
+class expiry_index;
 struct expiration {
     using time_point = clock_type::time_point;
     using duration   = time_point::duration;
@@ -76,16 +101,126 @@ struct expiration {
     }
 };
 
+// The string values of a shard held compressed, see
+// cache_entry::compressed_initializer: the bytes they take and those they
+// decompress to, and the time spent compressing and decompressing them.
+struct compression_stats {
+    size_t _raw_bytes = 0;
+    size_t _compressed_bytes = 0;
+    uint64_t _compressions = 0;
+    uint64_t _decompressions = 0;
+    uint64_t _compress_time_ns = 0;
+    uint64_t _decompress_time_ns = 0;
+};
+
+// The sizes of the values of a shard: the bytes of the strings and the
+// elements of the collections, by kind. The entries are counted as they
+// change rather than by a walk, see cache_entry::settle_size().
+class size_distribution {
+public:
+    enum class kind : uint8_t {
+        string,
+        list,
+        hash,
+        set,
+        zset,
+        stream,
+        // keep it last.
+        count,
+    };
+    static constexpr size_t kinds = static_cast<size_t>(kind::count);
+    // The bucket of an entry not counted.
+    static constexpr uint8_t uncounted = std::numeric_limits<uint8_t>::max();
+private:
+    std::array<utils::estimated_histogram, kinds> _histograms;
+public:
+    // The kind of the values of the type, false for those not counted.
+    static bool kind_of(data_type type, kind& k)
+    {
+        switch (type) {
+        case data_type::bytes: k = kind::string; return true;
+        case data_type::list: k = kind::list; return true;
+        case data_type::dict: k = kind::hash; return true;
+        case data_type::set: k = kind::set; return true;
+        case data_type::sset: k = kind::zset; return true;
+        case data_type::stream: k = kind::stream; return true;
+        default: return false;
+        }
+    }
+    static const char* kind_name(kind k)
+    {
+        static const char* names[] = { "strings", "lists", "hashes", "sets", "zsets", "streams" };
+        return names[static_cast<size_t>(k)];
+    }
+
+    // Counts a value of `size`, and returns its bucket for remove().
+    uint8_t add(kind k, size_t size)
+    {
+        auto& h = _histograms[static_cast<size_t>(k)];
+        auto bucket = h.bucket_of(static_cast<int64_t>(std::min<size_t>(size, std::numeric_limits<int64_t>::max())));
+        h.add_to_bucket(bucket);
+        return static_cast<uint8_t>(bucket);
+    }
+    void remove(kind k, uint8_t bucket)
+    {
+        _histograms[static_cast<size_t>(k)].remove_from_bucket(bucket);
+    }
+    const utils::estimated_histogram& of(kind k) const
+    {
+        return _histograms[static_cast<size_t>(k)];
+    }
+};
+
 class cache_entry
 {
 protected:
     friend class cache;
+    friend struct cache_entry_layout;
     using list_link_type = bi::list_member_hook<bi::link_mode<bi::auto_unlink>>;
     using hook_type = boost::intrusive::unordered_set_member_hook<>;
-    hook_type _cache_link;
-    data_type _type;
-    managed_ref<managed_bytes> _key;
-    size_t _key_hash;
+    // Short keys and string values are held in the entry itself, saving an
+    // allocation of the region and a pointer chase on every lookup: a key
+    // of at most max_inline_key bytes, and a string of at most
+    // max_inline_value bytes.
+    static constexpr size_t max_inline_key = 23;
+    static constexpr size_t max_inline_value = 31;
+    template <size_t Size>
+    struct inline_bytes {
+        char _data[Size];
+        uint8_t _size;
+    };
+    // A string which reads as an int64, with its digits so that reads do
+    // not format it and INCR does not parse it.
+    struct integer_string {
+        int64_t _value;
+        char _data[max_integer_string];
+        uint8_t _size;
+    };
+    // A string held as an LZ4 block of the region, and the size it
+    // decompresses to.
+    struct compressed_bytes {
+        managed_ref<managed_bytes> _block;
+        uint32_t _size;
+    };
+    // Where the value is: a string in a managed_bytes of the region, in
+    // the entry, as an integer_string, out of the region, in the pages of
+    // a bitmap_lsa, or compressed; a hash or set in a dict_lsa, or in a
+    // packed_dict blob.
+    enum class encoding : uint8_t {
+        region,
+        inlined,
+        integer,
+        shared,
+        packed,
+        paged,
+        compressed,
+    };
+    union key_storage {
+        managed_ref<managed_bytes> _ref;
+        inline_bytes<max_inline_key> _inline;
+        key_storage() {}
+        ~key_storage() {}
+    };
     union storage {
         double _float_number;
         int64_t _integer_number;
@@ -93,26 +228,154 @@ protected:
         managed_ref<list_lsa> _list;
         managed_ref<dict_lsa> _dict;
         managed_ref<sset_lsa> _sset;
+        managed_ref<bitmap_lsa> _bitmap;
+        managed_ref<stream_lsa> _stream;
+        managed_ref<timeseries_lsa> _timeseries;
+        managed_ref<bloom_lsa> _bloom;
+        managed_ref<count_min_lsa> _cms;
+        managed_ref<topk_lsa> _topk;
+        temporary_buffer<char> _shared_bytes;
+        inline_bytes<max_inline_value> _inline_bytes;
+        integer_string _integer;
+        compressed_bytes _compressed;
         storage() {}
         ~storage() {}
-    } _u;
-    bi::list_member_hook<> _timer_link;
-    expiration _expiry;
+    };
+
+    // The fields a lookup reads come first, in the first 64 bytes: the
+    // bucket link, the hash, the type and encoding, the flags, the key,
+    // then the value, whose pointer or inline prefix ends the line. What
+    // eviction, flushing and expiry walks use follows. The expiry is not in
+    // the entry, see expiry_index.
+    hook_type _cache_link;
+    size_t _key_hash;
+    data_type _type;
+    encoding _encoding { encoding::region };
+    // The key is in _key._inline, else in _key._ref.
+    bool _inline_key { false };
     bool _dirty { true };
+    // Expired, waiting in cache::_expired to be released.
+    bool _expired { false };
+    // Expires: its record is in cache::_expiries.
+    bool _expires { false };
+    key_storage _key;
+    storage _u;
+
+    // Other shards may hold a copy of the value, see cache::find_for_copy().
+    bool _copied { false };
+    // A connection WATCHes the key, see cache::set_watch_notifier().
+    bool _watched { false };
+    // A client caches the value, see cache::set_tracking_notifier().
+    bool _tracked { false };
+    // Some fields of the hash expire, see cache::set_field_ttl_dropper().
+    bool _field_ttls { false };
+    // Set with a short TTL, neither logged nor flushed, see
+    // database_options::_volatile_ttl_ms. Any later change clears it.
+    bool _volatile { false };
+    // Logarithmic access frequency, see touch().
+    uint8_t _lfu_counter;
+    // The bucket of the size distribution the entry is counted in, see
+    // settle_size().
+    uint8_t _size_bucket { size_distribution::uncounted };
+    // The last snapshot the entry was saved to, see cache::begin_snapshot().
+    uint32_t _snapshot_epoch = 0;
     clock_type::time_point _last_touched;
+    // What the entry adds to the digest of its slot, see cache::fold_digest().
+    uint64_t _digest = 0;
     list_link_type _dirty_link;
     list_link_type _lru_link;
+
+    static thread_local size_t _shared_value_bytes;
+    static thread_local compression_stats _compression_stats;
+    static thread_local size_distribution _size_distribution;
+    // The entry written last, counted again by the next write, see resized().
+    static thread_local cache_entry* _resized;
+    // The records of the cache of the shard, which follow its entries as
+    // the region moves them.
+    static thread_local expiry_index* _local_expiries;
+    void construct_key(bytes_view key)
+    {
+        _inline_key = key.size() <= max_inline_key;
+        if (_inline_key) {
+            _key._inline._size = key.size();
+            std::copy_n(key.data(), key.size(), _key._inline._data);
+        }
+        else {
+            new (&_key._ref) managed_ref<managed_bytes>(make_managed<managed_bytes>(key));
+        }
+    }
+    // Takes `key` in place of its own, as RENAME does within a shard.
+    void replace_key(bytes_view key, size_t hash)
+    {
+        if (!_inline_key) {
+            _key._ref.~managed_ref<managed_bytes>();
+        }
+        construct_key(key);
+        _key_hash = hash;
+    }
+    // A string value held in the region: as an integer if it reads as one,
+    // else inline if it is short enough.
+    void construct_value_bytes(bytes_view data)
+    {
+        int64_t value;
+        if (parse_integer_string(data.data(), data.size(), value)) {
+            construct_value_integer(value);
+        }
+        else if (data.size() <= max_inline_value) {
+            _encoding = encoding::inlined;
+            _u._inline_bytes._size = data.size();
+            std::copy_n(data.data(), data.size(), _u._inline_bytes._data);
+        }
+        else {
+            _encoding = encoding::region;
+            new (&_u._bytes) managed_ref<managed_bytes>(make_managed<managed_bytes>(data));
+        }
+    }
+    // Holds the value as an LZ4 block, under the allocator of the region.
+    // false, and nothing done, unless it saves an eighth of the value.
+    bool construct_value_compressed(bytes_view data);
+    void construct_value_integer(int64_t value)
+    {
+        _encoding = encoding::integer;
+        _u._integer._value = value;
+        _u._integer._size = format_integer_string(value, _u._integer._data);
+    }
+    void destroy_value_bytes()
+    {
+        if (_encoding == encoding::shared) {
+            _shared_value_bytes -= _u._shared_bytes.size();
+            _u._shared_bytes.~temporary_buffer<char>();
+        }
+        else if (_encoding == encoding::region) {
+            _u._bytes.~managed_ref<managed_bytes>();
+        }
+        else if (_encoding == encoding::paged) {
+            _u._bitmap.~managed_ref<bitmap_lsa>();
+        }
+        else if (_encoding == encoding::compressed) {
+            _compression_stats._raw_bytes -= _u._compressed._size;
+            _compression_stats._compressed_bytes -= _u._compressed._block->size();
+            _u._compressed._block.~managed_ref<managed_bytes>();
+        }
+    }
 public:
-    using time_point = expiration::time_point;
-    using duration = expiration::duration;
+    // As in Redis: new entries start with a small counter so that they are
+    // not evicted before getting a chance to be accessed, the counter grows
+    // with probability 1 / ((counter - init) * factor + 1) and decays by one
+    // for every period the entry is not accessed.
+    static constexpr uint8_t lfu_init_value = 5;
+    static constexpr double lfu_log_factor = 10;
+    static constexpr auto lfu_decay_period = std::chrono::minutes(1);
     cache_entry(const bytes& key, size_t hash, data_type type) noexcept
         : _cache_link()
-        , _type(type)
         , _key_hash(hash)
+        , _type(type)
+        , _lfu_counter(lfu_init_value)
+        , _last_touched(clock_type::now())
         , _dirty_link()
         , _lru_link()
     {
-        _key = make_managed<managed_bytes>(bytes_view{key.data(), key.size()});
+        construct_key(bytes_view { key.data(), key.size() });
     }
 
     cache_entry(const bytes& key, size_t hash, double data) noexcept
@@ -121,23 +384,97 @@ public:
         _u._float_number = data;
     }
 
+    // A string holding the integer, as INCR creates.
     cache_entry(const bytes key, size_t hash, int64_t data) noexcept
-        : cache_entry(key, hash, data_type::int64)
+        : cache_entry(key, hash, data_type::bytes)
     {
-        _u._integer_number = data;
+        construct_value_integer(data);
     }
 
     cache_entry(const bytes key, size_t hash, size_t origin_size) noexcept
         : cache_entry(key, hash, data_type::bytes)
     {
-        //_u._bytes = make_managed<managed_bytes>(origin_size, 0);
+        _u._bytes = make_managed<managed_bytes>(bits_operation::make_bitmap(origin_size));
+    }
+
+    // A string of `size` zeroes in a bitmap_lsa, as SETBIT creates past a
+    // page.
+    struct bitmap_initializer {
+        size_t _size;
+    };
+    cache_entry(const bytes& key, size_t hash, bitmap_initializer init) noexcept
+        : cache_entry(key, hash, data_type::bytes)
+    {
+        _encoding = encoding::paged;
+        new (&_u._bitmap) managed_ref<bitmap_lsa>(make_managed<bitmap_lsa>());
+        _u._bitmap->grow(init._size);
+    }
+    // A BITOP result past a page, kept in the form its pages came in.
+    cache_entry(const bytes& key, size_t hash, const sparse_bitmap& pages) noexcept
+        : cache_entry(key, hash, data_type::bytes)
+    {
+        _encoding = encoding::paged;
+        new (&_u._bitmap) managed_ref<bitmap_lsa>(make_managed<bitmap_lsa>(pages));
     }
 
     cache_entry(const bytes& key, size_t hash, const bytes& data) noexcept
         : cache_entry(key, hash, data_type::bytes)
     {
-        _u._bytes = make_managed<managed_bytes>(bytes_view{data.data(), data.size()});
+        construct_value_bytes(bytes_view { data.data(), data.size() });
+    }
+
+    cache_entry(const bytes& key, size_t hash, bytes_view data) noexcept
+        : cache_entry(key, hash, data_type::bytes)
+    {
+        construct_value_bytes(data);
+    }
+    // A string compressed if it is worth it, see construct_value_compressed().
+    struct compressed_initializer {
+        bytes_view _data;
+    };
+    cache_entry(const bytes& key, size_t hash, compressed_initializer init) noexcept
+        : cache_entry(key, hash, data_type::bytes)
+    {
+        if (!construct_value_compressed(init._data)) {
+            construct_value_bytes(init._data);
+        }
+    }
+    // A large string from the fragments it arrived in, copied once into
+    // the region, see request_wrapper::arg_fragments(). At least
+    // max_inline_value bytes.
+    struct fragmented_initializer {
+        const std::vector<bytes_view>& _fragments;
+        size_t _size;
+    };
+    cache_entry(const bytes& key, size_t hash, fragmented_initializer init) noexcept
+        : cache_entry(key, hash, data_type::bytes)
+    {
+        _encoding = encoding::region;
+        new (&_u._bytes) managed_ref<managed_bytes>(make_managed<managed_bytes>(managed_bytes::initialized_later(), init._size));
+        auto f = init._fragments.begin();
+        size_t used = 0;
+        _u._bytes->for_each_mutable_fragment([&f, &used] (char* data, size_t size) {
+            while (size > 0) {
+                auto n = std::min(size, f->size() - used);
+                std::copy_n(f->data() + used, n, data);
+                data += n;
+                size -= n;
+                used += n;
+                if (used == f->size()) {
+                    ++f;
+                    used = 0;
+                }
+            }
+        });
+    }
+    cache_entry(const bytes& key, size_t hash, temporary_buffer<char> data) noexcept
+        : cache_entry(key, hash, data_type::bytes)
+    {
+        _encoding = encoding::shared;
+        _shared_value_bytes += data.size();
+        new (&_u._shared_bytes) temporary_buffer<char>(std::move(data));
     }
+
     struct list_initializer {};
     cache_entry(const bytes& key, size_t hash, list_initializer) noexcept
         : cache_entry(key, hash, data_type::list)
@@ -159,6 +496,30 @@ public:
         _u._dict = make_managed<dict_lsa>();
     }
 
+    struct packed_dict_initializer {};
+    cache_entry(const bytes& key, size_t hash, packed_dict_initializer) noexcept
+        : cache_entry(key, hash, data_type::dict)
+    {
+        _encoding = encoding::packed;
+        new (&_u._bytes) managed_ref<managed_bytes>(make_managed<managed_bytes>(packed_dict::make_blob()));
+    }
+
+    struct packed_set_initializer {};
+    cache_entry(const bytes& key, size_t hash, packed_set_initializer) noexcept
+        : cache_entry(key, hash, data_type::set)
+    {
+        _encoding = encoding::packed;
+        new (&_u._bytes) managed_ref<managed_bytes>(make_managed<managed_bytes>(packed_dict::make_blob()));
+    }
+
+    struct intset_initializer {};
+    cache_entry(const bytes& key, size_t hash, intset_initializer) noexcept
+        : cache_entry(key, hash, data_type::set)
+    {
+        _encoding = encoding::packed;
+        new (&_u._bytes) managed_ref<managed_bytes>(make_managed<managed_bytes>(packed_dict::make_int_blob()));
+    }
+
     struct sset_initializer {};
     cache_entry(const bytes& key, size_t hash, sset_initializer) noexcept
         : cache_entry(key, hash, data_type::sset)
@@ -166,38 +527,114 @@ public:
         _u._sset = make_managed<sset_lsa>();
     }
 
-    struct hll_initializer {};
-    cache_entry(const bytes& key, size_t hash, hll_initializer) noexcept
+    struct hll_initializer {
+        bool _sparse = true;
+    };
+    cache_entry(const bytes& key, size_t hash, hll_initializer init) noexcept
         : cache_entry(key, hash, data_type::hll)
     {
-        //_u._bytes = make_managed<managed_bytes>(HLL_BYTES_SIZE, 0);
+        _u._bytes = make_managed<managed_bytes>(hll::make(init._sparse));
+    }
+
+    struct stream_initializer {};
+    cache_entry(const bytes& key, size_t hash, stream_initializer) noexcept
+        : cache_entry(key, hash, data_type::stream)
+    {
+        _u._stream = make_managed<stream_lsa>();
+    }
+
+    struct timeseries_initializer {};
+    cache_entry(const bytes& key, size_t hash, timeseries_initializer) noexcept
+        : cache_entry(key, hash, data_type::timeseries)
+    {
+        _u._timeseries = make_managed<timeseries_lsa>();
+    }
+
+    struct bloom_initializer {
+        double _error;
+        uint64_t _capacity;
+        uint32_t _expansion;
+    };
+    cache_entry(const bytes& key, size_t hash, bloom_initializer init)
+        : cache_entry(key, hash, data_type::bloom)
+    {
+        _u._bloom = make_managed<bloom_lsa>(init._error, init._capacity, init._expansion);
+    }
+
+    struct cms_initializer {
+        uint32_t _width;
+        uint32_t _depth;
+    };
+    cache_entry(const bytes& key, size_t hash, cms_initializer init) noexcept
+        : cache_entry(key, hash, data_type::cms)
+    {
+        _u._cms = make_managed<count_min_lsa>(init._width, init._depth);
+    }
+
+    struct topk_initializer {
+        uint32_t _k;
+        uint32_t _width;
+        uint32_t _depth;
+        double _decay;
+    };
+    cache_entry(const bytes& key, size_t hash, topk_initializer init) noexcept
+        : cache_entry(key, hash, data_type::topk)
+    {
+        _u._topk = make_managed<topk_lsa>(init._k, init._width, init._depth, init._decay);
     }
 
     cache_entry(cache_entry&& o) noexcept;
 
-    virtual ~cache_entry()
+    ~cache_entry()
     {
+        forget_size();
+        if (_resized == this) {
+            _resized = nullptr;
+        }
         switch (_type) {
             case data_type::numeric:
             case data_type::int64:
                 break;
             case data_type::bytes:
             case data_type::hll:
-                _u._bytes.~managed_ref<managed_bytes>();
+                destroy_value_bytes();
                 break;
             case data_type::list:
                 _u._list.~managed_ref<list_lsa>();
                 break;
             case data_type::dict:
             case data_type::set:
-                _u._dict.~managed_ref<dict_lsa>();
+                if (_encoding == encoding::packed) {
+                    _u._bytes.~managed_ref<managed_bytes>();
+                }
+                else {
+                    _u._dict.~managed_ref<dict_lsa>();
+                }
                 break;
             case data_type::sset:
                 _u._sset.~managed_ref<sset_lsa>();
                 break;
+            case data_type::stream:
+                _u._stream.~managed_ref<stream_lsa>();
+                break;
+            case data_type::timeseries:
+                _u._timeseries.~managed_ref<timeseries_lsa>();
+                break;
+            case data_type::bloom:
+                _u._bloom.~managed_ref<bloom_lsa>();
+                break;
+            case data_type::cms:
+                _u._cms.~managed_ref<count_min_lsa>();
+                break;
+            case data_type::topk:
+                _u._topk.~managed_ref<topk_lsa>();
+                break;
             default:
                 break;
         }
+        if (!_inline_key) {
+            _key._ref.~managed_ref<managed_bytes>();
+        }
     }
 
     const bytes type_name() const
@@ -205,7 +642,7 @@ public:
         return {};
     }
     friend inline bool operator == (const cache_entry &l, const cache_entry &r) {
-        return (l._key_hash == r._key_hash) && (*(l._key) == *(r._key));
+        return (l._key_hash == r._key_hash) && (l.key() == r.key());
     }
 
     friend inline std::size_t hash_value(const cache_entry& e) {
@@ -215,9 +652,7 @@ public:
     struct compare {
     public:
         inline bool operator () (const cache_entry& l, const cache_entry& r) const {
-            const auto& lk = *(l._key);
-            const auto& rk = *(r._key);
-            return (l.key_hash() == r.key_hash()) && (lk == rk);
+            return (l.key_hash() == r.key_hash()) && (l.key() == r.key());
         }
         inline bool operator () (const redis_key& k, const cache_entry& e) const {
             return (k.hash() == e.key_hash()) && (k.size() == e.key_size()) && (memcmp(k.data(), e.key_data(), k.size()) == 0);
@@ -227,24 +662,22 @@ public:
         }
     };
 public:
-    inline const clock_type::time_point get_timeout() const
-    {
-        return _expiry.to_time_point();
-    }
+    // Only for an entry which ever_expires().
+    inline const clock_type::time_point get_timeout() const;
 
     inline const bool ever_expires() const
     {
-        return _expiry.ever_expires();
+        return _expires;
     }
 
-    inline void set_never_expired()
+    inline bool has_field_ttls() const
     {
-        return _expiry.set_never_expired();
+        return _field_ttls;
     }
 
-    inline void set_expiry(const expiration& expiry)
+    inline void set_field_ttls()
     {
-        _expiry = expiry;
+        _field_ttls = true;
     }
 
     inline const size_t time_of_live() const
@@ -253,11 +686,60 @@ public:
         return static_cast<size_t>(std::chrono::duration_cast<std::chrono::milliseconds>(dur).count());
     }
 
-    inline bool cancel() const
+    inline clock_type::time_point last_touched() const
     {
-        return false;
+        return _last_touched;
+    }
+
+    inline uint8_t lfu_counter(clock_type::time_point now) const
+    {
+        auto periods = (now - _last_touched) / lfu_decay_period;
+        if (periods <= 0) {
+            return _lfu_counter;
+        }
+        return periods >= _lfu_counter ? 0 : _lfu_counter - periods;
+    }
+
+    // Records an access for the LRU and LFU eviction policies.
+    void touch(clock_type::time_point now);
+
+    // Number of elements held by a list, dict, set, sorted set, stream or
+    // time series value, zero for the other types. The lazily freed
+    // entries are destroyed by flush_some() until it is zero. Bloom
+    // filters and Top-K sketches count none, whatever was added to them:
+    // they are freed at once.
+    size_t value_elements() const;
+
+    // The bytes of a string, or the elements of a collection packed or
+    // not, as the size distribution counts them.
+    size_t value_size() const;
+
+    // Counts the entry again in the size distribution of the shard, at its
+    // current size.
+    void settle_size();
+    void forget_size();
+
+    // The entry is about to be written: the one written before is settled,
+    // and this one will be by the next write, or before the distribution
+    // is read.
+    static void resized(cache_entry& e)
+    {
+        if (_resized && _resized != &e) {
+            _resized->settle_size();
+        }
+        _resized = &e;
     }
 
+    // Destroys up to `count` elements of a collection value, returns how
+    // many were destroyed.
+    size_t flush_some(size_t count);
+
+    // Bytes held by the entry, its key and value included, as MEMORY USAGE
+    // reports them: the elements of a collection are estimated from the
+    // first `samples` of them, or counted all when 0. Run with the
+    // allocator of the region.
+    size_t memory_usage(size_t samples) const;
+
     inline size_t key_hash() const
     {
         return _key_hash;
@@ -265,25 +747,230 @@ public:
 
     inline size_t key_size() const
     {
-        return _key->size();
+        return _inline_key ? _key._inline._size : _key._ref->size();
     }
 
     inline const bytes_view key() const
     {
-        return { _key->data(), _key->size() };
+        return { key_data(), key_size() };
     }
 
     inline const char* key_data() const
     {
-        return _key->data();
+        return _inline_key ? _key._inline._data : _key._ref->data();
     }
     inline size_t value_bytes_size() const
     {
-        return _u._bytes->size();
+        switch (_encoding) {
+        case encoding::inlined:
+            return _u._inline_bytes._size;
+        case encoding::integer:
+            return _u._integer._size;
+        case encoding::shared:
+            return _u._shared_bytes.size();
+        case encoding::paged:
+            return _u._bitmap->size();
+        case encoding::compressed:
+            return _u._compressed._size;
+        default:
+            return _u._bytes->size();
+        }
     }
+    // The bytes of a string value which is neither paged nor compressed,
+    // see for_each_value_fragment() for those of any string.
     inline const char* value_bytes_data() const
     {
-        return _u._bytes->data();
+        switch (_encoding) {
+        case encoding::inlined:
+            return _u._inline_bytes._data;
+        case encoding::integer:
+            return _u._integer._data;
+        case encoding::shared:
+            return _u._shared_bytes.get();
+        default:
+            assert(_encoding != encoding::compressed);
+            return _u._bytes->data();
+        }
+    }
+    // Whether the string value is held in the entry, as bytes or as an
+    // integer, see max_inline_value.
+    inline bool inline_value() const
+    {
+        return _encoding == encoding::inlined || _encoding == encoding::integer;
+    }
+    // Whether the string value reads as an int64, see string_integer().
+    inline bool integer_value() const
+    {
+        return _encoding == encoding::integer;
+    }
+    inline int64_t string_integer() const
+    {
+        return _u._integer._value;
+    }
+    // Replaces a string value with the integer, as INCR does.
+    inline void assign_integer(int64_t value)
+    {
+        destroy_value_bytes();
+        construct_value_integer(value);
+    }
+    // Whether the string value is held out of the region, so that replies
+    // may reference it instead of copying it, see share_value().
+    inline bool shared_value() const
+    {
+        return _encoding == encoding::shared;
+    }
+    // A reference to a string value held out of the region. The buffer is
+    // immutable: a value changed in place is first moved into the region by
+    // unshare_value(), and one replaced whole gets a new buffer.
+    inline temporary_buffer<char> share_value() const
+    {
+        return const_cast<temporary_buffer<char>&>(_u._shared_bytes).share();
+    }
+    // Whether the string value is an LZ4 block, see compressed_initializer.
+    inline bool compressed_value() const
+    {
+        return _encoding == encoding::compressed;
+    }
+    // A compressed string value, decompressed into a new buffer.
+    temporary_buffer<char> decompress_value() const;
+    // Passes the fragments of a string value to func(bytes_view).
+    template <typename Func>
+    void for_each_value_fragment(Func&& func) const
+    {
+        if (_encoding == encoding::region) {
+            _u._bytes->for_each_fragment(func);
+        }
+        else if (_encoding == encoding::paged) {
+            _u._bitmap->for_each_fragment(func);
+        }
+        else if (_encoding == encoding::compressed) {
+            auto data = decompress_value();
+            func(bytes_view { data.get(), data.size() });
+        }
+        else {
+            func(bytes_view { value_bytes_data(), value_bytes_size() });
+        }
+    }
+    // Replaces a string value, with one held in the region by the first
+    // overload and out of it by the second. The first one, as
+    // unshare_value(), runs under the allocator of the region.
+    void assign_value(bytes_view data)
+    {
+        destroy_value_bytes();
+        construct_value_bytes(data);
+    }
+    void assign_value(temporary_buffer<char> data)
+    {
+        destroy_value_bytes();
+        _encoding = encoding::shared;
+        _shared_value_bytes += data.size();
+        new (&_u._shared_bytes) temporary_buffer<char>(std::move(data));
+    }
+    // Appends to a string value, under the allocator of the region. A
+    // value short enough to stay in the entry is rebuilt, the others are
+    // moved into a managed_bytes once and grow in place, see
+    // managed_bytes::append().
+    void append_value(bytes_view data)
+    {
+        auto size = value_bytes_size() + data.size();
+        if (size <= max_inline_value) {
+            char buffer[max_inline_value];
+            auto out = buffer;
+            for_each_value_fragment([&out] (bytes_view f) {
+                out = std::copy(f.begin(), f.end(), out);
+            });
+            std::copy_n(data.data(), data.size(), out);
+            assign_value(bytes_view { buffer, size });
+            return;
+        }
+        unshare_value();
+        _u._bytes->append(data);
+    }
+    // SETRANGE: writes `data` at `offset` of a string value, padding it
+    // with zeroes up to there, under the allocator of the region. Only the
+    // fragments or pages written are touched.
+    void write_value(size_t offset, bytes_view data)
+    {
+        auto size = std::max(value_bytes_size(), offset + data.size());
+        if (size <= max_inline_value) {
+            char buffer[max_inline_value] = {};
+            auto out = buffer;
+            for_each_value_fragment([&out] (bytes_view f) {
+                out = std::copy(f.begin(), f.end(), out);
+            });
+            std::copy_n(data.data(), data.size(), buffer + offset);
+            assign_value(bytes_view { buffer, size });
+            return;
+        }
+        if (_encoding == encoding::paged) {
+            _u._bitmap->grow(size);
+            for (size_t i = 0; i < data.size(); ++i) {
+                _u._bitmap->set_byte(offset + i, data[i]);
+            }
+            return;
+        }
+        unshare_value();
+        _u._bytes->grow(size);
+        _u._bytes->write(offset, data);
+    }
+    // Moves a string value held out of the region, inline, as an integer or
+    // compressed into a managed_bytes, which value_bytes() may change in
+    // place.
+    void unshare_value()
+    {
+        if (_encoding != encoding::region) {
+            temporary_buffer<char> data(value_bytes_size());
+            auto out = data.get_write();
+            for_each_value_fragment([&out] (bytes_view f) {
+                out = std::copy(f.begin(), f.end(), out);
+            });
+            destroy_value_bytes();
+            _encoding = encoding::region;
+            new (&_u._bytes) managed_ref<managed_bytes>(make_managed<managed_bytes>(bytes_view { data.get(), data.size() }));
+        }
+    }
+    // Whether the string value is a bitmap_lsa, see page_value().
+    inline bool paged_value() const
+    {
+        return _encoding == encoding::paged;
+    }
+    // Moves a string value into the pages of a bitmap_lsa, as SETBIT does
+    // once it grows past a page, under the allocator of the region.
+    void page_value()
+    {
+        if (_encoding == encoding::paged) {
+            return;
+        }
+        unshare_value();
+        auto bitmap = make_managed<bitmap_lsa>(*_u._bytes);
+        destroy_value_bytes();
+        _encoding = encoding::paged;
+        new (&_u._bitmap) managed_ref<bitmap_lsa>(std::move(bitmap));
+    }
+    inline bitmap_lsa& value_bitmap() {
+        assert(_encoding == encoding::paged);
+        return *(_u._bitmap);
+    }
+    inline const bitmap_lsa& value_bitmap() const {
+        assert(_encoding == encoding::paged);
+        return *(_u._bitmap);
+    }
+    // Bytes of the string values held out of the regions of this shard.
+    static size_t shared_value_bytes()
+    {
+        return _shared_value_bytes;
+    }
+    static const compression_stats& value_compression_stats()
+    {
+        return _compression_stats;
+    }
+    static const size_distribution& value_size_distribution()
+    {
+        if (_resized) {
+            _resized->settle_size();
+            _resized = nullptr;
+        }
+        return _size_distribution;
     }
     inline data_type type() const
     {
@@ -317,6 +1004,21 @@ public:
     inline bool type_of_hll() const {
         return _type == data_type::hll;
     }
+    inline bool type_of_stream() const {
+        return _type == data_type::stream;
+    }
+    inline bool type_of_timeseries() const {
+        return _type == data_type::timeseries;
+    }
+    inline bool type_of_bloom() const {
+        return _type == data_type::bloom;
+    }
+    inline bool type_of_cms() const {
+        return _type == data_type::cms;
+    }
+    inline bool type_of_topk() const {
+        return _type == data_type::topk;
+    }
     inline int64_t value_integer() const
     {
         return _u._integer_number;
@@ -335,10 +1037,13 @@ public:
     {
         _u._float_number += step;
     }
+    // The value of a string held in a managed_bytes, see unshare_value().
     inline managed_bytes& value_bytes() {
+        assert(_encoding == encoding::region);
         return *(_u._bytes);
     }
     inline const managed_bytes& value_bytes() const {
+        assert(_encoding == encoding::region);
         return *(_u._bytes);
     }
     inline list_lsa& value_list() {
@@ -347,6 +1052,82 @@ public:
     inline const list_lsa& value_list() const {
         return *(_u._list);
     }
+    inline stream_lsa& value_stream() {
+        return *(_u._stream);
+    }
+    inline const stream_lsa& value_stream() const {
+        return *(_u._stream);
+    }
+    inline timeseries_lsa& value_timeseries() {
+        return *(_u._timeseries);
+    }
+    inline const timeseries_lsa& value_timeseries() const {
+        return *(_u._timeseries);
+    }
+    inline bloom_lsa& value_bloom() {
+        return *(_u._bloom);
+    }
+    inline const bloom_lsa& value_bloom() const {
+        return *(_u._bloom);
+    }
+    inline count_min_lsa& value_cms() {
+        return *(_u._cms);
+    }
+    inline const count_min_lsa& value_cms() const {
+        return *(_u._cms);
+    }
+    inline topk_lsa& value_topk() {
+        return *(_u._topk);
+    }
+    inline const topk_lsa& value_topk() const {
+        return *(_u._topk);
+    }
+    inline bool packed() const {
+        return _encoding == encoding::packed;
+    }
+
+    // Runs `func` with the dict of a hash or set, either a dict_lsa or a
+    // packed_dict depending on the encoding.
+    template <typename Func>
+    inline decltype(auto) with_dict(Func&& func) {
+        if (_encoding == encoding::packed) {
+            packed_dict d(*_u._bytes, _type == data_type::dict);
+            return func(d);
+        }
+        return func(*_u._dict);
+    }
+
+    template <typename Func>
+    inline decltype(auto) with_dict(Func&& func) const {
+        if (_encoding == encoding::packed) {
+            const packed_dict d(const_cast<managed_bytes&>(*_u._bytes), _type == data_type::dict);
+            return func(d);
+        }
+        return func(static_cast<const dict_lsa&>(*_u._dict));
+    }
+
+    inline size_t dict_size() const {
+        return with_dict([] (const auto& d) { return d.size(); });
+    }
+
+    inline size_t packed_blob_size() const {
+        return _u._bytes->size();
+    }
+
+    // Whether a set is packed as an intset, see packed_dict.
+    inline bool packed_integers() const {
+        return _encoding == encoding::packed && _type == data_type::set
+            && packed_dict(const_cast<managed_bytes&>(*_u._bytes), false).integers();
+    }
+
+    // Packs an intset as records, so that it takes members of any kind.
+    inline void pack_as_records() {
+        packed_dict(*_u._bytes, false).to_records();
+    }
+
+    // Converts a packed dict or set into a dict_lsa.
+    void unpack();
+
     inline dict_lsa& value_map() {
         return *(_u._dict);
     }
@@ -369,52 +1150,1127 @@ public:
 
 static constexpr const size_t DEFAULT_INITIAL_SIZE = 1 << 20;
 
-class cache {
-    using cache_type = boost::intrusive::unordered_set<cache_entry,
-        boost::intrusive::member_hook<cache_entry, cache_entry::hook_type, &cache_entry::_cache_link>,
-        boost::intrusive::power_2_buckets<true>,
-        boost::intrusive::constant_time_size<true>>;
-    using cache_iterator = typename cache_type::iterator;
-    using const_cache_iterator = typename cache_type::const_iterator;
-    using lru_list_type = bi::list<cache_entry,
-        bi::member_hook<cache_entry, typename cache_entry::list_link_type, &cache_entry::_lru_link>,
-        bi::constant_time_size<false>>;
-    using dirty_list_type = bi::list<cache_entry,
-        bi::member_hook<cache_entry, typename cache_entry::list_link_type, &cache_entry::_dirty_link>,
-        bi::constant_time_size<false>>;
-    static constexpr size_t initial_bucket_count = DEFAULT_INITIAL_SIZE;
-    static constexpr float load_factor = 0.75f;
-    size_t _resize_up_threshold = load_factor * initial_bucket_count;
-    cache_type::bucket_type* _buckets;
-    cache_type _store;
-    seastar::timer_set<cache_entry, &cache_entry::_timer_link> _alive;
-    timer<clock_type> _timer;
-    clock_type::duration _wc_to_clock_type_delta;
-    allocation_strategy* alloc;
-    using expired_entry_releaser_type = std::function<void(cache_entry& e)>;
-    expired_entry_releaser_type _expired_entry_releaser;
+enum class eviction_policy {
+    noeviction,
+    allkeys_lru,
+    allkeys_lfu,
+    volatile_ttl,
+};
 
-    // Evict cache_entry from lru, make the cache not to be too large.
-    // Of cause, flush it before evicted from the lru list.
-    lru_list_type _lru;
+// Parses a maxmemory-policy name such as "allkeys-lru", throws
+// std::invalid_argument on unknown names.
+eviction_policy to_eviction_policy(const std::string& name);
+// The maxmemory-policy name of the policy, as INFO reports it.
+const char* to_eviction_policy_name(eviction_policy policy);
 
-    // Every modified cache_entry is dirty before flushed to memory table.
-    dirty_list_type _dirty;
+// Region memory held by the entries of each type, kept up to date by
+// measuring the region around the operations that change it rather than
+// by walking the values. A scope accounts what the region grew or shrank
+// by to its type, less what the scopes nested in it accounted to theirs,
+// such as the erase of an entry of another type a write replaces.
+class type_memory {
+    static constexpr size_t type_count = static_cast<size_t>(data_type::topk) + 1;
+    std::array<int64_t, type_count> _bytes {};
+    const logalloc::region* _region = nullptr;
+    int64_t _nested = 0;
+
+    inline int64_t used() const
+    {
+        return _region ? static_cast<int64_t>(_region->occupancy().used_space()) : 0;
+    }
+public:
+    class scope {
+        type_memory& _memory;
+        data_type _type;
+        int64_t _before;
+        int64_t _outer;
+    public:
+        scope(type_memory& memory, data_type type)
+            : _memory(memory)
+            , _type(type)
+            , _before(memory.used())
+            , _outer(memory._nested)
+        {
+            _memory._nested = 0;
+        }
+        scope(const scope&) = delete;
+        scope& operator = (const scope&) = delete;
+        ~scope()
+        {
+            auto delta = _memory.used() - _before;
+            _memory._bytes[static_cast<size_t>(_type)] += delta - _memory._nested;
+            _memory._nested = _outer + delta;
+        }
+    };
+
+    void set_region(const logalloc::region& r)
+    {
+        _region = &r;
+    }
+
+    inline size_t of(data_type type) const
+    {
+        return static_cast<size_t>(std::max<int64_t>(0, _bytes[static_cast<size_t>(type)]));
+    }
+
+    void clear()
+    {
+        _bytes.fill(0);
+    }
+};
+
+// The keys demoted to the store since the start, as a bloom filter of the
+// hashes of their keys: a miss of a key it does not hold never reads the
+// store. The keys of the store from before the start are unknown to it,
+// set_all() has it hold every key.
+class tier_hint {
+    static constexpr size_t probes = 3;
+    std::vector<uint64_t> _bits;
+    bool _all = false;
+public:
+    void resize(size_t bytes);
+    void add(size_t hash);
+    bool may_contain(size_t hash) const;
+    void set_all() { _all = true; }
+};
+
+// The deadline of an entry which expires, and its link in the timers of
+// the cache.
+struct expiry_record {
+    using time_point = clock_type::time_point;
+    using duration = clock_type::duration;
+    bi::list_member_hook<> _timer_link;
+    time_point _deadline;
+    cache_entry* _entry;
+
+    expiry_record(cache_entry* e, time_point deadline) : _deadline(deadline), _entry(e) {}
+    time_point get_timeout() const { return _deadline; }
+    bool cancel() const { return false; }
+};
+
+// The expiry of the entries which expire. Most keys never do, and would
+// carry a deadline and a timer hook for nothing: an entry only has a flag,
+// see cache_entry::ever_expires(), and its record is here, by the hash of
+// its key. The region may move the entry, the record follows it without
+// allocating, see moved().
+class expiry_index {
+    using records_type = std::unordered_multimap<size_t, expiry_record>;
+    records_type _records;
+
+    records_type::iterator lookup(const cache_entry& e)
+    {
+        auto range = _records.equal_range(e.key_hash());
+        for (auto i = range.first; i != range.second; ++i) {
+            if (i->second._entry == &e) {
+                return i;
+            }
+        }
+        return _records.end();
+    }
+public:
+    expiry_record* find(const cache_entry& e)
+    {
+        auto i = lookup(e);
+        return i == _records.end() ? nullptr : &i->second;
+    }
+    // A record for the entry, which has none.
+    expiry_record& insert(cache_entry& e, clock_type::time_point deadline)
+    {
+        auto i = _records.emplace(std::piecewise_construct, std::forward_as_tuple(e.key_hash()), std::forward_as_tuple(&e, deadline));
+        return i->second;
+    }
+    // The record must be out of the timers.
+    void erase(const cache_entry& e)
+    {
+        auto i = lookup(e);
+        if (i != _records.end()) {
+            _records.erase(i);
+        }
+    }
+    void moved(const cache_entry& from, cache_entry& to)
+    {
+        auto i = lookup(from);
+        if (i != _records.end()) {
+            i->second._entry = &to;
+        }
+    }
+    void clear() { _records.clear(); }
+    template <typename Func>
+    void for_each(Func&& func)
+    {
+        for (auto& r : _records) {
+            func(r.second);
+        }
+    }
+    size_t size() const { return _records.size(); }
+    // About the bytes the records take, with their nodes and buckets.
+    size_t memory_usage() const
+    {
+        return _records.size() * (sizeof(records_type::value_type) + 2 * sizeof(void*)) + _records.bucket_count() * sizeof(void*);
+    }
+};
+
+inline const clock_type::time_point cache_entry::get_timeout() const
+{
+    return _local_expiries->find(*this)->_deadline;
+}
+
+class cache {
+    using cache_type = boost::intrusive::unordered_set<cache_entry,
+        boost::intrusive::member_hook<cache_entry, cache_entry::hook_type, &cache_entry::_cache_link>,
+        boost::intrusive::power_2_buckets<true>,
+        boost::intrusive::constant_time_size<true>>;
+    using cache_iterator = typename cache_type::iterator;
+    using const_cache_iterator = typename cache_type::const_iterator;
+    using lru_list_type = bi::list<cache_entry,
+        bi::member_hook<cache_entry, typename cache_entry::list_link_type, &cache_entry::_lru_link>,
+        bi::constant_time_size<false>>;
+    using dirty_list_type = bi::list<cache_entry,
+        bi::member_hook<cache_entry, typename cache_entry::list_link_type, &cache_entry::_dirty_link>,
+        bi::constant_time_size<false>>;
+    static constexpr size_t initial_bucket_count = DEFAULT_INITIAL_SIZE;
+    static constexpr float load_factor = 0.75f;
+    // Shrink when the table is less than 1/16 full.
+    static constexpr float shrink_factor = 0.0625f;
+    // Buckets migrated by every insert or erase while rehashing, and by
+    // every run of the rehash timer.
+    static constexpr size_t rehash_buckets_per_operation = 16;
+    static constexpr size_t rehash_buckets_per_timer = 4096;
+    // Candidates compared by the sampling eviction policies, and the most
+    // draws, and LRU entries, looked at to find them.
+    static constexpr size_t eviction_samples = 5;
+    static constexpr size_t eviction_max_probes = 64;
+    static constexpr size_t eviction_max_draws = 256;
+    // A draw picks a bucket and a position in its chain up to this length,
+    // and is rejected if the chain is shorter: every entry of a chain no
+    // longer than this has the same chance to be drawn.
+    static constexpr size_t max_sampled_chain = 4;
+    // Expired entries are released in slices bounded by both count and time,
+    // so a mass expiry does not stall the shard.
+    static constexpr size_t expired_entries_per_slice = 1024;
+    static constexpr auto expire_slice_duration = std::chrono::microseconds(500);
+    // Collections larger than this are freed by the background reclaimer,
+    // which destroys this many elements per run.
+    static constexpr size_t lazy_free_threshold = 64;
+    static constexpr size_t lazy_free_elements_per_slice = 4096;
+    // Dirty entries written to the memtable before yielding.
+    static constexpr size_t dirty_entries_per_flush = 256;
+
+    // A hash table and the bucket array it owns, with a 16 bit tag filter
+    // beside each bucket: the tag bits, see tag_of(), of the entries of its
+    // chain. A lookup whose bit is clear misses without reading the bucket
+    // or any entry, the filters being four times denser than the buckets.
+    struct table {
+        std::unique_ptr<cache_type::bucket_type[]> _buckets;
+        std::unique_ptr<uint16_t[]> _tags;
+        cache_type _store;
+        table(size_t bucket_count)
+            : _buckets(new cache_type::bucket_type[bucket_count])
+            , _tags(new uint16_t[bucket_count]())
+            , _store(cache_type::bucket_traits(_buckets.get(), bucket_count))
+        {
+        }
+        // The top bits of the hash, which the bucket index does not use.
+        static inline uint16_t tag_of(size_t hash)
+        {
+            return uint16_t(1) << (hash >> (sizeof(size_t) * 8 - 4));
+        }
+        inline size_t bucket_of(size_t hash) const
+        {
+            return hash & (_store.bucket_count() - 1);
+        }
+        inline bool may_contain(size_t hash) const
+        {
+            return (_tags[bucket_of(hash)] & tag_of(hash)) != 0;
+        }
+        inline void insert(cache_entry& e)
+        {
+            _store.insert(e);
+            _tags[bucket_of(e.key_hash())] |= tag_of(e.key_hash());
+        }
+        // The chain was walked by the erase already, rebuilding its filter
+        // reads the same entries again.
+        inline void erase(cache_entry& e)
+        {
+            auto bucket = bucket_of(e.key_hash());
+            _store.erase(_store.iterator_to(e));
+            uint16_t tags = 0;
+            for (auto it = _store.begin(bucket); it != _store.end(bucket); ++it) {
+                tags |= tag_of(it->key_hash());
+            }
+            _tags[bucket] = tags;
+        }
+        void clear_tags()
+        {
+            std::fill_n(_tags.get(), _store.bucket_count(), 0);
+        }
+    };
+
+    // The entries taken out of the cache at once by flush_async(), released
+    // by release_retired_entries() bucket by bucket. They are out of the
+    // expiry timers, and their lists and key index went with them.
+    struct retired_keyspace {
+        std::vector<std::unique_ptr<table>> _tables;
+        size_t _bucket = 0;
+        lru_list_type _lru;
+        dirty_list_type _dirty;
+        std::unique_ptr<key_index> _key_index;
+    };
+
+    // Incremental rehashing, see rehash_step(): while _old is not null,
+    // entries whose bucket in _old is below _rehash_index were moved to
+    // _table, the others are still in _old. Inserts honour the same rule,
+    // so every key has exactly one table to look in.
+    std::unique_ptr<table> _table;
+    std::unique_ptr<table> _old;
+    size_t _rehash_index = 0;
+    timer<clock_type> _rehash_timer;
+    // The table is not shrunk below this, see presize().
+    size_t _min_bucket_count = initial_bucket_count;
+
+    // Declared before the timers, whose hooks are in the records.
+    expiry_index _expiries;
+    seastar::timer_set<expiry_record, &expiry_record::_timer_link> _alive;
+    timer<clock_type> _timer;
+    clock_type::duration _wc_to_clock_type_delta;
+    allocation_strategy* alloc;
+    // Releases an expired or evicted entry, a large value may be freed
+    // lazily when `lazily` is true.
+    using expired_entry_releaser_type = std::function<void(cache_entry& e, bool lazily)>;
+    expired_entry_releaser_type _expired_entry_releaser;
+    using snapshot_saver_type = std::function<void(const cache_entry& e)>;
+
+    // Evict cache_entry from lru, make the cache not to be too large.
+    // Of cause, flush it before evicted from the lru list.
+    lru_list_type _lru;
+
+    // Every modified cache_entry is dirty before flushed to memory table.
+    // A flush moves _dirty to _flushing and writes the entries from there,
+    // so that entries modified meanwhile wait for the next flush.
+    dirty_list_type _dirty;
+    dirty_list_type _flushing;
+    // Keys deleted since the last flush, written as deletions before the
+    // dirty entries of the flush.
+    std::vector<bytes> _deleted_keys;
+    uint64_t _flushed_entries = 0;
+    // Flushes which wrote deletions, see may_be_demoted().
+    uint64_t _deletion_flushes = 0;
+
+    // Tiered: evicted entries are written to the store rather than dropped,
+    // those of the types it has a record for, see demotable(). The others
+    // stay in memory.
+    store::column_family* _lower_tier = nullptr;
+    tier_hint _tier_hint;
+    uint64_t _demotions = 0;
+    void demote(const cache_entry& e);
+
+    // The digest of each hash slot: the XOR of those of its entries, for the
+    // Merkle trees of anti-entropy repair. The digest of an entry follows its
+    // writes when it is flushed, and leaves the slot with it.
+    std::vector<uint64_t> _slot_digests;
+    using digester_type = std::function<uint64_t (const cache_entry& e)>;
+    digester_type _digester;
+    // Called once an entry other shards copied is modified or removed.
+    using copy_invalidator_type = std::function<void (const cache_entry& e)>;
+    copy_invalidator_type _copy_invalidator;
+    // Called once a watched entry is modified or removed, and once an entry
+    // is created while _watching; returns whether its key is still watched.
+    using watch_notifier_type = std::function<bool (const cache_entry& e)>;
+    watch_notifier_type _watch_notifier;
+    bool _watching = false;
+    // Called once a tracked entry is modified or removed, and once an entry
+    // is created while _tracking; with every entry modified, created or
+    // removed while _tracking_all.
+    using tracking_notifier_type = std::function<void (const cache_entry& e)>;
+    tracking_notifier_type _tracking_notifier;
+    bool _tracking = false;
+    bool _tracking_all = false;
+    // Called once a hash some fields of which expire is removed.
+    using field_ttl_dropper_type = std::function<void (const cache_entry& e)>;
+    field_ttl_dropper_type _field_ttl_dropper;
+
+    // Taken from _alive, waiting to be released by release_expired_entries().
+    using expired_list_type = decltype(_alive)::timer_list_t;
+    expired_list_type _expired;
+    timer<> _expired_slice_timer;
+    uint64_t _expired_total = 0;
+
+    // Detached entries whose values are destroyed in the background,
+    // linked by _lru_link.
+    lru_list_type _lazy_free;
+    size_t _lazy_free_entries = 0;
+    timer<> _lazy_free_timer;
+
+    // Keyspaces flushed asynchronously, oldest first.
+    std::deque<std::unique_ptr<retired_keyspace>> _retired;
+    size_t _retired_entries = 0;
+    timer<> _retired_timer;
+    // Called with a retired entry whose key was not written again since
+    // the flush, before it is released.
+    using retired_entry_releaser_type = std::function<void (const cache_entry& e)>;
+    retired_entry_releaser_type _retired_entry_releaser;
+    type_memory _type_memory;
+
+    eviction_policy _eviction_policy = eviction_policy::noeviction;
+    // Accesses update the LFU counters of the entries even when nothing is
+    // evicted, for the key sampler.
+    bool _track_frequency = false;
+    size_t _max_memory = 0;
+    std::function<size_t()> _memory_usage;
+    uint64_t _evictions = 0;
+    // Lookups answered by the tag filter of their bucket alone.
+    uint64_t _filtered_lookups = 0;
+    // The keys in order, for the SCANs of a prefix, see scan_prefix().
+    std::unique_ptr<key_index> _key_index;
+    uint64_t _indexed_scans = 0;
+
+    inline bool evicting() const
+    {
+        return _eviction_policy != eviction_policy::noeviction;
+    }
+
+    inline void touch(cache_entry& e)
+    {
+        if (evicting()) {
+            e.touch(clock_type::now());
+            e._lru_link.unlink();
+            _lru.push_front(e);
+        }
+        else if (_track_frequency) {
+            e.touch(clock_type::now());
+        }
+    }
+
+    // The entries a command looks up give the size its stall is reported
+    // with, see stall_monitor.
+    template <typename Key>
+    inline cache_entry* lookup_and_touch(const Key& k, size_t hash)
+    {
+        auto e = lookup(k, hash);
+        if (e) {
+            touch(*e);
+            auto& op = current_operation();
+            if (op._command != command_code::unknown) {
+                op._elements = static_cast<uint32_t>(std::min<size_t>(e->value_elements(), std::numeric_limits<uint32_t>::max()));
+            }
+        }
+        return e;
+    }
+
+    static size_t random_bucket();
+
+    // One draw of the rejection sampling: a bucket out of those of both
+    // tables while rehashing, then a position in its chain. The buckets of
+    // _old already moved are empty and reject their draws, so an entry has
+    // the same chance whichever table holds it. Returns nullptr when the
+    // draw is rejected.
+    cache_entry* draw_entry()
+    {
+        auto buckets = _table->_store.bucket_count();
+        auto old_buckets = _old ? _old->_store.bucket_count() : 0;
+        auto r = random_bucket();
+        auto index = r % (buckets + old_buckets);
+        auto& store = index < buckets ? _table->_store : _old->_store;
+        if (index >= buckets) {
+            index -= buckets;
+        }
+        auto position = (r / (buckets + old_buckets)) % max_sampled_chain;
+        auto it = store.begin(index);
+        for (; it != store.end(index) && position > 0; ++it, --position) {
+        }
+        if (it == store.end(index) || it->_expired) {
+            return nullptr;
+        }
+        return &*it;
+    }
+
+    // Samples up to eviction_samples entries accepted by `filter` and
+    // returns the one `better` prefers, or nullptr if none was found.
+    template <typename Filter, typename Better>
+    cache_entry* sample(Filter&& filter, Better&& better)
+    {
+        cache_entry* victim = nullptr;
+        size_t sampled = 0;
+        for (size_t draws = 0; draws < eviction_max_draws && sampled < eviction_samples; ++draws) {
+            auto e = draw_entry();
+            if (e && filter(*e)) {
+                if (!victim || better(*e, *victim)) {
+                    victim = e;
+                }
+                ++sampled;
+            }
+        }
+        return victim;
+    }
+
+    cache_entry* choose_victim()
+    {
+        // Entries touched in the current tick may still be referenced by
+        // the running operation, including the one being inserted.
+        auto now = clock_type::now();
+        auto evictable = [this, now] (const cache_entry& e) {
+            return e.last_touched() != now && (!_lower_tier || demotable(e));
+        };
+        switch (_eviction_policy) {
+        case eviction_policy::allkeys_lru: {
+            // tiered, the least recently used entries the store cannot hold
+            // are passed over.
+            size_t probes = 0;
+            for (auto i = _lru.rbegin(); i != _lru.rend() && probes < eviction_max_probes; ++i, ++probes) {
+                if (i->last_touched() == now) {
+                    return nullptr;
+                }
+                if (evictable(*i)) {
+                    return &*i;
+                }
+            }
+            return nullptr;
+        }
+        case eviction_policy::allkeys_lfu:
+            return sample(evictable, [now] (const cache_entry& l, const cache_entry& r) {
+                return l.lfu_counter(now) < r.lfu_counter(now);
+            });
+        case eviction_policy::volatile_ttl:
+            return sample([&evictable] (const cache_entry& e) {
+                return e.ever_expires() && evictable(e);
+            }, [] (const cache_entry& l, const cache_entry& r) {
+                return l.get_timeout() < r.get_timeout();
+            });
+        default:
+            return nullptr;
+        }
+    }
+
+    inline void evict_over_budget()
+    {
+        while (_memory_usage() > _max_memory && evict_one()) {
+        }
+    }
+
+    inline table& table_of(size_t hash)
+    {
+        if (_old && _old->bucket_of(hash) >= _rehash_index) {
+            return *_old;
+        }
+        return *_table;
+    }
+
+    template <typename Key>
+    inline cache_entry* lookup(const Key& k, size_t hash)
+    {
+        static auto hash_fn = [] (const Key& k) -> size_t { return hash_of(k); };
+        auto& t = table_of(hash);
+        if (!t.may_contain(hash)) {
+            ++_filtered_lookups;
+            return nullptr;
+        }
+        auto& store = t._store;
+        auto it = store.find(k, hash_fn, cache_entry::compare());
+        if (it != store.end()) {
+            auto& e = *it;
+            // Expired but not released yet by release_expired_entries().
+            if (e._expired) {
+                forget_expiry(e);
+                _expired_entry_releaser(e, true);
+                ++_expired_total;
+                return nullptr;
+            }
+            return &e;
+        }
+        return nullptr;
+    }
+
+    static inline size_t hash_of(const redis_key& k) { return k.hash(); }
+    static inline size_t hash_of(const cache_entry& e) { return e.key_hash(); }
+
+    inline void fold_digest(cache_entry& e, uint64_t digest)
+    {
+        auto& slot = _slot_digests[key_hash_slot(e.key_data(), e.key_size())];
+        slot ^= e._digest ^ digest;
+        e._digest = digest;
+    }
+
+    inline void invalidate_copies(cache_entry& e)
+    {
+        if (e._copied) {
+            e._copied = false;
+            if (_copy_invalidator) {
+                _copy_invalidator(e);
+            }
+        }
+    }
+
+    // A snapshot in progress saves the entries as they were when it began:
+    // those whose epoch is behind _snapshot_epoch are passed to the saver
+    // before they change or go away, or when its walk reaches them.
+    uint32_t _snapshot_epoch = 0;
+    snapshot_saver_type _snapshot_saver;
+
+    inline void save_before_write(cache_entry& e)
+    {
+        if (_snapshot_saver && e._snapshot_epoch != _snapshot_epoch) {
+            e._snapshot_epoch = _snapshot_epoch;
+            _snapshot_saver(e);
+        }
+    }
+
+    inline void notify_watchers(cache_entry& e)
+    {
+        if (e._watched) {
+            e._watched = _watch_notifier(e);
+        }
+    }
+
+    inline void notify_trackers(cache_entry& e)
+    {
+        if (e._tracked || _tracking_all) {
+            e._tracked = false;
+            _tracking_notifier(e);
+        }
+    }
+
+    inline void detach(cache_entry& e)
+    {
+        save_before_write(e);
+        invalidate_copies(e);
+        notify_watchers(e);
+        notify_trackers(e);
+        forget_expiry(e);
+        if (e._field_ttls) {
+            e._field_ttls = false;
+            _field_ttl_dropper(e);
+        }
+        fold_digest(e, 0);
+        table_of(e.key_hash()).erase(e);
+        if (_key_index) {
+            _key_index->erase(e.key());
+        }
+        e._dirty_link.unlink();
+        rehash_step(rehash_buckets_per_operation);
+    }
+
+    inline void unlink(cache_entry& e)
+    {
+        type_memory::scope accounting(_type_memory, e.type());
+        detach(e);
+        current_deleter<cache_entry>()(&e);
+    }
+
+    // Removes the entry from _alive, or from _expired if it already
+    // expired, and drops its record.
+    inline void forget_expiry(cache_entry& e)
+    {
+        if (!e._expires) {
+            return;
+        }
+        auto r = _expiries.find(e);
+        if (e._expired) {
+            _expired.erase(_expired.iterator_to(*r));
+            e._expired = false;
+        }
+        else {
+            _alive.remove(*r);
+        }
+        _expiries.erase(e);
+        e._expires = false;
+    }
+
+    // The entry expires at `deadline`, whatever it did before.
+    inline void expire_at(cache_entry& e, clock_type::time_point deadline)
+    {
+        forget_expiry(e);
+        auto& r = _expiries.insert(e, deadline);
+        e._expires = true;
+        if (_alive.insert(r)) {
+            _timer.rearm(deadline);
+        }
+    }
+
+    void release_expired_entries()
+    {
+        auto& scheduler = utils::local_work_scheduler();
+        if (!scheduler.try_run(utils::work_class::background)) {
+            _expired_slice_timer.arm(scheduler.next_period());
+            return;
+        }
+        utils::latency_timer timing(utils::latency_event::expire_cycle);
+        auto start = std::chrono::steady_clock::now();
+        size_t released = 0;
+        while (!_expired.empty()) {
+            auto& e = *_expired.front()._entry;
+            forget_expiry(e);
+            _expired_entry_releaser(e, true);
+            ++_expired_total;
+            if (++released == expired_entries_per_slice) {
+                break;
+            }
+            if (released % 16 == 0 && std::chrono::steady_clock::now() - start >= expire_slice_duration) {
+                break;
+            }
+        }
+        scheduler.account(utils::work_class::background, std::chrono::steady_clock::now() - start);
+        if (!_expired.empty()) {
+            _expired_slice_timer.arm(std::chrono::microseconds(0));
+        }
+    }
+
+    void release_lazily_freed_entries()
+    {
+        auto& scheduler = utils::local_work_scheduler();
+        if (!scheduler.try_run(utils::work_class::background)) {
+            _lazy_free_timer.arm(scheduler.next_period());
+            return;
+        }
+        auto start = std::chrono::steady_clock::now();
+        with_allocator(*alloc, [this] {
+            size_t budget = lazy_free_elements_per_slice;
+            while (!_lazy_free.empty() && budget > 0) {
+                auto& e = _lazy_free.front();
+                type_memory::scope accounting(_type_memory, e.type());
+                auto flushed = e.flush_some(budget);
+                budget -= std::min(budget, flushed);
+                // a value destroyed all at once is, when nothing flushes it.
+                if (flushed == 0 || e.value_elements() == 0) {
+                    --_lazy_free_entries;
+                    current_deleter<cache_entry>()(&e);
+                }
+            }
+        });
+        scheduler.account(utils::work_class::background, std::chrono::steady_clock::now() - start);
+        if (!_lazy_free.empty()) {
+            _lazy_free_timer.arm(std::chrono::microseconds(0));
+        }
+    }
+
+    // Releases an entry of the oldest retired keyspace, its large value
+    // lazily when `lazily` is true. false once there are none.
+    bool release_retired_entry(bool lazily)
+    {
+        while (!_retired.empty()) {
+            auto& r = *_retired.front();
+            if (r._tables.empty()) {
+                _retired.pop_front();
+                continue;
+            }
+            auto& store = r._tables.back()->_store;
+            while (r._bucket < store.bucket_count() && store.begin(r._bucket) == store.end(r._bucket)) {
+                ++r._bucket;
+            }
+            if (r._bucket == store.bucket_count()) {
+                r._tables.pop_back();
+                r._bucket = 0;
+                continue;
+            }
+            auto& e = *store.begin(r._bucket);
+            store.erase(store.iterator_to(e));
+            --_retired_entries;
+            if (_retired_entry_releaser && !lookup(e, e.key_hash())) {
+                _retired_entry_releaser(e);
+            }
+            e._lru_link.unlink();
+            e._dirty_link.unlink();
+            if (lazily && e.value_elements() > lazy_free_threshold) {
+                _lazy_free.push_back(e);
+                ++_lazy_free_entries;
+                if (!_lazy_free_timer.armed()) {
+                    _lazy_free_timer.arm(std::chrono::microseconds(0));
+                }
+            }
+            else {
+                type_memory::scope accounting(_type_memory, e.type());
+                current_deleter<cache_entry>()(&e);
+            }
+            return true;
+        }
+        return false;
+    }
+
+    void release_retired_entries()
+    {
+        auto& scheduler = utils::local_work_scheduler();
+        if (!scheduler.try_run(utils::work_class::background)) {
+            _retired_timer.arm(scheduler.next_period());
+            return;
+        }
+        auto start = std::chrono::steady_clock::now();
+        bool more = with_allocator(*alloc, [this, start] {
+            size_t released = 0;
+            while (release_retired_entry(true)) {
+                if (++released == expired_entries_per_slice) {
+                    return true;
+                }
+                if (released % 16 == 0 && std::chrono::steady_clock::now() - start >= expire_slice_duration) {
+                    return true;
+                }
+            }
+            return false;
+        });
+        scheduler.account(utils::work_class::background, std::chrono::steady_clock::now() - start);
+        if (more) {
+            _retired_timer.arm(std::chrono::microseconds(0));
+        }
+    }
+
+    // Every entry is about to leave the cache: their expiry records go at
+    // once rather than one by one.
+    void forget_all_expiries()
+    {
+        _expiries.for_each([] (expiry_record& r) {
+            r._entry->_expires = false;
+            r._entry->_expired = false;
+        });
+        _expired.clear();
+        _alive.clear();
+        _expiries.clear();
+        _timer.cancel();
+    }
+
+    inline void mark_dirty(cache_entry& e)
+    {
+        cache_entry::resized(e);
+        save_before_write(e);
+        invalidate_copies(e);
+        notify_watchers(e);
+        notify_trackers(e);
+        e._volatile = false;
+        e._dirty = true;
+        if (!e._dirty_link.is_linked()) {
+            _dirty.push_back(e);
+        }
+    }
+
+    inline void link(cache_entry& e)
+    {
+        // a new entry is not part of the snapshot in progress.
+        e._snapshot_epoch = _snapshot_epoch;
+        table_of(e.key_hash()).insert(e);
+        if (_key_index) {
+            _key_index->insert(e.key(), e.key_hash());
+        }
+        mark_dirty(e);
+        if (_watching) {
+            e._watched = _watch_notifier(e);
+        }
+        // _tracking_all passed it already.
+        if (_tracking && !_tracking_all) {
+            _tracking_notifier(e);
+        }
+        if (evicting()) {
+            touch(e);
+            evict_over_budget();
+        }
+        // maybe cache will be rehashed.
+        maybe_rehash();
+    }
+
+    void start_rehash(size_t new_size)
+    {
+        utils::latency_timer timing(utils::latency_event::rehash);
+        std::unique_ptr<table> t;
+        try {
+            t = std::make_unique<table>(new_size);
+        } catch (const std::bad_alloc& e) {
+            return;
+        }
+        _old = std::move(_table);
+        _table = std::move(t);
+        _rehash_index = 0;
+        _rehash_timer.arm(std::chrono::milliseconds(10));
+    }
+
+    // Moves up to `buckets` buckets of the old table into the new one.
+    void rehash_step(size_t buckets)
+    {
+        if (!_old) {
+            return;
+        }
+        auto& old = _old->_store;
+        auto end = std::min(old.bucket_count(), _rehash_index + buckets);
+        for (; _rehash_index < end; ++_rehash_index) {
+            while (old.begin(_rehash_index) != old.end(_rehash_index)) {
+                auto& e = *old.begin(_rehash_index);
+                // the filters of the old table are dropped with it.
+                old.erase(old.iterator_to(e));
+                _table->insert(e);
+            }
+        }
+        if (_rehash_index == old.bucket_count()) {
+            assert(old.empty());
+            _old = nullptr;
+            _rehash_index = 0;
+            _rehash_timer.cancel();
+        }
+    }
+
+    void on_rehash_timer()
+    {
+        {
+            utils::latency_timer timing(utils::latency_event::rehash);
+            rehash_step(rehash_buckets_per_timer);
+        }
+        if (_old) {
+            _rehash_timer.arm(std::chrono::milliseconds(10));
+        }
+        else {
+            maybe_rehash();
+        }
+    }
+
+    template <typename Func>
+    void for_each_store(Func&& func)
+    {
+        func(_table->_store);
+        if (_old) {
+            func(_old->_store);
+        }
+    }
 public:
     cache ()
-        : _buckets(new cache_type::bucket_type[initial_bucket_count])
-        , _store(cache_type::bucket_traits(_buckets, initial_bucket_count))
+        : _table(std::make_unique<table>(initial_bucket_count))
         , _lru()
         , _dirty()
+        , _flushing()
+        , _slot_digests(cluster_slots, 0)
     {
+        cache_entry::_local_expiries = &_expiries;
         _timer.set_callback([this] { erase_expired_entries(); });
+        _rehash_timer.set_callback([this] { on_rehash_timer(); });
+        _expired_slice_timer.set_callback([this] { release_expired_entries(); });
+        _lazy_free_timer.set_callback([this] { release_lazily_freed_entries(); });
+        _retired_timer.set_callback([this] { release_retired_entries(); });
     }
     ~cache ()
     {
+        if (cache_entry::_local_expiries == &_expiries) {
+            cache_entry::_local_expiries = nullptr;
+        }
+    }
+
+    bool should_flush_dirty_entry() const
+    {
+        return !_dirty.empty() || !_deleted_keys.empty();
+    }
+
+    inline uint64_t flushed_entries() const
+    {
+        return _flushed_entries;
+    }
+
+    const std::vector<uint64_t>& slot_digests() const
+    {
+        return _slot_digests;
+    }
+
+    void set_digester(digester_type&& digester)
+    {
+        _digester = std::move(digester);
+    }
+
+    void set_copy_invalidator(copy_invalidator_type&& invalidator)
+    {
+        _copy_invalidator = std::move(invalidator);
+    }
+
+    // The dropper forgets the expiring fields of the hashes removed, see
+    // cache_entry::set_field_ttls().
+    void set_field_ttl_dropper(field_ttl_dropper_type&& dropper)
+    {
+        _field_ttl_dropper = std::move(dropper);
+    }
+
+    // WATCH: the notifier is called with the entries of watched keys as they
+    // change, see watch_notifier_type. While watching, every new entry is
+    // passed to it, as its key may be watched before it exists.
+    void set_watch_notifier(watch_notifier_type&& notifier)
+    {
+        _watch_notifier = std::move(notifier);
+    }
+    void set_watching(bool watching)
+    {
+        _watching = watching;
+    }
+    void watch(const redis_key& rk)
+    {
+        auto e = lookup(rk, rk.hash());
+        if (e) {
+            e->_watched = true;
+        }
+    }
+
+    // CLIENT TRACKING: the notifier is called with the entries of tracked
+    // keys as they change, see tracking_notifier_type. While tracking, every
+    // new entry is passed to it, as a client may cache a missing key, and
+    // while tracking all, every change.
+    void set_tracking_notifier(tracking_notifier_type&& notifier)
+    {
+        _tracking_notifier = std::move(notifier);
+    }
+    void set_tracking(bool tracking, bool all)
+    {
+        _tracking = tracking;
+        _tracking_all = all;
+    }
+    void track(const redis_key& rk)
+    {
+        auto e = lookup(rk, rk.hash());
+        if (e) {
+            e->_tracked = true;
+        }
     }
 
-    bool should_flush_dirty_entry() const { return false; }
+    // Remembers a key removed by a command, so that the store forgets it
+    // too. Expired and evicted entries need not be remembered, unless the
+    // store may hold an older version of an expired one which would be read
+    // back, see hinted().
+    void mark_deleted(const bytes& key)
+    {
+        _deleted_keys.push_back(key);
+    }
 
+    // Tiered storage: evicted entries are written to `store` and their keys
+    // added to a hint of `hint_bytes`, see tier_hint.
+    void set_lower_tier(store::column_family& store, size_t hint_bytes)
+    {
+        _lower_tier = &store;
+        _tier_hint.resize(hint_bytes);
+    }
+    inline bool tiered() const
+    {
+        return _lower_tier != nullptr;
+    }
+    // The store kept keys before the start.
+    void hint_all_demoted()
+    {
+        _tier_hint.set_all();
+    }
+    static bool demotable(const cache_entry& e);
+    // Whether the store may hold a version of the key the cache wrote to it
+    // when evicting it.
+    bool hinted(size_t hash) const
+    {
+        return _lower_tier && _tier_hint.may_contain(hash);
+    }
+    // Whether the latest version of the key may be in the store only: it is
+    // not in memory, its deletion is not waiting for the flush, and the
+    // hint may hold it.
+    bool may_be_demoted(const redis_key& rk)
+    {
+        if (!hinted(rk.hash()) || lookup(rk, rk.hash())) {
+            return false;
+        }
+        return std::find(_deleted_keys.begin(), _deleted_keys.end(), rk.key()) == _deleted_keys.end();
+    }
+    // A read of the store started before this many flushes of deletions may
+    // have missed one.
+    inline uint64_t deletion_flushes() const
+    {
+        return _deletion_flushes;
+    }
+    // An entry read back from the store is as the store has it.
+    void mark_clean(cache_entry& e)
+    {
+        e._dirty = false;
+        e._dirty_link.unlink();
+        if (_digester) {
+            fold_digest(e, _digester(e));
+        }
+    }
+    inline uint64_t demotions() const
+    {
+        return _demotions;
+    }
+
+    // Starts a snapshot of the entries as they are now: until end_snapshot(),
+    // each one is passed to saver once, before it first changes or goes
+    // away, or when the walk of the snapshot passes it to
+    // save_for_snapshot(). Entries inserted meanwhile are left out.
+    void begin_snapshot(snapshot_saver_type saver)
+    {
+        ++_snapshot_epoch;
+        _snapshot_saver = std::move(saver);
+    }
+
+    void end_snapshot()
+    {
+        _snapshot_saver = nullptr;
+    }
+
+    inline bool snapshot_in_progress() const
+    {
+        return bool(_snapshot_saver);
+    }
+
+    void save_for_snapshot(const cache_entry& e)
+    {
+        save_before_write(const_cast<cache_entry&>(e));
+    }
+
+    void set_track_frequency(bool track)
+    {
+        _track_frequency = track;
+    }
+
+    // Keeps the memory reported by `memory_usage` below `max_memory` by
+    // evicting entries chosen by `policy` whenever an entry is inserted.
+    void set_eviction_policy(eviction_policy policy, size_t max_memory, std::function<size_t()> memory_usage)
+    {
+        _eviction_policy = policy;
+        _max_memory = max_memory;
+        _memory_usage = std::move(memory_usage);
+    }
+
+    inline eviction_policy get_eviction_policy() const
+    {
+        return _eviction_policy;
+    }
+
+    // Evicts one entry, returns false if there was nothing to evict. The
+    // entry is released like an expired one.
+    bool evict_one()
+    {
+        auto victim = choose_victim();
+        if (!victim) {
+            return false;
+        }
+        if (_lower_tier) {
+            demote(*victim);
+        }
+        forget_expiry(*victim);
+        _expired_entry_releaser(*victim, false);
+        ++_evictions;
+        return true;
+    }
+
+    inline uint64_t evictions() const
+    {
+        return _evictions;
+    }
+    inline uint64_t filtered_lookups() const
+    {
+        return _filtered_lookups;
+    }
+
+    inline uint64_t expired_entries() const
+    {
+        return _expired_total;
+    }
+
+    // How long the oldest expired entry has been waiting to be released.
+    clock_type::duration expiry_lag() const
+    {
+        if (_expired.empty()) {
+            return clock_type::duration::zero();
+        }
+        return clock_type::now() - _expired.front().get_timeout();
+    }
+
+    inline size_t lazy_free_entries() const
+    {
+        return _lazy_free_entries;
+    }
+
+    // Writes the entries modified since the last flush, and the deletions,
+    // to the memtable of cf, dirty_entries_per_flush entries at a time.
     future<> flush_dirty_entry(store::column_family& cf);
 
     inline size_t expiring_size() const
@@ -422,6 +2278,35 @@ public:
         return _alive.size();
     }
 
+    // About the bytes the expiry records take, out of the region.
+    inline size_t expiry_memory() const
+    {
+        return _expiries.memory_usage();
+    }
+
+
+    // The allocator of the region holding the entries, used by background
+    // tasks of the cache.
+    void set_allocator(allocation_strategy& a)
+    {
+        alloc = &a;
+    }
+
+    // The region holding the entries, which the memory of each type is
+    // measured in.
+    void set_region(const logalloc::region& r)
+    {
+        _type_memory.set_region(r);
+    }
+
+    inline type_memory& memory_by_type()
+    {
+        return _type_memory;
+    }
+    inline const type_memory& memory_by_type() const
+    {
+        return _type_memory;
+    }
 
     void set_expired_entry_releaser(expired_entry_releaser_type&& releaser)
     {
@@ -431,23 +2316,119 @@ public:
 
     void flush_all()
     {
-        for (auto it = _store.begin(); it != _store.end(); ++it) {
-            if (it->ever_expires()) {
-                _alive.remove(*it);
+        for (auto& r : _retired) {
+            for (auto& t : r->_tables) {
+                t->_store.erase_and_dispose(t->_store.begin(), t->_store.end(), current_deleter<cache_entry>());
+            }
+        }
+        _retired.clear();
+        _retired_entries = 0;
+        for_each_store([this] (cache_type& store) {
+            for (auto it = store.begin(); it != store.end(); ++it) {
+                save_before_write(*it);
+                forget_expiry(*it);
             }
+            store.erase_and_dispose(store.begin(), store.end(), current_deleter<cache_entry>());
+        });
+        _table->clear_tags();
+        if (_old) {
+            _old->clear_tags();
+        }
+        if (_key_index) {
+            _key_index->clear();
+        }
+        _expiries.clear();
+        _lazy_free.clear_and_dispose(current_deleter<cache_entry>());
+        _lazy_free_entries = 0;
+        _type_memory.clear();
+    }
+
+    // RENAME within the shard: the entry leaves its key as a removed one
+    // does, then is linked again under `to` with its value and expiry as
+    // they are, `to` being gone. The expiring fields of a hash are moved by
+    // the caller, see field_expiry::rename_key().
+    void rename(cache_entry& e, const redis_key& to)
+    {
+        bool expires = e._expires;
+        auto deadline = expires ? e.get_timeout() : clock_type::time_point();
+        bool field_ttls = e._field_ttls;
+        e._field_ttls = false;
+        detach(e);
+        e._lru_link.unlink();
+        e.replace_key(bytes_view { to.key().data(), to.key().size() }, to.hash());
+        if (expires) {
+            expire_at(e, deadline);
+        }
+        e._field_ttls = field_ttls;
+        link(e);
+    }
+
+    // FLUSHALL ASYNC: takes every entry out of the cache at once, which is
+    // left empty, and releases them in the background as the expired ones
+    // are, see release_retired_entries(). A snapshot in progress saves them
+    // first. Entries other shards copied, watched and tracked ones are the
+    // business of the caller, as is the field expiry of the hashes.
+    void flush_async()
+    {
+        auto t = std::make_unique<table>(_min_bucket_count);
+        auto r = std::make_unique<retired_keyspace>();
+        if (_snapshot_saver) {
+            for_each_store([this] (cache_type& store) {
+                for (auto& e : store) {
+                    save_before_write(e);
+                }
+            });
+        }
+        forget_all_expiries();
+        _retired_entries += size();
+        // the old table holds the buckets not rehashed yet, it goes last.
+        if (_old) {
+            r->_tables.push_back(std::move(_old));
+        }
+        r->_tables.push_back(std::move(_table));
+        _table = std::move(t);
+        _rehash_index = 0;
+        _rehash_timer.cancel();
+        r->_lru.splice(r->_lru.end(), _lru);
+        r->_dirty.splice(r->_dirty.end(), _dirty);
+        r->_dirty.splice(r->_dirty.end(), _flushing);
+        if (_key_index) {
+            r->_key_index = std::move(_key_index);
+            _key_index = std::make_unique<key_index>();
+        }
+        std::fill(_slot_digests.begin(), _slot_digests.end(), 0);
+        _retired.push_back(std::move(r));
+        if (!_retired_timer.armed()) {
+            _retired_timer.arm(std::chrono::microseconds(0));
         }
-        _store.erase_and_dispose(_store.begin(), _store.end(), current_deleter<cache_entry>());
+    }
+
+    // FLUSHALL SYNC: as flush_async(), releasing the entries before it
+    // returns.
+    void flush_sync()
+    {
+        flush_async();
+        while (release_retired_entry(false)) {
+        }
+        _retired_timer.cancel();
+    }
+
+    void set_retired_entry_releaser(retired_entry_releaser_type&& releaser)
+    {
+        _retired_entry_releaser = std::move(releaser);
+    }
+
+    // Entries of flushed keyspaces not released yet.
+    inline size_t retired_entries() const
+    {
+        return _retired_entries;
     }
 
     inline bool erase(const redis_key& key)
     {
-        static auto hash_fn = [] (const redis_key& k) -> size_t { return k.hash(); };
-        auto it = _store.find(key, hash_fn, cache_entry::compare());
-        if (it != _store.end()) {
-            if (it->ever_expires()) {
-                _alive.remove(*it);
-            }
-            _store.erase_and_dispose(it, current_deleter<cache_entry>());
+        auto e = lookup(key, key.hash());
+        if (e) {
+            unlink(*e);
             return true;
         }
         return false;
@@ -455,8 +2436,24 @@ public:
 
     inline bool erase(cache_entry& e)
     {
-        auto it = _store.iterator_to(e);
-        _store.erase_and_dispose(it, current_deleter<cache_entry>());
+        unlink(e);
+        return true;
+    }
+
+    // Like erase(), but a large collection is detached and destroyed in
+    // the background.
+    inline bool erase_lazily(cache_entry& e)
+    {
+        if (e.value_elements() <= lazy_free_threshold) {
+            return erase(e);
+        }
+        detach(e);
+        e._lru_link.unlink();
+        _lazy_free.push_back(e);
+        ++_lazy_free_entries;
+        if (!_lazy_free_timer.armed()) {
+            _lazy_free_timer.arm(std::chrono::microseconds(0));
+        }
         return true;
     }
 
@@ -464,13 +2461,9 @@ public:
     {
         bool res = true;
         if (entry) {
-            static auto hash_fn = [] (const cache_entry& e) -> size_t { return e.key_hash(); };
-            auto it = _store.find(*entry, hash_fn, cache_entry::compare());
-            if (it != _store.end()) {
-                if (it->ever_expires()) {
-                    _alive.remove(*it);
-                }
-                _store.erase_and_dispose(it, current_deleter<cache_entry>());
+            auto e = lookup(*entry, entry->key_hash());
+            if (e) {
+                erase_lazily(*e);
                 res = false;
             }
         }
@@ -480,49 +2473,34 @@ public:
 
     inline bool replace(cache_entry* entry, long expired)
     {
-        bool res = true;
-        if (entry) {
-            static auto hash_fn = [] (const cache_entry& e) -> size_t { return e.key_hash(); };
-            auto it = _store.find(*entry, hash_fn, cache_entry::compare());
-            if (it != _store.end()) {
-                if (it->ever_expires()) {
-                    _alive.remove(*it);
-                }
-                _store.erase_and_dispose(it, current_deleter<cache_entry>());
-                res = false;
-            }
-        }
-        insert(entry);
-        return res;
+        return replace(entry);
     }
 
-    // return value: true if the entry was inserted, otherwise false.
-    inline bool insert_if(cache_entry* entry, long expired, bool nx, bool xx)
+    // return value: true if the entry was inserted, otherwise false. With
+    // keep_ttl, the entry takes the deadline of the one it replaces.
+    inline bool insert_if(cache_entry* entry, long expired, bool nx, bool xx, bool keep_ttl = false)
     {
         if (!entry) {
             return false;
         }
-        static auto hash_fn = [] (const cache_entry& e) -> size_t {
-            return e.key_hash();
-        };
-        auto it = _store.find(*entry, hash_fn, cache_entry::compare());
-        if (it != _store.end() && (xx || (!xx && !nx))) {
-            if (it->ever_expires()) {
-                _alive.remove(*it);
+        auto e = lookup(*entry, entry->key_hash());
+        bool found = e != nullptr;
+        boost::optional<clock_type::time_point> kept;
+        if (found && (xx || (!xx && !nx))) {
+            if (keep_ttl && e->ever_expires()) {
+                kept = e->get_timeout();
             }
-            _store.erase_and_dispose(it, current_deleter<cache_entry>());
+            erase_lazily(*e);
         }
-        bool should_insert = (xx && it != _store.end()) || (nx && it == _store.end()) || (!nx && !xx);
+        bool should_insert = (xx && found) || (nx && !found) || (!nx && !xx);
         if (should_insert) {
-            if (expired > 0) {
-                auto expiry = expiration(expired);
-                entry->set_expiry(expiry);
-                if (_alive.insert(*entry)) {
-                    _timer.rearm(entry->get_timeout());
-                }
+            if (kept) {
+                expire_at(*entry, *kept);
             }
-            _store.insert(*entry);
-            maybe_rehash();
+            else if (expired > 0) {
+                expire_at(*entry, expiration(expired).to_time_point());
+            }
+            link(*entry);
             return true;
         }
         return false;
@@ -530,95 +2508,267 @@ public:
 
     inline void insert(cache_entry* entry)
     {
-        auto& etnry_reference = *entry;
-        _store.insert(etnry_reference);
-        // maybe cache will be rehashed.
-        maybe_rehash();
+        link(*entry);
     }
 
+    // Finds an entry to be modified, which becomes dirty. Read-only
+    // accesses go through run_with_entry() with a const entry.
     cache_entry* find(const redis_key& rk)
     {
-        static auto hash_fn = [] (const redis_key& k) -> size_t { return k.hash(); };
-        auto it = _store.find(rk, hash_fn, cache_entry::compare());
-        if (it != _store.end()) {
-            return &(*it);
+        auto e = lookup_and_touch(rk, rk.hash());
+        if (e) {
+            mark_dirty(*e);
         }
-        return nullptr;
+        return e;
+    }
+
+    // Finds a string entry without expiry whose value another shard caches:
+    // the copy invalidator is called once the entry changes. Other entries
+    // are not found.
+    const cache_entry* find_for_copy(const redis_key& rk)
+    {
+        auto e = lookup_and_touch(rk, rk.hash());
+        if (!e || !e->type_of_bytes() || e->ever_expires()) {
+            return nullptr;
+        }
+        e->_copied = true;
+        return e;
     }
 
     template <typename Func>
     inline std::result_of_t<Func(const cache_entry* e)> run_with_entry(const redis_key& rk, Func&& func) const {
-        static auto hash_fn = [] (const redis_key& k) -> size_t { return k.hash(); };
-        auto it = _store.find(rk, hash_fn, cache_entry::compare());
-        if (it != _store.end()) {
-            const auto& e = *it;
-            return func(&e);
-        }
-        else {
-            return func(nullptr);
-        }
+        const cache_entry* e = const_cast<cache*>(this)->lookup_and_touch(rk, rk.hash());
+        return func(e);
     }
 
     template <typename Func>
     inline std::result_of_t<Func(cache_entry* e)> run_with_entry(const redis_key& rk, Func&& func) {
-        static auto hash_fn = [] (const redis_key& k) -> size_t { return k.hash(); };
-        auto it = _store.find(rk, hash_fn, cache_entry::compare());
-        if (it != _store.end()) {
-            auto& e = *it;
-            return func(&e);
+        return func(lookup_and_touch(rk, rk.hash()));
+    }
+
+    // Looks the keys up in groups of lookup_batch, passing each entry to
+    // func(index, const cache_entry*) in the order of the keys. The filters
+    // and buckets of a group are prefetched first, then the first entries
+    // of the chains the filters do not rule out, and only then are keys
+    // compared: the misses of a group overlap instead of following each
+    // other.
+    static constexpr size_t lookup_batch = 16;
+    template <typename Func>
+    void run_with_entries(const std::vector<redis_key>& rks, Func&& func)
+    {
+        for (size_t start = 0; start < rks.size(); start += lookup_batch) {
+            auto end = std::min(rks.size(), start + lookup_batch);
+            for (auto i = start; i < end; ++i) {
+                auto& t = table_of(rks[i].hash());
+                auto bucket = t.bucket_of(rks[i].hash());
+                __builtin_prefetch(&t._tags[bucket]);
+                __builtin_prefetch(&t._buckets[bucket]);
+            }
+            for (auto i = start; i < end; ++i) {
+                auto& t = table_of(rks[i].hash());
+                if (t.may_contain(rks[i].hash())) {
+                    auto bucket = t.bucket_of(rks[i].hash());
+                    auto it = t._store.begin(bucket);
+                    if (it != t._store.end(bucket)) {
+                        __builtin_prefetch(&*it);
+                    }
+                }
+            }
+            for (auto i = start; i < end; ++i) {
+                const cache_entry* e = lookup_and_touch(rks[i], rks[i].hash());
+                func(i, e);
+            }
         }
-        else {
-            return func(nullptr);
+    }
+
+    inline bool exists(const redis_key& rk)
+    {
+        return lookup_and_touch(rk, rk.hash()) != nullptr;
+    }
+
+    // One step of SCAN: visits the live entries of one bucket, and of the
+    // buckets it is split into while rehashing, see scan_cursor. Returns
+    // the next cursor, 0 once every bucket has been visited.
+    template <typename Func>
+    size_t scan(size_t cursor, Func&& func)
+    {
+        auto visit = [&func] (cache_type& store, size_t bucket) {
+            for (auto it = store.begin(bucket); it != store.end(bucket); ++it) {
+                if (!it->_expired) {
+                    func(static_cast<const cache_entry&>(*it));
+                }
+            }
+        };
+        if (!_old) {
+            auto mask = _table->_store.bucket_count() - 1;
+            visit(_table->_store, cursor & mask);
+            return scan_cursor::next(cursor, mask);
+        }
+        auto small = &_old->_store, large = &_table->_store;
+        if (small->bucket_count() > large->bucket_count()) {
+            std::swap(small, large);
         }
+        auto small_mask = small->bucket_count() - 1, large_mask = large->bucket_count() - 1;
+        visit(*small, cursor & small_mask);
+        do {
+            visit(*large, cursor & large_mask);
+            cursor = scan_cursor::next(cursor, large_mask);
+        } while (cursor & (small_mask ^ large_mask));
+        return cursor;
     }
 
+    // Keeps the keys in order beside the table as well, so that the SCANs
+    // of a prefix only visit the keys starting with it.
+    void enable_key_index()
+    {
+        if (_key_index) {
+            return;
+        }
+        _key_index = std::make_unique<key_index>();
+        for_each_store([this] (cache_type& store) {
+            for (auto& e : store) {
+                _key_index->insert(e.key(), e.key_hash());
+            }
+        });
+    }
+    size_t key_index_memory() const
+    {
+        return _key_index ? _key_index->memory_usage() : 0;
+    }
+    uint64_t indexed_scans() const { return _indexed_scans; }
 
-    inline bool exists(const redis_key& rk)
+    // A whole SCAN of the keys starting with `prefix` through the key
+    // index, when there is one and at most max_keys keys start with it:
+    // calls func(const bytes& key) for each live one and returns true.
+    // Returns false otherwise, the SCAN then walks the table.
+    template <typename Func>
+    bool scan_prefix(bytes_view prefix, size_t max_keys, Func&& func)
     {
+        if (!_key_index || _key_index->count(prefix) > max_keys) {
+            return false;
+        }
+        ++_indexed_scans;
+        std::vector<redis_key> keys;
+        _key_index->for_each(prefix, [&keys] (bytes_view key, size_t hash) {
+            keys.emplace_back(bytes { key.data(), key.size() }, hash);
+        });
         static auto hash_fn = [] (const redis_key& k) -> size_t { return k.hash(); };
-        auto it = _store.find(rk, hash_fn, cache_entry::compare());
-        return it != _store.end();
+        for (auto& rk : keys) {
+            // expired entries are left to their release, as scan() does.
+            auto& store = table_of(rk.hash())._store;
+            auto it = store.find(rk, hash_fn, cache_entry::compare());
+            if (it != store.end() && !it->_expired) {
+                func(rk.key());
+            }
+        }
+        return true;
     }
 
+    // Starts growing (or shrinking) the table, the entries are then moved
+    // a few buckets at a time by later operations and the rehash timer, so
+    // that no single task has to touch every entry.
     void maybe_rehash()
     {
-        if (_store.size() >= _resize_up_threshold) {
-            auto new_size = _store.bucket_count() * 2;
-            auto old_buckets = _buckets;
-            try {
-                _buckets = new cache_type::bucket_type[new_size];
-            } catch (const std::bad_alloc& e) {
-                return;
-            }
-            _store.rehash(typename cache_type::bucket_traits(_buckets, new_size));
-            delete[] old_buckets;
-            _resize_up_threshold = _store.bucket_count() * load_factor;
+        if (_old) {
+            rehash_step(rehash_buckets_per_operation);
+            return;
         }
+        auto bucket_count = _table->_store.bucket_count();
+        auto size = _table->_store.size();
+        if (size >= bucket_count * load_factor) {
+            start_rehash(bucket_count * 2);
+        }
+        else if (bucket_count > _min_bucket_count && size < bucket_count * shrink_factor) {
+            start_rehash(bucket_count / 2);
+        }
+    }
+
+    inline bool rehashing() const
+    {
+        return _old != nullptr;
+    }
+
+    // Sizes the table for `keys` entries before they are loaded, rather
+    // than doubling it as they come. An empty table is replaced at once,
+    // a larger one is rehashed as a growing one is.
+    void presize(size_t keys)
+    {
+        size_t buckets = initial_bucket_count;
+        while (buckets * load_factor < keys) {
+            buckets *= 2;
+        }
+        _min_bucket_count = buckets;
+        if (buckets <= _table->_store.bucket_count() || _old) {
+            return;
+        }
+        if (_table->_store.empty()) {
+            _table = std::make_unique<table>(buckets);
+        }
+        else {
+            start_rehash(buckets);
+        }
+    }
+
+    inline size_t bucket_count() const
+    {
+        return _table->_store.bucket_count();
     }
 
     inline size_t size() const
     {
-        return _store.size();
+        return _table->_store.size() + (_old ? _old->_store.size() : 0);
     }
 
     inline bool empty() const
     {
-        return _store.empty();
+        return size() == 0;
+    }
+
+    // A key drawn uniformly, as far as the chains are no longer than
+    // max_sampled_chain. Should every draw be rejected, such as in a table
+    // emptied by deletions which did not shrink yet, the first entry found
+    // from a random bucket is taken.
+    cache_entry* random_entry()
+    {
+        if (empty()) {
+            return nullptr;
+        }
+        for (size_t draws = 0; draws < eviction_max_draws; ++draws) {
+            if (auto e = draw_entry()) {
+                return e;
+            }
+        }
+        auto walk = [] (cache_type& store, size_t from) -> cache_entry* {
+            auto count = store.bucket_count();
+            for (size_t i = 0; i < count; ++i) {
+                auto index = (from + i) & (count - 1);
+                for (auto it = store.begin(index); it != store.end(index); ++it) {
+                    if (!it->_expired) {
+                        return &*it;
+                    }
+                }
+            }
+            return nullptr;
+        };
+        auto from = random_bucket();
+        auto e = walk(_table->_store, from);
+        if (!e && _old) {
+            e = walk(_old->_store, from);
+        }
+        return e;
     }
 
     bool expire(const redis_key& rk, long expired)
     {
         bool result = false;
-        static auto hash_fn = [] (const redis_key& k) -> size_t { return k.hash(); };
-        auto it = _store.find(rk, hash_fn, cache_entry::compare());
-        if (it != _store.end()) {
+        auto e = lookup(rk, rk.hash());
+        if (e) {
+            save_before_write(*e);
+            // a time of 0 expires the entry at the next tick, as a past one.
             auto expiry = expiration(expired);
-            it->set_expiry(expiry);
-            auto& ref = *it;
-            if (_alive.insert(ref)) {
-                _timer.rearm(it->get_timeout());
-                result = true;
-            }
+            expire_at(*e, expiry.ever_expires() ? expiry.to_time_point() : clock_type::now());
+            mark_dirty(*e);
+            result = true;
         }
         return result;
     }
@@ -626,12 +2776,15 @@ public:
     void erase_expired_entries()
     {
         assert(_expired_entry_releaser);
+        utils::latency_timer timing(utils::latency_event::expire_cycle);
 
         auto expired_entries = _alive.expire(clock_type::now());
-        while (!expired_entries.empty()) {
-            auto entry = &*expired_entries.begin();
-            expired_entries.pop_front();
-            _expired_entry_releaser(*entry);
+        for (auto& r : expired_entries) {
+            r._entry->_expired = true;
+        }
+        _expired.splice(_expired.end(), expired_entries);
+        if (!_expired_slice_timer.armed()) {
+            release_expired_entries();
         }
         _timer.arm(_alive.get_next_timeout());
     }
@@ -639,12 +2792,11 @@ public:
     bool never_expired(const redis_key& rk)
     {
         bool result = false;
-        static auto hash_fn = [] (const redis_key& k) -> size_t { return k.hash(); };
-        auto it = _store.find(rk, hash_fn, cache_entry::compare());
-        if (it != _store.end() && it->ever_expires()) {
-            it->set_never_expired();
-            auto& ref = *it;
-            _alive.remove(ref);
+        auto e = lookup(rk, rk.hash());
+        if (e && e->ever_expires()) {
+            save_before_write(*e);
+            forget_expiry(*e);
+            mark_dirty(*e);
             result = true;
         }
         return result;
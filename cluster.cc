@@ -0,0 +1,411 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#include "cluster.hh"
+#include "db.hh"
+#include "ring.hh"
+#include "service.hh"
+#include "redis_command_code.hh"
+#include "request_wrapper.hh"
+#include "utils/fb_utilities.hh"
+#include "utils/murmur_hash.hh"
+#include "core/print.hh"
+#include <strings.h>
+#include <array>
+namespace redis {
+
+// Passes the positions of the key arguments of the command to func, which
+// returns false to stop.
+template <typename Func>
+static void for_each_key_position(const request_wrapper& req, Func&& func)
+{
+    auto count = req._args_count;
+    auto numkeys_at = [&req, count] (size_t i) -> size_t {
+        if (i >= count) {
+            return 0;
+        }
+        auto n = std::strtoul(req._args[i].c_str(), nullptr, 10);
+        return std::min<size_t>(n, count - i - 1);
+    };
+    auto range = [&func] (size_t from, size_t to, size_t step) {
+        for (size_t i = from; i < to; i += step) {
+            if (!func(i)) {
+                return;
+            }
+        }
+    };
+    switch (req._command_code) {
+    case command_code::unknown:
+    case command_code::echo:
+    case command_code::ping:
+    case command_code::command:
+    case command_code::scan:
+    case command_code::select:
+    case command_code::shards:
+    case command_code::cluster:
+    case command_code::asking:
+    case command_code::info:
+    case command_code::tracing:
+    case command_code::slowlog:
+    case command_code::capture:
+    case command_code::config:
+    case command_code::profile:
+    case command_code::debug:
+    case command_code::latency:
+    case command_code::hotkeys:
+    case command_code::bigkeys:
+    case command_code::save:
+    case command_code::bgsave:
+    case command_code::lastsave:
+    case command_code::dbsize:
+    case command_code::randomkey:
+    case command_code::multi:
+    case command_code::exec:
+    case command_code::discard:
+    case command_code::unwatch:
+    case command_code::script:
+    case command_code::subscribe:
+    case command_code::unsubscribe:
+    case command_code::psubscribe:
+    case command_code::punsubscribe:
+    case command_code::publish:
+    case command_code::pubsub:
+    case command_code::hello:
+    case command_code::client:
+        return;
+    case command_code::mget:
+    case command_code::del:
+    case command_code::unlink:
+    case command_code::exists:
+    case command_code::sdiff:
+    case command_code::sdiffstore:
+    case command_code::sinter:
+    case command_code::sinterstore:
+    case command_code::sunion:
+    case command_code::sunionstore:
+    case command_code::pfcount:
+    case command_code::pfmerge:
+    case command_code::watch:
+        return range(0, count, 1);
+    case command_code::mset:
+        return range(0, count, 2);
+    case command_code::blpop:
+    case command_code::brpop:
+    case command_code::bzpopmin:
+    case command_code::bzpopmax:
+        // the last argument is the timeout.
+        return range(0, count > 0 ? count - 1 : 0, 1);
+    case command_code::smove:
+    case command_code::lmove:
+    case command_code::blmove:
+    case command_code::rpoplpush:
+    case command_code::brpoplpush:
+    case command_code::geosearchstore:
+    case command_code::zrangestore:
+        return range(0, std::min<size_t>(count, 2), 1);
+    case command_code::xgroup:
+        return range(1, std::min<size_t>(count, 2), 1);
+    case command_code::xread:
+    case command_code::xreadgroup: {
+        // the keys follow STREAMS, each with an ID after them all.
+        size_t i = 0;
+        while (i < count && strcasecmp(req._args[i].c_str(), "streams") != 0) {
+            ++i;
+        }
+        auto streams = i < count ? (count - i - 1) / 2 : 0;
+        return range(i + 1, i + 1 + streams, 1);
+    }
+    case command_code::memory:
+        // MEMORY USAGE key, the other subcommands have no key.
+        return range(1, std::min<size_t>(count, 2), 1);
+    case command_code::bitop:
+        return range(1, count, 1);
+    case command_code::zunion:
+    case command_code::zinter:
+    case command_code::zdiff:
+    case command_code::sintercard:
+    case command_code::lmpop:
+    case command_code::zmpop:
+        return range(1, 1 + numkeys_at(0), 1);
+    case command_code::eval:
+    case command_code::evalsha:
+        return range(2, 2 + numkeys_at(1), 1);
+    case command_code::zunionstore:
+    case command_code::zinterstore:
+    case command_code::zdiffstore:
+        if (count > 0 && func(0)) {
+            range(2, 2 + numkeys_at(1), 1);
+        }
+        return;
+    default:
+        return range(0, std::min<size_t>(count, 1), 1);
+    }
+}
+
+std::vector<bytes> command_keys(const request_wrapper& req)
+{
+    std::vector<bytes> keys;
+    for_each_key_position(req, [&req, &keys] (size_t i) {
+        auto key = req.arg_view(i);
+        keys.emplace_back(key.data(), key.size());
+        return true;
+    });
+    return keys;
+}
+
+std::vector<size_t> command_key_positions(const request_wrapper& req)
+{
+    std::vector<size_t> positions;
+    for_each_key_position(req, [&positions] (size_t i) {
+        positions.push_back(i);
+        return true;
+    });
+    return positions;
+}
+
+static constexpr int no_keys = -1;
+static constexpr int cross_slot = -2;
+
+// The slot all the keys of the command hash to, no_keys or cross_slot.
+static int command_slot(const request_wrapper& req)
+{
+    int slot = no_keys;
+    for_each_key_position(req, [&req, &slot] (size_t i) {
+        auto key = req.arg_view(i);
+        int s = key_hash_slot(key.data(), key.size());
+        if (slot != no_keys && slot != s) {
+            slot = cross_slot;
+            return false;
+        }
+        slot = s;
+        return true;
+    });
+    return slot;
+}
+
+// 40 hex digits as the ids of Redis Cluster, stable for an address.
+static sstring node_id(const gms::inet_address& endpoint)
+{
+    auto addr = endpoint.raw_addr();
+    std::array<uint64_t, 2> hash;
+    utils::murmur_hash::hash3_x64_128(bytes_view { reinterpret_cast<const char*>(&addr), sizeof(addr) }, 0, hash);
+    return sprint("%016x%016x%08x", hash[0], hash[1], addr);
+}
+
+static bytes to_bytes(const sstring& s)
+{
+    return bytes { s.data(), s.size() };
+}
+
+static void append_bulk(sstring& out, const sstring& s)
+{
+    out += sprint("$%d\r\n", s.size());
+    out += s;
+    out += "\r\n";
+}
+
+static std::vector<gms::inet_address> replicas_of(const ring_snapshot& ring, unsigned slot)
+{
+    std::vector<gms::inet_address> replicas;
+    ring.for_each_replica(slot_token(slot), [&replicas] (const gms::inet_address& endpoint) {
+        replicas.push_back(endpoint);
+    });
+    return replicas;
+}
+
+struct slot_range {
+    unsigned _start;
+    unsigned _end;
+    std::vector<gms::inet_address> _replicas;
+};
+
+// The runs of consecutive slots with the same replicas, master first.
+static std::vector<slot_range> slot_ranges(const ring_snapshot& ring)
+{
+    std::vector<slot_range> ranges;
+    if (ring.empty()) {
+        return ranges;
+    }
+    for (unsigned slot = 0; slot < cluster_slots; ++slot) {
+        auto replicas = replicas_of(ring, slot);
+        if (!ranges.empty() && ranges.back()._replicas == replicas) {
+            ranges.back()._end = slot;
+        } else {
+            ranges.push_back(slot_range { slot, slot, std::move(replicas) });
+        }
+    }
+    return ranges;
+}
+
+class ring_cluster_router final : public cluster_router {
+    uint16_t _port;
+    bytes moved(int slot, const gms::inet_address& owner) const {
+        return to_bytes(sprint("-MOVED %d %s:%d\r\n", slot, owner, _port));
+    }
+    bytes ask(int slot, const gms::inet_address& owner) const {
+        return to_bytes(sprint("-ASK %d %s:%d\r\n", slot, owner, _port));
+    }
+    bytes slots() const;
+    bytes nodes() const;
+    bytes info() const;
+public:
+    explicit ring_cluster_router(uint16_t port) : _port(port) {}
+    future<bytes> redirect(const request_wrapper& req, bool asking) override;
+    future<scattered_message_ptr> cluster(request_wrapper& req) override;
+};
+
+future<bytes> ring_cluster_router::redirect(const request_wrapper& req, bool asking)
+{
+    auto slot = command_slot(req);
+    if (slot == no_keys) {
+        return make_ready_future<bytes>();
+    }
+    if (slot == cross_slot) {
+        return make_ready_future<bytes>("-CROSSSLOT Keys in request don't hash to the same slot\r\n");
+    }
+    auto& ring = get_local_service().get_ring();
+    auto& current = ring.snapshot();
+    if (current.empty()) {
+        return make_ready_future<bytes>();
+    }
+    auto me = utils::fb_utilities::get_broadcast_address();
+    auto t = slot_token(slot);
+    auto& pending = ring.pending_snapshot();
+    auto& owner = current.primary_replica(t);
+    if (owner != me) {
+        // An importing node serves the slot to the clients sent by ASK.
+        if (asking && !pending.empty() && pending.primary_replica(t) == me) {
+            return make_ready_future<bytes>();
+        }
+        return make_ready_future<bytes>(moved(slot, owner));
+    }
+    if (pending.empty() || pending.primary_replica(t) == me) {
+        return make_ready_future<bytes>();
+    }
+    // The slot is migrating: keys still here are served here, the others are
+    // already streamed or yet to be created, by the next owner. Multi-key
+    // commands are judged by their first key.
+    auto next = pending.primary_replica(t);
+    bytes key;
+    for_each_key_position(req, [&req, &key] (size_t i) {
+        auto k = req.arg_view(i);
+        key = bytes { k.data(), k.size() };
+        return false;
+    });
+    redis_key rk { std::move(key) };
+    auto cpu = rk.get_cpu();
+    return get_database().invoke_on(cpu, [rk = std::move(rk)] (database& db) {
+        return db.exists_direct(rk);
+    }).then([this, slot, next] (bool exists) {
+        return exists ? bytes {} : ask(slot, next);
+    });
+}
+
+bytes ring_cluster_router::slots() const
+{
+    auto ranges = slot_ranges(get_local_service().get_ring().snapshot());
+    auto out = sprint("*%d\r\n", ranges.size());
+    for (auto& r : ranges) {
+        out += sprint("*%d\r\n:%d\r\n:%d\r\n", 2 + r._replicas.size(), r._start, r._end);
+        for (auto& endpoint : r._replicas) {
+            out += "*3\r\n";
+            append_bulk(out, sprint("%s", endpoint));
+            out += sprint(":%d\r\n", _port);
+            append_bulk(out, node_id(endpoint));
+        }
+    }
+    return to_bytes(out);
+}
+
+bytes ring_cluster_router::nodes() const
+{
+    auto& ring = get_local_service().get_ring().snapshot();
+    auto ranges = slot_ranges(ring);
+    auto me = utils::fb_utilities::get_broadcast_address();
+    // The primaries are masters, a node replicating a range is counted as
+    // a master too since every node owns some ranges.
+    sstring out;
+    for (auto& endpoint : ring.endpoints()) {
+        out += sprint("%s %s:%d@%d %s - 0 0 0 connected", node_id(endpoint), endpoint, _port, _port + 10000,
+            endpoint == me ? "myself,master" : "master");
+        for (auto& r : ranges) {
+            if (r._replicas.front() != endpoint) {
+                continue;
+            }
+            out += r._start == r._end ? sprint(" %d", r._start) : sprint(" %d-%d", r._start, r._end);
+        }
+        out += "\n";
+    }
+    sstring reply;
+    append_bulk(reply, out);
+    return to_bytes(reply);
+}
+
+bytes ring_cluster_router::info() const
+{
+    auto& ring = get_local_service().get_ring().snapshot();
+    auto assigned = ring.empty() ? 0 : cluster_slots;
+    auto out = sprint("cluster_enabled:1\r\n"
+        "cluster_state:%s\r\n"
+        "cluster_slots_assigned:%d\r\n"
+        "cluster_slots_ok:%d\r\n"
+        "cluster_slots_pfail:0\r\n"
+        "cluster_slots_fail:0\r\n"
+        "cluster_known_nodes:%d\r\n"
+        "cluster_size:%d\r\n"
+        "cluster_replicas:%d\r\n",
+        ring.empty() ? "fail" : "ok", assigned, assigned, ring.endpoints().size(), ring.endpoints().size(), ring.replica_count());
+    sstring reply;
+    append_bulk(reply, out);
+    return to_bytes(reply);
+}
+
+future<scattered_message_ptr> ring_cluster_router::cluster(request_wrapper& req)
+{
+    auto is = [&req] (const char* name) {
+        return req._args_count > 0 && strcasecmp(req._args[0].c_str(), name) == 0;
+    };
+    if (is("keyslot") && req._args_count == 2) {
+        auto key = req.arg_view(1);
+        return reply_builder::build(static_cast<size_t>(key_hash_slot(key.data(), key.size())));
+    }
+    if (is("slots") && req._args_count == 1) {
+        return reply_builder::build(slots());
+    }
+    if (is("nodes") && req._args_count == 1) {
+        return reply_builder::build(nodes());
+    }
+    if (is("info") && req._args_count == 1) {
+        return reply_builder::build(info());
+    }
+    if (is("myid") && req._args_count == 1) {
+        sstring reply;
+        append_bulk(reply, node_id(utils::fb_utilities::get_broadcast_address()));
+        return reply_builder::build(to_bytes(reply));
+    }
+    auto sub = req._args_count > 0 ? req._args[0] : bytes {};
+    return reply_builder::build(to_bytes(sprint("-ERR Unknown subcommand or wrong number of arguments for '%s'. Try CLUSTER HELP.\r\n", sub)));
+}
+
+std::unique_ptr<cluster_router> make_ring_cluster_router(uint16_t port)
+{
+    return std::make_unique<ring_cluster_router>(port);
+}
+}
@@ -0,0 +1,52 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#pragma once
+#include "core/future.hh"
+#include "utils/bytes.hh"
+#include "hash_slot.hh"
+#include "reply_builder.hh"
+#include <memory>
+#include <vector>
+namespace redis {
+struct request_wrapper;
+
+// The cluster side of a connection, installed on the server of each shard
+// when the node runs in a cluster. Without one, CLUSTER fails and every
+// key is served here.
+class cluster_router {
+public:
+    virtual ~cluster_router() {}
+    // Empty when this node serves the command, else the -MOVED or -ASK
+    // error sending the client to the owner of its keys. `asking` tells
+    // that ASKING came right before.
+    virtual future<bytes> redirect(const request_wrapper& req, bool asking) = 0;
+    virtual future<scattered_message_ptr> cluster(request_wrapper& req) = 0;
+};
+
+// The key arguments of the command.
+std::vector<bytes> command_keys(const request_wrapper& req);
+// Their positions in _args.
+std::vector<size_t> command_key_positions(const request_wrapper& req);
+
+// Routes by the ring of the storage service, advertising `port` as that of
+// every node.
+std::unique_ptr<cluster_router> make_ring_cluster_router(uint16_t port);
+}
@@ -1,22 +1,1170 @@
 #include "column_family.hh"
-#include "store/reader.hh"
+#include "store/checked_file_impl.hh"
+#include "store/comparator.hh"
+#include "store/priority_manager.hh"
+#include "store/table_builder.hh"
+#include "mutation.hh"
+#include "core/fstream.hh"
+#include "core/future-util.hh"
+#include "core/reactor.hh"
+#include "util/log.hh"
+#include <algorithm>
 namespace store {
 
-column_family::column_family(bytes name, bool with_commitlog)
-    : _sstables()
-    , _active_memtable(nullptr)
+using logger = seastar::logger;
+static logger cf_log ("column_family");
+
+static uint64_t now_ms()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// The unix time in milliseconds the record expires at, 0 if it does not.
+// A record with a ttl rather than FLAG_EXPIRE_AT never expires here, the
+// store does not know when it was written.
+static uint64_t record_expiry(const decoded_mutation& m)
+{
+    if (m._type != data_type::bytes || !(m._flag & FLAG_EXPIRE_AT) || m._expire <= 0) {
+        return 0;
+    }
+    return m._expire;
+}
+
+static bytes encode_deletion(const bytes& key)
+{
+    auto r = mutation_record::deleted(bytes_view { key.data(), key.size() });
+    bytes record(bytes::initialized_later(), r.serialized_size());
+    r.encode_to(record.begin());
+    return record;
+}
+
+constexpr double column_family::MIN_COMPACTION_FACTOR;
+constexpr double column_family::MAX_COMPACTION_FACTOR;
+
+static lw_shared_ptr<memtable> make_memtable(const column_family_options& options)
+{
+    if (options._memtable_group != nullptr) {
+        return make_lw_shared<memtable>(*options._memtable_group);
+    }
+    return make_lw_shared<memtable>();
+}
+
+column_family::column_family(bytes name, bool with_commitlog, column_family_options options)
+    : _sstables(MAX_LEVELS)
+    , _fence_pointers(MAX_LEVELS)
+    , _active_memtable(make_memtable(options))
     , _immutable_memtables()
     , _sstable_dir_name(name)
     , _has_commitlog(with_commitlog)
+    , _options(options)
+    , _compact_pointers(MAX_LEVELS)
+    , _compaction_rate_limiter(options._compaction_throughput)
 {
+    _stats._levels.resize(MAX_LEVELS);
+    _stats._compaction_throughput = options._compaction_throughput;
+    _expiry_timer.set_callback([this] {
+        _compaction_pending.signal();
+    });
+    _controller_timer.set_callback([this] { adjust_compaction_throughput(); });
 }
 
 column_family::~column_family()
 {
 }
 
-future<> column_family::apply(cache_entry& e)
+void column_family::apply(mutation& m)
+{
+    _active_memtable->apply(m);
+}
+
+table_options column_family::make_table_options(int level) const
+{
+    table_options options;
+    options._compression = level < 2 ? _options._hot_compression : _options._cold_compression;
+    options._filter_policy = &blocked_bloom_filter_policy();
+    options._block_hash_index = _options._block_hash_index;
+    options._writer = _options._writer;
+    return options;
+}
+
+static sstable_options make_sstable_options()
+{
+    sstable_options options;
+    options._filter_policy = &blocked_bloom_filter_policy();
+    return options;
+}
+
+void fence_pointers::build(const std::vector<lw_shared_ptr<sstable_holder>>& sstables)
+{
+    size_t total = 0;
+    for (auto& sst : sstables) {
+        total += sst->_smallest_key.size() + sst->_largest_key.size();
+    }
+    bytes keys(bytes::initialized_later(), total);
+    std::vector<uint32_t> offsets;
+    offsets.reserve(2 * sstables.size() + 1);
+    offsets.push_back(0);
+    auto p = keys.begin();
+    for (auto& sst : sstables) {
+        p = std::copy(sst->_smallest_key.begin(), sst->_smallest_key.end(), p);
+        offsets.push_back(p - keys.begin());
+        p = std::copy(sst->_largest_key.begin(), sst->_largest_key.end(), p);
+        offsets.push_back(p - keys.begin());
+    }
+    _keys = std::move(keys);
+    _offsets = std::move(offsets);
+}
+
+bool fence_pointers::contains(size_t i, bytes_view key) const
+{
+    auto& cmp = default_bytewise_comparator();
+    return cmp.compare(smallest_key(i), key) <= 0 && cmp.compare(key, largest_key(i)) <= 0;
+}
+
+size_t fence_pointers::find(bytes_view key) const
+{
+    // the first sstable whose largest key is not below key.
+    auto& cmp = default_bytewise_comparator();
+    size_t begin = 0, end = size();
+    while (begin < end) {
+        auto m = begin + (end - begin) / 2;
+        if (cmp.compare(largest_key(m), key) < 0) {
+            begin = m + 1;
+        } else {
+            end = m;
+        }
+    }
+    if (begin < size() && cmp.compare(smallest_key(begin), key) <= 0) {
+        return begin;
+    }
+    return size();
+}
+
+void column_family::add_sstable(int level, lw_shared_ptr<sstable_holder> sst)
+{
+    sst->_level = level;
+    sst->_allowed_seeks = std::max<int64_t>(sst->_file_size / SEEK_COMPACTION_BYTES, MIN_ALLOWED_SEEKS);
+    auto& sstables = _sstables[level];
+    if (level == 0) {
+        auto i = std::upper_bound(sstables.begin(), sstables.end(), sst, [] (auto& l, auto& r) { return l->_generation < r->_generation; });
+        sstables.insert(i, std::move(sst));
+    } else {
+        auto i = std::upper_bound(sstables.begin(), sstables.end(), sst, [] (auto& l, auto& r) { return l->_smallest_key < r->_smallest_key; });
+        sstables.insert(i, std::move(sst));
+    }
+    _fence_pointers[level].build(sstables);
+}
+
+std::vector<lw_shared_ptr<sstable_holder>> column_family::candidates_of(bytes_view key) const
+{
+    // L0 sstables overlap: every one holding the key in its range is
+    // probed, the newest first, as it has the latest record. The sstables
+    // of a deeper level are disjoint, at most one of them may hold the key,
+    // and they come after the shallower ones.
+    std::vector<lw_shared_ptr<sstable_holder>> candidates;
+    auto& l0 = _fence_pointers[0];
+    for (size_t i = l0.size(); i-- > 0;) {
+        if (l0.contains(i, key)) {
+            candidates.emplace_back(_sstables[0][i]);
+        }
+    }
+    for (int level = 1; level < MAX_LEVELS; ++level) {
+        auto i = _fence_pointers[level].find(key);
+        if (i < _fence_pointers[level].size()) {
+            candidates.emplace_back(_sstables[level][i]);
+        }
+    }
+    return candidates;
+}
+
+future<bytes_opt> column_family::read(const redis::decorated_key& key)
+{
+    auto record = _active_memtable->find(key);
+    if (record) {
+        return make_ready_future<bytes_opt>(std::move(record));
+    }
+    for (auto i = _immutable_memtables.rbegin(); i != _immutable_memtables.rend(); ++i) {
+        record = (*i)->find(key);
+        if (record) {
+            return make_ready_future<bytes_opt>(std::move(record));
+        }
+    }
+    auto k = to_sstable_key(key);
+    auto candidates = candidates_of(bytes_view { k.data(), k.size() });
+    if (candidates.empty()) {
+        return make_ready_future<bytes_opt>();
+    }
+    // the filters of all the sstables take the same hash. A lookup which
+    // reads blocks of an sstable, then of another one, charges the first a
+    // seek.
+    auto hash = blocked_bloom_filter_policy().hash(bytes_view { k.data(), k.size() });
+    ++_stats._sstable_lookups;
+    auto started = std::chrono::steady_clock::now();
+    struct lookup_state {
+        std::vector<lw_shared_ptr<sstable_holder>> _candidates;
+        bytes _key;
+        size_t _next = 0;
+        bytes_opt _result;
+        sstable_read_stats _probe;
+        lw_shared_ptr<sstable_holder> _first_read;
+        bool _charged = false;
+    };
+    return do_with(lookup_state { std::move(candidates), std::move(k) }, [this, hash, started] (lookup_state& state) {
+        return repeat([this, hash, &state] {
+            if (state._next == state._candidates.size()) {
+                return make_ready_future<stop_iteration>(stop_iteration::yes);
+            }
+            auto sst = state._candidates[state._next++];
+            state._probe = sstable_read_stats();
+            return this->try_read_from_sstable(sst, state._key, hash, state._probe).then([this, sst, &state] (bytes_opt record) {
+                if (state._probe._blocks > 0 && !state._charged) {
+                    if (!state._first_read) {
+                        state._first_read = sst;
+                    } else {
+                        charge_seek(state._first_read);
+                        state._charged = true;
+                    }
+                }
+                if (record) {
+                    state._result = std::move(record);
+                    return stop_iteration::yes;
+                }
+                return stop_iteration::no;
+            });
+        }).then([this, &state, started] {
+            auto elapsed = std::chrono::steady_clock::now() - started;
+            _stats._sstable_lookup_usec += std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+            return std::move(state._result);
+        });
+    });
+}
+
+future<std::vector<bytes_opt>> column_family::multi_read(const std::vector<redis::decorated_key>& keys)
+{
+    struct lookup {
+        std::vector<bytes> _keys;
+        std::vector<bytes_opt> _results;
+        std::vector<std::vector<lw_shared_ptr<sstable_holder>>> _candidates;
+        std::vector<size_t> _next;
+        std::vector<filter_policy::key_hash> _hashes;
+        std::vector<lw_shared_ptr<sstable_holder>> _first_read;
+        std::vector<bool> _charged;
+        // The keys still looked up, in key order.
+        std::vector<size_t> _pending;
+    };
+    auto l = make_lw_shared<lookup>();
+    auto n = keys.size();
+    l->_keys.resize(n);
+    l->_results.resize(n);
+    l->_candidates.resize(n);
+    l->_next.resize(n, 0);
+    l->_hashes.resize(n);
+    l->_first_read.resize(n);
+    l->_charged.resize(n, false);
+    for (size_t i = 0; i < n; ++i) {
+        auto record = _active_memtable->find(keys[i]);
+        for (auto m = _immutable_memtables.rbegin(); !record && m != _immutable_memtables.rend(); ++m) {
+            record = (*m)->find(keys[i]);
+        }
+        if (record) {
+            l->_results[i] = std::move(record);
+            continue;
+        }
+        l->_keys[i] = to_sstable_key(keys[i]);
+        auto kv = bytes_view { l->_keys[i].data(), l->_keys[i].size() };
+        l->_candidates[i] = candidates_of(kv);
+        if (!l->_candidates[i].empty()) {
+            l->_hashes[i] = blocked_bloom_filter_policy().hash(kv);
+            l->_pending.push_back(i);
+        }
+    }
+    if (l->_pending.empty()) {
+        return make_ready_future<std::vector<bytes_opt>>(std::move(l->_results));
+    }
+    std::sort(l->_pending.begin(), l->_pending.end(), [l] (size_t a, size_t b) { return l->_keys[a] < l->_keys[b]; });
+    _stats._sstable_lookups += l->_pending.size();
+    auto lookups = l->_pending.size();
+    auto started = std::chrono::steady_clock::now();
+    // each round asks every sstable, once, for the keys it is the next
+    // candidate of, which its filter did not rule out; the keys it does
+    // not hold go on to their next candidate in the round after.
+    return repeat([this, l] {
+        std::vector<std::pair<lw_shared_ptr<sstable_holder>, std::vector<size_t>>> batches;
+        for (auto i : l->_pending) {
+            auto& candidates = l->_candidates[i];
+            while (l->_next[i] < candidates.size()) {
+                auto& sst = candidates[l->_next[i]];
+                if (!sst->_sstable) {
+                    ++l->_next[i];
+                    continue;
+                }
+                auto& level = _stats._levels[sst->_level];
+                ++_stats._sstable_reads;
+                ++level._probes;
+                if (sst->_sstable->may_contain(l->_hashes[i])) {
+                    break;
+                }
+                ++_stats._filter_negatives;
+                ++level._filter_negatives;
+                ++l->_next[i];
+            }
+            if (l->_next[i] == candidates.size()) {
+                continue;
+            }
+            auto& sst = candidates[l->_next[i]];
+            auto b = std::find_if(batches.begin(), batches.end(), [&sst] (auto& b) { return b.first == sst; });
+            if (b == batches.end()) {
+                batches.emplace_back(sst, std::vector<size_t>());
+                b = batches.end() - 1;
+            }
+            b->second.push_back(i);
+        }
+        if (batches.empty()) {
+            return make_ready_future<stop_iteration>(stop_iteration::yes);
+        }
+        return parallel_for_each(std::move(batches), [this, l] (std::pair<lw_shared_ptr<sstable_holder>, std::vector<size_t>>& batch) {
+            auto sst = batch.first;
+            auto table = sst->_sstable;
+            std::vector<bytes> keys;
+            keys.reserve(batch.second.size());
+            for (auto i : batch.second) {
+                keys.push_back(l->_keys[i]);
+            }
+            auto probe = make_lw_shared<sstable_read_stats>();
+            return table->multi_get(std::move(keys), probe.get()).then([this, l, sst, table, probe, indexes = std::move(batch.second)] (std::vector<bytes_opt> records) {
+                auto& level = _stats._levels[sst->_level];
+                level._blocks += probe->_blocks;
+                level._cache_hits += probe->_cache_hits;
+                level._bytes_read += probe->_bytes_read;
+                for (size_t j = 0; j < indexes.size(); ++j) {
+                    auto i = indexes[j];
+                    if (!l->_charged[i]) {
+                        if (!l->_first_read[i]) {
+                            l->_first_read[i] = sst;
+                        } else {
+                            charge_seek(l->_first_read[i]);
+                            l->_charged[i] = true;
+                        }
+                    }
+                    if (records[j]) {
+                        l->_results[i] = std::move(records[j]);
+                        continue;
+                    }
+                    if (table->has_filter()) {
+                        ++_stats._filter_false_positives;
+                        ++level._filter_false_positives;
+                    }
+                    ++l->_next[i];
+                }
+            });
+        }).then([l] {
+            l->_pending.erase(std::remove_if(l->_pending.begin(), l->_pending.end(), [l] (size_t i) {
+                return l->_results[i] || l->_next[i] == l->_candidates[i].size();
+            }), l->_pending.end());
+            return l->_pending.empty() ? stop_iteration::yes : stop_iteration::no;
+        });
+    }).then([this, l, lookups, started] {
+        // as many lookups as the batch held, each as long as all of it.
+        auto elapsed = std::chrono::steady_clock::now() - started;
+        _stats._sstable_lookup_usec += lookups * std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+        return std::move(l->_results);
+    });
+}
+
+future<bytes_opt> column_family::try_read_from_sstable(lw_shared_ptr<sstable_holder> sst, const bytes& key, const filter_policy::key_hash& hash, sstable_read_stats& probe)
+{
+    if (!sst->_sstable) {
+        return make_ready_future<bytes_opt>();
+    }
+    auto& level = _stats._levels[sst->_level];
+    ++_stats._sstable_reads;
+    ++level._probes;
+    if (!sst->_sstable->may_contain(hash)) {
+        ++_stats._filter_negatives;
+        ++level._filter_negatives;
+        return make_ready_future<bytes_opt>();
+    }
+    return sst->_sstable->get(bytes_view { key.data(), key.size() }, &probe).then([this, sst, &probe] (bytes_opt record) {
+        auto& level = _stats._levels[sst->_level];
+        level._blocks += probe._blocks;
+        level._cache_hits += probe._cache_hits;
+        level._bytes_read += probe._bytes_read;
+        if (!record && sst->_sstable->has_filter()) {
+            ++_stats._filter_false_positives;
+            ++level._filter_false_positives;
+        }
+        return record;
+    });
+}
+
+void column_family::charge_seek(lw_shared_ptr<sstable_holder> sst)
+{
+    // the last level has nowhere to go.
+    if (--sst->_allowed_seeks == 0 && sst->_level < MAX_LEVELS - 1 && !_seek_compaction) {
+        _seek_compaction = std::move(sst);
+        _compaction_pending.signal();
+    }
+}
+
+sstring column_family::sstable_file_name(uint64_t generation, int level) const
+{
+    return sstring(_sstable_dir_name.data(), _sstable_dir_name.size()) + "-" + to_sstring(engine().cpu_id()) + "-" + to_sstring(generation) + "-" + to_sstring(level) + ".sst";
+}
+
+static lw_shared_ptr<sstable_holder> make_holder(const sstring& name, uint64_t generation, lw_shared_ptr<sstable> table)
+{
+    auto sst = make_lw_shared<sstable_holder>();
+    sst->_file_name = bytes { name.data(), name.size() };
+    sst->_generation = generation;
+    sst->_file_size = table->file_size();
+    sst->_smallest_key = table->smallest_key();
+    sst->_largest_key = table->largest_key();
+    sst->_sstable = std::move(table);
+    return sst;
+}
+
+static bool overlaps(const sstable_holder& sst, const bytes& smallest, const bytes& largest)
+{
+    return !(sst._largest_key < smallest) && !(largest < sst._smallest_key);
+}
+
+future<> column_family::populate(bool adopt_removed_shards)
+{
+    // An sstable is written under a temporary name and renamed once
+    // complete, the temporary files left by a crash are removed.
+    // "<name>-<shard>-<generation>-<level>.sst"
+    auto prefix = sstring(_sstable_dir_name.data(), _sstable_dir_name.size()) + "-";
+    auto cpu = engine().cpu_id();
+    return open_checked_directory(sstable_write_error_handler, ".").then([prefix, cpu, adopt_removed_shards] (file dir) {
+        auto names = make_lw_shared<std::vector<sstring>>();
+        auto listing = make_lw_shared<subscription<directory_entry>>(dir.list_directory([names, prefix, cpu, adopt_removed_shards] (directory_entry de) {
+            auto& n = de.name;
+            if (n.size() > prefix.size() && std::equal(prefix.begin(), prefix.end(), n.begin())) {
+                char* end = nullptr;
+                auto shard = std::strtoul(n.c_str() + prefix.size(), &end, 10);
+                if (*end == '-' && (shard == cpu || (adopt_removed_shards && shard >= smp::count && shard % smp::count == cpu))) {
+                    names->emplace_back(n);
+                }
+            }
+            return make_ready_future<>();
+        }));
+        return listing->done().then([names, dir, listing] () mutable {
+            return dir.close();
+        }).then([names] {
+            return std::move(*names);
+        });
+    }).then([this, prefix, cpu] (std::vector<sstring> names) {
+        return do_with(std::move(names), [this, prefix, cpu] (auto& names) {
+            return do_for_each(names, [this, prefix, cpu] (auto& name) {
+                char* end = nullptr;
+                auto shard = std::strtoul(name.c_str() + prefix.size(), &end, 10);
+                auto generation = std::strtoull(end + 1, &end, 10);
+                // "<generation>-<level>.sst", or "<generation>.sst" for the
+                // L0 sstables of older versions.
+                int level = 0;
+                if (*end == '-') {
+                    level = std::strtol(end + 1, &end, 10);
+                }
+                auto suffix = sstring(end);
+                if (suffix == ".sst.tmp") {
+                    return remove_file(name);
+                }
+                if (suffix != ".sst" || level < 0 || level >= MAX_LEVELS) {
+                    return make_ready_future<>();
+                }
+                auto adopted = shard != cpu;
+                if (!adopted) {
+                    _next_generation = std::max<uint64_t>(_next_generation, generation + 1);
+                }
+                return sstable::open(name, make_sstable_options()).then([this, name, generation, level, adopted] (lw_shared_ptr<sstable> table) {
+                    auto sst = make_holder(name, generation, std::move(table));
+                    if (adopted) {
+                        sst->_level = level;
+                        _adopted.emplace_back(std::move(sst));
+                    } else {
+                        add_sstable(level, std::move(sst));
+                    }
+                });
+            });
+        });
+    }).then([this] {
+        // A crash between the install of a compaction and the removal of
+        // its inputs leaves both: the outputs are newer and overlap the
+        // inputs of their level, which are dropped.
+        std::vector<lw_shared_ptr<sstable_holder>> stale;
+        for (int level = 1; level < MAX_LEVELS; ++level) {
+            auto& sstables = _sstables[level];
+            for (auto& sst : sstables) {
+                for (auto& other : sstables) {
+                    if (other->_generation > sst->_generation && overlaps(*other, sst->_smallest_key, sst->_largest_key)) {
+                        stale.emplace_back(sst);
+                        break;
+                    }
+                }
+            }
+        }
+        if (stale.empty()) {
+            return make_ready_future<>();
+        }
+        version_edit edit;
+        for (auto& sst : stale) {
+            cf_log.info("removing {}, left by an interrupted compaction", sstring(sst->_file_name.data(), sst->_file_name.size()));
+            edit.delete_file(sst);
+        }
+        apply_edit(edit);
+        return remove_sstable_files(std::move(stale));
+    });
+}
+
+void column_family::apply_edit(const version_edit& edit)
+{
+    for (auto& sst : edit._deleted_files) {
+        auto& sstables = _sstables[sst->_level];
+        sstables.erase(std::remove(sstables.begin(), sstables.end(), sst), sstables.end());
+        _fence_pointers[sst->_level].build(sstables);
+    }
+    for (auto& sst : edit._new_files) {
+        add_sstable(sst->_level, sst);
+    }
+    if (!edit._new_files.empty()) {
+        _compaction_pending.signal();
+    }
+}
+
+future<> column_family::remove_sstable_files(std::vector<lw_shared_ptr<sstable_holder>> sstables)
+{
+    // lookups still reading them keep their files open.
+    return do_with(std::move(sstables), [] (auto& sstables) {
+        return do_for_each(sstables, [] (auto& sst) {
+            return remove_file(sstring(sst->_file_name.data(), sst->_file_name.size()));
+        });
+    }).then([] {
+        return open_checked_directory(sstable_write_error_handler, ".");
+    }).then([] (file dir) {
+        return do_with(std::move(dir), [] (file& dir) {
+            return dir.flush().then([&dir] {
+                return dir.close();
+            });
+        });
+    });
+}
+
+future<> column_family::flush_memtable()
+{
+    if (_active_memtable->empty()) {
+        return make_ready_future<>();
+    }
+    auto mt = _active_memtable;
+    mt->disable_write();
+    _immutable_memtables.emplace_back(mt);
+    _active_memtable = make_memtable(_options);
+    auto generation = _next_generation++;
+    return with_semaphore(_flush_semaphore, 1, [this, mt, generation] {
+        return write_sstable(mt, generation).then_wrapped([this, mt] (future<lw_shared_ptr<sstable_holder>> f) {
+            try {
+                version_edit edit;
+                edit.add_file(f.get0());
+                apply_edit(edit);
+                _immutable_memtables.erase(std::find(_immutable_memtables.begin(), _immutable_memtables.end(), mt));
+                ++_stats._memtable_flushes;
+            } catch (...) {
+                // the memtable stays sealed in memory.
+                ++_stats._memtable_flush_failures;
+                cf_log.error("failed to flush a memtable: {}", std::current_exception());
+                throw;
+            }
+        });
+    });
+}
+
+future<lw_shared_ptr<table_builder>> column_family::create_table_builder(const sstring& temporary_name, int level, const io_priority_class& pc)
+{
+    return open_checked_file_dma(sstable_write_error_handler, temporary_name, open_flags::wo | open_flags::create | open_flags::truncate).then([this, level, &pc] (file f) {
+        return make_lw_shared<table_builder>(make_table_options(level), std::move(f), pc);
+    });
+}
+
+future<lw_shared_ptr<sstable_holder>> column_family::seal_sstable(lw_shared_ptr<table_builder> builder, lw_shared_ptr<sstable_holder> sst)
+{
+    auto name = sstring(sst->_file_name.data(), sst->_file_name.size());
+    return builder->finish().then([builder, sst, name] {
+        sst->_file_size = builder->file_size();
+        // the data is flushed by finish(), the rename makes the sstable
+        // visible whole.
+        return rename_file(name + ".tmp", name);
+    }).then([] {
+        return open_checked_directory(sstable_write_error_handler, ".");
+    }).then([] (file dir) {
+        return do_with(std::move(dir), [] (file& dir) {
+            return dir.flush().then([&dir] {
+                return dir.close();
+            });
+        });
+    }).then([name] {
+        return sstable::open(name, make_sstable_options());
+    }).then([sst] (lw_shared_ptr<sstable> table) {
+        sst->_sstable = std::move(table);
+        return sst;
+    });
+}
+
+future<lw_shared_ptr<sstable_holder>> column_family::write_sstable(lw_shared_ptr<memtable> mt, uint64_t generation)
+{
+    auto name = sstable_file_name(generation, 0);
+    return create_table_builder(name + ".tmp", 0, get_local_memtable_flush_priority()).then([this, mt, name, generation] (lw_shared_ptr<table_builder> builder) {
+        auto sst = make_lw_shared<sstable_holder>();
+        sst->_generation = generation;
+        sst->_file_name = bytes { name.data(), name.size() };
+        auto after = make_lw_shared<optional<redis::decorated_key>>();
+        return repeat([this, mt, builder, sst, after] {
+            auto partitions = mt->read_partitions(*after, FLUSH_PARTITIONS_PER_BATCH);
+            if (partitions.empty()) {
+                return make_ready_future<stop_iteration>(stop_iteration::yes);
+            }
+            if (sst->_smallest_key.empty()) {
+                sst->_smallest_key = partitions.front()._key;
+            }
+            sst->_largest_key = partitions.back()._key;
+            _stats._flushed_partitions += partitions.size();
+            return do_with(std::move(partitions), [builder] (auto& partitions) {
+                return do_for_each(partitions, [builder] (auto& p) {
+                    bytes_view record { p._record.data(), p._record.size() };
+                    auto f = builder->add(bytes_view { p._key.data(), p._key.size() }, record);
+                    if (auto expire = record_expiry(decode_mutation(record))) {
+                        builder->add_expiry(expire);
+                    }
+                    return f;
+                });
+            }).then([] {
+                return stop_iteration::no;
+            });
+        }).then([this, builder, sst] {
+            return seal_sstable(builder, sst);
+        }).then([this, builder] (lw_shared_ptr<sstable_holder> sst) {
+            _stats._flushed_bytes += sst->_file_size;
+            _stats._flushed_raw_bytes += builder->raw_size();
+            return sst;
+        });
+    });
+}
+
+uint64_t column_family::max_bytes_for_level(int level)
+{
+    uint64_t result = L1_MAX_BYTES;
+    for (; level > 1; --level) {
+        result *= 10;
+    }
+    return result;
+}
+
+uint64_t column_family::level_bytes(int level) const
+{
+    uint64_t bytes = 0;
+    for (auto& sst : _sstables[level]) {
+        bytes += sst->_file_size;
+    }
+    return bytes;
+}
+
+std::pair<int, double> column_family::pick_compaction_level() const
+{
+    // L0 counts files rather than bytes: every one of them is probed by a
+    // lookup. The last level has nowhere to go.
+    auto best = std::make_pair(0, double(_sstables[0].size()) / L0_COMPACTION_TRIGGER);
+    for (int level = 1; level < MAX_LEVELS - 1; ++level) {
+        auto score = double(level_bytes(level)) / max_bytes_for_level(level);
+        if (score > best.second) {
+            best = std::make_pair(level, score);
+        }
+    }
+    return best;
+}
+
+std::vector<lw_shared_ptr<sstable_holder>> column_family::overlapping_sstables(int level, const bytes& smallest, const bytes& largest) const
+{
+    std::vector<lw_shared_ptr<sstable_holder>> result;
+    for (auto& sst : _sstables[level]) {
+        if (overlaps(*sst, smallest, largest)) {
+            result.emplace_back(sst);
+        }
+    }
+    return result;
+}
+
+lw_shared_ptr<sstable_holder> column_family::pick_expired_sstable() const
+{
+    // L0 is ordered by generation, an sstable of it is not rewritten alone.
+    auto now = now_ms();
+    lw_shared_ptr<sstable_holder> best;
+    double best_ratio = EXPIRY_COMPACTION_RATIO;
+    for (int level = 1; level < MAX_LEVELS; ++level) {
+        for (auto& sst : _sstables[level]) {
+            if (!sst->_sstable) {
+                continue;
+            }
+            auto ratio = sst->_sstable->expiry().expired_ratio(now);
+            if (ratio >= best_ratio) {
+                best = sst;
+                best_ratio = ratio;
+            }
+        }
+    }
+    return best;
+}
+
+bool column_family::is_base_level(int level, const bytes& key) const
+{
+    bytes_view k { key.data(), key.size() };
+    for (int l = level + 1; l < MAX_LEVELS; ++l) {
+        auto& fences = _fence_pointers[l];
+        if (fences.find(k) != fences.size()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void column_family::start_compaction()
+{
+    _compaction_done = repeat([this] {
+        return _compaction_pending.wait().then([this] {
+            if (_stopped) {
+                return make_ready_future<stop_iteration>(stop_iteration::yes);
+            }
+            return run_compactions().then([] {
+                return stop_iteration::no;
+            });
+        });
+    });
+    _expiry_timer.arm_periodic(std::chrono::seconds(EXPIRY_CHECK_SECONDS));
+    if (_options._adaptive_compaction && _options._compaction_throughput) {
+        _controller_timer.arm_periodic(std::chrono::seconds(1));
+    }
+    _compaction_pending.signal();
+}
+
+void column_family::adjust_compaction_throughput()
+{
+    auto lookups = _stats._sstable_lookups - _adjusted_lookups;
+    auto usec = _stats._sstable_lookup_usec - _adjusted_lookup_usec;
+    _adjusted_lookups = _stats._sstable_lookups;
+    _adjusted_lookup_usec = _stats._sstable_lookup_usec;
+    auto backlog = std::max(pick_compaction_level().second, double(_immutable_memtables.size()));
+    auto slow = lookups > 0 && usec / lookups > _options._read_latency_target_us;
+    if (backlog >= 2) {
+        _compaction_factor = std::min(_compaction_factor * 2, MAX_COMPACTION_FACTOR);
+    } else if (slow) {
+        _compaction_factor = std::max(_compaction_factor / 2, MIN_COMPACTION_FACTOR);
+    } else if (_compaction_factor > 1 && backlog < 1) {
+        _compaction_factor = std::max(_compaction_factor / 2, 1.0);
+    } else if (_compaction_factor < 1) {
+        _compaction_factor = std::min(_compaction_factor * 2, 1.0);
+    }
+    auto rate = std::max<size_t>(_options._compaction_throughput * _compaction_factor, 1);
+    _compaction_rate_limiter.set_rate(rate);
+    _stats._compaction_throughput = rate;
+}
+
+future<> column_family::stop()
+{
+    _stopped = true;
+    _expiry_timer.cancel();
+    _controller_timer.cancel();
+    _compaction_pending.signal();
+    return std::move(_compaction_done);
+}
+
+future<> column_family::run_compactions()
+{
+    return repeat([this] {
+        auto picked = pick_compaction_level();
+        auto seek = std::move(_seek_compaction);
+        _seek_compaction = nullptr;
+        if (seek && picked.second >= 1) {
+            // a compaction for size goes first, the sstable waits for it.
+            _seek_compaction = std::move(seek);
+        }
+        if (seek) {
+            auto& sstables = _sstables[seek->_level];
+            if (std::find(sstables.begin(), sstables.end(), seek) == sstables.end()) {
+                // compacted meanwhile.
+                seek = nullptr;
+            }
+        }
+        lw_shared_ptr<sstable_holder> expired;
+        if (!_stopped && picked.second < 1 && !seek) {
+            expired = pick_expired_sstable();
+        }
+        if (_stopped || (picked.second < 1 && !seek && !expired)) {
+            return make_ready_future<stop_iteration>(stop_iteration::yes);
+        }
+        auto level = seek ? seek->_level : expired ? expired->_level : picked.first;
+        // the last level is rewritten in place.
+        auto output_level = std::min(level + 1, MAX_LEVELS - 1);
+        std::vector<lw_shared_ptr<sstable_holder>> inputs;
+        if (seek) {
+            ++_stats._seek_compactions;
+        }
+        if (expired) {
+            // it goes down, its expired records with it, dropped once they
+            // reach their base level.
+            ++_stats._expiry_compactions;
+            inputs.emplace_back(expired);
+        } else if (seek && level > 0) {
+            // the sstable read too often without the key goes down.
+            inputs.emplace_back(seek);
+        } else if (level == 0) {
+            // L0 sstables overlap: all of them go, newest first.
+            inputs.assign(_sstables[0].rbegin(), _sstables[0].rend());
+        } else {
+            // the first sstable past the compact pointer, round the level.
+            auto& sstables = _sstables[level];
+            auto& pointer = _compact_pointers[level];
+            auto i = std::find_if(sstables.begin(), sstables.end(), [&pointer] (auto& sst) { return pointer < sst->_largest_key; });
+            inputs.emplace_back(i != sstables.end() ? *i : sstables.front());
+            pointer = inputs.front()->_largest_key;
+        }
+        auto smallest = inputs.front()->_smallest_key;
+        auto largest = inputs.front()->_largest_key;
+        for (auto& sst : inputs) {
+            smallest = std::min(smallest, sst->_smallest_key);
+            largest = std::max(largest, sst->_largest_key);
+        }
+        if (output_level > level) {
+            for (auto& sst : overlapping_sstables(output_level, smallest, largest)) {
+                inputs.emplace_back(sst);
+            }
+        }
+        return compact(output_level, std::move(inputs)).then_wrapped([this] (future<> f) {
+            try {
+                f.get();
+                ++_stats._compactions;
+                return stop_iteration::no;
+            } catch (...) {
+                // the inputs stay, the next flush tries again.
+                ++_stats._compaction_failures;
+                cf_log.error("compaction failed: {}", std::current_exception());
+                return stop_iteration::yes;
+            }
+        });
+    });
+}
+
+// The state of one compaction, or of one subcompaction: a scanner per
+// input, highest precedence first, and the output being written.
+struct compaction_state {
+    std::vector<std::unique_ptr<sstable_scanner>> _scanners;
+    lw_shared_ptr<std::vector<lw_shared_ptr<sstable_holder>>> _outputs;
+    lw_shared_ptr<table_builder> _builder;
+    lw_shared_ptr<sstable_holder> _output;
+    bytes _key;
+    bytes_opt _end;
+    std::function<bool (const bytes& key)> _keep;
+    // Records expiring up to now are expired.
+    uint64_t _now = 0;
+    // The deletion an expired record is written as.
+    bytes _deletion;
+};
+
+// The older versions of the key just merged are dropped.
+static future<> drop_older_versions(lw_shared_ptr<compaction_state> state)
+{
+    return do_for_each(state->_scanners, [state] (auto& scanner) {
+        if (scanner->valid() && scanner->key() == state->_key) {
+            return scanner->next();
+        }
+        return make_ready_future<>();
+    });
+}
+
+std::vector<bytes> column_family::subcompaction_boundaries(const std::vector<lw_shared_ptr<sstable_holder>>& inputs) const
+{
+    // The entries of an input are taken as spread evenly over its key
+    // range: the keys before a candidate boundary have the bytes of the
+    // inputs ending before it, and half of those holding it. The smallest
+    // keys of the inputs are the candidates.
+    uint64_t total = 0;
+    std::vector<bytes> candidates;
+    for (auto& sst : inputs) {
+        total += sst->_file_size;
+        candidates.emplace_back(sst->_smallest_key);
+    }
+    auto n = std::min<uint64_t>(_options._max_subcompactions, total / MIN_SUBCOMPACTION_BYTES);
+    std::vector<bytes> boundaries;
+    if (n < 2) {
+        return boundaries;
+    }
+    std::sort(candidates.begin(), candidates.end());
+    candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+    for (auto& key : candidates) {
+        uint64_t below = 0;
+        for (auto& sst : inputs) {
+            if (sst->_largest_key < key) {
+                below += sst->_file_size;
+            } else if (sst->_smallest_key < key) {
+                below += sst->_file_size / 2;
+            }
+        }
+        if (below * n >= total * (boundaries.size() + 1)) {
+            boundaries.emplace_back(key);
+            if (boundaries.size() + 1 == n) {
+                break;
+            }
+        }
+    }
+    return boundaries;
+}
+
+future<> column_family::compact(int level, std::vector<lw_shared_ptr<sstable_holder>> inputs, std::function<bool (const bytes& key)> keep)
+{
+    for (auto& sst : inputs) {
+        _stats._compaction_bytes_read += sst->_file_size;
+    }
+    // L0 is ordered by generation, its rewrites are not split.
+    auto boundaries = level > 0 ? subcompaction_boundaries(inputs) : std::vector<bytes>();
+    auto outputs = make_lw_shared<std::vector<lw_shared_ptr<sstable_holder>>>();
+    std::vector<future<>> merges;
+    bytes_opt start;
+    for (size_t i = 0; i <= boundaries.size(); ++i) {
+        auto end = i < boundaries.size() ? bytes_opt(boundaries[i]) : bytes_opt();
+        merges.emplace_back(merge(level, inputs, start, end, keep, outputs));
+        start = std::move(end);
+    }
+    if (merges.size() > 1) {
+        _stats._subcompactions += merges.size();
+    }
+    return when_all(merges.begin(), merges.end()).then([this, level, inputs, outputs] (std::vector<future<>> results) {
+        // a failed subcompaction fails them all: the outputs of the others
+        // are removed, the inputs stay.
+        std::exception_ptr error;
+        for (auto& f : results) {
+            if (f.failed()) {
+                auto e = f.get_exception();
+                if (!error) {
+                    error = std::move(e);
+                }
+            }
+        }
+        if (error) {
+            return remove_sstable_files(*outputs).then_wrapped([error] (future<> f) {
+                f.ignore_ready_future();
+                return make_exception_future<>(error);
+            });
+        }
+        version_edit edit;
+        for (auto& sst : inputs) {
+            edit.delete_file(sst);
+        }
+        for (auto& sst : *outputs) {
+            sst->_level = level;
+            edit.add_file(sst);
+        }
+        apply_edit(edit);
+        return remove_sstable_files(inputs);
+    });
+}
+
+future<> column_family::merge(int level, std::vector<lw_shared_ptr<sstable_holder>> inputs, bytes_opt start, bytes_opt end,
+    std::function<bool (const bytes& key)> keep, lw_shared_ptr<std::vector<lw_shared_ptr<sstable_holder>>> outputs)
+{
+    auto& pc = get_local_compaction_priority();
+    auto state = make_lw_shared<compaction_state>();
+    for (auto& sst : inputs) {
+        state->_scanners.emplace_back(std::make_unique<sstable_scanner>(sst->_sstable, pc));
+    }
+    state->_outputs = std::move(outputs);
+    state->_end = std::move(end);
+    state->_keep = std::move(keep);
+    state->_now = now_ms();
+    auto finish_output = [this, state] {
+        auto builder = std::move(state->_builder);
+        auto output = std::move(state->_output);
+        return seal_sstable(builder, output).then([this, state] (lw_shared_ptr<sstable_holder> sst) {
+            _stats._compaction_bytes_written += sst->_file_size;
+            state->_outputs->emplace_back(std::move(sst));
+        });
+    };
+    return parallel_for_each(state->_scanners, [start] (auto& scanner) {
+        return start ? scanner->seek(*start) : scanner->seek_to_first();
+    }).then([this, state, level, &pc, finish_output] {
+        return repeat([this, state, level, &pc, finish_output] {
+            // the smallest key, from the input of the highest precedence.
+            sstable_scanner* winner = nullptr;
+            for (auto& scanner : state->_scanners) {
+                if (scanner->valid() && (!winner || scanner->key() < winner->key())) {
+                    winner = scanner.get();
+                }
+            }
+            if (winner && state->_end && !(winner->key() < *state->_end)) {
+                winner = nullptr;
+            }
+            if (!winner) {
+                return (state->_builder ? finish_output() : make_ready_future<>()).then([] {
+                    return stop_iteration::yes;
+                });
+            }
+            if (state->_keep && !state->_keep(winner->key())) {
+                state->_key = winner->key();
+                return drop_older_versions(state).then([] {
+                    return stop_iteration::no;
+                });
+            }
+            auto record = decode_mutation(winner->value());
+            auto expire = record_expiry(record);
+            bool expired = expire != 0 && expire <= state->_now;
+            if ((expired || record._type == data_type::deleted) && level > 0 && is_base_level(level, winner->key())) {
+                // nothing older is left for it to hide.
+                if (expired) {
+                    ++_stats._expired_dropped;
+                } else {
+                    ++_stats._deletions_dropped;
+                }
+                state->_key = winner->key();
+                return drop_older_versions(state).then([] {
+                    return stop_iteration::no;
+                });
+            }
+            auto f = make_ready_future<>();
+            if (!state->_builder) {
+                auto generation = _next_generation++;
+                auto name = sstable_file_name(generation, level);
+                state->_output = make_lw_shared<sstable_holder>();
+                state->_output->_generation = generation;
+                state->_output->_file_name = bytes { name.data(), name.size() };
+                f = create_table_builder(name + ".tmp", level, pc).then([state] (lw_shared_ptr<table_builder> builder) {
+                    state->_builder = std::move(builder);
+                });
+            }
+            return f.then([this, state, winner, expire, expired] {
+                state->_key = winner->key();
+                auto value = winner->value();
+                if (expired) {
+                    // it still hides the older versions of a deeper level.
+                    state->_deletion = encode_deletion(state->_key);
+                    value = bytes_view { state->_deletion.data(), state->_deletion.size() };
+                    ++_stats._expired_to_deletions;
+                }
+                auto& output = *state->_output;
+                if (output._smallest_key.empty()) {
+                    output._smallest_key = state->_key;
+                }
+                output._largest_key = state->_key;
+                return _compaction_rate_limiter.reserve(state->_key.size() + value.size()).then([state, value, expire = expired ? 0 : expire] {
+                    auto f = state->_builder->add(bytes_view { state->_key.data(), state->_key.size() }, value);
+                    if (expire) {
+                        state->_builder->add_expiry(expire);
+                    }
+                    return f;
+                });
+            }).then([state] {
+                return drop_older_versions(state);
+            }).then([state, finish_output] {
+                if (state->_builder->file_size() >= MAX_COMPACTION_FILE_SIZE) {
+                    return finish_output();
+                }
+                return make_ready_future<>();
+            }).then([] {
+                return stop_iteration::no;
+            });
+        });
+    });
+}
+
+future<size_t> column_family::move_entries(lw_shared_ptr<sstable_holder> sst, const std::function<bool (const bytes& key)>& owned,
+    const std::function<future<> (std::vector<bytes> records)>& move)
+{
+    struct move_state {
+        std::unique_ptr<sstable_scanner> _scanner;
+        std::vector<bytes> _records;
+        size_t _moved = 0;
+    };
+    auto state = make_lw_shared<move_state>();
+    state->_scanner = std::make_unique<sstable_scanner>(sst->_sstable, get_local_compaction_priority());
+    return state->_scanner->seek_to_first().then([state, &owned, &move] {
+        return repeat([state, &owned, &move] {
+            auto& scanner = *state->_scanner;
+            if (scanner.valid() && owned(scanner.key())) {
+                return scanner.next().then([] {
+                    return stop_iteration::no;
+                });
+            }
+            if (scanner.valid()) {
+                auto value = scanner.value();
+                state->_records.emplace_back(value.data(), value.size());
+                ++state->_moved;
+            }
+            auto done = !scanner.valid();
+            auto f = make_ready_future<>();
+            if (state->_records.size() >= RESHARD_BATCH_ENTRIES || (done && !state->_records.empty())) {
+                f = move(std::move(state->_records));
+                state->_records.clear();
+            }
+            return f.then([state, done] {
+                return done ? make_ready_future<>() : state->_scanner->next();
+            }).then([done] {
+                return done ? stop_iteration::yes : stop_iteration::no;
+            });
+        });
+    }).then([state] {
+        return state->_moved;
+    });
+}
+
+future<> column_family::reshard(std::function<bool (const bytes& key)> owned, std::function<future<> (std::vector<bytes> records)> move)
 {
-    return make_ready_future<>();
+    // The records are moved before the sstables without them are installed,
+    // a crash in between moves them again on the next start. The deepest
+    // levels hold the oldest versions and go first, then L0 oldest first,
+    // so that the owners apply the versions of a key in their order.
+    std::vector<lw_shared_ptr<sstable_holder>> sstables;
+    for (int level = MAX_LEVELS - 1; level >= 0; --level) {
+        sstables.insert(sstables.end(), _sstables[level].begin(), _sstables[level].end());
+    }
+    auto adopted = std::move(_adopted);
+    _adopted.clear();
+    std::stable_sort(adopted.begin(), adopted.end(), [] (auto& l, auto& r) {
+        return l->_level != r->_level ? l->_level > r->_level : l->_generation < r->_generation;
+    });
+    struct reshard_state {
+        std::function<bool (const bytes& key)> _owned;
+        std::function<future<> (std::vector<bytes> records)> _move;
+        std::vector<lw_shared_ptr<sstable_holder>> _sstables;
+        std::vector<lw_shared_ptr<sstable_holder>> _adopted;
+        std::vector<lw_shared_ptr<sstable_holder>> _rewrites;
+        bool _rewrite_l0 = false;
+        std::function<bool (const bytes& key)> _none = [] (const bytes&) { return false; };
+    };
+    auto state = make_lw_shared<reshard_state>();
+    state->_owned = std::move(owned);
+    state->_move = std::move(move);
+    state->_sstables = std::move(sstables);
+    state->_adopted = std::move(adopted);
+    return do_for_each(state->_sstables, [this, state] (auto& sst) {
+        return this->move_entries(sst, state->_owned, state->_move).then([state, sst] (size_t moved) {
+            if (moved == 0) {
+                return;
+            }
+            if (sst->_level > 0) {
+                state->_rewrites.emplace_back(sst);
+            } else {
+                state->_rewrite_l0 = true;
+            }
+        });
+    }).then([this, state] {
+        // L0 is ordered by generation: it is written again whole, oldest
+        // first, to keep its order.
+        if (state->_rewrite_l0) {
+            state->_rewrites.insert(state->_rewrites.end(), _sstables[0].begin(), _sstables[0].end());
+        }
+        return do_for_each(state->_rewrites, [this, state] (auto& sst) {
+            return this->compact(sst->_level, { sst }, state->_owned);
+        });
+    }).then([this, state] {
+        return do_for_each(state->_adopted, [this, state] (auto& sst) {
+            return this->move_entries(sst, state->_none, state->_move).discard_result();
+        });
+    }).then([this, state] {
+        return remove_sstable_files(std::move(state->_adopted));
+    });
 }
 }
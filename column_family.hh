@@ -1,31 +1,286 @@
 #pragma once
+#include <algorithm>
 #include <vector>
 #include "core/shared_ptr.hh"
+#include "core/semaphore.hh"
 #include "memtable.hh"
-#include "partition.hh"
+#include "store/table.hh"
+#include "store/table_builder.hh"
 #include "core/sharded.hh"
+#include "core/timer.hh"
+#include "utils/rate_limiter.hh"
+#include <functional>
+#include <utility>
 namespace store {
 
 struct sstable_holder {
     bytes _smallest_key {};
     bytes _largest_key {};
     bytes _file_name {};
+    uint64_t _generation = 0;
+    uint64_t _file_size = 0;
+    int _level = 0;
+    // Lookups which may still read this sstable and then another one
+    // before it is compacted into the next level, as LevelDB's seeks.
+    int64_t _allowed_seeks = 0;
+    lw_shared_ptr<sstable> _sstable;
     sstable_holder()
     {
     }
 };
 
+// The sstables a compaction or a flush removes and adds, installed at once
+// so that a lookup sees either all the inputs or all the outputs.
+struct version_edit {
+    std::vector<lw_shared_ptr<sstable_holder>> _deleted_files;
+    std::vector<lw_shared_ptr<sstable_holder>> _new_files;
+
+    void delete_file(lw_shared_ptr<sstable_holder> sst) { _deleted_files.emplace_back(std::move(sst)); }
+    void add_file(lw_shared_ptr<sstable_holder> sst) { _new_files.emplace_back(std::move(sst)); }
+};
+
+// The key ranges of the sstables of a level, packed in one buffer so that
+// choosing the sstables of a lookup binary searches contiguous memory
+// rather than following a pointer to every holder.
+class fence_pointers {
+    // The smallest then the largest key of every sstable, in level order.
+    bytes _keys;
+    // Where every key starts in _keys, then the end of the last one.
+    std::vector<uint32_t> _offsets { 0 };
+    bytes_view key_at(size_t i) const {
+        return bytes_view { _keys.data() + _offsets[i], _offsets[i + 1] - _offsets[i] };
+    }
+public:
+    void build(const std::vector<lw_shared_ptr<sstable_holder>>& sstables);
+    size_t size() const { return _offsets.size() / 2; }
+    bytes_view smallest_key(size_t i) const { return key_at(2 * i); }
+    bytes_view largest_key(size_t i) const { return key_at(2 * i + 1); }
+    bool contains(size_t i, bytes_view key) const;
+    // For a level of disjoint sstables in key order: the one whose range
+    // holds key, size() if none does.
+    size_t find(bytes_view key) const;
+};
+
+// The lookups that reached the sstables of a level: the sstables probed,
+// the ones their filters answered, the ones read without the key, and what
+// the reads cost.
+struct level_read_stats {
+    uint64_t _probes = 0;
+    uint64_t _filter_negatives = 0;
+    uint64_t _filter_false_positives = 0;
+    uint64_t _blocks = 0;
+    uint64_t _cache_hits = 0;
+    uint64_t _bytes_read = 0;
+};
+
+struct column_family_stats {
+    uint64_t _memtable_flushes = 0;
+    uint64_t _memtable_flush_failures = 0;
+    uint64_t _flushed_partitions = 0;
+    uint64_t _flushed_bytes = 0;
+    // Size of the blocks of the flushed sstables before compression.
+    uint64_t _flushed_raw_bytes = 0;
+    // Lookups that reached an sstable, and the ones its filter answered.
+    uint64_t _sstable_reads = 0;
+    uint64_t _filter_negatives = 0;
+    // The filter let the lookup read a data block without the key.
+    uint64_t _filter_false_positives = 0;
+    // Lookups that reached the sstables, and the same by level.
+    uint64_t _sstable_lookups = 0;
+    std::vector<level_read_stats> _levels;
+    uint64_t _compactions = 0;
+    uint64_t _compaction_failures = 0;
+    uint64_t _compaction_bytes_read = 0;
+    uint64_t _compaction_bytes_written = 0;
+    // Key ranges of the compactions split into several.
+    uint64_t _subcompactions = 0;
+    // Compactions of an sstable which ran out of allowed seeks.
+    uint64_t _seek_compactions = 0;
+    // Compactions of an sstable holding many expired records.
+    uint64_t _expiry_compactions = 0;
+    // Expired records and deletions compactions dropped, no deeper level
+    // holding their keys, and expired records they wrote as deletions.
+    uint64_t _expired_dropped = 0;
+    uint64_t _deletions_dropped = 0;
+    uint64_t _expired_to_deletions = 0;
+    // Time spent by the lookups which reached the sstables.
+    uint64_t _sstable_lookup_usec = 0;
+    // Bytes per second compactions may write now, see
+    // column_family_options::_adaptive_compaction.
+    size_t _compaction_throughput = 0;
+};
+
+struct column_family_options {
+    // Codec of the sstables of L0 and L1, written and read the most.
+    compression_type _hot_compression = compression_type::lz4;
+    // Codec of the deeper levels, which hold most of the data.
+    compression_type _cold_compression = compression_type::deflate;
+    // Data blocks get a hash index for point lookups.
+    bool _block_hash_index = true;
+    // The buffers sstables are written with.
+    dma_file_writer_options _writer;
+    // Bytes per second compactions may write, 0 for no limit.
+    size_t _compaction_throughput = 0;
+    // Every second, the limit of the compactions goes up to four times
+    // _compaction_throughput while they fall behind, and down to a quarter
+    // of it while the lookups reaching the sstables take more than
+    // _read_latency_target_us on average. Only with a limit.
+    bool _adaptive_compaction = false;
+    uint32_t _read_latency_target_us = 2000;
+    // A large compaction is split into up to this many key ranges, merged
+    // at once.
+    unsigned _max_subcompactions = 4;
+    // The region group memtables count their memory in, none if null.
+    logalloc::region_group* _memtable_group = nullptr;
+};
+
 class column_family final {
     static constexpr int MAX_LEVELS = 9;
+    // Partitions copied out of a flushed memtable before writing them.
+    static constexpr size_t FLUSH_PARTITIONS_PER_BATCH = 128;
+    // L0 is ordered by generation, which follows the flushes. The deeper
+    // levels are ordered by key.
     std::vector<std::vector<lw_shared_ptr<sstable_holder>>> _sstables;
+    std::vector<fence_pointers> _fence_pointers;
     lw_shared_ptr<memtable> _active_memtable;
+    // Sealed memtables, oldest first, until their sstables are written.
     std::vector<lw_shared_ptr<memtable>> _immutable_memtables;
     bytes _sstable_dir_name;
     bytes _column_family_name;
     bool _has_commitlog;
+    column_family_options _options;
+    uint64_t _next_generation = 1;
+    // Memtables are written one at a time, in the order they are sealed.
+    semaphore _flush_semaphore { 1 };
+    column_family_stats _stats;
+
+    // Compactions: L0 is compacted once it has this many sstables, a deeper
+    // level once it holds more than its limit, ten times the one above.
+    static constexpr size_t L0_COMPACTION_TRIGGER = 4;
+    static constexpr uint64_t L1_MAX_BYTES = 10 * 1024 * 1024;
+    // Compactions cut their outputs at this size.
+    static constexpr uint64_t MAX_COMPACTION_FILE_SIZE = 2 * 1024 * 1024;
+    // A subcompaction merges at least this many bytes of inputs.
+    static constexpr uint64_t MIN_SUBCOMPACTION_BYTES = 4 * MAX_COMPACTION_FILE_SIZE;
+    // An sstable is allowed a seek per this many bytes, and at least
+    // MIN_ALLOWED_SEEKS: a lookup reading it then another sstable costs
+    // about what compacting these bytes does.
+    static constexpr uint64_t SEEK_COMPACTION_BYTES = 16 * 1024;
+    static constexpr int64_t MIN_ALLOWED_SEEKS = 100;
+    // The sstable which ran out of allowed seeks, compacted once no level
+    // needs a compaction for its size.
+    lw_shared_ptr<sstable_holder> _seek_compaction;
+    // An sstable of L1 or deeper with about this share of its bytes in
+    // expired records is compacted once no other compaction is due. The
+    // sstables are looked at this often, as they expire with no write.
+    static constexpr double EXPIRY_COMPACTION_RATIO = 0.25;
+    static constexpr unsigned EXPIRY_CHECK_SECONDS = 60;
+    timer<> _expiry_timer;
+    // Where the next compaction of every level starts, they go round the
+    // key space.
+    std::vector<bytes> _compact_pointers;
+    // Signaled when an sstable is added, wakes the compaction loop up.
+    semaphore _compaction_pending { 0 };
+    future<> _compaction_done = make_ready_future<>();
+    bool _stopped = false;
+    utils::rate_limiter _compaction_rate_limiter;
+    // The limit of the compactions over _compaction_throughput, and the
+    // lookups seen at the last adjustment.
+    static constexpr double MIN_COMPACTION_FACTOR = 0.25;
+    static constexpr double MAX_COMPACTION_FACTOR = 4;
+    double _compaction_factor = 1;
+    uint64_t _adjusted_lookups = 0;
+    uint64_t _adjusted_lookup_usec = 0;
+    timer<> _controller_timer;
+    // Raises the limit of the compactions while L0, the deeper levels or
+    // the memtables waiting for a flush are at least twice their limits,
+    // lowers it while the lookups are slower than their target, and brings
+    // it back otherwise.
+    void adjust_compaction_throughput();
+
+    sstring sstable_file_name(uint64_t generation, int level) const;
+    future<lw_shared_ptr<table_builder>> create_table_builder(const sstring& temporary_name, int level, const io_priority_class& pc);
+    future<lw_shared_ptr<sstable_holder>> seal_sstable(lw_shared_ptr<table_builder> builder, lw_shared_ptr<sstable_holder> sst);
+    future<lw_shared_ptr<sstable_holder>> write_sstable(lw_shared_ptr<memtable> mt, uint64_t generation);
+    void add_sstable(int level, lw_shared_ptr<sstable_holder> sst);
+    void apply_edit(const version_edit& edit);
+    future<> remove_sstable_files(std::vector<lw_shared_ptr<sstable_holder>> sstables);
+    table_options make_table_options(int level) const;
+
+    static uint64_t max_bytes_for_level(int level);
+    uint64_t level_bytes(int level) const;
+    // The level that needs a compaction the most and its score, a level
+    // needs one if its score is at least 1.
+    std::pair<int, double> pick_compaction_level() const;
+    std::vector<lw_shared_ptr<sstable_holder>> overlapping_sstables(int level, const bytes& smallest, const bytes& largest) const;
+    // The sstable with the most expired bytes, null unless one reaches
+    // EXPIRY_COMPACTION_RATIO.
+    lw_shared_ptr<sstable_holder> pick_expired_sstable() const;
+    // No level below level holds key: a compaction into level may drop its
+    // deletion, or its expired record, rather than write a deletion.
+    bool is_base_level(int level, const bytes& key) const;
+    future<> run_compactions();
+    // Merges inputs, highest precedence first, into sstables of level,
+    // without the keys keep rejects when it is given. Expired records are
+    // written as deletions, or dropped with the deletions where level is
+    // their base level. A large compaction is split into subcompactions of
+    // disjoint key ranges, run at once, whose outputs are installed by one
+    // edit.
+    future<> compact(int level, std::vector<lw_shared_ptr<sstable_holder>> inputs, std::function<bool (const bytes& key)> keep = {});
+    // The keys splitting inputs into ranges of about the same bytes, none
+    // for a compaction too small to split.
+    std::vector<bytes> subcompaction_boundaries(const std::vector<lw_shared_ptr<sstable_holder>>& inputs) const;
+    // Merges the entries of inputs from start, or from the first, up to
+    // end, or to the last, adding the sstables written to outputs.
+    future<> merge(int level, std::vector<lw_shared_ptr<sstable_holder>> inputs, bytes_opt start, bytes_opt end,
+        std::function<bool (const bytes& key)> keep, lw_shared_ptr<std::vector<lw_shared_ptr<sstable_holder>>> outputs);
+    // The sstables left by shards this run does not have, never read from:
+    // reshard() moves their entries to the shards owning them.
+    std::vector<lw_shared_ptr<sstable_holder>> _adopted;
+    static constexpr size_t RESHARD_BATCH_ENTRIES = 256;
+    future<size_t> move_entries(lw_shared_ptr<sstable_holder> sst, const std::function<bool (const bytes& key)>& owned,
+        const std::function<future<> (std::vector<bytes> records)>& move);
+    // What the lookup reads is added to probe, which must outlive it.
+    future<bytes_opt> try_read_from_sstable(lw_shared_ptr<sstable_holder> sst, const bytes& key, const filter_policy::key_hash& hash, sstable_read_stats& probe);
+    void charge_seek(lw_shared_ptr<sstable_holder> sst);
+    // The sstables which may hold key, in the order a lookup probes them.
+    std::vector<lw_shared_ptr<sstable_holder>> candidates_of(bytes_view key) const;
 public:
-    future<> apply(cache_entry& e);
-    column_family(bytes name, bool with_commitlog);
+    // Writes m to the active memtable.
+    void apply(mutation& m);
+    const lw_shared_ptr<memtable>& active_memtable() const { return _active_memtable; }
+    // The latest record of key, from the memtables or else the sstables,
+    // newest first.
+    future<bytes_opt> read(const redis::decorated_key& key);
+    // The latest records of keys, in their order, as read() would find
+    // them. The keys left after the memtables are sorted and looked up in
+    // rounds, every sstable taking those it is the next candidate of in a
+    // single multi_get, so that a block several keys share is read once.
+    future<std::vector<bytes_opt>> multi_read(const std::vector<redis::decorated_key>& keys);
+    // Finds the sstables of this shard left by earlier runs. With
+    // adopt_removed_shards, also the ones of the shards this run does not
+    // have, after the number of shards went down, for the shard of their
+    // number modulo smp::count.
+    future<> populate(bool adopt_removed_shards = false);
+    // After a change in the number of shards, before the compactions start:
+    // passes the records of the keys `owned` rejects to `move`, in batches,
+    // older versions first, then writes the sstables again without them.
+    // The adopted sstables are moved whole and removed.
+    future<> reshard(std::function<bool (const bytes& key)> owned, std::function<future<> (std::vector<bytes> records)> move);
+    // Seals the active memtable and writes it to a new L0 sstable. Writes go
+    // to a fresh memtable at once, they never wait for the flush.
+    future<> flush_memtable();
+    // Starts the background compactions, stop() waits for them.
+    void start_compaction();
+    future<> stop();
+    const std::vector<lw_shared_ptr<sstable_holder>>& sstables(int level) const { return _sstables[level]; }
+    size_t immutable_memtables() const { return _immutable_memtables.size(); }
+    bool has_sstables() const
+    {
+        return std::any_of(_sstables.begin(), _sstables.end(), [] (auto& level) { return !level.empty(); });
+    }
+    const column_family_stats& stats() const { return _stats; }
+    column_family(bytes name, bool with_commitlog, column_family_options options = column_family_options());
     ~column_family();
 };
 
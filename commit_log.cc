@@ -4,22 +4,57 @@
 #include "store/util/crc32c.hh"
 #include "store/log_format.hh"
 #include "store/priority_manager.hh"
+#include "utils/latency_monitor.hh"
 #include "core/align.hh"
+#include "core/future-util.hh"
 #include "core/gate.hh"
+#include "core/reactor.hh"
+#include "core/shared_future.hh"
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <experimental/optional>
+#include <limits>
 namespace store {
 
+// A segment file starts with a header holding the id of the segment, which
+// orders the segments on replay, then the records. The CRC of each record is
+// seeded with the id, so records left by an earlier use of a recycled file
+// do not pass for records of the segment. The records of the segments of
+// earlier versions, with the old magic, have the short header: they are
+// still replayed.
+static constexpr const uint32_t SEGMENT_MAGIC = 0x324c4450; // "PDL2"
+static constexpr const uint32_t SHORT_SEGMENT_MAGIC = 0x4c434450; // "PDCL"
+static constexpr const size_t SEGMENT_HEADER_SIZE = 4 + 8 + 4;
+
+struct segment {
+    // The id is 0 until the segment is used.
+    uint64_t _id = 0;
+    sstring _name;
+    lw_shared_ptr<file> _file;
+    uint32_t _crc_seed = 0;
+    // The replication offsets of the first record and past the last one, in
+    // the segments written by this run until they are recycled.
+    uint64_t _first_offset = 0;
+    uint64_t _end_offset = 0;
+    bool _tailable = false;
+    // Left by a shard this run does not have, removed once replayed.
+    bool _adopted = false;
+    // Written by an earlier version, whose records have the short header.
+    bool _short_frames = false;
+
+    size_t frame_header_size() const { return _short_frames ? SHORT_HEADER_SIZE : HEADER_SIZE; }
+};
+
 class flush_buffer final {
     lw_shared_ptr<temporary_buffer<char>> _data;
-    data_output _output;
     size_t _offset;
     size_t _written;
+    lw_shared_ptr<segment> _segment;
     uint32_t _touched_counter;
-    uint32_t _ref;
-    gate _gate;
 public:
     flush_buffer()
         : _data (nullptr)
-        , _output(nullptr, size_t(0))
         , _offset(0)
         , _written(0)
         , _touched_counter(0)
@@ -28,25 +63,20 @@ public:
 
     flush_buffer(char* data, size_t size)
         : _data(make_lw_shared<temporary_buffer<char>>(data, size, make_free_deleter(data)))
-        , _output(data, size)
         , _offset(0)
         , _written(0)
         , _touched_counter(0)
     {
     }
 
-    inline void enter() { _gate.enter(); }
-    inline void leave() { _gate.leave(); }
-    inline future<> close() { return _gate.close(); }
-
     inline void skip(size_t n) {
         _offset += n;
     }
 
-    inline size_t write(lw_shared_ptr<mutation> m) {
-        size_t serialized = m->encode_to(_output);
-        _offset += serialized;
-        return serialized;
+    // The record, of size bytes, must fit.
+    inline void write(const mutation_record& r, size_t size) {
+        r.encode_to(get_current());
+        _offset += size;
     }
 
     inline char* get_current() {
@@ -69,23 +99,31 @@ public:
         return _written >= _offset;
     }
 
-    inline void update_flushed_size(size_t flushed) {
-        _written += flushed;
+    inline size_t written() const {
+        return _written;
+    }
+
+    inline void set_written(size_t written) {
+        _written = std::max(_written, written);
     }
 
     inline char* data() {
-        return _data->get_write() + _written;
+        return _data->get_write();
+    }
+
+    inline const lw_shared_ptr<segment>& get_segment() const {
+        return _segment;
     }
 
-    inline size_t size() const {
-        return _offset - _written;
+    inline void set_segment(lw_shared_ptr<segment> s) {
+        _segment = std::move(s);
     }
 
     inline void reset() {
         _offset = 0;
         _written = 0;
+        _segment = nullptr;
         _touched_counter = 0;
-        _gate = {};
     }
 
     inline uint32_t touch() {
@@ -101,105 +139,581 @@ static void init_type_crc(uint32_t* type_crc) {
   }
 }
 
+// Reads a segment file from a position in chunks, keeping up to `depth` of
+// them in flight, so that the replay and the replicas tailing the log wait
+// for the disk once per read-ahead rather than once per chunk.
+class segment_reader {
+    file _file;
+    uint64_t _position;
+    uint64_t _end;
+    size_t _chunk;
+    size_t _depth;
+    std::deque<future<temporary_buffer<char>>> _ahead;
+
+    void fill()
+    {
+        while (_ahead.size() < _depth && _position < _end) {
+            auto length = std::min<uint64_t>(_chunk, _end - _position);
+            _ahead.push_back(_file.dma_read_exactly<char>(_position, length, get_local_commitlog_priority()));
+            _position += length;
+        }
+    }
+public:
+    // The position, the end and the chunk size are aligned for DMA.
+    segment_reader(file f, uint64_t position, uint64_t end, size_t chunk, size_t depth)
+        : _file(std::move(f))
+        , _position(position)
+        , _end(end)
+        , _chunk(chunk)
+        , _depth(depth)
+    {
+        fill();
+    }
+
+    // The next chunk, empty past the end.
+    future<temporary_buffer<char>> next()
+    {
+        if (_ahead.empty()) {
+            return make_ready_future<temporary_buffer<char>>();
+        }
+        auto f = std::move(_ahead.front());
+        _ahead.pop_front();
+        fill();
+        return f;
+    }
+
+    // Whether the chunks up to the end are all read or being read.
+    bool issued_all() const { return _position >= _end; }
+    bool done() const { return issued_all() && _ahead.empty(); }
+
+    // Waits for the reads in flight, dropping their chunks.
+    future<> close()
+    {
+        auto ahead = std::move(_ahead);
+        _ahead.clear();
+        return when_all(ahead.begin(), ahead.end()).then([f = _file] (std::vector<future<temporary_buffer<char>>> reads) mutable {
+            for (auto& r : reads) {
+                r.ignore_ready_future();
+            }
+            return f.close();
+        });
+    }
+};
+
+// The length of the frame whose header is at the start of data, which must
+// hold it: -1 when it is not a whole record, or one longer than max_size.
+static ssize_t frame_size(const segment& s, const char* data, size_t max_size)
+{
+    size_t record_size;
+    record_type type;
+    if (s._short_frames) {
+        record_size = static_cast<uint8_t>(data[4]) | (static_cast<uint8_t>(data[5]) << 8);
+        type = static_cast<record_type>(static_cast<uint8_t>(data[6]));
+    }
+    else {
+        record_size = frame_record_length(data);
+        type = frame_record_type(data);
+    }
+    if (type != record_type::full || s.frame_header_size() + record_size > max_size) {
+        return -1;
+    }
+    return s.frame_header_size() + record_size;
+}
+
+// The length of the framed record at the start of data: 0 when data does not
+// hold all of it, -1 when it is not a whole record of the segment.
+static ssize_t frame_length(const segment& s, const char* data, size_t size, size_t max_size)
+{
+    auto header_size = s.frame_header_size();
+    if (size < header_size) {
+        return 0;
+    }
+    auto length = frame_size(s, data, max_size);
+    if (length < 0) {
+        return -1;
+    }
+    if (size < static_cast<size_t>(length)) {
+        return 0;
+    }
+    if (crc32c::unmask(decode_fixed32(data)) != crc32c::extend(s._crc_seed, data + header_size, length - header_size)) {
+        return -1;
+    }
+    return length;
+}
+
+// A record straddling chunks of a segment read: its header, then its whole
+// frame once the header tells its length, filled as the chunks come.
+struct partial_frame {
+    temporary_buffer<char> _data;
+    size_t _filled = 0;
+};
+
 class commit_log::impl final {
-    sstring _file_name;
-    lw_shared_ptr<file> _file;
     static const size_t IO_EXTENT_ALLOCATION_SIZE = 32 * 1024 * 1024;
-    static const size_t FLUSH_BUFFER_SIZE = 1024 * 1024 * 1024;
-    static const size_t SEGEMENT_SIZE = 32 * 1024;
     static const size_t OUTPUT_BUFFER_ALIGNMENT = 4096;
     static const uint32_t MAX_FLUSH_BUFFER_SIZE = 32;
-    static const size_t FLUSH_SIZE_THRESHOLD = FLUSH_BUFFER_SIZE * 80 / 100;
     static const uint32_t FLUSH_TOUCH_COUNTER_THRESHOLD = 10;
+    commit_log_options _options;
     std::queue<lw_shared_ptr<flush_buffer>> _released_buffers;
-    std::queue<lw_shared_ptr<flush_buffer>> _pending_buffers;
+    // Buffers no longer appended to, in file order, until they are written.
+    std::deque<lw_shared_ptr<flush_buffer>> _pending_buffers;
     lw_shared_ptr<flush_buffer> _current_buffer;
-    size_t _file_offset;
     bool _shutdown { false };
+    std::experimental::optional<shared_future<>> _initialized;
+    bool _ready = false;
+
+    // Segments ready to be used, preallocated or recycled.
+    std::deque<lw_shared_ptr<segment>> _reserve_segments;
+    // Written segments, oldest first, whose records may not be flushed yet.
+    std::deque<lw_shared_ptr<segment>> _completed_segments;
+    // Segments of earlier runs, oldest first, until they are replayed.
+    std::vector<lw_shared_ptr<segment>> _replay_segments;
+    uint64_t _next_segment_id = 1;
+    uint64_t _next_file_number = 1;
+    bool _allocating = false;
+
+    // Bytes and records appended, and how many of them the last sync covered.
+    uint64_t _appended_bytes = 0;
+    uint64_t _appended_records = 0;
+    uint64_t _synced_bytes = 0;
+    uint64_t _synced_records = 0;
+    struct sync_waiter {
+        uint64_t _bytes;
+        promise<> _done;
+    };
+    std::deque<sync_waiter> _sync_waiters;
+    bool _syncing = false;
+    // Buffers are written by one writer at a time: the tail block of the
+    // current buffer is written again by each sync.
+    semaphore _write_lock { 1 };
+    commit_log_stats _stats;
+    // The segment replicas tail, read ahead from where the last pull
+    // stopped: the bytes from _position on not yet passed, then the chunks
+    // of the reader.
+    struct tail_reader {
+        lw_shared_ptr<segment> _segment;
+        uint64_t _segment_id = 0;
+        lw_shared_ptr<segment_reader> _reader;
+        uint64_t _position = 0;
+        temporary_buffer<char> _data;
+    };
+    tail_reader _tail;
+    semaphore _tail_lock { 1 };
 
     using clock_type = lowres_clock;
     // periodically flush commitlog buffer to disk
     timer<clock_type> _timer;
+    // syncs the log every second in the everysec mode
+    timer<clock_type> _sync_timer;
     gate _gate;
     using timeout_exception_factory = default_timeout_exception_factory;
     basic_semaphore<timeout_exception_factory> _released_semaphore;
     basic_semaphore<timeout_exception_factory> _pending_semaphore;
     uint32_t type_crc_[MAX_RECORD_TYPE + 1];
 public:
-    explicit impl(sstring fn);
+    explicit impl(commit_log_options options);
     ~impl() {}
-    future<> append(lw_shared_ptr<mutation> entry);
+    future<> append(const mutation_record& r);
     future<> close();
+    const commit_log_stats& stats() const { return _stats; }
+    replay_position position() const;
+    uint64_t replication_offset() const { return _appended_bytes; }
+    future<log_records> read_records(uint64_t offset, size_t max_bytes);
+    void discard_segments_before(replay_position rp);
+    future<> replay(std::function<future<> (std::vector<temporary_buffer<char>> records)> func);
 private:
+    using replay_func = std::function<future<> (std::vector<temporary_buffer<char>> records)>;
+    future<log_records> read_written_records(lw_shared_ptr<segment> s, uint64_t offset, size_t max_bytes);
+    future<> reset_tail(lw_shared_ptr<segment> s, uint64_t position, uint64_t end);
     future<> initialize();
+    future<> ensure_initialized();
+    future<> find_segments();
+    // Reads the segment from position up to end, or up to its size.
+    future<lw_shared_ptr<segment_reader>> open_reader(lw_shared_ptr<segment> s, uint64_t position, uint64_t end);
+    bool split_records(const segment& s, temporary_buffer<char> chunk, partial_frame& partial, std::vector<temporary_buffer<char>>& records);
+    future<> apply_records(std::vector<temporary_buffer<char>> records, replay_func& func);
+    future<> replay_segment(lw_shared_ptr<segment> s, lw_shared_ptr<segment_reader> r, replay_func& func, std::function<void ()> read_next);
+    sstring segment_name(uint64_t number) const;
+    future<lw_shared_ptr<segment>> allocate_segment();
+    void replenish_segments();
+    future<lw_shared_ptr<segment>> next_segment();
+    void recycle_segment(lw_shared_ptr<segment> s);
     future<> make_room_for_apending_mutation(size_t size);
+    // Writes the record, of size bytes, to the current buffer, which has
+    // room for it.
+    future<> write_record(const mutation_record& r, size_t size);
     future<> do_flush_one_buffer(lw_shared_ptr<flush_buffer> fb);
+    future<> wait_for_sync(uint64_t bytes);
+    void maybe_sync();
+    future<> sync();
+    void retire_current_buffer();
     lw_shared_ptr<flush_buffer> make_flush_buffer();
     void on_timer();
 };
 
-commit_log::impl::impl(sstring fn)
-    : _file_name (std::move(fn))
-    , _file(nullptr)
+commit_log_sync_mode to_commit_log_sync_mode(const std::string& name)
+{
+    if (name == "always") {
+        return commit_log_sync_mode::always;
+    }
+    else if (name == "everysec") {
+        return commit_log_sync_mode::everysec;
+    }
+    else if (name == "no") {
+        return commit_log_sync_mode::no;
+    }
+    throw std::invalid_argument("unknown commit log sync mode: " + name);
+}
+
+commit_log::impl::impl(commit_log_options options)
+    : _options(std::move(options))
     , _current_buffer(nullptr)
-    , _file_offset(0)
     , _shutdown(false)
     , _released_semaphore(MAX_FLUSH_BUFFER_SIZE)
     , _pending_semaphore(0)
 {
+    _options._segment_size = align_up<size_t>(std::max<size_t>(_options._segment_size, 2 * OUTPUT_BUFFER_ALIGNMENT), OUTPUT_BUFFER_ALIGNMENT);
+    _options._read_ahead_chunk = align_up<size_t>(std::max<size_t>(_options._read_ahead_chunk, OUTPUT_BUFFER_ALIGNMENT), OUTPUT_BUFFER_ALIGNMENT);
+    _options._read_ahead = std::max(_options._read_ahead, _options._read_ahead_chunk);
+    _options._replay_batch_records = std::max<size_t>(_options._replay_batch_records, 1);
     init_type_crc(type_crc_);
 }
 
-future<> commit_log::impl::do_flush_one_buffer(lw_shared_ptr<flush_buffer> fb)
+sstring commit_log::impl::segment_name(uint64_t number) const
+{
+    return "commitlog-" + to_sstring(engine().cpu_id()) + "-" + to_sstring(number) + ".log";
+}
+
+future<lw_shared_ptr<segment>> commit_log::impl::allocate_segment()
+{
+    // The file is allocated and sized up front, so that writing it never
+    // changes its metadata.
+    auto s = make_lw_shared<segment>();
+    s->_name = segment_name(_next_file_number++);
+    file_open_options opt;
+    opt.extent_allocation_size_hint = IO_EXTENT_ALLOCATION_SIZE;
+    return open_checked_file_dma(commit_error_handler, s->_name, open_flags::wo | open_flags::create, opt).then([this, s] (file f) {
+        s->_file = make_lw_shared<file>(std::move(f));
+        return s->_file->allocate(0, _options._segment_size);
+    }).then([this, s] {
+        return s->_file->truncate(_options._segment_size);
+    }).then([this, s] {
+        return s->_file->flush();
+    }).then([this, s] {
+        ++_stats._created_segments;
+        return s;
+    });
+}
+
+// Keeps a segment ready ahead of use.
+void commit_log::impl::replenish_segments()
+{
+    if (_allocating || _shutdown || !_reserve_segments.empty()) {
+        return;
+    }
+    _allocating = true;
+    allocate_segment().then_wrapped([this] (future<lw_shared_ptr<segment>> f) {
+        _allocating = false;
+        try {
+            _reserve_segments.emplace_back(f.get0());
+        } catch (...) {
+            // next_segment() allocates one itself, and fails the appends.
+        }
+    });
+}
+
+future<lw_shared_ptr<segment>> commit_log::impl::next_segment()
+{
+    auto activate = [this] (lw_shared_ptr<segment> s) {
+        s->_id = _next_segment_id++;
+        s->_short_frames = false;
+        char id[8];
+        encode_fixed64(id, s->_id);
+        s->_crc_seed = crc32c::extend(type_crc_[record_type::full], id, sizeof(id));
+        replenish_segments();
+        return s;
+    };
+    if (!_reserve_segments.empty()) {
+        auto s = _reserve_segments.front();
+        _reserve_segments.pop_front();
+        return make_ready_future<lw_shared_ptr<segment>>(activate(std::move(s)));
+    }
+    return allocate_segment().then(activate);
+}
+
+void commit_log::impl::recycle_segment(lw_shared_ptr<segment> s)
 {
-    // flush buffer to file
-    assert(_file);
-    return repeat([this, fb] () mutable {
-        auto data = fb->data();
-        auto size = align_up<size_t>(fb->size(), OUTPUT_BUFFER_ALIGNMENT);
-        std::fill(data + fb->size(), data + size, 0);
+    // The header of a recycled segment is cleared before it is used again,
+    // so that a replay skips it until it gets new records.
+    s->_tailable = false;
+    if (_shutdown || s->_adopted || _reserve_segments.size() >= _options._max_recycled_segments) {
+        auto f = s->_file ? s->_file->close() : make_ready_future<>();
+        f.then([s] {
+            return remove_file(s->_name);
+        }).handle_exception([] (auto ep) {});
+        return;
+    }
+    auto open = s->_file ? make_ready_future<>() : open_checked_file_dma(commit_error_handler, s->_name, open_flags::wo).then([s] (file f) {
+        s->_file = make_lw_shared<file>(std::move(f));
+    });
+    open.then([this, s] {
+        auto header = allocate_aligned_buffer<char>(OUTPUT_BUFFER_ALIGNMENT, OUTPUT_BUFFER_ALIGNMENT);
+        std::fill(header.get(), header.get() + OUTPUT_BUFFER_ALIGNMENT, 0);
         auto&& priority_class = get_local_commitlog_priority();
-        return _file->dma_write(_file_offset, data, size, priority_class).then([this, fb] (auto s) {
-            fb->update_flushed_size(s);
-            s = align_down<size_t>(s, OUTPUT_BUFFER_ALIGNMENT);
-            _file_offset += s;
+        auto data = header.get();
+        return s->_file->dma_write(0, data, OUTPUT_BUFFER_ALIGNMENT, priority_class).then([this, s, header = std::move(header)] (auto) {
+            return s->_file->flush();
+        });
+    }).then([this, s] {
+        s->_id = 0;
+        ++_stats._recycled_segments;
+        _reserve_segments.emplace_back(s);
+    }).handle_exception([] (auto ep) {});
+}
 
-            if (fb->flushed_all()) {
-                return make_ready_future<stop_iteration>(stop_iteration::yes);
-            }
-            return make_ready_future<stop_iteration>(stop_iteration::no);
+replay_position commit_log::impl::position() const
+{
+    if (_current_buffer) {
+        return replay_position { _current_buffer->get_segment()->_id, _current_buffer->payload_size() };
+    }
+    return replay_position { _next_segment_id, 0 };
+}
+
+void commit_log::impl::discard_segments_before(replay_position rp)
+{
+    while (!_completed_segments.empty() && _completed_segments.front()->_id < rp._segment_id) {
+        auto s = _completed_segments.front();
+        _completed_segments.pop_front();
+        recycle_segment(std::move(s));
+    }
+}
+
+future<> commit_log::impl::do_flush_one_buffer(lw_shared_ptr<flush_buffer> fb)
+{
+    // Writes what was appended to the buffer since it was last written. The
+    // block holding the tail is padded with zeros, it is written again once
+    // more records follow it.
+    assert(fb->get_segment());
+    if (fb->flushed_all()) {
+        return make_ready_future<>();
+    }
+    auto payload_size = fb->payload_size();
+    auto start = std::chrono::steady_clock::now();
+    auto begin = align_down<size_t>(fb->written(), OUTPUT_BUFFER_ALIGNMENT);
+    auto end = align_up<size_t>(payload_size, OUTPUT_BUFFER_ALIGNMENT);
+    std::fill(fb->data() + payload_size, fb->data() + end, 0);
+    return do_with(begin, [this, fb, end] (size_t& offset) {
+        return repeat([this, fb, end, &offset] {
+            auto&& priority_class = get_local_commitlog_priority();
+            auto& f = *fb->get_segment()->_file;
+            return f.dma_write(offset, fb->data() + offset, end - offset, priority_class).then([end, &offset] (auto s) {
+                offset += s;
+                return make_ready_future<stop_iteration>(offset >= end ? stop_iteration::yes : stop_iteration::no);
+            });
         });
-    }).then ([this] {
-         return _file->flush().then([] {
-             return make_ready_future<>();
-         });
+    }).then([fb, payload_size, start] {
+        fb->set_written(payload_size);
+        utils::local_latency_monitor().record(utils::latency_event::commit_log_write, std::chrono::steady_clock::now() - start);
     });
 }
 
-void commit_log::impl::on_timer()
+future<> commit_log::impl::wait_for_sync(uint64_t bytes)
+{
+    _sync_waiters.push_back(sync_waiter { bytes, promise<>() });
+    ++_stats._sync_waiters;
+    auto f = _sync_waiters.back()._done.get_future();
+    maybe_sync();
+    return f;
+}
+
+void commit_log::impl::maybe_sync()
 {
+    if (_syncing || _synced_bytes >= _appended_bytes) {
+        return;
+    }
+    _syncing = true;
+    sync().finally([this] {
+        _syncing = false;
+        if (!_sync_waiters.empty()) {
+            maybe_sync();
+        }
+    });
+}
+
+// One group commit: writes everything appended so far and syncs the files,
+// then resolves the appends it covers. Appends arriving meanwhile wait for
+// the next one, so they share its write and its sync.
+future<> commit_log::impl::sync()
+{
+    auto bytes = _appended_bytes;
+    auto records = _appended_records;
+    auto start = std::chrono::steady_clock::now();
+    std::vector<lw_shared_ptr<flush_buffer>> buffers(_pending_buffers.begin(), _pending_buffers.end());
     if (_current_buffer) {
-        _current_buffer->touch();
-        if ( _current_buffer->payload_size() > FLUSH_SIZE_THRESHOLD || _current_buffer->touch() > FLUSH_TOUCH_COUNTER_THRESHOLD) {
-            _current_buffer->close().then([this] {
-                _pending_buffers.emplace(_current_buffer);
-                _pending_semaphore.signal();
-                _current_buffer = nullptr; 
+        buffers.emplace_back(_current_buffer);
+    }
+    std::vector<lw_shared_ptr<segment>> segments;
+    for (auto& fb : buffers) {
+        segments.emplace_back(fb->get_segment());
+    }
+    return with_semaphore(_write_lock, 1, [this, buffers = std::move(buffers)] () mutable {
+        return do_with(std::move(buffers), [this] (auto& buffers) {
+            return do_for_each(buffers, [this] (auto& fb) {
+                return this->do_flush_one_buffer(fb);
+            });
+        });
+    }).then([segments = std::move(segments)] () mutable {
+        return do_with(std::move(segments), [] (auto& segments) {
+            return parallel_for_each(segments, [] (auto& s) {
+                return s->_file->flush();
             });
+        });
+    }).then_wrapped([this, bytes, records, start] (future<> f) {
+        std::exception_ptr ex;
+        if (f.failed()) {
+            ex = f.get_exception();
+        }
+        else {
+            auto elapsed = std::chrono::steady_clock::now() - start;
+            utils::local_latency_monitor().record(utils::latency_event::commit_log_sync, elapsed);
+            auto latency = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+            _stats._last_sync_bytes = bytes - _synced_bytes;
+            _stats._last_sync_appends = records - _synced_records;
+            _stats._last_sync_latency_us = latency;
+            _stats._synced_bytes += _stats._last_sync_bytes;
+            _stats._sync_latency_us += latency;
+            ++_stats._syncs;
+            _synced_bytes = bytes;
+            _synced_records = records;
+        }
+        while (!_sync_waiters.empty() && _sync_waiters.front()._bytes <= bytes) {
+            if (ex) {
+                _sync_waiters.front()._done.set_exception(ex);
+            }
+            else {
+                _sync_waiters.front()._done.set_value();
+            }
+            _sync_waiters.pop_front();
+            --_stats._sync_waiters;
         }
+    });
+}
+
+void commit_log::impl::retire_current_buffer()
+{
+    _current_buffer->get_segment()->_end_offset = _appended_bytes;
+    _pending_buffers.emplace_back(std::move(_current_buffer));
+    _current_buffer = nullptr;
+    _pending_semaphore.signal();
+}
+
+void commit_log::impl::on_timer()
+{
+    // Writes the tail of a buffer which has not filled up for a while, the
+    // only write of the no mode until the segment is full.
+    if (_current_buffer && !_current_buffer->flushed_all() && _current_buffer->touch() > FLUSH_TOUCH_COUNTER_THRESHOLD) {
+        with_semaphore(_write_lock, 1, [this, fb = _current_buffer] {
+            return do_flush_one_buffer(fb);
+        }).handle_exception([] (auto ep) {});
     }
     if (!_shutdown) {
         _timer.arm(std::chrono::milliseconds(8000));
     }
 }
 
+future<> commit_log::impl::find_segments()
+{
+    // The segments of this shard left by earlier runs, with a valid header,
+    // are replayed in the order of their ids. The others are recycled.
+    // "commitlog-<shard>-<number>.log"
+    static const sstring prefix = "commitlog-";
+    auto cpu = engine().cpu_id();
+    auto adopt = _options._adopt_removed_shards;
+    return open_checked_directory(commit_error_handler, ".").then([cpu, adopt] (file dir) {
+        auto names = make_lw_shared<std::vector<sstring>>();
+        auto listing = make_lw_shared<subscription<directory_entry>>(dir.list_directory([names, cpu, adopt] (directory_entry de) {
+            auto& n = de.name;
+            if (n.size() > prefix.size() + 4 && std::equal(prefix.begin(), prefix.end(), n.begin()) && n.find(".log") == n.size() - 4) {
+                auto shard = std::strtoul(n.c_str() + prefix.size(), nullptr, 10);
+                if (shard == cpu || (adopt && shard >= smp::count && shard % smp::count == cpu)) {
+                    names->emplace_back(n);
+                }
+            }
+            return make_ready_future<>();
+        }));
+        return listing->done().then([names, dir, listing] () mutable {
+            return dir.close();
+        }).then([names] {
+            return std::move(*names);
+        });
+    }).then([this, cpu] (std::vector<sstring> names) {
+        return do_with(std::move(names), [this, cpu] (auto& names) {
+            return do_for_each(names, [this, cpu] (auto& name) {
+                char* end = nullptr;
+                auto shard = std::strtoul(name.c_str() + prefix.size(), &end, 10);
+                auto number = std::strtoull(end + 1, nullptr, 10);
+                auto adopted = shard != cpu;
+                if (!adopted) {
+                    _next_file_number = std::max<uint64_t>(_next_file_number, number + 1);
+                }
+                return open_checked_file_dma(commit_error_handler, name, open_flags::ro).then([this, name, adopted] (file f) {
+                    auto header = make_lw_shared<file>(std::move(f));
+                    return header->dma_read_exactly<char>(0, SEGMENT_HEADER_SIZE).then_wrapped([this, name, adopted] (future<temporary_buffer<char>> f) {
+                        auto s = make_lw_shared<segment>();
+                        s->_name = name;
+                        s->_adopted = adopted;
+                        try {
+                            auto buf = f.get0();
+                            auto p = buf.get();
+                            auto magic = decode_fixed32(p);
+                            if ((magic == SEGMENT_MAGIC || magic == SHORT_SEGMENT_MAGIC) && crc32c::unmask(decode_fixed32(p + 12)) == crc32c::value(p, 12)) {
+                                s->_id = decode_fixed64(p + 4);
+                                s->_short_frames = magic == SHORT_SEGMENT_MAGIC;
+                            }
+                        } catch (...) {
+                        }
+                        if (s->_id) {
+                            char id[8];
+                            encode_fixed64(id, s->_id);
+                            s->_crc_seed = crc32c::extend(type_crc_[record_type::full], id, sizeof(id));
+                            _next_segment_id = std::max(_next_segment_id, s->_id + 1);
+                            _replay_segments.emplace_back(s);
+                        }
+                        else {
+                            recycle_segment(s);
+                        }
+                    }).finally([header] {
+                        return header->close();
+                    });
+                });
+            });
+        });
+    }).then([this] {
+        std::sort(_replay_segments.begin(), _replay_segments.end(), [] (auto& a, auto& b) {
+            return a->_id < b->_id;
+        });
+        for (auto& s : _replay_segments) {
+            _completed_segments.emplace_back(s);
+        }
+    });
+}
+
 future<> commit_log::impl::initialize()
 {
     repeat([this] {
     return _pending_semaphore.wait().then([this] {
         auto b = _pending_buffers.front();
-        _pending_buffers.pop();
-        return do_flush_one_buffer(b).then([this, released_buffer = b]  {
+        // the buffer stays pending until it is written, so that a sync
+        // waits for it.
+        return with_semaphore(_write_lock, 1, [this, b] {
+            return do_flush_one_buffer(b);
+        }).then([this, b] {
+            // in the always and everysec modes the last records of the
+            // segment are synced before it is used again.
+            return _options._sync_mode == commit_log_sync_mode::no ? make_ready_future<>() : b->get_segment()->_file->flush();
+        }).then([this, released_buffer = b]  {
+            _pending_buffers.pop_front();
+            _completed_segments.emplace_back(released_buffer->get_segment());
             released_buffer->reset();
             _released_buffers.emplace(released_buffer);
             _released_semaphore.signal();
@@ -211,38 +725,49 @@ future<> commit_log::impl::initialize()
 
      _timer.set_callback(std::bind(&commit_log::impl::on_timer, this));
      _timer.arm(std::chrono::milliseconds(8000));
+    if (_options._sync_mode == commit_log_sync_mode::everysec) {
+        _sync_timer.set_callback(std::bind(&commit_log::impl::maybe_sync, this));
+        _sync_timer.arm_periodic(std::chrono::seconds(1));
+    }
 
-    file_open_options opt;
-    opt.extent_allocation_size_hint = IO_EXTENT_ALLOCATION_SIZE;
-    return open_checked_file_dma(commit_error_handler, _file_name, open_flags::wo | open_flags::create, opt).then([this](file f) {
-        // xfs doesn't like files extended betond eof, so enlarge the file
-        _file = make_lw_shared<file>(std::move(f));
-        return _released_semaphore.wait().then([this] {
-            _current_buffer = this->make_flush_buffer();
-            return make_ready_future<>();
-        });
+    return find_segments().then([this] {
+        _ready = true;
+        replenish_segments();
     });
 }
+
+future<> commit_log::impl::ensure_initialized()
+{
+    if (!_initialized) {
+        _initialized = shared_future<>(initialize());
+    }
+    return _initialized->get_future();
+}
+
 lw_shared_ptr<flush_buffer> commit_log::impl::make_flush_buffer()
 {
-     auto b = ::memalign(OUTPUT_BUFFER_ALIGNMENT, FLUSH_BUFFER_SIZE);
-    // OUTPUT_BUFFER_ALIGNMENT, FLUSH_BUFFER_SIZE);
+     auto b = ::memalign(OUTPUT_BUFFER_ALIGNMENT, _options._segment_size);
      if (!b) {
          throw std::bad_alloc();
      }
-     auto s = FLUSH_BUFFER_SIZE;
-     return make_lw_shared<flush_buffer>(reinterpret_cast<char *>(b), s);
+     return make_lw_shared<flush_buffer>(reinterpret_cast<char *>(b), _options._segment_size);
 }
 
 future<> commit_log::impl::make_room_for_apending_mutation(size_t size)
 {
     if (!_current_buffer || _current_buffer->available_size() < size) {
         if (_current_buffer) {
-            _current_buffer->close();
-            _pending_buffers.emplace(_current_buffer);
-            _pending_semaphore.signal();
+            retire_current_buffer();
         }
         return _released_semaphore.wait().then([this] {
+            return next_segment();
+        }).then([this, size] (lw_shared_ptr<segment> s) {
+            if (_current_buffer) {
+                // another append installed a buffer meanwhile.
+                _reserve_segments.emplace_front(std::move(s));
+                _released_semaphore.signal();
+                return this->make_room_for_apending_mutation(size);
+            }
             if (!_released_buffers.empty()) {
                 _current_buffer = _released_buffers.front();
                 _released_buffers.pop();
@@ -250,40 +775,339 @@ future<> commit_log::impl::make_room_for_apending_mutation(size_t size)
             else {
                 _current_buffer = make_flush_buffer();
             }
+            s->_first_offset = _appended_bytes;
+            s->_end_offset = _appended_bytes;
+            s->_tailable = true;
+            _current_buffer->set_segment(s);
+            char* header = _current_buffer->get_current();
+            encode_fixed32(header, SEGMENT_MAGIC);
+            encode_fixed64(header + 4, s->_id);
+            encode_fixed32(header + 12, crc32c::mask(crc32c::value(header, 12)));
+            _current_buffer->skip(SEGMENT_HEADER_SIZE);
             return make_ready_future<>();
         });
     }
     return make_ready_future<>();
 }
 
-future<> commit_log::impl::append(lw_shared_ptr<mutation> m)
+future<> commit_log::impl::append(const mutation_record& r)
 {
-    if (!_file) {
-        return initialize().then([this, m = std::move(m)] {
-            return this->append(m);
+    auto size = r.serialized_size();
+    if (size + HEADER_SIZE + SEGMENT_HEADER_SIZE > _options._segment_size || size > std::numeric_limits<uint32_t>::max()) {
+        return make_exception_future<>(std::invalid_argument("mutation does not fit in a commit log segment"));
+    }
+    if (_ready && _current_buffer && _current_buffer->available_size() >= size + HEADER_SIZE) {
+        return with_gate(_gate, [this, &r, size] {
+            return write_record(r, size);
         });
     }
-    _gate.enter();
-    auto estimated_size = m->estimate_serialized_size() + HEADER_SIZE;
-    return make_room_for_apending_mutation(estimated_size).then([this, m, estimated_size] {
-        _current_buffer->enter();
-        // Format the header
-        char* header = _current_buffer->get_current();
-        // Fill the header later, because we need to compute the CRC32 of mutation.
-        _current_buffer->skip(HEADER_SIZE);
-        auto record = _current_buffer->get_current();
-        auto serialized_size = _current_buffer->write(m);
-        uint32_t crc = crc32c::extend(type_crc_[record_type::full], record, serialized_size);
-        crc = crc32c::mask(crc);
-        // [0-3] 4bytes for crc
-        encode_fixed32(header, crc);
-        header[4] = static_cast<char>(serialized_size & 0xff);
-        header[5] = static_cast<char>(serialized_size >> 8);
-        header[6] = static_cast<char>(record_type::full);
+    // The views of r do not outlive the call: waiting for a segment, the
+    // record is kept encoded.
+    auto encoded = make_lw_shared<bytes>(bytes::initialized_later(), size);
+    r.encode_to(encoded->begin());
+    return with_gate(_gate, [this, encoded, size] {
+        return ensure_initialized().then([this, size] {
+            return make_room_for_apending_mutation(size + HEADER_SIZE);
+        }).then([this, encoded, size] {
+            return write_record(mutation_record::encoded(bytes_view { encoded->data(), size }), size);
+        });
+    });
+}
+
+future<> commit_log::impl::write_record(const mutation_record& r, size_t size)
+{
+    // the header is filled once the crc of the record is known.
+    char* header = _current_buffer->get_current();
+    _current_buffer->skip(HEADER_SIZE);
+    auto record = _current_buffer->get_current();
+    _current_buffer->write(r, size);
+    uint32_t crc = crc32c::extend(_current_buffer->get_segment()->_crc_seed, record, size);
+    crc = crc32c::mask(crc);
+    encode_frame_header(header, crc, size, record_type::full);
+    _appended_bytes += HEADER_SIZE + size;
+    ++_appended_records;
+    if (_options._sync_mode == commit_log_sync_mode::always) {
+        return wait_for_sync(_appended_bytes);
+    }
+    return make_ready_future<>();
+}
+
+// The length of the whole records at the start of frames, at most max_bytes
+// of them unless the first one is longer.
+static size_t whole_records_size(const char* frames, size_t size, size_t max_bytes)
+{
+    size_t length = 0;
+    store::for_each_framed_record(frames, size, [&length, frames, max_bytes] (const char* record, size_t record_size) {
+        auto end = static_cast<size_t>(record - frames) + record_size;
+        if (length == 0 || end <= max_bytes) {
+            length = std::max(length, end);
+        }
+    });
+    return length;
+}
+
+future<log_records> commit_log::impl::read_records(uint64_t offset, size_t max_bytes)
+{
+    log_records r;
+    r._offset = offset;
+    if (offset >= _appended_bytes) {
+        r._available = offset == _appended_bytes;
+        return make_ready_future<log_records>(std::move(r));
+    }
+    // The segments of the buffers not yet recycled are read from memory.
+    auto from_buffer = [&r, offset, max_bytes] (flush_buffer& fb) {
+        auto& s = *fb.get_segment();
+        auto end = s._first_offset + fb.payload_size() - SEGMENT_HEADER_SIZE;
+        if (offset < s._first_offset || offset >= end) {
+            return false;
+        }
+        auto frames = fb.data() + SEGMENT_HEADER_SIZE + (offset - s._first_offset);
+        auto length = whole_records_size(frames, end - offset, max_bytes);
+        r._frames = temporary_buffer<char>(frames, length);
+        return true;
+    };
+    for (auto& fb : _pending_buffers) {
+        if (from_buffer(*fb)) {
+            return make_ready_future<log_records>(std::move(r));
+        }
+    }
+    if (_current_buffer && from_buffer(*_current_buffer)) {
+        return make_ready_future<log_records>(std::move(r));
+    }
+    for (auto& s : _completed_segments) {
+        if (s->_tailable && offset >= s->_first_offset && offset < s->_end_offset) {
+            return read_written_records(s, offset, max_bytes);
+        }
+    }
+    r._available = false;
+    return make_ready_future<log_records>(std::move(r));
+}
+
+future<lw_shared_ptr<segment_reader>> commit_log::impl::open_reader(lw_shared_ptr<segment> s, uint64_t position, uint64_t end)
+{
+    return open_checked_file_dma(commit_error_handler, s->_name, open_flags::ro).then([this, position, end] (file f) {
+        return f.size().then([this, f, position, end] (uint64_t size) mutable {
+            end = std::min<uint64_t>(end, align_down<uint64_t>(size, OUTPUT_BUFFER_ALIGNMENT));
+            auto depth = _options._read_ahead / _options._read_ahead_chunk;
+            return make_lw_shared<segment_reader>(std::move(f), position, end, _options._read_ahead_chunk, depth);
+        });
+    });
+}
+
+future<> commit_log::impl::reset_tail(lw_shared_ptr<segment> s, uint64_t position, uint64_t end)
+{
+    auto closed = _tail._reader ? _tail._reader->close() : make_ready_future<>();
+    _tail = tail_reader();
+    auto start = align_down<uint64_t>(position, OUTPUT_BUFFER_ALIGNMENT);
+    return closed.then([this, s, start, end] {
+        return open_reader(s, start, align_up<uint64_t>(end, OUTPUT_BUFFER_ALIGNMENT));
+    }).then([this, s, start] (lw_shared_ptr<segment_reader> r) {
+        _tail._segment = s;
+        _tail._segment_id = s->_id;
+        _tail._reader = std::move(r);
+        _tail._position = start;
+    });
+}
+
+future<log_records> commit_log::impl::read_written_records(lw_shared_ptr<segment> s, uint64_t offset, size_t max_bytes)
+{
+    // A replica pulls from where its last pull stopped, which the reader of
+    // the tail has read ahead. The bytes wanted cover the first record
+    // whatever its length, once its header is read. The CRCs are checked,
+    // as the segment may be recycled meanwhile.
+    return with_semaphore(_tail_lock, 1, [this, s, offset, max_bytes] {
+        auto position = SEGMENT_HEADER_SIZE + (offset - s->_first_offset);
+        auto end = SEGMENT_HEADER_SIZE + (s->_end_offset - s->_first_offset);
+        auto wanted = [this, position, end, max_bytes] {
+            uint64_t bytes = max_bytes + HEADER_SIZE;
+            if (_tail._data.size() >= HEADER_SIZE) {
+                bytes = std::max<uint64_t>(bytes, HEADER_SIZE + frame_record_length(_tail._data.get()));
+            }
+            return std::min<uint64_t>(end - position, bytes);
+        };
+        auto ready = make_ready_future<>();
+        if (_tail._segment != s || _tail._segment_id != s->_id || position < _tail._position || position > _tail._position + _tail._data.size()) {
+            ready = reset_tail(s, position, end);
+        }
+        return ready.then([this, position, wanted] {
+            _tail._data.trim_front(std::min<uint64_t>(position - _tail._position, _tail._data.size()));
+            _tail._position = position;
+            return do_until([this, wanted] { return _tail._data.size() >= wanted() || _tail._reader->done(); }, [this] {
+                return _tail._reader->next().then([this] (temporary_buffer<char> chunk) {
+                    if (_tail._data.empty()) {
+                        chunk.trim_front(std::min<uint64_t>(_tail._position % OUTPUT_BUFFER_ALIGNMENT, chunk.size()));
+                        _tail._data = std::move(chunk);
+                        return;
+                    }
+                    temporary_buffer<char> joined(_tail._data.size() + chunk.size());
+                    std::copy_n(_tail._data.get(), _tail._data.size(), joined.get_write());
+                    std::copy_n(chunk.get(), chunk.size(), joined.get_write() + _tail._data.size());
+                    _tail._data = std::move(joined);
+                });
+            });
+        }).then([this, s, offset, max_bytes, wanted] {
+            auto data = _tail._data.share(0, std::min<uint64_t>(wanted(), _tail._data.size()));
+            size_t valid = 0;
+            while (valid < data.size()) {
+                auto length = frame_length(*s, data.get() + valid, data.size() - valid, _options._segment_size);
+                if (length <= 0) {
+                    break;
+                }
+                valid += length;
+            }
+            log_records r;
+            r._offset = offset;
+            r._frames = std::move(data);
+            r._frames.trim(whole_records_size(r._frames.get(), valid, max_bytes));
+            r._available = r._frames.size() > 0;
+            return r;
+        });
+    });
+}
+
+bool commit_log::impl::split_records(const segment& s, temporary_buffer<char> chunk, partial_frame& partial, std::vector<temporary_buffer<char>>& records)
+{
+    // Records are shared with their chunk, but one straddling chunks is
+    // copied into a frame of its length as they are read, so that a large
+    // record is copied once.
+    auto header_size = s.frame_header_size();
+    auto max_size = _options._segment_size;
+    auto fill = [&partial, &chunk] (size_t offset, size_t size) {
+        auto n = std::min(chunk.size() - offset, size - partial._filled);
+        std::copy_n(chunk.get() + offset, n, partial._data.get_write() + partial._filled);
+        partial._filled += n;
+        return n;
+    };
+    size_t offset = 0;
+    if (partial._filled > 0) {
+        if (partial._filled < header_size) {
+            offset = fill(0, header_size);
+            if (partial._filled < header_size) {
+                return true;
+            }
+            auto size = frame_size(s, partial._data.get(), max_size);
+            if (size < 0) {
+                return false;
+            }
+            temporary_buffer<char> frame(size);
+            std::copy_n(partial._data.get(), header_size, frame.get_write());
+            partial._data = std::move(frame);
+        }
+        offset += fill(offset, partial._data.size());
+        if (partial._filled < partial._data.size()) {
+            return true;
+        }
+        auto length = frame_length(s, partial._data.get(), partial._data.size(), max_size);
+        if (length <= 0) {
+            return false;
+        }
+        records.emplace_back(partial._data.share(header_size, length - header_size));
+        _stats._replayed_bytes += length;
+        partial = partial_frame();
+    }
+    while (offset < chunk.size()) {
+        auto rest = chunk.size() - offset;
+        auto length = frame_length(s, chunk.get() + offset, rest, max_size);
+        if (length < 0) {
+            return false;
+        }
+        if (length == 0) {
+            auto size = rest < header_size ? ssize_t(header_size) : frame_size(s, chunk.get() + offset, max_size);
+            if (size < 0) {
+                return false;
+            }
+            partial._data = temporary_buffer<char>(size);
+            fill(offset, rest);
+            break;
+        }
+        records.emplace_back(chunk.share(offset + header_size, length - header_size));
+        _stats._replayed_bytes += length;
+        offset += length;
+    }
+    return true;
+}
+
+future<> commit_log::impl::apply_records(std::vector<temporary_buffer<char>> records, replay_func& func)
+{
+    _stats._replayed_records += records.size();
+    auto batch = _options._replay_batch_records;
+    if (records.size() <= batch) {
+        return records.empty() ? make_ready_future<>() : func(std::move(records));
+    }
+    return do_with(std::move(records), size_t(0), [&func, batch] (auto& records, size_t& done) {
+        return do_until([&records, &done] { return done >= records.size(); }, [&func, &records, &done, batch] {
+            auto first = records.begin() + done;
+            done = std::min(done + batch, records.size());
+            return func(std::vector<temporary_buffer<char>>(std::make_move_iterator(first), std::make_move_iterator(records.begin() + done)));
+        });
+    });
+}
+
+future<> commit_log::impl::replay_segment(lw_shared_ptr<segment> s, lw_shared_ptr<segment_reader> r, replay_func& func, std::function<void ()> read_next)
+{
+    // Stops at the first record which is not whole or fails its CRC: the
+    // zeros padding the tail, or what an earlier use of the file left. The
+    // next segment is read ahead once the reads of this one are issued.
+    return do_with(partial_frame(), true, std::move(read_next), [this, s, r, &func] (auto& partial, bool& first, auto& read_next) {
+        return repeat([this, s, r, &func, &partial, &first, &read_next] {
+            if (read_next && r->issued_all()) {
+                read_next();
+                read_next = nullptr;
+            }
+            return r->next().then([this, s, &func, &partial, &first] (temporary_buffer<char> chunk) {
+                if (chunk.empty()) {
+                    return make_ready_future<stop_iteration>(stop_iteration::yes);
+                }
+                if (first) {
+                    chunk.trim_front(std::min(SEGMENT_HEADER_SIZE, chunk.size()));
+                    first = false;
+                }
+                std::vector<temporary_buffer<char>> records;
+                auto more = this->split_records(*s, std::move(chunk), partial, records);
+                return this->apply_records(std::move(records), func).then([more] {
+                    return more ? stop_iteration::no : stop_iteration::yes;
+                });
+            });
+        }).then([&read_next] {
+            if (read_next) {
+                read_next();
+            }
+        });
     }).then([this] {
-        _current_buffer->leave();
-        _gate.leave();
-        return make_ready_future<>();
+        ++_stats._replayed_segments;
+    });
+}
+
+future<> commit_log::impl::replay(replay_func func)
+{
+    // Each segment is read in chunks, with the read-ahead of the options in
+    // flight, while the records of the chunks already read are applied.
+    return ensure_initialized().then([this, func = std::move(func)] () mutable {
+        auto segments = std::move(_replay_segments);
+        _stats._replay_segments = segments.size();
+        if (segments.empty()) {
+            return make_ready_future<>();
+        }
+        auto max = std::numeric_limits<uint64_t>::max();
+        auto next = make_lw_shared<future<lw_shared_ptr<segment_reader>>>(open_reader(segments[0], 0, max));
+        return do_with(std::move(segments), std::move(func), size_t(0), [this, next, max] (auto& segments, auto& func, size_t& i) {
+            return repeat([this, next, max, &segments, &func, &i] {
+                auto s = segments[i++];
+                auto current = std::move(*next);
+                auto read_next = [this, next, max, &segments, &i] {
+                    if (i < segments.size()) {
+                        *next = open_reader(segments[i], 0, max);
+                    }
+                };
+                return current.then([this, s, &func, read_next] (lw_shared_ptr<segment_reader> r) {
+                    return this->replay_segment(s, r, func, read_next).finally([r] {
+                        return r->close();
+                    });
+                }).then([&segments, &i] {
+                    return i < segments.size() ? stop_iteration::no : stop_iteration::yes;
+                });
+            });
+        });
     });
 }
 
@@ -291,6 +1115,19 @@ future<> commit_log::impl::close()
 {
     return _gate.close().then([this] {
         // flush all pending buffers to disk;
+        _shutdown = true;
+        _timer.cancel();
+        _sync_timer.cancel();
+        if (!_initialized) {
+            return make_ready_future<>();
+        }
+        return _syncing ? wait_for_sync(_appended_bytes) : sync();
+    }).then([this] {
+        return with_semaphore(_tail_lock, 1, [this] {
+            auto r = std::move(_tail._reader);
+            _tail = tail_reader();
+            return r ? r->close() : make_ready_future<>();
+        });
     });
 }
 
@@ -302,9 +1139,9 @@ commit_log::~commit_log()
 {
 }
 
-future<> commit_log::append(lw_shared_ptr<mutation> m)
+future<> commit_log::append(const mutation_record& r)
 {
-    return _impl->append(m);
+    return _impl->append(r);
 }
 
 future<> commit_log::close()
@@ -312,11 +1149,38 @@ future<> commit_log::close()
     return _impl->close();
 }
 
-lw_shared_ptr<commit_log> make_commit_log()
+const commit_log_stats& commit_log::stats() const
+{
+    return _impl->stats();
+}
+
+replay_position commit_log::position() const
+{
+    return _impl->position();
+}
+
+uint64_t commit_log::replication_offset() const
+{
+    return _impl->replication_offset();
+}
+
+future<log_records> commit_log::read_records(uint64_t offset, size_t max_bytes)
+{
+    return _impl->read_records(offset, max_bytes);
+}
+
+void commit_log::discard_segments_before(replay_position rp)
+{
+    _impl->discard_segments_before(rp);
+}
+
+future<> commit_log::replay(std::function<future<> (std::vector<temporary_buffer<char>> records)> func)
+{
+    return _impl->replay(std::move(func));
+}
+
+lw_shared_ptr<commit_log> make_commit_log(commit_log_options options)
 {
-    using clk = std::chrono::system_clock;
-    auto timestap = clk::now().time_since_epoch().count();
-    sstring filename = "commitlog-" + to_sstring(engine().cpu_id()) + "-" + to_sstring(timestap) + ".log";
-    return make_lw_shared<commit_log>(std::make_unique<commit_log::impl>(std::move(filename)));
+    return make_lw_shared<commit_log>(std::make_unique<commit_log::impl>(std::move(options)));
 }
 }
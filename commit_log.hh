@@ -1,15 +1,118 @@
 #pragma once
 #include "mutation.hh"
+#include "store/log_format.hh"
 #include "core/future.hh"
 #include "core/queue.hh"
 #include "core/semaphore.hh"
 #include "core/shared_ptr.hh"
 #include "core/sstring.hh"
+#include "core/temporary_buffer.hh"
 #include <queue>
+#include <functional>
+#include <string>
+#include <vector>
 namespace store {
 
 class flush_buffer;
 
+// When appended mutations reach the disk, as appendfsync of Redis:
+// - always: an append resolves once the fdatasync covering it completes.
+//   Concurrent appends are group committed, sharing one write and one sync.
+// - everysec: appends resolve at once, the log is written and synced every
+//   second.
+// - no: appends resolve at once, full buffers are written without a sync.
+enum class commit_log_sync_mode {
+    always,
+    everysec,
+    no,
+};
+
+// Parses "always", "everysec" or "no", throws std::invalid_argument on
+// other names.
+commit_log_sync_mode to_commit_log_sync_mode(const std::string& name);
+
+struct commit_log_stats {
+    uint64_t _syncs = 0;
+    uint64_t _synced_bytes = 0;
+    uint64_t _sync_latency_us = 0;
+    // The last sync: the bytes and the appends it covered, and how long it took.
+    uint64_t _last_sync_bytes = 0;
+    uint64_t _last_sync_appends = 0;
+    uint64_t _last_sync_latency_us = 0;
+    uint64_t _sync_waiters = 0;
+    uint64_t _created_segments = 0;
+    uint64_t _recycled_segments = 0;
+    // Progress of the replay at startup.
+    uint64_t _replay_segments = 0;
+    uint64_t _replayed_segments = 0;
+    uint64_t _replayed_records = 0;
+    uint64_t _replayed_bytes = 0;
+};
+
+struct commit_log_options {
+    commit_log_sync_mode _sync_mode = commit_log_sync_mode::everysec;
+    // Records go to segment files of this size, preallocated before they
+    // are used so that writes never extend a file.
+    size_t _segment_size = 32 * 1024 * 1024;
+    // Segments whose records are flushed are kept for reuse, up to this many.
+    size_t _max_recycled_segments = 4;
+    // The segments left by shards this run does not have, after the number
+    // of shards went down, are replayed by the shard of their number modulo
+    // smp::count, then removed.
+    bool _adopt_removed_shards = false;
+    // The replay and the replicas tailing written segments read them in
+    // chunks of this size, with up to _read_ahead bytes of them in flight.
+    size_t _read_ahead_chunk = 1024 * 1024;
+    size_t _read_ahead = 8 * 1024 * 1024;
+    // The replay passes the records to its function in batches of at most
+    // this many.
+    size_t _replay_batch_records = 256;
+};
+
+// Where the next record goes: records before it are in older segments or
+// before the offset of the segment.
+struct replay_position {
+    uint64_t _segment_id = 0;
+    size_t _offset = 0;
+};
+
+// Records of the log from a replication offset, framed as in its segments:
+// the header of HEADER_SIZE bytes, then the serialized mutation. Not
+// available when the offset is past the log or in a segment no longer kept,
+// such as with a restarted primary.
+struct log_records {
+    uint64_t _offset = 0;
+    temporary_buffer<char> _frames;
+    bool _available = true;
+};
+
+// Passes each framed record of `frames` to func, as the serialized mutation.
+template <typename Func>
+inline void for_each_framed_record(const char* frames, size_t size, Func&& func)
+{
+    size_t offset = 0;
+    while (offset + HEADER_SIZE <= size) {
+        auto header = frames + offset;
+        size_t record_size = frame_record_length(header);
+        if (offset + HEADER_SIZE + record_size > size) {
+            return;
+        }
+        func(header + HEADER_SIZE, record_size);
+        offset += HEADER_SIZE + record_size;
+    }
+}
+
+// Appends a serialized mutation to frames as for_each_framed_record reads
+// it. The checksum is left zero: the log seeds it per segment, and the
+// frames are only split by their lengths.
+inline void append_framed_record(bytes& frames, const char* record, size_t size)
+{
+    char header[HEADER_SIZE];
+    encode_frame_header(header, 0, size, record_type::full);
+    frames.append(header, HEADER_SIZE);
+    frames.append(record, size);
+}
+
 class commit_log {
     class impl;
     std::unique_ptr<impl> _impl;
@@ -18,10 +121,26 @@ public:
     ~commit_log();
     commit_log(const commit_log&) = delete;
     commit_log& operator = (const commit_log&) = delete;
-    future<> append(lw_shared_ptr<mutation> entry);
+    // Appends the record, whose views need not outlive the call.
+    future<> append(const mutation_record& r);
     future<> close();
-    friend lw_shared_ptr<commit_log> make_commit_log();
+    const commit_log_stats& stats() const;
+    replay_position position() const;
+    // The bytes of records appended by this run, the position replicas tail
+    // the log from.
+    uint64_t replication_offset() const;
+    // The whole records from offset, at least one when there is any, else at
+    // most max_bytes of them. Records not yet synced are read too.
+    future<log_records> read_records(uint64_t offset, size_t max_bytes);
+    // The records before rp are flushed into sstables: the segments holding
+    // only such records are recycled.
+    void discard_segments_before(replay_position rp);
+    // Passes the records left by earlier runs of this shard to func in
+    // batches, oldest first. Their segments are recycled by the first
+    // discard_segments_before after the replay.
+    future<> replay(std::function<future<> (std::vector<temporary_buffer<char>> records)> func);
+    friend lw_shared_ptr<commit_log> make_commit_log(commit_log_options options);
 };
 
-lw_shared_ptr<commit_log> make_commit_log();
+lw_shared_ptr<commit_log> make_commit_log(commit_log_options options = commit_log_options());
 }
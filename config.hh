@@ -450,6 +450,9 @@ public:
     val(storage_port, uint16_t, 7000, Used,                \
             "The port for inter-node communication."  \
     )                                                   \
+    val(shard_aware_storage_port, uint16_t, 0, Used,                \
+            "If non-zero, shard N also listens on shard_aware_storage_port + N for inter-node communication, and the commands forwarded to a node go to the shard owning their key. The nodes of the cluster must run as many shards."  \
+    )                                                   \
     /* Advanced automatic backup setting */ \
     val(auto_snapshot, bool, true, Used,     \
             "Enable or disable whether a snapshot is taken of the data before keyspace truncation or dropping of tables. To prevent data loss, using the default setting is strongly advised. If you set to false, you will lose data on truncation or drop."  \
@@ -551,6 +554,7 @@ public:
             "\n"    \
             "\tall: All traffic is compressed.\n"   \
             "\tdc : Traffic between data centers is compressed.\n"  \
+            "\tgossip : Gossip traffic is compressed, its digests grow with the cluster.\n"  \
             "\tnone : No compression."  \
     )   \
     val(inter_dc_tcp_nodelay, bool, false, Used,     \
@@ -784,6 +788,10 @@ public:
     val(ring_delay_ms, uint32_t, 30 * 1000, Used, "Time a node waits to hear from other nodes before joining the ring in milliseconds. Same as -Dcassandra.ring_delay_ms in cassandra.") \
     val(fd_max_interval_ms, uint32_t, 2 * 1000, Used, "The maximum failure_detector interval time in milliseconds. Interval larger than the maximum will be ignored. Larger cluster may need to increase the default.") \
     val(fd_initial_value_ms, uint32_t, 2 * 1000, Used, "The initial failure_detector interval time in milliseconds.") \
+    val(gossip_interval_ms, uint32_t, 1000, Used, "The period of the gossip rounds in milliseconds. The initial failure_detector interval is twice this.") \
+    val(gossip_ping_interval_ms, uint32_t, 100, Used, "How often every live peer is pinged directly in milliseconds, 0 to detect failures by the gossip rounds alone.") \
+    val(gossip_ping_misses_to_convict, uint32_t, 3, Used, "A peer missing this many direct pings in a row is marked down at once.") \
+    val(gossip_full_digest_rounds, uint32_t, 10, Used, "SYN messages to a peer carry only the endpoint digests changed since it acknowledged them, but every this many carry them all. 0 always sends them all.") \
     val(shutdown_announce_in_ms, uint32_t, 2 * 1000, Used, "Time a node waits after sending gossip shutdown message in milliseconds. Same as -Dcassandra.shutdown_announce_in_ms in cassandra.") \
     val(developer_mode, bool, false, Used, "Relax environment checks. Setting to true can reduce performance and reliability significantly.") \
     val(skip_wait_for_gossip_to_settle, int32_t, -1, Used, "An integer to configure the wait for gossip to settle. -1: wait normally, 0: do not wait at all, n: wait for at most n polls. Same as -Dcassandra.skip_wait_for_gossip_to_settle in cassandra.") \
@@ -41,6 +41,10 @@ i18n_xlat = {
         'debian': 'libboost-dev',
         'ubuntu': 'libboost-dev (libboost1.55-dev on 14.04)',
     },
+    'lua-devel': {
+        'debian': 'liblua5.3-dev',
+        'ubuntu': 'liblua5.3-dev',
+    },
 }
 
 def pkgname(name):
@@ -167,10 +171,17 @@ modes = {
 }
 
 scylla_tests = [
+    'tests/perf/perf_protocol_parser',
+    'tests/perf/perf_structures',
+    'tests/cache_test',
+    'tests/protocol_parser_test',
 ]
 
 apps = [
     'pedis',
+    'pedis_bench',
+    'pedis_replay',
+    'pedis_diff',
     ]
 
 tests = scylla_tests
@@ -235,6 +246,7 @@ scylla_core = ([
         'utils/large_bitset.cc',
         'utils/runtime.cc',
         'utils/murmur_hash.cc',
+        'utils/bloom_calculations.cc',
         'utils/uuid.cc',
         'utils/big_decimal.cc',
         'utils/types.cc',
@@ -244,6 +256,7 @@ scylla_core = ([
         'utils/file_lock.cc',
         'utils/dynamic_bitset.cc',
         'utils/managed_bytes.cc',
+        'utils/float_string.cc',
         'utils/exceptions.cc',
         'utils/unimplemented.cc',
         'utils/gc_clock.cc',
@@ -251,6 +264,7 @@ scylla_core = ([
         #'message/messaging_service.cc',
         'exceptions/exceptions.cc',
         #'idl/gossip_digest.idl.hh',
+        #'idl/replication.idl.hh',
         'release.cc',
         #'io/io.cc',
         #'gms/application_state.cc',
@@ -265,15 +279,34 @@ scylla_core = ([
         #'gms/inet_address.cc',
         'native_protocol_parser.cc',
         'protocol_parser.cc',
+        'redis_command_code.cc',
         'redis.cc',
         'server.cc',
+        'scripting.cc',
+        'pubsub.cc',
+        'unix_socket.cc',
+        'tracking.cc',
+        'keyspace_events.cc',
+        'tenants.cc',
+        'traffic_capture.cc',
+        'cpu_profiler.cc',
+        'current_operation.cc',
         'db.cc',
         'ragel_protocol_parser.rl',
         'structures/dict_lsa.cc',
         'structures/geo.cc',
         'structures/hll.cc',
         'structures/bits_operation.cc',
+        'structures/bitmap_lsa.cc',
         'structures/list_lsa.cc',
+        'structures/stream_lsa.cc',
+        'structures/timeseries_lsa.cc',
+        'structures/page_set.cc',
+        'structures/bloom_lsa.cc',
+        'structures/count_min_lsa.cc',
+        'structures/topk_lsa.cc',
+        'structures/key_index.cc',
+        'structures/field_expiry.cc',
         'cache.cc',
         'reply_builder.cc',
         'mutation.cc',
@@ -283,20 +316,34 @@ scylla_core = ([
         'store/priority_manager.cc',
         'utils/disk-error-handler.cc',
         'commit_log.cc',
+        'snapshot.cc',
+        'rdb.cc',
         #'ring.cc',
         #'proxy.cc',
+        #'hints.cc',
+        #'stream_manager.cc',
+        #'cluster.cc',
+        #'replication.cc',
+        #'repair.cc',
         #'service.cc',
         'partition.cc',
         'config.cc',
         'memtable.cc',
         'column_family.cc',
         #'init.cc',
-        #'token.cc',
+        'token.cc',
         'keys.cc',
-        #'store/table/block.cc',
-        #'store/table/table.cc',
-        #'store/table/block_builder.cc',
-        #'store/comparator.cc',
+        'store/table/block.cc',
+        'store/table/table.cc',
+        'store/table/filter_block.cc',
+        'store/table/block_cache.cc',
+        'store/table/compression.cc',
+        'store/filter_policy.cc',
+        'store/table/block_builder.cc',
+        'store/table/format.cc',
+        'store/table/table_builder.cc',
+        'store/dma_file_writer.cc',
+        'store/comparator.cc',
         #'store/util/coding.cc',
         #'store/column_family.cc',
                ]
@@ -319,12 +366,20 @@ scylla_tests_seastar_deps = [
 
 deps = {
     'pedis': ['main.cc'] + scylla_core + store + api,
+    'pedis_bench': ['bench/pedis_bench.cc'],
+    'pedis_replay': ['bench/pedis_replay.cc', 'store/util/coding.cc'],
+    'pedis_diff': ['bench/pedis_diff.cc'],
 }
 
+for t in scylla_tests:
+    deps[t] = [t + '.cc'] + scylla_tests_dependencies
+
 pure_boost_tests = set([
 ])
 
 tests_not_using_seastar_test_framework = set([
+    'tests/perf/perf_protocol_parser',
+    'tests/perf/perf_structures',
 ]) | pure_boost_tests
 
 for t in tests_not_using_seastar_test_framework:
@@ -474,6 +529,14 @@ libs = ' '.join(['-lyaml-cpp', '-llz4', '-lz', '-lsnappy', pkg_config("--libs",
                  maybe_static(args.staticboost, '-lboost_date_time'),
                 ])
 
+# Lua 5.3 of the scripts of EVAL, named differently by the distributions.
+lua_pkg = next((pkg for pkg in ['lua5.3', 'lua-5.3', 'lua'] if have_pkg(pkg)), None)
+if lua_pkg is None:
+    print('Lua 5.3 not installed.  Please install {}.'.format(pkgname("lua-devel")))
+    sys.exit(1)
+args.user_cflags += ' ' + pkg_config('--cflags', lua_pkg)
+libs += ' ' + pkg_config('--libs', lua_pkg)
+
 if not args.staticboost:
     args.user_cflags += ' -DBOOST_TEST_DYN_LINK'
 
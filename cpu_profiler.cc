@@ -0,0 +1,221 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#include "cpu_profiler.hh"
+#include "core/fstream.hh"
+#include "core/print.hh"
+#include "core/reactor.hh"
+#include "util/log.hh"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <system_error>
+#include <unordered_map>
+#include <sys/syscall.h>
+#include <unistd.h>
+namespace redis {
+
+using logger = seastar::logger;
+static logger profile_log ("profile");
+
+constexpr unsigned cpu_profiler::max_depth;
+constexpr size_t cpu_profiler::max_samples;
+constexpr unsigned cpu_profiler::max_hz;
+constexpr std::chrono::seconds cpu_profiler::max_duration;
+
+// The frames of the handler and of the signal trampoline, which every
+// sample starts with.
+static constexpr unsigned signal_frames = 2;
+
+// The profiler running on this thread, as the handler finds it.
+static thread_local cpu_profiler* running_profiler = nullptr;
+
+cpu_profiler::cpu_profiler()
+{
+    _end.set_callback([this] {
+        stop().handle_exception([] (std::exception_ptr ep) {
+            profile_log.warn("failed to write the profile: {}", ep);
+        });
+    });
+}
+
+cpu_profiler::~cpu_profiler()
+{
+    disarm();
+}
+
+void cpu_profiler::on_signal(int, siginfo_t*, void*)
+{
+    auto p = running_profiler;
+    if (!p) {
+        return;
+    }
+    auto saved_errno = errno;
+    size_t n = p->_taken;
+    if (n < p->_capacity) {
+        auto& s = p->_samples[n];
+        s._depth = ::backtrace(s._frames, max_depth);
+        p->_taken = n + 1;
+    }
+    else {
+        p->_dropped = p->_dropped + 1;
+    }
+    errno = saved_errno;
+}
+
+profile_stats cpu_profiler::stats() const
+{
+    if (!_samples) {
+        return _stats;
+    }
+    profile_stats s;
+    s._samples = _taken;
+    s._dropped = _dropped;
+    return s;
+}
+
+future<> cpu_profiler::start(profile_options options)
+{
+    return with_semaphore(_lock, 1, [this, options = std::move(options)] () mutable {
+        return finish().then([this, options = std::move(options)] () mutable {
+            _options = std::move(options);
+            _capacity = std::min<size_t>(max_samples, size_t(_options._hz) * (_options._duration.count() + 1));
+            _samples.reset(new sample[_capacity]);
+            _taken = 0;
+            _dropped = 0;
+            // backtrace() loads libgcc the first time, which the handler
+            // must not do.
+            void* frame;
+            ::backtrace(&frame, 1);
+            struct sigaction sa {};
+            sa.sa_sigaction = &cpu_profiler::on_signal;
+            sa.sa_flags = SA_SIGINFO | SA_RESTART;
+            sigemptyset(&sa.sa_mask);
+            if (::sigaction(SIGPROF, &sa, nullptr) != 0) {
+                throw std::system_error(errno, std::system_category(), "sigaction");
+            }
+            running_profiler = this;
+            struct sigevent sev {};
+            sev.sigev_notify = SIGEV_THREAD_ID;
+            sev.sigev_signo = SIGPROF;
+            sev._sigev_un._tid = ::syscall(SYS_gettid);
+            if (::timer_create(CLOCK_THREAD_CPUTIME_ID, &sev, &_timer) != 0) {
+                running_profiler = nullptr;
+                _samples.reset();
+                throw std::system_error(errno, std::system_category(), "timer_create");
+            }
+            struct itimerspec period {};
+            period.it_interval.tv_nsec = 1000000000 / _options._hz;
+            period.it_value = period.it_interval;
+            ::timer_settime(_timer, 0, &period, nullptr);
+            _active = true;
+            _end.arm(_options._duration);
+            profile_log.info("profiling at {} Hz for {} seconds", _options._hz, _options._duration.count());
+        });
+    });
+}
+
+void cpu_profiler::disarm()
+{
+    if (!_active) {
+        return;
+    }
+    ::timer_delete(_timer);
+    // a signal already sent finds no profiler.
+    running_profiler = nullptr;
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+    _active = false;
+    _end.cancel();
+}
+
+// `module+0xoffset`, of the file mapping the address.
+static sstring frame_name(void* address)
+{
+    Dl_info info;
+    if (::dladdr(address, &info) == 0 || info.dli_fname == nullptr) {
+        return sprint("[unknown]+0x%x", reinterpret_cast<uintptr_t>(address));
+    }
+    return sprint("%s+0x%x", info.dli_fname, reinterpret_cast<uintptr_t>(address) - reinterpret_cast<uintptr_t>(info.dli_fbase));
+}
+
+future<> cpu_profiler::write_out()
+{
+    _stats._samples = _taken;
+    _stats._dropped = _dropped;
+    // the stacks are counted by their frames, taken as a string.
+    std::unordered_map<sstring, uint64_t> stacks;
+    for (size_t i = 0; i < _taken; ++i) {
+        auto& s = _samples[i];
+        if (s._depth <= signal_frames) {
+            continue;
+        }
+        auto frames = reinterpret_cast<const char*>(s._frames + signal_frames);
+        ++stacks[sstring(frames, (s._depth - signal_frames) * sizeof(void*))];
+    }
+    std::unordered_map<void*, sstring> names;
+    sstring folded;
+    for (auto& stack : stacks) {
+        auto frames = reinterpret_cast<void* const*>(stack.first.data());
+        auto depth = stack.first.size() / sizeof(void*);
+        for (size_t i = depth; i-- > 0;) {
+            auto n = names.find(frames[i]);
+            if (n == names.end()) {
+                n = names.emplace(frames[i], frame_name(frames[i])).first;
+            }
+            folded += n->second;
+            folded += i > 0 ? ";" : " ";
+        }
+        folded += sprint("%u\n", stack.second);
+    }
+    auto name = sprint("%s/profile-%u.folded", _options._dir, engine().cpu_id());
+    return open_file_dma(name, open_flags::wo | open_flags::create | open_flags::truncate).then([folded = std::move(folded)] (file f) mutable {
+        return do_with(make_file_output_stream(std::move(f)), std::move(folded), [] (output_stream<char>& out, sstring& folded) {
+            return out.write(folded).then([&out] {
+                return out.flush();
+            }).finally([&out] {
+                return out.close();
+            });
+        });
+    }).then([this, name] {
+        profile_log.info("wrote {} samples to {}, {} dropped", _stats._samples, name, _stats._dropped);
+    });
+}
+
+future<> cpu_profiler::finish()
+{
+    if (!_samples) {
+        return make_ready_future<>();
+    }
+    disarm();
+    return write_out().finally([this] {
+        _samples.reset();
+        _capacity = 0;
+    });
+}
+
+future<> cpu_profiler::stop()
+{
+    return with_semaphore(_lock, 1, [this] {
+        return finish();
+    });
+}
+}
@@ -0,0 +1,97 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#pragma once
+#include "core/future.hh"
+#include "core/semaphore.hh"
+#include "core/sstring.hh"
+#include "core/timer.hh"
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <memory>
+#include <signal.h>
+namespace redis {
+using namespace seastar;
+
+struct profile_options {
+    sstring _dir = ".";
+    unsigned _hz = 99;
+    std::chrono::seconds _duration { 30 };
+};
+
+struct profile_stats {
+    uint64_t _samples = 0;
+    // Samples taken past the capacity of the buffer.
+    uint64_t _dropped = 0;
+};
+
+// A sampling profiler of the reactor thread of one shard, as PROFILE START
+// asks. A timer of the CPU time of the thread sends it SIGPROF _hz times a
+// second, and the handler copies the stack into a buffer allocated up front,
+// taking no lock and allocating nothing. Once _duration is over, or PROFILE
+// STOP, the stacks are counted and written to "profile-<shard>.folded" as
+// folded stacks of `module+0xoffset` frames, the root first, which
+// dist/common/scripts/pedis_symbolize_profile.py resolves offline.
+class cpu_profiler {
+public:
+    static constexpr unsigned max_depth = 48;
+    static constexpr size_t max_samples = 32 * 1024;
+    static constexpr unsigned max_hz = 1000;
+    static constexpr std::chrono::seconds max_duration { 600 };
+private:
+    struct sample {
+        uint32_t _depth;
+        void* _frames[max_depth];
+    };
+    profile_options _options;
+    // Of the last profile written.
+    profile_stats _stats;
+    std::unique_ptr<sample[]> _samples;
+    size_t _capacity = 0;
+    // Written by the signal handler, on this thread.
+    volatile size_t _taken = 0;
+    volatile size_t _dropped = 0;
+    bool _active = false;
+    timer_t _timer {};
+    timer<> _end;
+    // Start and stop take the buffer in turn.
+    semaphore _lock { 1 };
+
+    static void on_signal(int, siginfo_t*, void*);
+    void disarm();
+    future<> write_out();
+    future<> finish();
+public:
+    cpu_profiler();
+    cpu_profiler(const cpu_profiler&) = delete;
+    cpu_profiler& operator = (const cpu_profiler&) = delete;
+    ~cpu_profiler();
+
+    bool active() const { return _active; }
+    // Of the profile running, else of the last one.
+    profile_stats stats() const;
+
+    // Ends the profile running, if any, and starts one.
+    future<> start(profile_options options);
+    // Ends the profile and writes it.
+    future<> stop();
+};
+}
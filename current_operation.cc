@@ -0,0 +1,63 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#include "current_operation.hh"
+#include "request_wrapper.hh"
+#include "store/util/logging.hh"
+#include "core/print.hh"
+#include "util/log.hh"
+#include <utility>
+namespace redis {
+
+using logger = seastar::logger;
+static logger stall_log ("stall");
+
+constexpr size_t operation::max_key_bytes;
+
+operation operation_of(const request_wrapper& req)
+{
+    if (req._args_count == 0 || family_of(req._command_code) == command_family::none || req.fragmented(0)) {
+        return operation(req._command_code, bytes_view {});
+    }
+    return operation(req._command_code, req.arg_view(0));
+}
+
+void stall_monitor::report(const operation& op, clock_type::duration d)
+{
+    ++_stalls[static_cast<size_t>(op._command)];
+    ++_total;
+    auto now = clock_type::now();
+    if (now - _last_report < std::chrono::seconds(1)) {
+        ++_suppressed;
+        return;
+    }
+    _last_report = now;
+    auto suppressed = std::exchange(_suppressed, 0);
+    auto escaped = store::escape_string(op.key());
+    auto key = sstring(escaped.data(), escaped.size());
+    if (op.truncated()) {
+        key += sprint("... (%u bytes)", op._key_size);
+    }
+    auto name = to_command_name(op._command);
+    stall_log.warn("reactor stalled for {} us in {} '{}', a collection of {} elements{}",
+        std::chrono::duration_cast<std::chrono::microseconds>(d).count(), name ? name : "unknown", key, op._elements,
+        suppressed ? sprint(", %u more stalls since the last report", suppressed) : sstring());
+}
+}
@@ -0,0 +1,205 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#pragma once
+#include "redis_command_code.hh"
+#include "core/memory.hh"
+#include "utils/bytes.hh"
+#include "seastarx.hh"
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+namespace redis {
+struct request_wrapper;
+
+// What a shard is running: the command, the start of its key, and the
+// elements of the collection it last looked up, see cache::lookup_and_touch().
+// Small enough to go along with the calls to the owner of the key.
+struct operation {
+    static constexpr size_t max_key_bytes = 40;
+
+    command_code _command = command_code::unknown;
+    uint8_t _key_bytes = 0;
+    // The size of the whole key, of which _key holds the first _key_bytes.
+    uint32_t _key_size = 0;
+    uint32_t _elements = 0;
+    char _key[max_key_bytes];
+
+    operation() = default;
+    operation(command_code command, bytes_view key)
+        : _command(command)
+        , _key_bytes(static_cast<uint8_t>(std::min(key.size(), max_key_bytes)))
+        , _key_size(static_cast<uint32_t>(key.size()))
+    {
+        std::memcpy(_key, key.data(), _key_bytes);
+    }
+
+    bytes_view key() const { return bytes_view { _key, _key_bytes }; }
+    bool truncated() const { return _key_size > _key_bytes; }
+};
+
+// The command of the request, and its first argument when it works on data.
+operation operation_of(const request_wrapper& req);
+
+// The operation running on this shard, set by operation_scope for the
+// synchronous part of the handler on the shard of the connection, and of
+// the call on the owner of the key, as current_family().
+inline operation& current_operation()
+{
+    static thread_local operation op;
+    return op;
+}
+
+// The commands which held the reactor of one shard for at least the
+// threshold without yielding. Seastar's own detector knows only the stack,
+// so each of them is logged with the command, its key and the size of its
+// collection, at most once per second, and counted by command.
+class stall_monitor {
+public:
+    using clock_type = std::chrono::steady_clock;
+    static constexpr size_t commands = static_cast<size_t>(command_code::max);
+private:
+    // 0 disables it, the operations are then not timed.
+    std::chrono::microseconds _threshold { 0 };
+    std::array<uint64_t, commands> _stalls {};
+    uint64_t _total = 0;
+    clock_type::time_point _last_report {};
+    // Stalls not logged since the last report.
+    uint64_t _suppressed = 0;
+
+    void report(const operation& op, clock_type::duration d);
+public:
+    void set_threshold(std::chrono::microseconds threshold) { _threshold = threshold; }
+    std::chrono::microseconds threshold() const { return _threshold; }
+    bool enabled() const { return _threshold.count() > 0; }
+
+    void check(const operation& op, clock_type::duration d)
+    {
+        if (d >= _threshold) {
+            report(op, d);
+        }
+    }
+
+    uint64_t stalls(command_code command) const { return _stalls[static_cast<size_t>(command)]; }
+    uint64_t total() const { return _total; }
+};
+
+inline stall_monitor& local_stall_monitor()
+{
+    static thread_local stall_monitor monitor;
+    return monitor;
+}
+
+// The allocations of one in every _period operations of a shard, by
+// command, from the counters of the seastar allocator: the calls to malloc,
+// and the memory taken net of what was freed meanwhile. The values of the
+// cache are allocated in its region, which takes whole segments, and are
+// mostly left out.
+class allocation_sampler {
+public:
+    static constexpr size_t commands = static_cast<size_t>(command_code::max);
+    struct command_allocations {
+        uint64_t _samples = 0;
+        uint64_t _allocations = 0;
+        uint64_t _bytes = 0;
+    };
+private:
+    // 0 disables it.
+    uint32_t _period = 0;
+    uint32_t _countdown = 0;
+    std::array<command_allocations, commands> _commands {};
+public:
+    void set_period(uint32_t period)
+    {
+        _period = period;
+        _countdown = period;
+    }
+    uint32_t period() const { return _period; }
+
+    bool sample()
+    {
+        if (_period == 0 || --_countdown > 0) {
+            return false;
+        }
+        _countdown = _period;
+        return true;
+    }
+
+    void record(command_code command, uint64_t allocations, int64_t bytes)
+    {
+        auto& c = _commands[static_cast<size_t>(command)];
+        ++c._samples;
+        c._allocations += allocations;
+        c._bytes += static_cast<uint64_t>(std::max<int64_t>(bytes, 0));
+    }
+
+    const command_allocations& of(command_code command) const { return _commands[static_cast<size_t>(command)]; }
+};
+
+inline allocation_sampler& local_allocation_sampler()
+{
+    static thread_local allocation_sampler sampler;
+    return sampler;
+}
+
+// Makes `op` the current operation until its destruction. The outermost
+// scope of a shard times it for the stall monitor, and accounts its
+// allocations when the allocation sampler picks it.
+class operation_scope {
+    operation _previous;
+    stall_monitor::clock_type::time_point _start;
+    uint64_t _mallocs = 0;
+    size_t _allocated = 0;
+    bool _timed;
+    bool _sampled;
+public:
+    explicit operation_scope(const operation& op)
+        : _previous(current_operation())
+        , _timed(_previous._command == command_code::unknown && local_stall_monitor().enabled())
+        , _sampled(_previous._command == command_code::unknown && local_allocation_sampler().sample())
+    {
+        current_operation() = op;
+        if (_sampled) {
+            auto stats = memory::stats();
+            _mallocs = stats.mallocs();
+            _allocated = stats.allocated_memory();
+        }
+        if (_timed) {
+            _start = stall_monitor::clock_type::now();
+        }
+    }
+    ~operation_scope()
+    {
+        if (_timed) {
+            local_stall_monitor().check(current_operation(), stall_monitor::clock_type::now() - _start);
+        }
+        if (_sampled) {
+            auto stats = memory::stats();
+            local_allocation_sampler().record(current_operation()._command, stats.mallocs() - _mallocs,
+                static_cast<int64_t>(stats.allocated_memory()) - static_cast<int64_t>(_allocated));
+        }
+        current_operation() = _previous;
+    }
+    operation_scope(const operation_scope&) = delete;
+    operation_scope& operator = (const operation_scope&) = delete;
+};
+}
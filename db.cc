@@ -20,15 +20,32 @@
 */
 #include "db.hh"
 #include <random>
+#include <array>
 #include <chrono>
+#include <cstring>
 #include <algorithm>
+#include <limits>
+#include <unordered_set>
 #include "util/log.hh"
 #include "core/metrics.hh"
 #include "core/sleep.hh"
+#include "core/memory.hh"
 #include "structures/hll.hh"
 #include "types.hh"
-//using logger =  seastar::logger;
-//static logger db_log ("db");
+#include "utils/string_match.hh"
+#include "utils/float_string.hh"
+#include "store/table/block_cache.hh"
+#include "utils/murmur_hash.hh"
+#include "core/fstream.hh"
+#include <boost/range/irange.hpp>
+#include <ctime>
+#include <stdexcept>
+#include "snapshot.hh"
+#include "rdb.hh"
+#include "tracking.hh"
+#include "keyspace_events.hh"
+using logger =  seastar::logger;
+static logger db_log ("db");
 
 namespace redis {
 
@@ -63,19 +80,130 @@ private:
 
 distributed<database> _databases;
 
-database::database()
-    : _stat()
-    , _sys_cf(make_lw_shared<store::column_family>("SYSTEM", true))
-    , _data_cf(make_lw_shared<store::column_family>("DATA", false))
+namespace {
+uint64_t entry_digest(const cache_entry& e);
+}
+
+// 40 random hex digits, as the replication ids of Redis.
+static sstring make_replication_id()
+{
+    std::random_device rd;
+    std::uniform_int_distribution<uint32_t> dist;
+    sstring id;
+    for (int i = 0; i < 5; ++i) {
+        id += sprint("%08x", dist(rd));
+    }
+    return id;
+}
+
+// The number of shards of the data files, in decimal, then `tags` since
+// keys go to the shard of their hash tag, see shard_of_key().
+static const sstring data_shards_file = "SHARDS";
+static const sstring data_shards_layout = "tags";
+
+future<unsigned> load_data_shards()
+{
+    return engine().file_exists(data_shards_file).then([] (bool exists) {
+        if (!exists) {
+            return make_ready_future<unsigned>(0);
+        }
+        return open_file_dma(data_shards_file, open_flags::ro).then([] (file f) {
+            return f.size().then([f] (uint64_t size) mutable {
+                auto in = make_lw_shared<input_stream<char>>(make_file_input_stream(std::move(f)));
+                return in->read_exactly(size).then([in] (temporary_buffer<char> buf) {
+                    return in->close().then([buf = std::move(buf)] {
+                        auto text = sstring(buf.get(), buf.size());
+                        char* end = nullptr;
+                        auto shards = static_cast<unsigned>(std::strtoul(text.c_str(), &end, 10));
+                        // keys of the files of an older layout may be on any
+                        // shard, which then moves them as when resharding.
+                        return std::strstr(end, data_shards_layout.c_str()) == nullptr ? 0u : shards;
+                    });
+                });
+            });
+        });
+    });
+}
+
+future<> save_data_shards(unsigned shards)
+{
+    // written aside then renamed, a crash leaves the old count or the new.
+    auto temporary = data_shards_file + ".tmp";
+    return open_file_dma(temporary, open_flags::wo | open_flags::create | open_flags::truncate).then([shards] (file f) {
+        auto out = make_lw_shared<output_stream<char>>(make_file_output_stream(std::move(f)));
+        return out->write(to_sstring(shards) + " " + data_shards_layout + "\n").then([out] {
+            return out->flush();
+        }).then([out] {
+            return out->close();
+        }).finally([out] {});
+    }).then([temporary] {
+        return rename_file(temporary, data_shards_file);
+    }).then([] {
+        return open_directory(".");
+    }).then([] (file dir) {
+        return do_with(std::move(dir), [] (file& dir) {
+            return dir.flush().then([&dir] {
+                return dir.close();
+            });
+        });
+    });
+}
+
+static store::column_family_options make_column_family_options(const database_options& options, logalloc::region_group& memtable_group)
+{
+    store::column_family_options cf_options;
+    cf_options._memtable_group = &memtable_group;
+    cf_options._hot_compression = options._sstable_compression;
+    cf_options._cold_compression = options._sstable_cold_compression;
+    cf_options._block_hash_index = options._sstable_hash_index;
+    cf_options._writer._buffer_size = options._sstable_write_buffer_size;
+    cf_options._writer._write_behind = options._sstable_write_behind;
+    cf_options._max_subcompactions = std::max(options._max_subcompactions, 1u);
+    if (options._compaction_throughput) {
+        cf_options._compaction_throughput = std::max<size_t>(options._compaction_throughput / smp::count, 1);
+    }
+    cf_options._adaptive_compaction = options._adaptive_compaction;
+    cf_options._read_latency_target_us = options._read_latency_target_us;
+    return cf_options;
+}
+
+// The memory limits of a shard, see database_options::_memory_soft_limit.
+static std::pair<size_t, size_t> shard_memory_limits(const database_options& options)
+{
+    auto shard_memory = memory::stats().total_memory();
+    auto hard = options._memory_hard_limit ? options._memory_hard_limit / smp::count : shard_memory / 4 * 3;
+    auto soft = options._memory_soft_limit ? options._memory_soft_limit / smp::count : shard_memory / 2;
+    return { hard, std::min(soft, hard) };
+}
+
+database::database(database_options options)
+    : dirty_memory_manager(shard_memory_limits(options).first, shard_memory_limits(options).second)
+    , logalloc::region(dirty_memory_manager::region_group())
+    , _options(options)
+    , _stat()
+    , _sys_cf(make_lw_shared<store::column_family>("SYSTEM", true, make_column_family_options(options, dirty_memory_manager::region_group())))
+    , _data_cf(make_lw_shared<store::column_family>("DATA", false, make_column_family_options(options, dirty_memory_manager::region_group())))
     , _flush_cache(0)
     , _shutdown(false)
 {
     using namespace std::chrono;
 
-    _cache.set_expired_entry_releaser([this] (cache_entry& e) {
-         with_allocator(allocator(), [this, &e] {
+    _cache.set_allocator(allocator());
+    _cache.set_region(*this);
+    _cache.set_expired_entry_releaser([this] (cache_entry& e, bool lazily) {
+         // the cache releases the expired entries lazily, the evicted ones
+         // at once.
+         auto& events = local_keyspace_events();
+         if (events.wants(lazily ? event_expired : event_evicted)) {
+             events.notify(lazily ? "expired" : "evicted", e.key_data(), e.key_size());
+         }
+         with_allocator(allocator(), [this, &e, lazily] {
              auto type = e.type();
-             if (_cache.erase(e)) {
+             // an expired entry may hide an older version in the store.
+             if (lazily && _cache.hinted(e.key_hash())) {
+                 _cache.mark_deleted(bytes { e.key_data(), e.key_size() });
+             }
+             if (lazily ? _cache.erase_lazily(e) : _cache.erase(e)) {
                  switch (type) {
                      case data_type::numeric:
                      case data_type::int64:
@@ -99,13 +227,98 @@ database::database()
                      case data_type::hll:
                          --_stat._total_hll_entries;
                          break;
+                     case data_type::stream:
+                         --_stat._total_stream_entries;
+                         break;
+                     case data_type::timeseries:
+                         --_stat._total_timeseries_entries;
+                         break;
+                     case data_type::bloom:
+                         --_stat._total_bloom_entries;
+                         break;
+                     case data_type::cms:
+                         --_stat._total_cms_entries;
+                         break;
+                     case data_type::topk:
+                         --_stat._total_topk_entries;
+                         break;
                      default:
                          break;
                  }
              }
          });
     });
-    _commit_log = store::make_commit_log();
+    if (options._eviction_policy != eviction_policy::noeviction) {
+        auto max_memory = options._max_memory ? options._max_memory / smp::count : std::numeric_limits<size_t>::max();
+        _cache.set_eviction_policy(options._eviction_policy, max_memory, [this] {
+            return occupancy().used_space() + cache_entry::shared_value_bytes();
+        });
+        // Let LSA evict entries as well when the shard runs out of memory.
+        make_evictable([this] {
+            return with_allocator(allocator(), [this] {
+                return _cache.evict_one() ? memory::reclaiming_result::reclaimed_something : memory::reclaiming_result::reclaimed_nothing;
+            });
+        });
+    }
+    store::commit_log_options commit_log_options;
+    commit_log_options._sync_mode = options._commit_log_sync_mode;
+    commit_log_options._segment_size = options._commit_log_segment_size;
+    commit_log_options._max_recycled_segments = options._commit_log_recycled_segments;
+    commit_log_options._adopt_removed_shards = resharding();
+    commit_log_options._read_ahead = options._commit_log_read_ahead;
+    commit_log_options._replay_batch_records = REPLAY_BATCH_RECORDS;
+    _commit_log = store::make_commit_log(commit_log_options);
+    _replication_id = make_replication_id();
+    _cache.set_digester(entry_digest);
+    _cache.set_copy_invalidator([this] (const cache_entry& e) {
+        if (_copy_invalidator) {
+            _copy_invalidator(bytes { e.key_data(), e.key_size() });
+        }
+    });
+    _cache.set_field_ttl_dropper([this] (const cache_entry& e) {
+        _field_expiry.drop_key(bytes { e.key_data(), e.key_size() });
+    });
+    _field_expiry.set_releaser([this] (const bytes& key, const bytes& field) {
+        remove_expired_fields(redis_key { bytes { key } }, std::vector<bytes> { field });
+    });
+    _cache.set_watch_notifier([this] (const cache_entry& e) {
+        auto i = _watched_keys.find(bytes { e.key_data(), e.key_size() });
+        if (i == _watched_keys.end()) {
+            return false;
+        }
+        ++i->second._version;
+        return true;
+    });
+    _cache.set_tracking_notifier([this] (const cache_entry& e) {
+        invalidate_tracked(bytes { e.key_data(), e.key_size() });
+    });
+    _cache.set_retired_entry_releaser([this] (const cache_entry& e) {
+        // the store and the log forget the key as its entry is released,
+        // unless it was written again since the flush.
+        bytes key { e.key_data(), e.key_size() };
+        _cache.mark_deleted(key);
+        _commit_log->append(mutation_record::deleted(bytes_view { key.data(), key.size() })).handle_exception([] (std::exception_ptr) {});
+        if (!_tracking_prefixes.empty()) {
+            invalidate_tracked(key);
+        }
+    });
+    store::local_block_cache().set_capacity(options._block_cache_size / smp::count);
+    if (options._tiered_storage) {
+        _cache.set_lower_tier(*_data_cf, options._tiered_hint_bytes / smp::count);
+    }
+    if (options._key_index) {
+        _cache.enable_key_index();
+    }
+    set_reclaim([this] { reclaim_memory(); });
+    if (options._tiered_storage && options._warmup_keys > 0) {
+        // the heat map is of the LFU counters.
+        _cache.set_track_frequency(true);
+    }
+    if (options._key_sampling) {
+        _cache.set_track_frequency(true);
+        _key_sampling_timer.set_callback([this] { sample_keys(); });
+        _key_sampling_timer.arm_periodic(std::chrono::milliseconds(100));
+    }
     setup_metrics();
 }
 
@@ -113,9 +326,25 @@ future<> database::initialize()
 {
     assert(_sys_cf);
     assert(_data_cf);
+    // before the snapshots and the log are loaded, and traffic accepted.
+    if (_options._expected_keys > 0) {
+        _cache.presize(_options._expected_keys);
+    }
+    if (_options._memory_reserve > 0) {
+        auto segments = _options._memory_reserve / logalloc::segment_size;
+        auto reserved = logalloc::shard_tracker().prefault_segments(segments);
+        if (reserved < segments) {
+            db_log.warn("reserved {} of the {} LSA segments asked for", reserved, segments);
+        }
+    }
     repeat([this] {
         return _flush_cache.wait().then([this] {
-            return _cache.flush_dirty_entry(*_data_cf).then([this] {
+            // the memtable is not durable: the commit log keeps its
+            // segments until the memtable is written to sstables.
+            return utils::local_work_scheduler().run(utils::work_class::background, [this] {
+                return _cache.flush_dirty_entry(*_data_cf);
+            }).then([this] {
+                maybe_flush_memtable();
                 return _shutdown ? stop_iteration::yes : stop_iteration::no;
             });
         });
@@ -125,1200 +354,5424 @@ future<> database::initialize()
     if (!_shutdown) {
         _flush_timer.arm(std::chrono::milliseconds(8000));
     }
-    return make_ready_future<>();
+    // After a change in the number of shards, the sstables are resharded
+    // before the log is replayed: they hold the older versions.
+    return _data_cf->populate(resharding()).then([this] {
+        if (!resharding()) {
+            return make_ready_future<>();
+        }
+        return _data_cf->reshard([] (const bytes& key) {
+            return shard_of_key(bytes_view { key.data(), key.size() }, smp::count) == engine().cpu_id();
+        }, [this] (std::vector<bytes> records) {
+            return move_records(std::move(records));
+        });
+    }).then([this] {
+        // the keys of the sstables of an earlier run are not in the hint.
+        if (_cache.tiered() && _data_cf->has_sstables()) {
+            _cache.hint_all_demoted();
+        }
+        return replay_commit_log();
+    }).then([this] {
+        _data_cf->start_compaction();
+    });
 }
 
-void database::on_timer()
+void database::maybe_flush_memtable()
 {
-    if (_cache.should_flush_dirty_entry()) {
-        _flush_cache.signal();
-    }
-    if (!_shutdown) {
-        _flush_timer.arm(std::chrono::milliseconds(8000));
+    if (_data_cf->active_memtable()->occupancy().used_space() < _options._memtable_flush_size) {
+        return;
     }
+    // in the background: the dirty entries keep going to the new memtable.
+    // A failed flush is logged by the column family.
+    _data_cf->flush_memtable().handle_exception([] (std::exception_ptr) {});
 }
 
-database::~database()
+void database::reclaim_memory()
 {
-    with_allocator(allocator(), [this] {
-        _cache.flush_all();
-    });
+    ++_pressure_stats._reclaims;
+    auto block_cache_capacity = _options._block_cache_size / smp::count;
+    if (over_soft_limit()) {
+        // one memtable at a time: sealing each round would leave a trail of
+        // tiny sstables behind the flush in progress.
+        if (_data_cf->immutable_memtables() == 0 && !_data_cf->active_memtable()->empty()) {
+            ++_pressure_stats._flushes;
+            _data_cf->flush_memtable().handle_exception([] (std::exception_ptr) {});
+        }
+        // the block cache gives back half of its blocks, they can be read
+        // again; the cache only evicts when its policy allows it.
+        store::local_block_cache().set_capacity(block_cache_capacity / 2);
+        if (_options._eviction_policy != eviction_policy::noeviction) {
+            with_allocator(allocator(), [this] {
+                for (size_t i = 0; i < RECLAIM_EVICTIONS && over_soft_limit() && _cache.evict_one(); ++i) {
+                    ++_pressure_stats._evictions;
+                }
+            });
+        }
+    }
+    else {
+        store::local_block_cache().set_capacity(block_cache_capacity);
+    }
+    if (under_pressure() != _writes_throttled) {
+        _writes_throttled = under_pressure();
+        if (_writes_throttled) {
+            ++_pressure_stats._throttles;
+        }
+        if (_write_throttle_listener) {
+            _write_throttle_listener(_writes_throttled);
+        }
+    }
+    if (over_soft_limit() || _writes_throttled) {
+        rearm_reclaim(std::chrono::milliseconds(RECLAIM_INTERVAL_MS));
+    }
 }
 
-size_t database::sum_expiring_entries()
+future<> database::wait_for_memory()
 {
-    return _cache.expiring_size();
+    return dirty_memory_manager::wait_for_memory(lowres_clock::now() + _options._write_throttle_timeout);
 }
 
-void database::setup_metrics()
+uint64_t database::watch(redis_key rk)
 {
-    namespace sm = seastar::metrics;
-    _metrics.add_group("db", {
-        sm::make_counter("read", [this] { return _stat._read; }, sm::description("Total number of read operations.")),
-        sm::make_counter("hit", [this] { return _stat._hit; }, sm::description("Total number of the read hit.")),
-        sm::make_counter("total_counter_entries", [this] { return _stat._total_counter_entries; }, sm::description("Total of counter entries.")),
-        sm::make_counter("total_string_entries", [this] { return _stat._total_string_entries; }, sm::description("Total of string entries.")),
-        sm::make_counter("total_dict_entries", [this] { return _stat._total_dict_entries; }, sm::description("Total of dict entries.")),
-        sm::make_counter("total_list_entries", [this] { return _stat._total_list_entries; }, sm::description("Total of list entries.")),
-        sm::make_counter("total_set_entries", [this] { return _stat._total_set_entries; }, sm::description("Total of set entries.")),
-        sm::make_counter("total_sorted_set_entries", [this] { return _stat._total_zset_entries; }, sm::description("Total of sorted set entries.")),
-        sm::make_counter("total_hll_entries", [this] { return _stat._total_hll_entries; }, sm::description("Total of hyperloglog entries.")),
-        sm::make_counter("total_expiring_entries", [this] { return sum_expiring_entries(); }, sm::description("Total of expiring entries.")),
-    });
+    auto& w = _watched_keys[rk.key()];
+    ++w._watchers;
+    _cache.watch(rk);
+    _cache.set_watching(true);
+    return w._version;
+}
 
-    _metrics.add_group("op", {
-        sm::make_counter("echo", [this] { return _stat._echo; }, sm::description("ECHO")),
-        sm::make_counter("set", [this] { return _stat._set; }, sm::description("SET")),
-        sm::make_counter("get", [this] { return _stat._get; }, sm::description("GET")),
-        sm::make_counter("del", [this] { return _stat._del; }, sm::description("DEL")),
-        sm::make_counter("mset", [this] { return _stat._mset; }, sm::description("MSET")),
-        sm::make_counter("mget", [this] { return _stat._mget; }, sm::description("MGET")),
-        sm::make_counter("strlen", [this] { return _stat._strlen; }, sm::description("STRLEN")),
-        sm::make_counter("exists", [this] { return _stat._exists; }, sm::description("EXISTS")),
-        sm::make_counter("append", [this] { return _stat._append; }, sm::description("APPEND")),
-        sm::make_counter("lpush", [this] { return _stat._lpush; }, sm::description("LPUSH")),
-        sm::make_counter("lpushx", [this] { return _stat._lpushx; }, sm::description("LPUSHX")),
-        sm::make_counter("lpop", [this] { return _stat._lpop; }, sm::description("LPOP")),
-        sm::make_counter("rpop", [this] { return _stat._rpop; }, sm::description("RPOP")),
-        sm::make_counter("lindex", [this] { return _stat._lindex; }, sm::description("LINDEX")),
-        sm::make_counter("llen", [this] { return _stat._llen; }, sm::description("LLEN")),
-        sm::make_counter("linsert", [this] { return _stat._linsert; }, sm::description("LINSERT")),
-        sm::make_counter("lrange", [this] { return _stat._lrange; }, sm::description("LRANGE")),
-        sm::make_counter("lset", [this] { return _stat._lset; }, sm::description("LSET")),
-        sm::make_counter("ltrim", [this] { return _stat._ltrim; }, sm::description("LTRIM")),
-        sm::make_counter("lrem", [this] { return _stat._lrem; }, sm::description("LREM")),
-        sm::make_counter("counter", [this] { return _stat._counter; }, sm::description("DECR")),
-        sm::make_counter("hdel", [this] { return _stat._hdel; }, sm::description("HDEL")),
-        sm::make_counter("hexists", [this] { return _stat._hexists; }, sm::description("HEXISTS")),
-        sm::make_counter("hset", [this] { return _stat._hset; }, sm::description("HSET")),
-        sm::make_counter("hmset", [this] { return _stat._hmset; }, sm::description("HMSET")),
-        sm::make_counter("hincrby", [this] { return _stat._hincrby; }, sm::description("HINCR")),
-        sm::make_counter("hincrbyfloat", [this] { return _stat._hincrbyfloat; }, sm::description("HINCRBYFLOAT")),
-        sm::make_counter("hlen", [this] { return _stat._hlen; }, sm::description("HLEN")),
-        sm::make_counter("hstrlen", [this] { return _stat._hstrlen; }, sm::description("HSTRLEN")),
-        sm::make_counter("hgetall", [this] { return _stat._hgetall; }, sm::description("HGETALL")),
-        sm::make_counter("hgetallkeys", [this] { return _stat._hgetall_keys; }, sm::description("HGETALLKEYS")),
-        sm::make_counter("hgetallvalues", [this] { return _stat._hgetall_values; }, sm::description("HGETALLVALUES")),
-        sm::make_counter("hmget", [this] { return _stat._hmget; }, sm::description("HMGET")),
-        sm::make_counter("smembers", [this] { return _stat._smembers; }, sm::description("SMEMBERS")),
-        sm::make_counter("sadd", [this] { return _stat._sadd; }, sm::description("SADD")),
-        sm::make_counter("scard", [this] { return _stat._scard; }, sm::description("SCARD")),
-        sm::make_counter("sismember", [this] { return _stat._sismember; }, sm::description("SISMEMBER")),
-        sm::make_counter("srem", [this] { return _stat._srem; }, sm::description("SREM")),
-        sm::make_counter("sdiff", [this] { return _stat._sdiff; }, sm::description("SDIFF")),
-        sm::make_counter("sdiffstore", [this] { return _stat._sdiff_store; }, sm::description("SDIFFSTORE")),
-        sm::make_counter("sinter", [this] { return _stat._sinter; }, sm::description("SINTER")),
-        sm::make_counter("sinterstore", [this] { return _stat._sinter_store; }, sm::description("SINTERSTORE")),
-        sm::make_counter("sunion", [this] { return _stat._sunion; }, sm::description("SUNION")),
-        sm::make_counter("sunionstore", [this] { return _stat._sunion_store; }, sm::description("SUNIONSTORE")),
-        sm::make_counter("smove", [this] { return _stat._smove; }, sm::description("SMOVE")),
-        sm::make_counter("srandmember", [this] { return _stat._srandmember; }, sm::description("SRANDMEMBER")),
-        sm::make_counter("spop", [this] { return _stat._spop; }, sm::description("SPOP")),
-        sm::make_counter("type", [this] { return _stat._type; }, sm::description("TYPE")),
-        sm::make_counter("expire", [this] { return _stat._expire; }, sm::description("EXPIRE")),
-        sm::make_counter("pexpire", [this] { return _stat._pexpire; }, sm::description("PEXPIRE")),
-        sm::make_counter("ttl", [this] { return _stat._ttl; }, sm::description("TTL")),
-        sm::make_counter("pttl", [this] { return _stat._pttl; }, sm::description("PTTL")),
-        sm::make_counter("persist", [this] { return _stat._persist; }, sm::description("PERSIST")),
-        sm::make_counter("zadd", [this] { return _stat._zadd; }, sm::description("ZADD")),
-        sm::make_counter("zcard", [this] { return _stat._zcard; }, sm::description("ZCARD")),
-        sm::make_counter("zrange", [this] { return _stat._zrange; }, sm::description("ZRANGE")),
-        sm::make_counter("zrangebyscore", [this] { return _stat._zrangebyscore; }, sm::description("ZRANGEBYSCORE")),
-        sm::make_counter("zcount", [this] { return _stat._zcount; }, sm::description("ZCOUNT")),
-        sm::make_counter("zincrby", [this] { return _stat._zincrby; }, sm::description("ZINCRBY")),
-        sm::make_counter("zrank", [this] { return _stat._zrank; }, sm::description("ZRANK")),
-        sm::make_counter("zrem", [this] { return _stat._zrem; }, sm::description("ZREM")),
-        sm::make_counter("zscore", [this] { return _stat._zscore; }, sm::description("ZSCORE")),
-        sm::make_counter("zremrangebyscore", [this] { return _stat._zremrangebyscore; }, sm::description("ZREMRANGEBYSCORE")),
-        sm::make_counter("zremrangebyrank", [this] { return _stat._zremrangebyrank; }, sm::description("ZREMRANGEBYRANK")),
-        sm::make_counter("zdiffstore", [this] { return _stat._zdiffstore; }, sm::description("ZDIFFSTORE")),
-        sm::make_counter("zunionstore", [this] { return _stat._zunionstore; }, sm::description("ZUNIONSTORE")),
-        sm::make_counter("zinterstore", [this] { return _stat._zinterstore; }, sm::description("ZINTERSTORE")),
-        sm::make_counter("zdiff", [this] { return _stat._zdiff; }, sm::description("ZDIFF")),
-        sm::make_counter("zunion", [this] { return _stat._zunion; }, sm::description("ZUNION")),
-        sm::make_counter("zinter", [this] { return _stat._zinter; }, sm::description("ZINTER")),
-        sm::make_counter("zrangebylex", [this] { return _stat._zrangebylex; }, sm::description("ZRANGEBYLEX")),
-        sm::make_counter("zlexcount", [this] { return _stat._zlexcount; }, sm::description("ZLEXCOUNT")),
-        sm::make_counter("select", [this] { return _stat._select; }, sm::description("SELECT")),
-        sm::make_counter("geoadd", [this] { return _stat._geoadd; }, sm::description("GEOADD")),
-        sm::make_counter("geodist", [this] { return _stat._geodist; }, sm::description("GEODIST")),
-        sm::make_counter("geohash", [this] { return _stat._geohash; }, sm::description("GEOHASH")),
-        sm::make_counter("geopos", [this] { return _stat._geopos; }, sm::description("GEOPOS")),
-        sm::make_counter("georadius", [this] { return _stat._georadius; }, sm::description("GEORADIUS")),
-        sm::make_counter("setbit", [this] { return _stat._setbit; }, sm::description("SETBIT")),
-        sm::make_counter("getbit", [this] { return _stat._getbit; }, sm::description("GETBIT")),
-        sm::make_counter("bitcount", [this] { return _stat._bitcount; }, sm::description("BITCOUNT")),
-        sm::make_counter("bitop", [this] { return _stat._bitop; }, sm::description("BITOP")),
-        sm::make_counter("bitpos", [this] { return _stat._bitpos; }, sm::description("BITPOS")),
-        sm::make_counter("bitfield", [this] { return _stat._bitfield; }, sm::description("BITFIELD")),
-        sm::make_counter("pfadd", [this] { return _stat._pfadd; }, sm::description("PFADD")),
-        sm::make_counter("pfcount", [this] { return _stat._pfcount; }, sm::description("PFCOUNT")),
-        sm::make_counter("pfmerge", [this] { return _stat._pfmerge; }, sm::description("PFMERGE")),
-     });
+void database::unwatch(std::vector<bytes> keys)
+{
+    for (auto& key : keys) {
+        auto i = _watched_keys.find(key);
+        if (i != _watched_keys.end() && --i->second._watchers == 0) {
+            _watched_keys.erase(i);
+        }
+    }
+    // the entries of keys no longer watched forget it once they change.
+    _cache.set_watching(!_watched_keys.empty());
 }
 
-bool database::set_direct(redis_key rk, bytes val, long expired, uint32_t flag)
+void database::track(std::vector<bytes> keys, uint64_t client)
 {
-    ++_stat._set;
-    return with_allocator(allocator(), [this, rk = std::move(rk), val = std::move(val), expired, flag] {
-        auto entry = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), val);
-        bool result = true;
-        if (_cache.insert_if(entry, expired, flag & FLAG_SET_NX, flag & FLAG_SET_XX)) {
-            ++_stat._total_string_entries;
+    for (auto& key : keys) {
+        auto i = _tracked_keys.find(key);
+        if (i == _tracked_keys.end()) {
+            if (_tracked_keys.size() >= MAX_TRACKED_KEYS) {
+                auto evicted = _tracked_keys.begin()->first;
+                invalidate_tracked(evicted);
+            }
+            i = _tracked_keys.emplace(key, std::vector<uint64_t> {}).first;
         }
-        else {
-            result = false;
-            current_allocator().destroy<cache_entry>(entry);
+        auto& clients = i->second;
+        if (std::find(clients.begin(), clients.end(), client) == clients.end()) {
+            clients.push_back(client);
         }
-        return result;
-    });
+        _cache.track(redis_key { key });
+    }
+    _cache.set_tracking(!_tracked_keys.empty(), !_tracking_prefixes.empty());
 }
 
-future<scattered_message_ptr> database::set(redis_key rk, bytes val, long expired, uint32_t flag)
+void database::track_prefixes(std::vector<bytes> prefixes, uint64_t client, bool on)
 {
-    // First, append the operation commitlog.
-    // Second, update the data-structures in the cache, reply message to client.
-    // Third, flush dirty data in the cache to memtable periodically.
-    // Then, flush memtable to disk when some conditions are statisfied.
-    //
-    ++_stat._set;
-    auto m = make_bytes_mutation(rk.key(), val, expired, flag);
-    return _commit_log->append(m).then([this, rk = std::move(rk), val = std::move(val), expired, flag] {
-        return with_allocator(allocator(), [this, rk = std::move(rk), val = std::move(val), expired, flag] {
-            auto entry = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), val);
-            bool result = true;
-            if (_cache.insert_if(entry, expired, flag & FLAG_SET_NX, flag & FLAG_SET_XX)) {
-                ++_stat._total_string_entries;
+    if (on) {
+        if (prefixes.empty()) {
+            prefixes.emplace_back();
+        }
+        for (auto& prefix : prefixes) {
+            auto& clients = _tracking_prefixes[prefix];
+            if (std::find(clients.begin(), clients.end(), client) == clients.end()) {
+                clients.push_back(client);
             }
-            else {
-                result = false;
-                current_allocator().destroy<cache_entry>(entry);
-            }
-            return reply_builder::build(result ? msg_ok : msg_nil);
-        });
-    });
+        }
+    }
+    else {
+        for (auto i = _tracking_prefixes.begin(); i != _tracking_prefixes.end(); ) {
+            auto& clients = i->second;
+            clients.erase(std::remove(clients.begin(), clients.end(), client), clients.end());
+            i = clients.empty() ? _tracking_prefixes.erase(i) : std::next(i);
+        }
+    }
+    _cache.set_tracking(!_tracked_keys.empty(), !_tracking_prefixes.empty());
 }
 
-future<bool> database::del_direct(redis_key rk)
+void database::invalidate_tracked(const bytes& key)
 {
-    ++_stat._del;
-    auto m = make_deleted_mutation(rk.key());
-    return _commit_log->append(m).then([this, rk = std::move(rk)] {
-        return _cache.run_with_entry(rk, [this] (cache_entry* e) {
-            if (!e) return false;
-            if (e->type_of_bytes()) {
-                --_stat._total_string_entries;
-            }
-            else if (e->type_of_set()) {
-                --_stat._total_set_entries;
-            }
-            else if (e->type_of_list()) {
-                --_stat._total_list_entries;
-            }
-            else if (e->type_of_map()) {
-                --_stat._total_dict_entries;
+    auto i = _tracked_keys.find(key);
+    if (i != _tracked_keys.end()) {
+        auto clients = std::move(i->second);
+        _tracked_keys.erase(i);
+        local_tracking().invalidate(clients, key);
+    }
+    if (!_tracking_prefixes.empty()) {
+        // the prefixes of the key sort before it, each one at most once.
+        std::vector<uint64_t> clients;
+        for (auto& p : _tracking_prefixes) {
+            if (key < p.first) {
+                break;
             }
-            else if (e->type_of_sset()) {
-                --_stat._total_zset_entries;
+            if (key.size() < p.first.size() || !std::equal(p.first.begin(), p.first.end(), key.begin())) {
+                continue;
             }
-            else if (e->type_of_hll()) {
-                --_stat._total_hll_entries;
+            for (auto id : p.second) {
+                if (std::find(clients.begin(), clients.end(), id) == clients.end()) {
+                    clients.push_back(id);
+                }
             }
-            else {
-                --_stat._total_counter_entries;
+        }
+        local_tracking().invalidate(clients, key);
+    }
+    _cache.set_tracking(!_tracked_keys.empty(), !_tracking_prefixes.empty());
+}
+
+bool database::watched_unchanged(std::vector<std::pair<bytes, uint64_t>> versions) const
+{
+    for (auto& v : versions) {
+        auto i = _watched_keys.find(v.first);
+        if (i == _watched_keys.end() || i->second._version != v.second) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool database::hold_transaction_writes(std::vector<std::pair<bytes, uint64_t>> versions)
+{
+    if (!watched_unchanged(std::move(versions))) {
+        return false;
+    }
+    _held_writes.emplace();
+    return true;
+}
+
+bool database::release_transaction_writes(std::vector<std::pair<bytes, uint64_t>> versions)
+{
+    if (_held_writes) {
+        _held_writes->set_value();
+        _held_writes = {};
+    }
+    // only the changes the hold does not stop, expiry, eviction and
+    // replication, come between the two checks.
+    return watched_unchanged(std::move(versions));
+}
+
+future<> database::replay_commit_log()
+{
+    return _commit_log->replay([this] (std::vector<temporary_buffer<char>> records) {
+        auto moved = apply_replayed(records);
+        if (!moved.empty()) {
+            return move_records(std::move(moved));
+        }
+        return later();
+    });
+}
+
+std::vector<bytes> database::apply_replayed(std::vector<temporary_buffer<char>>& records)
+{
+    // One allocating section for the batch. If it runs out of memory it
+    // resumes from the record it failed on: applying those before it again
+    // would count their entries twice.
+    std::vector<bytes> moved;
+    size_t foreign = 0;
+    size_t next = 0;
+    with_allocator(allocator(), [this, &records, &moved, &foreign, &next] {
+        _replay_section(*this, [this, &records, &moved, &foreign, &next] {
+            for (; next < records.size(); ++next) {
+                auto& r = records[next];
+                decoded_mutation m;
+                try {
+                    m = decode_mutation(bytes_view { r.get(), r.size() });
+                } catch (const std::out_of_range&) {
+                    continue;
+                }
+                if (shard_of_key(m._key, smp::count) != engine().cpu_id()) {
+                    if (resharding()) {
+                        moved.emplace_back(r.get(), r.size());
+                    }
+                    ++foreign;
+                    continue;
+                }
+                apply_decoded(m);
             }
-            return with_allocator(allocator(), [this, e] {
-                auto result =  _cache.erase(*e);
-                return result;
-            });
         });
     });
+    ++_stat._replayed_batches;
+    _stat._replayed_mutations += records.size() - foreign;
+    if (!resharding()) {
+        _stat._dropped_foreign_records += foreign;
+    }
+    records.clear();
+    return moved;
 }
 
-future<scattered_message_ptr> database::del(redis_key rk)
+future<> database::move_records(std::vector<bytes> records)
 {
-    ++_stat._del;
-    auto m = make_deleted_mutation(rk.key());
-    return _commit_log->append(m).then([this, rk = std::move(rk)] {
-        return _cache.run_with_entry(rk, [this] (cache_entry* e) {
-            if (!e) return reply_builder::build(msg_zero);
-            if (e->type_of_bytes()) {
-                --_stat._total_string_entries;
-            }
-            else if (e->type_of_set()) {
-                --_stat._total_set_entries;
-            }
-            else if (e->type_of_list()) {
-                --_stat._total_list_entries;
-            }
-            else if (e->type_of_map()) {
-                --_stat._total_dict_entries;
-            }
-            else if (e->type_of_sset()) {
-                --_stat._total_zset_entries;
-            }
-            else if (e->type_of_hll()) {
-                --_stat._total_hll_entries;
-            }
-            else {
-                --_stat._total_counter_entries;
+    // The records of a shard keep their order, each batch is applied before
+    // the next one is sent.
+    std::vector<bytes> frames(smp::count);
+    for (auto& r : records) {
+        decoded_mutation m;
+        try {
+            m = decode_mutation(bytes_view { r.data(), r.size() });
+        } catch (const std::out_of_range&) {
+            continue;
+        }
+        auto cpu = shard_of_key(m._key, smp::count);
+        store::append_framed_record(frames[cpu], r.data(), r.size());
+    }
+    _stat._moved_records += records.size();
+    return do_with(std::move(frames), [] (auto& frames) {
+        return parallel_for_each(boost::irange<unsigned>(0, smp::count), [&frames] (unsigned cpu) {
+            if (frames[cpu].empty()) {
+                return make_ready_future<>();
             }
-            return with_allocator(allocator(), [this, e] {
-                auto result =  _cache.erase(*e);
-                return reply_builder::build(result ? msg_one : msg_zero);
+            return get_database().invoke_on(cpu, [frames = std::move(frames[cpu])] (database& db) mutable {
+                return db.apply_replicated(std::move(frames)).discard_result();
             });
         });
     });
 }
 
-bool database::exists_direct(redis_key rk)
+static long unix_time_ms()
 {
-    ++_stat._exists;
-    return _cache.exists(rk);
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
 }
 
-future<scattered_message_ptr> database::exists(redis_key rk)
+// The expiry a record of a write with this ttl carries with FLAG_EXPIRE_AT:
+// a ttl would start again at each replay of the log. 0 if it never expires.
+static long record_deadline(long ttl)
 {
-    ++_stat._exists;
-    auto result = _cache.exists(rk);
-    return reply_builder::build(result ? msg_one : msg_zero);
+    return ttl == 0 ? 0 : std::max<long>(unix_time_ms() + ttl, 1);
 }
 
-future<scattered_message_ptr> database::counter_by(redis_key rk, int64_t step, bool incr)
+// The ttl of the record in milliseconds, 0 if it never expires and
+// negative once it expired.
+static long record_ttl(const decoded_mutation& m)
 {
-    ++_stat._counter;
-    return with_allocator(allocator(), [this, rk = std::move(rk), step, incr] {
-        auto e = _cache.find(rk);
-        if (!e) {
-            // not exists
-            auto entry = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), int64_t{step});
-            _cache.replace(entry);
-            ++_stat._total_counter_entries;
-            return reply_builder::build<false, true>(entry);
-        }
-        if (!e->type_of_integer()) {
-            return reply_builder::build(msg_type_err);
-        }
-        if (incr) {
-            e->value_integer_incr(step);
+    if (!(m._flag & FLAG_EXPIRE_AT) || m._expire == 0) {
+        return m._expire;
+    }
+    auto now = unix_time_ms();
+    return m._expire > now ? m._expire - now : -1;
+}
+
+void database::apply_decoded(const decoded_mutation& m)
+{
+    redis_key rk { bytes { m._key.data(), m._key.size() } };
+    auto ttl = record_ttl(m);
+    if (m._type == data_type::bytes && ttl < 0) {
+        erase_entry(rk);
+    }
+    else if (m._type == data_type::bytes) {
+        type_memory::scope accounting(_cache.memory_by_type(), data_type::bytes);
+        auto entry = make_string(rk, m._value);
+        if (_cache.insert_if(entry, ttl, m._flag & FLAG_SET_NX, m._flag & FLAG_SET_XX, m._flag & FLAG_SET_KEEPTTL)) {
+            ++_stat._total_string_entries;
         }
         else {
-            e->value_integer_incr(-step);
+            current_allocator().destroy<cache_entry>(entry);
         }
-        return reply_builder::build<false, true>(e);
-    });
+    }
+    else if (m._type == data_type::deleted) {
+        erase_entry(rk);
+    }
+    else if (m._type == data_type::dict) {
+        apply_field_change(rk, m);
+    }
+    else if (m._type == expiry_record_type && ttl == 0) {
+        _cache.never_expired(rk);
+    }
+    else if (m._type == expiry_record_type && ttl < 0) {
+        erase_entry(rk);
+    }
+    else if (m._type == expiry_record_type) {
+        _cache.expire(rk, ttl);
+    }
 }
 
-future<scattered_message_ptr> database::append(redis_key rk, bytes val)
+void database::apply_field_change(const redis_key& rk, const decoded_mutation& m)
 {
-    ++_stat._append;
-    return with_allocator(allocator(), [this, rk = std::move(rk), val = std::move(val)] {
-        auto e = _cache.find(rk);
+    type_memory::scope accounting(_cache.memory_by_type(), data_type::dict);
+    auto e = _cache.find(rk);
+    if (e && !e->type_of_map()) {
+        return;
+    }
+    bytes field { m._field.data(), m._field.size() };
+    if (m._op == mutation_op::field_del) {
         if (!e) {
-            // not exists
-            auto entry = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), val);
-            _cache.replace(entry);
-            ++_stat._total_string_entries;
-            return reply_builder::build(val.size());
+            return;
         }
-        if (!e->type_of_bytes()) {
-            return reply_builder::build(msg_type_err);
+        bool empty = e->with_dict([&field] (auto& map) {
+            map.erase(field);
+            return map.empty();
+        });
+        if (empty) {
+            --_stat._total_dict_entries;
+            _cache.erase(rk);
+        }
+        return;
+    }
+    if (!e) {
+        e = make_dict(rk, false);
+    }
+    maybe_unpack(e, 1, std::max(field.size(), m._value.size()));
+    e->with_dict([&field, &m] (auto& map) {
+        switch (m._op) {
+        case mutation_op::field_set:
+            map.put(field, bytes { m._value.data(), m._value.size() });
+            break;
+        case mutation_op::field_set_integer:
+            map.put(field, m._integer);
+            break;
+        case mutation_op::field_set_float:
+            map.put(field, m._float);
+            break;
+        default:
+            break;
         }
-        size_t new_size = e->value_bytes_size() + val.size();
-        auto data = std::unique_ptr<bytes_view::value_type[]>(new bytes_view::value_type[new_size]);
-        std::copy_n(e->value_bytes_data(), e->value_bytes_size(), data.get());
-        std::copy_n(val.data(), val.size(), data.get() + e->value_bytes_size());
-        auto new_value = current_allocator().construct<managed_bytes>(data.get(), new_size);
-        auto& old_value = e->value_bytes();
-        current_allocator().destroy<managed_bytes>(&old_value);
-        e->value_bytes() = std::move(*new_value);
-        return reply_builder::build(new_size);
     });
 }
 
-future<scattered_message_ptr> database::get(redis_key rk)
+future<scattered_message_ptr> database::log_change(const mutation_record& r, future<scattered_message_ptr> reply)
 {
-    ++_stat._read;
-    ++_stat._get;
-    return _cache.run_with_entry(rk, [this] (const cache_entry* e) {
-       if (e && e->type_of_bytes() == false) {
-           return reply_builder::build(msg_type_err);
-       }
-       else {
-           if (e != nullptr) ++_stat._hit;
-           return reply_builder::build<false, true>(e);
-       }
+    return _commit_log->append(r).then([reply = std::move(reply)] () mutable {
+        return std::move(reply);
     });
 }
 
-future<scattered_message_ptr> database::strlen(redis_key rk)
+future<reply_value> database::log_exchange(const mutation_record& r, bool changed, reply_value reply)
 {
-    ++_stat._strlen;
-    return _cache.run_with_entry(rk, [] (const cache_entry* e) {
-        if (e) {
-            if (e->type_of_bytes()) {
-                return reply_builder::build(e->value_bytes_size());
-            }
-            return reply_builder::build(msg_type_err);
-        }
-        return reply_builder::build(msg_zero);
+    if (!changed) {
+        return make_ready_future<reply_value>(std::move(reply));
+    }
+    return _commit_log->append(r).then([reply = std::move(reply)] () mutable {
+        return std::move(reply);
     });
 }
 
-future<scattered_message_ptr> database::type(redis_key rk)
+future<reply_value> database::log_volatile(const redis_key& rk, bool shadowed, reply_value reply)
 {
-    ++_stat._type;
-    auto e = _cache.find(rk);
-    if (!e) {
-
-        return reply_builder::build(msg_type_none);
+    if (!shadowed) {
+        return make_ready_future<reply_value>(std::move(reply));
     }
-    auto type = e->type_name();
-    return reply_builder::build(type);
+    // the store and the log drop the version the entry replaced, which
+    // would otherwise come back with a restart or a fault in.
+    _cache.mark_deleted(rk.key());
+    return _commit_log->append(mutation_record::deleted(bytes_view { rk.key().data(), rk.key().size() })).then([reply = std::move(reply)] () mutable {
+        return std::move(reply);
+    });
 }
 
-future<scattered_message_ptr> database::expire(redis_key rk, long expired)
+template <typename Reply>
+future<Reply> database::log_changes(const std::vector<mutation_record>& records, future<Reply> reply)
 {
-    ++_stat._expire;
-    auto result = _cache.expire(rk, expired);
-    return reply_builder::build(result ? msg_one : msg_zero);
+    // the appends copy the records at once, the vector may go.
+    return parallel_for_each(records, [this] (const mutation_record& r) {
+        return _commit_log->append(r);
+    }).then([reply = std::move(reply)] () mutable {
+        return std::move(reply);
+    });
 }
 
-future<scattered_message_ptr> database::persist(redis_key rk)
+future<> database::fault_in(std::vector<bytes> keys)
 {
-    ++_stat._persist;
-    auto result = _cache.never_expired(rk);
-    return reply_builder::build(result ? msg_one : msg_zero);
+    std::vector<redis_key> demoted;
+    for (auto& key : keys) {
+        redis_key rk { std::move(key) };
+        if (_cache.may_be_demoted(rk)) {
+            demoted.push_back(std::move(rk));
+        }
+    }
+    if (demoted.empty()) {
+        return make_ready_future<>();
+    }
+    if (demoted.size() > 1) {
+        // the keys of an MGET, or of another command of several keys, in
+        // one multi_read: those sharing a data block read it once, and
+        // neighbouring blocks are read together.
+        return do_with(std::move(demoted), [this] (auto& demoted) {
+            return repeat([this, &demoted] {
+                _tier_stats._reads += demoted.size();
+                auto flushes = _cache.deletion_flushes();
+                std::vector<redis::decorated_key> keys;
+                keys.reserve(demoted.size());
+                for (auto& rk : demoted) {
+                    keys.push_back(to_decorated_key(rk));
+                }
+                return _data_cf->multi_read(keys).then([this, &demoted, flushes] (std::vector<bytes_opt> records) {
+                    if (_cache.deletion_flushes() != flushes) {
+                        return stop_iteration::no;
+                    }
+                    for (size_t i = 0; i < records.size(); ++i) {
+                        if (records[i]) {
+                            promote(demoted[i], bytes_view { records[i]->data(), records[i]->size() });
+                        }
+                    }
+                    return stop_iteration::yes;
+                });
+            });
+        });
+    }
+    return do_with(std::move(demoted), [this] (auto& demoted) {
+        return parallel_for_each(demoted, [this] (const redis_key& rk) {
+            // read again if a deletion reached the store during the read, it
+            // may have missed it.
+            return repeat([this, &rk] {
+                ++_tier_stats._reads;
+                auto flushes = _cache.deletion_flushes();
+                return _data_cf->read(to_decorated_key(rk)).then([this, &rk, flushes] (bytes_opt record) {
+                    if (_cache.deletion_flushes() != flushes) {
+                        return stop_iteration::no;
+                    }
+                    if (record) {
+                        promote(rk, bytes_view { record->data(), record->size() });
+                    }
+                    return stop_iteration::yes;
+                });
+            });
+        });
+    });
 }
 
-future<scattered_message_ptr> database::push(redis_key rk, bytes val, bool force, bool left)
+void database::promote(const redis_key& rk, bytes_view record)
 {
-    left ? ++_stat._lpush : ++_stat._rpush;
-    return with_allocator(allocator(), [this, rk = std::move(rk), val = std::move(val), force, left] () {
-        auto e = _cache.find(rk);
-        if (!e) {
-             if (!force) {
+    decoded_mutation m;
+    try {
+        m = decode_mutation(record);
+    } catch (const std::out_of_range&) {
+        return;
+    }
+    auto ttl = record_ttl(m);
+    if (m._type != data_type::bytes || ttl < 0 || !_cache.may_be_demoted(rk)) {
+        return;
+    }
+    with_allocator(allocator(), [this, &rk, &m, ttl] {
+        type_memory::scope accounting(_cache.memory_by_type(), data_type::bytes);
+        auto entry = make_string(rk, m._value);
+        if (_cache.insert_if(entry, ttl, true, false)) {
+            _cache.mark_clean(*entry);
+            ++_stat._total_string_entries;
+            ++_tier_stats._promotions;
+        }
+        else {
+            current_allocator().destroy<cache_entry>(entry);
+        }
+    });
+}
+
+future<store::log_records> database::read_replication_log(sstring replica, uint64_t offset, size_t max_bytes)
+{
+    // A replica pulls from where it has applied everything before.
+    auto& progress = _replicas[replica];
+    progress._offset = offset;
+    progress._seen = clock_type::now();
+    return _commit_log->read_records(offset, max_bytes);
+}
+
+future<size_t> database::apply_replicated(bytes frames)
+{
+    // The cache is updated at once, as by the replay, and the records go to
+    // the log of this shard as they are, without being encoded again. A
+    // retried section skips the records it already applied, see
+    // apply_replayed().
+    std::vector<mutation_record> records;
+    size_t done = 0;
+    with_allocator(allocator(), [this, &frames, &records, &done] {
+        _replay_section(*this, [this, &frames, &records, &done] {
+            size_t index = 0;
+            store::for_each_framed_record(frames.data(), frames.size(), [this, &records, &done, &index] (const char* record, size_t size) {
+                if (index++ < done) {
+                    return;
+                }
+                bytes_view r { record, size };
+                decoded_mutation m;
+                try {
+                    m = decode_mutation(r);
+                } catch (const std::out_of_range&) {
+                    ++done;
+                    return;
+                }
+                apply_decoded(m);
+                records.emplace_back(mutation_record::encoded(r));
+                ++done;
+            });
+        });
+    });
+    auto applied = records.size();
+    return do_with(std::move(frames), std::move(records), [this] (auto& frames, auto& records) {
+        return parallel_for_each(records, [this] (auto& r) {
+            return _commit_log->append(r);
+        });
+    }).then([applied] {
+        return applied;
+    });
+}
+
+void database::set_primary_offset(sstring primary, unsigned shard, uint64_t offset)
+{
+    auto& progress = _primaries[std::make_pair(std::move(primary), shard)];
+    progress._offset = offset;
+    progress._seen = clock_type::now();
+}
+
+foreign_ptr<lw_shared_ptr<replication_info>> database::get_replication_info() const
+{
+    auto info = make_lw_shared<replication_info>();
+    info->_replication_id = _replication_id;
+    info->_offset = replication_offset();
+    auto now = clock_type::now();
+    auto lag = [now] (const replication_progress& p) {
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::seconds>(now - p._seen).count());
+    };
+    for (auto& e : _replicas) {
+        info->_replicas.push_back(replication_info::peer { e.first, engine().cpu_id(), e.second._offset, lag(e.second) });
+    }
+    for (auto& e : _primaries) {
+        info->_primaries.push_back(replication_info::peer { e.first.first, e.first.second, e.second._offset, lag(e.second) });
+    }
+    return make_foreign(info);
+}
+
+memory_stats& memory_stats::operator += (const memory_stats& o)
+{
+    _allocated += o._allocated;
+    _keys += o._keys;
+    _region_used += o._region_used;
+    _region_free += o._region_free;
+    _shared_values += o._shared_values;
+    _memtables += o._memtables;
+    _block_cache += o._block_cache;
+    for (size_t i = 0; i < _by_type.size(); ++i) {
+        _by_type[i] += o._by_type[i];
+    }
+    return *this;
+}
+
+future<scattered_message_ptr> database::memory_usage(redis_key rk, size_t samples)
+{
+    return with_allocator(allocator(), [this, &rk, samples] {
+        return _cache.run_with_entry(rk, [samples] (const cache_entry* e) {
+            if (!e) {
+                return reply_builder::build(msg_null_blik);
+            }
+            return reply_builder::build(e->memory_usage(samples));
+        });
+    });
+}
+
+keyspace_info& keyspace_info::operator += (const keyspace_info& o)
+{
+    _keys += o._keys;
+    _expires += o._expires;
+    _reads += o._reads;
+    _hits += o._hits;
+    _expired += o._expired;
+    _evicted += o._evicted;
+    _max_memory += o._max_memory;
+    _memory += o._memory;
+    return *this;
+}
+
+keyspace_info database::get_keyspace_info() const
+{
+    keyspace_info info;
+    info._keys = _cache.size();
+    info._expires = _cache.expiring_size();
+    info._reads = _stat._read;
+    info._hits = _stat._hit;
+    info._expired = _cache.expired_entries();
+    info._evicted = _cache.evictions();
+    info._max_memory = _options._max_memory / smp::count;
+    info._memory = get_memory_stats();
+    return info;
+}
+
+memory_stats database::get_memory_stats() const
+{
+    memory_stats stats;
+    stats._allocated = memory::stats().allocated_memory();
+    stats._keys = _cache.size();
+    auto region = occupancy();
+    stats._region_used = region.used_space();
+    stats._region_free = region.free_space();
+    stats._shared_values = cache_entry::shared_value_bytes();
+    // the group holds the region of the cache and those of the memtables.
+    auto group = dirty_memory_manager::region_group().memory_used();
+    stats._memtables = group - std::min(group, region.total_space());
+    stats._block_cache = store::local_block_cache().used_bytes();
+    auto& by_type = _cache.memory_by_type();
+    for (size_t i = 0; i < stats._by_type.size(); ++i) {
+        stats._by_type[i] = by_type.of(static_cast<data_type>(i));
+    }
+    return stats;
+}
+
+void database::on_timer()
+{
+    if (_cache.should_flush_dirty_entry()) {
+        _flush_cache.signal();
+    }
+    if (!_shutdown) {
+        _flush_timer.arm(std::chrono::milliseconds(8000));
+    }
+}
+
+database::~database()
+{
+    with_allocator(allocator(), [this] {
+        _cache.flush_all();
+    });
+}
+
+size_t database::sum_expiring_entries()
+{
+    return _cache.expiring_size();
+}
+
+void database::setup_metrics()
+{
+    namespace sm = seastar::metrics;
+    _metrics.add_group("db", {
+        sm::make_counter("read", [this] { return _stat._read; }, sm::description("Total number of read operations.")),
+        sm::make_counter("hit", [this] { return _stat._hit; }, sm::description("Total number of the read hit.")),
+        sm::make_counter("total_counter_entries", [this] { return _stat._total_counter_entries; }, sm::description("Total of counter entries.")),
+        sm::make_counter("total_string_entries", [this] { return _stat._total_string_entries; }, sm::description("Total of string entries.")),
+        sm::make_counter("total_dict_entries", [this] { return _stat._total_dict_entries; }, sm::description("Total of dict entries.")),
+        sm::make_counter("total_list_entries", [this] { return _stat._total_list_entries; }, sm::description("Total of list entries.")),
+        sm::make_counter("total_set_entries", [this] { return _stat._total_set_entries; }, sm::description("Total of set entries.")),
+        sm::make_counter("total_sorted_set_entries", [this] { return _stat._total_zset_entries; }, sm::description("Total of sorted set entries.")),
+        sm::make_counter("total_hll_entries", [this] { return _stat._total_hll_entries; }, sm::description("Total of hyperloglog entries.")),
+        sm::make_counter("total_stream_entries", [this] { return _stat._total_stream_entries; }, sm::description("Total of stream entries.")),
+        sm::make_counter("total_timeseries_entries", [this] { return _stat._total_timeseries_entries; }, sm::description("Total of time series entries.")),
+        sm::make_counter("total_bloom_entries", [this] { return _stat._total_bloom_entries; }, sm::description("Total of Bloom filter entries.")),
+        sm::make_counter("total_cms_entries", [this] { return _stat._total_cms_entries; }, sm::description("Total of count-min sketch entries.")),
+        sm::make_counter("total_topk_entries", [this] { return _stat._total_topk_entries; }, sm::description("Total of Top-K entries.")),
+        sm::make_counter("total_expiring_entries", [this] { return sum_expiring_entries(); }, sm::description("Total of expiring entries.")),
+        sm::make_counter("evicted_entries", [this] { return _cache.evictions(); }, sm::description("Total of entries evicted by the maxmemory policy.")),
+        sm::make_counter("filtered_lookups", [this] { return _cache.filtered_lookups(); }, sm::description("Total of lookups of absent keys answered by the tag filter of their bucket.")),
+        sm::make_counter("expired_entries", [this] { return _cache.expired_entries(); }, sm::description("Total of entries released after expiring.")),
+        sm::make_counter("volatile_writes", [this] { return _stat._volatile_writes; }, sm::description("Total of SETs with a TTL under volatile_ttl_ms, neither logged nor flushed.")),
+        sm::make_counter("volatile_bytes", [this] { return _stat._volatile_bytes; }, sm::description("Total bytes of the values of the SETs which were neither logged nor flushed.")),
+        sm::make_gauge("compressed_value_bytes", [] { return cache_entry::value_compression_stats()._compressed_bytes; }, sm::description("Bytes taken by the string values held compressed.")),
+        sm::make_gauge("compressed_value_raw_bytes", [] { return cache_entry::value_compression_stats()._raw_bytes; }, sm::description("Bytes the string values held compressed decompress to.")),
+        sm::make_gauge("value_compression_ratio", [] {
+            auto& stats = cache_entry::value_compression_stats();
+            return stats._compressed_bytes ? double(stats._raw_bytes) / stats._compressed_bytes : 1.0;
+        }, sm::description("Bytes of the string values held compressed per byte they take.")),
+        sm::make_counter("value_compressions", [] { return cache_entry::value_compression_stats()._compressions; }, sm::description("Total of string values compressed, kept compressed or not.")),
+        sm::make_counter("value_decompressions", [] { return cache_entry::value_compression_stats()._decompressions; }, sm::description("Total of string values decompressed to be read.")),
+        sm::make_counter("value_compress_time_us", [] { return cache_entry::value_compression_stats()._compress_time_ns / 1000; }, sm::description("Total time spent compressing string values, in microseconds.")),
+        sm::make_counter("value_decompress_time_us", [] { return cache_entry::value_compression_stats()._decompress_time_ns / 1000; }, sm::description("Total time spent decompressing string values, in microseconds.")),
+        sm::make_gauge("expiry_index_bytes", [this] { return _cache.expiry_memory(); }, sm::description("Bytes taken by the expiry records of the expiring entries.")),
+        sm::make_gauge("key_index_bytes", [this] { return _cache.key_index_memory(); }, sm::description("Bytes taken by the ordered index of the keys.")),
+        sm::make_counter("indexed_scans", [this] { return _cache.indexed_scans(); }, sm::description("Total of SCANs of a prefix answered by the ordered index of the keys.")),
+        sm::make_gauge("expiring_fields", [this] { return _field_expiry.size(); }, sm::description("Fields of hashes which expire on their own.")),
+        sm::make_counter("expired_fields", [this] { return _field_expiry.expired_fields(); }, sm::description("Total of fields of hashes removed after expiring.")),
+        sm::make_gauge("expiry_lag_ms", [this] { return std::chrono::duration_cast<std::chrono::milliseconds>(_cache.expiry_lag()).count(); }, sm::description("How long the oldest expired entry has been waiting to be released.")),
+        sm::make_gauge("lazy_free_entries", [this] { return _cache.lazy_free_entries(); }, sm::description("Entries whose values are being freed in the background.")),
+        sm::make_gauge("retired_entries", [this] { return _cache.retired_entries(); }, sm::description("Entries of flushed keyspaces not released yet.")),
+        sm::make_counter("flushes", [this] { return _stat._flushes; }, sm::description("FLUSHALL and FLUSHDB commands run on this shard.")),
+        sm::make_counter("flushed_entries", [this] { return _cache.flushed_entries(); }, sm::description("Total of dirty entries written to the memtable.")),
+    });
+
+    if (_options._key_sampling) {
+        auto first = [] (const std::vector<sampled_key>& keys, auto field) {
+            return keys.empty() ? 0 : static_cast<uint64_t>(keys.front().*field);
+        };
+        _metrics.add_group("key_sampling", {
+            sm::make_gauge("hottest_key_frequency", [this, first] { return first(_key_samples._hot, &sampled_key::_frequency); }, sm::description("LFU counter of the most accessed key found by the last walk of the cache.")),
+            sm::make_gauge("largest_key_bytes", [this, first] { return first(_key_samples._largest_bytes, &sampled_key::_bytes); }, sm::description("Bytes of the largest key found by the last walk of the cache.")),
+            sm::make_gauge("largest_key_elements", [this, first] { return first(_key_samples._largest_elements, &sampled_key::_elements); }, sm::description("Elements of the largest collection found by the last walk of the cache.")),
+            sm::make_counter("walks", [this] { return _key_samples._rounds; }, sm::description("Total number of complete walks of the cache by the key sampler.")),
+        });
+    }
+
+    // Region memory of the entries by type, keys and entries included.
+    auto& by_type = _cache.memory_by_type();
+    _metrics.add_group("memory", {
+        sm::make_gauge("string_bytes", [&by_type] { return by_type.of(data_type::bytes); }, sm::description("Bytes of the region held by string entries.")),
+        sm::make_gauge("counter_bytes", [&by_type] { return by_type.of(data_type::numeric) + by_type.of(data_type::int64); }, sm::description("Bytes of the region held by counter entries.")),
+        sm::make_gauge("list_bytes", [&by_type] { return by_type.of(data_type::list); }, sm::description("Bytes of the region held by list entries.")),
+        sm::make_gauge("dict_bytes", [&by_type] { return by_type.of(data_type::dict); }, sm::description("Bytes of the region held by dict entries.")),
+        sm::make_gauge("set_bytes", [&by_type] { return by_type.of(data_type::set); }, sm::description("Bytes of the region held by set entries.")),
+        sm::make_gauge("sorted_set_bytes", [&by_type] { return by_type.of(data_type::sset); }, sm::description("Bytes of the region held by sorted set entries.")),
+        sm::make_gauge("hll_bytes", [&by_type] { return by_type.of(data_type::hll); }, sm::description("Bytes of the region held by hyperloglog entries.")),
+        sm::make_gauge("stream_bytes", [&by_type] { return by_type.of(data_type::stream); }, sm::description("Bytes of the region held by stream entries.")),
+        sm::make_gauge("timeseries_bytes", [&by_type] { return by_type.of(data_type::timeseries); }, sm::description("Bytes of the region held by time series entries.")),
+        sm::make_gauge("bloom_bytes", [&by_type] { return by_type.of(data_type::bloom); }, sm::description("Bytes of the region held by Bloom filter entries.")),
+        sm::make_gauge("cms_bytes", [&by_type] { return by_type.of(data_type::cms); }, sm::description("Bytes of the region held by count-min sketch entries.")),
+        sm::make_gauge("topk_bytes", [&by_type] { return by_type.of(data_type::topk); }, sm::description("Bytes of the region held by Top-K entries.")),
+        sm::make_gauge("region_used_bytes", [this] { return occupancy().used_space(); }, sm::description("Bytes of the region of the cache in use.")),
+        sm::make_gauge("region_free_bytes", [this] { return occupancy().free_space(); }, sm::description("Bytes of the region of the cache free in its segments.")),
+    });
+
+    // The sizes of the values by kind, up to 2^25 in the last bucket.
+    auto kind_label = sm::label("kind");
+    std::vector<sm::metric_definition> sizes;
+    for (size_t i = 0; i < size_distribution::kinds; ++i) {
+        auto k = static_cast<size_distribution::kind>(i);
+        sizes.emplace_back(sm::make_histogram("size", sm::description("Bytes of the string values, or elements of the collections."), {kind_label(size_distribution::kind_name(k))},
+            [k] { return cache_entry::value_size_distribution().of(k).get_histogram(1, 26); }));
+    }
+    _metrics.add_group("value_sizes", sizes);
+
+    _metrics.add_group("memtable", {
+        sm::make_gauge("partitions", [this] { return _data_cf->active_memtable()->partition_count(); }, sm::description("Keys held by the active memtable.")),
+        sm::make_gauge("used_bytes", [this] { return _data_cf->active_memtable()->occupancy().used_space(); }, sm::description("Memory used by the active memtable.")),
+        sm::make_gauge("sealed", [this] { return _data_cf->immutable_memtables(); }, sm::description("Sealed memtables waiting to be written to sstables.")),
+        sm::make_counter("flushes", [this] { return _data_cf->stats()._memtable_flushes; }, sm::description("Total number of memtables written to sstables.")),
+        sm::make_counter("flush_failures", [this] { return _data_cf->stats()._memtable_flush_failures; }, sm::description("Total number of memtable flushes that failed.")),
+        sm::make_counter("flushed_partitions", [this] { return _data_cf->stats()._flushed_partitions; }, sm::description("Total of partitions written to sstables.")),
+        sm::make_counter("flushed_bytes", [this] { return _data_cf->stats()._flushed_bytes; }, sm::description("Total bytes of sstables written by memtable flushes.")),
+        sm::make_counter("flushed_raw_bytes", [this] { return _data_cf->stats()._flushed_raw_bytes; }, sm::description("Total bytes of the blocks written by memtable flushes, before compression.")),
+        sm::make_gauge("l0_sstables", [this] { return _data_cf->sstables(0).size(); }, sm::description("Sstables in level 0.")),
+    });
+
+    _metrics.add_group("sstable", {
+        sm::make_counter("reads", [this] { return _data_cf->stats()._sstable_reads; }, sm::description("Total number of lookups that reached an sstable.")),
+        sm::make_counter("filter_negatives", [this] { return _data_cf->stats()._filter_negatives; }, sm::description("Total number of sstable lookups answered by the filter alone.")),
+        sm::make_counter("filter_false_positives", [this] { return _data_cf->stats()._filter_false_positives; }, sm::description("Total number of sstable lookups the filter let through to a block without the key.")),
+        sm::make_counter("lookups", [this] { return _data_cf->stats()._sstable_lookups; }, sm::description("Total number of reads that reached the sstables, the probes and the bytes read by level divide by it.")),
+    });
+
+    auto level_label = sm::label("level");
+    std::vector<sm::metric_definition> levels;
+    for (size_t level = 0; level < _data_cf->stats()._levels.size(); ++level) {
+        auto stats = [this, level] () -> const store::level_read_stats& { return _data_cf->stats()._levels[level]; };
+        levels.emplace_back(sm::make_counter("probes", [stats] { return stats()._probes; },
+            sm::description("Total number of sstables of the level probed by lookups."), {level_label(level)}));
+        levels.emplace_back(sm::make_counter("filter_negatives", [stats] { return stats()._filter_negatives; },
+            sm::description("Total number of probes of the level answered by the filter alone."), {level_label(level)}));
+        levels.emplace_back(sm::make_counter("filter_false_positives", [stats] { return stats()._filter_false_positives; },
+            sm::description("Total number of probes of the level the filter let through to a block without the key."), {level_label(level)}));
+        levels.emplace_back(sm::make_counter("blocks", [stats] { return stats()._blocks; },
+            sm::description("Total number of data blocks and index partitions of the level read by lookups."), {level_label(level)}));
+        levels.emplace_back(sm::make_counter("cache_hits", [stats] { return stats()._cache_hits; },
+            sm::description("Total number of blocks of the level lookups found in the block cache."), {level_label(level)}));
+        levels.emplace_back(sm::make_counter("bytes_read", [stats] { return stats()._bytes_read; },
+            sm::description("Total bytes of the level read from disk by lookups."), {level_label(level)}));
+    }
+    _metrics.add_group("sstable_level", levels);
+
+    _metrics.add_group("compaction", {
+        sm::make_counter("compactions", [this] { return _data_cf->stats()._compactions; }, sm::description("Total number of compactions.")),
+        sm::make_counter("failures", [this] { return _data_cf->stats()._compaction_failures; }, sm::description("Total number of compactions that failed.")),
+        sm::make_counter("bytes_read", [this] { return _data_cf->stats()._compaction_bytes_read; }, sm::description("Total bytes of sstables merged by compactions.")),
+        sm::make_counter("bytes_written", [this] { return _data_cf->stats()._compaction_bytes_written; }, sm::description("Total bytes of sstables written by compactions.")),
+        sm::make_counter("seek_compactions", [this] { return _data_cf->stats()._seek_compactions; }, sm::description("Total number of compactions of an sstable read too often by lookups which then read another one.")),
+        sm::make_counter("subcompactions", [this] { return _data_cf->stats()._subcompactions; }, sm::description("Total number of key ranges of the compactions split into several.")),
+        sm::make_counter("expiry_compactions", [this] { return _data_cf->stats()._expiry_compactions; }, sm::description("Total number of compactions of an sstable holding many expired records.")),
+        sm::make_counter("expired_dropped", [this] { return _data_cf->stats()._expired_dropped; }, sm::description("Total number of expired records dropped by compactions.")),
+        sm::make_counter("deletions_dropped", [this] { return _data_cf->stats()._deletions_dropped; }, sm::description("Total number of deletions dropped by compactions, no deeper level holding their keys.")),
+        sm::make_counter("expired_to_deletions", [this] { return _data_cf->stats()._expired_to_deletions; }, sm::description("Total number of expired records compactions wrote as deletions.")),
+        sm::make_gauge("throughput", [this] { return _data_cf->stats()._compaction_throughput; }, sm::description("Bytes per second compactions may write now, 0 for no limit.")),
+    });
+
+    _metrics.add_group("memory_pressure", {
+        sm::make_gauge("used_bytes", [this] { return dirty_memory_manager::region_group().memory_used(); }, sm::description("Bytes of the cache and of the memtables of this shard.")),
+        sm::make_gauge("soft_limit_bytes", [this] { return soft_limit_threshold(); }, sm::description("Bytes past which this shard flushes its memtable and evicts.")),
+        sm::make_gauge("hard_limit_bytes", [this] { return throttle_threshold(); }, sm::description("Bytes past which writes to this shard wait for memory.")),
+        sm::make_gauge("throttled", [this] { return _writes_throttled ? 1 : 0; }, sm::description("Whether writes to this shard wait for memory.")),
+        sm::make_counter("reclaims", [this] { return _pressure_stats._reclaims; }, sm::description("Total number of rounds of reclaiming memory past the soft limit.")),
+        sm::make_counter("flushes", [this] { return _pressure_stats._flushes; }, sm::description("Total number of memtables flushed past the soft limit.")),
+        sm::make_counter("evictions", [this] { return _pressure_stats._evictions; }, sm::description("Total number of entries evicted past the soft limit.")),
+        sm::make_counter("throttles", [this] { return _pressure_stats._throttles; }, sm::description("Total number of times writes started waiting for memory.")),
+    });
+
+    if (_cache.tiered()) {
+        _metrics.add_group("tiered_storage", {
+            sm::make_counter("demotions", [this] { return _cache.demotions(); }, sm::description("Total of evicted entries written to the store.")),
+            sm::make_counter("reads", [this] { return _tier_stats._reads; }, sm::description("Total of keys the hint sent to the store on a miss.")),
+            sm::make_counter("promotions", [this] { return _tier_stats._promotions; }, sm::description("Total of entries read back from the store.")),
+            sm::make_gauge("warmup_keys", [this] { return _warmup_queue.size(); }, sm::description("Keys of the heat map left by the last run still to read back from the store.")),
+        });
+    }
+
+    _metrics.add_group("snapshot", {
+        sm::make_gauge("in_progress", [this] { return _snapshot ? 1 : 0; }, sm::description("Whether this shard is writing its snapshot.")),
+        sm::make_counter("saves", [this] { return _snapshot_stats._saves; }, sm::description("Total number of snapshots written by this shard.")),
+        sm::make_counter("failures", [this] { return _snapshot_stats._failures; }, sm::description("Total number of snapshots of this shard which failed.")),
+        sm::make_counter("saved_before_write", [this] { return _snapshot_stats._saved_before_write; }, sm::description("Total number of entries saved to a snapshot before a write changed them.")),
+        sm::make_gauge("last_bytes", [this] { return _snapshot_stats._last_bytes; }, sm::description("Bytes of the last snapshot of this shard.")),
+        sm::make_counter("loaded_keys", [this] { return _stat._loaded_keys; }, sm::description("Total number of keys inserted from snapshots and RDB files.")),
+        sm::make_counter("loaded_batches", [this] { return _stat._loaded_batches; }, sm::description("Total number of batches of keys inserted from snapshots and RDB files.")),
+        sm::make_counter("populated_keys", [this] { return _stat._populated_keys; }, sm::description("Total number of keys created by DEBUG POPULATE.")),
+    });
+
+    _metrics.add_group("block_cache", {
+        sm::make_counter("hits", [] { return store::local_block_cache().stats()._hits; }, sm::description("Total number of data block reads served by the block cache.")),
+        sm::make_counter("misses", [] { return store::local_block_cache().stats()._misses; }, sm::description("Total number of data block reads that went to disk.")),
+        sm::make_counter("insertions", [] { return store::local_block_cache().stats()._insertions; }, sm::description("Total number of blocks put in the block cache.")),
+        sm::make_counter("evictions", [] { return store::local_block_cache().stats()._evictions; }, sm::description("Total number of blocks evicted from the block cache.")),
+        sm::make_gauge("blocks", [] { return store::local_block_cache().blocks(); }, sm::description("Data blocks held by the block cache.")),
+        sm::make_gauge("used_bytes", [] { return store::local_block_cache().used_bytes(); }, sm::description("Bytes of data blocks held by the block cache.")),
+        sm::make_gauge("pinned_bytes", [] { return store::local_block_cache().pinned_bytes(); }, sm::description("Bytes of index and filter blocks pinned by open sstables.")),
+        sm::make_gauge("capacity_bytes", [] { return store::local_block_cache().capacity(); }, sm::description("Bytes the block cache may hold, pinned blocks included.")),
+    });
+
+    _metrics.add_group("commit_log", {
+        sm::make_counter("syncs", [this] { return _commit_log->stats()._syncs; }, sm::description("Total number of syncs of the commit log.")),
+        sm::make_counter("synced_bytes", [this] { return _commit_log->stats()._synced_bytes; }, sm::description("Total bytes of records made durable by syncs.")),
+        sm::make_counter("sync_latency_us", [this] { return _commit_log->stats()._sync_latency_us; }, sm::description("Total time spent writing and syncing the commit log, in microseconds.")),
+        sm::make_gauge("bytes_per_sync", [this] { return _commit_log->stats()._last_sync_bytes; }, sm::description("Bytes of records covered by the last sync.")),
+        sm::make_gauge("appends_per_sync", [this] { return _commit_log->stats()._last_sync_appends; }, sm::description("Appends covered by the last sync.")),
+        sm::make_gauge("last_sync_latency_us", [this] { return _commit_log->stats()._last_sync_latency_us; }, sm::description("How long the last sync took, in microseconds.")),
+        sm::make_gauge("sync_waiters", [this] { return _commit_log->stats()._sync_waiters; }, sm::description("Appends waiting for a sync.")),
+        sm::make_counter("created_segments", [this] { return _commit_log->stats()._created_segments; }, sm::description("Total number of commit log segments created.")),
+        sm::make_counter("recycled_segments", [this] { return _commit_log->stats()._recycled_segments; }, sm::description("Total number of commit log segments recycled.")),
+        sm::make_gauge("replay_segments", [this] { return _commit_log->stats()._replay_segments; }, sm::description("Segments left by an earlier run to replay at startup.")),
+        sm::make_counter("replayed_segments", [this] { return _commit_log->stats()._replayed_segments; }, sm::description("Segments replayed at startup.")),
+        sm::make_counter("replayed_records", [this] { return _commit_log->stats()._replayed_records; }, sm::description("Records read by the replay at startup.")),
+        sm::make_counter("replayed_bytes", [this] { return _commit_log->stats()._replayed_bytes; }, sm::description("Bytes of records read by the replay at startup.")),
+        sm::make_counter("replayed_mutations", [this] { return _stat._replayed_mutations; }, sm::description("Mutations applied to the cache by the replay at startup.")),
+        sm::make_counter("replayed_batches", [this] { return _stat._replayed_batches; }, sm::description("Batches of mutations applied by the replay at startup.")),
+        sm::make_counter("moved_records", [this] { return _stat._moved_records; }, sm::description("Records of keys owned by other shards sent to them at startup, after a change in the number of shards.")),
+        sm::make_counter("dropped_foreign_records", [this] { return _stat._dropped_foreign_records; }, sm::description("Records of keys owned by other shards left by an earlier change in the number of shards, dropped by the replay.")),
+    });
+}
+
+bool database::shares_string(size_t size) const
+{
+    return _options._shared_value_min_bytes > 0 && size >= _options._shared_value_min_bytes;
+}
+
+bool database::compresses_string(size_t size) const
+{
+    return _options._compressed_value_min_bytes > 0 && size >= _options._compressed_value_min_bytes;
+}
+
+cache_entry* database::make_string(const redis_key& rk, bytes_view val)
+{
+    if (shares_string(val.size())) {
+        return current_allocator().construct<cache_entry>(rk.key(), rk.hash(), temporary_buffer<char>(val.data(), val.size()));
+    }
+    if (compresses_string(val.size())) {
+        return current_allocator().construct<cache_entry>(rk.key(), rk.hash(), cache_entry::compressed_initializer { val });
+    }
+    return current_allocator().construct<cache_entry>(rk.key(), rk.hash(), val);
+}
+
+cache_entry* database::make_string(const redis_key& rk, const std::vector<bytes_view>& fragments)
+{
+    if (fragments.size() == 1) {
+        return make_string(rk, fragments.front());
+    }
+    size_t size = 0;
+    for (auto& f : fragments) {
+        size += f.size();
+    }
+    if (shares_string(size) || compresses_string(size)) {
+        // these take the value whole.
+        bytes value(bytes::initialized_later(), size);
+        auto out = value.begin();
+        for (auto& f : fragments) {
+            out = std::copy(f.begin(), f.end(), out);
+        }
+        return make_string(rk, bytes_view { value.data(), value.size() });
+    }
+    return current_allocator().construct<cache_entry>(rk.key(), rk.hash(), cache_entry::fragmented_initializer { fragments, size });
+}
+
+reply_value database::insert_string(cache_entry* entry, long expired, uint32_t flag)
+{
+    if (!_cache.insert_if(entry, expired, flag & FLAG_SET_NX, flag & FLAG_SET_XX, flag & FLAG_SET_KEEPTTL)) {
+        current_allocator().destroy<cache_entry>(entry);
+        return reply_value::of(msg_nil);
+    }
+    ++_stat._total_string_entries;
+    notify_set(*entry);
+    return reply_value::of(msg_ok);
+}
+
+bool database::volatile_write(long expire, uint32_t flag) const
+{
+    return _options._volatile_ttl_ms > 0 && expire > 0 && expire < _options._volatile_ttl_ms
+        && !(flag & (FLAG_SET_KEEPTTL | FLAG_SET_GET));
+}
+
+reply_value database::insert_volatile(const redis_key& rk, cache_entry* entry, size_t size, long expire, uint32_t flag, bool& shadowed)
+{
+    // a volatile entry was never on disk, unless a later change dirtied it.
+    auto replaced = _cache.run_with_entry(rk, [] (const cache_entry* e) { return e && !e->_volatile; });
+    auto reply = insert_string(entry, expire, flag);
+    if (reply._constant != &msg_ok) {
+        return reply;
+    }
+    _cache.mark_clean(*entry);
+    entry->_volatile = true;
+    shadowed = replaced || _cache.hinted(rk.hash());
+    ++_stat._volatile_writes;
+    _stat._volatile_bytes += size;
+    return reply;
+}
+
+void database::notify_set(const cache_entry& e)
+{
+    auto& events = local_keyspace_events();
+    if (events.wants(event_string)) {
+        events.notify("set", e.key_data(), e.key_size());
+    }
+}
+
+bool database::set_direct(redis_key rk, bytes val, long expired, uint32_t flag)
+{
+    return with_allocator_for(data_type::bytes, [this, rk = std::move(rk), val = std::move(val), expired, flag] {
+        auto entry = make_string(rk, bytes_view { val.data(), val.size() });
+        bool result = true;
+        if (_cache.insert_if(entry, expired, flag & FLAG_SET_NX, flag & FLAG_SET_XX)) {
+            ++_stat._total_string_entries;
+            notify_set(*entry);
+        }
+        else {
+            result = false;
+            current_allocator().destroy<cache_entry>(entry);
+        }
+        return result;
+    });
+}
+
+// Whether GET replies the value of the entry rather than WRONGTYPE.
+static bool is_string(const cache_entry* e)
+{
+    return e->type_of_bytes() || e->type_of_integer() || e->type_of_float();
+}
+
+// A string entry as GET replies it, see reply_builder::build(const cache_entry*).
+static reply_value value_of(const cache_entry* e)
+{
+    if (e == nullptr) {
+        return reply_value::of(msg_not_found);
+    }
+    if (e->type_of_integer()) {
+        return reply_value::of_bulk_integer(e->value_integer());
+    }
+    if (e->type_of_float()) {
+        return reply_value::of_bulk_float(e->value_float());
+    }
+    if (!e->type_of_bytes()) {
+        return reply_value::of(msg_type_err);
+    }
+    if (e->integer_value()) {
+        return reply_value::of_bulk_integer(e->string_integer());
+    }
+    if (e->shared_value()) {
+        return reply_value::of_shared(e->share_value());
+    }
+    if (e->compressed_value()) {
+        return reply_value::of_shared(e->decompress_value());
+    }
+    bytes value(bytes::initialized_later(), e->value_bytes_size());
+    auto p = value.begin();
+    e->for_each_value_fragment([&p] (bytes_view f) {
+        p = std::copy_n(f.data(), f.size(), p);
+    });
+    return reply_value::of_bulk(std::move(value));
+}
+
+reply_value database::exchange_string(const redis_key& rk, cache_entry* entry, long expired, uint32_t flag, bool& inserted)
+{
+    bool string = true;
+    auto old = _cache.run_with_entry(rk, [&string] (const cache_entry* e) {
+        string = !e || is_string(e);
+        return value_of(e);
+    });
+    inserted = false;
+    if (!string) {
+        current_allocator().destroy<cache_entry>(entry);
+        return old;
+    }
+    inserted = insert_string(entry, expired, flag)._constant == &msg_ok;
+    return old;
+}
+
+future<reply_value> database::set(redis_key rk, bytes_view val, long expired, uint32_t flag)
+{
+    // First, append the operation commitlog.
+    // Second, update the data-structures in the cache, reply message to client.
+    // Third, flush dirty data in the cache to memtable periodically.
+    // Then, flush memtable to disk when some conditions are statisfied.
+    //
+    // A key of a short TTL skips all of it, see database_options::_volatile_ttl_ms.
+    if (volatile_write(expired, flag)) {
+        bool shadowed = false;
+        auto reply = with_allocator_for(data_type::bytes, [this, &rk, val, expired, flag, &shadowed] {
+            return insert_volatile(rk, make_string(rk, val), val.size(), expired, flag, shadowed);
+        });
+        return log_volatile(rk, shadowed, std::move(reply));
+    }
+    auto r = mutation_record::of_bytes(bytes_view { rk.key().data(), rk.key().size() }, val, record_deadline(expired), flag | FLAG_EXPIRE_AT);
+    if (flag & FLAG_SET_GET) {
+        // the old value is read and replaced in one step, then the change
+        // is logged, unless the key held another type.
+        bool inserted = false;
+        auto old = with_allocator_for(data_type::bytes, [this, &rk, val, expired, flag, &inserted] {
+            return exchange_string(rk, make_string(rk, val), expired, flag, inserted);
+        });
+        return log_exchange(r, inserted, std::move(old));
+    }
+    return _commit_log->append(r).then([this, rk = std::move(rk), val, expired, flag] {
+        return with_allocator_for(data_type::bytes, [this, rk = std::move(rk), val, expired, flag] {
+            return insert_string(make_string(rk, val), expired, flag);
+        });
+    });
+}
+
+future<reply_value> database::set_fragments(redis_key rk, std::vector<bytes_view> fragments, long expired, uint32_t flag)
+{
+    if (volatile_write(expired, flag)) {
+        size_t size = 0;
+        for (auto& f : fragments) {
+            size += f.size();
+        }
+        bool shadowed = false;
+        auto reply = with_allocator_for(data_type::bytes, [this, &rk, &fragments, size, expired, flag, &shadowed] {
+            return insert_volatile(rk, make_string(rk, fragments), size, expired, flag, shadowed);
+        });
+        return log_volatile(rk, shadowed, std::move(reply));
+    }
+    auto r = mutation_record::of_fragments(bytes_view { rk.key().data(), rk.key().size() }, fragments, record_deadline(expired), flag | FLAG_EXPIRE_AT);
+    if (flag & FLAG_SET_GET) {
+        bool inserted = false;
+        auto old = with_allocator_for(data_type::bytes, [this, &rk, &fragments, expired, flag, &inserted] {
+            return exchange_string(rk, make_string(rk, fragments), expired, flag, inserted);
+        });
+        return log_exchange(r, inserted, std::move(old));
+    }
+    return _commit_log->append(r).then([this, rk = std::move(rk), fragments = std::move(fragments), expired, flag] {
+        return with_allocator_for(data_type::bytes, [this, &rk, &fragments, expired, flag] {
+            return insert_string(make_string(rk, fragments), expired, flag);
+        });
+    });
+}
+
+bool database::erase_entry(const redis_key& rk)
+{
+    return _cache.run_with_entry(rk, [this, &rk] (cache_entry* e) {
+        if (!e) return false;
+        if (e->type_of_bytes()) {
+            --_stat._total_string_entries;
+        }
+        else if (e->type_of_set()) {
+            --_stat._total_set_entries;
+        }
+        else if (e->type_of_list()) {
+            --_stat._total_list_entries;
+        }
+        else if (e->type_of_map()) {
+            --_stat._total_dict_entries;
+        }
+        else if (e->type_of_sset()) {
+            --_stat._total_zset_entries;
+        }
+        else if (e->type_of_hll()) {
+            --_stat._total_hll_entries;
+        }
+        else if (e->type_of_stream()) {
+            --_stat._total_stream_entries;
+        }
+        else if (e->type_of_timeseries()) {
+            --_stat._total_timeseries_entries;
+        }
+        else if (e->type_of_bloom()) {
+            --_stat._total_bloom_entries;
+        }
+        else if (e->type_of_cms()) {
+            --_stat._total_cms_entries;
+        }
+        else if (e->type_of_topk()) {
+            --_stat._total_topk_entries;
+        }
+        else {
+            --_stat._total_counter_entries;
+        }
+        _cache.mark_deleted(rk.key());
+        auto& events = local_keyspace_events();
+        if (events.wants(event_generic)) {
+            events.notify("del", e->key_data(), e->key_size());
+        }
+        return with_allocator(allocator(), [this, e] {
+            auto result =  _cache.erase_lazily(*e);
+            return result;
+        });
+    });
+}
+
+future<bool> database::del_direct(redis_key rk)
+{
+    auto r = mutation_record::deleted(bytes_view { rk.key().data(), rk.key().size() });
+    return _commit_log->append(r).then([this, rk = std::move(rk)] {
+        return erase_entry(rk);
+    });
+}
+
+future<size_t> database::del_direct_batch(std::vector<redis_key> rks)
+{
+    return do_with(std::move(rks), [this] (auto& rks) {
+        return parallel_for_each(rks.begin(), rks.end(), [this] (auto& rk) {
+            return _commit_log->append(mutation_record::deleted(bytes_view { rk.key().data(), rk.key().size() }));
+        }).then([this, &rks] {
+            size_t removed = 0;
+            for (auto& rk : rks) {
+                if (erase_entry(rk)) {
+                    ++removed;
+                }
+            }
+            return removed;
+        });
+    });
+}
+
+future<scattered_message_ptr> database::del(redis_key rk)
+{
+    auto r = mutation_record::deleted(bytes_view { rk.key().data(), rk.key().size() });
+    return _commit_log->append(r).then([this, rk = std::move(rk)] {
+        return reply_builder::build(erase_entry(rk) ? msg_one : msg_zero);
+    });
+}
+
+bool database::exists_direct(redis_key rk)
+{
+    return _cache.exists(rk);
+}
+
+future<scattered_message_ptr> database::exists(redis_key rk)
+{
+    auto result = _cache.exists(rk);
+    return reply_builder::build(result ? msg_one : msg_zero);
+}
+
+future<reply_value> database::counter_by(redis_key rk, int64_t step, bool incr)
+{
+    return with_allocator_for(data_type::bytes, [this, rk = std::move(rk), step, incr] {
+        if (!incr && step == std::numeric_limits<int64_t>::min()) {
+            return reply_value::of(msg_overflow_err);
+        }
+        auto delta = incr ? step : -step;
+        auto e = _cache.find(rk);
+        if (!e) {
+            // not exists
+            auto entry = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), int64_t{delta});
+            _cache.replace(entry);
+            ++_stat._total_string_entries;
+            return value_of(entry);
+        }
+        if (!e->type_of_bytes()) {
+            return reply_value::of(msg_type_err);
+        }
+        // strings which read as integers are kept as such, see
+        // cache_entry::integer_value(); the others only after SETBIT.
+        int64_t value = 0;
+        if (e->integer_value()) {
+            value = e->string_integer();
+        }
+        else {
+            bytes text;
+            e->for_each_value_fragment([&text] (bytes_view f) {
+                text.append(f.data(), f.size());
+            });
+            if (!parse_integer_string(text.data(), text.size(), value)) {
+                return reply_value::of(msg_value_not_integer_err);
+            }
+        }
+        if ((delta > 0 && value > std::numeric_limits<int64_t>::max() - delta) ||
+            (delta < 0 && value < std::numeric_limits<int64_t>::min() - delta)) {
+            return reply_value::of(msg_overflow_err);
+        }
+        e->assign_integer(value + delta);
+        return value_of(e);
+    });
+}
+
+future<scattered_message_ptr> database::append(redis_key rk, bytes val)
+{
+    return with_allocator_for(data_type::bytes, [this, rk = std::move(rk), val = std::move(val)] {
+        auto e = _cache.find(rk);
+        if (!e) {
+            // not exists
+            auto entry = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), val);
+            _cache.replace(entry);
+            ++_stat._total_string_entries;
+            return reply_builder::build(val.size());
+        }
+        if (!e->type_of_bytes()) {
+            return reply_builder::build(msg_type_err);
+        }
+        // the value grows in place. One held out of the region is moved
+        // into it once, it could only be copied whole by every APPEND.
+        e->append_value(bytes_view { val.data(), val.size() });
+        return reply_builder::build(e->value_bytes_size());
+    });
+}
+
+future<scattered_message_ptr> database::append_fragments(redis_key rk, std::vector<bytes_view> fragments)
+{
+    return with_allocator_for(data_type::bytes, [this, rk = std::move(rk), fragments = std::move(fragments)] {
+        auto e = _cache.find(rk);
+        if (!e) {
+            auto entry = make_string(rk, fragments);
+            _cache.replace(entry);
+            ++_stat._total_string_entries;
+            return reply_builder::build(entry->value_bytes_size());
+        }
+        if (!e->type_of_bytes()) {
+            return reply_builder::build(msg_type_err);
+        }
+        for (auto& f : fragments) {
+            e->append_value(f);
+        }
+        return reply_builder::build(e->value_bytes_size());
+    });
+}
+
+future<scattered_message_ptr> database::setrange(redis_key rk, size_t offset, bytes val)
+{
+    return with_allocator_for(data_type::bytes, [this, rk = std::move(rk), offset, val = std::move(val)] {
+        auto e = _cache.find(rk);
+        if (e && !e->type_of_bytes()) {
+            return reply_builder::build(msg_type_err);
+        }
+        if (val.empty()) {
+            return reply_builder::build(e ? e->value_bytes_size() : size_t(0));
+        }
+        if (!e) {
+            e = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), size_t(0));
+            _cache.insert(e);
+            ++_stat._total_string_entries;
+        }
+        e->write_value(offset, bytes_view { val.data(), val.size() });
+        return reply_builder::build(e->value_bytes_size());
+    });
+}
+
+future<scattered_message_ptr> database::getrange(redis_key rk, long start, long end)
+{
+    ++_stat._read;
+    return _cache.run_with_entry(rk, [this, start, end] (const cache_entry* e) {
+        if (e && !e->type_of_bytes()) {
+            return reply_builder::build(msg_type_err);
+        }
+        auto size = e ? static_cast<long>(e->value_bytes_size()) : 0;
+        auto from = start < 0 ? std::max(start + size, 0L) : start;
+        auto to = end < 0 ? std::max(end + size, 0L) : std::min(end, size - 1);
+        if (e == nullptr || size == 0 || from > to) {
+            return reply_builder::build(msg_empty_bulk);
+        }
+        ++_stat._hit;
+        return reply_builder::build_bulk(to - from + 1, [e, from, to] (auto&& append) {
+            size_t position = 0, first = from, last = to + 1;
+            e->for_each_value_fragment([&] (bytes_view f) {
+                auto begin = position;
+                position += f.size();
+                if (position <= first || begin >= last) {
+                    return;
+                }
+                auto b = std::max(begin, first), l = std::min(position, last);
+                append(f.substr(b - begin, l - b));
+            });
+        });
+    });
+}
+
+future<scattered_message_ptr> database::get(redis_key rk)
+{
+    ++_stat._read;
+    return _cache.run_with_entry(rk, [this] (const cache_entry* e) {
+       if (e && e->type_of_bytes() == false) {
+           return reply_builder::build(msg_type_err);
+       }
+       else {
+           if (e != nullptr) ++_stat._hit;
+           return reply_builder::build<false, true>(e);
+       }
+    });
+}
+
+future<reply_value> database::get_value(redis_key rk)
+{
+    ++_stat._read;
+    return _cache.run_with_entry(rk, [this] (const cache_entry* e) {
+        if (e && e->type_of_bytes()) {
+            ++_stat._hit;
+        }
+        return value_of(e);
+    });
+}
+
+future<reply_value> database::getdel(redis_key rk)
+{
+    ++_stat._read;
+    bool deleted = false;
+    auto value = _cache.run_with_entry(rk, [&deleted] (const cache_entry* e) {
+        deleted = e && is_string(e);
+        return value_of(e);
+    });
+    if (deleted) {
+        ++_stat._hit;
+        erase_entry(rk);
+    }
+    auto r = mutation_record::deleted(bytes_view { rk.key().data(), rk.key().size() });
+    return log_exchange(r, deleted, std::move(value));
+}
+
+future<reply_value> database::getex(redis_key rk, long expired, bool persist)
+{
+    ++_stat._read;
+    bool string = false;
+    auto value = _cache.run_with_entry(rk, [&string] (const cache_entry* e) {
+        string = e && is_string(e);
+        return value_of(e);
+    });
+    if (!string) {
+        return make_ready_future<reply_value>(std::move(value));
+    }
+    ++_stat._hit;
+    auto key = bytes_view { rk.key().data(), rk.key().size() };
+    if (persist) {
+        bool changed = _cache.never_expired(rk);
+        return log_exchange(mutation_record::expiry(key, 0), changed, std::move(value));
+    }
+    if (expired >= 0) {
+        bool changed = _cache.expire(rk, expired);
+        return log_exchange(mutation_record::expiry(key, std::max<long>(unix_time_ms() + expired, 1)), changed, std::move(value));
+    }
+    return make_ready_future<reply_value>(std::move(value));
+}
+
+future<std::pair<scattered_message_ptr, bool>> database::get_for_copy(redis_key rk)
+{
+    auto e = _cache.find_for_copy(rk);
+    if (!e) {
+        return get(std::move(rk)).then([] (scattered_message_ptr reply) {
+            return std::make_pair(std::move(reply), false);
+        });
+    }
+    ++_stat._read;
+    ++_stat._hit;
+    return reply_builder::build<false, true>(e).then([] (scattered_message_ptr reply) {
+        return std::make_pair(std::move(reply), true);
+    });
+}
+
+future<scattered_message_ptr> database::strlen(redis_key rk)
+{
+    return _cache.run_with_entry(rk, [] (const cache_entry* e) {
+        if (e) {
+            if (e->type_of_bytes()) {
+                return reply_builder::build(e->value_bytes_size());
+            }
+            return reply_builder::build(msg_type_err);
+        }
+        return reply_builder::build(msg_zero);
+    });
+}
+
+future<scattered_message_ptr> database::type(redis_key rk)
+{
+    auto e = _cache.find(rk);
+    if (!e) {
+
+        return reply_builder::build(msg_type_none);
+    }
+    auto type = e->type_name();
+    return reply_builder::build(type);
+}
+
+// The deadline is logged rather than the ttl, see record_deadline(); a ttl
+// of 0 or less expires the key at once.
+future<scattered_message_ptr> database::expire(redis_key rk, long expired)
+{
+    if (!_cache.expire(rk, expired)) {
+        return reply_builder::build(msg_zero);
+    }
+    auto r = mutation_record::expiry(bytes_view { rk.key().data(), rk.key().size() }, std::max<long>(unix_time_ms() + expired, 1));
+    return log_change(r, reply_builder::build(msg_one));
+}
+
+future<scattered_message_ptr> database::persist(redis_key rk)
+{
+    if (!_cache.never_expired(rk)) {
+        return reply_builder::build(msg_zero);
+    }
+    auto r = mutation_record::expiry(bytes_view { rk.key().data(), rk.key().size() }, 0);
+    return log_change(r, reply_builder::build(msg_one));
+}
+
+future<scattered_message_ptr> database::push(redis_key rk, bytes val, bool force, bool left)
+{
+    return with_allocator_for(data_type::list, [this, rk = std::move(rk), val = std::move(val), force, left] () {
+        auto e = _cache.find(rk);
+        if (!e) {
+             if (!force) {
+                 return reply_builder::build(msg_err);
+             }
+            // create new list object
+            auto entry = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), cache_entry::list_initializer());
+            _cache.insert(entry);
+            ++_stat._total_list_entries;
+            e = entry;
+        }
+        if (e->type_of_list() == false) {
+            return reply_builder::build(msg_type_err);
+        }
+        auto& list = e->value_list();
+        left ? list.insert_head(val) : list.insert_tail(val);
+        auto reply = reply_builder::build(list.size());
+        serve_blocked(rk, e);
+        return reply;
+    });
+}
+
+future<scattered_message_ptr> database::push_multi(redis_key rk, std::vector<bytes> values, bool force, bool left)
+{
+    return with_allocator_for(data_type::list, [this, rk = std::move(rk), values = std::move(values), force, left] () {
+        auto e = _cache.find(rk);
+        if (!e) {
+             if (!force) {
                  return reply_builder::build(msg_err);
              }
             // create new list object
             auto entry = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), cache_entry::list_initializer());
             _cache.insert(entry);
-            ++_stat._total_list_entries;
+            ++_stat._total_list_entries;
+            e = entry;
+        }
+        if (e->type_of_list() == false) {
+            return reply_builder::build(msg_type_err);
+        }
+        auto& list = e->value_list();
+        for (auto& val : values) {
+            left ? list.insert_head(val) : list.insert_tail(val);
+        }
+        auto reply = reply_builder::build(list.size());
+        serve_blocked(rk, e);
+        return reply;
+    });
+}
+
+future<scattered_message_ptr> database::pop(redis_key rk, bool left)
+{
+    ++_stat._read;
+    return with_allocator_for(data_type::list, [this, rk = std::move(rk), left] () {
+        auto e = _cache.find(rk);
+        if (!e) {
+            return reply_builder::build(msg_nil);
+        }
+        if (e->type_of_list() == false) {
+            return reply_builder::build(msg_type_err);
+        }
+        auto& list = e->value_list();
+        assert(!list.empty());
+        auto reply = reply_builder::build(left ? list.front() : list.back());
+        left ? list.pop_front() : list.pop_back();
+        if (list.empty()) {
+           --_stat._total_list_entries;
+           _cache.erase(rk);
+        }
+        ++_stat._hit;
+        return reply;
+    });
+}
+
+future<scattered_message_ptr> database::lmove(redis_key source, redis_key destination, bool from_left, bool to_left, bool wait)
+{
+    ++_stat._read;
+    return with_allocator_for(data_type::list, [this, &source, &destination, from_left, to_left, wait] () {
+        auto s = _cache.find(source);
+        if (!s) {
+            return wait ? make_ready_future<scattered_message_ptr>() : reply_builder::build(msg_null_blik);
+        }
+        auto d = _cache.find(destination);
+        if (s->type_of_list() == false || (d && d->type_of_list() == false)) {
+            return reply_builder::build(msg_type_err);
+        }
+        ++_stat._hit;
+        if (!d) {
+            d = current_allocator().construct<cache_entry>(destination.key(), destination.hash(), cache_entry::list_initializer());
+            _cache.insert(d);
+            ++_stat._total_list_entries;
+        }
+        auto& from = s->value_list();
+        auto reply = reply_builder::build(from_left ? from.front() : from.back());
+        d->value_list().move_from(from, from_left, to_left);
+        if (from.empty()) {
+            --_stat._total_list_entries;
+            _cache.erase(source);
+        }
+        serve_blocked(destination, d);
+        return reply;
+    });
+}
+
+future<scattered_message_ptr> database::lmpop(std::vector<redis_key> keys, bool left, size_t count)
+{
+    ++_stat._read;
+    // the elements are copied into the reply before they are popped.
+    logalloc::reclaim_lock lock(*this);
+    return with_allocator_for(data_type::list, [this, &keys, left, count] () {
+        for (auto& rk : keys) {
+            auto e = _cache.find(rk);
+            if (!e) {
+                continue;
+            }
+            if (e->type_of_list() == false) {
+                return reply_builder::build(msg_type_err);
+            }
+            ++_stat._hit;
+            auto& list = e->value_list();
+            auto n = std::min(count, list.size());
+            auto m = make_lw_shared<scattered_message<char>>();
+            reply_builder::append_array_header(*m, 2);
+            reply_builder::append_bulk(*m, rk.key().data(), rk.key().size());
+            reply_builder::append_array_header(*m, n);
+            for (size_t i = 0; i < n; ++i) {
+                reply_builder::append(*m, left ? list.front() : list.back());
+                left ? list.pop_front() : list.pop_back();
+            }
+            if (list.empty()) {
+                --_stat._total_list_entries;
+                _cache.erase(rk);
+            }
+            return make_ready_future<scattered_message_ptr>(foreign_ptr<lw_shared_ptr<scattered_message<char>>>(m));
+        }
+        return make_ready_future<scattered_message_ptr>();
+    });
+}
+
+future<scattered_message_ptr> database::llen(redis_key rk)
+{
+    auto e = _cache.find(rk);
+    if (!e) {
+        return reply_builder::build(msg_zero);
+    }
+    if (e->type_of_list() == false) {
+        return reply_builder::build(msg_type_err);
+    }
+    auto& list = e->value_list();
+    return reply_builder::build(list.size());
+}
+
+future<scattered_message_ptr> database::lindex(redis_key rk, long idx)
+{
+    ++_stat._read;
+    return _cache.run_with_entry(rk, [this, rk = std::move(rk), idx] (const cache_entry* e) {
+        if (!e) {
+            return reply_builder::build(msg_nil);
+        }
+        if (e->type_of_list() == false) {
+            return reply_builder::build(msg_type_err);
+        }
+        auto& list = e->value_list();
+        auto index = alignment_index_base_on(list.size(), idx);
+        if (list.index_out_of_range(index)) {
+            return reply_builder::build(msg_nil);
+        }
+        auto& result = list.at(static_cast<size_t>(index));
+        ++_stat._hit;
+        return reply_builder::build(result);
+    });
+}
+
+namespace {
+// A reply which is not streamed, as the only chunk.
+future<reply_chunk> whole_reply(future<scattered_message_ptr> reply)
+{
+    return reply.then([] (scattered_message_ptr m) {
+        return reply_chunk { std::move(m), 0, 0 };
+    });
+}
+
+future<reply_chunk> make_chunk(lw_shared_ptr<scattered_message<char>> m, size_t next, size_t left)
+{
+    return make_ready_future<reply_chunk>(reply_chunk { foreign_ptr<lw_shared_ptr<scattered_message<char>>>(m), next, left });
+}
+}
+
+future<reply_chunk> database::lrange(redis_key rk, long start, long end, size_t next, size_t left, bool stream)
+{
+    bool first = left == 0;
+    // the elements are copied into the reply, which may allocate.
+    logalloc::reclaim_lock lock(*this);
+    auto e = _cache.find(rk);
+    auto m = make_lw_shared<scattered_message<char>>();
+    if (first) {
+        ++_stat._read;
+        if (!e) {
+            return whole_reply(reply_builder::build(msg_err));
+        }
+        if (e->type_of_list() == false) {
+            return whole_reply(reply_builder::build(msg_type_err));
+        }
+        auto size = e->value_list().size();
+        start = database::alignment_index_base_on(size, start);
+        end = database::alignment_index_base_on(size, end);
+        if (start < 0) start = 0;
+        if (end >= start && static_cast<size_t>(start) < size) {
+            next = static_cast<size_t>(start);
+            left = std::min(static_cast<size_t>(end), size - 1) - next + 1;
+            ++_stat._hit;
+        }
+        reply_builder::append_array_header(*m, left);
+    }
+    auto n = reply_chunk_size(stream, left);
+    size_t visited = 0;
+    if (e && e->type_of_list()) {
+        visited = e->value_list().for_each_in(next, n, [&m] (const managed_bytes& b) {
+            reply_builder::append(*m, b);
+        });
+    }
+    reply_builder::append_nulls(*m, n - visited);
+    return make_chunk(m, next + n, left - n);
+}
+
+future<scattered_message_ptr> database::lrem(redis_key rk, long count, bytes val)
+{
+    return with_allocator_for(data_type::list, [this, rk = std::move(rk), count, val = std::move(val)] {
+        auto e = _cache.find(rk);
+        if (!e) {
+            return reply_builder::build(msg_err);
+        }
+        if (e->type_of_list() == false) {
+            return reply_builder::build(msg_type_err);
+        }
+        auto& list = e->value_list();
+        size_t removed = 0;
+        if (count == 0) removed = list.trem<true, true>(val, count);
+        else if (count > 0) removed = list.trem<false, true>(val, count);
+        else removed = list.trem<false, false>(val, static_cast<size_t>(-count));
+        if (list.empty()) {
+            --_stat._total_list_entries;
+            _cache.erase(rk);
+        }
+        return reply_builder::build(removed);
+    });
+}
+
+future<scattered_message_ptr> database::linsert(redis_key rk, bytes pivot, bytes val, bool after)
+{
+    return with_allocator_for(data_type::list, [this, rk = std::move(rk), pivot = std::move(pivot), val = std::move(val), after] {
+        auto e = _cache.find(rk);
+        if (!e) {
+            return reply_builder::build(msg_zero);
+        }
+        if (e->type_of_list() == false) {
+            return reply_builder::build(msg_type_err);
+        }
+        auto& list = e->value_list();
+        auto index = list.index_of(pivot);
+        if (list.index_out_of_range(index)) {
+            return reply_builder::build(msg_zero);
+        }
+        if (after) {
+            ++index;
+        }
+        if (index == list.size()) list.insert_tail(val);
+        else list.insert_at(index, val);
+        return reply_builder::build(msg_one);
+    });
+}
+
+future<scattered_message_ptr> database::lset(redis_key rk, long idx, bytes val)
+{
+    return with_allocator_for(data_type::list, [this, rk = std::move(rk), idx, val = std::move(val)] {
+        auto e = _cache.find(rk);
+        if (!e) {
+            return reply_builder::build(msg_nokey_err);
+        }
+        if (e->type_of_list() == false) {
+            return reply_builder::build(msg_type_err);
+        }
+        auto& list = e->value_list();
+        auto nidx = database::alignment_index_base_on(list.size(), idx);
+        if (list.index_out_of_range(nidx)) {
+            return reply_builder::build(msg_out_of_range_err);
+        }
+        list.at(static_cast<size_t>(nidx)) = managed_bytes(bytes_view {val.data(), val.size()});
+        return reply_builder::build(msg_ok);
+        
+    });
+}
+
+future<scattered_message_ptr> database::ltrim(redis_key rk, long start, long end)
+{
+    return with_allocator_for(data_type::list, [this, rk = std::move(rk), start, end] {
+        auto e = _cache.find(rk);
+        if (!e) {
+            return reply_builder::build(msg_ok);
+        }
+        if (e->type_of_list() == false) {
+            return reply_builder::build(msg_type_err);
+        }
+        auto& list = e->value_list();
+        auto nstart = database::alignment_index_base_on(list.size(), start);
+        if (nstart < 0) nstart = 0;
+        auto nend = database::alignment_index_base_on(list.size(), end);
+        if (nstart > nend || nend < 0) {
+            list.clear();
+        }
+        else {
+            list.trim(static_cast<size_t>(nstart), static_cast<size_t>(nend));
+        }
+        if (list.empty()) {
+            --_stat._total_list_entries;
+            _cache.erase(rk);
+        }
+        return reply_builder::build(msg_ok);
+        
+    });
+}
+
+cache_entry* database::construct_dict(const redis_key& rk, bool set)
+{
+    if (set && _options._max_intset_entries > 0) {
+        return current_allocator().construct<cache_entry>(rk.key(), rk.hash(), cache_entry::intset_initializer());
+    }
+    if (_options._max_packed_entries == 0) {
+        return set ? current_allocator().construct<cache_entry>(rk.key(), rk.hash(), cache_entry::set_initializer())
+                   : current_allocator().construct<cache_entry>(rk.key(), rk.hash(), cache_entry::dict_initializer());
+    }
+    return set ? current_allocator().construct<cache_entry>(rk.key(), rk.hash(), cache_entry::packed_set_initializer())
+               : current_allocator().construct<cache_entry>(rk.key(), rk.hash(), cache_entry::packed_dict_initializer());
+}
+
+cache_entry* database::make_dict(const redis_key& rk, bool set)
+{
+    auto entry = construct_dict(rk, set);
+    _cache.insert(entry);
+    if (set) {
+        ++_stat._total_set_entries;
+    } else {
+        ++_stat._total_dict_entries;
+    }
+    return entry;
+}
+
+void database::maybe_unpack(cache_entry* e, size_t fields, size_t size, bool integers)
+{
+    if (!e->packed()) {
+        return;
+    }
+    if (e->packed_integers()) {
+        if (integers) {
+            if (e->dict_size() + fields > _options._max_intset_entries
+                || e->packed_blob_size() + fields * sizeof(int64_t) > packed_dict::max_blob_size) {
+                e->unpack();
+            }
+            return;
+        }
+        // a member which is not an integer: the set is packed as any other
+        // while it fits.
+        e->pack_as_records();
+    }
+    // each record costs at most two varints, a type byte and two strings.
+    auto record_size = 2 * size + 24;
+    if (e->dict_size() + fields > _options._max_packed_entries
+        || size > _options._max_packed_value
+        || e->packed_blob_size() + fields * record_size > packed_dict::max_blob_size) {
+        e->unpack();
+    }
+}
+
+namespace {
+
+inline bytes_view view_of(const bytes& b)
+{
+    return bytes_view { b.data(), b.size() };
+}
+
+// Copies a possibly fragmented value, e.g. a bitmap grown by SETBIT.
+inline bytes linearize(const managed_bytes& o)
+{
+    bytes result(bytes::initialized_later(), o.size());
+    auto out = result.begin();
+    o.for_each_fragment([&out] (bytes_view f) {
+        out = std::copy(f.begin(), f.end(), out);
+    });
+    return result;
+}
+
+template <typename Dict>
+using entries_of = std::vector<const typename std::decay_t<Dict>::entry_type*>;
+
+inline size_t random_number()
+{
+    return rand_generater::rand_less_than(std::numeric_limits<size_t>::max());
+}
+
+// min(count, size) distinct members of the set picked at random, as
+// SRANDMEMBER and SPOP pick them. A pick takes a few draws of the set.
+// Distinct picks of a large part of the set shuffle all its members rather
+// than draw again on every repeat.
+template <typename Set>
+entries_of<Set> random_members(const Set& set, size_t count)
+{
+    entries_of<Set> result;
+    if (set.empty()) {
+        return result;
+    }
+    auto n = std::min(count, set.size());
+    if (n * 3 > set.size()) {
+        set.fetch(result);
+        for (size_t i = 0; i < n && i + 1 < result.size(); ++i) {
+            std::swap(result[i], result[i + rand_generater::rand_less_than(result.size() - i)]);
+        }
+        result.resize(n);
+        return result;
+    }
+    std::unordered_set<const void*> picked;
+    result.reserve(n);
+    while (result.size() < n) {
+        auto e = set.random_entry(random_number);
+        if (picked.insert(e).second) {
+            result.push_back(e);
+        }
+    }
+    return result;
+}
+
+inline bool type_of_value(const dict_entry* d, int64_t) { return d->type_of_integer(); }
+inline bool type_of_value(const dict_entry* d, double) { return d->type_of_float(); }
+inline bool type_of_value(const packed_dict_entry* d, int64_t) { return d->type_of_integer(); }
+inline bool type_of_value(const packed_dict_entry* d, double) { return d->type_of_float(); }
+
+inline void incr_value(dict_entry* d, int64_t delta) { d->value_integer_incr(delta); }
+inline void incr_value(dict_entry* d, double delta) { d->value_float_incr(delta); }
+
+inline int64_t value_of(const packed_dict_entry* d, int64_t) { return d->value_integer(); }
+inline double value_of(const packed_dict_entry* d, double) { return d->value_float(); }
+
+// HINCRBY and HINCRBYFLOAT update a dict_entry in place, but have to
+// rewrite the record of a packed_dict.
+template <typename Value>
+const dict_entry* incr_field(dict_lsa& map, const bytes& key, Value delta)
+{
+    return map.run_with_entry(key, [&map, &key, delta] (dict_entry* d) {
+        if (!d) {
+            d = current_allocator().construct<dict_entry>(key, delta);
+            map.insert(d);
+            return static_cast<const dict_entry*>(d);
+        }
+        incr_value(d, delta);
+        return static_cast<const dict_entry*>(d);
+    });
+}
+
+template <typename Value>
+const packed_dict_entry* incr_field(packed_dict& map, const bytes& key, Value delta)
+{
+    auto value = map.run_with_entry(key, [delta] (const packed_dict_entry* d) {
+        return d ? value_of(d, delta) + delta : delta;
+    });
+    map.put(key, value);
+    return map.run_with_entry(key, [] (const packed_dict_entry* d) { return d; });
+}
+
+
+inline bool key_matches(const bytes& pattern, const char* data, size_t size)
+{
+    return pattern.empty() || string_match(pattern.data(), pattern.size(), data, size);
+}
+
+// The most keys of a prefix a SCAN takes from the key index at once.
+static constexpr size_t max_indexed_scan_keys = 4096;
+
+// The bytes every key matching the glob-style pattern starts with.
+inline bytes_view literal_prefix(const bytes& pattern)
+{
+    size_t n = 0;
+    while (n < pattern.size() && pattern[n] != '*' && pattern[n] != '?' && pattern[n] != '[' && pattern[n] != '\\') {
+        ++n;
+    }
+    return bytes_view { pattern.data(), n };
+}
+
+// Runs steps of `scannable.scan()` from `cursor` until `count` entries were
+// visited or, on a sparse table, 10 * `count` steps found nothing, as Redis
+// does, so that a single call never runs for long. Returns the next cursor.
+template <typename Scannable, typename Func>
+size_t scan_some(Scannable& scannable, size_t cursor, size_t count, Func&& func)
+{
+    size_t visited = 0;
+    auto steps = count * 10;
+    do {
+        cursor = scannable.scan(cursor, [&visited, &func] (const auto& e) {
+            ++visited;
+            func(e);
+        });
+    } while (cursor != 0 && visited < count && --steps > 0);
+    return cursor;
+}
+}
+
+void blocked_pop::finish(outcome o, bytes key, bytes value)
+{
+    auto done = [this, o, key = std::move(key), value = std::move(value)] () mutable {
+        _outcome = o;
+        _key = std::move(key);
+        _value = std::move(value);
+        _done.set_value();
+    };
+    if (_cpu == engine().cpu_id()) {
+        done();
+        return;
+    }
+    smp::submit_to(_cpu, std::move(done));
+}
+
+// Called with the allocator of the region.
+bytes database::pop_element(const redis_key& rk, cache_entry* e, bool left)
+{
+    auto& list = e->value_list();
+    auto value = linearize(left ? list.front() : list.back());
+    left ? list.pop_front() : list.pop_back();
+    if (list.empty()) {
+        --_stat._total_list_entries;
+        _cache.erase(rk);
+    }
+    return value;
+}
+
+void database::serve_blocked(const redis_key& rk, cache_entry* e)
+{
+    if (_blocked_pops.empty()) {
+        return;
+    }
+    auto i = _blocked_pops.find(rk.key());
+    if (i == _blocked_pops.end()) {
+        return;
+    }
+    auto& waiters = i->second;
+    bool sset = e->type_of_sset();
+    auto available = sset ? e->value_sset().size() : e->value_list().size();
+    for (auto w = waiters.begin(); available > 0 && w != waiters.end(); ) {
+        auto b = *w;
+        if (b->_sset != sset) {
+            // it waits for the key to hold the other type.
+            ++w;
+            continue;
+        }
+        w = waiters.erase(w);
+        if (!b->claim()) {
+            continue;
+        }
+        --available;
+        ++_stat._read;
+        ++_stat._hit;
+        auto value = sset ? pop_member(rk, e, !b->_left) : pop_element(rk, e, b->_left);
+        b->finish(blocked_pop::outcome::popped, rk.key(), std::move(value));
+    }
+    if (waiters.empty()) {
+        _blocked_pops.erase(i);
+    }
+}
+
+bool database::pop_or_block(std::vector<bytes> keys, blocked_pop* b, bool block)
+{
+    for (auto& key : keys) {
+        redis_key rk { key };
+        auto e = _cache.find(rk);
+        if (e == nullptr) {
+            continue;
+        }
+        if (!b->claim()) {
+            return true;
+        }
+        if (b->_sset ? e->type_of_sset() == false : e->type_of_list() == false) {
+            b->finish(blocked_pop::outcome::wrong_type);
+            return true;
+        }
+        ++_stat._read;
+        ++_stat._hit;
+        auto value = with_allocator_for(b->_sset ? data_type::sset : data_type::list, [this, &rk, e, b] {
+            return b->_sset ? pop_member(rk, e, !b->_left) : pop_element(rk, e, b->_left);
+        });
+        b->finish(blocked_pop::outcome::popped, std::move(key), std::move(value));
+        return true;
+    }
+    if (!block || b->claimed()) {
+        return true;
+    }
+    for (auto& key : keys) {
+        _blocked_pops[key].push_back(b);
+    }
+    return false;
+}
+
+void database::unblock(std::vector<bytes> keys, blocked_pop* b)
+{
+    if (b->_read) {
+        for (auto& key : keys) {
+            auto i = _blocked_reads.find(key);
+            if (i == _blocked_reads.end()) {
+                continue;
+            }
+            auto& waiters = i->second;
+            waiters.erase(std::remove_if(waiters.begin(), waiters.end(), [b] (auto& w) { return w.first == b; }), waiters.end());
+            if (waiters.empty()) {
+                _blocked_reads.erase(i);
+            }
+        }
+        return;
+    }
+    for (auto& key : keys) {
+        auto i = _blocked_pops.find(key);
+        if (i == _blocked_pops.end()) {
+            continue;
+        }
+        auto& waiters = i->second;
+        waiters.erase(std::remove(waiters.begin(), waiters.end(), b), waiters.end());
+        if (waiters.empty()) {
+            _blocked_pops.erase(i);
+        }
+    }
+}
+
+namespace {
+uint64_t wall_clock_ms()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+void append_header(bytes& out, char tag, size_t n)
+{
+    char buffer[24];
+    out.append(buffer, render_number(buffer, tag, n));
+}
+
+void append_element(bytes& out, const char* data, size_t size)
+{
+    append_header(out, '$', size);
+    out.append(data, size);
+    out.append("\r\n", 2);
+}
+
+void append_stream_id(bytes& out, stream_id id)
+{
+    char buffer[stream_id::max_size];
+    append_element(out, buffer, id.format(buffer));
+}
+
+// `*2 $<id> *<2n> <fields and values>`
+void append_stream_entry(bytes& out, const stream_entry_view& e)
+{
+    append_header(out, '*', 2);
+    append_stream_id(out, e._id);
+    append_header(out, '*', e._fields.size() * 2);
+    for (auto& f : e._fields) {
+        append_element(out, f.first.data(), f.first.size());
+        append_element(out, f.second.data(), f.second.size());
+    }
+}
+
+// `*2 $<key> *<n> <entries>`
+bytes stream_reply(const redis_key& rk, size_t n, const bytes& entries)
+{
+    bytes reply;
+    append_header(reply, '*', 2);
+    append_element(reply, rk.data(), rk.size());
+    append_header(reply, '*', n);
+    reply.append(entries.data(), entries.size());
+    return reply;
+}
+
+// The entries after `after` into r, at most `count` unless it is 0. Those
+// read for a group are its last delivered, and pending for the consumer
+// unless NOACK.
+void read_entries(const redis_key& rk, stream_lsa& s, stream_id after, size_t count, stream_group* g, const stream_group_read* gr,
+    stream_read_result& r)
+{
+    stream_id start;
+    if (!after.next(start)) {
+        return;
+    }
+    bytes entries;
+    auto now = wall_clock_ms();
+    s.range(start, stream_id::max(), false, [&] (const stream_entry_view& e) {
+        append_stream_entry(entries, e);
+        ++r._entries;
+        if (g != nullptr) {
+            g->_last_delivered = e._id;
+            if (!gr->_noack) {
+                g->deliver(gr->_consumer, e._id, now);
+            }
+        }
+        return count == 0 || r._entries < count;
+    });
+    if (r._entries > 0) {
+        r._reply = stream_reply(rk, r._entries, entries);
+    }
+}
+
+future<scattered_message_ptr> build_encoded(const bytes& reply)
+{
+    return reply_builder::build(reply);
+}
+
+using stream_read_result_ptr = foreign_ptr<lw_shared_ptr<stream_read_result>>;
+
+future<stream_read_result_ptr> read_result(lw_shared_ptr<stream_read_result> r)
+{
+    return make_ready_future<stream_read_result_ptr>(make_foreign(std::move(r)));
+}
+}
+
+// Called with the allocator of the region.
+bytes database::pop_member(const redis_key& rk, cache_entry* e, bool max)
+{
+    auto& sset = e->value_sset();
+    std::vector<const sset_entry*> entries;
+    sset.fetch_by_rank(0, 0, entries, max);
+    bytes value;
+    append_element(value, entries.front()->key_data(), entries.front()->key_size());
+    char score[max_float_string];
+    append_element(value, score, format_float_string(entries.front()->score(), score));
+    sset.erase(entries);
+    if (sset.empty()) {
+        --_stat._total_zset_entries;
+        _cache.erase(rk);
+    }
+    return value;
+}
+
+future<scattered_message_ptr> database::xadd(redis_key rk, std::vector<bytes> args, size_t first, stream_id id, bool auto_id, bool auto_seq,
+    bool make_stream, size_t max_length, bool approximate)
+{
+    return with_allocator_for(data_type::stream, [this, rk = std::move(rk), args = std::move(args), first, id, auto_id, auto_seq,
+        make_stream, max_length, approximate] () {
+        auto e = _cache.find(rk);
+        if (!e && !make_stream) {
+            return reply_builder::build(msg_null_blik);
+        }
+        if (e && e->type_of_stream() == false) {
+            return reply_builder::build(msg_type_err);
+        }
+        stream_lsa none;
+        auto& current = e ? e->value_stream() : none;
+        auto added = id;
+        if (auto_id || auto_seq) {
+            if (!current.next_id(wall_clock_ms(), auto_seq ? &id._ms : nullptr, added)) {
+                return reply_builder::build(msg_stream_id_small_err);
+            }
+        }
+        else if (id == stream_id::min()) {
+            return reply_builder::build(msg_stream_id_zero_err);
+        }
+        else if (id <= current.last_id()) {
+            return reply_builder::build(msg_stream_id_small_err);
+        }
+        if (!e) {
+            auto entry = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), cache_entry::stream_initializer());
+            _cache.insert(entry);
+            ++_stat._total_stream_entries;
+            e = entry;
+        }
+        auto& stream = e->value_stream();
+        stream.append(added, args, first);
+        stream.trim(max_length, approximate);
+        bytes reply;
+        append_stream_id(reply, added);
+        serve_blocked_reads(rk, e);
+        return build_encoded(reply);
+    });
+}
+
+future<scattered_message_ptr> database::xlen(redis_key rk)
+{
+    auto e = _cache.find(rk);
+    if (!e) {
+        return reply_builder::build(msg_zero);
+    }
+    if (e->type_of_stream() == false) {
+        return reply_builder::build(msg_type_err);
+    }
+    return reply_builder::build(e->value_stream().size());
+}
+
+future<scattered_message_ptr> database::xrange(redis_key rk, stream_id start, stream_id end, size_t count, bool reverse)
+{
+    ++_stat._read;
+    auto e = _cache.find(rk);
+    if (!e) {
+        return reply_builder::build(msg_empty_multi_bulk);
+    }
+    if (e->type_of_stream() == false) {
+        return reply_builder::build(msg_type_err);
+    }
+    ++_stat._hit;
+    bytes entries;
+    size_t n = 0;
+    e->value_stream().range(start, end, reverse, [&entries, &n, count] (const stream_entry_view& entry) {
+        append_stream_entry(entries, entry);
+        return ++n != count;
+    });
+    bytes reply;
+    append_header(reply, '*', n);
+    reply.append(entries.data(), entries.size());
+    return build_encoded(reply);
+}
+
+future<scattered_message_ptr> database::xdel(redis_key rk, std::vector<stream_id> ids)
+{
+    return with_allocator_for(data_type::stream, [this, rk = std::move(rk), ids = std::move(ids)] () {
+        auto e = _cache.find(rk);
+        if (!e) {
+            return reply_builder::build(msg_zero);
+        }
+        if (e->type_of_stream() == false) {
+            return reply_builder::build(msg_type_err);
+        }
+        auto& stream = e->value_stream();
+        size_t deleted = 0;
+        for (auto& id : ids) {
+            if (stream.remove(id)) {
+                ++deleted;
+            }
+        }
+        return reply_builder::build(deleted);
+    });
+}
+
+future<scattered_message_ptr> database::xtrim(redis_key rk, size_t max_length, bool approximate)
+{
+    return with_allocator_for(data_type::stream, [this, rk = std::move(rk), max_length, approximate] () {
+        auto e = _cache.find(rk);
+        if (!e) {
+            return reply_builder::build(msg_zero);
+        }
+        if (e->type_of_stream() == false) {
+            return reply_builder::build(msg_type_err);
+        }
+        return reply_builder::build(e->value_stream().trim(max_length, approximate));
+    });
+}
+
+future<foreign_ptr<lw_shared_ptr<stream_read_result>>> database::xread(redis_key rk, stream_id after, bool last, size_t count)
+{
+    ++_stat._read;
+    auto r = make_lw_shared<stream_read_result>();
+    auto e = _cache.find(rk);
+    if (!e) {
+        return read_result(std::move(r));
+    }
+    if (e->type_of_stream() == false) {
+        r->_status = stream_read_result::status::wrong_type;
+        return read_result(std::move(r));
+    }
+    ++_stat._hit;
+    auto& stream = e->value_stream();
+    r->_last_id = stream.last_id();
+    read_entries(rk, stream, last ? stream.last_id() : after, count, nullptr, nullptr, *r);
+    return read_result(std::move(r));
+}
+
+// The history of a consumer always replies, if only with no entries. Its
+// entries deleted since they were delivered reply with no fields.
+future<foreign_ptr<lw_shared_ptr<stream_read_result>>> database::xreadgroup(redis_key rk, stream_group_read gr, bool history, stream_id after, size_t count)
+{
+    ++_stat._read;
+    auto r = make_lw_shared<stream_read_result>();
+    auto e = _cache.find(rk);
+    if (e && e->type_of_stream() == false) {
+        r->_status = stream_read_result::status::wrong_type;
+        return read_result(std::move(r));
+    }
+    auto g = e ? e->value_stream().find_group(gr._group) : nullptr;
+    if (g == nullptr) {
+        r->_status = stream_read_result::status::no_group;
+        return read_result(std::move(r));
+    }
+    ++_stat._hit;
+    auto& stream = e->value_stream();
+    auto now = wall_clock_ms();
+    g->consumer(gr._consumer, now);
+    r->_last_id = stream.last_id();
+    if (!history) {
+        read_entries(rk, stream, g->_last_delivered, count, g, &gr, *r);
+        return read_result(std::move(r));
+    }
+    bytes entries;
+    for (auto i = g->_pending.upper_bound(after); i != g->_pending.end() && (count == 0 || r->_entries < count); ++i) {
+        if (i->second._consumer != gr._consumer) {
+            continue;
+        }
+        auto id = i->first;
+        bool found = false;
+        stream.range(id, id, false, [&entries, &found] (const stream_entry_view& entry) {
+            append_stream_entry(entries, entry);
+            found = true;
+            return false;
+        });
+        if (!found) {
+            append_header(entries, '*', 2);
+            append_stream_id(entries, id);
+            entries.append("*-1\r\n", 5);
+        }
+        g->deliver(gr._consumer, id, now);
+        ++r->_entries;
+    }
+    r->_reply = stream_reply(rk, r->_entries, entries);
+    return read_result(std::move(r));
+}
+
+// Called once the entry holds a stream: true when b is done with, read
+// here or by another shard.
+bool database::read_stream_for(const redis_key& rk, cache_entry* e, blocked_pop* b, stream_id after)
+{
+    auto& read = *b->_read;
+    auto& stream = e->value_stream();
+    stream_group* g = nullptr;
+    if (read._grouped) {
+        g = stream.find_group(read._group._group);
+        if (g == nullptr) {
+            return false;
+        }
+        after = g->_last_delivered;
+    }
+    if (!stream.has_after(after)) {
+        return false;
+    }
+    if (!b->claim()) {
+        return true;
+    }
+    ++_stat._read;
+    ++_stat._hit;
+    stream_read_result r;
+    read_entries(rk, stream, after, read._count, g, g ? &read._group : nullptr, r);
+    b->finish(blocked_pop::outcome::popped, rk.key(), std::move(r._reply));
+    return true;
+}
+
+bool database::read_or_block(std::vector<bytes> keys, blocked_pop* b, bool block)
+{
+    auto& read = *b->_read;
+    for (auto& key : keys) {
+        redis_key rk { key };
+        auto e = _cache.find(rk);
+        if (e == nullptr) {
+            continue;
+        }
+        if (e->type_of_stream() == false) {
+            if (b->claim()) {
+                b->finish(blocked_pop::outcome::wrong_type);
+            }
+            return true;
+        }
+        if (read_stream_for(rk, e, b, read._after.at(key))) {
+            return true;
+        }
+    }
+    if (!block || b->claimed()) {
+        return true;
+    }
+    for (auto& key : keys) {
+        _blocked_reads[key].emplace_back(b, read._after.at(key));
+    }
+    return false;
+}
+
+// The XREADs blocked on the stream all read the new entry, the consumers
+// of a group take it in turns.
+void database::serve_blocked_reads(const redis_key& rk, cache_entry* e)
+{
+    if (_blocked_reads.empty()) {
+        return;
+    }
+    auto i = _blocked_reads.find(rk.key());
+    if (i == _blocked_reads.end()) {
+        return;
+    }
+    auto& waiters = i->second;
+    for (auto w = waiters.begin(); w != waiters.end(); ) {
+        if (w->first->claimed() || read_stream_for(rk, e, w->first, w->second)) {
+            w = waiters.erase(w);
+        }
+        else {
+            ++w;
+        }
+    }
+    if (waiters.empty()) {
+        _blocked_reads.erase(i);
+    }
+}
+
+future<scattered_message_ptr> database::xgroup_create(redis_key rk, bytes group, stream_id id, bool last, bool make_stream)
+{
+    return with_allocator_for(data_type::stream, [this, rk = std::move(rk), group = std::move(group), id, last, make_stream] () {
+        auto e = _cache.find(rk);
+        if (!e) {
+            if (!make_stream) {
+                return reply_builder::build(msg_stream_no_key_err);
+            }
+            auto entry = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), cache_entry::stream_initializer());
+            _cache.insert(entry);
+            ++_stat._total_stream_entries;
+            e = entry;
+        }
+        if (e->type_of_stream() == false) {
+            return reply_builder::build(msg_type_err);
+        }
+        auto& stream = e->value_stream();
+        if (stream.find_group(group) != nullptr) {
+            return reply_builder::build(msg_stream_group_exists_err);
+        }
+        stream.groups()[group]._last_delivered = last ? stream.last_id() : id;
+        return reply_builder::build(msg_ok);
+    });
+}
+
+future<scattered_message_ptr> database::xgroup_destroy(redis_key rk, bytes group)
+{
+    auto e = _cache.find(rk);
+    if (!e) {
+        return reply_builder::build(msg_stream_no_key_err);
+    }
+    if (e->type_of_stream() == false) {
+        return reply_builder::build(msg_type_err);
+    }
+    return reply_builder::build(e->value_stream().groups().erase(group) ? msg_one : msg_zero);
+}
+
+future<scattered_message_ptr> database::xgroup_setid(redis_key rk, bytes group, stream_id id, bool last)
+{
+    auto e = _cache.find(rk);
+    if (!e) {
+        return reply_builder::build(msg_stream_no_key_err);
+    }
+    if (e->type_of_stream() == false) {
+        return reply_builder::build(msg_type_err);
+    }
+    auto& stream = e->value_stream();
+    auto g = stream.find_group(group);
+    if (g == nullptr) {
+        return reply_builder::build(msg_stream_no_group_err);
+    }
+    g->_last_delivered = last ? stream.last_id() : id;
+    return reply_builder::build(msg_ok);
+}
+
+future<scattered_message_ptr> database::xgroup_consumer(redis_key rk, bytes group, bytes consumer, bool create)
+{
+    auto e = _cache.find(rk);
+    if (!e) {
+        return reply_builder::build(msg_stream_no_key_err);
+    }
+    if (e->type_of_stream() == false) {
+        return reply_builder::build(msg_type_err);
+    }
+    auto g = e->value_stream().find_group(group);
+    if (g == nullptr) {
+        return reply_builder::build(msg_stream_no_group_err);
+    }
+    if (!create) {
+        return reply_builder::build(g->remove_consumer(consumer));
+    }
+    if (g->_consumers.count(consumer)) {
+        return reply_builder::build(msg_zero);
+    }
+    g->consumer(consumer, wall_clock_ms());
+    return reply_builder::build(msg_one);
+}
+
+future<scattered_message_ptr> database::xack(redis_key rk, bytes group, std::vector<stream_id> ids)
+{
+    auto e = _cache.find(rk);
+    if (!e) {
+        return reply_builder::build(msg_zero);
+    }
+    if (e->type_of_stream() == false) {
+        return reply_builder::build(msg_type_err);
+    }
+    auto g = e->value_stream().find_group(group);
+    if (g == nullptr) {
+        return reply_builder::build(msg_zero);
+    }
+    size_t acknowledged = 0;
+    for (auto& id : ids) {
+        if (g->ack(id)) {
+            ++acknowledged;
+        }
+    }
+    return reply_builder::build(acknowledged);
+}
+
+future<scattered_message_ptr> database::xpending(redis_key rk, bytes group, bool extended, stream_id start, stream_id end, size_t count,
+    uint64_t min_idle, bytes consumer)
+{
+    auto e = _cache.find(rk);
+    if (e && e->type_of_stream() == false) {
+        return reply_builder::build(msg_type_err);
+    }
+    auto g = e ? e->value_stream().find_group(group) : nullptr;
+    if (g == nullptr) {
+        return reply_builder::build(msg_stream_no_group_err);
+    }
+    bytes reply;
+    if (!extended) {
+        // `*4 :<count> $<first> $<last> *<consumers with pending entries>`
+        append_header(reply, '*', 4);
+        append_header(reply, ':', g->_pending.size());
+        if (g->_pending.empty()) {
+            reply.append("$-1\r\n$-1\r\n*-1\r\n", 15);
+            return build_encoded(reply);
+        }
+        append_stream_id(reply, g->_pending.begin()->first);
+        append_stream_id(reply, g->_pending.rbegin()->first);
+        bytes consumers;
+        size_t n = 0;
+        for (auto& c : g->_consumers) {
+            if (c.second._pending == 0) {
+                continue;
+            }
+            char buffer[24];
+            append_header(consumers, '*', 2);
+            append_element(consumers, c.first.data(), c.first.size());
+            append_element(consumers, buffer + 1, render_number(buffer, ':', c.second._pending) - 3);
+            ++n;
+        }
+        append_header(reply, '*', n);
+        reply.append(consumers.data(), consumers.size());
+        return build_encoded(reply);
+    }
+    // `*4 $<id> $<consumer> :<idle> :<deliveries>` for each entry.
+    bytes entries;
+    size_t n = 0;
+    auto now = wall_clock_ms();
+    for (auto i = g->_pending.lower_bound(start); i != g->_pending.end() && i->first <= end && n < count; ++i) {
+        auto& p = i->second;
+        auto idle = now > p._delivered_ms ? now - p._delivered_ms : 0;
+        if (idle < min_idle || (!consumer.empty() && p._consumer != consumer)) {
+            continue;
+        }
+        append_header(entries, '*', 4);
+        append_stream_id(entries, i->first);
+        append_element(entries, p._consumer.data(), p._consumer.size());
+        append_header(entries, ':', idle);
+        append_header(entries, ':', p._deliveries);
+        ++n;
+    }
+    append_header(reply, '*', n);
+    reply.append(entries.data(), entries.size());
+    return build_encoded(reply);
+}
+
+namespace {
+// `*2 :<timestamp> $<value>`
+void append_sample(bytes& out, uint64_t ts, double value)
+{
+    append_header(out, '*', 2);
+    append_header(out, ':', ts);
+    char buffer[max_float_string];
+    append_element(out, buffer, format_float_string(value, buffer));
+}
+
+// Appends the samples of the series in [from, to], or the aggregates of
+// their buckets, at most `count` unless it is 0. Returns how many.
+size_t append_samples(bytes& out, const timeseries_lsa& series, uint64_t from, uint64_t to, size_t count, ts_aggregation agg,
+    uint64_t bucket_ms)
+{
+    size_t n = 0;
+    auto emit = [&out, &n, count] (uint64_t ts, double value) {
+        append_sample(out, ts, value);
+        return ++n != count;
+    };
+    if (agg == ts_aggregation::none) {
+        series.range(from, to, emit);
+        return n;
+    }
+    ts_aggregator aggregator(agg, bucket_ms);
+    bool more = true;
+    series.range(from, to, [&aggregator, &emit, &more] (uint64_t ts, double value) {
+        more = aggregator.add(ts, value, emit);
+        return more;
+    });
+    if (more) {
+        aggregator.finish(emit);
+    }
+    return n;
+}
+}
+
+future<scattered_message_ptr> database::ts_add(redis_key rk, uint64_t ts, bool now, double value, uint64_t retention_ms)
+{
+    return with_allocator_for(data_type::timeseries, [this, rk = std::move(rk), ts, now, value, retention_ms] () {
+        auto e = _cache.find(rk);
+        if (e && e->type_of_timeseries() == false) {
+            return reply_builder::build(msg_type_err);
+        }
+        auto at = now ? wall_clock_ms() : ts;
+        if (e && !e->value_timeseries().empty() && at <= e->value_timeseries().last_timestamp()) {
+            return reply_builder::build(msg_ts_old_timestamp_err);
+        }
+        if (!e) {
+            auto entry = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), cache_entry::timeseries_initializer());
+            entry->value_timeseries().set_retention(retention_ms);
+            _cache.insert(entry);
+            ++_stat._total_timeseries_entries;
+            e = entry;
+        }
+        e->value_timeseries().append(at, value);
+        return reply_builder::build(static_cast<size_t>(at));
+    });
+}
+
+future<scattered_message_ptr> database::ts_range(redis_key rk, uint64_t from, uint64_t to, size_t count, ts_aggregation agg, uint64_t bucket_ms)
+{
+    ++_stat._read;
+    auto e = _cache.find(rk);
+    if (!e) {
+        return reply_builder::build(msg_empty_multi_bulk);
+    }
+    if (e->type_of_timeseries() == false) {
+        return reply_builder::build(msg_type_err);
+    }
+    ++_stat._hit;
+    bytes samples;
+    auto n = append_samples(samples, e->value_timeseries(), from, to, count, agg, bucket_ms);
+    bytes reply;
+    append_header(reply, '*', n);
+    reply.append(samples.data(), samples.size());
+    return build_encoded(reply);
+}
+
+future<foreign_ptr<lw_shared_ptr<bytes>>> database::ts_mrange_part(redis_key rk, uint64_t from, uint64_t to, size_t count, ts_aggregation agg,
+    uint64_t bucket_ms)
+{
+    ++_stat._read;
+    auto part = make_lw_shared<bytes>();
+    auto e = _cache.find(rk);
+    if (e && e->type_of_timeseries()) {
+        ++_stat._hit;
+        bytes samples;
+        auto n = append_samples(samples, e->value_timeseries(), from, to, count, agg, bucket_ms);
+        append_header(*part, '*', 3);
+        append_element(*part, rk.data(), rk.size());
+        append_header(*part, '*', 0);
+        append_header(*part, '*', n);
+        part->append(samples.data(), samples.size());
+    }
+    return make_ready_future<foreign_ptr<lw_shared_ptr<bytes>>>(make_foreign(std::move(part)));
+}
+
+future<scattered_message_ptr> database::bf_reserve(redis_key rk, double error, uint64_t capacity, uint32_t expansion)
+{
+    return with_allocator_for(data_type::bloom, [this, rk = std::move(rk), error, capacity, expansion] () {
+        if (_cache.find(rk) != nullptr) {
+            return reply_builder::build(msg_bf_exists_err);
+        }
+        auto entry = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), cache_entry::bloom_initializer { error, capacity, expansion });
+        _cache.insert(entry);
+        ++_stat._total_bloom_entries;
+        return reply_builder::build(msg_ok);
+    });
+}
+
+future<scattered_message_ptr> database::bf_add(redis_key rk, std::vector<bytes> items, bool multi)
+{
+    return with_allocator_for(data_type::bloom, [this, rk = std::move(rk), items = std::move(items), multi] () {
+        auto e = _cache.find(rk);
+        if (e && e->type_of_bloom() == false) {
+            return reply_builder::build(msg_type_err);
+        }
+        if (!e) {
+            auto entry = current_allocator().construct<cache_entry>(rk.key(), rk.hash(),
+                cache_entry::bloom_initializer { bloom_lsa::default_error, bloom_lsa::default_capacity, bloom_lsa::default_expansion });
+            _cache.insert(entry);
+            ++_stat._total_bloom_entries;
             e = entry;
         }
-        if (e->type_of_list() == false) {
+        auto& filter = e->value_bloom();
+        std::vector<int64_t> added;
+        added.reserve(items.size());
+        for (auto& item : items) {
+            auto r = filter.add(bytes_view { item.data(), item.size() });
+            if (r == bloom_lsa::add_result::full) {
+                return reply_builder::build(msg_bf_full_err);
+            }
+            added.push_back(r == bloom_lsa::add_result::added ? 1 : 0);
+        }
+        if (!multi) {
+            return reply_builder::build(added.front() ? msg_one : msg_zero);
+        }
+        return reply_builder::build(added);
+    });
+}
+
+future<scattered_message_ptr> database::bf_exists(redis_key rk, std::vector<bytes> items, bool multi)
+{
+    ++_stat._read;
+    auto e = _cache.find(rk);
+    if (e && e->type_of_bloom() == false) {
+        return reply_builder::build(msg_type_err);
+    }
+    std::vector<int64_t> found(items.size(), 0);
+    if (e) {
+        ++_stat._hit;
+        auto& filter = e->value_bloom();
+        for (size_t i = 0; i < items.size(); ++i) {
+            found[i] = filter.exists(bytes_view { items[i].data(), items[i].size() }) ? 1 : 0;
+        }
+    }
+    if (!multi) {
+        return reply_builder::build(found.front() ? msg_one : msg_zero);
+    }
+    return reply_builder::build(found);
+}
+
+future<scattered_message_ptr> database::cms_init(redis_key rk, uint32_t width, uint32_t depth)
+{
+    return with_allocator_for(data_type::cms, [this, rk = std::move(rk), width, depth] () {
+        if (_cache.find(rk) != nullptr) {
+            return reply_builder::build(msg_cms_exists_err);
+        }
+        auto entry = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), cache_entry::cms_initializer { width, depth });
+        _cache.insert(entry);
+        ++_stat._total_cms_entries;
+        return reply_builder::build(msg_ok);
+    });
+}
+
+future<scattered_message_ptr> database::cms_incrby(redis_key rk, std::vector<std::pair<bytes, uint32_t>> increments)
+{
+    return with_allocator_for(data_type::cms, [this, rk = std::move(rk), increments = std::move(increments)] () {
+        auto e = _cache.find(rk);
+        if (!e) {
+            return reply_builder::build(msg_cms_no_key_err);
+        }
+        if (e->type_of_cms() == false) {
+            return reply_builder::build(msg_type_err);
+        }
+        auto& sketch = e->value_cms();
+        std::vector<int64_t> estimates;
+        estimates.reserve(increments.size());
+        for (auto& i : increments) {
+            estimates.push_back(sketch.increment(bytes_view { i.first.data(), i.first.size() }, i.second));
+        }
+        return reply_builder::build(estimates);
+    });
+}
+
+future<scattered_message_ptr> database::cms_query(redis_key rk, std::vector<bytes> items)
+{
+    ++_stat._read;
+    auto e = _cache.find(rk);
+    if (!e) {
+        return reply_builder::build(msg_cms_no_key_err);
+    }
+    if (e->type_of_cms() == false) {
+        return reply_builder::build(msg_type_err);
+    }
+    ++_stat._hit;
+    auto& sketch = e->value_cms();
+    std::vector<int64_t> estimates;
+    estimates.reserve(items.size());
+    for (auto& item : items) {
+        estimates.push_back(sketch.query(bytes_view { item.data(), item.size() }));
+    }
+    return reply_builder::build(estimates);
+}
+
+future<scattered_message_ptr> database::topk_reserve(redis_key rk, uint32_t k, uint32_t width, uint32_t depth, double decay)
+{
+    return with_allocator_for(data_type::topk, [this, rk = std::move(rk), k, width, depth, decay] () {
+        if (_cache.find(rk) != nullptr) {
+            return reply_builder::build(msg_topk_exists_err);
+        }
+        auto entry = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), cache_entry::topk_initializer { k, width, depth, decay });
+        _cache.insert(entry);
+        ++_stat._total_topk_entries;
+        return reply_builder::build(msg_ok);
+    });
+}
+
+future<scattered_message_ptr> database::topk_add(redis_key rk, std::vector<bytes> items)
+{
+    return with_allocator_for(data_type::topk, [this, rk = std::move(rk), items = std::move(items)] () {
+        auto e = _cache.find(rk);
+        if (!e) {
+            return reply_builder::build(msg_topk_no_key_err);
+        }
+        if (e->type_of_topk() == false) {
+            return reply_builder::build(msg_type_err);
+        }
+        auto& topk = e->value_topk();
+        std::vector<bytes> names(items.size());
+        std::vector<const bytes*> expelled(items.size(), nullptr);
+        for (size_t i = 0; i < items.size(); ++i) {
+            if (topk.add(bytes_view { items[i].data(), items[i].size() }, 1, names[i])) {
+                expelled[i] = &names[i];
+            }
+        }
+        return reply_builder::build(expelled);
+    });
+}
+
+future<scattered_message_ptr> database::topk_query(redis_key rk, std::vector<bytes> items)
+{
+    ++_stat._read;
+    auto e = _cache.find(rk);
+    if (!e) {
+        return reply_builder::build(msg_topk_no_key_err);
+    }
+    if (e->type_of_topk() == false) {
+        return reply_builder::build(msg_type_err);
+    }
+    ++_stat._hit;
+    auto& topk = e->value_topk();
+    std::vector<int64_t> found;
+    found.reserve(items.size());
+    for (auto& item : items) {
+        found.push_back(topk.contains(bytes_view { item.data(), item.size() }) ? 1 : 0);
+    }
+    return reply_builder::build(found);
+}
+
+future<scattered_message_ptr> database::topk_list(redis_key rk, bool with_count)
+{
+    ++_stat._read;
+    auto e = _cache.find(rk);
+    if (!e) {
+        return reply_builder::build(msg_topk_no_key_err);
+    }
+    if (e->type_of_topk() == false) {
+        return reply_builder::build(msg_type_err);
+    }
+    ++_stat._hit;
+    auto& topk = e->value_topk();
+    bytes reply;
+    append_header(reply, '*', topk.size() * (with_count ? 2 : 1));
+    topk.list([&reply, with_count] (bytes_view name, uint32_t count) {
+        append_element(reply, name.data(), name.size());
+        if (with_count) {
+            append_header(reply, ':', count);
+        }
+    });
+    return reply_builder::build(build_encoded(std::move(reply)));
+}
+
+namespace {
+// Keeps `top` the `n` greatest keys by `less`, greatest first. The key is
+// built only once it makes it in.
+template <typename Less, typename Make>
+void offer_sample(std::vector<sampled_key>& top, size_t n, const sampled_key& candidate, Less&& less, Make&& make)
+{
+    if (top.size() >= n && !less(top.back(), candidate)) {
+        return;
+    }
+    auto at = std::upper_bound(top.begin(), top.end(), candidate, [&less] (const sampled_key& a, const sampled_key& b) {
+        return less(b, a);
+    });
+    top.insert(at, make());
+    if (top.size() > n) {
+        top.pop_back();
+    }
+}
+}
+
+// One step of the walk of the key sampler, bounded like a SCAN call. The
+// frequencies are those of the LFU counters, which count the accesses on a
+// logarithmic scale and decay by a step each minute without accesses.
+void database::sample_keys()
+{
+    auto n = _options._sampled_keys;
+    auto now = clock_type::now();
+    auto& walk = _key_samples_walk;
+    with_allocator(allocator(), [this, n, now, &walk] {
+        _key_sampling_cursor = scan_some(_cache, _key_sampling_cursor, _options._key_sampling_batch, [n, now, &walk] (const cache_entry& e) {
+            sampled_key candidate;
+            candidate._type = e.type();
+            candidate._frequency = e.lfu_counter(now);
+            candidate._elements = e.value_elements();
+            candidate._bytes = e.memory_usage(5);
+            candidate._shard = engine().cpu_id();
+            auto make = [&e, &candidate] {
+                auto k = candidate;
+                k._key = bytes { e.key_data(), e.key_size() };
+                return k;
+            };
+            offer_sample(walk._hot, n, candidate, [] (const sampled_key& a, const sampled_key& b) { return a._frequency < b._frequency; }, make);
+            offer_sample(walk._largest_bytes, n, candidate, [] (const sampled_key& a, const sampled_key& b) { return a._bytes < b._bytes; }, make);
+            if (candidate._elements > 0) {
+                offer_sample(walk._largest_elements, n, candidate, [] (const sampled_key& a, const sampled_key& b) { return a._elements < b._elements; }, make);
+            }
+        });
+    });
+    if (_key_sampling_cursor == 0) {
+        walk._rounds = _key_samples._rounds + 1;
+        _key_samples = std::move(walk);
+        walk = key_samples();
+    }
+}
+
+foreign_ptr<lw_shared_ptr<key_samples>> database::get_key_samples() const
+{
+    return make_foreign(make_lw_shared<key_samples>(_key_samples));
+}
+
+future<scattered_message_ptr> database::hset(redis_key rk, bytes key, bytes val)
+{
+    expire_fields(rk);
+    return with_allocator_for(data_type::dict, [this, rk = std::move(rk), key = std::move(key), val = std::move(val)] {
+        auto e = _cache.find(rk);
+        if (!e) {
+            // the rk was not exists, then create it.
+            e = make_dict(rk, false);
+        }
+        if (e->type_of_map() == false) {
+            return reply_builder::build(msg_type_err);
+        }
+        maybe_unpack(e, 1, std::max(key.size(), val.size()));
+        bool inserted = e->with_dict([&key, &val] (auto& map) {
+            return map.put(key, val);
+        });
+        // a field set anew no longer expires.
+        if (e->has_field_ttls()) {
+            _field_expiry.drop_field(rk.key(), key);
+        }
+        auto r = mutation_record::field_set(view_of(rk.key()), view_of(key), view_of(val));
+        return log_change(r, reply_builder::build(inserted ? msg_one : msg_zero));
+    });
+}
+
+future<scattered_message_ptr> database::hincrby(redis_key rk, bytes key, int64_t delta)
+{
+    expire_fields(rk);
+    return with_allocator_for(data_type::dict, [this, rk = std::move(rk), key = std::move(key), delta] {
+        auto e = _cache.find(rk);
+        if (!e) {
+            // the rk was not exists, then create it.
+            e = make_dict(rk, false);
+        }
+        if (e->type_of_map() == false) {
+            return reply_builder::build(msg_type_err);
+        }
+        maybe_unpack(e, 1, key.size());
+        return e->with_dict([this, &rk, &key, delta] (auto& map) {
+            bool integer = map.run_with_entry(key, [delta] (const auto* d) {
+                return !d || type_of_value(d, delta);
+            });
+            if (!integer) {
+                return reply_builder::build(msg_not_integer_err);
+            }
+            auto d = incr_field(map, key, delta);
+            auto r = mutation_record::field_set(view_of(rk.key()), view_of(key), d->value_integer());
+            return log_change(r, reply_builder::build<false, true>(d));
+        });
+    });
+}
+
+future<scattered_message_ptr> database::hincrbyfloat(redis_key rk, bytes key, double delta)
+{
+    expire_fields(rk);
+    return with_allocator_for(data_type::dict, [this, rk = std::move(rk), key = std::move(key), delta] {
+        auto e = _cache.find(rk);
+        if (!e) {
+            // the rk was not exists, then create it.
+            e = make_dict(rk, false);
+        }
+        if (e->type_of_map() == false) {
+            return reply_builder::build(msg_type_err);
+        }
+        maybe_unpack(e, 1, key.size());
+        return e->with_dict([this, &rk, &key, delta] (auto& map) {
+            bool floating = map.run_with_entry(key, [delta] (const auto* d) {
+                return !d || type_of_value(d, delta);
+            });
+            if (!floating) {
+                return reply_builder::build(msg_not_float_err);
+            }
+            auto d = incr_field(map, key, delta);
+            auto r = mutation_record::field_set(view_of(rk.key()), view_of(key), d->value_float());
+            return log_change(r, reply_builder::build<false, true>(d));
+        });
+    });
+}
+
+future<scattered_message_ptr> database::hmset(redis_key rk, std::vector<std::pair<bytes, bytes>> kvs, bool reply_added)
+{
+    return hmset_direct(std::move(rk), std::move(kvs)).then([reply_added] (long added) {
+        if (added < 0) {
+            return reply_builder::build(msg_type_err);
+        }
+        return reply_added ? reply_builder::build(static_cast<size_t>(added)) : reply_builder::build(msg_ok);
+    });
+}
+
+future<long> database::hmset_direct(redis_key rk, std::vector<std::pair<bytes, bytes>> kvs)
+{
+    expire_fields(rk);
+    return with_allocator_for(data_type::dict, [this, rk = std::move(rk), kvs = std::move(kvs)] {
+        auto e = _cache.find(rk);
+        if (!e) {
+            // the rk was not exists, then create it.
+            e = make_dict(rk, false);
+        }
+        if (e->type_of_map() == false) {
+            return make_ready_future<long>(-1);
+        }
+        size_t max_size = 0;
+        for (auto& kv : kvs) {
+            max_size = std::max(max_size, std::max(kv.first.size(), kv.second.size()));
+        }
+        maybe_unpack(e, kvs.size(), max_size);
+        std::vector<mutation_record> records;
+        records.reserve(kvs.size());
+        size_t added = 0;
+        e->with_dict([&rk, &kvs, &records, &added] (auto& map) {
+            map.reserve(map.size() + kvs.size());
+            for (auto& kv : kvs) {
+                if (map.put(kv.first, kv.second)) {
+                    ++added;
+                }
+                records.emplace_back(mutation_record::field_set(view_of(rk.key()), view_of(kv.first), view_of(kv.second)));
+            }
+        });
+        if (e->has_field_ttls()) {
+            for (auto& kv : kvs) {
+                _field_expiry.drop_field(rk.key(), kv.first);
+            }
+        }
+        return log_changes(records, make_ready_future<long>(added));
+    });
+}
+
+future<scattered_message_ptr> database::hget(redis_key rk, bytes key)
+{
+    expire_fields(rk);
+    ++_stat._read;
+    auto e = _cache.find(rk);
+    if (!e) {
+        return reply_builder::build(msg_err);
+    }
+    if (e->type_of_map() == false) {
+        return reply_builder::build(msg_type_err);
+    }
+    return e->with_dict([this, &key] (const auto& map) {
+        return map.run_with_entry(key, [this] (const auto* d) {
+            if (d) ++_stat._hit;
+            return reply_builder::build<false, true>(d);
+        });
+    });
+}
+
+future<scattered_message_ptr> database::hdel_multi(redis_key rk, std::vector<bytes> keys)
+{
+    return hdel_direct(std::move(rk), std::move(keys)).then([] (long removed) {
+        return removed < 0 ? reply_builder::build(msg_type_err) : reply_builder::build(static_cast<size_t>(removed));
+    });
+}
+
+future<long> database::hdel_direct(redis_key rk, std::vector<bytes> keys)
+{
+    expire_fields(rk);
+    return with_allocator_for(data_type::dict, [this, rk = std::move(rk), keys = std::move(keys)] {
+        auto e = _cache.find(rk);
+        if (!e) {
+            return make_ready_future<long>(0);
+        }
+        if (e->type_of_map() == false) {
+            return make_ready_future<long>(-1);
+        }
+        size_t removed = 0;
+        std::vector<mutation_record> records;
+        bool empty = e->with_dict([&rk, &keys, &removed, &records] (auto& map) {
+            for (auto& key : keys) {
+                if (map.erase(key)) {
+                    ++ removed;
+                    records.emplace_back(mutation_record::field_del(view_of(rk.key()), view_of(key)));
+                }
+            }
+            return map.empty();
+        });
+        if (e->has_field_ttls()) {
+            for (auto& key : keys) {
+                _field_expiry.drop_field(rk.key(), key);
+            }
+        }
+        if (empty) {
+            --_stat._total_dict_entries;
+            _cache.erase(rk);
+        }
+        return log_changes(records, make_ready_future<long>(removed));
+    });
+}
+
+
+future<scattered_message_ptr> database::hdel(redis_key rk, bytes key)
+{
+    expire_fields(rk);
+    return with_allocator_for(data_type::dict, [this, rk = std::move(rk), key = std::move(key)] {
+        auto e = _cache.find(rk);
+        if (!e) {
+            return reply_builder::build(msg_zero);
+        }
+        if (e->type_of_map() == false) {
+            return reply_builder::build(msg_type_err);
+        }
+        bool exists = false;
+        bool empty = e->with_dict([&key, &exists] (auto& map) {
+            exists = map.erase(key);
+            return map.empty();
+        });
+        if (e->has_field_ttls()) {
+            _field_expiry.drop_field(rk.key(), key);
+        }
+        if (empty) {
+            --_stat._total_dict_entries;
+            _cache.erase(rk);
+        }
+        if (!exists) {
+            return reply_builder::build(msg_err);
+        }
+        auto r = mutation_record::field_del(view_of(rk.key()), view_of(key));
+        return log_change(r, reply_builder::build(msg_ok));
+    });
+}
+
+future<scattered_message_ptr> database::hexists(redis_key rk, bytes key)
+{
+    expire_fields(rk);
+    return with_allocator_for(data_type::dict, [this, rk = std::move(rk), key = std::move(key)] {
+        auto e = _cache.find(rk);
+        if (!e) {
+            return reply_builder::build(msg_zero);
+        }
+        if (e->type_of_map() == false) {
+            return reply_builder::build(msg_type_err);
+        }
+        auto result = e->with_dict([&key] (const auto& map) { return map.exists(key); });
+        return reply_builder::build(result ? msg_one : msg_zero);
+    });
+}
+
+future<scattered_message_ptr> database::hstrlen(redis_key rk, bytes key)
+{
+    expire_fields(rk);
+    auto e = _cache.find(rk);
+    if (!e) {
+        return reply_builder::build(msg_zero);
+    }
+    if (e->type_of_map() == false) {
+        return reply_builder::build(msg_type_err);
+    }
+    return e->with_dict([&key] (const auto& map) {
+        return map.run_with_entry(key, [] (const auto* d) {
+            if (!d) {
+                return reply_builder::build(msg_zero);
+            }
+            return reply_builder::build(d->value_bytes_size());
+        });
+    });
+}
+
+future<scattered_message_ptr> database::hlen(redis_key rk)
+{
+    expire_fields(rk);
+    auto e = _cache.find(rk);
+    if (!e) {
+        return reply_builder::build(msg_zero);
+    }
+    if (e->type_of_map() == false) {
+        return reply_builder::build(msg_type_err);
+    }
+    return reply_builder::build(e->dict_size());
+}
+
+template<bool Key, bool Value>
+future<reply_chunk> database::dict_chunk(const redis_key& rk, bool set, size_t next, size_t left, bool stream)
+{
+    bool first = left == 0;
+    if (first && !set) {
+        expire_fields(rk);
+    }
+    logalloc::reclaim_lock lock(*this);
+    return _cache.run_with_entry(rk, [this, set, first, next, left, stream] (const cache_entry* e) mutable {
+        bool typed = e && (set ? e->type_of_set() : e->type_of_map());
+        size_t per_field = (Key && Value) ? 2 : 1;
+        if (first) {
+            ++_stat._read;
+            if (!e) {
+                return whole_reply(reply_builder::build(set ? msg_nil : msg_err));
+            }
+            if (!typed) {
+                return whole_reply(reply_builder::build(msg_type_err));
+            }
+            left = e->dict_size() * per_field;
+            if (left > 0) ++_stat._hit;
+            if (reply_chunk_size(stream, left) == left) {
+                return e->with_dict([] (const auto& map) {
+                    entries_of<decltype(map)> entries;
+                    map.fetch(entries);
+                    return whole_reply(reply_builder::build<Key, Value>(entries));
+                });
+            }
+        }
+        auto m = make_lw_shared<scattered_message<char>>();
+        if (first) {
+            reply_builder::append_array_header(*m, left);
+        }
+        // the walk is a scan, which visits a whole slot at a time, so that a
+        // chunk may run a little over its size. A cursor of 0 ends it.
+        auto n = reply_chunk_size(stream, left);
+        size_t written = 0;
+        if (typed && (first || next != 0)) {
+            e->with_dict([&] (const auto& map) {
+                do {
+                    next = map.scan(next, [&] (const auto& f) {
+                        if (written < left) {
+                            reply_builder::append_dict_entry<Key, Value>(*m, &f);
+                            written += per_field;
+                        }
+                    });
+                } while (next != 0 && written < n);
+            });
+        }
+        else {
+            next = 0;
+        }
+        if (next == 0 && written < n) {
+            reply_builder::append_nulls(*m, n - written);
+            written = n;
+        }
+        return make_chunk(m, next, left - written);
+    });
+}
+
+future<reply_chunk> database::hgetall(redis_key rk, size_t next, size_t left, bool stream)
+{
+    return dict_chunk<true, true>(rk, false, next, left, stream);
+}
+
+future<reply_chunk> database::hgetall_values(redis_key rk, size_t next, size_t left, bool stream)
+{
+    return dict_chunk<false, true>(rk, false, next, left, stream);
+}
+
+future<reply_chunk> database::hgetall_keys(redis_key rk, size_t next, size_t left, bool stream)
+{
+    return dict_chunk<true, false>(rk, false, next, left, stream);
+}
+
+future<scattered_message_ptr> database::hscan(redis_key rk, size_t cursor, bytes pattern, size_t count)
+{
+    expire_fields(rk);
+    ++_stat._read;
+    return _cache.run_with_entry(rk, [this, cursor, &pattern, count] (const cache_entry* e) {
+        if (!e) {
+            return reply_builder::build(msg_empty_scan);
+        }
+        if (e->type_of_map() == false) {
+            return reply_builder::build(msg_type_err);
+        }
+        return e->with_dict([this, cursor, &pattern, count] (const auto& map) {
+            entries_of<decltype(map)> entries;
+            auto next = scan_some(map, cursor, count, [&entries, &pattern] (const auto& f) {
+                if (key_matches(pattern, f.key_data(), f.key_size())) {
+                    entries.push_back(&f);
+                }
+            });
+            if (!entries.empty()) ++_stat._hit;
+            return reply_builder::build_scan<true>(next, entries);
+        });
+    });
+}
+
+future<scattered_message_ptr> database::hmget(redis_key rk, std::vector<bytes> keys)
+{
+    expire_fields(rk);
+    ++_stat._read;
+    auto e = _cache.find(rk);
+    if (!e) {
+        return reply_builder::build(msg_err);
+    }
+    if (e->type_of_map() == false) {
+        return reply_builder::build(msg_type_err);
+    }
+    return e->with_dict([this, &keys] (const auto& map) {
+        entries_of<decltype(map)> entries;
+        map.fetch(keys, entries);
+        if (!entries.empty()) ++_stat._hit;
+        return reply_builder::build<false, true>(entries);
+    });
+}
+
+future<foreign_ptr<lw_shared_ptr<database::batch_values_type>>> database::hmget_direct(redis_key rk, std::vector<bytes> fields)
+{
+    expire_fields(rk);
+    ++_stat._read;
+    using return_type = foreign_ptr<lw_shared_ptr<batch_values_type>>;
+    auto e = _cache.find(rk);
+    if (e && e->type_of_map() == false) {
+        return make_ready_future<return_type>();
+    }
+    auto result = make_lw_shared<batch_values_type>(fields.size());
+    bool found = false;
+    if (e) {
+        e->with_dict([&fields, &result, &found] (const auto& map) {
+            for (size_t i = 0; i < fields.size(); ++i) {
+                map.run_with_entry(fields[i], [&result, &found, i] (const auto* d) {
+                    if (d) {
+                        (*result)[i] = dict_value(*d);
+                        found = true;
+                    }
+                });
+            }
+        });
+    }
+    if (found) ++_stat._hit;
+    return make_ready_future<return_type>(return_type(std::move(result)));
+}
+
+void database::expire_fields(const redis_key& rk)
+{
+    if (_field_expiry.size() == 0) {
+        return;
+    }
+    auto fields = _field_expiry.take_expired(rk.key(), clock_type::now());
+    if (!fields.empty()) {
+        remove_expired_fields(rk, fields);
+    }
+}
+
+void database::remove_expired_fields(const redis_key& rk, const std::vector<bytes>& fields)
+{
+    with_allocator_for(data_type::dict, [this, &rk, &fields] {
+        auto e = _cache.find(rk);
+        if (!e || !e->type_of_map()) {
+            return;
+        }
+        bool empty = e->with_dict([&fields] (auto& map) {
+            for (auto& field : fields) {
+                map.erase(field);
+            }
+            return map.empty();
+        });
+        if (empty) {
+            --_stat._total_dict_entries;
+            _cache.erase(rk);
+        }
+        // logged as HDEL would, or a replay would bring the fields back
+        // without their expiry.
+        for (auto& field : fields) {
+            _commit_log->append(mutation_record::field_del(view_of(rk.key()), view_of(field))).handle_exception([] (std::exception_ptr) {});
+        }
+    });
+}
+
+future<scattered_message_ptr> database::hexpire(redis_key rk, int64_t ms, std::vector<bytes> fields)
+{
+    expire_fields(rk);
+    return with_allocator_for(data_type::dict, [this, rk = std::move(rk), ms, fields = std::move(fields)] {
+        std::vector<int64_t> results;
+        auto e = _cache.find(rk);
+        if (!e) {
+            results.assign(fields.size(), -2);
+            return reply_builder::build(results);
+        }
+        if (e->type_of_map() == false) {
+            return reply_builder::build(msg_type_err);
+        }
+        results.reserve(fields.size());
+        auto deadline = clock_type::now() + std::chrono::milliseconds(ms);
+        std::vector<mutation_record> records;
+        bool expiring = false;
+        bool empty = e->with_dict([this, &rk, &fields, ms, deadline, &results, &records, &expiring] (auto& map) {
+            for (auto& field : fields) {
+                if (!map.exists(field)) {
+                    results.push_back(-2);
+                }
+                else if (ms <= 0) {
+                    map.erase(field);
+                    _field_expiry.drop_field(rk.key(), field);
+                    records.emplace_back(mutation_record::field_del(view_of(rk.key()), view_of(field)));
+                    results.push_back(2);
+                }
+                else {
+                    _field_expiry.set(rk.key(), field, deadline);
+                    expiring = true;
+                    results.push_back(1);
+                }
+            }
+            return map.empty();
+        });
+        if (expiring) {
+            e->set_field_ttls();
+        }
+        if (empty) {
+            --_stat._total_dict_entries;
+            _cache.erase(rk);
+        }
+        return log_changes(records, reply_builder::build(results));
+    });
+}
+
+future<scattered_message_ptr> database::httl(redis_key rk, std::vector<bytes> fields, bool milliseconds)
+{
+    expire_fields(rk);
+    return _cache.run_with_entry(rk, [this, &rk, &fields, milliseconds] (const cache_entry* e) {
+        std::vector<int64_t> results;
+        if (!e) {
+            results.assign(fields.size(), -2);
+            return reply_builder::build(results);
+        }
+        if (e->type_of_map() == false) {
+            return reply_builder::build(msg_type_err);
+        }
+        results.reserve(fields.size());
+        auto now = clock_type::now();
+        e->with_dict([this, &rk, &fields, milliseconds, now, &results] (const auto& map) {
+            for (auto& field : fields) {
+                if (!map.exists(field)) {
+                    results.push_back(-2);
+                    continue;
+                }
+                auto deadline = _field_expiry.find(rk.key(), field);
+                if (!deadline) {
+                    results.push_back(-1);
+                    continue;
+                }
+                auto ttl = std::chrono::duration_cast<std::chrono::milliseconds>(*deadline - now).count();
+                ttl = std::max<int64_t>(ttl, 0);
+                results.push_back(milliseconds ? ttl : (ttl + 500) / 1000);
+            }
+        });
+        return reply_builder::build(results);
+    });
+}
+
+future<scattered_message_ptr> database::hpersist(redis_key rk, std::vector<bytes> fields)
+{
+    expire_fields(rk);
+    return _cache.run_with_entry(rk, [this, &rk, &fields] (const cache_entry* e) {
+        std::vector<int64_t> results;
+        if (!e) {
+            results.assign(fields.size(), -2);
+            return reply_builder::build(results);
+        }
+        if (e->type_of_map() == false) {
+            return reply_builder::build(msg_type_err);
+        }
+        results.reserve(fields.size());
+        e->with_dict([this, &rk, &fields, &results] (const auto& map) {
+            for (auto& field : fields) {
+                if (!map.exists(field)) {
+                    results.push_back(-2);
+                }
+                else {
+                    results.push_back(_field_expiry.drop_field(rk.key(), field) ? 1 : -1);
+                }
+            }
+        });
+        return reply_builder::build(results);
+    });
+}
+
+future<reply_chunk> database::srandmember(redis_key rk, int64_t count, size_t next, size_t left, bool stream)
+{
+    bool first = left == 0;
+    logalloc::reclaim_lock lock(*this);
+    auto e = _cache.find(rk);
+    bool typed = e && e->type_of_set();
+    if (first) {
+        ++_stat._read;
+        if (!e) {
+            return whole_reply(reply_builder::build<true, false>(std::vector<const dict_entry*>()));
+        }
+        if (!typed) {
+            return whole_reply(reply_builder::build(msg_type_err));
+        }
+        if (count >= 0) {
+            return e->with_dict([this, count] (const auto& set) {
+                auto result = random_members(set, static_cast<size_t>(count));
+                if (!result.empty()) ++_stat._hit;
+                return whole_reply(reply_builder::build<true, false>(result));
+            });
+        }
+        left = 0 - static_cast<uint64_t>(count);
+        ++_stat._hit;
+    }
+    // the picks are drawn straight into the reply, a chunk at a time, and
+    // no list of them is kept.
+    auto m = make_lw_shared<scattered_message<char>>();
+    if (first) {
+        reply_builder::append_array_header(*m, left);
+    }
+    auto n = reply_chunk_size(stream, left);
+    size_t written = 0;
+    if (typed) {
+        e->with_dict([&m, n, &written] (const auto& set) {
+            for (; written < n && !set.empty(); ++written) {
+                reply_builder::append_dict_entry<true, false>(*m, set.random_entry(random_number));
+            }
+        });
+    }
+    reply_builder::append_nulls(*m, n - written);
+    return make_chunk(m, next, left - n);
+}
+
+future<scattered_message_ptr> database::sadds(redis_key rk, std::vector<bytes> members)
+{
+    return with_allocator_for(data_type::set, [this, rk = std::move(rk), members = std::move(members)] {
+        auto o = _cache.find(rk);
+        if (!o) {
+            o = make_dict(rk, true);
+        }
+        if (o->type_of_set() == false) {
+            return reply_builder::build(msg_type_err);
+        }
+        size_t max_size = 0;
+        for (auto& member : members) {
+            max_size = std::max(max_size, member.size());
+        }
+        maybe_unpack(o, members.size(), max_size, packed_dict::integer_members(members));
+        size_t inserted = 0;
+        o->with_dict([&members, &inserted] (auto& set) {
+            for (auto& member : members) {
+                if (set.insert_key(member)) {
+                    inserted++;
+                }
+            }
+        });
+        return reply_builder::build(inserted);
+    });
+}
+
+bool database::sadd_direct(redis_key rk, bytes member)
+{
+    return with_allocator_for(data_type::set, [this, rk = std::move(rk), member = std::move(member)] {
+        auto o = _cache.find(rk);
+        if (!o) {
+            o = make_dict(rk, true);
+        }
+        if (o->type_of_set() == false) {
+            return false;
+        }
+        maybe_unpack(o, 1, member.size(), packed_dict::integer_member(member));
+        o->with_dict([&member] (auto& set) { set.insert_key(member); });
+        return true;
+    });
+}
+
+bool database::sadds_direct(redis_key rk, std::vector<bytes> members)
+{
+    return with_allocator_for(data_type::set, [this, rk = std::move(rk), members = std::move(members)] {
+        auto o = _cache.find(rk);
+        if (!o) {
+            o = make_dict(rk, true);
+        }
+        if (o->type_of_set() == false) {
+            return false;
+        }
+        size_t max_size = 0;
+        for (auto& member : members) {
+            max_size = std::max(max_size, member.size());
+        }
+        maybe_unpack(o, members.size(), max_size, packed_dict::integer_members(members));
+        size_t inserted = 0;
+        o->with_dict([&members, &inserted] (auto& set) {
+            for (auto& member : members) {
+                if (set.insert_key(member)) {
+                    inserted++;
+                }
+            }
+        });
+        return true;
+    });
+}
+
+future<scattered_message_ptr> database::scard(redis_key rk)
+{
+    auto e = _cache.find(rk);
+    if (!e) {
+        return reply_builder::build(msg_zero);
+    }
+    if (e->type_of_set() == false) {
+        return reply_builder::build(msg_type_err);
+    }
+    return reply_builder::build(e->dict_size());
+}
+
+future<scattered_message_ptr> database::sismember(redis_key rk, bytes member)
+{
+    auto e = _cache.find(rk);
+    if (!e) {
+        return reply_builder::build(msg_zero);
+    }
+    if (e->type_of_set() == false) {
+        return reply_builder::build(msg_type_err);
+    }
+    auto result = e->with_dict([&member] (const auto& set) { return set.exists(member); });
+    return reply_builder::build(result ? msg_one : msg_zero);
+}
+
+future<reply_chunk> database::smembers(redis_key rk, size_t next, size_t left, bool stream)
+{
+    return dict_chunk<true, false>(rk, true, next, left, stream);
+}
+
+future<scattered_message_ptr> database::sscan(redis_key rk, size_t cursor, bytes pattern, size_t count)
+{
+    ++_stat._read;
+    return _cache.run_with_entry(rk, [this, cursor, &pattern, count] (const cache_entry* e) {
+        if (!e) {
+            return reply_builder::build(msg_empty_scan);
+        }
+        if (e->type_of_set() == false) {
+            return reply_builder::build(msg_type_err);
+        }
+        return e->with_dict([this, cursor, &pattern, count] (const auto& set) {
+            entries_of<decltype(set)> entries;
+            auto next = scan_some(set, cursor, count, [&entries, &pattern] (const auto& m) {
+                if (key_matches(pattern, m.key_data(), m.key_size())) {
+                    entries.push_back(&m);
+                }
+            });
+            if (!entries.empty()) ++_stat._hit;
+            return reply_builder::build_scan<false>(next, entries);
+        });
+    });
+}
+
+future<foreign_ptr<lw_shared_ptr<bytes>>> database::get_hll_direct(redis_key rk)
+{
+    using return_type = foreign_ptr<lw_shared_ptr<bytes>>;
+    auto e = _cache.find(rk);
+    if (!e || e->type_of_hll() == false) {
+        return make_ready_future<return_type>(foreign_ptr<lw_shared_ptr<bytes>>(nullptr));
+    }
+    auto data = e->value_bytes_data();
+    auto size = e->value_bytes_size();
+    ++_stat._hit;
+    return make_ready_future<return_type>(foreign_ptr<lw_shared_ptr<bytes>>(make_lw_shared<bytes>(bytes {data, size})));
+}
+
+future<foreign_ptr<lw_shared_ptr<bytes>>> database::pfmerge_direct(std::vector<redis_key> rks)
+{
+    using return_type = foreign_ptr<lw_shared_ptr<bytes>>;
+    std::vector<const cache_entry*> entries;
+    for (auto& rk : rks) {
+        auto e = _cache.find(rk);
+        if (!e) {
+            continue;
+        }
+        if (e->type_of_hll() == false) {
+            return make_ready_future<return_type>(foreign_ptr<lw_shared_ptr<bytes>>(make_lw_shared<bytes>()));
+        }
+        entries.emplace_back(e);
+    }
+    if (entries.empty()) {
+        return make_ready_future<return_type>(foreign_ptr<lw_shared_ptr<bytes>>(nullptr));
+    }
+    _stat._hit += entries.size();
+    if (entries.size() == 1) {
+        auto e = entries.front();
+        return make_ready_future<return_type>(foreign_ptr<lw_shared_ptr<bytes>>(make_lw_shared<bytes>(bytes {e->value_bytes_data(), e->value_bytes_size()})));
+    }
+    // merge the local keys here, only one dense value leaves the shard.
+    std::unique_ptr<uint8_t[]> registers(new uint8_t[HLL_BUCKET_COUNT]());
+    for (auto e : entries) {
+        hll::merge_registers(registers.get(), reinterpret_cast<const uint8_t*>(e->value_bytes_data()), e->value_bytes_size());
+    }
+    auto merged = make_lw_shared<bytes>(bytes::initialized_later(), HLL_BYTES_SIZE);
+    hll::pack_registers(registers.get(), reinterpret_cast<uint8_t*>(merged->begin()));
+    return make_ready_future<return_type>(foreign_ptr<lw_shared_ptr<bytes>>(std::move(merged)));
+}
+
+namespace {
+bytes string_value(const cache_entry& e)
+{
+    if (e.shared_value() || e.inline_value()) {
+        return bytes { e.value_bytes_data(), e.value_bytes_size() };
+    }
+    if (e.paged_value() || e.compressed_value()) {
+        bytes result(bytes::initialized_later(), e.value_bytes_size());
+        auto out = result.begin();
+        e.for_each_value_fragment([&out] (bytes_view f) {
+            out = std::copy(f.begin(), f.end(), out);
+        });
+        return result;
+    }
+    return linearize(e.value_bytes());
+}
+}
+
+future<foreign_ptr<lw_shared_ptr<sparse_bitmap>>> database::get_bitmap(redis_key rk)
+{
+    ++_stat._read;
+    using return_type = foreign_ptr<lw_shared_ptr<sparse_bitmap>>;
+    auto e = _cache.find(rk);
+    if (!e || e->type_of_bytes() == false) {
+        return make_ready_future<return_type>(return_type(nullptr));
+    }
+    ++_stat._hit;
+    if (e->paged_value()) {
+        return make_ready_future<return_type>(return_type(make_lw_shared<sparse_bitmap>(e->value_bitmap().copy())));
+    }
+    auto value = string_value(*e);
+    return make_ready_future<return_type>(return_type(make_lw_shared<sparse_bitmap>(sparse_bitmap::of_bytes(bytes_view { value.data(), value.size() }))));
+}
+
+future<foreign_ptr<lw_shared_ptr<database::batch_values_type>>> database::get_direct_batch(std::vector<redis_key> rks)
+{
+    _stat._read += rks.size();
+    auto values = make_lw_shared<batch_values_type>();
+    values->reserve(rks.size());
+    _cache.run_with_entries(rks, [this, &values] (size_t, const cache_entry* e) {
+        if (!e || e->type_of_bytes() == false) {
+            values->emplace_back();
+            return;
+        }
+        ++_stat._hit;
+        values->emplace_back(string_value(*e));
+    });
+    return make_ready_future<foreign_ptr<lw_shared_ptr<batch_values_type>>>(foreign_ptr<lw_shared_ptr<batch_values_type>>(values));
+}
+
+size_t database::set_direct_batch(std::vector<std::pair<redis_key, bytes>> kvs)
+{
+    size_t success = 0;
+    for (auto& kv : kvs) {
+        if (set_direct(std::move(kv.first), std::move(kv.second), 0, FLAG_SET_NO)) {
+            ++success;
+        }
+    }
+    return success;
+}
+
+future<foreign_ptr<lw_shared_ptr<std::vector<bytes>>>> database::smembers_direct(redis_key rk)
+{
+    ++_stat._read;
+    using result_type = std::vector<bytes>;
+    using return_type = foreign_ptr<lw_shared_ptr<result_type>>;
+    return _cache.run_with_entry(rk, [this] (const cache_entry* e) {
+        if (!e || e->type_of_set() == false) {
+            return make_ready_future<return_type>(foreign_ptr<lw_shared_ptr<result_type>>(make_lw_shared<result_type>(result_type {})));
+        }
+        result_type keys;
+        e->with_dict([&keys] (const auto& set) { set.fetch_keys(keys); });
+        if (!keys.empty()) ++_stat._hit;
+        return make_ready_future<return_type>(foreign_ptr<lw_shared_ptr<result_type>>(make_lw_shared<result_type>(std::move(keys))));
+    });
+}
+
+future<size_t> database::scard_direct(redis_key rk)
+{
+    auto e = _cache.find(rk);
+    if (!e || e->type_of_set() == false) {
+        return make_ready_future<size_t>(0);
+    }
+    return make_ready_future<size_t>(e->dict_size());
+}
+
+future<foreign_ptr<lw_shared_ptr<std::vector<uint64_t>>>> database::sismember_batch(redis_key rk, const std::vector<bytes>& candidates)
+{
+    ++_stat._read;
+    using result_type = std::vector<uint64_t>;
+    using return_type = foreign_ptr<lw_shared_ptr<result_type>>;
+    auto hits = make_lw_shared<result_type>((candidates.size() + 63) >> 6, 0);
+    _cache.run_with_entry(rk, [this, &candidates, &hits] (const cache_entry* e) {
+        if (!e || e->type_of_set() == false) {
+            return;
+        }
+        ++_stat._hit;
+        e->with_dict([&candidates, &hits] (const auto& set) {
+            auto& bits = *hits;
+            for (size_t i = 0; i < candidates.size(); ++i) {
+                if (set.exists(candidates[i])) {
+                    bits[i >> 6] |= uint64_t(1) << (i & 63);
+                }
+            }
+        });
+    });
+    return make_ready_future<return_type>(return_type(std::move(hits)));
+}
+
+future<scattered_message_ptr> database::spop(redis_key rk, size_t count)
+{
+    ++_stat._read;
+    return with_allocator_for(data_type::set, [this, rk = std::move(rk), &count] {
+        auto e = _cache.find(rk);
+        if (!e) {
+            return reply_builder::build(msg_nil);
+        }
+        if (e->type_of_set() == false) {
+            return reply_builder::build(msg_type_err);
+        }
+        bool empty = false;
+        auto reply = e->with_dict([count, &empty] (auto& set) {
+            auto entries = random_members(set, count);
+            auto reply = reply_builder::build<true, false>(entries);
+            // erasing from a packed set moves its records, so erase by key.
+            std::vector<bytes> keys;
+            keys.reserve(entries.size());
+            for (auto entry : entries) {
+                keys.emplace_back(entry->key_data(), entry->key_size());
+            }
+            for (auto& key : keys) {
+                set.erase(key);
+            }
+            empty = !keys.empty() && set.empty();
+            return reply;
+        });
+        if (empty) {
+            --_stat._total_set_entries;
+            _cache.erase(rk);
+        }
+        return reply;
+    });
+}
+
+future<scattered_message_ptr> database::srem(redis_key rk, bytes member)
+{
+    return with_allocator_for(data_type::set, [this, rk = std::move(rk), member = std::move(member)] {
+        auto e = _cache.find(rk);
+        if (!e) {
+            return reply_builder::build(msg_zero);
+        }
+        if (e->type_of_set() == false) {
+            return reply_builder::build(msg_type_err);
+        }
+        bool empty = false;
+        auto result = e->with_dict([&member, &empty] (auto& set) {
+            auto result = set.erase(member);
+            empty = set.empty();
+            return result;
+        });
+        if (empty) {
+            --_stat._total_set_entries;
+            _cache.erase(rk);
+        }
+        return reply_builder::build(result ? msg_one : msg_zero);
+    });
+}
+bool database::srem_direct(redis_key rk, bytes member)
+{
+    return with_allocator_for(data_type::set, [this, rk = std::move(rk), member = std::move(member)] {
+        auto e = _cache.find(rk);
+        if (!e) {
+            return true;
+        }
+        if (e->type_of_set() == false) {
+            return false;
+        }
+        bool empty = false;
+        bool result = e->with_dict([&member, &empty] (auto& set) {
+            bool result = set.erase(member);
+            empty = set.empty();
+            return result;
+        });
+        if (empty) {
+            --_stat._total_set_entries;
+            _cache.erase(rk);
+        }
+        return result;
+    });
+}
+
+future<scattered_message_ptr> database::smove(redis_key src, redis_key dst, bytes member)
+{
+    auto s = _cache.find(src);
+    if (!s) {
+        return reply_builder::build(msg_zero);
+    }
+    auto d = _cache.find(dst);
+    if (!s->type_of_set() || (d && !d->type_of_set())) {
+        return reply_builder::build(msg_type_err);
+    }
+    if (!srem_direct(std::move(src), member)) {
+        return reply_builder::build(msg_zero);
+    }
+    sadd_direct(std::move(dst), std::move(member));
+    return reply_builder::build(msg_one);
+}
+
+future<scattered_message_ptr> database::srems(redis_key rk, std::vector<bytes> members)
+{
+    return with_allocator_for(data_type::set, [this, rk = std::move(rk), members = std::move(members)] {
+        auto e = _cache.find(rk);
+        if (!e) {
+            return reply_builder::build(msg_zero);
+        }
+        if (e->type_of_set() == false) {
             return reply_builder::build(msg_type_err);
         }
-        auto& list = e->value_list();
-        left ? list.insert_head(val) : list.insert_tail(val);
-        return reply_builder::build(list.size());
+        size_t removed = 0;
+        bool empty = e->with_dict([&members, &removed] (auto& set) {
+            for (auto& member : members) {
+                if (set.erase(member)) {
+                    removed++;
+                }
+            }
+            return set.empty();
+        });
+        if (empty) {
+            --_stat._total_set_entries;
+            _cache.erase(rk);
+        }
+        return reply_builder::build(removed);
     });
 }
 
-future<scattered_message_ptr> database::push_multi(redis_key rk, std::vector<bytes> values, bool force, bool left)
+future<scattered_message_ptr> database::pttl(redis_key rk)
 {
-    left ? ++_stat._lpush : ++_stat._rpush;
-    return with_allocator(allocator(), [this, rk = std::move(rk), values = std::move(values), force, left] () {
-        auto e = _cache.find(rk);
+    return _cache.run_with_entry(rk, [this] (const cache_entry* e) {
         if (!e) {
-             if (!force) {
-                 return reply_builder::build(msg_err);
-             }
-            // create new list object
-            auto entry = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), cache_entry::list_initializer());
-            _cache.insert(entry);
-            ++_stat._total_list_entries;
-            e = entry;
-        }
-        if (e->type_of_list() == false) {
-            return reply_builder::build(msg_type_err);
+            return reply_builder::build(msg_neg_two);
         }
-        auto& list = e->value_list();
-        for (auto& val : values) {
-            left ? list.insert_head(val) : list.insert_tail(val);
+        if (!e->ever_expires()) {
+            return reply_builder::build(msg_neg_one);
         }
-        return reply_builder::build(list.size());
+        return reply_builder::build(e->time_of_live());
     });
 }
 
-future<scattered_message_ptr> database::pop(redis_key rk, bool left)
+future<scattered_message_ptr> database::ttl(redis_key rk)
 {
-    ++_stat._read;
-    left ? ++_stat._lpop : ++_stat._rpop;
-    return with_allocator(allocator(), [this, rk = std::move(rk), left] () {
-        auto e = _cache.find(rk);
+    return _cache.run_with_entry(rk, [this] (const cache_entry* e) {
         if (!e) {
-            return reply_builder::build(msg_nil);
+            return reply_builder::build(msg_neg_two);
         }
-        if (e->type_of_list() == false) {
-            return reply_builder::build(msg_type_err);
+        if (!e->ever_expires()) {
+            return reply_builder::build(msg_neg_one);
         }
-        auto& list = e->value_list();
-        assert(!list.empty());
-        auto reply = reply_builder::build(left ? list.front() : list.back());
-        left ? list.pop_front() : list.pop_back();
-        if (list.empty()) {
-           --_stat._total_list_entries;
-           _cache.erase(rk);
+        return reply_builder::build(e->time_of_live() / 1000);
+    });
+}
+
+future<foreign_ptr<lw_shared_ptr<database::scan_result_type>>> database::scan_direct(size_t cursor, bytes pattern, size_t count)
+{
+    ++_stat._read;
+    auto result = make_lw_shared<scan_result_type>();
+    auto& keys = result->second;
+    // a SCAN of a prefix starting on this shard takes all its keys from the
+    // index at once, unless there are more than a long SCAN would visit.
+    auto prefix = literal_prefix(pattern);
+    if (cursor == 0 && !prefix.empty() && _cache.scan_prefix(prefix, std::max(count, max_indexed_scan_keys), [&keys, &pattern] (const bytes& key) {
+        if (key_matches(pattern, key.data(), key.size())) {
+            keys.push_back(key);
+        }
+    })) {
+        result->first = 0;
+        return make_ready_future<foreign_ptr<lw_shared_ptr<scan_result_type>>>(foreign_ptr<lw_shared_ptr<scan_result_type>>(std::move(result)));
+    }
+    result->first = scan_some(_cache, cursor, count, [&keys, &pattern] (const cache_entry& e) {
+        if (key_matches(pattern, e.key_data(), e.key_size())) {
+            keys.emplace_back(e.key_data(), e.key_size());
         }
-        ++_stat._hit;
-        return reply;
     });
+    return make_ready_future<foreign_ptr<lw_shared_ptr<scan_result_type>>>(foreign_ptr<lw_shared_ptr<scan_result_type>>(std::move(result)));
 }
 
-future<scattered_message_ptr> database::llen(redis_key rk)
+namespace {
+// Collections are rebuilt in commands of at most this many elements.
+static constexpr size_t dump_elements_per_command = 1024;
+
+template <typename Entry>
+bytes dict_value(const Entry& f)
 {
-    ++_stat._llen;
-    auto e = _cache.find(rk);
-    if (!e) {
-        return reply_builder::build(msg_zero);
+    if (f.type_of_integer()) {
+        auto v = to_sstring(f.value_integer());
+        return bytes { v.data(), v.size() };
     }
-    if (e->type_of_list() == false) {
-        return reply_builder::build(msg_type_err);
+    if (f.type_of_float()) {
+        char v[max_float_string];
+        return bytes { v, format_float_string(f.value_float(), v) };
     }
-    auto& list = e->value_list();
-    return reply_builder::build(list.size());
+    return bytes { f.value_bytes_data(), f.value_bytes_size() };
 }
 
-future<scattered_message_ptr> database::lindex(redis_key rk, long idx)
+// Appends the commands rebuilding the entry on another node: DEL and the
+// value in pieces for a collection, then its TTL. Returns false for the
+// types no command restores as they are, HyperLogLogs.
+bool append_restore_commands(const cache_entry& e, std::vector<std::vector<bytes>>& commands)
 {
-    ++_stat._read;
-    ++_stat._lindex;
-    return _cache.run_with_entry(rk, [this, rk = std::move(rk), idx] (const cache_entry* e) {
-        if (!e) {
-            return reply_builder::build(msg_nil);
+    if (e.type_of_hll()) {
+        return false;
+    }
+    bytes key { e.key_data(), e.key_size() };
+    auto add = [&commands, &key] (const char* name) {
+        commands.emplace_back();
+        commands.back().emplace_back(name);
+        commands.back().emplace_back(key);
+    };
+    auto append = [&commands] (bytes value) {
+        commands.back().emplace_back(std::move(value));
+    };
+    if (e.type_of_bytes() || e.type_of_integer() || e.type_of_float()) {
+        add("set");
+        append(e.type_of_bytes() ? string_value(e) : dict_value(e));
+    }
+    else if (e.type_of_list()) {
+        add("del");
+        auto& list = e.value_list();
+        std::vector<const managed_bytes*> elements;
+        if (list.size() > 0) {
+            list.fetch(0, list.size() - 1, elements);
+        }
+        for (size_t i = 0; i < elements.size(); ++i) {
+            if (i % dump_elements_per_command == 0) {
+                add("rpush");
+            }
+            append(linearize(*elements[i]));
         }
-        if (e->type_of_list() == false) {
-            return reply_builder::build(msg_type_err);
+    }
+    else if (e.type_of_map() || e.type_of_set()) {
+        add("del");
+        bool map = e.type_of_map();
+        e.with_dict([&] (const auto& dict) {
+            entries_of<decltype(dict)> entries;
+            dict.fetch(entries);
+            for (size_t i = 0; i < entries.size(); ++i) {
+                if (i % dump_elements_per_command == 0) {
+                    add(map ? "hmset" : "sadd");
+                }
+                append(bytes { entries[i]->key_data(), entries[i]->key_size() });
+                if (map) {
+                    append(dict_value(*entries[i]));
+                }
+            }
+        });
+    }
+    else if (e.type_of_sset()) {
+        add("del");
+        std::vector<std::pair<bytes, double>> members;
+        e.value_sset().fetch_by_rank(0, -1, members);
+        for (size_t i = 0; i < members.size(); ++i) {
+            if (i % dump_elements_per_command == 0) {
+                add("zadd");
+            }
+            char score[max_float_string];
+            append(bytes { score, format_float_string(members[i].second, score) });
+            append(std::move(members[i].first));
         }
-        auto& list = e->value_list();
-        auto index = alignment_index_base_on(list.size(), idx);
-        if (list.index_out_of_range(index)) {
-            return reply_builder::build(msg_nil);
+    }
+    else {
+        return false;
+    }
+    if (e.ever_expires()) {
+        add("pexpire");
+        auto ttl = to_sstring(std::max<size_t>(e.time_of_live(), 1));
+        append(bytes { ttl.data(), ttl.size() });
+    }
+    return true;
+}
+
+uint64_t digest_of(const bytes& data, uint64_t seed)
+{
+    std::array<uint64_t, 2> hash;
+    utils::murmur_hash::hash3_x64_128(bytes_view { data.data(), data.size() }, seed, hash);
+    return hash[0];
+}
+
+// What an entry adds to the digest of its slot: murmur hashes of its key and
+// of the elements of its value, those of hashes and sets added up since two
+// replicas may hold them in any order. TTLs are left out, they differ by
+// when each replica applied the write, and so are HyperLogLogs.
+uint64_t entry_digest(const cache_entry& e)
+{
+    auto key = digest_of(bytes { e.key_data(), e.key_size() }, 0);
+    std::vector<std::vector<bytes>> commands;
+    if (!append_restore_commands(e, commands)) {
+        return key;
+    }
+    uint64_t ordered = key;
+    uint64_t unordered = 0;
+    for (auto& cmd : commands) {
+        auto& name = cmd[0];
+        if (name == "del" || name == "pexpire") {
+            continue;
+        }
+        auto kind = digest_of(name, key);
+        if (name == "set" || name == "rpush") {
+            for (size_t i = 2; i < cmd.size(); ++i) {
+                ordered = digest_of(cmd[i], ordered ^ kind);
+            }
+            continue;
+        }
+        // a field and its value, a member, or a score and its member.
+        size_t step = name == "sadd" ? 1 : 2;
+        for (size_t i = 2; i + step <= cmd.size(); i += step) {
+            auto element = kind;
+            for (size_t j = i; j < i + step; ++j) {
+                element = digest_of(cmd[j], element);
+            }
+            unordered += element;
         }
-        auto& result = list.at(static_cast<size_t>(index));
-        ++_stat._hit;
-        return reply_builder::build(result);
-    });
+    }
+    return ordered ^ unordered;
+}
 }
 
-future<scattered_message_ptr> database::lrange(redis_key rk, long start, long end)
+future<long> database::hlen_direct(redis_key rk)
 {
-    ++_stat._read;
-    ++_stat._lrange;
+    expire_fields(rk);
     auto e = _cache.find(rk);
     if (!e) {
-        return reply_builder::build(msg_err);
+        return make_ready_future<long>(0);
     }
-    if (e->type_of_list() == false) {
-        return reply_builder::build(msg_type_err);
+    if (e->type_of_map() == false) {
+        return make_ready_future<long>(-1);
     }
-    auto& list = e->value_list();
-    start = database::alignment_index_base_on(list.size(), start);
-    end = database::alignment_index_base_on(list.size(), end);
-    if (start < 0) start = 0;
-    if (end >= static_cast<long>(list.size())) end = static_cast<size_t>(list.size()) - 1;
-    std::vector<const managed_bytes*> data;
-    if (start < end) {
-       for (auto i = start; i < end; ++i) {
-          const auto& b = list.at(static_cast<size_t>(i));
-          data.push_back(&b);
-       }
+    return make_ready_future<long>(e->dict_size());
+}
+
+future<foreign_ptr<lw_shared_ptr<std::vector<bytes>>>> database::hgetall_direct(redis_key rk, bool keys, bool values)
+{
+    expire_fields(rk);
+    ++_stat._read;
+    using result_type = std::vector<bytes>;
+    using return_type = foreign_ptr<lw_shared_ptr<result_type>>;
+    auto result = make_lw_shared<result_type>();
+    auto e = _cache.find(rk);
+    if (e && e->type_of_map()) {
+        e->with_dict([&result, keys, values] (const auto& map) {
+            entries_of<decltype(map)> entries;
+            map.fetch(entries);
+            result->reserve(entries.size() * (keys && values ? 2 : 1));
+            for (auto f : entries) {
+                if (keys) {
+                    result->emplace_back(f->key_data(), f->key_size());
+                }
+                if (values) {
+                    result->emplace_back(dict_value(*f));
+                }
+            }
+        });
+        if (!result->empty()) ++_stat._hit;
     }
-    if (!data.empty()) ++_stat._hit;
-    return reply_builder::build(data);
+    return make_ready_future<return_type>(return_type(std::move(result)));
 }
 
-future<scattered_message_ptr> database::lrem(redis_key rk, long count, bytes val)
+namespace {
+// The expiry of the entry in a snapshot, in milliseconds since the epoch.
+uint64_t snapshot_expiry(const cache_entry& e)
 {
-    ++_stat._lrem;
-    return with_allocator(allocator(), [this, rk = std::move(rk), count, val = std::move(val)] {
-        auto e = _cache.find(rk);
-        if (!e) {
-            return reply_builder::build(msg_err);
-        }
-        if (e->type_of_list() == false) {
-            return reply_builder::build(msg_type_err);
-        }
-        auto& list = e->value_list();
-        size_t removed = 0;
-        if (count == 0) removed = list.trem<true, true>(val, count);
-        else if (count > 0) removed = list.trem<false, true>(val, count);
-        else removed = list.trem<false, false>(val, count);
-        if (list.empty()) {
-            --_stat._total_list_entries;
-            _cache.erase(rk);
-        }
-        return reply_builder::build(removed);
-    });
+    if (!e.ever_expires()) {
+        return 0;
+    }
+    auto now = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    return static_cast<uint64_t>(now) + std::max<size_t>(e.time_of_live(), 1);
 }
 
-future<scattered_message_ptr> database::linsert(redis_key rk, bytes pivot, bytes val, bool after)
+// Encodes the entry as a record of a snapshot under `key`, see
+// snapshot.hh, to the encoder next_record() returns.
+template <typename NextRecord>
+void encode_entry(const cache_entry& e, const char* key, size_t key_size, NextRecord&& next_record)
 {
-    ++_stat._linsert;
-    return with_allocator(allocator(), [this, rk = std::move(rk), pivot = std::move(pivot), val = std::move(val), after] {
-        auto e = _cache.find(rk);
-        if (!e) {
-            return reply_builder::build(msg_zero);
+    auto expiry = snapshot_expiry(e);
+    if (e.type_of_bytes() || e.type_of_integer() || e.type_of_float() || e.type_of_hll()) {
+        auto value = e.type_of_integer() || e.type_of_float() ? dict_value(e) : string_value(e);
+        auto out = next_record();
+        out.begin(e.type_of_hll() ? snapshot_type::hll : snapshot_type::string, key, key_size, expiry);
+        out.put_bytes(value.data(), value.size());
+    }
+    else if (e.type_of_list()) {
+        auto& list = e.value_list();
+        std::vector<const managed_bytes*> elements;
+        if (list.size() > 0) {
+            list.fetch(0, list.size() - 1, elements);
+        }
+        auto out = next_record();
+        out.begin(snapshot_type::list, key, key_size, expiry);
+        out.put_count(elements.size());
+        for (auto element : elements) {
+            auto value = linearize(*element);
+            out.put_bytes(value.data(), value.size());
         }
-        if (e->type_of_list() == false) {
-            return reply_builder::build(msg_type_err);
+    }
+    else if (e.type_of_map() || e.type_of_set()) {
+        bool map = e.type_of_map();
+        auto out = next_record();
+        out.begin(map ? snapshot_type::hash : snapshot_type::set, key, key_size, expiry);
+        e.with_dict([&out, map] (const auto& dict) {
+            entries_of<decltype(dict)> entries;
+            dict.fetch(entries);
+            out.put_count(entries.size());
+            for (auto entry : entries) {
+                out.put_bytes(entry->key_data(), entry->key_size());
+                if (map) {
+                    auto value = dict_value(*entry);
+                    out.put_bytes(value.data(), value.size());
+                }
+            }
+        });
+    }
+    else if (e.type_of_stream()) {
+        auto& stream = e.value_stream();
+        auto out = next_record();
+        out.begin(snapshot_type::stream, key, key_size, expiry);
+        out.put_count(stream.last_id()._ms);
+        out.put_count(stream.last_id()._seq);
+        out.put_count(stream.size());
+        stream.range(stream_id::min(), stream_id::max(), false, [&out] (const stream_entry_view& entry) {
+            out.put_count(entry._id._ms);
+            out.put_count(entry._id._seq);
+            out.put_count(entry._fields.size());
+            for (auto& f : entry._fields) {
+                out.put_bytes(f.first);
+                out.put_bytes(f.second);
+            }
+            return true;
+        });
+        out.put_count(stream.groups().size());
+        for (auto& g : stream.groups()) {
+            out.put_bytes(g.first.data(), g.first.size());
+            out.put_count(g.second._last_delivered._ms);
+            out.put_count(g.second._last_delivered._seq);
+            out.put_count(g.second._pending.size());
+            for (auto& p : g.second._pending) {
+                out.put_count(p.first._ms);
+                out.put_count(p.first._seq);
+                out.put_bytes(p.second._consumer.data(), p.second._consumer.size());
+                out.put_count(p.second._deliveries);
+            }
         }
-        auto& list = e->value_list();
-        auto index = list.index_of(pivot);
-        if (list.index_out_of_range(index)) {
-            return reply_builder::build(msg_zero);
+    }
+    else if (e.type_of_timeseries()) {
+        auto& series = e.value_timeseries();
+        auto out = next_record();
+        out.begin(snapshot_type::timeseries, key, key_size, expiry);
+        out.put_count(series.retention());
+        out.put_count(series.size());
+        series.range(0, std::numeric_limits<uint64_t>::max(), [&out] (uint64_t ts, double value) {
+            out.put_count(ts);
+            out.put_double(value);
+            return true;
+        });
+    }
+    else if (e.type_of_bloom() || e.type_of_cms() || e.type_of_topk()) {
+        auto out = next_record();
+        const lsa_page_set* pages = nullptr;
+        if (e.type_of_bloom()) {
+            auto& filter = e.value_bloom();
+            out.begin(snapshot_type::bloom, key, key_size, expiry);
+            out.put_double(filter.error());
+            out.put_count(filter.capacity());
+            out.put_count(filter.expansion());
+            out.put_count(filter.size());
+            out.put_count(filter.layers().size());
+            for (auto& l : filter.layers()) {
+                out.put_count(l._capacity);
+                out.put_count(l._items);
+                out.put_count(l._blocks);
+                out.put_count(l._first_page);
+                out.put_count(l._hashes);
+            }
+            pages = &filter.pages();
         }
-        if (after) {
-            if (index == list.size()) list.insert_tail(val);
-            else  list.insert_at(++index, val);
+        else if (e.type_of_cms()) {
+            auto& sketch = e.value_cms();
+            out.begin(snapshot_type::cms, key, key_size, expiry);
+            out.put_count(sketch.width());
+            out.put_count(sketch.depth());
+            out.put_count(sketch.count());
+            pages = &sketch.pages();
         }
         else {
-           if (index == 0) list.insert_head(val);
-           else list.insert_at(--index, val);
+            auto& topk = e.value_topk();
+            out.begin(snapshot_type::topk, key, key_size, expiry);
+            out.put_count(topk.k());
+            out.put_count(topk.width());
+            out.put_count(topk.depth());
+            out.put_double(topk.decay());
+            out.put_count(topk.size());
+            topk.list([&out] (bytes_view name, uint32_t count) {
+                out.put_bytes(name);
+                out.put_count(count);
+            });
+            pages = &topk.buckets();
         }
-        return reply_builder::build(msg_one);
+        out.put_count(pages->pages());
+        pages->for_each([&out] (uint64_t index, const char* data) {
+            out.put_count(index);
+            out.put_bytes(data, lsa_page_set::page_size);
+        });
+    }
+    else if (e.type_of_sset()) {
+        std::vector<std::pair<bytes, double>> members;
+        e.value_sset().fetch_by_rank(0, -1, members);
+        auto out = next_record();
+        out.begin(snapshot_type::zset, key, key_size, expiry);
+        out.put_count(members.size());
+        for (auto& m : members) {
+            out.put_bytes(m.first.data(), m.first.size());
+            out.put_double(m.second);
+        }
+    }
+}
+
+// Appends the record of the entry to the snapshot.
+void append_snapshot_record(const cache_entry& e, snapshot_writer& writer)
+{
+    encode_entry(e, e.key_data(), e.key_size(), [&writer] {
+        return writer.next_record();
     });
 }
+}
 
-future<scattered_message_ptr> database::lset(redis_key rk, long idx, bytes val)
+void database::save_snapshot_entry(const cache_entry& e)
 {
-    ++_stat._lset;
-    return with_allocator(allocator(), [this, rk = std::move(rk), idx, val = std::move(val)] {
-        auto e = _cache.find(rk);
-        if (!e) {
-            return reply_builder::build(msg_nokey_err);
-        }
-        if (e->type_of_list() == false) {
-            return reply_builder::build(msg_type_err);
-        }
-        auto& list = e->value_list();
-        auto nidx = database::alignment_index_base_on(list.size(), idx);
-        if (list.index_out_of_range(nidx)) {
-            return reply_builder::build(msg_out_of_range_err);
-        }
-        auto& old = list.at(static_cast<size_t>(nidx));
-        current_allocator().destroy<managed_bytes>(&old);
-        auto entry = current_allocator().construct<managed_bytes>(bytes_view{val});
-        list.at(idx) = std::move(*entry);
-        return reply_builder::build(msg_ok);
-        
+    if (e.ever_expires() && e.get_timeout() <= clock_type::now()) {
+        return;
+    }
+    // called from writes too: the record goes to the standard allocator,
+    // and the region is not compacted under the pointers to the value.
+    logalloc::reclaim_lock lock(*this);
+    with_allocator(standard_allocator(), [this, &e] {
+        append_snapshot_record(e, *_snapshot);
     });
 }
 
-future<scattered_message_ptr> database::ltrim(redis_key rk, long start, long end)
+future<> database::save_snapshot()
 {
-    ++_stat._ltrim;
-    return with_allocator(allocator(), [this, rk = std::move(rk), start, end] {
-        auto e = _cache.find(rk);
-        if (!e) {
-            return reply_builder::build(msg_ok);
-        }
-        if (e->type_of_list() == false) {
-            return reply_builder::build(msg_type_err);
-        }
-        auto& list = e->value_list();
-        auto nstart = database::alignment_index_base_on(list.size(), start);
-        if (nstart < 0) nstart = 0;
-        auto nend = database::alignment_index_base_on(list.size(), end);
-        if (nstart > nend || nstart > static_cast<long>(list.size()) || nend < 0) {
-            list.clear();
-        }
-        list.trim(static_cast<size_t>(nstart), static_cast<size_t>(nend));
-        if (list.empty()) {
-            --_stat._total_list_entries;
-            _cache.erase(rk);
+    if (_snapshot) {
+        return make_exception_future<>(std::runtime_error("a snapshot is already being saved"));
+    }
+    if (_snapshot_gate.is_closed()) {
+        return make_exception_future<>(gate_closed_exception());
+    }
+    _snapshot_gate.enter();
+    return save_snapshot_to(snapshot_file_name(engine().cpu_id())).finally([this] {
+        _snapshot_gate.leave();
+    });
+}
+
+future<> database::save_warm_image()
+{
+    if (_options._warm_restart_dir.empty()) {
+        return make_ready_future<>();
+    }
+    auto name = warm_image_file_name(_options._warm_restart_dir, engine().cpu_id());
+    return save_snapshot_to(name).then([this, name] {
+        db_log.info("saved {} keys to the warm restart image {}", _snapshot_stats._last_keys, name);
+    }).handle_exception([name] (std::exception_ptr e) {
+        // the next process falls back to the snapshot and the commit log.
+        db_log.warn("failed to save the warm restart image {}: {}", name, e);
+    });
+}
+
+future<> database::save_snapshot_to(sstring name)
+{
+    _snapshot = make_lw_shared<snapshot_writer>(std::move(name));
+    _snapshot_cursor = 0;
+    auto started = std::chrono::steady_clock::now();
+    auto writer = _snapshot;
+    return writer->open().then([this, writer] {
+        // the point in time of the snapshot.
+        _cache.begin_snapshot([this] (const cache_entry& e) {
+            ++_snapshot_stats._saved_before_write;
+            save_snapshot_entry(e);
+        });
+        return repeat([this, writer] {
+            // one batch at a time: the buffer waits for the disk, and the
+            // next batch for its share of the reactor.
+            return utils::local_work_scheduler().run(utils::work_class::background, [this, writer] {
+                _snapshot_cursor = scan_some(_cache, _snapshot_cursor, SNAPSHOT_BATCH_ENTRIES, [this] (const cache_entry& e) {
+                    _cache.save_for_snapshot(e);
+                });
+                if (_snapshot_cursor == 0) {
+                    _cache.end_snapshot();
+                    return writer->finish().then([] { return stop_iteration::yes; });
+                }
+                return (writer->should_write() ? writer->write() : later()).then([] { return stop_iteration::no; });
+            });
+        });
+    }).then_wrapped([this, writer, started] (future<> f) {
+        _cache.end_snapshot();
+        _snapshot = nullptr;
+        auto duration = std::chrono::steady_clock::now() - started;
+        _snapshot_stats._last_duration_ms = std::chrono::duration_cast<std::chrono::milliseconds>(duration).count();
+        try {
+            f.get();
+            ++_snapshot_stats._saves;
+            _snapshot_stats._last_save = ::time(nullptr);
+            _snapshot_stats._last_save_ok = true;
+            _snapshot_stats._last_keys = writer->records();
+            _snapshot_stats._last_bytes = writer->bytes_written();
+            return make_ready_future<>();
+        } catch (...) {
+            ++_snapshot_stats._failures;
+            _snapshot_stats._last_save_ok = false;
+            db_log.error("failed to save the snapshot: {}", std::current_exception());
+            auto error = std::current_exception();
+            return writer->abort().then([error] {
+                return make_exception_future<>(error);
+            });
         }
-        return reply_builder::build(msg_ok);
-        
     });
 }
 
-future<scattered_message_ptr> database::hset(redis_key rk, bytes key, bytes val)
+reply_value database::random_key()
 {
-    ++_stat._hset;
-    return with_allocator(allocator(), [this, rk = std::move(rk), key = std::move(key), val = std::move(val)] {
-        auto e = _cache.find(rk);
-        if (!e) {
-            // the rk was not exists, then create it.
-            auto entry = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), cache_entry::dict_initializer());
-            _cache.insert(entry);
-            ++_stat._total_dict_entries;
-            e = entry;
+    auto e = _cache.random_entry();
+    if (!e) {
+        return reply_value::of(msg_nil);
+    }
+    return reply_value::of_bulk(bytes { e->key().data(), e->key().size() });
+}
+
+snapshot_stats database::get_snapshot_stats() const
+{
+    auto stats = _snapshot_stats;
+    stats._in_progress = bool(_snapshot);
+    return stats;
+}
+
+namespace {
+// Bytes of keys a shard gathers for another before sending them.
+static constexpr size_t LOAD_BATCH_BYTES = 1024 * 1024;
+
+// Sends the keys decoded by this shard to the shards owning them, in
+// batches. The decoding waits for the batches sent, so that a fast reader
+// does not pile up keys in its own memory.
+class record_router {
+    std::vector<std::vector<snapshot_record>> _batches;
+    std::vector<size_t> _sizes;
+public:
+    record_router() : _batches(smp::count), _sizes(smp::count, 0) {}
+    void route(snapshot_record r)
+    {
+        auto cpu = shard_of_key(bytes_view { r._key.data(), r._key.size() }, smp::count);
+        _sizes[cpu] += r.memory();
+        _batches[cpu].emplace_back(std::move(r));
+    }
+    // Sends the batches holding at least min_bytes.
+    future<> send(size_t min_bytes)
+    {
+        return parallel_for_each(boost::irange<unsigned>(0, smp::count), [this, min_bytes] (unsigned cpu) {
+            if (_batches[cpu].empty() || _sizes[cpu] < min_bytes) {
+                return make_ready_future<>();
+            }
+            std::vector<snapshot_record> batch;
+            batch.swap(_batches[cpu]);
+            _sizes[cpu] = 0;
+            return get_database().invoke_on(cpu, [batch = std::move(batch)] (database& db) mutable {
+                db.load_records(batch);
+            });
+        });
+    }
+};
+
+// Reads a snapshot or an RDB file, sending its keys to their shards.
+template <typename Decoder>
+future<> load_file(sstring name, lw_shared_ptr<Decoder> decoder)
+{
+    auto router = make_lw_shared<record_router>();
+    return read_file_in_chunks(name, [decoder, router] (const char* data, size_t size) {
+        if (decoder->ended()) {
+            return make_ready_future<size_t>(size);
         }
-        if (e->type_of_map() == false) {
-            return reply_builder::build(msg_type_err);
+        auto consumed = decoder->decode(data, size, [&router] (snapshot_record r) {
+            router->route(std::move(r));
+        });
+        return router->send(LOAD_BATCH_BYTES).then([consumed] {
+            return consumed;
+        });
+    }).then([name, decoder, router] {
+        if (!decoder->ended()) {
+            throw corrupt_snapshot(sprint("%s ends before its last record", name));
         }
-        auto& map = e->value_map();
-        bool exists = map.exists(key);
-        auto entry = current_allocator().construct<dict_entry>(key, val);
-        map.insert(entry);
-        return reply_builder::build(exists ? msg_zero : msg_one);
-        
+        return router->send(0);
     });
 }
+}
 
-future<scattered_message_ptr> database::hincrby(redis_key rk, bytes key, int64_t delta)
+namespace {
+// Sets the pages of a sketch from the indexes at `index` and the bytes of
+// the record from `element` on, see encode_entry().
+void load_pages(lsa_page_set& pages, std::vector<uint64_t>::const_iterator index,
+        std::vector<bytes>::const_iterator element, std::vector<bytes>::const_iterator end)
 {
-    ++_stat._hincrby;
-    return with_allocator(allocator(), [this, rk = std::move(rk), key = std::move(key), delta] {
-        auto e = _cache.find(rk);
-        if (!e) {
-            // the rk was not exists, then create it.
-            auto entry = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), cache_entry::dict_initializer());
-            _cache.insert(entry);
-            ++_stat._total_dict_entries;
-            e = entry;
-        }
-        if (e->type_of_map() == false) {
-            return reply_builder::build(msg_type_err);
-        }
-        auto& map = e->value_map();
-        return map.run_with_entry(key, [&map, &key, delta] (dict_entry* d) {
-            if (!d) {
-                auto entry = current_allocator().construct<dict_entry>(key, delta);
-                map.insert(entry);
-                return reply_builder::build<false, true>(entry);
-            }
-            if (!d->type_of_integer()) {
-                return reply_builder::build(msg_not_integer_err);
-            }
-            d->value_integer_incr(delta);
-            return reply_builder::build<false, true>(d);
-        });
-        
-    });
+    for (; element != end; ++element) {
+        pages.assign(*index++, element->data());
+    }
+}
 }
 
-future<scattered_message_ptr> database::hincrbyfloat(redis_key rk, bytes key, double delta)
+cache_entry* database::make_loaded_entry(const redis_key& rk, const snapshot_record& r)
 {
-    ++_stat._hincrbyfloat;
-    return with_allocator(allocator(), [this, rk = std::move(rk), key = std::move(key), delta] {
-        auto e = _cache.find(rk);
-        if (!e) {
-            // the rk was not exists, then create it.
-            auto entry = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), cache_entry::dict_initializer());
-            _cache.insert(entry);
-            ++_stat._total_dict_entries;
-            e = entry;
-        }
-        if (e->type_of_map() == false) {
-            return reply_builder::build(msg_type_err);
+    switch (r._type) {
+    case snapshot_type::string: {
+        auto& value = r._elements.front();
+        return make_string(rk, bytes_view { value.data(), value.size() });
+    }
+    case snapshot_type::hll: {
+        auto& value = r._elements.front();
+        auto entry = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), cache_entry::hll_initializer{false});
+        entry->value_bytes() = managed_bytes(bytes_view { value.data(), value.size() });
+        return entry;
+    }
+    case snapshot_type::list: {
+        auto entry = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), cache_entry::list_initializer());
+        auto& list = entry->value_list();
+        for (auto& element : r._elements) {
+            list.insert_tail(element);
         }
-        auto& map = e->value_map();
-        return map.run_with_entry(key, [&map, &key, delta] (dict_entry* d) {
-            if (!d) {
-                auto entry = current_allocator().construct<dict_entry>(key, delta);
-                map.insert(entry);
-                return reply_builder::build<false, true>(entry);
+        return entry;
+    }
+    case snapshot_type::set:
+    case snapshot_type::hash: {
+        bool set = r._type == snapshot_type::set;
+        auto entry = construct_dict(rk, set);
+        size_t max_size = 0;
+        for (auto& element : r._elements) {
+            max_size = std::max(max_size, element.size());
+        }
+        maybe_unpack(entry, set ? r._elements.size() : r._elements.size() / 2, max_size, set && packed_dict::integer_members(r._elements));
+        entry->with_dict([&r, set] (auto& dict) {
+            dict.reserve(set ? r._elements.size() : r._elements.size() / 2);
+            if (set) {
+                for (auto& member : r._elements) {
+                    dict.insert_key(member);
+                }
+                return;
             }
-            if (!d->type_of_float()) {
-                return reply_builder::build(msg_not_float_err);
+            for (size_t i = 0; i + 1 < r._elements.size(); i += 2) {
+                dict.put(r._elements[i], r._elements[i + 1]);
             }
-            d->value_float_incr(delta);
-            return reply_builder::build<false, true>(d);
         });
-    });
+        return entry;
+    }
+    case snapshot_type::zset: {
+        auto entry = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), cache_entry::sset_initializer());
+        // the members of a record are in rank order, see encode_entry().
+        std::vector<sset_entry*> members;
+        members.reserve(r._elements.size());
+        for (size_t i = 0; i < r._elements.size(); ++i) {
+            members.push_back(current_allocator().construct<sset_entry>(r._elements[i], r._scores[i]));
+        }
+        entry->value_sset().insert_sorted(members, [] (sset_entry* member) {
+            current_allocator().destroy<sset_entry>(member);
+        });
+        return entry;
+    }
+    case snapshot_type::stream: {
+        auto entry = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), cache_entry::stream_initializer());
+        auto& stream = entry->value_stream();
+        auto number = r._numbers.begin();
+        auto element = r._elements.begin();
+        stream_id last { number[0], number[1] };
+        number += 2;
+        // the fields of an entry are appended from a vector of their own.
+        std::vector<bytes> fields;
+        for (auto n = *number++; n > 0; --n) {
+            stream_id id { number[0], number[1] };
+            auto count = number[2];
+            number += 3;
+            fields.assign(element, element + count * 2);
+            element += count * 2;
+            stream.append(id, fields, 0);
+        }
+        stream.set_last_id(last);
+        auto now = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+        for (auto groups = *number++; groups > 0; --groups) {
+            auto& g = stream.groups()[*element++];
+            g._last_delivered = stream_id { number[0], number[1] };
+            auto pending = number[2];
+            number += 3;
+            for (; pending > 0; --pending) {
+                stream_id id { number[0], number[1] };
+                auto& consumer = *element++;
+                g.deliver(consumer, id, now);
+                g._pending[id]._deliveries = number[2];
+                number += 3;
+            }
+        }
+        return entry;
+    }
+    case snapshot_type::timeseries: {
+        auto entry = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), cache_entry::timeseries_initializer());
+        auto& series = entry->value_timeseries();
+        series.set_retention(r._numbers.front());
+        for (size_t i = 0; i < r._scores.size(); ++i) {
+            series.append(r._numbers[i + 1], r._scores[i]);
+        }
+        return entry;
+    }
+    case snapshot_type::bloom: {
+        auto number = r._numbers.begin();
+        cache_entry::bloom_initializer init { r._scores.front(), number[0], static_cast<uint32_t>(number[1]) };
+        auto items = number[2];
+        number += 3;
+        std::vector<bloom_lsa::layer> layers(*number++);
+        for (auto& l : layers) {
+            l._capacity = number[0];
+            l._items = number[1];
+            l._blocks = number[2];
+            l._first_page = number[3];
+            l._hashes = static_cast<uint32_t>(number[4]);
+            number += 5;
+        }
+        auto entry = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), init);
+        auto& filter = entry->value_bloom();
+        filter.restore(std::move(layers), items);
+        load_pages(filter.pages(), number + 1, r._elements.begin(), r._elements.end());
+        return entry;
+    }
+    case snapshot_type::cms: {
+        auto number = r._numbers.begin();
+        auto entry = current_allocator().construct<cache_entry>(rk.key(), rk.hash(),
+            cache_entry::cms_initializer { static_cast<uint32_t>(number[0]), static_cast<uint32_t>(number[1]) });
+        auto& sketch = entry->value_cms();
+        sketch.set_count(number[2]);
+        load_pages(sketch.pages(), number + 4, r._elements.begin(), r._elements.end());
+        return entry;
+    }
+    case snapshot_type::topk: {
+        auto number = r._numbers.begin();
+        auto entry = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), cache_entry::topk_initializer {
+            static_cast<uint32_t>(number[0]), static_cast<uint32_t>(number[1]), static_cast<uint32_t>(number[2]), r._scores.front() });
+        auto& topk = entry->value_topk();
+        auto items = number[3];
+        number += 4;
+        for (size_t i = 0; i < items; ++i) {
+            auto& name = r._elements[i];
+            topk.restore_item(bytes_view { name.data(), name.size() }, static_cast<uint32_t>(*number++));
+        }
+        load_pages(topk.buckets(), number + 1, r._elements.begin() + items, r._elements.end());
+        return entry;
+    }
+    default:
+        return nullptr;
+    }
 }
 
-future<scattered_message_ptr> database::hmset(redis_key rk, std::unordered_map<bytes, bytes> kvs)
+namespace {
+const data_type record_types[] = {
+    data_type::deleted, data_type::bytes, data_type::list, data_type::set, data_type::dict, data_type::sset, data_type::hll,
+    data_type::stream, data_type::timeseries, data_type::bloom, data_type::cms,
+    data_type::topk,
+};
+constexpr size_t record_type_count = std::extent<decltype(record_types)>::value;
+
+uint64_t epoch_ms()
 {
-    ++_stat._hmset;
-    return with_allocator(allocator(), [this, rk = std::move(rk), kvs = std::move(kvs)] {
-        auto e = _cache.find(rk);
-        if (!e) {
-            // the rk was not exists, then create it.
-            auto entry = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), cache_entry::dict_initializer());
-            _cache.insert(entry);
-            ++_stat._total_dict_entries;
-            e = entry;
-        }
-        if (e->type_of_map() == false) {
-            return reply_builder::build(msg_type_err);
-        }
-        auto& map = e->value_map();
-        bool result = false;
-        for (auto& kv : kvs) {
-           auto entry = current_allocator().construct<dict_entry>(kv.first, kv.second);
-           result = map.insert(entry);
-           if (!result) break;
-        }
-        return reply_builder::build(result ? msg_ok : msg_err);
-    });
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
 }
 
-future<scattered_message_ptr> database::hget(redis_key rk, bytes key)
+bool database::insert_record(const snapshot_record& r, uint64_t now_ms)
 {
-    ++_stat._read;
-    ++_stat._hget;
-    auto e = _cache.find(rk);
-    if (!e) {
-        return reply_builder::build(msg_err);
+    long expire = 0;
+    if (r._expire_at_ms) {
+        if (r._expire_at_ms <= now_ms) {
+            return false;
+        }
+        expire = r._expire_at_ms - now_ms;
     }
-    if (e->type_of_map() == false) {
-        return reply_builder::build(msg_type_err);
+    auto index = static_cast<size_t>(r._type);
+    if (index >= record_type_count) {
+        return false;
     }
-    auto& map = e->value_map();
-    return map.run_with_entry(key, [this] (const dict_entry* d) {
-        if (d) ++_stat._hit;
-        return reply_builder::build<false, true>(d);
-    });
+    type_memory::scope accounting(_cache.memory_by_type(), record_types[index]);
+    redis_key rk { r._key };
+    _cache.insert_if(make_loaded_entry(rk, r), expire, false, false);
+    return true;
 }
 
-future<scattered_message_ptr> database::hdel_multi(redis_key rk, std::vector<bytes> keys)
+void database::count_records(snapshot_type type, uint64_t n)
 {
-    ++_stat._hdel;
-    return with_allocator(allocator(), [this, rk = std::move(rk), keys = std::move(keys)] {
-        auto e = _cache.find(rk);
-        if (!e) {
-            return reply_builder::build(msg_zero);
-        }
-        if (e->type_of_map() == false) {
-            return reply_builder::build(msg_type_err);
-        }
-        auto& map = e->value_map();
-        size_t removed = 0;
-        for (auto& key : keys) {
-            if (map.erase(key)) {
-                ++ removed;
+    switch (type) {
+    case snapshot_type::string: _stat._total_string_entries += n; break;
+    case snapshot_type::list: _stat._total_list_entries += n; break;
+    case snapshot_type::set: _stat._total_set_entries += n; break;
+    case snapshot_type::hash: _stat._total_dict_entries += n; break;
+    case snapshot_type::zset: _stat._total_zset_entries += n; break;
+    case snapshot_type::hll: _stat._total_hll_entries += n; break;
+    case snapshot_type::stream: _stat._total_stream_entries += n; break;
+    case snapshot_type::timeseries: _stat._total_timeseries_entries += n; break;
+    case snapshot_type::bloom: _stat._total_bloom_entries += n; break;
+    case snapshot_type::cms: _stat._total_cms_entries += n; break;
+    case snapshot_type::topk: _stat._total_topk_entries += n; break;
+    default: break;
+    }
+}
+
+uint64_t database::insert_records(std::vector<snapshot_record>& records)
+{
+    auto now = epoch_ms();
+    // One allocating section for the batch. If it runs out of memory the
+    // batch is inserted again, which leaves the same entries, so the new
+    // entries are only counted once it is done.
+    std::array<uint64_t, record_type_count> loaded;
+    with_allocator(allocator(), [this, &records, &loaded, now] {
+        _load_section(*this, [this, &records, &loaded, now] {
+            loaded.fill(0);
+            for (auto& r : records) {
+                if (insert_record(r, now)) {
+                    ++loaded[static_cast<size_t>(r._type)];
+                }
             }
-        }
-        if (map.empty()) {
-            --_stat._total_dict_entries;
-            _cache.erase(rk);
-        }
-        return reply_builder::build(removed);
+        });
     });
+    uint64_t inserted = 0;
+    for (size_t i = 0; i < loaded.size(); ++i) {
+        count_records(static_cast<snapshot_type>(i), loaded[i]);
+        inserted += loaded[i];
+    }
+    records.clear();
+    return inserted;
 }
 
+void database::load_records(std::vector<snapshot_record>& records)
+{
+    _stat._loaded_keys += insert_records(records);
+    ++_stat._loaded_batches;
+}
 
-future<scattered_message_ptr> database::hdel(redis_key rk, bytes key)
+namespace {
+// "value:<n>", padded with 'x' to `size` bytes when it is shorter.
+bytes populate_value(const char* tag, uint64_t n, size_t size)
 {
-    ++_stat._hdel;
-    return with_allocator(allocator(), [this, rk = std::move(rk), key = std::move(key)] {
-        auto e = _cache.find(rk);
-        if (!e) {
-            return reply_builder::build(msg_zero);
-        }
-        if (e->type_of_map() == false) {
-            return reply_builder::build(msg_type_err);
-        }
-        auto& map = e->value_map();
-        bool exists = map.erase(key);
-        if (map.empty()) {
-            --_stat._total_dict_entries;
-            _cache.erase(rk);
-        }
-        return reply_builder::build(exists ? msg_ok : msg_err);
-    });
+    auto v = sprint("%s:%u", tag, n);
+    bytes value(bytes::initialized_later(), std::max(size, v.size()));
+    std::fill(std::copy(v.begin(), v.end(), value.begin()), value.end(), 'x');
+    return value;
+}
 }
 
-future<scattered_message_ptr> database::hexists(redis_key rk, bytes key)
+future<uint64_t> database::populate(populate_options options)
 {
-    ++_stat._hexists;
-    return with_allocator(allocator(), [this, rk = std::move(rk), key = std::move(key)] {
-        auto e = _cache.find(rk);
-        if (!e) {
-            return reply_builder::build(msg_zero);
-        }
-        if (e->type_of_map() == false) {
-            return reply_builder::build(msg_type_err);
-        }
-        auto& map = e->value_map();
-        auto result = map.exists(key);
-        return reply_builder::build(result ? msg_one : msg_zero);
+    snapshot_type type;
+    switch (options._type) {
+    case data_type::bytes: type = snapshot_type::string; break;
+    case data_type::list: type = snapshot_type::list; break;
+    case data_type::set: type = snapshot_type::set; break;
+    case data_type::dict: type = snapshot_type::hash; break;
+    case data_type::sset: type = snapshot_type::zset; break;
+    default:
+        return make_exception_future<uint64_t>(std::invalid_argument("DEBUG POPULATE creates strings, lists, sets, hashes and sorted sets"));
+    }
+    struct state {
+        populate_options _options;
+        snapshot_type _type;
+        uint64_t _next = 0;
+        uint64_t _created = 0;
+        std::vector<snapshot_record> _batch;
+        std::mt19937_64 _random;
+    };
+    auto s = make_lw_shared<state>(state { std::move(options), type, 0, 0, {}, std::mt19937_64(engine().cpu_id()) });
+    return repeat([this, s] {
+        auto& o = s->_options;
+        auto now = epoch_ms();
+        // every shard goes through all the names, and keeps those it owns
+        // which do not exist, a bounded number of names at a time.
+        auto end = std::min(o._count, s->_next + POPULATE_BATCH_KEYS * smp::count * 4);
+        for (; s->_next < end && s->_batch.size() < POPULATE_BATCH_KEYS; ++s->_next) {
+            auto name = sprint("%s:%u", o._prefix, s->_next);
+            if (shard_of_key(bytes_view { name.data(), name.size() }, smp::count) != engine().cpu_id()) {
+                continue;
+            }
+            redis_key rk { bytes { name.data(), name.size() } };
+            if (_cache.exists(rk)) {
+                continue;
+            }
+            snapshot_record r;
+            r._type = s->_type;
+            r._key = rk.key();
+            if (o._ttl_max > 0) {
+                auto ttl = std::uniform_int_distribution<uint64_t>(o._ttl_min, o._ttl_max)(s->_random);
+                r._expire_at_ms = now + std::max<uint64_t>(ttl, 1) * 1000;
+            }
+            if (s->_type == snapshot_type::string) {
+                r._elements.push_back(populate_value("value", s->_next, o._size));
+            }
+            for (size_t i = 0; s->_type != snapshot_type::string && i < o._elements; ++i) {
+                switch (s->_type) {
+                case snapshot_type::hash:
+                    r._elements.push_back(populate_value("field", i, 0));
+                    r._elements.push_back(populate_value("value", i, o._size));
+                    break;
+                case snapshot_type::zset:
+                    r._scores.push_back(i);
+                    // fall through
+                default:
+                    r._elements.push_back(populate_value("element", i, o._size));
+                    break;
+                }
+            }
+            s->_batch.push_back(std::move(r));
+        }
+        auto created = insert_records(s->_batch);
+        s->_created += created;
+        _stat._populated_keys += created;
+        return make_ready_future<stop_iteration>(s->_next < o._count ? stop_iteration::no : stop_iteration::yes);
+    }).then([s] {
+        return s->_created;
     });
 }
 
-future<scattered_message_ptr> database::hstrlen(redis_key rk, bytes key)
+future<scattered_message_ptr> database::rename(redis_key src, redis_key dst, bool nx)
 {
-    ++_stat._hstrlen;
-    auto e = _cache.find(rk);
-    if (!e) {
-        return reply_builder::build(msg_zero);
+    if (!_cache.exists(src)) {
+        return reply_builder::build(msg_nokey_err);
     }
-    if (e->type_of_map() == false) {
-        return reply_builder::build(msg_type_err);
+    if (src.key() == dst.key()) {
+        return reply_builder::build(nx ? msg_zero : msg_ok);
     }
-    auto& map = e->value_map();
-    return map.run_with_entry(key, [] (const dict_entry* d) {
-        if (!d) {
+    if (nx && _cache.exists(dst)) {
+        return reply_builder::build(msg_zero);
+    }
+    erase_entry(dst);
+    _field_expiry.rename_key(src.key(), dst.key());
+    _cache.mark_deleted(src.key());
+    with_allocator(allocator(), [this, &src, &dst] {
+        auto e = _cache.find(src);
+        type_memory::scope accounting(_cache.memory_by_type(), e->type());
+        _cache.rename(*e, dst);
+    });
+    auto r = mutation_record::deleted(bytes_view { src.key().data(), src.key().size() });
+    return _commit_log->append(r).then([this, dst = std::move(dst)] {
+        return log_entry(dst);
+    }).then([nx] {
+        return reply_builder::build(nx ? msg_one : msg_ok);
+    });
+}
+
+future<scattered_message_ptr> database::copy(redis_key src, redis_key dst, bool replace)
+{
+    return dump_entry(src, dst.key(), false).then([this, dst = std::move(dst), replace] (foreign_ptr<lw_shared_ptr<bytes>> record) mutable {
+        if (!record) {
             return reply_builder::build(msg_zero);
         }
-        return reply_builder::build(d->value_bytes_size());
+        return restore_entry(std::move(dst), std::move(record), replace).then([] (bool copied) {
+            return reply_builder::build(copied ? msg_one : msg_zero);
+        });
     });
 }
 
-future<scattered_message_ptr> database::hlen(redis_key rk)
+lw_shared_ptr<bytes> database::encode_record(const redis_key& rk, const bytes& dst)
 {
-    ++_stat._hlen;
-    auto e = _cache.find(rk);
-    if (!e) {
-        return reply_builder::build(msg_zero);
-    }
-    if (e->type_of_map() == false) {
-        return reply_builder::build(msg_type_err);
-    }
-    auto& map = e->value_map();
-    return reply_builder::build(map.size());
+    lw_shared_ptr<bytes> record;
+    _cache.run_with_entry(rk, [this, &dst, &record] (const cache_entry* e) {
+        if (!e) {
+            return;
+        }
+        // the record goes to the standard allocator, and the region is not
+        // compacted under the pointers to the value.
+        std::vector<char> out;
+        logalloc::reclaim_lock lock(*this);
+        with_allocator(standard_allocator(), [e, &dst, &out] {
+            encode_entry(*e, dst.data(), dst.size(), [&out] {
+                return snapshot_encoder(out);
+            });
+        });
+        record = make_lw_shared<bytes>(out.data(), out.size());
+    });
+    return record;
 }
 
-future<scattered_message_ptr> database::hgetall(redis_key rk)
+future<foreign_ptr<lw_shared_ptr<bytes>>> database::dump_entry(redis_key rk, bytes dst, bool remove)
 {
-    return hgetall_impl<true, true>(rk);
+    auto record = encode_record(rk, dst);
+    if (!record || !remove) {
+        return make_ready_future<foreign_ptr<lw_shared_ptr<bytes>>>(make_foreign(std::move(record)));
+    }
+    erase_entry(rk);
+    auto r = mutation_record::deleted(bytes_view { rk.key().data(), rk.key().size() });
+    return _commit_log->append(r).then([record = std::move(record)] () mutable {
+        return make_foreign(std::move(record));
+    });
 }
 
-future<scattered_message_ptr> database::hgetall_values(redis_key rk)
+future<bool> database::restore_entry(redis_key rk, foreign_ptr<lw_shared_ptr<bytes>> record, bool replace)
 {
-    return hgetall_impl<false, true>(rk);
+    if (!replace && _cache.exists(rk)) {
+        return make_ready_future<bool>(false);
+    }
+    auto r = decode_snapshot_record(record->data(), record->size());
+    return replace_with_record(rk, r).then([] {
+        return true;
+    });
 }
 
-future<scattered_message_ptr> database::hgetall_keys(redis_key rk)
+future<> database::replace_with_record(const redis_key& rk, const snapshot_record& r)
 {
-    return hgetall_impl<true, false>(rk);
+    erase_entry(rk);
+    bool inserted = false;
+    with_allocator(allocator(), [this, &r, &inserted] {
+        _load_section(*this, [this, &r, &inserted] {
+            inserted = insert_record(r, epoch_ms());
+        });
+    });
+    if (inserted) {
+        count_records(r._type, 1);
+    }
+    return log_entry(rk);
 }
 
-
-future<scattered_message_ptr> database::hmget(redis_key rk, std::vector<bytes> keys)
+future<scattered_message_ptr> database::dump(redis_key rk)
 {
-    ++_stat._read;
-    ++_stat._hmget;
-    auto e = _cache.find(rk);
-    if (!e) {
-        return reply_builder::build(msg_err);
+    auto record = encode_record(rk, bytes());
+    if (!record) {
+        return reply_builder::build(msg_null_blik);
     }
-    if (e->type_of_map() == false) {
-        return reply_builder::build(msg_type_err);
-    }
-    auto& map = e->value_map();
-    std::vector<const dict_entry*> entries;
-    map.fetch(keys, entries);
-    if (!entries.empty()) ++_stat._hit;
-    return reply_builder::build<false, true>(entries);
+    auto payload = make_dump_payload(record->data(), record->size());
+    return reply_builder::build_bulk(payload.size(), [&payload] (auto&& append) {
+        append(bytes_view { payload.data(), payload.size() });
+    });
 }
 
-future<scattered_message_ptr> database::srandmember(redis_key rk, size_t count)
+future<scattered_message_ptr> database::restore(redis_key rk, bytes payload, uint64_t expire_at_ms, bool replace)
 {
-    ++_stat._read;
-    ++_stat._srandmember;
-    auto e = _cache.find(rk);
-    std::vector<const dict_entry*> result;
-    if (!e) {
-        return reply_builder::build<true, false>(result);
+    bytes_view record;
+    if (!open_dump_payload(bytes_view { payload.data(), payload.size() }, record)) {
+        return reply_builder::build(msg_dump_payload_err);
     }
-    if (e->type_of_set() == false) {
-        return reply_builder::build(msg_type_err);
+    snapshot_record r;
+    try {
+        r = decode_snapshot_record(record.data(), record.size());
+    } catch (const corrupt_snapshot&) {
+        return reply_builder::build(msg_dump_payload_err);
     }
-    auto& set = e->value_set();
-    count = std::min(count, set.size());
-    for (size_t i = 0; i < count; ++i) {
-        auto index = rand_generater::rand_less_than(set.size());
-        auto entry = set.at(index);
-        result.push_back(&(*entry));
+    if (!replace && _cache.exists(rk)) {
+        return reply_builder::build(msg_busykey_err);
     }
-    if (!result.empty()) ++_stat._hit;
-    return reply_builder::build<true, false>(result);
+    // the payload carries no name, and the TTL is that of the command.
+    r._key = rk.key();
+    r._expire_at_ms = expire_at_ms;
+    return replace_with_record(rk, r).then([] {
+        return reply_builder::build(msg_ok);
+    });
 }
 
-future<scattered_message_ptr> database::sadds(redis_key rk, std::vector<bytes> members)
+future<> database::log_entry(const redis_key& rk)
 {
-    ++_stat._sadd;
-    return with_allocator(allocator(), [this, rk = std::move(rk), members = std::move(members)] {
-        auto o = _cache.find(rk);
-        if (!o) {
-            auto entry = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), cache_entry::set_initializer());
-            _cache.insert(entry);
-            ++_stat._total_set_entries;
-            o = entry;
-        }
-        if (o->type_of_set() == false) {
-            return reply_builder::build(msg_type_err);
+    // the records point into the values, which are taken first.
+    std::vector<bytes> values;
+    long expire = 0;
+    bool string = false;
+    _cache.run_with_entry(rk, [&values, &expire, &string] (const cache_entry* e) {
+        if (!e) {
+            return;
+        }
+        if (e->type_of_bytes() || e->type_of_integer() || e->type_of_float()) {
+            string = true;
+            values.push_back(e->type_of_integer() || e->type_of_float() ? dict_value(*e) : string_value(*e));
+            expire = e->ever_expires() ? std::max<long>(e->time_of_live(), 1) : 0;
+        }
+        else if (e->type_of_map()) {
+            e->with_dict([&values] (const auto& dict) {
+                entries_of<decltype(dict)> entries;
+                dict.fetch(entries);
+                for (auto entry : entries) {
+                    values.emplace_back(entry->key_data(), entry->key_size());
+                    values.push_back(dict_value(*entry));
+                }
+            });
         }
-        auto& set = o->value_set();
-        size_t inserted = 0;
-        for (auto& member : members) {
-            if (set.insert(current_allocator().construct<dict_entry>(member))) {
-                inserted++;
-            }
+    });
+    auto key = bytes_view { rk.key().data(), rk.key().size() };
+    std::vector<mutation_record> records;
+    if (string) {
+        records.push_back(mutation_record::of_bytes(key, bytes_view { values[0].data(), values[0].size() }, record_deadline(expire), FLAG_EXPIRE_AT));
+    }
+    else {
+        records.push_back(mutation_record::deleted(key));
+        for (size_t i = 0; i + 1 < values.size(); i += 2) {
+            records.push_back(mutation_record::field_set(key, view_of(values[i]), view_of(values[i + 1])));
         }
-        return reply_builder::build(inserted);
+    }
+    // the appends copy the records at once.
+    return parallel_for_each(records, [this] (const mutation_record& r) {
+        return _commit_log->append(r);
     });
 }
 
-bool database::sadd_direct(redis_key rk, bytes member)
+namespace {
+future<> load_snapshot_file(sstring name)
 {
-    ++_stat._sadd;
-    return with_allocator(allocator(), [this, rk = std::move(rk), member = std::move(member)] {
-        auto o = _cache.find(rk);
-        if (!o) {
-            auto entry = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), cache_entry::set_initializer());
-            _cache.insert(entry);
-            ++_stat._total_set_entries;
-            o = entry;
-        }
-        if (o->type_of_set() == false) {
-            return false;
+    return engine().file_exists(name).then([name] (bool exists) {
+        if (!exists) {
+            return make_ready_future<>();
         }
-        auto& set = o->value_set();
-        set.insert(current_allocator().construct<dict_entry>(member));
-        return true;
+        db_log.info("loading the snapshot {}", name);
+        return load_file(name, make_lw_shared<snapshot_decoder>());
     });
 }
 
-bool database::sadds_direct(redis_key rk, std::vector<bytes> members)
+// The warm restart image is read whole before any of its keys is loaded,
+// so that one cut short by a crash leaves the snapshot to load. Once loaded
+// it is removed: the keys change from then on, and after a crash they are
+// in the snapshot and the commit log.
+future<> load_warm_image(sstring name, sstring snapshot)
 {
-    ++_stat._sadd;
-    return with_allocator(allocator(), [this, rk = std::move(rk), members = std::move(members)] {
-        auto o = _cache.find(rk);
-        if (!o) {
-            auto entry = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), cache_entry::set_initializer());
-            _cache.insert(entry);
-            ++_stat._total_set_entries;
-            o = entry;
-        }
-        if (o->type_of_set() == false) {
-            return false;
-        }
-        auto& set = o->value_set();
-        size_t inserted = 0;
-        for (auto& member : members) {
-            if (set.insert(current_allocator().construct<dict_entry>(member))) {
-                inserted++;
+    return engine().file_exists(name).then([name, snapshot] (bool exists) {
+        if (!exists) {
+            return load_snapshot_file(snapshot);
+        }
+        return verify_snapshot(name).then_wrapped([name, snapshot] (future<> f) {
+            try {
+                f.get();
+            } catch (...) {
+                db_log.warn("the warm restart image {} is not whole, loading the snapshot: {}", name, std::current_exception());
+                return remove_file(name).then([snapshot] {
+                    return load_snapshot_file(snapshot);
+                });
             }
-        }
-        return true;
+            db_log.info("loading the warm restart image {}", name);
+            return load_file(name, make_lw_shared<snapshot_decoder>()).then([name] {
+                return remove_file(name);
+            });
+        });
+    });
+}
+}
+
+future<> database::load_snapshot()
+{
+    std::vector<std::pair<sstring, sstring>> names;
+    auto shards = std::max(_options._data_shards, smp::count);
+    for (auto shard = engine().cpu_id(); shard < shards; shard += smp::count) {
+        auto& dir = _options._warm_restart_dir;
+        names.emplace_back(snapshot_file_name(shard), dir.empty() ? sstring() : warm_image_file_name(dir, shard));
+    }
+    return do_with(std::move(names), [] (auto& names) {
+        return do_for_each(names, [] (const std::pair<sstring, sstring>& name) {
+            if (name.second.empty()) {
+                return load_snapshot_file(name.first);
+            }
+            return load_warm_image(name.second, name.first);
+        });
+    });
+}
+
+future<> database::save_heat_map()
+{
+    if (!_cache.tiered() || _options._warmup_keys == 0) {
+        return make_ready_future<>();
+    }
+    // a min-heap of the hottest keys found so far, the coldest on top.
+    using hot_key = std::pair<uint8_t, bytes>;
+    auto hottest = make_lw_shared<std::vector<hot_key>>();
+    auto cursor = make_lw_shared<size_t>(0);
+    auto colder = [] (const hot_key& a, const hot_key& b) { return a.first > b.first; };
+    return repeat([this, hottest, cursor, colder] {
+        auto n = _options._warmup_keys;
+        auto now = clock_type::now();
+        *cursor = scan_some(_cache, *cursor, SNAPSHOT_BATCH_ENTRIES, [&hottest, n, now, colder] (const cache_entry& e) {
+            auto frequency = e.lfu_counter(now);
+            if (hottest->size() >= n && frequency <= hottest->front().first) {
+                return;
+            }
+            hottest->emplace_back(frequency, bytes { e.key_data(), e.key_size() });
+            std::push_heap(hottest->begin(), hottest->end(), colder);
+            if (hottest->size() > n) {
+                std::pop_heap(hottest->begin(), hottest->end(), colder);
+                hottest->pop_back();
+            }
+        });
+        return *cursor == 0 ? make_ready_future<stop_iteration>(stop_iteration::yes) : later().then([] { return stop_iteration::no; });
+    }).then([hottest, colder] {
+        std::sort_heap(hottest->begin(), hottest->end(), colder);
+        auto writer = make_lw_shared<snapshot_writer>(heat_map_file_name(engine().cpu_id()));
+        return writer->open().then([writer, hottest] {
+            return do_for_each(*hottest, [writer] (const hot_key& k) {
+                auto out = writer->next_record();
+                out.begin(snapshot_type::string, k.second.data(), k.second.size(), 0);
+                out.put_bytes(nullptr, 0);
+                return writer->should_write() ? writer->write() : make_ready_future<>();
+            });
+        }).then([writer] {
+            return writer->finish();
+        }).then_wrapped([writer] (future<> f) {
+            try {
+                f.get();
+                db_log.info("saved the {} hottest keys to the heat map", writer->records());
+                return make_ready_future<>();
+            } catch (...) {
+                db_log.warn("failed to save the heat map: {}", std::current_exception());
+                return writer->abort();
+            }
+        });
+    });
+}
+
+future<> database::start_warmup()
+{
+    if (!_cache.tiered() || _options._warmup_keys == 0) {
+        return make_ready_future<>();
+    }
+    auto name = heat_map_file_name(engine().cpu_id());
+    return engine().file_exists(name).then([this, name] (bool exists) {
+        if (!exists) {
+            return make_ready_future<>();
+        }
+        if (resharding()) {
+            db_log.info("dropping the heat map {}, written for {} shards", name, _options._data_shards);
+            return remove_file(name);
+        }
+        auto decoder = make_lw_shared<snapshot_decoder>();
+        return read_file_in_chunks(name, [this, decoder] (const char* data, size_t size) {
+            if (decoder->ended()) {
+                return make_ready_future<size_t>(size);
+            }
+            auto n = _options._warmup_keys;
+            return make_ready_future<size_t>(decoder->decode(data, size, [this, n] (snapshot_record r) {
+                if (_warmup_queue.size() < n) {
+                    _warmup_queue.push_back(std::move(r._key));
+                }
+            }));
+        }).then([name, decoder] {
+            if (!decoder->ended()) {
+                throw corrupt_snapshot(sprint("%s ends before its last record", name));
+            }
+        }).then_wrapped([this, name] (future<> f) {
+            try {
+                f.get();
+            } catch (...) {
+                db_log.warn("failed to read the heat map {}: {}", name, std::current_exception());
+                _warmup_queue.clear();
+            }
+            // the next process gets the heat map this one leaves.
+            return remove_file(name).then([this] {
+                run_warmup();
+            });
+        });
     });
 }
 
-future<scattered_message_ptr> database::scard(redis_key rk)
+constexpr std::chrono::milliseconds database::WARMUP_PERIOD;
+
+void database::run_warmup()
 {
-    ++_stat._scard;
-    auto e = _cache.find(rk);
-    if (!e) {
-        return reply_builder::build(msg_zero);
-    }
-    if (e->type_of_set() == false) {
-        return reply_builder::build(msg_type_err);
+    if (_warmup_queue.empty()) {
+        return;
     }
-    auto& set = e->value_set();
-    return reply_builder::build(set.size());
+    db_log.info("reading back the {} hottest keys of the last run", _warmup_queue.size());
+    _warmup_gate.enter();
+    auto batch_size = std::max<size_t>(_options._warmup_rate * WARMUP_PERIOD.count() / 1000, 1);
+    repeat([this, batch_size] {
+        if (_warmup_queue.empty() || _warmup_gate.is_closed()) {
+            return make_ready_future<stop_iteration>(stop_iteration::yes);
+        }
+        std::vector<bytes> batch;
+        while (!_warmup_queue.empty() && batch.size() < batch_size) {
+            batch.push_back(std::move(_warmup_queue.front()));
+            _warmup_queue.pop_front();
+        }
+        auto started = lowres_clock::now();
+        // keys already read back by the commands of clients are skipped.
+        return utils::local_work_scheduler().run(utils::work_class::background, [this, batch = std::move(batch)] () mutable {
+            return fault_in(std::move(batch));
+        }).then([started] {
+            auto spent = lowres_clock::now() - started;
+            return spent >= WARMUP_PERIOD ? make_ready_future<>() : sleep(WARMUP_PERIOD - spent);
+        }).then([] {
+            return stop_iteration::no;
+        });
+    }).handle_exception([] (std::exception_ptr e) {
+        db_log.warn("failed to read back the keys of the heat map: {}", e);
+    }).finally([this] {
+        _warmup_queue.clear();
+        _warmup_gate.leave();
+    });
 }
 
-future<scattered_message_ptr> database::sismember(redis_key rk, bytes member)
+future<uint64_t> import_rdb(sstring name)
 {
-    ++_stat._sismember;
-    auto e = _cache.find(rk);
-    if (!e) {
-        return reply_builder::build(msg_zero);
-    }
-    if (e->type_of_set() == false) {
-        return reply_builder::build(msg_type_err);
-    }
-    auto& set = e->value_set();
-    auto result = set.exists(member);
-    return reply_builder::build(result ? msg_one : msg_zero);
+    auto decoder = make_lw_shared<rdb_decoder>();
+    return load_file(name, decoder).then([decoder] {
+        return decoder->keys();
+    });
 }
 
-future<scattered_message_ptr> database::smembers(redis_key rk)
+future<foreign_ptr<lw_shared_ptr<database::dump_result_type>>> database::dump_direct(size_t cursor, size_t count, std::function<bool (bytes_view key)> filter)
 {
-    ++_stat._read;
-    ++_stat._smembers;
-    return _cache.run_with_entry(rk, [this] (const cache_entry* e) {
-        if (!e) {
-            return reply_builder::build(msg_nil);
+    auto result = make_lw_shared<dump_result_type>();
+    auto& commands = result->second;
+    auto now = clock_type::now();
+    result->first = scan_some(_cache, cursor, count, [&commands, &filter, now] (const cache_entry& e) {
+        if (e.ever_expires() && e.get_timeout() <= now) {
+            return;
         }
-        if (e->type_of_set() == false) {
-            return reply_builder::build(msg_type_err);
+        if (filter(e.key())) {
+            append_restore_commands(e, commands);
         }
-        auto& set = e->value_set();
-        std::vector<const dict_entry*> entries;
-        set.fetch(entries);
-        if (!entries.empty()) ++_stat._hit;
-        return reply_builder::build<true, false>(entries);
     });
+    return make_ready_future<foreign_ptr<lw_shared_ptr<dump_result_type>>>(foreign_ptr<lw_shared_ptr<dump_result_type>>(std::move(result)));
 }
 
-future<foreign_ptr<lw_shared_ptr<bytes>>> database::get_hll_direct(redis_key rk)
+future<foreign_ptr<lw_shared_ptr<database::scan_result_type>>> database::keys_direct(size_t cursor, size_t count, std::function<bool (bytes_view key)> filter)
 {
-    using return_type = foreign_ptr<lw_shared_ptr<bytes>>;
-    auto e = _cache.find(rk);
-    if (!e || e->type_of_hll() == false) {
-        return make_ready_future<return_type>(foreign_ptr<lw_shared_ptr<bytes>>(nullptr));
-    }
-    auto data = e->value_bytes_data();
-    auto size = e->value_bytes_size();
-    ++_stat._hit;
-    return make_ready_future<return_type>(foreign_ptr<lw_shared_ptr<bytes>>(make_lw_shared<bytes>(bytes {data, size})));
+    auto result = make_lw_shared<scan_result_type>();
+    auto& keys = result->second;
+    auto now = clock_type::now();
+    result->first = scan_some(_cache, cursor, count, [&keys, &filter, now] (const cache_entry& e) {
+        if (e.ever_expires() && e.get_timeout() <= now) {
+            return;
+        }
+        if (filter(e.key())) {
+            keys.emplace_back(e.key_data(), e.key_size());
+        }
+    });
+    return make_ready_future<foreign_ptr<lw_shared_ptr<scan_result_type>>>(foreign_ptr<lw_shared_ptr<scan_result_type>>(std::move(result)));
 }
 
-future<foreign_ptr<lw_shared_ptr<bytes>>> database::get_direct(redis_key rk)
+foreign_ptr<lw_shared_ptr<std::vector<uint64_t>>> database::slot_digests() const
 {
-    ++_stat._read;
-    ++_stat._get;
-    using return_type = foreign_ptr<lw_shared_ptr<bytes>>;
-    auto e = _cache.find(rk);
-    if (!e || e->type_of_bytes() == false) {
-        return make_ready_future<return_type>(foreign_ptr<lw_shared_ptr<bytes>>(nullptr));
-    }
-    auto data = e->value_bytes_data();
-    auto size = e->value_bytes_size();
-    ++_stat._hit;
-    return make_ready_future<return_type>(foreign_ptr<lw_shared_ptr<bytes>>(make_lw_shared<bytes>(bytes {data, size})));
+    return make_foreign(make_lw_shared<std::vector<uint64_t>>(_cache.slot_digests()));
 }
 
-future<foreign_ptr<lw_shared_ptr<std::vector<bytes>>>> database::smembers_direct(redis_key rk)
+future<scattered_message_ptr> database::zadds(redis_key rk, sset_lsa::member_scores members, int flags)
 {
-    ++_stat._read;
-    ++_stat._smembers;
-    using result_type = std::vector<bytes>;
-    using return_type = foreign_ptr<lw_shared_ptr<result_type>>;
-    return _cache.run_with_entry(rk, [this] (const cache_entry* e) {
-        if (!e || e->type_of_set() == false) {
-            return make_ready_future<return_type>(foreign_ptr<lw_shared_ptr<result_type>>(make_lw_shared<result_type>(result_type {})));
-        }
-        auto& set = e->value_set();
-        result_type keys;
-        set.fetch_keys(keys);
-        if (!keys.empty()) ++_stat._hit;
-        return make_ready_future<return_type>(foreign_ptr<lw_shared_ptr<result_type>>(make_lw_shared<result_type>(std::move(keys))));
-    });
+    auto inserted = zadds_direct(std::move(rk), std::move(members), flags);
+    return inserted < 0 ? reply_builder::build(msg_type_err) : reply_builder::build(static_cast<size_t>(inserted));
 }
 
-future<scattered_message_ptr> database::spop(redis_key rk, size_t count)
+long database::zadds_direct(redis_key rk, sset_lsa::member_scores members, int flags)
 {
-    ++_stat._read;
-    ++_stat._spop;
-    return with_allocator(allocator(), [this, rk = std::move(rk), &count] {
-        auto e = _cache.find(rk);
-        if (!e) {
-            return reply_builder::build(msg_nil);
+    return with_allocator_for(data_type::sset, [this, rk = std::move(rk), members = std::move(members), flags] {
+        auto o = _cache.find(rk);
+        if (o == nullptr) {
+            auto entry = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), cache_entry::sset_initializer());
+            _cache.insert(entry);
+            ++_stat._total_zset_entries;
+            o = entry;
         }
-        if (e->type_of_set() == false) {
-            return reply_builder::build(msg_type_err);
+        if (o->type_of_sset() == false) {
+            return -1L;
         }
-        auto& set = e->value_set();
-        std::vector<dict_lsa::const_iterator> removed;
-        std::vector<const dict_entry*> entries;
-        count = std::min(count, set.size());
-        for (size_t i = 0; i < count; ++i) {
-            auto index = rand_generater::rand_less_than(set.size());
-            auto entry = set.at(index);
-            entries.push_back(&(*entry));
-            removed.push_back(entry);
-        }
-        auto reply = reply_builder::build<true, false>(entries);
-        if (!removed.empty()) {
-            for (auto it : removed) {
-                set.erase(it);
-            }
-            if (set.empty()) {
-                --_stat._total_set_entries;
-                _cache.erase(rk);
-            }
+        auto& sset = o->value_sset();
+        size_t inserted = 0;
+        if (flags & ZADD_NX) {
+            inserted = sset.insert_if_not_exists(members);
         }
-        return reply;
+        else if (flags & ZADD_XX) {
+            inserted = sset.update_if_only_exists(members);
+        }
+        else if (flags & ZADD_CH) {
+            inserted = sset.insert_or_update(members);
+        }
+        else {
+            assert(false);
+        }
+        serve_blocked(rk, o);
+        return static_cast<long>(inserted);
     });
 }
 
-future<scattered_message_ptr> database::srem(redis_key rk, bytes member)
+
+future<scattered_message_ptr> database::zcard(redis_key rk)
 {
-    ++_stat._srem;
-    return with_allocator(allocator(), [this, rk = std::move(rk), member = std::move(member)] {
-        auto e = _cache.find(rk);
-        if (!e) {
+    return _cache.run_with_entry(rk, [] (const cache_entry* e) {
+        if (e == nullptr) {
             return reply_builder::build(msg_zero);
         }
-        if (e->type_of_set() == false) {
+        if (e->type_of_sset() == false) {
             return reply_builder::build(msg_type_err);
         }
-        auto& set = e->value_set();
-        auto result = set.erase(member);
-        if (set.empty()) {
-            --_stat._total_set_entries;
-            _cache.erase(rk);
-        }
-        return reply_builder::build(result ? msg_one : msg_zero);
+        auto& sset = e->value_sset();
+        return reply_builder::build(sset.size());
     });
 }
-bool database::srem_direct(redis_key rk, bytes member)
+
+future<scattered_message_ptr> database::zrem(redis_key rk, std::vector<bytes> members)
 {
-    ++_stat._srem;
-    return with_allocator(allocator(), [this, rk = std::move(rk), member = std::move(member)] {
+    auto removed = zrem_direct(std::move(rk), std::move(members));
+    return removed < 0 ? reply_builder::build(msg_type_err) : reply_builder::build(static_cast<size_t>(removed));
+}
+
+long database::zrem_direct(redis_key rk, std::vector<bytes> members)
+{
+    return with_allocator_for(data_type::sset, [this, rk = std::move(rk), members = std::move(members)] {
         auto e = _cache.find(rk);
-        if (!e) {
-            return true;
+        if (e == nullptr) {
+            return 0L;
         }
-        if (e->type_of_set() == false) {
-            return false;
+        if (e->type_of_sset() == false) {
+            return -1L;
         }
-        auto& set = e->value_set();
-        bool result = set.erase(member);
-        if (set.empty()) {
-            --_stat._total_set_entries;
-            _cache.erase(rk);
+        auto& sset = e->value_sset();
+        long removed = sset.erase(members);
+        if (sset.empty()) {
+           --_stat._total_zset_entries;
+           _cache.erase(rk);
         }
-        return result;
+        return removed;
     });
 }
 
-future<scattered_message_ptr> database::srems(redis_key rk, std::vector<bytes> members)
+void database::pop_members(const redis_key& rk, cache_entry* e, bool max, size_t count, scattered_message<char>& m, bool pairs)
+{
+    auto& sset = e->value_sset();
+    std::vector<const sset_entry*> entries;
+    sset.fetch_by_rank(0, static_cast<long>(count) - 1, entries, max);
+    for (auto entry : entries) {
+        if (pairs) {
+            reply_builder::append_array_header(m, 2);
+        }
+        reply_builder::append(m, *entry, true);
+    }
+    sset.erase(entries);
+    if (sset.empty()) {
+        --_stat._total_zset_entries;
+        _cache.erase(rk);
+    }
+}
+
+future<scattered_message_ptr> database::zpop(redis_key rk, bool max, size_t count)
 {
-    ++_stat._srem;
-    return with_allocator(allocator(), [this, rk = std::move(rk), members = std::move(members)] {
+    ++_stat._read;
+    logalloc::reclaim_lock lock(*this);
+    return with_allocator_for(data_type::sset, [this, &rk, max, count] {
         auto e = _cache.find(rk);
-        if (!e) {
-            return reply_builder::build(msg_zero);
+        if (e == nullptr) {
+            return reply_builder::build(msg_empty_multi_bulk);
         }
-        if (e->type_of_set() == false) {
+        if (e->type_of_sset() == false) {
             return reply_builder::build(msg_type_err);
         }
-        auto& set = e->value_set();
-        size_t removed = 0;
-        for (auto& member : members) {
-            if (set.erase(member)) {
-                removed++;
-            }
-        }
-        if (set.empty()) {
-            --_stat._total_set_entries;
-            _cache.erase(rk);
-        }
-        return reply_builder::build(removed);
+        ++_stat._hit;
+        auto n = std::min(count, e->value_sset().size());
+        auto m = make_lw_shared<scattered_message<char>>();
+        reply_builder::append_array_header(*m, n * 2);
+        pop_members(rk, e, max, n, *m, false);
+        return make_ready_future<scattered_message_ptr>(foreign_ptr<lw_shared_ptr<scattered_message<char>>>(m));
     });
 }
 
-future<scattered_message_ptr> database::pttl(redis_key rk)
+future<scattered_message_ptr> database::zmpop(std::vector<redis_key> keys, bool max, size_t count)
 {
-    ++_stat._pttl;
-    return _cache.run_with_entry(rk, [this] (const cache_entry* e) {
-        if (!e) {
-            return reply_builder::build(msg_neg_two);
-        }
-        if (!e->ever_expires()) {
-            return reply_builder::build(msg_neg_one);
-        }
-        return reply_builder::build(e->time_of_live());
+    ++_stat._read;
+    logalloc::reclaim_lock lock(*this);
+    return with_allocator_for(data_type::sset, [this, &keys, max, count] {
+        for (auto& rk : keys) {
+            auto e = _cache.find(rk);
+            if (!e) {
+                continue;
+            }
+            if (e->type_of_sset() == false) {
+                return reply_builder::build(msg_type_err);
+            }
+            ++_stat._hit;
+            auto n = std::min(count, e->value_sset().size());
+            auto m = make_lw_shared<scattered_message<char>>();
+            reply_builder::append_array_header(*m, 2);
+            reply_builder::append_bulk(*m, rk.key().data(), rk.key().size());
+            reply_builder::append_array_header(*m, n);
+            pop_members(rk, e, max, n, *m, true);
+            return make_ready_future<scattered_message_ptr>(foreign_ptr<lw_shared_ptr<scattered_message<char>>>(m));
+        }
+        return make_ready_future<scattered_message_ptr>();
     });
 }
 
-future<scattered_message_ptr> database::ttl(redis_key rk)
+future<scattered_message_ptr> database::zcount(redis_key rk, double min, double max)
 {
-    ++_stat._ttl;
-    return _cache.run_with_entry(rk, [this] (const cache_entry* e) {
-        if (!e) {
-            return reply_builder::build(msg_neg_two);
+    return _cache.run_with_entry(rk, [min, max] (const cache_entry* e) {
+        if (e == nullptr) {
+            return reply_builder::build(msg_zero);
         }
-        if (!e->ever_expires()) {
-            return reply_builder::build(msg_neg_one);
+        if (e->type_of_sset() == false) {
+            return reply_builder::build(msg_type_err);
         }
-        return reply_builder::build(e->time_of_live() / 1000);
+        auto& sset = e->value_sset();
+        auto count = sset.count_by_score(min, max);
+        return reply_builder::build(count);
     });
 }
 
-future<scattered_message_ptr> database::zadds(redis_key rk, std::unordered_map<bytes, double> members, int flags)
+future<scattered_message_ptr> database::zincrby(redis_key rk, bytes member, double delta)
 {
-    ++_stat._zadd;
-    return with_allocator(allocator(), [this, rk = std::move(rk), members = std::move(members), flags] {
+    return with_allocator_for(data_type::sset, [this, rk = std::move(rk), member = std::move(member), delta] {
         auto o = _cache.find(rk);
         if (o == nullptr) {
             auto entry = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), cache_entry::sset_initializer());
@@ -1330,195 +5783,285 @@ future<scattered_message_ptr> database::zadds(redis_key rk, std::unordered_map<b
             return reply_builder::build(msg_type_err);
         }
         auto& sset = o->value_sset();
-        size_t inserted = 0;
-        if (flags & ZADD_NX) {
-            inserted = sset.insert_if_not_exists(members);
+        auto result = sset.insert_or_update(member, delta);
+        auto reply = reply_builder::build(result);
+        serve_blocked(rk, o);
+        return reply;
+    });
+}
+
+future<long> database::zcard_direct(redis_key rk)
+{
+    ++_stat._read;
+    auto e = _cache.find(rk);
+    if (!e) {
+        return make_ready_future<long>(0);
+    }
+    if (e->type_of_sset()) {
+        return make_ready_future<long>(e->value_sset().size());
+    }
+    if (e->type_of_set()) {
+        return make_ready_future<long>(e->dict_size());
+    }
+    return make_ready_future<long>(-1);
+}
+
+future<foreign_ptr<lw_shared_ptr<zset_members>>> database::zmembers_direct(redis_key rk, double weight)
+{
+    ++_stat._read;
+    using return_type = foreign_ptr<lw_shared_ptr<zset_members>>;
+    return _cache.run_with_entry(rk, [this, weight] (const cache_entry* e) {
+        auto members = make_lw_shared<zset_members>();
+        if (e == nullptr) {
+            return make_ready_future<return_type>(return_type(std::move(members)));
         }
-        else if (flags & ZADD_XX) {
-            inserted = sset.update_if_only_exists(members);
+        if (e->type_of_sset()) {
+            auto& sset = e->value_sset();
+            members->reserve(sset.size());
+            sset.for_each_in(sset.range_by_rank(0, -1, false), false, [&members, weight] (const sset_entry& m) {
+                members->emplace_back(bytes(m.key_data(), m.key_size()), weigh_score(m.score(), weight));
+            });
         }
-        else if (flags & ZADD_CH) {
-            inserted = sset.insert_or_update(members);
+        else if (e->type_of_set()) {
+            std::vector<bytes> keys;
+            e->with_dict([&keys] (const auto& set) { set.fetch_keys(keys); });
+            members->reserve(keys.size());
+            auto score = weigh_score(1, weight);
+            for (auto& key : keys) {
+                members->emplace_back(std::move(key), score);
+            }
         }
         else {
-            // FIXME: RETURN ERROR MESSAGE
-            assert(false);
+            return make_ready_future<return_type>(return_type(nullptr));
         }
-        return reply_builder::build(inserted);
+        ++_stat._hit;
+        // Sorting here keeps the work on the owners, in parallel.
+        std::sort(members->begin(), members->end(), [] (const auto& l, const auto& r) { return l.first < r.first; });
+        return make_ready_future<return_type>(return_type(std::move(members)));
     });
 }
 
-bool database::zadds_direct(redis_key rk, std::unordered_map<bytes, double> members, int flags)
+future<foreign_ptr<lw_shared_ptr<std::vector<double>>>> database::zscore_batch(redis_key rk, const zset_members& candidates, double weight)
 {
-    ++_stat._zadd;
-    return with_allocator(allocator(), [this, rk = std::move(rk), members = std::move(members), flags] {
-        auto o = _cache.find(rk);
-        if (o == nullptr) {
-            auto entry = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), cache_entry::sset_initializer());
-            _cache.insert(entry);
-            ++_stat._total_zset_entries;
-            o = entry;
-        }
-        if (o->type_of_sset() == false) {
-            return false;
-        }
-        auto& sset = o->value_sset();
-        size_t inserted = 0;
-        if (flags & ZADD_NX) {
-            inserted = sset.insert_if_not_exists(members);
-        }
-        else if (flags & ZADD_XX) {
-            inserted = sset.update_if_only_exists(members);
-        }
-        else if (flags & ZADD_CH) {
-            inserted = sset.insert_or_update(members);
+    ++_stat._read;
+    using result_type = std::vector<double>;
+    using return_type = foreign_ptr<lw_shared_ptr<result_type>>;
+    auto scores = make_lw_shared<result_type>(candidates.size(), std::numeric_limits<double>::quiet_NaN());
+    _cache.run_with_entry(rk, [this, &candidates, &scores, weight] (const cache_entry* e) {
+        if (e == nullptr) {
+            return;
+        }
+        auto& result = *scores;
+        if (e->type_of_sset()) {
+            auto& sset = e->value_sset();
+            for (size_t i = 0; i < candidates.size(); ++i) {
+                auto score = sset.score(candidates[i].first);
+                if (score) {
+                    result[i] = weigh_score(*score, weight);
+                }
+            }
         }
-        else {
-            assert(false);
+        else if (e->type_of_set()) {
+            auto score = weigh_score(1, weight);
+            e->with_dict([&candidates, &result, score] (const auto& set) {
+                for (size_t i = 0; i < candidates.size(); ++i) {
+                    if (set.exists(candidates[i].first)) {
+                        result[i] = score;
+                    }
+                }
+            });
         }
-        return inserted > 0;
+        ++_stat._hit;
     });
+    return make_ready_future<return_type>(return_type(std::move(scores)));
+}
+
+template <typename Func>
+size_t database::store_zset(const redis_key& rk, Func&& fill)
+{
+    auto entry = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), cache_entry::sset_initializer());
+    fill(entry->value_sset());
+    auto size = entry->value_sset().size();
+    if (size == 0) {
+        current_allocator().destroy<cache_entry>(entry);
+        erase_entry(rk);
+        return 0;
+    }
+    if (_cache.replace(entry)) {
+        ++_stat._total_zset_entries;
+    }
+    return size;
+}
+
+namespace {
+
+inline void insert_member(sset_lsa& sset, const bytes& member, double score)
+{
+    auto entry = current_allocator().construct<sset_entry>(member, score);
+    if (!sset.insert(entry)) {
+        current_allocator().destroy<sset_entry>(entry);
+    }
+}
+
 }
 
+future<scattered_message_ptr> database::zunionstore(redis_key rk, const std::vector<const zset_members*>& runs, int aggregate)
+{
+    return with_allocator_for(data_type::sset, [this, &rk, &runs, aggregate] {
+        auto size = store_zset(rk, [&runs, aggregate] (sset_lsa& sset) {
+            merge_zset_runs(runs, aggregate, [&sset] (const bytes& member, double score) {
+                insert_member(sset, member, score);
+            });
+        });
+        return reply_builder::build(size);
+    });
+}
 
-future<scattered_message_ptr> database::zcard(redis_key rk)
+future<scattered_message_ptr> database::zstore(redis_key rk, const zset_members& members)
 {
-    ++_stat._zcard;
-    return _cache.run_with_entry(rk, [] (const cache_entry* e) {
-        if (e == nullptr) {
-            return reply_builder::build(msg_zero);
-        }
-        if (e->type_of_sset() == false) {
-            return reply_builder::build(msg_type_err);
-        }
-        auto& sset = e->value_sset();
-        return reply_builder::build(sset.size());
+    return with_allocator_for(data_type::sset, [this, &rk, &members] {
+        auto size = store_zset(rk, [&members] (sset_lsa& sset) {
+            sset.insert_or_update(members);
+        });
+        return reply_builder::build(size);
     });
 }
 
-future<scattered_message_ptr> database::zrem(redis_key rk, std::vector<bytes> members)
+future<scattered_message_ptr> database::zstore_sorted(redis_key rk, const zset_members& members)
 {
-    ++_stat._zrem;
-    return with_allocator(allocator(), [this, rk = std::move(rk), members = std::move(members)] {
-        auto e = _cache.find(rk);
-        if (e == nullptr) {
-            return reply_builder::build(msg_zero);
-        }
-        if (e->type_of_sset() == false) {
-            return reply_builder::build(msg_type_err);
-        }
-        auto& sset = e->value_sset();
-        auto removed = sset.erase(members);
-        if (sset.empty()) {
-           --_stat._total_zset_entries;
-           _cache.erase(rk);
-        }
-        return reply_builder::build(removed);
+    return with_allocator_for(data_type::sset, [this, &rk, &members] {
+        auto size = store_zset(rk, [&members] (sset_lsa& sset) {
+            sset.insert_sorted_members(members);
+        });
+        return reply_builder::build(size);
     });
 }
 
-future<scattered_message_ptr> database::zcount(redis_key rk, double min, double max)
+future<scattered_message_ptr> database::zrangestore(redis_key dest, redis_key rk, zrange_spec spec)
 {
-    ++_stat._zcount;
-    return _cache.run_with_entry(rk, [min, max] (const cache_entry* e) {
-        if (e == nullptr) {
-            return reply_builder::build(msg_zero);
-        }
-        if (e->type_of_sset() == false) {
-            return reply_builder::build(msg_type_err);
-        }
-        auto& sset = e->value_sset();
-        auto count = sset.count_by_score(min, max);
-        return reply_builder::build(count);
-    });
+    ++_stat._read;
+    auto e = _cache.find(rk);
+    if (e && e->type_of_sset() == false) {
+        return reply_builder::build(msg_type_err);
+    }
+    // the range leaves the region before the destination is built, which
+    // may move the source, or replace it.
+    zset_members members;
+    if (e) {
+        e->value_sset().fetch_range(spec, members);
+        if (!members.empty()) ++_stat._hit;
+    }
+    return zstore_sorted(std::move(dest), members);
 }
 
-future<scattered_message_ptr> database::zincrby(redis_key rk, bytes member, double delta)
+future<foreign_ptr<lw_shared_ptr<zset_members>>> database::zrange_members(redis_key rk, zrange_spec spec)
 {
-    ++_stat._zincrby;
-    return with_allocator(allocator(), [this, rk = std::move(rk), member = std::move(member), delta] {
-        auto o = _cache.find(rk);
-        if (o == nullptr) {
-            auto entry = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), cache_entry::sset_initializer());
-            _cache.insert(entry);
-            ++_stat._total_zset_entries;
-            o = entry;
-        }
-        if (o->type_of_sset() == false) {
-            return reply_builder::build(msg_type_err);
-        }
-        auto& sset = o->value_sset();
-        auto result = sset.insert_or_update(member, delta);
-        return reply_builder::build(result);
-    });
+    ++_stat._read;
+    using return_type = foreign_ptr<lw_shared_ptr<zset_members>>;
+    auto e = _cache.find(rk);
+    if (e && e->type_of_sset() == false) {
+        return make_ready_future<return_type>(return_type());
+    }
+    auto members = make_lw_shared<zset_members>();
+    if (e) {
+        e->value_sset().fetch_range(spec, *members);
+        if (!members->empty()) ++_stat._hit;
+    }
+    return make_ready_future<return_type>(make_foreign(std::move(members)));
 }
 
-future<foreign_ptr<lw_shared_ptr<std::vector<std::pair<bytes, double>>>>> database::zrange_direct(redis_key rk, long begin, long end)
+future<foreign_ptr<lw_shared_ptr<std::vector<std::pair<bytes, double>>>>> database::zrange_direct(redis_key rk, long begin, long end, bool reverse)
 {
     ++_stat._read;
-    ++_stat._zrange;
     using return_type = foreign_ptr<lw_shared_ptr<std::vector<std::pair<bytes, double>>>>;
     using result_type = std::vector<std::pair<bytes, double>>;
-    return _cache.run_with_entry(rk, [this, begin, end] (const cache_entry* e) {
+    return _cache.run_with_entry(rk, [this, begin, end, reverse] (const cache_entry* e) {
         if (e == nullptr || e->type_of_sset() == false) {
             return make_ready_future<return_type>(foreign_ptr<lw_shared_ptr<result_type>>(make_lw_shared<result_type>(result_type {})));
         }
         auto& sset = e->value_sset();
         result_type entries {};
-        sset.fetch_by_rank(begin, end, entries);
+        sset.fetch_by_rank(begin, end, entries, reverse);
         if (!entries.empty()) ++_stat._hit;
         return make_ready_future<return_type>(foreign_ptr<lw_shared_ptr<result_type>>(make_lw_shared<result_type>(std::move(entries))));
     });
 }
 
-future<scattered_message_ptr> database::zrange(redis_key rk, long begin, long end, bool reverse, bool with_score)
+future<reply_chunk> database::zrange(redis_key rk, long begin, long end, bool reverse, bool with_score, size_t next, size_t left, bool stream)
 {
-    ++_stat._read;
-    ++_stat._zrange;
-    return _cache.run_with_entry(rk, [this, begin, end, reverse, with_score] (const cache_entry* e) {
-        std::vector<const sset_entry*> entries;
-        if (e == nullptr) {
-            return reply_builder::build(entries, with_score);
-        }
-        if (e->type_of_sset() == false) {
-            return reply_builder::build(msg_type_err);
+    bool first = left == 0;
+    logalloc::reclaim_lock lock(*this);
+    return _cache.run_with_entry(rk, [this, begin, end, reverse, with_score, first, next, left, stream] (const cache_entry* e) mutable {
+        size_t per_member = with_score ? 2 : 1;
+        if (first) {
+            ++_stat._read;
+            if (e == nullptr) {
+                return whole_reply(reply_builder::build(msg_empty_multi_bulk));
+            }
+            if (e->type_of_sset() == false) {
+                return whole_reply(reply_builder::build(msg_type_err));
+            }
+            auto& sset = e->value_sset();
+            auto range = sset.range_by_rank(begin, end, reverse);
+            if (range._count > 0) ++_stat._hit;
+            left = range._count * per_member;
+            if (reply_chunk_size(stream, left) == left) {
+                return whole_reply(reply_builder::build_sset(range._count, with_score, [&sset, &range, reverse] (auto&& append) {
+                    sset.for_each_in(range, reverse, append);
+                }));
+            }
+            // the rank of the next member, walking down if reverse.
+            next = reverse ? range._first + range._count - 1 : range._first;
+        }
+        auto m = make_lw_shared<scattered_message<char>>();
+        if (first) {
+            reply_builder::append_array_header(*m, left);
+        }
+        auto members = std::max<size_t>(reply_chunk_size(stream, left) / per_member, 1);
+        size_t visited = 0;
+        if (e && e->type_of_sset()) {
+            auto& sset = e->value_sset();
+            if (next < sset.size()) {
+                visited = std::min(members, reverse ? next + 1 : sset.size() - next);
+                rank_range r { reverse ? next + 1 - visited : next, visited };
+                sset.for_each_in(r, reverse, [&m, with_score] (const sset_entry& member) {
+                    reply_builder::append(*m, member, with_score);
+                });
+            }
         }
-        auto& sset = e->value_sset();
-        sset.fetch_by_rank(begin, end, entries);
+        reply_builder::append_nulls(*m, (members - visited) * per_member);
         if (reverse) {
-           std::reverse(std::begin(entries), std::end(entries));
+            next = next >= members ? next - members : std::numeric_limits<size_t>::max();
         }
-        if (!entries.empty()) ++_stat._hit;
-        return reply_builder::build(entries, with_score);
+        else {
+            next += members;
+        }
+        return make_chunk(m, next, left - members * per_member);
     });
 }
 
 future<scattered_message_ptr> database::zrangebyscore(redis_key rk, double min, double max, bool reverse, bool with_score)
 {
     ++_stat._read;
-    ++_stat._zrangebyscore;
     return _cache.run_with_entry(rk, [this, min, max, reverse, with_score] (const cache_entry* e) {
-        std::vector<const sset_entry*> entries;
         if (e == nullptr) {
-            return reply_builder::build(entries, with_score);
+            return reply_builder::build(msg_empty_multi_bulk);
         }
         if (e->type_of_sset() == false) {
             return reply_builder::build(msg_type_err);
         }
         auto& sset = e->value_sset();
-        sset.fetch_by_score(min, max, entries);
-        if (reverse) {
-           std::reverse(std::begin(entries), std::end(entries));
-        }
-        if (!entries.empty()) ++_stat._hit;
-        return reply_builder::build(entries, with_score);
+        auto range = sset.range_by_score(min, max);
+        if (range._count > 0) ++_stat._hit;
+        return reply_builder::build_sset(range._count, with_score, [&sset, &range, reverse] (auto&& append) {
+            sset.for_each_in(range, reverse, append);
+        });
     });
 }
 
 future<scattered_message_ptr> database::zrank(redis_key rk, bytes member, bool reverse)
 {
     ++_stat._read;
-    ++_stat._zrank;
     auto e = _cache.find(rk);
     if (e == nullptr) {
         return reply_builder::build(msg_nil);
@@ -1531,7 +6074,7 @@ future<scattered_message_ptr> database::zrank(redis_key rk, bytes member, bool r
     if (rank_opt) {
        auto rank = *rank_opt;
        if (reverse) {
-           rank = sset.size() - rank;
+           rank = sset.size() - rank - 1;
        }
        ++_stat._hit;
        return reply_builder::build(rank);
@@ -1542,7 +6085,6 @@ future<scattered_message_ptr> database::zrank(redis_key rk, bytes member, bool r
 future<scattered_message_ptr> database::zscore(redis_key rk, bytes member)
 {
     ++_stat._read;
-    ++_stat._zscore;
     auto e = _cache.find(rk);
     if (e == nullptr) {
         return reply_builder::build(msg_zero);
@@ -1561,8 +6103,7 @@ future<scattered_message_ptr> database::zscore(redis_key rk, bytes member)
 
 future<scattered_message_ptr> database::zremrangebyscore(redis_key rk, double min, double max)
 {
-    ++_stat._zremrangebyscore;
-    return with_allocator(allocator(), [this, rk = std::move(rk), min, max] {
+    return with_allocator_for(data_type::sset, [this, rk = std::move(rk), min, max] {
         auto e = _cache.find(rk);
         if (e == nullptr) {
             return reply_builder::build(msg_zero);
@@ -1584,8 +6125,7 @@ future<scattered_message_ptr> database::zremrangebyscore(redis_key rk, double mi
 
 future<scattered_message_ptr> database::zremrangebyrank(redis_key rk, size_t begin, size_t end)
 {
-    ++_stat._zremrangebyrank;
-    return with_allocator(allocator(), [this, rk = std::move(rk), begin, end] {
+    return with_allocator_for(data_type::sset, [this, rk = std::move(rk), begin, end] {
         auto e = _cache.find(rk);
         if (e == nullptr) {
             return reply_builder::build(msg_zero);
@@ -1605,9 +6145,124 @@ future<scattered_message_ptr> database::zremrangebyrank(redis_key rk, size_t beg
     });
 }
 
+future<scattered_message_ptr> database::zrangebylex(redis_key rk, lex_bound min, lex_bound max, long offset, long limit, bool reverse)
+{
+    ++_stat._read;
+    return _cache.run_with_entry(rk, [this, &min, &max, offset, limit, reverse] (const cache_entry* e) {
+        if (e == nullptr) {
+            return reply_builder::build(msg_empty_multi_bulk);
+        }
+        if (e->type_of_sset() == false) {
+            return reply_builder::build(msg_type_err);
+        }
+        auto& sset = e->value_sset();
+        auto range = sset.range_by_lex(min, max).window(offset, limit, reverse);
+        if (range._count > 0) ++_stat._hit;
+        return reply_builder::build_sset(range._count, false, [&sset, &range, reverse] (auto&& append) {
+            sset.for_each_in(range, reverse, append);
+        });
+    });
+}
+
+future<scattered_message_ptr> database::zlexcount(redis_key rk, lex_bound min, lex_bound max)
+{
+    ++_stat._read;
+    return _cache.run_with_entry(rk, [&min, &max] (const cache_entry* e) {
+        if (e == nullptr) {
+            return reply_builder::build(msg_zero);
+        }
+        if (e->type_of_sset() == false) {
+            return reply_builder::build(msg_type_err);
+        }
+        auto& sset = e->value_sset();
+        return reply_builder::build(sset.count_by_lex(min, max));
+    });
+}
+
+future<scattered_message_ptr> database::zremrangebylex(redis_key rk, lex_bound min, lex_bound max)
+{
+    return with_allocator_for(data_type::sset, [this, rk = std::move(rk), &min, &max] {
+        auto e = _cache.find(rk);
+        if (e == nullptr) {
+            return reply_builder::build(msg_zero);
+        }
+        if (e->type_of_sset() == false) {
+            return reply_builder::build(msg_type_err);
+        }
+        std::vector<const sset_entry*> entries;
+        auto& sset = e->value_sset();
+        sset.fetch_by_lex(min, max, entries);
+        auto removed = sset.erase(entries);
+        if (sset.empty()) {
+            --_stat._total_zset_entries;
+            _cache.erase(rk);
+        }
+        return reply_builder::build(removed);
+    });
+}
+
+future<scattered_message_ptr> database::zscan(redis_key rk, size_t cursor, bytes pattern, size_t count)
+{
+    ++_stat._read;
+    return _cache.run_with_entry(rk, [this, cursor, &pattern, count] (const cache_entry* e) {
+        if (e == nullptr) {
+            return reply_builder::build(msg_empty_scan);
+        }
+        if (e->type_of_sset() == false) {
+            return reply_builder::build(msg_type_err);
+        }
+        std::vector<const sset_entry*> entries;
+        auto& sset = e->value_sset();
+        auto next = scan_some(sset, cursor, count, [&entries, &pattern] (const sset_entry& m) {
+            if (key_matches(pattern, m.key_data(), m.key_size())) {
+                entries.push_back(&m);
+            }
+        });
+        if (!entries.empty()) ++_stat._hit;
+        return reply_builder::build_scan(next, entries);
+    });
+}
+
 bool database::select(size_t index)
 {
-    (void) index;
+    // a single keyspace, see redis_service::select().
+    return index == 0;
+}
+
+bool database::flushall(bool async)
+{
+    if (_cache.tiered()) {
+        return false;
+    }
+    ++_stat._flushes;
+    for (auto& w : _watched_keys) {
+        ++w.second._version;
+    }
+    std::vector<bytes> tracked;
+    for (auto& t : _tracked_keys) {
+        tracked.push_back(t.first);
+    }
+    for (auto& key : tracked) {
+        invalidate_tracked(key);
+    }
+    _field_expiry.clear();
+    _stat._total_counter_entries = 0;
+    _stat._total_string_entries = 0;
+    _stat._total_dict_entries = 0;
+    _stat._total_list_entries = 0;
+    _stat._total_set_entries = 0;
+    _stat._total_zset_entries = 0;
+    _stat._total_bitmap_entries = 0;
+    _stat._total_hll_entries = 0;
+    _stat._total_stream_entries = 0;
+    with_allocator(allocator(), [this, async] {
+        if (async) {
+            _cache.flush_async();
+        }
+        else {
+            _cache.flush_sync();
+        }
+    });
     return true;
 }
 
@@ -1615,7 +6270,6 @@ bool database::select(size_t index)
 future<scattered_message_ptr> database::geodist(redis_key rk, bytes lpos, bytes rpos, int flag)
 {
     ++_stat._read;
-    ++_stat._geodist;
     double factor = 1;
     if (flag & GEODIST_UNIT_M) {
         factor = 1;
@@ -1624,10 +6278,10 @@ future<scattered_message_ptr> database::geodist(redis_key rk, bytes lpos, bytes
         factor = 1000;
     }
     else if (flag & GEODIST_UNIT_MI) {
-        factor = 0.3048;
+        factor = 1609.34;
     }
     else if (flag & GEODIST_UNIT_FT) {
-        factor = 1609.34;
+        factor = 0.3048;
     }
     auto e = _cache.find(rk);
     if (e == nullptr) {
@@ -1655,7 +6309,6 @@ future<scattered_message_ptr> database::geodist(redis_key rk, bytes lpos, bytes
 future<scattered_message_ptr> database::geohash(redis_key rk, std::vector<bytes> members)
 {
     ++_stat._read;
-    ++_stat._geohash;
     auto e = _cache.find(rk);
     if (e == nullptr) {
        return reply_builder::build(msg_err);
@@ -1682,53 +6335,59 @@ future<scattered_message_ptr> database::geohash(redis_key rk, std::vector<bytes>
 future<scattered_message_ptr> database::geopos(redis_key rk, std::vector<bytes> members)
 {
     ++_stat._read;
-    ++_stat._geopos;
+    using position = std::experimental::optional<std::pair<double, double>>;
+    std::vector<position> positions(members.size());
     auto e = _cache.find(rk);
     if (e == nullptr) {
-       return reply_builder::build(msg_err);
+       return reply_builder::build(positions);
     }
     if (e->type_of_sset() == false) {
        return reply_builder::build(msg_type_err);
     }
     auto& sset = e->value_sset();
-    std::vector<const sset_entry*> entries;
-    sset.fetch_by_key(members, entries);
-    std::vector<bytes> geohash_set;
-    for (size_t i = 0; i < entries.size(); ++i) {
-        auto entry = entries[i];
-        bytes hashstr;
-        if (geo::encode_to_geohash_string(entry->score(), hashstr) == false) {
-            return reply_builder::build(msg_err);
+    std::vector<double> scores;
+    std::vector<size_t> found;
+    scores.reserve(members.size());
+    found.reserve(members.size());
+    for (size_t i = 0; i < members.size(); ++i) {
+        auto score = sset.score(members[i]);
+        if (score) {
+            scores.push_back(*score);
+            found.push_back(i);
         }
-        geohash_set.emplace_back(std::move(hashstr));;
     }
-    if (!geohash_set.empty()) ++_stat._hit;
-    return reply_builder::build(geohash_set);
+    std::vector<double> longitudes(scores.size()), latitudes(scores.size());
+    geo::decode_batch(scores.data(), scores.size(), longitudes.data(), latitudes.data());
+    for (size_t i = 0; i < found.size(); ++i) {
+        positions[found[i]] = std::make_pair(longitudes[i], latitudes[i]);
+    }
+    if (!found.empty()) ++_stat._hit;
+    return reply_builder::build(positions);
 }
 
 using georadius_result_type = std::pair<std::vector<std::tuple<bytes, double, double, double, double>>, int>;
-future<foreign_ptr<lw_shared_ptr<georadius_result_type>>> database::georadius_coord_direct(redis_key rk, double longitude, double latitude, double radius, size_t count, int flag)
+future<foreign_ptr<lw_shared_ptr<georadius_result_type>>> database::georadius_coord_direct(redis_key rk, geo::shape shape, size_t count, int flag)
 {
     using return_type = foreign_ptr<lw_shared_ptr<georadius_result_type>>;
-    return _cache.run_with_entry(rk, [this, longitude, latitude, radius, count, flag] (const cache_entry* e) {
+    return _cache.run_with_entry(rk, [this, &shape, count, flag] (const cache_entry* e) {
         if (e == nullptr) {
-            return make_ready_future<return_type>(foreign_ptr<lw_shared_ptr<georadius_result_type>>(make_lw_shared<georadius_result_type>(georadius_result_type {{}, REDIS_ERR})));
+            return make_ready_future<return_type>(foreign_ptr<lw_shared_ptr<georadius_result_type>>(make_lw_shared<georadius_result_type>(georadius_result_type {{}, REDIS_OK})));
         }
         if (e->type_of_sset() == false) {
             return make_ready_future<return_type>(foreign_ptr<lw_shared_ptr<georadius_result_type>>(make_lw_shared<georadius_result_type>(georadius_result_type {{}, REDIS_WRONG_TYPE})));
         }
         auto& sset = e->value_sset();
-        return georadius(sset, longitude, latitude, radius, count, flag);
+        return georadius(sset, shape, count, flag);
     });
 }
 
-future<foreign_ptr<lw_shared_ptr<georadius_result_type>>> database::georadius_member_direct(redis_key rk, bytes pos, double radius, size_t count, int flag)
+future<foreign_ptr<lw_shared_ptr<georadius_result_type>>> database::georadius_member_direct(redis_key rk, bytes pos, geo::shape shape, size_t count, int flag)
 {
 
     using return_type = foreign_ptr<lw_shared_ptr<georadius_result_type>>;
     auto e = _cache.find(rk);
     if (e == nullptr) {
-        return make_ready_future<return_type>(foreign_ptr<lw_shared_ptr<georadius_result_type>>(make_lw_shared<georadius_result_type>(georadius_result_type {{}, REDIS_ERR})));
+        return make_ready_future<return_type>(foreign_ptr<lw_shared_ptr<georadius_result_type>>(make_lw_shared<georadius_result_type>(georadius_result_type {{}, REDIS_OK})));
     }
     if (e->type_of_sset() == false) {
         return make_ready_future<return_type>(foreign_ptr<lw_shared_ptr<georadius_result_type>>(make_lw_shared<georadius_result_type>(georadius_result_type {{}, REDIS_WRONG_TYPE})));
@@ -1738,80 +6397,196 @@ future<foreign_ptr<lw_shared_ptr<georadius_result_type>>> database::georadius_me
     if (!score_opt) {
         return make_ready_future<return_type>(foreign_ptr<lw_shared_ptr<georadius_result_type>>(make_lw_shared<georadius_result_type>(georadius_result_type {{}, REDIS_ERR})));
     }
-    double longitude = 0, latitude = 0;
-    if (geo::decode_from_geohash(*score_opt, longitude, latitude) == false) {
+    if (geo::decode_from_geohash(*score_opt, shape._longitude, shape._latitude) == false) {
         return make_ready_future<return_type>(foreign_ptr<lw_shared_ptr<georadius_result_type>>(make_lw_shared<georadius_result_type>(georadius_result_type {{}, REDIS_ERR})));
     }
-    return georadius(sset, longitude, latitude, radius, count, flag);
+    return georadius(sset, shape, count, flag);
+}
+
+future<scattered_message_ptr> database::geosearch_store(redis_key dest, redis_key rk, bytes pos, bool from_member, geo::shape shape, size_t count, int flag)
+{
+    auto points = from_member ? georadius_member_direct(std::move(rk), std::move(pos), shape, count, flag)
+                              : georadius_coord_direct(std::move(rk), shape, count, flag);
+    return points.then([this, dest = std::move(dest), flag] (auto&& data) {
+        if (data->second == REDIS_WRONG_TYPE) {
+            return reply_builder::build(msg_type_err);
+        }
+        else if (data->second == REDIS_ERR) {
+            return reply_builder::build(msg_geo_member_err);
+        }
+        auto members = geo_store_members(*data, flag);
+        return zstore(std::move(dest), members);
+    });
+}
+
+zset_members database::geo_store_members(georadius_result_type& result, int flag)
+{
+    zset_members members;
+    members.reserve(result.first.size());
+    bool store_dist = flag & GEORADIUS_STORE_DIST;
+    for (auto& p : result.first) {
+        auto score = std::get<1>(p);
+        if (store_dist) {
+            score = std::get<2>(p);
+            geo::from_meters(score, flag);
+        }
+        members.emplace_back(std::move(std::get<0>(p)), score);
+    }
+    return members;
 }
 
-future<foreign_ptr<lw_shared_ptr<georadius_result_type>>> database::georadius(const sset_lsa& sset, double longitude, double latitude, double radius, size_t count, int flag)
+// Walks the score ranges of the geohash cells covering the shape. With a
+// COUNT but no ANY, a heap keeps the `count` nearest (or farthest) points
+// seen so far, and only those are copied out.
+future<foreign_ptr<lw_shared_ptr<georadius_result_type>>> database::georadius(const sset_lsa& sset, const geo::shape& shape, size_t count, int flag)
 {
     ++_stat._read;
-    ++_stat._georadius;
     using return_type = foreign_ptr<lw_shared_ptr<georadius_result_type>>;
     using data_type = std::vector<std::tuple<bytes, double, double, double, double>>;
-    data_type points;
-    auto fetch_point = [&sset, count] (double min, double max, double log, double lat, double r, data_type& points) -> size_t {
-        std::vector<const sset_entry*> entries;
-        sset.fetch_by_score(min, max, entries, count);
-        size_t _count = 0;
-        for (size_t i = 0; i < entries.size(); ++i) {
-            auto e = entries[i];
-            double score = e->score(), longitude = 0, latitude = 0, dist = 0;
-            if (geo::decode_from_geohash(score, longitude, latitude) == false) {
-                continue;
-            }
-            if (geo::dist(log, lat, longitude, latitude, dist) == false) {
-                continue;
+    std::vector<std::pair<double, double>> ranges;
+    if (geo::cover(shape, ranges) == false) {
+        return make_ready_future<return_type>(foreign_ptr<lw_shared_ptr<georadius_result_type>>(make_lw_shared<georadius_result_type>(georadius_result_type {{}, REDIS_ERR})));
+    }
+    struct candidate {
+        double dist;
+        double longitude;
+        double latitude;
+        const sset_entry* e;
+    };
+    bool desc = flag & GEORADIUS_DESC;
+    bool any = flag & GEORADIUS_ANY;
+    bool bounded = count > 0 && !any;
+    auto before = [desc] (const candidate& l, const candidate& r) {
+        return desc ? l.dist > r.dist : l.dist < r.dist;
+    };
+    std::vector<candidate> found;
+    auto add = [&] (const candidate& c) {
+        if (!bounded || found.size() < count) {
+            found.push_back(c);
+            if (bounded) {
+                std::push_heap(found.begin(), found.end(), before);
             }
-            if (dist < r) {
-                _count++;
-                bytes n(e->key_data(), e->key_size());
-                points.emplace_back(std::move(std::tuple<bytes, double, double, double, double>{std::move(n), score, dist, longitude, latitude}));
+            return !(any && found.size() == count);
+        }
+        // the top of the heap is the last point of the result.
+        if (before(c, found.front())) {
+            std::pop_heap(found.begin(), found.end(), before);
+            found.back() = c;
+            std::push_heap(found.begin(), found.end(), before);
+        }
+        return true;
+    };
+    // the points are decoded and tested in batches, see geo::within_batch.
+    static constexpr size_t batch_size = 256;
+    const sset_entry* entries[batch_size];
+    double scores[batch_size], longitudes[batch_size], latitudes[batch_size], dists[batch_size];
+    uint8_t inside[batch_size];
+    size_t batched = 0;
+    auto flush = [&] {
+        auto n = batched;
+        batched = 0;
+        geo::decode_batch(scores, n, longitudes, latitudes);
+        if (geo::within_batch(shape, longitudes, latitudes, n, inside, dists) == 0) {
+            return true;
+        }
+        for (size_t i = 0; i < n; ++i) {
+            if (inside[i] && !add(candidate { dists[i], longitudes[i], latitudes[i], entries[i] })) {
+                return false;
             }
         }
-        return _count;
+        return true;
     };
-    if (geo::fetch_points_from_location(longitude, latitude, radius, std::move(fetch_point), points) == false) {
-        return make_ready_future<return_type>(foreign_ptr<lw_shared_ptr<georadius_result_type>>(make_lw_shared<georadius_result_type>(georadius_result_type {{}, REDIS_ERR})));
+    bool more = true;
+    for (auto& range : ranges) {
+        sset.for_each_in_score(range.first, range.second, [&] (const sset_entry& e) {
+            entries[batched] = &e;
+            scores[batched] = e.score();
+            more = ++batched < batch_size || flush();
+            return more;
+        });
+        if (!more) {
+            break;
+        }
+    }
+    if (more && batched > 0) {
+        flush();
     }
-    if (flag & GEORADIUS_ASC) {
-        std::sort(points.begin(), points.end(), [] (const auto& l, const auto& r) { return std::get<2>(l) > std::get<2>(r); });
+    if (bounded) {
+        std::sort_heap(found.begin(), found.end(), before);
     }
-    else if (flag & GEORADIUS_DESC) {
-        std::sort(points.begin(), points.end(), [] (const auto& l, const auto& r) { return std::get<2>(l) < std::get<2>(r); });
+    else if (flag & (GEORADIUS_ASC | GEORADIUS_DESC)) {
+        std::sort(found.begin(), found.end(), before);
+    }
+    data_type points;
+    points.reserve(found.size());
+    for (auto& c : found) {
+        points.emplace_back(bytes(c.e->key_data(), c.e->key_size()), c.e->score(), c.dist, c.longitude, c.latitude);
     }
     if (!points.empty()) ++_stat._hit;
     return make_ready_future<return_type>(foreign_ptr<lw_shared_ptr<georadius_result_type>>(make_lw_shared<georadius_result_type>(georadius_result_type {std::move(points), REDIS_OK})));
 }
 
+namespace {
+// Prepares a string value for a bitmap command writing up to `size` bytes:
+// a value growing past a page is moved into a bitmap_lsa, once, so that it
+// grows without being copied and its pages of zeroes take no memory; the
+// others into a managed_bytes. Runs func(managed_bytes&) or
+// func(bitmap_lsa&) on the value.
+template <typename Func>
+auto with_bitmap(cache_entry& e, size_t size, Func&& func)
+{
+    if (!e.paged_value() && size > e.value_bytes_size() && size > bitmap_lsa::page_size) {
+        e.page_value();
+    }
+    if (e.paged_value()) {
+        return func(e.value_bitmap());
+    }
+    e.unshare_value();
+    return func(e.value_bytes());
+}
+
+// Runs func(const managed_bytes&) or func(const bitmap_lsa&) on a string
+// value for the bitmap commands which only read it. A value held out of the
+// region, inline or compressed is read through a copy, outside of the region
+// too.
+template <typename Func>
+auto with_string(const cache_entry& e, Func&& func)
+{
+    if (e.paged_value()) {
+        return func(e.value_bitmap());
+    }
+    if (!e.shared_value() && !e.inline_value() && !e.compressed_value()) {
+        return func(e.value_bytes());
+    }
+    if (e.compressed_value()) {
+        auto data = e.decompress_value();
+        managed_bytes copy(bytes_view { data.get(), data.size() });
+        return func(static_cast<const managed_bytes&>(copy));
+    }
+    managed_bytes copy(bytes_view { e.value_bytes_data(), e.value_bytes_size() });
+    return func(static_cast<const managed_bytes&>(copy));
+}
+}
+
 future<scattered_message_ptr> database::setbit(redis_key rk, size_t offset, bool value)
 {
-    ++_stat._setbit;
-    return with_allocator(allocator(), [this, rk = std::move(rk), offset, value] {
+    return with_allocator_for(data_type::bytes, [this, rk = std::move(rk), offset, value] {
+        auto size = (offset >> 3) + 1;
         auto o = _cache.find(rk);
-        size_t offset_in_bytes = offset >> 3;
         if (o == nullptr) {
-           size_t offset_in_bytes = offset >> 3;
-           size_t origin_size = offset_in_bytes + offset_in_bytes / 4;
-           if (origin_size < 15) {
-               origin_size = 15;
-           }
-           auto entry = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), origin_size);
+           auto entry = size > bitmap_lsa::page_size
+               ? current_allocator().construct<cache_entry>(rk.key(), rk.hash(), cache_entry::bitmap_initializer { size })
+               : current_allocator().construct<cache_entry>(rk.key(), rk.hash(), size);
            _cache.insert(entry);
-            --_stat._total_bitmap_entries;
+           ++_stat._total_string_entries;
            o = entry;
         }
         if (o->type_of_bytes() == false) {
             return reply_builder::build(msg_type_err);
         }
-        auto& mbytes = o->value_bytes();
-        if (mbytes.size() < offset_in_bytes) {
-            //auto extend_size = offset_in_bytes + offset_in_bytes / 4;
-            //mbytes.extend(extend_size, 0);
-        }
-        auto result = bits_operation::set(mbytes, offset, value);
+        auto result = with_bitmap(*o, size, [offset, value] (auto& bitmap) {
+            return bits_operation::set(bitmap, offset, value);
+        });
         return reply_builder::build(result ? msg_one : msg_zero);
     });
 }
@@ -1819,7 +6594,6 @@ future<scattered_message_ptr> database::setbit(redis_key rk, size_t offset, bool
 future<scattered_message_ptr> database::getbit(redis_key rk, size_t offset)
 {
     ++_stat._read;
-    ++_stat._getbit;
     return _cache.run_with_entry(rk, [this, offset] (const cache_entry* e) {
         if (e == nullptr) {
             return reply_builder::build(msg_zero);
@@ -1827,8 +6601,9 @@ future<scattered_message_ptr> database::getbit(redis_key rk, size_t offset)
         if (e->type_of_bytes() == false) {
             return reply_builder::build(msg_type_err);
         }
-        auto& mbytes = e->value_bytes();
-        auto result = bits_operation::get(mbytes, offset);
+        auto result = with_string(*e, [offset] (const auto& mbytes) {
+            return bits_operation::get(mbytes, offset);
+        });
         ++_stat._hit;
         return reply_builder::build(result ? msg_one : msg_zero);
     });
@@ -1837,7 +6612,6 @@ future<scattered_message_ptr> database::getbit(redis_key rk, size_t offset)
 future<scattered_message_ptr> database::bitcount(redis_key rk, long start, long end)
 {
     ++_stat._read;
-    ++_stat._bitcount;
     return _cache.run_with_entry(rk, [this, start, end] (const cache_entry* e) {
         if (e == nullptr) {
             return reply_builder::build(msg_zero);
@@ -1845,34 +6619,110 @@ future<scattered_message_ptr> database::bitcount(redis_key rk, long start, long
         if (e->type_of_bytes() == false) {
             return reply_builder::build(msg_type_err);
         }
-        auto& mbytes = e->value_bytes();
-        auto result = bits_operation::count(mbytes, start, end);
+        auto result = with_string(*e, [start, end] (const auto& mbytes) {
+            return bits_operation::count(mbytes, start, end);
+        });
         ++_stat._hit;
         return reply_builder::build(result);
     });
 }
 
-future<scattered_message_ptr> database::bitpos(redis_key rk, bool bit, long start, long end)
+future<scattered_message_ptr> database::bitpos(redis_key rk, bool bit, long start, long end, bool end_given)
 {
-    return reply_builder::build(msg_nil);
+    ++_stat._read;
+    return _cache.run_with_entry(rk, [this, bit, start, end, end_given] (const cache_entry* e) {
+        if (e == nullptr) {
+            return reply_builder::build(bit ? msg_neg_one : msg_zero);
+        }
+        if (e->type_of_bytes() == false) {
+            return reply_builder::build(msg_type_err);
+        }
+        ++_stat._hit;
+        auto result = with_string(*e, [bit, start, end, end_given] (const auto& mbytes) {
+            return bits_operation::position(mbytes, bit, start, end, end_given);
+        });
+        if (result < 0) {
+            return reply_builder::build(msg_neg_one);
+        }
+        return reply_builder::build(static_cast<size_t>(result));
+    });
+}
+
+future<scattered_message_ptr> database::bitop(redis_key rk, sparse_bitmap result)
+{
+    return with_allocator_for(data_type::bytes, [this, rk = std::move(rk), result = std::move(result)] {
+        auto size = result._size;
+        if (size == 0) {
+            erase_entry(rk);
+            return reply_builder::build(size);
+        }
+        auto entry = size > bitmap_lsa::page_size
+            ? current_allocator().construct<cache_entry>(rk.key(), rk.hash(), result)
+            : current_allocator().construct<cache_entry>(rk.key(), rk.hash(), result.to_bytes());
+        _cache.replace(entry);
+        ++_stat._total_string_entries;
+        return reply_builder::build(size);
+    });
+}
+
+future<scattered_message_ptr> database::bitfield(redis_key rk, std::vector<bitfield_op> ops)
+{
+    return with_allocator_for(data_type::bytes, [this, rk = std::move(rk), ops = std::move(ops)] {
+        auto writes = std::any_of(ops.begin(), ops.end(), [] (const auto& op) { return op._kind != bitfield_op::kind::get; });
+        auto o = _cache.find(rk);
+        if (o == nullptr && writes) {
+            auto entry = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), size_t(0));
+            _cache.insert(entry);
+            ++_stat._total_string_entries;
+            o = entry;
+        }
+        if (o != nullptr && o->type_of_bytes() == false) {
+            return reply_builder::build(msg_type_err);
+        }
+        std::vector<stdx::optional<int64_t>> results;
+        results.reserve(ops.size());
+        auto run = [&ops, &results] (auto& mbytes) {
+            for (auto& op : ops) {
+                int64_t result = 0;
+                if (bits_operation::run(mbytes, op, result)) {
+                    results.emplace_back(result);
+                }
+                else {
+                    results.emplace_back();
+                }
+            }
+        };
+        if (o == nullptr) {
+            managed_bytes empty;
+            run(empty);
+            return reply_builder::build(results);
+        }
+        size_t size = 0;
+        for (auto& op : ops) {
+            if (op._kind != bitfield_op::kind::get) {
+                size = std::max(size, (op._offset + op._bits + 7) >> 3);
+            }
+        }
+        with_bitmap(*o, size, run);
+        return reply_builder::build(results);
+    });
 }
 
-future<scattered_message_ptr> database::pfadd(redis_key rk, std::vector<bytes> elements)
+future<scattered_message_ptr> database::pfadd(redis_key rk, std::vector<hll_update> updates)
 {
-    ++_stat._pfadd;
-    return with_allocator(allocator(), [this, rk = std::move(rk), elements = std::move(elements)] {
+    return with_allocator_for(data_type::hll, [this, rk = std::move(rk), updates = std::move(updates)] {
         auto e = _cache.find(rk);
         if (e == nullptr) {
-            auto entry = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), cache_entry::hll_initializer());
+            auto entry = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), cache_entry::hll_initializer{_options._hll_sparse_max_bytes > 0});
             _cache.insert(entry);
-            --_stat._total_hll_entries;
+            ++_stat._total_hll_entries;
             e = entry;
         }
         if (e->type_of_hll() == false) {
            return reply_builder::build(msg_type_err);
         }
         managed_bytes& mbytes = e->value_bytes();
-        auto result = hll::append(mbytes, elements);
+        auto result = hll::append(mbytes, updates, _options._hll_sparse_max_bytes);
         return reply_builder::build(result);
     });
 }
@@ -1880,7 +6730,6 @@ future<scattered_message_ptr> database::pfadd(redis_key rk, std::vector<bytes> e
 future<scattered_message_ptr> database::pfcount(redis_key rk)
 {
     ++_stat._read;
-    ++_stat._pfcount;
     return _cache.run_with_entry(rk, [this] (cache_entry* e) {
         if (e == nullptr) {
             return reply_builder::build(msg_zero);
@@ -1897,13 +6746,12 @@ future<scattered_message_ptr> database::pfcount(redis_key rk)
 
 future<scattered_message_ptr> database::pfmerge(redis_key rk, uint8_t* merged_sources, size_t size)
 {
-    ++_stat._pfmerge;
-    return with_allocator(allocator(), [this, rk = std::move(rk), merged_sources, size] {
+    return with_allocator_for(data_type::hll, [this, rk = std::move(rk), merged_sources, size] {
         auto e = _cache.find(rk);
         if (e == nullptr) {
-            auto entry = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), cache_entry::hll_initializer());
+            auto entry = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), cache_entry::hll_initializer{false});
             _cache.insert(entry);
-            --_stat._total_hll_entries;
+            ++_stat._total_hll_entries;
             e = entry;
         }
         if (e->type_of_hll() == false) {
@@ -1918,6 +6766,22 @@ future<scattered_message_ptr> database::pfmerge(redis_key rk, uint8_t* merged_so
 
 future<> database::stop()
 {
-    return make_ready_future<>();
+    // a snapshot being written is finished first, then the warm restart
+    // image and the heat map are written while the commands stop.
+    return _warmup_gate.close().then([this] {
+        return _snapshot_gate.close();
+    }).then([this] {
+        return save_warm_image();
+    }).then([this] {
+        return save_heat_map();
+    }).then([this] {
+        // the process exits without the destructors, the keys are only in
+        // the commit log and the store.
+        return _options._fast_shutdown ? _commit_log->close() : make_ready_future<>();
+    }).then([this] {
+        return _data_cf->stop();
+    }).then([this] {
+        return dirty_memory_manager::shutdown();
+    });
 }
 }
@@ -26,16 +26,26 @@
 #include "core/temporary_buffer.hh"
 #include "core/metrics_registration.hh"
 #include "core/semaphore.hh"
+#include "core/gate.hh"
+#include "core/shared_future.hh"
+#include <functional>
 #include <sstream>
 #include <iostream>
 #include "structures/geo.hh"
 #include "structures/bits_operation.hh"
+#include "structures/sset_merge.hh"
+#include "structures/field_expiry.hh"
 #include <tuple>
+#include <map>
+#include <array>
+#include <atomic>
+#include <deque>
 #include "cache.hh"
 #include "keys.hh"
 #include "reply_builder.hh"
 #include  <experimental/vector>
 #include "commit_log.hh"
+#include "dirty_memory_manager.hh"
 namespace stdx = std::experimental;
 namespace redis {
 
@@ -45,22 +55,339 @@ enum {
     FLAG_SET_PX = 1 << 2,
     FLAG_SET_NX = 1 << 3,
     FLAG_SET_XX = 1 << 4,
+    FLAG_SET_KEEPTTL = 1 << 6,
+    FLAG_SET_GET = 1 << 7,
 };
 
 using scattered_message_ptr = foreign_ptr<lw_shared_ptr<scattered_message<char>>>;
 class sset_lsa;
-class database final : private logalloc::region {
+
+struct database_options {
+    // Memory budget of all shards in bytes, 0 means unbounded.
+    size_t _max_memory = 0;
+    eviction_policy _eviction_policy = eviction_policy::noeviction;
+    // Hashes and sets with at most this many fields, none longer than
+    // _max_packed_value bytes, are stored as a packed_dict. 0 disables it.
+    size_t _max_packed_entries = 128;
+    size_t _max_packed_value = 64;
+    // Sets of at most this many members which all read as integers are
+    // packed as an intset, see packed_dict. 0 disables it.
+    size_t _max_intset_entries = 512;
+    // HyperLogLogs stay sparse up to this many bytes. 0 creates them dense.
+    size_t _hll_sparse_max_bytes = HLL_SPARSE_MAX_BYTES;
+    // String values of at least this many bytes are kept out of the region,
+    // so that GET replies reference them instead of copying them. 0 keeps
+    // every value in the region.
+    size_t _shared_value_min_bytes = 64 * 1024;
+    // String values of at least this many bytes, short of being shared, are
+    // held LZ4 compressed when it saves an eighth of them, and decompressed
+    // as they are read. 0 disables it.
+    size_t _compressed_value_min_bytes = 0;
+    // Replies of collections with more elements are streamed in chunks of
+    // this many. 0 builds every reply whole.
+    size_t _reply_chunk_elements = 4096;
+    // Capacity set up before the data is loaded: the hash table of each
+    // shard is sized for this many keys, and this many bytes of LSA
+    // segments are faulted in. 0 grows them as the keys come.
+    size_t _expected_keys = 0;
+    size_t _memory_reserve = 0;
+    // When writes reach the disk, see commit_log_sync_mode.
+    store::commit_log_sync_mode _commit_log_sync_mode = store::commit_log_sync_mode::everysec;
+    // Size of the commit log segments, and how many flushed ones are kept
+    // for reuse.
+    size_t _commit_log_segment_size = 32 * 1024 * 1024;
+    size_t _commit_log_recycled_segments = 4;
+    // Bytes of commit log segments read ahead by the replay at startup and
+    // for the replicas tailing the log.
+    size_t _commit_log_read_ahead = 8 * 1024 * 1024;
+    // A SET or SETEX whose TTL is shorter than this many milliseconds is
+    // neither logged nor flushed to the store: the key is lost by a
+    // restart, is not sent to the replicas, and in tiered storage may go
+    // with an eviction, as if it expired early; changes made to it by
+    // other commands until it is SET again do not bring it back. Only a
+    // deletion is logged when it replaces a version which was on disk.
+    // 0 disables it.
+    long _volatile_ttl_ms = 0;
+    // The memtable is written to a new sstable once it uses this many bytes.
+    size_t _memtable_flush_size = 64 * 1024 * 1024;
+    // Bytes of sstable blocks cached in memory by all shards, the index and
+    // filter blocks of open sstables included.
+    size_t _block_cache_size = 256 * 1024 * 1024;
+    // Codecs of the sstable blocks of L0 and L1, and of the deeper levels.
+    store::compression_type _sstable_compression = store::compression_type::lz4;
+    store::compression_type _sstable_cold_compression = store::compression_type::deflate;
+    // Data blocks of new sstables get a hash index for point lookups.
+    bool _sstable_hash_index = true;
+    // The sstables are written in buffers of this size, up to
+    // _sstable_write_behind of them in flight.
+    size_t _sstable_write_buffer_size = 1024 * 1024;
+    unsigned _sstable_write_behind = 4;
+    // Bytes per second all shards may write by compactions, 0 for no limit.
+    size_t _compaction_throughput = 0;
+    // Adjusts the limit to the backlog of the compactions and to the time
+    // the lookups take, see store::column_family_options.
+    bool _adaptive_compaction = false;
+    uint32_t _read_latency_target_us = 2000;
+    // A large compaction is split into up to this many key ranges, merged
+    // at once.
+    unsigned _max_subcompactions = 4;
+    // Memory of all shards the cache and the memtables may use. Past the
+    // soft limit a shard flushes its memtable, shrinks its block cache and
+    // evicts by the maxmemory policy; past the hard limit writes wait for it
+    // to free memory, up to _write_throttle_timeout, then fail with OOM.
+    // 0 for half, and three quarters, of the memory of the shards.
+    size_t _memory_soft_limit = 0;
+    size_t _memory_hard_limit = 0;
+    std::chrono::milliseconds _write_throttle_timeout { 1000 };
+    // The number of shards which wrote the data files, see
+    // load_data_shards(). When it is not smp::count, the shards move the
+    // keys they no longer own to their owners at startup.
+    unsigned _data_shards = 0;
+    // Each shard walks its cache in the background, _key_sampling_batch
+    // entries every 100ms, for the _sampled_keys most accessed and largest
+    // keys of HOTKEYS and BIGKEYS. It keeps the access frequency of the
+    // entries up to date under every eviction policy.
+    bool _key_sampling = false;
+    size_t _key_sampling_batch = 1000;
+    size_t _sampled_keys = 16;
+    // Tiered storage: the entries the maxmemory policy evicts are written to
+    // the store, and read back by the commands of their keys, see
+    // database::fault_in(). The shards keep a hint of the keys they evicted,
+    // of _tiered_hint_bytes for all of them.
+    bool _tiered_storage = false;
+    size_t _tiered_hint_bytes = 256 * 1024 * 1024;
+    // Each shard keeps its keys in order as well, so that a SCAN whose
+    // pattern starts with literal bytes only visits the keys starting with
+    // them, see cache::scan_prefix().
+    bool _key_index = false;
+    // Each shard leaves its keys in this directory as it stops, as a
+    // snapshot, which the next process loads in place of the snapshot of
+    // the shard: on a tmpfs such as /dev/shm, or a DAX mount, a planned
+    // restart reloads them from memory. Empty disables it.
+    sstring _warm_restart_dir;
+    // Tiered storage: each shard leaves its _warmup_keys most accessed keys
+    // in its heat map as it stops, and the next process reads them back
+    // from the store in the background, _warmup_rate keys per second, before
+    // and while it serves commands. 0 disables it.
+    size_t _warmup_keys = 0;
+    size_t _warmup_rate = 10000;
+    // stop() syncs the commit log, and the process exits without
+    // destroying the entries, see main().
+    bool _fast_shutdown = false;
+};
+
+// The number of shards the data files were last resharded for, 0 when
+// unknown or written before keys went to the shard of their hash tag, and
+// saving it once every shard is initialized.
+future<unsigned> load_data_shards();
+future<> save_data_shards(unsigned shards);
+
+// Reads an RDB file of Redis on this shard and sends its keys to the shards
+// owning them, replacing keys of the same names. Resolves to the number of
+// keys read.
+future<uint64_t> import_rdb(sstring name);
+
+// One chunk of a streamed reply of LRANGE, HGETALL, SMEMBERS or ZRANGE. The
+// first call, with `left` 0, replies with the header of the whole array;
+// `_left` elements are still to come from the position `_next`, until it is
+// 0. Each chunk looks the key up again, so no pointer into the collection is
+// held between chunks: writes to the key in between may or may not show in
+// the later chunks, as with SCAN, and elements that vanished are sent as nulls.
+struct reply_chunk {
+    scattered_message_ptr _message;
+    size_t _next = 0;
+    size_t _left = 0;
+};
+
+// A key found by the key sampler: its access frequency, the logarithmic
+// LFU counter of its entry, and its size, see cache_entry::memory_usage().
+struct sampled_key {
+    bytes _key;
+    data_type _type = data_type::bytes;
+    uint8_t _frequency = 0;
+    size_t _elements = 0;
+    size_t _bytes = 0;
+    unsigned _shard = 0;
+};
+
+// The keys of a shard found by the last complete walk of its cache, most
+// accessed or largest first.
+struct key_samples {
+    std::vector<sampled_key> _hot;
+    std::vector<sampled_key> _largest_bytes;
+    std::vector<sampled_key> _largest_elements;
+    uint64_t _rounds = 0;
+};
+
+// The snapshots of a shard, as INFO persistence and LASTSAVE report them.
+struct snapshot_stats {
+    bool _in_progress = false;
+    uint64_t _saves = 0;
+    uint64_t _failures = 0;
+    // Entries saved before a write changed them, rather than by the walk.
+    uint64_t _saved_before_write = 0;
+    // The last save: whether it succeeded, when it ended in seconds since
+    // the epoch, and what it wrote.
+    bool _last_save_ok = true;
+    uint64_t _last_save = 0;
+    uint64_t _last_keys = 0;
+    uint64_t _last_bytes = 0;
+    uint64_t _last_duration_ms = 0;
+};
+
+// What DEBUG POPULATE creates: the keys <prefix>:0 to <prefix>:<count - 1>
+// which do not exist yet, of `_type`.
+struct populate_options {
+    uint64_t _count = 0;
+    sstring _prefix = "key";
+    // The bytes of a string, or of each element of a collection, padded
+    // from "value:<n>" with 'x'. 0 leaves "value:<n>" as it is.
+    size_t _size = 0;
+    data_type _type = data_type::bytes;
+    // Elements of each list, set, hash or sorted set.
+    size_t _elements = 10;
+    // Keys live a uniform number of seconds in [_ttl_min, _ttl_max], or
+    // for good when both are 0.
+    uint64_t _ttl_min = 0;
+    uint64_t _ttl_max = 0;
+};
+
+class snapshot_writer;
+struct snapshot_record;
+enum class snapshot_type : uint8_t;
+
+// What INFO replication shows of a shard: the log replicas tail, the
+// replicas tailing it, and the logs of the primaries this shard tails.
+struct replication_info {
+    sstring _replication_id;
+    uint64_t _offset = 0;
+    struct peer {
+        sstring _address;
+        unsigned _shard = 0;
+        uint64_t _offset = 0;
+        // Seconds since the last pull
+        uint64_t _lag = 0;
+    };
+    std::vector<peer> _replicas;
+    std::vector<peer> _primaries;
+};
+
+// The memory of a shard as MEMORY STATS reports it, summed over the shards
+// by the coordinator.
+struct memory_stats {
+    uint64_t _allocated = 0;
+    uint64_t _keys = 0;
+    uint64_t _region_used = 0;
+    uint64_t _region_free = 0;
+    uint64_t _shared_values = 0;
+    uint64_t _memtables = 0;
+    uint64_t _block_cache = 0;
+    // Region memory of the entries by type, indexed by data_type.
+    std::array<uint64_t, static_cast<size_t>(data_type::topk) + 1> _by_type {};
+
+    memory_stats& operator += (const memory_stats& o);
+};
+
+// The keyspace of a shard as INFO reports it, summed over the shards by the
+// coordinator.
+struct keyspace_info {
+    uint64_t _keys = 0;
+    uint64_t _expires = 0;
+    uint64_t _reads = 0;
+    uint64_t _hits = 0;
+    uint64_t _expired = 0;
+    uint64_t _evicted = 0;
+    uint64_t _max_memory = 0;
+    memory_stats _memory;
+
+    keyspace_info& operator += (const keyspace_info& o);
+};
+
+// XREADGROUP reading as a consumer of a group.
+struct stream_group_read {
+    bytes _group;
+    bytes _consumer;
+    // The entries read are acknowledged at once rather than pending.
+    bool _noack = false;
+};
+
+// The entries XREAD or XREADGROUP read of a stream.
+struct stream_read_result {
+    enum class status { ok, wrong_type, no_group };
+    status _status = status::ok;
+    // What `$` stands for.
+    stream_id _last_id;
+    size_t _entries = 0;
+    // `*2 $<key> *<entries> <entries>`, unless there are none.
+    bytes _reply;
+};
+
+// What an XREAD or XREADGROUP blocked on streams waits for: an entry after
+// the ID given for one of its keys, or a new entry for the group.
+struct stream_read {
+    std::unordered_map<bytes, stream_id> _after;
+    size_t _count = 0;
+    bool _grouped = false;
+    stream_group_read _group;
+};
+
+// A BLPOP, BRPOP, BLMOVE, BZPOPMIN or BZPOPMAX waiting for an element, blocked on the shards
+// owning its keys. It lives on the shard of its connection, `_cpu`, which
+// keeps it until every shard forgot it. It is done once: by the first
+// shard claiming it, which pops an element for it, or by its timeout.
+//
+// An XREAD or XREADGROUP with BLOCK waits the same way, with `_read` set,
+// the first shard with entries for it reading them into `_value`.
+struct blocked_pop {
+    enum class outcome { waiting, popped, timed_out, wrong_type };
+    std::atomic<bool> _claimed { false };
+    unsigned _cpu;
+    bool _left;
+    // A BZPOPMIN, `_left`, or BZPOPMAX: it waits for a sorted set, and
+    // `_value` is the member and its score, encoded as two bulks.
+    bool _sset = false;
+    // Read only by the other shards.
+    const stream_read* _read = nullptr;
+    outcome _outcome = outcome::waiting;
+    // The key the element was popped from.
+    bytes _key;
+    bytes _value;
+    promise<> _done;
+    // Armed on _cpu, unless it waits for ever.
+    timer<> _timeout;
+
+    blocked_pop(unsigned cpu, bool left) : _cpu(cpu), _left(left) {}
+    bool claim()
+    {
+        return !_claimed.exchange(true);
+    }
+    bool claimed() const
+    {
+        return _claimed.load();
+    }
+    // Once claimed: sets the outcome on _cpu, resolving _done.
+    void finish(outcome o, bytes key = {}, bytes value = {});
+};
+
+class database final : private dirty_memory_manager, private logalloc::region {
 public:
-    database();
+    database(database_options options = database_options());
     ~database();
 
     future<> initialize();
 
-    future<scattered_message_ptr> set(redis_key rk, bytes val, long expire, uint32_t flag);
+    // The value may be a view into the request buffers, which are pinned
+    // until the reply is built. SET, INCR and the GET of another shard
+    // return a reply_value, built by the shard of the connection.
+    future<reply_value> set(redis_key rk, bytes_view val, long expire, uint32_t flag);
     bool set_direct(redis_key rk, bytes val, long expire, uint32_t flag);
+    // SET and APPEND of a large value which arrived in several reads, viewed
+    // in the buffers the request pins, see request_wrapper::arg_fragments().
+    future<reply_value> set_fragments(redis_key rk, std::vector<bytes_view> fragments, long expire, uint32_t flag);
 
-    future<scattered_message_ptr> counter_by(redis_key rk, int64_t step, bool incr);
+    future<reply_value> counter_by(redis_key rk, int64_t step, bool incr);
     future<scattered_message_ptr> append(redis_key rk, bytes val);
+    future<scattered_message_ptr> append_fragments(redis_key rk, std::vector<bytes_view> fragments);
 
     future<scattered_message_ptr> del(redis_key key);
     future<bool> del_direct(redis_key key);
@@ -69,8 +396,73 @@ public:
     bool exists_direct(redis_key key);
 
     future<scattered_message_ptr> get(redis_key key);
-    future<foreign_ptr<lw_shared_ptr<bytes>>> get_direct(redis_key rk);
+    future<reply_value> get_value(redis_key key);
+    // GETDEL and GETEX: the value is read and the key removed, or its
+    // expiry changed, in the same step. A negative `expire` keeps the
+    // expiry, 0 expires the key at once, unless `persist`.
+    future<reply_value> getdel(redis_key rk);
+    future<reply_value> getex(redis_key rk, long expire, bool persist);
+    // A string value for BITOP to combine, in pages as bitmap_lsa keeps them.
+    future<foreign_ptr<lw_shared_ptr<sparse_bitmap>>> get_bitmap(redis_key rk);
+    // GET for a shard caching the value of a hot key: true with the reply
+    // when it may be cached until the copy invalidator is called with the
+    // key, see cache::find_for_copy().
+    future<std::pair<scattered_message_ptr, bool>> get_for_copy(redis_key rk);
+    using copy_invalidator_type = std::function<void (bytes key)>;
+    void set_copy_invalidator(copy_invalidator_type invalidator) { _copy_invalidator = std::move(invalidator); }
+    // Called with true once this shard is past its hard memory limit, and
+    // with false once it is back under it.
+    using write_throttle_listener_type = std::function<void(bool)>;
+    void set_write_throttle_listener(write_throttle_listener_type listener) { _write_throttle_listener = std::move(listener); }
+    // Resolves once the shard is under its hard memory limit, or fails with
+    // timed_out_error after _write_throttle_timeout.
+    future<> wait_for_memory();
+
+    // Tiered storage: reads back the keys of a command which may have been
+    // evicted to the store, before it runs.
+    future<> fault_in(std::vector<bytes> keys);
+    bool tiered() const { return _cache.tiered(); }
+
+    // WATCH: each watched key of this shard has a version, bumped by every
+    // change of the key, which EXEC compares with the one WATCH returned.
+    uint64_t watch(redis_key rk);
+    // Once for every watch() of the keys.
+    void unwatch(std::vector<bytes> keys);
+    bool watched_unchanged(std::vector<std::pair<bytes, uint64_t>> versions) const;
+    // CLIENT TRACKING: the clients which read each key of this shard, told
+    // of its next change and forgotten, see client_tracking. A missing key
+    // is tracked as well, until it is created.
+    void track(std::vector<bytes> keys, uint64_t client);
+    // BCAST: the client is told of every change of the keys starting with
+    // one of the prefixes, all keys if there is none, until it stops.
+    void track_prefixes(std::vector<bytes> prefixes, uint64_t client, bool on);
+    size_t tracked_key_count() const { return _tracked_keys.size(); }
+    // Held by a transaction while it runs on this shard, see
+    // redis_service::exec(). Transactions take the shards they touch in
+    // shard order, so that any two of them run in the same order on all.
+    future<> begin_transaction() { return _transaction_order.wait(); }
+    void end_transaction() { _transaction_order.signal(); }
+    // A transaction across shards holds the commands of the shards of its
+    // watched keys from the check of their versions to the task running its
+    // batch there, which checks them again as it releases them. The commands
+    // dispatched meanwhile wait on transaction_writes().
+    bool hold_transaction_writes(std::vector<std::pair<bytes, uint64_t>> versions);
+    bool release_transaction_writes(std::vector<std::pair<bytes, uint64_t>> versions);
+    bool transaction_writes_held() const { return bool(_held_writes); }
+    future<> transaction_writes() {
+        return _held_writes ? _held_writes->get_shared_future() : make_ready_future<>();
+    }
+
+    // Batched variants for multi-key commands, invoked once per shard.
+    using batch_values_type = std::vector<stdx::optional<bytes>>;
+    future<foreign_ptr<lw_shared_ptr<batch_values_type>>> get_direct_batch(std::vector<redis_key> rks);
+    size_t set_direct_batch(std::vector<std::pair<redis_key, bytes>> kvs);
+    future<size_t> del_direct_batch(std::vector<redis_key> rks);
     future<scattered_message_ptr> strlen(redis_key key);
+    future<scattered_message_ptr> setrange(redis_key rk, size_t offset, bytes val);
+    // The bytes [start, end] of a string, negative offsets count from the
+    // end, read a fragment at a time.
+    future<scattered_message_ptr> getrange(redis_key rk, long start, long end);
 
     future<scattered_message_ptr> expire(redis_key rk, long expired);
     future<scattered_message_ptr> persist(redis_key rk);
@@ -78,22 +470,203 @@ public:
     future<scattered_message_ptr> pttl(redis_key rk);
     future<scattered_message_ptr> ttl(redis_key rk);
     bool select(size_t index);
+    // FLUSHALL: removes every key of this shard, releasing their memory in
+    // the background when `async`. false with tiered storage, whose store
+    // holds keys the shard does not know.
+    bool flushall(bool async);
+    // RENAME and RENAMENX within the shard: the entry is linked again under
+    // `dst`, its value left where it is.
+    future<scattered_message_ptr> rename(redis_key src, redis_key dst, bool nx);
+    // COPY within the shard.
+    future<scattered_message_ptr> copy(redis_key src, redis_key dst, bool replace);
+    // RENAME and COPY across shards: the owner of the source encodes the key
+    // under the name of the destination as a snapshot record, see
+    // snapshot.hh, and removes it when `remove`; null if there is no key.
+    // The owner of the destination then inserts the record whole, false if
+    // the key is there and not `replace`.
+    future<foreign_ptr<lw_shared_ptr<bytes>>> dump_entry(redis_key rk, bytes dst, bool remove);
+    future<bool> restore_entry(redis_key rk, foreign_ptr<lw_shared_ptr<bytes>> record, bool replace);
+    // DUMP and RESTORE, the payload being a record as dump_entry() encodes
+    // it, see make_dump_payload(). The key expires at `expire_at_ms` since
+    // the epoch, never when 0.
+    future<scattered_message_ptr> dump(redis_key rk);
+    future<scattered_message_ptr> restore(redis_key rk, bytes payload, uint64_t expire_at_ms, bool replace);
+    // One step of SCAN over the keys of this shard: the next cursor of the
+    // shard, and the matching keys.
+    using scan_result_type = std::pair<size_t, std::vector<bytes>>;
+    future<foreign_ptr<lw_shared_ptr<scan_result_type>>> scan_direct(size_t cursor, bytes pattern, size_t count);
+    // One step of streaming the keys of this shard to another node: the next
+    // cursor, and the commands rebuilding the entries the filter accepts,
+    // those of one key next to each other.
+    using dump_result_type = std::pair<size_t, std::vector<std::vector<bytes>>>;
+    future<foreign_ptr<lw_shared_ptr<dump_result_type>>> dump_direct(size_t cursor, size_t count, std::function<bool (bytes_view key)> filter);
+    // One step of listing the keys of this shard the filter accepts.
+    future<foreign_ptr<lw_shared_ptr<scan_result_type>>> keys_direct(size_t cursor, size_t count, std::function<bool (bytes_view key)> filter);
+    // The digests of the hash slots, the leaves of the Merkle trees of
+    // anti-entropy repair. Writes show in them once flushed.
+    foreign_ptr<lw_shared_ptr<std::vector<uint64_t>>> slot_digests() const;
+
+    // Replication by tailing the commit log. The offsets of a shard are
+    // those of its log, valid for its replication id, which changes with
+    // each run.
+    const sstring& replication_id() const { return _replication_id; }
+    uint64_t replication_offset() const { return _commit_log->replication_offset(); }
+    future<store::log_records> read_replication_log(sstring replica, uint64_t offset, size_t max_bytes);
+    // Applies records tailed from a primary, framed as in its log, to the
+    // cache and to the log of this shard. Returns how many were applied.
+    future<size_t> apply_replicated(bytes frames);
+    // Where this shard is in the log of a primary shard.
+    void set_primary_offset(sstring primary, unsigned shard, uint64_t offset);
+    foreign_ptr<lw_shared_ptr<replication_info>> get_replication_info() const;
+
+    // [MEMORY]
+    // The bytes held by the key, see cache_entry::memory_usage().
+    future<scattered_message_ptr> memory_usage(redis_key rk, size_t samples);
+    memory_stats get_memory_stats() const;
+
+    // [INFO]
+    keyspace_info get_keyspace_info() const;
+    eviction_policy get_eviction_policy() const { return _options._eviction_policy; }
+
+    // [DBSIZE] and [RANDOMKEY], over the keys in memory.
+    size_t key_count() const { return _cache.size(); }
+    // A key drawn at random, see cache::random_entry(), nil if the shard
+    // has none.
+    reply_value random_key();
+
+    // [BGSAVE]
+    // Writes the keys of this shard as they are now to its snapshot file
+    // while commands go on, see cache::begin_snapshot(). Fails if a
+    // snapshot of the shard is already being written.
+    future<> save_snapshot();
+    bool saving_snapshot() const { return bool(_snapshot); }
+    snapshot_stats get_snapshot_stats() const;
+    // Reads the snapshots this shard wrote at startup, and sends their keys
+    // to the shards owning them. After a change in the number of shards,
+    // shard N also reads those of the shards N + smp::count, N + 2 *
+    // smp::count and so on. Every shard loads its snapshots before any
+    // replays its commit log, which is newer. The warm restart image of a
+    // shard, whole, is loaded instead of its snapshot, then removed.
+    future<> load_snapshot();
+    // Inserts the keys, which this shard owns, replacing those of the same
+    // names. Expired keys are dropped.
+    void load_records(std::vector<snapshot_record>& records);
+    // [DEBUG POPULATE]
+    // Creates the keys of the options which this shard owns, a batch of
+    // load_records() at a time, and returns how many it created. They are
+    // neither logged nor replicated.
+    future<uint64_t> populate(populate_options options);
+    // Reads the heat map the shard left as it stopped, and starts reading
+    // its keys back from the store, see database_options::_warmup_keys.
+    // After a change in the number of shards the heat maps are dropped.
+    future<> start_warmup();
+
+    // [HOTKEYS, BIGKEYS]
+    foreign_ptr<lw_shared_ptr<key_samples>> get_key_samples() const;
 
     // [LIST]
     future<scattered_message_ptr> push(redis_key rk, bytes value, bool force, bool left);
     future<scattered_message_ptr> push_multi(redis_key rk, std::vector<bytes> value, bool force, bool left);
     future<scattered_message_ptr> pop(redis_key rk, bool left);
+    // LMOVE of two keys of this shard, as one step: the destination is
+    // checked before the pop, and the element moves between the lists
+    // without a copy. With `wait`, an empty source replies a null pointer
+    // rather than nil, for the caller to block.
+    future<scattered_message_ptr> lmove(redis_key source, redis_key destination, bool from_left, bool to_left, bool wait);
+    // LMPOP of the keys of this shard: pops up to `count` elements of the
+    // first one holding a list, replied with its key, `left` as pop()
+    // takes it. A null pointer when
+    // all are empty, for the caller to try the keys of the next shard.
+    future<scattered_message_ptr> lmpop(std::vector<redis_key> keys, bool left, size_t count);
+    // Pops an element of the first of `keys` holding a list for `b`, or a
+    // sorted set for a BZPOPMIN, unless another shard claimed it first,
+    // else blocks it on all of them when `block`, until a push serves it. True when b is done with this
+    // shard, false when it is blocked here.
+    bool pop_or_block(std::vector<bytes> keys, blocked_pop* b, bool block);
+    // Forgets b, blocked on the keys.
+    void unblock(std::vector<bytes> keys, blocked_pop* b);
     future<scattered_message_ptr> llen(redis_key rk);
     future<scattered_message_ptr> lindex(redis_key rk, long idx);
     future<scattered_message_ptr> linsert(redis_key rk, bytes pivot, bytes value, bool after);
-    future<scattered_message_ptr> lrange(redis_key rk, long start, long end);
+    future<reply_chunk> lrange(redis_key rk, long start, long end, size_t next, size_t left, bool stream);
     future<scattered_message_ptr> lset(redis_key rk, long idx, bytes value);
     future<scattered_message_ptr> lrem(redis_key rk, long count, bytes value);
     future<scattered_message_ptr> ltrim(redis_key rk, long start, long end);
 
+    // [STREAM]
+    // Appends the entry with the fields and values of `args` from `first`
+    // on, with the ID `id`, or the next one when `auto_id`, or the next one
+    // of the milliseconds of `id` when `auto_seq`. Then trims the stream to
+    // `max_length` entries, about when `approximate`.
+    future<scattered_message_ptr> xadd(redis_key rk, std::vector<bytes> args, size_t first, stream_id id, bool auto_id, bool auto_seq,
+        bool make_stream, size_t max_length, bool approximate);
+    future<scattered_message_ptr> xlen(redis_key rk);
+    future<scattered_message_ptr> xrange(redis_key rk, stream_id start, stream_id end, size_t count, bool reverse);
+    future<scattered_message_ptr> xdel(redis_key rk, std::vector<stream_id> ids);
+    future<scattered_message_ptr> xtrim(redis_key rk, size_t max_length, bool approximate);
+    // The entries after `after`, or after the last one when `last`. At
+    // most `count` of them, unless it is 0.
+    future<foreign_ptr<lw_shared_ptr<stream_read_result>>> xread(redis_key rk, stream_id after, bool last, size_t count);
+    // The new entries of the group, delivered to the consumer, or when
+    // `history` those pending for the consumer after `after`.
+    future<foreign_ptr<lw_shared_ptr<stream_read_result>>> xreadgroup(redis_key rk, stream_group_read g, bool history, stream_id after, size_t count);
+    // Reads the entries of the first of `keys` with some for `b`, which
+    // reads streams, as pop_or_block() pops.
+    bool read_or_block(std::vector<bytes> keys, blocked_pop* b, bool block);
+    future<scattered_message_ptr> xgroup_create(redis_key rk, bytes group, stream_id id, bool last, bool make_stream);
+    future<scattered_message_ptr> xgroup_destroy(redis_key rk, bytes group);
+    future<scattered_message_ptr> xgroup_setid(redis_key rk, bytes group, stream_id id, bool last);
+    // CREATECONSUMER when `create`, else DELCONSUMER.
+    future<scattered_message_ptr> xgroup_consumer(redis_key rk, bytes group, bytes consumer, bool create);
+    future<scattered_message_ptr> xack(redis_key rk, bytes group, std::vector<stream_id> ids);
+    // The summary of the pending entries of the group, or when `extended`
+    // those in [start, end], at most `count`, idle for at least `min_idle`
+    // milliseconds, of the consumer unless it is empty.
+    future<scattered_message_ptr> xpending(redis_key rk, bytes group, bool extended, stream_id start, stream_id end, size_t count,
+        uint64_t min_idle, bytes consumer);
+
+    // [TIMESERIES]
+    // Appends the sample, at the time of the shard when `now`. A series
+    // made by it keeps `retention_ms` of samples, 0 for all of them.
+    future<scattered_message_ptr> ts_add(redis_key rk, uint64_t ts, bool now, double value, uint64_t retention_ms);
+    // The samples in [from, to], or their aggregates in buckets of
+    // `bucket_ms` unless `agg` is none, at most `count` unless it is 0.
+    future<scattered_message_ptr> ts_range(redis_key rk, uint64_t from, uint64_t to, size_t count, ts_aggregation agg, uint64_t bucket_ms);
+    // The series of TS.MRANGE: `*3 $<key> *0 *<n> <samples>`, without
+    // labels, empty unless the key holds a series.
+    future<foreign_ptr<lw_shared_ptr<bytes>>> ts_mrange_part(redis_key rk, uint64_t from, uint64_t to, size_t count, ts_aggregation agg,
+        uint64_t bucket_ms);
+
+    // [SKETCHES]
+    // Makes a Bloom filter, which does not scale when `expansion` is 0.
+    future<scattered_message_ptr> bf_reserve(redis_key rk, double error, uint64_t capacity, uint32_t expansion);
+    // Adds the items to the filter, made with the default error and
+    // capacity unless there is one. Replies whether each was added, as an
+    // array when `multi`. The items after the first a full filter which does
+    // not scale refuses are not added, and the command fails.
+    future<scattered_message_ptr> bf_add(redis_key rk, std::vector<bytes> items, bool multi);
+    // Whether the filter may hold each item, as an array when `multi`.
+    future<scattered_message_ptr> bf_exists(redis_key rk, std::vector<bytes> items, bool multi);
+    future<scattered_message_ptr> cms_init(redis_key rk, uint32_t width, uint32_t depth);
+    // Counts the items the times given, replies their estimates.
+    future<scattered_message_ptr> cms_incrby(redis_key rk, std::vector<std::pair<bytes, uint32_t>> increments);
+    future<scattered_message_ptr> cms_query(redis_key rk, std::vector<bytes> items);
+    future<scattered_message_ptr> topk_reserve(redis_key rk, uint32_t k, uint32_t width, uint32_t depth, double decay);
+    // Counts the items once each, replies the item each expelled from the
+    // top k, or nil.
+    future<scattered_message_ptr> topk_add(redis_key rk, std::vector<bytes> items);
+    // Whether each item is among the top k.
+    future<scattered_message_ptr> topk_query(redis_key rk, std::vector<bytes> items);
+    // The top k items, the largest count first, each followed by its count
+    // when `with_count`.
+    future<scattered_message_ptr> topk_list(redis_key rk, bool with_count);
+
     // [HASHMAP]
     future<scattered_message_ptr> hset(redis_key rk, bytes field, bytes value);
-    future<scattered_message_ptr> hmset(redis_key rk, std::unordered_map<bytes, bytes> kv);
+    // HMSET, or HSET of several fields replying with those added when
+    // `reply_added`. The fields are set in order, the last value of a field
+    // given twice is kept.
+    future<scattered_message_ptr> hmset(redis_key rk, std::vector<std::pair<bytes, bytes>> kv, bool reply_added);
     future<scattered_message_ptr> hget(redis_key rk, bytes field);
     future<scattered_message_ptr> hdel(redis_key rk, bytes field);
     future<scattered_message_ptr> hdel_multi(redis_key rk, std::vector<bytes> fields);
@@ -102,10 +675,30 @@ public:
     future<scattered_message_ptr> hlen(redis_key rk);
     future<scattered_message_ptr> hincrby(redis_key rk, bytes field, int64_t delta);
     future<scattered_message_ptr> hincrbyfloat(redis_key rk, bytes field, double delta);
-    future<scattered_message_ptr> hgetall(redis_key rk);
-    future<scattered_message_ptr> hgetall_values(redis_key rk);
-    future<scattered_message_ptr> hgetall_keys(redis_key rk);
+    future<reply_chunk> hgetall(redis_key rk, size_t next, size_t left, bool stream);
+    future<reply_chunk> hgetall_values(redis_key rk, size_t next, size_t left, bool stream);
+    future<reply_chunk> hgetall_keys(redis_key rk, size_t next, size_t left, bool stream);
     future<scattered_message_ptr> hmget(redis_key rk, std::vector<bytes> keys);
+    future<scattered_message_ptr> hscan(redis_key rk, size_t cursor, bytes pattern, size_t count);
+    // Of the partitions of a split hash, see redis_service::set_split_keys():
+    // the number of fields, -1 if the key holds another type, and the fields,
+    // the values or both, in pairs, none for another type.
+    future<long> hlen_direct(redis_key rk);
+    future<foreign_ptr<lw_shared_ptr<std::vector<bytes>>>> hgetall_direct(redis_key rk, bool keys, bool values);
+    // HMSET and HDEL of several fields, which reply with what these count:
+    // the fields added or removed, -1 if the key holds another type.
+    future<long> hmset_direct(redis_key rk, std::vector<std::pair<bytes, bytes>> kvs);
+    future<long> hdel_direct(redis_key rk, std::vector<bytes> fields);
+    // The values of the fields in their order, none for a missing one; null
+    // if the key holds another type.
+    future<foreign_ptr<lw_shared_ptr<batch_values_type>>> hmget_direct(redis_key rk, std::vector<bytes> fields);
+    // The fields expire after `ms`, or at once unless it is positive: 1 for
+    // each field set, 2 for each deleted, -2 for each not in the hash.
+    future<scattered_message_ptr> hexpire(redis_key rk, int64_t ms, std::vector<bytes> fields);
+    // The time to live of each field, -1 if it does not expire.
+    future<scattered_message_ptr> httl(redis_key rk, std::vector<bytes> fields, bool milliseconds);
+    future<scattered_message_ptr> hpersist(redis_key rk, std::vector<bytes> fields);
+    size_t expiring_fields() const { return _field_expiry.size(); }
 
     // [SET]
     future<scattered_message_ptr> sadds(redis_key rk, std::vector<bytes> members);
@@ -114,54 +707,180 @@ public:
     future<scattered_message_ptr> sadd(redis_key rk, bytes member);
     future<scattered_message_ptr> scard(redis_key rk);
     future<scattered_message_ptr> sismember(redis_key rk, bytes member);
-    future<scattered_message_ptr> smembers(redis_key rk);
+    future<reply_chunk> smembers(redis_key rk, size_t next, size_t left, bool stream);
+    future<scattered_message_ptr> sscan(redis_key rk, size_t cursor, bytes pattern, size_t count);
     future<scattered_message_ptr> spop(redis_key rk, size_t count);
     future<scattered_message_ptr> srem(redis_key rk, bytes member);
     bool srem_direct(redis_key rk, bytes member);
+    // SMOVE of two keys of this shard, say sharing a hash tag: in one task,
+    // so that no command sees the member in neither set nor in both.
+    future<scattered_message_ptr> smove(redis_key src, redis_key dst, bytes member);
     future<scattered_message_ptr> srems(redis_key rk, std::vector<bytes> members);
     future<foreign_ptr<lw_shared_ptr<std::vector<bytes>>>> smembers_direct(redis_key rk);
-    future<scattered_message_ptr> srandmember(redis_key rk, size_t count);
+    future<size_t> scard_direct(redis_key rk);
+    // Bit i of the result is set if candidates[i] is a member of the set.
+    // The candidates are read in place, from the shard that owns them.
+    future<foreign_ptr<lw_shared_ptr<std::vector<uint64_t>>>> sismember_batch(redis_key rk, const std::vector<bytes>& candidates);
+    // A negative count picks -count members, the same one maybe several
+    // times, and is streamed as SMEMBERS is, see reply_chunk. A count of
+    // zero or more picks distinct members, see random_members().
+    future<reply_chunk> srandmember(redis_key rk, int64_t count, size_t next, size_t left, bool stream);
 
 
     // [SORTED SET]
-    future<scattered_message_ptr> zadds(redis_key rk, std::unordered_map<bytes, double> members, int flags);
-    bool zadds_direct(redis_key rk, std::unordered_map<bytes, double> members, int flags);
+    future<scattered_message_ptr> zadds(redis_key rk, sset_lsa::member_scores members, int flags);
     future<scattered_message_ptr> zcard(redis_key rk);
     future<scattered_message_ptr> zrem(redis_key rk, std::vector<bytes> members);
+    // ZADD and ZREM as they count: the members added or removed, -1 if the
+    // key holds another type.
+    long zadds_direct(redis_key rk, sset_lsa::member_scores members, int flags);
+    long zrem_direct(redis_key rk, std::vector<bytes> members);
+    // ZMPOP, as lmpop() does for lists.
+    future<scattered_message_ptr> zmpop(std::vector<redis_key> keys, bool max, size_t count);
+    // ZPOPMIN, or ZPOPMAX when `max`: the members and their scores, as a
+    // flat array.
+    future<scattered_message_ptr> zpop(redis_key rk, bool max, size_t count);
     future<scattered_message_ptr> zcount(redis_key rk, double min, double max);
     future<scattered_message_ptr> zincrby(redis_key rk, bytes member, double delta);
-    future<scattered_message_ptr> zrange(redis_key rk, long begin, long end, bool reverse, bool with_score);
-    future<foreign_ptr<lw_shared_ptr<std::vector<std::pair<bytes, double>>>>> zrange_direct(redis_key rk, long begin, long end);
+    future<reply_chunk> zrange(redis_key rk, long begin, long end, bool reverse, bool with_score, size_t next, size_t left, bool stream);
+    future<foreign_ptr<lw_shared_ptr<std::vector<std::pair<bytes, double>>>>> zrange_direct(redis_key rk, long begin, long end, bool reverse);
     future<scattered_message_ptr> zrangebyscore(redis_key rk, double min, double max, bool reverse, bool with_score);
     future<scattered_message_ptr> zrank(redis_key rk, bytes member, bool reverse);
     future<scattered_message_ptr> zscore(redis_key rk, bytes member);
     future<scattered_message_ptr> zremrangebyscore(redis_key rk, double min, double max);
     future<scattered_message_ptr> zremrangebyrank(redis_key rk, size_t begin, size_t end);
+    future<scattered_message_ptr> zrangebylex(redis_key rk, lex_bound min, lex_bound max, long offset, long limit, bool reverse);
+    future<scattered_message_ptr> zlexcount(redis_key rk, lex_bound min, lex_bound max);
+    future<scattered_message_ptr> zremrangebylex(redis_key rk, lex_bound min, lex_bound max);
+    future<scattered_message_ptr> zscan(redis_key rk, size_t cursor, bytes pattern, size_t count);
+    // The sources of ZUNION, ZINTER and ZDIFF may be sorted sets or sets,
+    // whose members score 1. Scores are multiplied by `weight`.
+    //
+    // Cardinality of a source, -1 if the key holds another type.
+    future<long> zcard_direct(redis_key rk);
+    // The members of a source sorted by member, for merge_zset_runs().
+    // Null if the key holds another type.
+    future<foreign_ptr<lw_shared_ptr<zset_members>>> zmembers_direct(redis_key rk, double weight);
+    // The scores of the candidates in a source, NaN for the missing ones.
+    // The candidates are read in place, from the shard that owns them.
+    future<foreign_ptr<lw_shared_ptr<std::vector<double>>>> zscore_batch(redis_key rk, const zset_members& candidates, double weight);
+    // ZUNIONSTORE: merges the runs here, on the shard of the destination.
+    future<scattered_message_ptr> zunionstore(redis_key rk, const std::vector<const zset_members*>& runs, int aggregate);
+    // ZINTERSTORE and ZDIFFSTORE: stores the distinct members computed by
+    // the coordinator.
+    future<scattered_message_ptr> zstore(redis_key rk, const zset_members& members);
+    // ZRANGESTORE with both keys on this shard: the range is copied to the
+    // destination here.
+    future<scattered_message_ptr> zrangestore(redis_key dest, redis_key rk, zrange_spec spec);
+    // The members of the range, in score order, for ZRANGESTORE to another
+    // shard. Null if the key holds another type.
+    future<foreign_ptr<lw_shared_ptr<zset_members>>> zrange_members(redis_key rk, zrange_spec spec);
+    // Stores the distinct members sorted by score, then by member, as
+    // zrange_members() returns them, in O(n).
+    future<scattered_message_ptr> zstore_sorted(redis_key rk, const zset_members& members);
 
     // [GEO]
     future<scattered_message_ptr> geodist(redis_key rk, bytes lpos, bytes rpos, int flag);
     future<scattered_message_ptr> geohash(redis_key rk, std::vector<bytes> members);
     future<scattered_message_ptr> geopos(redis_key rk, std::vector<bytes> members);
     using georadius_result_type = std::pair<std::vector<std::tuple<bytes, double, double, double, double>>, int>;
-    future<foreign_ptr<lw_shared_ptr<georadius_result_type>>> georadius_coord_direct(redis_key rk, double longtitude, double latitude, double radius, size_t count, int flag);
-    future<foreign_ptr<lw_shared_ptr<georadius_result_type>>> georadius_member_direct(redis_key rk, bytes pos, double radius, size_t count, int flag);
+    // Points of the shape around its center, or around `pos` for the member
+    // variant: REDIS_ERR if `pos` is not a member, REDIS_WRONG_TYPE.
+    future<foreign_ptr<lw_shared_ptr<georadius_result_type>>> georadius_coord_direct(redis_key rk, geo::shape shape, size_t count, int flag);
+    future<foreign_ptr<lw_shared_ptr<georadius_result_type>>> georadius_member_direct(redis_key rk, bytes pos, geo::shape shape, size_t count, int flag);
+    // GEOSEARCHSTORE and the STORE options with both keys on this shard:
+    // the points are stored here rather than sent back to the caller.
+    future<scattered_message_ptr> geosearch_store(redis_key dest, redis_key rk, bytes pos, bool from_member, geo::shape shape, size_t count, int flag);
+    // The points of a search as STORE, or STOREDIST, keeps them.
+    static zset_members geo_store_members(georadius_result_type& result, int flag);
 
     // [BITMAP]
     future<scattered_message_ptr> setbit(redis_key rk, size_t offset, bool value);
     future<scattered_message_ptr> getbit(redis_key rk, size_t offset);
     future<scattered_message_ptr> bitcount(redis_key rk, long start, long end);
-    future<scattered_message_ptr> bitop(redis_key rk, int flags, std::vector<bytes> keys);
-    future<scattered_message_ptr> bitpos(redis_key rk, bool bit, long start, long end);
+    // Stores the combined BITOP result computed by the coordinator, an
+    // empty result removes the key. A result past a page stays in pages.
+    future<scattered_message_ptr> bitop(redis_key rk, sparse_bitmap result);
+    future<scattered_message_ptr> bitpos(redis_key rk, bool bit, long start, long end, bool end_given);
+    future<scattered_message_ptr> bitfield(redis_key rk, std::vector<bitfield_op> ops);
 
     // [HLL]
-    future<scattered_message_ptr> pfadd(redis_key rk, std::vector<bytes> keys);
+    // updates come from hll::prepare() on the shard of the connection.
+    future<scattered_message_ptr> pfadd(redis_key rk, std::vector<hll_update> updates);
     future<scattered_message_ptr> pfcount(redis_key rk);
     future<scattered_message_ptr> pfmerge(redis_key rk, uint8_t* merged_sources, size_t size);
     future<foreign_ptr<lw_shared_ptr<bytes>>> get_hll_direct(redis_key rk);
+    // All HLL keys of this shard merged into one dense value: null if none exists, empty on a wrong type.
+    future<foreign_ptr<lw_shared_ptr<bytes>>> pfmerge_direct(std::vector<redis_key> rks);
 
     future<> stop();
 private:
-    future<foreign_ptr<lw_shared_ptr<georadius_result_type>>> georadius(const sset_lsa&, double longtitude, double latitude, double radius, size_t count, int flag);
+    bool erase_entry(const redis_key& rk);
+    // Like with_allocator(allocator(), func), accounting the memory of the
+    // region func allocates or frees to the entries of `type`.
+    template <typename Func>
+    decltype(auto) with_allocator_for(data_type type, Func&& func)
+    {
+        return with_allocator(allocator(), [this, type, &func] () -> decltype(auto) {
+            type_memory::scope accounting(_cache.memory_by_type(), type);
+            return func();
+        });
+    }
+    // Creates an empty hash or set, packed if the options allow it.
+    cache_entry* make_dict(const redis_key& rk, bool set);
+    // The same, not yet inserted.
+    cache_entry* construct_dict(const redis_key& rk, bool set);
+    // A new string entry, holding the value out of the region if it is at
+    // least _shared_value_min_bytes long, else compressed if it is at least
+    // _compressed_value_min_bytes long.
+    cache_entry* make_string(const redis_key& rk, bytes_view val);
+    // The same from the fragments of a large value, which are copied
+    // straight into the region unless the value is held out of it.
+    cache_entry* make_string(const redis_key& rk, const std::vector<bytes_view>& fragments);
+    // Inserts the string entry as SET does.
+    reply_value insert_string(cache_entry* entry, long expire, uint32_t flag);
+    // SET with GET: the string entry replaces the value, which is replied,
+    // unless it is not a string. `inserted` tells whether it was set.
+    reply_value exchange_string(const redis_key& rk, cache_entry* entry, long expire, uint32_t flag, bool& inserted);
+    // Whether a SET with these expiry and flags skips the commit log and
+    // the flush, see database_options::_volatile_ttl_ms.
+    bool volatile_write(long expire, uint32_t flag) const;
+    // Inserts the string entry as SET does, clean. `shadowed` tells whether
+    // it replaced a version which may be on disk.
+    reply_value insert_volatile(const redis_key& rk, cache_entry* entry, size_t size, long expire, uint32_t flag, bool& shadowed);
+    // Logs the deletion of the key of a volatile SET which shadowed a
+    // version on disk, before replying.
+    future<reply_value> log_volatile(const redis_key& rk, bool shadowed, reply_value reply);
+    // The "set" keyspace event of the string entry just inserted.
+    void notify_set(const cache_entry& e);
+    bool shares_string(size_t size) const;
+    bool compresses_string(size_t size) const;
+    // Replaces the key with a new sorted set filled by func(sset_lsa&), or
+    // removes it if the set is left empty. Returns the size of the set.
+    template <typename Func>
+    size_t store_zset(const redis_key& rk, Func&& fill);
+    // Unpacks a hash or set which would outgrow the packed encoding by
+    // adding `fields` fields of at most `size` bytes.
+    // `integers` when the fields are members of a set which all read as
+    // integers, which an intset takes.
+    void maybe_unpack(cache_entry* e, size_t fields, size_t size, bool integers = false);
+    // Pops the head or the tail of the list, removing the key once empty.
+    bytes pop_element(const redis_key& rk, cache_entry* e, bool left);
+    // The same for the member of the lowest score of the sorted set, or of
+    // the highest when `max`, encoded as the bulks of a BZPOPMIN reply.
+    bytes pop_member(const redis_key& rk, cache_entry* e, bool max);
+    // Pops `count` members of the lowest scores, or of the highest when
+    // `max`, appending each and its score to m, as `*2 member score` when
+    // `pairs`. Removes the key once empty.
+    void pop_members(const redis_key& rk, cache_entry* e, bool max, size_t count, scattered_message<char>& m, bool pairs);
+    // Serves the pops blocked on the list or the sorted set just added
+    // to, first blocked first served, while it has elements.
+    void serve_blocked(const redis_key& rk, cache_entry* e);
+    // Serves the reads blocked on the stream, after an XADD.
+    void serve_blocked_reads(const redis_key& rk, cache_entry* e);
+    // Reads for `b` what it waits for, false if there is nothing yet.
+    bool read_stream_for(const redis_key& rk, cache_entry* e, blocked_pop* b, stream_id after);
+    future<foreign_ptr<lw_shared_ptr<georadius_result_type>>> georadius(const sset_lsa&, const geo::shape& shape, size_t count, int flag);
     static inline long alignment_index_base_on(size_t size, long index)
     {
         if (index < 0) {
@@ -170,25 +889,16 @@ private:
         return index;
     }
 
-    template<bool Key, bool Value>
-    future<scattered_message_ptr> hgetall_impl(redis_key& rk)
+    // The size of the next chunk of a reply with `left` elements to go.
+    size_t reply_chunk_size(bool stream, size_t left) const
     {
-        ++_stat._read;
-        return _cache.run_with_entry(rk, [this] (const cache_entry* e) {
-            if (!e) {
-                return reply_builder::build(msg_err);
-            }
-            if (e->type_of_map() == false) {
-                return reply_builder::build(msg_type_err);
-            }
-            auto& map = e->value_map();
-            std::vector<const dict_entry*> entries;
-            map.fetch(entries);
-            if (!entries.empty()) ++_stat._hit;
-            return reply_builder::build<Key, Value>(entries);
-        });
+        auto chunk = _options._reply_chunk_elements;
+        return stream && chunk > 0 ? std::min(left, chunk) : left;
     }
+    template<bool Key, bool Value>
+    future<reply_chunk> dict_chunk(const redis_key& rk, bool set, size_t next, size_t left, bool stream);
 private:
+    database_options _options;
     cache _cache;
     seastar::metrics::metric_groups _metrics;
     lw_shared_ptr<store::commit_log> _commit_log { nullptr };
@@ -203,97 +913,29 @@ private:
         uint64_t _total_zset_entries = 0;
         uint64_t _total_bitmap_entries = 0;
         uint64_t _total_hll_entries = 0;
+        uint64_t _total_stream_entries = 0;
+        uint64_t _total_timeseries_entries = 0;
+        uint64_t _total_bloom_entries = 0;
+        uint64_t _total_cms_entries = 0;
+        uint64_t _total_topk_entries = 0;
+        uint64_t _flushes = 0;
 
-        uint64_t _echo = 0;
-        uint64_t _set = 0;
-        uint64_t _get = 0;
-        uint64_t _del = 0;
-        uint64_t _mset = 0;
-        uint64_t _mget = 0;
-        uint64_t _counter = 0;
-        uint64_t _strlen = 0;
-        uint64_t _exists = 0;
-        uint64_t _append = 0;
-        uint64_t _lpush = 0;
-        uint64_t _lpushx = 0;
-        uint64_t _rpush = 0;
-        uint64_t _rpushx = 0;
-        uint64_t _lpop = 0;
-        uint64_t _rpop = 0;
-        uint64_t _lindex = 0;
-        uint64_t _llen = 0;
-        uint64_t _linsert = 0;
-        uint64_t _lrange = 0;
-        uint64_t _lset = 0;
-        uint64_t _ltrim = 0;
-        uint64_t _lrem = 0;
-        uint64_t _hdel = 0;
-        uint64_t _hexists = 0;
-        uint64_t _hset = 0;
-        uint64_t _hget = 0;
-        uint64_t _hmset = 0;
-        uint64_t _hincrby = 0;
-        uint64_t _hincrbyfloat = 0;
-        uint64_t _hlen = 0;
-        uint64_t _hstrlen = 0;
-        uint64_t _hgetall = 0;
-        uint64_t _hgetall_keys = 0;
-        uint64_t _hgetall_values = 0;
-        uint64_t _hmget = 0;
-        uint64_t _smembers = 0;
-        uint64_t _sadd = 0;
-        uint64_t _scard = 0;
-        uint64_t _sismember = 0;
-        uint64_t _srem = 0;
-        uint64_t _sdiff = 0;
-        uint64_t _sdiff_store = 0;
-        uint64_t _sinter = 0;
-        uint64_t _sinter_store = 0;
-        uint64_t _sunion = 0;
-        uint64_t _sunion_store = 0;
-        uint64_t _smove = 0;
-        uint64_t _srandmember = 0;
-        uint64_t _spop = 0;
-        uint64_t _type = 0;
-        uint64_t _expire = 0;
-        uint64_t _pexpire = 0;
-        uint64_t _pttl = 0;
-        uint64_t _ttl = 0;
-        uint64_t _persist = 0;
-        uint64_t _zadd  = 0;
-        uint64_t _zcard = 0;
-        uint64_t _zrange = 0;
-        uint64_t _zrangebyscore = 0;
-        uint64_t _zcount = 0;
-        uint64_t _zincrby = 0;
-        uint64_t _zrank = 0;
-        uint64_t _zrem = 0;
-        uint64_t _zscore = 0;
-        uint64_t _zunionstore = 0;
-        uint64_t _zinterstore = 0;
-        uint64_t _zdiffstore = 0;
-        uint64_t _zremrangebyscore = 0;
-        uint64_t _zremrangebyrank = 0;
-        uint64_t _zdiff = 0;
-        uint64_t _zunion = 0;
-        uint64_t _zinter = 0;
-        uint64_t _zrangebylex = 0;
-        uint64_t _zlexcount = 0;
-        uint64_t _select  = 0;
-        uint64_t _geoadd = 0;
-        uint64_t _geodist = 0;
-        uint64_t _geohash = 0;
-        uint64_t _geopos = 0;
-        uint64_t _georadius = 0;
-        uint64_t _setbit = 0;
-        uint64_t _getbit = 0;
-        uint64_t _bitcount = 0;
-        uint64_t _bitop = 0;
-        uint64_t _bitpos = 0;
-        uint64_t _bitfield = 0;
-        uint64_t _pfadd = 0;
-        uint64_t _pfcount = 0;
-        uint64_t _pfmerge = 0;
+        uint64_t _replayed_mutations = 0;
+        uint64_t _replayed_batches = 0;
+        // Records of the keys of other shards found at startup: sent to
+        // their owners after a change in the number of shards, else left
+        // over from an earlier change and dropped.
+        uint64_t _moved_records = 0;
+        uint64_t _dropped_foreign_records = 0;
+        // Keys inserted from snapshots and RDB files.
+        uint64_t _loaded_keys = 0;
+        uint64_t _loaded_batches = 0;
+        // Keys created by DEBUG POPULATE.
+        uint64_t _populated_keys = 0;
+        // SETs which skipped the commit log and the flush, see
+        // database_options::_volatile_ttl_ms, and the bytes of their values.
+        uint64_t _volatile_writes = 0;
+        uint64_t _volatile_bytes = 0;
     };
     stats _stat;
     lw_shared_ptr<store::column_family> _sys_cf;
@@ -305,8 +947,133 @@ private:
     using clock_type = lowres_clock;
     timer<clock_type> _flush_timer;
     void on_timer();
+    void maybe_flush_memtable();
+    // Runs while the shard is past its soft memory limit, see
+    // dirty_memory_manager.
+    static constexpr size_t RECLAIM_EVICTIONS = 256;
+    static constexpr unsigned RECLAIM_INTERVAL_MS = 10;
+    void reclaim_memory();
+    write_throttle_listener_type _write_throttle_listener;
+    bool _writes_throttled = false;
+    struct memory_pressure_stats {
+        uint64_t _reclaims = 0;
+        uint64_t _flushes = 0;
+        uint64_t _evictions = 0;
+        uint64_t _throttles = 0;
+    };
+    memory_pressure_stats _pressure_stats;
+    struct tier_stats {
+        // Keys looked up in the store, and those found there.
+        uint64_t _reads = 0;
+        uint64_t _promotions = 0;
+    };
+    tier_stats _tier_stats;
+    // The keys of the heat map still to read back, hottest first, one batch
+    // every WARMUP_PERIOD.
+    static constexpr auto WARMUP_PERIOD = std::chrono::milliseconds(100);
+    std::deque<bytes> _warmup_queue;
+    seastar::gate _warmup_gate;
+    void run_warmup();
+    // Writes the heat map of the shard as it stops.
+    future<> save_heat_map();
+    // Inserts the value the store has for the key, unless the key was
+    // written meanwhile.
+    void promote(const redis_key& rk, bytes_view record);
     void setup_metrics();
     size_t sum_expiring_entries();
+    // Replays the commit log left by an earlier run into the cache, applying
+    // the records in batches of REPLAY_BATCH_RECORDS.
+    static constexpr size_t REPLAY_BATCH_RECORDS = 256;
+    logalloc::allocating_section _replay_section;
+    future<> replay_commit_log();
+    // Applies the records of this shard, returns those of the others when
+    // resharding.
+    std::vector<bytes> apply_replayed(std::vector<temporary_buffer<char>>& records);
+    bool resharding() const { return _options._data_shards != smp::count; }
+    // Sends records of keys this shard does not own to their shards, which
+    // apply them as replicated records.
+    future<> move_records(std::vector<bytes> records);
+    void apply_decoded(const decoded_mutation& m);
+    void apply_field_change(const redis_key& rk, const decoded_mutation& m);
+    // Appends the records of a change the cache already has, then resolves
+    // to its reply: a hash logs the fields it changes, not its value.
+    future<scattered_message_ptr> log_change(const mutation_record& r, future<scattered_message_ptr> reply);
+    template <typename Reply>
+    future<Reply> log_changes(const std::vector<mutation_record>& records, future<Reply> reply);
+    // The same for the reply_value of GETDEL and SET with GET, when the
+    // cache changed.
+    future<reply_value> log_exchange(const mutation_record& r, bool changed, reply_value reply);
+    copy_invalidator_type _copy_invalidator;
+    // The fields of the hashes which expire, see hexpire().
+    field_expiry _field_expiry;
+    // Removes the fields of the hash past their deadline, before a command
+    // reads or writes them.
+    void expire_fields(const redis_key& rk);
+    void remove_expired_fields(const redis_key& rk, const std::vector<bytes>& fields);
+    struct watched_key {
+        uint32_t _watchers = 0;
+        uint64_t _version = 0;
+    };
+    std::unordered_map<bytes, watched_key> _watched_keys;
+    // The tracked keys, at most MAX_TRACKED_KEYS of them: past it, a key is
+    // invalidated to make room, as its clients would rather read it again
+    // than cache a stale value.
+    static constexpr size_t MAX_TRACKED_KEYS = 1 << 20;
+    std::unordered_map<bytes, std::vector<uint64_t>> _tracked_keys;
+    std::map<bytes, std::vector<uint64_t>> _tracking_prefixes;
+    void invalidate_tracked(const bytes& key);
+    semaphore _transaction_order { 1 };
+    stdx::optional<shared_promise<>> _held_writes;
+    // The pops blocked on each key, in the order they blocked. Those claimed
+    // by another shard are dropped as they come up.
+    std::unordered_map<bytes, std::deque<blocked_pop*>> _blocked_pops;
+    // The reads blocked on each stream, and the ID each reads after.
+    std::unordered_map<bytes, std::deque<std::pair<blocked_pop*, stream_id>>> _blocked_reads;
+    // The walk of the key sampler: its cursor, the keys of the walk so far,
+    // and those of the last complete one.
+    timer<> _key_sampling_timer;
+    size_t _key_sampling_cursor = 0;
+    key_samples _key_samples_walk;
+    key_samples _key_samples;
+    void sample_keys();
+    // The snapshot being written, and where its walk of the cache is.
+    static constexpr size_t SNAPSHOT_BATCH_ENTRIES = 256;
+    lw_shared_ptr<snapshot_writer> _snapshot;
+    size_t _snapshot_cursor = 0;
+    snapshot_stats _snapshot_stats;
+    seastar::gate _snapshot_gate;
+    void save_snapshot_entry(const cache_entry& e);
+    future<> save_snapshot_to(sstring name);
+    // Leaves the keys in the warm restart image of the shard as it stops,
+    // see database_options::_warm_restart_dir.
+    future<> save_warm_image();
+    // Keys loaded by load_records() are inserted in one allocating section
+    // per batch, as are those restore_entry() inserts.
+    logalloc::allocating_section _load_section;
+    // Inserts the records in one allocating section, and counts their
+    // keys by type. Returns how many were inserted.
+    uint64_t insert_records(std::vector<snapshot_record>& records);
+    static constexpr size_t POPULATE_BATCH_KEYS = 256;
+    cache_entry* make_loaded_entry(const redis_key& rk, const snapshot_record& r);
+    // Inserts the record in place of the key of its name, within the
+    // allocating section and under the allocator of the caller. false if
+    // it expired or is of no known type.
+    bool insert_record(const snapshot_record& r, uint64_t now_ms);
+    void count_records(snapshot_type type, uint64_t n);
+    // The key encoded under the name `dst`, null if there is none.
+    lw_shared_ptr<bytes> encode_record(const redis_key& rk, const bytes& dst);
+    // Inserts the record in place of the key, and logs it.
+    future<> replace_with_record(const redis_key& rk, const snapshot_record& r);
+    // Logs the key as it now is, for the types whose commands are logged:
+    // the deletion of a hash then its fields, or a string.
+    future<> log_entry(const redis_key& rk);
+    sstring _replication_id;
+    struct replication_progress {
+        uint64_t _offset = 0;
+        clock_type::time_point _seen;
+    };
+    std::map<sstring, replication_progress> _replicas;
+    std::map<std::pair<sstring, unsigned>, replication_progress> _primaries;
 };
 extern distributed<database> _databases;
 inline distributed<database>& get_database() {
@@ -0,0 +1,75 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#pragma once
+#include "utils/logalloc.hh"
+#include "core/timer.hh"
+#include "core/lowres_clock.hh"
+#include <chrono>
+#include <functional>
+namespace redis {
+
+// Accounts the memory of the cache and of the memtables of a shard in one
+// region group. Past the soft limit the reclaim function runs on a timer,
+// out of the allocation path it is noticed in, until the group is back
+// under it; past the hard limit run_when_memory_available() queues writes.
+class dirty_memory_manager : public logalloc::region_group_reclaimer {
+    logalloc::region_group _region_group;
+    timer<> _reclaim_timer;
+
+    // Called synchronously with allocations: it must neither allocate nor
+    // touch a region, and arming a timer does neither.
+    void start_reclaiming() noexcept override {
+        if (!_reclaim_timer.armed()) {
+            _reclaim_timer.arm(std::chrono::microseconds(0));
+        }
+    }
+public:
+    dirty_memory_manager(size_t hard_limit, size_t soft_limit)
+        : logalloc::region_group_reclaimer(hard_limit, soft_limit)
+        , _region_group(*this)
+    {
+    }
+
+    // The reclaim function calls rearm_reclaim() while it is still needed.
+    void set_reclaim(std::function<void()> reclaim) {
+        _reclaim_timer.set_callback(std::move(reclaim));
+    }
+    void rearm_reclaim(std::chrono::milliseconds delay) {
+        if (!_reclaim_timer.armed()) {
+            _reclaim_timer.arm(delay);
+        }
+    }
+
+    logalloc::region_group& region_group() { return _region_group; }
+    const logalloc::region_group& region_group() const { return _region_group; }
+
+    // Writes queued past the hard limit fail with timed_out_error at the
+    // timeout.
+    future<> wait_for_memory(lowres_clock::time_point timeout) {
+        return _region_group.run_when_memory_available([] {}, timeout);
+    }
+
+    future<> shutdown() {
+        _reclaim_timer.cancel();
+        return _region_group.shutdown();
+    }
+};
+}
@@ -0,0 +1,91 @@
+#!/usr/bin/python3
+#
+# Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+#
+# Pedis is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Affero General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+#
+# pedis_symbolize_profile.py resolves the `module+0xoffset` frames of the
+# profile-<shard>.folded files of PROFILE START with addr2line, and writes
+# the folded stacks with the names of the functions to stdout, for
+# flamegraph.pl or speedscope:
+#
+# $ pedis_symbolize_profile.py profile-*.folded > pedis.folded
+#
+# Run it where the binary and the libraries are at the paths the node
+# mapped them from, or name the binary with --binary.
+#
+import argparse
+import collections
+import subprocess
+
+
+def parse(line):
+    stack, _, count = line.rstrip('\n').rpartition(' ')
+    return stack.split(';'), int(count)
+
+
+def split_frame(frame):
+    module, _, offset = frame.rpartition('+')
+    return module, int(offset, 16)
+
+
+def resolve(module, offsets):
+    args = ['addr2line', '-f', '-C', '-e', module]
+    query = '\n'.join('0x{:x}'.format(o) for o in offsets) + '\n'
+    try:
+        out = subprocess.run(args, input=query, stdout=subprocess.PIPE,
+                             universal_newlines=True, check=True).stdout
+    except (OSError, subprocess.CalledProcessError):
+        return {}
+    # a function and its file:line per address.
+    lines = out.splitlines()
+    return {o: lines[2 * i] for i, o in enumerate(offsets) if 2 * i < len(lines)}
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Symbolize the folded stacks of PROFILE START.')
+    parser.add_argument('--binary', help='the pedis binary, instead of the path the node ran')
+    parser.add_argument('files', nargs='+')
+    args = parser.parse_args()
+
+    stacks = collections.Counter()
+    wanted = collections.defaultdict(set)
+    for name in args.files:
+        with open(name) as f:
+            for line in f:
+                frames, count = parse(line)
+                stacks[tuple(frames)] += count
+                for depth, frame in enumerate(frames):
+                    module, offset = split_frame(frame)
+                    # below the leaf, return addresses: the call is before.
+                    if depth != len(frames) - 1:
+                        offset -= 1
+                    wanted[module].add(offset)
+
+    names = {}
+    for module, offsets in wanted.items():
+        path = module
+        if args.binary and module != '[unknown]' and not module.startswith('/lib') and not module.startswith('/usr'):
+            path = args.binary
+        offsets = sorted(offsets)
+        resolved = resolve(path, offsets) if module != '[unknown]' else {}
+        for o in offsets:
+            function = resolved.get(o, '??')
+            names[(module, o)] = function if function != '??' else '{}+0x{:x}'.format(module, o)
+
+    for frames, count in stacks.items():
+        symbols = []
+        for depth, frame in enumerate(frames):
+            module, offset = split_frame(frame)
+            if depth != len(frames) - 1:
+                offset -= 1
+            symbols.append(names[(module, offset)].replace(';', ':'))
+        print('{} {}'.format(';'.join(symbols), count))
+
+
+if __name__ == '__main__':
+    main()
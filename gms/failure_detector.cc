@@ -55,6 +55,9 @@ constexpr std::chrono::milliseconds failure_detector::DEFAULT_MAX_PAUSE;
 
 using clk = arrival_window::clk;
 
+// Twice the gossip interval, see failure_detector::set_heartbeat_interval().
+static thread_local clk::duration initial_value = std::chrono::seconds(2);
+
 static clk::duration get_initial_value() {
 #if 0
     String newvalue = System.getProperty("cassandra.fd_initial_value_ms");
@@ -68,8 +71,7 @@ static clk::duration get_initial_value() {
         return Integer.parseInt(newvalue);
     }
 #endif
-    //warn(unimplemented::cause::GOSSIP);
-    return std::chrono::seconds(2);
+    return initial_value;
 }
 
 clk::duration arrival_window::get_max_interval() {
@@ -275,6 +277,10 @@ void failure_detector::force_conviction(inet_address ep) {
     }
 }
 
+void failure_detector::set_heartbeat_interval(std::chrono::milliseconds interval) {
+    initial_value = std::chrono::duration_cast<clk::duration>(interval * 2);
+}
+
 void failure_detector::remove(inet_address ep) {
     _arrival_samples.erase(ep);
 }
@@ -193,6 +193,10 @@ public:
 
     void force_conviction(inet_address ep);
 
+    // The windows of new endpoints start from twice the interval heartbeats
+    // are expected at, and longer gaps are not sampled.
+    void set_heartbeat_interval(std::chrono::milliseconds interval);
+
     void remove(inet_address ep);
 
     void register_failure_detection_event_listener(i_failure_detection_event_listener* listener);
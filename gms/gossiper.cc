@@ -83,6 +83,16 @@ void gossiper::set_cluster_name(sstring name) {
     _cluster_name = name;
 }
 
+void gossiper::set_interval(std::chrono::milliseconds interval) {
+    _interval = interval;
+    get_local_failure_detector().set_heartbeat_interval(interval);
+}
+
+void gossiper::set_ping_interval(std::chrono::milliseconds interval, unsigned misses_to_convict) {
+    _ping_interval = interval;
+    _ping_misses_to_convict = std::max(misses_to_convict, 1u);
+}
+
 sstring gossiper::get_partitioner_name() {
     //return dht::global_partitioner().name();
     return "partitioner"; 
@@ -114,6 +124,11 @@ gossiper::gossiper() {
     }
 
     _scheduled_gossip_task.set_callback([this] { run(); });
+    _ping_timer.set_callback([this] { ping_peers(); });
+    auto& cfg = redis::get_local_database().get_config();
+    set_interval(std::chrono::milliseconds(cfg.gossip_interval_ms()));
+    set_ping_interval(std::chrono::milliseconds(cfg.gossip_ping_interval_ms()), cfg.gossip_ping_misses_to_convict());
+    set_full_digest_rounds(cfg.gossip_full_digest_rounds());
     // half of QUARATINE_DELAY, to ensure _just_removed_endpoints has enough leeway to prevent re-gossip
     fat_client_timeout = quarantine_delay() / 2;
     /* register with the Failure Detector for receiving Failure detector events */
@@ -131,6 +146,13 @@ gossiper::gossiper() {
                     return 0;
                 }
             }, sm::description("Heart beat of the current Node.")),
+        sm::make_derive("pings", [this] { return _pings; }, sm::description("Total number of direct pings sent to live peers.")),
+        sm::make_derive("missed_pings", [this] { return _missed_pings_total; }, sm::description("Total number of direct pings not answered in time.")),
+        sm::make_derive("ping_convictions", [this] { return _ping_convictions; }, sm::description("Total number of peers convicted for missing direct pings.")),
+        sm::make_derive("sent_digests", [this] { return _sent_digests; }, sm::description("Total number of endpoint digests sent in SYN messages.")),
+        sm::make_derive("omitted_digests", [this] { return _omitted_digests; }, sm::description("Total number of endpoint digests left out of SYN messages as the peer had them.")),
+        sm::make_derive("sent_bytes", [this] { return ms().gossip_sent_bytes(); }, sm::description("Total number of serialized bytes of the gossip messages sent, before compression.")),
+        sm::make_gauge("last_round_bytes", [this] { return _last_round_bytes; }, sm::description("Serialized bytes of the gossip messages sent during the last round.")),
     });
 }
 
@@ -226,6 +248,18 @@ future<> gossiper::handle_ack_msg(msg_addr id, gossip_digest_ack ack_msg) {
     auto g_digest_list = ack_msg.get_gossip_digest_list();
     auto ep_state_map = ack_msg.get_endpoint_state_map();
 
+    // It answered the last SYN: it has the versions it told, it asks for
+    // the newer ones.
+    auto peer = _peer_digests.find(id.addr);
+    if (peer != _peer_digests.end()) {
+        for (auto& x : peer->second._sent) {
+            peer->second._acked[x.first] = x.second;
+        }
+        for (auto& d : g_digest_list) {
+            peer->second._acked.erase(d.get_endpoint());
+        }
+    }
+
     auto f = make_ready_future<>();
     if (ep_state_map.size() > 0) {
         /* Notify the Failure Detector */
@@ -278,6 +312,53 @@ future<> gossiper::handle_echo_msg() {
     return make_ready_future<>();
 }
 
+future<> gossiper::handle_ping_msg() {
+    set_last_processed_message_at();
+    return make_ready_future<>();
+}
+
+// Pings run next to the gossip rounds, so that a round waiting on a dead
+// peer does not delay noticing it.
+void gossiper::ping_peers() {
+    if (!_enabled) {
+        return;
+    }
+    std::vector<inet_address> peers(_live_endpoints.begin(), _live_endpoints.end());
+    auto timeout = _ping_interval;
+    parallel_for_each(std::move(peers), [this, timeout] (inet_address ep) {
+        ++_pings;
+        return ms().send_gossip_ping(get_msg_addr(ep), timeout).then_wrapped([this, ep] (future<> f) {
+            if (!f.failed()) {
+                f.ignore_ready_future();
+                _missed_pings.erase(ep);
+                get_local_failure_detector().report(ep);
+                return make_ready_future<>();
+            }
+            f.ignore_ready_future();
+            ++_missed_pings_total;
+            if (++_missed_pings[ep] < _ping_misses_to_convict) {
+                return make_ready_future<>();
+            }
+            _missed_pings.erase(ep);
+            ++_ping_convictions;
+            logger.info("InetAddress {} missed {} pings in a row, convicting it", ep, _ping_misses_to_convict);
+            return timer_callback_lock().then([this, ep] {
+                return seastar::async([ep] {
+                    get_local_failure_detector().force_conviction(ep);
+                }).finally([this] {
+                    timer_callback_unlock();
+                });
+            });
+        });
+    }).handle_exception([] (std::exception_ptr ep) {
+        logger.warn("Fail to ping peers: {}", ep);
+    }).finally([this, g = this->shared_from_this()] {
+        if (_enabled && _ping_interval.count() > 0) {
+            _ping_timer.arm(_ping_interval);
+        }
+    });
+}
+
 future<> gossiper::handle_shutdown_msg(inet_address from) {
     set_last_processed_message_at();
     if (!is_enabled()) {
@@ -327,6 +408,11 @@ void gossiper::init_messaging_service_handler() {
             return gms::get_local_gossiper().handle_echo_msg();
         });
     });
+    ms().register_gossip_ping([] {
+        return smp::submit_to(0, [] {
+            return gms::get_local_gossiper().handle_ping_msg();
+        });
+    });
     ms().register_gossip_shutdown([] (inet_address from) {
         smp::submit_to(0, [from] {
             return gms::get_local_gossiper().handle_shutdown_msg(from);
@@ -343,6 +429,7 @@ void gossiper::init_messaging_service_handler() {
 void gossiper::uninit_messaging_service_handler() {
     auto& ms = netw::get_local_messaging_service();
     ms.unregister_gossip_echo();
+    ms.unregister_gossip_ping();
     ms.unregister_gossip_shutdown();
     ms.unregister_gossip_digest_syn();
     ms.unregister_gossip_digest_ack();
@@ -363,7 +450,7 @@ future<> gossiper::send_gossip(gossip_digest_syn message, std::set<inet_address>
     auto id = get_msg_addr(to);
     logger.trace("Sending a GossipDigestSyn to {} ...", id);
     _gossiped_to_seed = _seeds.count(to);
-    return ms().send_gossip_digest_syn(id, std::move(message)).handle_exception([id] (auto ep) {
+    return ms().send_gossip_digest_syn(id, delta_syn(to, message)).handle_exception([id] (auto ep) {
         // It is normal to reach here because it is normal that a node
         // tries to send a SYN message to a peer node which is down before
         // failure_detector thinks that peer node is down.
@@ -372,6 +459,25 @@ future<> gossiper::send_gossip(gossip_digest_syn message, std::set<inet_address>
 }
 
 
+gossip_digest_syn gossiper::delta_syn(inet_address to, const gossip_digest_syn& message) {
+    auto digests = message.get_gossip_digests();
+    auto& peer = _peer_digests[to];
+    bool full = _full_digest_rounds <= 1 || peer._syns++ % _full_digest_rounds == 0;
+    std::vector<gossip_digest> delta;
+    peer._sent.clear();
+    for (auto& d : digests) {
+        auto version = std::make_pair(d.get_generation(), d.get_max_version());
+        peer._sent.emplace(d.get_endpoint(), version);
+        auto it = peer._acked.find(d.get_endpoint());
+        if (full || it == peer._acked.end() || it->second != version) {
+            delta.push_back(d);
+        }
+    }
+    _sent_digests += delta.size();
+    _omitted_digests += digests.size() - delta.size();
+    return gossip_digest_syn(message.cluster_id(), message.partioner(), std::move(delta));
+}
+
 void gossiper::notify_failure_detector(inet_address endpoint, endpoint_state remote_endpoint_state) {
     /*
      * If the local endpoint state exists then report to the FD only
@@ -561,6 +667,7 @@ void gossiper::run() {
             shadow_endpoint_state_map[br_addr].get_heart_beat_state() = hbs;
 
             logger.trace("My heartbeat is now {}", endpoint_state_map[br_addr].get_heart_beat_state().get_heart_beat_version());
+            auto round_start_bytes = ms().gossip_sent_bytes();
             std::vector<gossip_digest> g_digests;
             this->make_random_gossip_digest(g_digests);
 
@@ -605,6 +712,7 @@ void gossiper::run() {
 
                 do_status_check();
             }
+            _last_round_bytes = ms().gossip_sent_bytes() - round_start_bytes;
 
             //
             // Gossiper task runs only on CPU0:
@@ -668,7 +776,7 @@ void gossiper::run() {
             }
         }
         if (_enabled) {
-            _scheduled_gossip_task.arm(INTERVAL);
+            _scheduled_gossip_task.arm(_interval);
         }
         this->timer_callback_unlock();
     });
@@ -782,6 +890,7 @@ void gossiper::evict_from_membership(inet_address endpoint) {
     _unreachable_endpoints.erase(endpoint);
     endpoint_state_map.erase(endpoint);
     _expire_time_endpoint_map.erase(endpoint);
+    _peer_digests.erase(endpoint);
     get_local_failure_detector().remove(endpoint);
     quarantine_endpoint(endpoint);
     logger.debug("evicting {} from gossip", endpoint);
@@ -865,7 +974,7 @@ future<> gossiper::advertise_token_removed(inet_address endpoint, utils::UUID ho
         add_expire_time_for_endpoint(endpoint, expire_time);
         endpoint_state_map[endpoint] = eps;
         // ensure at least one gossip round occurs before returning
-        sleep(INTERVAL * 2).get();
+        sleep(_interval * 2).get();
     });
 }
 
@@ -921,7 +1030,7 @@ future<> gossiper::assassinate_endpoint(sstring address) {
             //auto expire_time = gossiper.compute_expire_time();
             //ep_state.add_application_state(application_state::STATUS, storage_service_value_factory().left(tokens_set, expire_time.time_since_epoch().count()));
             gossiper.handle_major_state_change(endpoint, ep_state);
-            sleep(INTERVAL * 4).get();
+            sleep(gossiper.interval() * 4).get();
             logger.warn("Finished assassinating {}", endpoint);
         });
     });
@@ -1187,6 +1296,7 @@ void gossiper::real_mark_alive(inet_address addr, endpoint_state& local_state) {
 // Runs inside seastar::async context
 void gossiper::mark_dead(inet_address addr, endpoint_state& local_state) {
     logger.trace("marking as down {}", addr);
+    _peer_digests.erase(addr);
     local_state.mark_dead();
     _live_endpoints.erase(addr);
     _live_endpoints_just_added.remove(addr);
@@ -1222,6 +1332,8 @@ void gossiper::handle_major_state_change(inet_address ep, const endpoint_state&
     }
 
     if (eps_old) {
+        // it restarted knowing nothing.
+        _peer_digests.erase(ep);
         // the node restarted: it is up to the subscriber to take whatever action is necessary
         _subscribers.for_each([ep, eps_old] (auto& subscriber) {
             subscriber->on_restart(ep, *eps_old);
@@ -1424,7 +1536,10 @@ future<> gossiper::start_gossiping(int generation_nbr, std::map<application_stat
             logger.trace("gossip started with generation {}", generation);
             _enabled = true;
             _nr_run = 0;
-            _scheduled_gossip_task.arm(INTERVAL);
+            _scheduled_gossip_task.arm(_interval);
+            if (_ping_interval.count() > 0) {
+                _ping_timer.arm(_ping_interval);
+            }
             return make_ready_future<>();
         });
             return make_ready_future<>();
@@ -1573,6 +1688,7 @@ future<> gossiper::do_stop_gossiping() {
             logger.warn("No local state or state is in silent shutdown, not announcing shutdown");
         }
         _scheduled_gossip_task.cancel();
+        _ping_timer.cancel();
         timer_callback_lock().get();
         //
         // Release the timer semaphore since storage_proxy may be waiting for
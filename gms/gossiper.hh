@@ -54,6 +54,7 @@
 #include <algorithm>
 #include <chrono>
 #include <set>
+#include <unordered_map>
 #include <seastar/core/condition-variable.hh>
 #include <seastar/core/metrics_registration.hh>
 #include <random>
@@ -69,7 +70,7 @@ class i_failure_detector;
 
 /**
  * This module is responsible for Gossiping information for the local endpoint. This abstraction
- * maintains the list of live and dead endpoints. Periodically i.e. every 1 second this module
+ * maintains the list of live and dead endpoints. Periodically i.e. every interval (1 second by default) this module
  * chooses a random node and initiates a round of Gossip with it. A round of Gossip involves 3
  * rounds of messaging. For instance if node A wants to initiate a round of Gossip with node B
  * it starts off by sending node B a GossipDigestSynMessage. Node B on receipt of this message
@@ -95,11 +96,42 @@ private:
     future<> handle_ack_msg(msg_addr from, gossip_digest_ack ack_msg);
     future<> handle_ack2_msg(gossip_digest_ack2 msg);
     future<> handle_echo_msg();
+    future<> handle_ping_msg();
+    void ping_peers();
     future<> handle_shutdown_msg(inet_address from);
     static constexpr uint32_t _default_cpuid = 0;
     msg_addr get_msg_addr(inet_address to);
     void do_sort(std::vector<gossip_digest>& g_digest_list);
     timer<lowres_clock> _scheduled_gossip_task;
+    // The period of the gossip rounds.
+    std::chrono::milliseconds _interval = INTERVAL;
+    // Every live peer is also pinged directly this often, 0 to rely on the
+    // gossip rounds alone. A reply counts as a heartbeat for the failure
+    // detector, and a peer missing this many pings in a row is convicted
+    // without waiting for its phi to grow.
+    std::chrono::milliseconds _ping_interval{100};
+    unsigned _ping_misses_to_convict = 3;
+    timer<lowres_clock> _ping_timer;
+    std::unordered_map<inet_address, unsigned> _missed_pings;
+    uint64_t _pings = 0;
+    uint64_t _missed_pings_total = 0;
+    uint64_t _ping_convictions = 0;
+    // What the SYNs to a peer told it, so that the next ones carry only the
+    // digests which changed since it acknowledged them. Every
+    // _full_digest_rounds-th SYN to a peer carries them all, making up for
+    // lost messages and for what it heard from others meanwhile.
+    struct peer_digests {
+        using versions = std::unordered_map<inet_address, std::pair<int32_t, int32_t>>;
+        versions _acked;
+        versions _sent;
+        unsigned _syns = 0;
+    };
+    std::unordered_map<inet_address, peer_digests> _peer_digests;
+    unsigned _full_digest_rounds = 10;
+    uint64_t _sent_digests = 0;
+    uint64_t _omitted_digests = 0;
+    uint64_t _last_round_bytes = 0;
+    gossip_digest_syn delta_syn(inet_address to, const gossip_digest_syn& message);
     bool _enabled = false;
     std::set<inet_address> _seeds_from_config;
     sstring _cluster_name;
@@ -113,6 +145,13 @@ public:
         return utils::fb_utilities::get_broadcast_address();
     }
     void set_cluster_name(sstring name);
+    std::chrono::milliseconds interval() const { return _interval; }
+    // Before the gossip starts: the period of the rounds, and the initial
+    // heartbeat interval of the failure detector follows it.
+    void set_interval(std::chrono::milliseconds interval);
+    void set_ping_interval(std::chrono::milliseconds interval, unsigned misses_to_convict);
+    // 0 or 1 sends every digest in every SYN.
+    void set_full_digest_rounds(unsigned rounds) { _full_digest_rounds = rounds; }
     std::set<inet_address> get_seeds();
     void set_seeds(std::set<inet_address> _seeds);
 public:
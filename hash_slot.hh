@@ -0,0 +1,59 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#pragma once
+#include "utils/crc16.hh"
+#include <cstddef>
+namespace redis {
+
+// The hash slots of Redis Cluster, which the ring hands out whole.
+static constexpr unsigned cluster_slots = 16384;
+
+// The hash tag of a key, the part between the first `{` and the next `}`
+// when not empty: the keys sharing one hash to the same slot and shard.
+inline bool key_hash_tag(const char* key, size_t size, size_t& start, size_t& length)
+{
+    size_t open = 0;
+    for (; open < size && key[open] != '{'; ++open) {
+    }
+    if (open == size) {
+        return false;
+    }
+    size_t close = open + 1;
+    for (; close < size && key[close] != '}'; ++close) {
+    }
+    if (close == size || close == open + 1) {
+        return false;
+    }
+    start = open + 1;
+    length = close - open - 1;
+    return true;
+}
+
+// The slot of a key: CRC16 of its hash tag, else of the whole key.
+inline unsigned key_hash_slot(const char* key, size_t size)
+{
+    size_t start, length;
+    if (key_hash_tag(key, size, start, length)) {
+        return utils::crc16(key + start, length) & (cluster_slots - 1);
+    }
+    return utils::crc16(key, size) & (cluster_slots - 1);
+}
+}
@@ -0,0 +1,338 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#include "hints.hh"
+#include "snapshot.hh"
+#include "store/checked_file_impl.hh"
+#include "store/log_format.hh"
+#include "store/util/coding.hh"
+#include "store/util/crc32c.hh"
+#include "utils/disk-error-handler.hh"
+#include "core/future-util.hh"
+#include "core/reactor.hh"
+#include "core/sleep.hh"
+#include "util/log.hh"
+#include <algorithm>
+#include <cstdlib>
+#include <tuple>
+namespace redis {
+
+using logger = seastar::logger;
+static logger hints_log ("hints");
+
+static const sstring hints_prefix = "hints-";
+// The hints are framed with the short header, whose length takes two bytes.
+static constexpr size_t max_hint_size = 0xffff;
+
+// The hint framed as a record of the commit log with the short header,
+// empty when the command is too large for one.
+static bytes make_hint_frame(const hint_manager::command& cmd)
+{
+    bytes payload;
+    store::put_varint32(payload, cmd.size());
+    for (auto& arg : cmd) {
+        store::put_length_prefixed_slice(payload, bytes_view { arg.data(), arg.size() });
+    }
+    if (payload.size() > max_hint_size) {
+        return bytes {};
+    }
+    bytes frame;
+    store::put_fixed32(frame, store::crc32c::mask(store::crc32c::value(payload.data(), payload.size())));
+    const char length_type[3] = { static_cast<char>(payload.size() & 0xff), static_cast<char>(payload.size() >> 8), static_cast<char>(store::record_type::full) };
+    frame.append(length_type, sizeof(length_type));
+    frame.append(payload.data(), payload.size());
+    return frame;
+}
+
+enum class frame_status { ok, incomplete, corrupt };
+
+// The hint at the start of data, and the bytes of its frame.
+static frame_status parse_hint_frame(const char* data, size_t size, hint_manager::command& cmd, size_t& frame_size)
+{
+    if (size < store::SHORT_HEADER_SIZE) {
+        return frame_status::incomplete;
+    }
+    size_t length = static_cast<uint8_t>(data[4]) | (static_cast<uint8_t>(data[5]) << 8);
+    if (data[6] != static_cast<char>(store::record_type::full)) {
+        return frame_status::corrupt;
+    }
+    if (size < store::SHORT_HEADER_SIZE + length) {
+        return frame_status::incomplete;
+    }
+    auto payload = data + store::SHORT_HEADER_SIZE;
+    if (store::crc32c::unmask(store::decode_fixed32(data)) != store::crc32c::value(payload, length)) {
+        return frame_status::corrupt;
+    }
+    bytes_view in { payload, length };
+    uint32_t count = 0;
+    if (!store::get_varint32(in, count)) {
+        return frame_status::corrupt;
+    }
+    cmd.clear();
+    cmd.reserve(count);
+    for (uint32_t i = 0; i < count; ++i) {
+        bytes_view arg;
+        if (!store::get_length_prefixed_slice(in, arg)) {
+            return frame_status::corrupt;
+        }
+        cmd.emplace_back(arg.data(), arg.size());
+    }
+    frame_size = store::SHORT_HEADER_SIZE + length;
+    return frame_status::ok;
+}
+
+lw_shared_ptr<hint_manager::endpoint_hints> hint_manager::hints_of(const gms::inet_address& addr)
+{
+    auto& h = _endpoints[addr];
+    if (!h) {
+        h = make_lw_shared<endpoint_hints>();
+    }
+    return h;
+}
+
+sstring hint_manager::segment_name(const gms::inet_address& addr)
+{
+    return hints_prefix + to_sstring(engine().cpu_id()) + "-" + addr.to_sstring() + "-" + to_sstring(_next_number++) + ".log";
+}
+
+future<> hint_manager::start()
+{
+    // "hints-<shard>-<endpoint>-<number>.log", replayed in the order of their
+    // numbers.
+    auto prefix = hints_prefix + to_sstring(engine().cpu_id()) + "-";
+    return open_checked_directory(commit_error_handler, ".").then([prefix] (file dir) {
+        auto names = make_lw_shared<std::vector<sstring>>();
+        auto listing = make_lw_shared<subscription<directory_entry>>(dir.list_directory([names, prefix] (directory_entry de) {
+            auto& n = de.name;
+            if (n.size() > prefix.size() + 4 && std::equal(prefix.begin(), prefix.end(), n.begin()) && n.find(".log") == n.size() - 4) {
+                names->emplace_back(n);
+            }
+            return make_ready_future<>();
+        }));
+        return listing->done().then([names, dir, listing] () mutable {
+            return dir.close();
+        }).then([names] {
+            return std::move(*names);
+        });
+    }).then([this, prefix] (std::vector<sstring> names) {
+        using found_type = std::vector<std::tuple<uint64_t, gms::inet_address, lw_shared_ptr<segment>>>;
+        return do_with(std::move(names), found_type {}, [this, prefix] (auto& names, auto& found) {
+            return do_for_each(names, [this, prefix, &found] (auto& name) {
+                // "<endpoint>-<number>"
+                auto rest = name.substr(prefix.size(), name.size() - prefix.size() - 4);
+                auto dash = rest.find_last_of('-');
+                if (dash == sstring::npos) {
+                    return make_ready_future<>();
+                }
+                gms::inet_address addr { rest.substr(0, dash) };
+                auto number = std::strtoull(rest.c_str() + dash + 1, nullptr, 10);
+                _next_number = std::max<uint64_t>(_next_number, number + 1);
+                return open_checked_file_dma(commit_error_handler, name, open_flags::ro).then([name, addr, number, &found] (file f) {
+                    return f.size().then([name, addr, number, &found] (uint64_t size) {
+                        auto s = make_lw_shared<segment>();
+                        s->_name = name;
+                        s->_size = size;
+                        found.emplace_back(number, addr, s);
+                    }).finally([f] () mutable {
+                        return f.close();
+                    });
+                });
+            }).then([this, &found] {
+                std::sort(found.begin(), found.end(), [] (auto& a, auto& b) {
+                    return std::get<0>(a) < std::get<0>(b);
+                });
+                for (auto& e : found) {
+                    auto h = hints_of(std::get<1>(e));
+                    auto& s = std::get<2>(e);
+                    h->_segments.push_back(s);
+                    h->_bytes += s->_size;
+                    _stats._bytes += s->_size;
+                }
+                if (!found.empty()) {
+                    hints_log.info("found {} segments of hints, {} bytes", found.size(), _stats._bytes);
+                }
+            });
+        });
+    });
+}
+
+void hint_manager::store(const gms::inet_address& addr, const command& cmd)
+{
+    auto frame = make_hint_frame(cmd);
+    auto h = hints_of(addr);
+    auto size = frame.size();
+    if (_stopping || size == 0 || h->_bytes + size > _options._max_bytes_per_endpoint) {
+        ++_stats._dropped;
+        return;
+    }
+    // counted now, so that the hints in flight keep to the cap too.
+    h->_bytes += size;
+    _stats._bytes += size;
+    with_gate(_gate, [this, addr, h, frame = std::move(frame)] () mutable {
+        return with_semaphore(h->_lock, 1, [this, addr, h, frame = std::move(frame)] () mutable {
+            return write(addr, h, std::move(frame));
+        });
+    }).handle_exception([this, addr, h, size] (std::exception_ptr ep) {
+        h->_bytes -= size;
+        _stats._bytes -= size;
+        ++_stats._dropped;
+        hints_log.warn("failed to write a hint for {}: {}", addr, ep);
+    });
+}
+
+future<> hint_manager::write(const gms::inet_address& addr, lw_shared_ptr<endpoint_hints> h, bytes frame)
+{
+    auto open = make_ready_future<>();
+    if (!h->_out) {
+        auto s = make_lw_shared<segment>();
+        s->_name = segment_name(addr);
+        open = open_checked_file_dma(commit_error_handler, s->_name, open_flags::wo | open_flags::create | open_flags::truncate).then([h, s] (file f) {
+            h->_out.emplace(make_file_output_stream(std::move(f)));
+            h->_current = s;
+        });
+    }
+    return open.then([this, h, frame = std::move(frame)] () mutable {
+        h->_current->_size += frame.size();
+        return do_with(std::move(frame), [h] (bytes& frame) {
+            return h->_out->write(frame.data(), frame.size());
+        }).then([this, h] {
+            ++_stats._written;
+            if (h->_current->_size >= _options._segment_size) {
+                return close_current(h);
+            }
+            return make_ready_future<>();
+        });
+    });
+}
+
+future<> hint_manager::close_current(lw_shared_ptr<endpoint_hints> h)
+{
+    if (!h->_out) {
+        return make_ready_future<>();
+    }
+    // closing the stream writes its last buffer and syncs the file.
+    return h->_out->close().then([h] {
+        h->_out = std::experimental::nullopt;
+        h->_segments.push_back(std::move(h->_current));
+        h->_current = nullptr;
+    });
+}
+
+void hint_manager::replay(const gms::inet_address& addr)
+{
+    auto i = _endpoints.find(addr);
+    if (_stopping || i == _endpoints.end() || i->second->_replaying || i->second->_bytes == 0) {
+        return;
+    }
+    auto h = i->second;
+    h->_replaying = true;
+    with_gate(_gate, [this, addr, h] {
+        return with_semaphore(h->_lock, 1, [this, h] {
+            return close_current(h);
+        }).then([this, addr, h] {
+            return do_until([this, h] { return _stopping || h->_segments.empty(); }, [this, addr, h] {
+                return replay_segment(addr, h, h->_segments.front());
+            });
+        });
+    }).then_wrapped([this, addr, h] (future<> f) {
+        h->_replaying = false;
+        try {
+            f.get();
+        } catch (...) {
+            ++_stats._failed_replays;
+            hints_log.info("the replay of the hints for {} stopped, {} bytes are left: {}", addr, h->_bytes, std::current_exception());
+        }
+    });
+}
+
+future<> hint_manager::replay_segment(const gms::inet_address& addr, lw_shared_ptr<endpoint_hints> h, lw_shared_ptr<segment> s)
+{
+    auto start = std::chrono::steady_clock::now();
+    // the offset of the data passed next, and the bytes sent so far.
+    auto position = make_lw_shared<size_t>(0);
+    auto sent = make_lw_shared<size_t>(0);
+    return read_file_in_chunks(s->_name, [this, addr, s, start, position, sent] (const char* data, size_t size) {
+        return do_with(size_t(0), command {}, [this, addr, s, start, position, sent, data, size] (size_t& consumed, command& cmd) {
+            return repeat([this, addr, s, start, position, sent, data, size, &consumed, &cmd] {
+                if (_stopping) {
+                    return make_exception_future<stop_iteration>(std::runtime_error("stopping"));
+                }
+                size_t frame_size = 0;
+                auto status = parse_hint_frame(data + consumed, size - consumed, cmd, frame_size);
+                if (status == frame_status::incomplete) {
+                    return make_ready_future<stop_iteration>(stop_iteration::yes);
+                }
+                if (status == frame_status::corrupt) {
+                    return make_exception_future<stop_iteration>(corrupt_snapshot("a hint does not pass its checksum"));
+                }
+                auto end = *position + consumed + frame_size;
+                consumed += frame_size;
+                if (end <= s->_replayed) {
+                    // sent by an earlier replay which failed further on.
+                    return make_ready_future<stop_iteration>(stop_iteration::no);
+                }
+                return _sender(addr, std::move(cmd)).then([this, s, start, sent, end, frame_size] {
+                    s->_replayed = end;
+                    ++_stats._replayed;
+                    *sent += frame_size;
+                    if (_options._replay_bytes_per_second == 0) {
+                        return make_ready_future<stop_iteration>(stop_iteration::no);
+                    }
+                    auto due = start + std::chrono::microseconds(*sent * 1000000 / _options._replay_bytes_per_second);
+                    auto now = std::chrono::steady_clock::now();
+                    if (due <= now) {
+                        return make_ready_future<stop_iteration>(stop_iteration::no);
+                    }
+                    return sleep(due - now).then([] {
+                        return stop_iteration::no;
+                    });
+                });
+            }).then([position, &consumed] {
+                *position += consumed;
+                return consumed;
+            });
+        });
+    }).then_wrapped([this, h, s] (future<> f) {
+        try {
+            f.get();
+        } catch (corrupt_snapshot&) {
+            // the node stopped before the segment was closed.
+            hints_log.warn("the hints of {} past {} bytes are lost", s->_name, s->_replayed);
+        }
+        h->_segments.pop_front();
+        h->_bytes -= s->_size;
+        _stats._bytes -= s->_size;
+        return remove_file(s->_name);
+    });
+}
+
+future<> hint_manager::stop()
+{
+    _stopping = true;
+    return _gate.close().then([this] {
+        return parallel_for_each(_endpoints, [this] (auto& e) {
+            auto h = e.second;
+            return with_semaphore(h->_lock, 1, [this, h] {
+                return close_current(h);
+            });
+        });
+    });
+}
+}
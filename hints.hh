@@ -0,0 +1,124 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#pragma once
+#include "core/fstream.hh"
+#include "core/future.hh"
+#include "core/gate.hh"
+#include "core/semaphore.hh"
+#include "core/shared_ptr.hh"
+#include "core/sstring.hh"
+#include "gms/inet_address.hh"
+#include "utils/bytes.hh"
+#include <chrono>
+#include <deque>
+#include <experimental/optional>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+namespace redis {
+
+struct hint_options {
+    // The hints to one endpoint take at most this many bytes of disk, the
+    // writes it misses past them are left to repair. 0 disables the hints.
+    size_t _max_bytes_per_endpoint = 64 * 1024 * 1024;
+    // Hints go to segment files of about this size, a segment is replayed
+    // once it is closed.
+    size_t _segment_size = 1024 * 1024;
+    // The replay sends at most this many bytes of hints a second to the
+    // endpoint, so that it serves its clients meanwhile.
+    size_t _replay_bytes_per_second = 1024 * 1024;
+};
+
+struct hint_stats {
+    uint64_t _written = 0;
+    // Writes not hinted, as the hints of their endpoint are full.
+    uint64_t _dropped = 0;
+    uint64_t _replayed = 0;
+    uint64_t _failed_replays = 0;
+    uint64_t _bytes = 0;
+};
+
+// The writes a replica misses while the failure detector sees it down, kept
+// per endpoint in segment files of this shard and sent to it once it is
+// alive again, so that a short outage costs neither the writes nor a repair.
+// A hint is framed as a record of the commit log, its checksum, length and
+// type, followed by the command: the count of its arguments, then each of
+// them length prefixed.
+//
+// "hints-<shard>-<endpoint>-<number>.log"
+//
+// A replica applies the hints after the writes it received since it came
+// back, the commands which do not commute, such as INCR after SET, may then
+// leave it apart from the others until the next repair.
+class hint_manager {
+public:
+    using command = std::vector<bytes>;
+    // Sends the command to the endpoint, fails unless it applied it.
+    using sender_type = std::function<future<> (const gms::inet_address&, command)>;
+private:
+    struct segment {
+        sstring _name;
+        size_t _size = 0;
+        // The bytes already replayed, skipped when a failed replay resumes.
+        size_t _replayed = 0;
+    };
+    struct endpoint_hints {
+        // Closed, oldest first.
+        std::deque<lw_shared_ptr<segment>> _segments;
+        lw_shared_ptr<segment> _current;
+        std::experimental::optional<output_stream<char>> _out;
+        size_t _bytes = 0;
+        bool _replaying = false;
+        // Writes, rotations and the replay take the segments in turn.
+        semaphore _lock { 1 };
+    };
+    hint_options _options;
+    hint_stats _stats;
+    sender_type _sender;
+    std::unordered_map<gms::inet_address, lw_shared_ptr<endpoint_hints>> _endpoints;
+    uint64_t _next_number = 0;
+    bool _stopping = false;
+    seastar::gate _gate;
+
+    lw_shared_ptr<endpoint_hints> hints_of(const gms::inet_address& addr);
+    sstring segment_name(const gms::inet_address& addr);
+    // Closes the segment being written, it can then be replayed.
+    future<> close_current(lw_shared_ptr<endpoint_hints> h);
+    future<> write(const gms::inet_address& addr, lw_shared_ptr<endpoint_hints> h, bytes frame);
+    future<> replay_segment(const gms::inet_address& addr, lw_shared_ptr<endpoint_hints> h, lw_shared_ptr<segment> s);
+public:
+    hint_manager(hint_options options, sender_type sender) : _options(options), _sender(std::move(sender)) {}
+    hint_manager(const hint_manager&) = delete;
+    hint_manager& operator = (const hint_manager&) = delete;
+
+    bool enabled() const { return _options._max_bytes_per_endpoint > 0; }
+    // Finds the hints left by earlier runs of this shard.
+    future<> start();
+    // Keeps the command for the endpoint. A hint is written in the
+    // background, it is lost if the node stops before its segment is closed.
+    void store(const gms::inet_address& addr, const command& cmd);
+    // The endpoint is alive again: its hints are sent to it in the
+    // background, and those it did not take are kept for the next time.
+    void replay(const gms::inet_address& addr);
+    const hint_stats& stats() const { return _stats; }
+    future<> stop();
+};
+}
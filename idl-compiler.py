@@ -39,6 +39,19 @@ SERIALIZER = 'serialize'
 DESERIALIZER = 'deserialize'
 SETSIZE = 'set_size'
 SIZETYPE = 'size_type'
+# The integral types written as they are, and how: bool goes as an int8_t.
+FIXED_SIZE_TYPES = {
+    'bool' : ('int8_t', 1),
+    'int8_t' : ('int8_t', 1),
+    'uint8_t' : ('uint8_t', 1),
+    'int16_t' : ('int16_t', 2),
+    'uint16_t' : ('uint16_t', 2),
+    'int' : ('int32_t', 4),
+    'int32_t' : ('int32_t', 4),
+    'uint32_t' : ('uint32_t', 4),
+    'int64_t' : ('int64_t', 8),
+    'uint64_t' : ('uint64_t', 8),
+}
 
 parser = argparse.ArgumentParser(description="""Generate serializer helper function""")
 
@@ -173,12 +186,13 @@ def declare_class(hout, name, ns_open, ns_close):
     clas_def = ns_open + name + ";" + ns_close
     fprintln(hout, "\n", clas_def)
 
-def declear_methods(hout, name, template_param = ""):
+def declear_methods(hout, name, template_param = "", size = None):
     if config.ns != '':
         fprintln(hout, "namespace ", config.ns, " {")
+    fixed = "\n  static constexpr size_t fixed_size = %d;\n" % size if size else ""
     fprintln(hout, Template("""
 template <$tmp_param>
-struct serializer<$name> {
+struct serializer<$name> {$fixed
   template <typename Output>
   static void write(Output& buf, const $name& v);
 
@@ -188,7 +202,7 @@ struct serializer<$name> {
   template <typename Input>
   static void skip(Input& buf);
 };
-""").substitute({'name' : name, 'sizetype' : SIZETYPE, 'tmp_param' : template_param }))
+""").substitute({'name' : name, 'sizetype' : SIZETYPE, 'tmp_param' : template_param, 'fixed' : fixed }))
     if config.ns != '':
         fprintln(hout, "}")
 
@@ -285,6 +299,23 @@ def get_members(cls):
 
 def is_final(cls):
     return "final" in cls
+
+# A final class of integral members only is serialized in fixed_size()
+# bytes, copied in one go rather than member by member, and skipped
+# without being read. None for other classes.
+def fixed_size(cls):
+    if not is_final(cls) or "template" in cls:
+        return None
+    members = get_members(cls)
+    if not members:
+        return None
+    size = 0
+    for m in members:
+        typ = param_type(m["type"])
+        if typ not in FIXED_SIZE_TYPES or "attribute" in m:
+            return None
+        size += FIXED_SIZE_TYPES[typ][1]
+    return size
 def get_variant_type(lst):
     if is_variant(lst):
         return "variant"
@@ -865,8 +896,12 @@ def handle_class(cls, hout, cout, namespaces=[], parent_template_param = []):
             handle_class(param, hout, cout, namespaces + [cls["name"] + template_class_param], parent_template_param + template_param_list)
         elif is_enum(param):
             handle_enum(param, hout, cout, namespaces + [cls["name"] + template_class_param], parent_template_param + template_param_list)
-    declear_methods(hout, name + template_class_param, temp_def)
+    size = fixed_size(cls)
+    declear_methods(hout, name + template_class_param, temp_def, size)
     is_final = "final" in cls
+    if size:
+        handle_fixed_size_class(cls, cout, name, size)
+        return
 
     fprintln(cout, Template("""
 $template
@@ -928,6 +963,46 @@ void serializer<$name$temp_param>::skip(Input& buf) {
     fprintln(cout, """ });\n}""")
 
 
+def handle_fixed_size_class(cls, cout, name, size):
+    members = get_members(cls)
+    fprintln(cout, Template("""
+template <typename Output>
+void serializer<$name>::write(Output& buf, const $name& obj) {
+  char run[$size];
+  auto p = run;""").substitute({'name' : name, 'size' : size}))
+    for m in members:
+        typ = param_type(m["type"])
+        fprintln(cout, Template("""  static_assert(is_equivalent<decltype(obj.$var), $type>::value, "member value has a wrong type");
+  {
+    auto v = cpu_to_le($wire(obj.$var));
+    std::memcpy(p, &v, sizeof(v));
+    p += sizeof(v);
+  }""").substitute({'var' : m["name"], 'type' : typ, 'wire' : FIXED_SIZE_TYPES[typ][0]}))
+    fprintln(cout, """  buf.write(run, sizeof(run));
+}""")
+    fprintln(cout, Template("""
+template <typename Input>
+$name serializer<$name>::read(Input& buf) {
+  char run[$size];
+  buf.read(run, sizeof(run));
+  auto p = run;""").substitute({'name' : name, 'size' : size}))
+    params = []
+    for index, m in enumerate(members):
+        typ = param_type(m["type"])
+        local = "__local_" + str(index)
+        fprintln(cout, Template("""  $wire $local;
+  std::memcpy(&$local, p, sizeof($local));
+  p += sizeof($local);""").substitute({'wire' : FIXED_SIZE_TYPES[typ][0], 'local' : local}))
+        params.append("%s(le_to_cpu(%s))" % (typ, local))
+    fprintln(cout, Template("""  $name res {$params};
+  return res;
+}""").substitute({'name' : name, 'params' : ", ".join(params)}))
+    fprintln(cout, Template("""
+template <typename Input>
+void serializer<$name>::skip(Input& buf) {
+  buf.skip($size);
+}""").substitute({'name' : name, 'size' : size}))
+
 def handle_objects(tree, hout, cout, namespaces=[]):
     for obj in tree:
         if is_class(obj):
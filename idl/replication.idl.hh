@@ -0,0 +1,42 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+
+namespace redis {
+
+class replication_cursor final {
+    uint64_t offset;
+    uint32_t shards;
+};
+
+class replication_pull_reply {
+    bytes replication_id;
+    redis::replication_cursor cursor;
+    bytes frames;
+};
+
+class replication_dc_pull_reply {
+    bytes replication_id;
+    redis::replication_cursor cursor;
+    uint64_t read_bytes;
+    bytes frames;
+};
+
+}
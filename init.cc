@@ -42,7 +42,8 @@ future<> init_message_failuredetector_gossiper(sstring listen_address
                 , sstring seeds_str 
                 , sstring cluster_name
                 , double phi
-                , bool sltba)
+                , bool sltba
+                , uint16_t shard_aware_storage_port)
 {
     const gms::inet_address listen(listen_address);
 
@@ -64,6 +65,8 @@ future<> init_message_failuredetector_gossiper(sstring listen_address
         cw = compress_what::all;
     } else if (ms_compress == "dc") {
         cw = compress_what::dc;
+    } else if (ms_compress == "gossip") {
+        cw = compress_what::gossip;
     }
 
     auto tndw = netw::messaging_service::tcp_nodelay_what::all;
@@ -86,7 +89,7 @@ future<> init_message_failuredetector_gossiper(sstring listen_address
     // Init messaging_service
     // Delay listening messaging_service until gossip message handlers are registered
     bool listen_now = false;
-    netw::get_messaging_service().start(listen, storage_port, ew, cw, tndw, ssl_storage_port, creds, sltba, listen_now).get();
+    netw::get_messaging_service().start(listen, storage_port, ew, cw, tndw, ssl_storage_port, creds, sltba, listen_now, shard_aware_storage_port).get();
 
     // #293 - do not stop anything
     //engine().at_exit([] { return netw::get_messaging_service().stop(); });
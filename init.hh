@@ -171,4 +171,5 @@ future<> init_message_failuredetector_gossiper(sstring listen_address
                 , sstring seeds 
                 , sstring cluster_name = "Test Cluster"
                 , double phi = 8
-                , bool sltba = false);
+                , bool sltba = false
+                , uint16_t shard_aware_storage_port = 0);
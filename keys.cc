@@ -1,7 +1,18 @@
 #include "keys.hh"
 namespace redis {
 decorated_key to_decorated_key(const redis_key& rk) {
-    //mock now.
-    return decorated_key();
+    return decorated_key { managed_bytes(rk.key()), token::from_bytes(rk.key()) };
+}
+
+int tri_compare(const decorated_key& l, const decorated_key& r) {
+    auto c = tri_compare(l._token, r._token);
+    if (c != 0) {
+        return c;
+    }
+    return l.key_view().compare(r.key_view());
+}
+
+bool operator == (const decorated_key& l, const decorated_key& r) {
+    return tri_compare(l, r) == 0;
 }
 }
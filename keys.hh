@@ -2,6 +2,7 @@
 #include "utils/bytes.hh"
 #include "core/reactor.hh"
 #include "token.hh"
+#include "shard_slot.hh"
 #include "utils/managed_bytes.hh"
 namespace redis {
 struct decorated_key {
@@ -35,6 +36,8 @@ struct redis_key {
     bytes _key;
     size_t _hash;
     redis_key(bytes key) : _key(std::move(key)), _hash(std::hash<bytes>()(_key)) {}
+    // With the hash already known, see request_wrapper::key_hash().
+    redis_key(bytes key, size_t hash) : _key(std::move(key)), _hash(hash) {}
     redis_key& operator = (const redis_key& o) {
         if (this != &o) {
             _key = o._key;
@@ -42,7 +45,7 @@ struct redis_key {
         }
         return *this;
     }
-    inline unsigned get_cpu() const { return _hash % smp::count; }
+    inline unsigned get_cpu() const { return shard_of_key(bytes_view { _key.data(), _key.size() }, _hash, smp::count); }
     inline const size_t hash() const { return _hash; }
     inline const bytes& key() const { return _key; }
     inline const uint32_t size() const { return _key.size(); }
@@ -50,4 +53,6 @@ struct redis_key {
 };
 
 decorated_key to_decorated_key(const redis_key& rk);
+// Orders keys by token, then bytewise.
+int tri_compare(const decorated_key& l, const decorated_key& r);
 }
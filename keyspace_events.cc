@@ -0,0 +1,120 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#include "keyspace_events.hh"
+#include "pubsub.hh"
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+namespace redis {
+
+constexpr size_t keyspace_events::max_batch;
+constexpr std::chrono::milliseconds keyspace_events::flush_interval;
+
+static constexpr uint32_t all_event_classes = event_generic | event_string | event_expired | event_evicted;
+
+static const std::pair<char, uint32_t> event_flags[] = {
+    { 'K', event_keyspace },
+    { 'E', event_keyevent },
+    { 'g', event_generic },
+    { '$', event_string },
+    { 'x', event_expired },
+    { 'e', event_evicted },
+};
+
+keyspace_events::keyspace_events()
+{
+    _flush_timer.set_callback([this] { flush(); });
+}
+
+bool keyspace_events::parse(const char* flags, size_t size, uint32_t& result)
+{
+    result = 0;
+    for (size_t i = 0; i < size; ++i) {
+        if (flags[i] == 'A') {
+            result |= all_event_classes;
+            continue;
+        }
+        auto f = std::find_if(std::begin(event_flags), std::end(event_flags), [c = flags[i]] (auto& f) { return f.first == c; });
+        if (f == std::end(event_flags)) {
+            return false;
+        }
+        result |= f->second;
+    }
+    return true;
+}
+
+sstring keyspace_events::to_string(uint32_t flags)
+{
+    sstring result;
+    for (auto& f : event_flags) {
+        if (flags & f.second) {
+            result += sstring(1, f.first);
+        }
+    }
+    return result;
+}
+
+void keyspace_events::set_flags(uint32_t flags)
+{
+    _flags = flags;
+    _classes = (flags & (event_keyspace | event_keyevent)) ? flags & all_event_classes : 0;
+    if (_classes == 0) {
+        _flush_timer.cancel();
+        _buffer.clear();
+    }
+}
+
+void keyspace_events::notify(const char* event, const char* key, size_t size)
+{
+    ++_stats._events;
+    _buffer.emplace_back(event, bytes { key, size });
+    if (_buffer.size() >= max_batch) {
+        _flush_timer.cancel();
+        flush();
+    }
+    else if (!_flush_timer.armed()) {
+        _flush_timer.arm(flush_interval);
+    }
+}
+
+// `__keyspace@0__:<key> <event>` and `__keyevent@0__:<event> <key>`, as
+// Redis names them: there is only the database 0.
+void keyspace_events::flush()
+{
+    if (_buffer.empty()) {
+        return;
+    }
+    ++_stats._flushes;
+    std::vector<std::pair<bytes, bytes>> messages;
+    messages.reserve(_buffer.size() * ((_flags & event_keyspace) && (_flags & event_keyevent) ? 2 : 1));
+    for (auto& e : _buffer) {
+        bytes event { e.first, std::strlen(e.first) };
+        if (_flags & event_keyspace) {
+            messages.emplace_back(bytes { "__keyspace@0__:" } + e.second, event);
+        }
+        if (_flags & event_keyevent) {
+            messages.emplace_back(bytes { "__keyevent@0__:" } + event, std::move(e.second));
+        }
+    }
+    _buffer.clear();
+    local_pubsub().publish_batch(std::move(messages));
+}
+}
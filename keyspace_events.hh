@@ -0,0 +1,93 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <utility>
+#include <vector>
+#include "core/sstring.hh"
+#include "core/timer.hh"
+#include "utils/bytes.hh"
+namespace redis {
+using namespace seastar;
+
+// The classes of notify-keyspace-events, by their letters. K and E choose
+// the channels, the others the events published to them.
+enum keyspace_event_class : uint32_t {
+    event_keyspace = 1,       // K: __keyspace@0__:<key>, the event as message
+    event_keyevent = 1 << 1,  // E: __keyevent@0__:<event>, the key as message
+    event_generic = 1 << 2,   // g: del
+    event_string = 1 << 3,    // $: set
+    event_expired = 1 << 4,   // x: expired
+    event_evicted = 1 << 5,   // e: evicted
+};
+
+// Keyspace notifications, as the shard owning a key raises them.
+//
+// An event whose class is disabled costs the test of wants() and nothing
+// else: the owner checks it before it copies the key. The others wait in
+// the buffer of the shard for flush_interval, or until max_batch of them,
+// and are then published together, one batch per shard with a subscriber,
+// see pubsub::publish_batch().
+class keyspace_events {
+public:
+    struct stats {
+        uint64_t _events = 0;
+        uint64_t _flushes = 0;
+    };
+    static constexpr size_t max_batch = 1024;
+    static constexpr std::chrono::milliseconds flush_interval { 1 };
+private:
+    uint32_t _flags = 0;
+    // The event classes raised, none unless a channel is chosen too.
+    uint32_t _classes = 0;
+    std::vector<std::pair<const char*, bytes>> _buffer;
+    timer<> _flush_timer;
+    stats _stats;
+
+    void flush();
+public:
+    keyspace_events();
+    keyspace_events(const keyspace_events&) = delete;
+    keyspace_events& operator = (const keyspace_events&) = delete;
+
+    // The flags of notify-keyspace-events, "KEA" for instance, A standing
+    // for all the classes of events. False on a letter not supported.
+    static bool parse(const char* flags, size_t size, uint32_t& result);
+    static sstring to_string(uint32_t flags);
+
+    void set_flags(uint32_t flags);
+    uint32_t flags() const { return _flags; }
+    bool wants(uint32_t event_class) const
+    {
+        return (_classes & event_class) != 0;
+    }
+    // An event of a class wants(), on the key of the entry.
+    void notify(const char* event, const char* key, size_t size);
+    const stats& get_stats() const { return _stats; }
+};
+
+inline keyspace_events& local_keyspace_events()
+{
+    static thread_local keyspace_events e;
+    return e;
+}
+}
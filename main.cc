@@ -22,9 +22,13 @@
 #include "db.hh"
 #include "redis.hh"
 #include "server.hh"
+#include "unix_socket.hh"
 #include "util/log.hh"
 #include "core/prometheus.hh"
 #include "utils/disk-error-handler.hh"
+#include "store/priority_manager.hh"
+#include <cstdio>
+#include <unistd.h>
 #define PLATFORM "seastar"
 #define VERSION "v1.0"
 #define VERSION_STRING PLATFORM " " VERSION
@@ -46,22 +50,277 @@ int main(int ac, char** av) {
     app.add_options()
         ("port", bpo::value<uint16_t>()->default_value(6379), "Redis server port to listen on")
         ("native_parser", bpo::value<bool>()->default_value(false), "Use native protocol parser")
+        ("reply_flush_bytes", bpo::value<size_t>()->default_value(64 * 1024), "Max bytes of pipelined replies coalesced into one flush, 0 to flush every reply")
+        ("shard_port_base", bpo::value<uint16_t>()->default_value(0), "If non-zero, shard N also listens on shard_port_base + N for cluster-aware clients")
+        ("connection_balancing", bpo::value<std::string>()->default_value("kernel"), "How the connections to port are spread over the shards, one of kernel, connections (to the shard with the fewest) or port (by client port). connections and port apply when one socket accepts for all the shards, with the native stack or where SO_REUSEPORT is not available")
+        ("unixsocket", bpo::value<std::string>()->default_value(""), "If not empty, every shard also accepts the connections to this unix socket, for clients on the same host")
+        ("unixsocketperm", bpo::value<std::string>()->default_value("0"), "Permissions of the unix socket, in octal, 0 to leave them to the umask")
+        ("unixsocket_input_buffer_size", bpo::value<size_t>()->default_value(8192), "Bytes a connection to the unix socket reads at once, into a buffer taken only once data is there")
+        ("max_connection_reply_bytes", bpo::value<size_t>()->default_value(1024 * 1024), "Stop reading requests of a connection while its unwritten replies exceed this")
+        ("max_shard_reply_bytes", bpo::value<size_t>()->default_value(64 * 1024 * 1024), "Stop reading requests of a shard while its unwritten replies exceed this")
+        ("max_pipeline_depth", bpo::value<size_t>()->default_value(1024), "Max unwritten replies per connection")
+        ("pipeline_batch", bpo::value<size_t>()->default_value(64), "Commands a connection parses ahead from one read; the consecutive ones for another shard run there as one task, 1 to disable")
+        ("maxclients", bpo::value<size_t>()->default_value(0), "Max connections of all shards, each taking an even share, 0 for no limit. Those past it are refused with an error")
+        ("timeout", bpo::value<uint32_t>()->default_value(0), "Close the connections idle for this many seconds, 0 to disable. Subscribers and commands in progress are left alone")
+        ("client_output_buffer_hard_limit", bpo::value<size_t>()->default_value(0), "Close a connection whose unwritten replies exceed this many bytes, 0 to disable")
+        ("client_output_buffer_soft_limit", bpo::value<size_t>()->default_value(0), "Close a connection whose unwritten replies exceed this many bytes for client_output_buffer_soft_seconds, 0 to disable")
+        ("busy_lag_us", bpo::value<uint32_t>()->default_value(0), "Answer the commands on data with -BUSY while the reactor of a shard runs this many microseconds late, 0 to disable")
+        ("max_inflight_requests", bpo::value<size_t>()->default_value(0), "Commands of the connections of a shard in progress at once, past which they wait before reading the next one, 0 for no limit. Blocked commands count too")
+        ("tenant_requests_per_sec", bpo::value<uint64_t>()->default_value(0), "Requests per second all shards take from a tenant, the clients of the same HELLO AUTH user or else of the same name, unless tenant_limit gives its own, 0 for no limit")
+        ("tenant_bytes_per_sec", bpo::value<uint64_t>()->default_value(0), "Bytes of requests per second all shards take from a tenant unless tenant_limit gives its own, 0 for no limit")
+        ("tenant_limit", bpo::value<std::vector<std::string>>()->multitoken()->default_value({}, ""), "The limits of a tenant, as name:requests_per_sec:bytes_per_sec, 0 for no limit")
+        ("client_output_buffer_soft_seconds", bpo::value<uint32_t>()->default_value(60), "How long a connection may stay past client_output_buffer_soft_limit")
+        ("coalesce_reads", bpo::value<bool>()->default_value(false), "Concurrent GETs of a key owned by another shard share one lookup. A GET then may miss a write through another shard acknowledged after the shared lookup was sent")
+        ("hot_key_copies", bpo::value<bool>()->default_value(false), "Cache on every shard the strings of other shards it reads more than hot_key_threshold times per second, until they change. A GET then may miss a write through another shard for as long as the change takes to reach its shard")
+        ("hot_key_threshold", bpo::value<uint64_t>()->default_value(10000), "GETs per second of a key by one shard which make it hot")
+        ("sharded_counter", bpo::value<std::vector<std::string>>()->multitoken()->default_value({}, ""), "Glob-style patterns of the keys whose INCR and DECR add to a cell of the shard of the connection, folded into the owner every counter_fold_ms. Their reply then misses the increments through other shards not yet folded, a GET sees them all")
+        ("counter_fold_ms", bpo::value<uint32_t>()->default_value(100), "Milliseconds between the folds of the cells of sharded counters")
+        ("split_key", bpo::value<std::vector<std::string>>()->multitoken()->default_value({}, ""), "Glob-style patterns of the hashes and sorted sets kept as split_partitions keys spread over the shards by the hash of their fields and members. Only the commands on fields or members, HLEN, HGETALL, HKEYS, HVALS, ZCARD, ZRANGE, ZREVRANGE, DEL and UNLINK are supported on them")
+        ("split_partitions", bpo::value<uint32_t>()->default_value(64), "Partitions of a split key, which must not change while split keys exist")
+        ("trace_capacity", bpo::value<size_t>()->default_value(1024), "Traces of requests sampled by TRACING ON kept by each shard")
+        ("slowlog_log_slower_than", bpo::value<int64_t>()->default_value(10000), "Commands running at least this many microseconds go to the SLOWLOG, negative to disable")
+        ("slowlog_max_len", bpo::value<size_t>()->default_value(128), "Slow commands kept by each shard")
+        ("capture_dir", bpo::value<std::string>()->default_value("."), "Directory of the files of CAPTURE START, one per shard")
+        ("capture_max_mb", bpo::value<size_t>()->default_value(1024), "Megabytes of requests each shard captures at most")
+        ("profile_dir", bpo::value<std::string>()->default_value("."), "Directory of the files of PROFILE START, one per shard")
+        ("notify_keyspace_events", bpo::value<std::string>()->default_value(""), "Keyspace events published, as the flags of notify-keyspace-events: K and E for the channels, g (del), $ (set), x (expired), e (evicted) or A for all of them")
+        ("stall_threshold_us", bpo::value<uint32_t>()->default_value(0), "Log the commands holding the reactor of a shard this many microseconds without yielding, with their key and the size of its collection, and count them by command, 0 to disable")
+        ("alloc_sample_period", bpo::value<uint32_t>()->default_value(0), "Account the allocations of one in this many commands of each shard, on the shard of the connection and on the owner of the key, by command, 0 to disable")
+        ("latency_monitor_threshold", bpo::value<uint32_t>()->default_value(0), "Internal events (rehash, expiry, LSA reclaim, commit log writes and syncs) lasting at least this many milliseconds go to LATENCY, 0 to disable")
+        ("point_shares", bpo::value<unsigned>()->default_value(1000), "Share of the reactor of a shard for single-key commands and small collections")
+        ("heavy_shares", bpo::value<unsigned>()->default_value(200), "Share of the reactor of a shard for the later chunks of large collections and the commands over several collections, while there are single-key commands")
+        ("background_shares", bpo::value<unsigned>()->default_value(100), "Share of the reactor of a shard for expiry, lazy freeing, flushes and snapshots, while there are single-key commands")
+        ("scheduling_period_us", bpo::value<uint32_t>()->default_value(1000), "Period in microseconds over which the shares of the reactor are given")
+        ("maxmemory", bpo::value<size_t>()->default_value(0), "Max bytes of data held by all shards, evicting by maxmemory_policy, 0 for no limit")
+        ("maxmemory_policy", bpo::value<std::string>()->default_value("noeviction"), "How to evict entries, one of noeviction, allkeys-lru, allkeys-lfu, volatile-ttl")
+        ("max_packed_entries", bpo::value<size_t>()->default_value(128), "Hashes and sets up to this many fields are stored packed, 0 to disable")
+        ("max_packed_value", bpo::value<size_t>()->default_value(64), "Hashes and sets with a field longer than this are not stored packed")
+        ("max_intset_entries", bpo::value<size_t>()->default_value(512), "Sets up to this many members, all integers, are stored as sorted arrays of integers, 0 to disable")
+        ("hll_sparse_max_bytes", bpo::value<size_t>()->default_value(3000), "HyperLogLogs are stored sparse up to this many bytes, 0 to disable")
+        ("shared_value_min_bytes", bpo::value<size_t>()->default_value(64 * 1024), "String values of at least this many bytes are kept out of the LSA region and referenced by GET replies instead of copied, 0 to disable")
+        ("compressed_value_min_bytes", bpo::value<size_t>()->default_value(0), "String values of at least this many bytes are held LZ4 compressed in memory when it saves an eighth of them, 0 to disable")
+        ("warm_restart_dir", bpo::value<std::string>()->default_value(""), "Each shard saves its keys in this directory as it stops, and the next process loads them instead of the snapshots: a tmpfs such as /dev/shm, or a DAX mount, makes planned restarts warm. Empty to disable")
+        ("warmup_keys", bpo::value<size_t>()->default_value(0), "With tiered storage, each shard saves its this many most accessed keys as it stops, and the next process reads them back from the store in the background, 0 to disable")
+        ("warmup_rate", bpo::value<size_t>()->default_value(10000), "Keys per second each shard reads back from the store for the warm-up")
+        ("reply_chunk_elements", bpo::value<size_t>()->default_value(4096), "Replies of LRANGE, HGETALL, SMEMBERS and ZRANGE longer than this are streamed in chunks of this many elements, 0 to disable")
+        ("expected_keys", bpo::value<size_t>()->default_value(0), "Keys each shard is expected to hold: its hash table is sized for them at startup instead of growing as they are loaded, 0 to disable")
+        ("memory_reserve", bpo::value<size_t>()->default_value(0), "Bytes of memory each shard faults in for its data at startup, before loading it, 0 to disable")
+        ("commit_log_sync", bpo::value<std::string>()->default_value("everysec"), "When writes reach the disk, one of always (group committed, a write replies after the sync covering it), everysec, no")
+        ("commit_log_segment_size", bpo::value<size_t>()->default_value(32 * 1024 * 1024), "Size of the preallocated commit log segment files")
+        ("commit_log_recycled_segments", bpo::value<size_t>()->default_value(4), "Flushed commit log segments kept for reuse instead of removed")
+        ("volatile_ttl_ms", bpo::value<long>()->default_value(0), "SETs with a TTL shorter than this many milliseconds skip the commit log and the flush to the store: such keys are lost by a restart, are not replicated, and may be lost by an eviction to tiered storage, 0 to disable")
+        ("commit_log_read_ahead", bpo::value<size_t>()->default_value(8 * 1024 * 1024), "Bytes of commit log segments read ahead, in chunks of 1MB, when replaying them at startup and for the replicas tailing them")
+        ("memtable_flush_size", bpo::value<size_t>()->default_value(64 * 1024 * 1024), "Memory used by a memtable before it is written to an sstable")
+        ("block_cache_size", bpo::value<size_t>()->default_value(256 * 1024 * 1024), "Memory of all shards caching sstable blocks")
+        ("sstable_compression", bpo::value<std::string>()->default_value("lz4"), "Codec of the sstable blocks of levels 0 and 1: none, lz4 or deflate")
+        ("sstable_cold_compression", bpo::value<std::string>()->default_value("deflate"), "Codec of the sstable blocks of the deeper levels: none, lz4 or deflate")
+        ("sstable_hash_index", bpo::value<bool>()->default_value(true), "Write a hash index of the keys of every sstable data block, for point lookups")
+        ("sstable_write_buffer_size", bpo::value<size_t>()->default_value(1024 * 1024), "Bytes of the buffers sstables are written with")
+        ("sstable_write_behind", bpo::value<unsigned>()->default_value(4), "Buffers of an sstable being written while the next one fills")
+        ("compaction_throughput", bpo::value<size_t>()->default_value(0), "Bytes per second all shards may write by compactions, 0 for no limit")
+        ("adaptive_compaction", bpo::value<bool>()->default_value(false), "Every second, raise the compaction_throughput of a shard up to 4 times while its compactions or flushes fall behind, and lower it down to a quarter while its lookups reaching the sstables are slower than read_latency_target_us")
+        ("read_latency_target_us", bpo::value<uint32_t>()->default_value(2000), "Average time of the lookups reaching the sstables over which adaptive_compaction slows the compactions down")
+        ("commitlog_io_shares", bpo::value<uint32_t>()->default_value(100), "I/O shares of the commit log writes")
+        ("memtable_flush_io_shares", bpo::value<uint32_t>()->default_value(100), "I/O shares of the memtable flushes")
+        ("write_io_shares", bpo::value<uint32_t>()->default_value(20), "I/O shares of the other writes")
+        ("read_io_shares", bpo::value<uint32_t>()->default_value(20), "I/O shares of the reads of the sstables by lookups")
+        ("compaction_io_shares", bpo::value<uint32_t>()->default_value(100), "I/O shares of the compactions")
+        ("snapshot_io_shares", bpo::value<uint32_t>()->default_value(50), "I/O shares of the snapshots")
+        ("max_subcompactions", bpo::value<unsigned>()->default_value(4), "A large compaction is split into up to this many key ranges merged at once, 1 to disable")
+        ("memory_soft_limit", bpo::value<size_t>()->default_value(0), "Memory of all shards the cache and the memtables may use before a shard flushes its memtable, shrinks its block cache and evicts by maxmemory_policy, 0 for half of the memory")
+        ("memory_hard_limit", bpo::value<size_t>()->default_value(0), "Memory of all shards the cache and the memtables may use before writes wait for a shard to free memory, 0 for three quarters of the memory")
+        ("write_throttle_timeout_ms", bpo::value<unsigned>()->default_value(1000), "How long a write waits for memory past memory_hard_limit before it fails with OOM")
+        ("key_sampling", bpo::value<bool>()->default_value(false), "Walk the keys in the background to find the hottest and largest ones for HOTKEYS and BIGKEYS")
+        ("key_sampling_batch", bpo::value<size_t>()->default_value(1000), "Keys a shard visits every 100ms while walking its keys")
+        ("sampled_keys", bpo::value<size_t>()->default_value(16), "Hottest and largest keys a shard keeps from each walk")
+        ("key_index", bpo::value<bool>()->default_value(false), "Keep the keys of each shard in order as well, so that a SCAN whose pattern starts with literal characters only visits the keys starting with them")
+        ("tiered_storage", bpo::value<bool>()->default_value(false), "Write the strings maxmemory_policy evicts to the store and read them back when their keys are used")
+        ("tiered_hint_bytes", bpo::value<size_t>()->default_value(256 * 1024 * 1024), "Memory of all shards for the filter of the keys evicted to the store")
+        ("fast_shutdown", bpo::value<bool>()->default_value(false), "Exit once every shard has stopped and synced its commit log, without freeing the keys one by one. Connections are dropped as the process exits")
+        ("import_rdb", bpo::value<std::string>()->default_value(""), "Load the keys of this RDB file of Redis at startup, then save a snapshot of every shard")
         ("prometheus_port", bpo::value<uint16_t>()->default_value(10000), "Prometheus server port to listen on")
         ;
 
     return app.run_deprecated(ac, av, [&] {
         engine().at_exit([&] { return server.stop(); });
-        engine().at_exit([&] { return db.stop(); });
+        engine().at_exit([&] {
+            if (!app.configuration()["fast_shutdown"].as<bool>()) {
+                return db.stop();
+            }
+            // every shard has stopped and synced its commit log: the process
+            // exits without destroying the entries one by one, the kernel
+            // takes their memory back at once.
+            return db.invoke_on_all(&redis::database::stop).then([] {
+                main_log.info("fast shutdown, the commit logs are synced");
+                std::fflush(nullptr);
+                ::_exit(0);
+            });
+        });
         engine().at_exit([&] { return prometheus_server.stop(); });
 
         auto&& config = app.configuration();
         auto port = config["port"].as<uint16_t>();
         auto pport = config["prometheus_port"].as<uint16_t>();
-        auto user_native_parser = config["native_parser"].as<bool>();
-        return db.start().then([&, port] {
-            return server.start(port, user_native_parser);
+        redis::server_options options;
+        options._port = port;
+        options._use_native_parser = config["native_parser"].as<bool>();
+        options._reply_flush_bytes = config["reply_flush_bytes"].as<size_t>();
+        options._shard_port_base = config["shard_port_base"].as<uint16_t>();
+        options._connection_balancing = redis::to_connection_balancing(config["connection_balancing"].as<std::string>());
+        options._native_stack = config.count("network-stack") && config["network-stack"].as<std::string>() == "native";
+        if (options._native_stack && options._connection_balancing != redis::connection_balancing::kernel) {
+            // the queue a connection hashes to decides its shard.
+            throw std::invalid_argument("connection_balancing must be kernel on the native stack, see README-DPDK.md");
+        }
+        if (options._native_stack && options._shard_port_base) {
+            // a shard only gets the connections its queue receives, those
+            // to the port of another shard would be reset.
+            throw std::invalid_argument("shard_port_base is not supported on the native stack, see README-DPDK.md");
+        }
+        options._unix_socket = config["unixsocket"].as<std::string>();
+        options._unix_socket_perm = std::stoul(config["unixsocketperm"].as<std::string>(), nullptr, 8);
+        options._unix_input_buffer_size = std::max<size_t>(config["unixsocket_input_buffer_size"].as<size_t>(), 512);
+        options._max_connection_reply_bytes = config["max_connection_reply_bytes"].as<size_t>();
+        options._max_shard_reply_bytes = config["max_shard_reply_bytes"].as<size_t>();
+        options._max_pipeline_depth = config["max_pipeline_depth"].as<size_t>();
+        options._pipeline_batch = std::max<size_t>(config["pipeline_batch"].as<size_t>(), 1);
+        options._max_clients = config["maxclients"].as<size_t>();
+        options._idle_timeout_s = config["timeout"].as<uint32_t>();
+        options._output_hard_limit = config["client_output_buffer_hard_limit"].as<size_t>();
+        options._output_soft_limit = config["client_output_buffer_soft_limit"].as<size_t>();
+        options._output_soft_seconds = config["client_output_buffer_soft_seconds"].as<uint32_t>();
+        options._busy_lag_us = config["busy_lag_us"].as<uint32_t>();
+        options._tenant_defaults._requests_per_sec = config["tenant_requests_per_sec"].as<uint64_t>();
+        options._tenant_defaults._bytes_per_sec = config["tenant_bytes_per_sec"].as<uint64_t>();
+        for (auto& limit : config["tenant_limit"].as<std::vector<std::string>>()) {
+            auto second = limit.rfind(':');
+            auto first = second == std::string::npos || second == 0 ? std::string::npos : limit.rfind(':', second - 1);
+            if (first == std::string::npos) {
+                throw std::invalid_argument("tenant_limit takes name:requests_per_sec:bytes_per_sec");
+            }
+            redis::tenant_limits limits;
+            limits._requests_per_sec = std::stoull(limit.substr(first + 1, second - first - 1));
+            limits._bytes_per_sec = std::stoull(limit.substr(second + 1));
+            auto name = limit.substr(0, first);
+            options._tenant_limits[bytes { name.data(), name.size() }] = limits;
+        }
+        options._max_inflight_requests = config["max_inflight_requests"].as<size_t>();
+        options._coalesce_reads = config["coalesce_reads"].as<bool>();
+        options._hot_key_copies = config["hot_key_copies"].as<bool>();
+        options._hot_key_threshold = config["hot_key_threshold"].as<uint64_t>();
+        for (auto& pattern : config["sharded_counter"].as<std::vector<std::string>>()) {
+            options._sharded_counters.emplace_back(pattern.data(), pattern.size());
+        }
+        for (auto& pattern : config["split_key"].as<std::vector<std::string>>()) {
+            options._split_keys.emplace_back(pattern.data(), pattern.size());
+        }
+        options._split_partitions = std::max(config["split_partitions"].as<uint32_t>(), 1u);
+        options._counter_fold_ms = std::max(config["counter_fold_ms"].as<uint32_t>(), 1u);
+        options._trace_capacity = config["trace_capacity"].as<size_t>();
+        options._slowlog_log_slower_than = config["slowlog_log_slower_than"].as<int64_t>();
+        options._slowlog_max_len = config["slowlog_max_len"].as<size_t>();
+        options._capture_dir = config["capture_dir"].as<std::string>();
+        options._capture_max_bytes = config["capture_max_mb"].as<size_t>() * 1024 * 1024;
+        options._profile_dir = config["profile_dir"].as<std::string>();
+        auto events = config["notify_keyspace_events"].as<std::string>();
+        if (!redis::keyspace_events::parse(events.data(), events.size(), options._notify_keyspace_events)) {
+            throw std::invalid_argument("unknown flag in notify_keyspace_events: " + events);
+        }
+        options._latency_monitor_threshold = config["latency_monitor_threshold"].as<uint32_t>();
+        options._stall_threshold_us = config["stall_threshold_us"].as<uint32_t>();
+        options._alloc_sample_period = config["alloc_sample_period"].as<uint32_t>();
+        options._point_shares = std::max(config["point_shares"].as<unsigned>(), 1u);
+        options._heavy_shares = std::max(config["heavy_shares"].as<unsigned>(), 1u);
+        options._background_shares = std::max(config["background_shares"].as<unsigned>(), 1u);
+        options._scheduling_period_us = std::max(config["scheduling_period_us"].as<uint32_t>(), 100u);
+        redis::database_options db_options;
+        db_options._max_memory = config["maxmemory"].as<size_t>();
+        db_options._eviction_policy = redis::to_eviction_policy(config["maxmemory_policy"].as<std::string>());
+        db_options._max_packed_entries = config["max_packed_entries"].as<size_t>();
+        db_options._max_packed_value = config["max_packed_value"].as<size_t>();
+        db_options._max_intset_entries = config["max_intset_entries"].as<size_t>();
+        db_options._hll_sparse_max_bytes = config["hll_sparse_max_bytes"].as<size_t>();
+        db_options._shared_value_min_bytes = config["shared_value_min_bytes"].as<size_t>();
+        db_options._compressed_value_min_bytes = config["compressed_value_min_bytes"].as<size_t>();
+        db_options._warm_restart_dir = config["warm_restart_dir"].as<std::string>();
+        db_options._warmup_keys = config["warmup_keys"].as<size_t>();
+        db_options._warmup_rate = config["warmup_rate"].as<size_t>();
+        db_options._reply_chunk_elements = config["reply_chunk_elements"].as<size_t>();
+        db_options._expected_keys = config["expected_keys"].as<size_t>();
+        db_options._memory_reserve = config["memory_reserve"].as<size_t>();
+        db_options._commit_log_sync_mode = store::to_commit_log_sync_mode(config["commit_log_sync"].as<std::string>());
+        db_options._commit_log_segment_size = config["commit_log_segment_size"].as<size_t>();
+        db_options._commit_log_recycled_segments = config["commit_log_recycled_segments"].as<size_t>();
+        db_options._commit_log_read_ahead = config["commit_log_read_ahead"].as<size_t>();
+        db_options._volatile_ttl_ms = config["volatile_ttl_ms"].as<long>();
+        db_options._memtable_flush_size = config["memtable_flush_size"].as<size_t>();
+        db_options._block_cache_size = config["block_cache_size"].as<size_t>();
+        db_options._key_sampling = config["key_sampling"].as<bool>();
+        db_options._key_sampling_batch = config["key_sampling_batch"].as<size_t>();
+        db_options._sampled_keys = config["sampled_keys"].as<size_t>();
+        db_options._tiered_storage = config["tiered_storage"].as<bool>();
+        db_options._key_index = config["key_index"].as<bool>();
+        db_options._fast_shutdown = config["fast_shutdown"].as<bool>();
+        db_options._tiered_hint_bytes = config["tiered_hint_bytes"].as<size_t>();
+        db_options._sstable_compression = store::to_compression_type(config["sstable_compression"].as<std::string>());
+        db_options._sstable_cold_compression = store::to_compression_type(config["sstable_cold_compression"].as<std::string>());
+        db_options._sstable_hash_index = config["sstable_hash_index"].as<bool>();
+        db_options._sstable_write_buffer_size = config["sstable_write_buffer_size"].as<size_t>();
+        db_options._sstable_write_behind = config["sstable_write_behind"].as<unsigned>();
+        db_options._compaction_throughput = config["compaction_throughput"].as<size_t>();
+        db_options._max_subcompactions = config["max_subcompactions"].as<unsigned>();
+        db_options._adaptive_compaction = config["adaptive_compaction"].as<bool>();
+        db_options._read_latency_target_us = config["read_latency_target_us"].as<uint32_t>();
+        store::priority_shares io_shares;
+        io_shares._commitlog = std::max(config["commitlog_io_shares"].as<uint32_t>(), 1u);
+        io_shares._memtable_flush = std::max(config["memtable_flush_io_shares"].as<uint32_t>(), 1u);
+        io_shares._write = std::max(config["write_io_shares"].as<uint32_t>(), 1u);
+        io_shares._read = std::max(config["read_io_shares"].as<uint32_t>(), 1u);
+        io_shares._compaction = std::max(config["compaction_io_shares"].as<uint32_t>(), 1u);
+        io_shares._snapshot = std::max(config["snapshot_io_shares"].as<uint32_t>(), 1u);
+        // before any shard registers its priority classes.
+        store::set_priority_shares(io_shares);
+        db_options._memory_soft_limit = config["memory_soft_limit"].as<size_t>();
+        db_options._memory_hard_limit = config["memory_hard_limit"].as<size_t>();
+        db_options._write_throttle_timeout = std::chrono::milliseconds(config["write_throttle_timeout_ms"].as<unsigned>());
+        return redis::load_data_shards().then([&, db_options] (unsigned data_shards) mutable {
+            db_options._data_shards = data_shards;
+            return db.start(db_options).then([&] {
+                // every shard reads its snapshots in parallel, and sends the
+                // keys to their shards before any replays its commit log.
+                return db.invoke_on_all(&redis::database::load_snapshot);
+            }).then([&] {
+                // each shard replays its own commit log, all in parallel.
+                return db.invoke_on_all(&redis::database::initialize);
+            }).then([&] {
+                // the keys are read back while the commands are served.
+                return db.invoke_on_all(&redis::database::start_warmup);
+            }).then([data_shards] {
+                // the keys are where this number of shards expects them.
+                return data_shards == smp::count ? make_ready_future<>() : redis::save_data_shards(smp::count);
+            });
+        }).then([&, rdb = config["import_rdb"].as<std::string>()] {
+            if (rdb.empty()) {
+                return make_ready_future<>();
+            }
+            // the commit log has none of the keys, the snapshots keep them.
+            return redis::import_rdb(rdb).then([&, rdb] (uint64_t keys) {
+                main_log.info("imported {} keys from {}", keys, rdb);
+                return db.invoke_on_all(&redis::database::save_snapshot);
+            });
+        }).then([&, options] {
+            return server.start(options);
         }).then([&] {
             return server.invoke_on_all(&redis::server::start);
+        }).then([&, path = options._unix_socket, perm = options._unix_socket_perm] {
+            if (path.empty()) {
+                return make_ready_future<>();
+            }
+            // bound once, every shard accepts from its own duplicate.
+            auto socket = make_lw_shared<file_desc>(redis::bind_unix_socket(path, perm));
+            return server.invoke_on_all([socket = socket.get()] (redis::server& s) {
+                s.listen_unix(*socket);
+            }).finally([socket] {});
         }).then([&, pport] {
              prometheus_config.metric_help = "Redis server statistics";
              prometheus_config.prefix = "redis";
@@ -9,6 +9,11 @@ memtable::memtable()
 {
 }
 
+memtable::memtable(logalloc::region_group& group)
+    : logalloc::region(group)
+{
+}
+
 memtable::~memtable() {
     //revert_flushed_memory();
     clear();
@@ -53,21 +58,58 @@ future<> memtable::clear_gently() noexcept {
     });
 }
 
-future<> memtable::apply(cache_entry& e) {
+void memtable::apply(mutation& m) {
     assert(write_enabled());
-    /*
-    // call lower_bound so we have a hint for the insert, just in case.
-    auto i = _partitions.lower_bound(key, memtable_entry::compare());
-    if (i == _partitions.end()) {
-        memtable_entry* entry = current_allocator().construct<memtable_entry>();
-        i = partitions.insert(i, *entry);
-    } else {
-        upgrade_entry(*i);
+    bytes record(bytes::initialized_later(), m.estimate_serialized_size());
+    data_output out(record.begin(), record.size());
+    m.encode_to(out);
+    bytes_view key { m.key().data(), m.key().size() };
+    bytes_view value { record.data(), record.size() };
+    with_allocator(allocator(), [this, key, value] {
+        _allocating_section(*this, [this, key, value] {
+            redis::decorated_key dk { managed_bytes(key), redis::token::from_bytes(key) };
+            // call lower_bound so we have a hint for the insert.
+            auto i = _partitions.lower_bound(dk, memtable_entry::compare());
+            if (i != _partitions.end() && redis::tri_compare(i->_key, dk) == 0) {
+                i->_record = managed_bytes(value);
+            }
+            else {
+                auto entry = current_allocator().construct<memtable_entry>(std::move(dk), value);
+                _partitions.insert_before(i, *entry);
+            }
+        });
+    });
+}
+
+static bytes copy_record(const managed_bytes& record) {
+    bytes b(bytes::initialized_later(), record.size());
+    auto p = b.begin();
+    record.for_each_fragment([&p] (bytes_view fragment) {
+        p = std::copy(fragment.begin(), fragment.end(), p);
+    });
+    return b;
+}
+
+std::vector<memtable::flushed_partition> memtable::read_partitions(optional<redis::decorated_key>& after, size_t count) {
+    std::vector<flushed_partition> partitions;
+    partitions.reserve(count);
+    logalloc::reclaim_lock lock(*this);
+    auto i = after ? _partitions.upper_bound(*after, memtable_entry::compare()) : _partitions.begin();
+    for (; i != _partitions.end() && partitions.size() < count; ++i) {
+        partitions.emplace_back(flushed_partition { i->sstable_key(), copy_record(i->_record) });
+        after = i->_key;
     }
-    */
-    return make_ready_future<>();
+    return partitions;
 }
 
+bytes_opt memtable::find(const redis::decorated_key& key) {
+    logalloc::reclaim_lock lock(*this);
+    auto i = _partitions.find(key, memtable_entry::compare());
+    if (i == _partitions.end()) {
+        return bytes_opt();
+    }
+    return bytes_opt(copy_record(i->_record));
+}
 
 logalloc::occupancy_stats memtable::occupancy() const {
     return logalloc::region::occupancy();
@@ -79,10 +121,28 @@ size_t memtable::partition_count() const {
 
 memtable_entry::memtable_entry(memtable_entry&& o) noexcept
     : _link()
-    , _partition(std::move(o._partition))
+    , _key(std::move(o._key))
+    , _record(std::move(o._record))
 {
     using container_type = memtable::partitions_type;
     container_type::node_algorithms::replace_node(o._link.this_ptr(), _link.this_ptr());
     container_type::node_algorithms::init(o._link.this_ptr());
 }
+
+// The position of the token, big endian, so that the keys of an sstable
+// compare bytewise in the order of the memtable.
+bytes to_sstable_key(const redis::decorated_key& dk) {
+    auto token = redis::token_value(dk._token);
+    auto key = dk.key_view();
+    bytes k(bytes::initialized_later(), sizeof(token) + key.size());
+    for (size_t i = 0; i < sizeof(token); ++i) {
+        k[i] = static_cast<char>(token >> (8 * (sizeof(token) - 1 - i)));
+    }
+    std::copy(key.begin(), key.end(), k.begin() + sizeof(token));
+    return k;
+}
+
+bytes memtable_entry::sstable_key() const {
+    return to_sstable_key(_key);
+}
 }
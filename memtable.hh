@@ -41,13 +41,14 @@
 #pragma once
 #include <map>
 #include <memory>
+#include <vector>
 #include <boost/intrusive/set.hpp>
 #include <boost/intrusive/list.hpp>
 #include <boost/intrusive_ptr.hpp>
 #include "utils/logalloc.hh"
 #include "utils/managed_bytes.hh"
 #include "utils/managed_ref.hh"
-#include "partition.hh"
+#include "mutation.hh"
 #include "keys.hh"
 #include "seastarx.hh"
 #include <experimental/optional>
@@ -58,32 +59,42 @@ using optional = std::experimental::optional<T>;
 namespace bi = boost::intrusive;
 
 namespace store {
+// The key in sstables: the token then the key, so that sstable keys
+// compare bytewise as the decorated keys do.
+bytes to_sstable_key(const redis::decorated_key& dk);
+
+// The latest record of a key: a mutation encoded as in the commit log.
 class memtable_entry {
     boost::intrusive::set_member_hook<> _link;
-    managed_ref<partition> _partition;
+    redis::decorated_key _key;
+    managed_bytes _record;
 public:
     friend class memtable;
 
-    memtable_entry()
+    memtable_entry(redis::decorated_key&& key, bytes_view record)
+        : _key(std::move(key))
+        , _record(record)
     {
     }
 
     memtable_entry(memtable_entry&& o) noexcept;
 
+    const redis::decorated_key& key() const { return _key; }
+    // May be fragmented when large, see with_linearized_managed_bytes().
+    const managed_bytes& record() const { return _record; }
+    bytes sstable_key() const;
+
     struct compare {
-        bool operator()(const bytes& l, const memtable_entry& r) const {
-            //return l == r.key();
-            return true; 
+        bool operator()(const redis::decorated_key& l, const memtable_entry& r) const {
+            return redis::tri_compare(l, r._key) < 0;
         }
 
         bool operator()(const memtable_entry& l, const memtable_entry& r) const {
-            //return l.key() == r.key();
-            return true; 
+            return redis::tri_compare(l._key, r._key) < 0;
         }
 
-        bool operator()(const memtable_entry& l, const bytes& r) const {
-            //return l.key() == r;
-            return true; 
+        bool operator()(const memtable_entry& l, const redis::decorated_key& r) const {
+            return redis::tri_compare(l._key, r) < 0;
         }
     };
 };
@@ -101,8 +112,6 @@ private:
     uint64_t _flushed_memory = 0;
     bool _write_enabled = true;
 private:
-    partition& find_or_create_partition(const redis::decorated_key& key);
-    void upgrade_entry(memtable_entry&);
     void add_flushed_memory(uint64_t);
     void remove_flushed_memory(uint64_t);
     void clear() noexcept;
@@ -110,6 +119,8 @@ private:
     future<> clear_gently() noexcept;
 public:
     explicit memtable();
+    // A memtable whose memory counts in the group, see dirty_memory_manager.
+    explicit memtable(logalloc::region_group& group);
     ~memtable();
 
     static memtable& from_region(logalloc::region& r) {
@@ -129,7 +140,22 @@ public:
     size_t partition_count() const;
     logalloc::occupancy_stats occupancy() const;
 
-    future<> apply(cache_entry& e);
+    // Keeps m as the latest record of its key, replacing an older one.
+    void apply(mutation& m);
+
+    // A partition copied out of the region to be written to an sstable.
+    struct flushed_partition {
+        bytes _key;
+        bytes _record;
+    };
+    // Copies up to `count` partitions following `after` in key order, the
+    // first ones if it is disengaged, and moves `after` to the last one
+    // copied. The position is a key rather than an iterator, so the region
+    // may be compacted between two calls.
+    std::vector<flushed_partition> read_partitions(optional<redis::decorated_key>& after, size_t count);
+
+    // A copy of the record of key, disengaged if the memtable does not hold it.
+    bytes_opt find(const redis::decorated_key& key);
 
     bool empty() const { return _partitions.empty(); }
     bool is_flushed() const;
@@ -0,0 +1,90 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#pragma once
+#include "hash_slot.hh"
+#include "utils/bytes.hh"
+#include "utils/murmur_hash.hh"
+#include <array>
+#include <cassert>
+#include <vector>
+namespace redis {
+
+// A binary hash tree over the hash slots: leaf i is the digest of the keys
+// of slot i, an inner node hashes its two children. Two trees are compared
+// from the root down into the subtrees which differ only, so the work is
+// proportional to the number of slots which differ. Nodes are numbered as
+// in a heap: the root is 1, the children of n are 2n and 2n + 1, and the
+// leaves are cluster_slots to 2 * cluster_slots - 1. An empty subtree
+// hashes to 0.
+class merkle_tree {
+    std::vector<uint64_t> _nodes;
+public:
+    static constexpr size_t leaf_count = cluster_slots;
+    static constexpr size_t node_count = 2 * leaf_count;
+    // Levels below the root, that of the leaves.
+    static constexpr unsigned depth = 14;
+    static_assert(leaf_count == size_t(1) << depth, "the tree is complete");
+
+    merkle_tree() : _nodes(node_count, 0) {}
+    // REQUIRES: leaves.size() == leaf_count
+    explicit merkle_tree(const std::vector<uint64_t>& leaves) : _nodes(node_count, 0) {
+        assert(leaves.size() == leaf_count);
+        std::copy(leaves.begin(), leaves.end(), _nodes.begin() + leaf_count);
+        for (size_t n = leaf_count - 1; n > 0; --n) {
+            _nodes[n] = combine(_nodes[2 * n], _nodes[2 * n + 1]);
+        }
+    }
+
+    static uint64_t combine(uint64_t left, uint64_t right) {
+        if (left == 0 && right == 0) {
+            return 0;
+        }
+        uint64_t children[2] = { left, right };
+        std::array<uint64_t, 2> hash;
+        utils::murmur_hash::hash3_x64_128(bytes_view { reinterpret_cast<const char*>(children), sizeof(children) }, 0, hash);
+        return hash[0];
+    }
+
+    uint64_t root() const { return _nodes[1]; }
+    uint64_t node(size_t n) const { return _nodes[n]; }
+    static bool is_leaf(size_t n) { return n >= leaf_count; }
+    static unsigned slot_of(size_t n) { return static_cast<unsigned>(n - leaf_count); }
+
+    // Passes the nodes of the subtree of n down to `levels` levels below it,
+    // or to the leaves, level by level, to func(node, bottom), where bottom
+    // tells the nodes of the last level.
+    template <typename Func>
+    static void for_each_subtree_node(size_t n, unsigned levels, Func&& func) {
+        size_t first = n, count = 1;
+        for (unsigned level = 0; level <= levels; ++level) {
+            bool bottom = level == levels || is_leaf(first);
+            for (size_t i = first; i < first + count; ++i) {
+                func(i, bottom);
+            }
+            if (bottom) {
+                break;
+            }
+            first *= 2;
+            count *= 2;
+        }
+    }
+};
+}
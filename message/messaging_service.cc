@@ -30,10 +30,14 @@
 #include "gms/gossiper.hh"
 #include "rpc/rpc.hh"
 #include "config.hh"
+#include "replication.hh"
+#include "core/simple-stream.hh"
 #include "idl/gossip_digest.dist.hh"
+#include "idl/replication.dist.hh"
 #include "utils/serializer_impl.hh"
 #include "utils/serialization_visitors.hh"
 #include "idl/gossip_digest.dist.impl.hh"
+#include "idl/replication.dist.impl.hh"
 #include "rpc/lz4_compressor.hh"
 #include "rpc/multi_algo_compressor_factory.hh"
 #include "utils/stdx.hh"
@@ -230,6 +234,11 @@ void messaging_service::start_listen() {
         }
     }
 
+    if (_shard_port && !_server_shard) {
+        auto addr = ipv4_addr{_listen_address.raw_addr(), static_cast<uint16_t>(_shard_port + engine().cpu_id())};
+        _server_shard = std::make_unique<rpc_protocol_server_wrapper>(*_rpc, so, addr, rpc_resource_limits());
+    }
+
     if (!_server_tls[0]) {
         auto listen = [&] (const gms::inet_address& a) {
             return std::unique_ptr<rpc_protocol_server_wrapper>(
@@ -255,6 +264,9 @@ void messaging_service::start_listen() {
             mlogger.info("Starting Encrypted Messaging Service on SSL port {}", _ssl_port);
         }
         mlogger.info("Starting Messaging Service on port {}", _port);
+        if (_shard_port) {
+            mlogger.info("Starting shard-aware Messaging Service on ports {}-{}", _shard_port, _shard_port + smp::count - 1);
+        }
     }
 }
 
@@ -266,10 +278,12 @@ messaging_service::messaging_service(gms::inet_address ip
         , uint16_t ssl_port
         , std::shared_ptr<seastar::tls::credentials_builder> credentials
         , bool sltba
-        , bool listen_now)
+        , bool listen_now
+        , uint16_t shard_port)
     : _listen_address(ip)
     , _port(port)
     , _ssl_port(ssl_port)
+    , _shard_port(shard_port)
     , _encrypt_what(ew)
     , _compress_what(cw)
     , _tcp_nodelay_what(tnw)
@@ -320,12 +334,15 @@ future<> messaging_service::stop_tls_server() {
 }
 
 future<> messaging_service::stop_nontls_server() {
-    for (auto&& s : _server) {
-        if (s) {
-            return s->stop();
+    auto f = _server_shard ? _server_shard->stop() : make_ready_future<>();
+    return f.then([this] {
+        for (auto&& s : _server) {
+            if (s) {
+                return s->stop();
+            }
         }
-    }
-    return make_ready_future<>();
+        return make_ready_future<>();
+    });
 }
 
 future<> messaging_service::stop_client() {
@@ -354,8 +371,20 @@ static unsigned get_rpc_client_idx(messaging_verb verb) {
     if (verb == messaging_verb::GOSSIP_DIGEST_SYN ||
         verb == messaging_verb::GOSSIP_DIGEST_ACK2 ||
         verb == messaging_verb::GOSSIP_SHUTDOWN ||
-        verb == messaging_verb::GOSSIP_ECHO) { 
+        verb == messaging_verb::GOSSIP_ECHO ||
+        verb == messaging_verb::GOSSIP_PING) {
         idx = 1;
+    } else if (verb == messaging_verb::STREAM_MUTATIONS ||
+               verb == messaging_verb::REPLICATION_PULL ||
+               verb == messaging_verb::REPLICATION_DUMP ||
+               verb == messaging_verb::REPAIR_TREE ||
+               verb == messaging_verb::REPAIR_KEYS) {
+        // Bulk streams do not hold back the commands the proxy forwards.
+        idx = 2;
+    } else if (verb == messaging_verb::REPLICATION_PULL_DC ||
+               verb == messaging_verb::REPLICATION_DUMP_DC) {
+        // The connections across datacenters, compressed on their own.
+        idx = 3;
     }
     return idx;
 }
@@ -445,17 +474,18 @@ shared_ptr<messaging_service::rpc_protocol_client_wrapper> messaging_service::ge
         return false;
     }();
 
-    auto must_compress = [&id, this] {
+    auto must_compress = [&id, verb, this] {
         if (_compress_what == compress_what::none) {
             return false;
         }
-/*
+        if (_compress_what == compress_what::gossip) {
+            return get_rpc_client_idx(verb) == 1;
+        }
+        // There is no snitch to tell the datacenter of an endpoint, but
+        // only the verbs of the other datacenters cross it.
         if (_compress_what == compress_what::dc) {
-            auto& snitch_ptr = locator::i_endpoint_snitch::get_local_snitch_ptr();
-            return snitch_ptr->get_datacenter(id.addr)
-                            != snitch_ptr->get_datacenter(utils::fb_utilities::get_broadcast_address());
+            return get_rpc_client_idx(verb) == 3;
         }
-*/
         return true;
     }();
 
@@ -473,7 +503,17 @@ shared_ptr<messaging_service::rpc_protocol_client_wrapper> messaging_service::ge
         return true;
     }();
 
-    auto remote_addr = ipv4_addr(get_preferred_ip(id.addr).raw_addr(), must_encrypt ? _ssl_port : _port);
+    auto remote_port = [&] () -> uint16_t {
+        if (must_encrypt) {
+            return _ssl_port;
+        }
+        // gossip and the bulk streams do not care which shard serves them.
+        if (idx == 0 && _shard_port) {
+            return _shard_port + id.cpu_id;
+        }
+        return _port;
+    }();
+    auto remote_addr = ipv4_addr(get_preferred_ip(id.addr).raw_addr(), remote_port);
     auto local_addr = ipv4_addr{_listen_address.raw_addr(), 0};
 
     rpc::client_options opts;
@@ -538,6 +578,20 @@ void messaging_service::remove_rpc_client(msg_addr id) {
     }
 }
 
+void messaging_service::remove_rpc_clients(gms::inet_address addr) {
+    for (auto& c : _clients) {
+        std::vector<msg_addr> ids;
+        for (auto& e : c) {
+            if (e.first.addr == addr) {
+                ids.push_back(e.first);
+            }
+        }
+        for (auto& id : ids) {
+            remove_rpc_client_one(c, id, false);
+        }
+    }
+}
+
 std::unique_ptr<messaging_service::rpc_protocol_wrapper>& messaging_service::rpc() {
     return _rpc;
 }
@@ -684,6 +738,16 @@ future<> messaging_service::send_gossip_echo(msg_addr id) {
     return send_message_timeout<void>(this, messaging_verb::GOSSIP_ECHO, std::move(id), 3000ms);
 }
 
+void messaging_service::register_gossip_ping(std::function<future<> ()>&& func) {
+    register_handler(this, messaging_verb::GOSSIP_PING, std::move(func));
+}
+void messaging_service::unregister_gossip_ping() {
+    _rpc->unregister_handler(netw::messaging_verb::GOSSIP_PING);
+}
+future<> messaging_service::send_gossip_ping(msg_addr id, std::chrono::milliseconds timeout) {
+    return send_message_timeout<void>(this, messaging_verb::GOSSIP_PING, std::move(id), timeout);
+}
+
 void messaging_service::register_gossip_shutdown(std::function<rpc::no_wait_type (inet_address from)>&& func) {
     register_handler(this, messaging_verb::GOSSIP_SHUTDOWN, std::move(func));
 }
@@ -701,7 +765,15 @@ void messaging_service::register_gossip_digest_syn(std::function<rpc::no_wait_ty
 void messaging_service::unregister_gossip_digest_syn() {
     _rpc->unregister_handler(netw::messaging_verb::GOSSIP_DIGEST_SYN);
 }
+template <typename T>
+static size_t serialized_size(const T& msg) {
+    seastar::measuring_output_stream out;
+    ser::serialize(out, msg);
+    return out.size();
+}
+
 future<> messaging_service::send_gossip_digest_syn(msg_addr id, gossip_digest_syn msg) {
+    _gossip_sent_bytes += serialized_size(msg);
     return send_message_oneway(this, messaging_verb::GOSSIP_DIGEST_SYN, std::move(id), std::move(msg));
 }
 
@@ -713,6 +785,7 @@ void messaging_service::unregister_gossip_digest_ack() {
     _rpc->unregister_handler(netw::messaging_verb::GOSSIP_DIGEST_ACK);
 }
 future<> messaging_service::send_gossip_digest_ack(msg_addr id, gossip_digest_ack msg) {
+    _gossip_sent_bytes += serialized_size(msg);
     return send_message_oneway(this, messaging_verb::GOSSIP_DIGEST_ACK, std::move(id), std::move(msg));
 }
 
@@ -724,7 +797,101 @@ void messaging_service::unregister_gossip_digest_ack2() {
     _rpc->unregister_handler(netw::messaging_verb::GOSSIP_DIGEST_ACK2);
 }
 future<> messaging_service::send_gossip_digest_ack2(msg_addr id, gossip_digest_ack2 msg) {
+    _gossip_sent_bytes += serialized_size(msg);
     return send_message_oneway(this, messaging_verb::GOSSIP_DIGEST_ACK2, std::move(id), std::move(msg));
 }
 
+// mutate
+void messaging_service::register_mutate(command_batch_handler&& func) {
+    register_handler(this, messaging_verb::MUTATE, std::move(func));
+}
+void messaging_service::unregister_mutate() {
+    _rpc->unregister_handler(netw::messaging_verb::MUTATE);
+}
+future<std::vector<bytes>> messaging_service::send_mutate(msg_addr id, std::chrono::milliseconds timeout, command_batch commands) {
+    return send_message_timeout<future<std::vector<bytes>>>(this, messaging_verb::MUTATE, std::move(id), timeout, std::move(commands));
+}
+
+// read
+void messaging_service::register_read(command_batch_handler&& func) {
+    register_handler(this, messaging_verb::READ, std::move(func));
+}
+void messaging_service::unregister_read() {
+    _rpc->unregister_handler(netw::messaging_verb::READ);
+}
+future<std::vector<bytes>> messaging_service::send_read(msg_addr id, std::chrono::milliseconds timeout, command_batch commands) {
+    return send_message_timeout<future<std::vector<bytes>>>(this, messaging_verb::READ, std::move(id), timeout, std::move(commands));
+}
+
+// stream mutations
+void messaging_service::register_stream_mutations(std::function<future<> (const rpc::client_info& cinfo, command_batch)>&& func) {
+    register_handler(this, messaging_verb::STREAM_MUTATIONS, std::move(func));
+}
+void messaging_service::unregister_stream_mutations() {
+    _rpc->unregister_handler(netw::messaging_verb::STREAM_MUTATIONS);
+}
+future<> messaging_service::send_stream_mutations(msg_addr id, std::chrono::milliseconds timeout, command_batch commands) {
+    return send_message_timeout<void>(this, messaging_verb::STREAM_MUTATIONS, std::move(id), timeout, std::move(commands));
+}
+
+void messaging_service::register_replication_pull(replication_pull_handler&& func) {
+    register_handler(this, messaging_verb::REPLICATION_PULL, std::move(func));
+}
+void messaging_service::unregister_replication_pull() {
+    _rpc->unregister_handler(netw::messaging_verb::REPLICATION_PULL);
+}
+future<redis::replication_pull_reply> messaging_service::send_replication_pull(msg_addr id, std::chrono::milliseconds timeout, uint32_t shard, bytes replication_id, uint64_t offset, uint32_t max_bytes) {
+    return send_message_timeout<future<redis::replication_pull_reply>>(this, messaging_verb::REPLICATION_PULL, std::move(id), timeout, shard, std::move(replication_id), offset, max_bytes);
+}
+
+void messaging_service::register_replication_dump(replication_dump_handler&& func) {
+    register_handler(this, messaging_verb::REPLICATION_DUMP, std::move(func));
+}
+void messaging_service::unregister_replication_dump() {
+    _rpc->unregister_handler(netw::messaging_verb::REPLICATION_DUMP);
+}
+future<messaging_service::command_batch> messaging_service::send_replication_dump(msg_addr id, std::chrono::milliseconds timeout, uint32_t shard, uint64_t cursor) {
+    return send_message_timeout<future<command_batch>>(this, messaging_verb::REPLICATION_DUMP, std::move(id), timeout, shard, cursor);
+}
+
+void messaging_service::register_replication_pull_dc(replication_dc_pull_handler&& func) {
+    register_handler(this, messaging_verb::REPLICATION_PULL_DC, std::move(func));
+}
+void messaging_service::unregister_replication_pull_dc() {
+    _rpc->unregister_handler(netw::messaging_verb::REPLICATION_PULL_DC);
+}
+future<redis::replication_dc_pull_reply> messaging_service::send_replication_pull_dc(msg_addr id, std::chrono::milliseconds timeout, uint32_t shard, bytes replication_id, uint64_t offset, uint32_t max_bytes, std::vector<uint64_t> ranges) {
+    return send_message_timeout<future<redis::replication_dc_pull_reply>>(this, messaging_verb::REPLICATION_PULL_DC, std::move(id), timeout, shard, std::move(replication_id), offset, max_bytes, std::move(ranges));
+}
+
+void messaging_service::register_replication_dump_dc(replication_dc_dump_handler&& func) {
+    register_handler(this, messaging_verb::REPLICATION_DUMP_DC, std::move(func));
+}
+void messaging_service::unregister_replication_dump_dc() {
+    _rpc->unregister_handler(netw::messaging_verb::REPLICATION_DUMP_DC);
+}
+future<messaging_service::command_batch> messaging_service::send_replication_dump_dc(msg_addr id, std::chrono::milliseconds timeout, uint32_t shard, uint64_t cursor, std::vector<uint64_t> ranges) {
+    return send_message_timeout<future<command_batch>>(this, messaging_verb::REPLICATION_DUMP_DC, std::move(id), timeout, shard, cursor, std::move(ranges));
+}
+
+void messaging_service::register_repair_tree(std::function<future<std::vector<uint64_t>> (const rpc::client_info& cinfo, std::vector<uint64_t> roots, uint32_t levels)>&& func) {
+    register_handler(this, messaging_verb::REPAIR_TREE, std::move(func));
+}
+void messaging_service::unregister_repair_tree() {
+    _rpc->unregister_handler(netw::messaging_verb::REPAIR_TREE);
+}
+future<std::vector<uint64_t>> messaging_service::send_repair_tree(msg_addr id, std::chrono::milliseconds timeout, std::vector<uint64_t> roots, uint32_t levels) {
+    return send_message_timeout<future<std::vector<uint64_t>>>(this, messaging_verb::REPAIR_TREE, std::move(id), timeout, std::move(roots), levels);
+}
+
+void messaging_service::register_repair_keys(std::function<future<std::vector<bytes>> (const rpc::client_info& cinfo, std::vector<uint32_t> slots)>&& func) {
+    register_handler(this, messaging_verb::REPAIR_KEYS, std::move(func));
+}
+void messaging_service::unregister_repair_keys() {
+    _rpc->unregister_handler(netw::messaging_verb::REPAIR_KEYS);
+}
+future<std::vector<bytes>> messaging_service::send_repair_keys(msg_addr id, std::chrono::milliseconds timeout, std::vector<uint32_t> slots) {
+    return send_message_timeout<future<std::vector<bytes>>>(this, messaging_verb::REPAIR_KEYS, std::move(id), timeout, std::move(slots));
+}
+
 } // namespace net
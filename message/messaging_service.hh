@@ -27,7 +27,9 @@
 #include "core/sstring.hh"
 #include "gms/inet_address.hh"
 #include "rpc/rpc_types.hh"
+#include "utils/bytes.hh"
 #include <unordered_map>
+#include <vector>
 #include <seastar/net/tls.hh>
 
 // forward declarations
@@ -42,6 +44,11 @@ namespace utils {
     class UUID;
 }
 
+namespace redis {
+    struct replication_pull_reply;
+    struct replication_dc_pull_reply;
+}
+
 namespace netw {
 
 /* All verb handler identifiers */
@@ -53,7 +60,24 @@ enum class messaging_verb : int32_t {
     GOSSIP_DIGEST_ACK2 = 8,
     GOSSIP_ECHO = 9,
     GOSSIP_SHUTDOWN = 10,
+    // the direct heartbeat of the failure detector
+    GOSSIP_PING = 18,
     // end of gossip verb
+    // Used by proxy, a batch of commands forwarded to the owner of their keys
+    MUTATE = 11,
+    READ = 12,
+    // Used by streaming, the commands rebuilding the keys of moved ranges
+    STREAM_MUTATIONS = 13,
+    // Used by replication, replicas tailing the commit logs of primaries
+    REPLICATION_PULL = 14,
+    REPLICATION_DUMP = 15,
+    // Used by anti-entropy repair
+    REPAIR_TREE = 16,
+    REPAIR_KEYS = 17,
+    // Used by replication, the nodes of another datacenter tailing the
+    // commit logs of this one
+    REPLICATION_PULL_DC = 19,
+    REPLICATION_DUMP_DC = 20,
     LAST = 24,
 };
 
@@ -124,9 +148,13 @@ public:
         all,
     };
 
+    // gossip: the gossip connections only, whose digests grow with the
+    // cluster, and not the commands. dc: the connections of the nodes of
+    // another datacenter tailing the logs, which cross the WAN.
     enum class compress_what {
         none,
         dc,
+        gossip,
         all,
     };
 
@@ -139,8 +167,14 @@ private:
     gms::inet_address _listen_address;
     uint16_t _port;
     uint16_t _ssl_port;
+    // When non-zero, shard N also listens on _shard_port + N, and the verbs
+    // of the data plane connect to the port of the shard they are addressed
+    // to, so that a command lands on the shard owning its key.
+    uint16_t _shard_port;
     encrypt_what _encrypt_what;
     compress_what _compress_what;
+    // The serialized bytes of the gossip messages sent, before compression.
+    uint64_t _gossip_sent_bytes = 0;
     tcp_nodelay_what _tcp_nodelay_what;
     bool _should_listen_to_broadcast_address;
     // map: Node broadcast address -> Node internal IP for communication within the same data center
@@ -149,6 +183,7 @@ private:
     std::array<std::unique_ptr<rpc_protocol_server_wrapper>, 2> _server;
     ::shared_ptr<seastar::tls::server_credentials> _credentials;
     std::array<std::unique_ptr<rpc_protocol_server_wrapper>, 2> _server_tls;
+    std::unique_ptr<rpc_protocol_server_wrapper> _server_shard;
     std::array<clients_map, 4> _clients;
     uint64_t _dropped_messages[static_cast<int32_t>(messaging_verb::LAST)] = {};
     bool _stopping = false;
@@ -161,11 +196,14 @@ public:
             uint16_t port = 7000, bool listen_now = true);
     messaging_service(gms::inet_address ip, uint16_t port, encrypt_what, compress_what, tcp_nodelay_what,
             uint16_t ssl_port, std::shared_ptr<seastar::tls::credentials_builder>,
-            bool sltba = false, bool listen_now = true);
+            bool sltba = false, bool listen_now = true, uint16_t shard_port = 0);
     ~messaging_service();
 public:
     void start_listen();
     uint16_t port();
+    // Whether the clients of the data plane connect to a shard of the
+    // endpoint, msg_addr::cpu_id, rather than to whichever accepts them.
+    bool shard_aware() const { return _shard_port != 0; }
     gms::inet_address listen_address();
     future<> stop_tls_server();
     future<> stop_nontls_server();
@@ -183,11 +221,18 @@ public:
     void unregister_gossip_echo();
     future<> send_gossip_echo(msg_addr id);
 
+    // Wrapper for GOSSIP_PING
+    void register_gossip_ping(std::function<future<> ()>&& func);
+    void unregister_gossip_ping();
+    future<> send_gossip_ping(msg_addr id, std::chrono::milliseconds timeout);
+
     // Wrapper for GOSSIP_SHUTDOWN
     void register_gossip_shutdown(std::function<rpc::no_wait_type (inet_address from)>&& func);
     void unregister_gossip_shutdown();
     future<> send_gossip_shutdown(msg_addr id, inet_address from);
 
+    uint64_t gossip_sent_bytes() const { return _gossip_sent_bytes; }
+
     // Wrapper for GOSSIP_DIGEST_SYN
     void register_gossip_digest_syn(std::function<rpc::no_wait_type (const rpc::client_info& cinfo, gms::gossip_digest_syn)>&& func);
     void unregister_gossip_digest_syn();
@@ -203,6 +248,64 @@ public:
     void unregister_gossip_digest_ack2();
     future<> send_gossip_digest_ack2(msg_addr id, gms::gossip_digest_ack2 msg);
 
+    // Wrapper for MUTATE and READ: each command of the batch is its name and
+    // arguments, the result is the encoded reply of each, in order.
+    using command_batch = std::vector<std::vector<bytes>>;
+    using command_batch_handler = std::function<future<std::vector<bytes>> (const rpc::client_info& cinfo, command_batch)>;
+    void register_mutate(command_batch_handler&& func);
+    void unregister_mutate();
+    future<std::vector<bytes>> send_mutate(msg_addr id, std::chrono::milliseconds timeout, command_batch commands);
+
+    void register_read(command_batch_handler&& func);
+    void unregister_read();
+    future<std::vector<bytes>> send_read(msg_addr id, std::chrono::milliseconds timeout, command_batch commands);
+
+    // Wrapper for STREAM_MUTATIONS, resolves once the batch is applied.
+    void register_stream_mutations(std::function<future<> (const rpc::client_info& cinfo, command_batch)>&& func);
+    void unregister_stream_mutations();
+    future<> send_stream_mutations(msg_addr id, std::chrono::milliseconds timeout, command_batch commands);
+
+    // Wrapper for REPLICATION_PULL: the records of the log of a shard from
+    // an offset. The result is the replication id of the log, the offset
+    // the records start from, the number of shards, then the records.
+    using replication_pull_handler = std::function<future<redis::replication_pull_reply> (const rpc::client_info& cinfo, uint32_t shard, bytes replication_id, uint64_t offset, uint32_t max_bytes)>;
+    void register_replication_pull(replication_pull_handler&& func);
+    void unregister_replication_pull();
+    future<redis::replication_pull_reply> send_replication_pull(msg_addr id, std::chrono::milliseconds timeout, uint32_t shard, bytes replication_id, uint64_t offset, uint32_t max_bytes);
+
+    // Wrapper for REPLICATION_DUMP: one step of the full copy of the keys of
+    // a shard the caller replicates. The first command of the result is the
+    // next cursor alone, 0 once done.
+    using replication_dump_handler = std::function<future<command_batch> (const rpc::client_info& cinfo, uint32_t shard, uint64_t cursor)>;
+    void register_replication_dump(replication_dump_handler&& func);
+    void unregister_replication_dump();
+    future<command_batch> send_replication_dump(msg_addr id, std::chrono::milliseconds timeout, uint32_t shard, uint64_t cursor);
+
+    // Wrappers for REPLICATION_PULL_DC and REPLICATION_DUMP_DC, as the two
+    // above for a node of another datacenter: only the records and the keys
+    // of its token ranges are sent, see replication_manager. The reply to a
+    // pull also has the bytes of the log read, past the records dropped.
+    using replication_dc_pull_handler = std::function<future<redis::replication_dc_pull_reply> (const rpc::client_info& cinfo, uint32_t shard, bytes replication_id, uint64_t offset, uint32_t max_bytes, std::vector<uint64_t> ranges)>;
+    void register_replication_pull_dc(replication_dc_pull_handler&& func);
+    void unregister_replication_pull_dc();
+    future<redis::replication_dc_pull_reply> send_replication_pull_dc(msg_addr id, std::chrono::milliseconds timeout, uint32_t shard, bytes replication_id, uint64_t offset, uint32_t max_bytes, std::vector<uint64_t> ranges);
+    using replication_dc_dump_handler = std::function<future<command_batch> (const rpc::client_info& cinfo, uint32_t shard, uint64_t cursor, std::vector<uint64_t> ranges)>;
+    void register_replication_dump_dc(replication_dc_dump_handler&& func);
+    void unregister_replication_dump_dc();
+    future<command_batch> send_replication_dump_dc(msg_addr id, std::chrono::milliseconds timeout, uint32_t shard, uint64_t cursor, std::vector<uint64_t> ranges);
+
+    // Wrapper for REPAIR_TREE: the nodes of the Merkle tree of the slots the
+    // caller is the primary of and the callee a replica of, those of the
+    // subtree of each root down `levels` levels, see merkle_tree.
+    void register_repair_tree(std::function<future<std::vector<uint64_t>> (const rpc::client_info& cinfo, std::vector<uint64_t> roots, uint32_t levels)>&& func);
+    void unregister_repair_tree();
+    future<std::vector<uint64_t>> send_repair_tree(msg_addr id, std::chrono::milliseconds timeout, std::vector<uint64_t> roots, uint32_t levels);
+
+    // Wrapper for REPAIR_KEYS: the keys the callee holds in the slots.
+    void register_repair_keys(std::function<future<std::vector<bytes>> (const rpc::client_info& cinfo, std::vector<uint32_t> slots)>&& func);
+    void unregister_repair_keys();
+    future<std::vector<bytes>> send_repair_keys(msg_addr id, std::chrono::milliseconds timeout, std::vector<uint32_t> slots);
+
     void foreach_server_connection_stats(std::function<void(const rpc::client_info&, const rpc::stats&)>&& f) const;
 private:
     bool remove_rpc_client_one(clients_map& clients, msg_addr id, bool dead_only);
@@ -211,6 +314,8 @@ public:
     shared_ptr<rpc_protocol_client_wrapper> get_rpc_client(messaging_verb verb, msg_addr id);
     void remove_error_rpc_client(messaging_verb verb, msg_addr id);
     void remove_rpc_client(msg_addr id);
+    // The clients of every shard of the endpoint.
+    void remove_rpc_clients(gms::inet_address addr);
     using drop_notifier_handler = decltype(_connection_drop_notifiers)::iterator;
     drop_notifier_handler register_connection_drop_notifier(std::function<void(gms::inet_address ep)> cb);
     void unregister_connection_drop_notifier(drop_notifier_handler h);
@@ -36,17 +36,28 @@ lw_shared_ptr<mutation> make_deleted_mutation(const bytes& key) {
 }
 
 class string_mutation_impl : public mutation_impl {
-    bytes _value;
+    // The value is not copied, it must stay alive until the mutation is
+    // appended to the commit log, unless the mutation owns it.
+    bytes _owned;
+    bytes_view _value;
     long _expire;
     int _flag;
 public:
-    string_mutation_impl(const bytes& key, const bytes& value, long expire, int flag)
+    string_mutation_impl(const bytes& key, bytes_view value, long expire, int flag)
         : mutation_impl(data_type::bytes, key)
         , _value(value)
         , _expire(expire)
         , _flag(flag)
     {
     }
+    string_mutation_impl(const bytes& key, bytes&& value, long expire, int flag)
+        : mutation_impl(data_type::bytes, key)
+        , _owned(std::move(value))
+        , _value(_owned.data(), _owned.size())
+        , _expire(expire)
+        , _flag(flag)
+    {
+    }
 
     virtual size_t encode_to(data_output& output) const override {
         output.write(static_cast<unsigned>(_type))
@@ -73,6 +84,41 @@ public:
     }
 };
 
-lw_shared_ptr<mutation> make_bytes_mutation(const bytes& key, const bytes& value, long expire, int flag) {
+lw_shared_ptr<mutation> make_bytes_mutation(const bytes& key, bytes_view value, long expire, int flag) {
     return make_lw_shared<mutation>(std::make_unique<string_mutation_impl>(key, value, expire, flag));
 }
+
+lw_shared_ptr<mutation> make_owned_bytes_mutation(const bytes& key, bytes value, long expire, int flag) {
+    return make_lw_shared<mutation>(std::make_unique<string_mutation_impl>(key, std::move(value), expire, flag));
+}
+
+decoded_mutation decode_mutation(bytes_view record)
+{
+    // The layout of encode_to() above: the type, the generation, the key,
+    // then the value, the expiry and the flags of strings, the deadline of
+    // an expiry record, or the change of a field of hashes.
+    data_input input(record);
+    decoded_mutation m;
+    m._type = static_cast<data_type>(input.read<unsigned>());
+    input.read<mutation_generation_type>();
+    m._key = input.read_view_to_blob<uint32_t>();
+    if (m._type == data_type::bytes) {
+        m._value = input.read_view_to_blob<uint32_t>();
+        m._expire = input.read<long>();
+        m._flag = input.read<int>();
+    } else if (m._type == expiry_record_type) {
+        m._expire = input.read<long>();
+        m._flag = FLAG_EXPIRE_AT;
+    } else if (m._type == data_type::dict) {
+        m._op = static_cast<mutation_op>(input.read<uint8_t>());
+        m._field = input.read_view_to_blob<uint32_t>();
+        switch (m._op) {
+        case mutation_op::field_set: m._value = input.read_view_to_blob<uint32_t>(); break;
+        case mutation_op::field_set_integer: m._integer = input.read<int64_t>(); break;
+        case mutation_op::field_set_float: m._float = float_of_bits(input.read<uint64_t>()); break;
+        case mutation_op::field_del: break;
+        default: throw std::out_of_range("unknown field change");
+        }
+    }
+    return m;
+}
@@ -5,7 +5,10 @@
 #include "utils/data_input.hh"
 #include "utils/data_output.hh"
 #include "types.hh"
+#include <algorithm>
+#include <cstring>
 #include <memory>
+#include <vector>
 
 using mutation_generation_type = size_t;
 
@@ -48,7 +51,220 @@ public:
     size_t encode_to(data_output& output) { return _impl->encode_to(output); }
     void decode_from(data_input& input) { _impl->decode_from(input); }
     size_t estimate_serialized_size() const { return _impl->estimate_serialized_size(); }
+    const bytes& key() const { return _impl->key(); }
 };
 
+// The flag of a record whose expire is a unix time in milliseconds rather
+// than a ttl: the records the cache writes to the store may be read back
+// long after, see cache::demote().
+static constexpr int FLAG_EXPIRE_AT = 1 << 5;
+
+// The type of the commit log records of EXPIRE, PERSIST and GETEX, which
+// change the expiry of a key of any type: after the key, the unix time in
+// milliseconds it expires at, 0 once it never expires. No value has it.
+static constexpr data_type expiry_record_type = static_cast<data_type>(64);
+
 lw_shared_ptr<mutation> make_deleted_mutation(const bytes& key);
-lw_shared_ptr<mutation> make_bytes_mutation(const bytes& key, const bytes& value, long expire, int flag);
+lw_shared_ptr<mutation> make_bytes_mutation(const bytes& key, bytes_view value, long expire, int flag);
+// The mutation keeps the value, for those outliving the buffer it was
+// built in, such as the records the cache flushes and demotes.
+lw_shared_ptr<mutation> make_owned_bytes_mutation(const bytes& key, bytes value, long expire, int flag);
+
+// What the record of a hash changes: one of its fields, rather than the
+// whole value. After the key, such a record has the op, the field, then
+// the value the field is set to as a blob, an int64 or the bits of a
+// double.
+enum class mutation_op : uint8_t {
+    none = 0,
+    field_set = 1,
+    field_set_integer = 2,
+    field_set_float = 3,
+    field_del = 4,
+};
+
+inline uint64_t float_bits(double value)
+{
+    uint64_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+inline double float_of_bits(uint64_t bits)
+{
+    double value;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+// A mutation as the commit log appends it: the key and the value are views,
+// encoded straight into the log with the layout of the mutations above, so
+// that an append allocates no mutation and copies no key.
+struct mutation_record {
+    data_type _type = data_type::deleted;
+    bytes_view _key;
+    bytes_view _value;
+    long _expire = 0;
+    int _flag = 0;
+    mutation_op _op = mutation_op::none;
+    bytes_view _field;
+    int64_t _integer = 0;
+    double _float = 0;
+    // A record serialized by another log, appended as it is when not empty.
+    bytes_view _encoded;
+    // The value of a string in fragments, in place of _value when set.
+    const std::vector<bytes_view>* _value_fragments = nullptr;
+
+    static mutation_record deleted(bytes_view key)
+    {
+        mutation_record r;
+        r._key = key;
+        return r;
+    }
+    static mutation_record of_bytes(bytes_view key, bytes_view value, long expire, int flag)
+    {
+        mutation_record r;
+        r._type = data_type::bytes;
+        r._key = key;
+        r._value = value;
+        r._expire = expire;
+        r._flag = flag;
+        return r;
+    }
+    // The value is encoded as the concatenation of the fragments.
+    static mutation_record of_fragments(bytes_view key, const std::vector<bytes_view>& fragments, long expire, int flag)
+    {
+        auto r = of_bytes(key, bytes_view(), expire, flag);
+        r._value_fragments = &fragments;
+        return r;
+    }
+    static mutation_record expiry(bytes_view key, long expire_at)
+    {
+        mutation_record r;
+        r._type = expiry_record_type;
+        r._key = key;
+        r._expire = expire_at;
+        r._flag = FLAG_EXPIRE_AT;
+        return r;
+    }
+    static mutation_record field_change(bytes_view key, mutation_op op, bytes_view field)
+    {
+        mutation_record r;
+        r._type = data_type::dict;
+        r._key = key;
+        r._op = op;
+        r._field = field;
+        return r;
+    }
+    static mutation_record field_set(bytes_view key, bytes_view field, bytes_view value)
+    {
+        auto r = field_change(key, mutation_op::field_set, field);
+        r._value = value;
+        return r;
+    }
+    static mutation_record field_set(bytes_view key, bytes_view field, int64_t value)
+    {
+        auto r = field_change(key, mutation_op::field_set_integer, field);
+        r._integer = value;
+        return r;
+    }
+    static mutation_record field_set(bytes_view key, bytes_view field, double value)
+    {
+        auto r = field_change(key, mutation_op::field_set_float, field);
+        r._float = value;
+        return r;
+    }
+    static mutation_record field_del(bytes_view key, bytes_view field)
+    {
+        return field_change(key, mutation_op::field_del, field);
+    }
+    static mutation_record encoded(bytes_view record)
+    {
+        mutation_record r;
+        r._encoded = record;
+        return r;
+    }
+
+    size_t serialized_size() const
+    {
+        if (!_encoded.empty()) {
+            return _encoded.size();
+        }
+        using output = data_output;
+        auto size = output::serialized_size<unsigned>() + output::serialized_size<mutation_generation_type>() + output::serialized_size(_key);
+        if (_type == data_type::bytes) {
+            size += output::serialized_size(_value) + output::serialized_size(_expire) + output::serialized_size(_flag);
+            if (_value_fragments) {
+                for (auto& f : *_value_fragments) {
+                    size += f.size();
+                }
+            }
+        } else if (_type == expiry_record_type) {
+            size += output::serialized_size(_expire);
+        } else if (_type == data_type::dict) {
+            size += output::serialized_size<uint8_t>() + output::serialized_size(_field);
+            switch (_op) {
+            case mutation_op::field_set: size += output::serialized_size(_value); break;
+            case mutation_op::field_set_integer: size += output::serialized_size(_integer); break;
+            case mutation_op::field_set_float: size += output::serialized_size<uint64_t>(); break;
+            default: break;
+            }
+        }
+        return size;
+    }
+    // Writes the serialized_size() bytes of the record to out.
+    void encode_to(char* out) const
+    {
+        if (!_encoded.empty()) {
+            std::copy(_encoded.begin(), _encoded.end(), out);
+            return;
+        }
+        data_output output(out, serialized_size());
+        output.write(static_cast<unsigned>(_type))
+              .write(mutation_generation_type(0))
+              .write(_key);
+        if (_type == data_type::bytes && _value_fragments) {
+            uint32_t size = 0;
+            for (auto& f : *_value_fragments) {
+                size += f.size();
+            }
+            output.write(size);
+            for (auto& f : *_value_fragments) {
+                output.write(f.data(), f.data() + f.size());
+            }
+            output.write(_expire)
+                  .write(_flag);
+        } else if (_type == data_type::bytes) {
+            output.write(_value)
+                  .write(_expire)
+                  .write(_flag);
+        } else if (_type == expiry_record_type) {
+            output.write(_expire);
+        } else if (_type == data_type::dict) {
+            output.write(static_cast<uint8_t>(_op))
+                  .write(_field);
+            switch (_op) {
+            case mutation_op::field_set: output.write(_value); break;
+            case mutation_op::field_set_integer: output.write(_integer); break;
+            case mutation_op::field_set_float: output.write(float_bits(_float)); break;
+            default: break;
+            }
+        }
+    }
+};
+
+// A mutation read back from a commit log record, viewing into the record.
+struct decoded_mutation {
+    data_type _type;
+    bytes_view _key;
+    bytes_view _value;
+    long _expire = 0;
+    int _flag = 0;
+    // Of the records of a hash.
+    mutation_op _op = mutation_op::none;
+    bytes_view _field;
+    int64_t _integer = 0;
+    double _float = 0;
+};
+
+// Throws std::out_of_range on a truncated record.
+decoded_mutation decode_mutation(bytes_view record);
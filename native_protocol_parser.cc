@@ -1,205 +1,273 @@
 #include "native_protocol_parser.hh"
-#include <unordered_map>
 #include "redis_command_code.hh"
 #include "exceptions/exceptions.hh"
 #include <cctype>
 #include <cstring>
+#include <limits>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
 namespace redis {
 
-static thread_local std::unordered_map<bytes, command_code> _command_table {
-   { "set", command_code::set },
-   { "mset", command_code::mset },
-   { "get", command_code::get },
-   { "mget", command_code::mget },
-   { "del", command_code::del },
-   { "echo", command_code::echo },
-   { "ping", command_code::ping },
-   { "incr", command_code::incr },
-   { "decr", command_code::decr },
-   { "incrby", command_code::incrby },
-   { "decrby", command_code::decrby },
-   { "command", command_code::command },
-   { "exists", command_code::exists },
-   { "append", command_code::append },
-   { "strlen", command_code::strlen },
-   { "lpush", command_code::lpush },
-   { "lpushx", command_code::lpushx },
-   { "lpop", command_code::lpop },
-   { "llen", command_code::llen },
-   { "lindex", command_code::lindex },
-   { "linsert", command_code::linsert },
-   { "lrange", command_code::lrange },
-   { "lset", command_code::lset },
-   { "rpush", command_code::rpush },
-   { "rpushx", command_code::rpushx },
-   { "rpop", command_code::rpop },
-   { "lrem", command_code::lrem },
-   { "ltrim", command_code::ltrim },
-   { "hset", command_code::hset },
-   { "hdel", command_code::hdel },
-   { "hget", command_code::hget },
-   { "hlen", command_code::hlen },
-   { "hexists", command_code::hexists },
-   { "hstrlen", command_code::hstrlen },
-   { "hincrby", command_code::hincrby },
-   { "hincrbyfloat", command_code::hincrbyfloat },
-   { "hkeys", command_code::hkeys },
-   { "hvals", command_code::hvals },
-   { "hmget", command_code::hmget },
-   { "hmset", command_code::hmset },
-   { "hgetall", command_code::hgetall },
-   { "sadd", command_code::sadd },
-   { "scard", command_code::scard },
-   { "sismember", command_code::sismember },
-   { "smembers", command_code::smembers },
-   { "srem", command_code::srem },
-   { "sdiff", command_code::sdiff },
-   { "sdiffstore", command_code::sdiffstore },
-   { "sunion", command_code::sunion },
-   { "sunionstore", command_code::sunionstore },
-   { "smove", command_code::smove },
-   { "srandmember", command_code::srandmember },
-   { "spop", command_code::spop },
-   { "type", command_code::type },
-   { "expire", command_code::expire },
-   { "pexpire", command_code::pexpire },
-   { "ttl", command_code::ttl },
-   { "pttl", command_code::pttl },
-   { "persist", command_code::persist },
-   { "zadd", command_code::zadd },
-   { "zcard", command_code::zcard },
-   { "zcount", command_code::zcount },
-   { "zrange", command_code::zrange },
-   { "zrangebyscore", command_code::zrangebyscore },
-   { "zrank", command_code::zrank },
-   { "zrem", command_code::zrem },
-   { "zremrangebyrank", command_code::zremrangebyrank },
-   { "zremrangebyscore", command_code::zremrangebyscore },
-   { "zrevrange", command_code::zrevrange },
-   { "zrevrangebyscore", command_code::zrevrangebyscore },
-   { "zscore", command_code::zscore },
-   { "zunionstore", command_code::zunionstore },
-   { "zinterstore", command_code::zinterstore },
-   { "zdiffstore", command_code::zdiffstore },
-   { "zunion", command_code::zunion },
-   { "zinter", command_code::zinter },
-   { "zdiff", command_code::zdiff },
-   { "zscan", command_code::zscan },
-   { "zrangebylex", command_code::zrangebylex },
-   { "zlexcount", command_code::zlexcount },
-   { "zremrangebylex", command_code::zremrangebylex },
-   { "select", command_code::select },
-   { "geoadd", command_code::geoadd },
-   { "geohash", command_code::geohash },
-   { "geodist", command_code::geodist },
-   { "geopos", command_code::geopos },
-   { "georadius", command_code::georadius },
-   { "georadiusbymember", command_code::georadiusbymember },
-   { "setbit", command_code::setbit },
-   { "getbit", command_code::getbit },
-   { "bitcount", command_code::bitcount },
-   { "bitop", command_code::bitop },
-   { "bitpos", command_code::bitpos },
-   { "bitfield", command_code::bitfield },
-   { "pfadd", command_code::pfadd },
-   { "pfcount", command_code::pfcount },
-   { "pfmerge", command_code::pfmerge },
-};
+
+// Locates the first '\n' in [p, pe), or returns pe. Header lines of RESP are
+// scanned with SIMD compares when the target supports it, the bulk strings
+// are never scanned since their length is known.
+static inline char* find_lf(char* p, char* pe)
+{
+#if defined(__AVX2__)
+    const __m256i lf = _mm256_set1_epi8('\n');
+    while (pe - p >= 32) {
+        auto v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+        auto mask = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, lf)));
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 32;
+    }
+#endif
+#if defined(__SSE2__)
+    const __m128i lf16 = _mm_set1_epi8('\n');
+    while (pe - p >= 16) {
+        auto v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        auto mask = static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, lf16)));
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 16;
+    }
+#endif
+    auto r = static_cast<char*>(std::memchr(p, '\n', pe - p));
+    return r ? r : pe;
+}
 
 void native_protocol_parser::init()
 {
     _req._command =  {};
+    _req._command_code = command_code::unknown;
     _req._state = protocol_state::error;
     _req._args_count = 0;
     _req._args.clear();
+    _req._pinned_args.clear();
+    _req._arena.reset();
+    _req.clear_fragmented_arg();
+    _fragmenting = false;
+    _arena_arg = nullptr;
+    _req.reset_key_hashes();
+    _has_command = false;
 }
 
-uint32_t native_protocol_parser::convert_to_number(char* begin, char* end) const
+uint32_t native_protocol_parser::convert_to_number(const char* begin, const char* end) const
 {
-    auto num = std::atoi(begin);
-    if (num == 0) {
+    if (begin == end) {
         throw protocol_exception("Protocol error: invalid request");
     }
+    uint64_t num = 0;
+    for (auto s = begin; s < end; ++s) {
+        if (!std::isdigit(*s)) {
+            throw protocol_exception("Protocol error: invalid request");
+        }
+        num = num * 10 + (*s - '0');
+        if (num > std::numeric_limits<uint32_t>::max()) {
+            throw protocol_exception("Protocol error: invalid bulk length");
+        }
+    }
     return static_cast<uint32_t> (num);
 }
 
-char* native_protocol_parser::find_first_nonnumeric(char* begin, char* end) const
+char* native_protocol_parser::parse_header(char* p, char* pe)
 {
-    for (auto s = begin; s < end; ++s) {
-        if (!isdigit(*s)) {
-            return s;
+    auto lf = find_lf(p, pe);
+    if (lf == pe) {
+        if (_header.size() + (pe - p) > MAX_INLINE_BUFFER_SIZE) {
+            throw protocol_exception("Protocol error: too big bulk count string");
         }
+        _header.append(p, pe - p);
+        return nullptr;
+    }
+    const char* begin = p;
+    const char* end = lf;
+    if (!_header.empty()) {
+        _header.append(p, lf - p);
+        begin = _header.begin();
+        end = _header.end();
+    }
+    if (end == begin || *(end - 1) != '\r') {
+        throw protocol_exception("Protocol error: invalid request");
+    }
+    --end;
+    if (_state == state::args_count) {
+        if (*begin != '*') {
+            // igore the inline request format
+            throw protocol_exception("Protocol error: inline request format is not supported");
+        }
+        auto count = convert_to_number(begin + 1, end);
+        if (count == 0) {
+            throw protocol_exception("Protocol error: invalid request");
+        }
+        if (count > MAX_MULTIBULK_COUNT) {
+            throw protocol_exception("Protocol error: invalid multibulk length");
+        }
+        _args_left = count;
+        _req._args_count = count - 1;
+        _req._args.reserve(std::min(count - 1, RESERVED_ARGS));
+        _state = state::arg_size;
+    }
+    else {
+        if (*begin != '$') {
+            throw unexpect_protocol_exception('$', *begin);
+        }
+        _arg_size = _size_left = convert_to_number(begin + 1, end);
+        if (_arg_size > MAX_BULK_LENGTH) {
+            throw protocol_exception("Protocol error: invalid bulk length");
+        }
+        _state = _size_left ? state::arg_data : state::arg_crlf;
+        _crlf_left = 2;
+    }
+    _header = {};
+    return lf + 1;
+}
+
+bool native_protocol_parser::can_pin_argument(size_t index) const
+{
+    // Commands have to opt in, by reading the argument through arg_view().
+    switch (_req._command_code) {
+    case command_code::set:
+        return index == 1;
+    default:
+        return false;
     }
-    return end;
+}
+
+bool native_protocol_parser::can_fragment_argument(size_t index) const
+{
+    // Commands have to opt in, by reading the argument through arg_fragments().
+    switch (_req._command_code) {
+    case command_code::set:
+    case command_code::append:
+        return index == 1;
+    default:
+        return false;
+    }
+}
+
+void native_protocol_parser::finish_argument()
+{
+    if (_pinned) {
+        _req._args.emplace_back();
+        _pinned = false;
+    }
+    else if (!_has_command) {
+        _req._command = std::move(_arg);
+        _req._command_code = to_command_code(_req._command.data(), _req._command.size());
+        _has_command = true;
+    }
+    else {
+        _req._args.emplace_back(std::move(_arg));
+    }
+    _arg = {};
+    --_args_left;
+    _state = _args_left ? state::arg_size : state::args_count;
 }
 
 char* native_protocol_parser::parse(char* p, char* pe, char* eof)
 {
-    auto s = p;
-    auto begin = s, end = s;
-    auto limit = pe - 1;
-    bool parse_cmd_name = false;
-    _req._command = {};
-    while (s < limit) {
-        while (*s == ' ') ++s;
-        if (*s == '\r' && *(s + 1) == '\n') {
-            // end with \r\n
-            end = s + 2;
-            if (*begin == '*') {
-                if (parse_cmd_name) {
-                    throw protocol_exception("Protocol error: invalid request");
-                }
-                parse_cmd_name = true;
-                assert(_req._args.empty());
-                ++begin;
-                _req._args_count = convert_to_number(begin, end) - 1;
-                // skip \r\n
-                s += 2;
-                begin = s;
-                continue;
+    if (eof && p == pe) {
+        if (_state == state::args_count && _header.empty() && !_has_command) {
+            _req._state = protocol_state::eof;
+            return p;
+        }
+        throw protocol_exception("Protocol error: unexpected end of stream");
+    }
+    while (p < pe) {
+        switch (_state) {
+        case state::args_count:
+        case state::arg_size:
+            p = parse_header(p, pe);
+            if (p == nullptr) {
+                // here, we need more data to construct request.
+                return nullptr;
             }
-            if (*begin != '$') {
-                throw unexpect_protocol_exception('$', *begin);
+            break;
+        case state::arg_data: {
+            // only from the first byte of the value on, the bytes of one
+            // read so far being copied already.
+            bool starts = _size_left == _arg_size;
+            if (starts && _has_command && _input && _size_left >= ZERO_COPY_THRESHOLD && static_cast<size_t>(pe - p) >= _size_left
+                && can_pin_argument(_req._args.size())) {
+                // The whole value is in this buffer, pin it instead of copying.
+                auto index = _req._args.size();
+                _req._pinned_args.resize(index + 1);
+                _req._pinned_args[index] = _input->share(p - _input->get(), _size_left);
+                _arg = {};
+                _pinned = true;
+                p += _size_left;
+                _size_left = 0;
+                _state = state::arg_crlf;
+                break;
             }
-            if (!parse_cmd_name) {
-                // igore the inline request format
-                throw protocol_exception("Protocol error: inline request format is not supported");
+            if (starts && _has_command && _input && _arg_size >= FRAGMENT_THRESHOLD && can_fragment_argument(_req._args.size())) {
+                _fragmenting = true;
+                _req._fragmented_arg = _req._args.size();
             }
-            ++begin;
-            auto endnumber = find_first_nonnumeric(begin, end);
-            if (endnumber == end) {
-                throw protocol_exception("Protocol error: invalid request");
+            if (_fragmenting) {
+                // The slice of this buffer is kept, which pins the buffer
+                // until the command replied.
+                auto len = std::min<size_t>(pe - p, _size_left);
+                _req._arg_fragments.push_back(_input->share(p - _input->get(), len));
+                _size_left -= len;
+                p += len;
+                if (_size_left == 0) {
+                    _fragmenting = false;
+                    _pinned = true;
+                    _state = state::arg_crlf;
+                }
+                break;
             }
-            auto number = convert_to_number(begin, endnumber);
-            end += number;
-            end += 2;
-            begin = end;
-            endnumber += 2;
-            if (end > pe || endnumber > pe) {
-                throw protocol_exception("Protocol error: invalid request");
+            // The bulk string is copied in as large chunks as the buffer has,
+            // to the arena if it may be pinned, which saves an allocation of
+            // its own.
+            if (starts) {
+                if (_has_command && _arg_size >= ARENA_THRESHOLD && can_pin_argument(_req._args.size())) {
+                    _arena_arg = _req._arena.allocate(_arg_size, 1);
+                }
+                else {
+                    _arg = bytes(bytes::initialized_later(), _arg_size);
+                }
             }
-            if (_req._command.empty()) {
-                // command string
-                _req._command = bytes { endnumber, number };
-                s = end;
-                begin = s;
-                continue;
+            auto len = std::min<size_t>(pe - p, _size_left);
+            std::copy_n(p, len, (_arena_arg ? _arena_arg : _arg.begin()) + (_arg_size - _size_left));
+            _size_left -= len;
+            p += len;
+            if (_size_left == 0) {
+                if (_arena_arg) {
+                    auto index = _req._args.size();
+                    _req._pinned_args.resize(index + 1);
+                    // the arena outlives the buffer, which frees nothing.
+                    _req._pinned_args[index] = temporary_buffer<char>(_arena_arg, _arg_size, deleter());
+                    _arena_arg = nullptr;
+                    _pinned = true;
+                }
+                _state = state::arg_crlf;
+            }
+            break;
+        }
+        case state::arg_crlf:
+            if (*p != (_crlf_left == 2 ? '\r' : '\n')) {
+                throw protocol_exception("Protocol error: invalid request");
             }
-            _req._args.emplace_back(bytes { endnumber, number });
-            if (_req._args.size() == _req._args_count) {
-                // ok
-                _req._state = protocol_state::ok;
-                return end;
+            ++p;
+            if (--_crlf_left == 0) {
+                finish_argument();
+                if (_state == state::args_count) {
+                    // ok
+                    _req._state = protocol_state::ok;
+                    return p;
+                }
             }
-            s = end;
-            continue;
+            break;
         }
-        ++s;
-    }
-    if (static_cast<size_t>(pe - p) > MAX_INLINE_BUFFER_SIZE) {
-        throw protocol_exception("Protocol error: too big bulk count string");
     }
-    // here, we need more data to construct request.
     return nullptr;
 }
 }
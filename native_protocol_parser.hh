@@ -35,9 +35,48 @@ namespace redis {
 
 class native_protocol_parser : public protocol_parser::impl {
     static constexpr size_t MAX_INLINE_BUFFER_SIZE = 1024 * 64; // 64K
+    // The limits of Redis on the arguments of a request, and on the length
+    // of one, its proto-max-bulk-len: a request declaring more is refused
+    // before anything is allocated for it.
+    static constexpr uint32_t MAX_MULTIBULK_COUNT = 1024 * 1024;
+    static constexpr uint32_t MAX_BULK_LENGTH = 512 * 1024 * 1024;
+    // The arguments reserved up front, the others as they arrive.
+    static constexpr uint32_t RESERVED_ARGS = 64;
+    // Values at least this large are shared from the input buffer rather
+    // than copied, when the command reads them through arg_view().
+    static constexpr size_t ZERO_COPY_THRESHOLD = 1024;
+    // Values at least this large which do not arrive in one buffer are kept
+    // as the slices of the buffers they arrive in, see
+    // request_wrapper::_arg_fragments.
+    static constexpr size_t FRAGMENT_THRESHOLD = 1024 * 64;
+    // Values which could be pinned but are not go to the arena of the
+    // request from this size on, below which a bytes holds them inline.
+    static constexpr size_t ARENA_THRESHOLD = 32;
+    bool _pinned { false };
+    bool _fragmenting { false };
+    // The argument being copied into the arena of the request.
+    char* _arena_arg { nullptr };
+    enum class state {
+        args_count,
+        arg_size,
+        arg_data,
+        arg_crlf,
+    };
     request_wrapper _req;
-    char* find_first_nonnumeric(char* begin, char* end) const;
-    uint32_t convert_to_number(char* begin, char* end) const;
+    state _state { state::args_count };
+    uint32_t _args_left { 0 };
+    uint32_t _arg_size { 0 };
+    uint32_t _size_left { 0 };
+    uint32_t _crlf_left { 0 };
+    // Header line or argument which spans temporary buffers.
+    bytes _header {};
+    bytes _arg {};
+    bool _has_command { false };
+    uint32_t convert_to_number(const char* begin, const char* end) const;
+    char* parse_header(char* p, char* pe);
+    void finish_argument();
+    bool can_pin_argument(size_t index) const;
+    bool can_fragment_argument(size_t index) const;
 public:
     native_protocol_parser() {}
     virtual ~native_protocol_parser() {}
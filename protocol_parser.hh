@@ -36,6 +36,9 @@ public:
     using unconsumed_remainder = std::experimental::optional<temporary_buffer<char>>;
     class impl {
     public:
+        // The buffer being parsed, parsers may share() slices of it instead
+        // of copying. Only valid during parse().
+        temporary_buffer<char>* _input = nullptr;
         impl() {}
         virtual ~impl() {}
         virtual void init() = 0;
@@ -45,16 +48,23 @@ public:
 public:
     explicit protocol_parser(std::unique_ptr<impl> p) : _impl(std::move(p)) {}
     void init() { _impl->init(); }
-    inline future<unconsumed_remainder> operator()(temporary_buffer<char> buf) {
+    // The rest of the buffer once a request is complete, nothing while it
+    // takes more input.
+    inline unconsumed_remainder parse(temporary_buffer<char> buf) {
         char* p = buf.get_write();
         char* pe = p + buf.size();
         char* eof = buf.empty() ? pe : nullptr;
+        _impl->_input = &buf;
         char* parsed = _impl->parse(p, pe, eof);
+        _impl->_input = nullptr;
         if (parsed) {
             buf.trim_front(parsed - p);
-            return make_ready_future<unconsumed_remainder>(std::move(buf));
+            return unconsumed_remainder(std::move(buf));
         }
-        return make_ready_future<unconsumed_remainder>();
+        return unconsumed_remainder();
+    }
+    inline future<unconsumed_remainder> operator()(temporary_buffer<char> buf) {
+        return make_ready_future<unconsumed_remainder>(parse(std::move(buf)));
     }
     inline request_wrapper& request() {
         return _impl->request();
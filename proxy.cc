@@ -41,13 +41,608 @@
 #include "net/packet-data-source.hh"
 #include <unistd.h>
 #include <cstdlib>
+#include <cstring>
+#include "message/messaging_service.hh"
+#include "request_wrapper.hh"
+#include "server.hh"
+#include "service.hh"
+#include "utils/fb_utilities.hh"
+#include <algorithm>
+#include <limits>
+#include <map>
+#include <stdexcept>
 namespace redis {
 
 distributed<proxy> _the_redis_proxy;
 
+static bytes error_reply(std::exception_ptr ep)
+{
+    bytes reply { "-ERR " };
+    try {
+        std::rethrow_exception(ep);
+    } catch (std::exception& e) {
+        reply.append(e.what(), std::strlen(e.what()));
+    } catch (...) {
+        static bytes unknown { "unknown error" };
+        reply.append(unknown.data(), unknown.size());
+    }
+    static bytes tail { "\r\n" };
+    reply.append(tail.data(), tail.size());
+    return reply;
+}
+
+static proxy::command to_command(const request_wrapper& req)
+{
+    proxy::command cmd;
+    cmd.reserve(req._args.size() + 1);
+    cmd.emplace_back(req._command);
+    for (size_t i = 0; i < req._args.size(); ++i) {
+        auto v = req.arg_view(i);
+        cmd.emplace_back(v.data(), v.size());
+    }
+    return cmd;
+}
+
+static future<> write_reply(output_stream<char>& out, bytes reply)
+{
+    return do_with(std::move(reply), [&out] (auto& reply) {
+        return out.write(reply.data(), reply.size());
+    });
+}
+
+void proxy::setup_metrics()
+{
+    namespace sm = seastar::metrics;
+    _metrics.add_group("proxy", {
+        sm::make_counter("forwarded_total", [this] { return _stats._forwarded_commands; }, sm::description("Total number of commands forwarded to other nodes.")),
+        sm::make_counter("batches_total", [this] { return _stats._batches; }, sm::description("Total number of frames of commands sent to other nodes.")),
+        sm::make_counter("failed_batches_total", [this] { return _stats._failed_batches; }, sm::description("Total number of frames of commands which got no reply.")),
+        sm::make_gauge("queued", [this] { return _stats._queued_commands; }, sm::description("Number of commands waiting for a frame to other nodes.")),
+        sm::make_counter("served_total", [this] { return _stats._served_commands; }, sm::description("Total number of commands forwarded by other nodes.")),
+        sm::make_counter("speculative_reads_total", [this] { return _stats._speculative_reads; }, sm::description("Total number of reads also sent to a second replica.")),
+        sm::make_counter("unavailable_total", [this] { return _stats._unavailable; }, sm::description("Total number of commands fewer replicas than their consistency level acknowledged.")),
+        sm::make_counter("down_endpoint_failures_total", [this] { return _stats._down_endpoint_failures; }, sm::description("Total number of commands failed at once as their endpoint is down.")),
+        sm::make_counter("hints_written_total", [this] { return _hints.stats()._written; }, sm::description("Total number of writes kept for the replicas down.")),
+        sm::make_counter("hints_dropped_total", [this] { return _hints.stats()._dropped; }, sm::description("Total number of writes to the replicas down not kept, as their hints are full.")),
+        sm::make_counter("hints_replayed_total", [this] { return _hints.stats()._replayed; }, sm::description("Total number of hints replayed to the replicas alive again.")),
+        sm::make_gauge("hint_bytes", [this] { return _hints.stats()._bytes; }, sm::description("Bytes of hints on disk.")),
+    });
+}
+
+bool proxy::is_local(const gms::inet_address& addr) const
+{
+    return addr == utils::fb_utilities::get_broadcast_address();
+}
+
+std::vector<gms::inet_address> proxy::replicas_for(const bytes& key) const
+{
+    auto& ring = get_local_service().get_ring();
+    if (ring.snapshot().empty()) {
+        return { utils::fb_utilities::get_broadcast_address() };
+    }
+    return ring.get_replica_nodes_for_write(token_value(bytes_view { key.data(), key.size() }));
+}
+
+std::vector<gms::inet_address> proxy::write_targets_for(const bytes& key) const
+{
+    auto replicas = replicas_for(key);
+    if (_options._log_replication) {
+        replicas.resize(1);
+    }
+    return replicas;
+}
+
+std::vector<gms::inet_address> proxy::read_replicas_for(const bytes& key) const
+{
+    auto replicas = replicas_for(key);
+    // This node is the closest, the others are as loaded as the commands
+    // they have not answered yet, and those down come last.
+    auto& ring = get_local_service().get_ring();
+    auto load = [this, &ring] (const gms::inet_address& addr) -> size_t {
+        if (is_local(addr)) {
+            return 0;
+        }
+        if (!ring.is_alive(addr)) {
+            return std::numeric_limits<size_t>::max();
+        }
+        auto i = _destinations.find(addr);
+        return i == _destinations.end() ? 1 : i->second->_pending + 1;
+    };
+    std::stable_sort(replicas.begin(), replicas.end(), [&load] (const gms::inet_address& l, const gms::inet_address& r) {
+        return load(l) < load(r);
+    });
+    return replicas;
+}
+
+consistency_level to_consistency_level(const std::string& name)
+{
+    if (name == "one") {
+        return consistency_level::one;
+    }
+    if (name == "quorum") {
+        return consistency_level::quorum;
+    }
+    if (name == "all") {
+        return consistency_level::all;
+    }
+    throw std::invalid_argument("unknown consistency level: " + name);
+}
+
+size_t proxy::block_for(consistency_level cl, size_t replicas)
+{
+    switch (cl) {
+    case consistency_level::one:
+        return 1;
+    case consistency_level::quorum:
+        return replicas / 2 + 1;
+    case consistency_level::all:
+        return replicas;
+    }
+    return 1;
+}
+
+static bool is_error_reply(const bytes& reply)
+{
+    return reply.empty() || reply[0] == '-';
+}
+
+proxy::proxy(proxy_options options)
+    : _options(options)
+    , _hints(options._hints, [this] (const gms::inet_address& addr, command cmd) {
+        return send(addr, batch_kind::mutate, std::move(cmd)).then([] (bytes reply) {
+            if (is_error_reply(reply)) {
+                throw std::runtime_error("the replica failed a hint");
+            }
+        });
+    })
+{
+    setup_metrics();
+}
+
+future<> proxy::start()
+{
+    return _hints.enabled() ? _hints.start() : make_ready_future<>();
+}
+
+future<bytes> proxy::execute_local(command cmd)
+{
+    return do_with(request_wrapper {}, [cmd = std::move(cmd)] (auto& req) mutable {
+        if (cmd.empty()) {
+            req._state = protocol_state::error;
+        } else {
+            req._state = protocol_state::ok;
+            req._command = std::move(cmd[0]);
+            req._command_code = to_command_code(req._command.data(), req._command.size());
+            req._args.assign(std::make_move_iterator(cmd.begin() + 1), std::make_move_iterator(cmd.end()));
+            req._args_count = req._args.size();
+        }
+        return execute_command(req).then_wrapped([] (auto f) {
+            try {
+                return reply_builder::to_bytes(f.get0());
+            } catch (...) {
+                return error_reply(std::current_exception());
+            }
+        });
+    });
+}
+
+future<std::vector<bytes>> proxy::execute_batch(std::vector<command> commands)
+{
+    return do_with(std::move(commands), std::vector<bytes> {}, [] (auto& commands, auto& replies) {
+        replies.reserve(commands.size());
+        // One by one, so that the writes to a key apply in the order the
+        // coordinator sent them.
+        return do_for_each(commands, [&replies] (command& cmd) {
+            return execute_local(std::move(cmd)).then([&replies] (bytes reply) {
+                replies.emplace_back(std::move(reply));
+            });
+        }).then([&replies] {
+            return std::move(replies);
+        });
+    });
+}
+
+unsigned proxy::remote_shard_of(const command& cmd)
+{
+    if (!netw::get_local_messaging_service().shard_aware() || cmd.size() < 2) {
+        return 0;
+    }
+    return shard_of_key(bytes_view { cmd[1].data(), cmd[1].size() }, smp::count);
+}
+
+future<bytes> proxy::proxy_command_to_endpoint(gms::inet_address addr, batch_kind kind, command cmd)
+{
+    auto& d = _destinations[addr];
+    if (!d) {
+        auto shards = netw::get_local_messaging_service().shard_aware() ? smp::count : 1;
+        d = make_lw_shared<destination>(_options._max_in_flight_batches, shards);
+    }
+    auto shard = remote_shard_of(cmd);
+    auto& b = d->get(kind, shard);
+    b._commands.emplace_back(std::move(cmd));
+    b._replies.emplace_back();
+    auto f = b._replies.back().get_future();
+    ++_stats._queued_commands;
+    if (!b._flush_scheduled) {
+        b._flush_scheduled = true;
+        // All the commands queued before the reactor polls again share the frame.
+        later().then([this, addr, d, kind, shard] {
+            return flush(addr, d, kind, shard);
+        });
+    }
+    ++d->_pending;
+    return f.then_wrapped([d] (future<bytes> f) {
+        --d->_pending;
+        try {
+            return f.get0();
+        } catch (...) {
+            return error_reply(std::current_exception());
+        }
+    });
+}
+
+future<> proxy::flush(gms::inet_address addr, lw_shared_ptr<destination> d, batch_kind kind, unsigned shard)
+{
+    return d->_in_flight.wait(1).then([this, addr, d, kind, shard] {
+        auto& b = d->get(kind, shard);
+        auto n = std::min(b._commands.size(), _options._max_batch_commands);
+        if (n == 0) {
+            // failed by on_endpoint_down() meanwhile.
+            b._flush_scheduled = false;
+            d->_in_flight.signal(1);
+            return make_ready_future<>();
+        }
+        std::vector<command> commands(std::make_move_iterator(b._commands.begin()), std::make_move_iterator(b._commands.begin() + n));
+        std::vector<promise<bytes>> replies(std::make_move_iterator(b._replies.begin()), std::make_move_iterator(b._replies.begin() + n));
+        b._commands.erase(b._commands.begin(), b._commands.begin() + n);
+        b._replies.erase(b._replies.begin(), b._replies.begin() + n);
+        if (b._commands.empty()) {
+            b._flush_scheduled = false;
+        } else {
+            later().then([this, addr, d, kind, shard] {
+                return flush(addr, d, kind, shard);
+            });
+        }
+        _stats._queued_commands -= n;
+        _stats._forwarded_commands += n;
+        ++_stats._batches;
+        auto& ms = netw::get_local_messaging_service();
+        auto id = netw::msg_addr { addr, shard };
+        auto sent = kind == batch_kind::mutate ? ms.send_mutate(id, _options._timeout, std::move(commands))
+                                                : ms.send_read(id, _options._timeout, std::move(commands));
+        return sent.then_wrapped([this, d, replies = std::move(replies)] (future<std::vector<bytes>> f) mutable {
+            d->_in_flight.signal(1);
+            try {
+                auto results = f.get0();
+                if (results.size() != replies.size()) {
+                    throw std::runtime_error("the reply of a forwarded batch does not match its commands");
+                }
+                for (size_t i = 0; i < replies.size(); ++i) {
+                    replies[i].set_value(std::move(results[i]));
+                }
+            } catch (...) {
+                ++_stats._failed_batches;
+                auto ep = std::current_exception();
+                for (auto& r : replies) {
+                    r.set_exception(ep);
+                }
+            }
+        });
+    });
+}
+
+future<bytes> proxy::send(const gms::inet_address& addr, batch_kind kind, command cmd)
+{
+    if (is_local(addr)) {
+        return execute_local(std::move(cmd));
+    }
+    if (!get_local_service().get_ring().is_alive(addr)) {
+        ++_stats._down_endpoint_failures;
+        return make_ready_future<bytes>(error_reply(std::make_exception_ptr(std::runtime_error("endpoint is down"))));
+    }
+    return proxy_command_to_endpoint(addr, kind, std::move(cmd));
+}
+
+void proxy::on_endpoint_down(const gms::inet_address& addr)
+{
+    auto i = _destinations.find(addr);
+    if (i != _destinations.end()) {
+        auto ep = std::make_exception_ptr(std::runtime_error("endpoint is down"));
+        for (auto batches : { &i->second->_mutations, &i->second->_reads }) {
+            for (auto& b : *batches) {
+                _stats._down_endpoint_failures += b._commands.size();
+                _stats._queued_commands -= b._commands.size();
+                for (auto& r : b._replies) {
+                    r.set_exception(ep);
+                }
+                b._commands.clear();
+                b._replies.clear();
+            }
+        }
+    }
+    netw::get_local_messaging_service().remove_rpc_clients(addr);
+}
+
+void proxy::on_endpoint_up(const gms::inet_address& addr)
+{
+    if (_hints.enabled()) {
+        _hints.replay(addr);
+    }
+}
+
+struct proxy::write_state {
+    promise<bytes> _done;
+    size_t _block_for;
+    size_t _targets;
+    size_t _acks = 0;
+    size_t _failures = 0;
+    bool _completed = false;
+    bytes _reply;
+    write_state(size_t block_for, size_t targets) : _block_for(block_for), _targets(targets) {}
+};
+
+void proxy::on_write_reply(lw_shared_ptr<write_state> state, bytes reply)
+{
+    if (state->_completed) {
+        return;
+    }
+    if (is_error_reply(reply)) {
+        // Too many replicas failed for the rest to make up the level.
+        if (++state->_failures > state->_targets - state->_block_for) {
+            state->_completed = true;
+            ++_stats._unavailable;
+            state->_done.set_value(std::move(reply));
+        }
+        return;
+    }
+    if (++state->_acks == 1) {
+        state->_reply = std::move(reply);
+    }
+    if (state->_acks == state->_block_for) {
+        state->_completed = true;
+        state->_done.set_value(std::move(state->_reply));
+    }
+}
+
+future<bytes> proxy::mutate(std::vector<gms::inet_address> targets, command cmd)
+{
+    if (targets.size() == 1) {
+        return send(targets.front(), batch_kind::mutate, std::move(cmd));
+    }
+    auto state = make_lw_shared<write_state>(block_for(_options._write_consistency, targets.size()), targets.size());
+    auto& ring = get_local_service().get_ring();
+    // The replicas past the level are written all the same, in the background.
+    for (auto& addr : targets) {
+        if (_hints.enabled() && !is_local(addr) && !ring.is_alive(addr)) {
+            // still a failure toward the level.
+            _hints.store(addr, cmd);
+        }
+        send(addr, batch_kind::mutate, cmd).then([this, state] (bytes reply) {
+            on_write_reply(state, std::move(reply));
+        });
+    }
+    return state->_done.get_future();
+}
+
+struct proxy::read_state : public enable_lw_shared_from_this<read_state> {
+    promise<bytes> _done;
+    command _cmd;
+    gms::inet_address _next;
+    bool _can_retry;
+    bool _retried = false;
+    bool _completed = false;
+    size_t _outstanding = 0;
+    timer<> _timer;
+    std::chrono::steady_clock::time_point _start = std::chrono::steady_clock::now();
+    read_state(command cmd, gms::inet_address next, bool can_retry) : _cmd(std::move(cmd)), _next(next), _can_retry(can_retry) {}
+};
+
+void proxy::send_speculative_read(lw_shared_ptr<read_state> state)
+{
+    state->_retried = true;
+    ++state->_outstanding;
+    ++_stats._speculative_reads;
+    send(state->_next, batch_kind::read, state->_cmd).then([this, state] (bytes reply) {
+        on_read_reply(state, std::move(reply));
+    });
+}
+
+void proxy::on_read_reply(lw_shared_ptr<read_state> state, bytes reply)
+{
+    --state->_outstanding;
+    if (state->_completed) {
+        return;
+    }
+    if (is_error_reply(reply)) {
+        // The other replica may still answer, or be asked now.
+        if (state->_outstanding > 0) {
+            return;
+        }
+        if (state->_can_retry && !state->_retried) {
+            state->_timer.cancel();
+            send_speculative_read(state);
+            return;
+        }
+    }
+    state->_completed = true;
+    state->_timer.cancel();
+    auto elapsed = std::chrono::steady_clock::now() - state->_start;
+    _read_latencies.add(std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+    state->_done.set_value(std::move(reply));
+}
+
+struct proxy::quorum_read_state {
+    promise<bytes> _done;
+    size_t _block_for;
+    std::vector<bytes> _replies;
+    explicit quorum_read_state(size_t block_for) : _block_for(block_for) {}
+};
+
+// Replies carry no version, so the one most replicas agree on wins.
+static bytes reconcile(std::vector<bytes>& replies)
+{
+    size_t best = 0, best_votes = 0;
+    for (size_t i = 0; i < replies.size(); ++i) {
+        if (is_error_reply(replies[i])) {
+            continue;
+        }
+        auto votes = std::count(replies.begin(), replies.end(), replies[i]);
+        if (size_t(votes) > best_votes) {
+            best = i;
+            best_votes = votes;
+        }
+    }
+    return std::move(replies[best]);
+}
+
+future<bytes> proxy::read(std::vector<gms::inet_address> targets, command cmd)
+{
+    auto n = block_for(_options._read_consistency, targets.size());
+    if (n > 1) {
+        auto state = make_lw_shared<quorum_read_state>(n);
+        for (size_t i = 0; i < n; ++i) {
+            send(targets[i], batch_kind::read, cmd).then([state] (bytes reply) {
+                state->_replies.emplace_back(std::move(reply));
+                if (state->_replies.size() == state->_block_for) {
+                    state->_done.set_value(reconcile(state->_replies));
+                }
+            });
+        }
+        return state->_done.get_future();
+    }
+    auto can_retry = _options._speculative_retry && targets.size() > 1;
+    auto state = make_lw_shared<read_state>(cmd, can_retry ? targets[1] : targets[0], can_retry);
+    ++state->_outstanding;
+    send(targets[0], batch_kind::read, std::move(cmd)).then([this, state] (bytes reply) {
+        on_read_reply(state, std::move(reply));
+    });
+    // Until enough reads are seen the p99 means nothing.
+    if (can_retry && _read_latencies.count() >= 100) {
+        state->_timer.set_callback([this, s = state.get()] {
+            if (!s->_completed && !s->_retried) {
+                send_speculative_read(s->shared_from_this());
+            }
+        });
+        state->_timer.arm(std::chrono::microseconds(_read_latencies.percentile(0.99)));
+    }
+    return state->_done.get_future();
+}
+
+future<> proxy::execute_command_set(const request_wrapper& req, output_stream<char>& out)
+{
+    auto cmd = to_command(req);
+    if (cmd.size() < 3) {
+        return execute_local(std::move(cmd)).then([&out] (bytes reply) {
+            return write_reply(out, std::move(reply));
+        });
+    }
+    auto targets = write_targets_for(cmd[1]);
+    return mutate(std::move(targets), std::move(cmd)).then([&out] (bytes reply) {
+        return write_reply(out, std::move(reply));
+    });
+}
+
+future<> proxy::execute_command_get(const request_wrapper& req, output_stream<char>& out)
+{
+    auto cmd = to_command(req);
+    if (cmd.size() != 2) {
+        return execute_local(std::move(cmd)).then([&out] (bytes reply) {
+            return write_reply(out, std::move(reply));
+        });
+    }
+    auto targets = read_replicas_for(cmd[1]);
+    return read(std::move(targets), std::move(cmd)).then([&out] (bytes reply) {
+        return write_reply(out, std::move(reply));
+    });
+}
+
+future<> proxy::execute_command_del(const request_wrapper& req, output_stream<char>& out)
+{
+    // The keys go to their replicas in one DEL per replica set, the counts
+    // add up.
+    std::map<std::vector<gms::inet_address>, command> groups;
+    for (size_t i = 0; i < req._args.size(); ++i) {
+        auto v = req.arg_view(i);
+        bytes key { v.data(), v.size() };
+        auto& cmd = groups[write_targets_for(key)];
+        if (cmd.empty()) {
+            cmd.emplace_back(req._command);
+        }
+        cmd.emplace_back(std::move(key));
+    }
+    if (groups.empty()) {
+        return execute_local(to_command(req)).then([&out] (bytes reply) {
+            return write_reply(out, std::move(reply));
+        });
+    }
+    struct counts {
+        long _deleted = 0;
+        bytes _error;
+    };
+    return do_with(std::move(groups), counts {}, [this, &out] (auto& groups, auto& r) {
+        return parallel_for_each(groups, [this, &r] (auto& g) {
+            return this->mutate(g.first, std::move(g.second)).then([&r] (bytes reply) {
+                if (reply.size() > 1 && reply[0] == ':') {
+                    r._deleted += std::strtol(reply.data() + 1, nullptr, 10);
+                } else if (r._error.empty()) {
+                    r._error = std::move(reply);
+                }
+            });
+        }).then([&out, &r] {
+            if (!r._error.empty()) {
+                return write_reply(out, std::move(r._error));
+            }
+            auto reply = sprint(":%ld\r\n", r._deleted);
+            return write_reply(out, bytes { reply.data(), reply.size() });
+        });
+    });
+}
+
+future<> proxy::execute(const request_wrapper& req, output_stream<char>& out)
+{
+    switch (req._command_code) {
+    case command_code::set:
+        return execute_command_set(req, out);
+    case command_code::get:
+        return execute_command_get(req, out);
+    case command_code::del:
+        return execute_command_del(req, out);
+    default:
+        return execute_local(to_command(req)).then([&out] (bytes reply) {
+            return write_reply(out, std::move(reply));
+        });
+    }
+}
+
+void proxy::init_messaging_service()
+{
+    auto& ms = netw::get_local_messaging_service();
+    ms.register_mutate([this] (const rpc::client_info& cinfo, std::vector<command> commands) {
+        _stats._served_commands += commands.size();
+        return execute_batch(std::move(commands));
+    });
+    ms.register_read([this] (const rpc::client_info& cinfo, std::vector<command> commands) {
+        _stats._served_commands += commands.size();
+        return execute_batch(std::move(commands));
+    });
+}
+
+void proxy::uninit_messaging_service()
+{
+    auto& ms = netw::get_local_messaging_service();
+    ms.unregister_mutate();
+    ms.unregister_read();
+}
+
 future<> proxy::stop()
 {
-    return make_ready_future<>();
+    uninit_messaging_service();
+    // The frames in flight are answered or time out.
+    return _hints.stop().then([this] {
+        return parallel_for_each(_destinations, [this] (auto& e) {
+            return e.second->_in_flight.wait(_options._max_in_flight_batches);
+        });
+    });
 }
 
 }
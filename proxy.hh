@@ -3,13 +3,17 @@
 #include "utils/histogram.hh"
 #include "utils/estimated_histogram.hh"
 #include <seastar/core/metrics.hh>
+#include "core/semaphore.hh"
 #include "gms/inet_address.hh"
+#include "hints.hh"
 #include "keys.hh"
 #include "token.hh"
+#include <string>
+#include <unordered_map>
+#include <vector>
 namespace redis {
 class service;
-class request_wrapper;
-class result;
+struct request_wrapper;
 class proxy;
 extern distributed<proxy> _the_redis_proxy;
 
@@ -24,29 +28,139 @@ inline proxy& get_local_proxy() {
 inline shared_ptr<proxy> get_local_shared_proxy() {
     return _the_redis_proxy.local_shared();
 }
+
+// How many replicas answer a command before its reply goes to the client:
+// one, a majority, or all of them.
+enum class consistency_level {
+    one,
+    quorum,
+    all,
+};
+
+// Parses "one", "quorum" or "all", throws std::invalid_argument on other
+// names.
+consistency_level to_consistency_level(const std::string& name);
+
+struct proxy_options {
+    // Commands sent to one endpoint in the same tick share one frame, of at
+    // most this many commands.
+    size_t _max_batch_commands = 256;
+    // Frames sent to one endpoint and not yet answered, the next ones wait
+    // and keep coalescing meanwhile.
+    size_t _max_in_flight_batches = 8;
+    std::chrono::milliseconds _timeout { 2000 };
+    // Writes go to every replica in parallel, reads to the least loaded ones.
+    consistency_level _write_consistency = consistency_level::one;
+    consistency_level _read_consistency = consistency_level::one;
+    // A read at ONE not answered within the p99 latency of reads is also sent
+    // to the next replica, the first reply wins.
+    bool _speculative_retry = true;
+    // Writes go to the primary alone, the replicas tail its commit log,
+    // as the replication manager does.
+    bool _log_replication = false;
+    // The writes to the replicas down are kept and replayed to them once
+    // they are alive again.
+    hint_options _hints;
+};
+
+struct proxy_stats {
+    uint64_t _forwarded_commands = 0;
+    uint64_t _batches = 0;
+    uint64_t _failed_batches = 0;
+    uint64_t _queued_commands = 0;
+    uint64_t _served_commands = 0;
+    uint64_t _speculative_reads = 0;
+    // Commands fewer replicas than their consistency level acknowledged.
+    uint64_t _unavailable = 0;
+    // Commands failed at once as their endpoint is down.
+    uint64_t _down_endpoint_failures = 0;
+};
+
 class proxy : public seastar::async_sharded_service<proxy> {
 public:
     using clock_type = lowres_clock;
+    // A command as it goes over the wire: its name, then its arguments.
+    using command = std::vector<bytes>;
 private:
-    distributed<redis::service> _redis;
+    enum class batch_kind { mutate, read };
+    struct batch {
+        std::vector<command> _commands;
+        std::vector<promise<bytes>> _replies;
+        bool _flush_scheduled = false;
+    };
+    // The commands queued for one endpoint, by the shard of the endpoint
+    // they go to when the messaging service is shard-aware.
+    struct destination {
+        std::vector<batch> _mutations;
+        std::vector<batch> _reads;
+        semaphore _in_flight;
+        // Commands sent and not answered yet, how loaded the endpoint is.
+        size_t _pending = 0;
+        destination(size_t max_in_flight, unsigned shards) : _mutations(shards), _reads(shards), _in_flight(max_in_flight) {}
+        batch& get(batch_kind kind, unsigned shard) { return (kind == batch_kind::mutate ? _mutations : _reads)[shard]; }
+    };
+    struct write_state;
+    struct read_state;
+    struct quorum_read_state;
+    proxy_options _options;
+    proxy_stats _stats;
+    hint_manager _hints;
+    // Latencies of reads at ONE, in microseconds.
+    utils::estimated_histogram _read_latencies;
+    std::unordered_map<gms::inet_address, lw_shared_ptr<destination>> _destinations;
     seastar::metrics::metric_groups _metrics;
 private:
-    void uninit_messaging_service() {}
-    std::vector<gms::inet_address> get_live_endpoints(const redis::token& token);
-    future<> proxy_command_to_endpoint(gms::inet_address addr, const redis::request_wrapper& req);
+    void setup_metrics();
+    void uninit_messaging_service();
+    // The replicas of the key, primary first, or this node while there is
+    // no ring.
+    std::vector<gms::inet_address> replicas_for(const bytes& key) const;
+    // The replicas a write goes to: all of them, or with log replication
+    // the primary only.
+    std::vector<gms::inet_address> write_targets_for(const bytes& key) const;
+    // The replicas of the key, the least loaded first.
+    std::vector<gms::inet_address> read_replicas_for(const bytes& key) const;
+    bool is_local(const gms::inet_address& addr) const;
+    static size_t block_for(consistency_level cl, size_t replicas);
+    // The reply of the endpoint, an error reply when it is unreachable.
+    future<bytes> send(const gms::inet_address& addr, batch_kind kind, command cmd);
+    future<bytes> mutate(std::vector<gms::inet_address> targets, command cmd);
+    future<bytes> read(std::vector<gms::inet_address> targets, command cmd);
+    void on_write_reply(lw_shared_ptr<write_state> state, bytes reply);
+    void on_read_reply(lw_shared_ptr<read_state> state, bytes reply);
+    void send_speculative_read(lw_shared_ptr<read_state> state);
+    // The shard of the endpoint owning the key of the command, which the
+    // nodes of a cluster shard alike as they run as many shards; 0 unless
+    // the messaging service is shard-aware.
+    static unsigned remote_shard_of(const command& cmd);
+    future<bytes> proxy_command_to_endpoint(gms::inet_address addr, batch_kind kind, command cmd);
+    future<> flush(gms::inet_address addr, lw_shared_ptr<destination> d, batch_kind kind, unsigned shard);
+    static future<bytes> execute_local(command cmd);
 
-    future<foreign_ptr<lw_shared_ptr<redis::result>>> execute(const redis::request_wrapper& req);
     future<> execute_command_set(const redis::request_wrapper& req, output_stream<char>& out);
     future<> execute_command_get(const redis::request_wrapper& req, output_stream<char>& out);
     future<> execute_command_del(const redis::request_wrapper& req, output_stream<char>& out);
 
 public:
-    proxy() {}
+    proxy(proxy_options options = proxy_options {});
     ~proxy() {}
 
+    // Finds the hints left by earlier runs.
+    future<> start();
+
+    // Runs the command on the node owning its key, directly when it is this
+    // one, and writes the reply to out.
     future<> execute(const redis::request_wrapper& req, output_stream<char>& out);
     void init_messaging_service();
-
+    // The failure detector convicted the endpoint: the commands queued for
+    // it fail, and so do those in flight as its connections close.
+    void on_endpoint_down(const gms::inet_address& addr);
+    // The endpoint is alive again: the writes it missed are replayed to it.
+    void on_endpoint_up(const gms::inet_address& addr);
+    const proxy_stats& stats() const { return _stats; }
+    const hint_stats& hints() const { return _hints.stats(); }
+    // Runs the commands on this node one by one, the replies in order.
+    static future<std::vector<bytes>> execute_batch(std::vector<command> commands);
 
     future<> stop();
 };
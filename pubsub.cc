@@ -0,0 +1,316 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#include "pubsub.hh"
+#include "core/reactor.hh"
+#include "utils/integer_string.hh"
+#include <algorithm>
+#include <fnmatch.h>
+namespace redis {
+
+// `$<size>\r\n<data>\r\n`
+static void append_element(bytes& out, const bytes& data)
+{
+    char header[24];
+    header[0] = '$';
+    auto n = format_integer_string(data.size(), header + 1) + 1;
+    header[n++] = '\r';
+    header[n++] = '\n';
+    out.append(header, n);
+    out.append(data.data(), data.size());
+    out.append("\r\n", 2);
+}
+
+// Every subscriber of a channel gets the same encoded message.
+static void append_shared(scattered_message<char>& m, const lw_shared_ptr<const bytes>& encoded)
+{
+    m.append_static(encoded->data(), encoded->size());
+    m.on_delete([encoded] {});
+}
+
+pubsub::pubsub()
+    : _pattern_shards(smp::count)
+    , _outbox(smp::count)
+    , _announced(make_ready_future<>())
+{
+}
+
+bool pubsub::matches(const bytes& pattern, const bytes& channel)
+{
+    return ::fnmatch(pattern.c_str(), channel.c_str(), 0) == 0;
+}
+
+void pubsub::announce(bytes channel, bool pattern, bool subscribed)
+{
+    auto cpu = engine().cpu_id();
+    // in turn, so that a shard never learns of an unsubscription before the
+    // subscription it follows.
+    _announced = _announced.get_future().then([channel = std::move(channel), pattern, cpu, subscribed] {
+        return smp::invoke_on_all([channel, pattern, cpu, subscribed] {
+            local_pubsub().set_shard(channel, pattern, cpu, subscribed);
+        });
+    }).handle_exception([] (std::exception_ptr) {});
+}
+
+void pubsub::set_shard(const bytes& channel, bool pattern, unsigned cpu, bool subscribed)
+{
+    if (pattern) {
+        _pattern_shards[cpu] = subscribed;
+        return;
+    }
+    if (subscribed) {
+        auto& shards = _channel_shards[channel];
+        shards.resize(smp::count);
+        shards[cpu] = true;
+        return;
+    }
+    auto i = _channel_shards.find(channel);
+    if (i == _channel_shards.end()) {
+        return;
+    }
+    i->second[cpu] = false;
+    if (std::none_of(i->second.begin(), i->second.end(), [] (bool b) { return b; })) {
+        _channel_shards.erase(i);
+    }
+}
+
+void pubsub::subscribe(pubsub_subscriber* s, const bytes& channel, bool pattern)
+{
+    auto& table = pattern ? _patterns : _channels;
+    auto& subs = table[channel];
+    subs.push_back(s);
+    if (pattern) {
+        if (_pattern_subscriptions++ == 0) {
+            announce(bytes {}, true, true);
+        }
+    }
+    else if (subs.size() == 1) {
+        announce(channel, false, true);
+    }
+}
+
+void pubsub::unsubscribe(pubsub_subscriber* s, const bytes& channel, bool pattern)
+{
+    auto& table = pattern ? _patterns : _channels;
+    auto i = table.find(channel);
+    if (i == table.end()) {
+        return;
+    }
+    auto& subs = i->second;
+    auto j = std::find(subs.begin(), subs.end(), s);
+    if (j == subs.end()) {
+        return;
+    }
+    subs.erase(j);
+    if (subs.empty()) {
+        table.erase(i);
+        if (!pattern) {
+            announce(channel, false, false);
+        }
+    }
+    if (pattern && --_pattern_subscriptions == 0) {
+        announce(bytes {}, true, false);
+    }
+}
+
+scattered_message<char>& pubsub::pending(pubsub_subscriber* s)
+{
+    if (!s->_pending) {
+        s->_pending = make_lw_shared<scattered_message<char>>();
+        _touched.push_back(s);
+    }
+    return *s->_pending;
+}
+
+// `*3 $message $channel $message` to the subscribers of the channel,
+// `*4 $pmessage $pattern $channel $message` to those of each pattern.
+uint32_t pubsub::add_message(const bytes& channel, const bytes& message)
+{
+    uint32_t receivers = 0;
+    auto i = _channels.find(channel);
+    if (i != _channels.end()) {
+        bytes encoded { "*3\r\n$7\r\nmessage\r\n" };
+        append_element(encoded, channel);
+        append_element(encoded, message);
+        auto shared = make_lw_shared<const bytes>(std::move(encoded));
+        for (auto s : i->second) {
+            append_shared(pending(s), shared);
+        }
+        receivers += i->second.size();
+    }
+    for (auto& p : _patterns) {
+        if (!matches(p.first, channel)) {
+            continue;
+        }
+        bytes encoded { "*4\r\n$8\r\npmessage\r\n" };
+        append_element(encoded, p.first);
+        append_element(encoded, channel);
+        append_element(encoded, message);
+        auto shared = make_lw_shared<const bytes>(std::move(encoded));
+        for (auto s : p.second) {
+            append_shared(pending(s), shared);
+        }
+        receivers += p.second.size();
+    }
+    _stats._messages_delivered += receivers;
+    return receivers;
+}
+
+void pubsub::flush()
+{
+    auto touched = std::move(_touched);
+    _touched.clear();
+    _stats._deliveries += touched.size();
+    for (auto s : touched) {
+        s->deliver(scattered_message_ptr(std::move(s->_pending)));
+    }
+}
+
+std::vector<uint32_t> pubsub::deliver(const std::vector<message>& messages)
+{
+    std::vector<uint32_t> receivers;
+    receivers.reserve(messages.size());
+    for (auto& m : messages) {
+        receivers.push_back(add_message(m.first, m.second));
+    }
+    flush();
+    return receivers;
+}
+
+future<size_t> pubsub::publish(bytes channel, bytes message)
+{
+    ++_stats._published;
+    auto me = engine().cpu_id();
+    auto i = _channel_shards.find(channel);
+    size_t local = 0;
+    std::vector<future<uint32_t>> remote;
+    for (unsigned cpu = 0; cpu < smp::count; ++cpu) {
+        if (!_pattern_shards[cpu] && (i == _channel_shards.end() || !i->second[cpu])) {
+            continue;
+        }
+        ++_stats._fanout_shards;
+        if (cpu == me) {
+            local = add_message(channel, message);
+            flush();
+        }
+        else {
+            remote.push_back(send(cpu, channel, message));
+        }
+    }
+    if (remote.empty()) {
+        return make_ready_future<size_t>(local);
+    }
+    return when_all(remote.begin(), remote.end()).then([local] (std::vector<future<uint32_t>> results) {
+        auto receivers = local;
+        for (auto& f : results) {
+            if (f.failed()) {
+                f.ignore_ready_future();
+                continue;
+            }
+            receivers += f.get0();
+        }
+        return receivers;
+    });
+}
+
+void pubsub::publish_batch(std::vector<message> messages)
+{
+    _stats._published += messages.size();
+    auto me = engine().cpu_id();
+    std::vector<lw_shared_ptr<std::vector<message>>> batches(smp::count);
+    for (auto& m : messages) {
+        auto i = _channel_shards.find(m.first);
+        for (unsigned cpu = 0; cpu < smp::count; ++cpu) {
+            if (!_pattern_shards[cpu] && (i == _channel_shards.end() || !i->second[cpu])) {
+                continue;
+            }
+            ++_stats._fanout_shards;
+            if (cpu == me) {
+                add_message(m.first, m.second);
+                continue;
+            }
+            auto& b = batches[cpu];
+            if (!b) {
+                b = make_lw_shared<std::vector<message>>();
+            }
+            b->push_back(m);
+        }
+    }
+    flush();
+    for (unsigned cpu = 0; cpu < smp::count; ++cpu) {
+        auto& b = batches[cpu];
+        if (!b) {
+            continue;
+        }
+        ++_stats._batches_sent;
+        smp::submit_to(cpu, [messages = b.get()] {
+            local_pubsub().deliver(*messages);
+        }).finally([b] {});
+    }
+}
+
+future<uint32_t> pubsub::send(unsigned cpu, bytes channel, bytes message)
+{
+    auto& b = _outbox[cpu];
+    if (!b) {
+        b = make_lw_shared<batch>();
+        later().then([this, cpu] {
+            send_batch(cpu);
+        });
+    }
+    auto index = b->_messages.size();
+    b->_messages.emplace_back(std::move(channel), std::move(message));
+    return b->_receivers.get_shared_future().then([index] (lw_shared_ptr<std::vector<uint32_t>> receivers) {
+        return (*receivers)[index];
+    });
+}
+
+void pubsub::send_batch(unsigned cpu)
+{
+    auto b = std::move(_outbox[cpu]);
+    ++_stats._batches_sent;
+    smp::submit_to(cpu, [messages = &b->_messages] {
+        return local_pubsub().deliver(*messages);
+    }).then_wrapped([b] (future<std::vector<uint32_t>> f) {
+        if (f.failed()) {
+            b->_receivers.set_exception(f.get_exception());
+            return;
+        }
+        b->_receivers.set_value(make_lw_shared<std::vector<uint32_t>>(f.get0()));
+    });
+}
+
+std::vector<bytes> pubsub::channels(const bytes* pattern) const
+{
+    std::vector<bytes> result;
+    for (auto& c : _channel_shards) {
+        if (pattern == nullptr || matches(*pattern, c.first)) {
+            result.push_back(c.first);
+        }
+    }
+    return result;
+}
+
+size_t pubsub::subscribers_of(const bytes& channel) const
+{
+    auto i = _channels.find(channel);
+    return i == _channels.end() ? 0 : i->second.size();
+}
+}
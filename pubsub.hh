@@ -0,0 +1,139 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#pragma once
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "core/future.hh"
+#include "core/shared_future.hh"
+#include "core/shared_ptr.hh"
+#include "utils/bytes.hh"
+#include "reply_builder.hh"
+namespace redis {
+using namespace seastar;
+
+// A connection in subscribed mode, as the table of its shard knows it.
+class pubsub_subscriber {
+    friend class pubsub;
+    // The messages of the batch being delivered, not yet handed over.
+    lw_shared_ptr<scattered_message<char>> _pending;
+public:
+    virtual ~pubsub_subscriber() {}
+    // The messages of a batch published to the subscriber, as one reply.
+    virtual void deliver(scattered_message_ptr messages) = 0;
+};
+
+// The channels and patterns the connections of a shard subscribe to.
+//
+// Every shard also knows which shards have subscribers of each channel, and
+// which have pattern subscriptions, so that PUBLISH only goes to the shards
+// which have a receiver. They learn it as a shard gets its first subscriber
+// of a channel or loses its last, which the shard announces to all in turn.
+//
+// The messages PUBLISHed to another shard wait for the end of the task, and
+// go there as one batch with the others published meanwhile: a shard
+// receiving a batch encodes each message once, and hands a subscriber all
+// the messages of the batch for it at once.
+class pubsub {
+public:
+    struct stats {
+        uint64_t _published = 0;
+        // Shards the messages published here went to, this one included.
+        uint64_t _fanout_shards = 0;
+        uint64_t _batches_sent = 0;
+        // Messages received by the subscribers of this shard.
+        uint64_t _messages_delivered = 0;
+        // Batches of messages handed to the subscribers of this shard.
+        uint64_t _deliveries = 0;
+    };
+private:
+    using subscribers = std::vector<pubsub_subscriber*>;
+    using message = std::pair<bytes, bytes>;
+    // The messages published to a shard in the current task, and the
+    // number of receivers of each once it delivered them.
+    struct batch {
+        std::vector<message> _messages;
+        shared_promise<lw_shared_ptr<std::vector<uint32_t>>> _receivers;
+    };
+    std::unordered_map<bytes, subscribers> _channels;
+    std::unordered_map<bytes, subscribers> _patterns;
+    size_t _pattern_subscriptions = 0;
+    // The shards with subscribers of a channel, and with pattern
+    // subscriptions, as announced by every shard.
+    std::unordered_map<bytes, std::vector<bool>> _channel_shards;
+    std::vector<bool> _pattern_shards;
+    // By shard.
+    std::vector<lw_shared_ptr<batch>> _outbox;
+    // The subscribers with messages pending.
+    std::vector<pubsub_subscriber*> _touched;
+    // The announcements of this shard, one after the other.
+    shared_future<> _announced;
+    stats _stats;
+
+    void announce(bytes channel, bool pattern, bool subscribed);
+    void set_shard(const bytes& channel, bool pattern, unsigned cpu, bool subscribed);
+    scattered_message<char>& pending(pubsub_subscriber* s);
+    // Encodes the message for the subscribers of this shard, returns their
+    // number. They get it on flush().
+    uint32_t add_message(const bytes& channel, const bytes& message);
+    void flush();
+    future<uint32_t> send(unsigned cpu, bytes channel, bytes message);
+    void send_batch(unsigned cpu);
+public:
+    pubsub();
+    pubsub(const pubsub&) = delete;
+    pubsub& operator = (const pubsub&) = delete;
+
+    // The channel, or the pattern, which the subscriber must not already
+    // be subscribed to.
+    void subscribe(pubsub_subscriber* s, const bytes& channel, bool pattern);
+    void unsubscribe(pubsub_subscriber* s, const bytes& channel, bool pattern);
+    // Resolves once every shard knows of the subscriptions made here so far.
+    future<> announced()
+    {
+        return _announced.get_future();
+    }
+    // Delivers the message to its subscribers on every shard, resolves to
+    // their number.
+    future<size_t> publish(bytes channel, bytes message);
+    // Delivers the messages without counting their receivers, each shard
+    // with a receiver of any of them getting its messages as one batch.
+    void publish_batch(std::vector<std::pair<bytes, bytes>> messages);
+    // The receivers of each message of a batch from another shard.
+    std::vector<uint32_t> deliver(const std::vector<message>& messages);
+    // The channels with a subscriber on any shard, matching the pattern
+    // unless it is null.
+    std::vector<bytes> channels(const bytes* pattern) const;
+    // The subscribers of the channel on this shard.
+    size_t subscribers_of(const bytes& channel) const;
+    size_t channel_count() const { return _channels.size(); }
+    size_t pattern_count() const { return _patterns.size(); }
+    const stats& get_stats() const { return _stats; }
+    // The glob-style patterns of PSUBSCRIBE.
+    static bool matches(const bytes& pattern, const bytes& channel);
+};
+
+inline pubsub& local_pubsub()
+{
+    static thread_local pubsub p;
+    return p;
+}
+}
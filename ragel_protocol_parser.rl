@@ -70,6 +70,7 @@ action advance_command {
     p += len;
     if (_size_left == 0) {
       _req._command = str();
+      _req._command_code = to_command_code(_req._command.data(), _req._command.size());
       p--;
       fret;
     }
@@ -187,6 +188,8 @@ public:
         _req._state = protocol_state::error;
         _req._args.clear();
         _req._args_count = 0;
+        _req._command_code = command_code::unknown;
+        _req.reset_key_hashes();
         _size_left = 0;
         _arg_size = 0;
         %% write init;
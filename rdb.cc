@@ -0,0 +1,642 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pengjian.uestc@gmail.com. All rights reserved.
+*
+*/
+#include "rdb.hh"
+#include "structures/hll.hh"
+#include "core/print.hh"
+#include <array>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+namespace redis {
+
+// The opcodes and the value types of the RDB format, see rdb.h of Redis.
+enum rdb_opcode : uint8_t {
+    rdb_slot_info = 0xf4,
+    rdb_function2 = 0xf5,
+    rdb_function = 0xf6,
+    rdb_module_aux = 0xf7,
+    rdb_idle = 0xf8,
+    rdb_freq = 0xf9,
+    rdb_aux = 0xfa,
+    rdb_resizedb = 0xfb,
+    rdb_expiretime_ms = 0xfc,
+    rdb_expiretime = 0xfd,
+    rdb_selectdb = 0xfe,
+    rdb_eof = 0xff,
+};
+
+enum rdb_type : uint8_t {
+    rdb_string = 0,
+    rdb_list = 1,
+    rdb_set = 2,
+    rdb_zset = 3,
+    rdb_hash = 4,
+    rdb_zset_2 = 5,
+    rdb_hash_zipmap = 9,
+    rdb_list_ziplist = 10,
+    rdb_set_intset = 11,
+    rdb_zset_ziplist = 12,
+    rdb_hash_ziplist = 13,
+    rdb_list_quicklist = 14,
+    rdb_hash_listpack = 16,
+    rdb_zset_listpack = 17,
+    rdb_list_quicklist_2 = 18,
+    rdb_set_listpack = 20,
+};
+
+static constexpr unsigned rdb_max_version = 12;
+
+namespace {
+template <typename T>
+T little_endian(const char* p)
+{
+    T v = 0;
+    for (size_t i = 0; i < sizeof(T); ++i) {
+        v |= static_cast<T>(static_cast<uint8_t>(p[i])) << (8 * i);
+    }
+    return v;
+}
+
+template <typename T>
+T big_endian(const char* p)
+{
+    T v = 0;
+    for (size_t i = 0; i < sizeof(T); ++i) {
+        v = (v << 8) | static_cast<uint8_t>(p[i]);
+    }
+    return v;
+}
+
+bytes integer_bytes(int64_t v)
+{
+    return to_sstring<bytes>(v);
+}
+
+// The lengths: 00 and 6 bits, 01 and 14 bits, 0x80 and 32 bits or 0x81 and
+// 64 bits big endian. 11 and 6 bits is a special encoding of a string.
+uint64_t load_length(record_cursor& c, bool* encoded = nullptr)
+{
+    auto b = c.byte();
+    switch (b >> 6) {
+    case 0:
+        return b & 0x3f;
+    case 1:
+        return ((b & 0x3f) << 8) | c.byte();
+    case 2:
+        if (b == 0x80) {
+            return big_endian<uint32_t>(c.take(4));
+        }
+        if (b == 0x81) {
+            return big_endian<uint64_t>(c.take(8));
+        }
+        break;
+    default:
+        if (encoded) {
+            *encoded = true;
+            return b & 0x3f;
+        }
+        break;
+    }
+    throw corrupt_snapshot(sprint("bad length encoding %d", static_cast<int>(b)));
+}
+
+bool lzf_decompress(const char* in, size_t in_size, char* out, size_t out_size)
+{
+    auto ip = reinterpret_cast<const uint8_t*>(in);
+    auto in_end = ip + in_size;
+    size_t op = 0;
+    while (ip < in_end) {
+        unsigned ctrl = *ip++;
+        if (ctrl < 32) {
+            size_t n = ctrl + 1;
+            if (op + n > out_size || ip + n > in_end) {
+                return false;
+            }
+            std::memcpy(out + op, ip, n);
+            ip += n;
+            op += n;
+            continue;
+        }
+        size_t n = ctrl >> 5;
+        if (n == 7) {
+            if (ip >= in_end) {
+                return false;
+            }
+            n += *ip++;
+        }
+        if (ip >= in_end) {
+            return false;
+        }
+        size_t back = ((ctrl & 0x1f) << 8) + *ip++ + 1;
+        n += 2;
+        if (back > op || op + n > out_size) {
+            return false;
+        }
+        // the copy may overlap what it writes.
+        for (size_t i = 0; i < n; ++i, ++op) {
+            out[op] = out[op - back];
+        }
+    }
+    return op == out_size;
+}
+
+bytes load_string(record_cursor& c)
+{
+    bool encoded = false;
+    auto size = load_length(c, &encoded);
+    if (!encoded) {
+        return bytes { c.take(size), size };
+    }
+    switch (size) {
+    case 0:
+        return integer_bytes(static_cast<int8_t>(c.byte()));
+    case 1:
+        return integer_bytes(little_endian<int16_t>(c.take(2)));
+    case 2:
+        return integer_bytes(little_endian<int32_t>(c.take(4)));
+    case 3: {
+        auto compressed = load_length(c);
+        auto length = load_length(c);
+        auto data = c.take(compressed);
+        bytes out(bytes::initialized_later(), length);
+        if (!lzf_decompress(data, compressed, out.begin(), length)) {
+            throw corrupt_snapshot("bad LZF string");
+        }
+        return out;
+    }
+    default:
+        throw corrupt_snapshot(sprint("bad string encoding %u", size));
+    }
+}
+
+// The scores of the first sorted sets: a length, or 253 for NaN, 254 for
+// +inf and 255 for -inf, then the number in ASCII.
+double load_double_string(record_cursor& c)
+{
+    auto size = c.byte();
+    switch (size) {
+    case 253: return std::numeric_limits<double>::quiet_NaN();
+    case 254: return std::numeric_limits<double>::infinity();
+    case 255: return -std::numeric_limits<double>::infinity();
+    default: {
+        std::string text { c.take(size), size };
+        return std::strtod(text.c_str(), nullptr);
+    }
+    }
+}
+
+double load_binary_double(record_cursor& c)
+{
+    auto bits = little_endian<uint64_t>(c.take(8));
+    double v;
+    std::memcpy(&v, &bits, sizeof(v));
+    return v;
+}
+
+double parse_score(const bytes& text)
+{
+    return std::strtod(sstring(text.data(), text.size()).c_str(), nullptr);
+}
+
+// Runs func on a cursor over an encoded value, which is whole: running out
+// of it means it is corrupt.
+template <typename Func>
+void in_blob(const bytes& blob, const char* what, Func&& func)
+{
+    record_cursor c(blob.data(), blob.data() + blob.size());
+    try {
+        func(c);
+    } catch (const incomplete_record&) {
+        throw corrupt_snapshot(sprint("bad %s", what));
+    }
+}
+
+// The entries of a ziplist: the total bytes, the offset of the tail and the
+// number of entries, then each entry as the length of the previous one, the
+// encoding and the data, then 0xff.
+template <typename Func>
+void for_each_ziplist_entry(const bytes& blob, Func&& func)
+{
+    in_blob(blob, "ziplist", [&func] (record_cursor& c) {
+        c.take(10);
+        for (;;) {
+            auto prev = c.byte();
+            if (prev == 0xff) {
+                return;
+            }
+            if (prev == 254) {
+                c.take(4);
+            }
+            auto enc = c.byte();
+            switch (enc >> 6) {
+            case 0:
+                func(bytes { c.take(enc & 0x3f), size_t(enc & 0x3f) });
+                continue;
+            case 1: {
+                size_t size = ((enc & 0x3f) << 8) | c.byte();
+                func(bytes { c.take(size), size });
+                continue;
+            }
+            case 2: {
+                size_t size = big_endian<uint32_t>(c.take(4));
+                func(bytes { c.take(size), size });
+                continue;
+            }
+            default:
+                break;
+            }
+            switch (enc) {
+            case 0xc0: func(integer_bytes(little_endian<int16_t>(c.take(2)))); break;
+            case 0xd0: func(integer_bytes(little_endian<int32_t>(c.take(4)))); break;
+            case 0xe0: func(integer_bytes(little_endian<int64_t>(c.take(8)))); break;
+            case 0xf0: func(integer_bytes(static_cast<int32_t>(little_endian<uint32_t>(c.take(3)) << 8) >> 8)); break;
+            case 0xfe: func(integer_bytes(static_cast<int8_t>(c.byte()))); break;
+            default:
+                if (enc > 0xf0 && enc < 0xfe) {
+                    func(integer_bytes((enc & 0x0f) - 1));
+                    break;
+                }
+                throw corrupt_snapshot(sprint("bad ziplist encoding %d", static_cast<int>(enc)));
+            }
+        }
+    });
+}
+
+// The entries of a listpack: the total bytes and the number of entries,
+// then each entry as the encoding, the data and the length of both
+// backwards, then 0xff.
+template <typename Func>
+void for_each_listpack_entry(const bytes& blob, Func&& func)
+{
+    in_blob(blob, "listpack", [&func] (record_cursor& c) {
+        c.take(6);
+        for (;;) {
+            auto start = c.position();
+            auto enc = c.byte();
+            if (enc == 0xff) {
+                return;
+            }
+            auto sign_extend = [] (uint64_t v, unsigned bits) {
+                auto shift = 64 - bits;
+                return static_cast<int64_t>(v << shift) >> shift;
+            };
+            if ((enc & 0x80) == 0) {
+                func(integer_bytes(enc & 0x7f));
+            }
+            else if ((enc & 0xc0) == 0x80) {
+                func(bytes { c.take(enc & 0x3f), size_t(enc & 0x3f) });
+            }
+            else if ((enc & 0xe0) == 0xc0) {
+                func(integer_bytes(sign_extend(((enc & 0x1f) << 8) | c.byte(), 13)));
+            }
+            else if ((enc & 0xf0) == 0xe0) {
+                size_t size = ((enc & 0x0f) << 8) | c.byte();
+                func(bytes { c.take(size), size });
+            }
+            else if (enc == 0xf0) {
+                size_t size = little_endian<uint32_t>(c.take(4));
+                func(bytes { c.take(size), size });
+            }
+            else if (enc == 0xf1) {
+                func(integer_bytes(little_endian<int16_t>(c.take(2))));
+            }
+            else if (enc == 0xf2) {
+                func(integer_bytes(sign_extend(little_endian<uint32_t>(c.take(3)), 24)));
+            }
+            else if (enc == 0xf3) {
+                func(integer_bytes(little_endian<int32_t>(c.take(4))));
+            }
+            else if (enc == 0xf4) {
+                func(integer_bytes(little_endian<int64_t>(c.take(8))));
+            }
+            else {
+                throw corrupt_snapshot(sprint("bad listpack encoding %d", static_cast<int>(enc)));
+            }
+            size_t size = c.position() - start;
+            c.take(size <= 127 ? 1 : size < 16383 ? 2 : size < 2097151 ? 3 : size < 268435455 ? 4 : 5);
+        }
+    });
+}
+
+// The members of an intset: the size of each, the count, then the
+// integers.
+template <typename Func>
+void for_each_intset_member(const bytes& blob, Func&& func)
+{
+    in_blob(blob, "intset", [&func] (record_cursor& c) {
+        auto width = little_endian<uint32_t>(c.take(4));
+        auto count = little_endian<uint32_t>(c.take(4));
+        for (uint32_t i = 0; i < count; ++i) {
+            switch (width) {
+            case 2: func(integer_bytes(little_endian<int16_t>(c.take(2)))); break;
+            case 4: func(integer_bytes(little_endian<int32_t>(c.take(4)))); break;
+            case 8: func(integer_bytes(little_endian<int64_t>(c.take(8)))); break;
+            default: throw corrupt_snapshot(sprint("bad intset width %u", width));
+            }
+        }
+    });
+}
+
+// The fields and values of a zipmap, the hash encoding before ziplists.
+template <typename Func>
+void for_each_zipmap_entry(const bytes& blob, Func&& func)
+{
+    in_blob(blob, "zipmap", [&func] (record_cursor& c) {
+        c.byte();
+        auto length = [&c] (uint8_t b) -> size_t {
+            return b < 254 ? b : little_endian<uint32_t>(c.take(4));
+        };
+        for (;;) {
+            auto b = c.byte();
+            if (b == 0xff) {
+                return;
+            }
+            auto key_size = length(b);
+            bytes key { c.take(key_size), key_size };
+            auto value_size = length(c.byte());
+            auto free = c.byte();
+            bytes value { c.take(value_size), value_size };
+            c.take(free);
+            func(std::move(key));
+            func(std::move(value));
+        }
+    });
+}
+
+// A HyperLogLog of Redis: "HYLL", the encoding, 3 unused bytes and the
+// cached cardinality, then the registers, dense or sparse. Pedis keeps the
+// same registers behind its own 8 bytes of cached cardinality.
+bool is_redis_hll(const bytes& value)
+{
+    return value.size() >= 16 && std::memcmp(value.data(), "HYLL", 4) == 0;
+}
+
+bytes convert_redis_hll(const bytes& value)
+{
+    static constexpr size_t header = 16;
+    std::array<uint8_t, HLL_BUCKET_COUNT> registers {};
+    auto p = reinterpret_cast<const uint8_t*>(value.data()) + header;
+    auto size = value.size() - header;
+    if (value[4] == 0) {
+        if (size < size_t(HLL_BUCKET_COUNT * HLL_BITS / 8)) {
+            throw corrupt_snapshot("bad dense HyperLogLog");
+        }
+        for (size_t i = 0; i < registers.size(); ++i) {
+            size_t byte = i * HLL_BITS / 8;
+            unsigned bit = (i * HLL_BITS) & 7;
+            unsigned b0 = p[byte];
+            unsigned b1 = byte + 1 < size ? p[byte + 1] : 0;
+            registers[i] = ((b0 >> bit) | (b1 << (8 - bit))) & HLL_BUCKET_COUNT_MAX;
+        }
+    }
+    else {
+        // ZERO 00xxxxxx, XZERO 01xxxxxx yyyyyyyy and VAL 1vvvvvxx.
+        size_t index = 0;
+        for (size_t i = 0; i < size; ++i) {
+            auto op = p[i];
+            size_t run;
+            uint8_t v = 0;
+            if ((op & 0xc0) == 0) {
+                run = (op & 0x3f) + 1;
+            }
+            else if ((op & 0xc0) == 0x40) {
+                if (++i >= size) {
+                    throw corrupt_snapshot("bad sparse HyperLogLog");
+                }
+                run = (((op & 0x3f) << 8) | p[i]) + 1;
+            }
+            else {
+                v = ((op >> 2) & 0x1f) + 1;
+                run = (op & 0x03) + 1;
+            }
+            if (index + run > registers.size()) {
+                throw corrupt_snapshot("bad sparse HyperLogLog");
+            }
+            std::fill_n(registers.begin() + index, run, v);
+            index += run;
+        }
+    }
+    bytes dense(bytes::initialized_later(), HLL_BYTES_SIZE);
+    hll::pack_registers(registers.data(), reinterpret_cast<uint8_t*>(dense.begin()));
+    return dense;
+}
+}
+
+void rdb_decoder::decode_value(record_cursor& c, uint8_t type, snapshot_record& r)
+{
+    auto add = [&r] (bytes element) {
+        r._elements.emplace_back(std::move(element));
+    };
+    // the members and the scores of the encodings holding them in turns.
+    bool member = true;
+    auto add_pair = [&r, &member] (bytes element) {
+        if (member) {
+            r._elements.emplace_back(std::move(element));
+        }
+        else {
+            r._scores.push_back(parse_score(element));
+        }
+        member = !member;
+    };
+    switch (type) {
+    case rdb_string: {
+        auto value = load_string(c);
+        if (is_redis_hll(value)) {
+            r._type = snapshot_type::hll;
+            add(convert_redis_hll(value));
+        }
+        else {
+            r._type = snapshot_type::string;
+            add(std::move(value));
+        }
+        return;
+    }
+    case rdb_list:
+    case rdb_set:
+        r._type = type == rdb_list ? snapshot_type::list : snapshot_type::set;
+        for (auto n = load_length(c); n > 0; --n) {
+            add(load_string(c));
+        }
+        return;
+    case rdb_hash:
+        r._type = snapshot_type::hash;
+        for (auto n = load_length(c); n > 0; --n) {
+            add(load_string(c));
+            add(load_string(c));
+        }
+        return;
+    case rdb_zset:
+    case rdb_zset_2:
+        r._type = snapshot_type::zset;
+        for (auto n = load_length(c); n > 0; --n) {
+            add(load_string(c));
+            r._scores.push_back(type == rdb_zset ? load_double_string(c) : load_binary_double(c));
+        }
+        return;
+    case rdb_hash_zipmap:
+        r._type = snapshot_type::hash;
+        for_each_zipmap_entry(load_string(c), add);
+        return;
+    case rdb_list_ziplist:
+        r._type = snapshot_type::list;
+        for_each_ziplist_entry(load_string(c), add);
+        return;
+    case rdb_set_intset:
+        r._type = snapshot_type::set;
+        for_each_intset_member(load_string(c), add);
+        return;
+    case rdb_zset_ziplist:
+        r._type = snapshot_type::zset;
+        for_each_ziplist_entry(load_string(c), add_pair);
+        return;
+    case rdb_hash_ziplist:
+        r._type = snapshot_type::hash;
+        for_each_ziplist_entry(load_string(c), add);
+        return;
+    case rdb_list_quicklist:
+        r._type = snapshot_type::list;
+        for (auto n = load_length(c); n > 0; --n) {
+            for_each_ziplist_entry(load_string(c), add);
+        }
+        return;
+    case rdb_hash_listpack:
+        r._type = snapshot_type::hash;
+        for_each_listpack_entry(load_string(c), add);
+        return;
+    case rdb_zset_listpack:
+        r._type = snapshot_type::zset;
+        for_each_listpack_entry(load_string(c), add_pair);
+        return;
+    case rdb_list_quicklist_2:
+        r._type = snapshot_type::list;
+        for (auto n = load_length(c); n > 0; --n) {
+            // a node is a plain element or a listpack of them.
+            auto container = load_length(c);
+            auto node = load_string(c);
+            if (container == 1) {
+                add(std::move(node));
+            }
+            else {
+                for_each_listpack_entry(node, add);
+            }
+        }
+        return;
+    case rdb_set_listpack:
+        r._type = snapshot_type::set;
+        for_each_listpack_entry(load_string(c), add);
+        return;
+    default:
+        throw corrupt_snapshot(sprint("unsupported RDB value type %d", static_cast<int>(type)));
+    }
+}
+
+bool rdb_decoder::decode_one(record_cursor& c, snapshot_record& r)
+{
+    uint64_t expire_at_ms = 0;
+    for (;;) {
+        auto type = c.byte();
+        switch (type) {
+        case rdb_eof:
+            // the CRC64 of the file follows, since version 5.
+            if (_version >= 5) {
+                c.take(8);
+            }
+            _ended = true;
+            return false;
+        case rdb_selectdb:
+            load_length(c);
+            return false;
+        case rdb_resizedb:
+            load_length(c);
+            load_length(c);
+            return false;
+        case rdb_slot_info:
+            load_length(c);
+            load_length(c);
+            load_length(c);
+            return false;
+        case rdb_aux:
+            load_string(c);
+            load_string(c);
+            return false;
+        case rdb_function2:
+            load_string(c);
+            return false;
+        case rdb_expiretime_ms:
+            expire_at_ms = little_endian<uint64_t>(c.take(8));
+            continue;
+        case rdb_expiretime:
+            expire_at_ms = uint64_t(little_endian<uint32_t>(c.take(4))) * 1000;
+            continue;
+        case rdb_idle:
+            load_length(c);
+            continue;
+        case rdb_freq:
+            c.byte();
+            continue;
+        case rdb_function:
+        case rdb_module_aux:
+            throw corrupt_snapshot("modules and functions are not supported");
+        default:
+            r._expire_at_ms = expire_at_ms;
+            r._key = load_string(c);
+            decode_value(c, type, r);
+            if ((r._type == snapshot_type::hash && r._elements.size() % 2 != 0)
+                || (r._type == snapshot_type::zset && r._elements.size() != r._scores.size())) {
+                throw corrupt_snapshot("bad hash or sorted set");
+            }
+            return true;
+        }
+    }
+}
+
+size_t rdb_decoder::decode(const char* data, size_t size, const record_func& func)
+{
+    record_cursor c(data, data + size);
+    size_t consumed = 0;
+    try {
+        if (!_started) {
+            auto header = c.take(9);
+            if (std::memcmp(header, "REDIS", 5) != 0) {
+                throw corrupt_snapshot("not an RDB file");
+            }
+            _version = std::strtoul(std::string(header + 5, 4).c_str(), nullptr, 10);
+            if (_version == 0 || _version > rdb_max_version) {
+                throw corrupt_snapshot(sprint("unsupported RDB version %u", _version));
+            }
+            _started = true;
+            consumed = 9;
+        }
+        while (!_ended && c.left() > 0) {
+            snapshot_record r;
+            auto key = decode_one(c, r);
+            consumed = c.position() - data;
+            if (key) {
+                ++_keys;
+                func(std::move(r));
+            }
+        }
+    } catch (const incomplete_record&) {
+    }
+    return consumed;
+}
+}
@@ -0,0 +1,49 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pengjian.uestc@gmail.com. All rights reserved.
+*
+*/
+#pragma once
+#include "snapshot.hh"
+namespace redis {
+
+// Decodes the keys of an RDB file of Redis, up to version 12: strings,
+// lists, sets, hashes and sorted sets in their plain encodings and in the
+// zipmap, ziplist, intset, quicklist and listpack ones, and HyperLogLogs,
+// which become dense values of Pedis. The keys of every database are
+// decoded, Pedis has only one. Streams, modules and hashes with field
+// expiries are not supported: decoding fails with corrupt_snapshot.
+// The checksum at the end of the file is not verified.
+class rdb_decoder {
+    bool _started = false;
+    bool _ended = false;
+    unsigned _version = 0;
+    uint64_t _keys = 0;
+    // Decodes the next key with the opcodes before it, returns false for
+    // an opcode without a key.
+    bool decode_one(record_cursor& c, snapshot_record& r);
+    void decode_value(record_cursor& c, uint8_t type, snapshot_record& r);
+public:
+    using record_func = snapshot_decoder::record_func;
+    // Passes the whole keys at the front of the input to func, returns the
+    // bytes they took.
+    size_t decode(const char* data, size_t size, const record_func& func);
+    bool ended() const { return _ended; }
+    uint64_t keys() const { return _keys; }
+};
+}
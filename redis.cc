@@ -22,6 +22,13 @@
 #include <iomanip>
 #include <sstream>
 #include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <limits>
+#include <numeric>
+#include <queue>
+#include <random>
+#include <unordered_set>
 #include "core/app-template.hh"
 #include "core/future-util.hh"
 #include "core/timer-set.hh"
@@ -33,16 +40,26 @@
 #include "core/vector-data-sink.hh"
 #include "core/bitops.hh"
 #include "core/slab.hh"
+#include "core/execution_stage.hh"
 #include "core/align.hh"
 #include "net/api.hh"
 #include "net/packet-data-source.hh"
 #include "util/log.hh"
 #include <unistd.h>
 #include <cstdlib>
+#include <strings.h>
 #include "db.hh"
 #include "reply_builder.hh"
+#include "utils/float_string.hh"
+#include "tracing.hh"
+#include "utils/work_scheduler.hh"
+#include "scripting.hh"
+#include "pubsub.hh"
+#include "cluster.hh"
+#include "utils/murmur_hash.hh"
 #include  <experimental/vector>
 #include "core/metrics.hh"
+#include "core/print.hh"
 using namespace net;
 namespace redis {
 
@@ -52,6 +69,278 @@ namespace redis {
 
 namespace stdx = std::experimental;
 
+// A call a shard runs for a command of another shard, through the
+// execution stage of the command's family.
+class staged_call {
+public:
+    virtual ~staged_call() {}
+    virtual void run() = 0;
+};
+
+template <typename Ret, typename Func>
+class staged_call_impl final : public staged_call {
+    Func _func;
+    typename futurize<Ret>::promise_type _result;
+public:
+    explicit staged_call_impl(Func&& func) : _func(std::move(func)) {}
+    futurize_t<Ret> get_future() { return _result.get_future(); }
+    void run() override
+    {
+        futurize<Ret>::apply(_func).forward_to(std::move(_result));
+    }
+};
+
+static future<> run_staged_call(std::unique_ptr<staged_call> call)
+{
+    call->run();
+    return make_ready_future<>();
+}
+
+using family_stage = decltype(seastar::make_execution_stage("", &run_staged_call));
+
+// The stages of this shard, by family, created on first use.
+static family_stage& stage_of(command_family family)
+{
+    static thread_local std::vector<std::unique_ptr<family_stage>> stages = [] {
+        std::vector<std::unique_ptr<family_stage>> s;
+        for (size_t i = 0; i < static_cast<size_t>(command_family::max); ++i) {
+            auto name = sstring("owner_") + to_family_name(static_cast<command_family>(i));
+            s.emplace_back(std::make_unique<family_stage>(seastar::make_execution_stage(name, &run_staged_call)));
+        }
+        return s;
+    }();
+    return *stages[static_cast<size_t>(family)];
+}
+
+// Runs the call here, after those of its family already queued on this
+// shard, unless it has none.
+template <typename Ret, typename Func>
+static inline futurize_t<Ret> run_in_stage(command_family family, Func&& func)
+{
+    if (family == command_family::none) {
+        return futurize<Ret>::apply(func);
+    }
+    auto call = std::make_unique<staged_call_impl<Ret, std::decay_t<Func>>>(std::forward<Func>(func));
+    auto result = call->get_future();
+    return stage_of(family)(std::move(call)).then([result = std::move(result)] () mutable {
+        return std::move(result);
+    });
+}
+
+// Runs the database method on the shard owning the key. When the key is
+// owned by the current shard, call the local database directly rather than
+// going through the cross-core queue.
+//
+// On another shard, the call goes through the execution stage of the
+// family of the command, see current_family(): the commands arriving from
+// every shard are then run by family, rather than in the order they came.
+//
+// The owner runs the call in the class of work of the command, see
+// utils::current_work_class(): heavy calls wait for their share of the
+// reactor, and are not staged.
+//
+// The owner runs the call as the operation of the command, see
+// current_operation(), for its stalls to be reported with it.
+//
+// A sampled request, see current_trace(), has the dispatch stamped here and
+// the execution stamped on the owner. The trace outlives the call, it is
+// held by the connection until the reply is flushed.
+//
+// While a transaction holds the commands of the owner, see
+// redis_service::exec(), the call waits for it to release them.
+template <typename Ret, typename... Args, typename... CallArgs>
+static inline futurize_t<Ret> invoke_on_owner(unsigned cpu, Ret (database::*func)(Args...), CallArgs&&... args)
+{
+    auto trace = current_trace();
+    auto work = utils::current_work_class();
+    if (trace == nullptr && cpu == engine().cpu_id() && work == utils::work_class::point
+        && !get_database().local().transaction_writes_held()) {
+        utils::local_work_scheduler().note_point();
+        auto& db = get_database().local();
+        return futurize<Ret>::apply([&db, func] (auto&&... a) {
+            return (db.*func)(std::forward<decltype(a)>(a)...);
+        }, std::forward<CallArgs>(args)...);
+    }
+    if (trace != nullptr) {
+        trace->_owner = cpu;
+        trace->_dispatched = trace_clock::now();
+    }
+    auto staged = cpu != engine().cpu_id() && work == utils::work_class::point;
+    auto family = staged ? current_family() : command_family::none;
+    return get_database().invoke_on(cpu, [trace, family, work, op = current_operation(), func, call_args = std::tuple<std::decay_t<CallArgs>...>(std::forward<CallArgs>(args)...)] (database& db) mutable {
+        auto call = [&db, trace, op, func, call_args = std::move(call_args)] () mutable {
+            operation_scope scope(op);
+            if (trace == nullptr) {
+                return futurize<Ret>::apply([&db, func] (auto&&... a) {
+                    return (db.*func)(std::forward<decltype(a)>(a)...);
+                }, std::move(call_args));
+            }
+            trace->_execute_start = trace_clock::now();
+            return futurize<Ret>::apply([&db, func] (auto&&... a) {
+                return (db.*func)(std::forward<decltype(a)>(a)...);
+            }, std::move(call_args)).finally([trace] {
+                trace->_execute_end = trace_clock::now();
+            });
+        };
+        auto run = [work, family, call = std::move(call)] () mutable {
+            return utils::local_work_scheduler().run(work, [family, call = std::move(call)] () mutable {
+                return run_in_stage<Ret>(family, std::move(call));
+            });
+        };
+        if (!db.transaction_writes_held()) {
+            return run();
+        }
+        return db.transaction_writes().then(std::move(run));
+    });
+}
+
+// Runs the database method returning a reply_value on the owner, and
+// builds the reply here.
+template <typename... Args, typename... CallArgs>
+static inline future<scattered_message_ptr> invoke_for_value(unsigned cpu, future<reply_value> (database::*func)(Args...), CallArgs&&... args)
+{
+    return invoke_on_owner(cpu, func, std::forward<CallArgs>(args)...).then([] (reply_value v) {
+        return reply_builder::build(std::move(v));
+    });
+}
+
+// The key of a command in its first argument, moved out, with the hash
+// the request computed once.
+static inline redis_key take_key(request_wrapper& req)
+{
+    auto hash = req.key_hash();
+    return redis_key { std::move(req._args[0]), hash };
+}
+
+// Replies with the chunks `fetch(next, left, stream)` builds on the owner
+// of a key, see reply_chunk. The leading chunks are handed to the
+// connection as they come, so that a large collection is never held whole
+// in a reply and the owner serves other requests between its chunks. The
+// chunks after the first are heavy work, see utils::work_class.
+template <typename Fetch>
+static future<scattered_message_ptr> stream_reply(request_wrapper& req, Fetch fetch)
+{
+    auto sink = req._sink;
+    return fetch(0, 0, sink != nullptr).then([sink, fetch] (reply_chunk chunk) {
+        if (chunk._left == 0) {
+            return make_ready_future<scattered_message_ptr>(std::move(chunk._message));
+        }
+        return do_with(std::move(chunk), [sink, fetch] (reply_chunk& chunk) {
+            return repeat([sink, fetch, &chunk] {
+                return sink->push(std::move(chunk._message)).then([fetch, &chunk] {
+                    utils::work_class_scope heavy(utils::work_class::heavy);
+                    return fetch(chunk._next, chunk._left, true);
+                }).then([&chunk] (reply_chunk next) {
+                    chunk = std::move(next);
+                    return chunk._left == 0 ? stop_iteration::yes : stop_iteration::no;
+                });
+            }).then([&chunk] {
+                return std::move(chunk._message);
+            });
+        });
+    });
+}
+
+// The flag of ZADD, if args[1] is one, in `flags`. Returns the position of
+// the first score.
+static size_t parse_zadd_flags(request_wrapper& req, int& flags)
+{
+    std::string un = req._args[1];
+    std::transform(un.begin(), un.end(), un.begin(), ::tolower);
+    flags = ZADD_CH;
+    if (un == "nx") {
+        flags |= ZADD_NX;
+    }
+    else if (un == "xx") {
+        flags |= ZADD_XX;
+    }
+    else if (un == "ch") {
+        flags |= ZADD_CH;
+    }
+    else if (un == "incr") {
+        flags |= ZADD_INCR;
+    }
+    else {
+        return 1;
+    }
+    return 2;
+}
+
+// The scores and members of ZADD from args[first] on, moved out of the
+// arguments; false if a score is not a float.
+static bool parse_zadd_members(request_wrapper& req, size_t first, std::vector<std::pair<bytes, double>>& members)
+{
+    members.reserve((req._args_count - first) / 2);
+    for (size_t i = first; i < req._args_count; i += 2) {
+        bytes& score_ = req._args[i];
+        bytes& member = req._args[i + 1];
+        double score = 0;
+        if (!parse_float_string(score_.data(), score_.size(), score)) {
+            return false;
+        }
+        members.emplace_back(std::move(member), score);
+    }
+    return true;
+}
+
+// Parses `cursor [MATCH pattern] [COUNT count]` of the SCAN family, from
+// the argument at `index`. An empty pattern matches everything. Returns the
+// error to reply, or nullptr.
+static const static_reply* parse_scan_arguments(request_wrapper& req, size_t index, size_t& cursor, bytes& pattern, size_t& count)
+{
+    count = 10;
+    int64_t n = 0;
+    if (!parse_integer_string(req._args[index].data(), req._args[index].size(), n) || n < 0) {
+        return &msg_value_not_integer_err;
+    }
+    cursor = static_cast<size_t>(n);
+    for (size_t i = index + 1; i < req._args_count; i += 2) {
+        auto& option = req._args[i];
+        std::transform(option.begin(), option.end(), option.begin(), ::toupper);
+        if (i + 1 == req._args_count) {
+            return &msg_syntax_err;
+        }
+        if (option == "MATCH") {
+            pattern = std::move(req._args[i + 1]);
+            // `*` matches everything, skip matching altogether.
+            if (pattern == "*") {
+                pattern = bytes();
+            }
+        }
+        else if (option == "COUNT") {
+            auto& c = req._args[i + 1];
+            if (!parse_integer_string(c.data(), c.size(), n)) {
+                return &msg_value_not_integer_err;
+            }
+            if (n < 1) {
+                return &msg_syntax_err;
+            }
+            count = static_cast<size_t>(n);
+        }
+        else {
+            return &msg_syntax_err;
+        }
+    }
+    return nullptr;
+}
+
+// `FIELDS numfields field [field ...]` from `index` on, ending the request.
+static bool parse_fields_argument(request_wrapper& req, size_t index, std::vector<bytes>& fields)
+{
+    int64_t n = 0;
+    if (index + 2 > req._args_count || strcasecmp(req._args[index].c_str(), "fields") != 0) {
+        return false;
+    }
+    auto& count = req._args[index + 1];
+    if (!parse_integer_string(count.data(), count.size(), n) || n < 1 || static_cast<size_t>(n) != req._args_count - index - 2) {
+        return false;
+    }
+    for (size_t i = index + 2; i < req._args_count; ++i) {
+        fields.emplace_back(std::move(req._args[i]));
+    }
+    return true;
+}
+
 future<bytes> redis_service::echo(request_wrapper& req)
 {
     if (req._args_count < 1) {
@@ -75,7 +364,7 @@ future<bool> redis_service::set_impl(bytes& key, bytes& val, long expir, uint8_t
 {
     redis_key rk { std::ref(key) };
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::set_direct, std::move(rk), std::move(val), expir, flag).then([] (auto&& m) {
+    return invoke_on_owner(cpu, &database::set_direct, std::move(rk), std::move(val), expir, flag).then([] (auto&& m) {
         return m == REDIS_OK;
     });
 }
@@ -87,58 +376,65 @@ future<scattered_message_ptr> redis_service::set(request_wrapper& req)
         return reply_builder::build(msg_syntax_err);
     }
     bytes& key = req._args[0];
-    bytes& val = req._args[1];
     long expir = 0;
     uint8_t flag = FLAG_SET_NO;
-    // [EX seconds] [PS milliseconds] [NX] [XX]
-    if (req._args_count > 2) {
-        for (unsigned int i = 2; i < req._args_count; ++i) {
-            bytes* v = (i == req._args_count - 1) ? nullptr : &(req._args[i + 1]);
-            bytes& o = req._args[i];
-            if (o.size() != 2) {
+    // [EX seconds|PX milliseconds|KEEPTTL] [NX|XX] [GET]
+    auto is = [&req] (size_t i, const char* name) {
+        return strcasecmp(req._args[i].c_str(), name) == 0;
+    };
+    for (size_t i = 2; i < req._args_count; ++i) {
+        if (is(i, "ex") || is(i, "px")) {
+            int64_t n = 0;
+            if (i + 1 == req._args_count || (flag & (FLAG_SET_EX | FLAG_SET_PX | FLAG_SET_KEEPTTL)) ||
+                !parse_integer_string(req._args[i + 1].data(), req._args[i + 1].size(), n) || n <= 0) {
                 return reply_builder::build(msg_syntax_err);
             }
-            if ((o[0] == 'e' || o[0] == 'E') && (o[1] == 'x' || o[1] == 'X') && o[2] == '\0') {
-                flag |= FLAG_SET_EX;
-                if (v == nullptr) {
-                    return reply_builder::build(msg_syntax_err);
-                }
-                try {
-                    expir = std::atol(v->c_str()) * 1000;
-                } catch (const std::invalid_argument&) {
-                    return reply_builder::build(msg_syntax_err);
-                }
-                i++;
-            }
-            if ((o[0] == 'p' || o[0] == 'P') && (o[1] == 'x' || o[1] == 'X') && o[2] == '\0') {
-                flag |= FLAG_SET_PX;
-                if (v == nullptr) {
-                    return reply_builder::build(msg_syntax_err);
-                }
-                try {
-                    expir = std::atol(v->c_str());
-                } catch (const std::invalid_argument&) {
-                    return reply_builder::build(msg_syntax_err);
-                }
-                i++;
-            }
-            if ((o[0] == 'n' || o[0] == 'N') && (o[1] == 'x' || o[1] == 'X') && o[2] == '\0') {
-                flag |= FLAG_SET_NX;
-            }
-            if ((o[0] == 'x' || o[0] == 'X') && (o[1] == 'x' || o[1] == 'X') && o[2] == '\0') {
-                flag |= FLAG_SET_XX;
-            }
+            bool seconds = is(i, "ex");
+            flag |= seconds ? FLAG_SET_EX : FLAG_SET_PX;
+            expir = seconds ? n * 1000 : n;
+            ++i;
+        }
+        else if (is(i, "keepttl") && !(flag & (FLAG_SET_EX | FLAG_SET_PX))) {
+            flag |= FLAG_SET_KEEPTTL;
+        }
+        else if (is(i, "nx") && !(flag & FLAG_SET_XX)) {
+            flag |= FLAG_SET_NX;
+        }
+        else if (is(i, "xx") && !(flag & FLAG_SET_NX)) {
+            flag |= FLAG_SET_XX;
+        }
+        else if (is(i, "get")) {
+            // the old value is replied, read where it is replaced.
+            flag |= FLAG_SET_GET;
+        }
+        else {
+            return reply_builder::build(msg_syntax_err);
         }
     }
-    redis_key rk { std::ref(key) };
+    redis_key rk { std::ref(key), req.key_hash() };
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::set, std::move(rk), std::move(val), expir, flag);
+    if (req.fragmented(1)) {
+        return invoke_for_value(cpu, &database::set_fragments, std::move(rk), req.arg_fragments(1), expir, flag);
+    }
+    return invoke_for_value(cpu, &database::set, std::move(rk), req.arg_view(1), expir, flag);
 }
 
 future<bool> redis_service::remove_impl(bytes& key) {
     redis_key rk { std::ref(key) };
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::del_direct, std::move(rk));
+    return invoke_on_owner(cpu, &database::del_direct, std::move(rk));
+}
+
+std::vector<redis_service::shard_batch> redis_service::group_by_shard(std::vector<bytes>& keys, size_t count)
+{
+    std::vector<shard_batch> batches(smp::count);
+    for (size_t i = 0; i < count; ++i) {
+        redis_key rk { std::ref(keys[i]) };
+        auto& batch = batches[get_cpu(rk)];
+        batch._keys.emplace_back(std::move(rk));
+        batch._positions.emplace_back(i);
+    }
+    return batches;
 }
 
 future<scattered_message_ptr> redis_service::del(request_wrapper& req)
@@ -154,16 +450,24 @@ future<scattered_message_ptr> redis_service::del(request_wrapper& req)
     }
     else {
         struct mdel_state {
-            std::vector<bytes>& keys;
+            std::vector<shard_batch> batches;
             size_t success_count;
         };
-        for (size_t i = 0; i < req._args_count; ++i) {
-            req._tmp_keys.emplace_back(req._args[i]);
+        auto batches = group_by_shard(req._args, req._args_count);
+        auto only = only_shard(batches, [] (const shard_batch& b) { return b._keys.empty(); });
+        if (only != smp::count) {
+            return invoke_on_owner(only, &database::del_direct_batch, std::move(batches[only]._keys)).then([] (auto removed) {
+                return reply_builder::build(removed);
+            });
         }
-        return do_with(mdel_state{req._tmp_keys, 0}, [this] (auto& state) {
-            return parallel_for_each(std::begin(state.keys), std::end(state.keys), [this, &state] (auto& key) {
-                return this->remove_impl(key).then([&state] (auto r) {
-                    if (r) state.success_count++;
+        return do_with(mdel_state{std::move(batches), 0}, [] (auto& state) {
+            return parallel_for_each(boost::irange<unsigned>(0, smp::count), [&state] (unsigned cpu) {
+                auto& batch = state.batches[cpu];
+                if (batch._keys.empty()) {
+                    return make_ready_future<>();
+                }
+                return invoke_on_owner(cpu, &database::del_direct_batch, std::move(batch._keys)).then([&state] (auto removed) {
+                    state.success_count += removed;
                 });
             }).then([&state] {
                 return reply_builder::build(state.success_count);
@@ -172,6 +476,172 @@ future<scattered_message_ptr> redis_service::del(request_wrapper& req)
     }
 }
 
+// Large values are always freed in the background, by DEL as well, so
+// UNLINK only differs from DEL by name.
+future<scattered_message_ptr> redis_service::unlink(request_wrapper& req)
+{
+    return del(req);
+}
+
+// RENAME and RENAMENX. Across shards the owner of the source hands the key
+// over as a record, which the owner of the destination inserts whole, see
+// database::dump_entry(); the source is removed only once the destination
+// took it, so the key is never lost. RENAMENX leaves a destination created
+// meanwhile alone and replies 0. As with the other commands of keys of
+// several shards, commands of other connections may run between the steps.
+future<scattered_message_ptr> redis_service::rename(request_wrapper& req, bool nx)
+{
+    if (req._args_count != 2 || req._args.empty()) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    bytes& key = req._args[0];
+    bytes& dest = req._args[1];
+    redis_key src_rk { std::ref(key), req.key_hash() };
+    redis_key dst_rk { std::ref(dest) };
+    auto cpu = get_cpu(src_rk);
+    auto dst_cpu = get_cpu(dst_rk);
+    if (cpu == dst_cpu) {
+        return invoke_on_owner(cpu, &database::rename, std::move(src_rk), std::move(dst_rk), nx);
+    }
+    auto taken = nx ? invoke_on_owner(dst_cpu, &database::exists_direct, dst_rk) : make_ready_future<bool>(false);
+    return taken.then([src_rk = std::move(src_rk), dst_rk = std::move(dst_rk), cpu, dst_cpu, nx] (bool exists) mutable {
+        if (exists) {
+            return reply_builder::build(msg_zero);
+        }
+        auto dst = dst_rk.key();
+        return invoke_on_owner(cpu, &database::dump_entry, src_rk, std::move(dst), false).then([src_rk = std::move(src_rk), dst_rk = std::move(dst_rk), cpu, dst_cpu, nx] (foreign_ptr<lw_shared_ptr<bytes>> record) mutable {
+            if (!record) {
+                return reply_builder::build(msg_nokey_err);
+            }
+            return invoke_on_owner(dst_cpu, &database::restore_entry, std::move(dst_rk), std::move(record), !nx).then([src_rk = std::move(src_rk), cpu, nx] (bool restored) mutable {
+                if (!restored) {
+                    return reply_builder::build(msg_zero);
+                }
+                return invoke_on_owner(cpu, &database::del_direct, std::move(src_rk)).then([nx] (bool) {
+                    return reply_builder::build(nx ? msg_one : msg_ok);
+                });
+            });
+        });
+    });
+}
+
+// COPY source destination [DB 0] [REPLACE]. Pedis has a single database.
+future<scattered_message_ptr> redis_service::copy(request_wrapper& req)
+{
+    if (req._args_count < 2 || req._args.empty()) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    bool replace = false;
+    for (size_t i = 2; i < req._args_count; ++i) {
+        if (strcasecmp(req._args[i].c_str(), "replace") == 0) {
+            replace = true;
+        }
+        else if (strcasecmp(req._args[i].c_str(), "db") == 0 && i + 1 < req._args_count) {
+            int64_t db = 0;
+            if (!parse_integer_string(req._args[i + 1].data(), req._args[i + 1].size(), db)) {
+                return reply_builder::build(msg_value_not_integer_err);
+            }
+            if (db != 0) {
+                return reply_builder::build(msg_db_index_err);
+            }
+            ++i;
+        }
+        else {
+            return reply_builder::build(msg_syntax_err);
+        }
+    }
+    bytes& key = req._args[0];
+    bytes& dest = req._args[1];
+    if (key == dest) {
+        return reply_builder::build(msg_same_object_err);
+    }
+    redis_key src_rk { std::ref(key), req.key_hash() };
+    redis_key dst_rk { std::ref(dest) };
+    auto cpu = get_cpu(src_rk);
+    auto dst_cpu = get_cpu(dst_rk);
+    if (cpu == dst_cpu) {
+        return invoke_on_owner(cpu, &database::copy, std::move(src_rk), std::move(dst_rk), replace);
+    }
+    auto dst = dst_rk.key();
+    return invoke_on_owner(cpu, &database::dump_entry, std::move(src_rk), std::move(dst), false).then([dst_rk = std::move(dst_rk), dst_cpu, replace] (foreign_ptr<lw_shared_ptr<bytes>> record) mutable {
+        if (!record) {
+            return reply_builder::build(msg_zero);
+        }
+        return invoke_on_owner(dst_cpu, &database::restore_entry, std::move(dst_rk), std::move(record), replace).then([] (bool copied) {
+            return reply_builder::build(copied ? msg_one : msg_zero);
+        });
+    });
+}
+
+// MOVE key db: the only database is 0, which the key is in already.
+future<scattered_message_ptr> redis_service::move(request_wrapper& req)
+{
+    if (req._args_count != 2 || req._args.empty()) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    int64_t db = 0;
+    if (!parse_integer_string(req._args[1].data(), req._args[1].size(), db)) {
+        return reply_builder::build(msg_value_not_integer_err);
+    }
+    return reply_builder::build(db == 0 ? msg_same_object_err : msg_db_index_err);
+}
+
+future<scattered_message_ptr> redis_service::dump(request_wrapper& req)
+{
+    if (req._args_count != 1 || req._args.empty()) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    auto rk = take_key(req);
+    auto cpu = get_cpu(rk);
+    return invoke_on_owner(cpu, &database::dump, std::move(rk));
+}
+
+// RESTORE key ttl serialized-value [REPLACE] [ABSTTL]. IDLETIME and FREQ
+// are taken and ignored, the cache keeps no such thing per key.
+future<scattered_message_ptr> redis_service::restore(request_wrapper& req)
+{
+    if (req._args_count < 3 || req._args.empty()) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    int64_t ttl = 0;
+    if (!parse_integer_string(req._args[1].data(), req._args[1].size(), ttl)) {
+        return reply_builder::build(msg_value_not_integer_err);
+    }
+    if (ttl < 0) {
+        return reply_builder::build(msg_invalid_ttl_err);
+    }
+    bool replace = false;
+    bool absttl = false;
+    for (size_t i = 3; i < req._args_count; ++i) {
+        if (strcasecmp(req._args[i].c_str(), "replace") == 0) {
+            replace = true;
+        }
+        else if (strcasecmp(req._args[i].c_str(), "absttl") == 0) {
+            absttl = true;
+        }
+        else if ((strcasecmp(req._args[i].c_str(), "idletime") == 0 || strcasecmp(req._args[i].c_str(), "freq") == 0)
+            && i + 1 < req._args_count) {
+            int64_t ignored = 0;
+            if (!parse_integer_string(req._args[i + 1].data(), req._args[i + 1].size(), ignored)) {
+                return reply_builder::build(msg_value_not_integer_err);
+            }
+            ++i;
+        }
+        else {
+            return reply_builder::build(msg_syntax_err);
+        }
+    }
+    uint64_t expire_at_ms = 0;
+    if (ttl > 0) {
+        auto now = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+        expire_at_ms = absttl ? static_cast<uint64_t>(ttl) : static_cast<uint64_t>(now + ttl);
+    }
+    auto payload = std::move(req._args[2]);
+    auto rk = take_key(req);
+    auto cpu = get_cpu(rk);
+    return invoke_on_owner(cpu, &database::restore, std::move(rk), std::move(payload), expire_at_ms, replace);
+}
+
 future<scattered_message_ptr> redis_service::mset(request_wrapper& req)
 {
     if (req._args_count <= 1 || req._args.empty()) {
@@ -180,24 +650,36 @@ future<scattered_message_ptr> redis_service::mset(request_wrapper& req)
     if (req._args.size() % 2 != 0) {
         return reply_builder::build(msg_syntax_err);
     }
+    using batch_type = std::vector<std::pair<redis_key, bytes>>;
     struct mset_state {
-        std::vector<std::pair<bytes, bytes>>& key_value_pairs;
+        std::vector<batch_type> batches;
+        size_t pair_size;
         size_t success_count;
     };
     auto pair_size = req._args.size() / 2;
+    std::vector<batch_type> batches(smp::count);
     for (size_t i = 0; i < pair_size; ++i) {
-        req._tmp_key_value_pairs.emplace_back(std::make_pair(std::move(req._args[i * 2]), std::move(req._args[i * 2 + 1])));
-    }
-    return do_with(mset_state{std::ref(req._tmp_key_value_pairs), 0}, [this] (auto& state) {
-        return parallel_for_each(std::begin(state.key_value_pairs), std::end(state.key_value_pairs), [this, &state] (auto& entry) {
-            bytes& key = entry.first;
-            bytes& value = entry.second;
-            redis_key rk {std::ref(key)};
-            return get_database().invoke_on(this->get_cpu(rk), &database::set_direct, std::move(rk), std::move(value), 0, FLAG_SET_NO).then([&state] (auto m) {
-                if (m) state.success_count++ ;
+        redis_key rk { std::move(req._args[i * 2]) };
+        auto cpu = get_cpu(rk);
+        batches[cpu].emplace_back(std::make_pair(std::move(rk), std::move(req._args[i * 2 + 1])));
+    }
+    auto only = only_shard(batches, [] (const batch_type& b) { return b.empty(); });
+    if (only != smp::count) {
+        return invoke_on_owner(only, &database::set_direct_batch, std::move(batches[only])).then([pair_size] (auto success) {
+            return reply_builder::build(pair_size == success ? msg_ok : msg_err);
+        });
+    }
+    return do_with(mset_state{std::move(batches), pair_size, 0}, [] (auto& state) {
+        return parallel_for_each(boost::irange<unsigned>(0, smp::count), [&state] (unsigned cpu) {
+            auto& batch = state.batches[cpu];
+            if (batch.empty()) {
+                return make_ready_future<>();
+            }
+            return invoke_on_owner(cpu, &database::set_direct_batch, std::move(batch)).then([&state] (auto success) {
+                state.success_count += success;
             });
         }).then([&state] {
-            return reply_builder::build(state.key_value_pairs.size() == state.success_count ? msg_ok : msg_err);
+            return reply_builder::build(state.pair_size == state.success_count ? msg_ok : msg_err);
         });
    });
 }
@@ -208,9 +690,142 @@ future<scattered_message_ptr> redis_service::get(request_wrapper& req)
         return reply_builder::build(msg_syntax_err);
     }
     bytes& key = req._args[0];
-    redis_key rk { std::ref(key) };
+    redis_key rk { std::ref(key), req.key_hash() };
+    auto cpu = get_cpu(rk);
+    if (!_sharded_counter_patterns.empty() && sharded_counter(key)) {
+        return _counter_folder(key).then([rk = std::move(rk), cpu] () mutable {
+            return invoke_on_owner(cpu, &database::get, std::move(rk));
+        });
+    }
+    auto hot = sample_read(key);
+    if (cpu == engine().cpu_id()) {
+        return invoke_on_owner(cpu, &database::get, std::move(rk));
+    }
+    if (_hot_key_copies) {
+        auto c = _hot_copies.find(key);
+        if (c != _hot_copies.end()) {
+            ++_hot_copy_hits;
+            return reply_builder::build(c->second);
+        }
+        if (hot && _hot_copies.size() < max_hot_copies && _hot_copy_fetches.count(key) == 0) {
+            return copy_hot_key(key, std::move(rk), cpu);
+        }
+    }
+    if (!_coalesce_reads) {
+        return invoke_for_value(cpu, &database::get_value, std::move(rk));
+    }
+    auto i = _reads_in_flight.find(key);
+    if (i != _reads_in_flight.end()) {
+        ++_coalesced_reads;
+        return i->second->get_shared_future().then([] (lw_shared_ptr<const bytes> reply) {
+            return reply_builder::build(std::move(reply));
+        });
+    }
+    auto read = make_lw_shared<coalesced_read>();
+    _reads_in_flight.emplace(key, read);
+    get_database().invoke_on(cpu, &database::get, std::move(rk)).then_wrapped([this, key, read] (future<scattered_message_ptr> f) {
+        auto i = _reads_in_flight.find(key);
+        if (i != _reads_in_flight.end() && i->second == read) {
+            _reads_in_flight.erase(i);
+        }
+        try {
+            read->set_value(make_lw_shared<const bytes>(reply_builder::to_bytes(f.get0())));
+        } catch (...) {
+            read->set_exception(std::current_exception());
+        }
+    });
+    return read->get_shared_future().then([] (lw_shared_ptr<const bytes> reply) {
+        return reply_builder::build(std::move(reply));
+    });
+}
+
+// GETDEL key: the value is read and the key deleted in the same call on
+// its shard.
+future<scattered_message_ptr> redis_service::getdel(request_wrapper& req)
+{
+    if (req._args_count != 1 || req._args.empty()) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    redis_key rk { std::ref(req._args[0]), req.key_hash() };
+    auto cpu = get_cpu(rk);
+    return invoke_for_value(cpu, &database::getdel, std::move(rk));
+}
+
+// GETEX key [EX seconds|PX milliseconds|EXAT unix-time|PXAT unix-time-ms|PERSIST]
+future<scattered_message_ptr> redis_service::getex(request_wrapper& req)
+{
+    if (req._args_count < 1 || req._args_count > 3 || req._args.empty()) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    auto is = [&req] (const char* name) {
+        return strcasecmp(req._args[1].c_str(), name) == 0;
+    };
+    long expire = -1;
+    bool persist = false;
+    if (req._args_count == 2) {
+        if (!is("persist")) {
+            return reply_builder::build(msg_syntax_err);
+        }
+        persist = true;
+    }
+    else if (req._args_count == 3) {
+        int64_t n = 0;
+        if (!parse_integer_string(req._args[2].data(), req._args[2].size(), n) || n <= 0) {
+            return reply_builder::build(msg_syntax_err);
+        }
+        if (is("ex")) {
+            expire = n * 1000;
+        }
+        else if (is("px")) {
+            expire = n;
+        }
+        else if (is("exat") || is("pxat")) {
+            auto at = is("exat") ? n * 1000 : n;
+            auto now = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+            // a time already past expires the key at once.
+            expire = at > now ? at - now : 0;
+        }
+        else {
+            return reply_builder::build(msg_syntax_err);
+        }
+    }
+    redis_key rk { std::ref(req._args[0]), req.key_hash() };
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::get, std::move(rk));
+    return invoke_for_value(cpu, &database::getex, std::move(rk), expire, persist);
+}
+
+bool redis_service::sample_read(const bytes& key)
+{
+    if (++_reads % hot_key_sample_rate != 0) {
+        return false;
+    }
+    auto now = lowres_clock::now();
+    if (now - _hot_keys_decayed >= std::chrono::seconds(1)) {
+        _hot_keys.decay();
+        _hot_keys_decayed = now;
+        // the copies of the keys which cooled down are dropped.
+        for (auto i = _hot_copies.begin(); i != _hot_copies.end();) {
+            i = _hot_keys.count(i->first) == 0 ? _hot_copies.erase(i) : std::next(i);
+        }
+    }
+    // the count settles near twice the samples of a second.
+    return _hot_keys.offer(key) * hot_key_sample_rate >= 2 * _hot_key_threshold;
+}
+
+future<scattered_message_ptr> redis_service::copy_hot_key(bytes key, redis_key rk, unsigned cpu)
+{
+    _hot_copy_fetches.emplace(key);
+    return get_database().invoke_on(cpu, &database::get_for_copy, std::move(rk)).then_wrapped([this, key] (future<std::pair<scattered_message_ptr, bool>> f) {
+        // not there any more when a write of the key through this shard or
+        // the owner dropped it meanwhile.
+        auto fetching = _hot_copy_fetches.erase(key) > 0;
+        auto result = f.get0();
+        auto reply = make_lw_shared<const bytes>(reply_builder::to_bytes(std::move(result.first)));
+        if (fetching && result.second && reply->size() <= max_hot_copy_bytes) {
+            _hot_copies[key] = reply;
+        }
+        return reply_builder::build(std::move(reply));
+    });
 }
 
 future<scattered_message_ptr> redis_service::mget(request_wrapper& req)
@@ -218,24 +833,52 @@ future<scattered_message_ptr> redis_service::mget(request_wrapper& req)
     if (req._args_count < 1) {
         return reply_builder::build(msg_syntax_err);
     }
-    using return_type = foreign_ptr<lw_shared_ptr<bytes>>;
+    using return_type = foreign_ptr<lw_shared_ptr<database::batch_values_type>>;
     struct mget_state {
-        std::vector<bytes> keys;
+        std::vector<shard_batch> batches;
         std::vector<return_type> values;
+        size_t count;
     };
-    for (size_t i = 0; i < req._args_count; ++i) {
-        req._tmp_keys.emplace_back(req._args[i]);
+    auto batches = group_by_shard(req._args, req._args_count);
+    auto only = only_shard(batches, [] (const shard_batch& b) { return b._keys.empty(); });
+    if (only != smp::count) {
+        // the values come back in the order of the keys.
+        return invoke_on_owner(only, &database::get_direct_batch, std::move(batches[only]._keys)).then([] (auto&& values) {
+            std::vector<const bytes*> ordered;
+            ordered.reserve(values->size());
+            for (auto& v : *values) {
+                ordered.push_back(v ? &(*v) : nullptr);
+            }
+            return reply_builder::build(ordered);
+        });
     }
-    return do_with(mget_state{std::move(req._tmp_keys), {}}, [this] (auto& state) {
-        return parallel_for_each(std::begin(state.keys), std::end(state.keys), [this, &state] (bytes& key) {
-            redis_key rk { std::ref(key) };
-            return get_database().invoke_on(this->get_cpu(rk), &database::get_direct, std::move(rk)).then([&state] (auto&& m) {
-                if (m) {
-                   state.values.emplace_back(std::move(m));
-                }
+    return do_with(mget_state{std::move(batches), {}, req._args_count}, [] (auto& state) {
+        state.values.resize(smp::count);
+        return parallel_for_each(boost::irange<unsigned>(0, smp::count), [&state] (unsigned cpu) {
+            auto& batch = state.batches[cpu];
+            if (batch._keys.empty()) {
+                return make_ready_future<>();
+            }
+            return invoke_on_owner(cpu, &database::get_direct_batch, std::move(batch._keys)).then([&state, cpu] (auto&& m) {
+                state.values[cpu] = std::move(m);
             });
         }).then([&state] {
-            return reply_builder::build(state.values);
+            // Reassemble the values in the order of the requested keys.
+            std::vector<const bytes*> ordered(state.count, nullptr);
+            for (unsigned cpu = 0; cpu < smp::count; ++cpu) {
+                auto& values = state.values[cpu];
+                if (!values) {
+                    continue;
+                }
+                auto& positions = state.batches[cpu]._positions;
+                for (size_t i = 0; i < positions.size(); ++i) {
+                    auto& v = (*values)[i];
+                    if (v) {
+                        ordered[positions[i]] = &(*v);
+                    }
+                }
+            }
+            return reply_builder::build(ordered);
         });
     });
 }
@@ -246,16 +889,59 @@ future<scattered_message_ptr> redis_service::strlen(request_wrapper& req)
         return reply_builder::build(msg_syntax_err);
     }
     bytes& key = req._args[0];
-    redis_key rk { std::ref(key) };
+    redis_key rk { std::ref(key), req.key_hash() };
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::strlen, std::move(rk));
+    return invoke_on_owner(cpu, &database::strlen, std::move(rk));
 }
 
-future<bool> redis_service::exists_impl(bytes& key)
+future<scattered_message_ptr> redis_service::setrange(request_wrapper& req)
 {
-    redis_key rk { std::ref(key) };
+    if (req._args_count != 3 || req._args.empty()) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    bytes& key = req._args[0];
+    long offset = 0;
+    try {
+        offset = std::stol(req._args[1]);
+    } catch (const std::exception&) {
+        return reply_builder::build(msg_value_not_integer_err);
+    }
+    if (offset < 0) {
+        return reply_builder::build(msg_offset_err);
+    }
+    bytes& val = req._args[2];
+    // strings are at most 512MB, as in Redis.
+    if (static_cast<size_t>(offset) + val.size() > (BITMAP_MAX_OFFSET >> 3) + 1) {
+        return reply_builder::build(msg_string_size_err);
+    }
+    redis_key rk { std::ref(key), req.key_hash() };
+    auto cpu = get_cpu(rk);
+    return invoke_on_owner(cpu, &database::setrange, std::move(rk), static_cast<size_t>(offset), std::move(val));
+}
+
+future<scattered_message_ptr> redis_service::getrange(request_wrapper& req)
+{
+    if (req._args_count != 3 || req._args.empty()) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    bytes& key = req._args[0];
+    long start = 0, end = 0;
+    try {
+        start = std::stol(req._args[1]);
+        end = std::stol(req._args[2]);
+    } catch (const std::exception&) {
+        return reply_builder::build(msg_value_not_integer_err);
+    }
+    redis_key rk { std::ref(key), req.key_hash() };
+    auto cpu = get_cpu(rk);
+    return invoke_on_owner(cpu, &database::getrange, std::move(rk), start, end);
+}
+
+future<bool> redis_service::exists_impl(bytes& key)
+{
+    redis_key rk { std::ref(key) };
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::exists_direct, std::move(rk));
+    return invoke_on_owner(cpu, &database::exists_direct, std::move(rk));
 }
 
 future<scattered_message_ptr> redis_service::exists(request_wrapper& req)
@@ -275,9 +961,9 @@ future<scattered_message_ptr> redis_service::exists(request_wrapper& req)
             size_t success_count;
         };
         for (size_t i = 0; i < req._args_count; ++i) {
-            req._tmp_keys.emplace_back(req._args[i]);
+            req.tmp()._keys.emplace_back(req._args[i]);
         }
-        return do_with(mexists_state{std::ref(req._tmp_keys), 0}, [this] (auto& state) {
+        return do_with(mexists_state{std::ref(req.tmp()._keys), 0}, [this] (auto& state) {
             return parallel_for_each(std::begin(state.keys), std::end(state.keys), [this, &state] (auto& key) {
                 return this->exists_impl(key).then([&state] (auto r) {
                     if (r) state.success_count++;
@@ -295,24 +981,27 @@ future<scattered_message_ptr> redis_service::append(request_wrapper& req)
         return reply_builder::build(msg_syntax_err);
     }
     bytes& key = req._args[0];
-    bytes& val = req._args[1];
-    redis_key rk { std::ref(key) };
+    redis_key rk { std::ref(key), req.key_hash() };
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::append, std::move(rk), std::move(val));
+    if (req.fragmented(1)) {
+        return invoke_on_owner(cpu, &database::append_fragments, std::move(rk), req.arg_fragments(1));
+    }
+    bytes& val = req._args[1];
+    return invoke_on_owner(cpu, &database::append, std::move(rk), std::move(val));
 }
 
 future<scattered_message_ptr> redis_service::push_impl(bytes& key, bytes& val, bool force, bool left)
 {
     redis_key rk {std::ref(key)};
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::push, std::move(rk), std::move(val), force, left);
+    return invoke_on_owner(cpu, &database::push, std::move(rk), std::move(val), force, left);
 }
 
 future<scattered_message_ptr> redis_service::push_impl(bytes& key, std::vector<bytes>& vals, bool force, bool left)
 {
     redis_key rk {std::ref(key)};
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::push_multi, std::move(rk), std::move(vals), force, left);
+    return invoke_on_owner(cpu, &database::push_multi, std::move(rk), std::move(vals), force, left);
 }
 
 future<scattered_message_ptr> redis_service::push_impl(request_wrapper& req, bool force, bool left)
@@ -326,8 +1015,8 @@ future<scattered_message_ptr> redis_service::push_impl(request_wrapper& req, boo
         return push_impl(key, value, force, left);
     }
     else {
-        for (size_t i = 1; i < req._args.size(); ++i) req._tmp_keys.emplace_back(req._args[i]);
-        return push_impl(key, req._tmp_keys, force, left);
+        for (size_t i = 1; i < req._args.size(); ++i) req.tmp()._keys.emplace_back(req._args[i]);
+        return push_impl(key, req.tmp()._keys, force, left);
     }
 }
 
@@ -367,9 +1056,240 @@ future<scattered_message_ptr> redis_service::pop_impl(request_wrapper& req, bool
         return reply_builder::build(msg_syntax_err);
     }
     bytes& key = req._args[0];
-    redis_key rk {std::ref(key)};
+    redis_key rk { std::ref(key), req.key_hash() };
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::pop, std::move(rk), left);
+    return invoke_on_owner(cpu, &database::pop, std::move(rk), left);
+}
+
+// Seconds, as a float since Redis 6.
+static bool parse_timeout(const bytes& arg, double& timeout)
+{
+    return parse_float_string(arg.data(), arg.size(), timeout) && std::isfinite(timeout);
+}
+
+static future<scattered_message_ptr> build_bulk(const bytes& value)
+{
+    auto m = make_lw_shared<scattered_message<char>>();
+    reply_builder::append_bulk(*m, value);
+    return make_ready_future<scattered_message_ptr>(foreign_ptr<lw_shared_ptr<scattered_message<char>>>(m));
+}
+
+// The shards owning the keys are asked in the order of their first key,
+// each popping from its keys or blocking the pop on them, until one pops.
+// A pop blocked on several shards is served by the first claiming it, see
+// blocked_pop; it is then forgotten by all of them before it is destroyed.
+future<lw_shared_ptr<blocked_pop>> redis_service::pop_blocking(std::vector<bytes> keys, bool left, double timeout, bool block, const stream_read* read,
+    bool sset)
+{
+    struct wait_state {
+        lw_shared_ptr<blocked_pop> _pop;
+        std::vector<std::pair<unsigned, std::vector<bytes>>> _shards;
+        std::vector<size_t> _blocked;
+    };
+    wait_state state { make_lw_shared<blocked_pop>(engine().cpu_id(), left), {}, {} };
+    state._pop->_read = read;
+    state._pop->_sset = sset;
+    for (auto& key : keys) {
+        auto cpu = get_cpu(key);
+        auto i = std::find_if(state._shards.begin(), state._shards.end(), [cpu] (auto& s) { return s.first == cpu; });
+        if (i == state._shards.end()) {
+            state._shards.emplace_back(cpu, std::vector<bytes>());
+            i = state._shards.end() - 1;
+        }
+        i->second.push_back(std::move(key));
+    }
+    return do_with(std::move(state), [block, timeout] (wait_state& state) {
+        return do_for_each(boost::irange<size_t>(0, state._shards.size()), [&state, block] (size_t i) {
+            if (state._pop->claimed()) {
+                return make_ready_future<>();
+            }
+            auto& s = state._shards[i];
+            return get_database().invoke_on(s.first, [b = state._pop.get(), keys = s.second, block] (database& db) mutable {
+                // a pop writes: it waits for a transaction holding the shard.
+                return db.transaction_writes().then([&db, b, keys = std::move(keys), block] () mutable {
+                    return b->_read ? db.read_or_block(std::move(keys), b, block) : db.pop_or_block(std::move(keys), b, block);
+                });
+            }).then([&state, i] (bool done) {
+                if (!done) {
+                    state._blocked.push_back(i);
+                }
+            });
+        }).then([&state, block, timeout] {
+            auto& b = *state._pop;
+            if (!block) {
+                if (b.claim()) {
+                    b.finish(blocked_pop::outcome::timed_out);
+                }
+            }
+            else if (timeout > 0) {
+                b._timeout.set_callback([&b] {
+                    if (b.claim()) {
+                        b.finish(blocked_pop::outcome::timed_out);
+                    }
+                });
+                b._timeout.arm(std::chrono::duration_cast<steady_clock_type::duration>(std::chrono::duration<double>(timeout)));
+            }
+            return b._done.get_future();
+        }).then([&state] {
+            state._pop->_timeout.cancel();
+            return parallel_for_each(state._blocked, [&state] (size_t i) {
+                auto& s = state._shards[i];
+                return get_database().invoke_on(s.first, [b = state._pop.get(), keys = std::move(s.second)] (database& db) mutable {
+                    db.unblock(std::move(keys), b);
+                });
+            });
+        }).then([&state] {
+            return state._pop;
+        });
+    });
+}
+
+// A command of a transaction or of a script has no connection to wait on,
+// so it only pops, as in Redis.
+future<scattered_message_ptr> redis_service::blocking_pop(request_wrapper& req, bool left, bool sset)
+{
+    if (req._args_count < 2 || req._args.empty()) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    double timeout = 0;
+    if (!parse_timeout(req._args[req._args_count - 1], timeout)) {
+        return reply_builder::build(msg_timeout_err);
+    }
+    if (timeout < 0) {
+        return reply_builder::build(msg_negative_timeout_err);
+    }
+    std::vector<bytes> keys(req._args.begin(), req._args.begin() + req._args_count - 1);
+    return pop_blocking(std::move(keys), left, timeout, req._sink != nullptr, nullptr, sset).then([sset] (lw_shared_ptr<blocked_pop> b) {
+        switch (b->_outcome) {
+        case blocked_pop::outcome::popped: {
+            auto m = make_lw_shared<scattered_message<char>>();
+            reply_builder::append_array_header(*m, sset ? 3 : 2);
+            reply_builder::append_bulk(*m, b->_key);
+            if (sset) {
+                // the member and its score, encoded by the shard popping.
+                m->append(std::move(b->_value));
+            }
+            else {
+                reply_builder::append_bulk(*m, b->_value);
+            }
+            return make_ready_future<scattered_message_ptr>(foreign_ptr<lw_shared_ptr<scattered_message<char>>>(m));
+        }
+        case blocked_pop::outcome::wrong_type:
+            return reply_builder::build(msg_type_err);
+        default:
+            return reply_builder::build(msg_null_multi_bulk);
+        }
+    });
+}
+
+future<scattered_message_ptr> redis_service::blpop(request_wrapper& req)
+{
+    return blocking_pop(req, false);
+}
+
+future<scattered_message_ptr> redis_service::brpop(request_wrapper& req)
+{
+    return blocking_pop(req, true);
+}
+
+future<scattered_message_ptr> redis_service::lmove(request_wrapper& req, bool blocking)
+{
+    if (req._args_count != (blocking ? 5u : 4u) || req._args.empty()) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    // LPUSH and LPOP pass `left` false to database::push() and pop().
+    auto side_of = [] (const bytes& side, bool& left) {
+        if (strcasecmp(side.c_str(), "left") == 0) {
+            left = false;
+            return true;
+        }
+        if (strcasecmp(side.c_str(), "right") == 0) {
+            left = true;
+            return true;
+        }
+        return false;
+    };
+    bool from = false, to = false;
+    if (!side_of(req._args[2], from) || !side_of(req._args[3], to)) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    double timeout = 0;
+    if (blocking) {
+        if (!parse_timeout(req._args[4], timeout)) {
+            return reply_builder::build(msg_timeout_err);
+        }
+        if (timeout < 0) {
+            return reply_builder::build(msg_negative_timeout_err);
+        }
+    }
+    return move_element(req, from, to, blocking, timeout);
+}
+
+// RPOPLPUSH is LMOVE source destination RIGHT LEFT.
+future<scattered_message_ptr> redis_service::rpoplpush(request_wrapper& req, bool blocking)
+{
+    if (req._args_count != (blocking ? 3u : 2u) || req._args.empty()) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    double timeout = 0;
+    if (blocking) {
+        if (!parse_timeout(req._args[2], timeout)) {
+            return reply_builder::build(msg_timeout_err);
+        }
+        if (timeout < 0) {
+            return reply_builder::build(msg_negative_timeout_err);
+        }
+    }
+    return move_element(req, true, false, blocking, timeout);
+}
+
+// Both keys on one shard: one call there moves the element, atomically.
+// Only a blocking move finding the source empty goes on as across shards,
+// where the element is popped, then pushed to the destination: another
+// command may come between the two. It goes back where it was popped from
+// if the destination holds another type.
+future<scattered_message_ptr> redis_service::move_element(request_wrapper& req, bool from, bool to, bool blocking, double timeout)
+{
+    auto& source = req._args[0];
+    auto& destination = req._args[1];
+    auto cpu = get_cpu(source);
+    bool wait = blocking && req._sink != nullptr;
+    if (cpu == get_cpu(destination)) {
+        auto moved = invoke_on_owner(cpu, &database::lmove, redis_key { source }, redis_key { destination }, from, to, wait);
+        if (!wait) {
+            return moved;
+        }
+        return moved.then([this, &req, from, to, timeout] (scattered_message_ptr reply) {
+            if (reply) {
+                return make_ready_future<scattered_message_ptr>(std::move(reply));
+            }
+            return this->pop_and_push(req, from, to, timeout, true);
+        });
+    }
+    return pop_and_push(req, from, to, timeout, wait);
+}
+
+future<scattered_message_ptr> redis_service::pop_and_push(request_wrapper& req, bool from, bool to, double timeout, bool wait)
+{
+    std::vector<bytes> keys { req._args[0] };
+    return pop_blocking(std::move(keys), from, timeout, wait).then([this, &req, from, to] (lw_shared_ptr<blocked_pop> b) {
+        if (b->_outcome == blocked_pop::outcome::wrong_type) {
+            return reply_builder::build(msg_type_err);
+        }
+        if (b->_outcome != blocked_pop::outcome::popped) {
+            return reply_builder::build(msg_null_blik);
+        }
+        auto& destination = req._args[1];
+        return invoke_on_owner(get_cpu(destination), &database::push, redis_key { destination }, b->_value, true, to).then([this, b, from] (scattered_message_ptr reply) {
+            auto pushed = reply_builder::to_bytes(std::move(reply));
+            if (pushed.empty() || pushed[0] != '-') {
+                return build_bulk(b->_value);
+            }
+            return invoke_on_owner(get_cpu(b->_key), &database::push, redis_key { b->_key }, b->_value, true, from).then([] (scattered_message_ptr) {
+                return reply_builder::build(msg_type_err);
+            });
+        });
+    });
 }
 
 future<scattered_message_ptr> redis_service::lindex(request_wrapper& req)
@@ -379,9 +1299,9 @@ future<scattered_message_ptr> redis_service::lindex(request_wrapper& req)
     }
     bytes& key = req._args[0];
     int idx = std::atoi(req._args[1].c_str());
-    redis_key rk {std::ref(key)};
+    redis_key rk { std::ref(key), req.key_hash() };
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::lindex, std::move(rk), idx);
+    return invoke_on_owner(cpu, &database::lindex, std::move(rk), idx);
 }
 
 future<scattered_message_ptr> redis_service::llen(request_wrapper& req)
@@ -390,9 +1310,9 @@ future<scattered_message_ptr> redis_service::llen(request_wrapper& req)
         return reply_builder::build(msg_syntax_err);
     }
     bytes& key = req._args[0];
-    auto cpu = get_cpu(key);
-    redis_key rk {std::ref(key)};
-    return get_database().invoke_on(cpu, &database::llen, std::move(rk));
+    redis_key rk { std::ref(key), req.key_hash() };
+    auto cpu = get_cpu(rk);
+    return invoke_on_owner(cpu, &database::llen, std::move(rk));
 }
 
 future<scattered_message_ptr> redis_service::linsert(request_wrapper& req)
@@ -407,9 +1327,9 @@ future<scattered_message_ptr> redis_service::linsert(request_wrapper& req)
     std::transform(dir.begin(), dir.end(), dir.begin(), ::toupper);
     bool after = true;
     if (dir == "BEFORE") after = false;
-    redis_key rk {std::ref(key)};
+    redis_key rk { std::ref(key), req.key_hash() };
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::linsert, std::move(rk), std::move(pivot), std::move(value), after);
+    return invoke_on_owner(cpu, &database::linsert, std::move(rk), std::move(pivot), std::move(value), after);
 }
 
 future<scattered_message_ptr> redis_service::lrange(request_wrapper& req)
@@ -422,9 +1342,11 @@ future<scattered_message_ptr> redis_service::lrange(request_wrapper& req)
     bytes& e = req._args[2];
     int start = std::atoi(s.c_str());
     int end = std::atoi(e.c_str());
-    redis_key rk {std::ref(key)};
+    redis_key rk { std::ref(key), req.key_hash() };
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::lrange, std::move(rk), start, end);
+    return stream_reply(req, [cpu, rk, start, end] (size_t next, size_t left, bool stream) {
+        return invoke_on_owner(cpu, &database::lrange, rk, start, end, next, left, stream);
+    });
 }
 
 future<scattered_message_ptr> redis_service::lset(request_wrapper& req)
@@ -436,9 +1358,9 @@ future<scattered_message_ptr> redis_service::lset(request_wrapper& req)
     bytes& index = req._args[1];
     bytes& value = req._args[2];
     int idx = std::atoi(index.c_str());
-    redis_key rk {std::ref(key)};
+    redis_key rk { std::ref(key), req.key_hash() };
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::lset, std::move(rk), idx, std::move(value));
+    return invoke_on_owner(cpu, &database::lset, std::move(rk), idx, std::move(value));
 }
 
 future<scattered_message_ptr> redis_service::ltrim(request_wrapper& req)
@@ -449,9 +1371,9 @@ future<scattered_message_ptr> redis_service::ltrim(request_wrapper& req)
     bytes& key = req._args[0];
     int start =  std::atoi(req._args[1].c_str());
     int stop = std::atoi(req._args[2].c_str());
-    redis_key rk {std::ref(key)};
+    redis_key rk { std::ref(key), req.key_hash() };
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::ltrim, std::move(rk), start, stop);
+    return invoke_on_owner(cpu, &database::ltrim, std::move(rk), start, stop);
 }
 
 future<scattered_message_ptr> redis_service::lrem(request_wrapper& req)
@@ -459,1419 +1381,4155 @@ future<scattered_message_ptr> redis_service::lrem(request_wrapper& req)
     if (req._args_count < 3 || req._args.empty()) {
         return reply_builder::build(msg_syntax_err);
     }
-    bytes& key = req._args[0];
     int count = std::atoi(req._args[1].c_str());
     bytes& value = req._args[2];
-    redis_key rk { std::move(key) };
+    auto rk = take_key(req);
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::lrem, std::move(rk), count, std::move(value));
+    return invoke_on_owner(cpu, &database::lrem, std::move(rk), count, std::move(value));
 }
 
-future<scattered_message_ptr> redis_service::incr(request_wrapper& req)
+// `<ms>-<seq>`, or `<ms>` for its first sequence, or for its last one when
+// it ends a range. `-` and `+` are the least and the greatest IDs, and an ID
+// after `(` is excluded from the range.
+static bool parse_range_id(const bytes& arg, bool end, stream_id& id)
 {
-    return counter_by(req, true, false);
+    if (arg.size() == 1 && (arg[0] == '-' || arg[0] == '+')) {
+        id = arg[0] == '-' ? stream_id::min() : stream_id::max();
+        return true;
+    }
+    bool exclusive = !arg.empty() && arg[0] == '(';
+    auto data = arg.data() + (exclusive ? 1 : 0);
+    auto size = arg.size() - (exclusive ? 1 : 0);
+    if (!stream_id::parse(data, size, id, end ? std::numeric_limits<uint64_t>::max() : 0)) {
+        return false;
+    }
+    if (!exclusive) {
+        return true;
+    }
+    if (!end) {
+        return id.next(id);
+    }
+    if (id == stream_id::min()) {
+        return false;
+    }
+    id = id._seq > 0 ? stream_id { id._ms, id._seq - 1 } : stream_id { id._ms - 1, std::numeric_limits<uint64_t>::max() };
+    return true;
 }
 
-future<scattered_message_ptr> redis_service::incrby(request_wrapper& req)
+static bool parse_count(const bytes& arg, size_t& count)
 {
-    return counter_by(req, true, true);
+    int64_t n = 0;
+    if (!parse_integer_string(arg.data(), arg.size(), n) || n < 0) {
+        return false;
+    }
+    count = static_cast<size_t>(n);
+    return true;
 }
-future<scattered_message_ptr> redis_service::decr(request_wrapper& req)
+
+// MAXLEN [~|=] <count> at args[i], moving i past it.
+static bool parse_max_length(request_wrapper& req, size_t& i, size_t& max_length, bool& approximate)
 {
-    return counter_by(req, false, false);
+    if (i + 1 < req._args_count && (req._args[i + 1] == "~" || req._args[i + 1] == "=")) {
+        approximate = req._args[++i] == "~";
+    }
+    return ++i < req._args_count && parse_count(req._args[i++], max_length);
 }
-future<scattered_message_ptr> redis_service::decrby(request_wrapper& req)
+
+static std::vector<stream_id> parse_ids(request_wrapper& req, size_t first, bool& valid)
 {
-    return counter_by(req, false, true);
+    std::vector<stream_id> ids;
+    valid = true;
+    for (size_t i = first; i < req._args_count && valid; ++i) {
+        stream_id id;
+        valid = stream_id::parse(req._args[i].data(), req._args[i].size(), id);
+        ids.push_back(id);
+    }
+    return ids;
 }
 
-future<scattered_message_ptr> redis_service::counter_by(request_wrapper& req, bool incr, bool with_step)
+// XADD key [NOMKSTREAM] [MAXLEN [~|=] count] *|id field value [field value ...]
+future<scattered_message_ptr> redis_service::xadd(request_wrapper& req)
 {
-    if (req._args_count < 1 || req._args.empty() || (with_step == true && req._args_count <= 1)) {
+    if (req._args_count < 4 || req._args.empty()) {
         return reply_builder::build(msg_syntax_err);
     }
-    bytes& key = req._args[0];
-    uint64_t step = 1;
-    if (with_step) {
-        bytes& s = req._args[1];
-        try {
-            step = std::atol(s.c_str());
-        } catch (const std::invalid_argument&) {
-            return reply_builder::build(msg_syntax_err);
+    bool make_stream = true, approximate = false;
+    size_t max_length = std::numeric_limits<size_t>::max();
+    size_t i = 1;
+    for (; i < req._args_count; ) {
+        auto& option = req._args[i];
+        if (strcasecmp(option.c_str(), "nomkstream") == 0) {
+            make_stream = false;
+            ++i;
+        }
+        else if (strcasecmp(option.c_str(), "maxlen") == 0) {
+            if (!parse_max_length(req, i, max_length, approximate)) {
+                return reply_builder::build(msg_value_not_integer_err);
+            }
+        }
+        else {
+            break;
         }
     }
-    redis_key rk { std::move(key) };
+    if (i + 3 > req._args_count || (req._args_count - i - 1) % 2 != 0) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    auto& id_arg = req._args[i];
+    stream_id id;
+    bool auto_id = id_arg == "*";
+    bool auto_seq = !auto_id && id_arg.size() > 2 && id_arg[id_arg.size() - 1] == '*' && id_arg[id_arg.size() - 2] == '-';
+    if (auto_seq) {
+        if (!stream_id::parse(id_arg.data(), id_arg.size() - 2, id)) {
+            return reply_builder::build(msg_stream_id_err);
+        }
+    }
+    else if (!auto_id && !stream_id::parse(id_arg.data(), id_arg.size(), id)) {
+        return reply_builder::build(msg_stream_id_err);
+    }
+    std::vector<bytes> args(req._args.begin() + i + 1, req._args.begin() + req._args_count);
+    auto rk = take_key(req);
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::counter_by, std::move(rk), step, incr);
+    return invoke_on_owner(cpu, &database::xadd, std::move(rk), std::move(args), size_t(0), id, auto_id, auto_seq, make_stream, max_length, approximate);
 }
 
-future<scattered_message_ptr> redis_service::hdel(request_wrapper& req)
+future<scattered_message_ptr> redis_service::xlen(request_wrapper& req)
 {
-    if (req._args_count < 2 || req._args.empty()) {
+    if (req._args_count != 1 || req._args.empty()) {
         return reply_builder::build(msg_syntax_err);
     }
-    bytes& key = req._args[0];
-    bytes& field = req._args[1];
-    redis_key rk { std::move(key) };
+    auto rk = take_key(req);
     auto cpu = get_cpu(rk);
-    if (req._args_count == 2) {
-        return get_database().invoke_on(cpu, &database::hdel, std::move(rk), std::move(field));
-    }
-    else {
-        for (size_t i = 1; i < req._args.size(); ++i) req._tmp_keys.emplace_back(req._args[i]);
-        auto& keys = req._tmp_keys;
-        return get_database().invoke_on(cpu, &database::hdel_multi, std::move(rk), std::move(keys));
-    }
+    return invoke_on_owner(cpu, &database::xlen, std::move(rk));
 }
 
-future<scattered_message_ptr> redis_service::hexists(request_wrapper& req)
+// XRANGE key start end [COUNT count], and XREVRANGE key end start [COUNT
+// count] when `reverse`.
+future<scattered_message_ptr> redis_service::xrange(request_wrapper& req, bool reverse)
 {
-    if (req._args_count < 2 || req._args.empty()) {
+    if ((req._args_count != 3 && req._args_count != 5) || req._args.empty()) {
         return reply_builder::build(msg_syntax_err);
     }
-    bytes& key = req._args[0];
-    bytes& field = req._args[1];
-    redis_key rk { std::move(key) };
+    stream_id start, end;
+    if (!parse_range_id(req._args[reverse ? 2 : 1], false, start) || !parse_range_id(req._args[reverse ? 1 : 2], true, end)) {
+        return reply_builder::build(msg_stream_id_err);
+    }
+    size_t count = 0;
+    if (req._args_count == 5) {
+        if (strcasecmp(req._args[3].c_str(), "count") != 0) {
+            return reply_builder::build(msg_syntax_err);
+        }
+        if (!parse_count(req._args[4], count)) {
+            return reply_builder::build(msg_value_not_integer_err);
+        }
+        if (count == 0) {
+            return reply_builder::build(msg_empty_multi_bulk);
+        }
+    }
+    auto rk = take_key(req);
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::hexists, std::move(rk), std::move(field));
+    return invoke_on_owner(cpu, &database::xrange, std::move(rk), start, end, count, reverse);
 }
 
-future<scattered_message_ptr> redis_service::hset(request_wrapper& req)
+future<scattered_message_ptr> redis_service::xdel(request_wrapper& req)
 {
-    if (req._args_count < 3 || req._args.empty()) {
+    if (req._args_count < 2 || req._args.empty()) {
         return reply_builder::build(msg_syntax_err);
     }
-    bytes& key = req._args[0];
-    bytes& field = req._args[1];
-    bytes& val = req._args[2];
-    redis_key rk { std::move(key) };
+    bool valid = true;
+    auto ids = parse_ids(req, 1, valid);
+    if (!valid) {
+        return reply_builder::build(msg_stream_id_err);
+    }
+    auto rk = take_key(req);
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::hset, std::move(rk), std::move(field), std::move(val));
+    return invoke_on_owner(cpu, &database::xdel, std::move(rk), std::move(ids));
 }
 
-future<scattered_message_ptr> redis_service::hmset(request_wrapper& req)
+// XTRIM key MAXLEN [~|=] count
+future<scattered_message_ptr> redis_service::xtrim(request_wrapper& req)
 {
-    if (req._args_count < 3 || req._args.empty()) {
+    if (req._args_count < 3 || req._args.empty() || strcasecmp(req._args[1].c_str(), "maxlen") != 0) {
         return reply_builder::build(msg_syntax_err);
     }
-    unsigned int field_count = (req._args_count - 1) / 2;
-    bytes& key = req._args[0];
-    for (unsigned int i = 0; i < field_count; ++i) {
-        req._tmp_key_values.emplace(std::make_pair(req._args[i], req._args[i + 1]));
+    size_t i = 1, max_length = 0;
+    bool approximate = false;
+    if (!parse_max_length(req, i, max_length, approximate)) {
+        return reply_builder::build(msg_value_not_integer_err);
     }
-    redis_key rk { std::move(key) };
+    if (i != req._args_count) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    auto rk = take_key(req);
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::hmset, std::move(rk), std::move(req._tmp_key_values));
+    return invoke_on_owner(cpu, &database::xtrim, std::move(rk), max_length, approximate);
 }
 
-future<scattered_message_ptr> redis_service::hincrby(request_wrapper& req)
+// XREAD [COUNT count] [BLOCK ms] STREAMS key [key ...] id [id ...], and
+// XREADGROUP GROUP group consumer [COUNT count] [BLOCK ms] [NOACK] STREAMS
+// key [key ...] id [id ...] when `grouped`.
+//
+// The streams are first read on their shards all at once, each reply
+// holding those with entries. When none has any and the command blocks, it
+// then waits for entries as BLPOP does for elements, see
+// database::read_or_block(), and replies with the stream which has some
+// first.
+future<scattered_message_ptr> redis_service::xread(request_wrapper& req, bool grouped)
+{
+    struct read_state {
+        stream_read _read;
+        std::vector<bytes> _keys;
+        std::vector<bytes> _ids;
+        std::vector<foreign_ptr<lw_shared_ptr<stream_read_result>>> _results;
+    };
+    read_state state;
+    double timeout = 0;
+    bool block = false;
+    size_t i = 0;
+    if (grouped) {
+        if (req._args_count < 3 || strcasecmp(req._args[0].c_str(), "group") != 0) {
+            return reply_builder::build(msg_syntax_err);
+        }
+        state._read._grouped = true;
+        state._read._group._group = req._args[1];
+        state._read._group._consumer = req._args[2];
+        i = 3;
+    }
+    for (; i < req._args_count; ++i) {
+        auto& option = req._args[i];
+        if (strcasecmp(option.c_str(), "streams") == 0) {
+            ++i;
+            break;
+        }
+        if (strcasecmp(option.c_str(), "count") == 0 && i + 1 < req._args_count) {
+            if (!parse_count(req._args[++i], state._read._count)) {
+                return reply_builder::build(msg_value_not_integer_err);
+            }
+        }
+        else if (strcasecmp(option.c_str(), "block") == 0 && i + 1 < req._args_count) {
+            int64_t ms = 0;
+            auto& arg = req._args[++i];
+            if (!parse_integer_string(arg.data(), arg.size(), ms)) {
+                return reply_builder::build(msg_timeout_err);
+            }
+            if (ms < 0) {
+                return reply_builder::build(msg_negative_timeout_err);
+            }
+            block = true;
+            timeout = ms / 1000.0;
+        }
+        else if (grouped && strcasecmp(option.c_str(), "noack") == 0) {
+            state._read._group._noack = true;
+        }
+        else {
+            return reply_builder::build(msg_syntax_err);
+        }
+    }
+    auto streams = req._args_count - i;
+    if (i > req._args_count || streams == 0 || streams % 2 != 0) {
+        return reply_builder::build(msg_stream_unbalanced_err);
+    }
+    streams /= 2;
+    for (size_t k = 0; k < streams; ++k) {
+        auto& id = req._args[i + streams + k];
+        stream_id parsed;
+        bool special = grouped ? id == ">" : id == "$";
+        if (!special && !stream_id::parse(id.data(), id.size(), parsed)) {
+            return reply_builder::build(msg_stream_id_err);
+        }
+        state._keys.push_back(req._args[i + k]);
+        state._ids.push_back(id);
+        state._read._after[req._args[i + k]] = parsed;
+    }
+    // a command of a transaction or of a script only reads.
+    block = block && req._sink != nullptr;
+    return do_with(std::move(state), [this, grouped, block, timeout] (read_state& state) {
+        state._results.resize(state._keys.size());
+        return parallel_for_each(boost::irange<size_t>(0, state._keys.size()), [this, &state, grouped] (size_t k) {
+            auto& key = state._keys[k];
+            auto& id = state._ids[k];
+            auto after = state._read._after[key];
+            auto cpu = get_cpu(key);
+            auto f = grouped
+                ? invoke_on_owner(cpu, &database::xreadgroup, redis_key { key }, state._read._group, id != ">", after, state._read._count)
+                : invoke_on_owner(cpu, &database::xread, redis_key { key }, after, id == "$", state._read._count);
+            return f.then([&state, k] (foreign_ptr<lw_shared_ptr<stream_read_result>> r) {
+                state._results[k] = std::move(r);
+            });
+        }).then([this, &state, grouped, block, timeout] {
+            bytes replies;
+            size_t n = 0;
+            for (size_t k = 0; k < state._keys.size(); ++k) {
+                auto& r = *state._results[k];
+                if (r._status == stream_read_result::status::wrong_type) {
+                    return reply_builder::build(msg_type_err);
+                }
+                if (r._status == stream_read_result::status::no_group) {
+                    return reply_builder::build(msg_stream_no_group_err);
+                }
+                if (!r._reply.empty()) {
+                    replies.append(r._reply.data(), r._reply.size());
+                    ++n;
+                }
+                if (state._ids[k] == "$") {
+                    state._read._after[state._keys[k]] = r._last_id;
+                }
+            }
+            if (n > 0 || !block) {
+                if (n == 0) {
+                    return reply_builder::build(msg_null_multi_bulk);
+                }
+                auto m = make_lw_shared<scattered_message<char>>();
+                reply_builder::append_array_header(*m, n);
+                m->append(std::move(replies));
+                return make_ready_future<scattered_message_ptr>(foreign_ptr<lw_shared_ptr<scattered_message<char>>>(m));
+            }
+            return pop_blocking(state._keys, false, timeout, true, &state._read).then([] (lw_shared_ptr<blocked_pop> b) {
+                switch (b->_outcome) {
+                case blocked_pop::outcome::popped: {
+                    auto m = make_lw_shared<scattered_message<char>>();
+                    reply_builder::append_array_header(*m, 1);
+                    m->append(std::move(b->_value));
+                    return make_ready_future<scattered_message_ptr>(foreign_ptr<lw_shared_ptr<scattered_message<char>>>(m));
+                }
+                case blocked_pop::outcome::wrong_type:
+                    return reply_builder::build(msg_type_err);
+                default:
+                    return reply_builder::build(msg_null_multi_bulk);
+                }
+            });
+        });
+    });
+}
+
+// XGROUP CREATE key group id|$ [MKSTREAM], SETID key group id|$, DESTROY
+// key group, CREATECONSUMER key group consumer, DELCONSUMER key group
+// consumer
+future<scattered_message_ptr> redis_service::xgroup(request_wrapper& req)
 {
     if (req._args_count < 3 || req._args.empty()) {
         return reply_builder::build(msg_syntax_err);
     }
-    bytes& key = req._args[0];
-    bytes& field = req._args[1];
-    bytes& val = req._args[2];
-    int delta = std::atoi(val.c_str());
-    redis_key rk { std::move(key) };
-    auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::hincrby, std::move(rk), std::move(field), delta);
+    auto& subcommand = req._args[0];
+    auto& key = req._args[1];
+    auto& group = req._args[2];
+    auto cpu = get_cpu(key);
+    auto parse_start = [&req] (stream_id& id, bool& last) {
+        last = req._args[3] == "$";
+        return last || stream_id::parse(req._args[3].data(), req._args[3].size(), id);
+    };
+    stream_id id;
+    bool last = false;
+    if (strcasecmp(subcommand.c_str(), "create") == 0 && (req._args_count == 4 || req._args_count == 5)) {
+        if (req._args_count == 5 && strcasecmp(req._args[4].c_str(), "mkstream") != 0) {
+            return reply_builder::build(msg_syntax_err);
+        }
+        if (!parse_start(id, last)) {
+            return reply_builder::build(msg_stream_id_err);
+        }
+        return invoke_on_owner(cpu, &database::xgroup_create, redis_key { key }, group, id, last, req._args_count == 5);
+    }
+    if (strcasecmp(subcommand.c_str(), "setid") == 0 && req._args_count == 4) {
+        if (!parse_start(id, last)) {
+            return reply_builder::build(msg_stream_id_err);
+        }
+        return invoke_on_owner(cpu, &database::xgroup_setid, redis_key { key }, group, id, last);
+    }
+    if (strcasecmp(subcommand.c_str(), "destroy") == 0 && req._args_count == 3) {
+        return invoke_on_owner(cpu, &database::xgroup_destroy, redis_key { key }, group);
+    }
+    bool create = strcasecmp(subcommand.c_str(), "createconsumer") == 0;
+    if ((create || strcasecmp(subcommand.c_str(), "delconsumer") == 0) && req._args_count == 4) {
+        return invoke_on_owner(cpu, &database::xgroup_consumer, redis_key { key }, group, req._args[3], create);
+    }
+    return reply_builder::build(msg_syntax_err);
 }
 
-future<scattered_message_ptr> redis_service::hincrbyfloat(request_wrapper& req)
+// XACK key group id [id ...]
+future<scattered_message_ptr> redis_service::xack(request_wrapper& req)
 {
     if (req._args_count < 3 || req._args.empty()) {
         return reply_builder::build(msg_syntax_err);
     }
-    bytes& key = req._args[0];
-    bytes& field = req._args[1];
-    bytes& val = req._args[2];
-    double delta = std::atof(val.c_str());
-    redis_key rk { std::move(key) };
+    bool valid = true;
+    auto ids = parse_ids(req, 2, valid);
+    if (!valid) {
+        return reply_builder::build(msg_stream_id_err);
+    }
+    auto& group = req._args[1];
+    auto rk = take_key(req);
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::hincrbyfloat, std::move(rk), std::move(field), delta);
+    return invoke_on_owner(cpu, &database::xack, std::move(rk), std::move(group), std::move(ids));
 }
 
-future<scattered_message_ptr> redis_service::hlen(request_wrapper& req)
+// XPENDING key group [[IDLE min-idle-time] start end count [consumer]]
+future<scattered_message_ptr> redis_service::xpending(request_wrapper& req)
 {
-    if (req._args_count < 1 || req._args.empty()) {
+    if (req._args_count < 2 || req._args.empty()) {
         return reply_builder::build(msg_syntax_err);
     }
-    bytes& key = req._args[0];
-    redis_key rk { std::move(key) };
+    auto& group = req._args[1];
+    bool extended = req._args_count > 2;
+    stream_id start, end;
+    size_t count = 0, min_idle = 0;
+    bytes consumer;
+    if (extended) {
+        size_t i = 2;
+        if (strcasecmp(req._args[i].c_str(), "idle") == 0) {
+            if (i + 1 >= req._args_count || !parse_count(req._args[i + 1], min_idle)) {
+                return reply_builder::build(msg_value_not_integer_err);
+            }
+            i += 2;
+        }
+        if (req._args_count != i + 3 && req._args_count != i + 4) {
+            return reply_builder::build(msg_syntax_err);
+        }
+        if (!parse_range_id(req._args[i], false, start) || !parse_range_id(req._args[i + 1], true, end)) {
+            return reply_builder::build(msg_stream_id_err);
+        }
+        if (!parse_count(req._args[i + 2], count)) {
+            return reply_builder::build(msg_value_not_integer_err);
+        }
+        if (req._args_count == i + 4) {
+            consumer = req._args[i + 3];
+        }
+    }
+    auto rk = take_key(req);
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::hlen, std::move(rk));
+    return invoke_on_owner(cpu, &database::xpending, std::move(rk), std::move(group), extended, start, end, count, uint64_t(min_idle), std::move(consumer));
 }
 
-future<scattered_message_ptr> redis_service::hstrlen(request_wrapper& req)
+// A timestamp in milliseconds, `-` and `+` being the first and the last of
+// a range.
+static bool parse_timestamp(const bytes& arg, uint64_t& ts)
 {
-    if (req._args_count < 2 || req._args.empty()) {
-        return reply_builder::build(msg_syntax_err);
+    if (arg.size() == 1 && (arg[0] == '-' || arg[0] == '+')) {
+        ts = arg[0] == '-' ? 0 : std::numeric_limits<uint64_t>::max();
+        return true;
     }
-    bytes& key = req._args[0];
-    bytes& field = req._args[1];
-    redis_key rk { std::move(key) };
-    auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::hstrlen, std::move(rk), std::move(field));
+    int64_t n = 0;
+    if (!parse_integer_string(arg.data(), arg.size(), n) || n < 0) {
+        return false;
+    }
+    ts = static_cast<uint64_t>(n);
+    return true;
 }
 
-future<scattered_message_ptr> redis_service::hget(request_wrapper& req)
+namespace {
+struct ts_range_options {
+    size_t _count = 0;
+    ts_aggregation _agg = ts_aggregation::none;
+    uint64_t _bucket_ms = 0;
+};
+}
+
+// [COUNT count] [AGGREGATION type bucket] from args[i] on, until `stop`
+// or the end of the arguments. Returns the error to reply, or nullptr.
+static const static_reply* parse_ts_range_options(request_wrapper& req, size_t& i, const char* stop, ts_range_options& o)
 {
-    if (req._args_count < 2 || req._args.empty()) {
-        return reply_builder::build(msg_syntax_err);
+    for (; i < req._args_count; ++i) {
+        auto& option = req._args[i];
+        if (stop != nullptr && strcasecmp(option.c_str(), stop) == 0) {
+            break;
+        }
+        if (strcasecmp(option.c_str(), "count") == 0 && i + 1 < req._args_count) {
+            if (!parse_count(req._args[++i], o._count)) {
+                return &msg_value_not_integer_err;
+            }
+        }
+        else if (strcasecmp(option.c_str(), "aggregation") == 0 && i + 2 < req._args_count) {
+            auto& type = req._args[++i];
+            if (!parse_ts_aggregation(type.data(), type.size(), o._agg)) {
+                return &msg_ts_aggregation_err;
+            }
+            if (!parse_count(req._args[++i], o._bucket_ms) || o._bucket_ms == 0) {
+                return &msg_value_not_integer_err;
+            }
+        }
+        else {
+            return &msg_syntax_err;
+        }
     }
-    bytes& key = req._args[0];
-    bytes& field = req._args[1];
-    redis_key rk { std::move(key) };
-    auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::hget, std::move(rk), std::move(field));
+    return nullptr;
 }
 
-future<scattered_message_ptr> redis_service::hgetall(request_wrapper& req)
+// TS.ADD key timestamp|* value [RETENTION ms]
+future<scattered_message_ptr> redis_service::ts_add(request_wrapper& req)
 {
-    if (req._args_count < 1 || req._args.empty()) {
+    if ((req._args_count != 3 && req._args_count != 5) || req._args.empty()) {
         return reply_builder::build(msg_syntax_err);
     }
-    bytes& key = req._args[0];
-    redis_key rk { std::move(key) };
+    auto& ts_arg = req._args[1];
+    bool now = ts_arg == "*";
+    uint64_t ts = 0;
+    if (!now && (ts_arg == "-" || ts_arg == "+" || !parse_timestamp(ts_arg, ts))) {
+        return reply_builder::build(msg_ts_timestamp_err);
+    }
+    double value = 0;
+    if (!parse_float_string(req._args[2].data(), req._args[2].size(), value) || std::isnan(value)) {
+        return reply_builder::build(msg_ts_value_err);
+    }
+    size_t retention_ms = 0;
+    if (req._args_count == 5) {
+        if (strcasecmp(req._args[3].c_str(), "retention") != 0) {
+            return reply_builder::build(msg_syntax_err);
+        }
+        if (!parse_count(req._args[4], retention_ms)) {
+            return reply_builder::build(msg_value_not_integer_err);
+        }
+    }
+    auto rk = take_key(req);
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::hgetall, std::move(rk));
+    return invoke_on_owner(cpu, &database::ts_add, std::move(rk), ts, now, value, uint64_t(retention_ms));
 }
 
-future<scattered_message_ptr> redis_service::hgetall_keys(request_wrapper& req)
+// TS.RANGE key from to [COUNT count] [AGGREGATION type bucket]
+future<scattered_message_ptr> redis_service::ts_range(request_wrapper& req)
 {
-    if (req._args_count < 1 || req._args.empty()) {
+    if (req._args_count < 3 || req._args.empty()) {
         return reply_builder::build(msg_syntax_err);
     }
-    bytes& key = req._args[0];
-    redis_key rk { std::move(key) };
+    uint64_t from = 0, to = 0;
+    if (!parse_timestamp(req._args[1], from) || !parse_timestamp(req._args[2], to)) {
+        return reply_builder::build(msg_ts_timestamp_err);
+    }
+    ts_range_options o;
+    size_t i = 3;
+    if (auto err = parse_ts_range_options(req, i, nullptr, o)) {
+        return reply_builder::build(*err);
+    }
+    auto rk = take_key(req);
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::hgetall_keys, std::move(rk));
+    return invoke_on_owner(cpu, &database::ts_range, std::move(rk), from, to, o._count, o._agg, o._bucket_ms);
 }
 
-future<scattered_message_ptr> redis_service::hgetall_values(request_wrapper& req)
+// TS.MRANGE from to [COUNT count] [AGGREGATION type bucket] KEYS key [key ...]
+//
+// The series are named rather than found by their labels, which Pedis does
+// not keep. Each is read and aggregated on its shard, all at once, and the
+// reply holds those of the keys holding a series, in the order of the keys.
+future<scattered_message_ptr> redis_service::ts_mrange(request_wrapper& req)
 {
-    if (req._args_count < 1 || req._args.empty()) {
+    struct mrange_state {
+        std::vector<bytes> _keys;
+        std::vector<foreign_ptr<lw_shared_ptr<bytes>>> _parts;
+    };
+    if (req._args_count < 4) {
         return reply_builder::build(msg_syntax_err);
     }
-    bytes& key = req._args[0];
-    redis_key rk { std::move(key) };
-    auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::hgetall_values, std::move(rk));
+    uint64_t from = 0, to = 0;
+    if (!parse_timestamp(req._args[0], from) || !parse_timestamp(req._args[1], to)) {
+        return reply_builder::build(msg_ts_timestamp_err);
+    }
+    ts_range_options o;
+    size_t i = 2;
+    if (auto err = parse_ts_range_options(req, i, "keys", o)) {
+        return reply_builder::build(*err);
+    }
+    if (i + 1 >= req._args_count) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    mrange_state state;
+    state._keys.assign(req._args.begin() + i + 1, req._args.begin() + req._args_count);
+    return do_with(std::move(state), [this, from, to, o] (mrange_state& state) {
+        state._parts.resize(state._keys.size());
+        return parallel_for_each(boost::irange<size_t>(0, state._keys.size()), [this, &state, from, to, o] (size_t k) {
+            auto& key = state._keys[k];
+            auto cpu = get_cpu(key);
+            return invoke_on_owner(cpu, &database::ts_mrange_part, redis_key { key }, from, to, o._count, o._agg, o._bucket_ms)
+                .then([&state, k] (foreign_ptr<lw_shared_ptr<bytes>> part) {
+                state._parts[k] = std::move(part);
+            });
+        }).then([&state] {
+            bytes series;
+            size_t n = 0;
+            for (auto& part : state._parts) {
+                if (!part->empty()) {
+                    series.append(part->data(), part->size());
+                    ++n;
+                }
+            }
+            auto m = make_lw_shared<scattered_message<char>>();
+            reply_builder::append_array_header(*m, n);
+            m->append(std::move(series));
+            return make_ready_future<scattered_message_ptr>(foreign_ptr<lw_shared_ptr<scattered_message<char>>>(m));
+        });
+    });
 }
 
-future<scattered_message_ptr> redis_service::hmget(request_wrapper& req)
+// BF.RESERVE key error_rate capacity [EXPANSION expansion] [NONSCALING]
+future<scattered_message_ptr> redis_service::bf_reserve(request_wrapper& req)
 {
-    if (req._args_count < 1 || req._args.empty()) {
+    if (req._args_count < 3 || req._args.empty()) {
         return reply_builder::build(msg_syntax_err);
     }
-    bytes& key = req._args[0];
-    for (unsigned int i = 1; i < req._args_count; ++i) {
-        req._tmp_keys.emplace_back(std::move(req._args[i]));
+    double error = 0;
+    if (!parse_float_string(req._args[1].data(), req._args[1].size(), error) || !(error > 0 && error < 1)) {
+        return reply_builder::build(msg_bf_error_rate_err);
     }
-    redis_key rk { std::move(key) };
+    size_t capacity = 0;
+    if (!parse_count(req._args[2], capacity) || capacity == 0) {
+        return reply_builder::build(msg_bf_capacity_err);
+    }
+    size_t expansion = bloom_lsa::default_expansion;
+    bool scaling = true;
+    for (size_t i = 3; i < req._args_count; ++i) {
+        if (strcasecmp(req._args[i].c_str(), "nonscaling") == 0) {
+            scaling = false;
+        }
+        else if (strcasecmp(req._args[i].c_str(), "expansion") == 0 && i + 1 < req._args_count) {
+            if (!parse_count(req._args[++i], expansion) || expansion == 0 || expansion > std::numeric_limits<uint32_t>::max()) {
+                return reply_builder::build(msg_value_not_integer_err);
+            }
+        }
+        else {
+            return reply_builder::build(msg_syntax_err);
+        }
+    }
+    auto rk = take_key(req);
     auto cpu = get_cpu(rk);
-    auto& keys = req._tmp_keys;
-    return get_database().invoke_on(cpu, &database::hmget, std::move(rk), std::move(keys));
+    return invoke_on_owner(cpu, &database::bf_reserve, std::move(rk), error, uint64_t(capacity), scaling ? uint32_t(expansion) : uint32_t(0));
 }
 
-future<scattered_message_ptr> redis_service::smembers_impl(bytes& key)
+// BF.ADD key item, BF.MADD key item [item ...]
+//
+// The items of a key are added in one call on its shard, the filter being
+// made with the default error rate and capacity unless it was reserved.
+future<scattered_message_ptr> redis_service::bf_add(request_wrapper& req, bool multi)
 {
-    redis_key rk { std::move(key) };
+    if ((multi ? req._args_count < 2 : req._args_count != 2) || req._args.empty()) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    std::vector<bytes> items(std::make_move_iterator(req._args.begin() + 1), std::make_move_iterator(req._args.end()));
+    auto rk = take_key(req);
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::smembers, std::move(rk));
+    return invoke_on_owner(cpu, &database::bf_add, std::move(rk), std::move(items), multi);
 }
 
-future<scattered_message_ptr> redis_service::smembers(request_wrapper& req)
+// BF.EXISTS key item, BF.MEXISTS key item [item ...]
+future<scattered_message_ptr> redis_service::bf_exists(request_wrapper& req, bool multi)
 {
-    if (req._args_count < 1 || req._args.empty()) {
+    if ((multi ? req._args_count < 2 : req._args_count != 2) || req._args.empty()) {
         return reply_builder::build(msg_syntax_err);
     }
-    bytes& key = req._args[0];
-    return smembers_impl(key);
+    std::vector<bytes> items(std::make_move_iterator(req._args.begin() + 1), std::make_move_iterator(req._args.end()));
+    auto rk = take_key(req);
+    auto cpu = get_cpu(rk);
+    return invoke_on_owner(cpu, &database::bf_exists, std::move(rk), std::move(items), multi);
 }
 
-future<scattered_message_ptr> redis_service::sadds_impl(bytes& key, std::vector<bytes>& members)
+// CMS.INITBYDIM key width depth, CMS.INITBYPROB key error probability
+//
+// A sketch made by its error, the share of the total count an estimate may
+// exceed the true count by, and the probability it does, is e / error wide,
+// rounded up to 2 / error, and log(probability) / log(1/2) deep.
+future<scattered_message_ptr> redis_service::cms_init(request_wrapper& req, bool by_prob)
 {
-    redis_key rk { std::move(key) };
+    if (req._args_count != 3 || req._args.empty()) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    uint64_t width = 0, depth = 0;
+    if (by_prob) {
+        double error = 0, probability = 0;
+        if (!parse_float_string(req._args[1].data(), req._args[1].size(), error) || !(error > 0 && error < 1)
+            || !parse_float_string(req._args[2].data(), req._args[2].size(), probability) || !(probability > 0 && probability < 1)) {
+            return reply_builder::build(msg_cms_probability_err);
+        }
+        width = static_cast<uint64_t>(std::ceil(2 / error));
+        depth = static_cast<uint64_t>(std::ceil(std::log10(probability) / std::log10(0.5)));
+    }
+    else {
+        size_t w = 0, d = 0;
+        if (!parse_count(req._args[1], w) || !parse_count(req._args[2], d)) {
+            return reply_builder::build(msg_cms_dimensions_err);
+        }
+        width = w;
+        depth = d;
+    }
+    if (width == 0 || depth == 0 || width > count_min_lsa::max_counters / depth) {
+        return reply_builder::build(msg_cms_dimensions_err);
+    }
+    auto rk = take_key(req);
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::sadds, std::move(rk), std::move(members));
+    return invoke_on_owner(cpu, &database::cms_init, std::move(rk), uint32_t(width), uint32_t(depth));
 }
 
-future<scattered_message_ptr> redis_service::sadds_impl_return_keys(bytes& key, std::vector<bytes>& members)
+// CMS.INCRBY key item increment [item increment ...]
+future<scattered_message_ptr> redis_service::cms_incrby(request_wrapper& req)
 {
-    redis_key rk { std::move(key) };
+    if (req._args_count < 3 || req._args_count % 2 == 0 || req._args.empty()) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    std::vector<std::pair<bytes, uint32_t>> increments;
+    increments.reserve(req._args_count / 2);
+    for (size_t i = 1; i + 1 < req._args_count; i += 2) {
+        size_t n = 0;
+        if (!parse_count(req._args[i + 1], n) || n > std::numeric_limits<uint32_t>::max()) {
+            return reply_builder::build(msg_cms_increment_err);
+        }
+        increments.emplace_back(std::move(req._args[i]), uint32_t(n));
+    }
+    auto rk = take_key(req);
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::sadds_direct, std::move(rk), std::move(members)).then([&members] (auto m) {
-        if (m)
-           return reply_builder::build(members);
-        return reply_builder::build(msg_err);
-    });
+    return invoke_on_owner(cpu, &database::cms_incrby, std::move(rk), std::move(increments));
 }
 
-future<scattered_message_ptr> redis_service::sadd(request_wrapper& req)
+// CMS.QUERY key item [item ...]
+future<scattered_message_ptr> redis_service::cms_query(request_wrapper& req)
 {
     if (req._args_count < 2 || req._args.empty()) {
         return reply_builder::build(msg_syntax_err);
     }
-    bytes& key = req._args[0];
-    for (uint32_t i = 1; i < req._args_count; ++i) req._tmp_keys.emplace_back(std::move(req._args[i]));
-    auto& keys = req._tmp_keys;
-    return sadds_impl(key, std::ref(keys));
+    std::vector<bytes> items(std::make_move_iterator(req._args.begin() + 1), std::make_move_iterator(req._args.end()));
+    auto rk = take_key(req);
+    auto cpu = get_cpu(rk);
+    return invoke_on_owner(cpu, &database::cms_query, std::move(rk), std::move(items));
 }
 
-future<scattered_message_ptr> redis_service::scard(request_wrapper& req)
+// TOPK.RESERVE key topk [width depth decay]
+future<scattered_message_ptr> redis_service::topk_reserve(request_wrapper& req)
 {
-    if (req._args_count < 1 || req._args.empty()) {
+    if ((req._args_count != 2 && req._args_count != 5) || req._args.empty()) {
         return reply_builder::build(msg_syntax_err);
     }
-    bytes& key = req._args[0];
-    redis_key rk { std::move(key) };
+    size_t k = 0, width = topk_lsa::default_width, depth = topk_lsa::default_depth;
+    double decay = topk_lsa::default_decay;
+    if (!parse_count(req._args[1], k)) {
+        return reply_builder::build(msg_topk_params_err);
+    }
+    if (req._args_count == 5) {
+        if (!parse_count(req._args[2], width) || !parse_count(req._args[3], depth)
+            || !parse_float_string(req._args[4].data(), req._args[4].size(), decay)) {
+            return reply_builder::build(msg_topk_params_err);
+        }
+    }
+    if (k == 0 || k > std::numeric_limits<uint32_t>::max() || width == 0 || depth == 0
+        || width > topk_lsa::max_buckets / depth || !(decay > 0 && decay <= 1)) {
+        return reply_builder::build(msg_topk_params_err);
+    }
+    auto rk = take_key(req);
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::scard, std::move(rk));
+    return invoke_on_owner(cpu, &database::topk_reserve, std::move(rk), uint32_t(k), uint32_t(width), uint32_t(depth), decay);
 }
-future<scattered_message_ptr> redis_service::sismember(request_wrapper& req)
+
+// TOPK.ADD key item [item ...]
+//
+// The items of a key are counted in one call on its shard, in their order.
+future<scattered_message_ptr> redis_service::topk_add(request_wrapper& req)
 {
     if (req._args_count < 2 || req._args.empty()) {
         return reply_builder::build(msg_syntax_err);
     }
-    bytes& key = req._args[0];
-    bytes& member = req._args[1];
-    redis_key rk { std::move(key) };
+    std::vector<bytes> items(std::make_move_iterator(req._args.begin() + 1), std::make_move_iterator(req._args.end()));
+    auto rk = take_key(req);
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::sismember, std::move(rk), std::move(member));
+    return invoke_on_owner(cpu, &database::topk_add, std::move(rk), std::move(items));
 }
 
-future<scattered_message_ptr> redis_service::srem(request_wrapper& req)
+// TOPK.QUERY key item [item ...]
+future<scattered_message_ptr> redis_service::topk_query(request_wrapper& req)
 {
     if (req._args_count < 2 || req._args.empty()) {
         return reply_builder::build(msg_syntax_err);
     }
-    bytes& key = req._args[0];
-    redis_key rk { std::move(key) };
+    std::vector<bytes> items(std::make_move_iterator(req._args.begin() + 1), std::make_move_iterator(req._args.end()));
+    auto rk = take_key(req);
     auto cpu = get_cpu(rk);
-    for (uint32_t i = 1; i < req._args_count; ++i) req._tmp_keys.emplace_back(std::move(req._args[i]));
-    auto& keys = req._tmp_keys;
-    return get_database().invoke_on(cpu, &database::srems, std::move(rk), std::ref(keys));
+    return invoke_on_owner(cpu, &database::topk_query, std::move(rk), std::move(items));
 }
 
-future<scattered_message_ptr> redis_service::sdiff_store(request_wrapper& req)
+// TOPK.LIST key [WITHCOUNT]
+future<scattered_message_ptr> redis_service::topk_list(request_wrapper& req)
 {
-    if (req._args_count < 2 || req._args.empty()) {
+    if (req._args_count < 1 || req._args_count > 2 || req._args.empty()) {
         return reply_builder::build(msg_syntax_err);
     }
-    bytes& dest = req._args[0];
-    for (size_t i = 1; i < req._args.size(); ++i) {
-        req._tmp_keys.emplace_back(std::move(req._args[i]));
+    bool with_count = false;
+    if (req._args_count == 2) {
+        if (strcasecmp(req._args[1].c_str(), "withcount") != 0) {
+            return reply_builder::build(msg_syntax_err);
+        }
+        with_count = true;
     }
-    return sdiff_impl(req._tmp_keys, &dest);
+    auto rk = take_key(req);
+    auto cpu = get_cpu(rk);
+    return invoke_on_owner(cpu, &database::topk_list, std::move(rk), with_count);
 }
 
-future<scattered_message_ptr> redis_service::sdiff(request_wrapper& req)
+future<scattered_message_ptr> redis_service::incr(request_wrapper& req)
 {
-    if (req._args_count < 1 || req._args.empty()) {
-        return reply_builder::build(msg_syntax_err);
-    }
-    if (req._args_count == 1) {
-        return smembers(req);
-    }
-    return sdiff_impl(std::ref(req._args), nullptr);
+    return counter_by(req, true, false);
 }
 
-future<scattered_message_ptr> redis_service::sdiff_impl(std::vector<bytes>& keys, bytes* dest)
+future<scattered_message_ptr> redis_service::incrby(request_wrapper& req)
 {
-    using item_unordered_map = std::unordered_map<unsigned, std::vector<bytes>>;
-    struct sdiff_state {
-        item_unordered_map items_set;
-        std::vector<bytes>& keys;
-        bytes* dest = nullptr;
-        std::vector<bytes> result;
-    };
-    uint32_t count = static_cast<uint32_t>(keys.size());
-    return do_with(sdiff_state{item_unordered_map{}, std::ref(keys), dest, {}}, [this, count] (auto& state) {
-        return parallel_for_each(boost::irange<unsigned>(0, count), [this, &state] (unsigned k) {
-            bytes& key = state.keys[k];
-            redis_key rk { std::ref(key) };
-            auto cpu = this->get_cpu(rk);
-            return get_database().invoke_on(cpu, &database::smembers_direct, std::move(rk)).then([&state, index = k] (auto&& members) {
-                state.items_set[index] = std::move(*members);
-            });
-        }).then([this,&state, count] {
-            auto& temp = state.items_set[0];
-            for (uint32_t i = 1; i < count; ++i) {
-                auto&& next_items = std::move(state.items_set[i]);
-                for (auto& item : next_items) {
-                    stdx::erase_if(temp, [&item] (auto& o) { return item == o; });
-                }
-            }
-            std::vector<bytes>& result = temp;
-            if (state.dest) {
-                return this->sadds_impl_return_keys(*state.dest, result);
-            }
-            return reply_builder::build(result);
-        });
-    });
+    return counter_by(req, true, true);
 }
-
-future<scattered_message_ptr> redis_service::sinter_impl(std::vector<bytes>& keys, bytes* dest)
+future<scattered_message_ptr> redis_service::decr(request_wrapper& req)
 {
-    using item_unordered_map = std::unordered_map<unsigned, std::vector<bytes>>;
-    struct sinter_state {
-        item_unordered_map items_set;
-        std::vector<bytes>& keys;
-        bytes* dest = nullptr;
-    };
-    uint32_t count = static_cast<uint32_t>(keys.size());
-    return do_with(sinter_state{item_unordered_map{}, std::ref(keys), dest}, [this, count] (auto& state) {
-        return parallel_for_each(boost::irange<unsigned>(0, count), [this, &state] (unsigned k) {
-            bytes& key = state.keys[k];
-            redis_key rk { std::ref(key) };
-            auto cpu = this->get_cpu(rk);
-            return get_database().invoke_on(cpu, &database::smembers_direct, std::move(rk)).then([&state, index = k] (auto&& members) {
-                state.items_set[index] = std::move(*members);
-            });
-        }).then([this, &state, count] {
-            auto& result = state.items_set[0];
-            for (uint32_t i = 1; i < count; ++i) {
-                auto& next_items = state.items_set[i];
-                if (result.empty() || next_items.empty()) {
-                    return reply_builder::build(result);
-                }
-                std::vector<bytes> temp;
-                for (auto& item : next_items) {
-                    if (std::find_if(result.begin(), result.end(), [&item] (auto& o) { return item == o; }) != result.end()) {
-                        temp.emplace_back(std::move(item));
-                    }
-                }
-                result = std::move(temp);
-            }
-            if (state.dest) {
-                return this->sadds_impl_return_keys(*state.dest, result);
-            }
-            return reply_builder::build(result);
-       });
-   });
+    return counter_by(req, false, false);
 }
-
-future<scattered_message_ptr> redis_service::sinter(request_wrapper& req)
+future<scattered_message_ptr> redis_service::decrby(request_wrapper& req)
 {
-    if (req._args_count < 1 || req._args.empty()) {
-        return reply_builder::build(msg_syntax_err);
-    }
-    if (req._args_count == 1) {
-        return smembers(req);
-    }
-    return sinter_impl(req._args, nullptr);
+    return counter_by(req, false, true);
 }
 
-future<scattered_message_ptr> redis_service::sinter_store(request_wrapper& req)
+future<scattered_message_ptr> redis_service::counter_by(request_wrapper& req, bool incr, bool with_step)
 {
-    if (req._args_count < 2 || req._args.empty()) {
+    if (req._args_count < 1 || req._args.empty() || (with_step == true && req._args_count <= 1)) {
         return reply_builder::build(msg_syntax_err);
     }
-    bytes& dest = req._args[0];
-    for (size_t i = 1; i < req._args.size(); ++i) {
-        req._tmp_keys.emplace_back(std::move(req._args[i]));
+    int64_t step = 1;
+    if (with_step) {
+        bytes& s = req._args[1];
+        if (!parse_integer_string(s.data(), s.size(), step)) {
+            return reply_builder::build(msg_value_not_integer_err);
+        }
     }
-    return sinter_impl(req._tmp_keys, &dest);
+    if (!incr && step == std::numeric_limits<int64_t>::min()) {
+        return reply_builder::build(msg_overflow_err);
+    }
+    if (!_sharded_counter_patterns.empty() && sharded_counter(req._args[0])) {
+        auto delta = incr ? step : -step;
+        auto& cell = _counter_cells[req._args[0]];
+        if ((delta > 0 && cell._delta > std::numeric_limits<int64_t>::max() - delta) ||
+            (delta < 0 && cell._delta < std::numeric_limits<int64_t>::min() - delta)) {
+            // the cell is full, the owner takes the increment directly.
+            auto rk = take_key(req);
+            auto cpu = get_cpu(rk);
+            return invoke_for_value(cpu, &database::counter_by, std::move(rk), step, incr);
+        }
+        ++_sharded_increments;
+        cell._delta += delta;
+        cell._touched = true;
+        // the known value may have overflowed with the increments of the
+        // other shards, the owner checks the sum at the fold.
+        auto known = static_cast<uint64_t>(cell._known) + static_cast<uint64_t>(cell._delta);
+        return reply_builder::build(reply_value::of_bulk_integer(static_cast<int64_t>(known)));
+    }
+    auto rk = take_key(req);
+    auto cpu = get_cpu(rk);
+    return invoke_for_value(cpu, &database::counter_by, std::move(rk), step, incr);
 }
 
-future<scattered_message_ptr> redis_service::sunion_impl(std::vector<bytes>& keys, bytes* dest)
+void redis_service::set_sharded_counters(std::vector<bytes> patterns, std::chrono::milliseconds fold_period, std::function<future<> (bytes)> folder)
 {
-    struct union_state {
-        std::vector<bytes> result;
-        std::vector<bytes>& keys;
-        bytes* dest = nullptr;
-    };
-    uint32_t count = static_cast<uint32_t>(keys.size());
-    return do_with(union_state{{}, std::ref(keys), dest}, [this, count] (auto& state) {
-        return parallel_for_each(boost::irange<unsigned>(0, count), [this, &state] (unsigned k) {
-            bytes& key = state.keys[k];
-            redis_key rk { std::ref(key) };
-            auto cpu = this->get_cpu(rk);
-            return get_database().invoke_on(cpu, &database::smembers_direct, std::move(rk)).then([&state] (auto&& members) {
-                auto& result = state.result;
-                for (auto& item : *members) {
-                    if (std::find_if(result.begin(), result.end(), [&item] (auto& o) { return o == item; }) == result.end()) {
-                        result.emplace_back(std::move(item));
-                    }
-                }
-            });
-        }).then([this, &state] {
-            auto& result = state.result;
-            if (state.dest) {
-                return this->sadds_impl_return_keys(*state.dest, result);
-            }
-            return reply_builder::build(result);
+    _sharded_counter_patterns = std::move(patterns);
+    _counter_folder = std::move(folder);
+    _counter_fold_timer.cancel();
+    if (_sharded_counter_patterns.empty()) {
+        return;
+    }
+    // the next period starts once the cells are folded.
+    _counter_fold_timer.set_callback([this, fold_period] {
+        fold_counters().finally([this, fold_period] {
+            _counter_fold_timer.arm(fold_period);
         });
     });
+    _counter_fold_timer.arm(fold_period);
 }
 
-future<scattered_message_ptr> redis_service::sunion(request_wrapper& req)
+bool redis_service::sharded_counter(const bytes& key) const
 {
-    if (req._args_count < 1 || req._args.empty()) {
-        return reply_builder::build(msg_syntax_err);
-    }
-    if (req._args_count == 1) {
-        return smembers(req);
-    }
-    return sunion_impl(req._args, nullptr);
+    return std::any_of(_sharded_counter_patterns.begin(), _sharded_counter_patterns.end(), [&key] (const bytes& pattern) {
+        return pubsub::matches(pattern, key);
+    });
 }
 
-future<scattered_message_ptr> redis_service::sunion_store(request_wrapper& req)
+future<> redis_service::fold_counters()
 {
-    if (req._args_count < 2 || req._args.empty()) {
-        return reply_builder::build(msg_syntax_err);
-    }
-    bytes& dest = req._args[0];
-    for (size_t i = 1; i < req._args.size(); ++i) {
-        req._tmp_keys.emplace_back(std::move(req._args[i]));
+    // the cells not incremented for a whole period are dropped, their
+    // increments folded.
+    std::vector<bytes> keys;
+    for (auto i = _counter_cells.begin(); i != _counter_cells.end();) {
+        if (i->second._delta != 0) {
+            keys.push_back(i->first);
+        }
+        if (!i->second._touched && i->second._delta == 0) {
+            i = _counter_cells.erase(i);
+            continue;
+        }
+        i->second._touched = false;
+        ++i;
     }
-    return sunion_impl(req._tmp_keys, &dest);
+    return do_with(std::move(keys), [this] (auto& keys) {
+        return parallel_for_each(keys, [this] (const bytes& key) {
+            return fold_counter(key);
+        });
+    });
 }
 
-future<bool> redis_service::srem_direct(bytes& key, bytes& member)
+future<> redis_service::fold_counter(const bytes& key)
 {
-    redis_key rk {std::ref(key) };
+    auto i = _counter_cells.find(key);
+    if (i == _counter_cells.end() || i->second._delta == 0) {
+        return make_ready_future<>();
+    }
+    auto delta = i->second._delta;
+    i->second._delta = 0;
+    ++_counter_folds;
+    redis_key rk { bytes { key } };
     auto cpu = get_cpu(rk);
-    return   get_database().invoke_on(cpu, &database::srem_direct, rk, std::move(member));
+    return invoke_on_owner(cpu, &database::counter_by, std::move(rk), delta, true).then([this, key] (reply_value v) {
+        if (v._kind != reply_value::kind::bulk_integer) {
+            // not an integer any more, or out of range: the increments
+            // are lost, as a failed INCR would have been.
+            ++_counter_fold_errors;
+            return;
+        }
+        auto i = _counter_cells.find(key);
+        if (i != _counter_cells.end()) {
+            i->second._known = v._integer;
+        }
+    });
+}
+
+void redis_service::set_split_keys(std::vector<bytes> patterns, unsigned partitions)
+{
+    _split_key_patterns = std::move(patterns);
+    _split_partitions = std::max(partitions, 1u);
+}
+
+bool redis_service::split_key(const bytes& key) const
+{
+    return std::any_of(_split_key_patterns.begin(), _split_key_patterns.end(), [&key] (const bytes& pattern) {
+        return pubsub::matches(pattern, key);
+    });
+}
+
+// The hash tag alone places a partition, the same N on the same shard
+// whatever the key.
+bytes redis_service::split_partition(const bytes& key, unsigned partition) const
+{
+    auto tag = sprint("{split:%u}", partition);
+    return bytes { tag.data(), tag.size() } + key;
+}
+
+unsigned redis_service::split_partition_of(const bytes& field) const
+{
+    return utils::murmur_hash::hash2_64(bytes_view { field.data(), field.size() }, 0) % _split_partitions;
+}
+
+void redis_service::to_partition(request_wrapper& req, size_t field)
+{
+    ++_split_point_ops;
+    auto partition = split_partition_of(req._args[field]);
+    req._args[0] = split_partition(req._args[0], partition);
+    req.reset_key_hashes();
+}
+
+bool redis_service::splits(const request_wrapper& req) const
+{
+    if (_split_key_patterns.empty() || req._args_count == 0 || req._args.empty()) {
+        return false;
+    }
+    for (auto i : command_key_positions(req)) {
+        if (i < req._args.size() && split_key(req._args[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+future<scattered_message_ptr> redis_service::split_command(request_wrapper& req)
+{
+    // The position of the field or the member, whose partition the command
+    // runs on as if it named it. The commands of several fields or members
+    // send those of each partition to it, and sum or order what they reply.
+    size_t field = 0;
+    switch (req._command_code) {
+    case command_code::hget:
+    case command_code::hexists:
+    case command_code::hstrlen:
+    case command_code::zscore:
+        field = req._args_count == 2 ? 1 : 0;
+        break;
+    case command_code::hdel:
+    case command_code::zrem:
+        if (req._args_count > 2) {
+            return split_remove(req, req._command_code == command_code::zrem);
+        }
+        field = req._args_count == 2 ? 1 : 0;
+        break;
+    case command_code::hset:
+        if (req._args_count > 3) {
+            return split_hmset(req, true);
+        }
+        field = req._args_count == 3 ? 1 : 0;
+        break;
+    case command_code::hincrby:
+    case command_code::hincrbyfloat:
+        field = req._args_count == 3 ? 1 : 0;
+        break;
+    case command_code::zincrby:
+        field = req._args_count == 3 ? 2 : 0;
+        break;
+    case command_code::hmset:
+        return split_hmset(req, false);
+    case command_code::hmget:
+        return split_hmget(req);
+    case command_code::zadd:
+        return split_zadd(req);
+    case command_code::hlen:
+        return split_len(req, false);
+    case command_code::zcard:
+        return split_len(req, true);
+    case command_code::hgetall:
+        return split_getall(req, true, true);
+    case command_code::hkeys:
+        return split_getall(req, true, false);
+    case command_code::hvals:
+        return split_getall(req, false, true);
+    case command_code::zrange:
+        return split_range(req, false);
+    case command_code::zrevrange:
+        return split_range(req, true);
+    case command_code::del:
+    case command_code::unlink:
+        return split_del(req);
+    default:
+        break;
+    }
+    if (field == 0 || req._args.size() <= field) {
+        return reply_builder::build(msg_split_key_err);
+    }
+    to_partition(req, field);
+    switch (req._command_code) {
+    case command_code::hget: return hget(req);
+    case command_code::hdel: return hdel(req);
+    case command_code::hexists: return hexists(req);
+    case command_code::hstrlen: return hstrlen(req);
+    case command_code::zscore: return zscore(req);
+    case command_code::zrem: return zrem(req);
+    case command_code::hset: return hset(req);
+    case command_code::hincrby: return hincrby(req);
+    case command_code::hincrbyfloat: return hincrbyfloat(req);
+    case command_code::zadd: return zadd(req);
+    default: return zincrby(req);
+    }
+}
+
+future<long> redis_service::split_size(bytes key, bool sset)
+{
+    struct size_state {
+        bytes _key;
+        long _size = 0;
+        bool _wrong_type = false;
+    };
+    return do_with(size_state { std::move(key) }, [this, sset] (size_state& state) {
+        return parallel_for_each(boost::irange<unsigned>(0, _split_partitions), [this, sset, &state] (unsigned p) {
+            redis_key rk { split_partition(state._key, p) };
+            auto cpu = get_cpu(rk);
+            auto size = sset ? invoke_on_owner(cpu, &database::zcard_direct, std::move(rk))
+                             : invoke_on_owner(cpu, &database::hlen_direct, std::move(rk));
+            return size.then([&state] (long n) {
+                if (n < 0) {
+                    state._wrong_type = true;
+                }
+                else {
+                    state._size += n;
+                }
+            });
+        }).then([&state] {
+            return state._wrong_type ? -1L : state._size;
+        });
+    });
+}
+
+future<scattered_message_ptr> redis_service::split_len(request_wrapper& req, bool sset)
+{
+    if (req._args_count != 1) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    ++_split_gathers;
+    return split_size(std::move(req._args[0]), sset).then([] (long size) {
+        return size < 0 ? reply_builder::build(msg_type_err) : reply_builder::build(static_cast<size_t>(size));
+    });
+}
+
+future<scattered_message_ptr> redis_service::split_getall(request_wrapper& req, bool keys, bool values)
+{
+    if (req._args_count != 1) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    ++_split_gathers;
+    using part_type = foreign_ptr<lw_shared_ptr<std::vector<bytes>>>;
+    return do_with(std::move(req._args[0]), std::vector<part_type>(_split_partitions), [this, keys, values] (bytes& key, std::vector<part_type>& parts) {
+        return parallel_for_each(boost::irange<unsigned>(0, _split_partitions), [this, keys, values, &key, &parts] (unsigned p) {
+            redis_key rk { split_partition(key, p) };
+            auto cpu = get_cpu(rk);
+            return invoke_on_owner(cpu, &database::hgetall_direct, std::move(rk), keys, values).then([&parts, p] (part_type fields) {
+                parts[p] = std::move(fields);
+            });
+        }).then([&parts] {
+            size_t size = 0;
+            for (auto& part : parts) {
+                size += part->size();
+            }
+            // copied, the partitions were built in the memory of their shards.
+            std::vector<bytes> all;
+            all.reserve(size);
+            for (auto& part : parts) {
+                all.insert(all.end(), part->begin(), part->end());
+            }
+            return reply_builder::build(all);
+        });
+    });
+}
+
+// Each partition gives its first `end` + 1 members of the order asked, the
+// runs are merged up to the rank `end`. The ranks counted from the end need
+// the size of the whole set first.
+future<scattered_message_ptr> redis_service::split_range(request_wrapper& req, bool reverse)
+{
+    if (req._args_count < 3 || req._args_count > 4) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    int64_t begin = 0, end = 0;
+    if (!parse_integer_string(req._args[1].data(), req._args[1].size(), begin) || !parse_integer_string(req._args[2].data(), req._args[2].size(), end)) {
+        return reply_builder::build(msg_value_not_integer_err);
+    }
+    bool with_score = false;
+    if (req._args_count == 4) {
+        if (strcasecmp(req._args[3].c_str(), "withscores") != 0) {
+            return reply_builder::build(msg_syntax_err);
+        }
+        with_score = true;
+    }
+    ++_split_gathers;
+    using run_type = foreign_ptr<lw_shared_ptr<std::vector<std::pair<bytes, double>>>>;
+    struct range_state {
+        bytes _key;
+        int64_t _begin;
+        int64_t _end;
+        std::vector<run_type> _runs;
+    };
+    return do_with(range_state { std::move(req._args[0]), begin, end, std::vector<run_type>(_split_partitions) }, [this, reverse, with_score] (range_state& state) {
+        auto sized = make_ready_future<long>(0);
+        if (state._begin < 0 || state._end < 0) {
+            sized = split_size(state._key, true);
+        }
+        return sized.then([this, reverse, with_score, &state] (long size) {
+            if (size < 0) {
+                return reply_builder::build(msg_type_err);
+            }
+            if (state._begin < 0) {
+                state._begin = std::max<int64_t>(size + state._begin, 0);
+            }
+            if (state._end < 0) {
+                state._end = size + state._end;
+            }
+            if (state._end < 0 || state._begin > state._end) {
+                return reply_builder::build(msg_empty_multi_bulk);
+            }
+            return parallel_for_each(boost::irange<unsigned>(0, _split_partitions), [this, reverse, &state] (unsigned p) {
+                redis_key rk { split_partition(state._key, p) };
+                auto cpu = get_cpu(rk);
+                return invoke_on_owner(cpu, &database::zrange_direct, std::move(rk), 0L, static_cast<long>(state._end), reverse).then([&state, p] (run_type run) {
+                    state._runs[p] = std::move(run);
+                });
+            }).then([reverse, with_score, &state] {
+                auto& runs = state._runs;
+                auto before = [reverse] (const std::pair<bytes, double>& a, const std::pair<bytes, double>& b) {
+                    if (a.second != b.second) {
+                        return reverse ? a.second > b.second : a.second < b.second;
+                    }
+                    return reverse ? b.first < a.first : a.first < b.first;
+                };
+                // the heads of the runs, the next one at the front.
+                using head = std::pair<size_t, size_t>;
+                auto after = [&runs, &before] (const head& a, const head& b) {
+                    return before((*runs[b.first])[b.second], (*runs[a.first])[a.second]);
+                };
+                std::priority_queue<head, std::vector<head>, decltype(after)> heads(after);
+                for (size_t r = 0; r < runs.size(); ++r) {
+                    if (!runs[r]->empty()) {
+                        heads.emplace(r, 0);
+                    }
+                }
+                std::vector<std::pair<bytes, double>> result;
+                for (int64_t rank = 0; rank <= state._end && !heads.empty(); ++rank) {
+                    auto h = heads.top();
+                    heads.pop();
+                    if (rank >= state._begin) {
+                        result.push_back((*runs[h.first])[h.second]);
+                    }
+                    if (h.second + 1 < runs[h.first]->size()) {
+                        heads.emplace(h.first, h.second + 1);
+                    }
+                }
+                return reply_builder::build(result, with_score);
+            });
+        });
+    });
+}
+
+template <typename Share, typename Apply>
+future<long> redis_service::split_apply(bytes key, std::vector<Share> shares, Apply apply)
+{
+    ++_split_gathers;
+    struct apply_state {
+        bytes _key;
+        std::vector<Share> _shares;
+        long _count = 0;
+        bool _wrong_type = false;
+    };
+    return do_with(apply_state { std::move(key), std::move(shares) }, [this, apply] (apply_state& state) {
+        return parallel_for_each(boost::irange<unsigned>(0, _split_partitions), [this, apply, &state] (unsigned p) {
+            if (state._shares[p].empty()) {
+                return make_ready_future<>();
+            }
+            redis_key rk { split_partition(state._key, p) };
+            auto cpu = get_cpu(rk);
+            return apply(cpu, std::move(rk), std::move(state._shares[p])).then([&state] (long n) {
+                if (n < 0) {
+                    state._wrong_type = true;
+                }
+                else {
+                    state._count += n;
+                }
+            });
+        }).then([&state] {
+            return state._wrong_type ? -1L : state._count;
+        });
+    });
+}
+
+// HSET of several fields replies with those added, HMSET with OK.
+future<scattered_message_ptr> redis_service::split_hmset(request_wrapper& req, bool reply_added)
+{
+    if (req._args_count < 3 || req._args_count % 2 == 0) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    std::vector<std::vector<std::pair<bytes, bytes>>> shares(_split_partitions);
+    for (size_t i = 1; i + 1 < req._args_count; i += 2) {
+        shares[split_partition_of(req._args[i])].emplace_back(std::move(req._args[i]), std::move(req._args[i + 1]));
+    }
+    return split_apply(std::move(req._args[0]), std::move(shares), [] (unsigned cpu, redis_key rk, auto share) {
+        return invoke_on_owner(cpu, &database::hmset_direct, std::move(rk), std::move(share));
+    }).then([reply_added] (long added) {
+        if (added < 0) {
+            return reply_builder::build(msg_type_err);
+        }
+        return reply_added ? reply_builder::build(static_cast<size_t>(added)) : reply_builder::build(msg_ok);
+    });
+}
+
+future<scattered_message_ptr> redis_service::split_remove(request_wrapper& req, bool sset)
+{
+    std::vector<std::vector<bytes>> shares(_split_partitions);
+    for (size_t i = 1; i < req._args_count; ++i) {
+        shares[split_partition_of(req._args[i])].emplace_back(std::move(req._args[i]));
+    }
+    auto removed = sset
+        ? split_apply(std::move(req._args[0]), std::move(shares), [] (unsigned cpu, redis_key rk, auto share) {
+            return invoke_on_owner(cpu, &database::zrem_direct, std::move(rk), std::move(share));
+        })
+        : split_apply(std::move(req._args[0]), std::move(shares), [] (unsigned cpu, redis_key rk, auto share) {
+            return invoke_on_owner(cpu, &database::hdel_direct, std::move(rk), std::move(share));
+        });
+    return removed.then([] (long n) {
+        return n < 0 ? reply_builder::build(msg_type_err) : reply_builder::build(static_cast<size_t>(n));
+    });
+}
+
+// ZADD with INCR names one member, and runs on its partition.
+future<scattered_message_ptr> redis_service::split_zadd(request_wrapper& req)
+{
+    if (req._args_count < 3) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    int flags = 0;
+    auto first = parse_zadd_flags(req, flags);
+    if (flags & ZADD_INCR) {
+        if (req._args_count != first + 2) {
+            return reply_builder::build(msg_syntax_err);
+        }
+        to_partition(req, first + 1);
+        return zadd(req);
+    }
+    if ((req._args_count - first) % 2 != 0 || ((flags & ZADD_NX) && (flags & ZADD_XX))) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    auto& members = req.tmp()._key_scores;
+    if (!parse_zadd_members(req, first, members)) {
+        return reply_builder::build(msg_value_not_float_err);
+    }
+    std::vector<std::vector<std::pair<bytes, double>>> shares(_split_partitions);
+    for (auto& member : members) {
+        shares[split_partition_of(member.first)].emplace_back(std::move(member));
+    }
+    return split_apply(std::move(req._args[0]), std::move(shares), [flags] (unsigned cpu, redis_key rk, auto share) {
+        return invoke_on_owner(cpu, &database::zadds_direct, std::move(rk), std::move(share), flags);
+    }).then([] (long added) {
+        return added < 0 ? reply_builder::build(msg_type_err) : reply_builder::build(static_cast<size_t>(added));
+    });
+}
+
+// The fields of each partition are asked of it, and their values put back
+// in the order of the command.
+future<scattered_message_ptr> redis_service::split_hmget(request_wrapper& req)
+{
+    if (req._args_count < 2) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    ++_split_gathers;
+    using values_type = foreign_ptr<lw_shared_ptr<database::batch_values_type>>;
+    struct hmget_state {
+        bytes _key;
+        std::vector<std::vector<bytes>> _fields;
+        std::vector<std::vector<size_t>> _positions;
+        std::vector<values_type> _values;
+        size_t _count;
+    };
+    hmget_state state { std::move(req._args[0]), std::vector<std::vector<bytes>>(_split_partitions),
+        std::vector<std::vector<size_t>>(_split_partitions), std::vector<values_type>(_split_partitions), req._args_count - 1 };
+    for (size_t i = 1; i < req._args_count; ++i) {
+        auto p = split_partition_of(req._args[i]);
+        state._fields[p].emplace_back(std::move(req._args[i]));
+        state._positions[p].push_back(i - 1);
+    }
+    return do_with(std::move(state), [this] (hmget_state& state) {
+        return parallel_for_each(boost::irange<unsigned>(0, _split_partitions), [this, &state] (unsigned p) {
+            if (state._fields[p].empty()) {
+                return make_ready_future<>();
+            }
+            redis_key rk { split_partition(state._key, p) };
+            auto cpu = get_cpu(rk);
+            return invoke_on_owner(cpu, &database::hmget_direct, std::move(rk), std::move(state._fields[p])).then([&state, p] (values_type values) {
+                state._values[p] = std::move(values);
+            });
+        }).then([&state] {
+            std::vector<const bytes*> ordered(state._count, nullptr);
+            for (size_t p = 0; p < state._positions.size(); ++p) {
+                auto& positions = state._positions[p];
+                if (positions.empty()) {
+                    continue;
+                }
+                if (!state._values[p]) {
+                    return reply_builder::build(msg_type_err);
+                }
+                auto& values = *state._values[p];
+                for (size_t i = 0; i < positions.size(); ++i) {
+                    if (values[i]) {
+                        ordered[positions[i]] = &(*values[i]);
+                    }
+                }
+            }
+            return reply_builder::build(ordered);
+        });
+    });
+}
+
+future<scattered_message_ptr> redis_service::split_del(request_wrapper& req)
+{
+    // DEL of several keys, one split, would be a DEL of keys of all shards.
+    if (req._args_count != 1) {
+        return reply_builder::build(msg_split_key_err);
+    }
+    ++_split_gathers;
+    std::vector<std::vector<redis_key>> batches(smp::count);
+    for (unsigned p = 0; p < _split_partitions; ++p) {
+        redis_key rk { split_partition(req._args[0], p) };
+        auto cpu = get_cpu(rk);
+        batches[cpu].emplace_back(std::move(rk));
+    }
+    return do_with(std::move(batches), size_t(0), [] (auto& batches, size_t& removed) {
+        return parallel_for_each(boost::irange<unsigned>(0, smp::count), [&batches, &removed] (unsigned cpu) {
+            if (batches[cpu].empty()) {
+                return make_ready_future<>();
+            }
+            return invoke_on_owner(cpu, &database::del_direct_batch, std::move(batches[cpu])).then([&removed] (size_t n) {
+                removed += n;
+            });
+        }).then([&removed] {
+            return reply_builder::build(removed > 0 ? msg_one : msg_zero);
+        });
+    });
+}
+
+future<scattered_message_ptr> redis_service::hdel(request_wrapper& req)
+{
+    if (req._args_count < 2 || req._args.empty()) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    bytes& field = req._args[1];
+    auto rk = take_key(req);
+    auto cpu = get_cpu(rk);
+    if (req._args_count == 2) {
+        return invoke_on_owner(cpu, &database::hdel, std::move(rk), std::move(field));
+    }
+    else {
+        for (size_t i = 1; i < req._args.size(); ++i) req.tmp()._keys.emplace_back(req._args[i]);
+        auto& keys = req.tmp()._keys;
+        return invoke_on_owner(cpu, &database::hdel_multi, std::move(rk), std::move(keys));
+    }
+}
+
+future<scattered_message_ptr> redis_service::hexists(request_wrapper& req)
+{
+    if (req._args_count < 2 || req._args.empty()) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    bytes& field = req._args[1];
+    auto rk = take_key(req);
+    auto cpu = get_cpu(rk);
+    return invoke_on_owner(cpu, &database::hexists, std::move(rk), std::move(field));
+}
+
+future<scattered_message_ptr> redis_service::hset(request_wrapper& req)
+{
+    if (req._args_count < 3 || req._args.empty()) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    if (req._args_count > 3) {
+        return hmset(req, true);
+    }
+    bytes& field = req._args[1];
+    bytes& val = req._args[2];
+    auto rk = take_key(req);
+    auto cpu = get_cpu(rk);
+    return invoke_on_owner(cpu, &database::hset, std::move(rk), std::move(field), std::move(val));
+}
+
+// The fields go to the owner as they were given, moved out of the
+// arguments, and are set in order there.
+future<scattered_message_ptr> redis_service::hmset(request_wrapper& req, bool reply_added)
+{
+    if (req._args_count < 3 || req._args_count % 2 == 0 || req._args.empty()) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    auto& fields = req.tmp()._key_value_pairs;
+    fields.reserve((req._args_count - 1) / 2);
+    for (size_t i = 1; i + 1 < req._args_count; i += 2) {
+        fields.emplace_back(std::move(req._args[i]), std::move(req._args[i + 1]));
+    }
+    auto rk = take_key(req);
+    auto cpu = get_cpu(rk);
+    return invoke_on_owner(cpu, &database::hmset, std::move(rk), std::move(fields), reply_added);
+}
+
+future<scattered_message_ptr> redis_service::hincrby(request_wrapper& req)
+{
+    if (req._args_count < 3 || req._args.empty()) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    bytes& field = req._args[1];
+    bytes& val = req._args[2];
+    int64_t delta = 0;
+    if (!parse_integer_string(val.data(), val.size(), delta)) {
+        return reply_builder::build(msg_value_not_integer_err);
+    }
+    auto rk = take_key(req);
+    auto cpu = get_cpu(rk);
+    return invoke_on_owner(cpu, &database::hincrby, std::move(rk), std::move(field), delta);
+}
+
+future<scattered_message_ptr> redis_service::hincrbyfloat(request_wrapper& req)
+{
+    if (req._args_count < 3 || req._args.empty()) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    bytes& field = req._args[1];
+    bytes& val = req._args[2];
+    double delta = 0;
+    if (!parse_float_string(val.data(), val.size(), delta)) {
+        return reply_builder::build(msg_value_not_float_err);
+    }
+    auto rk = take_key(req);
+    auto cpu = get_cpu(rk);
+    return invoke_on_owner(cpu, &database::hincrbyfloat, std::move(rk), std::move(field), delta);
+}
+
+future<scattered_message_ptr> redis_service::hlen(request_wrapper& req)
+{
+    if (req._args_count < 1 || req._args.empty()) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    auto rk = take_key(req);
+    auto cpu = get_cpu(rk);
+    return invoke_on_owner(cpu, &database::hlen, std::move(rk));
+}
+
+future<scattered_message_ptr> redis_service::hstrlen(request_wrapper& req)
+{
+    if (req._args_count < 2 || req._args.empty()) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    bytes& field = req._args[1];
+    auto rk = take_key(req);
+    auto cpu = get_cpu(rk);
+    return invoke_on_owner(cpu, &database::hstrlen, std::move(rk), std::move(field));
+}
+
+future<scattered_message_ptr> redis_service::hget(request_wrapper& req)
+{
+    if (req._args_count < 2 || req._args.empty()) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    bytes& field = req._args[1];
+    auto rk = take_key(req);
+    auto cpu = get_cpu(rk);
+    return invoke_on_owner(cpu, &database::hget, std::move(rk), std::move(field));
+}
+
+future<scattered_message_ptr> redis_service::hgetall(request_wrapper& req)
+{
+    if (req._args_count < 1 || req._args.empty()) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    auto rk = take_key(req);
+    auto cpu = get_cpu(rk);
+    return stream_reply(req, [cpu, rk] (size_t next, size_t left, bool stream) {
+        return invoke_on_owner(cpu, &database::hgetall, rk, next, left, stream);
+    });
+}
+
+future<scattered_message_ptr> redis_service::hgetall_keys(request_wrapper& req)
+{
+    if (req._args_count < 1 || req._args.empty()) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    auto rk = take_key(req);
+    auto cpu = get_cpu(rk);
+    return stream_reply(req, [cpu, rk] (size_t next, size_t left, bool stream) {
+        return invoke_on_owner(cpu, &database::hgetall_keys, rk, next, left, stream);
+    });
+}
+
+future<scattered_message_ptr> redis_service::hgetall_values(request_wrapper& req)
+{
+    if (req._args_count < 1 || req._args.empty()) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    auto rk = take_key(req);
+    auto cpu = get_cpu(rk);
+    return stream_reply(req, [cpu, rk] (size_t next, size_t left, bool stream) {
+        return invoke_on_owner(cpu, &database::hgetall_values, rk, next, left, stream);
+    });
+}
+
+future<scattered_message_ptr> redis_service::hscan(request_wrapper& req)
+{
+    // HSCAN key cursor [MATCH pattern] [COUNT count]
+    if (req._args_count < 2 || req._args.empty()) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    size_t cursor = 0, count = 0;
+    bytes pattern;
+    if (auto err = parse_scan_arguments(req, 1, cursor, pattern, count)) {
+        return reply_builder::build(*err);
+    }
+    auto rk = take_key(req);
+    auto cpu = get_cpu(rk);
+    return invoke_on_owner(cpu, &database::hscan, std::move(rk), cursor, std::move(pattern), count);
+}
+
+future<scattered_message_ptr> redis_service::hexpire(request_wrapper& req, bool milliseconds)
+{
+    // HEXPIRE key seconds FIELDS numfields field [field ...]
+    if (req._args_count < 5 || req._args.empty()) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    auto& time = req._args[1];
+    int64_t ttl = 0;
+    // past max_field_ttl_ms, the deadline would not fit the clock.
+    static constexpr int64_t max_field_ttl_ms = int64_t(1) << 42;
+    if (!parse_integer_string(time.data(), time.size(), ttl) || ttl > (milliseconds ? max_field_ttl_ms : max_field_ttl_ms / 1000)) {
+        return reply_builder::build(msg_value_not_integer_err);
+    }
+    auto& fields = req.tmp()._keys;
+    if (!parse_fields_argument(req, 2, fields)) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    auto rk = take_key(req);
+    auto cpu = get_cpu(rk);
+    return invoke_on_owner(cpu, &database::hexpire, std::move(rk), milliseconds ? ttl : ttl * 1000, std::move(fields));
+}
+
+future<scattered_message_ptr> redis_service::httl(request_wrapper& req, bool milliseconds)
+{
+    // HTTL key FIELDS numfields field [field ...]
+    if (req._args_count < 4 || req._args.empty()) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    auto& fields = req.tmp()._keys;
+    if (!parse_fields_argument(req, 1, fields)) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    auto rk = take_key(req);
+    auto cpu = get_cpu(rk);
+    return invoke_on_owner(cpu, &database::httl, std::move(rk), std::move(fields), milliseconds);
+}
+
+future<scattered_message_ptr> redis_service::hpersist(request_wrapper& req)
+{
+    // HPERSIST key FIELDS numfields field [field ...]
+    if (req._args_count < 4 || req._args.empty()) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    auto& fields = req.tmp()._keys;
+    if (!parse_fields_argument(req, 1, fields)) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    auto rk = take_key(req);
+    auto cpu = get_cpu(rk);
+    return invoke_on_owner(cpu, &database::hpersist, std::move(rk), std::move(fields));
+}
+
+future<scattered_message_ptr> redis_service::hmget(request_wrapper& req)
+{
+    if (req._args_count < 1 || req._args.empty()) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    for (unsigned int i = 1; i < req._args_count; ++i) {
+        req.tmp()._keys.emplace_back(std::move(req._args[i]));
+    }
+    auto rk = take_key(req);
+    auto cpu = get_cpu(rk);
+    auto& keys = req.tmp()._keys;
+    return invoke_on_owner(cpu, &database::hmget, std::move(rk), std::move(keys));
+}
+
+future<scattered_message_ptr> redis_service::smembers(request_wrapper& req)
+{
+    if (req._args_count < 1 || req._args.empty()) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    auto rk = take_key(req);
+    auto cpu = get_cpu(rk);
+    return stream_reply(req, [cpu, rk] (size_t next, size_t left, bool stream) {
+        return invoke_on_owner(cpu, &database::smembers, rk, next, left, stream);
+    });
+}
+
+future<scattered_message_ptr> redis_service::sscan(request_wrapper& req)
+{
+    // SSCAN key cursor [MATCH pattern] [COUNT count]
+    if (req._args_count < 2 || req._args.empty()) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    size_t cursor = 0, count = 0;
+    bytes pattern;
+    if (auto err = parse_scan_arguments(req, 1, cursor, pattern, count)) {
+        return reply_builder::build(*err);
+    }
+    auto rk = take_key(req);
+    auto cpu = get_cpu(rk);
+    return invoke_on_owner(cpu, &database::sscan, std::move(rk), cursor, std::move(pattern), count);
+}
+
+future<scattered_message_ptr> redis_service::sadds_impl(bytes& key, std::vector<bytes>& members)
+{
+    redis_key rk { std::move(key) };
+    auto cpu = get_cpu(rk);
+    return invoke_on_owner(cpu, &database::sadds, std::move(rk), std::move(members));
+}
+
+future<scattered_message_ptr> redis_service::sadds_impl_return_keys(bytes& key, std::vector<bytes>& members)
+{
+    redis_key rk { std::move(key) };
+    auto cpu = get_cpu(rk);
+    return invoke_on_owner(cpu, &database::sadds_direct, std::move(rk), std::move(members)).then([&members] (auto m) {
+        if (m)
+           return reply_builder::build(members);
+        return reply_builder::build(msg_err);
+    });
+}
+
+future<scattered_message_ptr> redis_service::sadd(request_wrapper& req)
+{
+    if (req._args_count < 2 || req._args.empty()) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    bytes& key = req._args[0];
+    for (uint32_t i = 1; i < req._args_count; ++i) req.tmp()._keys.emplace_back(std::move(req._args[i]));
+    auto& keys = req.tmp()._keys;
+    return sadds_impl(key, std::ref(keys));
+}
+
+future<scattered_message_ptr> redis_service::scard(request_wrapper& req)
+{
+    if (req._args_count < 1 || req._args.empty()) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    auto rk = take_key(req);
+    auto cpu = get_cpu(rk);
+    return invoke_on_owner(cpu, &database::scard, std::move(rk));
+}
+future<scattered_message_ptr> redis_service::sismember(request_wrapper& req)
+{
+    if (req._args_count < 2 || req._args.empty()) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    bytes& member = req._args[1];
+    auto rk = take_key(req);
+    auto cpu = get_cpu(rk);
+    return invoke_on_owner(cpu, &database::sismember, std::move(rk), std::move(member));
+}
+
+future<scattered_message_ptr> redis_service::srem(request_wrapper& req)
+{
+    if (req._args_count < 2 || req._args.empty()) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    auto rk = take_key(req);
+    auto cpu = get_cpu(rk);
+    for (uint32_t i = 1; i < req._args_count; ++i) req.tmp()._keys.emplace_back(std::move(req._args[i]));
+    auto& keys = req.tmp()._keys;
+    return invoke_on_owner(cpu, &database::srems, std::move(rk), std::ref(keys));
+}
+
+future<scattered_message_ptr> redis_service::sdiff_store(request_wrapper& req)
+{
+    if (req._args_count < 2 || req._args.empty()) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    bytes& dest = req._args[0];
+    for (size_t i = 1; i < req._args.size(); ++i) {
+        req.tmp()._keys.emplace_back(std::move(req._args[i]));
+    }
+    return sdiff_impl(req.tmp()._keys, &dest);
+}
+
+future<scattered_message_ptr> redis_service::sdiff(request_wrapper& req)
+{
+    if (req._args_count < 1 || req._args.empty()) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    if (req._args_count == 1) {
+        return smembers(req);
+    }
+    return sdiff_impl(std::ref(req._args), nullptr);
+}
+
+future<scattered_message_ptr> redis_service::sdiff_impl(std::vector<bytes>& keys, bytes* dest)
+{
+    std::vector<unsigned> others(keys.size() - 1);
+    std::iota(others.begin(), others.end(), 1);
+    return probe_members(keys, 0, std::move(others), false, 0).then([this, dest] (std::vector<bytes> result) {
+        // the reply is built at once, only the store keeps the members.
+        if (!dest) {
+            return reply_builder::build(result);
+        }
+        return do_with(std::move(result), [this, dest] (auto& result) {
+            return this->sadds_impl_return_keys(*dest, result);
+        });
+    });
+}
+
+// Candidates are shipped to the owners of the other sets in batches of
+// this size, SINTERCARD stops after the batch reaching its limit.
+static constexpr const size_t set_probe_batch_size = 4096;
+
+// Ships a batch of candidates to the owner of every set in `sets`, in turn,
+// and keeps the ones reported as members, or as non members if `members`
+// is false. The owners read the batch in place and only send back a bitmap
+// of hits.
+future<> redis_service::probe_batch(std::vector<bytes>& candidates, std::vector<bytes>& keys, const std::vector<unsigned>& sets, bool members)
+{
+    return do_for_each(sets.begin(), sets.end(), [this, &candidates, &keys, members] (unsigned k) {
+        if (candidates.empty()) {
+            return make_ready_future<>();
+        }
+        redis_key rk { std::ref(keys[k]) };
+        auto cpu = this->get_cpu(rk);
+        return invoke_on_owner(cpu, &database::sismember_batch, std::move(rk), std::cref(candidates)).then([&candidates, members] (auto&& hits) {
+            size_t kept = 0;
+            for (size_t i = 0; i < candidates.size(); ++i) {
+                bool hit = ((*hits)[i >> 6] >> (i & 63)) & 1;
+                if (hit != members) {
+                    continue;
+                }
+                if (kept != i) {
+                    candidates[kept] = std::move(candidates[i]);
+                }
+                ++kept;
+            }
+            candidates.resize(kept);
+        });
+    });
+}
+
+// Members of the set `keys[first]` held by every set in `sets` (SINTER),
+// or by none of them (SDIFF). Only the first set is copied to this shard,
+// at most `limit` members are returned unless it is 0.
+future<std::vector<bytes>> redis_service::probe_members(std::vector<bytes>& keys, unsigned first, std::vector<unsigned> sets, bool members, size_t limit)
+{
+    struct probe_state {
+        std::vector<bytes>& keys;
+        std::vector<unsigned> sets;
+        bool members;
+        size_t limit;
+        std::vector<std::vector<bytes>> batches;
+        size_t found = 0;
+    };
+    redis_key rk { std::ref(keys[first]) };
+    auto cpu = get_cpu(rk);
+    return invoke_on_owner(cpu, &database::smembers_direct, std::move(rk)).then([this, &keys, sets = std::move(sets), members, limit] (auto&& candidates) mutable {
+        return do_with(probe_state{std::ref(keys), std::move(sets), members, limit, {}}, [this, candidates = std::move(candidates)] (auto& state) {
+            auto& from = *candidates;
+            for (size_t i = 0; i < from.size(); i += set_probe_batch_size) {
+                auto end = std::min(from.size(), i + set_probe_batch_size);
+                state.batches.emplace_back(std::make_move_iterator(from.begin() + i), std::make_move_iterator(from.begin() + end));
+            }
+            auto probe = [this, &state] (auto& batch) {
+                if (state.limit > 0 && state.found >= state.limit) {
+                    return make_ready_future<>();
+                }
+                return this->probe_batch(batch, state.keys, state.sets, state.members).then([&state, &batch] {
+                    state.found += batch.size();
+                });
+            };
+            // Batches go one at a time when a limit may end the probing early.
+            auto done = state.limit > 0 ? do_for_each(state.batches.begin(), state.batches.end(), probe)
+                                        : parallel_for_each(state.batches.begin(), state.batches.end(), probe);
+            return done.then([&state] {
+                std::vector<bytes> result;
+                result.reserve(state.found);
+                for (auto& batch : state.batches) {
+                    std::move(batch.begin(), batch.end(), std::back_inserter(result));
+                }
+                if (state.limit > 0 && result.size() > state.limit) {
+                    result.resize(state.limit);
+                }
+                return result;
+            });
+        });
+    });
+}
+
+// Intersects from the smallest set: only its members are copied, and are
+// probed against the larger sets in ascending order of cardinality.
+future<std::vector<bytes>> redis_service::sinter_members(std::vector<bytes>& keys, size_t limit)
+{
+    struct sinter_state {
+        std::vector<bytes>& keys;
+        std::vector<size_t> sizes;
+    };
+    uint32_t count = static_cast<uint32_t>(keys.size());
+    return do_with(sinter_state{std::ref(keys), std::vector<size_t>(count)}, [this, count, limit] (auto& state) {
+        return parallel_for_each(boost::irange<unsigned>(0, count), [this, &state] (unsigned k) {
+            redis_key rk { std::ref(state.keys[k]) };
+            auto cpu = this->get_cpu(rk);
+            return invoke_on_owner(cpu, &database::scard_direct, std::move(rk)).then([&state, k] (size_t size) {
+                state.sizes[k] = size;
+            });
+        }).then([this, &state, count, limit] {
+            std::vector<unsigned> order(count);
+            std::iota(order.begin(), order.end(), 0);
+            std::sort(order.begin(), order.end(), [&state] (unsigned l, unsigned r) { return state.sizes[l] < state.sizes[r]; });
+            if (state.sizes[order[0]] == 0) {
+                return make_ready_future<std::vector<bytes>>();
+            }
+            auto first = order[0];
+            order.erase(order.begin());
+            return this->probe_members(state.keys, first, std::move(order), true, limit);
+        });
+    });
+}
+
+future<scattered_message_ptr> redis_service::sinter_impl(std::vector<bytes>& keys, bytes* dest)
+{
+    return sinter_members(keys, 0).then([this, dest] (std::vector<bytes> result) {
+        // the reply is built at once, only the store keeps the members.
+        if (!dest) {
+            return reply_builder::build(result);
+        }
+        return do_with(std::move(result), [this, dest] (auto& result) {
+            return this->sadds_impl_return_keys(*dest, result);
+        });
+    });
+}
+
+future<scattered_message_ptr> redis_service::sinter(request_wrapper& req)
+{
+    if (req._args_count < 1 || req._args.empty()) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    if (req._args_count == 1) {
+        return smembers(req);
+    }
+    return sinter_impl(req._args, nullptr);
+}
+
+future<scattered_message_ptr> redis_service::sinter_store(request_wrapper& req)
+{
+    if (req._args_count < 2 || req._args.empty()) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    bytes& dest = req._args[0];
+    for (size_t i = 1; i < req._args.size(); ++i) {
+        req.tmp()._keys.emplace_back(std::move(req._args[i]));
+    }
+    return sinter_impl(req.tmp()._keys, &dest);
+}
+
+future<scattered_message_ptr> redis_service::sintercard(request_wrapper& req)
+{
+    if (req._args_count < 2 || req._args.empty()) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    size_t numkeys = 0, limit = 0;
+    int64_t n = 0;
+    if (!parse_integer_string(req._args[0].data(), req._args[0].size(), n)) {
+        return reply_builder::build(msg_value_not_integer_err);
+    }
+    if (n < 1 || static_cast<uint64_t>(n) + 1 > req._args_count) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    numkeys = static_cast<size_t>(n);
+    size_t i = numkeys + 1;
+    if (i < req._args_count) {
+        auto& option = req._args[i];
+        std::transform(option.begin(), option.end(), option.begin(), ::toupper);
+        if (option != "LIMIT" || i + 2 != req._args_count) {
+            return reply_builder::build(msg_syntax_err);
+        }
+        auto& l = req._args[i + 1];
+        if (!parse_integer_string(l.data(), l.size(), n)) {
+            return reply_builder::build(msg_value_not_integer_err);
+        }
+        if (n < 0) {
+            return reply_builder::build(msg_syntax_err);
+        }
+        limit = static_cast<size_t>(n);
+    }
+    for (size_t i = 1; i <= numkeys; ++i) {
+        req.tmp()._keys.emplace_back(std::move(req._args[i]));
+    }
+    return sinter_members(req.tmp()._keys, limit).then([] (std::vector<bytes> result) {
+        return reply_builder::build(result.size());
+    });
+}
+
+future<scattered_message_ptr> redis_service::sunion_impl(std::vector<bytes>& keys, bytes* dest)
+{
+    struct union_state {
+        std::unordered_set<bytes> result;
+        std::vector<bytes>& keys;
+        bytes* dest = nullptr;
+    };
+    uint32_t count = static_cast<uint32_t>(keys.size());
+    return do_with(union_state{{}, std::ref(keys), dest}, [this, count] (auto& state) {
+        return parallel_for_each(boost::irange<unsigned>(0, count), [this, &state] (unsigned k) {
+            bytes& key = state.keys[k];
+            redis_key rk { std::ref(key) };
+            auto cpu = this->get_cpu(rk);
+            return invoke_on_owner(cpu, &database::smembers_direct, std::move(rk)).then([&state] (auto&& members) {
+                for (auto& item : *members) {
+                    state.result.emplace(std::move(item));
+                }
+            });
+        }).then([this, &state] {
+            std::vector<bytes> result(state.result.begin(), state.result.end());
+            if (state.dest) {
+                return this->sadds_impl_return_keys(*state.dest, result);
+            }
+            return reply_builder::build(result);
+        });
+    });
+}
+
+future<scattered_message_ptr> redis_service::sunion(request_wrapper& req)
+{
+    if (req._args_count < 1 || req._args.empty()) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    if (req._args_count == 1) {
+        return smembers(req);
+    }
+    return sunion_impl(req._args, nullptr);
+}
+
+future<scattered_message_ptr> redis_service::sunion_store(request_wrapper& req)
+{
+    if (req._args_count < 2 || req._args.empty()) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    bytes& dest = req._args[0];
+    for (size_t i = 1; i < req._args.size(); ++i) {
+        req.tmp()._keys.emplace_back(std::move(req._args[i]));
+    }
+    return sunion_impl(req.tmp()._keys, &dest);
+}
+
+future<bool> redis_service::srem_direct(bytes& key, bytes& member)
+{
+    redis_key rk {std::ref(key) };
+    auto cpu = get_cpu(rk);
+    return   invoke_on_owner(cpu, &database::srem_direct, rk, std::move(member));
+}
+
+future<bool> redis_service::sadd_direct(bytes& key, bytes& member)
+{
+    redis_key rk {std::ref(key) };
+    auto cpu = get_cpu(rk);
+    return  invoke_on_owner(cpu, &database::sadd_direct, rk, std::move(member));
+}
+
+future<scattered_message_ptr> redis_service::smove(request_wrapper& req)
+{
+    if (req._args_count < 3 || req._args.empty()) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    bytes& key = req._args[0];
+    bytes& dest = req._args[1];
+    bytes& member = req._args[2];
+    redis_key src_rk { std::ref(key), req.key_hash() };
+    redis_key dst_rk { std::ref(dest) };
+    auto cpu = get_cpu(src_rk);
+    if (cpu == get_cpu(dst_rk)) {
+        return invoke_on_owner(cpu, &database::smove, std::move(src_rk), std::move(dst_rk), std::move(member));
+    }
+    struct smove_state {
+        bytes& src;
+        bytes& dst;
+        bytes& member;
+    };
+    return do_with(smove_state{std::ref(key), std::ref(dest), std::ref(member)}, [this] (auto& state) {
+        return this->srem_direct(state.src, state.member).then([this, &state] (auto u) {
+            if (u) {
+                return this->sadd_direct(state.dst, state.member).then([] (auto m) {
+                    return reply_builder::build(m ? msg_one : msg_zero);
+                });
+            }
+            return reply_builder::build(msg_zero);
+        });
+    });
+}
+
+future<scattered_message_ptr> redis_service::srandmember(request_wrapper& req)
+{
+    if (req._args_count <= 0 || req._args.empty()) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    int64_t count = 1;
+    if (req._args_count > 1 && !parse_integer_string(req._args[1].data(), req._args[1].size(), count)) {
+        return reply_builder::build(msg_value_not_integer_err);
+    }
+    // a reply of more members than the largest bulk, 512MB, has bytes is
+    // refused.
+    if (count < -(int64_t(512) << 20)) {
+        return reply_builder::build(msg_value_not_integer_err);
+    }
+    auto rk = take_key(req);
+    auto cpu = get_cpu(rk);
+    return stream_reply(req, [cpu, rk, count] (size_t next, size_t left, bool stream) {
+        return invoke_on_owner(cpu, &database::srandmember, rk, count, next, left, stream);
+    });
+}
+
+future<scattered_message_ptr> redis_service::spop(request_wrapper& req)
+{
+    if (req._args_count <= 0 || req._args.empty()) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    int64_t count = 1;
+    if (req._args_count > 1 && (!parse_integer_string(req._args[1].data(), req._args[1].size(), count) || count < 0)) {
+        return reply_builder::build(msg_value_not_integer_err);
+    }
+    auto rk = take_key(req);
+    auto cpu = get_cpu(rk);
+    return invoke_on_owner(cpu, &database::spop, std::move(rk), static_cast<size_t>(count));
+}
+
+future<scattered_message_ptr> redis_service::type(request_wrapper& req)
+{
+    if (req._args_count <= 0 || req._args.empty()) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    auto rk = take_key(req);
+    auto cpu = get_cpu(rk);
+    return invoke_on_owner(cpu, &database::type, std::move(rk));
+}
+
+future<scattered_message_ptr> redis_service::scan(request_wrapper& req)
+{
+    // SCAN cursor [MATCH pattern] [COUNT count]
+    // Shards are scanned one after the other: the cursor is the cursor of
+    // the shard times the number of shards, plus the shard.
+    if (req._args_count < 1 || req._args.empty()) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    size_t cursor = 0, count = 0;
+    bytes pattern;
+    if (auto err = parse_scan_arguments(req, 0, cursor, pattern, count)) {
+        return reply_builder::build(*err);
+    }
+    auto cpu = static_cast<unsigned>(cursor % smp::count);
+    return invoke_on_owner(cpu, &database::scan_direct, cursor / smp::count, std::move(pattern), count).then([cpu] (auto&& result) {
+        size_t next = 0;
+        if (result->first != 0) {
+            next = result->first * smp::count + cpu;
+        }
+        else if (cpu + 1 < smp::count) {
+            next = cpu + 1;
+        }
+        return reply_builder::build_scan(next, result->second);
+    });
+}
+
+future<scattered_message_ptr> redis_service::expire(request_wrapper& req)
+{
+    if (req._args_count <= 1 || req._args.empty()) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    long expir = 0;
+    try {
+        expir = std::atol(req._args[1].c_str());
+        expir *= 1000;
+    } catch (const std::invalid_argument&) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    auto rk = take_key(req);
+    auto cpu = get_cpu(rk);
+    return invoke_on_owner(cpu, &database::expire, std::move(rk), expir);
+}
+
+future<scattered_message_ptr> redis_service::pexpire(request_wrapper& req)
+{
+    if (req._args_count <= 1 || req._args.empty()) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    long expir = 0;
+    try {
+        expir = std::atol(req._args[1].c_str());
+    } catch (const std::invalid_argument&) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    auto rk = take_key(req);
+    auto cpu = get_cpu(rk);
+    return invoke_on_owner(cpu, &database::expire, std::move(rk), expir);
+}
+
+future<scattered_message_ptr> redis_service::pttl(request_wrapper& req)
+{
+    if (req._args_count < 1 || req._args.empty()) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    auto rk = take_key(req);
+    auto cpu = get_cpu(rk);
+    return invoke_on_owner(cpu, &database::pttl, std::move(rk));
+}
+
+future<scattered_message_ptr> redis_service::ttl(request_wrapper& req)
+{
+    if (req._args_count < 1 || req._args.empty()) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    auto rk = take_key(req);
+    auto cpu = get_cpu(rk);
+    return invoke_on_owner(cpu, &database::ttl, std::move(rk));
+}
+
+future<scattered_message_ptr> redis_service::memory(request_wrapper& req)
+{
+    auto is = [&req] (const char* name) {
+        return req._args_count > 0 && strcasecmp(req._args[0].c_str(), name) == 0;
+    };
+    if (is("usage") && (req._args_count == 2 || req._args_count == 4)) {
+        // SAMPLES 0 counts every element of a collection.
+        size_t samples = 5;
+        if (req._args_count == 4) {
+            if (strcasecmp(req._args[2].c_str(), "samples") != 0) {
+                return reply_builder::build(msg_syntax_err);
+            }
+            try {
+                auto n = std::stol(req._args[3].c_str());
+                if (n < 0) {
+                    return reply_builder::build(msg_syntax_err);
+                }
+                samples = static_cast<size_t>(n);
+            } catch (const std::logic_error&) {
+                return reply_builder::build(msg_syntax_err);
+            }
+        }
+        redis_key rk { std::move(req._args[1]) };
+        auto cpu = get_cpu(rk);
+        return invoke_on_owner(cpu, &database::memory_usage, std::move(rk), samples);
+    }
+    if (is("stats") && req._args_count == 1) {
+        return do_with(memory_stats {}, [] (auto& total) {
+            return parallel_for_each(boost::irange<unsigned>(0, smp::count), [&total] (unsigned cpu) {
+                return get_database().invoke_on(cpu, [] (database& db) {
+                    return db.get_memory_stats();
+                }).then([&total] (memory_stats stats) {
+                    total += stats;
+                });
+            }).then([&total] {
+                auto of = [&total] (data_type type) {
+                    return total._by_type[static_cast<size_t>(type)];
+                };
+                const std::pair<const char*, uint64_t> fields[] = {
+                    { "total.allocated", total._allocated },
+                    { "keys.count", total._keys },
+                    { "dataset.bytes", total._region_used + total._shared_values },
+                    { "region.used", total._region_used },
+                    { "region.free", total._region_free },
+                    { "shared.values", total._shared_values },
+                    { "memtables", total._memtables },
+                    { "block.cache", total._block_cache },
+                    { "type.string", of(data_type::bytes) },
+                    { "type.counter", of(data_type::numeric) + of(data_type::int64) },
+                    { "type.list", of(data_type::list) },
+                    { "type.hash", of(data_type::dict) },
+                    { "type.set", of(data_type::set) },
+                    { "type.zset", of(data_type::sset) },
+                    { "type.hll", of(data_type::hll) },
+                    { "type.stream", of(data_type::stream) },
+                    { "type.timeseries", of(data_type::timeseries) },
+                    { "type.bloom", of(data_type::bloom) },
+                    { "type.cms", of(data_type::cms) },
+                    { "type.topk", of(data_type::topk) },
+                };
+                auto reply = sprint("*%u\r\n", 2 * (sizeof(fields) / sizeof(fields[0])));
+                for (auto& f : fields) {
+                    reply += sprint("$%u\r\n%s\r\n:%u\r\n", std::strlen(f.first), f.first, f.second);
+                }
+                return reply_builder::build(bytes { reply.data(), reply.size() });
+            });
+        });
+    }
+    return reply_builder::build(msg_syntax_err);
+}
+
+namespace {
+enum class sample_order {
+    hot,
+    bytes,
+    elements,
+};
+
+// Gathers the samples of every shard and replies the `count` first by
+// `order`, each as key, type, the measure and the shard.
+future<scattered_message_ptr> reply_key_samples(size_t count, sample_order order)
+{
+    return do_with(std::vector<sampled_key> {}, [count, order] (auto& all) {
+        return parallel_for_each(boost::irange<unsigned>(0, smp::count), [&all, order] (unsigned cpu) {
+            return get_database().invoke_on(cpu, [] (database& db) {
+                return db.get_key_samples();
+            }).then([&all, order] (foreign_ptr<lw_shared_ptr<key_samples>> samples) {
+                auto& keys = order == sample_order::hot ? samples->_hot
+                    : order == sample_order::bytes ? samples->_largest_bytes : samples->_largest_elements;
+                all.insert(all.end(), keys.begin(), keys.end());
+            });
+        }).then([&all, count, order] {
+            auto measure = [order] (const sampled_key& k) -> size_t {
+                return order == sample_order::hot ? k._frequency : order == sample_order::bytes ? k._bytes : k._elements;
+            };
+            std::stable_sort(all.begin(), all.end(), [&measure] (const sampled_key& a, const sampled_key& b) {
+                return measure(a) > measure(b);
+            });
+            if (all.size() > count) {
+                all.resize(count);
+            }
+            auto reply = sprint("*%u\r\n", all.size());
+            for (auto& k : all) {
+                auto type = data_type_name(k._type);
+                reply += sprint("*4\r\n$%u\r\n", k._key.size());
+                reply.append(k._key.data(), k._key.size());
+                reply += sprint("\r\n$%u\r\n%s\r\n:%u\r\n:%u\r\n", std::strlen(type), type, measure(k), k._shard);
+            }
+            return reply_builder::build(bytes { reply.data(), reply.size() });
+        });
+    });
+}
+
+bool parse_sample_count(const bytes& arg, size_t& count)
+{
+    try {
+        auto n = std::stol(arg.c_str());
+        if (n <= 0) {
+            return false;
+        }
+        count = static_cast<size_t>(n);
+        return true;
+    } catch (const std::logic_error&) {
+        return false;
+    }
+}
+}
+
+future<scattered_message_ptr> redis_service::hotkeys(request_wrapper& req)
+{
+    size_t count = 10;
+    if (req._args_count > 1 || (req._args_count == 1 && !parse_sample_count(req._args[0], count))) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    return reply_key_samples(count, sample_order::hot);
 }
 
-future<bool> redis_service::sadd_direct(bytes& key, bytes& member)
+future<scattered_message_ptr> redis_service::bigkeys(request_wrapper& req)
 {
-    redis_key rk {std::ref(key) };
-    auto cpu = get_cpu(rk);
-    return  get_database().invoke_on(cpu, &database::sadd_direct, rk, std::move(member));
+    size_t count = 10;
+    auto order = sample_order::bytes;
+    for (size_t i = 0; i < req._args_count; ++i) {
+        if (strcasecmp(req._args[i].c_str(), "elements") == 0) {
+            order = sample_order::elements;
+        }
+        else if (i != 0 || !parse_sample_count(req._args[i], count)) {
+            return reply_builder::build(msg_syntax_err);
+        }
+    }
+    return reply_key_samples(count, order);
 }
 
-future<scattered_message_ptr> redis_service::smove(request_wrapper& req)
+future<scattered_message_ptr> redis_service::save(request_wrapper& req, bool background)
 {
-    if (req._args_count < 3 || req._args.empty()) {
+    if (req._args_count > 0) {
         return reply_builder::build(msg_syntax_err);
     }
-    bytes& key = req._args[0];
-    bytes& dest = req._args[1];
-    bytes& member = req._args[2];
-    struct smove_state {
-        bytes& src;
-        bytes& dst;
-        bytes& member;
+    return get_database().map_reduce0([] (database& db) {
+        return db.saving_snapshot();
+    }, false, std::logical_or<bool>()).then([background] (bool saving) {
+        if (saving) {
+            return reply_builder::build(msg_bgsave_in_progress_err);
+        }
+        // each shard saves on its own, a failed one is logged and counted.
+        auto saved = get_database().map_reduce0([] (database& db) {
+            return db.save_snapshot().then([] {
+                return true;
+            }).handle_exception([] (std::exception_ptr) {
+                return false;
+            });
+        }, true, std::logical_and<bool>());
+        if (background) {
+            saved.handle_exception([] (std::exception_ptr) {});
+            return reply_builder::build(msg_bgsave_started);
+        }
+        return saved.then([] (bool ok) {
+            return reply_builder::build(ok ? msg_ok : msg_save_err);
+        });
+    });
+}
+
+future<scattered_message_ptr> redis_service::lastsave(request_wrapper& req)
+{
+    if (req._args_count > 0) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    return get_database().map_reduce0([] (database& db) {
+        return db.get_snapshot_stats()._last_save;
+    }, std::numeric_limits<uint64_t>::max(), [] (uint64_t a, uint64_t b) {
+        return std::min(a, b);
+    }).then([] (uint64_t last) {
+        return reply_builder::build(static_cast<size_t>(last));
+    });
+}
+
+future<scattered_message_ptr> redis_service::dbsize(request_wrapper& req)
+{
+    if (req._args_count > 0) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    return get_database().map_reduce0([] (database& db) {
+        return db.key_count();
+    }, size_t(0), std::plus<size_t>()).then([] (size_t count) {
+        return reply_builder::build(count);
+    });
+}
+
+future<scattered_message_ptr> redis_service::randomkey(request_wrapper& req)
+{
+    if (req._args_count > 0) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    return get_database().map_reduce0([] (database& db) {
+        std::vector<size_t> counts(smp::count, 0);
+        counts[engine().cpu_id()] = db.key_count();
+        return counts;
+    }, std::vector<size_t>(smp::count, 0), [] (std::vector<size_t> a, const std::vector<size_t>& b) {
+        std::transform(a.begin(), a.end(), b.begin(), a.begin(), std::plus<size_t>());
+        return a;
+    }).then([] (std::vector<size_t> counts) {
+        static thread_local std::mt19937_64 random_engine { std::random_device {}() };
+        auto total = std::accumulate(counts.begin(), counts.end(), size_t(0));
+        if (total == 0) {
+            return reply_builder::build(msg_nil);
+        }
+        auto n = std::uniform_int_distribution<size_t>(0, total - 1)(random_engine);
+        unsigned cpu = 0;
+        while (n >= counts[cpu]) {
+            n -= counts[cpu++];
+        }
+        return get_database().invoke_on(cpu, &database::random_key).then([] (reply_value v) {
+            return reply_builder::build(std::move(v));
+        });
+    });
+}
+
+future<scattered_message_ptr> redis_service::watch(request_wrapper& req, std::vector<watched_key>& watched)
+{
+    if (req._args_count < 1 || req._args.empty()) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    return parallel_for_each(boost::irange<size_t>(0, req._args_count), [this, &req, &watched] (size_t i) {
+        redis_key rk { std::ref(req._args[i]) };
+        auto cpu = get_cpu(rk);
+        return invoke_on_owner(cpu, &database::watch, rk).then([&watched, rk] (uint64_t version) {
+            watched.push_back(watched_key { rk, version });
+        });
+    }).then([] {
+        return reply_builder::build(msg_ok);
+    });
+}
+
+future<> redis_service::unwatch(std::vector<watched_key>& watched)
+{
+    if (watched.empty()) {
+        return make_ready_future<>();
+    }
+    std::vector<std::vector<bytes>> keys(smp::count);
+    for (auto& w : watched) {
+        keys[w._key.get_cpu()].push_back(w._key.key());
+    }
+    watched.clear();
+    return do_with(std::move(keys), [] (auto& keys) {
+        return parallel_for_each(boost::irange<unsigned>(0, smp::count), [&keys] (unsigned cpu) {
+            if (keys[cpu].empty()) {
+                return make_ready_future<>();
+            }
+            return invoke_on_owner(cpu, &database::unwatch, std::move(keys[cpu]));
+        });
+    });
+}
+
+// The commands of a transaction on one shard, at their positions in the
+// transaction, run there one after the other. They run as one task unless
+// a command waits, as those of several keys on other shards do.
+static future<> run_transaction_batch(std::vector<request_wrapper>& commands, const std::vector<size_t>& positions,
+    redis_service::command_executor executor, std::vector<scattered_message_ptr>& replies)
+{
+    return do_for_each(positions, [&commands, executor, &replies] (size_t i) {
+        return futurize_apply(executor, commands[i]).handle_exception([] (std::exception_ptr) {
+            return reply_builder::build(msg_err);
+        }).then([&replies, i] (scattered_message_ptr reply) {
+            replies[i] = std::move(reply);
+        });
+    });
+}
+
+// A command runs on the owner of its first key, a command without keys on
+// this shard. The shards of the transaction are those of its commands and
+// of its watched keys:
+//
+// - on a single shard, the versions of the watched keys are checked and
+//   the commands run in one task there, one hop in all;
+// - on several, the transaction takes the shards in ascending order, see
+//   database::begin_transaction(), so that two transactions sharing shards
+//   run in the same order on each of them. It then prepares: the versions
+//   are checked on their owners, each of which holds its commands from
+//   then on, see database::hold_transaction_writes(). If one changed, the
+//   holds are released and the transaction is discarded. Otherwise it
+//   commits: the task running the batch of a shard checks the versions
+//   again as it releases the shard, and the batches of all the shards run
+//   at once. Only what the holds do not stop, expiry, eviction and
+//   replication, may fail the second check: the commands of that shard are
+//   then not run and reply with an error, as those of the others may have
+//   run already.
+//
+// When a command has keys of another shard than its own, such as
+// SUNIONSTORE, those shards are taken too, and the commands run in queue
+// order instead, a run of consecutive commands of a shard at a time, so
+// that each sees the writes queued before it. As a run may wait on any of
+// the shards, all are released, and checked again, before the first one:
+// other commands may then come between the check and the runs, and
+// between the keys of a command of several shards.
+//
+// A batch runs as the futures of its commands chained in one task, not in
+// a single allocating section: a command may wait, or hop to other shards,
+// and its reply outlives the section.
+future<bool> redis_service::exec(std::vector<request_wrapper>& commands, const std::vector<watched_key>& watched,
+    command_executor executor, std::vector<scattered_message_ptr>& replies)
+{
+    struct transaction_state {
+        std::vector<std::vector<size_t>> _batches;
+        std::vector<std::vector<std::pair<bytes, uint64_t>>> _versions;
+        std::vector<unsigned> _shards;
+        // The commands in queue order, by runs on the same shard, when one
+        // has keys of another shard.
+        std::vector<std::pair<unsigned, std::vector<size_t>>> _runs;
+        // The shards holding their commands for the transaction.
+        std::vector<bool> _held;
+        size_t _taken = 0;
+        bool _unchanged = true;
     };
-    return do_with(smove_state{std::ref(key), std::ref(dest), std::ref(member)}, [this] (auto& state) {
-        return this->srem_direct(state.src, state.member).then([this, &state] (auto u) {
-            if (u) {
-                return this->sadd_direct(state.dst, state.member).then([] (auto m) {
-                    return reply_builder::build(m ? msg_one : msg_zero);
+    transaction_state state;
+    state._batches.resize(smp::count);
+    state._versions.resize(smp::count);
+    state._held.resize(smp::count, false);
+    replies.clear();
+    replies.resize(commands.size());
+    std::vector<unsigned> owners(commands.size());
+    std::vector<bool> touched(smp::count, false);
+    bool crossing = false;
+    for (size_t i = 0; i < commands.size(); ++i) {
+        auto& req = commands[i];
+        retire_reads(req);
+        auto cpu = req._args_count > 0 ? shard_of_key(req.arg_view(0), req.key_hash(), smp::count) : engine().cpu_id();
+        state._batches[cpu].push_back(i);
+        owners[i] = cpu;
+        for (auto position : command_key_positions(req)) {
+            auto owner = position == 0 ? cpu : shard_of_key(req.arg_view(position), smp::count);
+            if (owner != cpu) {
+                touched[owner] = true;
+                crossing = true;
+            }
+        }
+    }
+    if (crossing) {
+        for (size_t i = 0; i < commands.size(); ++i) {
+            if (state._runs.empty() || state._runs.back().first != owners[i]) {
+                state._runs.emplace_back(owners[i], std::vector<size_t>());
+            }
+            state._runs.back().second.push_back(i);
+        }
+    }
+    for (auto& w : watched) {
+        state._versions[w._key.get_cpu()].emplace_back(w._key.key(), w._version);
+    }
+    for (unsigned cpu = 0; cpu < smp::count; ++cpu) {
+        if (!state._batches[cpu].empty() || !state._versions[cpu].empty() || touched[cpu]) {
+            state._shards.push_back(cpu);
+        }
+    }
+    if (state._shards.empty()) {
+        return make_ready_future<bool>(true);
+    }
+    if (state._shards.size() == 1) {
+        auto cpu = state._shards.front();
+        return smp::submit_to(cpu, [&commands, &replies, executor, batch = std::move(state._batches[cpu]), versions = std::move(state._versions[cpu])] () mutable {
+            auto& db = get_database().local();
+            return db.begin_transaction().then([&db, &commands, &replies, executor, batch = std::move(batch), versions = std::move(versions)] () mutable {
+                if (!db.watched_unchanged(std::move(versions))) {
+                    return make_ready_future<bool>(false);
+                }
+                return do_with(std::move(batch), [&commands, &replies, executor] (auto& batch) {
+                    return run_transaction_batch(commands, batch, executor, replies);
+                }).then([] {
+                    return true;
+                });
+            }).finally([&db] {
+                db.end_transaction();
+            });
+        });
+    }
+    return do_with(std::move(state), [&commands, &replies, executor] (transaction_state& state) {
+        return do_for_each(state._shards, [&state] (unsigned cpu) {
+            return get_database().invoke_on(cpu, &database::begin_transaction).then([&state] {
+                ++state._taken;
+            });
+        }).then([&state] {
+            return parallel_for_each(state._shards, [&state] (unsigned cpu) {
+                if (state._versions[cpu].empty()) {
+                    return make_ready_future<>();
+                }
+                return get_database().invoke_on(cpu, [versions = state._versions[cpu]] (database& db) mutable {
+                    return db.hold_transaction_writes(std::move(versions));
+                }).then([&state, cpu] (bool unchanged) {
+                    state._held[cpu] = unchanged;
+                    state._unchanged &= unchanged;
                 });
+            });
+        }).then([&state, &commands, &replies, executor] {
+            if (!state._unchanged) {
+                return make_ready_future<>();
             }
-            return reply_builder::build(msg_zero);
+            if (!state._runs.empty()) {
+                return parallel_for_each(state._shards, [&state] (unsigned cpu) {
+                    if (!state._held[cpu]) {
+                        return make_ready_future<>();
+                    }
+                    state._held[cpu] = false;
+                    return get_database().invoke_on(cpu, [versions = std::move(state._versions[cpu])] (database& db) mutable {
+                        return db.release_transaction_writes(std::move(versions));
+                    }).then([&state] (bool unchanged) {
+                        state._unchanged &= unchanged;
+                    });
+                }).then([&state, &commands, &replies, executor] {
+                    if (!state._unchanged) {
+                        return make_ready_future<>();
+                    }
+                    return do_for_each(state._runs, [&commands, &replies, executor] (auto& run) {
+                        return smp::submit_to(run.first, [&commands, &replies, executor, &batch = run.second] {
+                            return run_transaction_batch(commands, batch, executor, replies);
+                        });
+                    });
+                });
+            }
+            return parallel_for_each(state._shards, [&state, &commands, &replies, executor] (unsigned cpu) {
+                auto held = state._held[cpu];
+                if (state._batches[cpu].empty() && !held) {
+                    return make_ready_future<>();
+                }
+                state._held[cpu] = false;
+                return smp::submit_to(cpu, [&commands, &replies, executor, &batch = state._batches[cpu], versions = std::move(state._versions[cpu]), held] () mutable {
+                    auto& db = get_database().local();
+                    if (held && !db.release_transaction_writes(std::move(versions))) {
+                        for (auto i : batch) {
+                            replies[i] = reply_builder::build(msg_watched_changed_err);
+                        }
+                        return make_ready_future<>();
+                    }
+                    return run_transaction_batch(commands, batch, executor, replies);
+                });
+            });
+        }).finally([&state] {
+            return parallel_for_each(boost::irange<size_t>(0, state._taken), [&state] (size_t i) {
+                auto cpu = state._shards[i];
+                return get_database().invoke_on(cpu, [held = bool(state._held[cpu])] (database& db) {
+                    if (held) {
+                        db.release_transaction_writes({});
+                    }
+                    db.end_transaction();
+                });
+            });
+        }).then([&state] {
+            return state._unchanged;
         });
     });
 }
 
-future<scattered_message_ptr> redis_service::srandmember(request_wrapper& req)
+future<bytes> redis_service::load_script(const sstring& sha, const bytes& body)
 {
-    if (req._args_count <= 0 || req._args.empty()) {
+    return local_script_engine().load(sha, body).then([sha, body] (bytes error) {
+        if (!error.empty()) {
+            return make_ready_future<bytes>(std::move(error));
+        }
+        return smp::invoke_on_all([sha, body] {
+            local_script_engine().add(sha, body);
+        }).then([] {
+            return bytes {};
+        });
+    });
+}
+
+// The keys are checked here, so that a script whose keys are owned by
+// several shards fails before it runs rather than while it runs.
+future<scattered_message_ptr> redis_service::eval(request_wrapper& req, bool by_sha, command_executor executor)
+{
+    if (req._args_count < 2 || req._args.empty()) {
         return reply_builder::build(msg_syntax_err);
     }
-    bytes& key = req._args[0];
-    size_t count = 1;
-    if (req._args_count > 1) {
-        try {
-            count  = std::stol(req._args[1].c_str());
-        } catch (const std::invalid_argument&) {
-            return reply_builder::build(msg_syntax_err);
+    int64_t numkeys = 0;
+    if (!parse_integer_string(req._args[1].data(), req._args[1].size(), numkeys)) {
+        return reply_builder::build(msg_value_not_integer_err);
+    }
+    if (numkeys < 0) {
+        return reply_builder::build(msg_script_negative_keys_err);
+    }
+    if (static_cast<size_t>(numkeys) > req._args_count - 2) {
+        return reply_builder::build(msg_script_too_many_keys_err);
+    }
+    auto cpu = engine().cpu_id();
+    for (size_t i = 2; i < 2 + static_cast<size_t>(numkeys); ++i) {
+        auto owner = get_cpu(req._args[i]);
+        if (i > 2 && owner != cpu) {
+            return reply_builder::build(msg_script_cross_shard_err);
         }
+        cpu = owner;
     }
-    redis_key rk { std::move(key) };
+    auto run = [&req, cpu, numkeys, executor] (sstring sha) {
+        return smp::submit_to(cpu, [&req, numkeys, executor, sha = std::move(sha)] {
+            return local_script_engine().run(sha, req, numkeys, executor);
+        });
+    };
+    if (by_sha) {
+        auto& name = req._args[0];
+        sstring sha(name.data(), name.size());
+        std::transform(sha.begin(), sha.end(), sha.begin(), ::tolower);
+        if (!local_script_engine().exists(sha)) {
+            return reply_builder::build(msg_noscript_err);
+        }
+        return run(std::move(sha));
+    }
+    auto& body = req._args[0];
+    auto sha = script_engine::sha1_hex(bytes_view { body.data(), body.size() });
+    if (local_script_engine().exists(sha)) {
+        return run(std::move(sha));
+    }
+    return load_script(sha, body).then([run, sha] (bytes error) {
+        if (!error.empty()) {
+            return reply_builder::build(error);
+        }
+        return run(sha);
+    });
+}
+
+future<scattered_message_ptr> redis_service::script(request_wrapper& req)
+{
+    auto is = [&req] (const char* name) {
+        return req._args_count > 0 && strcasecmp(req._args[0].c_str(), name) == 0;
+    };
+    if (is("load") && req._args_count == 2) {
+        auto& body = req._args[1];
+        auto sha = script_engine::sha1_hex(bytes_view { body.data(), body.size() });
+        return load_script(sha, body).then([sha] (bytes error) {
+            if (!error.empty()) {
+                return reply_builder::build(error);
+            }
+            auto m = make_lw_shared<scattered_message<char>>();
+            reply_builder::append_bulk(*m, sha);
+            return make_ready_future<scattered_message_ptr>(foreign_ptr<lw_shared_ptr<scattered_message<char>>>(m));
+        });
+    }
+    if (is("exists") && req._args_count > 1) {
+        // every shard knows every script.
+        auto m = make_lw_shared<scattered_message<char>>();
+        reply_builder::append_array_header(*m, req._args_count - 1);
+        for (size_t i = 1; i < req._args_count; ++i) {
+            sstring sha(req._args[i].data(), req._args[i].size());
+            std::transform(sha.begin(), sha.end(), sha.begin(), ::tolower);
+            reply_builder::append_integer(*m, local_script_engine().exists(sha) ? 1 : 0);
+        }
+        return make_ready_future<scattered_message_ptr>(foreign_ptr<lw_shared_ptr<scattered_message<char>>>(m));
+    }
+    // SYNC and ASYNC are accepted, the scripts are dropped at once anyway.
+    if (is("flush") && (req._args_count == 1 || (req._args_count == 2
+        && (strcasecmp(req._args[1].c_str(), "sync") == 0 || strcasecmp(req._args[1].c_str(), "async") == 0)))) {
+        return smp::invoke_on_all([] {
+            return local_script_engine().flush();
+        }).then([] {
+            return reply_builder::build(msg_ok);
+        });
+    }
+    return reply_builder::build(msg_syntax_err);
+}
+
+future<scattered_message_ptr> redis_service::persist(request_wrapper& req)
+{
+    if (req._args_count < 1 || req._args.empty()) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    auto rk = take_key(req);
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::srandmember, std::move(rk), count);
+    return invoke_on_owner(cpu, &database::persist, std::move(rk));
 }
 
-future<scattered_message_ptr> redis_service::spop(request_wrapper& req)
+future<scattered_message_ptr> redis_service::zadd(request_wrapper& req)
 {
-    if (req._args_count <= 0 || req._args.empty()) {
+    if (req._args_count < 3 || req._args.empty()) {
         return reply_builder::build(msg_syntax_err);
     }
-    bytes& key = req._args[0];
-    size_t count = 1;
-    if (req._args_count > 1) {
-        try {
-            count  = std::stol(req._args[1].c_str());
-        } catch (const std::invalid_argument&) {
+    int zadd_flags = 0;
+    size_t first_score_index = parse_zadd_flags(req, zadd_flags);
+    if (zadd_flags & ZADD_INCR) {
+        if (req._args_count - first_score_index > 2) {
+            return reply_builder::build(msg_syntax_err);
+        }
+        auto rk = take_key(req);
+        auto cpu = get_cpu(rk);
+        bytes& member = req._args[first_score_index + 1];
+        bytes& delta = req._args[first_score_index];
+        double score = 0;
+        if (!parse_float_string(delta.data(), delta.size(), score)) {
+            return reply_builder::build(msg_value_not_float_err);
+        }
+        return invoke_on_owner(cpu, &database::zincrby, std::move(rk), std::move(member), score);
+    }
+    else {
+        if ((req._args_count - first_score_index) % 2 != 0 || ((zadd_flags & ZADD_NX) && (zadd_flags & ZADD_XX))) {
             return reply_builder::build(msg_syntax_err);
         }
     }
-    redis_key rk { std::move(key) };
+    if (!parse_zadd_members(req, first_score_index, req.tmp()._key_scores)) {
+        return reply_builder::build(msg_value_not_float_err);
+    }
+    auto rk = take_key(req);
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::spop, std::move(rk), count);
+    return invoke_on_owner(cpu, &database::zadds, std::move(rk), std::move(req.tmp()._key_scores), zadd_flags);
 }
 
-future<scattered_message_ptr> redis_service::type(request_wrapper& req)
+future<scattered_message_ptr> redis_service::zcard(request_wrapper& req)
 {
-    if (req._args_count <= 0 || req._args.empty()) {
+    if (req._args_count < 1 || req._args.empty()) {
         return reply_builder::build(msg_syntax_err);
     }
-    bytes& key = req._args[0];
-    redis_key rk { std::move(key) };
+    auto rk = take_key(req);
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::type, std::move(rk));
+    return invoke_on_owner(cpu, &database::zcard, std::move(rk));
 }
 
-future<scattered_message_ptr> redis_service::expire(request_wrapper& req)
+future<scattered_message_ptr> redis_service::zrange(request_wrapper& req, bool reverse)
 {
-    if (req._args_count <= 1 || req._args.empty()) {
+    if (req._args_count < 3 || req._args.empty()) {
         return reply_builder::build(msg_syntax_err);
     }
-    bytes& key = req._args[0];
-    long expir = 0;
+    long begin = 0, end = 0;
     try {
-        expir = std::atol(req._args[1].c_str());
-        expir *= 1000;
+        begin = std::stoi(req._args[1].c_str());
+        end = std::stoi(req._args[2].c_str());
     } catch (const std::invalid_argument&) {
         return reply_builder::build(msg_syntax_err);
     }
-    redis_key rk { std::move(key) };
+    bool with_score = false;
+    if (req._args_count == 4) {
+        auto ws = req._args[3];
+        std::transform(ws.begin(), ws.end(), ws.begin(), ::toupper);
+        if (ws == "WITHSCORES") {
+            with_score = true;
+        }
+    }
+    auto rk = take_key(req);
+    auto cpu = get_cpu(rk);
+    return stream_reply(req, [cpu, rk, begin, end, reverse, with_score] (size_t next, size_t left, bool stream) {
+        return invoke_on_owner(cpu, &database::zrange, rk, begin, end, reverse, with_score, next, left, stream);
+    });
+}
+
+future<scattered_message_ptr> redis_service::zrangebyscore(request_wrapper& req, bool reverse)
+{
+    if (req._args_count < 3 || req._args.empty()) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    auto rk = take_key(req);
+    auto cpu = get_cpu(rk);
+    double min = 0, max = 0;
+    if (!parse_float_string(req._args[1].data(), req._args[1].size(), min)
+        || !parse_float_string(req._args[2].data(), req._args[2].size(), max)) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    bool with_score = false;
+    if (req._args_count == 4) {
+        auto ws = req._args[3];
+        std::transform(ws.begin(), ws.end(), ws.begin(), ::toupper);
+        if (ws == "WITHSCORES") {
+            with_score = true;
+        }
+    }
+    return invoke_on_owner(cpu, &database::zrangebyscore, std::move(rk), min, max, reverse, with_score);
+}
+
+// ZRANGESTORE dst src min max [BYSCORE | BYLEX] [REV] [LIMIT offset count]
+//
+// With both keys on one shard, hash tags helping, the range is copied there
+// without leaving it. Otherwise the shard of the source sends the members
+// in score order to that of the destination, which builds the set from
+// them in O(n).
+future<scattered_message_ptr> redis_service::zrangestore(request_wrapper& req)
+{
+    if (req._args_count < 4 || req._args.empty()) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    zrange_spec spec;
+    bool limit = false;
+    for (size_t i = 4; i < req._args_count; ++i) {
+        auto& option = req._args[i];
+        if (strcasecmp(option.c_str(), "byscore") == 0) {
+            spec._kind = zrange_spec::kind::score;
+        }
+        else if (strcasecmp(option.c_str(), "bylex") == 0) {
+            spec._kind = zrange_spec::kind::lex;
+        }
+        else if (strcasecmp(option.c_str(), "rev") == 0) {
+            spec._reverse = true;
+        }
+        else if (strcasecmp(option.c_str(), "limit") == 0 && i + 2 < req._args_count) {
+            int64_t offset = 0, count = 0;
+            if (!parse_integer_string(req._args[i + 1].data(), req._args[i + 1].size(), offset)
+                || !parse_integer_string(req._args[i + 2].data(), req._args[i + 2].size(), count)) {
+                return reply_builder::build(msg_value_not_integer_err);
+            }
+            spec._offset = offset;
+            spec._limit = count;
+            limit = true;
+            i += 2;
+        }
+        else {
+            return reply_builder::build(msg_syntax_err);
+        }
+    }
+    // REV takes the bounds of scores and members as max then min.
+    auto& from = req._args[spec._reverse && spec._kind != zrange_spec::kind::rank ? 3 : 2];
+    auto& to = req._args[spec._reverse && spec._kind != zrange_spec::kind::rank ? 2 : 3];
+    switch (spec._kind) {
+    case zrange_spec::kind::rank: {
+        int64_t begin = 0, end = 0;
+        if (limit) {
+            return reply_builder::build(msg_syntax_err);
+        }
+        if (!parse_integer_string(from.data(), from.size(), begin) || !parse_integer_string(to.data(), to.size(), end)) {
+            return reply_builder::build(msg_value_not_integer_err);
+        }
+        spec._begin = begin;
+        spec._end = end;
+        break;
+    }
+    case zrange_spec::kind::score:
+        if (!parse_float_string(from.data(), from.size(), spec._min) || !parse_float_string(to.data(), to.size(), spec._max)) {
+            return reply_builder::build(msg_syntax_err);
+        }
+        break;
+    case zrange_spec::kind::lex:
+        if (!lex_bound::parse(from, spec._lex_min) || !lex_bound::parse(to, spec._lex_max)) {
+            return reply_builder::build(msg_syntax_err);
+        }
+        break;
+    }
+    struct keys {
+        bytes _dest;
+        bytes _src;
+    };
+    return do_with(keys { std::move(req._args[0]), std::move(req._args[1]) }, std::move(spec), [this] (auto& k, auto& spec) {
+        redis_key dest { std::ref(k._dest) };
+        redis_key src { std::ref(k._src) };
+        auto dest_cpu = this->get_cpu(dest);
+        auto src_cpu = this->get_cpu(src);
+        if (dest_cpu == src_cpu) {
+            return this->invoke_on_owner(src_cpu, &database::zrangestore, std::move(dest), std::move(src), spec);
+        }
+        return this->invoke_on_owner(src_cpu, &database::zrange_members, std::move(src), spec).then([this, dest = std::move(dest), dest_cpu] (auto&& members) {
+            if (!members) {
+                return reply_builder::build(msg_type_err);
+            }
+            return do_with(std::move(members), [this, dest = std::move(dest), dest_cpu] (auto& members) {
+                return this->invoke_on_owner(dest_cpu, &database::zstore_sorted, std::move(dest), std::cref(*members));
+            });
+        });
+    });
+}
+
+future<scattered_message_ptr> redis_service::zcount(request_wrapper& req)
+{
+    if (req._args_count < 1 || req._args.empty()) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    double min = 0, max = 0;
+    if (!parse_float_string(req._args[1].data(), req._args[1].size(), min)
+        || !parse_float_string(req._args[2].data(), req._args[2].size(), max)) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    auto rk = take_key(req);
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::expire, std::move(rk), expir);
+    return invoke_on_owner(cpu, &database::zcount, std::move(rk), min, max);
 }
 
-future<scattered_message_ptr> redis_service::pexpire(request_wrapper& req)
+future<scattered_message_ptr> redis_service::zincrby(request_wrapper& req)
 {
-    if (req._args_count <= 1 || req._args.empty()) {
+    if (req._args_count < 3 || req._args.empty()) {
         return reply_builder::build(msg_syntax_err);
     }
-    bytes& key = req._args[0];
-    long expir = 0;
-    try {
-        expir = std::atol(req._args[1].c_str());
-    } catch (const std::invalid_argument&) {
-        return reply_builder::build(msg_syntax_err);
+    bytes& member = req._args[2];
+    double delta = 0;
+    if (!parse_float_string(req._args[1].data(), req._args[1].size(), delta)) {
+        return reply_builder::build(msg_value_not_float_err);
     }
-    redis_key rk { std::move(key) };
+    auto rk = take_key(req);
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::expire, std::move(rk), expir);
+    return invoke_on_owner(cpu, &database::zincrby, std::move(rk), std::move(member), delta);
 }
 
-future<scattered_message_ptr> redis_service::pttl(request_wrapper& req)
+future<scattered_message_ptr> redis_service::zrank(request_wrapper& req, bool reverse)
 {
-    if (req._args_count < 1 || req._args.empty()) {
+    if (req._args_count < 2 || req._args.empty()) {
         return reply_builder::build(msg_syntax_err);
     }
-    bytes& key = req._args[0];
-    redis_key rk { std::move(key) };
+    bytes& member = req._args[1];
+    auto rk = take_key(req);
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::pttl, std::move(rk));
+    return invoke_on_owner(cpu, &database::zrank, std::move(rk), std::move(member), reverse);
 }
 
-future<scattered_message_ptr> redis_service::ttl(request_wrapper& req)
+future<scattered_message_ptr> redis_service::zrem(request_wrapper& req)
 {
-    if (req._args_count < 1 || req._args.empty()) {
+    if (req._args_count < 2 || req._args.empty()) {
         return reply_builder::build(msg_syntax_err);
     }
-    bytes& key = req._args[0];
-    redis_key rk { std::move(key) };
+    for (size_t i = 1; i < req._args_count; ++i) {
+        bytes& member = req._args[i];
+        req.tmp()._keys.emplace_back(std::move(member));
+    }
+    auto rk = take_key(req);
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::ttl, std::move(rk));
+    return invoke_on_owner(cpu, &database::zrem, std::move(rk), std::move(req.tmp()._keys));
 }
 
-future<scattered_message_ptr> redis_service::persist(request_wrapper& req)
+// ZPOPMIN key [count], ZPOPMAX key [count]
+future<scattered_message_ptr> redis_service::zpop(request_wrapper& req, bool max)
 {
-    if (req._args_count < 1 || req._args.empty()) {
+    if (req._args_count < 1 || req._args_count > 2 || req._args.empty()) {
         return reply_builder::build(msg_syntax_err);
     }
-    bytes& key = req._args[0];
-    redis_key rk { std::move(key) };
+    size_t count = 1;
+    if (req._args_count == 2 && !parse_count(req._args[1], count)) {
+        return reply_builder::build(msg_value_not_integer_err);
+    }
+    auto rk = take_key(req);
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::persist, std::move(rk));
+    return invoke_on_owner(cpu, &database::zpop, std::move(rk), max, count);
 }
 
-future<scattered_message_ptr> redis_service::zadd(request_wrapper& req)
+// BZPOPMIN key [key ...] timeout, which waits on the shards of its keys as
+// BLPOP does, served by ZADD and ZINCRBY.
+future<scattered_message_ptr> redis_service::bzpopmin(request_wrapper& req)
+{
+    return blocking_pop(req, true, true);
+}
+
+future<scattered_message_ptr> redis_service::bzpopmax(request_wrapper& req)
+{
+    return blocking_pop(req, false, true);
+}
+
+// LMPOP numkeys key [key ...] LEFT|RIGHT [COUNT count], and ZMPOP with
+// MIN|MAX. The keys of a shard are all tried in one call there, the first
+// holding elements popping them: the calls follow the keys in their order,
+// a run of consecutive keys of the same shard at a time, until one pops.
+future<scattered_message_ptr> redis_service::mpop(request_wrapper& req, bool list)
 {
     if (req._args_count < 3 || req._args.empty()) {
         return reply_builder::build(msg_syntax_err);
     }
-    bytes& key = req._args[0];
-    std::string un = req._args[1];
-    std::transform(un.begin(), un.end(), un.begin(), ::tolower);
-    int zadd_flags = ZADD_CH;
-    size_t first_score_index = 2;
-    if (un == "nx") {
-        zadd_flags |= ZADD_NX;
-    }
-    else if (un == "xx") {
-        zadd_flags |= ZADD_XX;
-    }
-    else if (un == "ch") {
-        zadd_flags |= ZADD_CH;
-    }
-    else if (un == "incr") {
-        zadd_flags |= ZADD_INCR;
+    int64_t numkeys = 0;
+    if (!parse_integer_string(req._args[0].data(), req._args[0].size(), numkeys) || numkeys < 1 ||
+        static_cast<size_t>(numkeys) + 2 > req._args_count) {
+        return reply_builder::build(msg_syntax_err);
     }
-    else {
-        first_score_index = 1;
+    auto is = [&req] (size_t i, const char* name) {
+        return strcasecmp(req._args[i].c_str(), name) == 0;
+    };
+    size_t i = static_cast<size_t>(numkeys) + 1;
+    bool front = false;
+    if (is(i, list ? "left" : "min")) {
+        front = true;
     }
-    if (zadd_flags & ZADD_INCR) {
-        if (req._args_count - first_score_index > 2) {
-            return reply_builder::build(msg_syntax_err);
-        }
-        redis_key rk { std::move(key) };
-        auto cpu = get_cpu(rk);
-        bytes& member = req._args[first_score_index + 1];
-        bytes& delta = req._args[first_score_index];
-        double score = 0;
-        try {
-            score = std::stod(delta.c_str());
-        } catch (const std::invalid_argument&) {
-            return reply_builder::build(msg_syntax_err);
-        }
-        return get_database().invoke_on(cpu, &database::zincrby, std::move(rk), std::move(member), score);
+    else if (!is(i, list ? "right" : "max")) {
+        return reply_builder::build(msg_syntax_err);
     }
-    else {
-        if ((req._args_count - first_score_index) % 2 != 0 || ((zadd_flags & ZADD_NX) && (zadd_flags & ZADD_XX))) {
+    size_t count = 1;
+    if (++i < req._args_count) {
+        if (i + 2 != req._args_count || !is(i, "count") || !parse_count(req._args[i + 1], count) || count == 0) {
             return reply_builder::build(msg_syntax_err);
         }
     }
-    for (size_t i = first_score_index; i < req._args_count; i += 2) {
-        bytes& score_ = req._args[i];
-        bytes& member = req._args[i + 1];
-        double score = 0;
-        try {
-            score = std::stod(score_.c_str());
-        } catch (const std::invalid_argument&) {
-            return reply_builder::build(msg_syntax_err);
+    struct mpop_state {
+        std::vector<std::pair<unsigned, std::vector<redis_key>>> runs;
+        size_t next = 0;
+        scattered_message_ptr reply;
+    };
+    mpop_state state;
+    for (size_t k = 1; k <= static_cast<size_t>(numkeys); ++k) {
+        redis_key rk { std::ref(req._args[k]) };
+        auto cpu = get_cpu(rk);
+        if (state.runs.empty() || state.runs.back().first != cpu) {
+            state.runs.emplace_back(cpu, std::vector<redis_key>());
         }
-        req._tmp_key_scores.emplace(std::pair<bytes, double>(member, score));
+        state.runs.back().second.emplace_back(std::move(rk));
     }
-    redis_key rk { std::move(key) };
-    auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::zadds, std::move(rk), std::move(req._tmp_key_scores), zadd_flags);
+    return do_with(std::move(state), [list, front, count] (auto& state) {
+        return repeat([&state, list, front, count] {
+            if (state.next == state.runs.size()) {
+                return make_ready_future<stop_iteration>(stop_iteration::yes);
+            }
+            auto& run = state.runs[state.next++];
+            // LPOP passes `left` false to database::pop(), as lmpop() takes it.
+            auto popped = list ? invoke_on_owner(run.first, &database::lmpop, std::move(run.second), !front, count)
+                               : invoke_on_owner(run.first, &database::zmpop, std::move(run.second), !front, count);
+            return popped.then([&state] (scattered_message_ptr reply) {
+                state.reply = std::move(reply);
+                return state.reply ? stop_iteration::yes : stop_iteration::no;
+            });
+        }).then([&state] {
+            if (!state.reply) {
+                return reply_builder::build(msg_null_multi_bulk);
+            }
+            return make_ready_future<scattered_message_ptr>(std::move(state.reply));
+        });
+    });
 }
 
-future<scattered_message_ptr> redis_service::zcard(request_wrapper& req)
+future<scattered_message_ptr> redis_service::zscore(request_wrapper& req)
 {
-    if (req._args_count < 1 || req._args.empty()) {
+    if (req._args_count < 2 || req._args.empty()) {
         return reply_builder::build(msg_syntax_err);
     }
-    bytes& key = req._args[0];
-    redis_key rk { std::move(key) };
+    bytes& member = req._args[1];
+    auto rk = take_key(req);
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::zcard, std::move(rk));
+    return invoke_on_owner(cpu, &database::zscore, std::move(rk), std::move(member));
 }
 
-future<scattered_message_ptr> redis_service::zrange(request_wrapper& req, bool reverse)
+bool redis_service::parse_zset_args(request_wrapper& req, zset_args& uargs, bool store)
 {
-    if (req._args_count < 3 || req._args.empty()) {
-        return reply_builder::build(msg_syntax_err);
+    size_t index = store ? 1 : 0;
+    if (req._args_count < index + 2 || req._args.empty()) {
+        return false;
     }
-    bytes& key = req._args[0];
-    long begin = 0, end = 0;
+    if (store) {
+        uargs.dest = std::move(req._args[0]);
+    }
+    long numkeys = 0;
     try {
-        begin = std::stoi(req._args[1].c_str());
-        end = std::stoi(req._args[2].c_str());
-    } catch (const std::invalid_argument&) {
+        numkeys = std::stol(req._args[index++].c_str());
+    } catch (const std::exception&) {
+        return false;
+    }
+    if (numkeys < 1 || index + numkeys > req._args_count) {
+        return false;
+    }
+    uargs.numkeys = static_cast<size_t>(numkeys);
+    for (size_t i = 0; i < uargs.numkeys; ++i) {
+        uargs.keys.emplace_back(std::move(req._args[index++]));
+    }
+    uargs.weights.assign(uargs.numkeys, 1);
+    uargs.aggregate_flag = ZAGGREGATE_SUM;
+    uargs.with_scores = false;
+    while (index < req._args_count) {
+        auto& option = req._args[index++];
+        std::transform(option.begin(), option.end(), option.begin(), ::toupper);
+        if (option == "WEIGHTS") {
+            if (index + uargs.numkeys > req._args_count) {
+                return false;
+            }
+            for (size_t i = 0; i < uargs.numkeys; ++i) {
+                auto& weight = req._args[index++];
+                if (!parse_float_string(weight.data(), weight.size(), uargs.weights[i])) {
+                    return false;
+                }
+            }
+        }
+        else if (option == "AGGREGATE") {
+            if (index == req._args_count) {
+                return false;
+            }
+            auto& aggregate = req._args[index++];
+            std::transform(aggregate.begin(), aggregate.end(), aggregate.begin(), ::toupper);
+            if (aggregate == "SUM") {
+                uargs.aggregate_flag = ZAGGREGATE_SUM;
+            }
+            else if (aggregate == "MIN") {
+                uargs.aggregate_flag = ZAGGREGATE_MIN;
+            }
+            else if (aggregate == "MAX") {
+                uargs.aggregate_flag = ZAGGREGATE_MAX;
+            }
+            else {
+                return false;
+            }
+        }
+        else if (option == "WITHSCORES" && !store) {
+            uargs.with_scores = true;
+        }
+        else {
+            return false;
+        }
+    }
+    return true;
+}
+
+// The sources are fetched in parallel, sorted by member on their owners.
+// ZUNIONSTORE ships them to the shard of the destination, which reads them
+// in place and builds the new set with a k-way merge; ZUNION merges here.
+future<scattered_message_ptr> redis_service::zunion_impl(request_wrapper& req, bool store)
+{
+    zset_args uargs;
+    if (parse_zset_args(req, uargs, store) == false) {
         return reply_builder::build(msg_syntax_err);
     }
-    bool with_score = false;
-    if (req._args_count == 4) {
-        auto ws = req._args[3];
-        std::transform(ws.begin(), ws.end(), ws.begin(), ::toupper);
-        if (ws == "WITHSCORES") {
-            with_score = true;
+    struct zunion_state {
+        zset_args args;
+        std::vector<foreign_ptr<lw_shared_ptr<zset_members>>> sources;
+        std::vector<const zset_members*> runs;
+    };
+    return do_with(zunion_state{std::move(uargs), {}, {}}, [this, store] (auto& state) {
+        state.sources.resize(state.args.numkeys);
+        return parallel_for_each(boost::irange<size_t>(0, state.args.numkeys), [this, &state] (size_t k) {
+            redis_key rk{std::ref(state.args.keys[k])};
+            auto cpu = this->get_cpu(rk);
+            return invoke_on_owner(cpu, &database::zmembers_direct, std::move(rk), state.args.weights[k]).then([&state, k] (auto&& members) {
+                state.sources[k] = std::move(members);
+            });
+        }).then([this, &state, store] {
+            for (auto& source : state.sources) {
+                if (!source) {
+                    return reply_builder::build(msg_type_err);
+                }
+                state.runs.push_back(&*source);
+            }
+            if (store) {
+                redis_key rk{std::ref(state.args.dest)};
+                auto cpu = this->get_cpu(rk);
+                return invoke_on_owner(cpu, &database::zunionstore, std::move(rk), std::cref(state.runs), state.args.aggregate_flag);
+            }
+            zset_members result;
+            merge_zset_runs(state.runs, state.args.aggregate_flag, [&result] (const bytes& member, double score) {
+                result.emplace_back(member, score);
+            });
+            sort_by_score(result);
+            return reply_builder::build(result, state.args.with_scores);
+        });
+    });
+}
+
+future<scattered_message_ptr> redis_service::zunionstore(request_wrapper& req)
+{
+    return zunion_impl(req, true);
+}
+
+future<scattered_message_ptr> redis_service::zunion(request_wrapper& req)
+{
+    return zunion_impl(req, false);
+}
+
+// Probes a batch of candidates against the sources, in turn, on their
+// owners. ZINTER keeps the candidates found in every source and folds their
+// scores, ZDIFF keeps the ones found in none.
+future<> redis_service::zprobe_batch(zset_members& candidates, zset_args& uargs, const std::vector<unsigned>& sources, bool diff)
+{
+    return do_for_each(sources.begin(), sources.end(), [this, &candidates, &uargs, diff] (unsigned k) {
+        if (candidates.empty()) {
+            return make_ready_future<>();
         }
+        redis_key rk{std::ref(uargs.keys[k])};
+        auto cpu = this->get_cpu(rk);
+        return invoke_on_owner(cpu, &database::zscore_batch, std::move(rk), std::cref(candidates), uargs.weights[k]).then([&candidates, &uargs, diff] (auto&& scores) {
+            size_t kept = 0;
+            for (size_t i = 0; i < candidates.size(); ++i) {
+                auto score = (*scores)[i];
+                if (std::isnan(score) != diff) {
+                    continue;
+                }
+                if (!diff) {
+                    candidates[i].second = aggregate_score(candidates[i].second, score, uargs.aggregate_flag);
+                }
+                if (kept != i) {
+                    candidates[kept] = std::move(candidates[i]);
+                }
+                ++kept;
+            }
+            candidates.resize(kept);
+        });
+    });
+}
+
+// Only one source is copied here: the smallest for ZINTER, the first for
+// ZDIFF. Its members are probed in batches against the other sources, in
+// ascending order of cardinality for ZINTER.
+future<scattered_message_ptr> redis_service::zinter_impl(request_wrapper& req, bool store, bool diff)
+{
+    zset_args uargs;
+    if (parse_zset_args(req, uargs, store) == false) {
+        return reply_builder::build(msg_syntax_err);
     }
-    redis_key rk { std::move(key) };
-    auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::zrange, std::move(rk), begin, end, reverse, with_score);
+    struct zinter_state {
+        zset_args args;
+        std::vector<long> sizes;
+        std::vector<unsigned> sources;
+        std::vector<zset_members> batches;
+        zset_members result;
+    };
+    auto count = uargs.numkeys;
+    return do_with(zinter_state{std::move(uargs), std::vector<long>(count), {}, {}, {}}, [this, store, diff, count] (auto& state) {
+        return parallel_for_each(boost::irange<unsigned>(0, count), [this, &state] (unsigned k) {
+            redis_key rk{std::ref(state.args.keys[k])};
+            auto cpu = this->get_cpu(rk);
+            return invoke_on_owner(cpu, &database::zcard_direct, std::move(rk)).then([&state, k] (long size) {
+                state.sizes[k] = size;
+            });
+        }).then([this, &state, store, diff, count] {
+            auto& sizes = state.sizes;
+            if (std::any_of(sizes.begin(), sizes.end(), [] (long size) { return size < 0; })) {
+                return reply_builder::build(msg_type_err);
+            }
+            auto& sources = state.sources;
+            sources.resize(count);
+            std::iota(sources.begin(), sources.end(), 0);
+            if (!diff) {
+                std::sort(sources.begin(), sources.end(), [&sizes] (unsigned l, unsigned r) { return sizes[l] < sizes[r]; });
+            }
+            auto first = sources[0];
+            sources.erase(sources.begin());
+            auto probed = make_ready_future<>();
+            if (sizes[first] > 0) {
+                redis_key rk{std::ref(state.args.keys[first])};
+                auto cpu = this->get_cpu(rk);
+                probed = invoke_on_owner(cpu, &database::zmembers_direct, std::move(rk), state.args.weights[first]).then([this, &state, diff] (auto&& members) {
+                    if (!members) {
+                        return make_ready_future<>();
+                    }
+                    auto& from = *members;
+                    for (size_t i = 0; i < from.size(); i += set_probe_batch_size) {
+                        auto end = std::min(from.size(), i + set_probe_batch_size);
+                        state.batches.emplace_back(std::make_move_iterator(from.begin() + i), std::make_move_iterator(from.begin() + end));
+                    }
+                    return parallel_for_each(state.batches.begin(), state.batches.end(), [this, &state, diff] (auto& batch) {
+                        return this->zprobe_batch(batch, state.args, state.sources, diff);
+                    });
+                });
+            }
+            return probed.then([this, &state, store] {
+                for (auto& batch : state.batches) {
+                    std::move(batch.begin(), batch.end(), std::back_inserter(state.result));
+                }
+                if (store) {
+                    redis_key rk{std::ref(state.args.dest)};
+                    auto cpu = this->get_cpu(rk);
+                    return invoke_on_owner(cpu, &database::zstore, std::move(rk), std::cref(state.result));
+                }
+                sort_by_score(state.result);
+                return reply_builder::build(state.result, state.args.with_scores);
+            });
+        });
+    });
 }
 
-future<scattered_message_ptr> redis_service::zrangebyscore(request_wrapper& req, bool reverse)
+future<scattered_message_ptr> redis_service::zinterstore(request_wrapper& req)
+{
+    return zinter_impl(req, true, false);
+}
+
+future<scattered_message_ptr> redis_service::zinter(request_wrapper& req)
+{
+    return zinter_impl(req, false, false);
+}
+
+future<scattered_message_ptr> redis_service::zremrangebyscore(request_wrapper& req)
 {
+    // ZREMRANGEBYSCORE key min max
+    // Removes all elements in the sorted set stored at key with a score between min and max (inclusive).
+    // Integer reply: the number of elements removed.
     if (req._args_count < 3 || req._args.empty()) {
         return reply_builder::build(msg_syntax_err);
     }
-    bytes& key = req._args[0];
-    redis_key rk { std::move(key) };
-    auto cpu = get_cpu(rk);
     double min = 0, max = 0;
-    try {
-        min = std::stod(req._args[1].c_str());
-        max = std::stod(req._args[2].c_str());
-    } catch (const std::invalid_argument&) {
+    if (!parse_float_string(req._args[1].data(), req._args[1].size(), min)
+        || !parse_float_string(req._args[2].data(), req._args[2].size(), max)) {
         return reply_builder::build(msg_syntax_err);
     }
-    bool with_score = false;
-    if (req._args_count == 4) {
-        auto ws = req._args[3];
-        std::transform(ws.begin(), ws.end(), ws.begin(), ::toupper);
-        if (ws == "WITHSCORES") {
-            with_score = true;
-        }
-    }
-    return get_database().invoke_on(cpu, &database::zrangebyscore, std::move(rk), min, max, reverse, with_score);
+    auto rk = take_key(req);
+    auto cpu = get_cpu(rk);
+    return invoke_on_owner(cpu, &database::zremrangebyscore, std::move(rk), min, max);
 }
 
-future<scattered_message_ptr> redis_service::zcount(request_wrapper& req)
+future<scattered_message_ptr> redis_service::zremrangebyrank(request_wrapper& req)
 {
-    if (req._args_count < 1 || req._args.empty()) {
+    // ZREMRANGEBYRANK key begin end
+    // Removes all elements in the sorted set stored at key with a rank between start and end (inclusive).
+    // Integer reply: the number of elements removed.
+    if (req._args_count < 3 || req._args.empty()) {
         return reply_builder::build(msg_syntax_err);
     }
-    bytes& key = req._args[0];
-    double min = 0, max = 0;
+    long begin = 0, end = 0;
     try {
-        min = std::stod(req._args[1].c_str());
-        max = std::stod(req._args[2].c_str());
-    } catch (const std::invalid_argument&) {
+        begin = std::stol(req._args[1].c_str());
+        end = std::stol(req._args[2].c_str());
+    } catch(const std::invalid_argument& e) {
         return reply_builder::build(msg_syntax_err);
     }
-    redis_key rk { std::move(key) };
+    auto rk = take_key(req);
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::zcount, std::move(rk), min, max);
+    return invoke_on_owner(cpu, &database::zremrangebyrank, std::move(rk), begin, end);
 }
 
-future<scattered_message_ptr> redis_service::zincrby(request_wrapper& req)
+future<scattered_message_ptr> redis_service::zdiffstore(request_wrapper& req)
+{
+    return zinter_impl(req, true, true);
+}
+
+future<scattered_message_ptr> redis_service::zdiff(request_wrapper& req)
 {
+    return zinter_impl(req, false, true);
+}
+
+future<scattered_message_ptr> redis_service::zrangebylex(request_wrapper& req, bool reverse)
+{
+    // ZRANGEBYLEX key min max [LIMIT offset count]
+    // ZREVRANGEBYLEX key max min [LIMIT offset count]
     if (req._args_count < 3 || req._args.empty()) {
         return reply_builder::build(msg_syntax_err);
     }
-    bytes& key = req._args[0];
-    bytes& member = req._args[2];
-    double delta = 0;
-    try {
-        delta = std::stod(req._args[1].c_str());
-    } catch (const std::invalid_argument&) {
+    lex_bound min, max;
+    if (!lex_bound::parse(req._args[reverse ? 2 : 1], min) || !lex_bound::parse(req._args[reverse ? 1 : 2], max)) {
         return reply_builder::build(msg_syntax_err);
     }
-    redis_key rk { std::move(key) };
+    long offset = 0, limit = -1;
+    if (req._args_count > 3) {
+        auto& l = req._args[3];
+        std::transform(l.begin(), l.end(), l.begin(), ::toupper);
+        if (req._args_count != 6 || l != "LIMIT") {
+            return reply_builder::build(msg_syntax_err);
+        }
+        try {
+            offset = std::stol(req._args[4].c_str());
+            limit = std::stol(req._args[5].c_str());
+        } catch (const std::invalid_argument&) {
+            return reply_builder::build(msg_syntax_err);
+        }
+    }
+    auto rk = take_key(req);
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::zincrby, std::move(rk), std::move(member), delta);
+    return invoke_on_owner(cpu, &database::zrangebylex, std::move(rk), std::move(min), std::move(max), offset, limit, reverse);
 }
 
-future<scattered_message_ptr> redis_service::zrank(request_wrapper& req, bool reverse)
+future<scattered_message_ptr> redis_service::zlexcount(request_wrapper& req)
 {
-    if (req._args_count < 2 || req._args.empty()) {
+    // ZLEXCOUNT key min max
+    if (req._args_count < 3 || req._args.empty()) {
         return reply_builder::build(msg_syntax_err);
     }
-    bytes& key = req._args[0];
-    bytes& member = req._args[1];
-    redis_key rk { std::move(key) };
+    lex_bound min, max;
+    if (!lex_bound::parse(req._args[1], min) || !lex_bound::parse(req._args[2], max)) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    auto rk = take_key(req);
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::zrank, std::move(rk), std::move(member), reverse);
+    return invoke_on_owner(cpu, &database::zlexcount, std::move(rk), std::move(min), std::move(max));
 }
 
-future<scattered_message_ptr> redis_service::zrem(request_wrapper& req)
+future<scattered_message_ptr> redis_service::zremrangebylex(request_wrapper& req)
 {
-    if (req._args_count < 2 || req._args.empty()) {
+    // ZREMRANGEBYLEX key min max
+    // Integer reply: the number of elements removed.
+    if (req._args_count < 3 || req._args.empty()) {
         return reply_builder::build(msg_syntax_err);
     }
-    bytes& key = req._args[0];
-    for (size_t i = 1; i < req._args_count; ++i) {
-        bytes& member = req._args[i];
-        req._tmp_keys.emplace_back(std::move(member));
+    lex_bound min, max;
+    if (!lex_bound::parse(req._args[1], min) || !lex_bound::parse(req._args[2], max)) {
+        return reply_builder::build(msg_syntax_err);
     }
-    redis_key rk { std::move(key) };
+    auto rk = take_key(req);
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::zrem, std::move(rk), std::move(req._tmp_keys));
+    return invoke_on_owner(cpu, &database::zremrangebylex, std::move(rk), std::move(min), std::move(max));
 }
 
-future<scattered_message_ptr> redis_service::zscore(request_wrapper& req)
+future<scattered_message_ptr> redis_service::zscan(request_wrapper& req)
 {
+    // ZSCAN key cursor [MATCH pattern] [COUNT count]
     if (req._args_count < 2 || req._args.empty()) {
         return reply_builder::build(msg_syntax_err);
     }
-    bytes& key = req._args[0];
-    bytes& member = req._args[1];
-    redis_key rk { std::move(key) };
+    size_t cursor = 0, count = 0;
+    bytes pattern;
+    if (auto err = parse_scan_arguments(req, 1, cursor, pattern, count)) {
+        return reply_builder::build(*err);
+    }
+    auto rk = take_key(req);
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::zscore, std::move(rk), std::move(member));
+    return invoke_on_owner(cpu, &database::zscan, std::move(rk), cursor, std::move(pattern), count);
 }
 
-bool redis_service::parse_zset_args(request_wrapper& req, zset_args& ureq)
+future<scattered_message_ptr> redis_service::select(request_wrapper& req)
 {
-    if (req._args_count < 3 || req._args.empty()) {
-        return false;
+    if (req._args_count < 1 || req._args.empty()) {
+        return reply_builder::build(msg_syntax_err);
     }
-    ureq.dest = std::move(req._args[0]);
+    size_t index = 0;
     try {
-        ureq.numkeys = std::stol(req._args[1].c_str());
-    } catch(const std::invalid_argument&) {
-        return false;
-    }
-    size_t index = static_cast<size_t>(ureq.numkeys) + 2;
-    if (req._args_count < index) {
-        return false;
+        index = std::stol(req._args[0].c_str());
+    } catch (const std::invalid_argument&) {
+        return reply_builder::build(msg_err);
     }
-    for (size_t i = 2; i < index; ++i) {
-        ureq.keys.emplace_back(std::move(req._args[i]));
+    // the shards hold one keyspace: the commit log, the snapshots and the
+    // store have no database number to tell others apart.
+    if (index != 0) {
+        return reply_builder::build(msg_db_index_err);
     }
-    bool has_weights = false, has_aggregate = false;
-    if (index < req._args_count) {
-        for (; index < req._args_count; ++index) {
-            bytes& syntax = req._args[index];
-            if (syntax == "WEIGHTS") {
-                index ++;
-                if (index + ureq.numkeys > req._args_count) {
-                    return false;
-                }
-                has_weights = true;
-                size_t i = index;
-                index += ureq.numkeys;
-                for (; i < index; ++i) {
-                    try {
-                        ureq.weights.push_back(std::stod(req._args[i].c_str()));
-                    } catch (const std::invalid_argument&) {
-                        return false;
-                    }
-                }
-            }
-            if (syntax == "AGGREGATE") {
-                if (index + 1 > req._args_count) {
-                    return false;
-                }
-                index++;
-                bytes& aggre = req._args[index];
-                if (aggre == "SUM") {
-                    ureq.aggregate_flag |= ZAGGREGATE_SUM;
-                }
-                else if (aggre == "MIN") {
-                    ureq.aggregate_flag |= ZAGGREGATE_MIN;
-                }
-                else if (aggre == "MAX") {
-                    ureq.aggregate_flag |= ZAGGREGATE_MAX;
-                }
-                else {
-                    return false;
+    return do_with(size_t {0}, [this, index] (auto& count) {
+        return parallel_for_each(boost::irange<unsigned>(0, smp::count), [this, index, &count] (unsigned cpu) {
+            return invoke_on_owner(cpu, &database::select, index).then([&count] (auto&& u) {
+                if (u) {
+                    count++;
                 }
-                has_aggregate = true;
-            }
-        }
-    }
-    if (has_weights == false) {
-        for (size_t i = 0; i < ureq.numkeys; ++i) {
-            ureq.weights.push_back(1);
-        }
-    }
-    if (has_aggregate == false) {
-        ureq.aggregate_flag = ZAGGREGATE_SUM;
-    }
-    return true;
+            });
+        }).then([&count] () {
+            return reply_builder::build((count == smp::count) ? msg_ok : msg_err);
+        });
+    });
 }
 
-future<scattered_message_ptr> redis_service::zunionstore(request_wrapper& req)
+// FLUSHDB and FLUSHALL [ASYNC|SYNC]: the keyspace is flushed by every
+// shard, then the copies of its keys other shards hold are dropped. ASYNC
+// returns once the keys are gone, their memory is released in the
+// background, see cache::flush_async().
+future<scattered_message_ptr> redis_service::flushall(request_wrapper& req, std::function<future<> ()> drop_copies)
 {
-    zset_args uargs;
-    if (parse_zset_args(req, uargs) == false) {
+    bool async = false;
+    if (req._args_count > 1) {
         return reply_builder::build(msg_syntax_err);
     }
-    struct zunion_store_state {
-        std::vector<std::pair<bytes, double>> wkeys;
-        bytes dest;
-        std::unordered_map<bytes, double> result;
-        int aggregate_flag;
-    };
-    std::vector<std::pair<bytes, double>> wkeys;
-    for (size_t i = 0; i < uargs.numkeys; ++i) {
-        wkeys.emplace_back(std::pair<bytes, double>(std::move(uargs.keys[i]), uargs.weights[i]));
-    }
-    return do_with(zunion_store_state{std::move(wkeys), std::move(uargs.dest), {}, uargs.aggregate_flag}, [this] (auto& state) {
-        return parallel_for_each(std::begin(state.wkeys), std::end(state.wkeys), [this, &state] (auto& entry) {
-            redis_key rk{std::ref(entry.first)};
-            auto cpu = rk.get_cpu();
-            return get_database().invoke_on(cpu, &database::zrange_direct, std::move(rk), 0, -1).then([this, weight = entry.second, &state] (auto&& m) {
-                auto& range_result = *m;
-                auto& result = state.result;
-                for (size_t i = 0; i < range_result.size(); ++i) {
-                    auto& key = range_result[i].first;
-                    auto& score = range_result[i].second;
-                    if (result.find(key) != result.end()) {
-                       result[key] = redis_service::score_aggregation(result[key], score * weight, state.aggregate_flag);
-                    }
-                    else {
-                        result[key] = score;
-                    }
-                }
-            });
-        }).then([this, &state] () {
-            redis_key rk{std::ref(state.dest)};
-            auto cpu = rk.get_cpu();
-            return get_database().invoke_on(cpu, &database::zadds, std::move(rk), std::move(state.result), ZADD_CH);
+    if (req._args_count == 1) {
+        if (strcasecmp(req._args[0].c_str(), "async") == 0) {
+            async = true;
+        }
+        else if (strcasecmp(req._args[0].c_str(), "sync") != 0) {
+            return reply_builder::build(msg_syntax_err);
+        }
+    }
+    return get_database().map_reduce0([async] (database& db) {
+        return db.flushall(async);
+    }, true, std::logical_and<bool>()).then([drop_copies = std::move(drop_copies)] (bool flushed) {
+        if (!flushed) {
+            return reply_builder::build(msg_flush_tiered_err);
+        }
+        return drop_copies().then([] {
+            return reply_builder::build(msg_ok);
         });
     });
 }
 
-future<scattered_message_ptr> redis_service::zinterstore(request_wrapper& req)
+// DEBUG POPULATE count [prefix] [size] [TYPE type] [ELEMENTS n] [TTL min max]
+//
+// Every shard creates the keys it owns of <prefix>:0 to <prefix>:<count - 1>,
+// skipping those which exist, all shards at once. A type other than string
+// gets `ELEMENTS` elements of `size` bytes per key, TTL gives each key a
+// uniform number of seconds to live in [min, max].
+future<scattered_message_ptr> redis_service::debug(request_wrapper& req)
 {
+    if (req._args_count < 2 || strcasecmp(req._args[0].c_str(), "populate") != 0) {
         return reply_builder::build(msg_syntax_err);
-/*
-    zset_args uargs;
-    if (parse_zset_args(req, uargs) == false) {
+    }
+    populate_options options;
+    size_t count = 0;
+    if (!parse_count(req._args[1], count)) {
         return reply_builder::build(msg_syntax_err);
     }
-    struct zinter_store_state {
-        std::vector<std::pair<bytes, double>> wkeys;
-        bytes dest;
-        std::unordered_map<bytes, double> result;
-        int aggregate_flag;
+    options._count = count;
+    auto is = [&req] (size_t i, const char* name) {
+        return strcasecmp(req._args[i].c_str(), name) == 0;
     };
-    std::vector<std::pair<bytes, double>> wkeys;
-    for (size_t i = 0; i < uargs.numkeys; ++i) {
-        wkeys.emplace_back(std::pair<bytes, double>(std::move(uargs.keys[i]), uargs.weights[i]));
+    auto is_option = [&is] (size_t i) {
+        return is(i, "type") || is(i, "elements") || is(i, "ttl");
+    };
+    size_t i = 2;
+    if (i < req._args_count && !is_option(i)) {
+        options._prefix = sstring(req._args[i].data(), req._args[i].size());
+        ++i;
+        if (i < req._args_count && !is_option(i)) {
+            if (!parse_count(req._args[i], options._size)) {
+                return reply_builder::build(msg_syntax_err);
+            }
+            ++i;
+        }
     }
-    return do_with(zinter_store_state{std::move(wkeys), std::move(uargs.dest), {}, uargs.aggregate_flag}, [this] (auto& state) {
-        redis_key rk{std::ref(state.wkeys[0].first)};
-        return get_database().invoke_on(rk.get_cpu(), &database::zrange_direct, std::move(rk), 0, -1).then([this, &state, weight = state.wkeys[0].second] (auto&& m) {
-            auto& range_result = *m;
-            auto& result = state.result;
-            for (size_t i = 0; i < range_result.size(); ++i) {
-                result[range_result[i].first] = range_result[i].second * weight;
+    for (; i < req._args_count; ++i) {
+        size_t n = 0, m = 0;
+        if (is(i, "type") && i + 1 < req._args_count) {
+            ++i;
+            if (is(i, "string")) {
+                options._type = data_type::bytes;
+            }
+            else if (is(i, "list")) {
+                options._type = data_type::list;
             }
-            return make_ready_future<bool>(!result.empty() && state.wkeys.size() > 1);
-        }).then([this, &state] (bool continue_next) {
-            if (!continue_next) {
-                return make_ready_future<scattered_message_ptr>();
+            else if (is(i, "set")) {
+                options._type = data_type::set;
+            }
+            else if (is(i, "hash")) {
+                options._type = data_type::dict;
+            }
+            else if (is(i, "zset")) {
+                options._type = data_type::sset;
             }
             else {
-                return parallel_for_each(boost::irange<size_t>(1, state.wkeys.size()), [this, &state] (size_t k) {
-                    auto& entry = state.wkeys[k];
-                    redis_key rk{std::ref(entry.first)};
-                    auto cpu = rk.get_cpu();
-                    return get_database().invoke_on(cpu, &database::zrange_direct, std::move(rk), 0, -1).then([this, &state, weight = entry.second] (auto&& m) {
-                        auto& range_result = *m;
-                        auto& result = state.result;
-                        std::unordered_map<bytes, double> new_result;
-                        for (size_t i = 0; i < range_result.size(); ++i) {
-                            auto& key = range_result[i].first;
-                            auto& score = range_result[i].second;
-                            auto it = result.find(key);
-                            if (it != result.end()) {
-                                auto& old_score = it->second;
-                                new_result[key] = redis_service::score_aggregation(old_score, score * weight, state.aggregate_flag);
-                            }
-                        }
-                        state.result = std::move(new_result);
-                    });
-                }).then([this] () {
-                    return make_ready_future<scattered_message_ptr>();
-                });
+                return reply_builder::build(msg_syntax_err);
             }
-        }).then([this, &state] {
-            redis_key rk{std::ref(state.dest)};
-            auto cpu = rk.get_cpu();
-            return get_database().invoke_on(cpu, &database::zadds, std::move(rk), std::ref(state.result), ZADD_CH);
-        });
+        }
+        else if (is(i, "elements") && i + 1 < req._args_count && parse_count(req._args[i + 1], n) && n > 0) {
+            options._elements = n;
+            ++i;
+        }
+        else if (is(i, "ttl") && i + 2 < req._args_count && parse_count(req._args[i + 1], n) && parse_count(req._args[i + 2], m) && n <= m) {
+            options._ttl_min = n;
+            options._ttl_max = m;
+            i += 2;
+        }
+        else {
+            return reply_builder::build(msg_syntax_err);
+        }
+    }
+    return get_database().map_reduce0([options] (database& db) {
+        return db.populate(options);
+    }, uint64_t(0), std::plus<uint64_t>()).then([] (uint64_t) {
+        return reply_builder::build(msg_ok);
     });
-*/
 }
 
-future<scattered_message_ptr> redis_service::zremrangebyscore(request_wrapper& req)
+future<scattered_message_ptr> redis_service::geoadd(request_wrapper& req)
 {
-    // ZREMRANGEBYSCORE key min max
-    // Removes all elements in the sorted set stored at key with a score between min and max (inclusive).
-    // Integer reply: the number of elements removed.
-    if (req._args_count < 3 || req._args.empty()) {
+    if (req._args_count < 4 || (req._args_count - 1) % 3 != 0 || req._args.empty()) {
         return reply_builder::build(msg_syntax_err);
     }
-    bytes& key = req._args[0];
-    double min = 0, max = 0;
-    try {
-        min = std::stod(req._args[1].c_str());
-        max = std::stod(req._args[2].c_str());
-    } catch (const std::invalid_argument&) {
-        return reply_builder::build(msg_syntax_err);
+    for (size_t i = 1; i < req._args_count; i += 3) {
+        bytes& longitude = req._args[i];
+        bytes& latitude = req._args[i + 1];
+        bytes& member = req._args[i + 2];
+        double longitude_ = 0, latitude_ = 0, score = 0;
+        if (!parse_float_string(longitude.data(), longitude.size(), longitude_)
+            || !parse_float_string(latitude.data(), latitude.size(), latitude_)) {
+            return reply_builder::build(msg_syntax_err);
+        }
+        if (geo::encode_to_geohash(longitude_, latitude_, score) == false) {
+            return reply_builder::build(msg_err);
+        }
+        req.tmp()._key_scores.emplace_back(std::move(member), score);
     }
-    redis_key rk { std::move(key) };
+    auto rk = take_key(req);
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::zremrangebyscore, std::move(rk), min, max);
+    return invoke_on_owner(cpu, &database::zadds, std::move(rk), std::move(req.tmp()._key_scores), ZADD_CH);
 }
 
-future<scattered_message_ptr> redis_service::zremrangebyrank(request_wrapper& req)
+future<scattered_message_ptr> redis_service::geodist(request_wrapper& req)
 {
-    // ZREMRANGEBYRANK key begin end
-    // Removes all elements in the sorted set stored at key with a rank between start and end (inclusive).
-    // Integer reply: the number of elements removed.
     if (req._args_count < 3 || req._args.empty()) {
         return reply_builder::build(msg_syntax_err);
     }
     bytes& key = req._args[0];
-    long begin = 0, end = 0;
-    try {
-        begin = std::stol(req._args[1].c_str());
-        end = std::stol(req._args[2].c_str());
-    } catch(const std::invalid_argument& e) {
-        return reply_builder::build(msg_syntax_err);
+    bytes& lpos = req._args[1];
+    bytes& rpos = req._args[2];
+    int geodist_flag = GEODIST_UNIT_M;
+    if (req._args_count == 4) {
+        bytes& unit = req._args[3];
+        if (unit == "km") {
+            geodist_flag = GEODIST_UNIT_KM;
+        }
+        else if (unit == "mi") {
+            geodist_flag = GEODIST_UNIT_MI;
+        }
+        else if (unit == "ft") {
+            geodist_flag = GEODIST_UNIT_FT;
+        }
+        else {
+            return reply_builder::build(msg_syntax_err);
+        }
     }
-    redis_key rk { std::move(key) };
+    redis_key rk { std::ref(key), req.key_hash() };
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::zremrangebyrank, std::move(rk), begin, end);
-}
-
-future<scattered_message_ptr> redis_service::zdiffstore(request_wrapper&)
-{
-    return reply_builder::build(msg_syntax_err);
+    return invoke_on_owner(cpu, &database::geodist, std::move(rk), std::move(lpos), std::move(rpos), geodist_flag);
 }
 
-future<scattered_message_ptr> redis_service::zunion(request_wrapper& req)
-{
-    return reply_builder::build(msg_syntax_err);
-}
-
-future<scattered_message_ptr> redis_service::zinter(request_wrapper& req)
+future<scattered_message_ptr> redis_service::geohash(request_wrapper& req)
 {
-    return reply_builder::build(msg_syntax_err);
+    if (req._args_count < 2 || req._args.empty()) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    bytes& key = req._args[0];
+    for (size_t i = 1; i < req._args_count; ++i) {
+        req.tmp()._keys.emplace_back(std::move(req._args[i]));
+    }
+    redis_key rk { std::ref(key), req.key_hash() };
+    auto cpu = get_cpu(rk);
+    return invoke_on_owner(cpu, &database::geohash, std::move(rk), std::move(req.tmp()._keys));
 }
 
-future<scattered_message_ptr> redis_service::zdiff(request_wrapper& req)
+future<scattered_message_ptr> redis_service::geopos(request_wrapper& req)
 {
-    return reply_builder::build(msg_syntax_err);
+    if (req._args_count < 2 || req._args.empty()) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    bytes& key = req._args[0];
+    std::vector<bytes> members;
+    members.reserve(req._args_count - 1);
+    for (size_t i = 1; i < req._args_count; ++i) {
+        members.emplace_back(std::move(req._args[i]));
+    }
+    redis_key rk { std::ref(key), req.key_hash() };
+    auto cpu = get_cpu(rk);
+    return invoke_on_owner(cpu, &database::geopos, std::move(rk), std::move(members));
 }
 
-future<scattered_message_ptr> redis_service::zrangebylex(request_wrapper& req)
+static bool parse_geo_double(const bytes& arg, double& value)
 {
-    return reply_builder::build(msg_syntax_err);
+    return parse_float_string(arg.data(), arg.size(), value) && std::isfinite(value);
 }
 
-future<scattered_message_ptr> redis_service::zlexcount(request_wrapper& req)
+static bool parse_geo_unit(bytes& unit, int& flags)
 {
-    return reply_builder::build(msg_syntax_err);
+    std::transform(unit.begin(), unit.end(), unit.begin(), ::tolower);
+    if (unit == "m") {
+        flags |= GEO_UNIT_M;
+    }
+    else if (unit == "km") {
+        flags |= GEO_UNIT_KM;
+    }
+    else if (unit == "mi") {
+        flags |= GEO_UNIT_MI;
+    }
+    else if (unit == "ft") {
+        flags |= GEO_UNIT_FT;
+    }
+    else {
+        return false;
+    }
+    return true;
 }
 
-future<scattered_message_ptr> redis_service::select(request_wrapper& req)
+bool redis_service::parse_geo_args(request_wrapper& req, geo_args& uargs, bool search, bool store, bool member, const bytes*& err)
 {
-    if (req._args_count < 1 || req._args.empty()) {
-        return reply_builder::build(msg_syntax_err);
+    err = &msg_syntax_err;
+    uargs.from_member = false;
+    uargs.count = 0;
+    uargs.flags = 0;
+    bool has_center = false, has_shape = false, has_count = false;
+    auto& shape = uargs.shape;
+    auto parse_center = [&req, &shape, &err] (size_t i) {
+        if (!parse_geo_double(req._args[i], shape._longitude) || !parse_geo_double(req._args[i + 1], shape._latitude)) {
+            return false;
+        }
+        double score = 0;
+        if (geo::encode_to_geohash(shape._longitude, shape._latitude, score) == false) {
+            err = &msg_geo_coord_err;
+            return false;
+        }
+        return true;
+    };
+    auto parse_unit = [&req, &uargs, &err] (size_t i) {
+        if (!parse_geo_unit(req._args[i], uargs.flags)) {
+            err = &msg_geo_unit_err;
+            return false;
+        }
+        return true;
+    };
+    size_t i = 0;
+    if (!search) {
+        // GEORADIUS key longitude latitude radius unit, GEORADIUSBYMEMBER key member radius unit
+        size_t index = member ? 2 : 3;
+        if (req._args_count < index + 2 || req._args.empty()) {
+            return false;
+        }
+        uargs.key = std::move(req._args[0]);
+        if (member) {
+            uargs.member = std::move(req._args[1]);
+            uargs.from_member = true;
+        }
+        else if (!parse_center(1)) {
+            return false;
+        }
+        if (!parse_geo_double(req._args[index], shape._radius) || shape._radius < 0 || !parse_unit(index + 1)) {
+            return false;
+        }
+        has_center = has_shape = true;
+        i = index + 2;
     }
-    size_t index = 0;
-    try {
-        index = std::stol(req._args[0].c_str());
-    } catch (const std::invalid_argument&) {
-        return reply_builder::build(msg_err);
+    else {
+        // GEOSEARCH key ..., GEOSEARCHSTORE dest key ...
+        size_t index = store ? 1 : 0;
+        if (req._args_count < index + 1 || req._args.empty()) {
+            return false;
+        }
+        if (store) {
+            uargs.dest = std::move(req._args[0]);
+            uargs.flags |= GEORADIUS_STORE_SCORE;
+        }
+        uargs.key = std::move(req._args[index]);
+        i = index + 1;
+    }
+    while (i < req._args_count) {
+        auto& option = req._args[i++];
+        std::transform(option.begin(), option.end(), option.begin(), ::toupper);
+        auto remaining = req._args_count - i;
+        if (option == "WITHCOORD" && !store) {
+            uargs.flags |= GEORADIUS_WITHCOORD;
+        }
+        else if (option == "WITHDIST" && !store) {
+            uargs.flags |= GEORADIUS_WITHDIST;
+        }
+        else if (option == "WITHHASH" && !store) {
+            uargs.flags |= GEORADIUS_WITHHASH;
+        }
+        else if (option == "ASC") {
+            uargs.flags = (uargs.flags & ~GEORADIUS_DESC) | GEORADIUS_ASC;
+        }
+        else if (option == "DESC") {
+            uargs.flags = (uargs.flags & ~GEORADIUS_ASC) | GEORADIUS_DESC;
+        }
+        else if (option == "COUNT" && remaining >= 1) {
+            long count = 0;
+            try {
+                count = std::stol(req._args[i++].c_str());
+            } catch (const std::exception&) {
+                return false;
+            }
+            if (count <= 0) {
+                err = &msg_geo_count_err;
+                return false;
+            }
+            uargs.count = static_cast<size_t>(count);
+            has_count = true;
+            if (i < req._args_count) {
+                auto& any = req._args[i];
+                std::transform(any.begin(), any.end(), any.begin(), ::toupper);
+                if (any == "ANY") {
+                    uargs.flags |= GEORADIUS_ANY;
+                    ++i;
+                }
+            }
+        }
+        else if ((option == "STORE" || option == "STOREDIST") && !search && remaining >= 1) {
+            uargs.flags &= ~(GEORADIUS_STORE_SCORE | GEORADIUS_STORE_DIST);
+            uargs.flags |= option == "STORE" ? GEORADIUS_STORE_SCORE : GEORADIUS_STORE_DIST;
+            uargs.dest = std::move(req._args[i++]);
+        }
+        else if (option == "STOREDIST" && store) {
+            uargs.flags = (uargs.flags & ~GEORADIUS_STORE_SCORE) | GEORADIUS_STORE_DIST;
+        }
+        else if (option == "FROMMEMBER" && search && !has_center && remaining >= 1) {
+            uargs.member = std::move(req._args[i++]);
+            uargs.from_member = true;
+            has_center = true;
+        }
+        else if (option == "FROMLONLAT" && search && !has_center && remaining >= 2) {
+            if (!parse_center(i)) {
+                return false;
+            }
+            i += 2;
+            has_center = true;
+        }
+        else if (option == "BYRADIUS" && search && !has_shape && remaining >= 2) {
+            if (!parse_geo_double(req._args[i], shape._radius) || shape._radius < 0 || !parse_unit(i + 1)) {
+                return false;
+            }
+            i += 2;
+            has_shape = true;
+        }
+        else if (option == "BYBOX" && search && !has_shape && remaining >= 3) {
+            if (!parse_geo_double(req._args[i], shape._width) || !parse_geo_double(req._args[i + 1], shape._height)
+                || shape._width < 0 || shape._height < 0 || !parse_unit(i + 2)) {
+                return false;
+            }
+            shape._box = true;
+            i += 3;
+            has_shape = true;
+        }
+        else {
+            return false;
+        }
     }
-    if (index >= smp::count) {
-        return reply_builder::build(msg_syntax_err);
+    if (!has_center || !has_shape || ((uargs.flags & GEORADIUS_ANY) && !has_count)) {
+        return false;
     }
-    return do_with(size_t {0}, [this, index] (auto& count) {
-        return parallel_for_each(boost::irange<unsigned>(0, smp::count), [this, index, &count] (unsigned cpu) {
-            return get_database().invoke_on(cpu, &database::select, index).then([&count] (auto&& u) {
-                if (u) {
-                    count++;
-                }
+    // like Redis, the points of STORE do not carry the WITH options.
+    if ((uargs.flags & (GEORADIUS_STORE_SCORE | GEORADIUS_STORE_DIST))
+        && (uargs.flags & (GEORADIUS_WITHCOORD | GEORADIUS_WITHDIST | GEORADIUS_WITHHASH))) {
+        return false;
+    }
+    // COUNT without ANY returns the nearest points.
+    if (has_count && !(uargs.flags & (GEORADIUS_ANY | GEORADIUS_ASC | GEORADIUS_DESC))) {
+        uargs.flags |= GEORADIUS_ASC;
+    }
+    geo::to_meters(shape._radius, uargs.flags);
+    geo::to_meters(shape._width, uargs.flags);
+    geo::to_meters(shape._height, uargs.flags);
+    return true;
+}
+
+// The search runs on the shard of the key, which returns the points in
+// their final order; STORE and GEOSEARCHSTORE then replace the destination,
+// on that shard already when the destination is there too.
+future<scattered_message_ptr> redis_service::geosearch_impl(request_wrapper& req, bool search, bool store, bool member)
+{
+    geo_args uargs;
+    const bytes* err = nullptr;
+    if (parse_geo_args(req, uargs, search, store, member, err) == false) {
+        return reply_builder::build(*err);
+    }
+    return do_with(std::move(uargs), [this] (auto& uargs) {
+        redis_key rk {std::ref(uargs.key)};
+        auto cpu = this->get_cpu(rk);
+        if (uargs.flags & (GEORADIUS_STORE_SCORE | GEORADIUS_STORE_DIST)) {
+            // both keys on one shard, the points are stored there.
+            redis_key dest {std::ref(uargs.dest)};
+            if (this->get_cpu(dest) == cpu) {
+                return invoke_on_owner(cpu, &database::geosearch_store, std::move(dest), std::move(rk), uargs.member, uargs.from_member, uargs.shape, uargs.count, uargs.flags);
+            }
+        }
+        auto points_ready = uargs.from_member ? invoke_on_owner(cpu, &database::georadius_member_direct, std::move(rk), uargs.member, uargs.shape, uargs.count, uargs.flags)
+                                              : invoke_on_owner(cpu, &database::georadius_coord_direct, std::move(rk), uargs.shape, uargs.count, uargs.flags);
+        return points_ready.then([this, &uargs] (auto&& data) {
+            auto& points = data->first;
+            if (data->second == REDIS_WRONG_TYPE) {
+                return reply_builder::build(msg_type_err);
+            }
+            else if (data->second == REDIS_ERR) {
+                return reply_builder::build(msg_geo_member_err);
+            }
+            if (!(uargs.flags & (GEORADIUS_STORE_SCORE | GEORADIUS_STORE_DIST))) {
+                return reply_builder::build(points, uargs.flags);
+            }
+            auto members = database::geo_store_members(*data, uargs.flags);
+            return do_with(std::move(members), [this, &uargs] (auto& members) {
+                redis_key rk {std::ref(uargs.dest)};
+                auto cpu = this->get_cpu(rk);
+                return invoke_on_owner(cpu, &database::zstore, std::move(rk), std::cref(members));
             });
-        }).then([&count] () {
-            return reply_builder::build((count == smp::count) ? msg_ok : msg_err);
         });
     });
 }
 
+future<scattered_message_ptr> redis_service::georadius(request_wrapper& req, bool member)
+{
+    return geosearch_impl(req, false, false, member);
+}
 
-future<scattered_message_ptr> redis_service::geoadd(request_wrapper& req)
+future<scattered_message_ptr> redis_service::geosearch(request_wrapper& req)
 {
-    if (req._args_count < 4 || (req._args_count - 1) % 3 != 0 || req._args.empty()) {
-        return reply_builder::build(msg_syntax_err);
-    }
-    bytes& key = req._args[0];
-    for (size_t i = 1; i < req._args_count; i += 3) {
-        bytes& longitude = req._args[i];
-        bytes& latitude = req._args[i + 1];
-        bytes& member = req._args[i + 2];
-        double longitude_ = 0, latitude_ = 0, score = 0;
-        try {
-            longitude_ = std::stod(longitude.c_str());
-            latitude_ = std::stod(latitude.c_str());
-        } catch (const std::invalid_argument&) {
-            return reply_builder::build(msg_syntax_err);
-        }
-        if (geo::encode_to_geohash(longitude_, latitude_, score) == false) {
-            return reply_builder::build(msg_err);
-        }
-        req._tmp_key_scores.emplace(std::pair<bytes, double>(member, score));
-    }
-    redis_key rk { std::move(key) };
-    auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::zadds, std::move(rk), std::move(req._tmp_key_scores), ZADD_CH);
+    return geosearch_impl(req, true, false, false);
 }
 
-future<scattered_message_ptr> redis_service::geodist(request_wrapper& req)
+future<scattered_message_ptr> redis_service::geosearchstore(request_wrapper& req)
 {
-    if (req._args_count < 3 || req._args.empty()) {
-        return reply_builder::build(msg_syntax_err);
+    return geosearch_impl(req, true, true, false);
+}
+
+// Bit offsets of SETBIT, GETBIT and BITFIELD, at most BITMAP_MAX_OFFSET.
+static bool parse_bit_offset(const char* arg, size_t& offset)
+{
+    long value = 0;
+    try {
+        value = std::stol(arg);
+    } catch (const std::exception&) {
+        return false;
     }
-    bytes& key = req._args[0];
-    bytes& lpos = req._args[1];
-    bytes& rpos = req._args[2];
-    int geodist_flag = GEODIST_UNIT_M;
-    if (req._args_count == 4) {
-        bytes& unit = req._args[3];
-        if (unit == "km") {
-            geodist_flag = GEODIST_UNIT_KM;
-        }
-        else if (unit == "mi") {
-            geodist_flag = GEODIST_UNIT_MI;
-        }
-        else if (unit == "ft") {
-            geodist_flag = GEODIST_UNIT_FT;
-        }
-        else {
-            return reply_builder::build(msg_syntax_err);
-        }
+    if (value < 0 || static_cast<size_t>(value) > BITMAP_MAX_OFFSET) {
+        return false;
     }
-    redis_key rk {std::ref(key)};
-    auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::geodist, std::move(rk), std::move(lpos), std::move(rpos), geodist_flag);
+    offset = static_cast<size_t>(value);
+    return true;
 }
 
-future<scattered_message_ptr> redis_service::geohash(request_wrapper& req)
+future<scattered_message_ptr> redis_service::setbit(request_wrapper& req)
 {
-    if (req._args_count < 2 || req._args.empty()) {
+    if (req._args_count < 3 || req._args.empty()) {
         return reply_builder::build(msg_syntax_err);
     }
     bytes& key = req._args[0];
-    for (size_t i = 1; i < req._args_count; ++i) {
-        req._tmp_keys.emplace_back(std::move(req._args[i]));
+    size_t offset = 0;
+    if (!parse_bit_offset(req._args[1].c_str(), offset)) {
+        return reply_builder::build(msg_bit_offset_err);
     }
-    redis_key rk {std::ref(key)};
+    auto& value = req._args[2];
+    if (value.size() != 1 || (value[0] != '0' && value[0] != '1')) {
+        return reply_builder::build(msg_bit_err);
+    }
+    redis_key rk { std::ref(key), req.key_hash() };
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::geohash, std::move(rk), std::move(req._tmp_keys));
+    return invoke_on_owner(cpu, &database::setbit, std::move(rk), offset, value[0] == '1');
 }
 
-future<scattered_message_ptr> redis_service::geopos(request_wrapper& req)
+future<scattered_message_ptr> redis_service::getbit(request_wrapper& req)
 {
     if (req._args_count < 2 || req._args.empty()) {
         return reply_builder::build(msg_syntax_err);
     }
     bytes& key = req._args[0];
-    std::vector<bytes> members;
-    for (size_t i = 1; i < req._args_count; ++i) {
-        req._tmp_keys.emplace_back(std::move(req._args[i]));
+    size_t offset = 0;
+    if (!parse_bit_offset(req._args[1].c_str(), offset)) {
+        return reply_builder::build(msg_bit_offset_err);
     }
-    redis_key rk {std::ref(key)};
+    redis_key rk { std::ref(key), req.key_hash() };
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::geopos, std::move(rk), std::move(members));
+    return invoke_on_owner(cpu, &database::getbit, std::move(rk), offset);
 }
 
-future<scattered_message_ptr> redis_service::georadius(request_wrapper& req, bool member)
+future<scattered_message_ptr> redis_service::bitcount(request_wrapper& req)
 {
-    return make_ready_future<scattered_message_ptr>();
-    /*
-    size_t option_index = member ? 4 : 5;
-    if (req._args_count < option_index || req._args.empty()) {
+    if ((req._args_count != 1 && req._args_count != 3) || req._args.empty()) {
         return reply_builder::build(msg_syntax_err);
     }
     bytes& key = req._args[0];
-    bytes unit{}, member_key{};
-    double log = 0, lat = 0, radius = 0;
-    if (!member) {
-        bytes& longitude = req._args[1];
-        bytes& latitude = req._args[2];
-        bytes& rad = req._args[3];
-        unit = std::move(req._args[4]);
-        try {
-            log = std::stod(longitude.c_str());
-            lat = std::stod(latitude.c_str());
-            radius = std::stod(rad.c_str());
-        } catch (const std::invalid_argument&) {
-            return reply_builder::build(msg_syntax_err);
-        }
-    }
-    else {
-        member_key = std::move(req._args[1]);
-        bytes& rad = req._args[2];
-        unit = std::move(req._args[3]);
+    long start = 0, end = -1;
+    if (req._args_count == 3) {
         try {
-            radius = std::stod(rad.c_str());
+            start = std::stol(req._args[1]);
+            end = std::stol(req._args[2]);
         } catch (const std::invalid_argument&) {
             return reply_builder::build(msg_syntax_err);
         }
     }
+    redis_key rk { std::ref(key), req.key_hash() };
+    auto cpu = get_cpu(rk);
+    return invoke_on_owner(cpu, &database::bitcount, std::move(rk), start, end);
+}
 
-    int flags = 0;
-    size_t count = 0, stored_key_index = 0;
-    if (req._args_count > option_index) {
-        for (size_t i = option_index; i < req._args_count; ++i) {
-            bytes& cc = req._args[i];
-            std::transform(cc.begin(), cc.end(), cc.begin(), ::toupper);
-            if (cc == "WITHCOORD") {
-                flags |= GEORADIUS_WITHCOORD;
-            }
-            else if (cc == "WITHDIST") {
-                flags |= GEORADIUS_WITHDIST;
-            }
-            else if (cc == "WITHHASH") {
-                flags |= GEORADIUS_WITHHASH;
-            }
-            else if (cc == "COUNT") {
-                flags |= GEORADIUS_COUNT;
-                if (i + 1 == req._args_count) {
-                    return reply_builder::build(msg_syntax_err);
-                }
-                bytes& c = req._args[++i];
-                try {
-                    count = std::stol(c.c_str());
-                } catch (const std::invalid_argument&) {
-                    return reply_builder::build(msg_syntax_err);
-                }
-            }
-            else if (cc == "ASC") {
-                flags |= GEORADIUS_ASC;
-            }
-            else if (cc == "DESC") {
-                flags |= GEORADIUS_DESC;
-            }
-            else if (cc == "STORE") {
-                flags |= GEORADIUS_STORE_SCORE;
-                if (i + 1 == req._args_count) {
-                    return reply_builder::build(msg_syntax_err);
-                }
-                ++i;
-                stored_key_index = i;
-            }
-            else if (cc == "STOREDIST") {
-                flags |= GEORADIUS_STORE_DIST;
-                if (i + 1 == req._args_count) {
-                    return reply_builder::build(msg_syntax_err);
-                }
-                ++i;
-                stored_key_index = i;
-            }
-            else {
-                return reply_builder::build(msg_syntax_err);
-            }
-        }
-    }
-    if (((flags & GEORADIUS_STORE_SCORE) || (flags & GEORADIUS_STORE_DIST)) && (stored_key_index == 0 || stored_key_index >= req._args_count)) {
+future<scattered_message_ptr> redis_service::bitop(request_wrapper& req)
+{
+    if (req._args_count < 3 || req._args.empty()) {
         return reply_builder::build(msg_syntax_err);
     }
-    std::transform(unit.begin(), unit.end(), unit.begin(), ::tolower);
-    if (unit == "m") {
-        flags |= GEO_UNIT_M;
+    auto& name = req._args[0];
+    std::transform(name.begin(), name.end(), name.begin(), ::toupper);
+    int op = 0;
+    if (name == "AND") {
+        op = BITOP_AND;
     }
-    else if (unit == "km") {
-        flags |= GEO_UNIT_KM;
+    else if (name == "OR") {
+        op = BITOP_OR;
     }
-    else if (unit == "mi") {
-        flags |= GEO_UNIT_MI;
+    else if (name == "XOR") {
+        op = BITOP_XOR;
     }
-    else if (unit == "ft") {
-        flags |= GEO_UNIT_FT;
+    else if (name == "NOT") {
+        op = BITOP_NOT;
     }
     else {
         return reply_builder::build(msg_syntax_err);
     }
-    geo::to_meters(radius, flags);
-
-    redis_key rk {std::ref(key)};
-    auto cpu = get_cpu(rk);
-    auto points_ready = !member ? get_database().invoke_on(cpu, &database::georadius_coord_direct, std::move(rk), log, lat, radius, count, flags)
-                                : get_database().invoke_on(cpu, &database::georadius_member_direct, std::move(rk), std::move(member_key), radius, count, flags);
-    return  points_ready.then([this, flags, &req, stored_key_index] (auto&& data) {
-        using data_type = std::vector<std::tuple<bytes, double, double, double, double>>;
-        using return_type = std::pair<std::vector<std::tuple<bytes, double, double, double, double>>, int>;
-        return_type& return_data = *data;
-        data_type& data_ = return_data.first;
-        if (return_data.second == REDIS_WRONG_TYPE) {
-            return reply_builder::build(msg_type_err);
-        }
-        else if (return_data.second == REDIS_ERR) {
-            return reply_builder::build(msg_nil);
-        }
-        bool store_with_score = flags & GEORADIUS_STORE_SCORE, store_with_dist = flags & GEORADIUS_STORE_DIST;
-        if (store_with_score || store_with_dist) {
-            std::unordered_map<bytes, double> members;
-            for (size_t i = 0; i < data_.size(); ++i) {
-                auto& data_tuple = data_[i];
-                auto& key = std::get<0>(data_tuple);
-                auto  score = store_with_score ? std::get<1>(data_tuple) : std::get<2>(data_tuple);
-                members[key] = score;
-            }
-            struct store_state
-            {
-                std::unordered_map<bytes, double> members;
-                bytes& stored_key;
-                data_type& data;
-            };
-            bytes& stored_key = req._args[stored_key_index];
-            return do_with(store_state{std::move(members), std::move(stored_key), std::move(data_)}, [this, flags, &data_] (auto& state) {
-                redis_key rk{std::ref(state.stored_key)};
-                auto cpu = rk.get_cpu();
-                return get_database().invoke_on(cpu, &database::zadds_direct, std::move(rk), std::move(state.members), ZADD_CH).then([flags, &data_] (auto&& m) {
-                   if (m)
-                     return reply_builder::build(data_, flags);
-                   else
-                      return reply_builder::build(msg_err);
-                });
+    if (op == BITOP_NOT && req._args_count != 3) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    struct bitop_state {
+        int op;
+        bytes& dest;
+        std::vector<bytes>& keys;
+        std::vector<foreign_ptr<lw_shared_ptr<sparse_bitmap>>> sources;
+    };
+    for (size_t i = 2; i < req._args_count; ++i) {
+        req.tmp()._keys.emplace_back(std::move(req._args[i]));
+    }
+    uint32_t count = static_cast<uint32_t>(req.tmp()._keys.size());
+    return do_with(bitop_state{op, req._args[1], req.tmp()._keys, {}}, [this, count] (auto& state) {
+        state.sources.resize(count);
+        return parallel_for_each(boost::irange<unsigned>(0, count), [this, &state] (unsigned k) {
+            redis_key rk { std::ref(state.keys[k]) };
+            auto cpu = this->get_cpu(rk);
+            return invoke_on_owner(cpu, &database::get_bitmap, std::move(rk)).then([&state, k] (auto&& u) {
+                state.sources[k] = std::move(u);
             });
-         }
-         return reply_builder::build(data_, flags);
+        }).then([this, &state] {
+            // Combine on this shard, the owner of the destination only
+            // stores the result. Missing keys are empty strings.
+            static const sparse_bitmap empty;
+            std::vector<const sparse_bitmap*> sources;
+            sources.reserve(state.sources.size());
+            for (auto& u : state.sources) {
+                sources.push_back(u ? &*u : &empty);
+            }
+            sparse_bitmap result;
+            bits_operation::combine(state.op, sources, result);
+            redis_key rk { std::ref(state.dest) };
+            auto cpu = this->get_cpu(rk);
+            return invoke_on_owner(cpu, &database::bitop, std::move(rk), std::move(result));
+        });
     });
-    */
 }
 
-future<scattered_message_ptr> redis_service::setbit(request_wrapper& req)
+future<scattered_message_ptr> redis_service::bitpos(request_wrapper& req)
 {
-    if (req._args_count < 3 || req._args.empty()) {
+    if (req._args_count < 2 || req._args_count > 4 || req._args.empty()) {
         return reply_builder::build(msg_syntax_err);
     }
     bytes& key = req._args[0];
-    size_t offset = 0;
-    int value = 0;
+    auto& bit = req._args[1];
+    if (bit.size() != 1 || (bit[0] != '0' && bit[0] != '1')) {
+        return reply_builder::build(msg_bit_err);
+    }
+    long start = 0, end = -1;
+    bool end_given = req._args_count == 4;
     try {
-        offset = std::stol(req._args[1]);
-        value = std::stoi(req._args[2]);
+        if (req._args_count > 2) {
+            start = std::stol(req._args[2]);
+        }
+        if (end_given) {
+            end = std::stol(req._args[3]);
+        }
     } catch (const std::invalid_argument&) {
         return reply_builder::build(msg_syntax_err);
     }
-    redis_key rk {std::ref(key)};
+    redis_key rk { std::ref(key), req.key_hash() };
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::setbit, std::move(rk), offset, value == 1);
+    return invoke_on_owner(cpu, &database::bitpos, std::move(rk), bit[0] == '1', start, end, end_given);
 }
 
-future<scattered_message_ptr> redis_service::getbit(request_wrapper& req)
+// i1 .. i64 and u1 .. u63, as in Redis.
+static bool parse_bitfield_type(const bytes& arg, bitfield_op& op)
 {
-    if (req._args_count < 2 || req._args.empty()) {
-        return reply_builder::build(msg_syntax_err);
+    if (arg.size() < 2 || (arg[0] != 'i' && arg[0] != 'u')) {
+        return false;
     }
-    bytes& key = req._args[0];
-    size_t offset = 0;
+    op._signed = arg[0] == 'i';
+    long bits = 0;
     try {
-        offset = std::stol(req._args[1]);
-    } catch (const std::invalid_argument&) {
-        return reply_builder::build(msg_syntax_err);
+        bits = std::stol(arg.c_str() + 1);
+    } catch (const std::exception&) {
+        return false;
     }
-    redis_key rk {std::ref(key)};
-    auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::getbit, std::move(rk), offset);
+    if (bits < 1 || bits > (op._signed ? 64 : 63)) {
+        return false;
+    }
+    op._bits = static_cast<unsigned>(bits);
+    return true;
 }
 
-future<scattered_message_ptr> redis_service::bitcount(request_wrapper& req)
+// Offsets prefixed with `#` are multiplied by the width of the field.
+static bool parse_bitfield_offset(const bytes& arg, bitfield_op& op)
 {
-    if (req._args_count < 3 || req._args.empty()) {
-        return reply_builder::build(msg_syntax_err);
+    if (!arg.empty() && arg[0] == '#') {
+        size_t index = 0;
+        if (!parse_bit_offset(arg.c_str() + 1, index) || index * op._bits > BITMAP_MAX_OFFSET) {
+            return false;
+        }
+        op._offset = index * op._bits;
     }
-    bytes& key = req._args[0];
-    long start = 0, end = 0;
-    try {
-        start = std::stol(req._args[1]);
-        end = std::stol(req._args[2]);
-    } catch (const std::invalid_argument&) {
-        return reply_builder::build(msg_syntax_err);
+    else if (!parse_bit_offset(arg.c_str(), op._offset)) {
+        return false;
     }
-    redis_key rk {std::ref(key)};
-    auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::bitcount, std::move(rk), start, end);
-}
-
-future<scattered_message_ptr> redis_service::bitop(request_wrapper& req)
-{
-    return reply_builder::build(msg_nil);
-}
-
-future<scattered_message_ptr> redis_service::bitpos(request_wrapper& req)
-{
-    return reply_builder::build(msg_nil);
+    return op._offset + op._bits - 1 <= BITMAP_MAX_OFFSET;
 }
 
 future<scattered_message_ptr> redis_service::bitfield(request_wrapper& req)
 {
-    return reply_builder::build(msg_nil);
+    if (req._args_count < 1 || req._args.empty()) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    bytes& key = req._args[0];
+    std::vector<bitfield_op> ops;
+    auto overflow = bitfield_overflow::wrap;
+    for (size_t i = 1; i < req._args_count; ++i) {
+        auto& sub = req._args[i];
+        std::transform(sub.begin(), sub.end(), sub.begin(), ::toupper);
+        bitfield_op op;
+        if (sub == "GET") {
+            op._kind = bitfield_op::kind::get;
+        }
+        else if (sub == "SET") {
+            op._kind = bitfield_op::kind::set;
+        }
+        else if (sub == "INCRBY") {
+            op._kind = bitfield_op::kind::incrby;
+        }
+        else if (sub == "OVERFLOW" && i + 1 < req._args_count) {
+            auto& mode = req._args[++i];
+            std::transform(mode.begin(), mode.end(), mode.begin(), ::toupper);
+            if (mode == "WRAP") {
+                overflow = bitfield_overflow::wrap;
+            }
+            else if (mode == "SAT") {
+                overflow = bitfield_overflow::sat;
+            }
+            else if (mode == "FAIL") {
+                overflow = bitfield_overflow::fail;
+            }
+            else {
+                return reply_builder::build(msg_syntax_err);
+            }
+            continue;
+        }
+        else {
+            return reply_builder::build(msg_syntax_err);
+        }
+        size_t needed = op._kind == bitfield_op::kind::get ? 2 : 3;
+        if (i + needed >= req._args_count) {
+            return reply_builder::build(msg_syntax_err);
+        }
+        if (!parse_bitfield_type(req._args[i + 1], op)) {
+            return reply_builder::build(msg_bitfield_type_err);
+        }
+        if (!parse_bitfield_offset(req._args[i + 2], op)) {
+            return reply_builder::build(msg_bit_offset_err);
+        }
+        if (op._kind != bitfield_op::kind::get) {
+            try {
+                op._value = std::stoll(req._args[i + 3].c_str());
+            } catch (const std::exception&) {
+                return reply_builder::build(msg_syntax_err);
+            }
+        }
+        op._overflow = overflow;
+        ops.emplace_back(op);
+        i += needed;
+    }
+    redis_key rk { std::ref(key), req.key_hash() };
+    auto cpu = get_cpu(rk);
+    return invoke_on_owner(cpu, &database::bitfield, std::move(rk), std::move(ops));
 }
 
 future<scattered_message_ptr> redis_service::pfadd(request_wrapper& req)
@@ -1881,85 +5539,85 @@ future<scattered_message_ptr> redis_service::pfadd(request_wrapper& req)
     }
     bytes& key = req._args[0];
     for (size_t i = 1; i < req._args_count; ++i) {
-        req._tmp_keys.emplace_back(req._args[i]);
+        req.tmp()._keys.emplace_back(req._args[i]);
     }
-    redis_key rk {std::ref(key)};
-    auto& elements = req._tmp_keys;
+    redis_key rk { std::ref(key), req.key_hash() };
+    // the elements are hashed here, so that the owner of a hot key only
+    // updates its registers, and a few bytes per register cross over.
+    auto updates = hll::prepare(req.tmp()._keys);
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::pfadd, rk, std::move(elements));
+    return invoke_on_owner(cpu, &database::pfadd, rk, std::move(updates));
+}
+
+future<bool> redis_service::pfmerge_impl(std::vector<bytes>& keys, size_t count, uint8_t* registers)
+{
+    struct pfmerge_state {
+        std::vector<shard_batch> batches;
+        bool type_err;
+    };
+    return do_with(pfmerge_state{group_by_shard(keys, count), false}, [registers] (auto& state) {
+        return parallel_for_each(boost::irange<unsigned>(0, smp::count), [&state, registers] (unsigned cpu) {
+            auto& batch = state.batches[cpu];
+            if (batch._keys.empty()) {
+                return make_ready_future<>();
+            }
+            return invoke_on_owner(cpu, &database::pfmerge_direct, std::move(batch._keys)).then([&state, registers] (auto&& u) {
+                if (!u) {
+                    return;
+                }
+                if (u->empty()) {
+                    state.type_err = true;
+                    return;
+                }
+                hll::merge_registers(registers, reinterpret_cast<const uint8_t*>(u->data()), u->size());
+            });
+        }).then([&state] {
+            return !state.type_err;
+        });
+    });
 }
 
 future<scattered_message_ptr> redis_service::pfcount(request_wrapper& req)
 {
-        return reply_builder::build(msg_syntax_err);
-    /*
     if (req._args_count < 1 || req._args.empty()) {
         return reply_builder::build(msg_syntax_err);
     }
     if (req._args_count == 1) {
         bytes& key = req._args[0];
-        redis_key rk {std::ref(key)};
+        redis_key rk { std::ref(key), req.key_hash() };
         auto cpu = get_cpu(rk);
-        return get_database().invoke_on(cpu, &database::pfcount, std::move(rk));
+        return invoke_on_owner(cpu, &database::pfcount, std::move(rk));
     }
-    else {
-        struct merge_state {
-            std::vector<bytes>& keys;
-            uint8_t merged_sources[HLL_BYTES_SIZE];
-        };
-        for (size_t i = 0; i < req._args_count; ++i) {
-            req._tmp_keys.emplace_back(req._args[i]);
-        }
-        return do_with(merge_state{std::ref(req._tmp_keys), { 0 }}, [this] (auto& state) {
-            return parallel_for_each(std::begin(state.keys), std::end(state.keys), [this, &state] (auto& key) {
-                redis_key rk { std::ref(key) };
-                auto cpu = this->get_cpu(rk);
-                return get_database().invoke_on(cpu, &database::get_hll_direct, std::move(rk)).then([&state] (auto&& u) {
-                    if (u) {
-                        hll::merge(state.merged_sources, HLL_BYTES_SIZE, *u);
-                    }
-                    return make_ready_future<scattered_message_ptr>();
-                });
-            }).then([this, &state] {
-                auto card = hll::count(state.merged_sources, HLL_BYTES_SIZE);
-                return reply_builder::build(card);
-            });
+    return do_with(std::unique_ptr<uint8_t[]>(new uint8_t[HLL_BUCKET_COUNT]()), [this, &req] (auto& registers) {
+        return this->pfmerge_impl(req._args, req._args_count, registers.get()).then([&registers] (bool ok) {
+            if (!ok) {
+                return reply_builder::build(msg_type_err);
+            }
+            return reply_builder::build(hll::count_registers(registers.get()));
         });
-    }
-    */
+    });
 }
 
 future<scattered_message_ptr> redis_service::pfmerge(request_wrapper& req)
 {
-        return reply_builder::build(msg_syntax_err);
-    /*
-    if (req._args_count < 2 || req._args.empty()) {
+    if (req._args_count < 1 || req._args.empty()) {
         return reply_builder::build(msg_syntax_err);
     }
-    struct merge_state {
-        bytes dest;
-        std::vector<bytes>& keys;
-        uint8_t merged_sources[HLL_BYTES_SIZE];
+    struct pfmerge_state {
+        std::unique_ptr<uint8_t[]> registers;
+        std::unique_ptr<uint8_t[]> merged_sources;
     };
-    for (size_t i = 1; i < req._args_count; ++i) {
-        req._tmp_keys.emplace_back(req._args[i]);
-    }
-    return do_with(merge_state{std::move(req._args[0]), std::ref(req._tmp_keys), { 0 }}, [this] (auto& state) {
-        return parallel_for_each(std::begin(state.keys), std::end(state.keys), [this, &state] (auto& key) {
-            redis_key rk { std::ref(key) };
-            auto cpu = this->get_cpu(rk);
-            return get_database().invoke_on(cpu, &database::get_hll_direct, std::move(rk)).then([&state] (auto&& u) {
-                if (u) {
-                    hll::merge(state.merged_sources, HLL_BYTES_SIZE, *u);
-                }
-                return make_ready_future<scattered_message_ptr>();
-            });
-        }).then([this, &state] {
-            redis_key rk { std::ref(state.dest) };
+    // the destination is merged as one of the sources, so it only receives the result.
+    return do_with(pfmerge_state{std::unique_ptr<uint8_t[]>(new uint8_t[HLL_BUCKET_COUNT]()), std::unique_ptr<uint8_t[]>(new uint8_t[HLL_BYTES_SIZE])}, [this, &req] (auto& state) {
+        return this->pfmerge_impl(req._args, req._args_count, state.registers.get()).then([this, &req, &state] (bool ok) {
+            if (!ok) {
+                return reply_builder::build(msg_type_err);
+            }
+            hll::pack_registers(state.registers.get(), state.merged_sources.get());
+            redis_key rk { std::ref(req._args[0]), req.key_hash() };
             auto cpu = this->get_cpu(rk);
-            return get_database().invoke_on(cpu, &database::pfmerge, std::move(rk), state.merged_sources, HLL_BYTES_SIZE);
+            return invoke_on_owner(cpu, &database::pfmerge, std::move(rk), state.merged_sources.get(), static_cast<size_t>(HLL_BYTES_SIZE));
         });
     });
-   */
 }
 } /* namespace redis */
@@ -27,6 +27,7 @@
 #include "core/app-template.hh"
 #include "core/future-util.hh"
 #include "core/timer-set.hh"
+#include "core/timer.hh"
 #include "core/shared_ptr.hh"
 #include "core/stream.hh"
 #include "core/memory.hh"
@@ -44,27 +45,197 @@
 #include "structures/sset_lsa.hh"
 #include "keys.hh"
 #include "request_wrapper.hh"
+#include "core/shared_future.hh"
+#include <unordered_map>
+#include <unordered_set>
+#include "utils/space_saving.hh"
 namespace redis {
 
 namespace stdx = std::experimental;
 
 struct request_wrapper;
 class database;
+struct blocked_pop;
 using message = scattered_message<char>;
 using scattered_message_ptr = foreign_ptr<lw_shared_ptr<scattered_message<char>>>;
 class redis_service {
 private:
     inline unsigned get_cpu(const bytes& key) {
-        return std::hash<bytes>()(key) % smp::count;
+        return shard_of_key(bytes_view { key.data(), key.size() }, smp::count);
     }
     inline unsigned get_cpu(const redis_key& key) {
-        return key.hash() % smp::count;
+        return key.get_cpu();
     }
+    // GETs of a key owned by another shard, one lookup each, which the GETs
+    // of the same key arriving meanwhile wait for instead of sending their
+    // own. The encoded reply is shared by all of them.
+    using coalesced_read = shared_promise<lw_shared_ptr<const bytes>>;
+    std::unordered_map<bytes, lw_shared_ptr<coalesced_read>> _reads_in_flight;
+    bool _coalesce_reads = false;
+    uint64_t _coalesced_reads = 0;
+    // One GET in hot_key_sample_rate is counted by a space-saving sketch
+    // whose counts are halved every second, so that a key read r times per
+    // second settles near 2r / hot_key_sample_rate.
+    static constexpr unsigned hot_key_sample_rate = 16;
+    static constexpr size_t hot_key_counters = 64;
+    // The values of hot keys of other shards cached here, strings of at most
+    // max_hot_copy_bytes and without expiry, until their owner reports a
+    // change or they cool down.
+    static constexpr size_t max_hot_copies = 1024;
+    static constexpr size_t max_hot_copy_bytes = 64 * 1024;
+    utils::space_saving<bytes> _hot_keys { hot_key_counters };
+    uint64_t _reads = 0;
+    lowres_clock::time_point _hot_keys_decayed;
+    bool _hot_key_copies = false;
+    uint64_t _hot_key_threshold = 0;
+    std::unordered_map<bytes, lw_shared_ptr<const bytes>> _hot_copies;
+    // Keys whose copy is on its way, installed only if still here.
+    std::unordered_set<bytes> _hot_copy_fetches;
+    uint64_t _hot_copy_hits = 0;
+    uint64_t _hot_copy_invalidations = 0;
+    // The shards past their hard memory limit, as they last reported.
+    std::vector<bool> _throttled_shards;
+    // The increments of a sharded counter taken by this shard and not yet
+    // folded into its owner, and the value the owner last returned.
+    struct counter_cell {
+        int64_t _delta = 0;
+        int64_t _known = 0;
+        bool _touched = false;
+    };
+    std::vector<bytes> _sharded_counter_patterns;
+    std::unordered_map<bytes, counter_cell> _counter_cells;
+    timer<> _counter_fold_timer;
+    // Folds the key on every shard, set by the server.
+    std::function<future<> (bytes)> _counter_folder;
+    uint64_t _sharded_increments = 0;
+    uint64_t _counter_folds = 0;
+    uint64_t _counter_fold_errors = 0;
+    bool sharded_counter(const bytes& key) const;
+    future<> fold_counters();
+    // Hashes and sorted sets split over the shards, see set_split_keys().
+    std::vector<bytes> _split_key_patterns;
+    unsigned _split_partitions = 0;
+    uint64_t _split_point_ops = 0;
+    uint64_t _split_gathers = 0;
+    bool split_key(const bytes& key) const;
+    bytes split_partition(const bytes& key, unsigned partition) const;
+    unsigned split_partition_of(const bytes& field) const;
+    // Points the command at the partition of the field at `field`.
+    void to_partition(request_wrapper& req, size_t field);
+    // Runs apply(cpu, partition, share) for the partitions with a share of
+    // the fields or members, and sums the counts they resolve to, -1 if one
+    // holds another type.
+    template <typename Share, typename Apply>
+    future<long> split_apply(bytes key, std::vector<Share> shares, Apply apply);
+    future<scattered_message_ptr> split_hmset(request_wrapper& req, bool reply_added);
+    future<scattered_message_ptr> split_remove(request_wrapper& req, bool sset);
+    future<scattered_message_ptr> split_zadd(request_wrapper& req);
+    future<scattered_message_ptr> split_hmget(request_wrapper& req);
+    // The members or fields of all the partitions, -1 if one holds another
+    // type.
+    future<long> split_size(bytes key, bool sset);
+    future<scattered_message_ptr> split_len(request_wrapper& req, bool sset);
+    future<scattered_message_ptr> split_getall(request_wrapper& req, bool keys, bool values);
+    future<scattered_message_ptr> split_range(request_wrapper& req, bool reverse);
+    future<scattered_message_ptr> split_del(request_wrapper& req);
+    // Counts a sampled GET of key, true when the key reads hot.
+    bool sample_read(const bytes& key);
+    future<scattered_message_ptr> copy_hot_key(bytes key, redis_key rk, unsigned cpu);
 public:
     redis_service()
     {
     }
 
+    // A GET only joins a lookup issued before any other command of this
+    // shard naming its key, see retire_reads(), so a client reads its own
+    // writes. Writes through other shards may not be seen by the GETs
+    // joining a lookup issued before them.
+    void set_coalesce_reads(bool coalesce) { _coalesce_reads = coalesce; }
+    uint64_t coalesced_reads() const { return _coalesced_reads; }
+    // Called before any command other than GET: the next GETs of the keys
+    // it names start a new lookup.
+    void retire_reads(const request_wrapper& req) {
+        if (_reads_in_flight.empty() && _hot_copies.empty() && _hot_copy_fetches.empty()) {
+            return;
+        }
+        for (size_t i = 0; i < req._args_count && i < req._args.size(); ++i) {
+            _reads_in_flight.erase(req._args[i]);
+            _hot_copies.erase(req._args[i]);
+            _hot_copy_fetches.erase(req._args[i]);
+        }
+    }
+
+    // With copies, a string of another shard read more than threshold times
+    // per second by this shard is served from a copy here. The owner
+    // broadcasts a change of a copied key to every shard, see
+    // drop_hot_copy(): a GET may miss a write through another shard until
+    // the broadcast reaches this one.
+    void set_hot_key_copies(bool enabled, uint64_t threshold) {
+        _hot_key_copies = enabled;
+        _hot_key_threshold = threshold;
+    }
+    void drop_hot_copy(const bytes& key) {
+        if (_hot_copies.erase(key) + _hot_copy_fetches.erase(key) > 0) {
+            ++_hot_copy_invalidations;
+        }
+    }
+    // Once every shard flushed its keys.
+    void drop_hot_copies() {
+        _hot_copy_invalidations += _hot_copies.size() + _hot_copy_fetches.size();
+        _hot_copies.clear();
+        _hot_copy_fetches.clear();
+        _reads_in_flight.clear();
+    }
+    // Writes which may take memory wait on their owner while it is past its
+    // hard memory limit, see database::wait_for_memory().
+    void set_shard_throttled(unsigned cpu, bool throttled) {
+        _throttled_shards.resize(smp::count);
+        _throttled_shards[cpu] = throttled;
+    }
+    bool shard_throttled(unsigned cpu) const {
+        return cpu < _throttled_shards.size() && _throttled_shards[cpu];
+    }
+    // The estimated GETs per second of the hottest key of this shard.
+    uint64_t hottest_key_reads() const {
+        auto top = _hot_keys.top(1);
+        return top.empty() ? 0 : top.front().second * hot_key_sample_rate / 2;
+    }
+    size_t hot_copies() const { return _hot_copies.size(); }
+
+    // INCR, INCRBY, DECR and DECRBY of a key matching one of the patterns
+    // add to a cell of the shard of the connection, folded into the owner
+    // every fold_period, so that a counter many connections increment is
+    // not bound to one shard. Their reply is the value the owner returned
+    // at the last fold plus the increments of this shard since: it misses
+    // those of the other shards until the next fold. A GET folds the cells
+    // of every shard first, the other commands only see folded values.
+    void set_sharded_counters(std::vector<bytes> patterns, std::chrono::milliseconds fold_period, std::function<future<> (bytes)> folder);
+    // Folds the cell of the key of this shard into its owner.
+    future<> fold_counter(const bytes& key);
+    size_t counter_cells() const { return _counter_cells.size(); }
+    uint64_t sharded_increments() const { return _sharded_increments; }
+    uint64_t counter_folds() const { return _counter_folds; }
+    uint64_t counter_fold_errors() const { return _counter_fold_errors; }
+    uint64_t hot_copy_hits() const { return _hot_copy_hits; }
+
+    // A hash or a sorted set whose key matches one of the patterns is kept
+    // as `partitions` keys "{split:N}key", N the hash of the field or the
+    // member modulo `partitions`, whose hash tags spread them over the
+    // shards, so that no single shard serves all of a very large key. The
+    // commands on one field or member run on its partition alone, HSET,
+    // HMSET, HMGET, HDEL, ZADD and ZREM of several run on each partition
+    // with its share of them, HLEN, HGETALL, HKEYS, HVALS, ZCARD, ZRANGE
+    // and ZREVRANGE gather those of every partition, DEL and UNLINK remove
+    // them all. The other commands naming a split key are refused. The partitions must not change while
+    // split keys exist: a field would be looked for in another partition.
+    void set_split_keys(std::vector<bytes> patterns, unsigned partitions);
+    // Whether the command names a split key, and is for split_command().
+    bool splits(const request_wrapper& req) const;
+    future<scattered_message_ptr> split_command(request_wrapper& req);
+    uint64_t split_point_ops() const { return _split_point_ops; }
+    uint64_t split_gathers() const { return _split_gathers; }
+    uint64_t hot_copy_invalidations() const { return _hot_copy_invalidations; }
+
     // [TEST APIs]
     future<bytes> echo(request_wrapper& args);
     future<scattered_message_ptr> ping(request_wrapper& args);
@@ -79,10 +250,20 @@ public:
     future<scattered_message_ptr> mset(request_wrapper& args);
     future<scattered_message_ptr> set(request_wrapper& args);
     future<scattered_message_ptr> del(request_wrapper& args);
+    future<scattered_message_ptr> unlink(request_wrapper& args);
+    future<scattered_message_ptr> rename(request_wrapper& args, bool nx);
+    future<scattered_message_ptr> copy(request_wrapper& args);
+    future<scattered_message_ptr> move(request_wrapper& args);
+    future<scattered_message_ptr> dump(request_wrapper& args);
+    future<scattered_message_ptr> restore(request_wrapper& args);
     future<scattered_message_ptr> exists(request_wrapper& args);
     future<scattered_message_ptr> append(request_wrapper& args);
     future<scattered_message_ptr> strlen(request_wrapper& args);
+    future<scattered_message_ptr> setrange(request_wrapper& args);
+    future<scattered_message_ptr> getrange(request_wrapper& args);
     future<scattered_message_ptr> get(request_wrapper& args);
+    future<scattered_message_ptr> getdel(request_wrapper& args);
+    future<scattered_message_ptr> getex(request_wrapper& args);
     future<scattered_message_ptr> mget(request_wrapper& args);
 
     // [LIST APIs]
@@ -92,6 +273,13 @@ public:
     future<scattered_message_ptr> rpushx(request_wrapper& args);
     future<scattered_message_ptr> lpop(request_wrapper& args);
     future<scattered_message_ptr> rpop(request_wrapper& args);
+    // BLPOP and BRPOP block on the shards owning their keys until a push
+    // serves them, see database::pop_or_block().
+    future<scattered_message_ptr> blpop(request_wrapper& args);
+    future<scattered_message_ptr> brpop(request_wrapper& args);
+    // LMOVE, and BLMOVE when `blocking`.
+    future<scattered_message_ptr> lmove(request_wrapper& args, bool blocking);
+    future<scattered_message_ptr> rpoplpush(request_wrapper& args, bool blocking);
     future<scattered_message_ptr> llen(request_wrapper& args);
     future<scattered_message_ptr> lindex(request_wrapper& args);
     future<scattered_message_ptr> linsert(request_wrapper& args);
@@ -100,11 +288,41 @@ public:
     future<scattered_message_ptr> ltrim(request_wrapper& args);
     future<scattered_message_ptr> lrem(request_wrapper& args);
 
+    // [STREAM APIs]
+    future<scattered_message_ptr> xadd(request_wrapper& args);
+    future<scattered_message_ptr> xlen(request_wrapper& args);
+    // XRANGE, and XREVRANGE when `reverse`.
+    future<scattered_message_ptr> xrange(request_wrapper& args, bool reverse);
+    future<scattered_message_ptr> xdel(request_wrapper& args);
+    future<scattered_message_ptr> xtrim(request_wrapper& args);
+    // XREAD, and XREADGROUP when `grouped`, which block as BLPOP does.
+    future<scattered_message_ptr> xread(request_wrapper& args, bool grouped);
+    future<scattered_message_ptr> xgroup(request_wrapper& args);
+    future<scattered_message_ptr> xack(request_wrapper& args);
+    future<scattered_message_ptr> xpending(request_wrapper& args);
+
+    // [TIMESERIES APIs]
+    future<scattered_message_ptr> ts_add(request_wrapper& args);
+    future<scattered_message_ptr> ts_range(request_wrapper& args);
+    future<scattered_message_ptr> ts_mrange(request_wrapper& args);
+
+    // [SKETCH APIs]
+    future<scattered_message_ptr> bf_reserve(request_wrapper& args);
+    future<scattered_message_ptr> bf_add(request_wrapper& args, bool multi);
+    future<scattered_message_ptr> bf_exists(request_wrapper& args, bool multi);
+    future<scattered_message_ptr> cms_init(request_wrapper& args, bool by_prob);
+    future<scattered_message_ptr> cms_incrby(request_wrapper& args);
+    future<scattered_message_ptr> cms_query(request_wrapper& args);
+    future<scattered_message_ptr> topk_reserve(request_wrapper& args);
+    future<scattered_message_ptr> topk_add(request_wrapper& args);
+    future<scattered_message_ptr> topk_query(request_wrapper& args);
+    future<scattered_message_ptr> topk_list(request_wrapper& args);
+
     // [HASH APIs]
     future<scattered_message_ptr> hdel(request_wrapper& args);
     future<scattered_message_ptr> hexists(request_wrapper& args);
     future<scattered_message_ptr> hset(request_wrapper& args);
-    future<scattered_message_ptr> hmset(request_wrapper& args);
+    future<scattered_message_ptr> hmset(request_wrapper& args, bool reply_added);
     future<scattered_message_ptr> hincrby(request_wrapper& args);
     future<scattered_message_ptr> hincrbyfloat(request_wrapper& args);
     future<scattered_message_ptr> hlen(request_wrapper& args);
@@ -114,6 +332,12 @@ public:
     future<scattered_message_ptr> hgetall_keys(request_wrapper& args);
     future<scattered_message_ptr> hgetall_values(request_wrapper& args);
     future<scattered_message_ptr> hmget(request_wrapper& args);
+    future<scattered_message_ptr> hscan(request_wrapper& args);
+    // HEXPIRE and HTTL, HPEXPIRE and HPTTL in `milliseconds`, and HPERSIST:
+    // `key ... FIELDS numfields field [field ...]`.
+    future<scattered_message_ptr> hexpire(request_wrapper& args, bool milliseconds);
+    future<scattered_message_ptr> httl(request_wrapper& args, bool milliseconds);
+    future<scattered_message_ptr> hpersist(request_wrapper& args);
 
     // [SET]
     future<scattered_message_ptr> sadd(request_wrapper& args);
@@ -121,10 +345,12 @@ public:
     future<scattered_message_ptr> srem(request_wrapper& args);
     future<scattered_message_ptr> sismember(request_wrapper& args);
     future<scattered_message_ptr> smembers(request_wrapper& args);
+    future<scattered_message_ptr> sscan(request_wrapper& args);
     future<scattered_message_ptr> sdiff(request_wrapper& args);
     future<scattered_message_ptr> sdiff_store(request_wrapper& args);
     future<scattered_message_ptr> sinter(request_wrapper& args);
     future<scattered_message_ptr> sinter_store(request_wrapper& args);
+    future<scattered_message_ptr> sintercard(request_wrapper& args);
     future<scattered_message_ptr> sunion(request_wrapper& args);
     future<scattered_message_ptr> sunion_store(request_wrapper& args);
     future<scattered_message_ptr> smove(request_wrapper& args);
@@ -134,19 +360,42 @@ public:
     future<scattered_message_ptr> type(request_wrapper& args);
     future<scattered_message_ptr> expire(request_wrapper& args);
     future<scattered_message_ptr> persist(request_wrapper& args);
+    future<scattered_message_ptr> scan(request_wrapper& args);
     future<scattered_message_ptr> pexpire(request_wrapper& args);
     future<scattered_message_ptr> ttl(request_wrapper& args);
     future<scattered_message_ptr> pttl(request_wrapper& args);
+    // MEMORY USAGE key [SAMPLES count] and MEMORY STATS.
+    future<scattered_message_ptr> memory(request_wrapper& args);
+    // HOTKEYS [count] and BIGKEYS [count] [ELEMENTS], from the last walk of
+    // the key sampler of each shard.
+    future<scattered_message_ptr> hotkeys(request_wrapper& args);
+    future<scattered_message_ptr> bigkeys(request_wrapper& args);
+    // SAVE and BGSAVE write the snapshot of every shard while commands go
+    // on, SAVE replies once they are written. LASTSAVE is when the last
+    // snapshot of every shard was written.
+    future<scattered_message_ptr> save(request_wrapper& args, bool background);
+    future<scattered_message_ptr> lastsave(request_wrapper& args);
+    // DBSIZE sums the keys of the shards. RANDOMKEY picks a shard by its
+    // share of the keys, then a key of it.
+    future<scattered_message_ptr> dbsize(request_wrapper& args);
+    future<scattered_message_ptr> randomkey(request_wrapper& args);
 
     // [ZSET]
     future<scattered_message_ptr> zadd(request_wrapper& args);
     future<scattered_message_ptr> zcard(request_wrapper& args);
     future<scattered_message_ptr> zrange(request_wrapper&, bool);
     future<scattered_message_ptr> zrangebyscore(request_wrapper&, bool);
+    future<scattered_message_ptr> zrangestore(request_wrapper&);
     future<scattered_message_ptr> zcount(request_wrapper& args);
     future<scattered_message_ptr> zincrby(request_wrapper& args);
     future<scattered_message_ptr> zrank(request_wrapper&, bool);
     future<scattered_message_ptr> zrem(request_wrapper&);
+    // LMPOP, or ZMPOP unless `list`.
+    future<scattered_message_ptr> mpop(request_wrapper&, bool list);
+    // ZPOPMIN, or ZPOPMAX when `max`.
+    future<scattered_message_ptr> zpop(request_wrapper&, bool max);
+    future<scattered_message_ptr> bzpopmin(request_wrapper&);
+    future<scattered_message_ptr> bzpopmax(request_wrapper&);
     future<scattered_message_ptr> zscore(request_wrapper&);
     future<scattered_message_ptr> zunionstore(request_wrapper&);
     future<scattered_message_ptr> zinterstore(request_wrapper&);
@@ -154,12 +403,17 @@ public:
     future<scattered_message_ptr> zunion(request_wrapper&);
     future<scattered_message_ptr> zinter(request_wrapper&);
     future<scattered_message_ptr> zdiff(request_wrapper&);
-    future<scattered_message_ptr> zrangebylex(request_wrapper&);
+    future<scattered_message_ptr> zrangebylex(request_wrapper&, bool);
     future<scattered_message_ptr> zlexcount(request_wrapper&);
-    future<scattered_message_ptr> zrevrangebylex(request_wrapper&);
+    future<scattered_message_ptr> zremrangebylex(request_wrapper&);
+    future<scattered_message_ptr> zscan(request_wrapper&);
     future<scattered_message_ptr> zremrangebyscore(request_wrapper&);
     future<scattered_message_ptr> zremrangebyrank(request_wrapper&);
     future<scattered_message_ptr> select(request_wrapper&);
+    // `drop_copies` drops the copies of keys of all shards, see
+    // drop_hot_copies().
+    future<scattered_message_ptr> flushall(request_wrapper&, std::function<future<> ()> drop_copies);
+    future<scattered_message_ptr> debug(request_wrapper&);
 
     // [GEO]
     future<scattered_message_ptr> geoadd(request_wrapper&);
@@ -167,6 +421,8 @@ public:
     future<scattered_message_ptr> geodist(request_wrapper&);
     future<scattered_message_ptr> geohash(request_wrapper&);
     future<scattered_message_ptr> georadius(request_wrapper&, bool);
+    future<scattered_message_ptr> geosearch(request_wrapper&);
+    future<scattered_message_ptr> geosearchstore(request_wrapper&);
 
     // [BITMAP]
     future<scattered_message_ptr> setbit(request_wrapper&);
@@ -180,7 +436,58 @@ public:
     future<scattered_message_ptr> pfadd(request_wrapper&);
     future<scattered_message_ptr> pfcount(request_wrapper&);
     future<scattered_message_ptr> pfmerge(request_wrapper&);
+
+    // [TRANSACTION]
+    // A key WATCH saw, with its version on its owner, see database::watch().
+    struct watched_key {
+        redis_key _key;
+        uint64_t _version;
+    };
+    // WATCH key [key ...], the keys added to `watched`.
+    future<scattered_message_ptr> watch(request_wrapper& req, std::vector<watched_key>& watched);
+    // Forgets the watched keys, on UNWATCH, EXEC, DISCARD and disconnection.
+    future<> unwatch(std::vector<watched_key>& watched);
+    // EXEC: runs the commands queued since MULTI, with their replies in
+    // `replies`, unless a watched key changed, then resolves to false.
+    using command_executor = future<scattered_message_ptr> (*)(request_wrapper& req);
+    future<bool> exec(std::vector<request_wrapper>& commands, const std::vector<watched_key>& watched,
+        command_executor executor, std::vector<scattered_message_ptr>& replies);
+
+    // [SCRIPTING]
+    // EVAL and EVALSHA: the script runs on the shard owning its keys, which
+    // must all be owned by the same one, or here when it has none. Its
+    // commands go through `executor` there, see script_engine.
+    future<scattered_message_ptr> eval(request_wrapper& req, bool by_sha, command_executor executor);
+    // SCRIPT LOAD, EXISTS and FLUSH.
+    future<scattered_message_ptr> script(request_wrapper& req);
 private:
+    // Compiles the body here, then hands it to every shard: empty or the
+    // error reply.
+    future<bytes> load_script(const sstring& sha, const bytes& body);
+    // Keys grouped by the owning shard, so multi-key commands send one message per shard.
+    struct shard_batch {
+        std::vector<redis_key> _keys;
+        std::vector<size_t> _positions;
+    };
+    std::vector<shard_batch> group_by_shard(std::vector<bytes>& keys, size_t count);
+    // The shard of all the keys of the batches, or smp::count if they are on
+    // several: the commands then skip the state of their fan out.
+    template <typename Batches, typename Empty>
+    static unsigned only_shard(const Batches& batches, Empty empty) {
+        unsigned only = smp::count;
+        for (unsigned cpu = 0; cpu < batches.size(); ++cpu) {
+            if (empty(batches[cpu])) {
+                continue;
+            }
+            if (only != smp::count) {
+                return smp::count;
+            }
+            only = cpu;
+        }
+        return only;
+    }
+    // Max-merges the HLL keys into one byte per register, shard by shard; false on a wrong type.
+    future<bool> pfmerge_impl(std::vector<bytes>& keys, size_t count, uint8_t* registers);
     future<std::pair<size_t, int>> zadds_impl(bytes& key, std::unordered_map<bytes, double>&& members, int flags);
     future<bool> exists_impl(bytes& key);
     future<scattered_message_ptr> srem_impl(bytes& key, bytes& member);
@@ -189,9 +496,23 @@ private:
     future<scattered_message_ptr> sadds_impl_return_keys(bytes& key, std::vector<bytes>& members);
     future<scattered_message_ptr> sdiff_impl(std::vector<bytes>& keys, bytes* dest);
     future<scattered_message_ptr> sinter_impl(std::vector<bytes>& keys, bytes* dest);
+    future<std::vector<bytes>> sinter_members(std::vector<bytes>& keys, size_t limit);
+    future<std::vector<bytes>> probe_members(std::vector<bytes>& keys, unsigned first, std::vector<unsigned> sets, bool members, size_t limit);
+    future<> probe_batch(std::vector<bytes>& candidates, std::vector<bytes>& keys, const std::vector<unsigned>& sets, bool members);
     future<scattered_message_ptr> sunion_impl(std::vector<bytes>& keys, bytes* dest);
-    future<scattered_message_ptr> smembers_impl(bytes& key);
     future<scattered_message_ptr> pop_impl(request_wrapper& args, bool left);
+    // BLPOP and BRPOP, or BZPOPMIN, `left`, and BZPOPMAX with `sset`.
+    future<scattered_message_ptr> blocking_pop(request_wrapper& args, bool left, bool sset = false);
+    // LMOVE and RPOPLPUSH of the first two arguments, `from` and `to` being
+    // the `left` of database::pop() and push().
+    future<scattered_message_ptr> move_element(request_wrapper& args, bool from, bool to, bool blocking, double timeout);
+    future<scattered_message_ptr> pop_and_push(request_wrapper& args, bool from, bool to, double timeout, bool wait);
+    // Pops an element of the first of the keys holding a list, waiting up
+    // to `timeout` seconds, 0 for ever, for one to be pushed when `block`.
+    // Reads the streams instead when `read` is set, which must outlive it,
+    // and pops of sorted sets with `sset`, see blocked_pop::_sset.
+    future<lw_shared_ptr<blocked_pop>> pop_blocking(std::vector<bytes> keys, bool left, double timeout, bool block, const stream_read* read = nullptr,
+        bool sset = false);
     future<scattered_message_ptr> push_impl(request_wrapper& arg, bool force, bool left);
     future<scattered_message_ptr> push_impl(bytes& key, bytes& value, bool force, bool left);
     future<scattered_message_ptr> push_impl(bytes& key, std::vector<bytes>& vals, bool force, bool left);
@@ -210,20 +531,28 @@ private:
         std::vector<bytes> keys;
         std::vector<double> weights;
         int aggregate_flag;
+        bool with_scores;
     };
-    bool parse_zset_args(request_wrapper& args, zset_args& uargs);
-    static inline double score_aggregation(const double& old, const double& newscore, int flag)
+    // Parses `[dest] numkeys key [key ...] [WEIGHTS ...] [AGGREGATE ...]`,
+    // with the destination if `store` and WITHSCORES if not.
+    bool parse_zset_args(request_wrapper& args, zset_args& uargs, bool store);
+    future<scattered_message_ptr> zunion_impl(request_wrapper& args, bool store);
+    future<scattered_message_ptr> zinter_impl(request_wrapper& args, bool store, bool diff);
+    future<> zprobe_batch(zset_members& candidates, zset_args& uargs, const std::vector<unsigned>& sources, bool diff);
+    struct geo_args
     {
-        if (flag == ZAGGREGATE_MIN) {
-            return std::min(old, newscore);
-        }
-        else if (flag == ZAGGREGATE_SUM) {
-            return old + newscore;
-        }
-        else {
-            return std::max(old, newscore);
-        }
-    }
+        bytes key;
+        bytes dest;
+        bytes member;
+        bool from_member;
+        geo::shape shape;
+        size_t count;
+        int flags;
+    };
+    // Parses GEORADIUS, or GEORADIUSBYMEMBER if `member`, and GEOSEARCH, or
+    // GEOSEARCHSTORE if `store`, if `search`. On failure `err` is the reply.
+    bool parse_geo_args(request_wrapper& args, geo_args& uargs, bool search, bool store, bool member, const bytes*& err);
+    future<scattered_message_ptr> geosearch_impl(request_wrapper& args, bool search, bool store, bool member);
 };
 
 } /* namespace redis */
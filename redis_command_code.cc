@@ -0,0 +1,600 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pengjian.uest@gmail.com. All rights reserved.
+*
+*/
+#include "redis_command_code.hh"
+#include <cstdint>
+#include <cstring>
+#include <vector>
+namespace redis {
+
+namespace {
+
+struct command_name {
+    const char* _name;
+    command_code _code;
+};
+
+static const command_name command_names[] = {
+    { "set", command_code::set },
+    { "mset", command_code::mset },
+    { "get", command_code::get },
+    { "mget", command_code::mget },
+    { "del", command_code::del },
+    { "echo", command_code::echo },
+    { "ping", command_code::ping },
+    { "incr", command_code::incr },
+    { "decr", command_code::decr },
+    { "incrby", command_code::incrby },
+    { "decrby", command_code::decrby },
+    { "command", command_code::command },
+    { "exists", command_code::exists },
+    { "append", command_code::append },
+    { "strlen", command_code::strlen },
+    { "setrange", command_code::setrange },
+    { "getrange", command_code::getrange },
+    { "getex", command_code::getex },
+    { "getdel", command_code::getdel },
+    { "lpush", command_code::lpush },
+    { "lpushx", command_code::lpushx },
+    { "lpop", command_code::lpop },
+    { "llen", command_code::llen },
+    { "lindex", command_code::lindex },
+    { "linsert", command_code::linsert },
+    { "lrange", command_code::lrange },
+    { "lset", command_code::lset },
+    { "rpush", command_code::rpush },
+    { "rpushx", command_code::rpushx },
+    { "rpop", command_code::rpop },
+    { "blpop", command_code::blpop },
+    { "brpop", command_code::brpop },
+    { "lmove", command_code::lmove },
+    { "blmove", command_code::blmove },
+    { "rpoplpush", command_code::rpoplpush },
+    { "brpoplpush", command_code::brpoplpush },
+    { "lmpop", command_code::lmpop },
+    { "lrem", command_code::lrem },
+    { "ltrim", command_code::ltrim },
+    { "hset", command_code::hset },
+    { "hdel", command_code::hdel },
+    { "hget", command_code::hget },
+    { "hlen", command_code::hlen },
+    { "hexists", command_code::hexists },
+    { "hstrlen", command_code::hstrlen },
+    { "hexpire", command_code::hexpire },
+    { "hpexpire", command_code::hpexpire },
+    { "httl", command_code::httl },
+    { "hpttl", command_code::hpttl },
+    { "hpersist", command_code::hpersist },
+    { "hincrby", command_code::hincrby },
+    { "hincrbyfloat", command_code::hincrbyfloat },
+    { "hkeys", command_code::hkeys },
+    { "hvals", command_code::hvals },
+    { "hmget", command_code::hmget },
+    { "hscan", command_code::hscan },
+    { "hmset", command_code::hmset },
+    { "hgetall", command_code::hgetall },
+    { "sadd", command_code::sadd },
+    { "scard", command_code::scard },
+    { "sismember", command_code::sismember },
+    { "smembers", command_code::smembers },
+    { "sscan", command_code::sscan },
+    { "srem", command_code::srem },
+    { "sdiff", command_code::sdiff },
+    { "sdiffstore", command_code::sdiffstore },
+    { "sinter", command_code::sinter },
+    { "sinterstore", command_code::sinterstore },
+    { "sintercard", command_code::sintercard },
+    { "sunion", command_code::sunion },
+    { "sunionstore", command_code::sunionstore },
+    { "smove", command_code::smove },
+    { "srandmember", command_code::srandmember },
+    { "spop", command_code::spop },
+    { "type", command_code::type },
+    { "expire", command_code::expire },
+    { "pexpire", command_code::pexpire },
+    { "ttl", command_code::ttl },
+    { "pttl", command_code::pttl },
+    { "persist", command_code::persist },
+    { "scan", command_code::scan },
+    { "zadd", command_code::zadd },
+    { "zcard", command_code::zcard },
+    { "zcount", command_code::zcount },
+    { "zincrby", command_code::zincrby },
+    { "zrange", command_code::zrange },
+    { "zrangebyscore", command_code::zrangebyscore },
+    { "zrank", command_code::zrank },
+    { "zrem", command_code::zrem },
+    { "zmpop", command_code::zmpop },
+    { "zpopmin", command_code::zpopmin },
+    { "zpopmax", command_code::zpopmax },
+    { "bzpopmin", command_code::bzpopmin },
+    { "bzpopmax", command_code::bzpopmax },
+    { "zremrangebyrank", command_code::zremrangebyrank },
+    { "zremrangebyscore", command_code::zremrangebyscore },
+    { "zrevrange", command_code::zrevrange },
+    { "zrevrangebyscore", command_code::zrevrangebyscore },
+    { "zrevrank", command_code::zrevrank },
+    { "zscore", command_code::zscore },
+    { "zunionstore", command_code::zunionstore },
+    { "zinterstore", command_code::zinterstore },
+    { "zdiffstore", command_code::zdiffstore },
+    { "zrangestore", command_code::zrangestore },
+    { "zunion", command_code::zunion },
+    { "zinter", command_code::zinter },
+    { "zdiff", command_code::zdiff },
+    { "zscan", command_code::zscan },
+    { "zrangebylex", command_code::zrangebylex },
+    { "zrevrangebylex", command_code::zrevrangebylex },
+    { "zlexcount", command_code::zlexcount },
+    { "zremrangebylex", command_code::zremrangebylex },
+    { "select", command_code::select },
+    { "flushdb", command_code::flushdb },
+    { "flushall", command_code::flushall },
+    { "debug", command_code::debug },
+    { "geoadd", command_code::geoadd },
+    { "geohash", command_code::geohash },
+    { "geodist", command_code::geodist },
+    { "geopos", command_code::geopos },
+    { "georadius", command_code::georadius },
+    { "georadiusbymember", command_code::georadiusbymember },
+    { "geosearch", command_code::geosearch },
+    { "geosearchstore", command_code::geosearchstore },
+    { "setbit", command_code::setbit },
+    { "getbit", command_code::getbit },
+    { "bitcount", command_code::bitcount },
+    { "bitop", command_code::bitop },
+    { "bitpos", command_code::bitpos },
+    { "bitfield", command_code::bitfield },
+    { "pfadd", command_code::pfadd },
+    { "pfcount", command_code::pfcount },
+    { "pfmerge", command_code::pfmerge },
+    { "shards", command_code::shards },
+    { "unlink", command_code::unlink },
+    { "rename", command_code::rename },
+    { "renamenx", command_code::renamenx },
+    { "copy", command_code::copy },
+    { "move", command_code::move },
+    { "dump", command_code::dump },
+    { "restore", command_code::restore },
+    { "cluster", command_code::cluster },
+    { "asking", command_code::asking },
+    { "info", command_code::info },
+    { "memory", command_code::memory },
+    { "tracing", command_code::tracing },
+    { "slowlog", command_code::slowlog },
+    { "capture", command_code::capture },
+    { "config", command_code::config },
+    { "profile", command_code::profile },
+    { "latency", command_code::latency },
+    { "hotkeys", command_code::hotkeys },
+    { "bigkeys", command_code::bigkeys },
+    { "save", command_code::save },
+    { "bgsave", command_code::bgsave },
+    { "lastsave", command_code::lastsave },
+    { "dbsize", command_code::dbsize },
+    { "randomkey", command_code::randomkey },
+    { "multi", command_code::multi },
+    { "exec", command_code::exec },
+    { "discard", command_code::discard },
+    { "watch", command_code::watch },
+    { "unwatch", command_code::unwatch },
+    { "eval", command_code::eval },
+    { "evalsha", command_code::evalsha },
+    { "script", command_code::script },
+    { "subscribe", command_code::subscribe },
+    { "unsubscribe", command_code::unsubscribe },
+    { "psubscribe", command_code::psubscribe },
+    { "punsubscribe", command_code::punsubscribe },
+    { "publish", command_code::publish },
+    { "pubsub", command_code::pubsub },
+    { "xadd", command_code::xadd },
+    { "xlen", command_code::xlen },
+    { "xrange", command_code::xrange },
+    { "xrevrange", command_code::xrevrange },
+    { "xdel", command_code::xdel },
+    { "xtrim", command_code::xtrim },
+    { "xread", command_code::xread },
+    { "xgroup", command_code::xgroup },
+    { "xreadgroup", command_code::xreadgroup },
+    { "xack", command_code::xack },
+    { "xpending", command_code::xpending },
+    { "ts.add", command_code::ts_add },
+    { "ts.range", command_code::ts_range },
+    { "ts.mrange", command_code::ts_mrange },
+    { "bf.reserve", command_code::bf_reserve },
+    { "bf.add", command_code::bf_add },
+    { "bf.madd", command_code::bf_madd },
+    { "bf.exists", command_code::bf_exists },
+    { "bf.mexists", command_code::bf_mexists },
+    { "cms.initbydim", command_code::cms_initbydim },
+    { "cms.initbyprob", command_code::cms_initbyprob },
+    { "cms.incrby", command_code::cms_incrby },
+    { "cms.query", command_code::cms_query },
+    { "topk.reserve", command_code::topk_reserve },
+    { "topk.add", command_code::topk_add },
+    { "topk.query", command_code::topk_query },
+    { "topk.list", command_code::topk_list },
+    { "hello", command_code::hello },
+    { "client", command_code::client },
+};
+
+// Perfect hash table: at startup we search for a seed under which no two
+// command names collide, so a lookup costs one hash and one compare.
+class command_table {
+    struct slot {
+        const char* _name = nullptr;
+        size_t _size = 0;
+        command_code _code = command_code::unknown;
+    };
+    std::vector<slot> _slots;
+    uint32_t _mask = 0;
+    uint32_t _seed = 0;
+
+    // FNV-1a over the lower-cased name. Command names are ASCII letters,
+    // so OR-ing 0x20 folds the case.
+    static inline uint32_t hash(uint32_t seed, const char* name, size_t size) {
+        uint32_t h = 2166136261u ^ seed;
+        for (size_t i = 0; i < size; ++i) {
+            h ^= static_cast<uint8_t>(name[i] | 0x20);
+            h *= 16777619u;
+        }
+        return h;
+    }
+
+    bool build(size_t size, uint32_t seed) {
+        _slots.assign(size, slot {});
+        _mask = size - 1;
+        _seed = seed;
+        for (auto& c : command_names) {
+            auto& s = _slots[hash(_seed, c._name, std::strlen(c._name)) & _mask];
+            if (s._name != nullptr) {
+                return false;
+            }
+            s._name = c._name;
+            s._size = std::strlen(c._name);
+            s._code = c._code;
+        }
+        return true;
+    }
+public:
+    command_table() {
+        static constexpr uint32_t max_seeds = 4096;
+        for (size_t size = 1024; ; size <<= 1) {
+            for (uint32_t seed = 0; seed < max_seeds; ++seed) {
+                if (build(size, seed)) {
+                    return;
+                }
+            }
+        }
+    }
+
+    inline command_code find(const char* name, size_t size) const {
+        auto& s = _slots[hash(_seed, name, size) & _mask];
+        if (s._size != size) {
+            return command_code::unknown;
+        }
+        for (size_t i = 0; i < size; ++i) {
+            if (static_cast<char>(name[i] | 0x20) != s._name[i]) {
+                return command_code::unknown;
+            }
+        }
+        return s._code;
+    }
+};
+
+static const command_table table;
+}
+
+command_code to_command_code(const char* name, size_t size)
+{
+    return table.find(name, size);
+}
+
+const char* to_command_name(command_code code)
+{
+    for (auto& c : command_names) {
+        if (c._code == code) {
+            return c._name;
+        }
+    }
+    return nullptr;
+}
+
+bool may_grow_memory(command_code code)
+{
+    switch (code) {
+    case command_code::set:
+    case command_code::mset:
+    case command_code::incr:
+    case command_code::decr:
+    case command_code::incrby:
+    case command_code::decrby:
+    case command_code::append:
+    case command_code::setrange:
+    case command_code::lpush:
+    case command_code::lpushx:
+    case command_code::linsert:
+    case command_code::lset:
+    case command_code::rpush:
+    case command_code::rpushx:
+    case command_code::hset:
+    case command_code::hincrby:
+    case command_code::hincrbyfloat:
+    case command_code::hmset:
+    case command_code::hexpire:
+    case command_code::hpexpire:
+    case command_code::sadd:
+    case command_code::sdiffstore:
+    case command_code::sinterstore:
+    case command_code::sunionstore:
+    case command_code::zadd:
+    case command_code::zincrby:
+    case command_code::zunionstore:
+    case command_code::zinterstore:
+    case command_code::zdiffstore:
+    case command_code::zrangestore:
+    case command_code::geoadd:
+    case command_code::geosearchstore:
+    case command_code::setbit:
+    case command_code::bitop:
+    case command_code::bitfield:
+    case command_code::pfadd:
+    case command_code::pfmerge:
+    case command_code::xadd:
+    case command_code::xgroup:
+    case command_code::xreadgroup:
+    case command_code::ts_add:
+    case command_code::bf_reserve:
+    case command_code::bf_add:
+    case command_code::bf_madd:
+    case command_code::cms_initbydim:
+    case command_code::cms_initbyprob:
+    case command_code::cms_incrby:
+    case command_code::topk_reserve:
+    case command_code::topk_add:
+    case command_code::rename:
+    case command_code::renamenx:
+    case command_code::copy:
+    case command_code::restore:
+        return true;
+    default:
+        return false;
+    }
+}
+
+bool is_heavy_command(command_code code)
+{
+    switch (code) {
+    case command_code::sdiff:
+    case command_code::sdiffstore:
+    case command_code::sinter:
+    case command_code::sinterstore:
+    case command_code::sintercard:
+    case command_code::sunion:
+    case command_code::sunionstore:
+    case command_code::zunionstore:
+    case command_code::zinterstore:
+    case command_code::zdiffstore:
+    case command_code::zunion:
+    case command_code::zinter:
+    case command_code::zdiff:
+    case command_code::georadius:
+    case command_code::georadiusbymember:
+    case command_code::geosearch:
+    case command_code::geosearchstore:
+    case command_code::bitop:
+    case command_code::pfmerge:
+    case command_code::ts_mrange:
+        return true;
+    default:
+        return false;
+    }
+}
+
+command_family family_of(command_code code)
+{
+    switch (code) {
+    case command_code::set:
+    case command_code::mset:
+    case command_code::get:
+    case command_code::mget:
+    case command_code::incr:
+    case command_code::decr:
+    case command_code::incrby:
+    case command_code::decrby:
+    case command_code::append:
+    case command_code::strlen:
+    case command_code::setrange:
+    case command_code::getrange:
+    case command_code::getex:
+    case command_code::getdel:
+    case command_code::setbit:
+    case command_code::getbit:
+    case command_code::bitcount:
+    case command_code::bitop:
+    case command_code::bitpos:
+    case command_code::bitfield:
+        return command_family::string;
+    case command_code::lpush:
+    case command_code::lpushx:
+    case command_code::lpop:
+    case command_code::llen:
+    case command_code::lindex:
+    case command_code::linsert:
+    case command_code::lrange:
+    case command_code::lset:
+    case command_code::rpush:
+    case command_code::rpushx:
+    case command_code::rpop:
+    case command_code::lmove:
+    case command_code::rpoplpush:
+    case command_code::lmpop:
+    case command_code::lrem:
+    case command_code::ltrim:
+        return command_family::list;
+    case command_code::hset:
+    case command_code::hdel:
+    case command_code::hget:
+    case command_code::hlen:
+    case command_code::hexists:
+    case command_code::hstrlen:
+    case command_code::hincrby:
+    case command_code::hincrbyfloat:
+    case command_code::hkeys:
+    case command_code::hvals:
+    case command_code::hmget:
+    case command_code::hmset:
+    case command_code::hgetall:
+    case command_code::hscan:
+    case command_code::hexpire:
+    case command_code::hpexpire:
+    case command_code::httl:
+    case command_code::hpttl:
+    case command_code::hpersist:
+        return command_family::hash;
+    case command_code::sadd:
+    case command_code::scard:
+    case command_code::sismember:
+    case command_code::smembers:
+    case command_code::srem:
+    case command_code::sdiff:
+    case command_code::sdiffstore:
+    case command_code::sinter:
+    case command_code::sinterstore:
+    case command_code::sintercard:
+    case command_code::sunion:
+    case command_code::sunionstore:
+    case command_code::smove:
+    case command_code::srandmember:
+    case command_code::spop:
+    case command_code::sscan:
+        return command_family::set;
+    // a geo index is a sorted set.
+    case command_code::zadd:
+    case command_code::zcard:
+    case command_code::zcount:
+    case command_code::zincrby:
+    case command_code::zrange:
+    case command_code::zrangebyscore:
+    case command_code::zrank:
+    case command_code::zrem:
+    case command_code::zmpop:
+    case command_code::zpopmin:
+    case command_code::zpopmax:
+    case command_code::zremrangebyrank:
+    case command_code::zremrangebyscore:
+    case command_code::zrevrange:
+    case command_code::zrevrangebyscore:
+    case command_code::zrevrank:
+    case command_code::zscore:
+    case command_code::zunionstore:
+    case command_code::zinterstore:
+    case command_code::zdiffstore:
+    case command_code::zrangestore:
+    case command_code::zunion:
+    case command_code::zinter:
+    case command_code::zdiff:
+    case command_code::zscan:
+    case command_code::zrangebylex:
+    case command_code::zrevrangebylex:
+    case command_code::zlexcount:
+    case command_code::zremrangebylex:
+    case command_code::geoadd:
+    case command_code::geohash:
+    case command_code::geodist:
+    case command_code::geopos:
+    case command_code::georadius:
+    case command_code::georadiusbymember:
+    case command_code::geosearch:
+    case command_code::geosearchstore:
+        return command_family::zset;
+    case command_code::pfadd:
+    case command_code::pfcount:
+    case command_code::pfmerge:
+        return command_family::hyperloglog;
+    case command_code::xadd:
+    case command_code::xlen:
+    case command_code::xrange:
+    case command_code::xrevrange:
+    case command_code::xdel:
+    case command_code::xtrim:
+    case command_code::xgroup:
+    case command_code::xack:
+    case command_code::xpending:
+        return command_family::stream;
+    case command_code::ts_add:
+    case command_code::ts_range:
+        return command_family::timeseries;
+    case command_code::bf_reserve:
+    case command_code::bf_add:
+    case command_code::bf_madd:
+    case command_code::bf_exists:
+    case command_code::bf_mexists:
+    case command_code::cms_initbydim:
+    case command_code::cms_initbyprob:
+    case command_code::cms_incrby:
+    case command_code::cms_query:
+    case command_code::topk_reserve:
+    case command_code::topk_add:
+    case command_code::topk_query:
+    case command_code::topk_list:
+        return command_family::sketch;
+    case command_code::del:
+    case command_code::unlink:
+    case command_code::rename:
+    case command_code::renamenx:
+    case command_code::copy:
+    case command_code::move:
+    case command_code::dump:
+    case command_code::restore:
+    case command_code::exists:
+    case command_code::type:
+    case command_code::expire:
+    case command_code::pexpire:
+    case command_code::ttl:
+    case command_code::pttl:
+    case command_code::persist:
+    case command_code::flushdb:
+    case command_code::flushall:
+    case command_code::dbsize:
+    case command_code::randomkey:
+        return command_family::keyspace;
+    default:
+        return command_family::none;
+    }
+}
+
+const char* to_family_name(command_family family)
+{
+    switch (family) {
+    case command_family::string: return "string";
+    case command_family::list: return "list";
+    case command_family::hash: return "hash";
+    case command_family::set: return "set";
+    case command_family::zset: return "zset";
+    case command_family::hyperloglog: return "hyperloglog";
+    case command_family::stream: return "stream";
+    case command_family::timeseries: return "timeseries";
+    case command_family::sketch: return "sketch";
+    case command_family::keyspace: return "keyspace";
+    default: return "none";
+    }
+}
+}
@@ -1,4 +1,5 @@
 #pragma once
+#include <cstddef>
 namespace redis {
 
 enum class protocol_state {
@@ -24,6 +25,10 @@ enum class command_code {
     exists,
     append,
     strlen,
+    setrange,
+    getrange,
+    getex,
+    getdel,
     lpush,
     lpushx,
     lpop,
@@ -35,6 +40,13 @@ enum class command_code {
     rpush,
     rpushx,
     rpop,
+    blpop,
+    brpop,
+    lmove,
+    blmove,
+    rpoplpush,
+    brpoplpush,
+    lmpop,
     lrem,
     ltrim,
     hset,
@@ -50,6 +62,12 @@ enum class command_code {
     hmget,
     hmset,
     hgetall,
+    hscan,
+    hexpire,
+    hpexpire,
+    httl,
+    hpttl,
+    hpersist,
     sadd,
     scard,
     sismember,
@@ -59,17 +77,20 @@ enum class command_code {
     sdiffstore,
     sinter,
     sinterstore,
+    sintercard,
     sunion,
     sunionstore,
     smove,
     srandmember,
     spop,
+    sscan,
     type,
     expire,
     pexpire,
     ttl,
     pttl,
     persist,
+    scan,
     zadd,
     zcard,
     zcount,
@@ -78,6 +99,11 @@ enum class command_code {
     zrangebyscore,
     zrank,
     zrem,
+    zmpop,
+    zpopmin,
+    zpopmax,
+    bzpopmin,
+    bzpopmax,
     zremrangebyrank,
     zremrangebyscore,
     zrevrange,
@@ -87,20 +113,27 @@ enum class command_code {
     zunionstore,
     zinterstore,
     zdiffstore,
+    zrangestore,
     zunion,
     zinter,
     zdiff,
     zscan,
     zrangebylex,
+    zrevrangebylex,
     zlexcount,
     zremrangebylex,
     select,
+    flushdb,
+    flushall,
+    debug,
     geoadd,
     geohash,
     geodist,
     geopos,
     georadius,
     georadiusbymember,
+    geosearch,
+    geosearchstore,
     setbit,
     getbit,
     bitcount,
@@ -110,5 +143,125 @@ enum class command_code {
     pfadd,
     pfcount,
     pfmerge,
+    shards,
+    unlink,
+    rename,
+    renamenx,
+    copy,
+    move,
+    dump,
+    restore,
+    cluster,
+    asking,
+    info,
+    memory,
+    tracing,
+    slowlog,
+    capture,
+    config,
+    profile,
+    latency,
+    hotkeys,
+    bigkeys,
+    save,
+    bgsave,
+    lastsave,
+    dbsize,
+    randomkey,
+    multi,
+    exec,
+    discard,
+    watch,
+    unwatch,
+    eval,
+    evalsha,
+    script,
+    subscribe,
+    unsubscribe,
+    psubscribe,
+    punsubscribe,
+    publish,
+    pubsub,
+    xadd,
+    xlen,
+    xrange,
+    xrevrange,
+    xdel,
+    xtrim,
+    xread,
+    xgroup,
+    xreadgroup,
+    xack,
+    xpending,
+    ts_add,
+    ts_range,
+    ts_mrange,
+    bf_reserve,
+    bf_add,
+    bf_madd,
+    bf_exists,
+    bf_mexists,
+    cms_initbydim,
+    cms_initbyprob,
+    cms_incrby,
+    cms_query,
+    topk_reserve,
+    topk_add,
+    topk_query,
+    topk_list,
+    hello,
+    client,
+    // keep it last, it is the size of the dispatch table.
+    max,
+};
+
+// Case-insensitive lookup of the command name, without any allocation.
+command_code to_command_code(const char* name, size_t size);
+// Lower-case name of the command, nullptr for unknown.
+const char* to_command_name(command_code code);
+// Whether the command may take more memory, as the denyoom commands of
+// Redis: writes which only remove data are not among them.
+bool may_grow_memory(command_code code);
+// Whether the command works on several collections at once, whatever
+// their size, see utils::work_class::heavy.
+bool is_heavy_command(command_code code);
+
+// The kind of data a command works on. The calls a shard runs for the
+// commands of other shards go through an execution stage per family, see
+// invoke_on_owner(), so that those of a family run back to back.
+enum class command_family {
+    // not staged: server, connection and cross-key commands.
+    none,
+    string,
+    list,
+    hash,
+    set,
+    zset,
+    hyperloglog,
+    stream,
+    timeseries,
+    sketch,
+    keyspace,
+    max,
+};
+
+command_family family_of(command_code code);
+const char* to_family_name(command_family family);
+
+// The family of the command whose handler is running on this shard, set
+// by family_scope for the synchronous part of the handler, as current_trace().
+inline command_family& current_family()
+{
+    static thread_local command_family family = command_family::none;
+    return family;
+}
+
+class family_scope {
+    command_family _previous;
+public:
+    explicit family_scope(command_family family) : _previous(current_family()) { current_family() = family; }
+    ~family_scope() { current_family() = _previous; }
+    family_scope(const family_scope&) = delete;
+    family_scope& operator = (const family_scope&) = delete;
 };
 }
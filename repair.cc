@@ -0,0 +1,353 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#include "repair.hh"
+#include "db.hh"
+#include "ring.hh"
+#include "service.hh"
+#include "message/messaging_service.hh"
+#include "utils/fb_utilities.hh"
+#include "core/future-util.hh"
+#include <boost/range/irange.hpp>
+#include <unordered_set>
+namespace redis {
+
+distributed<repair_service> _the_repair_service;
+
+// Whether `replica` holds the slot of which `primary` is the primary.
+static bool shares_slot(const ring_snapshot& ring, unsigned slot, const gms::inet_address& primary, const gms::inet_address& replica)
+{
+    auto t = slot_token(slot);
+    if (ring.primary_replica(t) != primary) {
+        return false;
+    }
+    bool found = false;
+    ring.for_each_replica(t, [&found, &replica] (const gms::inet_address& endpoint) {
+        found |= endpoint == replica;
+    });
+    return found;
+}
+
+// A set of slots to look keys up in from every shard.
+static lw_shared_ptr<std::vector<bool>> slot_set(const std::vector<uint32_t>& slots)
+{
+    auto set = make_lw_shared<std::vector<bool>>(cluster_slots, false);
+    for (auto slot : slots) {
+        if (slot < cluster_slots) {
+            (*set)[slot] = true;
+        }
+    }
+    return set;
+}
+
+static bool in_slots(const std::vector<bool>& set, bytes_view key)
+{
+    return set[key_hash_slot(key.data(), key.size())];
+}
+
+repair_service::repair_service(repair_options options)
+    : _options(options)
+{
+    setup_metrics();
+}
+
+void repair_service::setup_metrics()
+{
+    namespace sm = seastar::metrics;
+    _metrics.add_group("repair", {
+        sm::make_counter("repairs_total", [this] { return _stats._repairs; }, sm::description("Total number of repairs of a replica.")),
+        sm::make_counter("failed_repairs_total", [this] { return _stats._failed_repairs; }, sm::description("Total number of repairs of a replica which failed.")),
+        sm::make_counter("exchanged_nodes_total", [this] { return _stats._exchanged_nodes; }, sm::description("Total number of tree nodes received from replicas.")),
+        sm::make_counter("differing_slots_total", [this] { return _stats._differing_slots; }, sm::description("Total number of slots found to differ on a replica.")),
+        sm::make_counter("streamed_keys_total", [this] { return _stats._streamed_keys; }, sm::description("Total number of keys streamed to replicas by repairs.")),
+        sm::make_counter("deleted_keys_total", [this] { return _stats._deleted_keys; }, sm::description("Total number of keys deleted from replicas by repairs.")),
+        sm::make_gauge("active", [this] { return _stats._active; }, sm::description("Number of repairs running.")),
+    });
+}
+
+future<merkle_tree> repair_service::build_tree(gms::inet_address primary, gms::inet_address replica)
+{
+    using digests_ptr = foreign_ptr<lw_shared_ptr<std::vector<uint64_t>>>;
+    return do_with(std::vector<uint64_t>(cluster_slots, 0), [primary, replica] (auto& leaves) {
+        return parallel_for_each(boost::irange<unsigned>(0, smp::count), [&leaves] (unsigned cpu) {
+            return get_database().invoke_on(cpu, [] (database& db) {
+                return db.slot_digests();
+            }).then([&leaves] (digests_ptr digests) {
+                for (size_t i = 0; i < cluster_slots; ++i) {
+                    leaves[i] ^= (*digests)[i];
+                }
+            });
+        }).then([&leaves, primary, replica] {
+            auto& ring = get_local_service().get_ring().snapshot();
+            for (unsigned slot = 0; slot < cluster_slots; ++slot) {
+                if (ring.empty() || !shares_slot(ring, slot, primary, replica)) {
+                    leaves[slot] = 0;
+                }
+            }
+            return merkle_tree(leaves);
+        });
+    });
+}
+
+future<std::vector<uint32_t>> repair_service::differing_slots(gms::inet_address replica, lw_shared_ptr<merkle_tree> local)
+{
+    // Each exchange sends the subtrees of the nodes which differ at the
+    // bottom of the previous one, starting with the root.
+    struct state {
+        std::vector<uint64_t> roots { 1 };
+        std::vector<uint32_t> slots;
+    };
+    auto id = netw::msg_addr { replica, 0 };
+    auto levels = _options._levels_per_exchange;
+    return do_with(state {}, [this, id, levels, local] (state& s) {
+        return repeat([this, id, levels, local, &s] {
+            if (s.roots.empty()) {
+                return make_ready_future<stop_iteration>(stop_iteration::yes);
+            }
+            auto roots = s.roots;
+            return netw::get_local_messaging_service().send_repair_tree(id, _options._timeout, std::move(roots), levels).then([this, levels, local, &s] (std::vector<uint64_t> nodes) {
+                _stats._exchanged_nodes += nodes.size();
+                std::vector<uint64_t> next;
+                size_t i = 0;
+                for (auto root : s.roots) {
+                    merkle_tree::for_each_subtree_node(root, levels, [&] (size_t n, bool bottom) {
+                        if (i >= nodes.size()) {
+                            throw std::runtime_error("short repair tree reply");
+                        }
+                        auto remote = nodes[i++];
+                        if (!bottom || remote == local->node(n)) {
+                            return;
+                        }
+                        if (merkle_tree::is_leaf(n)) {
+                            s.slots.push_back(merkle_tree::slot_of(n));
+                        } else {
+                            next.push_back(n);
+                        }
+                    });
+                }
+                s.roots = std::move(next);
+                return stop_iteration::no;
+            });
+        }).then([&s] {
+            return std::move(s.slots);
+        });
+    });
+}
+
+future<std::vector<bytes>> repair_service::local_keys(std::vector<uint32_t> slots)
+{
+    auto set = slot_set(slots);
+    return do_with(std::vector<bytes>(), [this, set] (auto& keys) {
+        return do_for_each(boost::irange<unsigned>(0, smp::count), [this, set, &keys] (unsigned cpu) {
+            return do_with(size_t(0), [this, set, cpu, &keys] (size_t& cursor) {
+                return repeat([this, set, cpu, &keys, &cursor] {
+                    auto s = set.get();
+                    return get_database().invoke_on(cpu, [cursor, count = _options._scan_count, s] (database& db) {
+                        // The set is only read here, while the repair waits.
+                        return db.keys_direct(cursor, count, [s] (bytes_view key) {
+                            return in_slots(*s, key);
+                        });
+                    }).then([&keys, &cursor] (foreign_ptr<lw_shared_ptr<database::scan_result_type>> result) {
+                        cursor = result->first;
+                        for (auto& key : result->second) {
+                            keys.emplace_back(std::move(key));
+                        }
+                        return cursor == 0 ? stop_iteration::yes : stop_iteration::no;
+                    });
+                });
+            });
+        }).then([&keys] {
+            return std::move(keys);
+        });
+    });
+}
+
+future<> repair_service::send(gms::inet_address replica, std::vector<command> commands)
+{
+    if (commands.empty()) {
+        return make_ready_future<>();
+    }
+    auto id = netw::msg_addr { replica, 0 };
+    return netw::get_local_messaging_service().send_stream_mutations(id, _options._timeout, std::move(commands));
+}
+
+future<> repair_service::sync_slots(gms::inet_address replica, std::vector<uint32_t> slots)
+{
+    // The replica ends up with the keys of these slots this node has and no
+    // others. Frames are applied one after the other and end between keys,
+    // so the DEL and the rebuild of a key never interleave with a write
+    // the primary streams meanwhile.
+    struct state {
+        lw_shared_ptr<std::vector<bool>> set;
+        std::unordered_set<bytes> local_keys;
+        std::vector<bytes> remote_keys;
+        std::vector<command> frame;
+    };
+    auto id = netw::msg_addr { replica, 0 };
+    auto set = slot_set(slots);
+    return netw::get_local_messaging_service().send_repair_keys(id, _options._timeout, std::move(slots)).then([this, replica, set] (std::vector<bytes> remote_keys) {
+        return do_with(state { set, {}, std::move(remote_keys), {} }, [this, replica] (state& st) {
+            return do_for_each(boost::irange<unsigned>(0, smp::count), [this, replica, &st] (unsigned cpu) {
+                return do_with(size_t(0), [this, replica, cpu, &st] (size_t& cursor) {
+                    return repeat([this, replica, cpu, &st, &cursor] {
+                        auto s = st.set.get();
+                        return get_database().invoke_on(cpu, [cursor, count = _options._scan_count, s] (database& db) {
+                            return db.dump_direct(cursor, count, [s] (bytes_view key) {
+                                return in_slots(*s, key);
+                            });
+                        }).then([this, replica, &st, &cursor] (foreign_ptr<lw_shared_ptr<database::dump_result_type>> result) {
+                            cursor = result->first;
+                            auto f = make_ready_future<>();
+                            for (auto& cmd : result->second) {
+                                if (st.local_keys.insert(cmd[1]).second) {
+                                    ++_stats._streamed_keys;
+                                    if (st.frame.size() >= _options._batch_commands) {
+                                        f = f.then([this, replica, frame = std::move(st.frame)] () mutable {
+                                            return send(replica, std::move(frame));
+                                        });
+                                        st.frame.clear();
+                                    }
+                                }
+                                st.frame.emplace_back(std::move(cmd));
+                            }
+                            return f.then([&cursor] {
+                                return cursor == 0 ? stop_iteration::yes : stop_iteration::no;
+                            });
+                        });
+                    });
+                });
+            }).then([this, replica, &st] {
+                command del { bytes { "del" } };
+                for (auto& key : st.remote_keys) {
+                    if (!st.local_keys.count(key)) {
+                        del.emplace_back(std::move(key));
+                        ++_stats._deleted_keys;
+                    }
+                }
+                if (del.size() > 1) {
+                    st.frame.emplace_back(std::move(del));
+                }
+                return send(replica, std::move(st.frame));
+            });
+        });
+    });
+}
+
+future<> repair_service::repair_with(gms::inet_address replica)
+{
+    auto me = utils::fb_utilities::get_broadcast_address();
+    ++_stats._active;
+    return build_tree(me, replica).then([this, replica] (merkle_tree tree) {
+        auto local = make_lw_shared<merkle_tree>(std::move(tree));
+        return differing_slots(replica, local);
+    }).then([this, replica] (std::vector<uint32_t> slots) {
+        _stats._differing_slots += slots.size();
+        if (slots.empty()) {
+            return make_ready_future<>();
+        }
+        return sync_slots(replica, std::move(slots));
+    }).then_wrapped([this] (future<> f) {
+        --_stats._active;
+        ++_stats._repairs;
+        if (f.failed()) {
+            ++_stats._failed_repairs;
+        }
+        return f;
+    });
+}
+
+future<> repair_service::repair()
+{
+    // The replicas of the ranges this node is the primary of, one at a
+    // time, so that a repair streams to one endpoint at once.
+    auto me = utils::fb_utilities::get_broadcast_address();
+    auto& ring = get_local_service().get_ring().snapshot();
+    std::vector<gms::inet_address> replicas;
+    for (auto& endpoint : ring.endpoints()) {
+        if (endpoint != me) {
+            replicas.push_back(endpoint);
+        }
+    }
+    return do_with(std::move(replicas), std::exception_ptr(), [this] (auto& replicas, std::exception_ptr& error) {
+        return do_for_each(replicas, [this, &error] (const gms::inet_address& replica) {
+            return repair_with(replica).handle_exception([&error] (std::exception_ptr ep) {
+                error = ep;
+            });
+        }).then([&error] {
+            if (error) {
+                return make_exception_future<>(error);
+            }
+            return make_ready_future<>();
+        });
+    });
+}
+
+void repair_service::start()
+{
+    if (engine().cpu_id() != 0 || _options._interval.count() == 0) {
+        return;
+    }
+    _timer.set_callback([this] {
+        with_gate(_gate, [this] {
+            return repair().handle_exception([] (std::exception_ptr) {
+                // counted in the stats, the next round tries again.
+            });
+        }).finally([this] {
+            if (!_gate.is_closed()) {
+                _timer.arm(_options._interval);
+            }
+        });
+    });
+    _timer.arm(_options._interval);
+}
+
+void repair_service::init_messaging_service()
+{
+    auto& ms = netw::get_local_messaging_service();
+    ms.register_repair_tree([this] (const rpc::client_info& cinfo, std::vector<uint64_t> roots, uint32_t levels) {
+        auto primary = netw::messaging_service::get_source(cinfo).addr;
+        auto me = utils::fb_utilities::get_broadcast_address();
+        return build_tree(primary, me).then([roots = std::move(roots), levels] (merkle_tree tree) {
+            std::vector<uint64_t> nodes;
+            for (auto root : roots) {
+                if (root == 0 || root >= merkle_tree::node_count) {
+                    throw std::invalid_argument("no such repair tree node");
+                }
+                merkle_tree::for_each_subtree_node(root, levels, [&nodes, &tree] (size_t n, bool) {
+                    nodes.push_back(tree.node(n));
+                });
+            }
+            return nodes;
+        });
+    });
+    ms.register_repair_keys([this] (const rpc::client_info& cinfo, std::vector<uint32_t> slots) {
+        return local_keys(std::move(slots));
+    });
+}
+
+future<> repair_service::stop()
+{
+    auto& ms = netw::get_local_messaging_service();
+    ms.unregister_repair_tree();
+    ms.unregister_repair_keys();
+    _timer.cancel();
+    return _gate.close();
+}
+}
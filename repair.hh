@@ -0,0 +1,100 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#pragma once
+#include "core/distributed.hh"
+#include "core/gate.hh"
+#include "core/timer.hh"
+#include <seastar/core/metrics.hh>
+#include "gms/inet_address.hh"
+#include "merkle_tree.hh"
+#include "utils/bytes.hh"
+#include <vector>
+namespace redis {
+class repair_service;
+extern distributed<repair_service> _the_repair_service;
+
+inline distributed<repair_service>& get_repair_service() {
+    return _the_repair_service;
+}
+
+inline repair_service& get_local_repair_service() {
+    return _the_repair_service.local();
+}
+
+struct repair_options {
+    // Shard 0 repairs the slots this node is the primary of this often, 0
+    // repairs on demand only.
+    std::chrono::seconds _interval { 600 };
+    // Levels of the trees compared by one exchange: the first one compares
+    // the top of the trees, the next ones the subtrees which differ.
+    unsigned _levels_per_exchange = 7;
+    // Commands of one frame streamed to a replica, and keys of one step of
+    // the scans.
+    size_t _batch_commands = 512;
+    size_t _scan_count = 512;
+    std::chrono::milliseconds _timeout { 10000 };
+};
+
+struct repair_stats {
+    uint64_t _repairs = 0;
+    uint64_t _failed_repairs = 0;
+    uint64_t _exchanged_nodes = 0;
+    uint64_t _differing_slots = 0;
+    uint64_t _streamed_keys = 0;
+    uint64_t _deleted_keys = 0;
+    uint64_t _active = 0;
+};
+
+// Anti-entropy repair: the primary of some slots compares the Merkle tree
+// of their digests with that of each of their replicas, and streams to the
+// replica the keys of the slots which differ only, the commands rebuilding
+// its keys and DELs for the keys it has not. The cost of a repair follows
+// the divergence: a few exchanges of tree nodes when the replicas agree.
+// The trees of a node combine the digests of all its shards, see
+// cache::slot_digests(); only slots the two endpoints share count.
+class repair_service : public seastar::async_sharded_service<repair_service> {
+    using command = std::vector<bytes>;
+    repair_options _options;
+    repair_stats _stats;
+    timer<lowres_clock> _timer;
+    seastar::gate _gate;
+    seastar::metrics::metric_groups _metrics;
+private:
+    void setup_metrics();
+    // The tree of the slots `primary` is the primary of and `replica` a
+    // replica of, from the digests of this node.
+    future<merkle_tree> build_tree(gms::inet_address primary, gms::inet_address replica);
+    future<std::vector<uint32_t>> differing_slots(gms::inet_address replica, lw_shared_ptr<merkle_tree> local);
+    future<> sync_slots(gms::inet_address replica, std::vector<uint32_t> slots);
+    future<std::vector<bytes>> local_keys(std::vector<uint32_t> slots);
+    future<> send(gms::inet_address replica, std::vector<command> commands);
+public:
+    repair_service(repair_options options = repair_options {});
+
+    // Repairs every replica of the slots this node is the primary of.
+    future<> repair();
+    future<> repair_with(gms::inet_address replica);
+    void start();
+    const repair_stats& stats() const { return _stats; }
+    void init_messaging_service();
+    future<> stop();
+};
+}
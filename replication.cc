@@ -0,0 +1,492 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#include "replication.hh"
+#include "db.hh"
+#include "proxy.hh"
+#include "ring.hh"
+#include "service.hh"
+#include "message/messaging_service.hh"
+#include "utils/fb_utilities.hh"
+#include "core/future-util.hh"
+#include "core/sleep.hh"
+#include <boost/range/irange.hpp>
+#include <set>
+namespace redis {
+
+distributed<replication_manager> _the_replication_manager;
+
+// Whether `replica` tails the records of the key from the log of `primary`.
+static bool tails(const ring_snapshot& ring, bytes_view key, const gms::inet_address& primary, const gms::inet_address& replica)
+{
+    if (ring.empty()) {
+        return false;
+    }
+    auto t = token_value(key);
+    if (ring.primary_replica(t) != primary || primary == replica) {
+        return false;
+    }
+    bool found = false;
+    ring.for_each_replica(t, [&found, &replica] (const gms::inet_address& endpoint) {
+        found |= endpoint == replica;
+    });
+    return found;
+}
+
+static bool tails(const ring& r, bytes_view key, const gms::inet_address& primary, const gms::inet_address& replica)
+{
+    return tails(r.snapshot(), key, primary, replica) || tails(r.pending_snapshot(), key, primary, replica);
+}
+
+// Whether the token is in one of the ranges, pairs of an exclusive start and
+// an inclusive end, wrapping round the ring when the start is not below the
+// end. No ranges hold every token.
+static bool in_ranges(const std::vector<uint64_t>& ranges, uint64_t t)
+{
+    if (ranges.empty()) {
+        return true;
+    }
+    for (size_t i = 0; i + 1 < ranges.size(); i += 2) {
+        auto start = ranges[i];
+        auto end = ranges[i + 1];
+        if (start < end ? (t > start && t <= end) : (t > start || t <= end)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// The token ranges `endpoint` is the primary of.
+static std::vector<uint64_t> primary_ranges(const ring_snapshot& ring, const gms::inet_address& endpoint)
+{
+    std::vector<uint64_t> ranges;
+    auto& tokens = ring.tokens();
+    for (size_t i = 0; i < tokens.size(); ++i) {
+        if (ring.primary_replica(tokens[i]) == endpoint) {
+            ranges.push_back(tokens[i == 0 ? tokens.size() - 1 : i - 1]);
+            ranges.push_back(tokens[i]);
+        }
+    }
+    return ranges;
+}
+
+static std::vector<std::vector<bytes>> to_commands(foreign_ptr<lw_shared_ptr<database::dump_result_type>> result)
+{
+    std::vector<std::vector<bytes>> commands;
+    commands.reserve(result->second.size() + 1);
+    auto cursor = to_sstring(result->first);
+    commands.emplace_back(std::vector<bytes> { bytes { cursor.data(), cursor.size() } });
+    for (auto& cmd : result->second) {
+        commands.emplace_back(std::move(cmd));
+    }
+    return commands;
+}
+
+static bytes to_bytes(uint64_t n)
+{
+    auto s = to_sstring(n);
+    return bytes { s.data(), s.size() };
+}
+
+replication_manager::replication_manager(replication_options options)
+    : _options(options)
+{
+    setup_metrics();
+}
+
+void replication_manager::setup_metrics()
+{
+    namespace sm = seastar::metrics;
+    _metrics.add_group("replication", {
+        sm::make_counter("pulls_total", [this] { return _stats._pulls; }, sm::description("Total number of pulls of the logs of primaries.")),
+        sm::make_counter("pulled_bytes_total", [this] { return _stats._pulled_bytes; }, sm::description("Total number of bytes of records pulled from primaries.")),
+        sm::make_counter("failed_pulls_total", [this] { return _stats._failed_pulls; }, sm::description("Total number of pulls which failed.")),
+        sm::make_counter("applied_records_total", [this] { return _stats._applied_records; }, sm::description("Total number of pulled records applied on this node.")),
+        sm::make_counter("skipped_records_total", [this] { return _stats._skipped_records; }, sm::description("Total number of pulled records of keys this node does not replicate.")),
+        sm::make_counter("full_syncs_total", [this] { return _stats._full_syncs; }, sm::description("Total number of full copies from primaries.")),
+        sm::make_counter("served_pulls_total", [this] { return _stats._served_pulls; }, sm::description("Total number of pulls of the logs of this node served.")),
+        sm::make_counter("served_bytes_total", [this] { return _stats._served_bytes; }, sm::description("Total number of bytes of records served to replicas.")),
+        sm::make_gauge("sessions", [this] { return _stats._active_sessions; }, sm::description("Number of logs of primaries this shard tails.")),
+        sm::make_counter("dc_pulls_total", [this] { return _stats._dc_pulls; }, sm::description("Total number of pulls of the logs of another datacenter.")),
+        sm::make_counter("dc_pulled_bytes_total", [this] { return _stats._dc_pulled_bytes; }, sm::description("Total number of bytes of records pulled from another datacenter, before compression.")),
+        sm::make_counter("dc_read_bytes_total", [this] { return _stats._dc_read_bytes; }, sm::description("Total number of bytes of the logs of another datacenter read for the pulls of this shard.")),
+        sm::make_counter("dc_full_syncs_total", [this] { return _stats._dc_full_syncs; }, sm::description("Total number of full copies from another datacenter.")),
+    });
+}
+
+void replication_manager::update_dc_sources()
+{
+    if (_options._dc_sources.empty()) {
+        return;
+    }
+    // A node alone, without a ring, copies every key.
+    auto me = utils::fb_utilities::get_broadcast_address();
+    auto& ring = get_local_service().get_ring().snapshot();
+    auto ranges = ring.empty() ? std::vector<uint64_t>() : primary_ranges(ring, me);
+    bool copies = ring.empty() || !ranges.empty();
+    if (ranges != _dc_ranges || !copies) {
+        // The sessions start over with a full copy of the new ranges.
+        for (auto it = _sessions.begin(); it != _sessions.end();) {
+            if (!it->second->_cross_dc) {
+                ++it;
+                continue;
+            }
+            it->second->_stopped = true;
+            it = _sessions.erase(it);
+        }
+    }
+    _dc_ranges = std::move(ranges);
+    if (!copies) {
+        return;
+    }
+    for (auto& source : _options._dc_sources) {
+        start_session(source, engine().cpu_id(), true);
+    }
+}
+
+void replication_manager::update_primaries()
+{
+    update_dc_sources();
+    if (!_options._enabled) {
+        return;
+    }
+    auto me = utils::fb_utilities::get_broadcast_address();
+    auto& r = get_local_service().get_ring();
+    std::set<gms::inet_address> primaries;
+    for (auto snapshot : { &r.snapshot(), &r.pending_snapshot() }) {
+        if (snapshot->empty()) {
+            continue;
+        }
+        for (auto t : snapshot->tokens()) {
+            bool replica = false;
+            snapshot->for_each_replica(t, [&replica, &me] (const gms::inet_address& endpoint) {
+                replica |= endpoint == me;
+            });
+            auto& primary = snapshot->primary_replica(t);
+            if (replica && primary != me) {
+                primaries.insert(primary);
+            }
+        }
+    }
+    for (auto it = _sessions.begin(); it != _sessions.end();) {
+        if (it->second->_cross_dc || primaries.count(it->first.first)) {
+            ++it;
+            continue;
+        }
+        it->second->_stopped = true;
+        it = _sessions.erase(it);
+    }
+    // The other shards of each primary are found by the first pull.
+    for (auto& primary : primaries) {
+        start_session(primary, engine().cpu_id());
+    }
+}
+
+void replication_manager::start_session(gms::inet_address primary, unsigned shard, bool cross_dc)
+{
+    auto key = std::make_pair(primary, shard);
+    if (_gate.is_closed() || _sessions.count(key)) {
+        return;
+    }
+    auto s = make_lw_shared<session>(primary, shard, cross_dc);
+    _sessions.emplace(key, s);
+    with_gate(_gate, [this, s] {
+        return run(s);
+    }).finally([this, s, key] {
+        auto it = _sessions.find(key);
+        if (it != _sessions.end() && it->second == s) {
+            _sessions.erase(it);
+        }
+    });
+}
+
+future<> replication_manager::run(lw_shared_ptr<session> s)
+{
+    ++_stats._active_sessions;
+    return repeat([this, s] {
+        if (s->_stopped) {
+            return make_ready_future<stop_iteration>(stop_iteration::yes);
+        }
+        return (s->_cross_dc ? pull_dc(s) : pull(s)).then_wrapped([this, s] (future<bool> f) {
+            auto wait = s->_cross_dc ? _options._dc_poll_interval : _options._poll_interval;
+            try {
+                if (!f.get0()) {
+                    return make_ready_future<stop_iteration>(stop_iteration::no);
+                }
+            } catch (...) {
+                ++_stats._failed_pulls;
+                wait = _options._retry_interval;
+            }
+            if (s->_stopped) {
+                return make_ready_future<stop_iteration>(stop_iteration::yes);
+            }
+            return sleep(wait).then([] {
+                return stop_iteration::no;
+            });
+        });
+    }).finally([this] {
+        --_stats._active_sessions;
+    });
+}
+
+future<bool> replication_manager::pull(lw_shared_ptr<session> s)
+{
+    auto id = netw::msg_addr { s->_primary, 0 };
+    ++_stats._pulls;
+    return netw::get_local_messaging_service().send_replication_pull(id, _options._timeout, s->_shard, s->_replication_id, s->_offset, _options._max_pull_bytes)
+            .then([this, s] (replication_pull_reply reply) {
+        auto offset = reply.cursor.offset;
+        auto shards = reply.cursor.shards;
+        if (s->_shard >= shards) {
+            s->_stopped = true;
+            return make_ready_future<bool>(true);
+        }
+        if (s->_shard + smp::count < shards) {
+            start_session(s->_primary, s->_shard + smp::count);
+        }
+        // Another run of the primary, or an offset its log no longer holds.
+        if (reply.replication_id != s->_replication_id || offset != s->_offset) {
+            return full_sync(s, std::move(reply.replication_id), offset).then([] {
+                return false;
+            });
+        }
+        auto& frames = reply.frames;
+        if (frames.empty()) {
+            return make_ready_future<bool>(true);
+        }
+        auto size = frames.size();
+        _stats._pulled_bytes += size;
+        return apply(s, std::move(frames)).then([s, offset, size] {
+            s->_offset = offset + size;
+            get_local_database().set_primary_offset(sprint("%s", s->_primary), s->_shard, s->_offset);
+            return false;
+        });
+    });
+}
+
+future<bool> replication_manager::pull_dc(lw_shared_ptr<session> s)
+{
+    auto id = netw::msg_addr { s->_primary, 0 };
+    ++_stats._dc_pulls;
+    return netw::get_local_messaging_service().send_replication_pull_dc(id, _options._dc_timeout, s->_shard, s->_replication_id, s->_offset, _options._dc_max_pull_bytes, _dc_ranges)
+            .then([this, s] (replication_dc_pull_reply reply) {
+        auto offset = reply.cursor.offset;
+        auto shards = reply.cursor.shards;
+        if (s->_shard >= shards) {
+            s->_stopped = true;
+            return make_ready_future<bool>(true);
+        }
+        if (s->_shard + smp::count < shards) {
+            start_session(s->_primary, s->_shard + smp::count, true);
+        }
+        if (reply.replication_id != s->_replication_id || offset != s->_offset) {
+            return full_sync(s, std::move(reply.replication_id), offset).then([] {
+                return false;
+            });
+        }
+        // The records of the other ranges were dropped by the source, the
+        // log is read on past them all the same.
+        auto read = reply.read_bytes;
+        if (read == 0) {
+            return make_ready_future<bool>(true);
+        }
+        _stats._dc_pulled_bytes += reply.frames.size();
+        _stats._dc_read_bytes += read;
+        return apply(s, std::move(reply.frames)).then([s, offset, read] {
+            s->_offset = offset + read;
+            get_local_database().set_primary_offset(sprint("%s", s->_primary), s->_shard, s->_offset);
+            return false;
+        });
+    });
+}
+
+future<> replication_manager::apply(lw_shared_ptr<session> s, bytes frames)
+{
+    // The records keep the order of the log on each shard, a key never
+    // changes shards.
+    auto me = utils::fb_utilities::get_broadcast_address();
+    auto& r = get_local_service().get_ring();
+    std::vector<bytes> batches(smp::count);
+    store::for_each_framed_record(frames.data(), frames.size(), [this, s, &me, &r, &batches] (const char* record, size_t size) {
+        decoded_mutation m;
+        try {
+            m = decode_mutation(bytes_view { record, size });
+        } catch (const std::out_of_range&) {
+            return;
+        }
+        if (s->_cross_dc ? !in_ranges(_dc_ranges, token_value(m._key)) : !tails(r, m._key, s->_primary, me)) {
+            ++_stats._skipped_records;
+            return;
+        }
+        redis_key rk { bytes { m._key.data(), m._key.size() } };
+        batches[rk.get_cpu()].append(record - store::HEADER_SIZE, store::HEADER_SIZE + size);
+    });
+    return do_with(std::move(batches), [this] (auto& batches) {
+        return parallel_for_each(boost::irange<unsigned>(0, smp::count), [this, &batches] (unsigned cpu) {
+            if (batches[cpu].empty()) {
+                return make_ready_future<>();
+            }
+            return get_database().invoke_on(cpu, [frames = std::move(batches[cpu])] (database& db) mutable {
+                return db.apply_replicated(std::move(frames));
+            }).then([this] (size_t applied) {
+                _stats._applied_records += applied;
+            });
+        });
+    });
+}
+
+future<> replication_manager::full_sync(lw_shared_ptr<session> s, bytes replication_id, uint64_t offset)
+{
+    // The records from `offset` are applied after the copy, so the writes
+    // made during it are not lost.
+    ++(s->_cross_dc ? _stats._dc_full_syncs : _stats._full_syncs);
+    auto id = netw::msg_addr { s->_primary, 0 };
+    return do_with(uint64_t(0), [this, s, id] (uint64_t& cursor) {
+        return repeat([this, s, id, &cursor] {
+            auto& ms = netw::get_local_messaging_service();
+            auto dump = s->_cross_dc ? ms.send_replication_dump_dc(id, _options._dc_timeout, s->_shard, cursor, _dc_ranges)
+                                     : ms.send_replication_dump(id, _options._timeout, s->_shard, cursor);
+            return dump.then([&cursor] (std::vector<command> commands) {
+                if (commands.empty() || commands.front().size() != 1) {
+                    throw std::runtime_error("malformed replication dump reply");
+                }
+                cursor = std::strtoull(commands.front().front().c_str(), nullptr, 10);
+                commands.erase(commands.begin());
+                return proxy::execute_batch(std::move(commands)).then([&cursor] (auto&&) {
+                    return cursor == 0 ? stop_iteration::yes : stop_iteration::no;
+                });
+            });
+        });
+    }).then([s, replication_id = std::move(replication_id), offset] () mutable {
+        s->_replication_id = std::move(replication_id);
+        s->_offset = offset;
+        get_local_database().set_primary_offset(sprint("%s", s->_primary), s->_shard, offset);
+    });
+}
+
+void replication_manager::init_messaging_service()
+{
+    auto& ms = netw::get_local_messaging_service();
+    ms.register_replication_pull([this] (const rpc::client_info& cinfo, uint32_t shard, bytes replication_id, uint64_t offset, uint32_t max_bytes) {
+        uint32_t shards = smp::count;
+        if (shard >= smp::count) {
+            return make_ready_future<replication_pull_reply>(replication_pull_reply { bytes {}, { 0, shards }, bytes {} });
+        }
+        ++_stats._served_pulls;
+        auto replica = sprint("%s", netw::messaging_service::get_source(cinfo).addr);
+        return get_database().invoke_on(shard, [replica = std::move(replica), replication_id = std::move(replication_id), offset, max_bytes, shards] (database& db) {
+            // A replica of another run, or behind what the log holds, is
+            // given the current offset to copy the keys from.
+            auto current = [&db, shards] {
+                return replication_pull_reply { bytes { db.replication_id().data(), db.replication_id().size() }, { db.replication_offset(), shards }, bytes {} };
+            };
+            if (replication_id != bytes { db.replication_id().data(), db.replication_id().size() }) {
+                return make_ready_future<replication_pull_reply>(current());
+            }
+            return db.read_replication_log(replica, offset, max_bytes).then([current, replication_id, offset, shards] (store::log_records r) {
+                if (!r._available) {
+                    return current();
+                }
+                return replication_pull_reply { replication_id, { offset, shards }, bytes { r._frames.get(), r._frames.size() } };
+            });
+        }).then([this] (replication_pull_reply reply) {
+            _stats._served_bytes += reply.frames.size();
+            return reply;
+        });
+    });
+    ms.register_replication_dump([this] (const rpc::client_info& cinfo, uint32_t shard, uint64_t cursor) {
+        if (shard >= smp::count) {
+            return make_ready_future<std::vector<command>>(std::vector<command> { command { to_bytes(0) } });
+        }
+        auto replica = netw::messaging_service::get_source(cinfo).addr;
+        auto me = utils::fb_utilities::get_broadcast_address();
+        return get_database().invoke_on(shard, [cursor, count = _options._dump_keys, replica, me] (database& db) {
+            auto& r = get_local_service().get_ring();
+            return db.dump_direct(cursor, count, [&r, replica, me] (bytes_view key) {
+                return tails(r, key, me, replica);
+            });
+        }).then(to_commands);
+    });
+    ms.register_replication_pull_dc([this] (const rpc::client_info& cinfo, uint32_t shard, bytes replication_id, uint64_t offset, uint32_t max_bytes, std::vector<uint64_t> ranges) {
+        uint32_t shards = smp::count;
+        if (shard >= smp::count) {
+            return make_ready_future<replication_dc_pull_reply>(replication_dc_pull_reply { bytes {}, { 0, shards }, 0, bytes {} });
+        }
+        ++_stats._served_pulls;
+        auto replica = sprint("%s", netw::messaging_service::get_source(cinfo).addr);
+        return get_database().invoke_on(shard, [replica = std::move(replica), replication_id = std::move(replication_id), offset, max_bytes, shards, ranges = std::move(ranges)] (database& db) {
+            auto current = [&db, shards] {
+                return replication_dc_pull_reply { bytes { db.replication_id().data(), db.replication_id().size() }, { db.replication_offset(), shards }, 0, bytes {} };
+            };
+            if (replication_id != bytes { db.replication_id().data(), db.replication_id().size() }) {
+                return make_ready_future<replication_dc_pull_reply>(current());
+            }
+            return db.read_replication_log(replica, offset, max_bytes).then([current, replication_id, offset, shards, ranges] (store::log_records r) {
+                if (!r._available) {
+                    return current();
+                }
+                // Dropped on the shard which read them, before they cross
+                // the WAN.
+                bytes frames;
+                store::for_each_framed_record(r._frames.get(), r._frames.size(), [&frames, &ranges] (const char* record, size_t size) {
+                    decoded_mutation m;
+                    try {
+                        m = decode_mutation(bytes_view { record, size });
+                    } catch (const std::out_of_range&) {
+                        return;
+                    }
+                    if (in_ranges(ranges, token_value(m._key))) {
+                        frames.append(record - store::HEADER_SIZE, store::HEADER_SIZE + size);
+                    }
+                });
+                return replication_dc_pull_reply { replication_id, { offset, shards }, r._frames.size(), std::move(frames) };
+            });
+        }).then([this] (replication_dc_pull_reply reply) {
+            _stats._served_bytes += reply.frames.size();
+            return reply;
+        });
+    });
+    ms.register_replication_dump_dc([this] (const rpc::client_info& cinfo, uint32_t shard, uint64_t cursor, std::vector<uint64_t> ranges) {
+        if (shard >= smp::count) {
+            return make_ready_future<std::vector<command>>(std::vector<command> { command { to_bytes(0) } });
+        }
+        return get_database().invoke_on(shard, [cursor, count = _options._dump_keys, ranges = std::move(ranges)] (database& db) {
+            return db.dump_direct(cursor, count, [&ranges] (bytes_view key) {
+                return in_ranges(ranges, token_value(key));
+            });
+        }).then(to_commands);
+    });
+    // A copy of another datacenter starts tailing it once it can pull.
+    update_dc_sources();
+}
+
+future<> replication_manager::stop()
+{
+    auto& ms = netw::get_local_messaging_service();
+    ms.unregister_replication_pull();
+    ms.unregister_replication_dump();
+    ms.unregister_replication_pull_dc();
+    ms.unregister_replication_dump_dc();
+    for (auto& e : _sessions) {
+        e.second->_stopped = true;
+    }
+    return _gate.close();
+}
+}
@@ -0,0 +1,169 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#pragma once
+#include "core/distributed.hh"
+#include "core/gate.hh"
+#include <seastar/core/metrics.hh>
+#include "gms/inet_address.hh"
+#include "utils/bytes.hh"
+#include <map>
+#include <vector>
+namespace redis {
+class ring_snapshot;
+class replication_manager;
+extern distributed<replication_manager> _the_replication_manager;
+
+inline distributed<replication_manager>& get_replication_manager() {
+    return _the_replication_manager;
+}
+
+inline replication_manager& get_local_replication_manager() {
+    return _the_replication_manager.local();
+}
+
+struct replication_options {
+    // Replicas tail the commit logs of the primaries. It goes with
+    // proxy_options::_log_replication, which stops the proxy from sending
+    // the writes to the replicas itself.
+    bool _enabled = false;
+    // Bytes of records one pull returns at most.
+    size_t _max_pull_bytes = 1024 * 1024;
+    // A replica which caught up pulls again after this long, one whose pull
+    // failed after _retry_interval.
+    std::chrono::milliseconds _poll_interval { 10 };
+    std::chrono::milliseconds _retry_interval { 1000 };
+    std::chrono::milliseconds _timeout { 5000 };
+    // Keys of one step of a full copy.
+    size_t _dump_keys = 512;
+    // The nodes of another datacenter this one is an asynchronous copy of,
+    // tailed whether or not _enabled is. Across the WAN the pulls are
+    // larger and less frequent, so that the records are sent in large
+    // frames, which compress better.
+    std::vector<gms::inet_address> _dc_sources;
+    size_t _dc_max_pull_bytes = 8 * 1024 * 1024;
+    std::chrono::milliseconds _dc_poll_interval { 200 };
+    std::chrono::milliseconds _dc_timeout { 30000 };
+};
+
+// Where a pull left the log of a primary shard: the offset the frames
+// start at, or that a full copy starts from, and the shards of the primary.
+// See idl/replication.idl.hh.
+struct replication_cursor {
+    uint64_t offset = 0;
+    uint32_t shards = 0;
+};
+
+// The reply to a pull, the records of the log from the cursor on.
+struct replication_pull_reply {
+    bytes replication_id;
+    replication_cursor cursor;
+    bytes frames;
+};
+
+// The reply to a pull from another datacenter: the records of the token
+// ranges of the caller out of the `read_bytes` bytes of the log read from
+// the cursor on.
+struct replication_dc_pull_reply {
+    bytes replication_id;
+    replication_cursor cursor;
+    uint64_t read_bytes = 0;
+    bytes frames;
+};
+
+struct replication_stats {
+    uint64_t _pulls = 0;
+    uint64_t _pulled_bytes = 0;
+    uint64_t _failed_pulls = 0;
+    uint64_t _applied_records = 0;
+    // Records of the keys this node does not replicate.
+    uint64_t _skipped_records = 0;
+    uint64_t _full_syncs = 0;
+    uint64_t _served_pulls = 0;
+    uint64_t _served_bytes = 0;
+    uint64_t _active_sessions = 0;
+    // Of the sessions tailing another datacenter, the bytes of the records
+    // received, and those of the logs the sources read for them.
+    uint64_t _dc_pulls = 0;
+    uint64_t _dc_pulled_bytes = 0;
+    uint64_t _dc_read_bytes = 0;
+    uint64_t _dc_full_syncs = 0;
+};
+
+// Replicates the writes by tailing the commit logs of the primaries rather
+// than by the proxy sending each write to every replica. A replica pulls the
+// records of each shard of a primary from its offset in that log, and applies
+// those of the keys it replicates in batches on the shards owning them, as
+// they are: see database::apply_replicated(). A replica which has no offset
+// in the log, because it is new or because the primary restarted, first
+// copies the keys whole, then tails the log from where it was at the start
+// of the copy. Shard N of a primary is tailed by the shard N % smp::count of
+// the replica.
+//
+// A node may also be the copy of the nodes of another datacenter, of the
+// keys whose tokens it is the primary of in its own ring: the sources send
+// it only the records of those ranges, so that each record crosses the WAN
+// once, to the node which applies it, and its replicas tail it as they tail
+// any write. The records of a key are applied in the order of the log of
+// the source shard owning it, the last write wins as on the source.
+class replication_manager : public seastar::async_sharded_service<replication_manager> {
+    using command = std::vector<bytes>;
+    struct session {
+        gms::inet_address _primary;
+        unsigned _shard;
+        bytes _replication_id;
+        uint64_t _offset = 0;
+        // Tails a source of another datacenter.
+        bool _cross_dc;
+        bool _stopped = false;
+        session(gms::inet_address primary, unsigned shard, bool cross_dc)
+            : _primary(primary), _shard(shard), _cross_dc(cross_dc) {}
+    };
+    replication_options _options;
+    replication_stats _stats;
+    std::map<std::pair<gms::inet_address, unsigned>, lw_shared_ptr<session>> _sessions;
+    // The token ranges this node copies from the other datacenter, pairs of
+    // an exclusive start and an inclusive end, empty for all of them.
+    std::vector<uint64_t> _dc_ranges;
+    seastar::gate _gate;
+    seastar::metrics::metric_groups _metrics;
+private:
+    void setup_metrics();
+    void start_session(gms::inet_address primary, unsigned shard, bool cross_dc = false);
+    void update_dc_sources();
+    future<> run(lw_shared_ptr<session> s);
+    // Resolves to true once the replica caught up with the primary.
+    future<bool> pull(lw_shared_ptr<session> s);
+    future<bool> pull_dc(lw_shared_ptr<session> s);
+    future<> full_sync(lw_shared_ptr<session> s, bytes replication_id, uint64_t offset);
+    future<> apply(lw_shared_ptr<session> s, bytes frames);
+public:
+    replication_manager(replication_options options = replication_options {});
+
+    // Tails the logs of the primaries of the keys this node replicates, in
+    // the current ring and the pending one, and stops tailing the others.
+    // Called on every shard when the ring changes, which also starts tailing
+    // the sources of another datacenter, see replication_options.
+    void update_primaries();
+    const replication_stats& stats() const { return _stats; }
+    void init_messaging_service();
+    future<> stop();
+};
+}
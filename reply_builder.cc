@@ -19,4 +19,31 @@
 *
 */
 #include "reply_builder.hh"
-namespace redis {}
+namespace redis {
+
+constexpr size_t shared_replies::integers;
+constexpr size_t shared_replies::headers;
+
+template <size_t Count, size_t Width, typename Render>
+static shared_replies::table<Count, Width> make_table(Render&& render)
+{
+    shared_replies::table<Count, Width> t;
+    for (size_t n = 0; n < Count; ++n) {
+        t.size[n] = render(t.data[n], n);
+    }
+    return t;
+}
+
+const shared_replies::table<shared_replies::integers, 8> shared_replies::_integers =
+    make_table<integers, 8>([] (char* out, size_t n) { return render_number(out, ':', n); });
+
+const shared_replies::table<shared_replies::integers, 16> shared_replies::_bulk_integers =
+    make_table<integers, 16>([] (char* out, size_t n) { return render_bulk_integer(out, n); });
+
+const shared_replies::table<shared_replies::headers, 8> shared_replies::_bulk_headers =
+    make_table<headers, 8>([] (char* out, size_t n) { return render_number(out, '$', n); });
+
+const shared_replies::table<shared_replies::headers, 8> shared_replies::_multi_bulk_headers =
+    make_table<headers, 8>([] (char* out, size_t n) { return render_number(out, '*', n); });
+
+}
@@ -35,69 +35,490 @@
 #include "net/packet-data-source.hh"
 #include "cache.hh"
 #include "structures/dict_lsa.hh"
+#include "structures/packed_dict.hh"
 #include "structures/sset_lsa.hh"
 #include "structures/geo.hh"
 #include "keys.hh"
+#include "utils/float_string.hh"
+#include <experimental/optional>
 namespace redis {
 using scattered_message_ptr = foreign_ptr<lw_shared_ptr<scattered_message<char>>>;
 
-static const bytes msg_crlf {"\r\n"};
-static const bytes msg_ok {"+OK\r\n"};
-static const bytes msg_pong {"+PONG\r\n"};
-static const bytes msg_err = {"-ERR\r\n"};
-static const bytes msg_zero = {":0\r\n"};
-static const bytes msg_one = {":1\r\n"};
-static const bytes msg_neg_one = {":-1\r\n"};
-static const bytes msg_neg_two = {":-2\r\n"};
-static const bytes msg_null_blik = {"$-1\r\n"};
-static const bytes msg_null_multi_bulk = {"*-1\r\n"};
-static const bytes msg_empty_multi_bulk = {"*0\r\n"};
-static const bytes msg_type_err = {"-WRONGTYPE Operation against a key holding the wrong kind of value\r\n"};
-static const bytes msg_nokey_err = {"-ERR no such key\r\n"};
-static const bytes msg_nocmd_err = {"-ERR no such command\r\n"};
-static const bytes msg_syntax_err = {"-ERR syntax error\r\n"};
-static const bytes msg_same_object_err = {"-ERR source and destination objects are the same\r\n"};
-static const bytes msg_out_of_range_err = {"-ERR index out of range\r\n"};
-static const bytes msg_not_integer_err = {"-ERR ERR hash value is not an integer\r\n" };
-static const bytes msg_not_float_err = {"-ERR ERR hash value is not an float\r\n" };
-static const bytes msg_str_tag = {"+"};
-static const bytes msg_num_tag = {":"};
-static const bytes msg_sigle_tag = {"*"};
-static const bytes msg_batch_tag = {"$"};
-static const bytes msg_not_found = {"+(nil)\r\n"};
-static const bytes msg_nil = {"+(nil)\r\n"};
+// The constant replies below live as long as the process, so a reply which
+// is one of them references it instead of copying it.
+struct static_reply : public bytes {
+    using bytes::bytes;
+};
+
+static const static_reply msg_crlf {"\r\n"};
+static const static_reply msg_ok {"+OK\r\n"};
+static const static_reply msg_pong {"+PONG\r\n"};
+static const static_reply msg_err = {"-ERR\r\n"};
+static const static_reply msg_zero = {":0\r\n"};
+static const static_reply msg_one = {":1\r\n"};
+static const static_reply msg_neg_one = {":-1\r\n"};
+static const static_reply msg_neg_two = {":-2\r\n"};
+static const static_reply msg_null_blik = {"$-1\r\n"};
+static const static_reply msg_null_multi_bulk = {"*-1\r\n"};
+static const static_reply msg_empty_multi_bulk = {"*0\r\n"};
+static const static_reply msg_empty_bulk = {"$0\r\n\r\n"};
+static const static_reply msg_empty_scan = {"*2\r\n$1\r\n0\r\n*0\r\n"};
+static const static_reply msg_type_err = {"-WRONGTYPE Operation against a key holding the wrong kind of value\r\n"};
+static const static_reply msg_nokey_err = {"-ERR no such key\r\n"};
+static const static_reply msg_nocmd_err = {"-ERR no such command\r\n"};
+static const static_reply msg_syntax_err = {"-ERR syntax error\r\n"};
+static const static_reply msg_same_object_err = {"-ERR source and destination objects are the same\r\n"};
+static const static_reply msg_out_of_range_err = {"-ERR index out of range\r\n"};
+static const static_reply msg_not_integer_err = {"-ERR ERR hash value is not an integer\r\n" };
+static const static_reply msg_not_float_err = {"-ERR ERR hash value is not an float\r\n" };
+static const static_reply msg_value_not_integer_err = {"-ERR value is not an integer or out of range\r\n" };
+static const static_reply msg_value_not_float_err = {"-ERR value is not a valid float\r\n" };
+static const static_reply msg_overflow_err = {"-ERR increment or decrement would overflow\r\n" };
+static const static_reply msg_bit_err = {"-ERR bit is not an integer or out of range\r\n" };
+static const static_reply msg_bit_offset_err = {"-ERR bit offset is not an integer or out of range\r\n" };
+static const static_reply msg_offset_err = {"-ERR offset is out of range\r\n" };
+static const static_reply msg_string_size_err = {"-ERR string exceeds maximum allowed size (512MB)\r\n" };
+static const static_reply msg_bitfield_type_err = {"-ERR Invalid bitfield type. Use something like i16 u8. Note that u64 is not supported but i64 is.\r\n" };
+static const static_reply msg_geo_unit_err = {"-ERR unsupported unit provided. please use m, km, ft, mi\r\n" };
+static const static_reply msg_geo_coord_err = {"-ERR invalid longitude,latitude pair\r\n" };
+static const static_reply msg_geo_member_err = {"-ERR could not decode requested zset member\r\n" };
+static const static_reply msg_geo_count_err = {"-ERR COUNT must be > 0\r\n" };
+static const static_reply msg_oom_err = {"-OOM command not allowed when used memory > 'memory_hard_limit'.\r\n" };
+static const static_reply msg_busy_err = {"-BUSY server is overloaded, try again later\r\n" };
+static const static_reply msg_bgsave_started = {"+Background saving started\r\n" };
+static const static_reply msg_bgsave_in_progress_err = {"-ERR Background save already in progress\r\n" };
+static const static_reply msg_save_err = {"-ERR the snapshot of a shard failed, see the log\r\n" };
+static const static_reply msg_db_index_err = {"-ERR DB index is out of range\r\n" };
+static const static_reply msg_flush_tiered_err = {"-ERR FLUSHALL is not supported with tiered storage\r\n" };
+static const static_reply msg_split_key_err = {"-ERR the command is not supported on a split key\r\n" };
+static const static_reply msg_dump_payload_err = {"-ERR DUMP payload version or checksum are wrong\r\n" };
+static const static_reply msg_busykey_err = {"-BUSYKEY Target key name already exists.\r\n" };
+static const static_reply msg_invalid_ttl_err = {"-ERR Invalid TTL value, must be >= 0\r\n" };
+static const static_reply msg_queued = {"+QUEUED\r\n" };
+static const static_reply msg_multi_nested_err = {"-ERR MULTI calls can not be nested\r\n" };
+static const static_reply msg_exec_without_multi_err = {"-ERR EXEC without MULTI\r\n" };
+static const static_reply msg_discard_without_multi_err = {"-ERR DISCARD without MULTI\r\n" };
+static const static_reply msg_watch_inside_multi_err = {"-ERR WATCH inside MULTI is not allowed\r\n" };
+static const static_reply msg_exec_abort_err = {"-EXECABORT Transaction discarded because of previous errors.\r\n" };
+static const static_reply msg_watched_changed_err = {"-ERR watched keys changed during EXEC\r\n" };
+static const static_reply msg_timeout_err = {"-ERR timeout is not a float or out of range\r\n" };
+static const static_reply msg_negative_timeout_err = {"-ERR timeout is negative\r\n" };
+static const static_reply msg_noscript_err = {"-NOSCRIPT No matching script. Please use EVAL.\r\n" };
+static const static_reply msg_script_negative_keys_err = {"-ERR Number of keys can't be negative\r\n" };
+static const static_reply msg_script_too_many_keys_err = {"-ERR Number of keys can't be greater than number of args\r\n" };
+static const static_reply msg_script_cross_shard_err = {"-CROSSSLOT Keys in script don't belong to the same shard\r\n" };
+static const static_reply msg_subscribed_context_err = {"-ERR only (P)SUBSCRIBE / (P)UNSUBSCRIBE / PING are allowed in this context\r\n" };
+static const static_reply msg_stream_id_err = {"-ERR Invalid stream ID specified as stream command argument\r\n" };
+static const static_reply msg_stream_id_zero_err = {"-ERR The ID specified in XADD must be greater than 0-0\r\n" };
+static const static_reply msg_stream_id_small_err = {"-ERR The ID specified in XADD is equal or smaller than the target stream top item\r\n" };
+static const static_reply msg_stream_unbalanced_err = {"-ERR Unbalanced XREAD list of streams: for each stream key an ID or '$' must be specified.\r\n" };
+static const static_reply msg_stream_no_group_err = {"-NOGROUP No such key or consumer group\r\n" };
+static const static_reply msg_stream_group_exists_err = {"-BUSYGROUP Consumer Group name already exists\r\n" };
+static const static_reply msg_ts_old_timestamp_err = {"-ERR TSDB: timestamp must be greater than the one of the last sample\r\n" };
+static const static_reply msg_ts_timestamp_err = {"-ERR TSDB: invalid timestamp\r\n" };
+static const static_reply msg_ts_value_err = {"-ERR TSDB: invalid value\r\n" };
+static const static_reply msg_ts_aggregation_err = {"-ERR TSDB: unknown aggregation type\r\n" };
+static const static_reply msg_bf_exists_err = {"-ERR item exists\r\n" };
+static const static_reply msg_bf_full_err = {"-ERR non scaling filter is full\r\n" };
+static const static_reply msg_bf_error_rate_err = {"-ERR (0 < error rate range < 1)\r\n" };
+static const static_reply msg_bf_capacity_err = {"-ERR (capacity should be larger than 0)\r\n" };
+static const static_reply msg_cms_exists_err = {"-ERR CMS: key already exists\r\n" };
+static const static_reply msg_cms_no_key_err = {"-ERR CMS: key does not exist\r\n" };
+static const static_reply msg_cms_dimensions_err = {"-ERR CMS: invalid width or depth\r\n" };
+static const static_reply msg_cms_probability_err = {"-ERR CMS: invalid error or probability\r\n" };
+static const static_reply msg_cms_increment_err = {"-ERR CMS: cannot parse number\r\n" };
+static const static_reply msg_topk_exists_err = {"-ERR TopK: key already exists\r\n" };
+static const static_reply msg_topk_no_key_err = {"-ERR TopK: key does not exist\r\n" };
+static const static_reply msg_topk_params_err = {"-ERR TopK: invalid k, width, depth or decay\r\n" };
+static const static_reply msg_stream_no_key_err = {"-ERR The XGROUP subcommand requires the key to exist. Note that for CREATE you may want to use the MKSTREAM option to create an empty stream automatically.\r\n" };
+static const static_reply msg_noproto_err = {"-NOPROTO unsupported protocol version\r\n" };
+static const static_reply msg_client_name_err = {"-ERR Client names cannot contain spaces, newlines or special characters.\r\n" };
+static const static_reply msg_tracking_redirect_err = {"-ERR The client ID you want redirect to does not exist\r\n" };
+static const static_reply msg_tracking_prefix_err = {"-ERR PREFIX option requires BCAST mode to be enabled\r\n" };
+static const static_reply msg_tracking_mode_err = {"-ERR You can't switch BCAST mode on/off before disabling tracking for this client, and then re-enabling it with a different mode.\r\n" };
+static const static_reply msg_tracking_option_err = {"-ERR OPTIN, OPTOUT and NOLOOP are not supported\r\n" };
+static const static_reply msg_str_tag = {"+"};
+static const static_reply msg_num_tag = {":"};
+static const static_reply msg_sigle_tag = {"*"};
+static const static_reply msg_batch_tag = {"$"};
+static const static_reply msg_not_found = {"+(nil)\r\n"};
+static const static_reply msg_nil = {"+(nil)\r\n"};
 static constexpr const int REDIS_OK = 0;
 static constexpr const int REDIS_ERR = 1;
 static constexpr const int REDIS_NONE = -1;
 static constexpr const int REDIS_WRONG_TYPE = -2;
-static const bytes msg_type_string {"+string\r\n"};
-static const bytes msg_type_none {"+none\r\n"};
-static const bytes msg_type_list {"+list\r\n"};
-static const bytes msg_type_hll {"+hyperloglog\r\n"};
-static const bytes msg_type_set {"+set\r\n"};
-static const bytes msg_type_zset {"+zset\r\n"};
-static const bytes msg_type_hash {"+hash\r\n"};
+static const static_reply msg_type_string {"+string\r\n"};
+static const static_reply msg_type_none {"+none\r\n"};
+static const static_reply msg_type_list {"+list\r\n"};
+static const static_reply msg_type_hll {"+hyperloglog\r\n"};
+static const static_reply msg_type_set {"+set\r\n"};
+static const static_reply msg_type_zset {"+zset\r\n"};
+static const static_reply msg_type_hash {"+hash\r\n"};
+
+// Shared immutable replies, like the shared objects of Redis: `:<n>\r\n`
+// and `$<size>\r\n<n>\r\n` for small integers, and the `$<n>\r\n` and
+// `*<n>\r\n` headers of short bulks and arrays. They live as long as the
+// process, so a reply appends them without a copy and without a deleter.
+class shared_replies final {
+public:
+    static constexpr size_t integers = 10000;
+    static constexpr size_t headers = 1024;
+    template <size_t Count, size_t Width>
+    struct table {
+        char data[Count][Width];
+        uint8_t size[Count];
+        bytes_view at(size_t n) const {
+            return { data[n], size[n] };
+        }
+    };
+private:
+    static const table<integers, 8> _integers;
+    static const table<integers, 16> _bulk_integers;
+    static const table<headers, 8> _bulk_headers;
+    static const table<headers, 8> _multi_bulk_headers;
+public:
+    static bytes_view integer(size_t n) { return _integers.at(n); }
+    static bytes_view bulk_integer(size_t n) { return _bulk_integers.at(n); }
+    static bytes_view bulk_header(size_t n) { return _bulk_headers.at(n); }
+    static bytes_view multi_bulk_header(size_t n) { return _multi_bulk_headers.at(n); }
+};
+
+// Renders `<tag><n>\r\n` at out, which has room for 24 characters, and
+// returns its size.
+inline size_t render_number(char* out, char tag, int64_t n)
+{
+    char digits[20];
+    size_t count = 0;
+    uint64_t u = n < 0 ? -static_cast<uint64_t>(n) : static_cast<uint64_t>(n);
+    do {
+        digits[count++] = '0' + u % 10;
+        u /= 10;
+    } while (u);
+    char* p = out;
+    *p++ = tag;
+    if (n < 0) {
+        *p++ = '-';
+    }
+    while (count) {
+        *p++ = digits[--count];
+    }
+    *p++ = '\r';
+    *p++ = '\n';
+    return p - out;
+}
+
+// Renders `$<size>\r\n<n>\r\n` at out, which has room for 32 characters,
+// and returns its size.
+inline size_t render_bulk_integer(char* out, int64_t n)
+{
+    char number[24];
+    auto size = render_number(number, ':', n);
+    auto header_size = render_number(out, '$', size - 3);
+    std::copy_n(number + 1, size - 1, out + header_size);
+    return header_size + size - 1;
+}
+
+// A reply small enough to cross shards by value: a constant reply, an
+// integer, a float or a value. The owner of the key returns it, and the
+// shard of the connection builds it into a message, which then neither
+// crosses shards nor goes back to the owner to be freed. A value held out
+// of the region is referenced rather than copied, and released on its
+// shard.
+struct reply_value {
+    enum class kind : uint8_t {
+        constant,
+        integer,
+        bulk_integer,
+        bulk_float,
+        bulk,
+    };
+    kind _kind = kind::constant;
+    // The constants live as long as the process, on every shard.
+    const static_reply* _constant = &msg_nil;
+    int64_t _integer = 0;
+    double _float = 0;
+    bytes _bulk;
+    foreign_ptr<std::unique_ptr<temporary_buffer<char>>> _shared;
+
+    static reply_value of(const static_reply& r)
+    {
+        reply_value v;
+        v._constant = &r;
+        return v;
+    }
+    static reply_value of_integer(int64_t n)
+    {
+        reply_value v;
+        v._kind = kind::integer;
+        v._integer = n;
+        return v;
+    }
+    static reply_value of_bulk_integer(int64_t n)
+    {
+        reply_value v;
+        v._kind = kind::bulk_integer;
+        v._integer = n;
+        return v;
+    }
+    static reply_value of_bulk_float(double d)
+    {
+        reply_value v;
+        v._kind = kind::bulk_float;
+        v._float = d;
+        return v;
+    }
+    static reply_value of_bulk(bytes b)
+    {
+        reply_value v;
+        v._kind = kind::bulk;
+        v._bulk = std::move(b);
+        return v;
+    }
+    static reply_value of_shared(temporary_buffer<char> b)
+    {
+        reply_value v;
+        v._kind = kind::bulk;
+        v._shared = make_foreign(std::make_unique<temporary_buffer<char>>(std::move(b)));
+        return v;
+    }
+};
+
+// The shard's chunks of small reply fragments, see reply_writer. A chunk is
+// freed once the arena moved on to the next one and the replies using it
+// are written.
+class reply_arena final {
+public:
+    static constexpr size_t chunk_size = 16 * 1024;
+    struct chunk {
+        std::unique_ptr<char[]> _data { new char[chunk_size] };
+        size_t _used = 0;
+        char* end() { return _data.get() + _used; }
+    };
+private:
+    lw_shared_ptr<chunk> _current;
+public:
+    // The chunk to write `size` bytes at the end of, a new one when the
+    // current one is short of room.
+    const lw_shared_ptr<chunk>& room(size_t size)
+    {
+        if (!_current || chunk_size - _current->_used < size) {
+            _current = make_lw_shared<chunk>();
+        }
+        return _current;
+    }
+};
+
+inline reply_arena& local_reply_arena()
+{
+    static thread_local reply_arena arena;
+    return arena;
+}
+
+// Appends to a reply like the functions of reply_builder, but copies the
+// fragments of up to max_fragment bytes one after the other into the arena
+// of the shard, and adds each run of them to the message as one fragment.
+// A reply of many short elements then costs a deleter for each chunk it
+// spans, rather than a buffer and a deleter for each element. The message
+// holds the chunks through foreign pointers, as it may be written by the
+// connection of another shard. The last run goes to the message on flush(),
+// which must come before the message is returned.
+class reply_writer final {
+    scattered_message<char>& _m;
+    lw_shared_ptr<reply_arena::chunk> _chunk;
+    char* _run = nullptr;
+    char* _end = nullptr;
+    // The chunk the message holds already.
+    reply_arena::chunk* _held = nullptr;
+
+    // Room for `size` bytes at the end of the run, a new run if another
+    // writer wrote after it or the arena moved on.
+    char* reserve(size_t size)
+    {
+        auto& c = local_reply_arena().room(size);
+        if (c.get() != _chunk.get() || c->end() != _end) {
+            flush();
+            _chunk = c;
+            _run = _end = c->end();
+        }
+        auto p = _end;
+        _end += size;
+        c->_used += size;
+        return p;
+    }
+public:
+    static constexpr size_t max_fragment = 512;
+
+    explicit reply_writer(scattered_message<char>& m) : _m(m) {}
+    reply_writer(const reply_writer&) = delete;
+    ~reply_writer() { flush(); }
+
+    void flush()
+    {
+        if (_run == _end) {
+            return;
+        }
+        _m.append_static(_run, _end - _run);
+        if (_held != _chunk.get()) {
+            _m.on_delete([c = make_foreign(_chunk)] {});
+            _held = _chunk.get();
+        }
+        _run = _end;
+    }
+    void append_static(const char* data, size_t size)
+    {
+        if (size > max_fragment) {
+            flush();
+            _m.append_static(data, size);
+            return;
+        }
+        std::copy_n(data, size, reserve(size));
+    }
+    void append_static(const static_reply& r)
+    {
+        append_static(r.data(), r.size());
+    }
+    void append_integer(int64_t n)
+    {
+        char buf[24];
+        append_static(buf, render_number(buf, ':', n));
+    }
+    void append_bulk_integer(int64_t n)
+    {
+        char buf[32];
+        append_static(buf, render_bulk_integer(buf, n));
+    }
+    void append_array_header(size_t elements)
+    {
+        char buf[24];
+        append_static(buf, render_number(buf, '*', elements));
+    }
+    // `$<size>\r\n<data>\r\n`, copied into the run, or into a fragment of
+    // its own when it is large.
+    void append_bulk(const char* data, size_t size)
+    {
+        char header[24];
+        auto header_size = render_number(header, '$', size);
+        if (size > max_fragment) {
+            append_static(header, header_size);
+            flush();
+            _m.append(sstring{data, size});
+            append_static(msg_crlf);
+            return;
+        }
+        auto p = reserve(header_size + size + 2);
+        p = std::copy_n(header, header_size, p);
+        p = std::copy_n(data, size, p);
+        *p++ = '\r';
+        *p = '\n';
+    }
+};
 
 class reply_builder final {
 public:
+// The functions below append through a reply_writer too.
+static void append_integer(reply_writer& w, int64_t n) { w.append_integer(n); }
+static void append_bulk_integer(reply_writer& w, int64_t n) { w.append_bulk_integer(n); }
+static void append_array_header(reply_writer& w, size_t elements) { w.append_array_header(elements); }
+static void append_bulk(reply_writer& w, const char* data, size_t size) { w.append_bulk(data, size); }
+static void append_bulk_float(reply_writer& w, double d)
+{
+    char buf[max_float_string];
+    w.append_bulk(buf, format_float_string(d, buf));
+}
+
+// `:<n>\r\n`, a shared reply for small integers and a single fragment for
+// the others.
+static void append_integer(scattered_message<char>& m, int64_t n)
+{
+    if (n >= 0 && static_cast<size_t>(n) < shared_replies::integers) {
+        auto r = shared_replies::integer(n);
+        m.append_static(r.data(), r.size());
+        return;
+    }
+    char buf[24];
+    m.append(sstring{buf, render_number(buf, ':', n)});
+}
+
+// `$<size>\r\n<n>\r\n`, the replies of integers kept as strings.
+static void append_bulk_integer(scattered_message<char>& m, int64_t n)
+{
+    if (n >= 0 && static_cast<size_t>(n) < shared_replies::integers) {
+        auto r = shared_replies::bulk_integer(n);
+        m.append_static(r.data(), r.size());
+        return;
+    }
+    char buf[32];
+    m.append(sstring{buf, render_bulk_integer(buf, n)});
+}
+
+static void append_array_header(scattered_message<char>& m, size_t elements)
+{
+    if (elements < shared_replies::headers) {
+        auto r = shared_replies::multi_bulk_header(elements);
+        m.append_static(r.data(), r.size());
+        return;
+    }
+    char buf[24];
+    m.append(sstring{buf, render_number(buf, '*', elements)});
+}
+
+static void append_bulk_header(scattered_message<char>& m, size_t size)
+{
+    if (size < shared_replies::headers) {
+        auto r = shared_replies::bulk_header(size);
+        m.append_static(r.data(), r.size());
+        return;
+    }
+    char buf[24];
+    m.append(sstring{buf, render_number(buf, '$', size)});
+}
+
+// `$<size>\r\n<data>\r\n`, copied into a single fragment.
+static void append_bulk(scattered_message<char>& m, const char* data, size_t size)
+{
+    char header[24];
+    const char* h = header;
+    size_t header_size;
+    if (size < shared_replies::headers) {
+        auto r = shared_replies::bulk_header(size);
+        h = r.data();
+        header_size = r.size();
+    }
+    else {
+        header_size = render_number(header, '$', size);
+    }
+    sstring s(sstring::initialized_later(), header_size + size + 2);
+    auto p = std::copy_n(h, header_size, s.begin());
+    p = std::copy_n(data, size, p);
+    *p++ = '\r';
+    *p = '\n';
+    m.append(std::move(s));
+}
+
+template <typename Message, typename String>
+static void append_bulk(Message& m, const String& s)
+{
+    append_bulk(m, s.data(), s.size());
+}
+
+// A score or float field, in its shortest digits reading back as itself.
+static void append_bulk_float(scattered_message<char>& m, double d)
+{
+    char buf[max_float_string];
+    append_bulk(m, buf, format_float_string(d, buf));
+}
+
 static future<scattered_message_ptr> build(size_t size)
 {
     auto m = make_lw_shared<scattered_message<char>>();
-    m->append_static(msg_num_tag);
-    m->append(to_sstring(size));
-    m->append_static(msg_crlf);
+    append_integer(*m, size);
     return make_ready_future<scattered_message_ptr>(foreign_ptr<lw_shared_ptr<scattered_message<char>>>(m));
 }
 
 static future<scattered_message_ptr> build(double number)
 {
     auto m = make_lw_shared<scattered_message<char>>();
-    auto&& n = to_sstring(number);
-    m->append_static(msg_batch_tag);
-    m->append(to_sstring(n.size()));
-    m->append_static(msg_crlf);
-    m->append(std::move(n));
-    m->append_static(msg_crlf);
+    append_bulk_float(*m, number);
     return make_ready_future<scattered_message_ptr>(foreign_ptr<lw_shared_ptr<scattered_message<char>>>(m));
 }
 
@@ -108,6 +529,76 @@ static future<scattered_message_ptr> build(const bytes& message)
    return make_ready_future<scattered_message_ptr>(foreign_ptr<lw_shared_ptr<scattered_message<char>>>(m));
 }
 
+// A reply referencing the encoded bytes, which it keeps alive: the replies
+// to coalesced reads share one copy.
+static future<scattered_message_ptr> build(lw_shared_ptr<const bytes> message)
+{
+   auto m = make_lw_shared<scattered_message<char>>();
+   m->append_static(message->data(), message->size());
+   m->on_delete([message] {});
+   return make_ready_future<scattered_message_ptr>(foreign_ptr<lw_shared_ptr<scattered_message<char>>>(m));
+}
+
+// The reply of a reply_value, built on the shard of the connection.
+static future<scattered_message_ptr> build(reply_value v)
+{
+    auto m = make_lw_shared<scattered_message<char>>();
+    switch (v._kind) {
+    case reply_value::kind::integer:
+        append_integer(*m, v._integer);
+        break;
+    case reply_value::kind::bulk_integer:
+        append_bulk_integer(*m, v._integer);
+        break;
+    case reply_value::kind::bulk_float:
+        append_bulk_float(*m, v._float);
+        break;
+    case reply_value::kind::bulk:
+        if (v._shared) {
+            append_bulk_header(*m, v._shared->size());
+            m->append_static(v._shared->get(), v._shared->size());
+            m->on_delete([value = std::move(v._shared)] {});
+            m->append_static(msg_crlf);
+        }
+        else {
+            append_bulk(*m, v._bulk);
+        }
+        break;
+    default:
+        m->append_static(*v._constant);
+        break;
+    }
+    return make_ready_future<scattered_message_ptr>(foreign_ptr<lw_shared_ptr<scattered_message<char>>>(m));
+}
+
+// The encoded reply as one buffer, as the proxy forwards it.
+static bytes to_bytes(scattered_message_ptr message)
+{
+    bytes reply;
+    if (message) {
+        auto p = std::move(*message).release();
+        for (auto& f : p.fragments()) {
+            reply.append(f.base, f.size);
+        }
+    }
+    return reply;
+}
+
+static future<scattered_message_ptr> build(const static_reply& message)
+{
+   auto m = make_lw_shared<scattered_message<char>>();
+   m->append_static(message);
+   return make_ready_future<scattered_message_ptr>(foreign_ptr<lw_shared_ptr<scattered_message<char>>>(m));
+}
+
+// `*<count>\r\n` alone, for elements which are replies of their own.
+static future<scattered_message_ptr> build_array_header(size_t count)
+{
+    auto m = make_lw_shared<scattered_message<char>>();
+    append_array_header(*m, count);
+    return make_ready_future<scattered_message_ptr>(foreign_ptr<lw_shared_ptr<scattered_message<char>>>(m));
+}
+
 template<bool Key, bool Value>
 static future<scattered_message_ptr> build(const cache_entry* e)
 {
@@ -115,32 +606,39 @@ static future<scattered_message_ptr> build(const cache_entry* e)
         //build reply
         auto m = make_lw_shared<scattered_message<char>>();
         if (Key) {
-            m->append(msg_batch_tag);
-            m->append(to_sstring(e->key_size()));
-            m->append_static(msg_crlf);
-            m->append(sstring{e->key_data(), e->key_size()});
-            m->append_static(msg_crlf);
+            append_bulk(*m, e->key_data(), e->key_size());
         }
         if (Value) {
-            m->append_static(msg_batch_tag);
             if (e->type_of_integer()) {
-               auto&& n = to_sstring(e->value_integer());
-               m->append(to_sstring(n.size()));
-               m->append_static(msg_crlf);
-               m->append(n);
-               m->append_static(msg_crlf);
+               append_bulk_integer(*m, e->value_integer());
             }
             else if (e->type_of_float()) {
-               auto&& n = to_sstring(e->value_float());
-               m->append(to_sstring(n.size()));
-               m->append_static(msg_crlf);
-               m->append(n);
-               m->append_static(msg_crlf);
+               append_bulk_float(*m, e->value_float());
+            }
+            else if (e->type_of_bytes() && e->integer_value()) {
+               append_bulk_integer(*m, e->string_integer());
             }
             else if (e->type_of_bytes()) {
-                m->append(to_sstring(e->value_bytes_size()));
-                m->append_static(msg_crlf);
-                m->append(sstring{e->value_bytes_data(), e->value_bytes_size()});
+                append_bulk_header(*m, e->value_bytes_size());
+                if (e->shared_value()) {
+                    // the reply references the value, which the packet keeps
+                    // alive. It is released on the shard which owns it.
+                    auto value = std::make_unique<temporary_buffer<char>>(e->share_value());
+                    m->append_static(value->get(), value->size());
+                    m->on_delete([value = make_foreign(std::move(value))] {});
+                }
+                else if (e->compressed_value()) {
+                    // decompressed once, straight into the buffer the packet keeps.
+                    auto value = std::make_unique<temporary_buffer<char>>(e->decompress_value());
+                    m->append_static(value->get(), value->size());
+                    m->on_delete([value = make_foreign(std::move(value))] {});
+                }
+                else {
+                    // bitmaps grown by SETBIT may be fragmented.
+                    e->for_each_value_fragment([&m] (bytes_view f) {
+                        m->append(sstring{f.data(), f.size()});
+                    });
+                }
                 m->append_static(msg_crlf);
             }
             else {
@@ -154,66 +652,51 @@ static future<scattered_message_ptr> build(const cache_entry* e)
     }
 }
 
-template<bool Key, bool Value>
-static future<scattered_message_ptr> build(const std::vector<const dict_entry*>& entries)
+// Entry is dict_entry or packed_dict_entry.
+template<bool Key, bool Value, typename Entry, typename Message>
+static void append_dict_entry(Message& m, const Entry* e)
 {
-    if (!entries.empty()) {
-        //build reply
-        auto m = make_lw_shared<scattered_message<char>>();
-        m->append_static(msg_sigle_tag);
-        if (Key && Value) {
-           m->append(std::move(to_sstring(entries.size() * 2)));
+    if (Key) {
+        if (e) {
+            append_bulk(m, e->key_data(), e->key_size());
         }
         else {
-           m->append(std::move(to_sstring(entries.size())));
+            m.append_static(msg_not_found);
         }
-        m->append_static(msg_crlf);
-        for (size_t i = 0; i < entries.size(); ++i) {
-            const auto e = entries[i];
-            if (Key) {
-                if (e) {
-                    m->append_static(msg_batch_tag);
-                    m->append(to_sstring(e->key_size()));
-                    m->append_static(msg_crlf);
-                    m->append(sstring{e->key_data(), e->key_size()});
-                    m->append_static(msg_crlf);
-                }
-                else {
-                    m->append_static(msg_not_found);
-                }
+    }
+    if (Value) {
+        if (e) {
+            if (e->type_of_integer()) {
+                append_bulk_integer(m, e->value_integer());
             }
-            if (Value) {
-                if (e) {
-                    m->append_static(msg_batch_tag);
-                    if (e->type_of_integer()) {
-                        auto&& n = to_sstring(e->value_integer());
-                        m->append(to_sstring(n.size()));
-                        m->append_static(msg_crlf);
-                        m->append(n);
-                        m->append_static(msg_crlf);
-                    }
-                    else if (e->type_of_float()) {
-                        auto&& n = to_sstring(e->value_float());
-                        m->append(to_sstring(n.size()));
-                        m->append_static(msg_crlf);
-                        m->append(n);
-                        m->append_static(msg_crlf);
-                    }
-                    else if (e->type_of_bytes()) {
-                        m->append(to_sstring(e->value_bytes_size()));
-                        m->append_static(msg_crlf);
-                        m->append(sstring{e->value_bytes_data(), e->value_bytes_size()});
-                        m->append_static(msg_crlf);
-                    }
-                    else {
-                        m->append_static(msg_type_err);
-                    }
-                }
-                else {
-                    m->append_static(msg_not_found);
-                }
+            else if (e->type_of_float()) {
+                append_bulk_float(m, e->value_float());
+            }
+            else if (e->type_of_bytes()) {
+                append_bulk(m, e->value_bytes_data(), e->value_bytes_size());
+            }
+            else {
+                m.append_static(msg_type_err);
             }
         }
+        else {
+            m.append_static(msg_not_found);
+        }
+    }
+}
+
+template<bool Key, bool Value, typename Entry>
+static future<scattered_message_ptr> build(const std::vector<const Entry*>& entries)
+{
+    if (!entries.empty()) {
+        //build reply
+        auto m = make_lw_shared<scattered_message<char>>();
+        reply_writer w(*m);
+        append_array_header(w, Key && Value ? entries.size() * 2 : entries.size());
+        for (size_t i = 0; i < entries.size(); ++i) {
+            append_dict_entry<Key, Value>(w, entries[i]);
+        }
+        w.flush();
         return make_ready_future<scattered_message_ptr>(foreign_ptr<lw_shared_ptr<scattered_message<char>>>(m));
     }
     else {
@@ -221,40 +704,24 @@ static future<scattered_message_ptr> build(const std::vector<const dict_entry*>&
     }
 }
 
-template<bool Key, bool Value>
-static future<scattered_message_ptr> build(const dict_entry* e)
+template<bool Key, bool Value, typename Entry>
+static future<scattered_message_ptr> build_dict_entry(const Entry* e)
 {
     if (e) {
         //build reply
         auto m = make_lw_shared<scattered_message<char>>();
         if (Key) {
-            m->append(msg_batch_tag);
-            m->append(to_sstring(e->key_size()));
-            m->append_static(msg_crlf);
-            m->append(sstring{e->key_data(), e->key_size()});
-            m->append_static(msg_crlf);
+            append_bulk(*m, e->key_data(), e->key_size());
         }
         if (Value) {
             if (e->type_of_integer()) {
-               auto&& n = to_sstring(e->value_integer());
-               m->append(to_sstring(n.size()));
-               m->append_static(msg_crlf);
-               m->append(n);
-               m->append_static(msg_crlf);
+               append_bulk_integer(*m, e->value_integer());
             }
             else if (e->type_of_float()) {
-               auto&& n = to_sstring(e->value_float());
-               m->append(to_sstring(n.size()));
-               m->append_static(msg_crlf);
-               m->append(n);
-               m->append_static(msg_crlf);
+               append_bulk_float(*m, e->value_float());
             }
             else if (e->type_of_bytes()) {
-                m->append_static(msg_batch_tag);
-                m->append(to_sstring(e->value_bytes_size()));
-                m->append_static(msg_crlf);
-                m->append(sstring{e->value_bytes_data(), e->value_bytes_size()});
-                m->append_static(msg_crlf);
+                append_bulk(*m, e->value_bytes_data(), e->value_bytes_size());
             }
             else {
                m->append_static(msg_type_err);
@@ -268,63 +735,89 @@ static future<scattered_message_ptr> build(const dict_entry* e)
     }
 }
 
+template<bool Key, bool Value>
+static future<scattered_message_ptr> build(const dict_entry* e)
+{
+    return build_dict_entry<Key, Value>(e);
+}
+
+template<bool Key, bool Value>
+static future<scattered_message_ptr> build(const packed_dict_entry* e)
+{
+    return build_dict_entry<Key, Value>(e);
+}
+
+template <typename Message>
+static void append(Message& m, const managed_bytes& data)
+{
+    append_bulk(m, reinterpret_cast<const char*>(data.data()), data.size());
+}
+
 static future<scattered_message_ptr> build(const std::vector<const managed_bytes*>& data)
 {
     auto m = make_lw_shared<scattered_message<char>>();
-    m->append(msg_sigle_tag);
-    m->append(to_sstring(data.size()));
-    m->append_static(msg_crlf);
+    reply_writer w(*m);
+    append_array_header(w, data.size());
     for (size_t i = 0; i < data.size(); ++i) {
-        m->append_static(msg_batch_tag);
-        m->append(to_sstring(data[i]->size()));
-        m->append_static(msg_crlf);
-        m->append(sstring{reinterpret_cast<const char*>(data[i]->data()), data[i]->size()});
-        m->append_static(msg_crlf);
+        append(w, *data[i]);
     }
+    w.flush();
     return make_ready_future<scattered_message_ptr>(foreign_ptr<lw_shared_ptr<scattered_message<char>>>(m));
 }
 
-static future<scattered_message_ptr> build(const managed_bytes& data)
+// The pieces of a streamed reply, see reply_chunk: the first chunk starts
+// with the header of the whole array, and elements which vanished from the
+// collection since the reply started are sent as nulls.
+static void append_nulls(scattered_message<char>& m, size_t count)
+{
+    for (size_t i = 0; i < count; ++i) {
+        m.append_static(msg_null_blik);
+    }
+}
+
+// A bulk reply of `size` bytes, which walk(append) passes to
+// append(bytes_view) a fragment at a time.
+template <typename Walk>
+static future<scattered_message_ptr> build_bulk(size_t size, Walk&& walk)
 {
     auto m = make_lw_shared<scattered_message<char>>();
-    m->append_static(msg_batch_tag);
-    m->append(to_sstring(data.size()));
-    m->append_static(msg_crlf);
-    m->append(sstring{reinterpret_cast<const char*>(data.data()), data.size()});
+    append_bulk_header(*m, size);
+    walk([&m] (bytes_view f) {
+        m->append(sstring{f.data(), f.size()});
+    });
     m->append_static(msg_crlf);
     return make_ready_future<scattered_message_ptr>(foreign_ptr<lw_shared_ptr<scattered_message<char>>>(m));
 }
 
+static future<scattered_message_ptr> build(const managed_bytes& data)
+{
+    auto m = make_lw_shared<scattered_message<char>>();
+    append_bulk(*m, reinterpret_cast<const char*>(data.data()), data.size());
+    return make_ready_future<scattered_message_ptr>(foreign_ptr<lw_shared_ptr<scattered_message<char>>>(m));
+}
+
+template <typename Message>
+static void append(Message& m, const sset_entry& e, bool with_score)
+{
+    append_bulk(m, e.key_data(), e.key_size());
+    if (with_score) {
+        append_bulk_float(m, e.score());
+    }
+}
+
 static future<scattered_message_ptr> build(const std::vector<const sset_entry*>& entries, bool with_score)
 {
     if (!entries.empty()) {
         //build reply
         auto m = make_lw_shared<scattered_message<char>>();
-        m->append_static(msg_sigle_tag);
-        if (with_score) {
-            m->append(std::move(to_sstring(entries.size() * 2)));
-        }
-        else {
-            m->append(std::move(to_sstring(entries.size())));
-        }
-        m->append_static(msg_crlf);
+        reply_writer w(*m);
+        append_array_header(w, with_score ? entries.size() * 2 : entries.size());
         for (size_t i = 0; i < entries.size(); ++i) {
             const auto& e = entries[i];
             assert(e != nullptr);
-            m->append_static(msg_batch_tag);
-            m->append(to_sstring(e->key_size()));
-            m->append_static(msg_crlf);
-            m->append(sstring{e->key_data(), e->key_size()});
-            m->append_static(msg_crlf);
-            if (with_score) {
-                m->append_static(msg_batch_tag);
-                auto&& n = to_sstring(e->score());
-                m->append(to_sstring(n.size()));
-                m->append_static(msg_crlf);
-                m->append(n);
-                m->append_static(msg_crlf);
-            }
+            append(w, *e, with_score);
         }
+        w.flush();
         return make_ready_future<scattered_message_ptr>(foreign_ptr<lw_shared_ptr<scattered_message<char>>>(m));
     }
     else {
@@ -332,20 +825,83 @@ static future<scattered_message_ptr> build(const std::vector<const sset_entry*>&
     }
 }
 
+// Builds the reply of `count` sorted set members, which `walk` passes one
+// by one to the function it is given, writing each straight into the
+// message instead of collecting them first.
+template <typename Walk>
+static future<scattered_message_ptr> build_sset(size_t count, bool with_score, Walk&& walk)
+{
+    if (count == 0) {
+        return reply_builder::build(msg_empty_multi_bulk);
+    }
+    auto m = make_lw_shared<scattered_message<char>>();
+    reply_writer w(*m);
+    append_array_header(w, with_score ? count * 2 : count);
+    walk([&w, with_score] (const sset_entry& e) {
+        append(w, e, with_score);
+    });
+    w.flush();
+    return make_ready_future<scattered_message_ptr>(foreign_ptr<lw_shared_ptr<scattered_message<char>>>(m));
+}
+
+// The replies of the SCAN family: the next cursor, then `elements`
+// elements appended by the caller.
+static void append_scan_header(reply_writer& m, size_t cursor, size_t elements)
+{
+    auto&& c = to_sstring(cursor);
+    append_array_header(m, 2);
+    append_bulk(m, c);
+    append_array_header(m, elements);
+}
+
+static future<scattered_message_ptr> build_scan(size_t cursor, const std::vector<const sset_entry*>& entries)
+{
+    auto m = make_lw_shared<scattered_message<char>>();
+    reply_writer w(*m);
+    append_scan_header(w, cursor, entries.size() * 2);
+    for (auto e : entries) {
+        append(w, *e, true);
+    }
+    w.flush();
+    return make_ready_future<scattered_message_ptr>(foreign_ptr<lw_shared_ptr<scattered_message<char>>>(m));
+}
+
+// HSCAN replies fields and values, SSCAN members only.
+template<bool Value, typename Entry>
+static future<scattered_message_ptr> build_scan(size_t cursor, const std::vector<const Entry*>& entries)
+{
+    auto m = make_lw_shared<scattered_message<char>>();
+    reply_writer w(*m);
+    append_scan_header(w, cursor, Value ? entries.size() * 2 : entries.size());
+    for (auto e : entries) {
+        append_dict_entry<true, Value>(w, e);
+    }
+    w.flush();
+    return make_ready_future<scattered_message_ptr>(foreign_ptr<lw_shared_ptr<scattered_message<char>>>(m));
+}
+
+static future<scattered_message_ptr> build_scan(size_t cursor, std::vector<bytes>& keys)
+{
+    auto m = make_lw_shared<scattered_message<char>>();
+    reply_writer w(*m);
+    append_scan_header(w, cursor, keys.size());
+    for (auto& k : keys) {
+        append_bulk(w, k);
+    }
+    w.flush();
+    return make_ready_future<scattered_message_ptr>(foreign_ptr<lw_shared_ptr<scattered_message<char>>>(m));
+}
+
 static future<scattered_message_ptr> build(std::vector<bytes>& data)
 {
     auto m = make_lw_shared<scattered_message<char>>();
-    m->append_static(msg_sigle_tag);
-    m->append(std::move(to_sstring(data.size())));
-    m->append_static(msg_crlf);
+    reply_writer w(*m);
+    append_array_header(w, data.size());
     for (size_t i = 0; i < data.size(); ++i) {
         auto& uu = data[i];
-        m->append_static(msg_batch_tag);
-        m->append(to_sstring(uu.size()));
-        m->append_static(msg_crlf);
-        m->append(std::move(uu));
-        m->append_static(msg_crlf);
+        append_bulk(w, uu);
     }
+    w.flush();
     return make_ready_future<scattered_message_ptr>(foreign_ptr<lw_shared_ptr<scattered_message<char>>>(m));
 }
 
@@ -353,57 +909,124 @@ static  future<scattered_message_ptr> build(std::vector<foreign_ptr<lw_shared_pt
 {
     if (!entries.empty()) {
         auto m = make_lw_shared<scattered_message<char>>();
-        m->append_static(msg_sigle_tag);
-        m->append(std::move(to_sstring(entries.size())));
-        m->append_static(msg_crlf);
+        reply_writer w(*m);
+        append_array_header(w, entries.size());
         for (size_t i = 0; i < entries.size(); ++i) {
             auto& e = entries[i];
-            m->append_static(msg_batch_tag);
-            m->append(to_sstring(e->size()));
-            m->append_static(msg_crlf);
-            m->append(*e);
-            m->append_static(msg_crlf);
+            append_bulk(w, *e);
         }
+        w.flush();
         return make_ready_future<scattered_message_ptr>(foreign_ptr<lw_shared_ptr<scattered_message<char>>>(m));
     }
     return reply_builder::build(msg_nil);
 }
 
+static future<scattered_message_ptr> build(const std::vector<const bytes*>& values)
+{
+    auto m = make_lw_shared<scattered_message<char>>();
+    reply_writer w(*m);
+    append_array_header(w, values.size());
+    for (auto v : values) {
+        if (!v) {
+            w.append_static(msg_null_blik);
+            continue;
+        }
+        append_bulk(w, *v);
+    }
+    w.flush();
+    return make_ready_future<scattered_message_ptr>(foreign_ptr<lw_shared_ptr<scattered_message<char>>>(m));
+}
+
+// BITFIELD replies, a null element for a subcommand failed by OVERFLOW FAIL.
+static future<scattered_message_ptr> build(const std::vector<std::experimental::optional<int64_t>>& values)
+{
+    auto m = make_lw_shared<scattered_message<char>>();
+    reply_writer w(*m);
+    append_array_header(w, values.size());
+    for (auto& v : values) {
+        if (!v) {
+            w.append_static(msg_null_blik);
+            continue;
+        }
+        append_integer(w, *v);
+    }
+    w.flush();
+    return make_ready_future<scattered_message_ptr>(foreign_ptr<lw_shared_ptr<scattered_message<char>>>(m));
+}
+
+// An integer for each field of HEXPIRE, HTTL and HPERSIST, each item of
+// BF.MADD, BF.MEXISTS, CMS.INCRBY and CMS.QUERY.
+static future<scattered_message_ptr> build(const std::vector<int64_t>& values)
+{
+    auto m = make_lw_shared<scattered_message<char>>();
+    reply_writer w(*m);
+    append_array_header(w, values.size());
+    for (auto v : values) {
+        append_integer(w, v);
+    }
+    w.flush();
+    return make_ready_future<scattered_message_ptr>(foreign_ptr<lw_shared_ptr<scattered_message<char>>>(m));
+}
+
+// GEOPOS replies, a null element for a member not in the key.
+static future<scattered_message_ptr> build(const std::vector<std::experimental::optional<std::pair<double, double>>>& positions)
+{
+    auto m = make_lw_shared<scattered_message<char>>();
+    reply_writer w(*m);
+    append_array_header(w, positions.size());
+    for (auto& p : positions) {
+        if (!p) {
+            w.append_static(msg_null_multi_bulk);
+            continue;
+        }
+        append_array_header(w, 2);
+        for (auto v : { p->first, p->second }) {
+            auto&& n = to_sstring(v);
+            append_bulk(w, n);
+        }
+    }
+    w.flush();
+    return make_ready_future<scattered_message_ptr>(foreign_ptr<lw_shared_ptr<scattered_message<char>>>(m));
+}
+
 static future<scattered_message_ptr> build(std::unordered_map<sstring, double>& data, bool with_score)
 {
     auto m = make_lw_shared<scattered_message<char>>();
-    m->append_static(msg_sigle_tag);
-    if (with_score) {
-        m->append(std::move(to_sstring(data.size() * 2)));
+    reply_writer w(*m);
+    append_array_header(w, with_score ? data.size() * 2 : data.size());
+    for (auto& d : data) {
+        append_bulk(w, d.first);
+        if (with_score) {
+            append_bulk_float(w, d.second);
+        }
     }
-    else {
-        m->append(std::move(to_sstring(data.size())));
+    w.flush();
+    return make_ready_future<scattered_message_ptr>(foreign_ptr<lw_shared_ptr<scattered_message<char>>>(m));
+}
+
+static future<scattered_message_ptr> build(std::vector<std::pair<bytes, double>>& data, bool with_score)
+{
+    if (data.empty()) {
+        return reply_builder::build(msg_empty_multi_bulk);
     }
-    m->append_static(msg_crlf);
+    auto m = make_lw_shared<scattered_message<char>>();
+    reply_writer w(*m);
+    append_array_header(w, with_score ? data.size() * 2 : data.size());
     for (auto& d : data) {
-        m->append_static(msg_batch_tag);
-        m->append(to_sstring(d.first.size()));
-        m->append_static(msg_crlf);
-        m->append(std::move(d.first));
-        m->append_static(msg_crlf);
+        append_bulk(w, d.first);
         if (with_score) {
-            m->append_static(msg_batch_tag);
-            auto&& n = to_sstring(d.second);
-            m->append(to_sstring(n.size()));
-            m->append_static(msg_crlf);
-            m->append(n);
-            m->append_static(msg_crlf);
+            append_bulk_float(w, d.second);
         }
     }
+    w.flush();
     return make_ready_future<scattered_message_ptr>(foreign_ptr<lw_shared_ptr<scattered_message<char>>>(m));
 }
 
 static future<scattered_message_ptr> build(std::vector<std::tuple<bytes, double, double, double, double>>& u, int flags)
 {
     auto m = make_lw_shared<scattered_message<char>>();
-    m->append_static(msg_sigle_tag);
-    m->append(std::move(to_sstring(u.size())));
-    m->append_static(msg_crlf);
+    reply_writer w(*m);
+    append_array_header(w, u.size());
     int temp = 1, temp2 = 2;
     bool wd = flags & GEORADIUS_WITHDIST;
     bool wh = flags & GEORADIUS_WITHHASH;
@@ -412,58 +1035,35 @@ static future<scattered_message_ptr> build(std::vector<std::tuple<bytes, double,
     if (wh) temp++;
     if (wc) temp++;
     for (size_t i = 0; i < u.size(); ++i) {
-        m->append_static(msg_sigle_tag);
-        m->append(std::move(to_sstring(temp)));
-        m->append_static(msg_crlf);
+        append_array_header(w, temp);
 
         //key
         bytes& key = std::get<0>(u[i]);
-        m->append_static(msg_batch_tag);
-        m->append(to_sstring(key.size()));
-        m->append_static(msg_crlf);
-        m->append(std::move(key));
-        m->append_static(msg_crlf);
+        append_bulk(w, key);
         //dist
         if (wd) {
             double dist = std::get<2>(u[i]);
             geo::from_meters(dist, flags);
             auto&& n2 = to_sstring(dist);
-            m->append_static(msg_batch_tag);
-            m->append(to_sstring(n2.size()));
-            m->append_static(msg_crlf);
-            m->append(std::move(n2));
-            m->append_static(msg_crlf);
+            append_bulk(w, n2);
         }
         //coord
         if (wc) {
-            m->append_static(msg_sigle_tag);
-            m->append(std::move(to_sstring(temp2)));
-            m->append_static(msg_crlf);
+            append_array_header(w, temp2);
             auto&& n1 = to_sstring(std::get<3>(u[i]));
-            m->append_static(msg_batch_tag);
-            m->append(to_sstring(n1.size()));
-            m->append_static(msg_crlf);
-            m->append(std::move(n1));
-            m->append_static(msg_crlf);
+            append_bulk(w, n1);
             auto&& n2 = to_sstring(std::get<4>(u[i]));
-            m->append_static(msg_batch_tag);
-            m->append(to_sstring(n2.size()));
-            m->append_static(msg_crlf);
-            m->append(std::move(n2));
-            m->append_static(msg_crlf);
+            append_bulk(w, n2);
         }
         //hash
         if (wh) {
             double& score = std::get<1>(u[i]);
             bytes hashstr;
             geo::encode_to_geohash_string(score, hashstr);
-            m->append_static(msg_batch_tag);
-            m->append(to_sstring(hashstr.size()));
-            m->append_static(msg_crlf);
-            m->append(std::move(hashstr));
-            m->append_static(msg_crlf);
+            append_bulk(w, hashstr);
         }
     }
+    w.flush();
     return make_ready_future<scattered_message_ptr>(foreign_ptr<lw_shared_ptr<scattered_message<char>>>(m));
 }
 }; // end of class
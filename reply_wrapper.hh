@@ -25,14 +25,30 @@
 #include <unordered_map>
 #include <vector>
 #include "utils/bytes.hh"
+#include "core/future.hh"
+#include "core/sharded.hh"
+#include "core/scattered_message.hh"
 #include  <experimental/vector>
 #include "redis_command_code.hh"
+#include "tracing.hh"
 namespace redis {
 using namespace seastar;
 using scattered_message_ptr = foreign_ptr<lw_shared_ptr<scattered_message<char>>>;
+// Takes the leading chunks of a reply which is streamed, see reply_chunk.
+// The future resolves once there is room for the next one.
+class reply_sink {
+public:
+    virtual ~reply_sink() {}
+    virtual future<> push(scattered_message_ptr chunk) = 0;
+};
+
 struct reply_wrapper {
     reply_wrapper() : _reply(nullptr) {}
-    reply_wrapper(scattered_message_ptr reply) : _reply(std::move(reply)) {}
+    reply_wrapper(scattered_message_ptr reply, size_t size, lw_shared_ptr<request_trace> trace = {})
+        : _reply(std::move(reply)), _size(size), _trace(std::move(trace)) {}
     scattered_message_ptr _reply;
+    size_t _size { 0 };
+    // Of the last reply of a sampled request, completed once it is flushed.
+    lw_shared_ptr<request_trace> _trace;
 };
 }
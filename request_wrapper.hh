@@ -19,34 +19,169 @@
 *
 */
 #pragma once
+#include <algorithm>
 #include <iomanip>
+#include <limits>
 #include <sstream>
 #include <functional>
+#include <memory>
 #include <unordered_map>
 #include <vector>
 #include "utils/bytes.hh"
+#include "core/temporary_buffer.hh"
 #include  <experimental/vector>
 #include "redis_command_code.hh"
+#include "reply_wrapper.hh"
 #include "redis.hh"
 #include "utils/bytes.hh"
+#include "hash_slot.hh"
+#include "utils/request_arena.hh"
+#include <experimental/optional>
 namespace redis {
 using namespace seastar;
 struct request_wrapper {
     protocol_state _state;
     bytes _command;
+    command_code _command_code { command_code::unknown };
     uint32_t _args_count { 0 };
     std::vector<bytes> _args {};
-    std::vector<bytes> _tmp_keys {};
-    std::unordered_map<bytes, bytes> _tmp_key_values {};
-    std::unordered_map<bytes, double> _tmp_key_scores {};
-    std::vector<std::pair<bytes, bytes>> _tmp_key_value_pairs {};
+    // Arguments which the parser did not copy out of the input buffers. It is
+    // indexed like _args, and the entry of _args is left empty for them.
+    std::vector<temporary_buffer<char>> _pinned_args {};
+    // The pinned arguments which the parser copied rather than shared, as
+    // they were split across reads or too small to pin their buffer, are
+    // in the arena of the request. The parser resets it with the arguments.
+    utils::request_arena _arena {};
+    // A large argument which arrived over several reads, kept as the slices
+    // of the input buffers it is in rather than copied together: the value
+    // of a large SET is then copied once, into the region of its owner. Its
+    // entry of _args is left empty, see arg_fragments().
+    static constexpr size_t no_fragmented_arg = std::numeric_limits<size_t>::max();
+    std::vector<temporary_buffer<char>> _arg_fragments {};
+    size_t _fragmented_arg { no_fragmented_arg };
+    // The fragmented argument copied together, for the commands which read
+    // it through arg_view() nonetheless.
+    mutable bytes _linearized_arg {};
+    // The containers some commands gather their arguments into, allocated
+    // by the first of them: most connections never run one, and those idle
+    // between commands keep them only while they stay small.
+    struct temporaries {
+        std::vector<bytes> _keys;
+        std::vector<std::pair<bytes, double>> _key_scores;
+        std::vector<std::pair<bytes, bytes>> _key_value_pairs;
+    };
+    std::unique_ptr<temporaries> _tmp {};
+    // Arguments kept for the next command, beyond which release_memory()
+    // frees them.
+    static constexpr size_t max_retained_args = 16;
+    // Where the reply may be streamed to, nullptr to build it whole.
+    reply_sink* _sink { nullptr };
+    mutable std::experimental::optional<size_t> _key_hash {};
+    mutable std::experimental::optional<unsigned> _key_slot {};
     request_wrapper () {}
 
+    inline bytes_view arg_view(size_t i) const {
+        if (i == _fragmented_arg) {
+            if (_linearized_arg.empty()) {
+                _linearized_arg = bytes(bytes::initialized_later(), arg_size(i));
+                auto out = _linearized_arg.begin();
+                for (auto& f : _arg_fragments) {
+                    out = std::copy_n(f.get(), f.size(), out);
+                }
+            }
+            return bytes_view { _linearized_arg.data(), _linearized_arg.size() };
+        }
+        if (i < _pinned_args.size() && !_pinned_args[i].empty()) {
+            return bytes_view { _pinned_args[i].get(), _pinned_args[i].size() };
+        }
+        return bytes_view { _args[i].data(), _args[i].size() };
+    }
+
+    inline bool fragmented(size_t i) const {
+        return i == _fragmented_arg;
+    }
+
+    // The argument as the slices of the buffers it arrived in, in order.
+    std::vector<bytes_view> arg_fragments(size_t i) const {
+        if (i != _fragmented_arg) {
+            auto v = arg_view(i);
+            return std::vector<bytes_view> { v };
+        }
+        std::vector<bytes_view> fragments;
+        fragments.reserve(_arg_fragments.size());
+        for (auto& f : _arg_fragments) {
+            fragments.emplace_back(f.get(), f.size());
+        }
+        return fragments;
+    }
+
+    inline size_t arg_size(size_t i) const {
+        if (i != _fragmented_arg) {
+            return arg_view(i).size();
+        }
+        size_t size = 0;
+        for (auto& f : _arg_fragments) {
+            size += f.size();
+        }
+        return size;
+    }
+
+    void clear_fragmented_arg() {
+        _arg_fragments.clear();
+        _fragmented_arg = no_fragmented_arg;
+        _linearized_arg = {};
+    }
+
+    // The hash of the first argument, the key of most commands, and its hash
+    // slot: computed once, then shared by the shard routing, the cache, the
+    // cluster routing and the ring. The parsers reset them for each request.
+    size_t key_hash() const {
+        if (!_key_hash) {
+            _key_hash = std::hash<bytes>()(_args[0]);
+        }
+        return *_key_hash;
+    }
+    unsigned key_slot() const {
+        if (!_key_slot) {
+            auto key = arg_view(0);
+            _key_slot = key_hash_slot(key.data(), key.size());
+        }
+        return *_key_slot;
+    }
+    void reset_key_hashes() {
+        _key_hash = {};
+        _key_slot = {};
+    }
+
+    temporaries& tmp() {
+        if (!_tmp) {
+            _tmp = std::make_unique<temporaries>();
+        }
+        return *_tmp;
+    }
+
     void clear_temporary_containers() {
-        _tmp_keys.clear();
-        _tmp_key_values.clear();
-        _tmp_key_scores.clear();
-        _tmp_key_value_pairs.clear();
+        if (_tmp) {
+            _tmp->_keys.clear();
+            _tmp->_key_scores.clear();
+            _tmp->_key_value_pairs.clear();
+        }
+    }
+
+    // Once the command replied: the arguments left in the input buffers
+    // would pin them while the connection waits for the next command, and
+    // a large command would leave its containers grown.
+    void release_memory() {
+        _pinned_args.clear();
+        clear_fragmented_arg();
+        if (_tmp && (_tmp->_keys.capacity() > max_retained_args || _tmp->_key_scores.capacity() > max_retained_args
+            || _tmp->_key_value_pairs.capacity() > max_retained_args)) {
+            _tmp.reset();
+        }
+        if (_args.capacity() > max_retained_args) {
+            std::vector<bytes>().swap(_args);
+            std::vector<temporary_buffer<char>>().swap(_pinned_args);
+        }
     }
 };
 }
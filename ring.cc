@@ -21,8 +21,52 @@
 #include "ring.hh"
 #include "db.hh"
 #include "keys.hh"
+#include "service.hh"
+#include "stream_manager.hh"
+#include "replication.hh"
+#include "utils/murmur_hash.hh"
+#include <algorithm>
+#include <map>
 namespace redis {
 
+ring_snapshot::ring_snapshot(const std::unordered_map<gms::inet_address, std::vector<uint64_t>>& tokens_by_endpoint, size_t replica_count)
+    : _replica_count(replica_count)
+{
+    std::vector<std::pair<uint64_t, uint32_t>> tokens;
+    for (auto& e : tokens_by_endpoint) {
+        _endpoints.emplace_back(e.first);
+    }
+    // the same endpoint indexes on every node.
+    std::sort(_endpoints.begin(), _endpoints.end());
+    for (uint32_t i = 0; i < _endpoints.size(); ++i) {
+        for (auto t : tokens_by_endpoint.at(_endpoints[i])) {
+            tokens.emplace_back(t, i);
+        }
+    }
+    std::sort(tokens.begin(), tokens.end());
+    _replicas_per_set = std::min(_replica_count, _endpoints.size());
+    _tokens.reserve(tokens.size());
+    _replica_set_of_token.reserve(tokens.size());
+    std::map<std::vector<uint32_t>, uint32_t> sets;
+    std::vector<uint32_t> set;
+    for (size_t i = 0; i < tokens.size(); ++i) {
+        // the distinct endpoints met going round the ring from the token.
+        set.clear();
+        for (size_t j = 0; j < tokens.size() && set.size() < _replicas_per_set; ++j) {
+            auto endpoint = tokens[(i + j) % tokens.size()].second;
+            if (std::find(set.begin(), set.end(), endpoint) == set.end()) {
+                set.push_back(endpoint);
+            }
+        }
+        auto r = sets.emplace(set, sets.size());
+        if (r.second) {
+            _replica_sets.insert(_replica_sets.end(), set.begin(), set.end());
+        }
+        _tokens.push_back(tokens[i].first);
+        _replica_set_of_token.push_back(r.first->second);
+    }
+}
+
 future<> ring::start()
 {
     return make_ready_future<>();
@@ -33,62 +77,176 @@ future<> ring::stop()
     return make_ready_future<>();
 }
 
-size_t ring::token_to_index(const token& t) const
+std::vector<uint64_t> ring::vnode_tokens(const gms::inet_address& endpoint) const
 {
-    assert(_sorted_tokens.empty() == false);
-    auto it = std::lower_bound(_sorted_tokens.begin(), _sorted_tokens.end(), t);
-    if (it == _sorted_tokens.end()) {
-        return 0;
+    std::vector<uint64_t> tokens;
+    tokens.reserve(_vnode_count);
+    for (size_t i = 0; i < _vnode_count; ++i) {
+        uint32_t seed[2] = { endpoint.raw_addr(), static_cast<uint32_t>(i) };
+        std::array<uint64_t, 2> hash;
+        utils::murmur_hash::hash3_x64_128(bytes_view { reinterpret_cast<const char*>(seed), sizeof(seed) }, 0, hash);
+        tokens.push_back(hash[0]);
     }
-    return std::distance(_sorted_tokens.begin(), it);
+    return tokens;
 }
 
-const std::vector<gms::inet_address> ring::get_replica_nodes_internal(const redis_key& rk)
+std::vector<token> ring::get_tokens(const gms::inet_address& endpoint) const
 {
-    auto first_token_index = token_to_index(token{ token::kind::key, {rk.data(), rk.size()} });
-    auto& first_token = _sorted_tokens[first_token_index];
-    auto targets = _token_write_targets_endpoints_cache.find(first_token);
-    if (targets != _token_write_targets_endpoints_cache.end()) {
-        return targets->second;
+    std::vector<token> result;
+    auto i = _endpoint_tokens.find(endpoint);
+    if (i == _endpoint_tokens.end()) {
+        return result;
+    }
+    result.reserve(i->second.size());
+    for (auto t : i->second) {
+        result.push_back(token::from_value(t));
     }
-    std::vector<gms::inet_address> new_targets;
-    new_targets.reserve(_replica_count);
+    return result;
+}
 
-    new_targets.emplace_back(_token_to_endpoint[first_token]);
-    auto all_tokens = _sorted_tokens.size();
-    for (size_t i = 1; i < _replica_count; ++i) {
-        new_targets.emplace_back(_token_to_endpoint[_sorted_tokens[(i + first_token_index) % all_tokens]]);
+void ring::install(const endpoint_tokens_type& endpoint_tokens, const ring_snapshot& snapshot, const ring_snapshot& pending)
+{
+    // copies made on this shard, lookups read local memory only.
+    _endpoint_tokens = endpoint_tokens;
+    _snapshot = snapshot;
+    _pending = pending;
+}
+
+future<> ring::publish(lw_shared_ptr<endpoint_tokens_type> endpoint_tokens, lw_shared_ptr<ring_snapshot> snapshot, lw_shared_ptr<ring_snapshot> pending)
+{
+    // the other shards only read these until the call completes.
+    return get_service().invoke_on_all([endpoint_tokens, snapshot, pending] (service& s) {
+        s.get_ring().install(*endpoint_tokens, *snapshot, *pending);
+        get_local_replication_manager().update_primaries();
+    }).finally([endpoint_tokens, snapshot, pending] {});
+}
+
+future<> ring::change(endpoint_tokens_type endpoint_tokens)
+{
+    auto next_tokens = make_lw_shared<endpoint_tokens_type>(std::move(endpoint_tokens));
+    auto next = make_lw_shared<ring_snapshot>(*next_tokens, _replica_count);
+    auto none = make_lw_shared<ring_snapshot>();
+    if (_snapshot.empty()) {
+        // the first topology, there is nothing to move.
+        return publish(next_tokens, next, none);
     }
-    // cache the result
-    _token_write_targets_endpoints_cache[first_token] = new_targets;
-    return new_targets;
+    auto current_tokens = make_lw_shared<endpoint_tokens_type>(_endpoint_tokens);
+    auto current = make_lw_shared<ring_snapshot>(_snapshot);
+    return publish(current_tokens, current, next).then([current, next] {
+        return get_stream_manager().local().stream_ranges(*current, *next);
+    }).then_wrapped([this, current_tokens, current, next_tokens, next, none] (future<> f) {
+        if (f.failed()) {
+            // the new replicas may miss keys, keep the old ring.
+            auto ep = f.get_exception();
+            return publish(current_tokens, current, none).then([ep] {
+                return make_exception_future<>(ep);
+            });
+        }
+        return publish(next_tokens, next, none);
+    });
 }
 
-const std::vector<gms::inet_address> ring::get_replica_nodes_for_write(const redis_key& rk)
+future<> ring::add_endpoint(const gms::inet_address& endpoint)
 {
-    return get_replica_nodes_internal(rk);
+    return with_semaphore(_changes, 1, [this, endpoint] {
+        if (is_member(endpoint)) {
+            return make_ready_future<>();
+        }
+        auto endpoint_tokens = _endpoint_tokens;
+        endpoint_tokens.emplace(endpoint, vnode_tokens(endpoint));
+        return change(std::move(endpoint_tokens));
+    });
 }
 
+future<> ring::remove_endpoint(const gms::inet_address& endpoint)
+{
+    return with_semaphore(_changes, 1, [this, endpoint] {
+        if (!is_member(endpoint)) {
+            return make_ready_future<>();
+        }
+        auto endpoint_tokens = _endpoint_tokens;
+        endpoint_tokens.erase(endpoint);
+        return change(std::move(endpoint_tokens));
+    });
+}
 
-const gms::inet_address ring::get_replica_node_for_read(const redis_key& rk)
+const std::vector<gms::inet_address> ring::get_replica_nodes_for_write(uint64_t t) const
 {
-    auto first_token_index = token_to_index(token{ token::kind::key, {rk.data(), rk.size()} });
-    auto& first_token = _sorted_tokens[first_token_index];
-    auto targets = _token_read_targets_endpoints_cache.find(first_token);
-    if (targets != _token_read_targets_endpoints_cache.end()) {
-        return targets->second;
+    std::vector<gms::inet_address> targets;
+    if (_snapshot.empty()) {
+        return targets;
+    }
+    targets.reserve(_snapshot.replica_count());
+    _snapshot.for_each_replica(t, [&targets] (const gms::inet_address& endpoint) {
+        targets.push_back(endpoint);
+    });
+    if (!_pending.empty()) {
+        _pending.for_each_replica(t, [&targets] (const gms::inet_address& endpoint) {
+            if (std::find(targets.begin(), targets.end(), endpoint) == targets.end()) {
+                targets.push_back(endpoint);
+            }
+        });
+    }
+    return targets;
+}
+
+const gms::inet_address ring::get_replica_node_for_read(uint64_t t) const
+{
+    if (_snapshot.empty()) {
+        return gms::inet_address();
+    }
+    auto& liveness = *_liveness;
+    if (liveness._down.empty()) {
+        return _snapshot.primary_replica(t);
+    }
+    // the first live replica, the primary when they are all down.
+    std::experimental::optional<gms::inet_address> target;
+    _snapshot.for_each_replica(t, [&liveness, &target] (const gms::inet_address& endpoint) {
+        if (!target && liveness.is_alive(endpoint)) {
+            target = endpoint;
+        }
+    });
+    return target ? *target : _snapshot.primary_replica(t);
+}
+
+future<> ring::set_endpoint_alive(const gms::inet_address& endpoint, bool alive)
+{
+    if (_liveness->is_alive(endpoint) == alive) {
+        return make_ready_future<>();
+    }
+    auto next = make_lw_shared<endpoint_liveness>(*_liveness);
+    ++next->_version;
+    if (alive) {
+        next->_down.erase(endpoint);
+    } else {
+        next->_down.insert(endpoint);
+    }
+    _liveness = next;
+    // the other shards copy it before the call completes.
+    return get_service().invoke_on_all([next] (service& s) {
+        s.get_ring().install_liveness(*next);
+    }).finally([next] {});
+}
+
+void ring::install_liveness(const endpoint_liveness& liveness)
+{
+    if (liveness._version > _liveness->_version) {
+        _liveness = make_lw_shared<endpoint_liveness>(liveness);
     }
-    auto target = _token_to_endpoint[first_token];
-    _token_read_targets_endpoints_cache[first_token] = target;
-    return target;
 }
 
 void ring::set_sorted_tokens(const std::vector<token>& tokens, const std::unordered_map<token, gms::inet_address>& token_to_endpoint)
 {
-    _sorted_tokens = tokens;
-    _token_to_endpoint = token_to_endpoint;
-    _token_write_targets_endpoints_cache.clear();
-    _token_read_targets_endpoints_cache.clear();
+    // tokens assigned elsewhere, installed on this shard only.
+    endpoint_tokens_type endpoint_tokens;
+    for (auto& t : tokens) {
+        auto i = token_to_endpoint.find(t);
+        if (i != token_to_endpoint.end()) {
+            endpoint_tokens[i->second].push_back(token_value(t));
+        }
+    }
+    ring_snapshot snapshot { endpoint_tokens, _replica_count };
+    install(endpoint_tokens, snapshot, ring_snapshot {});
 }
 
 std::chrono::milliseconds ring::get_ring_delay() const{
@@ -21,14 +21,94 @@
 #pragma once
 #include "core/sharded.hh"
 #include "core/distributed.hh"
+#include "core/semaphore.hh"
 #include "core/sstring.hh"
 #include <experimental/optional>
+#include <algorithm>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 #include "gms/inet_address.hh"
 #include "token.hh"
 #include "keys.hh"
+#include "cluster.hh"
 namespace redis {
+
+// The position of a hash slot on the ring: its share of the token space.
+inline uint64_t slot_token(unsigned slot) {
+    return uint64_t(slot) << 50;
+}
+// The position of a key on the ring: that of its hash slot, so that the ring
+// hands out whole slots as Redis Cluster clients expect.
+inline uint64_t token_value(bytes_view key) {
+    return slot_token(key_hash_slot(key.data(), key.size()));
+}
+
+// An immutable view of the ring, built once per topology change and copied
+// to every shard: the tokens of all the vnodes, sorted in a flat array, and
+// for each of them the replicas of the range it ends, as an index in a
+// table of distinct replica sets. A lookup is a binary search that writes
+// nothing.
+class ring_snapshot {
+    std::vector<uint64_t> _tokens;
+    std::vector<uint32_t> _replica_set_of_token;
+    // _replicas_per_set endpoint indexes per set: the replica count, or
+    // the number of endpoints when there are fewer.
+    std::vector<uint32_t> _replica_sets;
+    std::vector<gms::inet_address> _endpoints;
+    size_t _replica_count = 1;
+    size_t _replicas_per_set = 0;
+public:
+    ring_snapshot() = default;
+    ring_snapshot(const std::unordered_map<gms::inet_address, std::vector<uint64_t>>& tokens_by_endpoint, size_t replica_count);
+
+    bool empty() const { return _tokens.empty(); }
+    size_t replica_count() const { return _replicas_per_set; }
+    const std::vector<uint64_t>& tokens() const { return _tokens; }
+    const std::vector<gms::inet_address>& endpoints() const { return _endpoints; }
+    bool contains(const gms::inet_address& endpoint) const {
+        return std::binary_search(_endpoints.begin(), _endpoints.end(), endpoint);
+    }
+
+    // The index of the first token at or after t, round the ring.
+    // REQUIRES: !empty()
+    size_t token_index(uint64_t t) const {
+        const uint64_t* base = _tokens.data();
+        size_t n = _tokens.size();
+        while (n > 1) {
+            size_t half = n / 2;
+            base = base[half] < t ? base + half : base;
+            n -= half;
+        }
+        size_t i = (base - _tokens.data()) + (*base < t);
+        return i == _tokens.size() ? 0 : i;
+    }
+
+    // Calls func with the replicas of t, the primary first.
+    template <typename Func>
+    void for_each_replica(uint64_t t, Func&& func) const {
+        auto set = &_replica_sets[_replica_set_of_token[token_index(t)] * _replicas_per_set];
+        for (size_t i = 0; i < _replicas_per_set; ++i) {
+            func(_endpoints[set[i]]);
+        }
+    }
+
+    const gms::inet_address& primary_replica(uint64_t t) const {
+        return _endpoints[_replica_sets[_replica_set_of_token[token_index(t)] * _replicas_per_set]];
+    }
+};
+
+// The endpoints the failure detector convicted, as shard 0 saw them at one
+// version. A version is never changed once published: every shard swaps in
+// its own copy of the next one whole, so that a command reads one version
+// or the other, from local memory.
+struct endpoint_liveness {
+    uint64_t _version = 0;
+    std::unordered_set<gms::inet_address> _down;
+
+    bool is_alive(const gms::inet_address& endpoint) const { return _down.count(endpoint) == 0; }
+};
+
 class ring final {
 public:
     ring() {}
@@ -39,27 +119,54 @@ public:
     ring(ring&&) = delete;
     ring& operator = (ring&&) = delete;
 
-    const std::vector<gms::inet_address> get_replica_nodes_for_write(const redis_key& rk);
-    const gms::inet_address get_replica_node_for_read(const redis_key& rk);
+    // Empty until the first topology is published. While a change streams
+    // the moved ranges, writes also go to the replicas it adds. The token is
+    // token_value() of the key, callers compute it once for all replicas.
+    const std::vector<gms::inet_address> get_replica_nodes_for_write(uint64_t t) const;
+    const gms::inet_address get_replica_node_for_read(uint64_t t) const;
     const size_t get_replica_count() const { return _replica_count; }
+    const ring_snapshot& snapshot() const { return _snapshot; }
+    // The ring a change in progress leads to, empty otherwise.
+    const ring_snapshot& pending_snapshot() const { return _pending; }
     void set_sorted_tokens(const std::vector<token>& tokens, const std::unordered_map<token, gms::inet_address>& token_to_endpoint);
 
-    bool is_member(const gms::inet_address& endpoint) const { return true; }
+    bool is_member(const gms::inet_address& endpoint) const { return _endpoint_tokens.count(endpoint) > 0; }
+    // Endpoints the failure detector convicted keep their ranges, but reads
+    // go to the other replicas and the proxy fails their commands at once,
+    // until they are seen alive again.
+    bool is_alive(const gms::inet_address& endpoint) const { return _liveness->is_alive(endpoint); }
+    // The version a command holds to see the same endpoints down throughout.
+    lw_shared_ptr<endpoint_liveness> liveness() const { return _liveness; }
+    // On shard 0: publishes the next version to all the shards.
+    future<> set_endpoint_alive(const gms::inet_address& endpoint, bool alive);
     std::chrono::milliseconds get_ring_delay() const;
-    std::vector<token> get_tokens(const gms::inet_address& endpoint) const { return {}; }
+    // The vnode tokens of an endpoint, derived from its address so that
+    // every node computes the same ones.
+    std::vector<token> get_tokens(const gms::inet_address& endpoint) const;
+
+    // Change the topology: the ranges which move are streamed to their new
+    // replicas, then the new snapshot replaces the old one on all the shards.
+    // Changes run one at a time.
+    future<> add_endpoint(const gms::inet_address& endpoint);
+    future<> remove_endpoint(const gms::inet_address& endpoint);
     future<> start();
     future<> stop();
 private:
     size_t _replica_count = 1;
     size_t _vnode_count = 1023;
-    std::vector<token> _sorted_tokens {};
-    std::unordered_map<token, gms::inet_address> _token_to_endpoint {};
-
-    // FIXME: need a timer to evict elements by LRU?
-    std::unordered_map<token, std::vector<gms::inet_address>> _token_write_targets_endpoints_cache {};
-    std::unordered_map<token, gms::inet_address>              _token_read_targets_endpoints_cache {};
+    using endpoint_tokens_type = std::unordered_map<gms::inet_address, std::vector<uint64_t>>;
+    endpoint_tokens_type _endpoint_tokens {};
+    ring_snapshot _snapshot {};
+    ring_snapshot _pending {};
+    lw_shared_ptr<endpoint_liveness> _liveness = make_lw_shared<endpoint_liveness>();
+    semaphore _changes { 1 };
 
-    const std::vector<gms::inet_address> get_replica_nodes_internal(const redis_key& rk);
-    size_t token_to_index(const token& t) const;
+    std::vector<uint64_t> vnode_tokens(const gms::inet_address& endpoint) const;
+    future<> change(endpoint_tokens_type endpoint_tokens);
+    future<> publish(lw_shared_ptr<endpoint_tokens_type> endpoint_tokens, lw_shared_ptr<ring_snapshot> snapshot, lw_shared_ptr<ring_snapshot> pending);
+    void install(const endpoint_tokens_type& endpoint_tokens, const ring_snapshot& snapshot, const ring_snapshot& pending);
+    // Older versions, which a publication overtaken by the next one brings,
+    // are ignored.
+    void install_liveness(const endpoint_liveness& liveness);
 };
 }
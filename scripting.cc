@@ -0,0 +1,445 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#include "scripting.hh"
+#include "request_wrapper.hh"
+#include "core/thread.hh"
+#include "core/reactor.hh"
+#include "core/print.hh"
+#include "utils/integer_string.hh"
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <cryptopp/sha.h>
+extern "C" {
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+}
+namespace redis {
+
+constexpr std::chrono::milliseconds script_engine::time_limit;
+
+// The deadline of the running script is checked every so many instructions.
+static constexpr int deadline_check_instructions = 100000;
+// Deeper tables of a reply, which may well be cycles, reply nil.
+static constexpr int max_reply_depth = 64;
+
+static script_engine*& engine_of(lua_State* L)
+{
+    return *static_cast<script_engine**>(lua_getextraspace(L));
+}
+
+static void append_line(bytes& out, char type, const char* data, size_t size)
+{
+    out.append(&type, 1);
+    // The line of a status or an error cannot hold a line break.
+    auto start = out.size();
+    out.append(data, size);
+    std::replace_if(out.begin() + start, out.end(), [] (char c) { return c == '\r' || c == '\n'; }, ' ');
+    out.append("\r\n", 2);
+}
+
+static void append_integer(bytes& out, char type, int64_t n)
+{
+    auto s = to_sstring(n);
+    out.append(&type, 1);
+    out.append(s.data(), s.size());
+    out.append("\r\n", 2);
+}
+
+// Appends the reply of the Lua value on top of the stack, as Redis converts
+// it: a number is truncated to an integer, true is 1 and false nil, a table
+// with an `err` or an `ok` field an error or a status, and any other table
+// the array of its elements up to the first nil.
+static void append_value(bytes& out, lua_State* L, int depth)
+{
+    switch (lua_type(L, -1)) {
+    case LUA_TNUMBER:
+        append_integer(out, ':', lua_isinteger(L, -1) ? lua_tointeger(L, -1) : static_cast<int64_t>(lua_tonumber(L, -1)));
+        return;
+    case LUA_TSTRING: {
+        size_t size;
+        auto data = lua_tolstring(L, -1, &size);
+        append_integer(out, '$', size);
+        out.append(data, size);
+        out.append("\r\n", 2);
+        return;
+    }
+    case LUA_TBOOLEAN:
+        if (lua_toboolean(L, -1)) {
+            out.append(msg_one.data(), msg_one.size());
+            return;
+        }
+        break;
+    case LUA_TTABLE: {
+        if (depth >= max_reply_depth || !lua_checkstack(L, 2)) {
+            break;
+        }
+        for (auto field : { "err", "ok" }) {
+            lua_getfield(L, -1, field);
+            if (lua_type(L, -1) == LUA_TSTRING) {
+                size_t size;
+                auto data = lua_tolstring(L, -1, &size);
+                append_line(out, field[0] == 'e' ? '-' : '+', data, size);
+                lua_pop(L, 1);
+                return;
+            }
+            lua_pop(L, 1);
+        }
+        size_t count = 0;
+        while (lua_rawgeti(L, -1, count + 1) != LUA_TNIL) {
+            lua_pop(L, 1);
+            ++count;
+        }
+        lua_pop(L, 1);
+        append_integer(out, '*', count);
+        for (size_t i = 1; i <= count; ++i) {
+            lua_rawgeti(L, -1, i);
+            append_value(out, L, depth + 1);
+            lua_pop(L, 1);
+        }
+        return;
+    }
+    default:
+        break;
+    }
+    out.append(msg_null_blik.data(), msg_null_blik.size());
+}
+
+// Pushes the Lua value of the reply at `p`, which is moved past it, as
+// Redis converts it: an integer is a number, a bulk a string, a status or
+// an error a table with an `ok` or an `err` field, an array a table, and a
+// nil bulk or array false.
+static void push_reply(lua_State* L, const char*& p, const char* end)
+{
+    auto eol = p < end ? static_cast<const char*>(std::memchr(p, '\r', end - p)) : nullptr;
+    if (eol == nullptr || !lua_checkstack(L, 3)) {
+        p = end;
+        lua_pushboolean(L, 0);
+        return;
+    }
+    auto type = *p;
+    auto line = p + 1;
+    auto line_size = static_cast<size_t>(eol - line);
+    p = std::min(eol + 2, end);
+    int64_t n = -1;
+    switch (type) {
+    case '+':
+    case '-':
+        lua_createtable(L, 0, 1);
+        lua_pushlstring(L, line, line_size);
+        lua_setfield(L, -2, type == '+' ? "ok" : "err");
+        return;
+    case ':':
+        parse_integer_string(line, line_size, n);
+        lua_pushinteger(L, n);
+        return;
+    case '$':
+        if (!parse_integer_string(line, line_size, n) || n < 0 || n > end - p) {
+            lua_pushboolean(L, 0);
+            return;
+        }
+        lua_pushlstring(L, p, n);
+        p = std::min(p + n + 2, end);
+        return;
+    case '*':
+        if (!parse_integer_string(line, line_size, n) || n < 0) {
+            lua_pushboolean(L, 0);
+            return;
+        }
+        lua_createtable(L, static_cast<int>(std::min<int64_t>(n, std::numeric_limits<int>::max())), 0);
+        for (int64_t i = 1; i <= n; ++i) {
+            push_reply(L, p, end);
+            lua_rawseti(L, -2, i);
+        }
+        return;
+    default:
+        p = end;
+        lua_pushboolean(L, 0);
+        return;
+    }
+}
+
+// Pushes {err = message}, the error redis.call() raises and redis.pcall()
+// returns.
+static void push_error(lua_State* L, const char* message)
+{
+    lua_createtable(L, 0, 1);
+    lua_pushstring(L, message);
+    lua_setfield(L, -2, "err");
+}
+
+script_engine::~script_engine()
+{
+    if (_lua != nullptr) {
+        lua_close(_lua);
+    }
+}
+
+sstring script_engine::sha1_hex(bytes_view body)
+{
+    uint8_t digest[CryptoPP::SHA1::DIGESTSIZE];
+    CryptoPP::SHA1().CalculateDigest(digest, reinterpret_cast<const uint8_t*>(body.data()), body.size());
+    static const char digits[] = "0123456789abcdef";
+    sstring sha(sstring::initialized_later(), sizeof(digest) * 2);
+    for (size_t i = 0; i < sizeof(digest); ++i) {
+        sha[2 * i] = digits[digest[i] >> 4];
+        sha[2 * i + 1] = digits[digest[i] & 0xf];
+    }
+    return sha;
+}
+
+void script_engine::open()
+{
+    _lua = luaL_newstate();
+    engine_of(_lua) = this;
+    // The libraries of Redis scripts: no io, os or package, nor files to load.
+    static const luaL_Reg libraries[] = {
+        { "_G", luaopen_base },
+        { LUA_TABLIBNAME, luaopen_table },
+        { LUA_STRLIBNAME, luaopen_string },
+        { LUA_MATHLIBNAME, luaopen_math },
+    };
+    for (auto& l : libraries) {
+        luaL_requiref(_lua, l.name, l.func, 1);
+        lua_pop(_lua, 1);
+    }
+    for (auto name : { "dofile", "loadfile" }) {
+        lua_pushnil(_lua);
+        lua_setglobal(_lua, name);
+    }
+    static const luaL_Reg functions[] = {
+        { "call", redis_call },
+        { "pcall", redis_pcall },
+        { "error_reply", redis_error_reply },
+        { "status_reply", redis_status_reply },
+        { nullptr, nullptr },
+    };
+    luaL_newlib(_lua, functions);
+    lua_setglobal(_lua, "redis");
+    lua_sethook(_lua, check_deadline, LUA_MASKCOUNT, deadline_check_instructions);
+}
+
+sstring script_engine::compile(const sstring& sha, script& s)
+{
+    if (s._function != LUA_NOREF) {
+        return {};
+    }
+    if (_lua == nullptr) {
+        open();
+    }
+    if (luaL_loadbuffer(_lua, s._body.data(), s._body.size(), "@user_script") != LUA_OK) {
+        sstring error = lua_tostring(_lua, -1);
+        lua_pop(_lua, 1);
+        return error;
+    }
+    s._function = luaL_ref(_lua, LUA_REGISTRYINDEX);
+    return {};
+}
+
+future<bytes> script_engine::load(const sstring& sha, bytes body)
+{
+    return with_semaphore(_running, 1, [this, &sha, body = std::move(body)] () mutable {
+        auto i = _scripts.find(sha);
+        if (i == _scripts.end()) {
+            i = _scripts.emplace(sha, script { std::move(body), LUA_NOREF }).first;
+        }
+        auto error = compile(sha, i->second);
+        if (error.empty()) {
+            return bytes {};
+        }
+        _scripts.erase(i);
+        bytes reply;
+        auto message = "ERR Error compiling script (new function): " + error;
+        append_line(reply, '-', message.data(), message.size());
+        return reply;
+    });
+}
+
+void script_engine::add(const sstring& sha, bytes body)
+{
+    _scripts.emplace(sha, script { std::move(body), LUA_NOREF });
+}
+
+future<> script_engine::flush()
+{
+    return with_semaphore(_running, 1, [this] {
+        _scripts.clear();
+        if (_lua != nullptr) {
+            lua_close(_lua);
+            _lua = nullptr;
+        }
+    });
+}
+
+bytes script_engine::execute(const sstring& sha, const request_wrapper& req, size_t numkeys)
+{
+    auto i = _scripts.find(sha);
+    if (i == _scripts.end()) {
+        return msg_noscript_err;
+    }
+    bytes reply;
+    auto error = compile(sha, i->second);
+    if (!error.empty()) {
+        auto message = "ERR Error compiling script (new function): " + error;
+        append_line(reply, '-', message.data(), message.size());
+        return reply;
+    }
+    auto L = _lua;
+    auto set_array = [L, &req] (const char* name, size_t from, size_t to) {
+        lua_createtable(L, to - from, 0);
+        for (size_t i = from; i < to; ++i) {
+            auto v = req.arg_view(i);
+            lua_pushlstring(L, v.data(), v.size());
+            lua_rawseti(L, -2, i - from + 1);
+        }
+        lua_setglobal(L, name);
+    };
+    set_array("KEYS", 2, 2 + numkeys);
+    set_array("ARGV", 2 + numkeys, req._args_count);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, i->second._function);
+    _deadline = std::chrono::steady_clock::now() + time_limit;
+    if (lua_pcall(L, 0, 1, 0) == LUA_OK) {
+        append_value(reply, L, 0);
+    }
+    else if (lua_type(L, -1) == LUA_TTABLE) {
+        // the error of redis.call() or of redis.error_reply().
+        append_value(reply, L, max_reply_depth - 1);
+        if (reply.empty() || reply[0] != '-') {
+            reply = msg_err;
+        }
+    }
+    else {
+        auto message = sprint("ERR Error running script (call to f_%s): %s", sha, lua_tostring(L, -1));
+        append_line(reply, '-', message.data(), message.size());
+    }
+    lua_settop(L, 0);
+    return reply;
+}
+
+future<scattered_message_ptr> script_engine::run(const sstring& sha, const request_wrapper& req, size_t numkeys, command_executor executor)
+{
+    return with_semaphore(_running, 1, [this, &sha, &req, numkeys, executor] {
+        return seastar::async([this, &sha, &req, numkeys, executor] {
+            _executor = executor;
+            return execute(sha, req, numkeys);
+        });
+    }).then([] (bytes reply) {
+        return reply_builder::build(reply);
+    });
+}
+
+// Nothing of C++ may be alive when Lua raises an error, which unwinds by
+// longjmp: the commands run here, and the caller raises the error.
+int script_engine::call(lua_State* L, bool protect)
+{
+    auto fail = [L, protect] (const char* message) {
+        push_error(L, message);
+        return protect ? 1 : -1;
+    };
+    auto argc = lua_gettop(L);
+    if (argc == 0) {
+        return fail("ERR Please specify at least one argument for redis.call()");
+    }
+    request_wrapper req;
+    for (int i = 1; i <= argc; ++i) {
+        auto type = lua_type(L, i);
+        if (type != LUA_TSTRING && type != LUA_TNUMBER) {
+            return fail("ERR Lua redis() command arguments must be strings or integers");
+        }
+        size_t size;
+        auto data = lua_tolstring(L, i, &size);
+        if (i == 1) {
+            req._command = bytes { data, size };
+            req._command_code = to_command_code(data, size);
+        }
+        else {
+            req._args.emplace_back(data, size);
+        }
+    }
+    req._args_count = argc - 1;
+    req._state = protocol_state::ok;
+    switch (req._command_code) {
+    case command_code::eval:
+    case command_code::evalsha:
+    case command_code::script:
+    case command_code::multi:
+    case command_code::exec:
+    case command_code::discard:
+    case command_code::watch:
+    case command_code::unwatch:
+        return fail("ERR This Redis command is not allowed from scripts");
+    default:
+        break;
+    }
+    bytes reply;
+    try {
+        reply = reply_builder::to_bytes(_executor(req).get0());
+    } catch (...) {
+        reply = msg_err;
+    }
+    auto p = static_cast<const char*>(reply.data());
+    auto error = !reply.empty() && reply[0] == '-';
+    push_reply(L, p, p + reply.size());
+    return error && !protect ? -1 : 1;
+}
+
+int script_engine::redis_call(lua_State* L)
+{
+    auto results = engine_of(L)->call(L, false);
+    if (results < 0) {
+        return lua_error(L);
+    }
+    return results;
+}
+
+int script_engine::redis_pcall(lua_State* L)
+{
+    return engine_of(L)->call(L, true);
+}
+
+int script_engine::redis_error_reply(lua_State* L)
+{
+    luaL_checkstring(L, 1);
+    lua_settop(L, 1);
+    lua_createtable(L, 0, 1);
+    lua_insert(L, 1);
+    lua_setfield(L, 1, "err");
+    return 1;
+}
+
+int script_engine::redis_status_reply(lua_State* L)
+{
+    luaL_checkstring(L, 1);
+    lua_settop(L, 1);
+    lua_createtable(L, 0, 1);
+    lua_insert(L, 1);
+    lua_setfield(L, 1, "ok");
+    return 1;
+}
+
+void script_engine::check_deadline(lua_State* L, lua_Debug*)
+{
+    if (std::chrono::steady_clock::now() > engine_of(L)->_deadline) {
+        luaL_error(L, "ERR script ran longer than %d milliseconds", static_cast<int>(time_limit.count()));
+    }
+}
+}
@@ -0,0 +1,106 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#pragma once
+#include <chrono>
+#include <unordered_map>
+#include "core/future.hh"
+#include "core/semaphore.hh"
+#include "core/sstring.hh"
+#include "utils/bytes.hh"
+#include "reply_builder.hh"
+struct lua_State;
+struct lua_Debug;
+namespace redis {
+using namespace seastar;
+struct request_wrapper;
+
+// The scripts of EVAL and EVALSHA on a shard, in a Lua interpreter of its
+// own. Every shard knows the bodies of all the scripts loaded, by their
+// SHA1, and compiles one the first time it runs it there; the compiled
+// chunk is then kept in the registry of the interpreter until SCRIPT FLUSH.
+//
+// A script runs on the shard owning its keys, its redis.call() commands
+// going straight to the database of that shard: a command whose first key
+// is owned by another shard fails. Scripts of a shard run one at a time,
+// and a script runs as a single task unless one of its commands waits.
+class script_engine {
+public:
+    using command_executor = future<scattered_message_ptr> (*)(request_wrapper& req);
+    // The reactor stalls while a script runs, so a script running longer
+    // than this fails rather than being waited for.
+    static constexpr std::chrono::milliseconds time_limit { 5000 };
+private:
+    struct script {
+        bytes _body;
+        // The registry reference of the compiled chunk, LUA_NOREF until it
+        // is compiled on this shard.
+        int _function;
+    };
+    lua_State* _lua = nullptr;
+    std::unordered_map<sstring, script> _scripts;
+    semaphore _running { 1 };
+    // Of the script running.
+    command_executor _executor = nullptr;
+    std::chrono::steady_clock::time_point _deadline;
+
+    void open();
+    // Compiles the script unless it is already, empty or the error.
+    sstring compile(const sstring& sha, script& s);
+    // The reply of the script, run in a seastar thread.
+    bytes execute(const sstring& sha, const request_wrapper& req, size_t numkeys);
+    // redis.call() and redis.pcall(): the number of values pushed, or -1 when
+    // the error on top of the stack is to be raised.
+    int call(lua_State* L, bool protect);
+    static int redis_call(lua_State* L);
+    static int redis_pcall(lua_State* L);
+    static int redis_error_reply(lua_State* L);
+    static int redis_status_reply(lua_State* L);
+    static void check_deadline(lua_State* L, lua_Debug*);
+public:
+    script_engine() {}
+    ~script_engine();
+    script_engine(const script_engine&) = delete;
+    script_engine& operator = (const script_engine&) = delete;
+
+    // The lower-case hex SHA1 of the body, which names the script.
+    static sstring sha1_hex(bytes_view body);
+    bool exists(const sstring& sha) const
+    {
+        return _scripts.count(sha) > 0;
+    }
+    // Compiles the body, which then runs as `sha`: empty or the error reply.
+    future<bytes> load(const sstring& sha, bytes body);
+    // Keeps the body of a script another shard compiled, compiled here when
+    // it first runs.
+    void add(const sstring& sha, bytes body);
+    // Forgets the scripts, once the one running is done.
+    future<> flush();
+    // Runs the script `sha`, which must exist, with the arguments of EVAL or
+    // EVALSHA: its reply, or the error of the script.
+    future<scattered_message_ptr> run(const sstring& sha, const request_wrapper& req, size_t numkeys, command_executor executor);
+};
+
+inline script_engine& local_script_engine()
+{
+    static thread_local script_engine engine;
+    return engine;
+}
+}
@@ -20,7 +20,21 @@
 */
 #include "server.hh"
 #include "core/execution_stage.hh"
+#include "core/metrics.hh"
 #include "utils/bytes.hh"
+#include "utils/work_scheduler.hh"
+#include "release.hh"
+#include <boost/range/irange.hpp>
+#include <algorithm>
+#include <array>
+#include <utility>
+#include <strings.h>
+#include <arpa/inet.h>
+#include <chrono>
+#include <cstring>
+#include <limits>
+#include <map>
+#include <unistd.h>
 namespace redis {
 
 distributed<server> _server;
@@ -30,97 +44,325 @@ static thread_local redis_service _redis;
 static inline redis_service& redis() {
     return _redis;
 }
-static thread_local std::unordered_map<bytes, std::function<future<scattered_message_ptr>(request_wrapper& req)>> _commands = {
-    { "set",  [] (request_wrapper& req) { return redis().set(req); } }, 
-    { "mset", [] (request_wrapper& req) { return redis().mset(req); } }, 
-    { "get",  [] (request_wrapper& req) { return redis().get(req); } }, 
-    { "del",  [] (request_wrapper& req) { return redis().del(req); } }, 
-    { "ping", [] (request_wrapper& req) { return redis().ping(req); } }, 
-    { "incr", [] (request_wrapper& req) { return redis().incr(req); } }, 
-    { "decr", [] (request_wrapper& req) { return redis().decr(req); } }, 
-    { "incrby", [] (request_wrapper& req) { return redis().incrby(req); } }, 
-    { "decrby", [] (request_wrapper& req) { return redis().decrby(req); } }, 
-    { "mget", [] (request_wrapper& req) { return redis().mget(req); } }, 
-    { "command", [] (request_wrapper& req) { return redis().command(req); } }, 
-    { "exists", [] (request_wrapper& req) { return redis().exists(req); } }, 
-    { "append", [] (request_wrapper& req) { return redis().append(req); } }, 
-    { "strlen", [] (request_wrapper& req) { return redis().strlen(req); } }, 
-    { "lpush", [] (request_wrapper& req) { return redis().lpush(req); } }, 
-    { "lpushx", [] (request_wrapper& req) { return redis().lpushx(req); } }, 
-    { "lpop", [] (request_wrapper& req) { return redis().lpop(req); } }, 
-    { "llen", [] (request_wrapper& req) { return redis().llen(req); } }, 
-    { "lindex", [] (request_wrapper& req) { return redis().lindex(req); } }, 
-    { "linsert", [] (request_wrapper& req) { return redis().linsert(req); } }, 
-    { "lrange", [] (request_wrapper& req) { return redis().lrange(req); } }, 
-    { "lset", [] (request_wrapper& req) { return redis().lset(req); } }, 
-    { "rpush", [] (request_wrapper& req) { return redis().rpush(req); } }, 
-    { "rpushx", [] (request_wrapper& req) { return redis().rpushx(req); } }, 
-    { "rpop", [] (request_wrapper& req) { return redis().rpop(req); } }, 
-    { "lrem", [] (request_wrapper& req) { return redis().lrem(req); } }, 
-    { "ltrim", [] (request_wrapper& req) { return redis().ltrim(req); } }, 
-    { "hset", [] (request_wrapper& req) { return redis().hset(req); } }, 
-    { "hmset", [] (request_wrapper& req) { return redis().hmset(req); } }, 
-    { "hdel", [] (request_wrapper& req) { return redis().hdel(req); } }, 
-    { "hget", [] (request_wrapper& req) { return redis().hget(req); } }, 
-    { "hlen", [] (request_wrapper& req) { return redis().hlen(req); } }, 
-    { "hexists", [] (request_wrapper& req) { return redis().hexists(req); } }, 
-    { "hstrlen", [] (request_wrapper& req) { return redis().hstrlen(req); } }, 
-    { "hincrby", [] (request_wrapper& req) { return redis().hincrby(req); } }, 
-    { "hincrbyfloat", [] (request_wrapper& req) { return redis().hincrbyfloat(req); } }, 
-    { "hkeys", [] (request_wrapper& req) { return redis().hgetall_keys(req); } }, 
-    { "hvals", [] (request_wrapper& req) { return redis().hgetall_values(req); } }, 
-    { "hmget", [] (request_wrapper& req) { return redis().hmget(req); } }, 
-    { "hgetall", [] (request_wrapper& req) { return redis().hgetall(req); } }, 
-    { "sadd", [] (request_wrapper& req) { return redis().sadd(req); } }, 
-    { "scard", [] (request_wrapper& req) { return redis().scard(req); } }, 
-    { "sismember", [] (request_wrapper& req) { return redis().sismember(req); } }, 
-    { "smembers", [] (request_wrapper& req) { return redis().smembers(req); } }, 
-    { "srandmember", [] (request_wrapper& req) { return redis().srandmember(req); } }, 
-    { "srem", [] (request_wrapper& req) { return redis().srem(req); } }, 
-    { "sdiff", [] (request_wrapper& req) { return redis().sdiff(req); } }, 
-    { "sdiffstore", [] (request_wrapper& req) { return redis().sdiff_store(req); } }, 
-    { "sinter", [] (request_wrapper& req) { return redis().sinter(req); } }, 
-    { "sinterstore", [] (request_wrapper& req) { return redis().sinter_store(req); } }, 
-    { "sunion", [] (request_wrapper& req) { return redis().sunion(req); } }, 
-    { "sunionstore", [] (request_wrapper& req) { return redis().sunion_store(req); } }, 
-    { "smove", [] (request_wrapper& req) { return redis().smove(req); } }, 
-    { "spop", [] (request_wrapper& req) { return redis().spop(req); } }, 
-    { "type", [] (request_wrapper& req) { return redis().type(req); } }, 
-    { "expire", [] (request_wrapper& req) { return redis().expire(req); } }, 
-    { "pexpire", [] (request_wrapper& req) { return redis().pexpire(req); } }, 
-    { "ttl", [] (request_wrapper& req) { return redis().ttl(req); } }, 
-    { "pttl", [] (request_wrapper& req) { return redis().pttl(req); } }, 
-    { "persist", [] (request_wrapper& req) { return redis().persist(req); } }, 
-    { "zadd", [] (request_wrapper& req) { return redis().zadd(req); } }, 
-    { "zrange", [] (request_wrapper& req) { return redis().zrange(req, false); } }, 
-    { "zrevrange", [] (request_wrapper& req) { return redis().zrange(req, true); } }, 
-    { "zrangebyscore", [] (request_wrapper& req) { return redis().zrangebyscore(req, false); } }, 
-    { "zrevrangebyscore", [] (request_wrapper& req) { return redis().zrangebyscore(req, true); } }, 
-    { "zrem", [] (request_wrapper& req) { return redis().zrem(req); } }, 
-    { "zremrangebyscore", [] (request_wrapper& req) { return redis().zremrangebyscore(req); } }, 
-    { "zremrangebyrank", [] (request_wrapper& req) { return redis().zremrangebyrank(req); } }, 
-    { "zcard", [] (request_wrapper& req) { return redis().zcard(req); } }, 
-    { "zcount", [] (request_wrapper& req) { return redis().zcount(req); } }, 
-    { "zscore", [] (request_wrapper& req) { return redis().zscore(req); } }, 
-    { "zincrby", [] (request_wrapper& req) { return redis().zincrby(req); } }, 
-    { "zrank", [] (request_wrapper& req) { return redis().zrank(req, false); } }, 
-    { "zrevrank", [] (request_wrapper& req) { return redis().zrank(req, true); } }, 
-    { "zunionstore", [] (request_wrapper& req) { return redis().zunionstore(req); } }, 
-    { "zinterstore", [] (request_wrapper& req) { return redis().zinterstore(req); } }, 
-    { "select", [] (request_wrapper& req) { return redis().select(req); } }, 
-    { "geoadd", [] (request_wrapper& req) { return redis().geoadd(req); } }, 
-    { "geodist", [] (request_wrapper& req) { return redis().geodist(req); } }, 
-    { "geopos", [] (request_wrapper& req) { return redis().geopos(req); } }, 
-    { "geohash", [] (request_wrapper& req) { return redis().geohash(req); } }, 
-    { "georadius", [] (request_wrapper& req) { return redis().georadius(req, false); } }, 
-    { "georadiusbymember", [] (request_wrapper& req) { return redis().georadius(req, true); } }, 
-    { "setbit", [] (request_wrapper& req) { return redis().setbit(req); } }, 
-    { "getbit", [] (request_wrapper& req) { return redis().getbit(req); } }, 
-    { "bitcount", [] (request_wrapper& req) { return redis().bitcount(req); } }, 
-    { "pfadd", [] (request_wrapper& req) { return redis().pfadd(req); } }, 
-    { "pfcount", [] (request_wrapper& req) { return redis().pfcount(req); } }, 
-    { "pfmerge", [] (request_wrapper& req) { return redis().pfmerge(req); } }, 
-};
+static future<> drop_hot_copies() {
+    return smp::invoke_on_all([] {
+        redis().drop_hot_copies();
+    });
+}
+using command_handler = future<scattered_message_ptr> (*)(request_wrapper& req);
+using command_handlers = std::array<command_handler, static_cast<size_t>(command_code::max)>;
+
+static command_handlers make_command_handlers()
+{
+    auto code = [] (command_code c) { return static_cast<size_t>(c); };
+    command_handlers handlers {};
+    handlers[code(command_code::set)] = [] (request_wrapper& req) { return redis().set(req); };
+    handlers[code(command_code::mset)] = [] (request_wrapper& req) { return redis().mset(req); };
+    handlers[code(command_code::get)] = [] (request_wrapper& req) { return redis().get(req); };
+    handlers[code(command_code::getdel)] = [] (request_wrapper& req) { return redis().getdel(req); };
+    handlers[code(command_code::getex)] = [] (request_wrapper& req) { return redis().getex(req); };
+    handlers[code(command_code::del)] = [] (request_wrapper& req) { return redis().del(req); };
+    handlers[code(command_code::unlink)] = [] (request_wrapper& req) { return redis().unlink(req); };
+    handlers[code(command_code::rename)] = [] (request_wrapper& req) { return redis().rename(req, false); };
+    handlers[code(command_code::renamenx)] = [] (request_wrapper& req) { return redis().rename(req, true); };
+    handlers[code(command_code::copy)] = [] (request_wrapper& req) { return redis().copy(req); };
+    handlers[code(command_code::move)] = [] (request_wrapper& req) { return redis().move(req); };
+    handlers[code(command_code::dump)] = [] (request_wrapper& req) { return redis().dump(req); };
+    handlers[code(command_code::restore)] = [] (request_wrapper& req) { return redis().restore(req); };
+    handlers[code(command_code::ping)] = [] (request_wrapper& req) { return redis().ping(req); };
+    handlers[code(command_code::incr)] = [] (request_wrapper& req) { return redis().incr(req); };
+    handlers[code(command_code::decr)] = [] (request_wrapper& req) { return redis().decr(req); };
+    handlers[code(command_code::incrby)] = [] (request_wrapper& req) { return redis().incrby(req); };
+    handlers[code(command_code::decrby)] = [] (request_wrapper& req) { return redis().decrby(req); };
+    handlers[code(command_code::mget)] = [] (request_wrapper& req) { return redis().mget(req); };
+    handlers[code(command_code::command)] = [] (request_wrapper& req) { return redis().command(req); };
+    handlers[code(command_code::exists)] = [] (request_wrapper& req) { return redis().exists(req); };
+    handlers[code(command_code::append)] = [] (request_wrapper& req) { return redis().append(req); };
+    handlers[code(command_code::strlen)] = [] (request_wrapper& req) { return redis().strlen(req); };
+    handlers[code(command_code::setrange)] = [] (request_wrapper& req) { return redis().setrange(req); };
+    handlers[code(command_code::getrange)] = [] (request_wrapper& req) { return redis().getrange(req); };
+    handlers[code(command_code::lpush)] = [] (request_wrapper& req) { return redis().lpush(req); };
+    handlers[code(command_code::lpushx)] = [] (request_wrapper& req) { return redis().lpushx(req); };
+    handlers[code(command_code::lpop)] = [] (request_wrapper& req) { return redis().lpop(req); };
+    handlers[code(command_code::llen)] = [] (request_wrapper& req) { return redis().llen(req); };
+    handlers[code(command_code::lindex)] = [] (request_wrapper& req) { return redis().lindex(req); };
+    handlers[code(command_code::linsert)] = [] (request_wrapper& req) { return redis().linsert(req); };
+    handlers[code(command_code::lrange)] = [] (request_wrapper& req) { return redis().lrange(req); };
+    handlers[code(command_code::lset)] = [] (request_wrapper& req) { return redis().lset(req); };
+    handlers[code(command_code::rpush)] = [] (request_wrapper& req) { return redis().rpush(req); };
+    handlers[code(command_code::rpushx)] = [] (request_wrapper& req) { return redis().rpushx(req); };
+    handlers[code(command_code::rpop)] = [] (request_wrapper& req) { return redis().rpop(req); };
+    handlers[code(command_code::blpop)] = [] (request_wrapper& req) { return redis().blpop(req); };
+    handlers[code(command_code::brpop)] = [] (request_wrapper& req) { return redis().brpop(req); };
+    handlers[code(command_code::lmove)] = [] (request_wrapper& req) { return redis().lmove(req, false); };
+    handlers[code(command_code::blmove)] = [] (request_wrapper& req) { return redis().lmove(req, true); };
+    handlers[code(command_code::rpoplpush)] = [] (request_wrapper& req) { return redis().rpoplpush(req, false); };
+    handlers[code(command_code::brpoplpush)] = [] (request_wrapper& req) { return redis().rpoplpush(req, true); };
+    handlers[code(command_code::lmpop)] = [] (request_wrapper& req) { return redis().mpop(req, true); };
+    handlers[code(command_code::lrem)] = [] (request_wrapper& req) { return redis().lrem(req); };
+    handlers[code(command_code::ltrim)] = [] (request_wrapper& req) { return redis().ltrim(req); };
+    handlers[code(command_code::xadd)] = [] (request_wrapper& req) { return redis().xadd(req); };
+    handlers[code(command_code::xlen)] = [] (request_wrapper& req) { return redis().xlen(req); };
+    handlers[code(command_code::xrange)] = [] (request_wrapper& req) { return redis().xrange(req, false); };
+    handlers[code(command_code::xrevrange)] = [] (request_wrapper& req) { return redis().xrange(req, true); };
+    handlers[code(command_code::xdel)] = [] (request_wrapper& req) { return redis().xdel(req); };
+    handlers[code(command_code::xtrim)] = [] (request_wrapper& req) { return redis().xtrim(req); };
+    handlers[code(command_code::xread)] = [] (request_wrapper& req) { return redis().xread(req, false); };
+    handlers[code(command_code::xreadgroup)] = [] (request_wrapper& req) { return redis().xread(req, true); };
+    handlers[code(command_code::xgroup)] = [] (request_wrapper& req) { return redis().xgroup(req); };
+    handlers[code(command_code::xack)] = [] (request_wrapper& req) { return redis().xack(req); };
+    handlers[code(command_code::xpending)] = [] (request_wrapper& req) { return redis().xpending(req); };
+    handlers[code(command_code::ts_add)] = [] (request_wrapper& req) { return redis().ts_add(req); };
+    handlers[code(command_code::ts_range)] = [] (request_wrapper& req) { return redis().ts_range(req); };
+    handlers[code(command_code::ts_mrange)] = [] (request_wrapper& req) { return redis().ts_mrange(req); };
+    handlers[code(command_code::bf_reserve)] = [] (request_wrapper& req) { return redis().bf_reserve(req); };
+    handlers[code(command_code::bf_add)] = [] (request_wrapper& req) { return redis().bf_add(req, false); };
+    handlers[code(command_code::bf_madd)] = [] (request_wrapper& req) { return redis().bf_add(req, true); };
+    handlers[code(command_code::bf_exists)] = [] (request_wrapper& req) { return redis().bf_exists(req, false); };
+    handlers[code(command_code::bf_mexists)] = [] (request_wrapper& req) { return redis().bf_exists(req, true); };
+    handlers[code(command_code::cms_initbydim)] = [] (request_wrapper& req) { return redis().cms_init(req, false); };
+    handlers[code(command_code::cms_initbyprob)] = [] (request_wrapper& req) { return redis().cms_init(req, true); };
+    handlers[code(command_code::cms_incrby)] = [] (request_wrapper& req) { return redis().cms_incrby(req); };
+    handlers[code(command_code::cms_query)] = [] (request_wrapper& req) { return redis().cms_query(req); };
+    handlers[code(command_code::topk_reserve)] = [] (request_wrapper& req) { return redis().topk_reserve(req); };
+    handlers[code(command_code::topk_add)] = [] (request_wrapper& req) { return redis().topk_add(req); };
+    handlers[code(command_code::topk_query)] = [] (request_wrapper& req) { return redis().topk_query(req); };
+    handlers[code(command_code::topk_list)] = [] (request_wrapper& req) { return redis().topk_list(req); };
+    handlers[code(command_code::hset)] = [] (request_wrapper& req) { return redis().hset(req); };
+    handlers[code(command_code::hmset)] = [] (request_wrapper& req) { return redis().hmset(req, false); };
+    handlers[code(command_code::hdel)] = [] (request_wrapper& req) { return redis().hdel(req); };
+    handlers[code(command_code::hget)] = [] (request_wrapper& req) { return redis().hget(req); };
+    handlers[code(command_code::hlen)] = [] (request_wrapper& req) { return redis().hlen(req); };
+    handlers[code(command_code::hexists)] = [] (request_wrapper& req) { return redis().hexists(req); };
+    handlers[code(command_code::hstrlen)] = [] (request_wrapper& req) { return redis().hstrlen(req); };
+    handlers[code(command_code::hincrby)] = [] (request_wrapper& req) { return redis().hincrby(req); };
+    handlers[code(command_code::hincrbyfloat)] = [] (request_wrapper& req) { return redis().hincrbyfloat(req); };
+    handlers[code(command_code::hkeys)] = [] (request_wrapper& req) { return redis().hgetall_keys(req); };
+    handlers[code(command_code::hvals)] = [] (request_wrapper& req) { return redis().hgetall_values(req); };
+    handlers[code(command_code::hmget)] = [] (request_wrapper& req) { return redis().hmget(req); };
+    handlers[code(command_code::hscan)] = [] (request_wrapper& req) { return redis().hscan(req); };
+    handlers[code(command_code::hgetall)] = [] (request_wrapper& req) { return redis().hgetall(req); };
+    handlers[code(command_code::hexpire)] = [] (request_wrapper& req) { return redis().hexpire(req, false); };
+    handlers[code(command_code::hpexpire)] = [] (request_wrapper& req) { return redis().hexpire(req, true); };
+    handlers[code(command_code::httl)] = [] (request_wrapper& req) { return redis().httl(req, false); };
+    handlers[code(command_code::hpttl)] = [] (request_wrapper& req) { return redis().httl(req, true); };
+    handlers[code(command_code::hpersist)] = [] (request_wrapper& req) { return redis().hpersist(req); };
+    handlers[code(command_code::sadd)] = [] (request_wrapper& req) { return redis().sadd(req); };
+    handlers[code(command_code::scard)] = [] (request_wrapper& req) { return redis().scard(req); };
+    handlers[code(command_code::sismember)] = [] (request_wrapper& req) { return redis().sismember(req); };
+    handlers[code(command_code::smembers)] = [] (request_wrapper& req) { return redis().smembers(req); };
+    handlers[code(command_code::sscan)] = [] (request_wrapper& req) { return redis().sscan(req); };
+    handlers[code(command_code::srandmember)] = [] (request_wrapper& req) { return redis().srandmember(req); };
+    handlers[code(command_code::srem)] = [] (request_wrapper& req) { return redis().srem(req); };
+    handlers[code(command_code::sdiff)] = [] (request_wrapper& req) { return redis().sdiff(req); };
+    handlers[code(command_code::sdiffstore)] = [] (request_wrapper& req) { return redis().sdiff_store(req); };
+    handlers[code(command_code::sinter)] = [] (request_wrapper& req) { return redis().sinter(req); };
+    handlers[code(command_code::sinterstore)] = [] (request_wrapper& req) { return redis().sinter_store(req); };
+    handlers[code(command_code::sintercard)] = [] (request_wrapper& req) { return redis().sintercard(req); };
+    handlers[code(command_code::sunion)] = [] (request_wrapper& req) { return redis().sunion(req); };
+    handlers[code(command_code::sunionstore)] = [] (request_wrapper& req) { return redis().sunion_store(req); };
+    handlers[code(command_code::smove)] = [] (request_wrapper& req) { return redis().smove(req); };
+    handlers[code(command_code::spop)] = [] (request_wrapper& req) { return redis().spop(req); };
+    handlers[code(command_code::type)] = [] (request_wrapper& req) { return redis().type(req); };
+    handlers[code(command_code::expire)] = [] (request_wrapper& req) { return redis().expire(req); };
+    handlers[code(command_code::pexpire)] = [] (request_wrapper& req) { return redis().pexpire(req); };
+    handlers[code(command_code::ttl)] = [] (request_wrapper& req) { return redis().ttl(req); };
+    handlers[code(command_code::pttl)] = [] (request_wrapper& req) { return redis().pttl(req); };
+    handlers[code(command_code::persist)] = [] (request_wrapper& req) { return redis().persist(req); };
+    handlers[code(command_code::scan)] = [] (request_wrapper& req) { return redis().scan(req); };
+    handlers[code(command_code::zadd)] = [] (request_wrapper& req) { return redis().zadd(req); };
+    handlers[code(command_code::zrange)] = [] (request_wrapper& req) { return redis().zrange(req, false); };
+    handlers[code(command_code::zrevrange)] = [] (request_wrapper& req) { return redis().zrange(req, true); };
+    handlers[code(command_code::zrangebyscore)] = [] (request_wrapper& req) { return redis().zrangebyscore(req, false); };
+    handlers[code(command_code::zrevrangebyscore)] = [] (request_wrapper& req) { return redis().zrangebyscore(req, true); };
+    handlers[code(command_code::zrangestore)] = [] (request_wrapper& req) { return redis().zrangestore(req); };
+    handlers[code(command_code::zrem)] = [] (request_wrapper& req) { return redis().zrem(req); };
+    handlers[code(command_code::zmpop)] = [] (request_wrapper& req) { return redis().mpop(req, false); };
+    handlers[code(command_code::zpopmin)] = [] (request_wrapper& req) { return redis().zpop(req, false); };
+    handlers[code(command_code::zpopmax)] = [] (request_wrapper& req) { return redis().zpop(req, true); };
+    handlers[code(command_code::bzpopmin)] = [] (request_wrapper& req) { return redis().bzpopmin(req); };
+    handlers[code(command_code::bzpopmax)] = [] (request_wrapper& req) { return redis().bzpopmax(req); };
+    handlers[code(command_code::zremrangebyscore)] = [] (request_wrapper& req) { return redis().zremrangebyscore(req); };
+    handlers[code(command_code::zremrangebyrank)] = [] (request_wrapper& req) { return redis().zremrangebyrank(req); };
+    handlers[code(command_code::zcard)] = [] (request_wrapper& req) { return redis().zcard(req); };
+    handlers[code(command_code::zcount)] = [] (request_wrapper& req) { return redis().zcount(req); };
+    handlers[code(command_code::zscore)] = [] (request_wrapper& req) { return redis().zscore(req); };
+    handlers[code(command_code::zincrby)] = [] (request_wrapper& req) { return redis().zincrby(req); };
+    handlers[code(command_code::zrank)] = [] (request_wrapper& req) { return redis().zrank(req, false); };
+    handlers[code(command_code::zrevrank)] = [] (request_wrapper& req) { return redis().zrank(req, true); };
+    handlers[code(command_code::zunionstore)] = [] (request_wrapper& req) { return redis().zunionstore(req); };
+    handlers[code(command_code::zinterstore)] = [] (request_wrapper& req) { return redis().zinterstore(req); };
+    handlers[code(command_code::zdiffstore)] = [] (request_wrapper& req) { return redis().zdiffstore(req); };
+    handlers[code(command_code::zunion)] = [] (request_wrapper& req) { return redis().zunion(req); };
+    handlers[code(command_code::zinter)] = [] (request_wrapper& req) { return redis().zinter(req); };
+    handlers[code(command_code::zdiff)] = [] (request_wrapper& req) { return redis().zdiff(req); };
+    handlers[code(command_code::zrangebylex)] = [] (request_wrapper& req) { return redis().zrangebylex(req, false); };
+    handlers[code(command_code::zrevrangebylex)] = [] (request_wrapper& req) { return redis().zrangebylex(req, true); };
+    handlers[code(command_code::zlexcount)] = [] (request_wrapper& req) { return redis().zlexcount(req); };
+    handlers[code(command_code::zremrangebylex)] = [] (request_wrapper& req) { return redis().zremrangebylex(req); };
+    handlers[code(command_code::zscan)] = [] (request_wrapper& req) { return redis().zscan(req); };
+    handlers[code(command_code::select)] = [] (request_wrapper& req) { return redis().select(req); };
+    handlers[code(command_code::flushdb)] = [] (request_wrapper& req) { return redis().flushall(req, drop_hot_copies); };
+    handlers[code(command_code::flushall)] = [] (request_wrapper& req) { return redis().flushall(req, drop_hot_copies); };
+    handlers[code(command_code::debug)] = [] (request_wrapper& req) { return redis().debug(req); };
+    handlers[code(command_code::geoadd)] = [] (request_wrapper& req) { return redis().geoadd(req); };
+    handlers[code(command_code::geodist)] = [] (request_wrapper& req) { return redis().geodist(req); };
+    handlers[code(command_code::geopos)] = [] (request_wrapper& req) { return redis().geopos(req); };
+    handlers[code(command_code::geohash)] = [] (request_wrapper& req) { return redis().geohash(req); };
+    handlers[code(command_code::georadius)] = [] (request_wrapper& req) { return redis().georadius(req, false); };
+    handlers[code(command_code::georadiusbymember)] = [] (request_wrapper& req) { return redis().georadius(req, true); };
+    handlers[code(command_code::geosearch)] = [] (request_wrapper& req) { return redis().geosearch(req); };
+    handlers[code(command_code::geosearchstore)] = [] (request_wrapper& req) { return redis().geosearchstore(req); };
+    handlers[code(command_code::setbit)] = [] (request_wrapper& req) { return redis().setbit(req); };
+    handlers[code(command_code::getbit)] = [] (request_wrapper& req) { return redis().getbit(req); };
+    handlers[code(command_code::bitcount)] = [] (request_wrapper& req) { return redis().bitcount(req); };
+    handlers[code(command_code::bitop)] = [] (request_wrapper& req) { return redis().bitop(req); };
+    handlers[code(command_code::bitpos)] = [] (request_wrapper& req) { return redis().bitpos(req); };
+    handlers[code(command_code::bitfield)] = [] (request_wrapper& req) { return redis().bitfield(req); };
+    handlers[code(command_code::pfadd)] = [] (request_wrapper& req) { return redis().pfadd(req); };
+    handlers[code(command_code::pfcount)] = [] (request_wrapper& req) { return redis().pfcount(req); };
+    handlers[code(command_code::pfmerge)] = [] (request_wrapper& req) { return redis().pfmerge(req); };
+    handlers[code(command_code::shards)] = [] (request_wrapper& req) { return get_local_server().shards(); };
+    handlers[code(command_code::cluster)] = [] (request_wrapper& req) { return get_local_server().cluster(req); };
+    handlers[code(command_code::asking)] = [] (request_wrapper& req) { return reply_builder::build(msg_ok); };
+    handlers[code(command_code::info)] = [] (request_wrapper& req) { return get_local_server().info(req); };
+    handlers[code(command_code::tracing)] = [] (request_wrapper& req) { return get_local_server().tracing(req); };
+    handlers[code(command_code::slowlog)] = [] (request_wrapper& req) { return get_local_server().slowlog(req); };
+    handlers[code(command_code::capture)] = [] (request_wrapper& req) { return get_local_server().capture(req); };
+    handlers[code(command_code::config)] = [] (request_wrapper& req) { return get_local_server().config(req); };
+    handlers[code(command_code::profile)] = [] (request_wrapper& req) { return get_local_server().profile(req); };
+    handlers[code(command_code::latency)] = [] (request_wrapper& req) { return get_local_server().latency(req); };
+    handlers[code(command_code::memory)] = [] (request_wrapper& req) { return redis().memory(req); };
+    handlers[code(command_code::hotkeys)] = [] (request_wrapper& req) { return redis().hotkeys(req); };
+    handlers[code(command_code::bigkeys)] = [] (request_wrapper& req) { return redis().bigkeys(req); };
+    handlers[code(command_code::save)] = [] (request_wrapper& req) { return redis().save(req, false); };
+    handlers[code(command_code::bgsave)] = [] (request_wrapper& req) { return redis().save(req, true); };
+    handlers[code(command_code::lastsave)] = [] (request_wrapper& req) { return redis().lastsave(req); };
+    handlers[code(command_code::dbsize)] = [] (request_wrapper& req) { return redis().dbsize(req); };
+    handlers[code(command_code::randomkey)] = [] (request_wrapper& req) { return redis().randomkey(req); };
+    // queued by MULTI: EXEC forgets the watched keys anyway.
+    handlers[code(command_code::unwatch)] = [] (request_wrapper& req) { return reply_builder::build(msg_ok); };
+    handlers[code(command_code::eval)] = [] (request_wrapper& req) { return redis().eval(req, false, execute_command); };
+    handlers[code(command_code::evalsha)] = [] (request_wrapper& req) { return redis().eval(req, true, execute_command); };
+    handlers[code(command_code::script)] = [] (request_wrapper& req) { return redis().script(req); };
+    handlers[code(command_code::publish)] = [] (request_wrapper& req) { return get_local_server().publish(req); };
+    handlers[code(command_code::pubsub)] = [] (request_wrapper& req) { return get_local_server().pubsub(req); };
+    return handlers;
+}
+
+// Dense jump table indexed by the command code emitted by the parser.
+static const command_handlers _commands = make_command_handlers();
+
+static bool is_transaction_command(command_code code)
+{
+    switch (code) {
+    case command_code::multi:
+    case command_code::exec:
+    case command_code::discard:
+    case command_code::watch:
+    case command_code::unwatch:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool is_subscription_command(command_code code)
+{
+    switch (code) {
+    case command_code::subscribe:
+    case command_code::unsubscribe:
+    case command_code::psubscribe:
+    case command_code::punsubscribe:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool is_blocking_command(command_code code)
+{
+    return code == command_code::blpop || code == command_code::brpop || code == command_code::blmove
+        || code == command_code::brpoplpush || code == command_code::bzpopmin || code == command_code::bzpopmax
+        || code == command_code::xread || code == command_code::xreadgroup;
+}
+
+static bool is_connection_command(command_code code)
+{
+    return code == command_code::hello || code == command_code::client;
+}
+
+// The commands on data, which a shard running late refuses. The others are
+// cheap, or change the state of the connection.
+static bool may_shed(command_code code)
+{
+    return family_of(code) != command_family::none || is_heavy_command(code)
+        || code == command_code::eval || code == command_code::evalsha || code == command_code::publish;
+}
+
+// Whether the command is queued rather than run after MULTI, as in Redis.
+static bool queued_in_multi(command_code code)
+{
+    return code != command_code::multi && code != command_code::exec
+        && code != command_code::discard && code != command_code::watch
+        && !is_connection_command(code);
+}
+
+// The reads CLIENT TRACKING remembers the keys of: those which leave the
+// entries they read clean, see cache::find(), lest the change a read makes
+// invalidate what the client just cached.
+static bool is_tracked_read(command_code code)
+{
+    switch (code) {
+    case command_code::get:
+    case command_code::mget:
+    case command_code::exists:
+    case command_code::strlen:
+    case command_code::getrange:
+    case command_code::getbit:
+    case command_code::bitcount:
+    case command_code::bitpos:
+    case command_code::lindex:
+    case command_code::hgetall:
+    case command_code::hkeys:
+    case command_code::hvals:
+    case command_code::ttl:
+    case command_code::pttl:
+    case command_code::zcard:
+    case command_code::zcount:
+    case command_code::zrange:
+    case command_code::zrangebyscore:
+    case command_code::zrangebylex:
+    case command_code::zlexcount:
+    case command_code::pfcount:
+        return true;
+    default:
+        return false;
+    }
+}
+
+connection_balancing to_connection_balancing(const std::string& name)
+{
+    if (name == "kernel") {
+        return connection_balancing::kernel;
+    }
+    else if (name == "connections") {
+        return connection_balancing::connections;
+    }
+    else if (name == "port") {
+        return connection_balancing::port;
+    }
+    throw std::invalid_argument("unknown connection balancing: " + name);
+}
+
+const char* to_connection_balancing_name(connection_balancing balancing)
+{
+    switch (balancing) {
+    case connection_balancing::connections: return "connections";
+    case connection_balancing::port: return "port";
+    default: return "kernel";
+    }
+}
 
 void server::setup_metrics()
 {
@@ -128,32 +370,935 @@ void server::setup_metrics()
     _metrics.add_group("connections", {
         sm::make_counter("opened_total", [this] { return _stats._connections_total; }, sm::description("Total number of connections opened.")),
         sm::make_counter("current_total", [this] { return _stats._connections_current; }, sm::description("Total number of connections current opened.")),
+        sm::make_gauge("current", [this] { return _stats._connections_current; }, sm::description("Number of connections open on the shard.")),
+        sm::make_counter("rejected_total", [this] { return _stats._rejected_connections; }, sm::description("Total number of connections refused past maxclients.")),
+        sm::make_counter("idle_timeouts_total", [this] { return _stats._idle_timeouts; }, sm::description("Total number of connections closed for being idle.")),
+        sm::make_counter("output_limit_disconnects_total", [this] { return _stats._output_limit_disconnects; }, sm::description("Total number of connections closed past their output limits.")),
+    });
+
+    _metrics.add_group("replies", {
+        sm::make_gauge("pending", [this] { return _stats._replies_pending; }, sm::description("Number of replies built but not yet written.")),
+        sm::make_gauge("pending_bytes", [this] { return _stats._reply_bytes_pending; }, sm::description("Bytes of replies built but not yet written.")),
+        sm::make_counter("backpressure_total", [this] { return _stats._backpressure_total; }, sm::description("Total number of times reading requests waited for replies to drain.")),
     });
 
     _metrics.add_group("reqests", {
-        sm::make_counter("served_total", [this] { return 0; }, sm::description("Total number of served requests.")),
-        sm::make_counter("serving_total", [this] { return 0; }, sm::description("Total number of requests being serving.")),
-        sm::make_counter("exception_total", [this] { return 0; }, sm::description("Total number of bad requests.")),
+        sm::make_counter("served_total", [this] { return _stats._requests_served; }, sm::description("Total number of served requests.")),
+        sm::make_gauge("serving_total", [this] { return _stats._requests_serving; }, sm::description("Total number of requests being serving.")),
+        sm::make_counter("exception_total", [this] { return _stats._requests_exception; }, sm::description("Total number of bad requests.")),
+        sm::make_counter("redirected_total", [this] { return _stats._redirects; }, sm::description("Total number of requests answered by MOVED or ASK.")),
+        sm::make_counter("throttled_writes_total", [this] { return _stats._throttled_writes; }, sm::description("Total number of writes which waited for their shard to free memory.")),
+        sm::make_counter("oom_rejections_total", [this] { return _stats._oom_rejections; }, sm::description("Total number of writes answered by OOM after waiting for memory.")),
+        sm::make_counter("busy_rejections_total", [this] { return _stats._busy_rejections; }, sm::description("Total number of commands answered by BUSY while the shard ran late.")),
+        sm::make_counter("admission_waits_total", [this] { return _stats._admission_waits; }, sm::description("Total number of times reading requests waited for fewer of them in progress.")),
+        sm::make_gauge("reactor_lag_us", [this] { return _reactor_lag_us; }, sm::description("How late the reactor of the shard runs, in microseconds.")),
+        sm::make_counter("parked_total", [this] { return _stats._requests_parked; }, sm::description("Total number of commands which waited for the store while the next ones of their connection ran.")),
+        sm::make_counter("pipeline_batches_total", [this] { return _stats._pipeline_batches; }, sm::description("Total number of batches of pipelined commands run as one task on another shard.")),
+        sm::make_counter("pipeline_batched_total", [this] { return _stats._pipeline_batched; }, sm::description("Total number of pipelined commands run in a batch on another shard.")),
+        sm::make_counter("coalesced_reads_total", [] { return redis().coalesced_reads(); }, sm::description("Total number of GETs which shared the lookup of a concurrent GET of the same key.")),
+    });
+
+    _metrics.add_group("hot_keys", {
+        sm::make_gauge("hottest_key_reads", [] { return redis().hottest_key_reads(); }, sm::description("Estimated GETs per second of the most read key of this shard.")),
+        sm::make_gauge("copies", [] { return redis().hot_copies(); }, sm::description("Values of hot keys of other shards cached by this shard.")),
+        sm::make_counter("copy_hits_total", [] { return redis().hot_copy_hits(); }, sm::description("Total number of GETs served from the copy of a hot key.")),
+        sm::make_counter("copy_invalidations_total", [] { return redis().hot_copy_invalidations(); }, sm::description("Total number of copies of hot keys dropped because their key changed.")),
+    });
+
+    _metrics.add_group("sharded_counters", {
+        sm::make_gauge("cells", [] { return redis().counter_cells(); }, sm::description("Sharded counters with a cell on this shard.")),
+        sm::make_counter("increments_total", [] { return redis().sharded_increments(); }, sm::description("Total number of increments of sharded counters taken by this shard.")),
+        sm::make_counter("folds_total", [] { return redis().counter_folds(); }, sm::description("Total number of cells of this shard folded into their owner.")),
+        sm::make_counter("fold_errors_total", [] { return redis().counter_fold_errors(); }, sm::description("Total number of folds the owner refused, their increments lost.")),
+    });
+
+    _metrics.add_group("split_keys", {
+        sm::make_counter("point_operations_total", [] { return redis().split_point_ops(); }, sm::description("Total number of commands on one field or member of a split key, run on its partition.")),
+        sm::make_counter("gathers_total", [] { return redis().split_gathers(); }, sm::description("Total number of commands on a split key gathered from all its partitions.")),
+    });
+
+    _metrics.add_group("pubsub", {
+        sm::make_gauge("channels", [] { return local_pubsub().channel_count(); }, sm::description("Channels subscribed to by the connections of this shard.")),
+        sm::make_gauge("patterns", [] { return local_pubsub().pattern_count(); }, sm::description("Patterns subscribed to by the connections of this shard.")),
+        sm::make_counter("published_total", [] { return local_pubsub().get_stats()._published; }, sm::description("Total number of messages published through this shard.")),
+        sm::make_counter("fanout_shards_total", [] { return local_pubsub().get_stats()._fanout_shards; }, sm::description("Total number of shards the messages published through this shard went to.")),
+        sm::make_counter("batches_sent_total", [] { return local_pubsub().get_stats()._batches_sent; }, sm::description("Total number of batches of messages sent to other shards.")),
+        sm::make_counter("messages_delivered_total", [] { return local_pubsub().get_stats()._messages_delivered; }, sm::description("Total number of messages received by the subscribers of this shard.")),
+        sm::make_counter("deliveries_total", [] { return local_pubsub().get_stats()._deliveries; }, sm::description("Total number of batches of messages written to the subscribers of this shard.")),
+        sm::make_counter("slow_subscribers_total", [this] { return _stats._slow_subscribers; }, sm::description("Total number of subscribers disconnected for not reading their messages.")),
+    });
+
+    _metrics.add_group("tracking", {
+        sm::make_gauge("keys", [] { return get_database().local().tracked_key_count(); }, sm::description("Keys of this shard read by a client tracking them.")),
+        sm::make_counter("invalidations_total", [] { return local_tracking().get_stats()._invalidations; }, sm::description("Total number of keys invalidated for a client, sent from this shard.")),
+        sm::make_counter("batches_sent_total", [] { return local_tracking().get_stats()._batches_sent; }, sm::description("Total number of batches of invalidations sent to the shards of their clients.")),
+        sm::make_counter("deliveries_total", [] { return local_tracking().get_stats()._deliveries; }, sm::description("Total number of invalidation messages written to the clients of this shard.")),
     });
+
+    _metrics.add_group("keyspace_events", {
+        sm::make_counter("events_total", [] { return local_keyspace_events().get_stats()._events; }, sm::description("Total number of keyspace events raised by this shard.")),
+        sm::make_counter("flushes_total", [] { return local_keyspace_events().get_stats()._flushes; }, sm::description("Total number of batches of keyspace events published by this shard.")),
+    });
+
+    auto command_label = sm::label("command");
+    std::vector<sm::metric_definition> latencies;
+    for (size_t code = 0; code < _latencies.size(); ++code) {
+        auto name = to_command_name(static_cast<command_code>(code));
+        if (name == nullptr || _commands[code] == nullptr) {
+            continue;
+        }
+        latencies.emplace_back(sm::make_histogram("latency", sm::description("Latency of the command in microseconds."), {command_label(name)},
+            [this, code] { return _latencies[code].get_histogram(); }));
+        latencies.emplace_back(sm::make_counter("calls", [this, code] { return _command_stats[code]._calls; },
+            sm::description("Total number of calls of the command."), {command_label(name)}));
+        latencies.emplace_back(sm::make_counter("usec", [this, code] { return _command_stats[code]._usec; },
+            sm::description("Total time spent in the command, in microseconds."), {command_label(name)}));
+        latencies.emplace_back(sm::make_counter("errors", [this, code] { return _command_stats[code]._errors; },
+            sm::description("Total number of calls of the command which failed."), {command_label(name)}));
+        latencies.emplace_back(sm::make_counter("stalls", [code] { return local_stall_monitor().stalls(static_cast<command_code>(code)); },
+            sm::description("Total number of calls of the command which held the reactor for at least stall_threshold_us."), {command_label(name)}));
+        latencies.emplace_back(sm::make_counter("alloc_samples", [code] { return local_allocation_sampler().of(static_cast<command_code>(code))._samples; },
+            sm::description("Total number of calls of the command whose allocations were accounted, see alloc_sample_period."), {command_label(name)}));
+        latencies.emplace_back(sm::make_counter("allocations", [code] { return local_allocation_sampler().of(static_cast<command_code>(code))._allocations; },
+            sm::description("Total number of allocations of the sampled calls of the command."), {command_label(name)}));
+        latencies.emplace_back(sm::make_counter("allocated_bytes", [code] { return local_allocation_sampler().of(static_cast<command_code>(code))._bytes; },
+            sm::description("Total bytes of memory the sampled calls of the command took, net of what they freed."), {command_label(name)}));
+    }
+    _metrics.add_group("commands", latencies);
+
+    auto event_label = sm::label("event");
+    std::vector<sm::metric_definition> events;
+    for (size_t i = 0; i < utils::latency_monitor::events; ++i) {
+        auto e = static_cast<utils::latency_event>(i);
+        events.emplace_back(sm::make_histogram("duration", sm::description("Duration of the internal event in microseconds."), {event_label(utils::latency_event_name(e))},
+            [e] { return utils::local_latency_monitor().histogram(e); }));
+    }
+    _metrics.add_group("latency_events", events);
+
+    auto class_label = sm::label("class");
+    std::vector<sm::metric_definition> work;
+    for (size_t i = 0; i < utils::work_scheduler::classes; ++i) {
+        auto c = static_cast<utils::work_class>(i);
+        work.emplace_back(sm::make_counter("runs", [c] { return utils::local_work_scheduler().stats(c)._runs; },
+            sm::description("Total number of units of work of the class run."), {class_label(utils::work_class_name(c))}));
+        work.emplace_back(sm::make_counter("deferred", [c] { return utils::local_work_scheduler().stats(c)._deferred; },
+            sm::description("Total number of units of work of the class which waited for their share of the reactor."), {class_label(utils::work_class_name(c))}));
+        work.emplace_back(sm::make_counter("usec", [c] { return utils::local_work_scheduler().stats(c)._usec; },
+            sm::description("Total time spent in the work of the class, in microseconds."), {class_label(utils::work_class_name(c))}));
+    }
+    _metrics.add_group("work_classes", work);
+}
+
+future<scattered_message_ptr> server::connection::do_unexpect_request(request_wrapper& req)
+{
+    ++_server._stats._requests_exception;
+    if (_multi) {
+        _multi_failed = true;
+    }
+    bytes msg {"-ERR Unknown or disabled command '"};
+    msg.append(req._command.data(), req._command.size());
+    static bytes tail {"'\r\n"};
+    msg.append(tail.data(), tail.size());
+    return reply_builder::build(msg);
+}
+
+future<scattered_message_ptr> server::connection::dispatch(request_wrapper& req)
+{
+    if (subscribed() && !is_subscription_command(req._command_code) && req._command_code != command_code::ping) {
+        return reply_builder::build(msg_subscribed_context_err);
+    }
+    if (!_multi && may_shed(req._command_code) && _server.shedding()) {
+        ++_server._stats._busy_rejections;
+        return reply_builder::build(msg_busy_err);
+    }
+    _in_command = true;
+    if (req._args_count == 0 || !get_database().local().tiered()) {
+        return admit(req);
+    }
+    // the keys the store may hold are read back first, before the command
+    // is queued by MULTI too.
+    auto keys = command_keys(req);
+    if (!may_run_ahead(req, keys)) {
+        return wait_for_parked().then([this, keys = std::move(keys)] () mutable {
+            return fault_in(std::move(keys));
+        }).then([this, &req] {
+            return admit(req);
+        });
+    }
+    auto faulted = fault_in(keys);
+    if (!faulted.available()) {
+        return park(req, std::move(keys), std::move(faulted));
+    }
+    if (_parked > 0) {
+        // its reply may wait for those of the parked commands.
+        req._sink = nullptr;
+    }
+    return faulted.then([this, &req] {
+        return admit(req);
+    });
+}
+
+// Whether the command may run before the parked ones: one which only acts
+// on its keys, none of which a parked command has.
+bool server::connection::may_run_ahead(const request_wrapper& req, const std::vector<bytes>& keys) const
+{
+    auto code = req._command_code;
+    if (_multi || keys.empty() || _parked >= max_parked || is_transaction_command(code)
+        || is_subscription_command(code) || is_connection_command(code) || is_blocking_command(code)
+        || code == command_code::eval || code == command_code::evalsha) {
+        return false;
+    }
+    return std::none_of(keys.begin(), keys.end(), [this] (const bytes& key) {
+        return _parked_keys.count(key) > 0;
+    });
+}
+
+future<scattered_message_ptr> server::connection::park(request_wrapper& req, std::vector<bytes> keys, future<> faulted)
+{
+    struct parked_command {
+        request_wrapper _req;
+        uint64_t _seq;
+        lw_shared_ptr<request_trace> _trace;
+        std::vector<bytes> _keys;
+    };
+    auto p = make_lw_shared<parked_command>();
+    // out of the parser, which goes on to the next command.
+    p->_req = std::move(req);
+    p->_req._sink = nullptr;
+    p->_seq = _seq;
+    p->_trace = std::move(_trace);
+    p->_keys = std::move(keys);
+    _parked_keys.insert(p->_keys.begin(), p->_keys.end());
+    ++_parked;
+    ++_server._stats._requests_parked;
+    _parked_current = true;
+    faulted.then([this, p] {
+        // traced as the command of the connection for its synchronous part.
+        auto trace = std::exchange(_trace, p->_trace);
+        auto replied = admit(p->_req);
+        _trace = std::move(trace);
+        return replied;
+    }).then_wrapped([this, p] (future<scattered_message_ptr> f) {
+        scattered_message_ptr message;
+        if (f.failed()) {
+            // as a command which fails in order, it ends the connection.
+            f.ignore_ready_future();
+            _done = true;
+            _socket.shutdown_input();
+        }
+        else {
+            message = f.get0();
+        }
+        for (auto& key : p->_keys) {
+            _parked_keys.erase(_parked_keys.find(key));
+        }
+        if (p->_trace) {
+            p->_trace->_replied = trace_clock::now();
+        }
+        complete(p->_seq, std::move(message), std::move(p->_trace));
+        --_parked;
+        _parked_done.broadcast();
+        if (_parked == 0 && !_in_command) {
+            release_held();
+        }
+    });
+    return make_ready_future<scattered_message_ptr>();
+}
+
+future<> server::connection::wait_for_parked()
+{
+    return do_until([this] { return _parked == 0; }, [this] {
+        return _parked_done.wait();
+    });
+}
+
+future<scattered_message_ptr> server::connection::admit(request_wrapper& req)
+{
+    if (_multi && queued_in_multi(req._command_code)) {
+        _queued.push_back(std::move(req));
+        return reply_builder::build(msg_queued);
+    }
+    if (_tracking && !_bcast && is_tracked_read(req._command_code) && req._args_count > 0) {
+        // tracked before the read, so that no change after it goes unnoticed.
+        return track_keys(req).then([this, &req] {
+            return do_dispatch(req);
+        });
+    }
+    if (!may_grow_memory(req._command_code) || req._args_count == 0) {
+        return do_dispatch(req);
+    }
+    // multi-key writes wait on the owner of their first key only.
+    auto cpu = shard_of_key(req.arg_view(0), req.key_hash(), smp::count);
+    if (!redis().shard_throttled(cpu)) {
+        return do_dispatch(req);
+    }
+    ++_server._stats._throttled_writes;
+    return get_database().invoke_on(cpu, &database::wait_for_memory).then_wrapped([this, &req] (future<> f) {
+        if (f.failed()) {
+            f.ignore_ready_future();
+            ++_server._stats._oom_rejections;
+            return reply_builder::build(msg_oom_err);
+        }
+        return do_dispatch(req);
+    });
+}
+
+future<scattered_message_ptr> server::connection::do_dispatch(request_wrapper& req)
+{
+    auto code = static_cast<size_t>(req._command_code);
+    if (req._command_code != command_code::get) {
+        redis().retire_reads(req);
+    }
+    ++_server._stats._requests_serving;
+    auto start = std::chrono::steady_clock::now();
+    trace_scope scope(_trace.get());
+    family_scope family(family_of(req._command_code));
+    operation_scope op(operation_of(req));
+    utils::work_class_scope work(is_heavy_command(req._command_code) ? utils::work_class::heavy : utils::work_class::point);
+    auto handled = is_transaction_command(req._command_code)
+        ? futurize_apply([this, &req] { return transaction(req); })
+        : is_subscription_command(req._command_code)
+        ? futurize_apply([this, &req] { return subscription(req); })
+        : req._command_code == command_code::hello
+        ? futurize_apply([this, &req] { return hello(req); })
+        : req._command_code == command_code::client
+        ? futurize_apply([this, &req] { return client(req); })
+        : redis().splits(req)
+        ? futurize_apply([&req] { return redis().split_command(req); })
+        : futurize_apply(_commands[code], req);
+    return handled.then_wrapped([this, &req, code, start] (auto f) {
+        auto& stats = _server._stats;
+        auto& command = _server._command_stats[code];
+        _server.finish_requests(1);
+        ++stats._requests_served;
+        if (f.failed()) {
+            ++stats._requests_exception;
+            ++command._errors;
+        }
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        auto us = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+        ++command._calls;
+        command._usec += us;
+        ++_tenant->_stats._calls;
+        _tenant->_stats._usec += us;
+        _server._latencies[code].add(us);
+        // the time blocked is not spent in the command, as in Redis.
+        if (_server._slow_log.is_slow(us) && !is_blocking_command(req._command_code)) {
+            log_slow(req, start, us);
+        }
+        return f;
+    });
+}
+
+void server::connection::end_multi()
+{
+    _multi = false;
+    _multi_failed = false;
+    _queued.clear();
+}
+
+future<scattered_message_ptr> server::connection::transaction(request_wrapper& req)
+{
+    switch (req._command_code) {
+    case command_code::multi:
+        if (_multi) {
+            return reply_builder::build(msg_multi_nested_err);
+        }
+        _multi = true;
+        return reply_builder::build(msg_ok);
+    case command_code::exec:
+        return exec();
+    case command_code::discard:
+        if (!_multi) {
+            return reply_builder::build(msg_discard_without_multi_err);
+        }
+        end_multi();
+        return redis().unwatch(_watched).then([] {
+            return reply_builder::build(msg_ok);
+        });
+    case command_code::watch:
+        if (_multi) {
+            return reply_builder::build(msg_watch_inside_multi_err);
+        }
+        return redis().watch(req, _watched);
+    default:
+        return redis().unwatch(_watched).then([] {
+            return reply_builder::build(msg_ok);
+        });
+    }
+}
+
+// The reply of EXEC is an array of the replies of the commands: the header
+// and all but the last are pushed to the connection, the last is returned.
+future<scattered_message_ptr> server::connection::exec()
+{
+    if (!_multi) {
+        return reply_builder::build(msg_exec_without_multi_err);
+    }
+    auto failed = _multi_failed;
+    auto commands = std::move(_queued);
+    end_multi();
+    if (failed) {
+        return redis().unwatch(_watched).then([] {
+            return reply_builder::build(msg_exec_abort_err);
+        });
+    }
+    return do_with(std::move(commands), std::vector<scattered_message_ptr>(), [this] (auto& commands, auto& replies) {
+        return redis().exec(commands, _watched, execute_command, replies).then([this] (bool unchanged) {
+            return redis().unwatch(_watched).then([unchanged] {
+                return unchanged;
+            });
+        }).then([this, &replies] (bool unchanged) {
+            if (!unchanged) {
+                return reply_builder::build(msg_null_multi_bulk);
+            }
+            if (replies.empty()) {
+                return reply_builder::build(msg_empty_multi_bulk);
+            }
+            return reply_builder::build_array_header(replies.size()).then([this] (scattered_message_ptr header) {
+                return push(std::move(header));
+            }).then([this, &replies] {
+                return do_for_each(replies.begin(), replies.end() - 1, [this] (scattered_message_ptr& reply) {
+                    return push(std::move(reply));
+                });
+            }).then([&replies] {
+                return std::move(replies.back());
+            });
+        });
+    });
+}
+
+// Each channel or pattern gets its own reply `*3 $kind $name :count`, count
+// being the subscriptions of the connection after it. The reply of
+// (P)SUBSCRIBE is queued once every shard knows of the subscriptions, with
+// the messages which came meanwhile after it, and the handler returns none.
+future<scattered_message_ptr> server::connection::subscription(request_wrapper& req)
+{
+    auto code = req._command_code;
+    auto pattern = code == command_code::psubscribe || code == command_code::punsubscribe;
+    auto& names = pattern ? _patterns : _channels;
+    auto kind = to_command_name(code);
+    auto kind_size = std::strlen(kind);
+    auto m = make_lw_shared<scattered_message<char>>();
+    auto append_reply = [this, &m, kind, kind_size] (const bytes* name) {
+        reply_builder::append_array_header(*m, 3);
+        reply_builder::append_bulk(*m, kind, kind_size);
+        if (name) {
+            reply_builder::append_bulk(*m, *name);
+        }
+        else {
+            m->append_static(msg_null_blik);
+        }
+        reply_builder::append_integer(*m, _channels.size() + _patterns.size());
+    };
+    if (code == command_code::subscribe || code == command_code::psubscribe) {
+        if (req._args_count == 0) {
+            return reply_builder::build(msg_syntax_err);
+        }
+        for (size_t i = 0; i < req._args_count; ++i) {
+            auto& name = req._args[i];
+            if (names.insert(name).second) {
+                local_pubsub().subscribe(this, name, pattern);
+            }
+            append_reply(&name);
+        }
+        ++_subscribing;
+        return local_pubsub().announced().then([this, m] {
+            --_subscribing;
+            queue_reply(scattered_message_ptr(m));
+            release_held();
+            return make_ready_future<scattered_message_ptr>();
+        });
+    }
+    // without names, from all of them.
+    std::vector<bytes> unsubscribed;
+    if (req._args_count == 0) {
+        unsubscribed.assign(names.begin(), names.end());
+    }
+    else {
+        unsubscribed.assign(req._args.begin(), req._args.begin() + req._args_count);
+    }
+    if (unsubscribed.empty()) {
+        append_reply(nullptr);
+    }
+    for (auto& name : unsubscribed) {
+        if (names.erase(name) > 0) {
+            local_pubsub().unsubscribe(this, name, pattern);
+        }
+        append_reply(&name);
+    }
+    return make_ready_future<scattered_message_ptr>(scattered_message_ptr(m));
+}
+
+void server::connection::unsubscribe_all()
+{
+    for (auto& channel : _channels) {
+        local_pubsub().unsubscribe(this, channel, false);
+    }
+    for (auto& pattern : _patterns) {
+        local_pubsub().unsubscribe(this, pattern, true);
+    }
+    _channels.clear();
+    _patterns.clear();
+}
+
+void server::connection::deliver(scattered_message_ptr messages)
+{
+    if (_done) {
+        return;
+    }
+    if (_subscribing > 0 || _in_command || _parked > 0) {
+        _held.push_back(std::move(messages));
+        return;
+    }
+    // A subscriber which does not read its messages is disconnected, rather
+    // than buffered for without bound, as the pubsub output limit of Redis.
+    if (_replies.full() || _reply_bytes.current() == 0) {
+        ++_server._stats._slow_subscribers;
+        disconnect();
+        return;
+    }
+    queue_reply(std::move(messages));
+}
+
+void server::connection::disconnect()
+{
+    if (_done) {
+        return;
+    }
+    _done = true;
+    _socket.shutdown_input();
+    _socket.shutdown_output();
+}
+
+bool server::connection::idle_for(lowres_clock::time_point now, lowres_clock::duration timeout) const
+{
+    return !_in_command && _parked == 0 && !subscribed() && now - _last_interaction > timeout;
+}
+
+bool server::connection::check_output_limits(lowres_clock::time_point now)
+{
+    auto& options = _server._options;
+    if (options._output_hard_limit > 0 && _pending_reply_bytes > options._output_hard_limit) {
+        ++_server._stats._output_limit_disconnects;
+        disconnect();
+        return true;
+    }
+    if (options._output_soft_limit == 0 || _pending_reply_bytes <= options._output_soft_limit) {
+        _over_soft_limit_since = {};
+        return false;
+    }
+    if (!_over_soft_limit_since) {
+        _over_soft_limit_since = now;
+        return false;
+    }
+    if (now - *_over_soft_limit_since >= std::chrono::seconds(options._output_soft_seconds)) {
+        ++_server._stats._output_limit_disconnects;
+        disconnect();
+        return true;
+    }
+    return false;
+}
+
+void server::connection::release_held()
+{
+    if (_held.empty()) {
+        return;
+    }
+    auto held = std::move(_held);
+    _held.clear();
+    for (auto& messages : held) {
+        deliver(std::move(messages));
+    }
+}
+
+// HELLO [protover [AUTH username password] [SETNAME name]]: the map of
+// Redis, an array of pairs with protocol 2. The replies of the commands
+// keep their RESP2 encoding, which RESP3 clients read as well; what
+// protocol 3 changes is that invalidations are pushed.
+future<scattered_message_ptr> server::connection::hello(request_wrapper& req)
+{
+    auto protocol = _protocol;
+    size_t i = 0;
+    if (req._args_count > 0) {
+        auto& version = req._args[0];
+        if (version == "2" || version == "3") {
+            protocol = version[0] - '0';
+        }
+        else {
+            return reply_builder::build(msg_noproto_err);
+        }
+        i = 1;
+    }
+    auto name = _name;
+    auto user = _user;
+    for (; i < req._args_count; ++i) {
+        auto& option = req._args[i];
+        if (strcasecmp(option.c_str(), "auth") == 0 && i + 2 < req._args_count) {
+            // there are no passwords to check, the user only names a tenant.
+            user = req._args[i + 1];
+            i += 2;
+        }
+        else if (strcasecmp(option.c_str(), "setname") == 0 && i + 1 < req._args_count) {
+            name = req._args[++i];
+        }
+        else {
+            return reply_builder::build(msg_syntax_err);
+        }
+    }
+    _protocol = protocol;
+    _name = std::move(name);
+    _user = std::move(user);
+    set_tenant();
+    auto m = make_lw_shared<scattered_message<char>>();
+    m->append_static(_protocol == 3 ? "%7\r\n" : "*14\r\n");
+    auto field = [&m] (const char* name, const char* value) {
+        reply_builder::append_bulk(*m, name, std::strlen(name));
+        reply_builder::append_bulk(*m, value, std::strlen(value));
+    };
+    field("server", "redis");
+    field("version", "3.2.0");
+    reply_builder::append_bulk(*m, "proto", 5);
+    reply_builder::append_integer(*m, _protocol);
+    reply_builder::append_bulk(*m, "id", 2);
+    reply_builder::append_integer(*m, _id);
+    field("mode", _server._cluster_router ? "cluster" : "standalone");
+    field("role", "master");
+    reply_builder::append_bulk(*m, "modules", 7);
+    reply_builder::append_array_header(*m, 0);
+    return make_ready_future<scattered_message_ptr>(scattered_message_ptr(m));
+}
+
+// CLIENT ID | GETNAME | SETNAME name | GETREDIR | TRACKING ...
+future<scattered_message_ptr> server::connection::client(request_wrapper& req)
+{
+    auto is = [&req] (const char* name) {
+        return req._args_count > 0 && strcasecmp(req._args[0].c_str(), name) == 0;
+    };
+    if (is("id") && req._args_count == 1) {
+        return reply_builder::build(_id);
+    }
+    if (is("getname") && req._args_count == 1) {
+        if (_name.empty()) {
+            return reply_builder::build(msg_null_blik);
+        }
+        auto m = make_lw_shared<scattered_message<char>>();
+        reply_builder::append_bulk(*m, _name);
+        return make_ready_future<scattered_message_ptr>(scattered_message_ptr(m));
+    }
+    if (is("setname") && req._args_count == 2) {
+        auto& name = req._args[1];
+        if (std::any_of(name.begin(), name.end(), [] (char c) { return c <= ' ' || c > '~'; })) {
+            return reply_builder::build(msg_client_name_err);
+        }
+        _name = name;
+        set_tenant();
+        return reply_builder::build(msg_ok);
+    }
+    if (is("getredir") && req._args_count == 1) {
+        auto m = make_lw_shared<scattered_message<char>>();
+        reply_builder::append_integer(*m, _tracking ? static_cast<int64_t>(_redirect) : -1);
+        return make_ready_future<scattered_message_ptr>(scattered_message_ptr(m));
+    }
+    if (is("tracking") && req._args_count >= 2) {
+        return tracking(req);
+    }
+    return reply_builder::build(msg_syntax_err);
+}
+
+// CLIENT TRACKING ON|OFF [REDIRECT id] [BCAST] [PREFIX prefix ...]
+future<scattered_message_ptr> server::connection::tracking(request_wrapper& req)
+{
+    bool on = strcasecmp(req._args[1].c_str(), "on") == 0;
+    if (!on && strcasecmp(req._args[1].c_str(), "off") != 0) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    uint64_t redirect = 0;
+    bool bcast = false;
+    std::vector<bytes> prefixes;
+    for (size_t i = 2; i < req._args_count; ++i) {
+        auto option = req._args[i].c_str();
+        if (strcasecmp(option, "redirect") == 0 && i + 1 < req._args_count) {
+            try {
+                redirect = std::stoull(req._args[++i].c_str());
+            } catch (const std::logic_error&) {
+                return reply_builder::build(msg_syntax_err);
+            }
+        }
+        else if (strcasecmp(option, "bcast") == 0) {
+            bcast = true;
+        }
+        else if (strcasecmp(option, "prefix") == 0 && i + 1 < req._args_count) {
+            prefixes.push_back(req._args[++i]);
+        }
+        else if (strcasecmp(option, "optin") == 0 || strcasecmp(option, "optout") == 0 || strcasecmp(option, "noloop") == 0) {
+            return reply_builder::build(msg_tracking_option_err);
+        }
+        else {
+            return reply_builder::build(msg_syntax_err);
+        }
+    }
+    if (!on) {
+        return stop_tracking().then([] {
+            return reply_builder::build(msg_ok);
+        });
+    }
+    if (!prefixes.empty() && !bcast) {
+        return reply_builder::build(msg_tracking_prefix_err);
+    }
+    if (_tracking && bcast != _bcast) {
+        return reply_builder::build(msg_tracking_mode_err);
+    }
+    auto exists = redirect == 0 ? make_ready_future<bool>(true) : smp::submit_to(client_tracking::shard_of_client(redirect), [redirect] {
+        return local_tracking().has_client(redirect);
+    });
+    return exists.then([this, redirect, bcast, prefixes = std::move(prefixes)] (bool exists) mutable {
+        if (!exists) {
+            return reply_builder::build(msg_tracking_redirect_err);
+        }
+        _tracking = true;
+        _bcast = bcast;
+        _redirect = redirect;
+        if (!bcast) {
+            return reply_builder::build(msg_ok);
+        }
+        if (prefixes.empty()) {
+            prefixes.emplace_back();
+        }
+        _prefixes.insert(_prefixes.end(), prefixes.begin(), prefixes.end());
+        auto client = redirect ? redirect : _id;
+        return get_database().invoke_on_all(&database::track_prefixes, std::move(prefixes), client, true).then([] {
+            return reply_builder::build(msg_ok);
+        });
+    });
+}
+
+// Calls func(cpu, keys) with the keys owned by each shard owning any.
+template <typename Func>
+static future<> for_each_owner(std::vector<bytes> keys, Func&& func)
+{
+    if (keys.size() == 1) {
+        auto cpu = shard_of_key(bytes_view { keys[0].data(), keys[0].size() }, smp::count);
+        return func(cpu, std::move(keys));
+    }
+    std::vector<std::vector<bytes>> owned(smp::count);
+    for (auto& key : keys) {
+        auto cpu = shard_of_key(bytes_view { key.data(), key.size() }, smp::count);
+        owned[cpu].push_back(std::move(key));
+    }
+    return do_with(std::move(owned), [func = std::forward<Func>(func)] (auto& owned) mutable {
+        return parallel_for_each(boost::irange<unsigned>(0, smp::count), [&owned, &func] (unsigned cpu) {
+            if (owned[cpu].empty()) {
+                return make_ready_future<>();
+            }
+            return func(cpu, std::move(owned[cpu]));
+        });
+    });
+}
+
+future<> server::connection::track_keys(request_wrapper& req)
+{
+    auto client = _redirect ? _redirect : _id;
+    auto code = req._command_code;
+    auto multi_key = code == command_code::mget || code == command_code::exists || code == command_code::pfcount;
+    std::vector<bytes> keys(req._args.begin(), req._args.begin() + (multi_key ? req._args_count : 1));
+    return for_each_owner(std::move(keys), [client] (unsigned cpu, std::vector<bytes> keys) {
+        return get_database().invoke_on(cpu, &database::track, std::move(keys), client);
+    });
+}
+
+future<> server::connection::fault_in(std::vector<bytes> keys)
+{
+    return for_each_owner(std::move(keys), [] (unsigned cpu, std::vector<bytes> keys) {
+        return get_database().invoke_on(cpu, &database::fault_in, std::move(keys));
+    });
+}
+
+// The owners of the keys it read still remember the connection, and send
+// it an invalidation on their next change, as they send the invalidations
+// of a closed connection to nobody.
+future<> server::connection::stop_tracking()
+{
+    auto prefixes = std::move(_prefixes);
+    _prefixes.clear();
+    auto client = _redirect ? _redirect : _id;
+    auto bcast = _tracking && _bcast;
+    _tracking = false;
+    _bcast = false;
+    _redirect = 0;
+    if (!bcast) {
+        return make_ready_future<>();
+    }
+    return get_database().invoke_on_all(&database::track_prefixes, std::move(prefixes), client, false);
+}
+
+// `>2 $invalidate *n keys` with protocol 3, else the message of the
+// __redis__:invalidate channel if the connection subscribes to it, as the
+// one another connection redirects to.
+void server::connection::invalidate(const std::vector<bytes>& keys)
+{
+    static const bytes channel { "__redis__:invalidate" };
+    auto m = make_lw_shared<scattered_message<char>>();
+    if (_protocol == 3) {
+        m->append_static(">2\r\n$10\r\ninvalidate\r\n");
+    }
+    else if (_channels.count(channel) > 0) {
+        m->append_static("*3\r\n$7\r\nmessage\r\n$20\r\n__redis__:invalidate\r\n");
+    }
+    else {
+        return;
+    }
+    reply_builder::append_array_header(*m, keys.size());
+    for (auto& key : keys) {
+        reply_builder::append_bulk(*m, key);
+    }
+    deliver(scattered_message_ptr(m));
+}
+
+future<scattered_message_ptr> server::publish(request_wrapper& req)
+{
+    if (req._args_count != 2) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    return local_pubsub().publish(req._args[0], req._args[1]).then([] (size_t receivers) {
+        return reply_builder::build(receivers);
+    });
+}
+
+future<scattered_message_ptr> server::pubsub(request_wrapper& req)
+{
+    auto is = [&req] (const char* name) {
+        return req._args_count > 0 && strcasecmp(req._args[0].c_str(), name) == 0;
+    };
+    if (is("channels") && req._args_count <= 2) {
+        // every shard knows the channels of all.
+        auto channels = local_pubsub().channels(req._args_count == 2 ? &req._args[1] : nullptr);
+        auto m = make_lw_shared<scattered_message<char>>();
+        reply_builder::append_array_header(*m, channels.size());
+        for (auto& c : channels) {
+            reply_builder::append_bulk(*m, c);
+        }
+        return make_ready_future<scattered_message_ptr>(scattered_message_ptr(m));
+    }
+    if (is("numsub")) {
+        std::vector<bytes> channels(req._args.begin() + 1, req._args.begin() + req._args_count);
+        auto counts = std::vector<size_t>(channels.size());
+        return do_with(std::move(channels), std::move(counts), [] (auto& channels, auto& counts) {
+            return parallel_for_each(boost::irange<unsigned>(0, smp::count), [&channels, &counts] (unsigned cpu) {
+                return smp::submit_to(cpu, [&channels] {
+                    std::vector<size_t> shard_counts;
+                    for (auto& c : channels) {
+                        shard_counts.push_back(local_pubsub().subscribers_of(c));
+                    }
+                    return shard_counts;
+                }).then([&counts] (std::vector<size_t> shard_counts) {
+                    for (size_t i = 0; i < counts.size(); ++i) {
+                        counts[i] += shard_counts[i];
+                    }
+                });
+            }).then([&channels, &counts] {
+                auto m = make_lw_shared<scattered_message<char>>();
+                reply_builder::append_array_header(*m, channels.size() * 2);
+                for (size_t i = 0; i < channels.size(); ++i) {
+                    reply_builder::append_bulk(*m, channels[i]);
+                    reply_builder::append_integer(*m, counts[i]);
+                }
+                return make_ready_future<scattered_message_ptr>(scattered_message_ptr(m));
+            });
+        });
+    }
+    if (is("numpat") && req._args_count == 1) {
+        // the patterns of each shard, as one subscribed to on two shards
+        // counts twice.
+        return get_server().map_reduce0([] (server&) {
+            return local_pubsub().pattern_count();
+        }, size_t(0), std::plus<size_t>()).then([] (size_t count) {
+            return reply_builder::build(count);
+        });
+    }
+    return reply_builder::build(msg_syntax_err);
+}
+
+// The clients of the unix socket show as its path, as in Redis.
+static sstring format_address(const socket_address& addr, const sstring& unix_socket)
+{
+    if (addr.u.sa.sa_family == AF_UNIX) {
+        return unix_socket + ":0";
+    }
+    char ip[INET_ADDRSTRLEN];
+    ::inet_ntop(AF_INET, &addr.u.in.sin_addr, ip, sizeof(ip));
+    return sprint("%s:%u", ip, ntohs(addr.u.in.sin_port));
+}
+
+void server::connection::capture(const request_wrapper& req)
+{
+    auto& capture = _server._capture;
+    if (_capture_generation != capture.generation()) {
+        _capture_generation = capture.generation();
+        _captured = capture.sample();
+    }
+    if (_captured && req._state == protocol_state::ok) {
+        capture.record(_id, req);
+    }
 }
 
-future<scattered_message_ptr> server::connection::do_unexpect_request(request_wrapper& req)
+void server::connection::log_slow(const request_wrapper& req, std::chrono::steady_clock::time_point start, uint64_t duration_us)
 {
-    bytes msg {"-ERR Unknown or disabled command '"};
-    msg.append(req._command.data(), req._command.size());
-    static bytes tail {"'\r\n"};
-    msg.append(tail.data(), tail.size());
-    return reply_builder::build(msg);
+    // the arguments are truncated as Redis does, so that a large command
+    // takes little room in the log.
+    auto truncated = [] (bytes_view v) {
+        if (v.size() <= slow_log::max_arg_bytes) {
+            return sstring(v.data(), v.size());
+        }
+        return sstring(v.data(), slow_log::max_arg_bytes) + sprint("... (%u more bytes)", v.size() - slow_log::max_arg_bytes);
+    };
+    slowlog_entry entry;
+    entry._id = _server._slow_log.next_id(engine().cpu_id(), smp::count);
+    auto started = std::chrono::system_clock::now() - (std::chrono::steady_clock::now() - start);
+    entry._timestamp = std::chrono::duration_cast<std::chrono::seconds>(started.time_since_epoch()).count();
+    entry._duration_us = duration_us;
+    entry._args.push_back(truncated(bytes_view { req._command.data(), req._command.size() }));
+    size_t args = req._args_count;
+    size_t kept = std::min(args, slow_log::max_args - 1);
+    if (kept < args) {
+        --kept;
+    }
+    for (size_t i = 0; i < kept; ++i) {
+        entry._args.push_back(truncated(req.arg_view(i)));
+    }
+    if (kept < args) {
+        entry._args.push_back(sprint("... (%u more arguments)", args - kept));
+    }
+    entry._client = format_address(_addr, _server._options._unix_socket);
+    entry._shard = engine().cpu_id();
+    _server._slow_log.record(std::move(entry));
 }
 
 future<scattered_message_ptr> server::connection::do_handle_one(request_wrapper& req)
 {
-    std::transform(req._command.begin(), req._command.end(), req._command.begin(), ::tolower);
     if (req._state == protocol_state::ok) {
         req.clear_temporary_containers();
-        const auto& command = _commands.find(req._command);
-        if (command != _commands.end()) {
-            return (command->second)(req);
+        req._sink = this;
+        if (_commands[static_cast<size_t>(req._command_code)] != nullptr || is_transaction_command(req._command_code)
+            || is_subscription_command(req._command_code) || is_connection_command(req._command_code)) {
+            if (_server._cluster_router == nullptr) {
+                return dispatch(req);
+            }
+            if (req._command_code == command_code::asking) {
+                _asking = true;
+                return dispatch(req);
+            }
+            auto asking = std::exchange(_asking, false);
+            return _server._cluster_router->redirect(req, asking).then([this, &req] (bytes error) {
+                if (!error.empty()) {
+                    ++_server._stats._redirects;
+                    if (_multi) {
+                        _multi_failed = true;
+                    }
+                    return reply_builder::build(error);
+                }
+                return dispatch(req);
+            });
         }
     }
     else if (req._state == protocol_state::eof) {
@@ -163,29 +1308,345 @@ future<scattered_message_ptr> server::connection::do_handle_one(request_wrapper&
     return do_unexpect_request(req);
 }
 
+// Plain commands of keys, which neither act on the connection nor wait.
+static bool batchable_command(const request_wrapper& req)
+{
+    return req._state == protocol_state::ok && req._args_count > 0
+        && _commands[static_cast<size_t>(req._command_code)] != nullptr
+        && !is_transaction_command(req._command_code) && !is_subscription_command(req._command_code)
+        && !is_connection_command(req._command_code) && !is_blocking_command(req._command_code);
+}
+
+size_t server::connection::batchable_run(unsigned& cpu) const
+{
+    // what dispatch() does besides running the command is left to it.
+    if (_pipeline.size() < 2 || _multi || subscribed() || _tracking || _server._cluster_router != nullptr
+        || _server._tracer.probability() > 0 || get_database().local().tiered() || _server.shedding()
+        || _tenant->limited()) {
+        return 0;
+    }
+    size_t count = 0;
+    for (auto& req : _pipeline) {
+        if (!batchable_command(req)) {
+            break;
+        }
+        auto owner = shard_of_key(req.arg_view(0), req.key_hash(), smp::count);
+        if (count == 0) {
+            if (owner == engine().cpu_id()) {
+                return 0;
+            }
+            cpu = owner;
+        }
+        else if (owner != cpu) {
+            break;
+        }
+        if (may_grow_memory(req._command_code) && redis().shard_throttled(cpu)) {
+            break;
+        }
+        ++count;
+    }
+    return count;
+}
+
+future<> server::connection::run_batch(unsigned cpu, size_t count)
+{
+    struct outcome {
+        scattered_message_ptr _reply;
+        std::exception_ptr _error;
+        uint64_t _usec = 0;
+    };
+    for (size_t i = 0; i < count; ++i) {
+        if (_pipeline[i]._command_code != command_code::get) {
+            redis().retire_reads(_pipeline[i]);
+        }
+    }
+    ++_server._stats._pipeline_batches;
+    _server._stats._pipeline_batched += count;
+    _server._stats._requests_serving += count;
+    auto start = std::chrono::steady_clock::now();
+    return smp::submit_to(cpu, [pipeline = &_pipeline, count] {
+        return do_with(std::vector<outcome>(count), [pipeline, count] (auto& outcomes) {
+            return do_for_each(boost::irange<size_t>(0, count), [pipeline, &outcomes] (size_t i) {
+                auto start = std::chrono::steady_clock::now();
+                operation_scope op(operation_of((*pipeline)[i]));
+                return execute_command((*pipeline)[i]).then_wrapped([&outcomes, i, start] (future<scattered_message_ptr> f) {
+                    auto& o = outcomes[i];
+                    if (f.failed()) {
+                        o._error = f.get_exception();
+                    }
+                    else {
+                        o._reply = f.get0();
+                    }
+                    o._usec = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+                });
+            }).then([&outcomes] {
+                return std::move(outcomes);
+            });
+        });
+    }).then([this, start] (std::vector<outcome> outcomes) {
+        auto& stats = _server._stats;
+        auto at = start;
+        for (size_t i = 0; i < outcomes.size(); ++i) {
+            auto& o = outcomes[i];
+            auto& req = _pipeline[i];
+            auto code = static_cast<size_t>(req._command_code);
+            auto& command = _server._command_stats[code];
+            _server.finish_requests(1);
+            ++stats._requests_served;
+            if (o._error) {
+                ++stats._requests_exception;
+                ++command._errors;
+            }
+            ++command._calls;
+            command._usec += o._usec;
+            ++_tenant->_stats._calls;
+            _tenant->_stats._usec += o._usec;
+            _server._latencies[code].add(o._usec);
+            if (_server._slow_log.is_slow(o._usec)) {
+                log_slow(req, at, o._usec);
+            }
+            at += std::chrono::microseconds(o._usec);
+            _batched.push_back(batched_reply { std::move(o._reply), std::move(o._error) });
+        }
+    });
+}
+
+future<scattered_message_ptr> execute_command(request_wrapper& req)
+{
+    auto handler = _commands[static_cast<size_t>(req._command_code)];
+    if (req._state != protocol_state::ok || handler == nullptr) {
+        bytes msg {"-ERR Unknown or disabled command '"};
+        msg.append(req._command.data(), req._command.size());
+        static bytes tail {"'\r\n"};
+        msg.append(tail.data(), tail.size());
+        return reply_builder::build(msg);
+    }
+    req.clear_temporary_containers();
+    req._sink = nullptr;
+    if (req._command_code != command_code::get) {
+        redis().retire_reads(req);
+    }
+    return futurize_apply(handler, req);
+}
+
+// A read which brings a single command leaves it in the parser, as the
+// parser owns the arguments of the command being handled. One which brings
+// several moves them out to the pipeline, up to _pipeline_batch.
+future<protocol_parser::unconsumed_remainder> server::connection::pipeline_consumer::operator()(temporary_buffer<char> buf)
+{
+    using remainder = protocol_parser::unconsumed_remainder;
+    auto& c = _connection;
+    for (;;) {
+        auto rest = c._parser.parse(std::move(buf));
+        if (!rest) {
+            if (c._pipeline.empty()) {
+                return make_ready_future<remainder>();
+            }
+            // the commands parsed go first, this one ends in a later read.
+            c._mid_command = true;
+            return make_ready_future<remainder>(temporary_buffer<char>());
+        }
+        c._mid_command = false;
+        if (c._server._capture.active()) {
+            c.capture(c._parser.request());
+        }
+        if (c._pipeline.empty() && (rest->empty() || c._server._options._pipeline_batch <= 1)) {
+            return make_ready_future<remainder>(std::move(rest));
+        }
+        c._pipeline.push_back(std::move(c._parser.request()));
+        if (c._pipeline.back()._state != protocol_state::ok || rest->empty() || c._pipeline.size() >= c._server._options._pipeline_batch) {
+            return make_ready_future<remainder>(std::move(rest));
+        }
+        c._parser.init();
+        buf = std::move(*rest);
+    }
+}
+
 future<scattered_message_ptr> server::connection::handle()
 {
-    _parser.init();
+    if (!_pipeline.empty()) {
+        return handle_parsed();
+    }
+    if (!_mid_command) {
+        _parser.init();
+    }
     // NOTE: The command is handled sequentially. The parser will control the lifetime
     // of every parameters for command.
-    return _in.consume(_parser).then([this] {
-        return _replies.not_full().then([this] {
-                return do_handle_one(_parser.request());
+    return _in.consume(_consumer).then([this] {
+        return handle_parsed();
+    });
+}
+
+future<scattered_message_ptr> server::connection::handle_parsed()
+{
+    _seq = _next_seq++;
+    if (!_batched.empty()) {
+        return take_batched();
+    }
+    if (_tenant->limited()) {
+        // the commands of a limited tenant are not batched, each waits for
+        // the limits in turn.
+        auto& req = _pipeline.empty() ? _parser.request() : _pipeline.front();
+        size_t size = 0;
+        if (_tenant->_bytes) {
+            for (size_t i = 0; i < req._args_count && i < req._args.size(); ++i) {
+                size += req._args[i].size();
+            }
+        }
+        auto admitted = _server._tenants.admit(*_tenant, size);
+        if (!admitted.available()) {
+            return admitted.then([this] {
+                return handle_admitted();
+            });
+        }
+    }
+    return handle_admitted();
+}
+
+future<scattered_message_ptr> server::connection::handle_admitted()
+{
+    unsigned cpu;
+    auto count = batchable_run(cpu);
+    if (count > 1) {
+        return run_batch(cpu, count).then([this] {
+            return take_batched();
+        });
+    }
+    auto& req = _pipeline.empty() ? _parser.request() : _pipeline.front();
+    if (req._state == protocol_state::ok) {
+        _trace = _server._tracer.sample(req._command_code, engine().cpu_id());
+    }
+    return do_handle_one(req);
+}
+
+future<scattered_message_ptr> server::connection::take_batched()
+{
+    auto batched = std::move(_batched.front());
+    _batched.pop_front();
+    if (batched._error) {
+        return make_exception_future<scattered_message_ptr>(batched._error);
+    }
+    return make_ready_future<scattered_message_ptr>(std::move(batched._reply));
+}
+
+// The parked commands and the replies waiting for theirs keep a place in
+// the queue, which they take as they are queued in order.
+bool server::connection::has_reply_room() const
+{
+    return _replies.size() + _parked + _reordered.size() < _replies.max_size()
+        && _reply_bytes.current() > 0 && _server._shard_reply_bytes.current() > 0;
+}
+
+future<> server::connection::wait_for_reply_room()
+{
+    // Replies are accounted once they are built, so a single large reply may
+    // overshoot the budget, but then no more requests are read until it drains.
+    if (has_reply_room()) {
+        return make_ready_future<>();
+    }
+    ++_server._stats._backpressure_total;
+    return do_until([this] { return has_reply_room(); }, [this] {
+        if (_replies.full()) {
+            return _replies.not_full();
+        }
+        if (_replies.size() + _parked + _reordered.size() >= _replies.max_size()) {
+            return _parked_done.wait();
+        }
+        return _reply_bytes.wait(1).then([this] {
+            _reply_bytes.signal(1);
+            return _server._shard_reply_bytes.wait(1).then([this] {
+                _server._shard_reply_bytes.signal(1);
+            });
         });
     });
 }
 
+reply_wrapper server::connection::account_reply(scattered_message_ptr message, lw_shared_ptr<request_trace> trace)
+{
+    size_t size = message ? message->size() : 0;
+    _pending_reply_bytes += size;
+    _reply_bytes.consume(size);
+    _server._shard_reply_bytes.consume(size);
+    _server._stats._reply_bytes_pending += size;
+    ++_server._stats._replies_pending;
+    if (!_done) {
+        check_output_limits(lowres_clock::now());
+    }
+    return reply_wrapper { std::move(message), size, std::move(trace) };
+}
+
+void server::connection::queue_reply(scattered_message_ptr message, lw_shared_ptr<request_trace> trace)
+{
+    _replies.push(account_reply(std::move(message), std::move(trace)));
+}
+
+void server::connection::complete(uint64_t seq, scattered_message_ptr message, lw_shared_ptr<request_trace> trace)
+{
+    if (seq != _next_reply) {
+        _reordered.emplace(seq, account_reply(std::move(message), std::move(trace)));
+        return;
+    }
+    queue_reply(std::move(message), std::move(trace));
+    ++_next_reply;
+    for (auto i = _reordered.begin(); i != _reordered.end() && i->first == _next_reply; i = _reordered.erase(i)) {
+        _replies.push(std::move(i->second));
+        ++_next_reply;
+    }
+}
+
+// The chunks of a streamed reply are written while the next ones are built,
+// under the same budget as whole replies.
+future<> server::connection::push(scattered_message_ptr chunk)
+{
+    return wait_for_reply_room().then([this, chunk = std::move(chunk)] () mutable {
+        queue_reply(std::move(chunk));
+    });
+}
+
+void server::connection::release_reply_bytes(size_t size, size_t count)
+{
+    _pending_reply_bytes -= size;
+    _reply_bytes.signal(size);
+    _server._shard_reply_bytes.signal(size);
+    _server._stats._reply_bytes_pending -= size;
+    _server._stats._replies_pending -= count;
+    if (_over_soft_limit_since && _pending_reply_bytes <= _server._options._output_soft_limit) {
+        _over_soft_limit_since = {};
+    }
+}
+
 future<> server::connection::request()
 {
     return do_until([this] { return _done; }, [this] {
-        return _replies.not_full().then([this] {
+        return wait_for_reply_room().then([this] {
+            return _server.wait_for_admission();
+        }).then([this] {
             return reqeust_process_stage(this).then([this] (auto message) {
-                _replies.push(reply_wrapper { std::move(message) });
+                if (!std::exchange(_parked_current, false)) {
+                    if (_trace) {
+                        _trace->_replied = trace_clock::now();
+                    }
+                    complete(_seq, std::move(message), std::move(_trace));
+                }
+                if (!_pipeline.empty()) {
+                    _pipeline.pop_front();
+                }
+                else {
+                    _parser.request().release_memory();
+                }
+                _last_interaction = lowres_clock::now();
+                _in_command = false;
+                if (_parked == 0) {
+                    release_held();
+                }
                 return make_ready_future<>();
             });
         });
     }).finally([this] {
-        return _in.close();
+        // the parked commands refer to the connection until they reply.
+        return wait_for_parked().finally([this] {
+            return _in.close();
+        });
     });
 }
 
@@ -193,28 +1654,927 @@ future<> server::connection::reply()
 {
     return do_until([this] { return _done && _replies.empty(); }, [this] {
         return _replies.pop_eventually().then([this] (auto resp) {
-            return _out.write(std::move(*resp._reply)).then([this] {
+            // Drain all replies which are ready now into one packet, so that
+            // a pipeline of N commands costs one flush rather than N.
+            net::packet p;
+            size_t size = 0, count = 0;
+            std::vector<lw_shared_ptr<request_trace>> traces;
+            auto append = [&p, &size, &count, &traces] (reply_wrapper& r) {
+                if (r._reply) {
+                    p.append(std::move(*r._reply).release());
+                }
+                if (r._trace) {
+                    traces.push_back(std::move(r._trace));
+                }
+                size += r._size;
+                ++count;
+            };
+            append(resp);
+            while (!_replies.empty() && p.len() < _reply_flush_bytes) {
+                auto next = _replies.pop();
+                append(next);
+            }
+            if (p.len() == 0) {
+                release_reply_bytes(size, count);
+                return make_ready_future<>();
+            }
+            return _out.write(std::move(p)).then([this] {
                 return _out.flush();
+            }).then([this, traces = std::move(traces)] {
+                auto now = trace_clock::now();
+                for (auto& t : traces) {
+                    t->_flushed = now;
+                    _server._tracer.record(*t);
+                }
+            }).finally([this, size, count] {
+                release_reply_bytes(size, count);
             });
         });
     });
 }
 
-void server::start()
+future<scattered_message_ptr> server::cluster(request_wrapper& req)
 {
-    listen_options lo;
-    lo.reuse_address = true;
-    _listener = engine().listen(make_ipv4_address({_port}), lo);
-    keep_doing([this] {
-       return _listener->accept().then([this] (connected_socket fd, socket_address addr) mutable {
+    if (_cluster_router == nullptr) {
+        static bytes disabled { "-ERR This instance has cluster support disabled\r\n" };
+        return reply_builder::build(disabled);
+    }
+    return _cluster_router->cluster(req);
+}
+
+void server::sample_ops()
+{
+    auto served = _stats._requests_served;
+    _ops_history[_ops_sampled++ % ops_samples] = served - _ops_last;
+    _ops_last = served;
+}
+
+uint64_t server::ops_per_sec() const
+{
+    auto samples = std::min<size_t>(_ops_sampled, ops_samples);
+    if (samples == 0) {
+        return 0;
+    }
+    uint64_t sum = 0;
+    for (size_t i = 0; i < samples; ++i) {
+        sum += _ops_history[i];
+    }
+    return sum * 1000 / (samples * ops_sample_period_ms);
+}
+
+shard_info server::get_shard_info() const
+{
+    shard_info info;
+    info._keyspace = get_local_database().get_keyspace_info();
+    info._connections_current = _stats._connections_current;
+    info._connections_total = _stats._connections_total;
+    info._rejected_connections = _stats._rejected_connections;
+    info._requests_served = _stats._requests_served;
+    info._ops_per_sec = ops_per_sec();
+    info._commands = _command_stats;
+    info._snapshot = get_local_database().get_snapshot_stats();
+    auto& sizes = cache_entry::value_size_distribution();
+    for (size_t i = 0; i < info._value_sizes.size(); ++i) {
+        info._value_sizes[i] = sizes.of(static_cast<size_distribution::kind>(i));
+    }
+    for (auto& t : _tenants.tenants()) {
+        info._tenants.emplace(t.first, t.second._stats);
+    }
+    return info;
+}
+
+// 1.50M, as the *_human fields of Redis.
+static sstring human_bytes(uint64_t n)
+{
+    const char* units = "BKMGTP";
+    double v = n;
+    size_t unit = 0;
+    while (v >= 1024 && unit + 1 < std::strlen(units)) {
+        v /= 1024;
+        ++unit;
+    }
+    return unit == 0 ? sprint("%uB", n) : sprint("%.2f%c", v, units[unit]);
+}
+
+future<scattered_message_ptr> server::info(request_wrapper& req)
+{
+    if (req._args_count > 1) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    static const char* sections[] = { "server", "clients", "memory", "persistence", "stats", "replication", "shards", "commandstats", "tenants", "keysizes", "keyspace" };
+    sstring section { "default" };
+    if (req._args_count == 1) {
+        section = sstring(req._args[0].data(), req._args[0].size());
+        std::transform(section.begin(), section.end(), section.begin(), ::tolower);
+        auto known = section == "default" || section == "all" || section == "everything";
+        for (auto name : sections) {
+            known |= section == name;
+        }
+        if (!known) {
+            static bytes empty { "$0\r\n\r\n" };
+            return reply_builder::build(empty);
+        }
+    }
+    using info_ptr = foreign_ptr<lw_shared_ptr<replication_info>>;
+    struct gathered {
+        std::vector<info_ptr> _replication { smp::count };
+        std::vector<shard_info> _shards { smp::count };
+    };
+    return do_with(gathered(), [this, section] (auto& g) {
+        return parallel_for_each(boost::irange<unsigned>(0, smp::count), [&g] (unsigned cpu) {
+            return get_database().invoke_on(cpu, [] (database& db) {
+                return db.get_replication_info();
+            }).then([&g, cpu] (info_ptr info) {
+                g._replication[cpu] = std::move(info);
+                return get_server().invoke_on(cpu, [] (server& s) {
+                    return s.get_shard_info();
+                });
+            }).then([&g, cpu] (shard_info info) {
+                g._shards[cpu] = std::move(info);
+            });
+        }).then([this, &g, section] {
+            auto wants = [&section] (const char* name) {
+                // commandstats is left out of the default sections, as in
+                // Redis, and so are the tenants and the key sizes.
+                auto all = section == "all" || section == "everything";
+                return all || section == name
+                    || (section == "default" && strcmp(name, "commandstats") != 0 && strcmp(name, "tenants") != 0
+                        && strcmp(name, "keysizes") != 0);
+            };
+            shard_info total;
+            for (auto& s : g._shards) {
+                total._keyspace += s._keyspace;
+                total._connections_current += s._connections_current;
+                total._connections_total += s._connections_total;
+                total._rejected_connections += s._rejected_connections;
+                total._requests_served += s._requests_served;
+                total._ops_per_sec += s._ops_per_sec;
+                for (size_t code = 0; code < total._commands.size(); ++code) {
+                    total._commands[code]._calls += s._commands[code]._calls;
+                    total._commands[code]._usec += s._commands[code]._usec;
+                    total._commands[code]._errors += s._commands[code]._errors;
+                }
+                for (auto& t : s._tenants) {
+                    total._tenants[t.first] += t.second;
+                }
+                for (size_t i = 0; i < total._value_sizes.size(); ++i) {
+                    total._value_sizes[i].merge(s._value_sizes[i]);
+                }
+            }
+            auto& keyspace = total._keyspace;
+            auto& memory = keyspace._memory;
+            sstring text;
+            auto add = [&text] (sstring lines) {
+                if (!text.empty()) {
+                    text += "\r\n";
+                }
+                text += lines;
+            };
+            if (wants("server")) {
+                auto uptime = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now() - _started).count();
+                add(sprint("# Server\r\nredis_version:%s\r\npedis_version:%s\r\nredis_mode:%s\r\nprocess_id:%d\r\ntcp_port:%u\r\n"
+                    "uptime_in_seconds:%d\r\nuptime_in_days:%d\r\nshards:%u\r\nnetwork_stack:%s\r\nconnection_balancing:%s\r\n",
+                    "3.2.0", pedis_version(), _cluster_router ? "cluster" : "standalone", ::getpid(), _options._port,
+                    uptime, uptime / 86400, smp::count, _options._native_stack ? "native" : "posix",
+                    to_connection_balancing_name(_options._connection_balancing)));
+            }
+            if (wants("clients")) {
+                // how evenly the connections are spread over the shards.
+                uint64_t fewest = std::numeric_limits<uint64_t>::max(), most = 0;
+                for (auto& s : g._shards) {
+                    fewest = std::min(fewest, s._connections_current);
+                    most = std::max(most, s._connections_current);
+                }
+                add(sprint("# Clients\r\nconnected_clients:%u\r\nconnected_clients_shard_min:%u\r\nconnected_clients_shard_max:%u\r\n"
+                    "maxclients:%u\r\n",
+                    total._connections_current, fewest, most, _options._max_clients));
+            }
+            if (wants("memory")) {
+                add(sprint("# Memory\r\nused_memory:%u\r\nused_memory_human:%s\r\nused_memory_dataset:%u\r\n"
+                    "lsa_region_used:%u\r\nlsa_region_free:%u\r\nmemtables:%u\r\nblock_cache:%u\r\n"
+                    "maxmemory:%u\r\nmaxmemory_human:%s\r\nmaxmemory_policy:%s\r\n",
+                    memory._allocated, human_bytes(memory._allocated), memory._region_used + memory._shared_values,
+                    memory._region_used, memory._region_free, memory._memtables, memory._block_cache,
+                    keyspace._max_memory, human_bytes(keyspace._max_memory),
+                    to_eviction_policy_name(get_local_database().get_eviction_policy())));
+            }
+            if (wants("persistence")) {
+                // a save is when every shard saved, which the shards do on
+                // their own: the oldest one counts.
+                bool in_progress = false, ok = true;
+                uint64_t last_save = std::numeric_limits<uint64_t>::max(), duration_ms = 0, keys = 0, bytes = 0, saved_before_write = 0;
+                for (auto& s : g._shards) {
+                    auto& snapshot = s._snapshot;
+                    in_progress |= snapshot._in_progress;
+                    ok &= snapshot._last_save_ok;
+                    last_save = std::min(last_save, snapshot._last_save);
+                    duration_ms = std::max(duration_ms, snapshot._last_duration_ms);
+                    keys += snapshot._last_keys;
+                    bytes += snapshot._last_bytes;
+                    saved_before_write += snapshot._saved_before_write;
+                }
+                add(sprint("# Persistence\r\nloading:0\r\nrdb_bgsave_in_progress:%d\r\nrdb_last_save_time:%u\r\n"
+                    "rdb_last_bgsave_status:%s\r\nrdb_last_bgsave_time_sec:%u\r\nrdb_last_saved_keys:%u\r\n"
+                    "rdb_last_saved_bytes:%u\r\nrdb_saved_before_write:%u\r\n",
+                    in_progress ? 1 : 0, last_save, ok ? "ok" : "err", duration_ms / 1000, keys, bytes, saved_before_write));
+            }
+            if (wants("stats")) {
+                auto misses = keyspace._reads - std::min(keyspace._reads, keyspace._hits);
+                auto ratio = keyspace._reads ? double(keyspace._hits) / keyspace._reads : 0.0;
+                add(sprint("# Stats\r\ntotal_connections_received:%u\r\ntotal_commands_processed:%u\r\n"
+                    "instantaneous_ops_per_sec:%u\r\nrejected_connections:%u\r\nkeyspace_hits:%u\r\nkeyspace_misses:%u\r\n"
+                    "keyspace_hit_ratio:%.4f\r\nexpired_keys:%u\r\nevicted_keys:%u\r\n",
+                    total._connections_total, total._requests_served, total._ops_per_sec, total._rejected_connections,
+                    keyspace._hits, misses, ratio, keyspace._expired, keyspace._evicted));
+            }
+            if (wants("replication")) {
+                // Every node of the ring is the primary of some keys, and tails
+                // the logs of the primaries of the keys it replicates.
+                uint64_t offset = 0;
+                size_t replicas = 0, primaries = 0;
+                sstring replica_lines, primary_lines, shard_lines;
+                for (unsigned cpu = 0; cpu < smp::count; ++cpu) {
+                    auto& info = *g._replication[cpu];
+                    offset += info._offset;
+                    shard_lines += sprint("shard%u:replid=%s,offset=%u\r\n", cpu, info._replication_id, info._offset);
+                    for (auto& p : info._replicas) {
+                        replica_lines += sprint("slave%u:ip=%s,shard=%u,offset=%u,lag=%u\r\n", replicas++, p._address, p._shard, p._offset, p._lag);
+                    }
+                    for (auto& p : info._primaries) {
+                        primary_lines += sprint("master%u:ip=%s,shard=%u,offset=%u,lag=%u\r\n", primaries++, p._address, p._shard, p._offset, p._lag);
+                    }
+                }
+                add(sprint("# Replication\r\nrole:master\r\nconnected_slaves:%u\r\n", replicas) + replica_lines
+                    + sprint("master_replid:%s\r\nmaster_repl_offset:%u\r\n", g._replication[0]->_replication_id, offset) + shard_lines
+                    + sprint("connected_masters:%u\r\n", primaries) + primary_lines);
+            }
+            if (wants("shards")) {
+                sstring lines { "# Shards\r\n" };
+                for (unsigned cpu = 0; cpu < smp::count; ++cpu) {
+                    auto& s = g._shards[cpu];
+                    lines += sprint("shard%u:keys=%u,expires=%u,used_memory=%u,connected_clients=%u,connections_received=%u,"
+                        "commands_processed=%u,ops_per_sec=%u,hits=%u,reads=%u\r\n",
+                        cpu, s._keyspace._keys, s._keyspace._expires, s._keyspace._memory._allocated, s._connections_current,
+                        s._connections_total, s._requests_served, s._ops_per_sec, s._keyspace._hits, s._keyspace._reads);
+                }
+                add(lines);
+            }
+            if (wants("commandstats")) {
+                sstring lines { "# Commandstats\r\n" };
+                for (size_t code = 0; code < total._commands.size(); ++code) {
+                    auto& c = total._commands[code];
+                    auto name = to_command_name(static_cast<command_code>(code));
+                    if (c._calls == 0 || name == nullptr) {
+                        continue;
+                    }
+                    lines += sprint("cmdstat_%s:calls=%u,usec=%u,usec_per_call=%.2f,rejected_calls=0,failed_calls=%u\r\n",
+                        name, c._calls, c._usec, double(c._usec) / c._calls, c._errors);
+                }
+                add(lines);
+            }
+            if (wants("tenants")) {
+                sstring lines { "# Tenants\r\n" };
+                for (auto& t : total._tenants) {
+                    auto& s = t.second;
+                    if (s._calls == 0 && s._throttled == 0) {
+                        continue;
+                    }
+                    lines += sprint("tenant_%s:calls=%u,usec=%u,usec_per_call=%.2f,bytes=%u,throttled_calls=%u\r\n",
+                        t.first.empty() ? "default" : t.first.c_str(), s._calls, s._usec,
+                        s._calls ? double(s._usec) / s._calls : 0.0, s._bytes, s._throttled);
+                }
+                add(lines);
+            }
+            if (wants("keysizes")) {
+                // the sizes are those of the buckets, which grow by 1.2.
+                sstring lines { "# Keysizes\r\n" };
+                for (size_t i = 0; i < total._value_sizes.size(); ++i) {
+                    auto& h = total._value_sizes[i];
+                    if (h._count == 0) {
+                        continue;
+                    }
+                    lines += sprint("distrib_%s_sizes:count=%d,p50=%d,p90=%d,p99=%d,max=%d\r\n",
+                        size_distribution::kind_name(static_cast<size_distribution::kind>(i)), h._count,
+                        h.percentile(0.5), h.percentile(0.9), h.percentile(0.99), h.max());
+                }
+                add(lines);
+            }
+            if (wants("keyspace")) {
+                // Pedis has one database, SELECT is accepted for any index.
+                sstring lines { "# Keyspace\r\n" };
+                if (keyspace._keys) {
+                    lines += sprint("db0:keys=%u,expires=%u,avg_ttl=0\r\n", keyspace._keys, keyspace._expires);
+                }
+                add(lines);
+            }
+            auto reply = sprint("$%u\r\n", text.size()) + text + "\r\n";
+            return reply_builder::build(bytes { reply.data(), reply.size() });
+        });
+    });
+}
+
+// An entry of TRACING GET:
+//   *6 :id :shard :owner +command :total_us *2N
+//     +stage :us ...
+// The stages are route (parse to dispatch to the owner), queue (to the
+// start of the execution on the owner), execute, return (back to the
+// reply) and flush; a command not routed to one owner has handle (parse to
+// reply) for the first four.
+static sstring format_trace(const request_trace& t)
+{
+    auto us = [] (trace_clock::time_point from, trace_clock::time_point to) {
+        return std::chrono::duration_cast<std::chrono::microseconds>(to - from).count();
+    };
+    std::vector<std::pair<const char*, int64_t>> stages;
+    if (t._dispatched != trace_clock::time_point() && t._execute_end != trace_clock::time_point()) {
+        stages.emplace_back("route", us(t._parsed, t._dispatched));
+        stages.emplace_back("queue", us(t._dispatched, t._execute_start));
+        stages.emplace_back("execute", us(t._execute_start, t._execute_end));
+        stages.emplace_back("return", us(t._execute_end, t._replied));
+    } else {
+        stages.emplace_back("handle", us(t._parsed, t._replied));
+    }
+    stages.emplace_back("flush", us(t._replied, t._flushed));
+    auto name = to_command_name(t._command);
+    auto entry = sprint("*6\r\n:%u\r\n:%u\r\n:%u\r\n+%s\r\n:%d\r\n*%u\r\n", t._id, t._shard, t._owner,
+        name ? name : "unknown", us(t._parsed, t._flushed), 2 * stages.size());
+    for (auto& s : stages) {
+        entry += sprint("+%s\r\n:%d\r\n", s.first, s.second);
+    }
+    return entry;
+}
+
+future<scattered_message_ptr> server::tracing(request_wrapper& req)
+{
+    auto is = [&req] (const char* name) {
+        return req._args_count > 0 && strcasecmp(req._args[0].c_str(), name) == 0;
+    };
+    if ((is("on") && req._args_count <= 2) || (is("off") && req._args_count == 1)) {
+        double probability = is("on") ? 1 : 0;
+        if (req._args_count == 2) {
+            try {
+                probability = std::stod(req._args[1].c_str());
+            } catch (const std::logic_error&) {
+                return reply_builder::build(msg_syntax_err);
+            }
+            if (!(probability > 0 && probability <= 1)) {
+                return reply_builder::build(msg_syntax_err);
+            }
+        }
+        return get_server().invoke_on_all([probability] (server& s) {
+            s._tracer.set_probability(probability);
+        }).then([] {
+            return reply_builder::build(msg_ok);
+        });
+    }
+    if (is("reset") && req._args_count == 1) {
+        return get_server().invoke_on_all([] (server& s) {
+            s._tracer.reset();
+        }).then([] {
+            return reply_builder::build(msg_ok);
+        });
+    }
+    if (is("len") && req._args_count == 1) {
+        return get_server().map_reduce0([] (server& s) {
+            return s._tracer.size();
+        }, size_t(0), std::plus<size_t>()).then([] (size_t size) {
+            return reply_builder::build(size);
+        });
+    }
+    if (is("get") && req._args_count <= 2) {
+        size_t count = 10;
+        if (req._args_count == 2) {
+            try {
+                auto n = std::stol(req._args[1].c_str());
+                if (n < 0) {
+                    return reply_builder::build(msg_syntax_err);
+                }
+                count = static_cast<size_t>(n);
+            } catch (const std::logic_error&) {
+                return reply_builder::build(msg_syntax_err);
+            }
+        }
+        using traces_ptr = foreign_ptr<lw_shared_ptr<std::vector<request_trace>>>;
+        return do_with(std::vector<request_trace>(), [count] (auto& traces) {
+            return parallel_for_each(boost::irange<unsigned>(0, smp::count), [&traces, count] (unsigned cpu) {
+                return get_server().invoke_on(cpu, [count] (server& s) {
+                    return make_foreign(make_lw_shared(s._tracer.last(count)));
+                }).then([&traces] (traces_ptr shard_traces) {
+                    traces.insert(traces.end(), shard_traces->begin(), shard_traces->end());
+                });
+            }).then([&traces, count] {
+                // the newest first, across the shards.
+                std::sort(traces.begin(), traces.end(), [] (const request_trace& a, const request_trace& b) {
+                    return a._parsed > b._parsed;
+                });
+                traces.resize(std::min(count, traces.size()));
+                auto reply = sprint("*%u\r\n", traces.size());
+                for (auto& t : traces) {
+                    reply += format_trace(t);
+                }
+                return reply_builder::build(bytes { reply.data(), reply.size() });
+            });
+        });
+    }
+    return reply_builder::build(msg_syntax_err);
+}
+
+// An entry of SLOWLOG GET, as in Redis with the shard appended:
+//   *7 :id :timestamp :duration_us *N $arg... $client $name :shard
+future<scattered_message_ptr> server::slowlog(request_wrapper& req)
+{
+    auto is = [&req] (const char* name) {
+        return req._args_count > 0 && strcasecmp(req._args[0].c_str(), name) == 0;
+    };
+    if (is("reset") && req._args_count == 1) {
+        return get_server().invoke_on_all([] (server& s) {
+            s._slow_log.reset();
+        }).then([] {
+            return reply_builder::build(msg_ok);
+        });
+    }
+    if (is("len") && req._args_count == 1) {
+        return get_server().map_reduce0([] (server& s) {
+            return s._slow_log.size();
+        }, size_t(0), std::plus<size_t>()).then([] (size_t size) {
+            return reply_builder::build(size);
+        });
+    }
+    if (is("get") && req._args_count <= 2) {
+        // a negative count replies every entry.
+        size_t count = 10;
+        if (req._args_count == 2) {
+            try {
+                auto n = std::stol(req._args[1].c_str());
+                count = n < 0 ? std::numeric_limits<size_t>::max() : static_cast<size_t>(n);
+            } catch (const std::logic_error&) {
+                return reply_builder::build(msg_syntax_err);
+            }
+        }
+        using entries_ptr = foreign_ptr<lw_shared_ptr<std::vector<slowlog_entry>>>;
+        return do_with(std::vector<slowlog_entry>(), [count] (auto& entries) {
+            return parallel_for_each(boost::irange<unsigned>(0, smp::count), [&entries, count] (unsigned cpu) {
+                return get_server().invoke_on(cpu, [count] (server& s) {
+                    return make_foreign(make_lw_shared(s._slow_log.last(count)));
+                }).then([&entries] (entries_ptr shard_entries) {
+                    entries.insert(entries.end(), shard_entries->begin(), shard_entries->end());
+                });
+            }).then([&entries, count] {
+                std::sort(entries.begin(), entries.end(), [] (const slowlog_entry& a, const slowlog_entry& b) {
+                    return a._timestamp != b._timestamp ? a._timestamp > b._timestamp : a._id > b._id;
+                });
+                entries.resize(std::min(count, entries.size()));
+                auto reply = sprint("*%u\r\n", entries.size());
+                for (auto& e : entries) {
+                    reply += sprint("*7\r\n:%u\r\n:%d\r\n:%u\r\n*%u\r\n", e._id, e._timestamp, e._duration_us, e._args.size());
+                    for (auto& a : e._args) {
+                        reply += sprint("$%u\r\n", a.size()) + a + "\r\n";
+                    }
+                    reply += sprint("$%u\r\n%s\r\n$0\r\n\r\n:%u\r\n", e._client.size(), e._client, e._shard);
+                }
+                return reply_builder::build(bytes { reply.data(), reply.size() });
+            });
+        });
+    }
+    return reply_builder::build(msg_syntax_err);
+}
+
+future<scattered_message_ptr> server::config(request_wrapper& req)
+{
+    static const char* parameter = "notify-keyspace-events";
+    if (req._args_count < 2 || strcasecmp(req._args[1].c_str(), parameter) != 0) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    auto& action = req._args[0];
+    if (strcasecmp(action.c_str(), "get") == 0 && req._args_count == 2) {
+        auto flags = keyspace_events::to_string(local_keyspace_events().flags());
+        std::vector<bytes> reply { bytes { parameter }, bytes { flags.data(), flags.size() } };
+        return reply_builder::build(reply);
+    }
+    if (strcasecmp(action.c_str(), "set") == 0 && req._args_count == 3) {
+        uint32_t flags = 0;
+        if (!keyspace_events::parse(req._args[2].data(), req._args[2].size(), flags)) {
+            return reply_builder::build(msg_syntax_err);
+        }
+        return get_server().invoke_on_all([flags] (server& s) {
+            s._options._notify_keyspace_events = flags;
+            local_keyspace_events().set_flags(flags);
+        }).then([] {
+            return reply_builder::build(msg_ok);
+        });
+    }
+    return reply_builder::build(msg_syntax_err);
+}
+
+future<scattered_message_ptr> server::profile(request_wrapper& req)
+{
+    auto is = [&req] (const char* name) {
+        return req._args_count > 0 && strcasecmp(req._args[0].c_str(), name) == 0;
+    };
+    if (is("start") && req._args_count <= 3) {
+        profile_options options;
+        options._dir = _options._profile_dir;
+        try {
+            if (req._args_count > 1) {
+                auto seconds = std::stol(req._args[1].c_str());
+                if (seconds < 1 || seconds > cpu_profiler::max_duration.count()) {
+                    return reply_builder::build(msg_syntax_err);
+                }
+                options._duration = std::chrono::seconds(seconds);
+            }
+            if (req._args_count > 2) {
+                auto hz = std::stol(req._args[2].c_str());
+                if (hz < 1 || hz > long(cpu_profiler::max_hz)) {
+                    return reply_builder::build(msg_syntax_err);
+                }
+                options._hz = static_cast<unsigned>(hz);
+            }
+        } catch (const std::logic_error&) {
+            return reply_builder::build(msg_syntax_err);
+        }
+        return get_server().invoke_on_all([options] (server& s) {
+            return s._profiler.start(options);
+        }).then([] {
+            return reply_builder::build(msg_ok);
+        });
+    }
+    if (is("stop") && req._args_count == 1) {
+        return get_server().invoke_on_all([] (server& s) {
+            return s._profiler.stop();
+        }).then([] {
+            return reply_builder::build(msg_ok);
+        });
+    }
+    if (is("status") && req._args_count == 1) {
+        return get_server().map_reduce0([] (server& s) {
+            auto st = s._profiler.stats();
+            return std::vector<int64_t> { s._profiler.active() ? 1 : 0, int64_t(st._samples), int64_t(st._dropped) };
+        }, std::vector<int64_t>(3), [] (std::vector<int64_t> total, std::vector<int64_t> shard) {
+            for (size_t i = 0; i < total.size(); ++i) {
+                total[i] += shard[i];
+            }
+            return total;
+        }).then([] (std::vector<int64_t> total) {
+            return reply_builder::build(total);
+        });
+    }
+    return reply_builder::build(msg_syntax_err);
+}
+
+future<scattered_message_ptr> server::capture(request_wrapper& req)
+{
+    auto is = [&req] (const char* name) {
+        return req._args_count > 0 && strcasecmp(req._args[0].c_str(), name) == 0;
+    };
+    if (is("start") && req._args_count <= 3) {
+        capture_options options;
+        options._dir = _options._capture_dir;
+        options._max_bytes = _options._capture_max_bytes;
+        for (size_t i = 1; i < req._args_count; ++i) {
+            if (strcasecmp(req._args[i].c_str(), "anonymize") == 0) {
+                options._anonymize = true;
+                continue;
+            }
+            try {
+                options._probability = std::stod(req._args[i].c_str());
+            } catch (const std::logic_error&) {
+                return reply_builder::build(msg_syntax_err);
+            }
+            if (!(options._probability > 0 && options._probability <= 1)) {
+                return reply_builder::build(msg_syntax_err);
+            }
+        }
+        // one salt for all shards, so that a key hashes alike on each.
+        std::random_device random;
+        options._salt = uint64_t(random()) << 32 | random();
+        return get_server().invoke_on_all([options] (server& s) {
+            return s._capture.start(options);
+        }).then([] {
+            return reply_builder::build(msg_ok);
+        });
+    }
+    if (is("stop") && req._args_count == 1) {
+        return get_server().invoke_on_all([] (server& s) {
+            return s._capture.stop();
+        }).then([] {
+            return reply_builder::build(msg_ok);
+        });
+    }
+    if (is("status") && req._args_count == 1) {
+        return get_server().map_reduce0([] (server& s) {
+            auto& st = s._capture.stats();
+            return std::vector<int64_t> { s._capture.active() ? 1 : 0, int64_t(st._records), int64_t(st._bytes), int64_t(st._dropped) };
+        }, std::vector<int64_t>(4), [] (std::vector<int64_t> total, std::vector<int64_t> shard) {
+            for (size_t i = 0; i < total.size(); ++i) {
+                total[i] += shard[i];
+            }
+            return total;
+        }).then([] (std::vector<int64_t> total) {
+            return reply_builder::build(total);
+        });
+    }
+    return reply_builder::build(msg_syntax_err);
+}
+
+static std::experimental::optional<utils::latency_event> to_latency_event(const bytes& name)
+{
+    for (size_t i = 0; i < utils::latency_monitor::events; ++i) {
+        auto e = static_cast<utils::latency_event>(i);
+        if (strcasecmp(name.c_str(), utils::latency_event_name(e)) == 0) {
+            return e;
+        }
+    }
+    return {};
+}
+
+future<scattered_message_ptr> server::latency(request_wrapper& req)
+{
+    using utils::latency_monitor;
+    using events_ptr = foreign_ptr<lw_shared_ptr<std::array<latency_monitor::event_state, latency_monitor::events>>>;
+    auto is = [&req] (const char* name) {
+        return req._args_count > 0 && strcasecmp(req._args[0].c_str(), name) == 0;
+    };
+    if (is("reset")) {
+        // no event names resets every event.
+        std::vector<utils::latency_event> events;
+        for (size_t i = 1; i < req._args_count; ++i) {
+            auto e = to_latency_event(req._args[i]);
+            if (e) {
+                events.push_back(*e);
+            }
+        }
+        if (req._args_count == 1) {
+            for (size_t i = 0; i < latency_monitor::events; ++i) {
+                events.push_back(static_cast<utils::latency_event>(i));
+            }
+        }
+        return get_server().invoke_on_all([events] (server&) {
+            for (auto e : events) {
+                utils::local_latency_monitor().reset(e);
+            }
+        }).then([count = events.size()] {
+            return reply_builder::build(count);
+        });
+    }
+    std::experimental::optional<utils::latency_event> history;
+    if (is("history") && req._args_count == 2) {
+        history = to_latency_event(req._args[1]);
+        if (!history) {
+            return reply_builder::build(msg_empty_multi_bulk);
+        }
+    } else if (!is("latest") || req._args_count != 1) {
+        return reply_builder::build(msg_syntax_err);
+    }
+    return do_with(std::vector<events_ptr>(smp::count), [history] (auto& shards) {
+        return parallel_for_each(boost::irange<unsigned>(0, smp::count), [&shards] (unsigned cpu) {
+            return smp::submit_to(cpu, [] {
+                return make_foreign(make_lw_shared(utils::local_latency_monitor().all()));
+            }).then([&shards, cpu] (events_ptr events) {
+                shards[cpu] = std::move(events);
+            });
+        }).then([&shards, history] {
+            if (history) {
+                // the samples of all shards, the largest of each second.
+                std::map<int64_t, uint32_t> samples;
+                for (auto& events : shards) {
+                    auto& s = (*events)[static_cast<size_t>(*history)];
+                    auto n = std::min(s._samples, latency_monitor::history_size);
+                    for (size_t i = 0; i < n; ++i) {
+                        auto& sample = s._history[(s._samples - 1 - i) % latency_monitor::history_size];
+                        auto& latency = samples[sample._time];
+                        latency = std::max(latency, sample._latency_ms);
+                    }
+                }
+                while (samples.size() > latency_monitor::history_size) {
+                    samples.erase(samples.begin());
+                }
+                auto reply = sprint("*%u\r\n", samples.size());
+                for (auto& s : samples) {
+                    reply += sprint("*2\r\n:%d\r\n:%u\r\n", s.first, s.second);
+                }
+                return reply_builder::build(bytes { reply.data(), reply.size() });
+            }
+            // *N
+            //   *4 $event :timestamp :latest_ms :max_ms
+            sstring entries;
+            size_t count = 0;
+            for (size_t i = 0; i < latency_monitor::events; ++i) {
+                const latency_monitor::sample* latest = nullptr;
+                uint32_t max = 0;
+                for (auto& events : shards) {
+                    auto& s = (*events)[i];
+                    auto l = s.latest();
+                    if (l && (!latest || l->_time > latest->_time || (l->_time == latest->_time && l->_latency_ms > latest->_latency_ms))) {
+                        latest = l;
+                    }
+                    max = std::max(max, s._max_ms);
+                }
+                if (latest) {
+                    auto name = utils::latency_event_name(static_cast<utils::latency_event>(i));
+                    entries += sprint("*4\r\n$%u\r\n%s\r\n:%d\r\n:%u\r\n:%u\r\n", std::strlen(name), name, latest->_time, latest->_latency_ms, max);
+                    ++count;
+                }
+            }
+            auto reply = sprint("*%u\r\n", count) + entries;
+            return reply_builder::build(bytes { reply.data(), reply.size() });
+        });
+    });
+}
+
+future<scattered_message_ptr> server::shards()
+{
+    // *N
+    //   *2 :cpu :port
+    // The shard owning a key is slot_shard(std::hash<bytes>(tag) % 16384, N),
+    // the tag being its hash tag or else the whole key, see shard_slot.hh.
+    bytes message { msg_sigle_tag };
+    auto count = to_sstring(smp::count);
+    message.append(count.data(), count.size());
+    message.append(msg_crlf.data(), msg_crlf.size());
+    for (unsigned cpu = 0; cpu < smp::count; ++cpu) {
+        auto port = _options._shard_port_base ? _options._shard_port_base + cpu : _options._port;
+        auto entry = sprint("*2\r\n:%u\r\n:%u\r\n", cpu, port);
+        message.append(entry.data(), entry.size());
+    }
+    return reply_builder::build(message);
+}
+
+size_t server::max_shard_clients() const
+{
+    return (_options._max_clients + smp::count - 1) / smp::count;
+}
+
+void server::clients_cron()
+{
+    auto now = lowres_clock::now();
+    auto timeout = std::chrono::seconds(_options._idle_timeout_s);
+    auto n = (_connections.size() + clients_cron_ticks - 1) / clients_cron_ticks;
+    for (; n > 0; --n) {
+        auto& c = _connections.front();
+        _connections.pop_front();
+        _connections.push_back(c);
+        if (c._done) {
+            continue;
+        }
+        if (_options._idle_timeout_s > 0 && c.idle_for(now, timeout)) {
+            ++_stats._idle_timeouts;
+            c.disconnect();
+            continue;
+        }
+        c.check_output_limits(now);
+    }
+}
+
+void server::sample_lag()
+{
+    auto now = std::chrono::steady_clock::now();
+    uint64_t lag = 0;
+    if (now > _lag_expected) {
+        lag = std::chrono::duration_cast<std::chrono::microseconds>(now - _lag_expected).count();
+    }
+    _lag_expected = now + std::chrono::milliseconds(lag_sample_period_ms);
+    _reactor_lag_us = std::max(lag, _reactor_lag_us / 2);
+}
+
+future<> server::wait_for_admission()
+{
+    if (_options._max_inflight_requests == 0 || _stats._requests_serving < _options._max_inflight_requests) {
+        return make_ready_future<>();
+    }
+    ++_stats._admission_waits;
+    _admission_waiters.emplace_back();
+    return _admission_waiters.back().get_future();
+}
+
+// A connection waiting to read takes the place of each command done.
+void server::finish_requests(size_t count)
+{
+    _stats._requests_serving -= count;
+    for (; count > 0 && !_admission_waiters.empty(); --count) {
+        auto w = std::move(_admission_waiters.front());
+        _admission_waiters.pop_front();
+        w.set_value();
+    }
+}
+
+// Refused with the error of Redis, without a connection to set up.
+void server::reject(connected_socket socket)
+{
+    ++_stats._rejected_connections;
+    auto s = make_lw_shared<connected_socket>(std::move(socket));
+    auto out = make_lw_shared<output_stream<char>>(s->output());
+    out->write("-ERR max number of clients reached\r\n").then([out] {
+        return out->flush();
+    }).finally([out] {
+        return out->close();
+    }).handle_exception([] (std::exception_ptr) {}).finally([s, out] {});
+}
+
+void server::do_accepts(lw_shared_ptr<server_socket> listener)
+{
+    keep_doing([this, listener] {
+       return listener->accept().then([this] (connected_socket fd, socket_address addr) mutable {
+           if (_options._max_clients > 0 && _stats._connections_current >= max_shard_clients()) {
+               reject(std::move(fd));
+               return;
+           }
            ++_stats._connections_total;
            ++_stats._connections_current;
-           auto conn = make_lw_shared<connection>(std::move(fd), addr, _use_native_parser);
-           return conn->process().finally([this, conn] {
+           auto conn = make_lw_shared<connection>(std::move(fd), addr, *this);
+           _connections.push_back(*conn);
+           // Do not wait for the connection, keep accepting the next one.
+           conn->process().finally([this, conn] {
+               _connections.erase(_connections.iterator_to(*conn));
                --_stats._connections_current;
-               return conn->_out.close().finally([conn]{});
+               conn->unsubscribe_all();
+               local_tracking().remove_client(conn->_id);
+               return conn->stop_tracking().finally([conn] {
+                   return redis().unwatch(conn->_watched);
+               }).finally([conn] {
+                   return conn->_out.close().finally([conn]{});
+               });
            });
        });
    }).or_terminate();
 }
+
+void server::start()
+{
+    _started = std::chrono::steady_clock::now();
+    _ops_timer.set_callback([this] { sample_ops(); });
+    _ops_timer.arm_periodic(std::chrono::milliseconds(ops_sample_period_ms));
+    _clients_timer.set_callback([this] { clients_cron(); });
+    _clients_timer.arm_periodic(std::chrono::milliseconds(clients_cron_period_ms));
+    _tenants.configure(_options._tenant_defaults, _options._tenant_limits);
+    if (_options._busy_lag_us > 0) {
+        _lag_timer.set_callback([this] { sample_lag(); });
+        _lag_expected = std::chrono::steady_clock::now() + std::chrono::milliseconds(lag_sample_period_ms);
+        _lag_timer.arm_periodic(std::chrono::milliseconds(lag_sample_period_ms));
+    }
+    utils::local_latency_monitor().set_threshold(_options._latency_monitor_threshold);
+    local_stall_monitor().set_threshold(std::chrono::microseconds(_options._stall_threshold_us));
+    local_allocation_sampler().set_period(_options._alloc_sample_period);
+    auto& scheduler = utils::local_work_scheduler();
+    scheduler.set_shares(utils::work_class::point, _options._point_shares);
+    scheduler.set_shares(utils::work_class::heavy, _options._heavy_shares);
+    scheduler.set_shares(utils::work_class::background, _options._background_shares);
+    scheduler.set_period(std::chrono::microseconds(_options._scheduling_period_us));
+    redis().set_coalesce_reads(_options._coalesce_reads);
+    redis().set_hot_key_copies(_options._hot_key_copies, _options._hot_key_threshold);
+    redis().set_split_keys(_options._split_keys, _options._split_partitions);
+    redis().set_sharded_counters(_options._sharded_counters, std::chrono::milliseconds(_options._counter_fold_ms), [] (bytes key) {
+        return smp::invoke_on_all([key] {
+            return redis().fold_counter(key);
+        });
+    });
+    if (_options._hot_key_copies) {
+        // every other shard may hold a copy of a key this one owns.
+        get_database().local().set_copy_invalidator([] (bytes key) {
+            for (unsigned cpu = 0; cpu < smp::count; ++cpu) {
+                if (cpu != engine().cpu_id()) {
+                    smp::submit_to(cpu, [key] {
+                        redis().drop_hot_copy(key);
+                    });
+                }
+            }
+        });
+    }
+    // writes wait on a shard past its hard memory limit, whichever shard
+    // they come through.
+    get_database().local().set_write_throttle_listener([] (bool throttled) {
+        auto owner = engine().cpu_id();
+        for (unsigned cpu = 0; cpu < smp::count; ++cpu) {
+            smp::submit_to(cpu, [owner, throttled] {
+                redis().set_shard_throttled(owner, throttled);
+            });
+        }
+    });
+    listen_options lo;
+    lo.reuse_address = true;
+    switch (_options._connection_balancing) {
+    case connection_balancing::connections:
+        lo.lba = server_socket::load_balancing_algorithm::connection_distribution;
+        break;
+    case connection_balancing::port:
+        lo.lba = server_socket::load_balancing_algorithm::port;
+        break;
+    default:
+        break;
+    }
+    _listener = engine().listen(make_ipv4_address({_options._port}), lo);
+    do_accepts(_listener);
+    if (_options._shard_port_base) {
+        auto port = static_cast<uint16_t>(_options._shard_port_base + engine().cpu_id());
+        listen_options shard_lo;
+        shard_lo.reuse_address = true;
+        _shard_listener = engine().listen(make_ipv4_address({port}), shard_lo);
+        do_accepts(_shard_listener);
+    }
+}
+
+void server::listen_unix(const file_desc& socket)
+{
+    _unix_listener = make_lw_shared<server_socket>(listen_unix_socket(socket, _options._unix_input_buffer_size));
+    do_accepts(_unix_listener);
+}
 }
@@ -24,24 +24,271 @@
 #include "redis.hh"
 #include "core/metrics_registration.hh"
 #include "core/thread.hh"
+#include "core/condition-variable.hh"
 #include "reply_wrapper.hh"
 #include "protocol_parser.hh"
+#include "utils/estimated_histogram.hh"
+#include "cluster.hh"
+#include "tracing.hh"
+#include "slowlog.hh"
+#include "traffic_capture.hh"
+#include "cpu_profiler.hh"
+#include "pubsub.hh"
+#include "tracking.hh"
+#include "keyspace_events.hh"
+#include "current_operation.hh"
+#include "unix_socket.hh"
+#include "tenants.hh"
+#include "utils/latency_monitor.hh"
+#include <array>
+#include <deque>
+#include <boost/intrusive/list.hpp>
+#include <experimental/optional>
+#include <map>
+#include <unordered_set>
+#include <unistd.h>
 namespace redis {
+// How the connections to the port are spread over the shards. kernel
+// leaves it to the network stack, which lets the kernel pick when every
+// shard accepts on its own SO_REUSEPORT socket. connections hands an
+// accepted connection to the shard with the fewest, port to the shard of
+// the client port modulo the shards. Both apply when one socket accepts
+// for all the shards: with the native stack, or the posix one where
+// SO_REUSEPORT is not available.
+enum class connection_balancing {
+    kernel,
+    connections,
+    port,
+};
+connection_balancing to_connection_balancing(const std::string& name);
+const char* to_connection_balancing_name(connection_balancing balancing);
+
+struct server_options {
+    uint16_t _port = 6379;
+    bool _use_native_parser = false;
+    // Upper bound of bytes coalesced into one flush, 0 means flush every reply.
+    size_t _reply_flush_bytes = 64 * 1024;
+    // When non-zero, shard N also listens on _shard_port_base + N, so that
+    // cluster-aware clients can connect to the shard owning their keys.
+    uint16_t _shard_port_base = 0;
+    connection_balancing _connection_balancing = connection_balancing::kernel;
+    // The native stack of seastar, over DPDK: a connection belongs to the
+    // shard of the queue its packets hash to, whichever the balancing.
+    bool _native_stack = false;
+    // When not empty, every shard also accepts the connections to this
+    // AF_UNIX socket, created with _unix_socket_perm unless it is 0.
+    sstring _unix_socket;
+    mode_t _unix_socket_perm = 0;
+    // The reads of its connections, see listen_unix_socket(). Those of TCP
+    // connections are sized by the network stack.
+    size_t _unix_input_buffer_size = 8192;
+    // Requests are not read while the replies not yet written exceed these.
+    size_t _max_connection_reply_bytes = 1024 * 1024;
+    size_t _max_shard_reply_bytes = 64 * 1024 * 1024;
+    size_t _max_pipeline_depth = 1024;
+    // Commands a connection parses ahead from one read. The consecutive
+    // ones for another shard run there as one task, see
+    // server::connection::run_batch(). 1 parses one command at a time.
+    size_t _pipeline_batch = 64;
+    // The connections all shards take, each an even share, as maxclients
+    // of Redis: 0 for no limit.
+    size_t _max_clients = 0;
+    // Connections idle this many seconds are closed, as timeout of Redis: 0
+    // never. Subscribers and commands in progress are left alone.
+    uint32_t _idle_timeout_s = 0;
+    // A connection whose replies not yet written exceed the hard limit, or
+    // the soft limit for _output_soft_seconds, is closed, as the
+    // client-output-buffer-limit of Redis. A limit of 0 is none.
+    size_t _output_hard_limit = 0;
+    size_t _output_soft_limit = 0;
+    uint32_t _output_soft_seconds = 60;
+    // Load shedding. While the reactor of a shard runs at least
+    // _busy_lag_us late, its connections get -BUSY for the commands on
+    // data. With _max_inflight_requests commands of its connections in
+    // progress, they wait before reading the next one. 0 disables either.
+    uint32_t _busy_lag_us = 0;
+    size_t _max_inflight_requests = 0;
+    // The limits of the tenants named in _tenant_limits, and of the others.
+    tenant_limits _tenant_defaults;
+    std::unordered_map<bytes, tenant_limits> _tenant_limits;
+    // Concurrent GETs of a key owned by another shard share one lookup, see
+    // redis_service::set_coalesce_reads().
+    bool _coalesce_reads = false;
+    // GETs of a string of another shard read more than _hot_key_threshold
+    // times per second are served from a copy, see
+    // redis_service::set_hot_key_copies().
+    bool _hot_key_copies = false;
+    uint64_t _hot_key_threshold = 10000;
+    // Counters incremented on the shard of the connection and folded into
+    // their owner every _counter_fold_ms, see
+    // redis_service::set_sharded_counters().
+    std::vector<bytes> _sharded_counters;
+    uint32_t _counter_fold_ms = 100;
+    // Hashes and sorted sets kept as _split_partitions keys spread over the
+    // shards, see redis_service::set_split_keys().
+    std::vector<bytes> _split_keys;
+    uint32_t _split_partitions = 64;
+    // Traces of sampled requests kept by each shard for TRACING GET.
+    size_t _trace_capacity = 1024;
+    // Commands running at least this many microseconds are logged, in the
+    // last _slowlog_max_len of each shard. Negative disables the log.
+    int64_t _slowlog_log_slower_than = 10000;
+    size_t _slowlog_max_len = 128;
+    // CAPTURE START writes the requests of each shard to a file of
+    // _capture_dir, up to _capture_max_bytes.
+    sstring _capture_dir = ".";
+    size_t _capture_max_bytes = size_t(1) << 30;
+    // The keyspace_event_class flags of notify-keyspace-events, which
+    // CONFIG SET changes.
+    uint32_t _notify_keyspace_events = 0;
+    // PROFILE START writes the stacks sampled on each shard to a file of
+    // _profile_dir.
+    sstring _profile_dir = ".";
+    // Internal events lasting at least this many milliseconds go to the
+    // history of LATENCY, 0 keeps only their histograms.
+    uint32_t _latency_monitor_threshold = 0;
+    // Commands holding the reactor of a shard this many microseconds
+    // without yielding are logged with their key, see stall_monitor. 0
+    // disables it.
+    uint32_t _stall_threshold_us = 0;
+    // One in this many commands of each shard has its allocations
+    // accounted, see allocation_sampler. 0 disables it.
+    uint32_t _alloc_sample_period = 0;
+    // Shares of the reactor of each shard by class of work, given over
+    // periods of _scheduling_period_us, see utils::work_scheduler.
+    unsigned _point_shares = 1000;
+    unsigned _heavy_shares = 200;
+    unsigned _background_shares = 100;
+    uint32_t _scheduling_period_us = 1000;
+};
+
+// Counted once per command by the dispatcher, as INFO commandstats.
+struct command_stats {
+    uint64_t _calls = 0;
+    uint64_t _usec = 0;
+    // Commands whose handler failed rather than replied.
+    uint64_t _errors = 0;
+};
+using command_stats_array = std::array<command_stats, static_cast<size_t>(command_code::max)>;
+
+// The part of INFO a shard reports, with the keyspace of its database.
+struct shard_info {
+    keyspace_info _keyspace;
+    uint64_t _connections_current = 0;
+    uint64_t _connections_total = 0;
+    uint64_t _rejected_connections = 0;
+    uint64_t _requests_served = 0;
+    uint64_t _ops_per_sec = 0;
+    command_stats_array _commands {};
+    snapshot_stats _snapshot;
+    std::unordered_map<bytes, tenant_stats> _tenants;
+    std::array<utils::estimated_histogram, size_distribution::kinds> _value_sizes;
+};
+
 class server {
 public:
     lw_shared_ptr<server_socket> _listener;
-    uint16_t _port;
-    bool _use_native_parser;
-    struct connection {
-        static constexpr size_t reply_queue_size = 16;
+    lw_shared_ptr<server_socket> _shard_listener;
+    lw_shared_ptr<server_socket> _unix_listener;
+    server_options _options;
+    // Bytes of built but not yet written replies of all connections.
+    semaphore _shard_reply_bytes;
+    struct connection : public reply_sink, public pubsub_subscriber, public tracking_client {
+        server& _server;
         connected_socket _socket;
         socket_address _addr;
         input_stream<char> _in;
         output_stream<char> _out;
         protocol_parser _parser;
         bool _done = false;
+        // ASKING came last, the next command may touch a slot this node imports.
+        bool _asking = false;
         bool _use_native_parser;
-        queue<reply_wrapper> _replies { reply_queue_size };
+        size_t _reply_flush_bytes;
+        semaphore _reply_bytes;
+        size_t _pending_reply_bytes = 0;
+        queue<reply_wrapper> _replies;
+        // The trace of the request being handled, if it is sampled.
+        lw_shared_ptr<request_trace> _trace;
+        // After MULTI the commands are queued until EXEC or DISCARD. One
+        // which could not be queued fails the EXEC.
+        bool _multi = false;
+        bool _multi_failed = false;
+        std::vector<request_wrapper> _queued;
+        // The keys WATCHed until EXEC, DISCARD or UNWATCH.
+        std::vector<redis_service::watched_key> _watched;
+        // The channels and patterns SUBSCRIBEd to: while there are any, the
+        // connection only takes the commands of subscriptions and PING.
+        std::unordered_set<bytes> _channels;
+        std::unordered_set<bytes> _patterns;
+        // While a (P)SUBSCRIBE waits for the other shards to know of it, the
+        // messages for the connection wait for its reply.
+        unsigned _subscribing = 0;
+        // Nor do they come between the chunks of the reply of a command.
+        bool _in_command = false;
+        std::vector<scattered_message_ptr> _held;
+        // The id of CLIENT ID, the name of CLIENT SETNAME, and the protocol
+        // of HELLO: with 3, invalidations are pushed to the connection.
+        uint64_t _id;
+        bytes _name;
+        int _protocol = 2;
+        // The user of HELLO AUTH, and the tenant of the user or else of the
+        // name, see tenant_table.
+        bytes _user;
+        tenant_table::tenant* _tenant = nullptr;
+        // Whether the requests of the connection go to the capture of the
+        // shard, drawn again for each capture, see traffic_capture::sample().
+        uint64_t _capture_generation = 0;
+        bool _captured = false;
+        void capture(const request_wrapper& req);
+        void set_tenant() { _tenant = &_server._tenants.get(_user.empty() ? _name : _user); }
+        // CLIENT TRACKING: the owners of the keys the connection reads
+        // remember it, or the connection it redirects to, see
+        // database::track(). With BCAST, every shard remembers the prefixes
+        // instead.
+        bool _tracking = false;
+        bool _bcast = false;
+        uint64_t _redirect = 0;
+        std::vector<bytes> _prefixes;
+        // Tiered storage: a command which waits for the store to read back
+        // its keys is parked, and the commands after it run meanwhile unless
+        // they share a key with a parked one or act on the connection, see
+        // dispatch(). Their replies are built whole, and queued in the order
+        // of the commands by their sequence number.
+        static constexpr unsigned max_parked = 64;
+        uint64_t _seq = 0;
+        uint64_t _next_seq = 0;
+        uint64_t _next_reply = 0;
+        std::map<uint64_t, reply_wrapper> _reordered;
+        unsigned _parked = 0;
+        // The command handled last was parked, its reply comes later.
+        bool _parked_current = false;
+        std::unordered_multiset<bytes> _parked_keys;
+        // Signalled as each parked command replies.
+        condition_variable _parked_done;
+        // The commands parsed ahead of the one being handled when a read
+        // brought several, handled from the front: the one being handled
+        // is the front, or the request of the parser when there are none.
+        // _mid_command when the parser holds the start of the next one.
+        std::deque<request_wrapper> _pipeline;
+        bool _mid_command = false;
+        // The outcome of the commands at the front of _pipeline which ran
+        // as one task on their shard, see run_batch().
+        struct batched_reply {
+            scattered_message_ptr _reply;
+            std::exception_ptr _error;
+        };
+        std::deque<batched_reply> _batched;
+        struct pipeline_consumer {
+            connection& _connection;
+            future<protocol_parser::unconsumed_remainder> operator()(temporary_buffer<char> buf);
+        };
+        pipeline_consumer _consumer { *this };
+        // In server::_connections, which clients_cron() walks.
+        boost::intrusive::list_member_hook<> _link;
+        lowres_clock::time_point _last_interaction;
+        // Since when the replies not yet written exceed the soft output limit.
+        std::experimental::optional<lowres_clock::time_point> _over_soft_limit_since;
 
         future<> process()
         {
@@ -53,20 +300,91 @@ public:
             });
         }
         future<scattered_message_ptr> handle();
+        future<scattered_message_ptr> handle_parsed();
+        // Once the tenant may run the command, see tenant_table::admit().
+        future<scattered_message_ptr> handle_admitted();
+        future<scattered_message_ptr> take_batched();
+        // The commands at the front of _pipeline which may run as one task
+        // on `cpu`, another shard owning their keys, see run_batch().
+        size_t batchable_run(unsigned& cpu) const;
+        // Runs the commands at the front of _pipeline in order on `cpu`,
+        // as a transaction runs its batch there, and keeps their replies in
+        // _batched. They are counted as if dispatched one by one.
+        future<> run_batch(unsigned cpu, size_t count);
         future<scattered_message_ptr> do_handle_one(request_wrapper& req);
+        future<scattered_message_ptr> dispatch(request_wrapper& req);
+        // Queues the command after MULTI, or runs it. Writes which may take
+        // memory first wait on an owner past its hard memory limit, see
+        // database::wait_for_memory().
+        future<scattered_message_ptr> admit(request_wrapper& req);
+        // Tiered storage: reads back the keys the store may hold, see
+        // database::fault_in().
+        future<> fault_in(std::vector<bytes> keys);
+        bool may_run_ahead(const request_wrapper& req, const std::vector<bytes>& keys) const;
+        // Runs the command once its keys are read back, while the next
+        // commands are handled.
+        future<scattered_message_ptr> park(request_wrapper& req, std::vector<bytes> keys, future<> faulted);
+        future<> wait_for_parked();
+        future<scattered_message_ptr> do_dispatch(request_wrapper& req);
         future<scattered_message_ptr> do_unexpect_request(request_wrapper& req);
+        // MULTI, EXEC, DISCARD, WATCH and UNWATCH, which act on the connection.
+        future<scattered_message_ptr> transaction(request_wrapper& req);
+        future<scattered_message_ptr> exec();
+        void end_multi();
+        // SUBSCRIBE, UNSUBSCRIBE, PSUBSCRIBE and PUNSUBSCRIBE.
+        future<scattered_message_ptr> subscription(request_wrapper& req);
+        void unsubscribe_all();
+        bool subscribed() const
+        {
+            return !_channels.empty() || !_patterns.empty();
+        }
+        void deliver(scattered_message_ptr messages) override;
+        // Closes the connection: the request fiber sees the end of its input,
+        // and a write the client does not read fails.
+        void disconnect();
+        bool idle_for(lowres_clock::time_point now, lowres_clock::duration timeout) const;
+        // Disconnects past the output limits, returns whether it did.
+        bool check_output_limits(lowres_clock::time_point now);
+        void release_held();
+        // HELLO and CLIENT, which act on the connection.
+        future<scattered_message_ptr> hello(request_wrapper& req);
+        future<scattered_message_ptr> client(request_wrapper& req);
+        future<scattered_message_ptr> tracking(request_wrapper& req);
+        // Tracks the keys of a read for the connection, before it runs.
+        future<> track_keys(request_wrapper& req);
+        future<> stop_tracking();
+        void invalidate(const std::vector<bytes>& keys) override;
+        bool has_reply_room() const;
+        future<> wait_for_reply_room();
+        reply_wrapper account_reply(scattered_message_ptr message, lw_shared_ptr<request_trace> trace);
+        void queue_reply(scattered_message_ptr message, lw_shared_ptr<request_trace> trace = {});
+        // Queues the reply of the command `seq` after those before it.
+        void complete(uint64_t seq, scattered_message_ptr message, lw_shared_ptr<request_trace> trace);
+        void release_reply_bytes(size_t size, size_t count);
+        void log_slow(const request_wrapper& req, std::chrono::steady_clock::time_point start, uint64_t duration_us);
+        future<> push(scattered_message_ptr chunk) override;
         future<> request();
         future<> reply();
 
-        connection(connected_socket&& socket, socket_address addr, bool use_native_parser)
-            : _socket(std::move(socket))
+        connection(connected_socket&& socket, socket_address addr, server& s)
+            : _server(s)
+            , _socket(std::move(socket))
             , _addr(addr)
             , _in(_socket.input())
             , _out(_socket.output())
-            , _parser(make_ragel_protocol_parser())
+            , _parser(s._options._use_native_parser ? make_native_protocol_parser() : make_ragel_protocol_parser())
+            , _use_native_parser(s._options._use_native_parser)
+            , _reply_flush_bytes(s._options._reply_flush_bytes)
+            , _reply_bytes(s._options._max_connection_reply_bytes)
+            , _replies(s._options._max_pipeline_depth)
+            , _id(local_tracking().add_client(this))
+            , _last_interaction(lowres_clock::now())
         {
+            set_tenant();
         }
         ~connection() {
+            // Replies which were never written still hold the shard budget.
+            release_reply_bytes(_pending_reply_bytes, _replies.size() + _reordered.size());
         }
     };
     seastar::metrics::metric_groups _metrics;
@@ -74,19 +392,140 @@ public:
     struct stats {
         uint64_t _connections_current = 0;
         uint64_t _connections_total = 0;
+        uint64_t _replies_pending = 0;
+        uint64_t _reply_bytes_pending = 0;
+        uint64_t _backpressure_total = 0;
+        uint64_t _requests_served = 0;
+        uint64_t _requests_serving = 0;
+        uint64_t _requests_exception = 0;
+        uint64_t _redirects = 0;
+        uint64_t _throttled_writes = 0;
+        uint64_t _oom_rejections = 0;
+        // Commands which waited for the store while the next ones ran.
+        uint64_t _requests_parked = 0;
+        // Batches of pipelined commands run on another shard, and their
+        // commands.
+        uint64_t _pipeline_batches = 0;
+        uint64_t _pipeline_batched = 0;
+        // Subscribers disconnected for not reading their messages.
+        uint64_t _slow_subscribers = 0;
+        // Connections refused past maxclients, and closed for being idle or
+        // past their output limits.
+        uint64_t _rejected_connections = 0;
+        uint64_t _idle_timeouts = 0;
+        uint64_t _output_limit_disconnects = 0;
+        // Commands refused with -BUSY, and times a connection waited for
+        // fewer commands in progress, see server_options::_busy_lag_us.
+        uint64_t _busy_rejections = 0;
+        uint64_t _admission_waits = 0;
     };
     stats _stats;
+    // Requests served, sampled every ops_sample_period_ms over the last
+    // ops_samples periods for instantaneous_ops_per_sec, as Redis does.
+    static constexpr size_t ops_samples = 16;
+    static constexpr unsigned ops_sample_period_ms = 100;
+    std::array<uint64_t, ops_samples> _ops_history {};
+    size_t _ops_sampled = 0;
+    uint64_t _ops_last = 0;
+    timer<> _ops_timer;
+    std::chrono::steady_clock::time_point _started;
+    void sample_ops();
+    uint64_t ops_per_sec() const;
+    request_tracer _tracer;
+    slow_log _slow_log;
+    traffic_capture _capture;
+    cpu_profiler _profiler;
+    cluster_router* _cluster_router = nullptr;
+    // Latency of commands in microseconds, and their counts, indexed by
+    // command_code.
+    std::array<utils::estimated_histogram, static_cast<size_t>(command_code::max)> _latencies;
+    command_stats_array _command_stats {};
+    tenant_table _tenants;
+    using connection_list = boost::intrusive::list<connection,
+        boost::intrusive::member_hook<connection, boost::intrusive::list_member_hook<>, &connection::_link>,
+        boost::intrusive::constant_time_size<true>>;
+    // The open connections of the shard, in the order clients_cron() checks
+    // them.
+    connection_list _connections;
+    static constexpr unsigned clients_cron_period_ms = 100;
+    static constexpr unsigned clients_cron_ticks = 10;
+    timer<lowres_clock> _clients_timer;
+    // As clientsCron of Redis, checks the next tenth of the connections for
+    // the idle timeout and the output limits, so that each is checked about
+    // once a second however many there are.
+    void clients_cron();
+    // How late the reactor runs: how late a timer armed every
+    // lag_sample_period_ms fires, which is how long the tasks queued before
+    // it took. It halves every sample which is not larger.
+    static constexpr unsigned lag_sample_period_ms = 10;
+    timer<> _lag_timer;
+    std::chrono::steady_clock::time_point _lag_expected;
+    uint64_t _reactor_lag_us = 0;
+    void sample_lag();
+    // The connections waiting for fewer commands in progress.
+    std::deque<promise<>> _admission_waiters;
+    bool shedding() const { return _options._busy_lag_us > 0 && _reactor_lag_us >= _options._busy_lag_us; }
+    future<> wait_for_admission();
+    void finish_requests(size_t count);
+    size_t max_shard_clients() const;
+    void reject(connected_socket socket);
+    void do_accepts(lw_shared_ptr<server_socket> listener);
 public:
-    server(uint16_t port = 6379, bool use_native_parser = false)
-        : _port(port)
-        , _use_native_parser(use_native_parser)
+    server(server_options options = server_options {})
+        : _options(options)
+        , _shard_reply_bytes(options._max_shard_reply_bytes)
+        , _tracer(options._trace_capacity)
+        , _slow_log(options._slowlog_log_slower_than, options._slowlog_max_len)
     {
+        local_keyspace_events().set_flags(options._notify_keyspace_events);
         setup_metrics();
     }
 
     void start();
+    // Accepts the connections to the socket of _unix_socket, which shard 0
+    // binds, see bind_unix_socket().
+    void listen_unix(const file_desc& socket);
+    future<scattered_message_ptr> shards();
+    future<scattered_message_ptr> cluster(request_wrapper& req);
+    // INFO [section]: the server, clients, memory, stats, replication,
+    // shards and keyspace sections, summed over all the shards.
+    future<scattered_message_ptr> info(request_wrapper& req);
+    shard_info get_shard_info() const;
+    // TRACING ON [probability] | OFF | GET [count] | LEN | RESET: samples
+    // requests on all shards and replies where their time went.
+    future<scattered_message_ptr> tracing(request_wrapper& req);
+    // SLOWLOG GET [count] | LEN | RESET, over the logs of all shards.
+    future<scattered_message_ptr> slowlog(request_wrapper& req);
+    // CAPTURE START [probability] [ANONYMIZE] | STOP | STATUS: captures the
+    // requests of all shards for pedis_replay, see traffic_capture.
+    future<scattered_message_ptr> capture(request_wrapper& req);
+    // CONFIG GET notify-keyspace-events | SET notify-keyspace-events flags,
+    // on all shards: the only parameter which changes at run time.
+    future<scattered_message_ptr> config(request_wrapper& req);
+    // PROFILE START [seconds] [hz] | STOP | STATUS: samples the stacks of
+    // the reactors of all shards, see cpu_profiler.
+    future<scattered_message_ptr> profile(request_wrapper& req);
+    // LATENCY LATEST | HISTORY event | RESET [event ...], over the internal
+    // events of all shards, see utils::latency_monitor.
+    future<scattered_message_ptr> latency(request_wrapper& req);
+    // PUBLISH channel message: the number of subscribers which got it.
+    future<scattered_message_ptr> publish(request_wrapper& req);
+    // PUBSUB CHANNELS [pattern] | NUMSUB [channel ...] | NUMPAT.
+    future<scattered_message_ptr> pubsub(request_wrapper& req);
+    // Not owned, it outlives the server.
+    void set_cluster_router(cluster_router* router) { _cluster_router = router; }
     future<> stop() {
-        return make_ready_future<>();
+        if (engine().cpu_id() == 0 && !_options._unix_socket.empty()) {
+            ::unlink(_options._unix_socket.c_str());
+        }
+        _lag_timer.cancel();
+        for (auto& w : _admission_waiters) {
+            w.set_value();
+        }
+        _admission_waiters.clear();
+        return _capture.stop().then([this] {
+            return _profiler.stop();
+        });
     }
 };
 extern distributed<server> _server;
@@ -96,4 +535,8 @@ inline distributed<server>& get_server() {
 inline server& get_local_server() {
     return _server.local();
 }
+
+// Runs a parsed command on this node as a client connection would, with the
+// reply built whole. For commands other nodes forward to this one.
+future<scattered_message_ptr> execute_command(request_wrapper& req);
 } /* namespace redis */
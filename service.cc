@@ -41,17 +41,60 @@
 #include "net/packet-data-source.hh"
 #include <unistd.h>
 #include <cstdlib>
+#include "gms/gossiper.hh"
+#include "gms/i_endpoint_state_change_subscriber.hh"
+#include "message/messaging_service.hh"
+#include "proxy.hh"
 namespace redis {
 
 distributed<service> _service;
 
+namespace {
+class liveness_subscriber : public gms::i_endpoint_state_change_subscriber {
+public:
+    virtual void on_join(gms::inet_address endpoint, gms::endpoint_state ep_state) override {}
+    virtual void before_change(gms::inet_address endpoint, gms::endpoint_state current_state, gms::application_state new_statekey, const gms::versioned_value& newvalue) override {}
+    virtual void on_change(gms::inet_address endpoint, gms::application_state state, const gms::versioned_value& value) override {}
+    virtual void on_remove(gms::inet_address endpoint) override {}
+    virtual void on_restart(gms::inet_address endpoint, gms::endpoint_state state) override {}
+
+    // Both run inside the seastar::async context of the gossiper: the
+    // routing changes before the next command is routed.
+    virtual void on_alive(gms::inet_address endpoint, gms::endpoint_state state) override {
+        get_local_service().get_ring().set_endpoint_alive(endpoint, true).get();
+        get_service().invoke_on_all([endpoint] (service& s) {
+            if (get_proxy().local_is_initialized()) {
+                get_local_proxy().on_endpoint_up(endpoint);
+            }
+        }).get();
+    }
+
+    virtual void on_dead(gms::inet_address endpoint, gms::endpoint_state state) override {
+        get_local_service().get_ring().set_endpoint_alive(endpoint, false).get();
+        get_service().invoke_on_all([endpoint] (service& s) {
+            if (get_proxy().local_is_initialized()) {
+                get_local_proxy().on_endpoint_down(endpoint);
+            }
+        }).get();
+    }
+};
+}
+
 future<> service::start()
 {
+    if (engine().cpu_id() == 0 && gms::get_gossiper().local_is_initialized()) {
+        _liveness_subscriber = make_shared<liveness_subscriber>();
+        gms::get_local_gossiper().register_(_liveness_subscriber);
+    }
     return make_ready_future<>();
 }
 
 future<> service::stop()
 {
+    if (_liveness_subscriber) {
+        gms::get_local_gossiper().unregister_(_liveness_subscriber);
+        _liveness_subscriber = nullptr;
+    }
     return make_ready_future<>();
 }
 }
@@ -42,6 +42,9 @@
 #include <unistd.h>
 #include <cstdlib>
 #include "ring.hh"
+namespace gms {
+class i_endpoint_state_change_subscriber;
+}
 namespace redis {
 class service;
 extern distributed<service> _service;
@@ -60,5 +63,9 @@ public:
     ring& get_ring() { return _ring; }
 private:
     ring _ring;
+    // On shard 0, publishes the endpoints the gossiper sees dead or alive to
+    // the rings of all the shards and fails the commands the proxies queued for
+    // them, as soon as the failure detector convicts them.
+    shared_ptr<gms::i_endpoint_state_change_subscriber> _liveness_subscriber;
 };
 }
@@ -0,0 +1,81 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include "hash_slot.hh"
+#include "utils/bytes.hh"
+namespace redis {
+
+// Keys go to shards through a fixed space of slots: the slot of a key never
+// changes, and a change in the number of shards moves only the slots the
+// new layout hands to other shards, about 1/N of them when a shard is added,
+// where hash % smp::count would move nearly every key.
+static constexpr unsigned shard_slots = 16384;
+
+inline unsigned shard_slot(size_t hash)
+{
+    return hash & (shard_slots - 1);
+}
+
+// The shard of a slot among `shards`, by the jump consistent hash of
+// Lamping and Veach.
+inline unsigned slot_shard(unsigned slot, unsigned shards)
+{
+    uint64_t key = slot;
+    int64_t b = -1, j = 0;
+    while (j < shards) {
+        b = j;
+        key = key * 2862933555777941757ULL + 1;
+        j = (b + 1) * (double(1LL << 31) / double((key >> 33) + 1));
+    }
+    return static_cast<unsigned>(b);
+}
+
+// The shard of a key of this std::hash<bytes>, with no hash tag.
+inline unsigned shard_of(size_t hash, unsigned shards)
+{
+    return slot_shard(shard_slot(hash), shards);
+}
+
+// The shard owning a key, whose std::hash<bytes> is `hash`: that of the
+// hash of its hash tag when it has one, see key_hash_tag(), so that the
+// commands on keys sharing a tag run on one shard. The cache still hashes
+// the whole key.
+inline unsigned shard_of_key(bytes_view key, size_t hash, unsigned shards)
+{
+    size_t start, length;
+    if (key_hash_tag(key.data(), key.size(), start, length)) {
+        hash = std::hash<bytes_view>()(key.substr(start, length));
+    }
+    return shard_of(hash, shards);
+}
+
+inline unsigned shard_of_key(bytes_view key, unsigned shards)
+{
+    size_t start, length;
+    if (key_hash_tag(key.data(), key.size(), start, length)) {
+        key = key.substr(start, length);
+    }
+    return shard_of(std::hash<bytes_view>()(key), shards);
+}
+}
@@ -0,0 +1,95 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+* 
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#pragma once
+#include <algorithm>
+#include <vector>
+#include "core/sstring.hh"
+namespace redis {
+using namespace seastar;
+
+// A command which ran longer than --slowlog_log_slower_than, as SLOWLOG
+// GET replies it.
+struct slowlog_entry {
+    uint64_t _id = 0;
+    // Unix time the command started, in seconds.
+    int64_t _timestamp = 0;
+    uint64_t _duration_us = 0;
+    // The command and its arguments, truncated as Redis does.
+    std::vector<sstring> _args;
+    sstring _client;
+    unsigned _shard = 0;
+};
+
+// The slow commands of one shard, the last max_len of them in a ring. Only
+// its shard touches it, so recording takes no lock; SLOWLOG gathers the
+// logs of all shards.
+class slow_log {
+    int64_t _slower_than_us;
+    std::vector<slowlog_entry> _ring;
+    // Entries recorded since the last reset, the next one goes to
+    // _recorded % _ring.size().
+    uint64_t _recorded = 0;
+    uint64_t _next_id = 0;
+public:
+    // Redis keeps at most this many arguments, and this many bytes of each.
+    static constexpr size_t max_args = 32;
+    static constexpr size_t max_arg_bytes = 128;
+
+    // A negative threshold disables the log, 0 logs every command.
+    slow_log(int64_t slower_than_us, size_t max_len)
+        : _slower_than_us(slower_than_us)
+        , _ring(max_len)
+    {
+    }
+
+    bool is_slow(uint64_t duration_us) const
+    {
+        return _slower_than_us >= 0 && !_ring.empty() && duration_us >= static_cast<uint64_t>(_slower_than_us);
+    }
+
+    // Ids are unique across the shards, and grow with time on each.
+    uint64_t next_id(unsigned shard, unsigned shards)
+    {
+        return _next_id++ * shards + shard;
+    }
+
+    void record(slowlog_entry&& entry)
+    {
+        _ring[_recorded++ % _ring.size()] = std::move(entry);
+    }
+
+    size_t size() const { return _ring.empty() ? 0 : std::min<uint64_t>(_recorded, _ring.size()); }
+
+    // The last `count` entries, newest first.
+    std::vector<slowlog_entry> last(size_t count) const
+    {
+        std::vector<slowlog_entry> entries;
+        count = std::min(count, size());
+        entries.reserve(count);
+        for (size_t i = 1; i <= count; ++i) {
+            entries.push_back(_ring[(_recorded - i) % _ring.size()]);
+        }
+        return entries;
+    }
+
+    void reset() { _recorded = 0; }
+};
+}
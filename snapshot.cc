@@ -0,0 +1,496 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pengjian.uestc@gmail.com. All rights reserved.
+*
+*/
+#include "snapshot.hh"
+#include "structures/page_set.hh"
+#include "store/priority_manager.hh"
+#include "store/util/coding.hh"
+#include "store/util/crc32c.hh"
+#include "core/print.hh"
+#include "core/reactor.hh"
+#include <algorithm>
+#include <cstring>
+namespace redis {
+
+sstring snapshot_file_name(unsigned shard)
+{
+    return sprint("snapshot-%u.pds", shard);
+}
+
+sstring heat_map_file_name(unsigned shard)
+{
+    return sprint("heat-%u.pds", shard);
+}
+
+sstring warm_image_file_name(const sstring& dir, unsigned shard)
+{
+    return sprint("%s/warm-%u.pds", dir, shard);
+}
+
+// The directory holding the file, whose entry a rename changes.
+static sstring directory_of(const sstring& name)
+{
+    auto slash = name.find_last_of('/');
+    if (slash == sstring::npos) {
+        return ".";
+    }
+    return slash == 0 ? sstring("/") : name.substr(0, slash);
+}
+
+void snapshot_encoder::begin(snapshot_type type, const char* key, size_t key_size, uint64_t expire_at_ms)
+{
+    _out.push_back(static_cast<char>(type));
+    char expiry[8];
+    store::encode_fixed64(expiry, expire_at_ms);
+    _out.insert(_out.end(), expiry, expiry + sizeof(expiry));
+    put_bytes(key, key_size);
+}
+
+void snapshot_encoder::put_count(uint64_t count)
+{
+    char varint[10];
+    auto end = store::encode_varint64(varint, count);
+    _out.insert(_out.end(), varint, end);
+}
+
+void snapshot_encoder::put_bytes(const char* data, size_t size)
+{
+    put_count(size);
+    _out.insert(_out.end(), data, data + size);
+}
+
+void snapshot_encoder::put_double(double value)
+{
+    uint64_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    char fixed[8];
+    store::encode_fixed64(fixed, bits);
+    _out.insert(_out.end(), fixed, fixed + sizeof(fixed));
+}
+
+snapshot_writer::snapshot_writer(sstring name)
+    : _name(std::move(name))
+    , _temporary(_name + ".tmp")
+{
+    _buffer.reserve(write_size * 2);
+    _buffer.insert(_buffer.end(), snapshot_magic, snapshot_magic + snapshot_magic_size);
+}
+
+future<> snapshot_writer::open()
+{
+    return open_file_dma(_temporary, open_flags::wo | open_flags::create | open_flags::truncate).then([this] (file f) {
+        file_output_stream_options options;
+        options.buffer_size = write_size;
+        options.io_priority_class = store::get_local_snapshot_priority();
+        _out = make_file_output_stream(std::move(f), options);
+        _opened = true;
+    });
+}
+
+future<> snapshot_writer::write_out(bool checksum)
+{
+    // a new buffer takes the records saved while this one is written.
+    auto data = std::move(_buffer);
+    _buffer = std::vector<char>();
+    _buffer.reserve(write_size * 2);
+    if (checksum) {
+        _crc = store::crc32c::extend(_crc, data.data(), data.size());
+    }
+    _bytes += data.size();
+    return do_with(std::move(data), [this] (auto& data) {
+        return _out.write(data.data(), data.size());
+    });
+}
+
+future<> snapshot_writer::write()
+{
+    if (_buffer.empty()) {
+        return make_ready_future<>();
+    }
+    return write_out(true);
+}
+
+future<> snapshot_writer::finish()
+{
+    _buffer.push_back(static_cast<char>(snapshot_type::end));
+    char count[8];
+    store::encode_fixed64(count, _records);
+    _buffer.insert(_buffer.end(), count, count + sizeof(count));
+    return write_out(true).then([this] {
+        char crc[4];
+        store::encode_fixed32(crc, store::crc32c::mask(_crc));
+        _buffer.insert(_buffer.end(), crc, crc + sizeof(crc));
+        return write_out(false);
+    }).then([this] {
+        return _out.flush();
+    }).then([this] {
+        // closing the stream syncs the file.
+        return _out.close();
+    }).then([this] {
+        return rename_file(_temporary, _name);
+    }).then([this] {
+        return open_directory(directory_of(_name));
+    }).then([] (file dir) {
+        return do_with(std::move(dir), [] (file& dir) {
+            return dir.flush().then([&dir] {
+                return dir.close();
+            });
+        });
+    });
+}
+
+future<> snapshot_writer::abort()
+{
+    if (!_opened) {
+        return make_ready_future<>();
+    }
+    return _out.close().then_wrapped([this] (future<> f) {
+        f.ignore_ready_future();
+        return remove_file(_temporary);
+    }).handle_exception([] (std::exception_ptr) {});
+}
+
+size_t snapshot_record::memory() const
+{
+    size_t size = sizeof(*this) + _key.size() + _scores.size() * sizeof(double) + _numbers.size() * sizeof(uint64_t);
+    for (auto& e : _elements) {
+        size += sizeof(e) + e.size();
+    }
+    return size;
+}
+
+uint64_t record_cursor::varint()
+{
+    uint64_t value;
+    auto next = store::get_varint64_ptr(_p, _end, value);
+    if (next == nullptr) {
+        if (left() < 10) {
+            throw incomplete_record();
+        }
+        throw corrupt_snapshot("bad varint");
+    }
+    _p = next;
+    return value;
+}
+
+uint64_t record_cursor::fixed64()
+{
+    return store::decode_fixed64(take(8));
+}
+
+bytes record_cursor::string()
+{
+    auto size = varint();
+    auto data = take(size);
+    return bytes { data, size };
+}
+
+snapshot_record snapshot_decoder::decode_record(record_cursor& c, snapshot_type type)
+{
+    snapshot_record r;
+    r._type = type;
+    r._expire_at_ms = c.fixed64();
+    r._key = c.string();
+    // the counts are not trusted further than the input holds.
+    auto elements = [&c, &r] (size_t per_element) {
+        auto count = c.varint();
+        r._elements.reserve(std::min<uint64_t>(count * per_element, c.left()));
+        return count;
+    };
+    switch (type) {
+    case snapshot_type::string:
+    case snapshot_type::hll:
+        r._elements.emplace_back(c.string());
+        break;
+    case snapshot_type::list:
+    case snapshot_type::set:
+        for (auto n = elements(1); n > 0; --n) {
+            r._elements.emplace_back(c.string());
+        }
+        break;
+    case snapshot_type::hash:
+        for (auto n = elements(2); n > 0; --n) {
+            r._elements.emplace_back(c.string());
+            r._elements.emplace_back(c.string());
+        }
+        break;
+    case snapshot_type::zset:
+        for (auto n = elements(1); n > 0; --n) {
+            r._elements.emplace_back(c.string());
+            auto bits = c.fixed64();
+            double score;
+            std::memcpy(&score, &bits, sizeof(score));
+            r._scores.push_back(score);
+        }
+        break;
+    case snapshot_type::stream: {
+        auto number = [&c, &r] {
+            auto n = c.varint();
+            r._numbers.push_back(n);
+            return n;
+        };
+        number();
+        number();
+        for (auto n = number(); n > 0; --n) {
+            number();
+            number();
+            for (auto fields = number(); fields > 0; --fields) {
+                r._elements.emplace_back(c.string());
+                r._elements.emplace_back(c.string());
+            }
+        }
+        for (auto groups = number(); groups > 0; --groups) {
+            r._elements.emplace_back(c.string());
+            number();
+            number();
+            for (auto pending = number(); pending > 0; --pending) {
+                number();
+                number();
+                r._elements.emplace_back(c.string());
+                number();
+            }
+        }
+        break;
+    }
+    case snapshot_type::timeseries: {
+        r._numbers.push_back(c.varint());
+        auto count = c.varint();
+        r._numbers.reserve(std::min<uint64_t>(count, c.left()) + 1);
+        for (; count > 0; --count) {
+            r._numbers.push_back(c.varint());
+            auto bits = c.fixed64();
+            double value;
+            std::memcpy(&value, &bits, sizeof(value));
+            r._scores.push_back(value);
+        }
+        break;
+    }
+    case snapshot_type::bloom:
+    case snapshot_type::cms:
+    case snapshot_type::topk: {
+        auto number = [&c, &r] {
+            auto n = c.varint();
+            r._numbers.push_back(n);
+            return n;
+        };
+        if (type == snapshot_type::bloom) {
+            auto bits = c.fixed64();
+            double error;
+            std::memcpy(&error, &bits, sizeof(error));
+            r._scores.push_back(error);
+            number();
+            number();
+            number();
+            for (auto layers = number(); layers > 0; --layers) {
+                for (int i = 0; i < 5; ++i) {
+                    number();
+                }
+            }
+        }
+        else if (type == snapshot_type::cms) {
+            number();
+            number();
+            number();
+        }
+        else {
+            number();
+            number();
+            number();
+            auto bits = c.fixed64();
+            double decay;
+            std::memcpy(&decay, &bits, sizeof(decay));
+            r._scores.push_back(decay);
+            for (auto items = number(); items > 0; --items) {
+                r._elements.emplace_back(c.string());
+                number();
+            }
+        }
+        for (auto pages = number(); pages > 0; --pages) {
+            number();
+            r._elements.emplace_back(c.string());
+            if (r._elements.back().size() != lsa_page_set::page_size) {
+                throw corrupt_snapshot(sprint("page of %d bytes", r._elements.back().size()));
+            }
+        }
+        break;
+    }
+    default:
+        throw corrupt_snapshot(sprint("unknown record type %d", static_cast<int>(type)));
+    }
+    return r;
+}
+
+snapshot_record decode_snapshot_record(const char* data, size_t size)
+{
+    record_cursor c(data, data + size);
+    try {
+        auto type = static_cast<snapshot_type>(c.byte());
+        auto r = snapshot_decoder().decode_record(c, type);
+        if (c.left() == 0) {
+            return r;
+        }
+    } catch (const incomplete_record&) {
+    }
+    throw corrupt_snapshot("not a whole record");
+}
+
+bytes make_dump_payload(const char* record, size_t size)
+{
+    bytes payload(bytes::initialized_later(), size + 6);
+    std::copy_n(record, size, payload.begin());
+    payload[size] = static_cast<char>(dump_version & 0xff);
+    payload[size + 1] = static_cast<char>(dump_version >> 8);
+    auto crc = store::crc32c::value(payload.data(), size + 2);
+    store::encode_fixed32(payload.begin() + size + 2, store::crc32c::mask(crc));
+    return payload;
+}
+
+bool open_dump_payload(bytes_view payload, bytes_view& record)
+{
+    if (payload.size() < 6) {
+        return false;
+    }
+    auto size = payload.size() - 6;
+    auto version = static_cast<uint8_t>(payload[size]) | static_cast<uint16_t>(static_cast<uint8_t>(payload[size + 1])) << 8;
+    if (version != dump_version) {
+        return false;
+    }
+    auto crc = store::crc32c::value(payload.data(), size + 2);
+    if (store::crc32c::unmask(store::decode_fixed32(payload.data() + size + 2)) != crc) {
+        return false;
+    }
+    record = payload.substr(0, size);
+    return true;
+}
+
+size_t snapshot_decoder::decode(const char* data, size_t size, const record_func& func)
+{
+    record_cursor c(data, data + size);
+    size_t consumed = 0;
+    try {
+        if (!_started) {
+            if (std::memcmp(c.take(snapshot_magic_size), snapshot_magic, snapshot_magic_size) != 0) {
+                throw corrupt_snapshot("not a snapshot of Pedis");
+            }
+            _started = true;
+            consumed = snapshot_magic_size;
+            _crc = store::crc32c::extend(_crc, data, consumed);
+        }
+        while (!_ended && c.left() > 0) {
+            auto start = c.position();
+            auto type = static_cast<snapshot_type>(c.byte());
+            if (type == snapshot_type::end) {
+                auto count = c.fixed64();
+                auto crc = store::crc32c::extend(_crc, start, c.position() - start);
+                if (store::crc32c::unmask(store::decode_fixed32(c.take(4))) != crc) {
+                    throw corrupt_snapshot("bad checksum");
+                }
+                if (count != _records) {
+                    throw corrupt_snapshot(sprint("%u records, the end says %u", _records, count));
+                }
+                _ended = true;
+                consumed = c.position() - data;
+                break;
+            }
+            auto r = decode_record(c, type);
+            _crc = store::crc32c::extend(_crc, start, c.position() - start);
+            ++_records;
+            consumed = c.position() - data;
+            func(std::move(r));
+        }
+    } catch (const incomplete_record&) {
+    }
+    return consumed;
+}
+
+static constexpr size_t read_chunk_size = 256 * 1024;
+
+future<> read_file_in_chunks(sstring name, chunk_consumer consume)
+{
+    return open_file_dma(name, open_flags::ro).then([consume = std::move(consume)] (file f) mutable {
+        struct reader {
+            input_stream<char> _in;
+            chunk_consumer _consume;
+            std::vector<char> _pending;
+            size_t _wanted = 0;
+            bool _eof = false;
+        };
+        file_input_stream_options options;
+        options.buffer_size = read_chunk_size;
+        options.read_ahead = 4;
+        options.io_priority_class = store::get_local_snapshot_priority();
+        auto r = make_lw_shared<reader>(reader { make_file_input_stream(std::move(f), options), std::move(consume) });
+        // what a consumer leaves is kept for the next call, and is more to
+        // be read before it is passed again when nothing was consumed.
+        auto keep = [r] (const char* data, size_t size, size_t consumed) {
+            if (consumed == 0 && r->_eof) {
+                throw corrupt_snapshot("the file ends inside a record");
+            }
+            r->_wanted = consumed == 0 ? size * 2 : 0;
+            r->_pending.assign(data + consumed, data + size);
+        };
+        return repeat([r, keep] {
+            return r->_in.read().then([r, keep] (temporary_buffer<char> chunk) {
+                if (chunk.empty()) {
+                    r->_eof = true;
+                    if (r->_pending.empty()) {
+                        return make_ready_future<stop_iteration>(stop_iteration::yes);
+                    }
+                }
+                if (r->_pending.empty()) {
+                    // the chunk is passed as it is read, without a copy.
+                    auto data = chunk.get();
+                    auto size = chunk.size();
+                    return r->_consume(data, size).then([keep, chunk = std::move(chunk)] (size_t consumed) {
+                        keep(chunk.get(), chunk.size(), consumed);
+                        return stop_iteration::no;
+                    });
+                }
+                r->_pending.insert(r->_pending.end(), chunk.begin(), chunk.end());
+                if (!r->_eof && r->_pending.size() < r->_wanted) {
+                    return make_ready_future<stop_iteration>(stop_iteration::no);
+                }
+                return r->_consume(r->_pending.data(), r->_pending.size()).then([r, keep] (size_t consumed) {
+                    auto pending = std::move(r->_pending);
+                    keep(pending.data(), pending.size(), consumed);
+                    return r->_eof && r->_pending.empty() ? stop_iteration::yes : stop_iteration::no;
+                });
+            });
+        }).finally([r] {
+            return r->_in.close();
+        });
+    });
+}
+
+future<> verify_snapshot(sstring name)
+{
+    auto decoder = make_lw_shared<snapshot_decoder>();
+    return read_file_in_chunks(name, [decoder] (const char* data, size_t size) {
+        if (decoder->ended()) {
+            return make_ready_future<size_t>(size);
+        }
+        return make_ready_future<size_t>(decoder->decode(data, size, [] (snapshot_record) {}));
+    }).then([name, decoder] {
+        if (!decoder->ended()) {
+            throw corrupt_snapshot(sprint("%s ends before its last record", name));
+        }
+    });
+}
+}
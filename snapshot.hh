@@ -0,0 +1,237 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pengjian.uestc@gmail.com. All rights reserved.
+*
+*/
+#pragma once
+#include "core/file.hh"
+#include "core/fstream.hh"
+#include "core/future.hh"
+#include "core/sstring.hh"
+#include "utils/bytes.hh"
+#include <cstdint>
+#include <functional>
+#include <stdexcept>
+#include <vector>
+namespace redis {
+
+// A snapshot of a shard, as BGSAVE writes it: the magic, one record per key,
+// then the end opcode followed by the number of records and the CRC32C of
+// all the bytes before it. Counts and lengths are varints, scores are the
+// 8 bytes of the double, the expiry is the time in milliseconds since the
+// epoch, 0 for keys without one:
+//
+//   record: type, expiry (8 bytes), key, value
+//   string, hll: the bytes
+//   list, set: count, then the elements
+//   hash: count, then the field and the value of each entry
+//   zset: count, then the member and the score of each entry
+//   stream: the ms and seq of its last ID, count, then the ms, seq, field
+//     count, fields and values of each entry; the count of its groups, then
+//     the name, the ms and seq of the last entry delivered and the count of
+//     pending entries of each, then the ms, seq, consumer and deliveries of
+//     each pending entry
+//   timeseries: the retention in milliseconds, count, then the timestamp
+//     and the value of each sample
+//   bloom: the error rate, capacity, expansion and items of the filter, the
+//     count of its layers, then the capacity, items, blocks, first page and
+//     hashes of each; then its pages
+//   cms: the width, depth and total count of the sketch, then its pages
+//   topk: k, width, depth and the decay of the sketch, the count of its top
+//     items, then the name and the count of each, largest first; then its
+//     pages
+//   the pages of a sketch: count, then the index and the page_size bytes
+//     of each page written, those left out holding zeroes
+//
+// Every byte string is its length followed by its bytes.
+enum class snapshot_type : uint8_t {
+    string = 1,
+    list = 2,
+    set = 3,
+    hash = 4,
+    zset = 5,
+    hll = 6,
+    stream = 7,
+    timeseries = 8,
+    bloom = 9,
+    cms = 10,
+    topk = 11,
+    end = 0xff,
+};
+
+static constexpr const char snapshot_magic[] = "PEDISSNAPSHOT001";
+static constexpr const size_t snapshot_magic_size = sizeof(snapshot_magic) - 1;
+
+// The snapshot file of a shard.
+sstring snapshot_file_name(unsigned shard);
+// The hottest keys a shard leaves as it stops, see
+// database_options::_warmup_keys. A heat map is a snapshot of string
+// records with empty values, hottest first.
+sstring heat_map_file_name(unsigned shard);
+// The snapshot a shard leaves in `dir` as it stops, for a warm restart, see
+// database_options::_warm_restart_dir.
+sstring warm_image_file_name(const sstring& dir, unsigned shard);
+
+// Appends the parts of records to a buffer.
+class snapshot_encoder {
+    std::vector<char>& _out;
+public:
+    explicit snapshot_encoder(std::vector<char>& out) : _out(out) {}
+    void begin(snapshot_type type, const char* key, size_t key_size, uint64_t expire_at_ms);
+    void put_count(uint64_t count);
+    void put_bytes(const char* data, size_t size);
+    void put_bytes(bytes_view data) { put_bytes(data.data(), data.size()); }
+    void put_double(double value);
+};
+
+// Writes a snapshot beside its file, then renames it over the file once it
+// is whole and synced, so that a failed save leaves the last one. Records
+// gather in a buffer, which write() sends to the disk with direct I/O
+// under the snapshot priority class.
+class snapshot_writer {
+    sstring _name;
+    sstring _temporary;
+    output_stream<char> _out;
+    std::vector<char> _buffer;
+    uint32_t _crc = 0;
+    uint64_t _records = 0;
+    uint64_t _bytes = 0;
+    bool _opened = false;
+    future<> write_out(bool checksum);
+public:
+    static constexpr size_t write_size = 128 * 1024;
+
+    explicit snapshot_writer(sstring name);
+    future<> open();
+    // An encoder for the next record, which must be appended whole.
+    snapshot_encoder next_record()
+    {
+        ++_records;
+        return snapshot_encoder(_buffer);
+    }
+    bool should_write() const { return _buffer.size() >= write_size; }
+    // Writes out the buffered records.
+    future<> write();
+    // Writes the end of the snapshot and makes it the file of the shard.
+    future<> finish();
+    // Drops the snapshot, the file of the shard is left as it was.
+    future<> abort();
+    uint64_t records() const { return _records; }
+    uint64_t bytes_written() const { return _bytes; }
+};
+
+// A key read from a snapshot or an RDB file, for the shard owning it.
+struct snapshot_record {
+    snapshot_type _type = snapshot_type::string;
+    bytes _key;
+    uint64_t _expire_at_ms = 0;
+    // The value of a string or a HyperLogLog, in the dense encoding of
+    // Pedis; the elements of a list or a set; the fields and the values of
+    // a hash, one after the other; the members of a sorted set.
+    std::vector<bytes> _elements;
+    // The scores of the members of a sorted set.
+    std::vector<double> _scores;
+    // The IDs and counts of a stream, in the order of the snapshot, its
+    // fields, values, group names and consumers being in _elements. The
+    // retention and the timestamps of a time series, its values being in
+    // _scores. The numbers of a Bloom filter or a count-min sketch with the
+    // indexes of its pages, their bytes being in _elements and the error
+    // rate of a filter in _scores. Those of a Top-K with the counts of its
+    // items, their names being in _elements before the pages and its decay
+    // in _scores.
+    std::vector<uint64_t> _numbers;
+
+    // About the bytes the record holds, to size the batches sent to shards.
+    size_t memory() const;
+};
+
+// Thrown by decoders which reach the end of their input inside a record:
+// the record is decoded again once more input is read.
+struct incomplete_record {};
+
+// Thrown on a file which cannot be decoded.
+class corrupt_snapshot : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// Bounds-checked reads from the input of a decoder.
+class record_cursor {
+    const char* _p;
+    const char* _end;
+public:
+    record_cursor(const char* p, const char* end) : _p(p), _end(end) {}
+    const char* position() const { return _p; }
+    size_t left() const { return _end - _p; }
+    const char* take(size_t n)
+    {
+        if (left() < n) {
+            throw incomplete_record();
+        }
+        auto p = _p;
+        _p += n;
+        return p;
+    }
+    uint8_t byte() { return static_cast<uint8_t>(*take(1)); }
+    uint64_t varint();
+    uint64_t fixed64();
+    bytes string();
+};
+
+// Reads the whole snapshot, failing with corrupt_snapshot unless it ends
+// with its count of records and its checksum.
+future<> verify_snapshot(sstring name);
+
+// Decodes the records of a snapshot, verifying its end and its checksum.
+class snapshot_decoder {
+    bool _started = false;
+    bool _ended = false;
+    uint32_t _crc = 0;
+    uint64_t _records = 0;
+    snapshot_record decode_record(record_cursor& c, snapshot_type type);
+    friend snapshot_record decode_snapshot_record(const char* data, size_t size);
+public:
+    using record_func = std::function<void (snapshot_record)>;
+    // Passes the whole records at the front of the input to func, returns
+    // the bytes they took.
+    size_t decode(const char* data, size_t size, const record_func& func);
+    bool ended() const { return _ended; }
+};
+
+// Decodes a single record as snapshot_encoder writes it, out of any
+// snapshot: the form a key takes from a shard to another, see
+// database::dump_entry(). Fails with corrupt_snapshot unless it is whole.
+snapshot_record decode_snapshot_record(const char* data, size_t size);
+
+// The payload of DUMP: the record of the key under an empty name, then the
+// version of the encoding in two bytes and the crc32c of all that, as the
+// payload of Redis ends with its RDB version and a CRC64. RESTORE refuses
+// the payload of another version, or one damaged on the way.
+static constexpr uint16_t dump_version = 1;
+bytes make_dump_payload(const char* record, size_t size);
+// The record of the payload, false if its version or checksum are wrong.
+bool open_dump_payload(bytes_view payload, bytes_view& record);
+
+// Reads a file with direct I/O, passing the bytes read and not yet
+// consumed to consume, which resolves to how many of them it consumed.
+// Input a record is cut in is kept, and more is read before it is passed
+// again: twice as much each time, so a large record is not decoded over and
+// over. Fails with corrupt_snapshot if the file ends inside a record.
+using chunk_consumer = std::function<future<size_t> (const char* data, size_t size)>;
+future<> read_file_in_chunks(sstring name, chunk_consumer consume);
+}
@@ -1,5 +1,6 @@
 #include "column_family.hh"
 #include "store/reader.hh"
+#include <algorithm>
 namespace store {
 
 int column_family::in_range(lw_shared_ptr<sstable_meta> m, const bytes_view& key) const
@@ -15,44 +16,42 @@ int column_family::in_range(lw_shared_ptr<sstable_meta> m, const bytes_view& key
 
 std::vector<lw_shared_ptr<sstable_meta>> column_family::filter_file_meta_from_level_zero(bytes_view key) const
 {
-    return std::vector<lw_shared_ptr<sstable_meta>> {};
+    // level 0 files overlap each other: all the ones holding key in their
+    // range, newest first, so that the first hit is the latest version.
+    std::vector<lw_shared_ptr<sstable_meta>> result;
+    for (auto& m : _sstables[0]) {
+        if (in_range(m, key) == 0) {
+            result.push_back(m);
+        }
+    }
+    std::sort(result.begin(), result.end(), [] (auto& l, auto& r) { return l->_sequence_number > r->_sequence_number; });
+    return result;
 }
 
 std::vector<lw_shared_ptr<sstable_meta>> column_family::filter_file_meta(bytes_view key) const
 {
+    // files of the other levels are disjoint and sorted by key: at most one
+    // per level may hold key.
     std::vector<lw_shared_ptr<sstable_meta>> result;
-    for (size_t i = 0; i < MAX_LEVELS; ++i) {
+    for (size_t i = 1; i < MAX_LEVELS; ++i) {
         auto& sstable_metas = _sstables[i];
-        auto files_number = sstable_metas.size();
-        if (i == 0) {
-            // iterate every files in the level 0.
-            for (size_t k = 0; k < files_number; ++k) {
-                if (in_range(sstable_metas[k], key) == 0) {
-                    result.push_back(sstable_metas[k]);
-                    break;
-                }
+        // binary search in [begin, end) for the first file whose largest
+        // key is not below key.
+        size_t begin = 0, end = sstable_metas.size();
+        while (begin < end) {
+            auto m = begin + (end - begin) / 2;
+            if (in_range(sstable_metas[m], key) > 0) {
+                begin = m + 1;
             }
-        }
-        else {
-            // binary search to lookup the target files.
-            size_t begin = 0, end = sstable_metas.size();
-            for (; begin < end; ) {
-                auto m = (begin + end) >> 1;
-                auto c = in_range(sstable_metas[m], key);
-                if (c == 0) {
-                    result.push_back(sstable_metas[m]);
-                    break;
-                }
-                else if (c > 0) {
-                    begin = m + 1;
-                }
-                else {
-                    end = m - 1;
-                }
+            else {
+                end = m;
             }
         }
+        if (begin < sstable_metas.size() && in_range(sstable_metas[begin], key) == 0) {
+            result.push_back(sstable_metas[begin]);
+        }
     }
-    return std::move(result);
+    return result;
 }
 
 lw_shared_ptr<partition> column_family::merge_multi_targets(std::vector<lw_shared_ptr<partition>>&& ps) const
@@ -12,6 +12,8 @@ struct sstable_meta {
     bytes _smallest_key {};
     bytes _largest_key {};
     bytes _file_name {};
+    // Orders the overlapping level 0 files, the newest has the largest one.
+    uint64_t _sequence_number = 0;
     lw_shared_ptr<sstable> _sstable = { nullptr };
     sstable_meta()
     {
@@ -22,10 +22,10 @@ class bytewise_comparator : public comparator {
     static bytes _name("redis.bytewise_comparator");
     return _name;
   }
-  virtual int compare(const bytes_view& a, const bytes_view& b) const { return a < b; } 
-  virtual int compare(const bytes& a, const bytes_view& b) const { return bytes_view { a } < b; }
-  virtual int compare(const bytes_view& a, const bytes& b) const { return a < bytes_view { b }; }
-  virtual int compare(const bytes& a, const bytes& b) const { return a < b; }
+  virtual int compare(const bytes_view& a, const bytes_view& b) const { return a.compare(b); }
+  virtual int compare(const bytes& a, const bytes_view& b) const { return compare(bytes_view { a.data(), a.size() }, b); }
+  virtual int compare(const bytes_view& a, const bytes& b) const { return compare(a, bytes_view { b.data(), b.size() }); }
+  virtual int compare(const bytes& a, const bytes& b) const { return compare(bytes_view { a.data(), a.size() }, bytes_view { b.data(), b.size() }); }
 };
 }
 
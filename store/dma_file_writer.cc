@@ -0,0 +1,119 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#include "store/dma_file_writer.hh"
+#include "store/util/crc32c.hh"
+#include "core/align.hh"
+#include "core/future-util.hh"
+#include <algorithm>
+#include <stdexcept>
+#include <string.h>
+
+namespace store {
+
+dma_file_writer::dma_file_writer(file f, const io_priority_class& pc, dma_file_writer_options options)
+    : _file(std::move(f))
+    , _pc(pc)
+    , _alignment(_file.disk_write_dma_alignment())
+    , _buffer_size(align_up<size_t>(std::max(options._buffer_size, _alignment), _alignment))
+    , _write_behind(std::max(options._write_behind, 1u))
+    , _state(make_lw_shared<write_state>(_write_behind))
+    , _buffer(temporary_buffer<char>::aligned(_alignment, _buffer_size))
+{
+}
+
+static future<> write_fully(file f, uint64_t pos, temporary_buffer<char> buf, size_t size, const io_priority_class& pc)
+{
+    return do_with(std::move(f), std::move(buf), size_t(0), [pos, size, &pc] (file& f, temporary_buffer<char>& buf, size_t& written) {
+        return repeat([&f, &buf, &written, pos, size, &pc] {
+            return f.dma_write(pos + written, buf.get() + written, size - written, pc).then([&written, size] (size_t n) {
+                if (n == 0) {
+                    throw std::runtime_error("short sstable write");
+                }
+                written += n;
+                return written >= size ? stop_iteration::yes : stop_iteration::no;
+            });
+        });
+    });
+}
+
+future<> dma_file_writer::write_buffer()
+{
+    return _state->_buffers.wait().then([this] {
+        auto size = align_up<size_t>(_pos, _alignment);
+        std::fill(_buffer.get_write() + _pos, _buffer.get_write() + size, 0);
+        auto buf = std::exchange(_buffer, temporary_buffer<char>::aligned(_alignment, _buffer_size));
+        auto pos = _buffer_offset;
+        _buffer_offset += _pos;
+        _pos = 0;
+        // in the background, the next buffer fills meanwhile.
+        write_fully(_file, pos, std::move(buf), size, _pc).then_wrapped([state = _state] (future<> f) {
+            if (f.failed()) {
+                state->_error = f.get_exception();
+            }
+            state->_buffers.signal();
+        });
+    });
+}
+
+future<> dma_file_writer::append(const char* data, size_t n, uint32_t* crc)
+{
+    if (_state->_error) {
+        return make_exception_future<>(_state->_error);
+    }
+    while (n > 0) {
+        auto chunk = std::min(n, _buffer_size - _pos);
+        auto dst = _buffer.get_write() + _pos;
+        if (crc) {
+            *crc = crc32c::extend_copy(*crc, dst, data, chunk);
+        } else {
+            memcpy(dst, data, chunk);
+        }
+        _pos += chunk;
+        data += chunk;
+        n -= chunk;
+        if (_pos == _buffer_size) {
+            return write_buffer().then([this, data, n, crc] {
+                return append(data, n, crc);
+            });
+        }
+    }
+    return make_ready_future<>();
+}
+
+future<> dma_file_writer::close()
+{
+    auto f = _pos > 0 && !_state->_error ? write_buffer() : make_ready_future<>();
+    return f.then([this] {
+        return _state->_buffers.wait(_write_behind).then([this] {
+            _state->_buffers.signal(_write_behind);
+            if (_state->_error) {
+                return make_exception_future<>(_state->_error);
+            }
+            return _file.truncate(offset()).then([this] {
+                return _file.flush();
+            });
+        });
+    }).finally([this] {
+        return _file.close();
+    });
+}
+
+}
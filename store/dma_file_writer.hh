@@ -0,0 +1,83 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#pragma once
+#include <stdint.h>
+#include <exception>
+#include "core/file.hh"
+#include "core/future.hh"
+#include "core/semaphore.hh"
+#include "core/shared_ptr.hh"
+#include "core/temporary_buffer.hh"
+#include "seastarx.hh"
+
+namespace store {
+
+struct dma_file_writer_options {
+    // Bytes written at once, rounded up to the DMA alignment of the file.
+    size_t _buffer_size = 1024 * 1024;
+    // Buffers being written while the next one fills.
+    unsigned _write_behind = 4;
+};
+
+// Writes a file from its start in large buffers aligned for DMA, up to
+// _write_behind of them in flight, so that the writer only waits for the
+// disk when all of them are. append() copies into the current buffer, and
+// folds the crc32c of what it copies in the same pass when asked to.
+//
+// Used by one task at a time, each call waiting for the future of the one
+// before. A failed write fails the next call. The last buffer is written
+// padded to the alignment, and close() truncates the file to the bytes
+// appended; it must be called, even after a failure.
+class dma_file_writer {
+    // Shared with the writes in flight, which may outlive the writer.
+    struct write_state {
+        semaphore _buffers;
+        std::exception_ptr _error;
+        explicit write_state(unsigned buffers) : _buffers(buffers) {}
+    };
+    file _file;
+    const io_priority_class& _pc;
+    size_t _alignment;
+    size_t _buffer_size;
+    unsigned _write_behind;
+    lw_shared_ptr<write_state> _state;
+    temporary_buffer<char> _buffer;
+    size_t _pos = 0;
+    // Of the start of _buffer in the file.
+    uint64_t _buffer_offset = 0;
+
+    future<> write_buffer();
+public:
+    dma_file_writer(file f, const io_priority_class& pc, dma_file_writer_options options = dma_file_writer_options {});
+    dma_file_writer(const dma_file_writer&) = delete;
+    void operator=(const dma_file_writer&) = delete;
+
+    // data must live until the future resolves. With crc, its crc32c is
+    // extended by data.
+    future<> append(const char* data, size_t n, uint32_t* crc = nullptr);
+    // Bytes appended so far.
+    uint64_t offset() const { return _buffer_offset + _pos; }
+    // Writes what is buffered, waits for the writes in flight, then
+    // truncates, flushes and closes the file.
+    future<> close();
+};
+
+}
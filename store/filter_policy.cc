@@ -0,0 +1,107 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#include "store/filter_policy.hh"
+#include "store/util/coding.hh"
+#include "utils/bloom_calculations.hh"
+#include "utils/murmur_hash.hh"
+namespace store {
+
+namespace {
+
+// The filter is the blocks, then the number of probes in one byte and the
+// number of blocks in a fixed32.
+class blocked_bloom_filter_policy_impl : public filter_policy {
+    static constexpr size_t block_bytes = 64;
+    static constexpr size_t block_bits = block_bytes * 8;
+    static constexpr size_t trailer_size = 1 + 4;
+    static constexpr int bits_per_key = 10;
+    int _num_probes;
+public:
+    blocked_bloom_filter_policy_impl()
+        : _num_probes(utils::bloom_calculations::compute_bloom_spec(bits_per_key).K)
+    {
+    }
+
+    virtual const char* name() const override {
+        return "pedis.blocked_bloom";
+    }
+
+    virtual key_hash hash(bytes_view key) const override {
+        key_hash h;
+        utils::murmur_hash::hash3_x64_128(key, 0, h);
+        return h;
+    }
+
+    virtual void create_filter(const std::vector<key_hash>& hashes, bytes& dst) const override {
+        size_t blocks = std::max<size_t>((hashes.size() * bits_per_key + block_bits - 1) / block_bits, 1);
+        bytes filter(bytes::initialized_later(), blocks * block_bytes + trailer_size);
+        auto bits = reinterpret_cast<uint8_t*>(filter.begin());
+        std::fill_n(bits, blocks * block_bytes, 0);
+        for (auto& h : hashes) {
+            for_each_bit(h, blocks, [bits] (size_t bit) {
+                bits[bit / 8] |= 1 << (bit % 8);
+            });
+        }
+        filter[blocks * block_bytes] = static_cast<char>(_num_probes);
+        encode_fixed32(filter.begin() + blocks * block_bytes + 1, blocks);
+        dst.append(filter.data(), filter.size());
+    }
+
+    virtual bool key_may_match(const key_hash& h, bytes_view filter) const override {
+        if (filter.size() < trailer_size) {
+            return true;
+        }
+        auto blocks = decode_fixed32(filter.data() + filter.size() - 4);
+        auto probes = static_cast<uint8_t>(filter[filter.size() - trailer_size]);
+        if (blocks == 0 || blocks * block_bytes + trailer_size != filter.size() || probes != _num_probes) {
+            // not written by this policy, or with other parameters.
+            return true;
+        }
+        auto bits = reinterpret_cast<const uint8_t*>(filter.data());
+        bool match = true;
+        for_each_bit(h, blocks, [bits, &match] (size_t bit) {
+            match &= (bits[bit / 8] >> (bit % 8)) & 1;
+        });
+        return match;
+    }
+private:
+    // The first half of the hash picks the block, the second one gives the
+    // bits in the block by double hashing.
+    template <typename Func>
+    void for_each_bit(const key_hash& h, size_t blocks, Func&& func) const {
+        size_t base = (h[0] % blocks) * block_bits;
+        uint64_t probe = h[1];
+        uint64_t delta = (probe >> 33) | (probe << 31);
+        for (int i = 0; i < _num_probes; ++i) {
+            func(base + probe % block_bits);
+            probe += delta;
+        }
+    }
+};
+
+}
+
+const filter_policy& blocked_bloom_filter_policy() {
+    static thread_local blocked_bloom_filter_policy_impl _policy;
+    return _policy;
+}
+
+}
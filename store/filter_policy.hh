@@ -0,0 +1,58 @@
+// Copyright (c) 2012 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+//
+// A database can be configured with a custom filter_policy object.
+// This object is responsible for creating a small filter from a set
+// of keys.  These filters are stored in sstables and are consulted
+// automatically to decide whether or not to read some
+// information from disk. In many cases, a filter can cut down the
+// number of disk seeks form a handful to a single disk seek per
+// DB::Get() call.
+//
+// Filters are built from hashes of the keys, so that a lookup hashes its
+// key once for every sstable it probes, and a builder keeps 16 bytes per
+// key instead of the key.
+
+/**
+ *
+ * Modified by Peng Jian, pstack@163.com.
+ *
+ **/
+#pragma once
+#include <array>
+#include <vector>
+#include <stdint.h>
+#include "utils/bytes.hh"
+
+namespace store {
+
+class filter_policy {
+public:
+    using key_hash = std::array<uint64_t, 2>;
+
+    virtual ~filter_policy() {}
+
+    // Return the name of this policy.  Note that if the filter encoding
+    // changes in an incompatible way, the name returned by this method
+    // must be changed.  Otherwise, old incompatible filters may be
+    // passed to methods of this type.
+    virtual const char* name() const = 0;
+
+    virtual key_hash hash(bytes_view key) const = 0;
+
+    // Appends to dst a filter that summarizes the keys of hashes.
+    virtual void create_filter(const std::vector<key_hash>& hashes, bytes& dst) const = 0;
+
+    // Returns false if the key of hash was not in the keys passed to
+    // create_filter() for filter, true if it probably was.
+    virtual bool key_may_match(const key_hash& hash, bytes_view filter) const = 0;
+};
+
+// A Bloom filter split in cache line sized blocks: every key sets and
+// tests bits of a single block, so a probe touches one cache line. It is
+// a little less precise than a plain Bloom filter of the same size.
+// bits_per_key 10 gives about 1% of false positives.
+const filter_policy& blocked_bloom_filter_policy();
+
+}
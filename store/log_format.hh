@@ -19,6 +19,7 @@
 *
 */
 #pragma once
+#include <cstdint>
 namespace store {
 enum record_type {
   zero   = 0,
@@ -29,6 +30,32 @@ enum record_type {
 };
 static constexpr const uint32_t MAX_RECORD_TYPE = record_type::last;
 static constexpr const int LOG_BLOCK_SIZE = 1024 * 32;
-// Header is checksum (4 bytes), length (2 bytes), type (1 byte).
-static constexpr const int HEADER_SIZE = 4 + 2 + 1;
+// Header is checksum (4 bytes), length (4 bytes), type (1 byte).
+static constexpr const int HEADER_SIZE = 4 + 4 + 1;
+// The header of the hints, and of the commit log segments of earlier
+// versions: its length takes 2 bytes, so records are at most 64KB.
+static constexpr const int SHORT_HEADER_SIZE = 4 + 2 + 1;
+
+inline void encode_frame_header(char* header, uint32_t masked_crc, uint32_t length, record_type type)
+{
+    for (int i = 0; i < 4; ++i) {
+        header[i] = static_cast<char>(masked_crc >> (8 * i));
+        header[4 + i] = static_cast<char>(length >> (8 * i));
+    }
+    header[8] = static_cast<char>(type);
+}
+
+inline uint32_t frame_record_length(const char* header)
+{
+    uint32_t length = 0;
+    for (int i = 0; i < 4; ++i) {
+        length |= uint32_t(static_cast<uint8_t>(header[4 + i])) << (8 * i);
+    }
+    return length;
+}
+
+inline record_type frame_record_type(const char* header)
+{
+    return static_cast<record_type>(static_cast<uint8_t>(header[8]));
+}
 }
@@ -39,6 +39,16 @@
 #include "priority_manager.hh"
 
 namespace store {
+static priority_shares shares;
+
+void set_priority_shares(const priority_shares& s) {
+    shares = s;
+}
+
+const priority_shares& get_priority_shares() {
+    return shares;
+}
+
 priority_manager& get_local_priority_manager() {
     static thread_local priority_manager pm = priority_manager();
     return pm;
@@ -43,12 +43,27 @@
 #include "seastarx.hh"
 
 namespace store {
+// The shares of the io_priority_classes of every shard. They are fixed
+// once a shard registers its classes, on its first I/O: set them before.
+struct priority_shares {
+    uint32_t _commitlog = 100;
+    uint32_t _memtable_flush = 100;
+    uint32_t _write = 20;
+    uint32_t _read = 20;
+    uint32_t _compaction = 100;
+    uint32_t _snapshot = 50;
+};
+
+void set_priority_shares(const priority_shares& shares);
+const priority_shares& get_priority_shares();
+
 class priority_manager {
     ::io_priority_class _commitlog_priority;
     ::io_priority_class _mt_flush_priority;
     ::io_priority_class _write_priority;
     ::io_priority_class _read_priority;
     ::io_priority_class _compaction_priority;
+    ::io_priority_class _snapshot_priority;
 
 public:
     const ::io_priority_class&
@@ -76,12 +91,18 @@ public:
         return _compaction_priority;
     }
 
-    priority_manager()
-        : _commitlog_priority(engine().register_one_priority_class("commitlog", 100))
-        , _mt_flush_priority(engine().register_one_priority_class("memtable_flush", 100))
-        , _write_priority(engine().register_one_priority_class("write", 20))
-        , _read_priority(engine().register_one_priority_class("read", 20))
-        , _compaction_priority(engine().register_one_priority_class("compaction", 100))
+    const ::io_priority_class&
+    snapshot_priority() {
+        return _snapshot_priority;
+    }
+
+    explicit priority_manager(const priority_shares& shares = get_priority_shares())
+        : _commitlog_priority(engine().register_one_priority_class("commitlog", shares._commitlog))
+        , _mt_flush_priority(engine().register_one_priority_class("memtable_flush", shares._memtable_flush))
+        , _write_priority(engine().register_one_priority_class("write", shares._write))
+        , _read_priority(engine().register_one_priority_class("read", shares._read))
+        , _compaction_priority(engine().register_one_priority_class("compaction", shares._compaction))
+        , _snapshot_priority(engine().register_one_priority_class("snapshot", shares._snapshot))
 
     {}
 };
@@ -111,4 +132,9 @@ const inline ::io_priority_class&
 get_local_compaction_priority() {
     return get_local_priority_manager().compaction_priority();
 }
+
+const inline ::io_priority_class&
+get_local_snapshot_priority() {
+    return get_local_priority_manager().snapshot_priority();
+}
 }
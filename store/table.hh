@@ -1,48 +1,140 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+/**
+ *
+ * Modified by Peng Jian, pstack@163.com.
+ *
+ **/
 #pragma once
 #include "core/future.hh"
+#include "core/file.hh"
 #include "core/shared_ptr.hh"
+#include "core/sstring.hh"
 #include "utils/bytes.hh"
-#include "utils/managed_bytes.hh"
-#include "store/file_reader.hh"
-#include "lru_cache.hh"
+#include "store/filter_policy.hh"
+#include "store/table/block.hh"
+#include "store/table/block_cache.hh"
+#include "store/table/filter_block.hh"
+#include "store/table/format.hh"
+#include "seastarx.hh"
 #include <memory>
+#include <vector>
 namespace store {
 
-class sstable_cache;
 struct sstable_options {
-    size_t _sstable_buffer_size = 4096;
+    // The policy the filter block was built with: other filter blocks are
+    // ignored, and so is the filter if it is null.
+    const filter_policy* _filter_policy = nullptr;
+};
+
+// A Table is a sorted map from strings to strings, written once by
+// table_builder. The index block, the filter and the key range are read
+// by open() and kept in memory, pinned in the block cache of the shard.
+// Data blocks go through that cache, and so do the partitions of a
+// partitioned index, whose index block only maps the last key of every
+// partition to it.
+// What a lookup cost: the data blocks and index partitions it needed, the
+// ones the block cache held, and the bytes it read for the others.
+struct sstable_read_stats {
+    uint32_t _blocks = 0;
+    uint32_t _cache_hits = 0;
+    uint64_t _bytes_read = 0;
 };
-// A Table is a sorted map from strings to strings.  Tables are
-// immutable and persistent.  A Table may be safely accessed from
-// multiple threads without external synchronization.
+
 class sstable {
-    struct rep;
 public:
-    explicit sstable(std::unique_ptr<rep> rep);
-    explicit sstable() = default;
-    sstable(sstable&&) = default;
-    sstable& operator = (sstable&&) = default;
-    ~sstable();
-    uint64_t approximate_offset_of(const bytes_view& key) const;
+    static constexpr uint64_t max_coalesced_read = 256 * 1024;
 private:
-    std::unique_ptr<rep> rep_;
+    uint64_t _id;
+    size_t _pinned_bytes = 0;
+    sstring _file_name;
+    file _file;
+    uint64_t _file_size;
+    sstable_options _options;
+    block _index_block;
+    bool _partitioned_index = false;
+    std::unique_ptr<filter_block_reader> _filter;
+    bytes _smallest_key;
+    bytes _largest_key;
+    table_expiry _expiry;
 
-    // No copying allowed
+    future<> read_meta(const footer& f);
+    // The value of key in the data block of handle.
+    future<bytes_opt> get_from(block_handle handle, bytes key, sstable_read_stats* stats);
+public:
+    sstable(sstring name, file f, uint64_t size, sstable_options options, block index_block);
     sstable(const sstable&) = delete;
     void operator=(const sstable&) = delete;
+    ~sstable();
+
+    // Throws malformed_sstable_exception when the file is not a complete
+    // sstable.
+    static future<lw_shared_ptr<sstable>> open(sstring name, sstable_options options);
+
+    const sstring& file_name() const { return _file_name; }
+    uint64_t file_size() const { return _file_size; }
+    const bytes& smallest_key() const { return _smallest_key; }
+    const bytes& largest_key() const { return _largest_key; }
+    const table_expiry& expiry() const { return _expiry; }
+    bool has_filter() const { return bool(_filter); }
+    size_t filter_size() const { return _filter ? _filter->size() : 0; }
+
+    // false if the key of hash is certainly not in the table.
+    bool may_contain(const filter_policy::key_hash& hash) const {
+        return !_filter || _filter->key_may_match(hash);
+    }
+
+    // The value of key, disengaged if the table does not hold it. What the
+    // lookup read is added to stats, which must outlive it, unless null.
+    future<bytes_opt> get(bytes_view key, sstable_read_stats* stats = nullptr);
+    // The values of keys, which are sorted, in their order. The index
+    // partitions and the data blocks the keys share are read once, and the
+    // ones next to each other in the file which the block cache lacks are
+    // read together, up to max_coalesced_read bytes at a time.
+    future<std::vector<bytes_opt>> multi_get(std::vector<bytes> keys, sstable_read_stats* stats = nullptr);
+
+    // Reads the block of handle and checks its crc.
+    future<temporary_buffer<char>> read_block(block_handle handle, const io_priority_class& pc);
+    // The data block, or index partition, of handle, from the block cache
+    // when it holds it.
+    future<lw_shared_ptr<const block>> read_data_block(block_handle handle, sstable_read_stats* stats = nullptr);
+
+    future<> close();
+
+    friend class sstable_scanner;
 };
 
-future<lw_shared_ptr<sstable>> open_sstable(bytes fname, const sstable_options& options);
+// Walks all the entries of an sstable in key order, reading its data
+// blocks one after the other with the priority class it is given. They do
+// not go through the block cache, a scan would only evict the blocks
+// lookups need.
+class sstable_scanner {
+    lw_shared_ptr<sstable> _sstable;
+    const io_priority_class& _pc;
+    // Over the index block, and over the partition it maps to when the
+    // index is partitioned.
+    block::iterator _index;
+    lw_shared_ptr<const block> _partition;
+    std::unique_ptr<block::iterator> _partition_it;
+    lw_shared_ptr<const block> _block;
+    std::unique_ptr<block::iterator> _it;
 
-class sstable_cache : public redis::base_cache<managed_bytes, lw_shared_ptr<sstable>> {
+    future<> read_next_block();
+    future<> read_next_partition();
 public:
-    sstable_cache()
-        : redis::base_cache<managed_bytes, lw_shared_ptr<sstable>> (redis::global_cache_tracker<managed_bytes, lw_shared_ptr<sstable>>())
-    {
-    }
-    sstable_cache(sstable_cache&&) = delete;
-    sstable_cache(const sstable_cache&) = delete;
-    sstable_cache& operator = (const sstable_cache&) = delete;
-    sstable_cache& operator = (sstable_cache&&) = delete;
+    sstable_scanner(lw_shared_ptr<sstable> sst, const io_priority_class& pc);
+    sstable_scanner(const sstable_scanner&) = delete;
+    void operator=(const sstable_scanner&) = delete;
+
+    future<> seek_to_first();
+    // To the first entry whose key is not below target.
+    future<> seek(bytes target);
+    bool valid() const { return _it && _it->valid(); }
+    const bytes& key() const { return _it->key(); }
+    bytes_view value() const { return _it->value(); }
+    future<> next();
 };
+
 }
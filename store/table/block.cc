@@ -1,42 +1,254 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file. See the AUTHORS file for names of contributors.
 //
 // Decodes the blocks generated by block_builder.cc.
-//
-// Modified by Pedis 
 
+/**
+ *
+ * Modified by Peng Jian, pstack@163.com.
+ *
+ **/
 #include "store/table/block.hh"
-#include "utils/managed_bytes.hh"
-#include <vector>
+#include "store/table/block_builder.hh"
+#include "store/table/format.hh"
+#include "store/util/coding.hh"
 #include <algorithm>
-//#include "store/table/format.hh"
-//#include "store/util/coding.hh"
+#include <assert.h>
 
 namespace store {
 
-inline uint32_t block::num_restarts() const {
-  // mock
-  return 0;
-  //assert(_size >= sizeof(uint32_t));
-  //return DecodeFixed32(data_ + size_ - sizeof(uint32_t));
-}
-
-block::block(managed_bytes cache_key, temporary_buffer<char> buffer)
-    : _cache_key(std::move(cache_key))
-    , _data(std::move(managed_bytes { bytes_view {buffer.get(), buffer.size()} }))
-    , _size(static_cast<uint32_t>(_data.size()))
-{
-  if (_size < sizeof(uint32_t)) {
-    _size = 0;  // Error marker
-  } else {
-    size_t max_restarts_allowed = (_size - sizeof(uint32_t)) / sizeof(uint32_t);
-    if (num_restarts() > max_restarts_allowed) {
-      // The size is too small for NumRestarts()
-      _size = 0;
-    } else {
-      _restart_offset = _size - (1 + num_restarts()) * sizeof(uint32_t);
-    }
-  }
+block::block(temporary_buffer<char> data)
+    : _data(std::move(data))
+{
+    if (_data.size() < sizeof(uint32_t)) {
+        throw malformed_sstable_exception("block too short");
+    }
+    _num_restarts = decode_fixed32(_data.get() + _data.size() - sizeof(uint32_t));
+    size_t restarts_end = _data.size() - sizeof(uint32_t);
+    if (_num_restarts & block_hash_index::flag) {
+        _num_restarts &= ~block_hash_index::flag;
+        if (restarts_end < sizeof(uint32_t)) {
+            throw malformed_sstable_exception("bad hash index");
+        }
+        _num_buckets = decode_fixed32(_data.get() + restarts_end - sizeof(uint32_t));
+        if (_num_buckets == 0 || _num_buckets > restarts_end - sizeof(uint32_t)) {
+            throw malformed_sstable_exception("bad hash index");
+        }
+        restarts_end -= sizeof(uint32_t) + _num_buckets;
+    }
+    size_t max_restarts_allowed = restarts_end / sizeof(uint32_t);
+    if (_num_restarts == 0 || _num_restarts > max_restarts_allowed) {
+        throw malformed_sstable_exception("bad restart array");
+    }
+    _restart_offset = restarts_end - _num_restarts * sizeof(uint32_t);
+}
+
+// Helper routine: decode the next block entry starting at "p",
+// storing the number of shared key bytes, non_shared key bytes,
+// and the length of the value in "*shared", "*non_shared", and
+// "*value_length", respectively.  Will not dereference past "limit".
+//
+// If any errors are detected, returns nullptr.  Otherwise, returns a
+// pointer to the key delta (just past the three decoded values).
+static inline const char* decode_entry(const char* p, const char* limit,
+        uint32_t& shared, uint32_t& non_shared, uint32_t& value_length)
+{
+    if ((p = get_varint32_ptr(p, limit, shared)) == nullptr) return nullptr;
+    if ((p = get_varint32_ptr(p, limit, non_shared)) == nullptr) return nullptr;
+    if ((p = get_varint32_ptr(p, limit, value_length)) == nullptr) return nullptr;
+    if (static_cast<uint32_t>(limit - p) < (non_shared + value_length)) {
+        return nullptr;
+    }
+    return p;
+}
+
+// Compares a and b, which share at least their first `from` bytes, and sets
+// `common` to the length of their common prefix.
+static inline int compare_from(bytes_view a, bytes_view b, size_t from, size_t& common)
+{
+    auto n = std::min(a.size(), b.size());
+    auto i = from;
+    while (i < n && a[i] == b[i]) {
+        ++i;
+    }
+    common = i;
+    if (i < n) {
+        return static_cast<uint8_t>(a[i]) < static_cast<uint8_t>(b[i]) ? -1 : 1;
+    }
+    return a.size() < b.size() ? -1 : a.size() > b.size() ? 1 : 0;
+}
+
+block::iterator::iterator(const block& b, const comparator& c)
+    : _block(b)
+    , _comparator(c)
+    , _bytewise(&c == &default_bytewise_comparator())
+    , _current(b._restart_offset)
+    , _restart_index(b._num_restarts)
+{
+}
+
+uint32_t block::iterator::next_entry_offset() const
+{
+    return static_cast<uint32_t>((_value.data() + _value.size()) - _block._data.get());
+}
+
+uint32_t block::iterator::restart_point(uint32_t index) const
+{
+    assert(index < _block._num_restarts);
+    return decode_fixed32(_block._data.get() + _block._restart_offset + index * sizeof(uint32_t));
+}
+
+void block::iterator::seek_to_restart_point(uint32_t index)
+{
+    _key.resize(0);
+    _restart_index = index;
+    // _current will be fixed by parse_next_key(), which starts at the end of
+    // _value.
+    _value = bytes_view { _block._data.get() + restart_point(index), 0 };
+}
+
+void block::iterator::corrupted()
+{
+    throw malformed_sstable_exception("bad entry in block");
+}
+
+void block::iterator::invalidate()
+{
+    _current = _block._restart_offset;
+    _restart_index = _block._num_restarts;
+}
+
+void block::iterator::seek_to_first()
+{
+    seek_to_restart_point(0);
+    parse_next_key();
+}
+
+void block::iterator::seek(bytes_view target)
+{
+    // Binary search in restart array to find the last restart point
+    // with a key < target. In the bytewise order, the keys between a key
+    // less than target and one at least target share with it the shorter
+    // of the prefixes these two share with it, and only the rest of them
+    // is compared.
+    uint32_t left = 0;
+    uint32_t right = _block._num_restarts - 1;
+    size_t low_common = 0;
+    size_t high_common = 0;
+    auto data = _block._data.get();
+    while (left < right) {
+        uint32_t mid = (left + right + 1) / 2;
+        uint32_t region_offset = restart_point(mid);
+        uint32_t shared, non_shared, value_length;
+        auto key_ptr = decode_entry(data + region_offset, data + _block._restart_offset, shared, non_shared, value_length);
+        if (key_ptr == nullptr || (shared != 0)) {
+            corrupted();
+        }
+        bytes_view mid_key { key_ptr, non_shared };
+        size_t common = 0;
+        auto c = _bytewise ? compare_from(mid_key, target, std::min(low_common, high_common), common) : _comparator.compare(mid_key, target);
+        if (c < 0) {
+            // Key at "mid" is smaller than "target".  Therefore all
+            // blocks before "mid" are uninteresting.
+            left = mid;
+            low_common = common;
+        } else {
+            // Key at "mid" is >= "target".  Therefore all blocks at or
+            // after "mid" are uninteresting.
+            right = mid - 1;
+            high_common = common;
+        }
+    }
+
+    // Linear search (within restart block) for first key >= target
+    seek_to_restart_point(left);
+    if (!_bytewise) {
+        while (parse_next_key()) {
+            if (_comparator.compare(bytes_view { _key.data(), _key.size() }, target) >= 0) {
+                return;
+            }
+        }
+        return;
+    }
+    // The key before the entry is less than target, and shares `common`
+    // bytes with it: the entry is greater if it shares less with that key,
+    // and less if it shares more, since that key differs from target right
+    // after. Only an entry sharing as much is compared, from there.
+    size_t common = 0;
+    bool first = true;
+    while (parse_next_key()) {
+        if (!first && _shared < common) {
+            return;
+        }
+        if (first || _shared == common) {
+            if (compare_from(bytes_view { _key.data(), _key.size() }, target, first ? 0 : common, common) >= 0) {
+                return;
+            }
+        }
+        first = false;
+    }
+}
+
+void block::iterator::seek_for_get(bytes_view target)
+{
+    if (_block._num_buckets == 0) {
+        seek(target);
+        return;
+    }
+    auto buckets = reinterpret_cast<const uint8_t*>(_block._data.get() + _block._restart_offset + _block._num_restarts * sizeof(uint32_t));
+    auto restart = buckets[block_hash_index::hash(target) % _block._num_buckets];
+    if (restart == block_hash_index::collision) {
+        seek(target);
+        return;
+    }
+    if (restart == block_hash_index::empty || restart >= _block._num_restarts) {
+        invalidate();
+        return;
+    }
+    // the key, if the block holds it, is in the restart interval.
+    seek_to_restart_point(restart);
+    while (parse_next_key() && _restart_index == restart) {
+        if (_comparator.compare(bytes_view { _key.data(), _key.size() }, target) >= 0) {
+            return;
+        }
+    }
+    invalidate();
+}
+
+void block::iterator::next()
+{
+    assert(valid());
+    parse_next_key();
+}
+
+bool block::iterator::parse_next_key()
+{
+    auto data = _block._data.get();
+    _current = next_entry_offset();
+    auto p = data + _current;
+    auto limit = data + _block._restart_offset;
+    if (p >= limit) {
+        // No more entries to return.  Mark as invalid.
+        _current = _block._restart_offset;
+        _restart_index = _block._num_restarts;
+        return false;
+    }
+
+    // Decode next entry
+    uint32_t shared, non_shared, value_length;
+    p = decode_entry(p, limit, shared, non_shared, value_length);
+    if (p == nullptr || _key.size() < shared) {
+        corrupted();
+    }
+    _key.resize(shared);
+    _key.append(p, non_shared);
+    _shared = shared;
+    _value = bytes_view { p + non_shared, value_length };
+    while (_restart_index + 1 < _block._num_restarts && restart_point(_restart_index + 1) < _current) {
+        ++_restart_index;
+    }
+    return true;
 }
 
 }
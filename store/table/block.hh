@@ -1,62 +1,76 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+//
+// Decodes the blocks generated by block_builder.
+
+/**
+ *
+ * Modified by Peng Jian, pstack@163.com.
+ *
+ **/
 #pragma once
 #include <stddef.h>
 #include <stdint.h>
-#include "utils/managed_bytes.hh"
+#include "utils/bytes.hh"
 #include "core/temporary_buffer.hh"
-#include "lru_cache.hh"
+#include "store/comparator.hh"
 #include "seastarx.hh"
 
 namespace store {
 
-class block_cache;
-
 class block {
-    managed_bytes _cache_key;     // used to lookup
-    managed_bytes _data; 
-    uint32_t _size;
-    uint32_t _restart_offset;     // Offset in data_ of restart array
-    uint32_t num_restarts() const;
+    temporary_buffer<char> _data;
+    uint32_t _restart_offset = 0;     // Offset in _data of restart array
+    uint32_t _num_restarts = 0;
+    // The hash index, see block_hash_index: its buckets follow the restart
+    // array.
+    uint32_t _num_buckets = 0;
 public:
-    block(managed_bytes cache_key, temporary_buffer<char> data);
-    block(bytes cache_key, temporary_buffer<char> data) 
-        : block(managed_bytes { bytes_view {cache_key.data(), cache_key.size() } }, std::move(data))
-    {
-    }
-
-    block(block&& o)
-        : _cache_key(std::move(o._cache_key))
-        , _data(std::move(o._data))
-        , _size(o._size)
-        , _restart_offset(std::move(o._restart_offset))
-    {
-    }
-    block& operator = (block&& o)
-    {
-        if (this != &o) {
-            _cache_key = std::move(o._cache_key);
-            _data = std::move(o._data);
-            _size = o._size;
-            _restart_offset = std::move(o._restart_offset);
-        }
-        return *this;
-    }
-
-    ~block() {}
-
-    size_t size() const { return _size; }
-    friend class block_cache;
-};
+    // data is the block without its trailer. Throws
+    // malformed_sstable_exception if its restart array is broken.
+    explicit block(temporary_buffer<char> data);
 
-class block_cache : public redis::base_cache<managed_bytes, lw_shared_ptr<block>> { 
-public:
-    block_cache()
-        : redis::base_cache<managed_bytes, lw_shared_ptr<block>> (redis::global_cache_tracker<managed_bytes, lw_shared_ptr<block>>())
-    {
-    }
-    block_cache(block_cache&&) = delete;
-    block_cache(const block_cache&) = delete;
-    block_cache& operator = (const block_cache&) = delete;
-    block_cache& operator = (block_cache&&) = delete;
+    block(block&&) = default;
+    block& operator = (block&&) = default;
+
+    size_t size() const { return _data.size(); }
+
+    // Walks the entries of a block, in key order. The block must outlive it.
+    class iterator {
+        const block& _block;
+        const comparator& _comparator;
+        // Keys in the bytewise order are compared from the prefix they are
+        // known to share, see seek().
+        bool _bytewise;
+        uint32_t _current;        // Offset of the current entry, _restart_offset when invalid
+        uint32_t _restart_index;  // The restart block holding _current
+        bytes _key;
+        uint32_t _shared = 0;     // Bytes _key shares with the key before it
+        bytes_view _value;
+    public:
+        iterator(const block& b, const comparator& c = default_bytewise_comparator());
+
+        bool valid() const { return _current < _block._restart_offset; }
+        const bytes& key() const { return _key; }
+        bytes_view value() const { return _value; }
+
+        void seek_to_first();
+        // Moves to the first entry whose key is at least target.
+        void seek(bytes_view target);
+        // Moves to the entry of target if the block holds it, through the
+        // hash index when the block has one. Otherwise it is left on
+        // another entry or invalid.
+        void seek_for_get(bytes_view target);
+        void next();
+    private:
+        uint32_t next_entry_offset() const;
+        uint32_t restart_point(uint32_t index) const;
+        void seek_to_restart_point(uint32_t index);
+        void corrupted();
+        void invalidate();
+        bool parse_next_key();
+    };
 };
 
 }
@@ -25,6 +25,7 @@
 //     restarts: uint32[num_restarts]
 //     num_restarts: uint32
 // restarts[i] contains the offset within the block of the ith restart point.
+// A hash index of the keys may follow, see block_hash_index.
 
 /**
  *
@@ -37,9 +38,20 @@
 #include <assert.h>
 #include "store/comparator.hh"
 #include "store/util/coding.hh"
+#include "utils/murmur_hash.hh"
 
 namespace store {
 
+constexpr uint8_t block_hash_index::empty;
+constexpr uint8_t block_hash_index::collision;
+constexpr uint32_t block_hash_index::max_restarts;
+constexpr uint32_t block_hash_index::flag;
+
+uint32_t block_hash_index::hash(bytes_view key)
+{
+    return utils::murmur_hash::hash32(key, 0x4b1d);
+}
+
 block_builder::block_builder(const block_options& options)
     :_options(options)
     ,_restarts{}
@@ -58,12 +70,15 @@ void block_builder::reset()
     _counter = 0;
     _finished = false;
     _last_key = {};
+    _hashes.clear();
 }
 
 size_t block_builder::current_size_estimate() const
 {
+    auto hash_index = _options._hash_index ? static_cast<size_t>(_hashes.size() / _options._hash_index_load) + sizeof(uint32_t) : 0;
     return (_buffer.size() +                        // Raw data buffer
             _restarts.size() * sizeof(uint32_t) +   // Restart array
+            hash_index +                            // Hash index
             sizeof(uint32_t));                      // Restart array length
 }
 
@@ -73,12 +88,29 @@ const bytes& block_builder::finish()
     for (size_t i = 0; i < _restarts.size(); i++) {
       put_fixed32(_buffer, _restarts[i]);
     }
-    put_fixed32(_buffer, _restarts.size());
+    uint32_t num_restarts = _restarts.size();
+    if (_options._hash_index && !_hashes.empty() && _restarts.size() <= block_hash_index::max_restarts) {
+        auto num_buckets = std::max<uint32_t>(_hashes.size() / _options._hash_index_load, 1);
+        bytes buckets(bytes::initialized_later(), num_buckets);
+        std::fill(buckets.begin(), buckets.end(), static_cast<char>(block_hash_index::empty));
+        for (auto& h : _hashes) {
+            auto& bucket = reinterpret_cast<uint8_t&>(buckets[h.first % num_buckets]);
+            if (bucket == block_hash_index::empty) {
+                bucket = h.second;
+            } else if (bucket != h.second) {
+                bucket = block_hash_index::collision;
+            }
+        }
+        _buffer.append(buckets.data(), buckets.size());
+        put_fixed32(_buffer, num_buckets);
+        num_restarts |= block_hash_index::flag;
+    }
+    put_fixed32(_buffer, num_restarts);
     _finished = true;
     return _buffer;
 }
 
-void block_builder::add(const bytes& key, const bytes& value) {
+void block_builder::add(bytes_view key, bytes_view value) {
     assert(!_finished);
     assert(_counter <= _options._block_restart_interval);
     assert(_buffer.empty() // No values yet?
@@ -109,8 +141,11 @@ void block_builder::add(const bytes& key, const bytes& value) {
     // Update state
     _last_key.resize(shared);
     _last_key.append(key.data() + shared, non_shared);
-    assert(_last_key == key);
+    assert(bytes_view(_last_key.data(), _last_key.size()) == key);
     _counter++;
+    if (_options._hash_index && _restarts.size() <= block_hash_index::max_restarts) {
+        _hashes.emplace_back(block_hash_index::hash(key), static_cast<uint8_t>(_restarts.size() - 1));
+    }
 }
 
 }
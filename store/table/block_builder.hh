@@ -10,6 +10,25 @@ struct block_options {
     explicit block_options(const comparator& c = default_bytewise_comparator()) : _block_restart_interval (1024), _comparator(c) {}
     uint32_t _block_restart_interval = 64;
     const comparator& _comparator;
+    // Appends a hash index of the keys to their restart point, see
+    // block_hash_index, for blocks of at most max_restarts restart points.
+    bool _hash_index = false;
+    // Keys per bucket of the hash index.
+    double _hash_index_load = 0.75;
+};
+
+// The hash index of a block maps the hash of every key to the restart point
+// before it, so that a point lookup scans a single restart interval instead
+// of searching the restart array. It follows the restart array:
+//     buckets: uint8[num_buckets], the restart index, or empty or collision
+//     num_buckets: uint32
+// and the top bit of num_restarts flags it.
+struct block_hash_index {
+    static constexpr uint8_t empty = 255;
+    static constexpr uint8_t collision = 254;
+    static constexpr uint32_t max_restarts = 254;
+    static constexpr uint32_t flag = 1u << 31;
+    static uint32_t hash(bytes_view key);
 };
 
 class block_builder {
@@ -21,7 +40,7 @@ class block_builder {
 
   // REQUIRES: Finish() has not been called since the last call to Reset().
   // REQUIRES: key is larger than any previously added key
-  void add(const bytes& key, const bytes& value);
+  void add(bytes_view key, bytes_view value);
 
   // Finish building the block and return a slice that refers to the
   // block contents.  The returned slice will remain valid for the
@@ -47,6 +66,8 @@ class block_builder {
   uint32_t              _counter;     // Number of entries emitted since restart
   bool                  _finished;    // Has Finish() been called?
   bytes                 _last_key;
+  // The hash of every key and its restart index, for the hash index.
+  std::vector<std::pair<uint32_t, uint8_t>> _hashes;
 };
 
 }
@@ -0,0 +1,115 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#include "store/table/block_cache.hh"
+#include <assert.h>
+namespace store {
+
+static thread_local block_cache _block_cache;
+
+block_cache& local_block_cache()
+{
+    return _block_cache;
+}
+
+block_cache::~block_cache()
+{
+    _lru.clear();
+}
+
+void block_cache::evict_to(size_t capacity)
+{
+    while (!_lru.empty() && _used_bytes + _pinned_bytes > capacity) {
+        auto& e = _lru.back();
+        _lru.pop_back();
+        _used_bytes -= e._block->size();
+        ++_stats._evictions;
+        // the readers of the block still hold it.
+        auto k = e._key;
+        _entries.erase(k);
+    }
+}
+
+void block_cache::set_capacity(size_t capacity)
+{
+    _capacity = capacity;
+    evict_to(_capacity);
+}
+
+lw_shared_ptr<const block> block_cache::find(const key& k)
+{
+    auto i = _entries.find(k);
+    if (i == _entries.end()) {
+        ++_stats._misses;
+        return nullptr;
+    }
+    ++_stats._hits;
+    auto& e = i->second;
+    _lru.erase(_lru.iterator_to(e));
+    _lru.push_front(e);
+    return e._block;
+}
+
+void block_cache::insert(const key& k, lw_shared_ptr<const block> b)
+{
+    auto size = b->size();
+    if (size + _pinned_bytes > _capacity) {
+        return;
+    }
+    evict_to(_capacity - size);
+    auto r = _entries.emplace(k, entry { {}, k, nullptr });
+    auto& e = r.first->second;
+    if (!r.second) {
+        // read twice by concurrent misses.
+        _used_bytes -= e._block->size();
+        _lru.erase(_lru.iterator_to(e));
+    }
+    e._block = std::move(b);
+    _used_bytes += size;
+    _lru.push_front(e);
+    ++_stats._insertions;
+}
+
+void block_cache::erase_sstable(uint64_t sstable_id)
+{
+    for (auto i = _entries.begin(); i != _entries.end();) {
+        if (i->first._sstable_id == sstable_id) {
+            _used_bytes -= i->second._block->size();
+            _lru.erase(_lru.iterator_to(i->second));
+            i = _entries.erase(i);
+        } else {
+            ++i;
+        }
+    }
+}
+
+void block_cache::pin(size_t bytes)
+{
+    _pinned_bytes += bytes;
+    evict_to(_capacity);
+}
+
+void block_cache::unpin(size_t bytes)
+{
+    assert(_pinned_bytes >= bytes);
+    _pinned_bytes -= bytes;
+}
+
+}
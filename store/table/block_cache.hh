@@ -0,0 +1,108 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#pragma once
+#include <stdint.h>
+#include <unordered_map>
+#include <boost/intrusive/list.hpp>
+#include "core/shared_ptr.hh"
+#include "store/table/block.hh"
+#include "seastarx.hh"
+
+namespace store {
+
+struct block_cache_stats {
+    uint64_t _hits = 0;
+    uint64_t _misses = 0;
+    uint64_t _insertions = 0;
+    uint64_t _evictions = 0;
+};
+
+// The data blocks of the sstables of a shard, bounded in bytes and
+// evicted in LRU order. Every shard has its own, so it needs no locking.
+//
+// The index and filter blocks are held by their sstable for as long as it
+// is open: they are pinned, their bytes count against the capacity and
+// leave less of it to data blocks, but they are never evicted.
+class block_cache {
+public:
+    struct key {
+        uint64_t _sstable_id;
+        uint64_t _offset;
+        bool operator==(const key& o) const {
+            return _sstable_id == o._sstable_id && _offset == o._offset;
+        }
+    };
+private:
+    struct key_hash {
+        size_t operator()(const key& k) const {
+            return std::hash<uint64_t>()(k._sstable_id * 0x9e3779b97f4a7c15ull ^ k._offset);
+        }
+    };
+    struct entry {
+        boost::intrusive::list_member_hook<> _lru_link;
+        key _key;
+        lw_shared_ptr<const block> _block;
+    };
+    using lru_type = boost::intrusive::list<entry,
+        boost::intrusive::member_hook<entry, boost::intrusive::list_member_hook<>, &entry::_lru_link>,
+        boost::intrusive::constant_time_size<true>>;
+    // unordered_map nodes do not move, the LRU links them in place.
+    std::unordered_map<key, entry, key_hash> _entries;
+    // The most recently used first.
+    lru_type _lru;
+    size_t _capacity;
+    size_t _used_bytes = 0;
+    size_t _pinned_bytes = 0;
+    uint64_t _next_sstable_id = 1;
+    block_cache_stats _stats;
+
+    void evict_to(size_t capacity);
+public:
+    explicit block_cache(size_t capacity = 64 * 1024 * 1024) : _capacity(capacity) {}
+    block_cache(const block_cache&) = delete;
+    void operator=(const block_cache&) = delete;
+    ~block_cache();
+
+    void set_capacity(size_t capacity);
+    size_t capacity() const { return _capacity; }
+
+    // Ids the blocks of one sstable.
+    uint64_t new_sstable_id() { return _next_sstable_id++; }
+
+    // The cached block, null on a miss.
+    lw_shared_ptr<const block> find(const key& k);
+    // Caches b, making room by evicting the least recently used blocks.
+    void insert(const key& k, lw_shared_ptr<const block> b);
+    // Drops the blocks of a closed sstable.
+    void erase_sstable(uint64_t sstable_id);
+
+    void pin(size_t bytes);
+    void unpin(size_t bytes);
+
+    size_t used_bytes() const { return _used_bytes; }
+    size_t pinned_bytes() const { return _pinned_bytes; }
+    size_t blocks() const { return _lru.size(); }
+    const block_cache_stats& stats() const { return _stats; }
+};
+
+block_cache& local_block_cache();
+
+}
@@ -0,0 +1,100 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#include "store/table/compression.hh"
+#include "store/util/coding.hh"
+#include <lz4.h>
+#include <zlib.h>
+#include <algorithm>
+namespace store {
+
+// deflate trades speed for ratio, for the levels read the least.
+static constexpr int deflate_level = 6;
+
+bool compress_block(compression_type type, bytes_view raw, bytes& out)
+{
+    char header[5];
+    auto header_size = encode_varint32(header, raw.size()) - header;
+    size_t bound = 0;
+    switch (type) {
+    case compression_type::lz4:
+        bound = LZ4_compressBound(raw.size());
+        break;
+    case compression_type::deflate:
+        bound = compressBound(raw.size());
+        break;
+    default:
+        return false;
+    }
+    out = bytes(bytes::initialized_later(), header_size + bound);
+    std::copy_n(header, header_size, out.begin());
+    auto dst = out.begin() + header_size;
+    size_t compressed = 0;
+    if (type == compression_type::lz4) {
+        auto n = LZ4_compress_default(raw.data(), dst, raw.size(), bound);
+        if (n <= 0) {
+            return false;
+        }
+        compressed = n;
+    } else {
+        uLongf n = bound;
+        if (compress2(reinterpret_cast<Bytef*>(dst), &n, reinterpret_cast<const Bytef*>(raw.data()), raw.size(), deflate_level) != Z_OK) {
+            return false;
+        }
+        compressed = n;
+    }
+    if (header_size + compressed >= raw.size() - raw.size() / 8) {
+        return false;
+    }
+    out.resize(header_size + compressed);
+    return true;
+}
+
+temporary_buffer<char> uncompress_block(compression_type type, const temporary_buffer<char>& data)
+{
+    uint32_t size = 0;
+    auto begin = get_varint32_ptr(data.get(), data.get() + data.size(), size);
+    if (begin == nullptr) {
+        throw malformed_sstable_exception("bad compressed block header");
+    }
+    size_t compressed = data.get() + data.size() - begin;
+    temporary_buffer<char> result(size);
+    switch (type) {
+    case compression_type::lz4: {
+        auto n = LZ4_decompress_safe(begin, result.get_write(), compressed, size);
+        if (n < 0 || static_cast<uint32_t>(n) != size) {
+            throw malformed_sstable_exception("bad lz4 block");
+        }
+        break;
+    }
+    case compression_type::deflate: {
+        uLongf n = size;
+        if (uncompress(reinterpret_cast<Bytef*>(result.get_write()), &n, reinterpret_cast<const Bytef*>(begin), compressed) != Z_OK || n != size) {
+            throw malformed_sstable_exception("bad deflate block");
+        }
+        break;
+    }
+    default:
+        throw malformed_sstable_exception("unknown block compression");
+    }
+    return result;
+}
+
+}
@@ -0,0 +1,37 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#pragma once
+#include "utils/bytes.hh"
+#include "core/temporary_buffer.hh"
+#include "store/table/format.hh"
+#include "seastarx.hh"
+namespace store {
+
+// Compresses raw with type into out. Returns false, leaving out
+// unspecified, when the block does not shrink by at least an eighth: it is
+// then better stored as it is.
+bool compress_block(compression_type type, bytes_view raw, bytes& out);
+
+// The contents of a block stored with type, which is not none. Throws
+// malformed_sstable_exception if they do not decompress.
+temporary_buffer<char> uncompress_block(compression_type type, const temporary_buffer<char>& data);
+
+}
@@ -0,0 +1,40 @@
+// Copyright (c) 2012 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+/**
+ *
+ * Modified by Peng Jian, pstack@163.com.
+ *
+ **/
+#include "store/table/filter_block.hh"
+#include <algorithm>
+
+namespace store {
+
+void filter_block_builder::add_key(bytes_view key)
+{
+    _hashes.emplace_back(_policy.hash(key));
+}
+
+bytes filter_block_builder::finish()
+{
+    bytes result;
+    _policy.create_filter(_hashes, result);
+    _hashes.clear();
+    return result;
+}
+
+filter_block_reader::filter_block_reader(const filter_policy& policy, const temporary_buffer<char>& contents)
+    : _policy(policy)
+    , _data(temporary_buffer<char>::aligned(64, contents.size()))
+{
+    std::copy_n(contents.get(), contents.size(), _data.get_write());
+}
+
+bool filter_block_reader::key_may_match(const filter_policy::key_hash& hash) const
+{
+    return _policy.key_may_match(hash, bytes_view { _data.get(), _data.size() });
+}
+
+}
@@ -0,0 +1,50 @@
+// Copyright (c) 2012 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+//
+// A filter block is stored near the end of a Table file.  It contains
+// one filter for all the keys of the table, built by the filter_policy of
+// the table_options. LevelDB keeps a filter per 2KB of data instead; the
+// memtable is flushed whole, so one filter answers a lookup with a single
+// probe and no offset array.
+
+/**
+ *
+ * Modified by Peng Jian, pstack@163.com.
+ *
+ **/
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include "utils/bytes.hh"
+#include "core/temporary_buffer.hh"
+#include "store/filter_policy.hh"
+#include "seastarx.hh"
+
+namespace store {
+
+class filter_block_builder {
+    const filter_policy& _policy;
+    std::vector<filter_policy::key_hash> _hashes;
+public:
+    explicit filter_block_builder(const filter_policy& policy) : _policy(policy) {}
+    filter_block_builder(const filter_block_builder&) = delete;
+    void operator=(const filter_block_builder&) = delete;
+
+    void add_key(bytes_view key);
+    bytes finish();
+};
+
+class filter_block_reader {
+    const filter_policy& _policy;
+    // Aligned so that the blocks of a blocked filter sit on cache lines.
+    temporary_buffer<char> _data;
+public:
+    // contents is the block without its trailer.
+    filter_block_reader(const filter_policy& policy, const temporary_buffer<char>& contents);
+    bool key_may_match(const filter_policy::key_hash& hash) const;
+    size_t size() const { return _data.size(); }
+};
+
+}
@@ -0,0 +1,112 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#include "store/table/format.hh"
+#include "store/util/coding.hh"
+#include <algorithm>
+namespace store {
+
+compression_type to_compression_type(const std::string& name)
+{
+    if (name == "none") {
+        return compression_type::none;
+    }
+    if (name == "lz4") {
+        return compression_type::lz4;
+    }
+    if (name == "deflate") {
+        return compression_type::deflate;
+    }
+    throw std::invalid_argument("unknown sstable compression: " + name);
+}
+
+void block_handle::encode_to(bytes& dst) const
+{
+    put_varint64(dst, _offset);
+    put_varint64(dst, _size);
+}
+
+bool block_handle::decode_from(bytes_view& input)
+{
+    return get_varint64(input, _offset) && get_varint64(input, _size);
+}
+
+void footer::encode_to(bytes& dst) const
+{
+    bytes handles;
+    _metaindex_handle.encode_to(handles);
+    _index_handle.encode_to(handles);
+    handles.resize(2 * block_handle::max_encoded_length);
+    dst.append(handles.data(), handles.size());
+    put_fixed64(dst, table_magic_number);
+}
+
+bool footer::decode_from(bytes_view input)
+{
+    if (input.size() < encoded_length) {
+        return false;
+    }
+    auto magic = decode_fixed64(input.data() + encoded_length - 8);
+    if (magic != table_magic_number) {
+        return false;
+    }
+    return _metaindex_handle.decode_from(input) && _index_handle.decode_from(input);
+}
+
+void table_expiry::add(uint64_t expire, size_t bytes)
+{
+    _earliest = empty() ? expire : std::min(_earliest, expire);
+    _latest = std::max(_latest, expire);
+    _expiring_bytes += bytes;
+}
+
+double table_expiry::expired_ratio(uint64_t now) const
+{
+    if (empty() || _data_bytes == 0 || now < _earliest) {
+        return 0;
+    }
+    auto expiring = double(_expiring_bytes) / _data_bytes;
+    if (now >= _latest) {
+        return expiring;
+    }
+    return expiring * (now - _earliest) / (_latest - _earliest);
+}
+
+void table_expiry::encode_to(bytes& dst) const
+{
+    put_fixed64(dst, _earliest);
+    put_fixed64(dst, _latest);
+    put_fixed64(dst, _expiring_bytes);
+    put_fixed64(dst, _data_bytes);
+}
+
+bool table_expiry::decode_from(bytes_view input)
+{
+    if (input.size() < encoded_length) {
+        return false;
+    }
+    _earliest = decode_fixed64(input.data());
+    _latest = decode_fixed64(input.data() + 8);
+    _expiring_bytes = decode_fixed64(input.data() + 16);
+    _data_bytes = decode_fixed64(input.data() + 24);
+    return true;
+}
+
+}
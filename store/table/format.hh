@@ -0,0 +1,132 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#pragma once
+#include <stdint.h>
+#include <stdexcept>
+#include <string>
+#include "utils/bytes.hh"
+namespace store {
+
+// The layout of an sstable, as in LevelDB:
+//
+//     data block 1 .. data block N
+//     meta block 1 .. meta block K
+//     metaindex block: the name of every meta block -> its block_handle
+//     index block: the last key of every data block -> its block_handle
+//
+// A partitioned index cuts the index block into partitions, written among
+// the data blocks, and the index block of the footer maps the last key of
+// every partition to it; the metaindex block then lists
+// "pedis.partitioned_index".
+//     footer
+//
+// Every block is followed by a trailer: the compression_type of the block,
+// then the masked crc32c of the block and of the type. A compressed block
+// starts with the varint32 size of its uncompressed contents.
+enum class compression_type : uint8_t {
+    none = 0,
+    lz4 = 1,
+    deflate = 2,
+};
+
+// Parses "none", "lz4" or "deflate", throws std::invalid_argument on
+// other names.
+compression_type to_compression_type(const std::string& name);
+
+static constexpr size_t block_trailer_size = 5;
+
+// The position of a block in a file.
+class block_handle {
+    uint64_t _offset = 0;
+    uint64_t _size = 0;
+public:
+    // Two varint64.
+    static constexpr size_t max_encoded_length = 10 + 10;
+
+    block_handle() = default;
+    block_handle(uint64_t offset, uint64_t size) : _offset(offset), _size(size) {}
+
+    uint64_t offset() const { return _offset; }
+    // The size of the block, without its trailer.
+    uint64_t size() const { return _size; }
+
+    void encode_to(bytes& dst) const;
+    bool decode_from(bytes_view& input);
+};
+
+// Closes every sstable, so that it can be opened from its end.
+class footer {
+    block_handle _metaindex_handle;
+    block_handle _index_handle;
+public:
+    // The two handles padded to their longest encodings, then the magic.
+    static constexpr size_t encoded_length = 2 * block_handle::max_encoded_length + 8;
+    static constexpr uint64_t table_magic_number = 0xdb4775248b80fb57ull;
+
+    footer() = default;
+    footer(block_handle metaindex, block_handle index)
+        : _metaindex_handle(metaindex)
+        , _index_handle(index)
+    {
+    }
+
+    const block_handle& metaindex_handle() const { return _metaindex_handle; }
+    const block_handle& index_handle() const { return _index_handle; }
+
+    void encode_to(bytes& dst) const;
+    // input holds the last encoded_length bytes of the file.
+    bool decode_from(bytes_view input);
+};
+
+// The records of a table which expire, in the value of its expiry entry of
+// the metaindex: when the first and the last of them expire, as unix times
+// in milliseconds, and their bytes next to those of all the entries. A
+// table without expiring records has no such entry.
+struct table_expiry {
+    uint64_t _earliest = 0;
+    uint64_t _latest = 0;
+    uint64_t _expiring_bytes = 0;
+    uint64_t _data_bytes = 0;
+
+    // Four fixed64.
+    static constexpr size_t encoded_length = 4 * 8;
+
+    bool empty() const { return _expiring_bytes == 0; }
+    void add(uint64_t expire, size_t bytes);
+    // The share of the bytes of the entries expired at now, taking the
+    // expiring records as spread evenly between the first and the last.
+    double expired_ratio(uint64_t now) const;
+
+    void encode_to(bytes& dst) const;
+    bool decode_from(bytes_view input);
+};
+
+// Thrown when an sstable fails its checks: a bad footer, a crc mismatch or
+// a block that does not parse.
+class malformed_sstable_exception : public std::runtime_error {
+public:
+    explicit malformed_sstable_exception(const std::string& what)
+        : std::runtime_error("malformed sstable: " + what)
+    {
+    }
+};
+
+}
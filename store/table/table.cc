@@ -1,450 +1,474 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+/**
+ *
+ * Modified by Peng Jian, pstack@163.com.
+ *
+ **/
 #include "store/table.hh"
-#include "store/filter_policy.hh"
-#include "store/options.hh"
-#include "store/table/block.hh"
-#include "store/table/filter_block.hh"
-#include "store/table/format.hh"
+#include "store/table_builder.hh"
+#include "store/checked_file_impl.hh"
+#include "store/priority_manager.hh"
 #include "store/util/coding.hh"
-#include "store/reader.hh"
+#include "store/util/crc32c.hh"
+#include "store/table/compression.hh"
+#include "core/future-util.hh"
+#include "core/reactor.hh"
+#include <string.h>
 
 namespace store {
-static thread_local sstable_cache _table_cache;
-static inline sstable_cache& get_table_cache() {
-    return _table_cache;
-}
-static thread_local block_cache _block_cache;
-static inline block_cache& get_block_cache() {
-    return _block_cache;
-}
 
-future<temporary_buffer<char>> read_block(lw_shared_ptr<file_random_access_reader> r, block_handle index);
-lw_shared_ptr<reader> make_block_reader(lw_shared_ptr<table> ptable, block_handle index);
-
-struct sstable::rep {
-  ~rep() {
-  }
+// The contents of the block of handle, from buf holding it and its trailer.
+static temporary_buffer<char> check_block(block_handle handle, temporary_buffer<char> buf)
+{
+    auto data = buf.get();
+    auto crc = crc32c::unmask(decode_fixed32(data + handle.size() + 1));
+    auto actual = crc32c::value(data, handle.size() + 1);
+    if (crc != actual) {
+        throw malformed_sstable_exception("block checksum mismatch");
+    }
+    auto type = static_cast<compression_type>(data[handle.size()]);
+    buf.trim(handle.size());
+    if (type == compression_type::none) {
+        return std::move(buf);
+    }
+    return uncompress_block(type, buf);
+}
 
-  rep(lw_shared_ptr<file_reader> freader,
-      block_handle metaindex,
-      lw_shared_ptr<block> index_block,
-      sstable_options opt)
-      : _file_reader (freader)
-      , _filter (nullptr)
-      , _fileter_data()
-      , _file_name ()
-      , _metaindex_handle ()
-      , _index_block (index_block)
-      , _options(opt)
-  {
-  }
+static future<temporary_buffer<char>> read_checked_block(file& f, uint64_t file_size, block_handle handle, const io_priority_class& pc)
+{
+    auto n = handle.size() + block_trailer_size;
+    if (handle.offset() + n > file_size) {
+        return make_exception_future<temporary_buffer<char>>(malformed_sstable_exception("block out of the file"));
+    }
+    return f.dma_read_exactly<char>(handle.offset(), n, pc).then([handle, n] (temporary_buffer<char> buf) {
+        if (buf.size() != n) {
+            throw malformed_sstable_exception("truncated block");
+        }
+        return check_block(handle, std::move(buf));
+    });
+}
 
-  lw_shared_ptr<file_reader> _file_reader;
-  lw_shared_ptr<filter_block_reader> _filter = nullptr;
-  managed_bytes _fileter_data;
-  bytes _file_name;
-  block_handle _metaindex_handle;  // Handle to metaindex_block: saved from footer
-  lw_shared_ptr<block> _index_block = nullptr;
-  sstable_options _options;
-  future<> read_meta(const footer& footer);
-  future<> read_filter(const slice& filter_handle_value);
-};
+constexpr uint64_t sstable::max_coalesced_read;
 
-future<temporary_buffer<char>> read_block(lw_shared_ptr<file_random_access_reader> r, block_handle index) {
-    r->seek(index.offset());
-    return r->read_exactly(index.size()).then([r] (auto&& buffer) {
-        return std::move(buffer);
-    }).hanlde_exception([index] (auto e) {
-        // log it and throw it.
-        throw io_exception();
-    });;
+sstable::sstable(sstring name, file f, uint64_t size, sstable_options options, block index_block)
+    : _id(local_block_cache().new_sstable_id())
+    , _file_name(std::move(name))
+    , _file(std::move(f))
+    , _file_size(size)
+    , _options(options)
+    , _index_block(std::move(index_block))
+{
 }
 
-sstable::sstable(std::unique_ptr<sstable::rep> r) : rep_(std::move(r)) {}
+sstable::~sstable()
+{
+    auto& cache = local_block_cache();
+    cache.unpin(_pinned_bytes);
+    cache.erase_sstable(_id);
+}
 
-future<lw_shared_ptr<sstable>> open_sstable(bytes fname, const sstable_options& opts) {
-    return open_file_dma(fname, open_flags::ro).then([this, &opts] (file file_) mutable {
-        // mock, we will get the table cache from the thread local instance?
-        auto cached_table = get_table_cache().find(fname);
-        if (cached_table) {
-            return make_ready_future<table> (cached_table);
-        }
-        return file_.size().then([this, file_ = std::move(file_), &opts] (uint64_t size) {
-            if (size < footer::kEncodedLength) {
-                return make_exception_future<>(lw_shared_ptr<table>({}));
+future<lw_shared_ptr<sstable>> sstable::open(sstring name, sstable_options options)
+{
+    return open_checked_file_dma(general_disk_error_handler, name, open_flags::ro).then([name, options] (file f) {
+        return f.size().then([name, options, f] (uint64_t size) mutable {
+            if (size < footer::encoded_length) {
+                throw malformed_sstable_exception(name + ": too short for a footer");
             }
-            auto f = make_checked_file(opts._read_error_handler, file_);
-            auto r = make_lw_shared<file_random_access_reader>(std::move(f), size, opts.sstable_buffer_size);
-            reader->seek(size - Footer::kEncodedLength);
-            return r->read_exactly(Footer::kEncodedLength).then([this, r, &opts] (auto buffer) mutable {
-                if (buffer.size() != footer::kEncodedLength) {
-                    return make_exception_future<>(lw_shared_ptr<table>({}));
-                }
-                // read footer
+            return f.dma_read_exactly<char>(size - footer::encoded_length, footer::encoded_length, get_local_read_priority()).then([name, options, f, size] (temporary_buffer<char> buf) mutable {
                 footer footer_;
-                if (!footer_.decode_from(buffer.get(), buffer.size())) {
-                    return make_exception_future<>(lw_shared_ptr<table>({}));
+                if (!footer_.decode_from(bytes_view { buf.get(), buf.size() })) {
+                    throw malformed_sstable_exception(name + ": bad footer");
                 }
-                // read index block, and do not parse the index block now.
-                auto fut = read_block(r, footer_.index_handle());
-                return fut.then([this, r = std::move(r), _footer = std::move(_footer), &opts] (auto&& data) {
-                    auto block_handle_key = convert_to_handle_key(footer_.index_handle());
-                    auto index_block = cache->find_and_create(std::move(block_handle_key), std::move(data));
-                    auto rep_ = std::make_unique<table::rep>(r, footer_.metaindex_handle(), index_block, opts);
-                    auto table_instance = make_lw_shared<table>(rep_);
-                    // read meta block
-                    return rep_->read_meta(footer_.metaindex_handle()).then([this, table_instance] {
-                        get_table_cache().insert(table_instance);
-                        return make_ready_future<lw_shared_ptr<sstable>> ({table_instance});
+                return read_checked_block(f, size, footer_.index_handle(), get_local_read_priority()).then([name, options, f, size, footer_] (temporary_buffer<char> data) mutable {
+                    auto sst = make_lw_shared<sstable>(name, std::move(f), size, options, block { std::move(data) });
+                    return sst->read_meta(footer_).then([sst] {
+                        return sst;
                     });
                 });
-             });
-        }).handle_exception([this, fname] (std::exception_ptr) {
-            throw redis::io_exception();
+            }).handle_exception([f] (std::exception_ptr ep) mutable {
+                return f.close().then_wrapped([ep] (future<> f) {
+                    f.ignore_ready_future();
+                    return make_exception_future<lw_shared_ptr<sstable>>(ep);
+                });
+            });
         });
     });
 }
 
-future<> table::read_meta(lw_shared_ptr<file_random_access_reader> reader, block_handle metaindex_handle) {
-    if (rep_->options.filter_policy == nullptr) {
-      // Do not need any metadata
-      return make_ready_future<>();
-    }
-
-    return read_block(reader, metaindex_handle).then([this] (auto&& key, auto&& data) {
-        auto meta = make_lw_shared<block>(std::move(key), std::move(data));
-        auto meta_block_reader = make_block_reader(meta, bytes_comparator());
-        bytes key { "filter." + rep_->_options.filter_policy->name() };
-        meta_block_reader->seek(key);
-        auto data = meta_block_reader->current().data();
+future<> sstable::read_meta(const footer& f)
+{
+    return read_block(f.metaindex_handle(), get_local_read_priority()).then([this] (temporary_buffer<char> data) {
+        block metaindex { std::move(data) };
+        block::iterator it { metaindex };
+        block_handle key_range_handle;
+        bool has_key_range = false;
         block_handle filter_handle;
-        if (filter_handle.decode_from(data)) {
-            return read_block(reader, filter_handle).then([this] (auto&& data) mutable {
-                // we do not put filter block into cache.
-                rep_->_filter = make_lw_shared<filter_block_reader> (rep_->_options._filter_policy, std::move(data));
-                return make_ready_future<>();
+        bool has_filter = false;
+        bytes filter_name { filter_block_prefix };
+        if (_options._filter_policy) {
+            filter_name.append(_options._filter_policy->name(), strlen(_options._filter_policy->name()));
+        }
+        for (it.seek_to_first(); it.valid(); it.next()) {
+            auto value = it.value();
+            if (it.key() == bytes { key_range_block_name }) {
+                has_key_range = key_range_handle.decode_from(value);
+            } else if (_options._filter_policy && it.key() == filter_name) {
+                has_filter = filter_handle.decode_from(value);
+            } else if (it.key() == bytes { partitioned_index_name }) {
+                _partitioned_index = true;
+            } else if (it.key() == bytes { expiry_entry_name }) {
+                if (!_expiry.decode_from(value)) {
+                    throw malformed_sstable_exception(_file_name + ": bad expiry");
+                }
+            }
+        }
+        if (!has_key_range) {
+            throw malformed_sstable_exception(_file_name + ": no key range");
+        }
+        auto f = read_block(key_range_handle, get_local_read_priority()).then([this] (temporary_buffer<char> data) {
+            bytes_view input { data.get(), data.size() };
+            bytes_view smallest, largest;
+            if (!get_length_prefixed_slice(input, smallest) || !get_length_prefixed_slice(input, largest)) {
+                throw malformed_sstable_exception(_file_name + ": bad key range");
+            }
+            _smallest_key = bytes { smallest.data(), smallest.size() };
+            _largest_key = bytes { largest.data(), largest.size() };
+        });
+        if (has_filter) {
+            f = f.then([this, filter_handle] {
+                return read_block(filter_handle, get_local_read_priority());
+            }).then([this] (temporary_buffer<char> data) {
+                _filter = std::make_unique<filter_block_reader>(*_options._filter_policy, data);
             });
         }
-        return make_ready_future<>();
+        return f.then([this] {
+            _pinned_bytes = _index_block.size() + filter_size();
+            local_block_cache().pin(_pinned_bytes);
+        });
     });
 }
 
-table::~table() {
+future<temporary_buffer<char>> sstable::read_block(block_handle handle, const io_priority_class& pc)
+{
+    return read_checked_block(_file, _file_size, handle, pc);
 }
 
-class block_reader : public reader::impl {
-    lw_shared_ptr<block> _block;
-    sstable_options _optons;
-    uint32_t _restarts_offset = 0;
-    uint32_t _num_restarts = 0;
-    uint32_t _restart_index = 0;
-    uint32_t _current_offset = 0;
-    partition _current;
-    bytes_view _data_view;
-    bytes_view _value_view;
-    bool _eof = false;
-public:
-    block_reader(lw_shared_ptr<block> b, sstable_options opt)
-        , _block(b)
-        , _options(opt)
-        , _data_view ({b->data(), b->size()})
-        , _value_view ()
-        , _restarts_offset (0)
-        , _num_restarts (b->num_restarts())
-        , _restart_index(0)
-        , _current_offset(0)
-        , _eof(false)
-    {
-    }
-    future<> seek_to_first() {
-        seek_to_restart_point(0);
-        parse_next_key();
-        return make_ready_future<>();
-    }
-
-    future<> seek_to_last() {
-        seek_to_restart_point(num_restarts_ - 1);
-        while (parse_next_key() && next_entry_offset() < restarts_) { }
-        return make_ready_future<>();
-    }
-
-    future<> seek(bytes key) {
-        // binary search the target restart point.
-        uint32_t left = 0;
-        uint32_t right = num_restarts_ - 1;
-        while (left < right) {
-            uint32_t mid = (left + right + 1) / 2;
-            uint32_t region_offset = get_restart_point(mid);
-            uint32_t shared, non_shared, value_length;
-            const char* key_ptr = decode_entry(data_ + region_offset, data_ + restarts_, &shared, &non_shared, &value_length);
-            if (key_ptr == nullptr || (shared != 0)) {
-                _eof = true;
-                return make_ready_future<>();
-            }
-            auto mid_key = bytes_view { key_ptr, non_shared };
-            if (compare(mid_key, target) < 0) {
-                left = mid;
-            } else {
-                right = mid - 1;
-            }
-        }
-        seek_to_restart_point(left);
-        // leaner search the target key
-        while (true) {
-            if (!parse_next_key()) {
-                return make_ready_future<>();
-            }
-            if (compare(_curent_key(), key) >= 0) {
-                return make_ready_future<>();
-            }
+future<lw_shared_ptr<const block>> sstable::read_data_block(block_handle handle, sstable_read_stats* stats)
+{
+    auto& cache = local_block_cache();
+    auto k = block_cache::key { _id, handle.offset() };
+    auto b = cache.find(k);
+    if (stats) {
+        ++stats->_blocks;
+        if (b) {
+            ++stats->_cache_hits;
+        } else {
+            stats->_bytes_read += handle.size() + block_trailer_size;
         }
     }
-
-    future<> next() {
-        parse_next_key();
-        return make_ready_future<>();
+    if (b) {
+        return make_ready_future<lw_shared_ptr<const block>>(std::move(b));
     }
-    partition current() const {
-        return _current;
-    }
-    bool eof() const {
-        return _current_offset >= restarts_ || _eof;
+    return read_block(handle, get_local_read_priority()).then([k] (temporary_buffer<char> data) {
+        lw_shared_ptr<const block> b = make_lw_shared<block>(std::move(data));
+        local_block_cache().insert(k, b);
+        return b;
+    });
+}
+
+future<bytes_opt> sstable::get(bytes_view key, sstable_read_stats* stats)
+{
+    if (default_bytewise_comparator().compare(key, _smallest_key) < 0 || default_bytewise_comparator().compare(key, _largest_key) > 0) {
+        return make_ready_future<bytes_opt>();
     }
-private:
-    inline uint32_t next_entry_offset() const {
-        return static_cast<uint32_t>((_value_view.data() + _value_view.size()) - _data_view.data());
+    // the index maps the last key of every data block, or of every index
+    // partition, to it.
+    block::iterator index { _index_block };
+    index.seek(key);
+    if (!index.valid()) {
+        return make_ready_future<bytes_opt>();
     }
-
-    uint32_t get_restart_point(uint32_t index) {
-        assert (index < _num_restarts);
-        return decode_fixed32(data_ + restarts_ + index * sizeof(uint32_t));
+    block_handle handle;
+    auto value = index.value();
+    if (!handle.decode_from(value)) {
+        return make_exception_future<bytes_opt>(malformed_sstable_exception(_file_name + ": bad index entry"));
     }
-
-    void seek_to_restart_point(uint32_t index) {
-        _current.key().clear();
-        restart_index_ = index;
-        uint32_t offset = get_restart_point(index);
-        _value_view = bytes_view { _data_view.data() + offset, 0 };
+    auto k = bytes { key.data(), key.size() };
+    if (!_partitioned_index) {
+        return get_from(handle, std::move(k), stats);
     }
-
-    bool parse_next_key() {
-        _current_offset = next_entry_offset();
-        const char* p = _data_view.data() + _current_offset;
-        const char* limit = data_ + restarts_offset;
-        if (p >= limit) {
-            current_ = restarts_offset;
-            restart_index_ = num_restarts_;
-            return false;
+    // the partition maps the last key of its data blocks to them, as a
+    // whole index would.
+    return read_data_block(handle, stats).then([this, k = std::move(k), stats] (lw_shared_ptr<const block> partition) mutable {
+        block::iterator it { *partition };
+        it.seek(bytes_view { k.data(), k.size() });
+        block_handle data_handle;
+        auto value = it.valid() ? it.value() : bytes_view {};
+        if (!it.valid() || !data_handle.decode_from(value)) {
+            return make_exception_future<bytes_opt>(malformed_sstable_exception(_file_name + ": bad index partition"));
         }
+        return get_from(data_handle, std::move(k), stats);
+    });
+}
 
-        uint32_t shared, non_shared, value_length;
-        p = decode_entry(p, limit, &shared, &non_shared, &value_length);
-        if (p == nullptr || key_.size() < shared) {
-            return false;
-        } else {
-            _current.key().resize(shared);
-            _current.key().append(p, non_shared);
-            _value_view = { p + non_shared, value_length };
-            while (restart_index_ + 1 < num_restarts_ && get_restart_point(restart_index_ + 1) < _current_offset) {
-                ++restart_index_;
-            }
-            return true;
+future<bytes_opt> sstable::get_from(block_handle handle, bytes key, sstable_read_stats* stats)
+{
+    return read_data_block(handle, stats).then([key = std::move(key)] (lw_shared_ptr<const block> b) {
+        block::iterator it { *b };
+        it.seek_for_get(bytes_view { key.data(), key.size() });
+        if (it.valid() && it.key() == key) {
+            return bytes_opt { bytes { it.value().data(), it.value().size() } };
         }
-    }
-};
-
-lw_shared_ptr<reader> make_block_reader(lw_shared_ptr<block> b, sstables_options opt) {
-    return make_lw_shared<reader>(std::make_unique<block_reader>(b, std::move(opt)));
+        return bytes_opt {};
+    });
 }
 
-class sstable_reader : public reader::impl {
-   lw_shared_ptr<table> _table;
-   lw_shared_ptr<block_reader> _index_block_reader;
-   lw_shared_ptr<block_reader> _data_block_reader;
-   lw_shared_ptr<file_random_access_reader> _reader;
-   bool _initialized = false;
-public:
-   sstable_reader(lw_shared_ptr<table> ptable) : _table(ptable) {}
-   future<> seek_to_first() {
-       return _index_block_reader->seek_to_first().then([this] {
-            _initialized = true;
-            block_handle data_handle;
-            data_handle.decode_from(_index_block_reader->current().data());
-            auto handle_key = convert_to_handle_key(data_handle);
-            auto b  = _table->cache()->find(handle_key);
-            if (b != nullptr) {
-                _data_block_reader = make_block_reader(b, _table->options());
-                return _data_block_reader.seek_to_first();
+future<std::vector<bytes_opt>> sstable::multi_get(std::vector<bytes> keys, sstable_read_stats* stats)
+{
+    struct lookup {
+        std::vector<bytes> _keys;
+        std::vector<bytes_opt> _values;
+        // The data block of every key, or the index partition until it is
+        // read, unless the key is out of the table.
+        std::vector<block_handle> _handles;
+        std::vector<bool> _in_table;
+    };
+    auto l = make_lw_shared<lookup>();
+    l->_keys = std::move(keys);
+    auto n = l->_keys.size();
+    l->_values.resize(n);
+    l->_handles.resize(n);
+    l->_in_table.resize(n, false);
+    block::iterator index { _index_block };
+    for (size_t i = 0; i < n; ++i) {
+        auto key = bytes_view { l->_keys[i].data(), l->_keys[i].size() };
+        if (default_bytewise_comparator().compare(key, _smallest_key) < 0 || default_bytewise_comparator().compare(key, _largest_key) > 0) {
+            continue;
+        }
+        index.seek(key);
+        if (!index.valid()) {
+            continue;
+        }
+        auto value = index.value();
+        if (!l->_handles[i].decode_from(value)) {
+            return make_exception_future<std::vector<bytes_opt>>(malformed_sstable_exception(_file_name + ": bad index entry"));
+        }
+        l->_in_table[i] = true;
+    }
+    // the keys of a block, or of a partition, are next to each other.
+    auto groups = [l, n] {
+        std::vector<std::pair<size_t, size_t>> ranges;
+        for (size_t i = 0; i < n; ++i) {
+            if (!l->_in_table[i]) {
+                continue;
             }
-            return read_block(_reader, data_handle).then([this, key = std::move(handle_key)] (auto&& data) {
-                // cache the block. the block in the cache will be evicted by LRU or the file was deleted.
-                auto b = _table->cache()->create(std::move(key), std::move(data));
-                 _data_block_reader = make_block_reader(b, _table->options());
-                return _data_block_reader->seek_to_first();
-            });
-       });
-   }
-   future<> seek_to_last() {
-       return _index_block_reader->seek_to_last().then([this] {
-            _initialized = true;
-            block_handle data_handle;
-            data_handle.decode_from(_index_block_reader->current().data());
-            auto handle_key = convert_to_handle_key(data_handle);
-            auto b  = _table->cache()->find(handle_key);
-            if (b != nullptr) {
-                _data_block_reader = make_block_reader(b, _table->options());
-                return _data_block_reader.seek_to_last();
+            if (!ranges.empty() && l->_handles[ranges.back().first].offset() == l->_handles[i].offset()) {
+                ranges.back().second = i + 1;
+            } else {
+                ranges.emplace_back(i, i + 1);
             }
-            return read_block(_reader, data_handle).then([this, key = std::move(handle_key)] (auto&& data) {
-                auto b = _table->cache()->create(std::move(key), std::move(data));
-                 _data_block_reader = make_block_reader(b, _table->options());
-                return _data_block_reader->seek_to_last();
+        }
+        return ranges;
+    };
+    auto partitions = make_ready_future<>();
+    if (_partitioned_index) {
+        partitions = parallel_for_each(groups(), [this, l, stats] (std::pair<size_t, size_t> range) {
+            return read_data_block(l->_handles[range.first], stats).then([this, l, range] (lw_shared_ptr<const block> partition) {
+                block::iterator it { *partition };
+                for (auto i = range.first; i < range.second; ++i) {
+                    if (!l->_in_table[i]) {
+                        continue;
+                    }
+                    it.seek(bytes_view { l->_keys[i].data(), l->_keys[i].size() });
+                    auto value = it.valid() ? it.value() : bytes_view {};
+                    if (!it.valid() || !l->_handles[i].decode_from(value)) {
+                        throw malformed_sstable_exception(_file_name + ": bad index partition");
+                    }
+                }
             });
-       });
-   }
-   future<> seek(bytes_view key) {
-       return _index_block_reader->seek(key).then([this, key] {
-            _initialized = true;
-            block_handle data_handle;
-            data_handle.decode_from(_index_block_reader->current().data());
-            auto handle_key = convert_to_handle_key(data_handle);
-            auto b  = _table->cache()->find(handle_key);
-            if (b != nullptr) {
-                _data_block_reader = make_block_reader(b, _table->options());
-                return _data_block_reader.seek(key);
+        });
+    }
+    return partitions.then([this, l, groups, stats] {
+        auto ranges = groups();
+        auto blocks = make_lw_shared<std::vector<lw_shared_ptr<const block>>>(ranges.size());
+        // the blocks the cache holds are taken from it, the others are
+        // read by runs of neighbours, each in one read.
+        auto& cache = local_block_cache();
+        std::vector<std::pair<size_t, size_t>> runs;
+        uint64_t run_end = 0;
+        for (size_t g = 0; g < ranges.size(); ++g) {
+            auto& handle = l->_handles[ranges[g].first];
+            (*blocks)[g] = cache.find(block_cache::key { _id, handle.offset() });
+            if (stats) {
+                ++stats->_blocks;
+                if ((*blocks)[g]) {
+                    ++stats->_cache_hits;
+                } else {
+                    stats->_bytes_read += handle.size() + block_trailer_size;
+                }
+            }
+            if ((*blocks)[g]) {
+                continue;
+            }
+            auto start = runs.empty() ? 0 : l->_handles[ranges[runs.back().first].first].offset();
+            if (!runs.empty() && runs.back().second == g && handle.offset() == run_end
+                    && handle.offset() + handle.size() + block_trailer_size - start <= max_coalesced_read) {
+                runs.back().second = g + 1;
+            } else {
+                runs.emplace_back(g, g + 1);
             }
-            return read_block(_reader, data_handle).then([this, key = std::move(handle_key)] (auto&& data) {
-                auto b = _table->cache()->create(std::move(key), std::move(data));
-                _data_block_reader = make_block_reader(b, _table->options());
-                return _data_block_reader->seek(ikey);
+            run_end = handle.offset() + handle.size() + block_trailer_size;
+        }
+        return parallel_for_each(std::move(runs), [this, l, ranges, blocks] (std::pair<size_t, size_t> run) {
+            auto& first = l->_handles[ranges[run.first].first];
+            auto& last = l->_handles[ranges[run.second - 1].first];
+            auto start = first.offset();
+            auto n = last.offset() + last.size() + block_trailer_size - start;
+            if (start + n > _file_size) {
+                return make_exception_future<>(malformed_sstable_exception(_file_name + ": block out of the file"));
+            }
+            return _file.dma_read_exactly<char>(start, n, get_local_read_priority()).then([this, l, ranges, blocks, run, start, n] (temporary_buffer<char> buf) {
+                if (buf.size() != n) {
+                    throw malformed_sstable_exception(_file_name + ": truncated block");
+                }
+                for (auto g = run.first; g < run.second; ++g) {
+                    auto& handle = l->_handles[ranges[g].first];
+                    // a copy, so that the cached block does not hold the
+                    // whole run.
+                    auto data = temporary_buffer<char>(buf.get() + (handle.offset() - start), handle.size() + block_trailer_size);
+                    lw_shared_ptr<const block> b = make_lw_shared<block>(check_block(handle, std::move(data)));
+                    local_block_cache().insert(block_cache::key { _id, handle.offset() }, b);
+                    (*blocks)[g] = std::move(b);
+                }
             });
-       });
-   }
-   future<> next() {
-       assert(_initialized);
-       return _data_block_reader->next().then([this] mutable {
-           if (_data_block_reader->current().empty()) {
-               return _index_block_reader->next().then([this] mutable {
-                   block_handle data_handle;
-                   data_handle.decode_from(_index_block_reader->current().data());
-                   auto handle_key = convert_to_handle_key(data_handle);
-                   auto b  = _table->cache()->find(handle_key);
-                   if (b != nullptr) {
-                       _data_block_reader = make_block_reader(b, _table->options());
-                       return _data_block_reader->seek_to_first();
-                   }
-                   return read_block(_reader, data_handle).then([this, key = std::move(handle_key)] (auto&& data) {
-                       auto b = _table->cache()->create(std::move(key), std::move(data));
-                       _data_block_reader = make_block_reader(b, _table->options());
-                       return _data_block_reader->seek_to_first();
-                   });
-               });
-           }
-           return make_ready_future<>();
-       });
-   }
-   partition current() {
-       return _data_block_reader->current();
-   }
-   bool eof() {
-       return _index_block_reader->eof() && _data_block_reader->eof();
-   }
-};
+        }).then([l, ranges, blocks] {
+            for (size_t g = 0; g < ranges.size(); ++g) {
+                block::iterator it { *(*blocks)[g] };
+                for (auto i = ranges[g].first; i < ranges[g].second; ++i) {
+                    if (!l->_in_table[i]) {
+                        continue;
+                    }
+                    auto& key = l->_keys[i];
+                    it.seek_for_get(bytes_view { key.data(), key.size() });
+                    if (it.valid() && it.key() == key) {
+                        l->_values[i] = bytes { it.value().data(), it.value().size() };
+                    }
+                }
+            }
+            return std::move(l->_values);
+        });
+    });
+}
 
-lw_shared_ptr<reader> make_sstable_reader(lw_shared_ptr<sstable> table) {
-    return make_lw_shared<reader>(std::make_unique<sstable_reader>(table));
+future<> sstable::close()
+{
+    return _file.close();
 }
 
-class combined_sstables_reader : public reader::impl {
-    std::vector<lw_shared_ptr<table>> _sstables;
-    std::vector<lw_shared_ptr<reader> _readers;
-    lw_shared_ptr<reader> _current = nullptr;
-    bool _eof = false;
+sstable_scanner::sstable_scanner(lw_shared_ptr<sstable> sst, const io_priority_class& pc)
+    : _sstable(std::move(sst))
+    , _pc(pc)
+    , _index(_sstable->_index_block)
+{
+}
 
-public:
-    combined_sstables_reader(std::vector<lw_shared_ptr<table>> sstables)
-        : _sstables(std::move(sstables))
-        , _readers(sstables.size())
-        , _current(nullptr)
-        , _eof(false)
-    {
-        for (size_t i = 0; i < sstables.size(); ++i) {
-            _readers[i] = make_sstable_reader(sstables[i]);
-        }
+future<> sstable_scanner::read_next_block()
+{
+    _it.reset();
+    _block = nullptr;
+    if (_sstable->_partitioned_index && !(_partition_it && _partition_it->valid())) {
+        return read_next_partition().then([this] {
+            if (!_partition_it) {
+                return make_ready_future<>();
+            }
+            return read_next_block();
+        });
     }
-
-    ~combined_sstables_reader()
-    {
+    auto& index = _sstable->_partitioned_index ? *_partition_it : _index;
+    if (!index.valid()) {
+        return make_ready_future<>();
     }
-
-    future<> seek_to_first() {
-        return parallel_for_each(_sstables, [this] (auto sstable) mutable {
-            sstable->seek_to_first();
-        }).then(this] mutable {
-            return find_smallest_one();
-        });
+    block_handle handle;
+    auto value = index.value();
+    if (!handle.decode_from(value)) {
+        return make_exception_future<>(malformed_sstable_exception(_sstable->file_name() + ": bad index entry"));
     }
+    index.next();
+    return _sstable->read_block(handle, _pc).then([this] (temporary_buffer<char> data) {
+        _block = make_lw_shared<block>(std::move(data));
+        _it = std::make_unique<block::iterator>(*_block);
+        _it->seek_to_first();
+        if (!_it->valid()) {
+            // an empty block, only written for an empty table.
+            return read_next_block();
+        }
+        return make_ready_future<>();
+    });
+}
 
-    future<> seek_to_last() {
-        return parallel_for_each(_sstables, [this] (auto sstable) mutable {
-            sstable->seek_to_last();
-        }).then(this] mutable {
-            return find_smallest_one();
-        });
+future<> sstable_scanner::read_next_partition()
+{
+    _partition_it.reset();
+    _partition = nullptr;
+    if (!_index.valid()) {
+        return make_ready_future<>();
     }
-
-    future<> seek(bytes_view key) {
-        return parallel_for_each(_sstables, [this, key] (auto sstable) mutable {
-            sstable->seek(key);
-        }).then(this] mutable {
-            return find_smallest_one();
-        });
+    block_handle handle;
+    auto value = _index.value();
+    if (!handle.decode_from(value)) {
+        return make_exception_future<>(malformed_sstable_exception(_sstable->file_name() + ": bad index entry"));
     }
+    _index.next();
+    return _sstable->read_block(handle, _pc).then([this] (temporary_buffer<char> data) {
+        _partition = make_lw_shared<block>(std::move(data));
+        _partition_it = std::make_unique<block::iterator>(*_partition);
+        _partition_it->seek_to_first();
+    });
+}
 
-    future<> next() {
-        return parallel_for_each(_sstables, [this] (auto sstable) mutable {
-            if (sstable == _current) {
-                sstable->next();
+future<> sstable_scanner::seek_to_first()
+{
+    _index.seek_to_first();
+    _partition_it.reset();
+    return read_next_block();
+}
+
+future<> sstable_scanner::seek(bytes target)
+{
+    // the index maps the last key of every data block, or of every
+    // partition, to it: the first one not below target holds the entry.
+    auto t = make_lw_shared<bytes>(std::move(target));
+    _index.seek(bytes_view { t->data(), t->size() });
+    _partition_it.reset();
+    auto f = make_ready_future<>();
+    if (_sstable->_partitioned_index) {
+        f = read_next_partition().then([this, t] {
+            if (_partition_it) {
+                _partition_it->seek(bytes_view { t->data(), t->size() });
             }
-        }).then([this] mutable {
-            return find_smallest_one();
         });
     }
-
-    bool eof() const {
-        if (_eof) {
-            return _eof;
+    return f.then([this] {
+        return read_next_block();
+    }).then([this, t] {
+        if (!_it) {
+            return make_ready_future<>();
         }
-        bool all_eof = false;
-        for (auto& sstable : _sstables) {
-            all_eof &= sstable->eof();
-        }
-        return all_eof;
-    }
+        _it->seek(bytes_view { t->data(), t->size() });
+        return _it->valid() ? make_ready_future<>() : read_next_block();
+    });
+}
 
-    partition current() const {
-        return _current->current();
-    }
-private:
-    future<> find_smallest_one() {
-       auto less_comparator = [] (const lw_shared_ptr<table> a, const lw_shared_ptr<table> b) {
-           return a->current().key() < b->current().key();
-       };
-       lw_shared_ptr<table> smallest = _sstables[0];
-       for (size_t i = 1; i < _sstables.size(); ++i) {
-           if (less_comparator(_sstables[i], smallest)) {
-               smallest = _sstables[i];
-           }
-       }
-       _current = smallest;
-       if (_current == nullptr) {
-           _eof = true;
-       }
-       return make_ready_future<>();
+future<> sstable_scanner::next()
+{
+    _it->next();
+    if (_it->valid()) {
+        return make_ready_future<>();
     }
-};
-
-lw_shared_ptr<reader> make_combined_sstables_reader(std::vector<lw_shared_ptr<table>> sstables) {
-    return make_lw_shared<reader>(std::make_unique<combined_sstables_reader>(std::move(stables)));
+    return read_next_block();
 }
 
 }
@@ -0,0 +1,183 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+/**
+ *
+ * Modified by Peng Jian, pstack@163.com.
+ *
+ **/
+#include "store/table_builder.hh"
+
+#include <assert.h>
+#include <string.h>
+#include "store/comparator.hh"
+#include "store/table/compression.hh"
+#include "store/util/coding.hh"
+#include "store/util/crc32c.hh"
+
+namespace store {
+
+static block_options make_block_options(uint32_t restart_interval, bool hash_index = false)
+{
+    block_options options;
+    options._block_restart_interval = restart_interval;
+    options._hash_index = hash_index;
+    return options;
+}
+
+table_builder::table_builder(const table_options& options, file f, const io_priority_class& pc)
+    : _options(options)
+    , _out(std::move(f), pc, options._writer)
+    , _data_block(make_block_options(options._block_restart_interval, options._block_hash_index))
+    // Index entries are looked up by binary search, only.
+    , _index_block(make_block_options(1))
+    , _top_index_block(make_block_options(1))
+    , _filter_block(options._filter_policy ? std::make_unique<filter_block_builder>(*options._filter_policy) : nullptr)
+{
+}
+
+future<> table_builder::add(bytes_view key, bytes_view value)
+{
+    assert(!_closed);
+    assert(_num_entries == 0 || default_bytewise_comparator().compare(key, _last_key) > 0);
+    if (_num_entries == 0) {
+        _first_key = bytes { key.data(), key.size() };
+    }
+    _last_key = bytes { key.data(), key.size() };
+    ++_num_entries;
+    _last_entry_bytes = key.size() + value.size();
+    _expiry._data_bytes += _last_entry_bytes;
+    if (_filter_block) {
+        _filter_block->add_key(key);
+    }
+    _data_block.add(key, value);
+    if (_data_block.current_size_estimate() >= _options._block_size) {
+        return flush();
+    }
+    return make_ready_future<>();
+}
+
+future<> table_builder::flush()
+{
+    assert(!_closed);
+    if (_data_block.empty()) {
+        return make_ready_future<>();
+    }
+    return write_block(_data_block, _pending_handle).then([this] {
+        // the last key of the block is at least every key in it, and less
+        // than the keys of the next blocks.
+        bytes handle_encoding;
+        _pending_handle.encode_to(handle_encoding);
+        _index_block.add(bytes_view { _last_key.data(), _last_key.size() }, bytes_view { handle_encoding.data(), handle_encoding.size() });
+        if (_options._index_partition_size > 0 && _index_block.current_size_estimate() >= _options._index_partition_size) {
+            return write_index_partition();
+        }
+        return make_ready_future<>();
+    });
+}
+
+future<> table_builder::write_index_partition()
+{
+    // its last key is that of the last data block written.
+    auto handle = make_lw_shared<block_handle>();
+    return write_block(_index_block, *handle).then([this, handle] {
+        bytes handle_encoding;
+        handle->encode_to(handle_encoding);
+        _top_index_block.add(bytes_view { _last_key.data(), _last_key.size() }, bytes_view { handle_encoding.data(), handle_encoding.size() });
+    });
+}
+
+future<> table_builder::write_block(block_builder& block, block_handle& handle)
+{
+    const auto& raw = block.finish();
+    auto contents = bytes_view { raw.data(), raw.size() };
+    auto type = _options._compression;
+    _raw_size += raw.size();
+    if (type != compression_type::none && compress_block(type, contents, _compressed)) {
+        contents = bytes_view { _compressed.data(), _compressed.size() };
+    } else {
+        type = compression_type::none;
+    }
+    return write_raw_block(contents, type, handle).then([&block] {
+        block.reset();
+    });
+}
+
+future<> table_builder::write_raw_block(bytes_view data, compression_type type, block_handle& handle)
+{
+    handle = block_handle { _offset, data.size() };
+    _offset += data.size() + block_trailer_size;
+    _trailer[0] = static_cast<char>(type);
+    // the crc is computed as the block is copied into the write buffer,
+    // the block may be reset once it is.
+    _block_crc = 0;
+    return _out.append(data.data(), data.size(), &_block_crc).then([this] {
+        auto crc = crc32c::extend(_block_crc, _trailer, 1);  // Extend crc to cover block type
+        encode_fixed32(_trailer + 1, crc32c::mask(crc));
+        return _out.append(_trailer, block_trailer_size);
+    });
+}
+
+future<> table_builder::finish()
+{
+    return flush().then([this] {
+        if (_top_index_block.empty() || _index_block.empty()) {
+            return make_ready_future<>();
+        }
+        return write_index_partition();
+    }).then([this] {
+        _closed = true;
+        // The metaindex block lists the meta blocks in name order.
+        auto metaindex = make_lw_shared<block_builder>(make_block_options(1));
+        auto filter_handle = make_lw_shared<block_handle>();
+        auto f = make_ready_future<>();
+        if (_filter_block) {
+            f = do_with(_filter_block->finish(), [this, filter_handle] (bytes& filter) {
+                return write_raw_block(bytes_view { filter.data(), filter.size() }, compression_type::none, *filter_handle);
+            }).then([this, metaindex, filter_handle] {
+                bytes name { filter_block_prefix };
+                name.append(_options._filter_policy->name(), strlen(_options._filter_policy->name()));
+                bytes handle_encoding;
+                filter_handle->encode_to(handle_encoding);
+                metaindex->add(bytes_view { name.data(), name.size() }, bytes_view { handle_encoding.data(), handle_encoding.size() });
+            });
+        }
+        return f.then([this, metaindex] {
+            if (!_expiry.empty()) {
+                bytes encoding;
+                _expiry.encode_to(encoding);
+                metaindex->add(bytes_view { expiry_entry_name, strlen(expiry_entry_name) }, bytes_view { encoding.data(), encoding.size() });
+            }
+            auto key_range = make_lw_shared<bytes>();
+            put_length_prefixed_slice(*key_range, bytes_view { _first_key.data(), _first_key.size() });
+            put_length_prefixed_slice(*key_range, bytes_view { _last_key.data(), _last_key.size() });
+            auto key_range_handle = make_lw_shared<block_handle>();
+            return write_raw_block(bytes_view { key_range->data(), key_range->size() }, compression_type::none, *key_range_handle).then([metaindex, key_range, key_range_handle] {
+                bytes handle_encoding;
+                key_range_handle->encode_to(handle_encoding);
+                metaindex->add(bytes_view { key_range_block_name, strlen(key_range_block_name) }, bytes_view { handle_encoding.data(), handle_encoding.size() });
+            });
+        }).then([this, metaindex] {
+            auto partitioned = !_top_index_block.empty();
+            if (partitioned) {
+                metaindex->add(bytes_view { partitioned_index_name, strlen(partitioned_index_name) }, bytes_view {});
+            }
+            auto metaindex_handle = make_lw_shared<block_handle>();
+            return write_block(*metaindex, *metaindex_handle).then([this, metaindex, metaindex_handle, partitioned] {
+                auto index_handle = make_lw_shared<block_handle>();
+                auto& index = partitioned ? _top_index_block : _index_block;
+                return write_block(index, *index_handle).then([this, metaindex_handle, index_handle] {
+                    auto encoding = make_lw_shared<bytes>();
+                    footer { *metaindex_handle, *index_handle }.encode_to(*encoding);
+                    _offset += encoding->size();
+                    return _out.append(encoding->data(), encoding->size()).finally([encoding] {});
+                });
+            });
+        });
+    }).finally([this] {
+        return _out.close();
+    });
+}
+
+}  // namespace store
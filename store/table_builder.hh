@@ -5,86 +5,122 @@
 // table_builder provides the interface used to build a Table
 // (an immutable and sorted map from keys to values).
 //
-// Multiple threads can invoke const methods on a table_builder without
-// external synchronization, but if any of the threads may call a
-// non-const method, all threads accessing the same table_builder must use
-// external synchronization.
+// A table_builder is used by one task at a time: each call must wait for
+// the future returned by the previous one.
 
 #pragma once
 #include <stdint.h>
-#include "store/options.hh"
-#include "store/status.hh"
+#include <memory>
+#include "store/table/block_builder.hh"
+#include "store/table/filter_block.hh"
+#include "store/table/format.hh"
+#include "store/dma_file_writer.hh"
 #include "core/future.hh"
-#include "core/file.hh"
 #include "seastarx.hh"
 
 namespace store {
 
-class block_builder;
-class block_handle;
+struct table_options {
+    // Data blocks are cut once they reach this size.
+    size_t _block_size = 4096;
+    // Keys between two restart points of a block, see block_builder.
+    uint32_t _block_restart_interval = 16;
+    // Codec of the data and index blocks. A block that does not shrink
+    // enough is stored uncompressed.
+    compression_type _compression = compression_type::none;
+    // Builds the filter block of the table, none if null.
+    const filter_policy* _filter_policy = nullptr;
+    // The index is cut into blocks of about this size, and the index block
+    // of the footer maps the last key of each to it, once there are more
+    // than one. 0 writes a single index block.
+    size_t _index_partition_size = 4096;
+    // Appends a hash index to every data block, for point lookups, see
+    // block_hash_index.
+    bool _block_hash_index = false;
+    // How the file is written, see dma_file_writer.
+    dma_file_writer_options _writer;
+};
+
+// The meta blocks, by their name in the metaindex block. The filter block
+// is "filter." followed by the name of its policy.
+static constexpr const char* filter_block_prefix = "filter.";
+// The table_expiry of the table, inline, when any of its values expires.
+static constexpr const char* expiry_entry_name = "pedis.expiry";
+// The smallest and the largest keys, length prefixed.
+static constexpr const char* key_range_block_name = "pedis.key_range";
+// Present, empty, when the index block is the top level of a partitioned
+// index.
+static constexpr const char* partitioned_index_name = "pedis.partitioned_index";
 
 class table_builder {
  public:
   // Create a builder that will store the contents of the table it is
-  // building in *file.  Does not close the file.  It is up to the
-  // caller to close the file after calling Finish().
-  table_builder(const options& options, file& file);
+  // building in f, written with pc. finish() closes the file.
+  table_builder(const table_options& options, file f, const io_priority_class& pc);
 
-  // REQUIRES: Either Finish() or Abandon() has been called.
-  ~table_builder();
-
-  // Change the options used by this builder.  Note: only some of the
-  // option fields can be changed after construction.  If a field is
-  // not allowed to change dynamically and its value in the structure
-  // passed to the constructor is different from its value in the
-  // structure passed to this method, this method will return an error
-  // without changing any fields.
-  status change_options(const options& options);
+  table_builder(const table_builder&) = delete;
+  void operator=(const table_builder&) = delete;
 
   // Add key,value to the table being constructed.
   // REQUIRES: key is after any previously added key according to comparator.
-  // REQUIRES: Finish(), Abandon() have not been called
-  future<> add(const bytes_view key, const bytes_view value);
+  // REQUIRES: finish() has not been called
+  future<> add(bytes_view key, bytes_view value);
+
+  // The value just added expires at expire, a unix time in milliseconds:
+  // the table records it, see table_expiry.
+  void add_expiry(uint64_t expire) { _expiry.add(expire, _last_entry_bytes); }
 
   // Advanced operation: flush any buffered key/value pairs to file.
   // Can be used to ensure that two adjacent entries never live in
   // the same data block.  Most clients should not need to use this method.
-  // REQUIRES: Finish(), Abandon() have not been called
-  void flush();
-
-  // Return non-ok iff some error has been detected.
-  status get_status() const;
+  // REQUIRES: finish() has not been called
+  future<> flush();
 
-  // Finish building the table.  Stops using the file passed to the
-  // constructor after this function returns.
-  // REQUIRES: Finish(), Abandon() have not been called
+  // Finish building the table: writes the meta blocks, the index and the
+  // footer, then flushes and closes the file.
+  // REQUIRES: finish() has not been called
   future<> finish();
 
-  // Indicate that the contents of this builder should be abandoned.  Stops
-  // using the file passed to the constructor after this function returns.
-  // If the caller is not going to call Finish(), it must call Abandon()
-  // before destroying this builder.
-  // REQUIRES: Finish(), Abandon() have not been called
-  void abandon();
-
-  // Number of calls to Add() so far.
-  uint64_t num_entries() const;
+  // Number of calls to add() so far.
+  uint64_t num_entries() const { return _num_entries; }
 
   // Size of the file generated so far.  If invoked after a successful
-  // Finish() call, returns the size of the final generated file.
-  uint64_t file_size() const;
-
- private:
-  bool ok() const { return status().ok(); }
-  void write_block(block_builder* block, block_handle* handle);
-  void write_raw_block(bytes_view data, compression_type, block_handle* handle);
+  // finish() call, returns the size of the final generated file.
+  uint64_t file_size() const { return _offset; }
 
-  struct rep;
-  rep* rep_;
+  // Size of the data, index and metaindex blocks written so far, before
+  // compression.
+  uint64_t raw_size() const { return _raw_size; }
 
-  // No copying allowed
-  table_builder(const table_builder&) = delete;
-  void operator=(const table_builder&) = delete;
+ private:
+  future<> write_block(block_builder& block, block_handle& handle);
+  future<> write_raw_block(bytes_view data, compression_type type, block_handle& handle);
+  // Writes the index block built so far as a partition.
+  future<> write_index_partition();
+
+  table_options _options;
+  dma_file_writer _out;
+  block_builder _data_block;
+  // The last key of every data block -> its handle, of the partition being
+  // built when the index is partitioned.
+  block_builder _index_block;
+  // The last key of every index partition -> its handle.
+  block_builder _top_index_block;
+  std::unique_ptr<filter_block_builder> _filter_block;
+  block_handle _pending_handle;
+  uint64_t _offset = 0;
+  uint64_t _raw_size = 0;
+  // Scratch buffer of write_block().
+  bytes _compressed;
+  // Of the block write_raw_block() writes.
+  uint32_t _block_crc = 0;
+  char _trailer[block_trailer_size];
+  uint64_t _num_entries = 0;
+  table_expiry _expiry;
+  size_t _last_entry_bytes = 0;
+  bytes _first_key;
+  bytes _last_key;
+  bool _closed = false;
 };
 
-}  // namespace store 
+}  // namespace store
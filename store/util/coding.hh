@@ -47,13 +47,13 @@ extern void put_fixed32(bytes& dst, uint32_t value);
 extern void put_fixed64(bytes& dst, uint64_t value);
 extern void put_varint32(bytes& dst, uint32_t value);
 extern void put_varint64(bytes& dst, uint64_t value);
-extern void put_length_prefixed_slice(bytes& dst, const bytes& value);
+extern void put_length_prefixed_slice(bytes& dst, const bytes_view& value);
 
 // Standard Get... routines parse a value from the beginning of a slice
 // and advance the slice past the parsed value.
 extern bool get_varint32(bytes_view& input, uint32_t& value);
 extern bool get_varint64(bytes_view& input, uint64_t& value);
-extern bool get_length_prefixed_slice(bytes_view& input, bytes& result);
+extern bool get_length_prefixed_slice(bytes_view& input, bytes_view& result);
 
 // Pointer-based variants of GetVarint...  These either store a value
 // in *v and return a pointer just past the parsed value, or return
@@ -34,6 +34,13 @@ namespace crc32c {
 // crc32c of a stream of data.
 extern uint32_t extend(uint32_t init_crc, const char* data, size_t n);
 
+// Copies src[0,n-1] to dst and returns extend(init_crc, src, n), checksumming
+// each piece while it is still in the cache from the copy.
+extern uint32_t extend_copy(uint32_t init_crc, char* dst, const char* src, size_t n);
+
+// Whether extend() uses the CRC32 instructions of the CPU.
+extern bool is_accelerated();
+
 // Return the crc32c of data[0,n-1]
 inline uint32_t value(const char* data, size_t n) {
   return extend(0, data, n);
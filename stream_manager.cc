@@ -0,0 +1,211 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#include "stream_manager.hh"
+#include "db.hh"
+#include "proxy.hh"
+#include "ring.hh"
+#include "message/messaging_service.hh"
+#include "utils/fb_utilities.hh"
+#include "core/future-util.hh"
+#include <boost/range/irange.hpp>
+#include <algorithm>
+namespace redis {
+
+distributed<stream_manager> _the_stream_manager;
+
+static std::vector<gms::inet_address> replicas_of(const ring_snapshot& ring, uint64_t t)
+{
+    std::vector<gms::inet_address> replicas;
+    ring.for_each_replica(t, [&replicas] (const gms::inet_address& endpoint) {
+        replicas.push_back(endpoint);
+    });
+    return replicas;
+}
+
+// The replicas `to` has for the key and `from` has not.
+static std::vector<gms::inet_address> new_replicas(const ring_snapshot& from, const ring_snapshot& to, bytes_view key)
+{
+    if (to.empty()) {
+        return {};
+    }
+    auto t = token_value(key);
+    auto old_replicas = replicas_of(from, t);
+    auto replicas = replicas_of(to, t);
+    replicas.erase(std::remove_if(replicas.begin(), replicas.end(), [&old_replicas] (const gms::inet_address& endpoint) {
+        return std::find(old_replicas.begin(), old_replicas.end(), endpoint) != old_replicas.end();
+    }), replicas.end());
+    return replicas;
+}
+
+// The node sending a key: its first old replica still in the new ring, so
+// that the keys of an endpoint which left come from the other replicas.
+static gms::inet_address source_of(const ring_snapshot& from, const ring_snapshot& to, bytes_view key)
+{
+    auto replicas = replicas_of(from, token_value(key));
+    for (auto& endpoint : replicas) {
+        if (to.contains(endpoint)) {
+            return endpoint;
+        }
+    }
+    return replicas.front();
+}
+
+stream_manager::stream_manager(stream_options options)
+    : _options(options)
+    , _rate_limiter(options._throughput)
+{
+    setup_metrics();
+}
+
+void stream_manager::setup_metrics()
+{
+    namespace sm = seastar::metrics;
+    _metrics.add_group("streaming", {
+        sm::make_counter("keys_total", [this] { return _stats._streamed_keys; }, sm::description("Total number of keys streamed to new replicas.")),
+        sm::make_counter("bytes_total", [this] { return _stats._streamed_bytes; }, sm::description("Total number of bytes streamed to new replicas.")),
+        sm::make_counter("batches_total", [this] { return _stats._sent_batches; }, sm::description("Total number of frames streamed to new replicas.")),
+        sm::make_counter("received_total", [this] { return _stats._received_commands; }, sm::description("Total number of streamed commands applied on this node.")),
+        sm::make_gauge("active", [this] { return _stats._active_sessions; }, sm::description("Number of topology changes streaming from this node.")),
+    });
+}
+
+future<> stream_manager::flush(lw_shared_ptr<session> s, gms::inet_address addr, lw_shared_ptr<destination> d)
+{
+    auto commands = std::move(d->_commands);
+    auto size = d->_bytes;
+    d->_commands.clear();
+    d->_bytes = 0;
+    return _rate_limiter.reserve(size).then([d] {
+        return d->_in_flight.wait(1);
+    }).then([this, s, addr, d, commands = std::move(commands), size] () mutable {
+        ++_stats._sent_batches;
+        _stats._streamed_bytes += size;
+        auto id = netw::msg_addr { addr, 0 };
+        // The frame is applied in the background, the scan goes on as long
+        // as frames in flight leave room.
+        netw::get_local_messaging_service().send_stream_mutations(id, _options._timeout, std::move(commands)).then_wrapped([s, d] (future<> f) {
+            d->_in_flight.signal(1);
+            if (f.failed()) {
+                auto ep = f.get_exception();
+                if (!s->_error) {
+                    s->_error = ep;
+                }
+            }
+        });
+    });
+}
+
+future<> stream_manager::add(lw_shared_ptr<session> s, command cmd)
+{
+    if (cmd.size() < 2) {
+        return make_ready_future<>();
+    }
+    auto replicas = new_replicas(s->_from, s->_to, bytes_view { cmd[1].data(), cmd[1].size() });
+    return do_with(std::move(cmd), std::move(replicas), [this, s] (auto& cmd, auto& replicas) {
+        return do_for_each(replicas, [this, s, &cmd] (const gms::inet_address& addr) {
+            auto& d = s->_destinations[addr];
+            if (!d) {
+                d = make_lw_shared<destination>(_options._max_in_flight_batches);
+            }
+            // A frame ends between keys, so that frames applied concurrently
+            // never interleave the commands of one key.
+            auto f = make_ready_future<>();
+            if (d->_commands.size() >= _options._batch_commands && d->_commands.back()[1] != cmd[1]) {
+                f = flush(s, addr, d);
+            }
+            return f.then([this, &cmd, d] {
+                if (d->_commands.empty() || d->_commands.back()[1] != cmd[1]) {
+                    ++_stats._streamed_keys;
+                }
+                for (auto& arg : cmd) {
+                    d->_bytes += arg.size();
+                }
+                d->_commands.emplace_back(cmd);
+            });
+        });
+    });
+}
+
+future<> stream_manager::stream_shard(lw_shared_ptr<session> s, unsigned cpu)
+{
+    auto me = utils::fb_utilities::get_broadcast_address();
+    return do_with(size_t(0), [this, s, cpu, me] (size_t& cursor) {
+        return repeat([this, s, cpu, me, &cursor] {
+            auto from = &s->_from;
+            auto to = &s->_to;
+            return get_database().invoke_on(cpu, [cursor, count = _options._batch_commands, from, to, me] (database& db) {
+                // The rings only are read here, while the session waits.
+                return db.dump_direct(cursor, count, [from, to, me] (bytes_view key) {
+                    return source_of(*from, *to, key) == me && !new_replicas(*from, *to, key).empty();
+                });
+            }).then([this, s, &cursor] (foreign_ptr<lw_shared_ptr<database::dump_result_type>> result) {
+                cursor = result->first;
+                return do_for_each(result->second, [this, s] (command& cmd) {
+                    return add(s, std::move(cmd));
+                }).then([&cursor, result = std::move(result)] {
+                    return cursor == 0 ? stop_iteration::yes : stop_iteration::no;
+                });
+            });
+        });
+    });
+}
+
+future<> stream_manager::stream_ranges(const ring_snapshot& from, const ring_snapshot& to)
+{
+    auto s = make_lw_shared<session>(from, to);
+    ++_stats._active_sessions;
+    return do_for_each(boost::irange<unsigned>(0, smp::count), [this, s] (unsigned cpu) {
+        return stream_shard(s, cpu);
+    }).then([this, s] {
+        return parallel_for_each(s->_destinations, [this, s] (auto& e) {
+            auto d = e.second;
+            auto f = d->_commands.empty() ? make_ready_future<>() : this->flush(s, e.first, d);
+            // Every frame is applied once all the units are back.
+            return f.then([this, d] {
+                return d->_in_flight.wait(_options._max_in_flight_batches).then([this, d] {
+                    d->_in_flight.signal(_options._max_in_flight_batches);
+                });
+            });
+        });
+    }).finally([this, s] {
+        --_stats._active_sessions;
+    }).then([s] {
+        if (s->_error) {
+            return make_exception_future<>(s->_error);
+        }
+        return make_ready_future<>();
+    });
+}
+
+void stream_manager::init_messaging_service()
+{
+    netw::get_local_messaging_service().register_stream_mutations([this] (const rpc::client_info& cinfo, std::vector<command> commands) {
+        _stats._received_commands += commands.size();
+        return proxy::execute_batch(std::move(commands)).discard_result();
+    });
+}
+
+future<> stream_manager::stop()
+{
+    netw::get_local_messaging_service().unregister_stream_mutations();
+    return make_ready_future<>();
+}
+}
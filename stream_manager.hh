@@ -0,0 +1,102 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#pragma once
+#include "core/distributed.hh"
+#include "core/semaphore.hh"
+#include <seastar/core/metrics.hh>
+#include "gms/inet_address.hh"
+#include "utils/bytes.hh"
+#include "utils/rate_limiter.hh"
+#include <unordered_map>
+#include <vector>
+namespace redis {
+class ring_snapshot;
+class stream_manager;
+extern distributed<stream_manager> _the_stream_manager;
+
+inline distributed<stream_manager>& get_stream_manager() {
+    return _the_stream_manager;
+}
+
+inline stream_manager& get_local_stream_manager() {
+    return _the_stream_manager.local();
+}
+
+struct stream_options {
+    // Commands of one frame, the commands of a key are never split.
+    size_t _batch_commands = 512;
+    // Frames sent to one endpoint and not yet applied, the scan waits for
+    // room beyond them.
+    size_t _max_in_flight_batches = 4;
+    // Bytes streamed per second by this shard, 0 for no limit.
+    size_t _throughput = 0;
+    std::chrono::milliseconds _timeout { 10000 };
+};
+
+struct stream_stats {
+    uint64_t _streamed_keys = 0;
+    uint64_t _streamed_bytes = 0;
+    uint64_t _sent_batches = 0;
+    uint64_t _received_commands = 0;
+    uint64_t _active_sessions = 0;
+};
+
+// Moves the keys of the ranges a topology change hands to other endpoints.
+// The first replica of a key in the old ring which is still in the new one
+// sends it, as the commands rebuilding it, to every replica the new ring
+// adds for it. The
+// writes which arrive meanwhile reach the new replicas too, see
+// ring::get_replica_nodes_for_write().
+class stream_manager : public seastar::async_sharded_service<stream_manager> {
+    using command = std::vector<bytes>;
+    struct destination {
+        std::vector<command> _commands;
+        size_t _bytes = 0;
+        semaphore _in_flight;
+        explicit destination(size_t max_in_flight) : _in_flight(max_in_flight) {}
+    };
+    struct session {
+        const ring_snapshot& _from;
+        const ring_snapshot& _to;
+        std::unordered_map<gms::inet_address, lw_shared_ptr<destination>> _destinations;
+        std::exception_ptr _error;
+        session(const ring_snapshot& from, const ring_snapshot& to) : _from(from), _to(to) {}
+    };
+    stream_options _options;
+    stream_stats _stats;
+    utils::rate_limiter _rate_limiter;
+    seastar::metrics::metric_groups _metrics;
+private:
+    void setup_metrics();
+    future<> stream_shard(lw_shared_ptr<session> s, unsigned cpu);
+    future<> add(lw_shared_ptr<session> s, command cmd);
+    future<> flush(lw_shared_ptr<session> s, gms::inet_address addr, lw_shared_ptr<destination> d);
+public:
+    stream_manager(stream_options options = stream_options {});
+
+    // Streams the keys which move from `from` to `to`, resolves once they
+    // are applied by their new replicas. Both rings outlive the call.
+    future<> stream_ranges(const ring_snapshot& from, const ring_snapshot& to);
+    const stream_stats& stats() const { return _stats; }
+    void init_messaging_service();
+    future<> stop();
+};
+}
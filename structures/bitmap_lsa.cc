@@ -0,0 +1,468 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#include "bitmap_lsa.hh"
+#include "bits_operation.hh"
+#include <algorithm>
+namespace redis {
+
+static const char zeroes[bitmap_lsa::page_size] = {};
+
+namespace {
+
+inline uint8_t bit_mask(uint32_t bit)
+{
+    return uint8_t(0x80 >> (bit & 0x7));
+}
+
+void offsets_to_bytes(const uint16_t* offsets, uint32_t count, char* out)
+{
+    std::memset(out, 0, bitmap_lsa::page_size);
+    for (uint32_t i = 0; i < count; ++i) {
+        out[offsets[i] >> 3] |= bit_mask(offsets[i]);
+    }
+}
+
+// Writes the offsets of the bits set in the page_size bytes at `data` to
+// `out`, in order. Words of zeroes are skipped whole.
+void bytes_to_offsets(const char* data, uint16_t* out)
+{
+    for (size_t i = 0; i < bitmap_lsa::page_size; i += 8) {
+        uint64_t w;
+        std::memcpy(&w, data + i, sizeof(w));
+        if (w == 0) {
+            continue;
+        }
+        for (size_t k = i; k < i + 8; ++k) {
+            auto b = static_cast<unsigned>(static_cast<uint8_t>(data[k]));
+            while (b) {
+                auto lead = __builtin_clz(b) - 24;
+                *out++ = static_cast<uint16_t>(k * 8 + lead);
+                b &= ~(0x80u >> lead);
+            }
+        }
+    }
+}
+
+void copy_page(bitmap_container kind, const char* data, uint32_t count, char* out)
+{
+    switch (kind) {
+    case bitmap_container::full:
+        std::memset(out, 0xff, bitmap_lsa::page_size);
+        break;
+    case bitmap_container::bitmap:
+        std::memcpy(out, data, bitmap_lsa::page_size);
+        break;
+    case bitmap_container::array:
+        offsets_to_bytes(reinterpret_cast<const uint16_t*>(data), count, out);
+        break;
+    }
+}
+}
+
+void bitmap_page::copy_bytes(char* out) const
+{
+    copy_page(_kind, _data.begin(), _count, out);
+}
+
+bitmap_page bitmap_page::of_bytes(uint32_t index, const char* data)
+{
+    bitmap_page p;
+    p._index = index;
+    p._count = static_cast<uint32_t>(bits_operation::popcount(data, bitmap_lsa::page_size));
+    if (p._count == bitmap_lsa::page_bits) {
+        p._kind = bitmap_container::full;
+    }
+    else if (p._count > bitmap_lsa::array_max) {
+        p._kind = bitmap_container::bitmap;
+        p._data = bytes(data, bitmap_lsa::page_size);
+    }
+    else if (p._count > 0) {
+        p._data = bytes(bytes::initialized_later(), p._count * sizeof(uint16_t));
+        bytes_to_offsets(data, reinterpret_cast<uint16_t*>(p._data.begin()));
+    }
+    return p;
+}
+
+sparse_bitmap sparse_bitmap::of_bytes(bytes_view v)
+{
+    sparse_bitmap r;
+    r._size = v.size();
+    char buffer[bitmap_lsa::page_size];
+    for (size_t first = 0; first < v.size(); first += bitmap_lsa::page_size) {
+        auto n = std::min(bitmap_lsa::page_size, v.size() - first);
+        auto data = v.data() + first;
+        if (n < bitmap_lsa::page_size) {
+            std::memcpy(buffer, data, n);
+            std::memset(buffer + n, 0, bitmap_lsa::page_size - n);
+            data = buffer;
+        }
+        auto p = bitmap_page::of_bytes(static_cast<uint32_t>(first / bitmap_lsa::page_size), data);
+        if (p._count > 0) {
+            r._pages.push_back(std::move(p));
+        }
+    }
+    return r;
+}
+
+bytes sparse_bitmap::to_bytes() const
+{
+    bytes result(bytes::initialized_later(), _size);
+    std::memset(result.begin(), 0, _size);
+    char buffer[bitmap_lsa::page_size];
+    for (auto& p : _pages) {
+        auto first = p._index * bitmap_lsa::page_size;
+        if (first >= _size) {
+            break;
+        }
+        p.copy_bytes(buffer);
+        std::memcpy(result.begin() + first, buffer, std::min(bitmap_lsa::page_size, _size - first));
+    }
+    return result;
+}
+
+const char* bitmap_lsa::zero_page()
+{
+    return zeroes;
+}
+
+bool bitmap_lsa::page::get(uint32_t bit) const
+{
+    switch (_kind) {
+    case bitmap_container::full:
+        return true;
+    case bitmap_container::bitmap:
+        return _data[bit >> 3] & bit_mask(bit);
+    default:
+        return std::binary_search(offsets(), offsets() + _count, static_cast<uint16_t>(bit));
+    }
+}
+
+void bitmap_lsa::page::copy_bytes(char* out) const
+{
+    copy_page(_kind, _data.begin(), _count, out);
+}
+
+bitmap_lsa::bitmap_lsa(const managed_bytes& o)
+{
+    // a page is converted once all its bytes are seen, as they may span
+    // fragments.
+    char buffer[page_size];
+    size_t filled = 0;
+    uint32_t index = 0;
+    auto flush = [this, &buffer, &filled, &index] {
+        std::memset(buffer + filled, 0, page_size - filled);
+        auto p = bitmap_page::of_bytes(index++, buffer);
+        if (p._count > 0) {
+            insert_page(p);
+        }
+        filled = 0;
+    };
+    try {
+        o.for_each_fragment([&] (bytes_view f) {
+            while (!f.empty()) {
+                auto n = std::min(f.size(), page_size - filled);
+                std::memcpy(buffer + filled, f.data(), n);
+                filled += n;
+                f.remove_prefix(n);
+                if (filled == page_size) {
+                    flush();
+                }
+            }
+        });
+        if (filled > 0) {
+            flush();
+        }
+    } catch (...) {
+        _pages.clear_and_dispose(current_deleter<page>());
+        throw;
+    }
+    _size = o.size();
+}
+
+bitmap_lsa::bitmap_lsa(const sparse_bitmap& o)
+{
+    try {
+        for (auto& p : o._pages) {
+            insert_page(p);
+        }
+    } catch (...) {
+        _pages.clear_and_dispose(current_deleter<page>());
+        throw;
+    }
+    _size = o._size;
+}
+
+bitmap_lsa::~bitmap_lsa()
+{
+    _pages.clear_and_dispose(current_deleter<page>());
+}
+
+void bitmap_lsa::insert_page(const bitmap_page& p)
+{
+    managed_bytes data(bytes_view { p._data.begin(), p._data.size() });
+    auto n = current_allocator().construct<page>(p._index, p._kind, p._count, std::move(data));
+    _pages.insert(_pages.end(), *n);
+}
+
+void bitmap_lsa::to_bitmap(page& p)
+{
+    managed_bytes data(managed_bytes::initialized_later(), page_size);
+    p.copy_bytes(data.begin());
+    p._data = std::move(data);
+    p._kind = bitmap_container::bitmap;
+}
+
+void bitmap_lsa::to_array(page& p)
+{
+    auto capacity = std::max<size_t>(4, std::min<size_t>(p._count * 2, array_max));
+    managed_bytes data(managed_bytes::initialized_later(), capacity * sizeof(uint16_t));
+    bytes_to_offsets(p._data.begin(), reinterpret_cast<uint16_t*>(data.begin()));
+    p._data = std::move(data);
+    p._kind = bitmap_container::array;
+}
+
+bool bitmap_lsa::set_in_page(page& p, uint32_t bit, bool value)
+{
+    if (p._kind == bitmap_container::full) {
+        if (value) {
+            return true;
+        }
+        to_bitmap(p);
+    }
+    if (p._kind == bitmap_container::bitmap) {
+        auto& byte = p._data[bit >> 3];
+        auto mask = bit_mask(bit);
+        bool old = byte & mask;
+        if (old == value) {
+            return old;
+        }
+        byte ^= mask;
+        if (value && ++p._count == page_bits) {
+            p._data = managed_bytes();
+            p._kind = bitmap_container::full;
+        }
+        // a page only turns back into an array well below array_max, so
+        // that a bit set and cleared at the limit converts nothing.
+        else if (!value && --p._count < array_max / 2 && p._count > 0) {
+            to_array(p);
+        }
+        return old;
+    }
+    auto begin = p.offsets(), end = begin + p._count;
+    auto i = std::lower_bound(begin, end, static_cast<uint16_t>(bit));
+    bool old = i != end && *i == bit;
+    if (old == value) {
+        return old;
+    }
+    if (!value) {
+        std::memmove(i, i + 1, (end - i - 1) * sizeof(uint16_t));
+        --p._count;
+        return old;
+    }
+    if (p._count == array_max) {
+        to_bitmap(p);
+        return set_in_page(p, bit, value);
+    }
+    auto at = i - begin;
+    if ((p._count + 1) * sizeof(uint16_t) > p._data.size()) {
+        managed_bytes data(managed_bytes::initialized_later(), std::min(p._data.size() * 2, page_size));
+        std::memcpy(data.begin(), p._data.begin(), p._count * sizeof(uint16_t));
+        p._data = std::move(data);
+    }
+    auto offsets = p.offsets();
+    std::memmove(offsets + at + 1, offsets + at, (p._count - at) * sizeof(uint16_t));
+    offsets[at] = static_cast<uint16_t>(bit);
+    ++p._count;
+    return old;
+}
+
+bool bitmap_lsa::set(size_t offset, bool value)
+{
+    auto index = static_cast<uint32_t>(offset / page_bits);
+    auto bit = static_cast<uint32_t>(offset % page_bits);
+    page_set_type::insert_commit_data commit;
+    auto r = _pages.insert_check(index, page::compare(), commit);
+    if (r.second) {
+        if (!value) {
+            return false;
+        }
+        // the offsets of a new array start inline in its managed_bytes.
+        managed_bytes data(managed_bytes::initialized_later(), 4 * sizeof(uint16_t));
+        auto p = current_allocator().construct<page>(index, bitmap_container::array, 1, std::move(data));
+        p->offsets()[0] = static_cast<uint16_t>(bit);
+        _pages.insert_commit(*p, commit);
+        return false;
+    }
+    auto& p = *r.first;
+    auto old = set_in_page(p, bit, value);
+    if (p._count == 0) {
+        _pages.erase_and_dispose(_pages.iterator_to(p), current_deleter<page>());
+    }
+    return old;
+}
+
+char bitmap_lsa::operator [] (size_t i) const
+{
+    auto p = find_page(i / page_size);
+    if (p == nullptr) {
+        return 0;
+    }
+    auto byte = i % page_size;
+    switch (p->_kind) {
+    case bitmap_container::full:
+        return static_cast<char>(0xff);
+    case bitmap_container::bitmap:
+        return p->_data[byte];
+    default:
+        break;
+    }
+    auto first = static_cast<uint16_t>(byte * 8);
+    auto end = p->offsets() + p->_count;
+    uint8_t b = 0;
+    for (auto o = std::lower_bound(p->offsets(), end, first); o != end && *o < first + 8; ++o) {
+        b |= bit_mask(*o);
+    }
+    return static_cast<char>(b);
+}
+
+void bitmap_lsa::set_byte(size_t i, char b)
+{
+    auto changed = static_cast<uint8_t>((*this)[i] ^ b);
+    for (uint32_t k = 0; k < 8; ++k) {
+        if (changed & bit_mask(k)) {
+            set(i * 8 + k, b & bit_mask(k));
+        }
+    }
+}
+
+size_t bitmap_lsa::count(size_t start, size_t end) const
+{
+    // the pages never written hold no bit, those wholly in the range have
+    // their count.
+    size_t n = 0;
+    for (auto i = _pages.lower_bound(static_cast<uint32_t>(start / page_size), page::compare()); i != _pages.end(); ++i) {
+        size_t first = i->_index * page_size;
+        if (first > end) {
+            break;
+        }
+        auto from = std::max(first, start), to = std::min(first + page_size, end + 1);
+        if (from == first && to == first + page_size) {
+            n += i->_count;
+            continue;
+        }
+        switch (i->_kind) {
+        case bitmap_container::full:
+            n += (to - from) * 8;
+            break;
+        case bitmap_container::bitmap:
+            n += bits_operation::popcount(i->_data.begin() + (from - first), to - from);
+            break;
+        case bitmap_container::array: {
+            auto b = i->offsets(), e = b + i->_count;
+            n += std::lower_bound(b, e, (to - first) * 8) - std::lower_bound(b, e, (from - first) * 8);
+            break;
+        }
+        }
+    }
+    return n;
+}
+
+long bitmap_lsa::first_in_page(const page& p, bool bit, uint32_t from, uint32_t to)
+{
+    switch (p._kind) {
+    case bitmap_container::full:
+        return bit ? from : -1;
+    case bitmap_container::bitmap: {
+        auto b = bits_operation::first_bit(p._data.begin() + from / 8, (to - from) / 8, bit);
+        return b < 0 ? -1 : from + b;
+    }
+    default:
+        break;
+    }
+    auto end = p.offsets() + p._count;
+    auto o = std::lower_bound(p.offsets(), end, from);
+    if (bit) {
+        return o != end && *o < to ? *o : -1;
+    }
+    // the first clear bit is the first gap in the offsets.
+    auto candidate = from;
+    for (; o != end && *o == candidate; ++o) {
+        ++candidate;
+    }
+    return candidate < to ? candidate : -1;
+}
+
+long bitmap_lsa::position(bool bit, size_t start, size_t end) const
+{
+    // a set bit is only in the pages written, a clear one in the first
+    // page never written, unless a written page has one before.
+    size_t next = start;
+    for (auto i = _pages.lower_bound(static_cast<uint32_t>(start / page_size), page::compare()); i != _pages.end(); ++i) {
+        size_t first = i->_index * page_size;
+        if (first > end) {
+            break;
+        }
+        auto from = std::max(first, start), to = std::min(first + page_size, end + 1);
+        if (!bit && from > next) {
+            return static_cast<long>(next * 8);
+        }
+        auto b = first_in_page(*i, bit, (from - first) * 8, (to - first) * 8);
+        if (b >= 0) {
+            return static_cast<long>(first * 8) + b;
+        }
+        next = to;
+    }
+    if (!bit && next <= end) {
+        return static_cast<long>(next * 8);
+    }
+    return -1;
+}
+
+sparse_bitmap bitmap_lsa::copy() const
+{
+    sparse_bitmap r;
+    r._size = _size;
+    r._pages.reserve(_pages.size());
+    for (auto& p : _pages) {
+        bitmap_page c;
+        c._index = p._index;
+        c._kind = p._kind;
+        c._count = p._count;
+        if (p._kind == bitmap_container::array) {
+            c._data = bytes(p._data.begin(), p._count * sizeof(uint16_t));
+        }
+        else if (p._kind == bitmap_container::bitmap) {
+            c._data = bytes(p._data.begin(), page_size);
+        }
+        r._pages.push_back(std::move(c));
+    }
+    return r;
+}
+
+size_t bitmap_lsa::memory_usage() const
+{
+    size_t n = 0;
+    for (auto& p : _pages) {
+        n += current_allocator().object_memory_size_in_allocator(&p) + p._data.external_memory_usage();
+    }
+    return n;
+}
+}
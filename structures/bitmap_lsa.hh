@@ -0,0 +1,206 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#pragma once
+#include <boost/intrusive/set.hpp>
+#include "utils/allocation_strategy.hh"
+#include "utils/managed_bytes.hh"
+#include "utils/bytes.hh"
+#include <cstring>
+#include <vector>
+namespace redis {
+// The forms of a page of a bitmap, after Roaring bitmaps (Chambi, Lemire,
+// Kaser and Godin, "Better bitmap performance with Roaring bitmaps"): the
+// sorted offsets of its bits set while they are few, its bytes once they
+// are many, nothing once they all are.
+enum class bitmap_container : uint8_t { array, bitmap, full };
+
+// A page of a bitmap out of the region, as BITOP gathers and combines them.
+struct bitmap_page {
+    uint32_t _index = 0;
+    bitmap_container _kind = bitmap_container::array;
+    uint32_t _count = 0;
+    // The uint16_t offsets of an array, the bytes of a bitmap.
+    bytes _data;
+
+    const uint16_t* offsets() const
+    {
+        return reinterpret_cast<const uint16_t*>(_data.begin());
+    }
+    // Writes the page_size bytes of the page to `out`.
+    void copy_bytes(char* out) const;
+    // The page of the page_size bytes at `data`, in its smallest form. Its
+    // _count is 0 if they are all zeroes.
+    static bitmap_page of_bytes(uint32_t index, const char* data);
+};
+
+// A bitmap out of the region: its size in bytes and the pages holding a bit
+// set, by index.
+struct sparse_bitmap {
+    size_t _size = 0;
+    std::vector<bitmap_page> _pages;
+
+    static sparse_bitmap of_bytes(bytes_view v);
+    bytes to_bytes() const;
+};
+
+// A string value in pages of page_size bytes, each an object of the region,
+// for bitmaps SETBIT grows past one page. Pages are only allocated once a
+// bit of theirs is set, the bytes of the others read as zeroes, so that a
+// bit set at a large offset costs one page and growing the value copies
+// nothing. A page keeps the offsets of its bits while there are at most
+// array_max of them, so a sparse bitmap takes two bytes a bit.
+class bitmap_lsa {
+public:
+    static constexpr size_t page_size = 4096;
+    static constexpr size_t page_bits = page_size * 8;
+    // The offsets of an array take no more than the bytes of a bitmap.
+    static constexpr size_t array_max = page_size / sizeof(uint16_t);
+private:
+    struct page {
+        boost::intrusive::set_member_hook<> _link;
+        uint32_t _index;
+        bitmap_container _kind;
+        uint32_t _count;
+        // The offsets of an array, in a buffer grown twice as large at a
+        // time; the bytes of a bitmap; nothing if full.
+        managed_bytes _data;
+
+        page(uint32_t index, bitmap_container kind, uint32_t count, managed_bytes data) noexcept
+            : _link(), _index(index), _kind(kind), _count(count), _data(std::move(data))
+        {
+        }
+        page(page&& o) noexcept : _link(), _index(o._index), _kind(o._kind), _count(o._count), _data(std::move(o._data))
+        {
+            _link.swap_nodes(o._link);
+        }
+        uint16_t* offsets()
+        {
+            return reinterpret_cast<uint16_t*>(_data.begin());
+        }
+        const uint16_t* offsets() const
+        {
+            return reinterpret_cast<const uint16_t*>(_data.begin());
+        }
+        bool get(uint32_t bit) const;
+        // Writes the page_size bytes of the page to `out`.
+        void copy_bytes(char* out) const;
+        struct compare {
+            bool operator () (const page& l, const page& r) const { return l._index < r._index; }
+            bool operator () (uint32_t l, const page& r) const { return l < r._index; }
+            bool operator () (const page& l, uint32_t r) const { return l._index < r; }
+        };
+    };
+    using page_set_type = boost::intrusive::set<page,
+        boost::intrusive::member_hook<page, boost::intrusive::set_member_hook<>, &page::_link>,
+        boost::intrusive::compare<page::compare>,
+        boost::intrusive::constant_time_size<true>>;
+    page_set_type _pages;
+    size_t _size = 0;
+
+    const page* find_page(size_t index) const
+    {
+        auto i = _pages.find(static_cast<uint32_t>(index), page::compare());
+        return i == _pages.end() ? nullptr : &*i;
+    }
+    void insert_page(const bitmap_page& p);
+    void to_bitmap(page& p);
+    void to_array(page& p);
+    // Sets or clears the bit of the page, returns its old value.
+    bool set_in_page(page& p, uint32_t bit, bool value);
+    // The first bit equal to `bit` in the bits [from, to) of the page, or -1.
+    static long first_in_page(const page& p, bool bit, uint32_t from, uint32_t to);
+public:
+    bitmap_lsa() noexcept {}
+    // A copy of the bytes, the pages of zeroes left out.
+    explicit bitmap_lsa(const managed_bytes& o);
+    explicit bitmap_lsa(const sparse_bitmap& o);
+    bitmap_lsa(bitmap_lsa&& o) noexcept : _pages(std::move(o._pages)), _size(o._size)
+    {
+        o._size = 0;
+    }
+    ~bitmap_lsa();
+
+    size_t size() const { return _size; }
+    size_t pages() const { return _pages.size(); }
+    // Grows the value to `size` bytes of zeroes, allocating nothing.
+    void grow(size_t size)
+    {
+        _size = std::max(_size, size);
+    }
+    // The bit at `offset`, numbered from the most significant bit of the
+    // first byte, which must be less than size() * 8.
+    bool get(size_t offset) const
+    {
+        auto p = find_page(offset / page_bits);
+        return p && p->get(offset % page_bits);
+    }
+    // Sets or clears the bit at `offset`, which must be less than
+    // size() * 8. Returns its old value.
+    bool set(size_t offset, bool value);
+    // The byte at `i`, which must be less than size().
+    char operator [] (size_t i) const;
+    // Writes the byte at `i`, which must be less than size().
+    void set_byte(size_t i, char b);
+    // Bits set in the bytes [start, end].
+    size_t count(size_t start, size_t end) const;
+    // The first bit equal to `bit` in the bytes [start, end], or -1.
+    long position(bool bit, size_t start, size_t end) const;
+    // The value out of the region, as BITOP reads it.
+    sparse_bitmap copy() const;
+
+    // Passes the bytes of the value to func(bytes_view), those of the
+    // absent pages as views of zeroes, those of the arrays through a copy.
+    template <typename Func>
+    void for_each_fragment(Func&& func) const
+    {
+        size_t position = 0;
+        auto zeroes_until = [&func, &position] (size_t end) {
+            while (position < end) {
+                auto n = std::min(end - position, page_size);
+                func(bytes_view { zero_page(), n });
+                position += n;
+            }
+        };
+        char buffer[page_size];
+        for (auto& p : _pages) {
+            auto first = p._index * page_size;
+            if (first >= _size) {
+                break;
+            }
+            zeroes_until(first);
+            auto n = std::min(page_size, _size - first);
+            if (p._kind == bitmap_container::bitmap) {
+                func(bytes_view { p._data.begin(), n });
+            }
+            else {
+                p.copy_bytes(buffer);
+                func(bytes_view { buffer, n });
+            }
+            position = first + n;
+        }
+        zeroes_until(_size);
+    }
+    // Bytes the pages take in the current allocator.
+    size_t memory_usage() const;
+
+    static const char* zero_page();
+};
+}
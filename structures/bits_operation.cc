@@ -19,41 +19,212 @@
 *
 */
 #include "bits_operation.hh"
+#include "bitmap_lsa.hh"
 #include "core/stream.hh"
 #include "core/memory.hh"
 #include "core/shared_ptr.hh"
 #include "core/sharded.hh"
 #include "keys.hh"
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+#include <limits>
+#include <immintrin.h>
 namespace redis {
-// 512M bytes
-static const size_t MAX_BYTE_COUNT = 1024 * 1024 * 512 - 1;
-static const size_t RESIZE_STEP    = 16;
 
-bool bits_operation::set(managed_bytes& o, size_t offset, bool value)
+namespace {
+
+inline uint64_t load_word(const char* p)
+{
+    uint64_t w;
+    std::memcpy(&w, p, sizeof(w));
+    return w;
+}
+
+inline void store_word(char* p, uint64_t w)
+{
+    std::memcpy(p, &w, sizeof(w));
+}
+
+size_t popcount_words(const char* p, size_t size)
+{
+    // Four counters keep several popcnt in flight.
+    uint64_t c0 = 0, c1 = 0, c2 = 0, c3 = 0;
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        c0 += __builtin_popcountll(load_word(p + i));
+        c1 += __builtin_popcountll(load_word(p + i + 8));
+        c2 += __builtin_popcountll(load_word(p + i + 16));
+        c3 += __builtin_popcountll(load_word(p + i + 24));
+    }
+    for (; i + 8 <= size; i += 8) {
+        c0 += __builtin_popcountll(load_word(p + i));
+    }
+    for (; i < size; ++i) {
+        c1 += __builtin_popcount(static_cast<uint8_t>(p[i]));
+    }
+    return c0 + c1 + c2 + c3;
+}
+
+// Harley-Seal over 256 bit vectors, see Muła, Kurz and Lemire, "Faster
+// Population Counts Using AVX2 Instructions": carry-save adders reduce 16
+// vectors to one whose bits are counted with a nibble lookup table.
+[[gnu::target("avx2")]]
+inline __m256i popcount256(__m256i v)
+{
+    const __m256i lookup = _mm256_setr_epi8(
+        0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+        0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low_mask = _mm256_set1_epi8(0x0f);
+    auto lo = _mm256_and_si256(v, low_mask);
+    auto hi = _mm256_and_si256(_mm256_srli_epi32(v, 4), low_mask);
+    auto counts = _mm256_add_epi8(_mm256_shuffle_epi8(lookup, lo), _mm256_shuffle_epi8(lookup, hi));
+    return _mm256_sad_epu8(counts, _mm256_setzero_si256());
+}
+
+[[gnu::target("avx2")]]
+inline void csa(__m256i& h, __m256i& l, __m256i a, __m256i b, __m256i c)
+{
+    auto u = _mm256_xor_si256(a, b);
+    h = _mm256_or_si256(_mm256_and_si256(a, b), _mm256_and_si256(u, c));
+    l = _mm256_xor_si256(u, c);
+}
+
+[[gnu::target("avx2")]]
+inline __m256i load_vector(const char* p, size_t i)
+{
+    return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i * 32));
+}
+
+[[gnu::target("avx2")]]
+size_t popcount_avx2(const char* p, size_t size)
+{
+    auto vectors = size / 32;
+    auto total = _mm256_setzero_si256();
+    auto ones = _mm256_setzero_si256(), twos = ones, fours = ones, eights = ones, sixteens = ones;
+    __m256i twos_a, twos_b, fours_a, fours_b, eights_a, eights_b;
+    size_t i = 0;
+    for (; i + 16 <= vectors; i += 16) {
+        csa(twos_a, ones, ones, load_vector(p, i), load_vector(p, i + 1));
+        csa(twos_b, ones, ones, load_vector(p, i + 2), load_vector(p, i + 3));
+        csa(fours_a, twos, twos, twos_a, twos_b);
+        csa(twos_a, ones, ones, load_vector(p, i + 4), load_vector(p, i + 5));
+        csa(twos_b, ones, ones, load_vector(p, i + 6), load_vector(p, i + 7));
+        csa(fours_b, twos, twos, twos_a, twos_b);
+        csa(eights_a, fours, fours, fours_a, fours_b);
+        csa(twos_a, ones, ones, load_vector(p, i + 8), load_vector(p, i + 9));
+        csa(twos_b, ones, ones, load_vector(p, i + 10), load_vector(p, i + 11));
+        csa(fours_a, twos, twos, twos_a, twos_b);
+        csa(twos_a, ones, ones, load_vector(p, i + 12), load_vector(p, i + 13));
+        csa(twos_b, ones, ones, load_vector(p, i + 14), load_vector(p, i + 15));
+        csa(fours_b, twos, twos, twos_a, twos_b);
+        csa(eights_b, fours, fours, fours_a, fours_b);
+        csa(sixteens, eights, eights, eights_a, eights_b);
+        total = _mm256_add_epi64(total, popcount256(sixteens));
+    }
+    total = _mm256_slli_epi64(total, 4);
+    total = _mm256_add_epi64(total, _mm256_slli_epi64(popcount256(eights), 3));
+    total = _mm256_add_epi64(total, _mm256_slli_epi64(popcount256(fours), 2));
+    total = _mm256_add_epi64(total, _mm256_slli_epi64(popcount256(twos), 1));
+    total = _mm256_add_epi64(total, popcount256(ones));
+    for (; i < vectors; ++i) {
+        total = _mm256_add_epi64(total, popcount256(load_vector(p, i)));
+    }
+    uint64_t lanes[4];
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), total);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + popcount_words(p + vectors * 32, size - vectors * 32);
+}
+
+using popcount_function = size_t (*)(const char*, size_t);
+
+popcount_function select_popcount()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") ? popcount_avx2 : popcount_words;
+}
+
+// Normalizes the byte range [start, end] of a `size` bytes value, as
+// BITCOUNT and BITPOS do. Returns false if the range is empty.
+bool normalize_range(size_t size, long& start, long& end)
+{
+    auto n = static_cast<long>(size);
+    if (start < 0) start += n;
+    if (end < 0) end += n;
+    if (start < 0) start = 0;
+    if (end < 0) end = 0;
+    if (end >= n) end = n - 1;
+    return n > 0 && start <= end;
+}
+
+// Calls func(const char* data, size_t size, size_t position) for the parts
+// of the fragments of `o` within the bytes [start, end], until it returns
+// false.
+template <typename Func>
+void for_each_range_fragment(const managed_bytes& o, size_t start, size_t end, Func&& func)
+{
+    size_t position = 0;
+    bool more = true;
+    o.for_each_fragment([&] (bytes_view f) {
+        auto first = position, last = position + f.size();
+        position = last;
+        if (!more || last <= start || first > end) {
+            return;
+        }
+        auto from = std::max(first, start), to = std::min(last, end + 1);
+        more = func(f.data() + (from - first), to - from, from);
+    });
+}
+
+inline int first_bit_of_byte(uint8_t byte, bool bit)
+{
+    if (!bit) {
+        byte = ~byte;
+    }
+    return byte == 0 ? -1 : __builtin_clz(static_cast<unsigned>(byte)) - 24;
+}
+
+inline void grow_value(managed_bytes& o, size_t size)
+{
+    bits_operation::grow(o, size);
+}
+
+inline void grow_value(bitmap_lsa& o, size_t size)
+{
+    o.grow(size);
+}
+
+inline void store_byte(managed_bytes& o, size_t i, uint8_t b)
+{
+    o[i] = b;
+}
+
+inline void store_byte(bitmap_lsa& o, size_t i, uint8_t b)
+{
+    o.set_byte(i, b);
+}
+
+bool set_bit(managed_bytes& o, size_t offset, bool value)
 {
     auto index = offset >> 3;
     if (index >= o.size()) {
-        size_t append_size = RESIZE_STEP;
-        while (append_size < index) append_size+= RESIZE_STEP;
-        if (append_size < 64) {
-            append_size = 64;
-        }
-        //o.extend(append_size, 0);
+        grow_value(o, index + 1);
     }
-    uint8_t byte_val = uint8_t(o[index]);
     auto bit = 7 - (offset & 0x7);
+    uint8_t byte_val = uint8_t(static_cast<const managed_bytes&>(o)[index]);
     auto bit_val = byte_val & (1 << bit);
-
+    if (bool(bit_val) == value) {
+        return bit_val > 0;
+    }
     byte_val &= ~(1 << bit);
     byte_val |= ((value ? 0x1 : 0x0) << bit);
     o[index] = byte_val;
     return bit_val > 0;
 }
 
-bool bits_operation::get(const managed_bytes& o, size_t offset)
+bool get_bit(const managed_bytes& o, size_t offset)
 {
     auto offset_in_bytes = offset >> 3;
-    if (offset_in_bytes > BITMAP_MAX_OFFSET || offset_in_bytes >= o.size()) {
+    if (offset > BITMAP_MAX_OFFSET || offset_in_bytes >= o.size()) {
         return false;
     }
     uint8_t byte_val = uint8_t(o[offset_in_bytes]);
@@ -62,72 +233,527 @@ bool bits_operation::get(const managed_bytes& o, size_t offset)
     return bit_val > 0;
 }
 
-size_t bits_operation::count(const managed_bytes& o, long start, long end)
+// BITFIELD indexes a value a byte at a time, whether it is a managed_bytes
+// or a bitmap_lsa. A field spans at most 9 bytes, each read or written
+// once: indexing a fragmented value walks its fragments, a paged one looks
+// up its page.
+template <typename Value>
+uint64_t get_raw_field(const Value& o, size_t offset, unsigned bits)
 {
-    if (start < 0) start = static_cast<size_t>(start) + o.size();
-    if (end < 0) end = static_cast<size_t>(end) + o.size();
-    if (start < 0) start = 0;
-    if (end < 0) end = 0;
-    if (end >= static_cast<long>(o.size())) end = static_cast<long>(o.size()) - 1;
-    size_t bits_count = 0, count = static_cast<size_t>(end - start) + 1;
-    size_t p = start /*, p4 = 0 */;
-    static const unsigned char bits_in_byte[256] = {
-        0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4,1,2,2,3,2,3,3,4,2,3,3,4,3,4,4,5,
-        1,2,2,3,2,3,3,4,2,3,3,4,3,4,4,5,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,
-        1,2,2,3,2,3,3,4,2,3,3,4,3,4,4,5,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,
-        2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,3,4,4,5,4,5,5,6,4,5,5,6,5,6,6,7,
-        1,2,2,3,2,3,3,4,2,3,3,4,3,4,4,5,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,
-        2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,3,4,4,5,4,5,5,6,4,5,5,6,5,6,6,7,
-        2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,3,4,4,5,4,5,5,6,4,5,5,6,5,6,6,7,
-        3,4,4,5,4,5,5,6,4,5,5,6,5,6,6,7,4,5,5,6,5,6,6,7,5,6,6,7,6,7,7,8
-    };
-
-    while((unsigned long)(uint8_t(o[p])) & 3 && count) {
-        uint8_t v = uint8_t(o[p++]);
-        bits_count += static_cast<size_t>(bits_in_byte[static_cast<unsigned int>(v)]);
-        count--;
+    auto first = offset >> 3, last = (offset + bits - 1) >> 3;
+    unsigned __int128 window = 0;
+    for (auto i = first; i <= last; ++i) {
+        window = (window << 8) | (i < o.size() ? uint8_t(o[i]) : 0);
     }
-/*
-    p4 = p;
-    uint32_t d1 = 0, d2 = 0, d3 = 0, d4 = 0, d5 = 0, d6 = 0, d7 = 0;
-    while(count>=28) {
-        d1 = uint8_t(o[p4++]);
-        d2 = uint8_t(o[p4++]);
-        d3 = uint8_t(o[p4++]);
-        d4 = uint8_t(o[p4++]);
-        d5 = uint8_t(o[p4++]);
-        d6 = uint8_t(o[p4++]);
-        d7 = uint8_t(o[p4++]);
-        count -= 28;
-
-        d1 = d1 - ((d1 >> 1) & 0x55555555);
-        d1 = (d1 & 0x33333333) + ((d1 >> 2) & 0x33333333);
-        d2 = d2 - ((d2 >> 1) & 0x55555555);
-        d2 = (d2 & 0x33333333) + ((d2 >> 2) & 0x33333333);
-        d3 = d3 - ((d3 >> 1) & 0x55555555);
-        d3 = (d3 & 0x33333333) + ((d3 >> 2) & 0x33333333);
-        d4 = d4 - ((d4 >> 1) & 0x55555555);
-        d4 = (d4 & 0x33333333) + ((d4 >> 2) & 0x33333333);
-        d5 = d5 - ((d5 >> 1) & 0x55555555);
-        d5 = (d5 & 0x33333333) + ((d5 >> 2) & 0x33333333);
-        d6 = d6 - ((d6 >> 1) & 0x55555555);
-        d6 = (d6 & 0x33333333) + ((d6 >> 2) & 0x33333333);
-        d7 = d7 - ((d7 >> 1) & 0x55555555);
-        d7 = (d7 & 0x33333333) + ((d7 >> 2) & 0x33333333);
-        bits_count += ((((d1 + (d1 >> 4)) & 0x0F0F0F0F) +
-                    ((d2 + (d2 >> 4)) & 0x0F0F0F0F) +
-                    ((d3 + (d3 >> 4)) & 0x0F0F0F0F) +
-                    ((d4 + (d4 >> 4)) & 0x0F0F0F0F) +
-                    ((d5 + (d5 >> 4)) & 0x0F0F0F0F) +
-                    ((d6 + (d6 >> 4)) & 0x0F0F0F0F) +
-                    ((d7 + (d7 >> 4)) & 0x0F0F0F0F))* 0x01010101) >> 24;
-    }
-    p = p4;
-*/
-    while(count--) {
-        uint8_t v = uint8_t(o[p++]);
-        bits_count += static_cast<size_t>(bits_in_byte[static_cast<unsigned int>(v)]);
+    window >>= 7 - ((offset + bits - 1) & 0x7);
+    auto mask = bits == 64 ? ~uint64_t(0) : (uint64_t(1) << bits) - 1;
+    return static_cast<uint64_t>(window) & mask;
+}
+
+template <typename Value>
+void set_raw_field(Value& o, size_t offset, unsigned bits, uint64_t value)
+{
+    auto end = offset + bits;
+    for (auto i = offset >> 3; i <= (end - 1) >> 3; ++i) {
+        auto b = uint8_t(static_cast<const Value&>(o)[i]);
+        auto old = b;
+        for (auto p = std::max(offset, i * 8); p < std::min(end, i * 8 + 8); ++p) {
+            auto shift = 7 - (p & 0x7);
+            auto bit = (value >> (end - 1 - p)) & 1;
+            b = (b & ~(1 << shift)) | (bit << shift);
+        }
+        if (b != old) {
+            store_byte(o, i, b);
+        }
+    }
+}
+
+template <typename Value>
+int64_t get_signed_field(const Value& o, const bitfield_op& op)
+{
+    auto raw = get_raw_field(o, op._offset, op._bits);
+    if (op._signed && op._bits < 64 && (raw >> (op._bits - 1)) & 1) {
+        raw |= ~uint64_t(0) << op._bits;
+    }
+    return static_cast<int64_t>(raw);
+}
+
+template <typename Value>
+bool run_field(Value& o, const bitfield_op& op, int64_t& result)
+{
+    auto old = get_signed_field(static_cast<const Value&>(o), op);
+    if (op._kind == bitfield_op::kind::get) {
+        result = old;
+        return true;
+    }
+    grow_value(o, (op._offset + op._bits + 7) >> 3);
+    // SET checks that the value fits as an increment from 0 would.
+    __int128 base = op._kind == bitfield_op::kind::set ? 0 : (op._signed ? __int128(old) : __int128(static_cast<uint64_t>(old)));
+    __int128 value = op._signed || op._kind == bitfield_op::kind::incrby ? __int128(op._value) : __int128(static_cast<uint64_t>(op._value));
+    auto sum = base + value;
+    __int128 max, min;
+    if (op._signed) {
+        max = (__int128(1) << (op._bits - 1)) - 1;
+        min = -max - 1;
+    }
+    else {
+        max = (__int128(1) << op._bits) - 1;
+        min = 0;
+    }
+    uint64_t mask = op._bits == 64 ? ~uint64_t(0) : (uint64_t(1) << op._bits) - 1;
+    uint64_t stored;
+    if (sum > max || sum < min) {
+        switch (op._overflow) {
+        case bitfield_overflow::fail:
+            return false;
+        case bitfield_overflow::sat:
+            stored = static_cast<uint64_t>(sum > max ? max : min) & mask;
+            break;
+        default:
+            stored = static_cast<uint64_t>(sum) & mask;
+            break;
+        }
+    }
+    else {
+        stored = static_cast<uint64_t>(sum) & mask;
+    }
+    set_raw_field(o, op._offset, op._bits, stored);
+    if (op._kind == bitfield_op::kind::set) {
+        result = old;
+    }
+    else {
+        result = get_signed_field(static_cast<const Value&>(o), op);
+    }
+    return true;
+}
+
+}
+
+managed_bytes bits_operation::make_bitmap(size_t size)
+{
+    managed_bytes o(managed_bytes::initialized_later(), size);
+    o.for_each_mutable_fragment([] (char* data, size_t size) {
+        std::memset(data, 0, size);
+    });
+    return o;
+}
+
+void bits_operation::grow(managed_bytes& o, size_t size)
+{
+    o.grow(size);
+}
+
+bool bits_operation::set(managed_bytes& o, size_t offset, bool value)
+{
+    return set_bit(o, offset, value);
+}
+
+bool bits_operation::set(bitmap_lsa& o, size_t offset, bool value)
+{
+    o.grow((offset >> 3) + 1);
+    return o.set(offset, value);
+}
+
+bool bits_operation::get(const managed_bytes& o, size_t offset)
+{
+    return get_bit(o, offset);
+}
+
+bool bits_operation::get(const bitmap_lsa& o, size_t offset)
+{
+    if (offset > BITMAP_MAX_OFFSET || (offset >> 3) >= o.size()) {
+        return false;
+    }
+    return o.get(offset);
+}
+
+size_t bits_operation::popcount(const char* data, size_t size)
+{
+    static const popcount_function popcount_impl = select_popcount();
+    return popcount_impl(data, size);
+}
+
+long bits_operation::first_bit(const char* data, size_t size, bool bit)
+{
+    // words without it are skipped whole.
+    const uint64_t skip = bit ? 0 : ~uint64_t(0);
+    size_t i = 0;
+    while (i + 8 <= size && load_word(data + i) == skip) {
+        i += 8;
+    }
+    for (; i < size; ++i) {
+        auto b = first_bit_of_byte(static_cast<uint8_t>(data[i]), bit);
+        if (b >= 0) {
+            return static_cast<long>(i * 8 + b);
+        }
+    }
+    return -1;
+}
+
+size_t bits_operation::count(const managed_bytes& o, long start, long end)
+{
+    if (!normalize_range(o.size(), start, end)) {
+        return 0;
     }
+    size_t bits_count = 0;
+    for_each_range_fragment(o, start, end, [&bits_count] (const char* data, size_t size, size_t) {
+        bits_count += popcount(data, size);
+        return true;
+    });
     return bits_count;
 }
+
+size_t bits_operation::count(const bitmap_lsa& o, long start, long end)
+{
+    if (!normalize_range(o.size(), start, end)) {
+        return 0;
+    }
+    return o.count(start, end);
+}
+
+long bits_operation::position(const managed_bytes& o, bool bit, long start, long end, bool end_given)
+{
+    if (!normalize_range(o.size(), start, end)) {
+        return -1;
+    }
+    long result = -1;
+    for_each_range_fragment(o, start, end, [&] (const char* data, size_t size, size_t position) {
+        auto b = first_bit(data, size, bit);
+        if (b >= 0) {
+            result = static_cast<long>(position * 8) + b;
+            return false;
+        }
+        return true;
+    });
+    if (result < 0 && !bit && !end_given) {
+        return (end + 1) * 8;
+    }
+    return result;
+}
+
+long bits_operation::position(const bitmap_lsa& o, bool bit, long start, long end, bool end_given)
+{
+    if (!normalize_range(o.size(), start, end)) {
+        return -1;
+    }
+    auto result = o.position(bit, start, end);
+    if (result < 0 && !bit && !end_given) {
+        return (end + 1) * 8;
+    }
+    return result;
+}
+
+namespace {
+
+// SSE2 rotates no 16 bit lanes, two shifts make one.
+inline __m128i rotate_lanes(__m128i v)
+{
+    return _mm_or_si128(_mm_srli_si128(v, 2), _mm_slli_si128(v, 14));
+}
+
+bitmap_page full_page(uint32_t index)
+{
+    bitmap_page p;
+    p._index = index;
+    p._kind = bitmap_container::full;
+    p._count = bitmap_lsa::page_bits;
+    return p;
+}
+
+bitmap_page array_page(uint32_t index, const std::vector<uint16_t>& offsets)
+{
+    bitmap_page p;
+    p._index = index;
+    p._count = static_cast<uint32_t>(offsets.size());
+    p._data = bytes(reinterpret_cast<const char*>(offsets.data()), offsets.size() * sizeof(uint16_t));
+    return p;
+}
+
+void add_page(sparse_bitmap& result, uint32_t index, const char* data)
+{
+    auto p = bitmap_page::of_bytes(index, data);
+    if (p._count > 0) {
+        result._pages.push_back(std::move(p));
+    }
+}
+
+inline bool test_bit(const char* data, uint16_t offset)
+{
+    return data[offset >> 3] & (0x80 >> (offset & 0x7));
+}
+
+// ORs or XORs a page into the bytes of another.
+void merge_page(int op, const bitmap_page& p, char* out)
+{
+    if (p._kind == bitmap_container::array) {
+        auto offsets = p.offsets();
+        for (uint32_t i = 0; i < p._count; ++i) {
+            auto mask = static_cast<char>(0x80 >> (offsets[i] & 0x7));
+            if (op == BITOP_OR) {
+                out[offsets[i] >> 3] |= mask;
+            }
+            else {
+                out[offsets[i] >> 3] ^= mask;
+            }
+        }
+        return;
+    }
+    auto full = p._kind == bitmap_container::full;
+    for (size_t i = 0; i < bitmap_lsa::page_size; i += 8) {
+        auto w = full ? ~uint64_t(0) : load_word(p._data.begin() + i);
+        store_word(out + i, op == BITOP_OR ? load_word(out + i) | w : load_word(out + i) ^ w);
+    }
+}
+
+// Full pages change nothing, the arrays are intersected from the smallest,
+// bitmaps filter the offsets left. Only pages without arrays are ANDed
+// word by word.
+void and_pages(uint32_t index, std::vector<const bitmap_page*>& pages, sparse_bitmap& result)
+{
+    pages.erase(std::remove_if(pages.begin(), pages.end(), [] (auto p) {
+        return p->_kind == bitmap_container::full;
+    }), pages.end());
+    if (pages.empty()) {
+        result._pages.push_back(full_page(index));
+        return;
+    }
+    std::sort(pages.begin(), pages.end(), [] (auto l, auto r) {
+        auto l_array = l->_kind == bitmap_container::array, r_array = r->_kind == bitmap_container::array;
+        return l_array != r_array ? l_array : l->_count < r->_count;
+    });
+    if (pages[0]->_kind == bitmap_container::array) {
+        std::vector<uint16_t> offsets(pages[0]->offsets(), pages[0]->offsets() + pages[0]->_count), scratch;
+        for (size_t k = 1; k < pages.size() && !offsets.empty(); ++k) {
+            auto& p = *pages[k];
+            if (p._kind == bitmap_container::array) {
+                scratch.resize(offsets.size());
+                scratch.resize(bits_operation::intersect(offsets.data(), offsets.size(), p.offsets(), p._count, scratch.data()));
+                offsets.swap(scratch);
+            }
+            else {
+                auto data = p._data.begin();
+                offsets.erase(std::remove_if(offsets.begin(), offsets.end(), [data] (uint16_t o) {
+                    return !test_bit(data, o);
+                }), offsets.end());
+            }
+        }
+        if (!offsets.empty()) {
+            result._pages.push_back(array_page(index, offsets));
+        }
+        return;
+    }
+    char buffer[bitmap_lsa::page_size];
+    std::memcpy(buffer, pages[0]->_data.begin(), bitmap_lsa::page_size);
+    for (size_t k = 1; k < pages.size(); ++k) {
+        auto data = pages[k]->_data.begin();
+        for (size_t i = 0; i < bitmap_lsa::page_size; i += 8) {
+            store_word(buffer + i, load_word(buffer + i) & load_word(data + i));
+        }
+    }
+    add_page(result, index, buffer);
+}
+
+// Arrays whose union still fits an array are merged, the other pages are
+// combined in bytes.
+void or_pages(uint32_t index, const std::vector<const bitmap_page*>& pages, sparse_bitmap& result)
+{
+    size_t total = 0;
+    bool arrays = true;
+    for (auto p : pages) {
+        if (p->_kind == bitmap_container::full) {
+            result._pages.push_back(full_page(index));
+            return;
+        }
+        arrays = arrays && p->_kind == bitmap_container::array;
+        total += p->_count;
+    }
+    if (arrays && total <= bitmap_lsa::array_max) {
+        std::vector<uint16_t> offsets, merged;
+        for (auto p : pages) {
+            merged.clear();
+            std::set_union(offsets.begin(), offsets.end(), p->offsets(), p->offsets() + p->_count, std::back_inserter(merged));
+            offsets.swap(merged);
+        }
+        result._pages.push_back(array_page(index, offsets));
+        return;
+    }
+    char buffer[bitmap_lsa::page_size];
+    std::memset(buffer, 0, bitmap_lsa::page_size);
+    for (auto p : pages) {
+        merge_page(BITOP_OR, *p, buffer);
+    }
+    add_page(result, index, buffer);
+}
+
+void xor_pages(uint32_t index, const std::vector<const bitmap_page*>& pages, sparse_bitmap& result)
+{
+    char buffer[bitmap_lsa::page_size];
+    std::memset(buffer, 0, bitmap_lsa::page_size);
+    for (auto p : pages) {
+        merge_page(BITOP_XOR, *p, buffer);
+    }
+    add_page(result, index, buffer);
+}
+
+// NOT turns the missing pages into full ones. The bytes past the end of
+// the last page stay zero.
+void not_pages(const sparse_bitmap& s, sparse_bitmap& result)
+{
+    auto count = (result._size + bitmap_lsa::page_size - 1) / bitmap_lsa::page_size;
+    auto p = s._pages.begin();
+    char buffer[bitmap_lsa::page_size];
+    for (uint32_t index = 0; index < count; ++index) {
+        auto valid = std::min(bitmap_lsa::page_size, result._size - size_t(index) * bitmap_lsa::page_size);
+        if (p != s._pages.end() && p->_index == index) {
+            p->copy_bytes(buffer);
+            ++p;
+            for (size_t i = 0; i < bitmap_lsa::page_size; i += 8) {
+                store_word(buffer + i, ~load_word(buffer + i));
+            }
+        }
+        else if (valid == bitmap_lsa::page_size) {
+            result._pages.push_back(full_page(index));
+            continue;
+        }
+        else {
+            std::memset(buffer, 0xff, bitmap_lsa::page_size);
+        }
+        std::memset(buffer + valid, 0, bitmap_lsa::page_size - valid);
+        add_page(result, index, buffer);
+    }
+}
+}
+
+size_t bits_operation::intersect(const uint16_t* a, size_t a_size, const uint16_t* b, size_t b_size, uint16_t* out)
+{
+    // Every offset of a block of eight of `a` is compared to those of a
+    // block of `b` at once, rotating the block of `b` through its eight
+    // lanes, see Katsov, "Fast intersection of sorted lists using SSE
+    // instructions". The block with the smaller last offset is passed.
+    size_t i = 0, j = 0, n = 0;
+    while (i + 8 <= a_size && j + 8 <= b_size) {
+        auto va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+        auto vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + j));
+        auto matches = _mm_cmpeq_epi16(va, vb);
+        for (int r = 1; r < 8; ++r) {
+            vb = rotate_lanes(vb);
+            matches = _mm_or_si128(matches, _mm_cmpeq_epi16(va, vb));
+        }
+        // two bits of the mask for every lane of `a` found in `b`.
+        auto mask = static_cast<unsigned>(_mm_movemask_epi8(matches));
+        while (mask) {
+            out[n++] = a[i + __builtin_ctz(mask) / 2];
+            mask &= mask - 1;
+            mask &= mask - 1;
+        }
+        auto a_last = a[i + 7], b_last = b[j + 7];
+        if (a_last <= b_last) {
+            i += 8;
+        }
+        if (b_last <= a_last) {
+            j += 8;
+        }
+    }
+    while (i < a_size && j < b_size) {
+        if (a[i] < b[j]) {
+            ++i;
+        }
+        else if (b[j] < a[i]) {
+            ++j;
+        }
+        else {
+            out[n++] = a[i];
+            ++i;
+            ++j;
+        }
+    }
+    return n;
+}
+
+void bits_operation::combine(int op, const std::vector<const sparse_bitmap*>& sources, sparse_bitmap& result)
+{
+    result._size = 0;
+    result._pages.clear();
+    for (auto s : sources) {
+        result._size = std::max(result._size, s->_size);
+    }
+    if (result._size == 0) {
+        return;
+    }
+    if (op == BITOP_NOT) {
+        not_pages(*sources[0], result);
+        return;
+    }
+    // the pages of the sources are visited by index, those of the same
+    // index together.
+    std::vector<std::vector<bitmap_page>::const_iterator> cursors;
+    for (auto s : sources) {
+        cursors.push_back(s->_pages.begin());
+    }
+    std::vector<const bitmap_page*> pages;
+    while (true) {
+        auto index = std::numeric_limits<uint32_t>::max();
+        bool more = false;
+        for (size_t k = 0; k < sources.size(); ++k) {
+            if (cursors[k] != sources[k]->_pages.end()) {
+                index = std::min(index, cursors[k]->_index);
+                more = true;
+            }
+        }
+        if (!more) {
+            return;
+        }
+        pages.clear();
+        for (size_t k = 0; k < sources.size(); ++k) {
+            if (cursors[k] != sources[k]->_pages.end() && cursors[k]->_index == index) {
+                pages.push_back(&*cursors[k]);
+                ++cursors[k];
+            }
+        }
+        if (op == BITOP_AND && pages.size() < sources.size()) {
+            continue;
+        }
+        if (pages.size() == 1) {
+            result._pages.push_back(*pages[0]);
+        }
+        else if (op == BITOP_AND) {
+            and_pages(index, pages, result);
+        }
+        else if (op == BITOP_OR) {
+            or_pages(index, pages, result);
+        }
+        else {
+            xor_pages(index, pages, result);
+        }
+    }
+}
+uint64_t bits_operation::get_field(const managed_bytes& o, size_t offset, unsigned bits)
+{
+    return get_raw_field(o, offset, bits);
+}
+
+void bits_operation::set_field(managed_bytes& o, size_t offset, unsigned bits, uint64_t value)
+{
+    set_raw_field(o, offset, bits, value);
+}
+
+int64_t bits_operation::get_field(const managed_bytes& o, const bitfield_op& op)
+{
+    return get_signed_field(o, op);
+}
+
+int64_t bits_operation::get_field(const bitmap_lsa& o, const bitfield_op& op)
+{
+    return get_signed_field(o, op);
+}
+
+bool bits_operation::run(managed_bytes& o, const bitfield_op& op, int64_t& result)
+{
+    return run_field(o, op, result);
+}
+
+bool bits_operation::run(bitmap_lsa& o, const bitfield_op& op, int64_t& result)
+{
+    return run_field(o, op, result);
+}
 }
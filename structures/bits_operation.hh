@@ -20,12 +20,78 @@
 */
 #pragma once
 #include "utils/managed_bytes.hh"
+#include <vector>
 namespace redis {
-static constexpr const size_t BITMAP_MAX_OFFSET  = (1 << 31);
+class bitmap_lsa;
+struct sparse_bitmap;
+// The largest bit offset of SETBIT and BITFIELD, values are at most 512MB.
+static constexpr const size_t BITMAP_MAX_OFFSET  = (size_t(1) << 32) - 1;
+
+static constexpr const int BITOP_AND = (1 << 0);
+static constexpr const int BITOP_OR  = (1 << 1);
+static constexpr const int BITOP_XOR = (1 << 2);
+static constexpr const int BITOP_NOT = (1 << 3);
+
+enum class bitfield_overflow { wrap, sat, fail };
+
+// One GET, SET or INCRBY subcommand of BITFIELD.
+struct bitfield_op
+{
+    enum class kind { get, set, incrby };
+    kind _kind = kind::get;
+    bool _signed = false;
+    unsigned _bits = 0;
+    size_t _offset = 0;
+    int64_t _value = 0;
+    bitfield_overflow _overflow = bitfield_overflow::wrap;
+};
+
+// Bits are numbered from the most significant bit of the first byte, as
+// in Redis. Large values are fragmented, so every operation works on one
+// fragment at a time, a machine word at a time. The overloads taking a
+// bitmap_lsa skip the pages never written, and read the others in the form
+// they are kept in.
 struct bits_operation
 {
+    // A zero filled value of `size` bytes.
+    static managed_bytes make_bitmap(size_t size);
+    // Grows the value to `size` bytes, filling the new bytes with zeroes.
+    static void grow(managed_bytes& o, size_t size);
+
     static bool set(managed_bytes& o, size_t offset, bool value);
+    static bool set(bitmap_lsa& o, size_t offset, bool value);
     static bool get(const managed_bytes& o, size_t offset);
+    static bool get(const bitmap_lsa& o, size_t offset);
+    // Bits set in the bytes [start, end], negative offsets count from the end.
     static size_t count(const managed_bytes& o, long start, long end);
+    static size_t count(const bitmap_lsa& o, long start, long end);
+    // Bits set in [data, data + size), using AVX2 if the CPU has it.
+    static size_t popcount(const char* data, size_t size);
+    // The first bit equal to `bit` in [data, data + size), or -1.
+    static long first_bit(const char* data, size_t size, bool bit);
+    // The first bit equal to `bit` in the bytes [start, end], or -1. If the
+    // end was not given, a clear bit is assumed right after the value.
+    static long position(const managed_bytes& o, bool bit, long start, long end, bool end_given);
+    static long position(const bitmap_lsa& o, bool bit, long start, long end, bool end_given);
+    // BITOP: combines the sources into `result`, as long as the longest
+    // source; shorter sources are padded with zeroes. Pages are combined in
+    // the form they are kept in: AND only visits the pages all sources
+    // have and intersects their offsets, NOT yields full pages for the
+    // missing ones.
+    static void combine(int op, const std::vector<const sparse_bitmap*>& sources, sparse_bitmap& result);
+    // Writes the offsets in both of the sorted arrays `a` and `b` to `out`,
+    // eight at a time with SSE2. Returns how many.
+    static size_t intersect(const uint16_t* a, size_t a_size, const uint16_t* b, size_t b_size, uint16_t* out);
+
+    // Reads `bits` bits at `offset`, bits past the end of the value are 0.
+    static uint64_t get_field(const managed_bytes& o, size_t offset, unsigned bits);
+    // Writes `bits` bits at `offset`, the value must be large enough.
+    static void set_field(managed_bytes& o, size_t offset, unsigned bits, uint64_t value);
+    // Runs a BITFIELD subcommand, SET and INCRBY grow the value as needed.
+    // Returns false if it failed with OVERFLOW FAIL.
+    static bool run(managed_bytes& o, const bitfield_op& op, int64_t& result);
+    static bool run(bitmap_lsa& o, const bitfield_op& op, int64_t& result);
+    static int64_t get_field(const managed_bytes& o, const bitfield_op& op);
+    static int64_t get_field(const bitmap_lsa& o, const bitfield_op& op);
 };
 }
@@ -0,0 +1,153 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#include "structures/bloom_lsa.hh"
+#include "utils/bloom_calculations.hh"
+#include "utils/murmur_hash.hh"
+#include <cmath>
+#include <stdexcept>
+namespace redis {
+
+constexpr size_t bloom_lsa::block_bytes;
+constexpr size_t bloom_lsa::blocks_per_page;
+constexpr double bloom_lsa::default_error;
+constexpr uint64_t bloom_lsa::default_capacity;
+constexpr uint32_t bloom_lsa::default_expansion;
+
+static constexpr unsigned block_bits = bloom_lsa::block_bytes * 8;
+
+bloom_lsa::bloom_lsa(double error, uint64_t capacity, uint32_t expansion)
+    : _error(error)
+    , _capacity(capacity)
+    , _expansion(expansion)
+{
+    add_layer();
+}
+
+bloom_lsa::hash_type bloom_lsa::hash_of(bytes_view item)
+{
+    hash_type h;
+    utils::murmur_hash::hash3_x64_128(item, 0, h);
+    return h;
+}
+
+void bloom_lsa::add_layer()
+{
+    auto n = _layers.size();
+    layer l;
+    l._capacity = _capacity;
+    for (size_t i = 0; i < n && _expansion > 0; ++i) {
+        l._capacity *= _expansion;
+    }
+    // the layers take half the error of the one before, the first half
+    // that of the filter, and a blocked layer half of its own again.
+    auto error = _error / std::pow(2.0, n + 2);
+    auto max_buckets = utils::bloom_calculations::max_buckets_per_element(l._capacity);
+    int buckets = max_buckets;
+    try {
+        auto spec = utils::bloom_calculations::compute_bloom_spec(max_buckets, error);
+        buckets = spec.buckets_per_element;
+        l._hashes = spec.K;
+    } catch (const std::invalid_argument&) {
+        // past the rates bloom_calculations knows, the most accurate one.
+        l._hashes = utils::bloom_calculations::compute_bloom_spec(max_buckets).K;
+    }
+    l._blocks = std::max<uint64_t>(1, (l._capacity * buckets + block_bits - 1) / block_bits);
+    if (n > 0) {
+        auto& last = _layers.back();
+        l._first_page = last._first_page + (last._blocks + blocks_per_page - 1) / blocks_per_page;
+    }
+    _layers.push_back(l);
+}
+
+// The block of the item is chosen by the first half of its hash, and the
+// bits within it by the top bits of h1 + i * h2, h2 being the first half
+// turned around.
+bool bloom_lsa::test(const layer& l, const hash_type& h) const
+{
+    auto block = h[0] % l._blocks;
+    auto p = _pages.find(l._first_page + block / blocks_per_page);
+    if (p == nullptr) {
+        return false;
+    }
+    p += (block % blocks_per_page) * block_bytes;
+    auto step = ((h[0] << 32) | (h[0] >> 32)) | 1;
+    auto x = h[1];
+    for (uint32_t i = 0; i < l._hashes; ++i, x += step) {
+        auto bit = x >> 55;
+        if ((p[bit >> 3] & (1 << (bit & 7))) == 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void bloom_lsa::set(const layer& l, const hash_type& h)
+{
+    auto block = h[0] % l._blocks;
+    auto p = _pages.get(l._first_page + block / blocks_per_page) + (block % blocks_per_page) * block_bytes;
+    auto step = ((h[0] << 32) | (h[0] >> 32)) | 1;
+    auto x = h[1];
+    for (uint32_t i = 0; i < l._hashes; ++i, x += step) {
+        auto bit = x >> 55;
+        p[bit >> 3] |= 1 << (bit & 7);
+    }
+}
+
+bloom_lsa::add_result bloom_lsa::add(bytes_view item)
+{
+    auto h = hash_of(item);
+    for (auto& l : _layers) {
+        if (test(l, h)) {
+            return add_result::present;
+        }
+    }
+    if (_layers.back()._items >= _layers.back()._capacity) {
+        if (_expansion == 0) {
+            return add_result::full;
+        }
+        add_layer();
+    }
+    auto& last = _layers.back();
+    set(last, h);
+    ++last._items;
+    ++_items;
+    return add_result::added;
+}
+
+bool bloom_lsa::exists(bytes_view item) const
+{
+    auto h = hash_of(item);
+    for (auto& l : _layers) {
+        if (test(l, h)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void bloom_lsa::restore(std::vector<layer> layers, uint64_t items)
+{
+    if (!layers.empty()) {
+        _layers = std::move(layers);
+    }
+    _items = items;
+}
+}
@@ -0,0 +1,111 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#pragma once
+#include "structures/page_set.hh"
+#include "utils/bytes.hh"
+#include <array>
+#include <cstdint>
+#include <vector>
+namespace redis {
+
+// A scalable Bloom filter, after the one of RedisBloom: a stack of layers,
+// each a Bloom filter of its capacity, the next one made `expansion` times
+// as large once the last is full, and with half its error rate, so that
+// the rate of the whole stays under that of the filter however many items
+// it takes.
+//
+// A layer is blocked: an item takes one block of 64 bytes, a cache line,
+// chosen by its hash, and all its bits are in that block, so that a test
+// reads one line of memory rather than one per hash. The number of hashes
+// and of bits per item come from bloom_calculations for half the error of
+// the layer, as a blocked filter is a little less accurate than a flat one
+// of the same size. The blocks of all the layers are in pages of the
+// region, see lsa_page_set; the layers, a few numbers each, are kept out
+// of it.
+class bloom_lsa {
+public:
+    static constexpr size_t block_bytes = 64;
+    static constexpr size_t blocks_per_page = lsa_page_set::page_size / block_bytes;
+    static constexpr double default_error = 0.01;
+    static constexpr uint64_t default_capacity = 100;
+    static constexpr uint32_t default_expansion = 2;
+
+    struct layer {
+        uint64_t _capacity = 0;
+        uint64_t _items = 0;
+        uint64_t _blocks = 0;
+        uint64_t _first_page = 0;
+        uint32_t _hashes = 0;
+    };
+    enum class add_result {
+        added,
+        // the item may have been added before.
+        present,
+        // the filter does not scale and its layer is full.
+        full,
+    };
+private:
+    lsa_page_set _pages;
+    std::vector<layer> _layers;
+    double _error;
+    uint64_t _capacity;
+    // 0 for a filter which does not scale.
+    uint32_t _expansion;
+    uint64_t _items = 0;
+
+    using hash_type = std::array<uint64_t, 2>;
+    static hash_type hash_of(bytes_view item);
+    bool test(const layer& l, const hash_type& h) const;
+    void set(const layer& l, const hash_type& h);
+    void add_layer();
+public:
+    bloom_lsa(double error, uint64_t capacity, uint32_t expansion);
+    bloom_lsa(bloom_lsa&& o) noexcept
+        : _pages(std::move(o._pages))
+        , _layers(std::move(o._layers))
+        , _error(o._error)
+        , _capacity(o._capacity)
+        , _expansion(o._expansion)
+        , _items(o._items)
+    {
+        o._items = 0;
+    }
+
+    add_result add(bytes_view item);
+    bool exists(bytes_view item) const;
+
+    // The items added.
+    uint64_t size() const { return _items; }
+    double error() const { return _error; }
+    uint64_t capacity() const { return _capacity; }
+    uint32_t expansion() const { return _expansion; }
+    const std::vector<layer>& layers() const { return _layers; }
+    const lsa_page_set& pages() const { return _pages; }
+    lsa_page_set& pages() { return _pages; }
+    // Puts back the layers of a filter, as a snapshot is loaded, its pages
+    // being set through pages().
+    void restore(std::vector<layer> layers, uint64_t items);
+
+    // Bytes the pages take in the current allocator, and about what the
+    // layers take out of it.
+    size_t memory_usage() const { return _pages.memory_usage() + _layers.capacity() * sizeof(layer); }
+};
+}
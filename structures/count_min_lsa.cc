@@ -0,0 +1,71 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#include "structures/count_min_lsa.hh"
+#include "utils/murmur_hash.hh"
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <limits>
+namespace redis {
+
+constexpr size_t count_min_lsa::counters_per_page;
+constexpr uint64_t count_min_lsa::max_counters;
+
+uint32_t count_min_lsa::counter(uint64_t index) const
+{
+    auto p = _pages.find(index / counters_per_page);
+    if (p == nullptr) {
+        return 0;
+    }
+    uint32_t c;
+    std::memcpy(&c, p + (index % counters_per_page) * sizeof(c), sizeof(c));
+    return c;
+}
+
+uint32_t count_min_lsa::increment(bytes_view item, uint32_t increment)
+{
+    std::array<uint64_t, 2> h;
+    utils::murmur_hash::hash3_x64_128(item, 0, h);
+    auto estimate = std::numeric_limits<uint32_t>::max();
+    for (uint32_t row = 0; row < _depth; ++row) {
+        auto index = index_of(row, h[0], h[1]);
+        auto p = _pages.get(index / counters_per_page) + (index % counters_per_page) * sizeof(uint32_t);
+        uint32_t c;
+        std::memcpy(&c, p, sizeof(c));
+        c = c > std::numeric_limits<uint32_t>::max() - increment ? std::numeric_limits<uint32_t>::max() : c + increment;
+        std::memcpy(p, &c, sizeof(c));
+        estimate = std::min(estimate, c);
+    }
+    _count += increment;
+    return estimate;
+}
+
+uint32_t count_min_lsa::query(bytes_view item) const
+{
+    std::array<uint64_t, 2> h;
+    utils::murmur_hash::hash3_x64_128(item, 0, h);
+    auto estimate = std::numeric_limits<uint32_t>::max();
+    for (uint32_t row = 0; row < _depth && estimate > 0; ++row) {
+        estimate = std::min(estimate, counter(index_of(row, h[0], h[1])));
+    }
+    return estimate;
+}
+}
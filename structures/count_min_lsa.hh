@@ -0,0 +1,72 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#pragma once
+#include "structures/page_set.hh"
+#include "utils/bytes.hh"
+#include <cstdint>
+namespace redis {
+
+// A count-min sketch: `depth` rows of `width` counters of 32 bits, an item
+// counting in one counter of each row chosen by its hash, and estimated by
+// the least of them, which never undercounts. The counters are in pages of
+// the region, see lsa_page_set, allocated as they are first counted in,
+// and stop at their largest value rather than wrap around.
+class count_min_lsa {
+public:
+    static constexpr size_t counters_per_page = lsa_page_set::page_size / sizeof(uint32_t);
+    static constexpr uint64_t max_counters = uint64_t(1) << 32;
+private:
+    lsa_page_set _pages;
+    uint32_t _width;
+    uint32_t _depth;
+    // The increments of all the items.
+    uint64_t _count = 0;
+
+    // The counter of the item in the row.
+    uint64_t index_of(uint32_t row, uint64_t h1, uint64_t h2) const
+    {
+        return uint64_t(row) * _width + (h1 + row * h2) % _width;
+    }
+    uint32_t counter(uint64_t index) const;
+public:
+    count_min_lsa(uint32_t width, uint32_t depth) noexcept : _width(width), _depth(depth) {}
+    count_min_lsa(count_min_lsa&& o) noexcept
+        : _pages(std::move(o._pages))
+        , _width(o._width)
+        , _depth(o._depth)
+        , _count(o._count)
+    {
+        o._count = 0;
+    }
+
+    // Counts the item `increment` more times, and returns its estimate.
+    uint32_t increment(bytes_view item, uint32_t increment);
+    uint32_t query(bytes_view item) const;
+
+    uint32_t width() const { return _width; }
+    uint32_t depth() const { return _depth; }
+    uint64_t count() const { return _count; }
+    void set_count(uint64_t count) { _count = count; }
+    const lsa_page_set& pages() const { return _pages; }
+    lsa_page_set& pages() { return _pages; }
+    size_t memory_usage() const { return _pages.memory_usage(); }
+};
+}
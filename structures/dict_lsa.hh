@@ -19,7 +19,10 @@
 *
 */
 #pragma once
-#include <boost/intrusive/set.hpp>
+#include <memory>
+#include <cstring>
+#include <cstddef>
+#include <utility>
 #include "utils/allocation_strategy.hh"
 #include "utils/managed_ref.hh"
 #include "utils/managed_bytes.hh"
@@ -27,6 +30,7 @@
 #include "utils/allocation_strategy.hh"
 #include "utils/logalloc.hh"
 #include "keys.hh"
+#include "structures/hash_index.hh"
 #include  <experimental/vector>
 namespace stdx = std::experimental;
 namespace redis {
@@ -35,8 +39,8 @@ class dict_lsa;
 struct dict_entry
 {
     friend class dict_lsa;
-    using hook_type = boost::intrusive::set_member_hook<>;
-    hook_type _link;
+    // The table slot pointing to this entry, so that LSA can move the entry.
+    dict_entry** _slot;
     managed_bytes _key;
     size_t _key_hash;
     union storage {
@@ -55,25 +59,26 @@ struct dict_entry
     entry_type _type;
 
     dict_entry(const bytes& key, const bytes& val) noexcept
-        : _link()
-        , _key(std::move(*(current_allocator().construct<managed_bytes>(bytes_view {key.data(), key.size()}))))
+        : _slot(nullptr)
+        , _key(bytes_view {key.data(), key.size()})
         , _key_hash(std::hash<managed_bytes>()(_key))
         , _type(entry_type::BYTES)
     {
-        _u._data = std::move(*(current_allocator().construct<managed_bytes>(bytes_view {val.data(), val.size()})));
+        new (&_u._data) managed_bytes(bytes_view {val.data(), val.size()});
     }
 
     dict_entry(const bytes& key) noexcept
-        : _link()
-        , _key(std::move(*(current_allocator().construct<managed_bytes>(bytes_view {key.data(), key.size()}))))
+        : _slot(nullptr)
+        , _key(bytes_view {key.data(), key.size()})
         , _key_hash(std::hash<managed_bytes>()(_key))
         , _type(entry_type::BYTES)
     {
+        new (&_u._data) managed_bytes();
     }
 
     dict_entry(const bytes& key, double data) noexcept
-        : _link()
-        , _key(std::move(*(current_allocator().construct<managed_bytes>(bytes_view {key.data(), key.size()}))))
+        : _slot(nullptr)
+        , _key(bytes_view {key.data(), key.size()})
         , _key_hash(std::hash<managed_bytes>()(_key))
         , _type(entry_type::FLOAT)
     {
@@ -81,8 +86,8 @@ struct dict_entry
     }
 
     dict_entry(const bytes& key, int64_t data) noexcept
-        : _link()
-        , _key(std::move(*(current_allocator().construct<managed_bytes>(bytes_view {key.data(), key.size()}))))
+        : _slot(nullptr)
+        , _key(bytes_view {key.data(), key.size()})
         , _key_hash(std::hash<managed_bytes>()(_key))
         , _type(entry_type::INTEGER)
     {
@@ -90,14 +95,14 @@ struct dict_entry
     }
 
     dict_entry(dict_entry&& o) noexcept
-        : _link(std::move(o._link))
+        : _slot(o._slot)
         , _key(std::move(o._key))
         , _key_hash(std::move(o._key_hash))
         , _type(std::move(o._type))
     {
         switch (_type) {
             case entry_type::BYTES:
-                 _u._data = std::move(o._u._data);
+                 new (&_u._data) managed_bytes(std::move(o._u._data));
                  break;
             case entry_type::FLOAT:
                  _u._float = o._u._float;
@@ -106,28 +111,33 @@ struct dict_entry
                  _u._integer = o._u._integer;
                  break;
         }
+        if (_slot) {
+            *_slot = this;
+        }
+        o._slot = nullptr;
     }
 
-    struct compare {
-        inline bool compare_impl(const char* d1, size_t s1, const char* d2, size_t s2) const noexcept {
-            const int len = std::min(s1, s2);
-            auto r = memcmp(d1, d2, len);
-            if (r == 0) {
-                if (s1 < s2) return true;
-                else if (s1 > s2) return false;
-            }
-            return r < 0;
-        }
-        inline bool operator () (const dict_entry& l, const dict_entry& r) const noexcept {
-            return compare_impl(l.key_data(), l.key_size(), r.key_data(), r.key_size());
-        }
-        inline bool operator () (const bytes& k, const dict_entry& e) const noexcept {
-            return compare_impl(k.data(), k.size(), e.key_data(), e.key_size());
+    ~dict_entry()
+    {
+        if (_type == entry_type::BYTES) {
+            _u._data.~managed_bytes();
         }
-        inline bool operator () (const dict_entry& e, const bytes& k) const noexcept {
-            return compare_impl(e.key_data(), e.key_size(), k.data(), k.size());
+    }
+
+    // Bytes the entry holds in the current allocator, its key and value
+    // included.
+    size_t memory_usage() const noexcept
+    {
+        auto size = current_allocator().object_memory_size_in_allocator(this) + _key.external_memory_usage();
+        if (_type == entry_type::BYTES) {
+            size += _u._data.external_memory_usage();
         }
-    };
+        return size;
+    }
+
+    inline bool equals(bytes_view k, size_t hash) const noexcept {
+        return _key_hash == hash && _key.size() == k.size() && memcmp(_key.data(), k.data(), k.size()) == 0;
+    }
 
     bool type_of_bytes() const {
         return _type == entry_type::BYTES;
@@ -181,20 +191,29 @@ struct dict_entry
 };
 
 class database;
+// The fields of a hash or the members of a set, indexed by a hash_index.
 class dict_lsa final {
     friend class database;
-    using dict_type = boost::intrusive::set<dict_entry,
-        boost::intrusive::member_hook<dict_entry, dict_entry::hook_type, &dict_entry::_link>,
-        boost::intrusive::compare<dict_entry::compare>>;
-    using iterator = typename dict_type::iterator;
-    using const_iterator = typename dict_type::const_iterator;
-    dict_type _dict;
+    using index_type = hash_index<dict_entry>;
+    index_type _index;
+
+    static inline void destroy(dict_entry* e) {
+        current_allocator().destroy<dict_entry>(e);
+    }
+
+    inline dict_entry* find(const dict_entry& e) const
+    {
+        return _index.find(bytes_view {e.key_data(), e.key_size()}, e._key_hash);
+    }
 public:
-    dict_lsa () noexcept : _dict()
+    using entry_type = dict_entry;
+
+    dict_lsa () noexcept
     {
     }
 
-    dict_lsa (dict_lsa&& o) noexcept : _dict(std::move(o._dict))
+    dict_lsa (dict_lsa&& o) noexcept
+        : _index(std::move(o._index))
     {
     }
 
@@ -205,44 +224,80 @@ public:
 
     void flush_all()
     {
-        _dict.erase_and_dispose(_dict.begin(), _dict.end(), current_deleter<dict_entry>());
+        _index.clear_and_dispose(destroy);
     }
 
+    // Destroys up to `count` entries, returns how many were destroyed. The
+    // dict is only fit to be flushed or destroyed afterwards.
+    size_t flush_some(size_t count)
+    {
+        return _index.dispose_some(count, destroy);
+    }
+
+    // Takes ownership of the entry, it is destroyed if an entry with the
+    // same key exists.
     bool insert(dict_entry* e)
     {
         assert(e != nullptr);
-        auto r = _dict.insert(*e);
-        return r.second;
+        if (find(*e)) {
+            destroy(e);
+            return false;
+        }
+        _index.insert(e);
+        return true;
+    }
+
+    // Takes ownership of the entry, replacing the one with the same key.
+    // Returns true if there was none.
+    bool replace(dict_entry* e)
+    {
+        assert(e != nullptr);
+        auto old = find(*e);
+        if (old) {
+            _index.replace(old, e);
+            destroy(old);
+            return false;
+        }
+        _index.insert(e);
+        return true;
+    }
+
+    // Sizes the index for `n` entries in all, see hash_index::reserve().
+    void reserve(size_t n)
+    {
+        _index.reserve(n);
+    }
+
+    // Sets the value of a field, returns true if the field is new.
+    template <typename Value>
+    bool put(const bytes& k, Value&& v)
+    {
+        return replace(current_allocator().construct<dict_entry>(k, std::forward<Value>(v)));
+    }
+
+    // Adds a member of a set, returns true if it is new.
+    bool insert_key(const bytes& k)
+    {
+        return insert(current_allocator().construct<dict_entry>(k));
     }
 
     template <typename Func>
     inline std::result_of_t<Func(const dict_entry* e)> run_with_entry(const bytes& k, Func&& func) const {
-        auto it = _dict.find(k, dict_entry::compare());
-        if (it != _dict.end()) {
-            const auto& e = *it;
-            return func(&e);
-        }
-        else {
-            return func(nullptr);
-        }
+        const dict_entry* e = _index.find(k);
+        return func(e);
     }
 
     template <typename Func>
     inline std::result_of_t<Func(dict_entry* e)> run_with_entry(const bytes& k, Func&& func) {
-        auto it = _dict.find(k, dict_entry::compare());
-        if (it != _dict.end()) {
-            auto& e = *it;
-            return func(&e);
-        }
-        else {
-            return func(nullptr);
-        }
+        return func(_index.find(k));
     }
 
-    inline bool erase(const_iterator i)
+    inline bool erase(const dict_entry* e)
     {
-        if (i != _dict.cend()) {
-            _dict.erase_and_dispose(i, current_deleter<dict_entry>());
+        if (e && e->_slot) {
+            auto entry = const_cast<dict_entry*>(e);
+            _index.erase(entry);
+            destroy(entry);
             return true;
         }
         return false;
@@ -250,20 +305,15 @@ public:
 
     inline bool erase(const bytes& key)
     {
-        auto it = _dict.find(key, dict_entry::compare());
-        if (it != _dict.end()) {
-            _dict.erase_and_dispose(it, current_deleter<dict_entry>());
-            return true;
-        }
-        return false;
+        return erase(_index.find(key));
     }
 
     inline bool empty() const {
-        return _dict.empty();
+        return _index.empty();
     }
 
     inline size_t size() const {
-        return _dict.size();
+        return _index.size();
     }
 
     inline void clear() {
@@ -272,54 +322,56 @@ public:
 
     inline bool exists(const bytes& key) const
     {
-        return _dict.find(key, dict_entry::compare()) != _dict.end();
+        return _index.find(key) != nullptr;
     }
 
-    inline const dict_entry* begin() const
+    // Returns an entry picked uniformly with the numbers random() draws,
+    // or nullptr if the dict is empty.
+    template <typename Random>
+    const dict_entry* random_entry(Random&& random) const
     {
-        if (_dict.begin() != _dict.end()) {
-            const auto& e = *(_dict.begin());
-            return &e;
-        }
-        return nullptr;
-    }
-
-    inline const_iterator at(size_t index) const
-    {
-        assert(index >= 0 && index < size());
-        for (auto i = _dict.cbegin(); i != _dict.cend(); ++i, index--) {
-            if (index == 0) {
-                return i;
-            }
-        }
-        return _dict.cend();
+        return _index.random_entry(std::forward<Random>(random));
     }
 
     void fetch(const std::vector<bytes>& keys, std::vector<const dict_entry*>& entries) const {
         for (const auto& key : keys) {
-            auto it = _dict.find(key, dict_entry::compare());
-            if (it != _dict.end()) {
-                const auto& e = *it;
-                entries.push_back(&e);
-            }
-            else {
-                entries.push_back(nullptr);
-            }
+            entries.push_back(_index.find(key));
         }
     }
 
     void fetch(std::vector<const dict_entry*>& entries) const {
-        for (auto it = _dict.begin(); it != _dict.end(); ++it) {
-            const auto& e = *it;
-            entries.push_back(&e);
-        }
+        entries.reserve(entries.size() + size());
+        _index.for_each([&entries] (const dict_entry* e) {
+            entries.push_back(e);
+        });
+    }
+
+    // One step of HSCAN or SSCAN, see hash_index::scan.
+    template <typename Func>
+    size_t scan(size_t cursor, Func&& func) const
+    {
+        return _index.scan(cursor, [&func] (const dict_entry* e) {
+            func(*e);
+        });
+    }
+
+    // Bytes held by the dict: the slot tables, and the entries estimated
+    // from the first `samples` of them, or from all of them when 0.
+    size_t memory_usage(size_t samples) const
+    {
+        size_t bytes = 0;
+        auto sampled = _index.for_first(samples ? samples : size(), [&bytes] (const dict_entry* e) {
+            bytes += e->memory_usage();
+        });
+        auto entries = sampled ? static_cast<size_t>(double(bytes) / sampled * size()) : 0;
+        return _index.slot_memory() + entries;
     }
 
     void fetch_keys(std::vector<bytes>& entries) const {
-        for (auto it = _dict.begin(); it != _dict.end(); ++it) {
-            const auto& e = *it;
-            entries.emplace_back(std::move(bytes(e.key_data(), e.key_size())));
-        }
+        entries.reserve(entries.size() + size());
+        _index.for_each([&entries] (const dict_entry* e) {
+            entries.emplace_back(bytes(e->key_data(), e->key_size()));
+        });
     }
 };
 }
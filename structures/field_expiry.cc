@@ -0,0 +1,204 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#include "structures/field_expiry.hh"
+#include "utils/work_scheduler.hh"
+namespace redis {
+
+constexpr size_t field_expiry::fields_per_slice;
+
+field_expiry::field_expiry()
+{
+    _timer.set_callback([this] { on_timer(); });
+    _slice_timer.set_callback([this] { release_expired(); });
+}
+
+field_expiry::~field_expiry()
+{
+    clear();
+}
+
+void field_expiry::unlink(field_timer& t)
+{
+    if (t._expired) {
+        _expired.erase(_expired.iterator_to(t));
+        t._expired = false;
+    }
+    else {
+        _timers.remove(t);
+    }
+}
+
+void field_expiry::set(const bytes& key, const bytes& field, clock_type::time_point deadline)
+{
+    auto k = _keys.emplace(key, fields_type {}).first;
+    auto f = k->second.emplace(field, field_timer {});
+    auto& t = f.first->second;
+    if (f.second) {
+        t._key = &k->first;
+        t._field = &f.first->first;
+        ++_size;
+    }
+    else {
+        unlink(t);
+    }
+    t._deadline = deadline;
+    if (_timers.insert(t)) {
+        _timer.rearm(deadline);
+    }
+}
+
+const field_expiry::clock_type::time_point* field_expiry::find(const bytes& key, const bytes& field) const
+{
+    auto k = _keys.find(key);
+    if (k == _keys.end()) {
+        return nullptr;
+    }
+    auto f = k->second.find(field);
+    return f == k->second.end() ? nullptr : &f->second._deadline;
+}
+
+bool field_expiry::drop_field(const bytes& key, const bytes& field)
+{
+    auto k = _keys.find(key);
+    if (k == _keys.end()) {
+        return false;
+    }
+    auto f = k->second.find(field);
+    if (f == k->second.end()) {
+        return false;
+    }
+    unlink(f->second);
+    k->second.erase(f);
+    --_size;
+    if (k->second.empty()) {
+        _keys.erase(k);
+    }
+    return true;
+}
+
+void field_expiry::drop_key(const bytes& key)
+{
+    auto k = _keys.find(key);
+    if (k == _keys.end()) {
+        return;
+    }
+    for (auto& f : k->second) {
+        unlink(f.second);
+    }
+    _size -= k->second.size();
+    _keys.erase(k);
+}
+
+void field_expiry::rename_key(const bytes& from, const bytes& to)
+{
+    auto k = _keys.find(from);
+    if (k == _keys.end()) {
+        return;
+    }
+    // the nodes of the fields move with the map, the timers stay linked.
+    auto fields = std::move(k->second);
+    _keys.erase(k);
+    auto n = _keys.emplace(to, std::move(fields)).first;
+    for (auto& f : n->second) {
+        f.second._key = &n->first;
+    }
+}
+
+std::vector<bytes> field_expiry::take_expired(const bytes& key, clock_type::time_point now)
+{
+    std::vector<bytes> fields;
+    auto k = _keys.find(key);
+    if (k == _keys.end()) {
+        return fields;
+    }
+    auto& map = k->second;
+    for (auto f = map.begin(); f != map.end(); ) {
+        if (f->second._deadline > now) {
+            ++f;
+            continue;
+        }
+        unlink(f->second);
+        fields.push_back(f->first);
+        f = map.erase(f);
+        --_size;
+    }
+    _expired_total += fields.size();
+    if (map.empty()) {
+        _keys.erase(k);
+    }
+    return fields;
+}
+
+void field_expiry::clear()
+{
+    _expired.clear();
+    _timers.clear();
+    _keys.clear();
+    _size = 0;
+    _timer.cancel();
+    _slice_timer.cancel();
+}
+
+void field_expiry::on_timer()
+{
+    auto expired = _timers.expire(clock_type::now());
+    for (auto& t : expired) {
+        t._expired = true;
+    }
+    _expired.splice(_expired.end(), expired);
+    if (!_slice_timer.armed()) {
+        release_expired();
+    }
+    _timer.arm(_timers.get_next_timeout());
+}
+
+void field_expiry::release_expired()
+{
+    auto& scheduler = utils::local_work_scheduler();
+    if (!scheduler.try_run(utils::work_class::background)) {
+        _slice_timer.arm(scheduler.next_period());
+        return;
+    }
+    auto start = std::chrono::steady_clock::now();
+    size_t released = 0;
+    while (!_expired.empty()) {
+        auto& t = _expired.front();
+        // the releaser may drop the key, and the timer with it.
+        bytes key = *t._key;
+        bytes field = *t._field;
+        drop_field(key, field);
+        ++_expired_total;
+        if (_releaser) {
+            _releaser(key, field);
+        }
+        if (++released == fields_per_slice) {
+            break;
+        }
+        if (released % 16 == 0 && std::chrono::steady_clock::now() - start >= slice_duration) {
+            break;
+        }
+    }
+    scheduler.account(utils::work_class::background, std::chrono::steady_clock::now() - start);
+    if (!_expired.empty()) {
+        _slice_timer.arm(std::chrono::microseconds(0));
+    }
+}
+}
@@ -0,0 +1,108 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#pragma once
+#include <boost/intrusive/list.hpp>
+#include <chrono>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+#include "core/timer.hh"
+#include "core/timer-set.hh"
+#include "core/lowres_clock.hh"
+#include "utils/bytes.hh"
+#include "seastarx.hh"
+namespace redis {
+
+// The fields of the hashes of a shard which expire on their own, HEXPIRE.
+// Their deadlines are kept in a timer_set, the bucketed timer wheel the
+// cache keeps the expiring keys in, so that setting one and taking the
+// expired ones cost no more than they do for keys. The fields past their
+// deadline are handed to the releaser in slices, as the cache releases its
+// expired entries.
+//
+// The index lives out of the region: the hash only knows that some of its
+// fields expire, see cache_entry::has_field_ttls(), and a read of the hash
+// drops the fields past their deadline first, see take_expired().
+class field_expiry {
+public:
+    using clock_type = lowres_clock;
+    // Removes the field from the hash.
+    using releaser_type = std::function<void (const bytes& key, const bytes& field)>;
+    static constexpr size_t fields_per_slice = 1024;
+    static constexpr auto slice_duration = std::chrono::microseconds(500);
+private:
+    struct field_timer {
+        using time_point = clock_type::time_point;
+        using duration = clock_type::duration;
+        boost::intrusive::list_member_hook<> _link;
+        time_point _deadline;
+        // The keys of the maps holding the timer, whose nodes do not move.
+        const bytes* _key = nullptr;
+        const bytes* _field = nullptr;
+        // Taken from _timers, waiting in _expired.
+        bool _expired = false;
+
+        time_point get_timeout() const { return _deadline; }
+        bool cancel() const { return false; }
+    };
+    using fields_type = std::unordered_map<bytes, field_timer>;
+    // Declared before the timers, which must go first.
+    std::unordered_map<bytes, fields_type> _keys;
+    seastar::timer_set<field_timer, &field_timer::_link> _timers;
+    using expired_list_type = decltype(_timers)::timer_list_t;
+    expired_list_type _expired;
+    timer<clock_type> _timer;
+    timer<> _slice_timer;
+    releaser_type _releaser;
+    size_t _size = 0;
+    uint64_t _expired_total = 0;
+
+    void on_timer();
+    void release_expired();
+    // Takes the timer out of _timers or _expired.
+    void unlink(field_timer& t);
+public:
+    field_expiry();
+    ~field_expiry();
+    field_expiry(const field_expiry&) = delete;
+    field_expiry& operator = (const field_expiry&) = delete;
+
+    void set_releaser(releaser_type releaser) { _releaser = std::move(releaser); }
+    // The field expires at `deadline`, whatever it did before.
+    void set(const bytes& key, const bytes& field, clock_type::time_point deadline);
+    // The deadline of the field, null if it does not expire.
+    const clock_type::time_point* find(const bytes& key, const bytes& field) const;
+    // false if the field did not expire.
+    bool drop_field(const bytes& key, const bytes& field);
+    // Forgets the fields of the key, as it goes away.
+    void drop_key(const bytes& key);
+    // The fields of `from` become those of `to`, which has none, as RENAME
+    // moves the hash.
+    void rename_key(const bytes& from, const bytes& to);
+    // Forgets the fields of the key past `now`, and returns them.
+    std::vector<bytes> take_expired(const bytes& key, clock_type::time_point now);
+    void clear();
+
+    // The fields which expire, and those expired so far.
+    size_t size() const { return _size; }
+    uint64_t expired_fields() const { return _expired_total; }
+};
+}
@@ -19,6 +19,10 @@
 *
 */
 #include "geo.hh"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <immintrin.h>
 #include "util/log.hh"
 using logger =  seastar::logger;
 static logger geo_log ("db");
@@ -279,26 +283,32 @@ bool geo::dist(const double& lhash, const double& rhash, double& output)
     return dist(llongitude, llatitude, rlongitude, rlatitude, output);
 }
 
-static bool geohash_bounding_box(double longitude, double latitude, double radius, double* bounds)
+// The half extents of a shape, north-south and east-west.
+static inline double shape_half_height(const geo::shape& s)
+{
+    return s._box ? s._height / 2 : s._radius;
+}
+
+static inline double shape_half_width(const geo::shape& s)
+{
+    return s._box ? s._width / 2 : s._radius;
+}
+
+static bool geohash_bounding_box(const geo::shape& s, double* bounds)
 {
     if (!bounds) return false;
 
-    double lonr = deg_rad(longitude), latr = deg_rad(latitude);
-    if (radius > EARTH_RADIUS_IN_METERS)
-        radius = EARTH_RADIUS_IN_METERS;
-    double distance = radius / EARTH_RADIUS_IN_METERS;
-    double min_latitude = latr - distance;
-    double max_latitude = latr + distance;
-
-    double min_longitude, max_longitude;
-    double difference_longitude = std::asin(std::sin(distance) / std::cos(latr));
-    min_longitude = lonr - difference_longitude;
-    max_longitude = lonr + difference_longitude;
-
-    bounds[0] = rad_deg(min_longitude);
-    bounds[1] = rad_deg(min_latitude);
-    bounds[2] = rad_deg(max_longitude);
-    bounds[3] = rad_deg(max_latitude);
+    double height = std::min(shape_half_height(s), EARTH_RADIUS_IN_METERS);
+    double width = std::min(shape_half_width(s), EARTH_RADIUS_IN_METERS);
+    double lat_delta = rad_deg(height / EARTH_RADIUS_IN_METERS);
+    // a box spans the most longitude on its side nearer to the pole.
+    double lat_wide = s._latitude < 0 ? s._latitude - lat_delta : s._latitude + lat_delta;
+    double long_delta = rad_deg(width / EARTH_RADIUS_IN_METERS / std::cos(deg_rad(std::max(-89.0, std::min(89.0, lat_wide)))));
+
+    bounds[0] = s._longitude - long_delta;
+    bounds[1] = s._latitude - lat_delta;
+    bounds[2] = s._longitude + long_delta;
+    bounds[3] = s._latitude + lat_delta;
     return true;
 }
 
@@ -442,31 +452,28 @@ static void geohash_neighbors(const geo_hash& hash, geo_hash_neighbors& neighbor
     geohash_move_y(neighbors._south_west, -1);
 }
 
-static int fetch_points_in_box(geo_hash& h, double longitude, double latitude, double radius, geo::fetch_point& f, geo::points_type& points)
+// The scores of the points of a cell are the 52 bits hashes with its prefix.
+static std::pair<double, double> cell_range(const geo_hash& h)
 {
-    uint64_t min = 0, max = 0;
-    auto align_hash = [] (const geo_hash& h) -> uint64_t {
-        uint64_t hash = h._hash;
-        hash <<= (52 - h._step * 2);
-        return hash;
-    };
-    min = align_hash(h);
-    h._hash++;
-    max = align_hash(h);
-    return f(min, max, longitude, latitude, radius, points);
+    uint64_t min = h._hash << (52 - h._step * 2);
+    uint64_t max = (h._hash + 1) << (52 - h._step * 2);
+    return { static_cast<double>(min), static_cast<double>(max) };
 }
 
-bool geo::fetch_points_from_location(double longitude, double latitude, double radius, fetch_point&& f, points_type& points)
+bool geo::cover(const shape& s, std::vector<std::pair<double, double>>& ranges)
 {
     geo_radius output;
 
     double bounds[4];
-    if (geohash_bounding_box(longitude, latitude, radius, bounds) == false) {
+    if (geohash_bounding_box(s, bounds) == false) {
         return false;
     }
     double min_lon = bounds[0], max_lon = bounds[2], min_lat = bounds[1], max_lat = bounds[3];
+    double height = shape_half_height(s), width = shape_half_width(s);
+    double longitude = s._longitude, latitude = s._latitude;
 
-    // 1. step
+    // 1. step, from the radius of the circle around the shape.
+    double radius = s._box ? std::sqrt(width * width + height * height) : s._radius;
     output._hash._step = geohash_estimate_steps_by_radius(radius, latitude);
 
     // 2. hash
@@ -478,12 +485,12 @@ bool geo::fetch_points_from_location(double longitude, double latitude, double r
     // 3. neighbors
     geohash_neighbors(output._hash, output._neighbors);
 
-
     // 4. area
     if (geohash_decode_internal(longitude_range, latitude_range, output._hash, output._area) == false) {
         return false;
     }
 
+    // the neighbors must reach the edges of the shape, or the cells are too small.
     bool decrease_step = false;
     {
         geo_hash_area north, south, east, west;
@@ -493,21 +500,21 @@ bool geo::fetch_points_from_location(double longitude, double latitude, double r
         geohash_decode_internal(longitude_range, latitude_range, output._neighbors._east, east);
         geohash_decode_internal(longitude_range, latitude_range, output._neighbors._west, west);
 
-        if (dist_internal(longitude, latitude, longitude, north._latitude_range._max) < radius) {
+        if (dist_internal(longitude, latitude, longitude, north._latitude_range._max) < height) {
             decrease_step = true;
         }
-        if (dist_internal(longitude, latitude, longitude, south._latitude_range._min) < radius) {
+        if (dist_internal(longitude, latitude, longitude, south._latitude_range._min) < height) {
             decrease_step = true;
         }
-        if (dist_internal(longitude, latitude, east._longitude_range._max, latitude) < radius) {
+        if (dist_internal(longitude, latitude, east._longitude_range._max, latitude) < width) {
             decrease_step = true;
         }
-        if (dist_internal(longitude, latitude, west._longitude_range._min, latitude) < radius) {
+        if (dist_internal(longitude, latitude, west._longitude_range._min, latitude) < width) {
             decrease_step = true;
         }
     }
 
-    if (decrease_step) {
+    if (decrease_step && output._hash._step > 1) {
         output._hash._step--;
         if (geohash_encode_internal(longitude_range, latitude_range, longitude, latitude, output._hash._step, output._hash._hash) == false) {
             return false;
@@ -518,24 +525,28 @@ bool geo::fetch_points_from_location(double longitude, double latitude, double r
         }
     }
 
-    if (output._area._latitude_range._min < min_lat) {
-        output._neighbors._south._hash =  output._neighbors._south_west._hash = output._neighbors._south_east._hash = 0;
-        output._neighbors._south._step =  output._neighbors._south_west._step = output._neighbors._south_east._step = 0;
-    }
-    if (output._area._latitude_range._max > max_lat) {
-        output._neighbors._north._hash = output._neighbors._north_east._hash = output._neighbors._north_west._hash = 0;
-        output._neighbors._north._step = output._neighbors._north_east._step = output._neighbors._north_west._step = 0;
-    }
-    if (output._area._longitude_range._min < min_lon) {
-        output._neighbors._west._hash = output._neighbors._south_west._hash = output._neighbors._north_west._hash = 0;
-        output._neighbors._west._step = output._neighbors._south_west._step = output._neighbors._north_west._step = 0;
-    }
-    if (output._area._longitude_range._max > max_lon) {
-        output._neighbors._east._hash = output._neighbors._south_east._hash = output._neighbors._north_east._hash = 0;
-        output._neighbors._east._step = output._neighbors._south_east._step = output._neighbors._north_east._step = 0;
+    // skip the neighbors on the sides the shape does not reach, the cells of
+    // the first steps are too large to tell.
+    if (output._hash._step >= 2) {
+        if (output._area._latitude_range._min < min_lat) {
+            output._neighbors._south._hash =  output._neighbors._south_west._hash = output._neighbors._south_east._hash = 0;
+            output._neighbors._south._step =  output._neighbors._south_west._step = output._neighbors._south_east._step = 0;
+        }
+        if (output._area._latitude_range._max > max_lat) {
+            output._neighbors._north._hash = output._neighbors._north_east._hash = output._neighbors._north_west._hash = 0;
+            output._neighbors._north._step = output._neighbors._north_east._step = output._neighbors._north_west._step = 0;
+        }
+        if (output._area._longitude_range._min < min_lon) {
+            output._neighbors._west._hash = output._neighbors._south_west._hash = output._neighbors._north_west._hash = 0;
+            output._neighbors._west._step = output._neighbors._south_west._step = output._neighbors._north_west._step = 0;
+        }
+        if (output._area._longitude_range._max > max_lon) {
+            output._neighbors._east._hash = output._neighbors._south_east._hash = output._neighbors._north_east._hash = 0;
+            output._neighbors._east._step = output._neighbors._south_east._step = output._neighbors._north_east._step = 0;
+        }
     }
 
-    geo_hash gh[9] = {
+    const geo_hash gh[9] = {
         output._hash,
         output._neighbors._north,
         output._neighbors._south,
@@ -546,22 +557,251 @@ bool geo::fetch_points_from_location(double longitude, double latitude, double r
         output._neighbors._south_east,
         output._neighbors._south_west
     };
-    size_t count = 0;
-    int last_processed = 0;
+    ranges.clear();
     for (int i = 0; i < 9; ++i) {
         auto& h = gh[i];
         if (h._hash == 0 && h._step == 0) {
             continue;
         }
-        if (last_processed && gh[i]._hash == gh[last_processed]._hash && gh[i]._step == gh[last_processed]._step) {
+        // neighbors wrap around the poles and the antimeridian onto the same cells.
+        auto range = cell_range(h);
+        if (std::find(ranges.begin(), ranges.end(), range) != ranges.end()) {
             continue;
         }
-        count += fetch_points_in_box(gh[i], longitude, latitude, radius, f, points);
-        last_processed = i;
+        ranges.emplace_back(range);
+    }
+    return true;
+}
+
+bool geo::within(const shape& s, double longitude, double latitude, double& dist)
+{
+    if (!s._box) {
+        dist = dist_internal(s._longitude, s._latitude, longitude, latitude);
+        return dist <= s._radius;
+    }
+    // the east-west extent is measured along the latitude of the point.
+    if (EARTH_RADIUS_IN_METERS * std::fabs(deg_rad(latitude) - deg_rad(s._latitude)) > s._height / 2) {
+        return false;
+    }
+    if (dist_internal(longitude, latitude, s._longitude, latitude) > s._width / 2) {
+        return false;
     }
+    dist = dist_internal(s._longitude, s._latitude, longitude, latitude);
     return true;
 }
 
+namespace {
+
+// The inputs of the AVX2 filter of within_batch, derived once per shape.
+struct shape_filter {
+    double _longitude;
+    double _latitude;
+    // a point may be inside if its haversine term is at most this.
+    double _max_term;
+    double _max_lat_dist;
+};
+
+// The haversine term of an arc of `dist` meters. The margins cover the
+// error of the vector sine, candidates are confirmed by geo::within.
+inline double max_haversine_term(double dist)
+{
+    auto half_angle = dist / (2 * EARTH_RADIUS_IN_METERS);
+    if (half_angle >= std::acos(-1) / 2) {
+        return std::numeric_limits<double>::infinity();
+    }
+    auto sine = std::sin(half_angle);
+    return sine * sine * (1 + 1e-9) + 1e-18;
+}
+
+[[gnu::target("avx2")]]
+inline __m256i to_uint64_avx2(__m256d x)
+{
+    // exact for integers below 2^52, as geohash scores are.
+    const __m256d magic = _mm256_set1_pd(4503599627370496.0);
+    x = _mm256_round_pd(x, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+    return _mm256_xor_si256(_mm256_castpd_si256(_mm256_add_pd(x, magic)), _mm256_castpd_si256(magic));
+}
+
+[[gnu::target("avx2")]]
+inline __m256d to_double_avx2(__m256i x)
+{
+    // x holds 32 bits integers in 64 bits lanes.
+    const __m256d magic = _mm256_set1_pd(4503599627370496.0);
+    return _mm256_sub_pd(_mm256_castsi256_pd(_mm256_or_si256(x, _mm256_castpd_si256(magic))), magic);
+}
+
+[[gnu::target("avx2")]]
+inline __m256i deinterleave_avx2(__m256i interleaved)
+{
+    auto x = interleaved;
+    auto y = _mm256_srli_epi64(interleaved, 1);
+    const uint64_t B[] = {
+        0x5555555555555555ULL,
+        0x3333333333333333ULL,
+        0x0F0F0F0F0F0F0F0FULL,
+        0x00FF00FF00FF00FFULL,
+        0x0000FFFF0000FFFFULL,
+        0x00000000FFFFFFFFULL
+    };
+    const int S[] = {0, 1, 2, 4, 8, 16};
+    for (int i = 0; i < 6; ++i) {
+        auto b = _mm256_set1_epi64x(B[i]);
+        auto shift = _mm_cvtsi32_si128(S[i]);
+        x = _mm256_and_si256(_mm256_or_si256(x, _mm256_srl_epi64(x, shift)), b);
+        y = _mm256_and_si256(_mm256_or_si256(y, _mm256_srl_epi64(y, shift)), b);
+    }
+    return _mm256_or_si256(x, _mm256_slli_epi64(y, 32));
+}
+
+// The center of the cells `v` of an axis, as decode_from_geohash has it.
+[[gnu::target("avx2")]]
+inline __m256d decode_range_avx2(__m256d v, double min, double scale)
+{
+    const auto cell = _mm256_set1_pd(1.0 / (1ull << GEO_HASH_STEP_MAX));
+    auto lo = _mm256_add_pd(_mm256_set1_pd(min), _mm256_mul_pd(_mm256_mul_pd(v, cell), _mm256_set1_pd(scale)));
+    auto hi = _mm256_add_pd(_mm256_set1_pd(min), _mm256_mul_pd(_mm256_mul_pd(_mm256_add_pd(v, _mm256_set1_pd(1)), cell), _mm256_set1_pd(scale)));
+    return _mm256_mul_pd(_mm256_add_pd(lo, hi), _mm256_set1_pd(0.5));
+}
+
+// The same operations as geo::decode_from_geohash, four scores at a time,
+// so both give the same coordinates.
+[[gnu::target("avx2")]]
+void decode_avx2(const double* scores, size_t n, double* longitudes, double* latitudes)
+{
+    const auto low = _mm256_set1_epi64x(0xffffffffULL);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        auto hash_sep = deinterleave_avx2(to_uint64_avx2(_mm256_loadu_pd(scores + i)));
+        auto ilato = to_double_avx2(_mm256_and_si256(hash_sep, low));
+        auto ilono = to_double_avx2(_mm256_srli_epi64(hash_sep, 32));
+        _mm256_storeu_pd(latitudes + i, decode_range_avx2(ilato, GEO_LAT_MIN, GEO_LAT_SCALE));
+        _mm256_storeu_pd(longitudes + i, decode_range_avx2(ilono, GEO_LONG_MIN, GEO_LONG_SCALE));
+    }
+    for (; i < n; ++i) {
+        geo::decode_from_geohash(scores[i], longitudes[i], latitudes[i]);
+    }
+}
+
+void decode_scalar(const double* scores, size_t n, double* longitudes, double* latitudes)
+{
+    for (size_t i = 0; i < n; ++i) {
+        geo::decode_from_geohash(scores[i], longitudes[i], latitudes[i]);
+    }
+}
+
+// sin(x) for |x| < 4 with the fdlibm kernels, about 1e-16 off.
+[[gnu::target("avx2")]]
+inline __m256d sin_avx2(__m256d x)
+{
+    const double S1 = -1.66666666666666324348e-01, S2 = 8.33333333332248946124e-03, S3 = -1.98412698298579493134e-04,
+                 S4 = 2.75573137070700676789e-06, S5 = -2.50507602534068634195e-08, S6 = 1.58969099521155010221e-10;
+    const double C1 = 4.16666666666666019037e-02, C2 = -1.38888888888741095749e-03, C3 = 2.48015872894767294178e-05,
+                 C4 = -2.75573143513906633035e-07, C5 = 2.08757232129817482790e-09, C6 = -1.13596475577881948265e-11;
+    // reduce to [-pi/4, pi/4] and the quadrant q.
+    auto j = _mm256_round_pd(_mm256_mul_pd(x, _mm256_set1_pd(6.36619772367581382433e-01)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    auto y = _mm256_sub_pd(_mm256_sub_pd(x, _mm256_mul_pd(j, _mm256_set1_pd(1.57079632673412561417e+00))), _mm256_mul_pd(j, _mm256_set1_pd(6.07710050650619224932e-11)));
+    auto z = _mm256_mul_pd(y, y);
+    auto ps = _mm256_add_pd(_mm256_set1_pd(S5), _mm256_mul_pd(z, _mm256_set1_pd(S6)));
+    ps = _mm256_add_pd(_mm256_set1_pd(S4), _mm256_mul_pd(z, ps));
+    ps = _mm256_add_pd(_mm256_set1_pd(S3), _mm256_mul_pd(z, ps));
+    ps = _mm256_add_pd(_mm256_set1_pd(S2), _mm256_mul_pd(z, ps));
+    ps = _mm256_add_pd(_mm256_set1_pd(S1), _mm256_mul_pd(z, ps));
+    auto sine = _mm256_add_pd(y, _mm256_mul_pd(_mm256_mul_pd(y, z), ps));
+    auto pc = _mm256_add_pd(_mm256_set1_pd(C5), _mm256_mul_pd(z, _mm256_set1_pd(C6)));
+    pc = _mm256_add_pd(_mm256_set1_pd(C4), _mm256_mul_pd(z, pc));
+    pc = _mm256_add_pd(_mm256_set1_pd(C3), _mm256_mul_pd(z, pc));
+    pc = _mm256_add_pd(_mm256_set1_pd(C2), _mm256_mul_pd(z, pc));
+    pc = _mm256_add_pd(_mm256_set1_pd(C1), _mm256_mul_pd(z, pc));
+    auto cosine = _mm256_add_pd(_mm256_sub_pd(_mm256_set1_pd(1), _mm256_mul_pd(_mm256_set1_pd(0.5), z)), _mm256_mul_pd(_mm256_mul_pd(z, z), pc));
+    auto q = _mm256_sub_pd(j, _mm256_mul_pd(_mm256_floor_pd(_mm256_mul_pd(j, _mm256_set1_pd(0.25))), _mm256_set1_pd(4)));
+    auto odd = _mm256_cmp_pd(_mm256_sub_pd(q, _mm256_mul_pd(_mm256_floor_pd(_mm256_mul_pd(q, _mm256_set1_pd(0.5))), _mm256_set1_pd(2))), _mm256_set1_pd(1), _CMP_EQ_OQ);
+    auto negative = _mm256_cmp_pd(q, _mm256_set1_pd(2), _CMP_GE_OQ);
+    return _mm256_xor_pd(_mm256_blendv_pd(sine, cosine, odd), _mm256_and_pd(negative, _mm256_set1_pd(-0.0)));
+}
+
+// Marks the points that may lie in the shape, four at a time: the
+// haversine term of the distance from the center for a circle, the
+// latitude distance and the term along the latitude of the point for a box.
+[[gnu::target("avx2")]]
+void filter_avx2(const geo::shape& s, const shape_filter& f, const double* longitudes, const double* latitudes, size_t n, uint8_t* maybe)
+{
+    const auto to_rad = _mm256_set1_pd(std::acos(-1) / 180.0);
+    const auto half = _mm256_set1_pd(0.5);
+    const auto quarter_turn = _mm256_set1_pd(std::acos(-1) / 2);
+    const auto center_lat = _mm256_set1_pd(deg_rad(f._latitude));
+    const auto center_lon = _mm256_set1_pd(deg_rad(f._longitude));
+    const auto center_cos = _mm256_set1_pd(std::cos(deg_rad(f._latitude)));
+    const auto max_term = _mm256_set1_pd(f._max_term);
+    const auto max_lat_dist = _mm256_set1_pd(f._max_lat_dist);
+    const auto radius = _mm256_set1_pd(EARTH_RADIUS_IN_METERS);
+    const auto abs_mask = _mm256_castsi256_pd(_mm256_set1_epi64x(0x7fffffffffffffffULL));
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        auto lat = _mm256_mul_pd(_mm256_loadu_pd(latitudes + i), to_rad);
+        auto lon = _mm256_mul_pd(_mm256_loadu_pd(longitudes + i), to_rad);
+        auto cos_lat = sin_avx2(_mm256_add_pd(lat, quarter_turn));
+        auto v = sin_avx2(_mm256_mul_pd(_mm256_sub_pd(center_lon, lon), half));
+        auto vv = _mm256_mul_pd(v, v);
+        __m256d mask;
+        if (!s._box) {
+            auto u = sin_avx2(_mm256_mul_pd(_mm256_sub_pd(lat, center_lat), half));
+            auto term = _mm256_add_pd(_mm256_mul_pd(u, u), _mm256_mul_pd(_mm256_mul_pd(center_cos, cos_lat), vv));
+            mask = _mm256_cmp_pd(term, max_term, _CMP_LE_OQ);
+        }
+        else {
+            auto lat_dist = _mm256_mul_pd(radius, _mm256_and_pd(_mm256_sub_pd(lat, center_lat), abs_mask));
+            auto term = _mm256_mul_pd(_mm256_mul_pd(cos_lat, cos_lat), vv);
+            mask = _mm256_and_pd(_mm256_cmp_pd(lat_dist, max_lat_dist, _CMP_LE_OQ), _mm256_cmp_pd(term, max_term, _CMP_LE_OQ));
+        }
+        auto bits = _mm256_movemask_pd(mask);
+        for (int k = 0; k < 4; ++k) {
+            maybe[i + k] = (bits >> k) & 1;
+        }
+    }
+    for (; i < n; ++i) {
+        maybe[i] = 1;
+    }
+}
+
+void filter_scalar(const geo::shape&, const shape_filter&, const double*, const double*, size_t n, uint8_t* maybe)
+{
+    std::fill(maybe, maybe + n, 1);
+}
+
+using decode_function = void (*)(const double*, size_t, double*, double*);
+using filter_function = void (*)(const geo::shape&, const shape_filter&, const double*, const double*, size_t, uint8_t*);
+
+bool has_avx2()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+
+}
+
+void geo::decode_batch(const double* scores, size_t n, double* longitudes, double* latitudes)
+{
+    static const decode_function decode_impl = has_avx2() ? decode_avx2 : decode_scalar;
+    decode_impl(scores, n, longitudes, latitudes);
+}
+
+size_t geo::within_batch(const shape& s, const double* longitudes, const double* latitudes, size_t n, uint8_t* inside, double* dists)
+{
+    static const filter_function filter_impl = has_avx2() ? filter_avx2 : filter_scalar;
+    shape_filter f { s._longitude, s._latitude,
+        max_haversine_term(s._box ? s._width / 2 : s._radius),
+        s._box ? s._height / 2 * (1 + 1e-9) + 1e-6 : std::numeric_limits<double>::infinity() };
+    filter_impl(s, f, longitudes, latitudes, n, inside);
+    size_t count = 0;
+    for (size_t i = 0; i < n; ++i) {
+        if (inside[i]) {
+            inside[i] = within(s, longitudes[i], latitudes[i], dists[i]);
+            count += inside[i];
+        }
+    }
+    return count;
+}
+
 bool geo::to_meters(double& n, int flags)
 {
     if (flags & GEO_UNIT_M) {
@@ -570,10 +810,10 @@ bool geo::to_meters(double& n, int flags)
         n *= 1000;
     }
     else if (flags & GEO_UNIT_MI) {
-        n *= 0.3048;
+        n *= 1609.34;
     }
     else if (flags & GEO_UNIT_FT) {
-        n *= 1609.34;
+        n *= 0.3048;
     }
     else {
         return false;
@@ -589,10 +829,10 @@ bool geo::from_meters(double& n, int flags)
         n /= 1000;
     }
     else if (flags & GEO_UNIT_MI) {
-        n /= 0.3048;
+        n /= 1609.34;
     }
     else if (flags & GEO_UNIT_FT) {
-        n /= 1609.34;
+        n /= 0.3048;
     }
     else {
         return false;
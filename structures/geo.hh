@@ -20,6 +20,7 @@
 */
 #pragma once
 #include "utils/bytes.hh"
+#include <vector>
 namespace redis {
 static constexpr const int GEODIST_UNIT_M  = (1 << 0);
 static constexpr const int GEODIST_UNIT_KM = (1 << 1);
@@ -39,6 +40,7 @@ static constexpr const int GEO_UNIT_M      = (1 << 9);
 static constexpr const int GEO_UNIT_KM     = (1 << 10);
 static constexpr const int GEO_UNIT_MI     = (1 << 11);
 static constexpr const int GEO_UNIT_FT     = (1 << 12);
+static constexpr const int GEORADIUS_ANY         = (1 << 13);
 class geo {
 public:
     static bool encode_to_geohash(const double& longitude, const double& latitude, double& geohash);
@@ -48,10 +50,27 @@ public:
     static bool dist(const double& llongitude, const double& llatitude, const double& rlongtitude, const double& rlatitude, double& line);
     static bytes to_bytes(const long long& u);
 
-    //[key, dist, score, longitude, latitude]
-    using points_type = std::vector<std::tuple<bytes, double, double, double, double>>;
-    using fetch_point = std::function<size_t (uint64_t, uint64_t, const double, const double, const double, points_type& points)>;
-    static bool fetch_points_from_location(double longitude, double latitude, double radius, fetch_point&& f, points_type& points);
+
+    // The area of GEORADIUS and GEOSEARCH, a circle or a box, in meters.
+    struct shape {
+        double _longitude = 0;
+        double _latitude = 0;
+        bool _box = false;
+        double _radius = 0;
+        double _width = 0;
+        double _height = 0;
+    };
+    // The score ranges [min, max) of the geohash cells covering the shape:
+    // the cell of the center and those of its 8 neighbors the shape reaches.
+    static bool cover(const shape& s, std::vector<std::pair<double, double>>& ranges);
+    // Whether a point lies in the shape, and its distance from the center.
+    static bool within(const shape& s, double longitude, double latitude, double& dist);
+    // decode_from_geohash of `n` scores, with AVX2 where the CPU has it.
+    static void decode_batch(const double* scores, size_t n, double* longitudes, double* latitudes);
+    // within of `n` points: flags inside[i] and sets dists[i] for those in
+    // the shape, and returns how many are. With AVX2 a vector haversine
+    // discards most of the others before the exact test.
+    static size_t within_batch(const shape& s, const double* longitudes, const double* latitudes, size_t n, uint8_t* inside, double* dists);
     static bool to_meters(double& n, int flags);
     static bool from_meters(double& n, int flags);
 };
@@ -0,0 +1,454 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#pragma once
+#include <memory>
+#include <utility>
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+#include "utils/bytes.hh"
+#include "structures/scan_cursor.hh"
+namespace redis {
+
+// Open addressing hash table with linear probing, indexing entries by key.
+// Every slot keeps the hash of its entry, so probing compares keys only on
+// a hash match. The index does not own the entries. They are allocated by
+// the current allocator, the slot arrays are not, so entries may be moved
+// by LSA while the slots stay put: an entry keeps a pointer to its slot in
+// `Entry::_slot`, which its move constructor repoints.
+//
+// Growing and shrinking are incremental: a new table is allocated and every
+// operation migrates a few slots of the old one. While rehashing, inserts go
+// to the new table, lookups probe both, and erasing from the old table
+// leaves a tombstone so the slots not migrated yet never move.
+//
+// Entry must provide `Entry** _slot`, `size_t _key_hash` and
+// `bool equals(bytes_view key, size_t hash) const`.
+template <typename Entry>
+class hash_index final {
+    struct slot {
+        size_t _hash;
+        Entry* _entry;
+    };
+    struct table {
+        std::unique_ptr<slot[]> _slots;
+        size_t _capacity = 0;
+        size_t _size = 0;
+
+        table() = default;
+        explicit table(size_t capacity)
+            : _slots(new slot[capacity]())
+            , _capacity(capacity)
+        {
+        }
+        table(table&& o) noexcept
+            : _slots(std::move(o._slots))
+            , _capacity(std::exchange(o._capacity, 0))
+            , _size(std::exchange(o._size, 0))
+        {
+        }
+        table& operator=(table&& o) noexcept
+        {
+            _slots = std::move(o._slots);
+            _capacity = std::exchange(o._capacity, 0);
+            _size = std::exchange(o._size, 0);
+            return *this;
+        }
+
+        inline bool owns(const slot* s) const {
+            return s >= _slots.get() && s < _slots.get() + _capacity;
+        }
+    };
+    static constexpr size_t initial_capacity = 8;
+    static constexpr size_t max_random_draws = 64;
+    static constexpr size_t rehash_slots_per_operation = 16;
+
+    table _table;
+    table _old;
+    size_t _rehash_index = 0;
+
+    static inline Entry* tombstone() {
+        return reinterpret_cast<Entry*>(uintptr_t(1));
+    }
+
+    static inline bool live(const slot& s) {
+        return s._entry != nullptr && s._entry != tombstone();
+    }
+
+    static inline slot* slot_of(const Entry* e) {
+        return reinterpret_cast<slot*>(reinterpret_cast<char*>(e->_slot) - offsetof(slot, _entry));
+    }
+
+    static slot* probe(const table& t, bytes_view k, size_t hash)
+    {
+        if (t._size == 0) {
+            return nullptr;
+        }
+        auto mask = t._capacity - 1;
+        for (auto i = hash & mask; ; i = (i + 1) & mask) {
+            auto& s = t._slots[i];
+            if (s._entry == nullptr) {
+                return nullptr;
+            }
+            if (s._entry != tombstone() && s._hash == hash && s._entry->equals(k, hash)) {
+                return &s;
+            }
+        }
+    }
+
+    // Places the entry into a table without tombstones.
+    static void place(table& t, size_t hash, Entry* e)
+    {
+        auto mask = t._capacity - 1;
+        auto i = hash & mask;
+        while (t._slots[i]._entry != nullptr) {
+            i = (i + 1) & mask;
+        }
+        t._slots[i] = slot { hash, e };
+        e->_slot = &t._slots[i]._entry;
+        ++t._size;
+    }
+
+    // Removes the slot from a table without tombstones, shifting back the
+    // entries behind it so that no probe sequence is broken.
+    static void remove(table& t, slot& s)
+    {
+        auto mask = t._capacity - 1;
+        auto i = static_cast<size_t>(&s - t._slots.get());
+        for (auto j = (i + 1) & mask; t._slots[j]._entry != nullptr; j = (j + 1) & mask) {
+            auto home = t._slots[j]._hash & mask;
+            // The entry at j may fill the hole at i unless its home slot is
+            // cyclically in (i, j].
+            bool stays = i <= j ? (home > i && home <= j) : (home > i || home <= j);
+            if (!stays) {
+                t._slots[i] = t._slots[j];
+                t._slots[i]._entry->_slot = &t._slots[i]._entry;
+                i = j;
+            }
+        }
+        t._slots[i]._entry = nullptr;
+        --t._size;
+    }
+
+    void start_rehash(size_t capacity)
+    {
+        _old = std::move(_table);
+        _table = table(capacity);
+        _rehash_index = 0;
+    }
+
+    void rehash_step(size_t slots)
+    {
+        if (!_old._slots) {
+            return;
+        }
+        auto end = std::min(_old._capacity, _rehash_index + slots);
+        for (; _rehash_index < end; ++_rehash_index) {
+            auto& s = _old._slots[_rehash_index];
+            if (live(s)) {
+                place(_table, s._hash, s._entry);
+                s._entry = tombstone();
+                --_old._size;
+            }
+        }
+        if (_rehash_index == _old._capacity) {
+            _old = table();
+            _rehash_index = 0;
+        }
+    }
+
+    void maybe_grow()
+    {
+        if (_old._slots) {
+            rehash_step(rehash_slots_per_operation);
+            // inserts outran the migration, finish it.
+            if ((_table._size + 1) * 4 > _table._capacity * 3) {
+                rehash_step(_old._capacity);
+            }
+        }
+        if (!_table._slots) {
+            _table = table(initial_capacity);
+        }
+        else if (!_old._slots && (_table._size + 1) * 4 > _table._capacity * 3) {
+            start_rehash(_table._capacity * 2);
+        }
+    }
+
+    void maybe_shrink()
+    {
+        if (_old._slots) {
+            rehash_step(rehash_slots_per_operation);
+        }
+        else if (_table._capacity > initial_capacity && _table._size * 8 < _table._capacity) {
+            start_rehash(_table._capacity / 2);
+        }
+    }
+
+    // Visits the entries whose home slot in `t` is `home`. They all live
+    // in the run of slots starting there.
+    template <typename Func>
+    static void visit_home(const table& t, size_t home, Func& func)
+    {
+        if (!t._slots) {
+            return;
+        }
+        auto mask = t._capacity - 1;
+        for (auto i = home; t._slots[i]._entry != nullptr; i = (i + 1) & mask) {
+            auto& s = t._slots[i];
+            if (s._entry != tombstone() && (s._hash & mask) == home) {
+                func(s._entry);
+            }
+        }
+    }
+
+    template <typename Func>
+    void for_each_table(Func&& func) const
+    {
+        func(_table);
+        if (_old._slots) {
+            func(_old);
+        }
+    }
+public:
+    hash_index() noexcept
+    {
+    }
+
+    hash_index(hash_index&& o) noexcept
+        : _table(std::move(o._table))
+        , _old(std::move(o._old))
+        , _rehash_index(std::exchange(o._rehash_index, 0))
+    {
+    }
+
+    static inline size_t hash_of(const bytes& k) {
+        return std::hash<bytes_view>()(bytes_view {k.data(), k.size()});
+    }
+
+    inline size_t size() const {
+        return _table._size + _old._size;
+    }
+
+    // Bytes of the slot tables, which are not in the region.
+    inline size_t slot_memory() const {
+        return (_table._capacity + _old._capacity) * sizeof(slot);
+    }
+
+    inline bool empty() const {
+        return size() == 0;
+    }
+
+    // Sizes the index for `n` entries in all, so that a bulk insert does
+    // not rehash through every power of two on the way: an empty index
+    // takes the table at once, a larger one migrates to it as it does when
+    // it grows.
+    void reserve(size_t n)
+    {
+        size_t capacity = initial_capacity;
+        while ((n + 1) * 4 > capacity * 3) {
+            capacity *= 2;
+        }
+        if (capacity <= _table._capacity) {
+            return;
+        }
+        if (empty()) {
+            _old = table();
+            _rehash_index = 0;
+            _table = table(capacity);
+        }
+        else if (!_old._slots) {
+            start_rehash(capacity);
+        }
+    }
+
+    inline Entry* find(bytes_view k, size_t hash) const
+    {
+        auto s = probe(_table, k, hash);
+        if (!s && _old._slots) {
+            s = probe(_old, k, hash);
+        }
+        return s ? s->_entry : nullptr;
+    }
+
+    inline Entry* find(const bytes& k) const
+    {
+        return find(bytes_view {k.data(), k.size()}, hash_of(k));
+    }
+
+    // Links an entry whose key is not in the index yet.
+    void insert(Entry* e)
+    {
+        maybe_grow();
+        place(_table, e->_key_hash, e);
+    }
+
+    // Puts `e` into the slot of `old`, which has the same key.
+    void replace(Entry* old, Entry* e)
+    {
+        e->_slot = old->_slot;
+        *e->_slot = e;
+        old->_slot = nullptr;
+    }
+
+    // Unlinks a linked entry.
+    void erase(Entry* e)
+    {
+        auto s = slot_of(e);
+        e->_slot = nullptr;
+        if (_old.owns(s)) {
+            s->_entry = tombstone();
+            --_old._size;
+        }
+        else {
+            remove(_table, *s);
+        }
+        maybe_shrink();
+    }
+
+    // Returns an entry picked uniformly with the numbers random() draws, or
+    // nullptr if the index is empty. Random slots are drawn until one is
+    // live, a few draws as a table is at least 1/16 full, see maybe_shrink().
+    // Past max_random_draws the entry after the last slot drawn is taken.
+    template <typename Random>
+    Entry* random_entry(Random&& random) const
+    {
+        if (empty()) {
+            return nullptr;
+        }
+        const table* t = nullptr;
+        size_t i = 0;
+        for (size_t draws = 0; draws < max_random_draws; ++draws) {
+            t = (random() % size()) < _old._size ? &_old : &_table;
+            i = random() & (t->_capacity - 1);
+            if (live(t->_slots[i])) {
+                return t->_slots[i]._entry;
+            }
+        }
+        for (auto mask = t->_capacity - 1; ; i = (i + 1) & mask) {
+            if (live(t->_slots[i])) {
+                return t->_slots[i]._entry;
+            }
+        }
+    }
+
+    // Visits up to `count` entries in slot order, returns how many were
+    // visited.
+    template <typename Func>
+    size_t for_first(size_t count, Func&& func) const
+    {
+        size_t visited = 0;
+        for_each_table([&func, count, &visited] (const table& t) {
+            for (size_t i = 0; i < t._capacity && visited < count; ++i) {
+                if (live(t._slots[i])) {
+                    func(t._slots[i]._entry);
+                    ++visited;
+                }
+            }
+        });
+        return visited;
+    }
+
+    template <typename Func>
+    void for_each(Func&& func) const
+    {
+        for_each_table([&func] (const table& t) {
+            for (size_t i = 0; i < t._capacity; ++i) {
+                if (live(t._slots[i])) {
+                    func(t._slots[i]._entry);
+                }
+            }
+        });
+    }
+
+    // Visits the entries of one home slot, and of the slots it is split
+    // into in the larger table while rehashing, see scan_cursor. Returns
+    // the next cursor, 0 once every entry has been visited: an entry
+    // present for the whole iteration is visited at least once.
+    template <typename Func>
+    size_t scan(size_t cursor, Func&& func) const
+    {
+        if (empty()) {
+            return 0;
+        }
+        if (!_old._slots) {
+            auto mask = _table._capacity - 1;
+            visit_home(_table, cursor & mask, func);
+            return scan_cursor::next(cursor, mask);
+        }
+        auto small = &_old, large = &_table;
+        if (small->_capacity > large->_capacity) {
+            std::swap(small, large);
+        }
+        auto small_mask = small->_capacity - 1, large_mask = large->_capacity - 1;
+        visit_home(*small, cursor & small_mask, func);
+        do {
+            visit_home(*large, cursor & large_mask, func);
+            cursor = scan_cursor::next(cursor, large_mask);
+        } while (cursor & (small_mask ^ large_mask));
+        return cursor;
+    }
+
+    // Unlinks every entry, passing it to `dispose`.
+    template <typename Dispose>
+    void clear_and_dispose(Dispose&& dispose)
+    {
+        for_each([&dispose] (Entry* e) {
+            e->_slot = nullptr;
+            dispose(e);
+        });
+        _table = table();
+        _old = table();
+        _rehash_index = 0;
+    }
+
+    // Unlinks up to `count` entries, passing each to `dispose`, and returns
+    // how many were unlinked. The index is only fit to be disposed further
+    // or destroyed afterwards.
+    template <typename Dispose>
+    size_t dispose_some(size_t count, Dispose&& dispose)
+    {
+        size_t disposed = 0;
+        while (disposed < count && size() > 0) {
+            if (!_old._slots) {
+                _old = std::move(_table);
+                _table = table();
+                _rehash_index = 0;
+            }
+            for (; _rehash_index < _old._capacity && disposed < count; ++_rehash_index) {
+                auto& s = _old._slots[_rehash_index];
+                if (live(s)) {
+                    auto e = s._entry;
+                    s._entry = tombstone();
+                    --_old._size;
+                    e->_slot = nullptr;
+                    dispose(e);
+                    ++disposed;
+                }
+            }
+            if (_rehash_index == _old._capacity) {
+                _old = table();
+                _rehash_index = 0;
+            }
+        }
+        return disposed;
+    }
+};
+}
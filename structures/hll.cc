@@ -20,6 +20,12 @@
 */
 #include "hll.hh"
 #include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <vector>
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
 namespace redis {
 
 static constexpr const int HLL_BUCKET_COUNT_MASK = HLL_BUCKET_COUNT - 1; 
@@ -36,6 +42,21 @@ static constexpr const double PE[64] = {
     1.0 / (1ULL << 57), 1.0 / (1ULL << 58), 1.0 / (1ULL << 59), 1.0 / (1ULL << 60), 1.0 / (1ULL << 61), 1.0 / (1ULL << 62), 1.0 / (1ULL << 63) 
 };
 
+// A value of HLL_BYTES_SIZE is dense, anything shorter holds the sparse
+// encoding of Redis after the cached card, a sequence of runs:
+//   ZERO  00xxxxxx           1..64 zero registers
+//   XZERO 01xxxxxx yyyyyyyy  1..16384 zero registers
+//   VAL   1vvvvvxx           1..4 registers of value 1..32
+static constexpr const unsigned HLL_SPARSE_VAL_MAX = 32;
+static constexpr const size_t HLL_SPARSE_VAL_RUN_MAX = 4;
+static constexpr const size_t HLL_SPARSE_ZERO_RUN_MAX = 64;
+static constexpr const size_t HLL_SPARSE_XZERO_RUN_MAX = 16384;
+
+static inline bool hll_is_sparse(size_t size)
+{
+    return size != HLL_BYTES_SIZE;
+}
+
 static inline void hll_invalidate_cache(uint8_t* cache, size_t size)
 {
     if (size > 7) {
@@ -55,7 +76,8 @@ static inline void hll_get_counter_on_bucket(uint8_t& counter, const uint8_t* p,
     unsigned long _fb = index * HLL_BITS & 7;
     unsigned long _fb8 = 8 - _fb;
     unsigned long b0 = _p[_byte];
-    unsigned long b1 = _p[_byte+1];
+    // the last register ends on a byte boundary, do not touch the byte after it.
+    unsigned long b1 = _fb > 8 - HLL_BITS ? _p[_byte+1] : 0;
     counter = ((b0 >> _fb) | (b1 << _fb8)) & HLL_BUCKET_COUNT_MAX;
 }
 
@@ -68,75 +90,332 @@ static inline void hll_set_counter_on_bucket(uint8_t* p, long index, uint8_t cou
     unsigned long _v = counter;
     _p[_byte] &= ~(HLL_BUCKET_COUNT_MAX << _fb);
     _p[_byte] |= _v << _fb;
-    _p[_byte+1] &= ~(HLL_BUCKET_COUNT_MAX >> _fb8);
-    _p[_byte+1] |= _v >> _fb8;
+    if (_fb > 8 - HLL_BITS) {
+        _p[_byte+1] &= ~(HLL_BUCKET_COUNT_MAX >> _fb8);
+        _p[_byte+1] |= _v >> _fb8;
+    }
 }
 
-bool hll_add(managed_bytes& data, const bytes& element)
+// The register of an element and the length of its run of zeros plus one.
+static inline uint8_t hll_pattern_len(const bytes& element, long& index)
 {
-    uint8_t oldcount = 0, count = 1;
-    uint8_t* p = (uint8_t*)(data.data()) + HLL_CARD_CACHE_SIZE;
+    uint8_t count = 1;
     auto hash = (uint64_t)(std::hash<bytes>()(element));
     //auto hash = murmur_hash_64a((uint8_t*)element.data(), element.size(), 0xadc83b19ULL);
-    auto index = hash & HLL_BUCKET_COUNT_MASK;
+    index = hash & HLL_BUCKET_COUNT_MASK;
     hash |= ((uint64_t) 1 << 63);
     uint64_t bit = HLL_BUCKET_COUNT;
     while ((hash & bit) == 0) {
         ++count;
         bit <<= 1;
     }
-    hll_get_counter_on_bucket(oldcount, p, index);
-    if (count > oldcount) {
-        hll_set_counter_on_bucket(p, index, count);
-        hll_invalidate_cache((uint8_t*)(data.data()), HLL_CARD_CACHE_SIZE);
-        return true;
+    return count;
+}
+
+std::vector<hll_update> hll::prepare(const std::vector<bytes>& elements)
+{
+    std::vector<hll_update> updates;
+    updates.reserve(elements.size());
+    for (auto& element : elements) {
+        long index = 0;
+        auto count = hll_pattern_len(element, index);
+        updates.push_back(hll_update { static_cast<uint16_t>(index), count });
     }
-    return false;
+    std::sort(updates.begin(), updates.end(), [] (const hll_update& a, const hll_update& b) {
+        return a._index < b._index || (a._index == b._index && a._count > b._count);
+    });
+    // the largest count of every register, which comes first.
+    updates.erase(std::unique(updates.begin(), updates.end(), [] (const hll_update& a, const hll_update& b) {
+        return a._index == b._index;
+    }), updates.end());
+    return updates;
+}
+
+// The dense registers are packed LSB first, so every 3 bytes hold 4 registers
+// and every 12 bytes hold 16. The kernels below widen 16 registers at a time
+// into one byte each, which is what the max-merge and the histogram want.
+#ifdef __SSSE3__
+static inline __m128i hll_unpack_16(__m128i w)
+{
+    // spread the 4 groups of 3 bytes into 4 lanes of 32 bits.
+    const __m128i spread = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    w = _mm_shuffle_epi8(w, spread);
+    // a lane holds r0 | r1 << 6 | r2 << 12 | r3 << 18, move register i to byte i.
+    auto r0 = _mm_and_si128(w, _mm_set1_epi32(0x3f));
+    auto r1 = _mm_and_si128(_mm_slli_epi32(w, 2), _mm_set1_epi32(0x3f00));
+    auto r2 = _mm_and_si128(_mm_slli_epi32(w, 4), _mm_set1_epi32(0x3f0000));
+    auto r3 = _mm_and_si128(_mm_slli_epi32(w, 6), _mm_set1_epi32(0x3f000000));
+    return _mm_or_si128(_mm_or_si128(r0, r1), _mm_or_si128(r2, r3));
 }
 
-size_t hll::append(managed_bytes& data, const std::vector<bytes>& elements)
+template <typename Func>
+static inline void hll_for_each_16_registers(const uint8_t* p, Func&& func)
 {
-    size_t result = 0;
-    for (size_t i = 0; i < elements.size(); ++i) {
-        if (hll_add(data, elements[i])) {
-            ++result;
+    static constexpr const size_t groups = HLL_BUCKET_COUNT / 16;
+    size_t i = 0;
+    for (; i + 1 < groups; ++i) {
+        func(i * 16, hll_unpack_16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i * 12))));
+    }
+    // the 16 bytes load of the last group would run past the value.
+    uint8_t last[16] = { 0 };
+    std::memcpy(last, p + i * 12, 12);
+    func(i * 16, hll_unpack_16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(last))));
+}
+#endif
+
+static inline uint64_t hll_load_8_registers(const uint8_t* p)
+{
+    uint64_t w = 0;
+    std::memcpy(&w, p, 6);
+    return w;
+}
+
+static void hll_unpack_registers(const uint8_t* p, uint8_t* registers)
+{
+#ifdef __SSSE3__
+    hll_for_each_16_registers(p, [registers] (size_t i, __m128i r) {
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(registers + i), r);
+    });
+#else
+    for (size_t i = 0; i < HLL_BUCKET_COUNT; i += 8, p += 6) {
+        auto w = hll_load_8_registers(p);
+        for (size_t j = 0; j < 8; ++j) {
+            registers[i + j] = (w >> (j * HLL_BITS)) & HLL_BUCKET_COUNT_MAX;
         }
     }
-    return result > 0;
+#endif
+}
+
+static void hll_max_registers(uint8_t* registers, const uint8_t* p)
+{
+#ifdef __SSSE3__
+    hll_for_each_16_registers(p, [registers] (size_t i, __m128i r) {
+        auto m = reinterpret_cast<__m128i*>(registers + i);
+        _mm_storeu_si128(m, _mm_max_epu8(_mm_loadu_si128(m), r));
+    });
+#else
+    for (size_t i = 0; i < HLL_BUCKET_COUNT; i += 8, p += 6) {
+        auto w = hll_load_8_registers(p);
+        for (size_t j = 0; j < 8; ++j) {
+            uint8_t r = (w >> (j * HLL_BITS)) & HLL_BUCKET_COUNT_MAX;
+            registers[i + j] = std::max(registers[i + j], r);
+        }
+    }
+#endif
+}
+
+static void hll_pack_registers(const uint8_t* registers, uint8_t* p)
+{
+    for (size_t i = 0; i < HLL_BUCKET_COUNT; i += 8, p += 6) {
+        uint64_t w = 0;
+        for (size_t j = 0; j < 8; ++j) {
+            w |= uint64_t(registers[i + j] & HLL_BUCKET_COUNT_MAX) << (j * HLL_BITS);
+        }
+        std::memcpy(p, &w, 6);
+    }
+}
+
+// Calls func(index, run, value) for every run of a sparse value, false if
+// the runs do not cover exactly HLL_BUCKET_COUNT registers.
+template <typename Func>
+static bool hll_for_each_sparse_run(const uint8_t* p, size_t size, Func&& func)
+{
+    const uint8_t* end = p + size;
+    size_t index = 0;
+    while (p < end) {
+        size_t run = 0;
+        unsigned value = 0;
+        if (*p & 0x80) {
+            value = ((*p >> 2) & 0x1f) + 1;
+            run = (*p & 0x3) + 1;
+            ++p;
+        }
+        else if (*p & 0x40) {
+            if (p + 1 == end) {
+                return false;
+            }
+            run = (((p[0] & 0x3f) << 8) | p[1]) + 1;
+            p += 2;
+        }
+        else {
+            run = (*p & 0x3f) + 1;
+            ++p;
+        }
+        if (index + run > HLL_BUCKET_COUNT) {
+            return false;
+        }
+        func(index, run, value);
+        index += run;
+    }
+    return index == HLL_BUCKET_COUNT;
+}
+
+// Encodes runs of registers, coalescing adjacent runs of the same value.
+class hll_sparse_writer {
+    std::vector<uint8_t>& _out;
+    unsigned _value = 0;
+    size_t _run = 0;
+public:
+    hll_sparse_writer(std::vector<uint8_t>& out) : _out(out) {}
+    void append(unsigned value, size_t run)
+    {
+        if (run == 0) {
+            return;
+        }
+        if (value != _value) {
+            flush();
+            _value = value;
+        }
+        _run += run;
+    }
+    void flush()
+    {
+        while (_run > 0) {
+            if (_value != 0) {
+                auto n = std::min(_run, HLL_SPARSE_VAL_RUN_MAX);
+                _out.push_back(0x80 | ((_value - 1) << 2) | (n - 1));
+                _run -= n;
+            }
+            else if (_run > HLL_SPARSE_ZERO_RUN_MAX) {
+                auto n = std::min(_run, HLL_SPARSE_XZERO_RUN_MAX);
+                _out.push_back(0x40 | ((n - 1) >> 8));
+                _out.push_back((n - 1) & 0xff);
+                _run -= n;
+            }
+            else {
+                _out.push_back(_run - 1);
+                _run = 0;
+            }
+        }
+    }
+};
+
+static bool hll_max_sparse_registers(uint8_t* registers, const uint8_t* p, size_t size)
+{
+    return hll_for_each_sparse_run(p, size, [registers] (size_t index, size_t run, unsigned value) {
+        for (size_t i = index; i < index + run; ++i) {
+            registers[i] = std::max(registers[i], static_cast<uint8_t>(value));
+        }
+    });
+}
+
+// Widens a dense or sparse value into one byte per register.
+static bool hll_to_registers(const uint8_t* data, size_t size, uint8_t* registers)
+{
+    if (!hll_is_sparse(size)) {
+        hll_unpack_registers(data + HLL_CARD_CACHE_SIZE, registers);
+        return true;
+    }
+    std::memset(registers, 0, HLL_BUCKET_COUNT);
+    return size >= HLL_CARD_CACHE_SIZE && hll_max_sparse_registers(registers, data + HLL_CARD_CACHE_SIZE, size - HLL_CARD_CACHE_SIZE);
 }
 
+managed_bytes hll::make(bool sparse)
+{
+    if (!sparse) {
+        managed_bytes o(managed_bytes::initialized_later(), HLL_BYTES_SIZE);
+        std::memset(o.data(), 0, HLL_BYTES_SIZE);
+        return o;
+    }
+    // a zero card in the cache and one XZERO run over all registers.
+    uint8_t empty[HLL_CARD_CACHE_SIZE + 2] = { 0 };
+    empty[HLL_CARD_CACHE_SIZE] = 0x40 | ((HLL_BUCKET_COUNT - 1) >> 8);
+    empty[HLL_CARD_CACHE_SIZE + 1] = (HLL_BUCKET_COUNT - 1) & 0xff;
+    return managed_bytes(reinterpret_cast<const char*>(empty), sizeof(empty));
+}
 
-static double hll_bucket_counter_sum(const uint8_t* data, size_t size, int& ez)
+static size_t hll_sparse_append(managed_bytes& data, const std::vector<hll_update>& updates, size_t sparse_max_bytes)
 {
-    ez = 0;
-    double E = 0;
+    auto p = reinterpret_cast<const uint8_t*>(data.data());
+    auto size = data.size();
+    bool promote = std::any_of(updates.begin(), updates.end(), [] (const hll_update& u) { return u._count > HLL_SPARSE_VAL_MAX; });
+    if (!promote) {
+        // rewrite the runs once, splitting those a larger count lands in.
+        std::vector<uint8_t> out(p, p + HLL_CARD_CACHE_SIZE);
+        out.reserve(size + 2 * updates.size());
+        hll_sparse_writer writer(out);
+        auto u = updates.begin();
+        bool changed = false;
+        auto valid = hll_for_each_sparse_run(p + HLL_CARD_CACHE_SIZE, size - HLL_CARD_CACHE_SIZE, [&] (size_t index, size_t run, unsigned value) {
+            auto end = index + run;
+            for (; u != updates.end() && static_cast<size_t>(u->_index) < end; ++u) {
+                auto at = static_cast<size_t>(u->_index);
+                auto count = u->_count;
+                if (count > value) {
+                    writer.append(value, at - index);
+                    writer.append(count, 1);
+                    index = at + 1;
+                    changed = true;
+                }
+            }
+            writer.append(value, end - index);
+        });
+        if (!valid) {
+            return 0;
+        }
+        if (!changed) {
+            return 0;
+        }
+        writer.flush();
+        if (out.size() <= sparse_max_bytes && hll_is_sparse(out.size())) {
+            hll_invalidate_cache(out.data(), HLL_CARD_CACHE_SIZE);
+            data = managed_bytes(reinterpret_cast<const char*>(out.data()), out.size());
+            return 1;
+        }
+    }
+    // too long or a count the sparse encoding can not hold, promote to dense.
+    uint8_t registers[HLL_BUCKET_COUNT];
+    if (!hll_to_registers(p, size, registers)) {
+        return 0;
+    }
+    for (auto& u : updates) {
+        registers[u._index] = std::max(registers[u._index], u._count);
+    }
+    auto dense = hll::make(false);
+    hll::pack_registers(registers, reinterpret_cast<uint8_t*>(dense.data()));
+    data = std::move(dense);
+    return 1;
+}
 
-    const uint8_t *r = data;
-    unsigned long r0, r1, r2, r3, r4, r5, r6, r7, r8, r9, r10, r11, r12, r13, r14, r15;
-    for (int j = 0; j < 1024; j++) {
-        r0 = r[0] & 63; if (r0 == 0) ez++;
-        r1 = (r[0] >> 6 | r[1] << 2) & 63; if (r1 == 0) ez++;
-        r2 = (r[1] >> 4 | r[2] << 4) & 63; if (r2 == 0) ez++;
-        r3 = (r[2] >> 2) & 63; if (r3 == 0) ez++;
-        r4 = r[3] & 63; if (r4 == 0) ez++;
-        r5 = (r[3] >> 6 | r[4] << 2) & 63; if (r5 == 0) ez++;
-        r6 = (r[4] >> 4 | r[5] << 4) & 63; if (r6 == 0) ez++;
-        r7 = (r[5] >> 2) & 63; if (r7 == 0) ez++;
-        r8 = r[6] & 63; if (r8 == 0) ez++;
-        r9 = (r[6] >> 6 | r[7] << 2) & 63; if (r9 == 0) ez++;
-        r10 = (r[7] >> 4 | r[8] << 4) & 63; if (r10 == 0) ez++;
-        r11 = (r[8] >> 2) & 63; if (r11 == 0) ez++;
-        r12 = r[9] & 63; if (r12 == 0) ez++;
-        r13 = (r[9] >> 6 | r[10] << 2) & 63; if (r13 == 0) ez++;
-        r14 = (r[10] >> 4 | r[11] << 4) & 63; if (r14 == 0) ez++;
-        r15 = (r[11] >> 2) & 63; if (r15 == 0) ez++;
+size_t hll::append(managed_bytes& data, const std::vector<hll_update>& updates, size_t sparse_max_bytes)
+{
+    if (hll_is_sparse(data.size())) {
+        return hll_sparse_append(data, updates, sparse_max_bytes);
+    }
+    uint8_t* p = (uint8_t*)(data.data()) + HLL_CARD_CACHE_SIZE;
+    bool changed = false;
+    for (auto& u : updates) {
+        uint8_t oldcount = 0;
+        hll_get_counter_on_bucket(oldcount, p, u._index);
+        if (u._count > oldcount) {
+            hll_set_counter_on_bucket(p, u._index, u._count);
+            changed = true;
+        }
+    }
+    if (changed) {
+        hll_invalidate_cache((uint8_t*)(data.data()), HLL_CARD_CACHE_SIZE);
+    }
+    return changed;
+}
+
+size_t hll::append(managed_bytes& data, const std::vector<bytes>& elements, size_t sparse_max_bytes)
+{
+    return append(data, prepare(elements), sparse_max_bytes);
+}
 
-        E += (PE[r0] + PE[r1]) + (PE[r2] + PE[r3]) + (PE[r4] + PE[r5]) +
-            (PE[r6] + PE[r7]) + (PE[r8] + PE[r9]) + (PE[r10] + PE[r11]) +
-            (PE[r12] + PE[r13]) + (PE[r14] + PE[r15]);
-        r += 12;
+static void hll_histogram(const uint8_t* registers, uint32_t* histogram)
+{
+    // four histograms break the store-to-load dependency on runs of equal registers.
+    uint32_t partial[4][HLL_BUCKET_COUNT_MAX + 1] = { { 0 } };
+    for (size_t i = 0; i < HLL_BUCKET_COUNT; i += 4) {
+        ++partial[0][registers[i]];
+        ++partial[1][registers[i + 1]];
+        ++partial[2][registers[i + 2]];
+        ++partial[3][registers[i + 3]];
+    }
+    for (int j = 0; j <= HLL_BUCKET_COUNT_MAX; ++j) {
+        histogram[j] = partial[0][j] + partial[1][j] + partial[2][j] + partial[3][j];
     }
-    return E;
 }
 
 static size_t hll_read_card_from_cache(const managed_bytes& data)
@@ -168,10 +447,13 @@ static void hll_write_card_to_cache(uint64_t card, managed_bytes& data)
 }
 
 
-static uint64_t compute_card(const uint8_t* data, size_t size)
+static uint64_t compute_card(const uint32_t* histogram)
 {
-    int ez = 0;
-    auto S = hll_bucket_counter_sum(data, size, ez);
+    double S = 0;
+    for (int j = HLL_BUCKET_COUNT_MAX; j >= 0; --j) {
+        S += histogram[j] * PE[j];
+    }
+    auto ez = histogram[0];
 
     S = (1/ S )* ALPHA_BUCKET_COUNT_POWER_2;
 
@@ -188,6 +470,13 @@ static uint64_t compute_card(const uint8_t* data, size_t size)
     return S;
 }
 
+static uint64_t compute_card(const uint8_t* registers)
+{
+    uint32_t histogram[HLL_BUCKET_COUNT_MAX + 1];
+    hll_histogram(registers, histogram);
+    return compute_card(histogram);
+}
+
 size_t hll::count(managed_bytes& data)
 {
     uint64_t card = 0;
@@ -196,53 +485,82 @@ size_t hll::count(managed_bytes& data)
         return hll_read_card_from_cache(data);
     }
     // compute the value of card.
-    auto S = compute_card((uint8_t*)(data.data()) + HLL_CARD_CACHE_SIZE, data.size() - HLL_CARD_CACHE_SIZE);
-    card = (uint64_t) S;
+    auto p = (const uint8_t*)(data.data());
+    if (hll_is_sparse(data.size())) {
+        uint32_t histogram[HLL_BUCKET_COUNT_MAX + 1] = { 0 };
+        hll_for_each_sparse_run(p + HLL_CARD_CACHE_SIZE, data.size() - HLL_CARD_CACHE_SIZE, [&histogram] (size_t, size_t run, unsigned value) {
+            histogram[value] += run;
+        });
+        card = compute_card(histogram);
+    }
+    else {
+        uint8_t registers[HLL_BUCKET_COUNT];
+        hll_unpack_registers(p + HLL_CARD_CACHE_SIZE, registers);
+        card = compute_card(registers);
+    }
     hll_write_card_to_cache(card, data);
     return (size_t) card;
 }
 
 size_t hll::count(const uint8_t* merged_sources, size_t size)
 {
-    auto S = compute_card(merged_sources + HLL_CARD_CACHE_SIZE, size - HLL_CARD_CACHE_SIZE);
-    return (size_t) S;
+    uint8_t registers[HLL_BUCKET_COUNT];
+    if (!hll_to_registers(merged_sources, size, registers)) {
+        return 0;
+    }
+    return (size_t) compute_card(registers);
+}
+
+size_t hll::count_registers(const uint8_t* registers)
+{
+    return (size_t) compute_card(registers);
 }
 
 size_t hll::merge(managed_bytes& data, const uint8_t* merged_sources, size_t size)
 {
-    if (size != HLL_BYTES_SIZE) {
+    uint8_t registers[HLL_BUCKET_COUNT];
+    if (!hll_to_registers((const uint8_t*)(data.data()), data.size(), registers)
+        || !merge_registers(registers, merged_sources, size)) {
         return 0;
     }
-    uint8_t* p = (uint8_t*)(data.data()) + HLL_CARD_CACHE_SIZE;
-    const uint8_t* s = merged_sources + HLL_CARD_CACHE_SIZE;
-    uint8_t counter = 0, counter_s = 0;
-    for (size_t i = 0; i < HLL_BUCKET_COUNT; ++i) {
-        hll_get_counter_on_bucket(counter_s, s, i);
-        hll_get_counter_on_bucket(counter, p, i);
-        if (counter_s > counter) {
-            hll_set_counter_on_bucket(p, i, counter_s);
-        }
+    // like Redis, the destination of a merge is always dense.
+    if (hll_is_sparse(data.size())) {
+        data = make(false);
     }
-    hll_invalidate_cache((uint8_t*)data.data(), HLL_CARD_CACHE_SIZE);
+    pack_registers(registers, (uint8_t*)(data.data()));
     return 1;
 }
 
 size_t hll::merge(uint8_t* data, size_t size, const bytes& merged_sources)
 {
-    if (merged_sources.size() != HLL_BYTES_SIZE) {
+    if (hll_is_sparse(size)) {
         return 0;
     }
-    uint8_t* p = data + HLL_CARD_CACHE_SIZE;
-    const uint8_t* s = (uint8_t*)(merged_sources.data()) + HLL_CARD_CACHE_SIZE;
-    uint8_t counter = 0, counter_s = 0;
-    for (size_t i = 0; i < HLL_BUCKET_COUNT; ++i) {
-        hll_get_counter_on_bucket(counter_s, s, i);
-        hll_get_counter_on_bucket(counter, p, i);
-        if (counter_s > counter) {
-            hll_set_counter_on_bucket(p, i, counter_s);
-        }
+    uint8_t registers[HLL_BUCKET_COUNT];
+    hll_unpack_registers(data + HLL_CARD_CACHE_SIZE, registers);
+    if (!merge_registers(registers, (const uint8_t*)(merged_sources.data()), merged_sources.size())) {
+        return 0;
     }
-    hll_invalidate_cache(data, HLL_CARD_CACHE_SIZE);
+    pack_registers(registers, data);
     return 1;
 }
+
+size_t hll::merge_registers(uint8_t* registers, const uint8_t* merged_sources, size_t size)
+{
+    if (!hll_is_sparse(size)) {
+        hll_max_registers(registers, merged_sources + HLL_CARD_CACHE_SIZE);
+        return 1;
+    }
+    if (size < HLL_CARD_CACHE_SIZE) {
+        return 0;
+    }
+    return hll_max_sparse_registers(registers, merged_sources + HLL_CARD_CACHE_SIZE, size - HLL_CARD_CACHE_SIZE);
+}
+
+void hll::pack_registers(const uint8_t* registers, uint8_t* data)
+{
+    std::memset(data, 0, HLL_CARD_CACHE_SIZE);
+    hll_invalidate_cache(data, HLL_CARD_CACHE_SIZE);
+    hll_pack_registers(registers, data + HLL_CARD_CACHE_SIZE);
+}
 }
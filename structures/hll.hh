@@ -30,13 +30,34 @@ static constexpr const int HLL_BUCKET_COUNT = (1 << HLL_P);
 static constexpr const int HLL_BYTES_SIZE = HLL_CARD_CACHE_SIZE + (HLL_BUCKET_COUNT * HLL_BITS + 7) / 8;
 
 static constexpr const int HLL_BUCKET_COUNT_MAX = (1 << HLL_BITS) - 1;
+// Sparse values longer than this are promoted to the dense encoding.
+static constexpr const size_t HLL_SPARSE_MAX_BYTES = 3000;
+// The register an element lands in and the count it sets there. PFADD
+// works them out on the shard of the connection, the owner of the key only
+// updates the registers.
+struct hll_update {
+    uint16_t _index;
+    uint8_t _count;
+};
+
 class hll {
 public:
-    static size_t append(managed_bytes& data, const std::vector<bytes>& elements);
+    // An empty value, sparse unless disabled; values shorter than HLL_BYTES_SIZE are sparse.
+    static managed_bytes make(bool sparse);
+    // The updates of elements, by register, the largest count of each.
+    static std::vector<hll_update> prepare(const std::vector<bytes>& elements);
+    static size_t append(managed_bytes& data, const std::vector<hll_update>& updates, size_t sparse_max_bytes = HLL_SPARSE_MAX_BYTES);
+    static size_t append(managed_bytes& data, const std::vector<bytes>& elements, size_t sparse_max_bytes = HLL_SPARSE_MAX_BYTES);
     static size_t count(managed_bytes& data);
     static size_t count(const uint8_t* merged_sources, size_t size);
     static size_t merge(managed_bytes& data, const uint8_t* merged_sources, size_t size); 
     static size_t merge(uint8_t* dest, size_t size, const bytes& merged_sources); 
+    // Multi-key merges keep one byte per register (HLL_BUCKET_COUNT bytes)
+    // and max-merge dense values into it, so the registers are widened once.
+    static size_t merge_registers(uint8_t* registers, const uint8_t* merged_sources, size_t size);
+    static size_t count_registers(const uint8_t* registers);
+    // Packs the registers into a dense value of HLL_BYTES_SIZE, the cached card is left invalid.
+    static void pack_registers(const uint8_t* registers, uint8_t* dest);
 };
 
 }
@@ -0,0 +1,178 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#include "structures/key_index.hh"
+#include <algorithm>
+namespace redis {
+
+static inline size_t common_prefix(bytes_view a, bytes_view b)
+{
+    auto n = std::min(a.size(), b.size());
+    size_t i = 0;
+    while (i < n && a[i] == b[i]) {
+        ++i;
+    }
+    return i;
+}
+
+std::vector<std::unique_ptr<key_index::node>>::iterator key_index::node::child(char c)
+{
+    // in byte order, as memcmp() compares keys.
+    return std::lower_bound(_children.begin(), _children.end(), static_cast<uint8_t>(c), [] (const std::unique_ptr<node>& n, uint8_t c) {
+        return static_cast<uint8_t>(n->_prefix[0]) < c;
+    });
+}
+
+bool key_index::insert(bytes_view key, size_t hash)
+{
+    return insert(_root, key, hash);
+}
+
+bool key_index::insert(node& n, bytes_view rest, size_t hash)
+{
+    if (rest.empty()) {
+        if (n._leaf) {
+            return false;
+        }
+        n._leaf = true;
+        n._hash = hash;
+        ++n._keys;
+        return true;
+    }
+    auto i = n.child(rest[0]);
+    if (i == n._children.end() || (*i)->_prefix[0] != rest[0]) {
+        auto leaf = std::make_unique<node>();
+        leaf->_prefix = bytes { rest.data(), rest.size() };
+        leaf->_leaf = true;
+        leaf->_hash = hash;
+        leaf->_keys = 1;
+        n._children.insert(i, std::move(leaf));
+        ++_nodes;
+        _prefix_bytes += rest.size();
+        ++n._keys;
+        return true;
+    }
+    auto& c = *i;
+    auto common = common_prefix(bytes_view { c->_prefix.data(), c->_prefix.size() }, rest);
+    if (common < c->_prefix.size()) {
+        // the key leaves the prefix of the child midway: the shared part
+        // becomes a node of its own, the child hangs below it.
+        auto split = std::make_unique<node>();
+        split->_prefix = bytes { c->_prefix.data(), common };
+        split->_keys = c->_keys;
+        c->_prefix = bytes { c->_prefix.data() + common, c->_prefix.size() - common };
+        split->_children.push_back(std::move(c));
+        c = std::move(split);
+        ++_nodes;
+    }
+    if (!insert(*c, rest.substr(common), hash)) {
+        return false;
+    }
+    ++n._keys;
+    return true;
+}
+
+bool key_index::erase(bytes_view key)
+{
+    return erase(_root, key);
+}
+
+bool key_index::erase(node& n, bytes_view rest)
+{
+    if (rest.empty()) {
+        if (!n._leaf) {
+            return false;
+        }
+        n._leaf = false;
+        --n._keys;
+        return true;
+    }
+    auto i = n.child(rest[0]);
+    if (i == n._children.end()) {
+        return false;
+    }
+    auto& c = *i;
+    bytes_view prefix { c->_prefix.data(), c->_prefix.size() };
+    if (rest.size() < prefix.size() || rest.substr(0, prefix.size()) != prefix) {
+        return false;
+    }
+    if (!erase(*c, rest.substr(prefix.size()))) {
+        return false;
+    }
+    --n._keys;
+    if (c->_keys == 0) {
+        _prefix_bytes -= c->_prefix.size();
+        --_nodes;
+        n._children.erase(i);
+    }
+    else if (!c->_leaf && c->_children.size() == 1) {
+        // a node only its child passes through is merged into it.
+        auto& only = c->_children.front();
+        bytes merged { c->_prefix.data(), c->_prefix.size() };
+        merged.append(only->_prefix.data(), only->_prefix.size());
+        only->_prefix = std::move(merged);
+        c = std::move(only);
+        --_nodes;
+    }
+    return true;
+}
+
+void key_index::clear()
+{
+    _root._children.clear();
+    _root._leaf = false;
+    _root._keys = 0;
+    _nodes = 1;
+    _prefix_bytes = 0;
+}
+
+const key_index::node* key_index::find_prefix(bytes_view prefix, size_t& depth) const
+{
+    auto n = &_root;
+    depth = 0;
+    auto rest = prefix;
+    while (!rest.empty()) {
+        auto i = const_cast<node*>(n)->child(rest[0]);
+        if (i == n->_children.end() || (*i)->_prefix[0] != rest[0]) {
+            return nullptr;
+        }
+        bytes_view own { (*i)->_prefix.data(), (*i)->_prefix.size() };
+        auto common = common_prefix(own, rest);
+        if (common == rest.size()) {
+            // the prefix ends within the prefix of the child.
+            return i->get();
+        }
+        if (common < own.size()) {
+            return nullptr;
+        }
+        depth += common;
+        rest = rest.substr(common);
+        n = i->get();
+    }
+    return n;
+}
+
+size_t key_index::count(bytes_view prefix) const
+{
+    size_t depth = 0;
+    auto n = find_prefix(prefix, depth);
+    return n ? n->_keys : 0;
+}
+}
@@ -0,0 +1,110 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#pragma once
+#include <memory>
+#include <string>
+#include <vector>
+#include "utils/bytes.hh"
+namespace redis {
+
+// The keys of a shard in byte order, as a radix tree: a node holds the
+// bytes its keys share past those of its parent once, and its children by
+// the byte which follows, so that the keys under a prefix are one subtree.
+// Every node counts the keys of its subtree, and a key keeps its hash.
+//
+// The children of a node are kept sorted in a vector, which grows with the
+// node as the nodes of an adaptive radix tree do, from a few children
+// searched in a cache line or two to a full fanout binary searched.
+//
+// The tree only knows keys, and lives out of the region: it holds no
+// pointer to an entry, which the region may move.
+class key_index {
+    struct node {
+        bytes _prefix;
+        bool _leaf = false;
+        size_t _hash = 0;
+        size_t _keys = 0;
+        std::vector<std::unique_ptr<node>> _children;
+
+        // The child whose prefix starts with `c`, or where it would be.
+        std::vector<std::unique_ptr<node>>::iterator child(char c);
+    };
+    node _root;
+    size_t _nodes = 1;
+    size_t _prefix_bytes = 0;
+
+    bool insert(node& n, bytes_view rest, size_t hash);
+    bool erase(node& n, bytes_view rest);
+    // The node of the keys starting with `prefix`, and the bytes before its
+    // own prefix, null if there is none.
+    const node* find_prefix(bytes_view prefix, size_t& depth) const;
+    template <typename Func>
+    static void walk(const node& n, std::string& key, Func& func);
+public:
+    key_index() = default;
+    key_index(const key_index&) = delete;
+    key_index& operator = (const key_index&) = delete;
+
+    // false if the key is already there.
+    bool insert(bytes_view key, size_t hash);
+    // false if the key is not there.
+    bool erase(bytes_view key);
+    void clear();
+    size_t size() const { return _root._keys; }
+    // The keys starting with `prefix`.
+    size_t count(bytes_view prefix) const;
+    // Calls func(bytes_view key, size_t hash) for the keys starting with
+    // `prefix`, in order. The tree must not change meanwhile.
+    template <typename Func>
+    void for_each(bytes_view prefix, Func&& func) const;
+    // About the bytes the tree takes.
+    size_t memory_usage() const
+    {
+        return _nodes * (sizeof(node) + sizeof(std::unique_ptr<node>)) + _prefix_bytes;
+    }
+};
+
+template <typename Func>
+void key_index::walk(const node& n, std::string& key, Func& func)
+{
+    auto size = key.size();
+    key.append(n._prefix.data(), n._prefix.size());
+    if (n._leaf) {
+        func(bytes_view { key.data(), key.size() }, n._hash);
+    }
+    for (auto& c : n._children) {
+        walk(*c, key, func);
+    }
+    key.resize(size);
+}
+
+template <typename Func>
+void key_index::for_each(bytes_view prefix, Func&& func) const
+{
+    size_t depth = 0;
+    auto n = find_prefix(prefix, depth);
+    if (n == nullptr) {
+        return;
+    }
+    std::string key { prefix.data(), depth };
+    walk(*n, key, func);
+}
+}
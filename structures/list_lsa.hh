@@ -25,33 +25,55 @@
 #include "utils/managed_bytes.hh"
 #include "keys.hh"
 namespace redis {
+// Elements are kept in chunks of up to chunk_capacity slots, so that index
+// seeks skip whole chunks, starting from the nearer end, and an element
+// costs no list hook or LSA object of its own.
 class list_lsa {
-    struct internal_node {
+    static constexpr uint16_t chunk_capacity = 64;
+    struct chunk {
         boost::intrusive::list_member_hook<> _link;
-        managed_bytes _data;
-        internal_node(bytes_view data) noexcept : _link(), _data(data) {}
-        internal_node(internal_node&& o) noexcept
-            : _link(std::move(o._link)), _data(std::move(o._data))
+        // the elements are _items[_begin, _begin + _count).
+        uint16_t _begin;
+        uint16_t _count = 0;
+        managed_bytes _items[chunk_capacity];
+
+        explicit chunk(uint16_t begin) noexcept : _link(), _begin(begin) {}
+        chunk(chunk&& o) noexcept
+            : _link()
+            , _begin(o._begin)
+            , _count(o._count)
         {
+            _link.swap_nodes(o._link);
+            for (size_t i = _begin; i < size_t(_begin) + _count; ++i) {
+                _items[i] = std::move(o._items[i]);
+            }
         }
-        inline bool operator==(const internal_node& o) const
+        inline managed_bytes& item(size_t i)
         {
-            return _data == o._data;
+            return _items[_begin + i];
+        }
+        inline const managed_bytes& item(size_t i) const
+        {
+            return _items[_begin + i];
+        }
+        inline bool full() const
+        {
+            return _count == chunk_capacity;
         }
     };
-    using internal_list_type = boost::intrusive::list<internal_node,
-        boost::intrusive::member_hook<internal_node, boost::intrusive::list_member_hook<>,
-        &internal_node::_link>>;
-    using const_iterator = internal_list_type::const_iterator;
-    using iterator = internal_list_type::iterator;
-    internal_list_type  _list;
+    using chunk_list_type = boost::intrusive::list<chunk,
+        boost::intrusive::member_hook<chunk, boost::intrusive::list_member_hook<>,
+        &chunk::_link>>;
+    chunk_list_type _chunks;
+    size_t _size = 0;
 public:
     list_lsa() noexcept
     {
     }
 
-    list_lsa(list_lsa&& o) noexcept : _list(std::move(o._list))
+    list_lsa(list_lsa&& o) noexcept : _chunks(std::move(o._chunks)), _size(o._size)
     {
+        o._size = 0;
     }
 
     ~list_lsa()
@@ -61,88 +83,203 @@ public:
     // Inserts the value in the front of the list.
     inline void insert_head(const bytes& data)
     {
-        bytes_view v {data.data(), data.size()};
-        auto entry = current_allocator().construct<internal_node>(v);
-        _list.push_front(*entry);
+        insert_head(managed_bytes(bytes_view {data.data(), data.size()}));
+    }
+
+    inline void insert_head(managed_bytes&& value)
+    {
+        if (_chunks.empty() || _chunks.front()._begin == 0) {
+            _chunks.push_front(*current_allocator().construct<chunk>(chunk_capacity));
+        }
+        auto& c = _chunks.front();
+        --c._begin;
+        ++c._count;
+        c.item(0) = std::move(value);
+        ++_size;
     }
 
     // Inserts the value in the back of the list.
     inline void insert_tail(const bytes& data)
     {
-        bytes_view v {data.data(), data.size()};
-        auto entry = current_allocator().construct<internal_node>(v);
-        _list.push_back(*entry);
+        insert_tail(managed_bytes(bytes_view {data.data(), data.size()}));
+    }
+
+    inline void insert_tail(managed_bytes&& value)
+    {
+        if (_chunks.empty() || _chunks.back()._begin + _chunks.back()._count == chunk_capacity) {
+            _chunks.push_back(*current_allocator().construct<chunk>(0));
+        }
+        auto& c = _chunks.back();
+        ++c._count;
+        c.item(c._count - 1) = std::move(value);
+        ++_size;
     }
 
+    // Moves the first or the last element of `from`, which must not be
+    // empty, to the front or the back of this list, which may be `from`
+    // too. The value is moved between the slots, not copied.
+    void move_from(list_lsa& from, bool from_front, bool to_front)
+    {
+        assert(!from.empty());
+        managed_bytes value;
+        if (from_front) {
+            value = std::move(from._chunks.front().item(0));
+            from.drop_front(1);
+        }
+        else {
+            auto& c = from._chunks.back();
+            value = std::move(c.item(c._count - 1));
+            from.drop_back(1);
+        }
+        to_front ? insert_head(std::move(value)) : insert_tail(std::move(value));
+    }
+
+    // Inserts the value before the element at `index`.
     inline void insert_at(size_t index, const bytes& data)
     {
-        assert(index < _list.size());
-        bytes_view v {data.data(), data.size()};
-        auto entry = current_allocator().construct<internal_node>(v);
-        const_iterator p = iterator_to(index);
-        _list.insert(p, *entry);
+        assert(index < _size);
+        auto pos = seek(index);
+        auto c = pos.first;
+        auto offset = pos.second;
+        if (c->full()) {
+            // split the chunk, moving its second half into a new one.
+            auto n = current_allocator().construct<chunk>(0);
+            auto half = c->_count / 2;
+            for (size_t i = half; i < c->_count; ++i) {
+                n->_items[i - half] = std::move(c->item(i));
+            }
+            n->_count = c->_count - half;
+            c->_count = half;
+            _chunks.insert(std::next(chunk_list_type::s_iterator_to(*c)), *n);
+            if (offset > half) {
+                c = n;
+                offset -= half;
+            }
+        }
+        if (c->_begin + c->_count < chunk_capacity) {
+            for (size_t i = c->_count; i > offset; --i) {
+                c->item(i) = std::move(c->item(i - 1));
+            }
+        }
+        else {
+            --c->_begin;
+            for (size_t i = 0; i < offset; ++i) {
+                c->item(i) = std::move(c->item(i + 1));
+            }
+        }
+        ++c->_count;
+        c->item(offset) = managed_bytes(bytes_view {data.data(), data.size()});
+        ++_size;
     }
 
-    inline size_t index_of(const std::string& pivot)
+    inline size_t index_of(const std::string& pivot) const
     {
-        size_t result = _list.size();
-        for (auto i = _list.begin(); i != _list.end(); ++i, --result) {
-            if (equal(pivot, *i)) {
-                return _list.size() - result;
+        size_t index = 0;
+        for (auto& c : _chunks) {
+            for (size_t i = 0; i < c._count; ++i, ++index) {
+                if (equal(c.item(i), pivot)) {
+                    return index;
+                }
             }
         }
-        return result;
+        return _size;
     }
 
     inline const managed_bytes& at(size_t index) const
     {
-        assert(index < _list.size());
-        auto i = iterator_to(index);
-        return i->_data;
+        assert(index < _size);
+        auto pos = const_cast<list_lsa*>(this)->seek(index);
+        return pos.first->item(pos.second);
     }
 
     inline managed_bytes& at(size_t index)
     {
-        assert(index < _list.size());
-        iterator i = iterator_to(index);
-        return i->_data;
+        assert(index < _size);
+        auto pos = seek(index);
+        return pos.first->item(pos.second);
+    }
+
+    // Visits up to `count` elements from `start`, seeking only once. Returns
+    // how many were visited.
+    template <typename Func>
+    size_t for_each_in(size_t start, size_t count, Func&& func) const
+    {
+        if (start >= _size) {
+            return 0;
+        }
+        count = std::min(count, _size - start);
+        auto pos = const_cast<list_lsa*>(this)->seek(start);
+        auto it = chunk_list_type::s_iterator_to(*pos.first);
+        auto offset = pos.second;
+        for (auto n = count; n > 0; ++it, offset = 0) {
+            for (; offset < it->_count && n > 0; ++offset, --n) {
+                func(static_cast<const managed_bytes&>(it->item(offset)));
+            }
+        }
+        return count;
+    }
+
+    // Appends the elements [start, end] to `data`, seeking only once.
+    void fetch(size_t start, size_t end, std::vector<const managed_bytes*>& data) const
+    {
+        if (start > end || start >= _size) {
+            return;
+        }
+        for_each_in(start, std::min(end, _size - 1) - start + 1, [&data] (const managed_bytes& b) {
+            data.push_back(&b);
+        });
     }
 
     // Returns a reference to the data of first element of the list.
     inline const managed_bytes& front() const
     {
-        auto& front_ref = _list.front();
-        return front_ref._data;
+        return _chunks.front().item(0);
     }
 
     // Erases the first element of the list. Destructors are called.
     inline void pop_front()
     {
-        _list.pop_front_and_dispose(current_deleter<internal_node>());
+        drop_front(1);
     }
 
     // Returns a reference to the data of last element of the list.
     inline const managed_bytes& back() const
     {
-        auto& back_ref = _list.back();
-        return back_ref._data;
+        auto& c = _chunks.back();
+        return c.item(c._count - 1);
     }
 
     // Erases the last element of the list. Destructors are called.
     inline void pop_back()
     {
-        _list.pop_back_and_dispose(current_deleter<internal_node>());
+        drop_back(1);
     }
 
     inline bool empty() const
     {
-        return _list.empty();
+        return _size == 0;
     }
 
     // Returns the number of the elements contained in the list.
     inline size_t size() const
     {
-        return static_cast<size_t>(_list.size());
+        return _size;
+    }
+
+    // Bytes held by the list in the current allocator: the chunks, and the
+    // elements estimated from the first `samples` of them, or from all of
+    // them when 0.
+    size_t memory_usage(size_t samples) const
+    {
+        if (_chunks.empty()) {
+            return 0;
+        }
+        auto chunks = _chunks.size() * current_allocator().object_memory_size_in_allocator(&_chunks.front());
+        size_t bytes = 0;
+        auto sampled = for_each_in(0, samples ? samples : _size, [&bytes] (const managed_bytes& b) {
+            bytes += b.external_memory_usage();
+        });
+        return chunks + (sampled ? static_cast<size_t>(double(bytes) / sampled * _size) : 0);
     }
 
     // Erase the elements from the list.
@@ -151,97 +288,160 @@ public:
         trem<false, true>(data, size_t{1});
     }
 
+    // Removes up to `count` elements equal to `data`, or all of them if
+    // RemoveAllEqual. Each chunk is compacted once.
     template<bool RemoveAllEqual, bool FromHeadToTail>
     inline size_t trem(const std::string& data, size_t count)
     {
         size_t erased = 0;
+        auto done = [&] { return !RemoveAllEqual && erased == count; };
         if (FromHeadToTail) {
-            for (auto it = _list.begin(); it != _list.end(); ++it) {
-                if (equal(*it, data)) {
-                    ++erased;
-                    const_iterator eit = it;
-                    ++it;
-                    _list.erase_and_dispose(eit, current_deleter<internal_node>());
-                    if (!RemoveAllEqual && erased == count) {
-                        break;
+            for (auto it = _chunks.begin(); it != _chunks.end() && !done(); ) {
+                auto& c = *it;
+                size_t kept = 0;
+                for (size_t i = 0; i < c._count; ++i) {
+                    if (!done() && equal(c.item(i), data)) {
+                        ++erased;
+                        continue;
+                    }
+                    if (kept != i) {
+                        c.item(kept) = std::move(c.item(i));
                     }
+                    ++kept;
                 }
+                for (size_t i = kept; i < c._count; ++i) {
+                    c.item(i) = managed_bytes();
+                }
+                c._count = kept;
+                it = c._count ? std::next(it) : _chunks.erase_and_dispose(it, current_deleter<chunk>());
             }
         }
         else {
-            for (auto it = _list.rbegin(); it != _list.rend(); ++it) {
-                if (equal(*it, data)) {
-                    ++erased;
-                    auto& entry = *it;
-                    ++it;
-                    _list.remove_and_dispose(entry, current_deleter<internal_node>());
-                    if (!RemoveAllEqual && erased == count) {
-                        break;
+            for (auto it = _chunks.end(); it != _chunks.begin() && !done(); ) {
+                auto& c = *--it;
+                size_t kept = c._count;
+                for (size_t i = c._count; i > 0; --i) {
+                    if (!done() && equal(c.item(i - 1), data)) {
+                        ++erased;
+                        continue;
+                    }
+                    if (kept != i) {
+                        c.item(kept - 1) = std::move(c.item(i - 1));
                     }
+                    --kept;
+                }
+                for (size_t i = 0; i < kept; ++i) {
+                    c.item(i) = managed_bytes();
+                }
+                c._begin += kept;
+                c._count -= kept;
+                if (c._count == 0) {
+                    it = _chunks.erase_and_dispose(it, current_deleter<chunk>());
                 }
             }
         }
+        _size -= erased;
         return erased;
     }
 
+    // Keeps only the elements [start, end].
     inline bool trim(size_t start, size_t end)
     {
-        auto i = iterator_to(start);
-        for (auto it = _list.begin(); it != i; ++it) {
-            _list.erase_and_dispose(it, current_deleter<internal_node>());
-        }
-        for (auto it = iterator_to(end); it != _list.end(); ++it) {
-            _list.erase_and_dispose(it, current_deleter<internal_node>());
+        if (start > end || start >= _size) {
+            clear();
+            return true;
         }
+        end = std::min(end, _size - 1);
+        drop_back(_size - 1 - end);
+        drop_front(start);
         return true;
     }
 
-    // Erases all the elements of the list. Destructors are called.
-    inline void clear()
+    // Destroys up to `count` elements, returns how many were destroyed.
+    inline size_t flush_some(size_t count)
     {
-        _list.clear_and_dispose(current_deleter<internal_node>());
+        count = std::min(count, _size);
+        drop_front(count);
+        return count;
     }
 
-    // reduce
-    void reduce(size_t start, size_t end, std::function<void(const_iterator it)>&& reduce_fn)
+    // Erases all the elements of the list. Destructors are called.
+    inline void clear()
     {
-        auto start_it = iterator_to(start);
-        auto end_it = iterator_to(end);
-        for (; start_it != end_it; ++start_it) {
-            reduce_fn(start_it);
-        }
+        _chunks.clear_and_dispose(current_deleter<chunk>());
+        _size = 0;
     }
 
     bool index_out_of_range(long index) const
     {
-        return index < 0 || static_cast<size_t>(index) > _list.size();
+        return index < 0 || static_cast<size_t>(index) >= _size;
     }
 private:
-    const_iterator iterator_to(size_t index) const
+    // Returns the chunk holding the element at `index`, and its offset
+    // in the chunk.
+    std::pair<chunk*, size_t> seek(size_t index)
     {
-        auto i = _list.begin();
-        for (size_t idx = 0; idx < index && i != _list.end(); ++idx, ++i) {};
-        return i;
+        if (index < _size / 2) {
+            for (auto& c : _chunks) {
+                if (index < c._count) {
+                    return { &c, index };
+                }
+                index -= c._count;
+            }
+        }
+        else {
+            index = _size - 1 - index;
+            for (auto it = _chunks.rbegin(); it != _chunks.rend(); ++it) {
+                if (index < it->_count) {
+                    return { &*it, it->_count - 1 - index };
+                }
+                index -= it->_count;
+            }
+        }
+        assert(false);
+        return { nullptr, 0 };
     }
-    iterator iterator_to(size_t index)
+
+    void drop_front(size_t count)
     {
-        auto i = _list.begin();
-        for (size_t idx = 0; idx < index && i != _list.end(); ++idx, ++i) {};
-        return i;
+        _size -= count;
+        while (count > 0) {
+            auto& c = _chunks.front();
+            if (count >= c._count) {
+                count -= c._count;
+                _chunks.pop_front_and_dispose(current_deleter<chunk>());
+                continue;
+            }
+            for (size_t i = 0; i < count; ++i) {
+                c.item(i) = managed_bytes();
+            }
+            c._begin += count;
+            c._count -= count;
+            count = 0;
+        }
     }
 
-    inline bool equal(const internal_node& n, const bytes& data) const
+    void drop_back(size_t count)
     {
-        auto mb = n._data;
-        bytes_view b {mb.data(), mb.size()} ;
-        bytes_view a {data.data(), data.size()};
-        return b == a;
+        _size -= count;
+        while (count > 0) {
+            auto& c = _chunks.back();
+            if (count >= c._count) {
+                count -= c._count;
+                _chunks.pop_back_and_dispose(current_deleter<chunk>());
+                continue;
+            }
+            for (size_t i = c._count - count; i < c._count; ++i) {
+                c.item(i) = managed_bytes();
+            }
+            c._count -= count;
+            count = 0;
+        }
     }
 
-    inline bool equal(const bytes& data, const internal_node& n) const
+    static inline bool equal(const managed_bytes& mb, const bytes& data)
     {
-        return equal(data, n);
+        return mb.size() == data.size() && bytes_view {mb.data(), mb.size()} == bytes_view {data.data(), data.size()};
     }
-
 };
 }
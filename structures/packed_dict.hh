@@ -0,0 +1,590 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#pragma once
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <vector>
+#include "utils/managed_bytes.hh"
+#include "utils/bytes.hh"
+#include "utils/integer_string.hh"
+#include "structures/dict_lsa.hh"
+namespace redis {
+
+class packed_dict;
+// A field of a packed_dict, pointing into the blob.
+class packed_dict_entry {
+    friend class packed_dict;
+    using entry_type = dict_entry::entry_type;
+    bytes_view _key;
+    entry_type _type = entry_type::BYTES;
+    bytes_view _bytes;
+    double _float = 0;
+    int64_t _integer = 0;
+    // Where the record lives in the blob.
+    size_t _offset = 0;
+    size_t _length = 0;
+public:
+    bool type_of_bytes() const {
+        return _type == entry_type::BYTES;
+    }
+    bool type_of_integer() const {
+        return _type == entry_type::INTEGER;
+    }
+    bool type_of_float() const {
+        return _type == entry_type::FLOAT;
+    }
+    inline bytes_view key() const
+    {
+        return _key;
+    }
+    inline const char* key_data() const
+    {
+        return _key.data();
+    }
+    inline size_t key_size() const
+    {
+        return _key.size();
+    }
+    inline size_t value_bytes_size() const
+    {
+        return _bytes.size();
+    }
+    inline const char* value_bytes_data() const
+    {
+        return _bytes.data();
+    }
+    inline const double value_float() const {
+        return _float;
+    }
+    inline const int64_t value_integer() const {
+        return _integer;
+    }
+};
+
+// Small hashes and sets packed into a single blob, instead of a dict_lsa
+// with one allocation per field. The layout is
+//
+//   [u32 count] then, for every field, [varint size][key], followed in
+//   hashes by [u8 type][varint size][bytes] or [u8 type][8 bytes] for
+//   integers and floats.
+//
+// Lookups scan the blob and every update rewrites it, which is cheap for
+// the sizes allowed by database_options. The accessor mirrors the dict_lsa
+// API so that commands can be written once for both encodings.
+//
+// A set whose members all read as integers, see parse_integer_string(),
+// may be packed as an intset instead, as Redis does: the header has
+// int_layout set and the width of the members, 2, 4 or 8 bytes, and the
+// members follow as integers of that width, sorted, so that a lookup is a
+// binary search. A member too wide for the others widens them all, one
+// which is not an integer turns the intset into records, see to_records().
+class packed_dict final {
+    using entry_type_tag = dict_entry::entry_type;
+    using bytes_ostream_type = std::vector<char>;
+    static constexpr size_t header_size = sizeof(uint32_t);
+    static constexpr uint32_t int_layout = uint32_t(1) << 31;
+    static constexpr unsigned width_shift = 24;
+    static constexpr uint32_t count_mask = (uint32_t(1) << width_shift) - 1;
+    managed_bytes& _blob;
+    bool _values;
+    mutable std::vector<packed_dict_entry> _entries;
+    // The digits of the members of an intset, which its entries point to.
+    mutable std::vector<char> _digits;
+    mutable bool _parsed = false;
+
+    uint32_t header() const
+    {
+        uint32_t h;
+        std::memcpy(&h, _blob.data(), sizeof(h));
+        return h;
+    }
+
+    size_t width() const
+    {
+        return (header() & ~int_layout) >> width_shift;
+    }
+
+    static size_t width_of(int64_t v)
+    {
+        if (v >= std::numeric_limits<int16_t>::min() && v <= std::numeric_limits<int16_t>::max()) {
+            return sizeof(int16_t);
+        }
+        if (v >= std::numeric_limits<int32_t>::min() && v <= std::numeric_limits<int32_t>::max()) {
+            return sizeof(int32_t);
+        }
+        return sizeof(int64_t);
+    }
+
+    static int64_t read_int(const char* p, size_t width)
+    {
+        if (width == sizeof(int16_t)) {
+            int16_t v;
+            std::memcpy(&v, p, sizeof(v));
+            return v;
+        }
+        if (width == sizeof(int32_t)) {
+            int32_t v;
+            std::memcpy(&v, p, sizeof(v));
+            return v;
+        }
+        int64_t v;
+        std::memcpy(&v, p, sizeof(v));
+        return v;
+    }
+
+    static void write_int(char* p, size_t width, int64_t v)
+    {
+        if (width == sizeof(int16_t)) {
+            auto n = static_cast<int16_t>(v);
+            std::memcpy(p, &n, sizeof(n));
+        }
+        else if (width == sizeof(int32_t)) {
+            auto n = static_cast<int32_t>(v);
+            std::memcpy(p, &n, sizeof(n));
+        }
+        else {
+            std::memcpy(p, &v, sizeof(v));
+        }
+    }
+
+    int64_t int_at(size_t i) const
+    {
+        auto w = width();
+        return read_int(_blob.data() + header_size + i * w, w);
+    }
+
+    // The index of the first member not less than v.
+    size_t int_lower_bound(int64_t v) const
+    {
+        size_t lo = 0, hi = size();
+        while (lo < hi) {
+            auto mid = lo + (hi - lo) / 2;
+            if (int_at(mid) < v) {
+                lo = mid + 1;
+            }
+            else {
+                hi = mid;
+            }
+        }
+        return lo;
+    }
+
+    static bool parse_member(bytes_view k, int64_t& v)
+    {
+        return parse_integer_string(k.data(), k.size(), v);
+    }
+
+    // Rewrites the intset with `count` members of `width` bytes, the i-th
+    // being value_at(i).
+    template <typename Func>
+    void rewrite_ints(size_t count, size_t width, Func&& value_at)
+    {
+        managed_bytes blob(managed_bytes::initialized_later(), header_size + count * width);
+        auto p = blob.data();
+        uint32_t h = int_layout | (static_cast<uint32_t>(width) << width_shift) | static_cast<uint32_t>(count);
+        std::memcpy(p, &h, sizeof(h));
+        for (size_t i = 0; i < count; ++i) {
+            write_int(p + header_size + i * width, width, value_at(i));
+        }
+        _blob = std::move(blob);
+        _parsed = false;
+    }
+
+    static size_t read_varint(const char* p, size_t& pos)
+    {
+        size_t v = 0;
+        for (unsigned shift = 0; ; shift += 7) {
+            auto b = static_cast<uint8_t>(p[pos++]);
+            v |= size_t(b & 0x7f) << shift;
+            if (!(b & 0x80)) {
+                return v;
+            }
+        }
+    }
+
+    static void write_varint(bytes_ostream_type& out, size_t v)
+    {
+        while (v >= 0x80) {
+            out.push_back(static_cast<char>(v | 0x80));
+            v >>= 7;
+        }
+        out.push_back(static_cast<char>(v));
+    }
+
+    static void write_raw(bytes_ostream_type& out, const void* p, size_t size)
+    {
+        auto c = static_cast<const char*>(p);
+        out.insert(out.end(), c, c + size);
+    }
+
+    static void write_bytes(bytes_ostream_type& out, bytes_view b)
+    {
+        write_varint(out, b.size());
+        write_raw(out, b.data(), b.size());
+    }
+
+    const std::vector<packed_dict_entry>& entries() const
+    {
+        if (_parsed) {
+            return _entries;
+        }
+        _entries.clear();
+        if (integers()) {
+            auto count = size();
+            auto w = width();
+            _entries.reserve(count);
+            _digits.resize(count * max_integer_string);
+            for (size_t i = 0; i < count; ++i) {
+                packed_dict_entry e;
+                auto digits = _digits.data() + i * max_integer_string;
+                e._key = bytes_view(digits, format_integer_string(int_at(i), digits));
+                e._offset = header_size + i * w;
+                e._length = w;
+                _entries.push_back(e);
+            }
+            _parsed = true;
+            return _entries;
+        }
+        auto p = _blob.data();
+        uint32_t count;
+        std::memcpy(&count, p, sizeof(count));
+        _entries.reserve(count);
+        size_t pos = header_size;
+        for (uint32_t i = 0; i < count; ++i) {
+            packed_dict_entry e;
+            e._offset = pos;
+            auto size = read_varint(p, pos);
+            e._key = bytes_view(p + pos, size);
+            pos += size;
+            if (_values) {
+                e._type = static_cast<entry_type_tag>(p[pos++]);
+                switch (e._type) {
+                    case entry_type_tag::BYTES:
+                        size = read_varint(p, pos);
+                        e._bytes = bytes_view(p + pos, size);
+                        pos += size;
+                        break;
+                    case entry_type_tag::FLOAT:
+                        std::memcpy(&e._float, p + pos, sizeof(double));
+                        pos += sizeof(double);
+                        break;
+                    case entry_type_tag::INTEGER:
+                        std::memcpy(&e._integer, p + pos, sizeof(int64_t));
+                        pos += sizeof(int64_t);
+                        break;
+                }
+            }
+            e._length = pos - e._offset;
+            _entries.push_back(e);
+        }
+        _parsed = true;
+        return _entries;
+    }
+
+    const packed_dict_entry* find(bytes_view k) const
+    {
+        if (integers()) {
+            int64_t v;
+            if (!parse_member(k, v)) {
+                return nullptr;
+            }
+            auto i = int_lower_bound(v);
+            return i < size() && int_at(i) == v ? &entries()[i] : nullptr;
+        }
+        for (auto& e : entries()) {
+            if (e._key == k) {
+                return &e;
+            }
+        }
+        return nullptr;
+    }
+
+    // Rewrites the blob with the record at [offset, offset + length)
+    // replaced by `record`, and `count` fields.
+    void rewrite(size_t offset, size_t length, const bytes_ostream_type& record, uint32_t count)
+    {
+        auto old = bytes_view(_blob.data(), _blob.size());
+        auto size = old.size() - length + record.size();
+        managed_bytes blob(managed_bytes::initialized_later(), size);
+        auto p = blob.data();
+        std::memcpy(p, &count, sizeof(count));
+        std::memcpy(p + header_size, old.data() + header_size, offset - header_size);
+        if (!record.empty()) {
+            std::memcpy(p + offset, record.data(), record.size());
+        }
+        std::memcpy(p + offset + record.size(), old.data() + offset + length, old.size() - offset - length);
+        _blob = std::move(blob);
+        _parsed = false;
+    }
+
+    bool put_record(bytes_view k, const bytes_ostream_type& record)
+    {
+        auto e = find(k);
+        if (e) {
+            rewrite(e->_offset, e->_length, record, size());
+            return false;
+        }
+        rewrite(_blob.size(), 0, record, size() + 1);
+        return true;
+    }
+
+    template <typename Func>
+    bool put_value(const bytes& k, entry_type_tag type, Func&& write_value)
+    {
+        bytes_ostream_type record;
+        write_bytes(record, bytes_view(k.data(), k.size()));
+        record.push_back(static_cast<char>(type));
+        write_value(record);
+        return put_record(bytes_view(k.data(), k.size()), record);
+    }
+public:
+    using entry_type = packed_dict_entry;
+    // Larger blobs would be fragmented by LSA.
+    static constexpr size_t max_blob_size = 8192;
+
+    packed_dict(managed_bytes& blob, bool values) : _blob(blob), _values(values)
+    {
+    }
+
+    // The blob of an empty dict.
+    static managed_bytes make_blob()
+    {
+        uint32_t count = 0;
+        return managed_bytes(bytes_view(reinterpret_cast<const char*>(&count), sizeof(count)));
+    }
+
+    // The blob of an empty intset.
+    static managed_bytes make_int_blob()
+    {
+        uint32_t h = int_layout | (static_cast<uint32_t>(sizeof(int16_t)) << width_shift);
+        return managed_bytes(bytes_view(reinterpret_cast<const char*>(&h), sizeof(h)));
+    }
+
+    // Whether the set is packed as an intset.
+    inline bool integers() const
+    {
+        return header() & int_layout;
+    }
+
+    // Whether the members read as integers an intset can hold.
+    static bool integer_member(const bytes& member)
+    {
+        int64_t v;
+        return parse_member(bytes_view(member.data(), member.size()), v);
+    }
+    static bool integer_members(const std::vector<bytes>& members)
+    {
+        return std::all_of(members.begin(), members.end(), [] (const bytes& m) { return integer_member(m); });
+    }
+
+    // The blob grows as the records are added, there is nothing to
+    // presize. Here for dict_lsa::reserve().
+    void reserve(size_t) {}
+
+    inline size_t size() const
+    {
+        auto h = header();
+        return h & int_layout ? h & count_mask : h;
+    }
+
+    // Turns an intset into records, once a member is not an integer.
+    void to_records()
+    {
+        if (!integers()) {
+            return;
+        }
+        bytes_ostream_type out;
+        uint32_t count = size();
+        write_raw(out, &count, sizeof(count));
+        for (auto& e : entries()) {
+            write_bytes(out, e._key);
+        }
+        _blob = managed_bytes(bytes_view(out.data(), out.size()));
+        _parsed = false;
+    }
+
+    inline bool empty() const
+    {
+        return size() == 0;
+    }
+
+    inline size_t blob_size() const
+    {
+        return _blob.size();
+    }
+
+    inline bool exists(const bytes& k) const
+    {
+        if (integers()) {
+            int64_t v;
+            if (!parse_member(bytes_view(k.data(), k.size()), v)) {
+                return false;
+            }
+            auto i = int_lower_bound(v);
+            return i < size() && int_at(i) == v;
+        }
+        return find(bytes_view(k.data(), k.size())) != nullptr;
+    }
+
+    template <typename Func>
+    inline std::result_of_t<Func(const packed_dict_entry* e)> run_with_entry(const bytes& k, Func&& func) const {
+        return func(find(bytes_view(k.data(), k.size())));
+    }
+
+    void fetch(const std::vector<bytes>& keys, std::vector<const packed_dict_entry*>& result) const {
+        for (const auto& key : keys) {
+            result.push_back(find(bytes_view(key.data(), key.size())));
+        }
+    }
+
+    void fetch(std::vector<const packed_dict_entry*>& result) const {
+        for (auto& e : entries()) {
+            result.push_back(&e);
+        }
+    }
+
+    // A packed dict is small enough to be scanned in one step, whatever
+    // the cursor.
+    template <typename Func>
+    size_t scan(size_t, Func&& func) const
+    {
+        for (auto& e : entries()) {
+            func(e);
+        }
+        return 0;
+    }
+
+    void fetch_keys(std::vector<bytes>& result) const {
+        for (auto& e : entries()) {
+            result.emplace_back(bytes(e.key_data(), e.key_size()));
+        }
+    }
+
+    template <typename Random>
+    const packed_dict_entry* random_entry(Random&& random) const
+    {
+        auto& all = entries();
+        return all.empty() ? nullptr : &all[random() % all.size()];
+    }
+
+    // Returns true if the field is new.
+    bool put(const bytes& k, const bytes& v)
+    {
+        return put_value(k, entry_type_tag::BYTES, [&v] (bytes_ostream_type& out) {
+            write_bytes(out, bytes_view(v.data(), v.size()));
+        });
+    }
+
+    bool put(const bytes& k, int64_t v)
+    {
+        return put_value(k, entry_type_tag::INTEGER, [v] (bytes_ostream_type& out) {
+            write_raw(out, &v, sizeof(v));
+        });
+    }
+
+    bool put(const bytes& k, double v)
+    {
+        return put_value(k, entry_type_tag::FLOAT, [v] (bytes_ostream_type& out) {
+            write_raw(out, &v, sizeof(v));
+        });
+    }
+
+    // Adds a member of a set, returns true if it is new.
+    bool insert_key(const bytes& k)
+    {
+        auto key = bytes_view(k.data(), k.size());
+        int64_t v;
+        if (integers() && parse_member(key, v)) {
+            auto n = size();
+            auto i = int_lower_bound(v);
+            if (i < n && int_at(i) == v) {
+                return false;
+            }
+            auto old_width = width();
+            // the blob is replaced while its members are read.
+            std::vector<char> old(_blob.data() + header_size, _blob.data() + _blob.size());
+            rewrite_ints(n + 1, std::max(old_width, width_of(v)), [&old, old_width, i, v] (size_t j) {
+                if (j == i) {
+                    return v;
+                }
+                return read_int(old.data() + (j < i ? j : j - 1) * old_width, old_width);
+            });
+            return true;
+        }
+        to_records();
+        if (find(key)) {
+            return false;
+        }
+        bytes_ostream_type record;
+        write_bytes(record, key);
+        rewrite(_blob.size(), 0, record, size() + 1);
+        return true;
+    }
+
+    bool erase(const bytes& k)
+    {
+        if (integers()) {
+            int64_t v;
+            if (!parse_member(bytes_view(k.data(), k.size()), v)) {
+                return false;
+            }
+            auto n = size();
+            auto i = int_lower_bound(v);
+            if (i == n || int_at(i) != v) {
+                return false;
+            }
+            auto w = width();
+            std::vector<char> old(_blob.data() + header_size, _blob.data() + _blob.size());
+            rewrite_ints(n - 1, w, [&old, w, i] (size_t j) {
+                return read_int(old.data() + (j < i ? j : j + 1) * w, w);
+            });
+            return true;
+        }
+        auto e = find(bytes_view(k.data(), k.size()));
+        if (e) {
+            rewrite(e->_offset, e->_length, {}, size() - 1);
+            return true;
+        }
+        return false;
+    }
+
+    // Moves every field into `dict`, which must be empty.
+    void unpack_into(dict_lsa& dict) const
+    {
+        for (auto& e : entries()) {
+            auto key = bytes(e.key_data(), e.key_size());
+            if (!_values) {
+                dict.insert(current_allocator().construct<dict_entry>(key));
+            }
+            else if (e.type_of_integer()) {
+                dict.insert(current_allocator().construct<dict_entry>(key, e.value_integer()));
+            }
+            else if (e.type_of_float()) {
+                dict.insert(current_allocator().construct<dict_entry>(key, e.value_float()));
+            }
+            else {
+                dict.insert(current_allocator().construct<dict_entry>(key, bytes(e.value_bytes_data(), e.value_bytes_size())));
+            }
+        }
+    }
+};
+}
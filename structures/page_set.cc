@@ -0,0 +1,58 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#include "structures/page_set.hh"
+#include <cstring>
+namespace redis {
+
+constexpr size_t lsa_page_set::page_size;
+
+lsa_page_set::~lsa_page_set()
+{
+    _pages.clear_and_dispose(current_deleter<page>());
+}
+
+char* lsa_page_set::get(uint64_t index)
+{
+    auto i = _pages.find(index, page::compare());
+    if (i != _pages.end()) {
+        return i->_data.begin();
+    }
+    managed_bytes data(managed_bytes::initialized_later(), page_size);
+    std::memset(data.begin(), 0, page_size);
+    auto p = current_allocator().construct<page>(index, std::move(data));
+    _pages.insert(*p);
+    return p->_data.begin();
+}
+
+void lsa_page_set::assign(uint64_t index, const char* data)
+{
+    std::memcpy(get(index), data, page_size);
+}
+
+size_t lsa_page_set::memory_usage() const
+{
+    size_t n = 0;
+    for (auto& p : _pages) {
+        n += current_allocator().object_memory_size_in_allocator(&p) + p._data.external_memory_usage();
+    }
+    return n;
+}
+}
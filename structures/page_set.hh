@@ -0,0 +1,88 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#pragma once
+#include <boost/intrusive/set.hpp>
+#include "utils/allocation_strategy.hh"
+#include "utils/managed_bytes.hh"
+#include <cstdint>
+namespace redis {
+
+// A large array of bytes, zeroes at first, in pages of page_size bytes,
+// each an object of the region, allocated as it is first written. The
+// sketches, whose size is set as they are made, keep their counters and
+// bits in one, so that those not yet written take no memory and no page
+// is larger than the region lets an object be.
+//
+// The pointers to the bytes of a page are valid until the region is next
+// allocated from, which may move it.
+class lsa_page_set {
+public:
+    static constexpr size_t page_size = 4096;
+private:
+    struct page {
+        boost::intrusive::set_member_hook<> _link;
+        uint64_t _index;
+        managed_bytes _data;
+
+        page(uint64_t index, managed_bytes data) noexcept : _link(), _index(index), _data(std::move(data)) {}
+        page(page&& o) noexcept : _link(), _index(o._index), _data(std::move(o._data))
+        {
+            _link.swap_nodes(o._link);
+        }
+        struct compare {
+            bool operator () (const page& l, const page& r) const { return l._index < r._index; }
+            bool operator () (uint64_t l, const page& r) const { return l < r._index; }
+            bool operator () (const page& l, uint64_t r) const { return l._index < r; }
+        };
+    };
+    using page_set_type = boost::intrusive::set<page,
+        boost::intrusive::member_hook<page, boost::intrusive::set_member_hook<>, &page::_link>,
+        boost::intrusive::compare<page::compare>,
+        boost::intrusive::constant_time_size<true>>;
+    page_set_type _pages;
+public:
+    lsa_page_set() noexcept {}
+    lsa_page_set(lsa_page_set&& o) noexcept : _pages(std::move(o._pages)) {}
+    ~lsa_page_set();
+
+    size_t pages() const { return _pages.size(); }
+    // The bytes of the page, nullptr while it holds only zeroes.
+    const char* find(uint64_t index) const
+    {
+        auto i = _pages.find(index, page::compare());
+        return i == _pages.end() ? nullptr : i->_data.begin();
+    }
+    // The bytes of the page, allocated with zeroes unless it was.
+    char* get(uint64_t index);
+    // Sets the page to the page_size bytes at `data`, as a snapshot is loaded.
+    void assign(uint64_t index, const char* data);
+    // Calls func(index, const char* data) for the pages allocated, in order.
+    template <typename Func>
+    void for_each(Func&& func) const
+    {
+        for (auto& p : _pages) {
+            func(p._index, static_cast<const char*>(p._data.begin()));
+        }
+    }
+    // Bytes the pages take in the current allocator.
+    size_t memory_usage() const;
+};
+}
@@ -0,0 +1,59 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#pragma once
+#include <cstddef>
+namespace redis {
+
+// The cursor of the SCAN family walks the slots of a power of two sized
+// table in reverse binary order, incrementing its high bits first. Slot i
+// of a table of size n is split into slots i and i + n of a table of size
+// 2n, which are visited right after each other, so growing or shrinking
+// the table between two calls never skips a slot.
+//
+// To keep the guarantee while a table is being rehashed, every step visits
+// slot `cursor & small_mask` of the smaller table and all the slots of the
+// larger one it is split into:
+//
+//     visit(small, cursor & small_mask);
+//     do {
+//         visit(large, cursor & large_mask);
+//         cursor = next_scan_cursor(cursor, large_mask);
+//     } while (cursor & (small_mask ^ large_mask));
+struct scan_cursor {
+    static inline size_t reverse_bits(size_t v)
+    {
+        size_t r = 0;
+        for (size_t i = 0; i < sizeof(size_t) * 8; ++i, v >>= 1) {
+            r = (r << 1) | (v & 1);
+        }
+        return r;
+    }
+
+    // The cursor following `cursor` in a table of `mask + 1` slots, 0 once
+    // it wrapped around.
+    static inline size_t next(size_t cursor, size_t mask)
+    {
+        cursor |= ~mask;
+        return reverse_bits(reverse_bits(cursor) + 1);
+    }
+};
+
+}
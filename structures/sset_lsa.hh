@@ -24,8 +24,6 @@
 #include "core/shared_ptr.hh"
 #include "core/sharded.hh"
 #include "util/log.hh"
-#include <boost/intrusive/list.hpp>
-#include <boost/intrusive/set.hpp>
 #include "utils/managed_bytes.hh"
 #include "utils/managed_ref.hh"
 #include "utils/bytes.hh"
@@ -34,7 +32,10 @@
 #include  <experimental/vector>
 #include <experimental/optional>
 #include  <vector>
+#include <algorithm>
+#include <numeric>
 #include "keys.hh"
+#include "structures/hash_index.hh"
 namespace redis {
 
 static const int ZADD_NONE = 0;
@@ -46,37 +47,149 @@ static constexpr const int ZADD_CH   = (1 << 3); // number elementes were change
 static constexpr const int ZAGGREGATE_MIN = (1 << 0);
 static constexpr const int ZAGGREGATE_MAX = (1 << 1);
 static constexpr const int ZAGGREGATE_SUM = (1 << 2);
-struct sset_entry
+
+// A bound of ZRANGEBYLEX and friends: `-`, `+`, `[member` or `(member`.
+struct lex_bound
+{
+    enum class kind { min, max, inclusive, exclusive };
+    kind _kind = kind::min;
+    bytes _member;
+
+    // Returns false if `s` is not a valid bound.
+    static bool parse(const bytes& s, lex_bound& b)
+    {
+        if (s.size() == 1 && (s[0] == '-' || s[0] == '+')) {
+            b._kind = s[0] == '-' ? kind::min : kind::max;
+            return true;
+        }
+        if (s.size() >= 1 && (s[0] == '[' || s[0] == '(')) {
+            b._kind = s[0] == '[' ? kind::inclusive : kind::exclusive;
+            b._member = bytes(s.data() + 1, s.size() - 1);
+            return true;
+        }
+        return false;
+    }
+};
+
+// A run of consecutive ranks of a sorted set.
+struct rank_range
+{
+    size_t _first = 0;
+    size_t _count = 0;
+
+    // Applies LIMIT `offset` `limit`, counted from the last rank when
+    // `reverse`; a negative `limit` keeps every rank after the offset.
+    rank_range window(long offset, long limit, bool reverse) const
+    {
+        if (offset < 0 || static_cast<size_t>(offset) >= _count || limit == 0) {
+            return rank_range {};
+        }
+        auto count = _count - offset;
+        if (limit > 0 && static_cast<size_t>(limit) < count) {
+            count = limit;
+        }
+        return rank_range { reverse ? _first + _count - offset - count : _first + offset, count };
+    }
+};
+
+// The range of ZRANGESTORE: ranks, scores or members, with REV and LIMIT
+// as ZRANGE takes them.
+struct zrange_spec
 {
-    using set_hook_type = boost::intrusive::set_member_hook<>;
-    using list_hook_type = boost::intrusive::list_member_hook<>;
-    list_hook_type _list_link;
-    set_hook_type _set_link;
+    enum class kind { rank, score, lex };
+    kind _kind = kind::rank;
+    long _begin = 0;
+    long _end = -1;
+    double _min = 0;
+    double _max = 0;
+    lex_bound _lex_min;
+    lex_bound _lex_max;
+    bool _reverse = false;
+    long _offset = 0;
+    long _limit = -1;
+};
+// The node of the order-statistic tree of a sset_lsa. Each node counts the
+// members of its subtree, so that ranks are found in O(log n).
+struct sset_rank_hook
+{
+    sset_rank_hook* _parent = nullptr;
+    sset_rank_hook* _left = nullptr;
+    sset_rank_hook* _right = nullptr;
+    size_t _count = 0;
+
+    sset_rank_hook() noexcept
+    {
+    }
+
+    // LSA moves linked nodes, so the neighbours are repointed.
+    sset_rank_hook(sset_rank_hook&& o) noexcept
+        : _parent(o._parent)
+        , _left(o._left)
+        , _right(o._right)
+        , _count(o._count)
+    {
+        if (_parent) {
+            if (_parent->_left == &o) {
+                _parent->_left = this;
+            }
+            else {
+                _parent->_right = this;
+            }
+        }
+        if (_left) {
+            _left->_parent = this;
+        }
+        if (_right) {
+            _right->_parent = this;
+        }
+        o._parent = o._left = o._right = nullptr;
+        o._count = 0;
+    }
+};
+
+struct sset_entry : public sset_rank_hook
+{
+    // The slot of the member index pointing to this entry.
+    sset_entry** _slot;
     managed_bytes _key;
     size_t _key_hash;
     double _score;
 
     sset_entry(const bytes& key, const double score) noexcept
-        : _list_link()
-        , _set_link()
-        , _key(std::move(*(current_allocator().construct<managed_bytes>(bytes_view {key.data(), key.size()}))))
+        : sset_rank_hook()
+        , _slot(nullptr)
+        , _key(bytes_view {key.data(), key.size()})
         , _key_hash(std::hash<managed_bytes>()(_key))
         , _score(score)
     {
     }
 
     sset_entry(sset_entry&& o) noexcept
-        : _list_link(std::move(o._list_link))
-        , _set_link(std::move(o._set_link))
+        : sset_rank_hook(std::move(o))
+        , _slot(o._slot)
         , _key(std::move(o._key))
         , _key_hash(std::move(o._key_hash))
         , _score(std::move(o._score))
     {
+        if (_slot) {
+            *_slot = this;
+        }
+        o._slot = nullptr;
     }
 
     ~sset_entry()
     {
     }
+
+    inline bool equals(bytes_view k, size_t hash) const noexcept {
+        return _key_hash == hash && _key.size() == k.size() && memcmp(_key.data(), k.data(), k.size()) == 0;
+    }
+
+    // Bytes the entry holds in the current allocator, its member included.
+    size_t memory_usage() const noexcept
+    {
+        return current_allocator().object_memory_size_in_allocator(this) + _key.external_memory_usage();
+    }
     struct compare {
         inline bool compare_impl(const char* d1, size_t s1, const char* d2, size_t s2) const noexcept {
             const int len = std::min(s1, s2);
@@ -127,21 +240,20 @@ struct sset_entry
 };
 
 class database;
+// Members are indexed twice: by member in a hash_index, and by (score, member) in a
+// treap whose priorities are derived from the member hash. The treap counts
+// the members of every subtree, so ZRANK and the start of a ZRANGE are
+// found in O(log n).
 class sset_lsa final {
     friend class database;
-    using dict_type = boost::intrusive::set<sset_entry,
-        boost::intrusive::member_hook<sset_entry, sset_entry::set_hook_type, &sset_entry::_set_link>,
-        boost::intrusive::compare<sset_entry::compare>>;
-    using list_type = boost::intrusive::list<sset_entry,
-        boost::intrusive::member_hook<sset_entry, boost::intrusive::list_member_hook<>,
-        &sset_entry::_list_link>>;
-    dict_type _dict;
-    list_type _list;
+    hash_index<sset_entry> _index;
+    // _header._left is the root of the treap.
+    sset_rank_hook _header;
 public:
-    sset_lsa() noexcept : _dict(), _list()
+    sset_lsa() noexcept : _index(), _header()
     {
     }
-    sset_lsa(sset_lsa&& o) noexcept : _dict(std::move(o._dict)), _list(std::move(o._list))
+    sset_lsa(sset_lsa&& o) noexcept : _index(std::move(o._index)), _header(std::move(o._header))
     {
     }
     ~sset_lsa()
@@ -150,26 +262,122 @@ public:
     }
     void flush_all()
     {
-        _list.clear_and_dispose(current_deleter<sset_entry>());
+        _index.clear_and_dispose([] (sset_entry*) {});
+        destroy_some(std::numeric_limits<size_t>::max());
+    }
+
+    // Destroys up to `count` members, returns how many were destroyed.
+    size_t flush_some(size_t count)
+    {
+        return destroy_some(count);
     }
 
     inline bool insert(sset_entry* e)
     {
         assert(e != nullptr);
-        if (insert_ordered(e)) {
-            auto r = _dict.insert(*e);
-            return r.second;
+        if (_index.find(bytes_view {e->key_data(), e->key_size()}, e->_key_hash)) {
+            return false;
         }
-        return false;
+        _index.insert(e);
+        link(e);
+        return true;
+    }
+
+    // Builds an empty set from members sorted by score, then by member, in
+    // O(n): the treap is built along its right spine as a Cartesian tree
+    // instead of rotating each member up from a leaf. Falls back to
+    // insert() when the set is not empty or the members are not sorted.
+    // Returns the members inserted, those already in are disposed of.
+    template <typename Dispose>
+    size_t insert_sorted(const std::vector<sset_entry*>& members, Dispose&& dispose)
+    {
+        bool sorted = root() == nullptr;
+        for (size_t i = 1; sorted && i < members.size(); ++i) {
+            sorted = less(*members[i - 1], *members[i]);
+        }
+        size_t inserted = 0;
+        if (!sorted) {
+            for (auto e : members) {
+                if (insert(e)) {
+                    ++inserted;
+                }
+                else {
+                    dispose(e);
+                }
+            }
+            return inserted;
+        }
+        _index.reserve(members.size());
+        std::vector<sset_rank_hook*> spine;
+        // a node leaves the spine with its subtree complete.
+        auto close = [] (sset_rank_hook* n) {
+            n->_count = 1 + count_of(n->_left) + count_of(n->_right);
+        };
+        for (auto e : members) {
+            // the same member under two scores.
+            if (_index.find(bytes_view {e->key_data(), e->key_size()}, e->_key_hash)) {
+                dispose(e);
+                continue;
+            }
+            _index.insert(e);
+            ++inserted;
+            auto priority = priority_of(e);
+            sset_rank_hook* last = nullptr;
+            while (!spine.empty() && priority_of(spine.back()) < priority) {
+                last = spine.back();
+                spine.pop_back();
+                close(last);
+            }
+            e->_left = last;
+            e->_right = nullptr;
+            if (last) {
+                last->_parent = e;
+            }
+            auto parent = spine.empty() ? &_header : spine.back();
+            if (parent == &_header) {
+                _header._left = e;
+            }
+            else {
+                parent->_right = e;
+            }
+            e->_parent = parent;
+            spine.push_back(e);
+        }
+        while (!spine.empty()) {
+            close(spine.back());
+            spine.pop_back();
+        }
+        return inserted;
+    }
+
+    // The members of ZADD and GEOADD as given, applied in order: a member
+    // given twice is inserted, then updated.
+    using member_scores = std::vector<std::pair<bytes, double>>;
+
+    // Fills the empty set with distinct members sorted by score, then by
+    // member, as fetch_range() yields them, in O(n) through insert_sorted().
+    size_t insert_sorted_members(const member_scores& members)
+    {
+        std::vector<sset_entry*> entries;
+        entries.reserve(members.size());
+        for (auto& m : members) {
+            entries.push_back(current_allocator().construct<sset_entry>(m.first, m.second));
+        }
+        return insert_sorted(entries, [] (sset_entry* e) {
+            current_allocator().destroy<sset_entry>(e);
+        });
     }
 
-    size_t insert_if_not_exists(const std::unordered_map<bytes, double>& members)
+    size_t insert_if_not_exists(const member_scores& members)
     {
+        if (root() == nullptr && members.size() > 1) {
+            return build(members, false);
+        }
         size_t inserted = 0;
         for (auto& member : members) {
             const auto& key = member.first;
             const auto& score = member.second;
-            if (_dict.find(key, sset_entry::compare()) == _dict.end()) {
+            if (!_index.find(key)) {
                 auto entry = current_allocator().construct<sset_entry>(key, score);
                 if (insert(entry)) {
                     inserted++;
@@ -182,19 +390,16 @@ public:
         return inserted;
     }
 
-    size_t update_if_only_exists(const std::unordered_map<bytes, double>& members)
+    size_t update_if_only_exists(const member_scores& members)
     {
         size_t inserted = 0;
         for (auto& member : members) {
             const auto& key = member.first;
             const auto& score = member.second;
-            auto it = _dict.find(key, sset_entry::compare());
-            if (it != _dict.end()) {
-                //remove it from list, update score, insert it to list again.
-                auto lit = list_type::s_iterator_to(*it);
-                _list.erase(lit);
+            auto it = _index.find(key);
+            if (it) {
                 it->update_score(score);
-                if (insert_ordered(&(*it))) {
+                if (update(it)) {
                     inserted++;
                 }
             }
@@ -205,11 +410,11 @@ public:
     double insert_or_update(const bytes& key, double delta)
     {
         double result = delta;
-        auto it = _dict.find(key, sset_entry::compare());
-        if (it != _dict.end()) {
+        auto it = _index.find(key);
+        if (it) {
             result += it->score();
             it->update_score(result);
-            update(&(*it));
+            update(it);
         }
         else {
             auto entry = current_allocator().construct<sset_entry>(key, result);
@@ -218,16 +423,20 @@ public:
         return result;
     }
 
-    size_t insert_or_update(const std::unordered_map<bytes, double>& members)
+    size_t insert_or_update(const member_scores& members)
     {
+        if (root() == nullptr && members.size() > 1) {
+            return build(members, true);
+        }
+        _index.reserve(_index.size() + members.size());
         size_t inserted = 0;
         for (auto& member : members) {
             const auto& key = member.first;
             const auto& score = member.second;
-            auto it = _dict.find(key, sset_entry::compare());
-            if (it != _dict.end()) {
+            auto it = _index.find(key);
+            if (it) {
                 it->update_score(score);
-                if (update(&(*it))) {
+                if (update(it)) {
                     inserted++;
                 }
             }
@@ -241,97 +450,64 @@ public:
         return inserted;
     }
 
-    void fetch_by_rank(long begin, long end, std::vector<std::pair<bytes, double>>& entries) const
+    // Ranks are 0 based and inclusive, negative ranks count from the end.
+    // With `reverse`, ranks count from the highest score.
+    void fetch_by_rank(long begin, long end, std::vector<std::pair<bytes, double>>& entries, bool reverse = false) const
     {
-        if (_list.empty()) {
-            return;
-        }
-        auto size = _list.size();
-        if (begin < 0) { begin += static_cast<long>(size); }
-        while (end < 0) { end += static_cast<long>(size); }
-        if (begin < 0) begin = 0;
-        if (begin > end) {
-           return;
-        }
-        if (begin > static_cast<long>(size)) {
-            begin = static_cast<long>(size);
-        }
-        long rank = 0;
-        if (rank_out_of_range(begin, end)) {
-            return;
-        }
-        for (auto it = _list.begin(); it != _list.end(); ++it, ++rank) {
-            if (rank < begin) {
-                continue;
-            }
-            else if (rank > end) {
-                return;
-            }
-            else {
-                const auto& e = *it;
-                entries.emplace_back(std::pair<bytes, double>(bytes(e.key_data(), e.key_size()), e.score()));
-            }
-        }
+        for_each_by_rank(begin, end, reverse, [&entries] (const sset_entry& e) {
+            entries.emplace_back(std::pair<bytes, double>(bytes(e.key_data(), e.key_size()), e.score()));
+        });
     }
 
-    void fetch_by_rank(long begin, long end, std::vector<const sset_entry*>& entries) const
+    // The members of the range, in score order whatever its REV.
+    void fetch_range(const zrange_spec& spec, std::vector<std::pair<bytes, double>>& entries) const
     {
-        if (_list.empty()) {
-            return;
-        }
-        auto size = _list.size();
-        if (begin < 0) { begin += static_cast<long>(size); }
-        while (end < 0) { end += static_cast<long>(size); }
-        if (begin < 0) begin = 0;
-        if (begin > end) {
-           return;
-        }
-        if (begin > static_cast<long>(size)) {
-            begin = static_cast<long>(size);
-        }
-        long rank = 0;
-        if (rank_out_of_range(begin, end)) {
-            return;
-        }
-        for (auto it = _list.begin(); it != _list.end(); ++it, ++rank) {
-            if (rank < begin) {
-                continue;
-            }
-            else if (rank > end) {
-                return;
-            }
-            else {
-                const auto& e = *it;
-                entries.push_back(&e);
-            }
+        rank_range r;
+        switch (spec._kind) {
+        case zrange_spec::kind::rank:
+            r = range_by_rank(spec._begin, spec._end, spec._reverse);
+            break;
+        case zrange_spec::kind::score:
+            r = range_by_score(spec._min, spec._max).window(spec._offset, spec._limit, spec._reverse);
+            break;
+        case zrange_spec::kind::lex:
+            r = range_by_lex(spec._lex_min, spec._lex_max).window(spec._offset, spec._limit, spec._reverse);
+            break;
         }
+        entries.reserve(r._count);
+        for_each_in(r, false, [&entries] (const sset_entry& e) {
+            entries.emplace_back(bytes(e.key_data(), e.key_size()), e.score());
+        });
+    }
+
+    void fetch_by_rank(long begin, long end, std::vector<const sset_entry*>& entries, bool reverse = false) const
+    {
+        for_each_by_rank(begin, end, reverse, [&entries] (const sset_entry& e) {
+            entries.push_back(&e);
+        });
     }
 
     void fetch_by_score(const double min, const double max, std::vector<const sset_entry*>& entries, size_t limit = 0) const
     {
-        if (_list.empty()) {
-            return;
-        }
-        if (score_out_of_range(min, max)) {
-            return;
-        }
         if (limit == 0) {
-            limit = _list.size();
+            limit = size();
         }
-        for (auto it = _list.begin(); it != _list.end(); ++it) {
-            const auto& score = it->score();
-            if (score < min) {
-                continue;
-            }
-            else if (score > max) {
-                return;
+        for (auto n = lower_bound(min); n && entry_of(n)->score() <= max; n = next(n)) {
+            entries.push_back(entry_of(n));
+            if (entries.size() >= limit) {
+                break;
             }
-            else {
-                const auto& e = *it;
-                entries.push_back(&e);
-                if (entries.size() >= limit) {
-                    break;
-                }
+        }
+    }
+
+    // Visits the members with a score in [min, max) from a single O(log n)
+    // seek, until `func` returns false.
+    template <typename Func>
+    void for_each_in_score(const double min, const double max, Func&& func) const
+    {
+        for (auto n = lower_bound(min); n && entry_of(n)->score() < max; n = next(n)) {
+            if (!func(*entry_of(n))) {
+                break;
             }
         }
     }
@@ -339,8 +515,8 @@ public:
     void fetch_by_key(const std::vector<bytes>& keys, std::vector<const sset_entry*>& entries) const
     {
         for (size_t i = 0; i < keys.size(); ++i) {
-           auto it = _dict.find(keys[i], sset_entry::compare());
-           if (it != _dict.end()) {
+           auto it = _index.find(keys[i]);
+           if (it) {
                const auto& e = *it;
                entries.push_back(&e);
            }
@@ -349,12 +525,10 @@ public:
 
     bool update_score(const bytes& key, double delta)
     {
-        auto it = _dict.find(key, sset_entry::compare());
-        if (it != _dict.end()) {
-            auto lit = list_type::s_iterator_to(*it);
-            _list.erase(lit);
+        auto it = _index.find(key);
+        if (it) {
             it->update_score(delta);
-            return insert_ordered(&(*it));
+            return update(it);
         }
         return false;
     }
@@ -362,10 +536,10 @@ public:
     size_t erase(const std::vector<const sset_entry*>& entries)
     {
         for (size_t i = 0; i < entries.size(); ++i) {
-            auto lit = list_type::s_iterator_to(*entries[i]);
-            auto dit = dict_type::s_iterator_to(*lit);
-            _dict.erase(dit);
-            _list.erase_and_dispose(lit, current_deleter<sset_entry>());
+            auto e = const_cast<sset_entry*>(entries[i]);
+            _index.erase(e);
+            unlink(e);
+            current_allocator().destroy<sset_entry>(e);
         }
         return entries.size();
     }
@@ -374,12 +548,7 @@ public:
     {
         size_t removed = 0;
         for (size_t i = 0; i < keys.size(); ++i) {
-            auto& key = keys[i];
-            auto dit = _dict.find(key, sset_entry::compare());
-            if (dit != _dict.end()) {
-                auto lit = list_type::s_iterator_to(*dit);
-                _dict.erase(dit);
-                _list.erase_and_dispose(lit, current_deleter<sset_entry>());
+            if (erase(keys[i])) {
                 removed++;
             }
         }
@@ -388,32 +557,77 @@ public:
 
     size_t count_by_score(const double min, const double max) const
     {
-        if (_dict.empty()) {
-            return 0;
+        return range_by_score(min, max)._count;
+    }
+
+    // Ranks are 0 based and inclusive, negative ranks count from the end.
+    // With `reverse`, ranks count from the highest score.
+    rank_range range_by_rank(long begin, long end, bool reverse) const
+    {
+        auto size = static_cast<long>(this->size());
+        if (begin < 0) begin += size;
+        if (end < 0) end += size;
+        if (begin < 0) begin = 0;
+        if (end >= size) end = size - 1;
+        if (begin > end || begin >= size) {
+            return rank_range {};
         }
-        if (score_out_of_range(min, max)) {
-            return 0;
+        auto count = static_cast<size_t>(end - begin + 1);
+        return rank_range { static_cast<size_t>(reverse ? size - 1 - end : begin), count };
+    }
+
+    rank_range range_by_score(const double min, const double max) const
+    {
+        return range_of(lower_bound(min), upper_bound(max));
+    }
+
+    // Members are compared byte by byte, which orders a sorted set by member
+    // only if all of its scores are equal, as Redis assumes.
+    rank_range range_by_lex(const lex_bound& min, const lex_bound& max) const
+    {
+        return range_of(lower_bound(min), upper_bound(max));
+    }
+
+    size_t count_by_lex(const lex_bound& min, const lex_bound& max) const
+    {
+        return range_by_lex(min, max)._count;
+    }
+
+    void fetch_by_lex(const lex_bound& min, const lex_bound& max, std::vector<const sset_entry*>& entries) const
+    {
+        for_each_in(range_by_lex(min, max), false, [&entries] (const sset_entry& e) {
+            entries.push_back(&e);
+        });
+    }
+
+    // Visits the members of the ranks in `r`, from the last one if `reverse`.
+    // The walk starts from a single O(log n) seek.
+    template <typename Func>
+    void for_each_in(const rank_range& r, bool reverse, Func&& func) const
+    {
+        if (r._count == 0) {
+            return;
         }
-        size_t count = 0;
-        for (auto it = _list.begin(); it != _list.end(); ++it) {
-            auto score = it->score();
-            if (score < min) {
-                continue;
-            }
-            else if (score > max) {
-                break;
-            }
-            else {
-                count++;
-            }
+        auto n = select(reverse ? r._first + r._count - 1 : r._first);
+        for (size_t i = 0; n && i < r._count; ++i) {
+            func(*entry_of(n));
+            n = reverse ? prev(n) : next(n);
         }
-        return count;
+    }
+
+    // One step of ZSCAN, see hash_index::scan.
+    template <typename Func>
+    size_t scan(size_t cursor, Func&& func) const
+    {
+        return _index.scan(cursor, [&func] (const sset_entry* e) {
+            func(*e);
+        });
     }
 
     template <typename Func>
     inline std::result_of_t<Func(const sset_entry* e)> run_with_entry(const bytes& k, Func&& func) const {
-        auto it = _dict.find(k, sset_entry::compare());
-        if (it != _dict.end()) {
+        auto it = _index.find(k);
+        if (it) {
             const auto& e = *it;
             return func(&e);
         }
@@ -424,8 +638,8 @@ public:
 
     template <typename Func>
     inline std::result_of_t<Func(sset_entry* e)> run_with_entry(const bytes& k, Func&& func) {
-        auto it = _dict.find(k, sset_entry::compare());
-        if (it != _dict.end()) {
+        auto it = _index.find(k);
+        if (it) {
             auto& e = *it;
             return func(&e);
         }
@@ -436,89 +650,410 @@ public:
 
     inline size_t size() const
     {
-        return _list.size();
+        return count_of(root());
+    }
+
+    // Bytes held by the set: the slot tables of the member index, and the
+    // entries estimated from the first `samples` of them, or from all of
+    // them when 0.
+    size_t memory_usage(size_t samples) const
+    {
+        auto members = size();
+        size_t bytes = 0;
+        auto sampled = _index.for_first(samples ? samples : members, [&bytes] (const sset_entry* e) {
+            bytes += e->memory_usage();
+        });
+        auto entries = sampled ? static_cast<size_t>(double(bytes) / sampled * members) : 0;
+        return _index.slot_memory() + entries;
     }
 
     inline bool empty() const
     {
-        return _list.empty();
+        return root() == nullptr;
     }
 
-    void erase(const bytes& key)
+    bool erase(const bytes& key)
     {
-        auto removed = _dict.erase(_dict.find(key, sset_entry::compare()));
-        if (removed != _dict.end()) {
-            _list.erase_and_dispose(list_type::s_iterator_to(*removed), current_deleter<sset_entry>());
+        auto e = _index.find(key);
+        if (!e) {
+            return false;
         }
+        _index.erase(e);
+        unlink(e);
+        current_allocator().destroy<sset_entry>(e);
+        return true;
     }
 
     std::experimental::optional<size_t> rank(const bytes& key) const
     {
-        size_t rank = 0;
-        auto it = _dict.find(key, sset_entry::compare());
-        if (it != _dict.end()) {
-            auto lit = list_type::s_iterator_to(*it);
-            for (auto i = _list.begin(); i != lit; ++i, ++rank) {}
-            return std::experimental::optional<size_t>(rank);
+        auto it = _index.find(key);
+        if (it) {
+            return std::experimental::optional<size_t>(rank_of(it));
         }
         return  std::experimental::optional<size_t>();
     }
 
     std::experimental::optional<double> score(const bytes& key) const
     {
-        auto it = _dict.find(key, sset_entry::compare());
-        if (it != _dict.end()) {
+        auto it = _index.find(key);
+        if (it) {
             return  std::experimental::optional<double>(it->score());
         }
         return  std::experimental::optional<double>();
     }
 private:
-    inline bool score_out_of_range(double min, double max) const
+    // Fills the empty set with `members` through insert_sorted(). Of a
+    // member given twice the last score is kept when `last_wins`, the first
+    // otherwise, as inserting them one at a time would.
+    size_t build(const member_scores& members, bool last_wins)
     {
-        return (min > _list.rbegin()->score()) || (max < _list.begin()->score());
+        std::vector<size_t> order(members.size());
+        std::iota(order.begin(), order.end(), 0);
+        std::stable_sort(order.begin(), order.end(), [&members] (size_t l, size_t r) {
+            return members[l].first < members[r].first;
+        });
+        std::vector<sset_entry*> entries;
+        entries.reserve(members.size());
+        for (size_t i = 0; i < order.size(); ) {
+            auto j = i + 1;
+            while (j < order.size() && members[order[j]].first == members[order[i]].first) {
+                ++j;
+            }
+            auto& m = members[order[last_wins ? j - 1 : i]];
+            entries.push_back(current_allocator().construct<sset_entry>(m.first, m.second));
+            i = j;
+        }
+        std::sort(entries.begin(), entries.end(), [] (const sset_entry* l, const sset_entry* r) {
+            return less(*l, *r);
+        });
+        return insert_sorted(entries, [] (sset_entry* e) {
+            current_allocator().destroy<sset_entry>(e);
+        });
     }
 
-    inline bool rank_out_of_range(long begin, long end) const
+    static inline sset_entry* entry_of(sset_rank_hook* n)
     {
-        return begin > static_cast<long>(_list.size()) || end <= 0;
+        return static_cast<sset_entry*>(n);
     }
 
-    inline bool insert_ordered(sset_entry* e)
+    static inline const sset_entry* entry_of(const sset_rank_hook* n)
     {
-        assert(e != nullptr);
-        auto it = _list.begin();
-        const auto& score = e->score();
-        if (it == _list.end() || score < it->score()) {
-            _list.push_front(*e);
-            return true;
+        return static_cast<const sset_entry*>(n);
+    }
+
+    static inline size_t count_of(const sset_rank_hook* n)
+    {
+        return n ? n->_count : 0;
+    }
+
+    static inline size_t priority_of(const sset_rank_hook* n)
+    {
+        auto h = entry_of(n)->_key_hash * 0x9e3779b97f4a7c15ULL;
+        return h ^ (h >> 32);
+    }
+
+    // Members are ordered by score, then by member.
+    static inline bool less(const sset_entry& l, const sset_entry& r)
+    {
+        if (l.score() != r.score()) {
+            return l.score() < r.score();
+        }
+        return sset_entry::compare()(l, r);
+    }
+
+    inline sset_rank_hook* root()
+    {
+        return _header._left;
+    }
+
+    inline const sset_rank_hook* root() const
+    {
+        return _header._left;
+    }
+
+    // Moves `n` above its parent, keeping the order.
+    void rotate_up(sset_rank_hook* n)
+    {
+        auto p = n->_parent;
+        auto g = p->_parent;
+        if (p->_left == n) {
+            p->_left = n->_right;
+            if (n->_right) {
+                n->_right->_parent = p;
+            }
+            n->_right = p;
         }
         else {
-            auto trace = it;
-            for (; it != _list.end(); ++it) {
-                if (it->score() > score) {
-                    _list.insert(it, *e);
-                    return true;
-                }
-                trace = it;
+            p->_right = n->_left;
+            if (n->_left) {
+                n->_left->_parent = p;
             }
-            if (it == _list.end()) {
-                if (trace->score() > score) {
-                    _list.push_front(*e);
+            n->_left = p;
+        }
+        if (g->_left == p) {
+            g->_left = n;
+        }
+        else {
+            g->_right = n;
+        }
+        n->_parent = g;
+        p->_parent = n;
+        n->_count = p->_count;
+        p->_count = 1 + count_of(p->_left) + count_of(p->_right);
+    }
+
+    void link(sset_entry* e)
+    {
+        sset_rank_hook* parent = &_header;
+        bool left = true;
+        for (auto n = root(); n != nullptr; n = left ? n->_left : n->_right) {
+            ++n->_count;
+            parent = n;
+            left = less(*e, *entry_of(n));
+        }
+        e->_parent = parent;
+        e->_left = e->_right = nullptr;
+        e->_count = 1;
+        if (left) {
+            parent->_left = e;
+        }
+        else {
+            parent->_right = e;
+        }
+        auto priority = priority_of(e);
+        while (e->_parent != &_header && priority > priority_of(e->_parent)) {
+            rotate_up(e);
+        }
+    }
+
+    void unlink(sset_entry* e)
+    {
+        // rotate `e` down to a leaf, then cut it.
+        while (e->_left || e->_right) {
+            auto child = e->_left;
+            if (!child || (e->_right && priority_of(e->_right) > priority_of(child))) {
+                child = e->_right;
+            }
+            rotate_up(child);
+        }
+        auto p = e->_parent;
+        if (p->_left == e) {
+            p->_left = nullptr;
+        }
+        else {
+            p->_right = nullptr;
+        }
+        for (auto n = p; n != &_header; n = n->_parent) {
+            --n->_count;
+        }
+        e->_parent = nullptr;
+        e->_count = 0;
+    }
+
+    inline bool update(sset_entry* e)
+    {
+        unlink(e);
+        link(e);
+        return true;
+    }
+
+    // Destroys members bottom up, which needs no rebalancing.
+    size_t destroy_some(size_t count)
+    {
+        size_t destroyed = 0;
+        auto n = root();
+        while (n != nullptr && destroyed < count) {
+            if (n->_left) {
+                n = n->_left;
+            }
+            else if (n->_right) {
+                n = n->_right;
+            }
+            else {
+                auto p = n->_parent;
+                if (p->_left == n) {
+                    p->_left = nullptr;
                 }
                 else {
-                    _list.push_back(*e);
+                    p->_right = nullptr;
+                }
+                for (auto a = p; a != &_header; a = a->_parent) {
+                    --a->_count;
+                }
+                auto e = entry_of(n);
+                if (e->_slot) {
+                    _index.erase(e);
                 }
-                return true;
+                e->_parent = nullptr;
+                e->_count = 0;
+                current_allocator().destroy<sset_entry>(e);
+                ++destroyed;
+                n = p != &_header ? p : root();
             }
         }
-        return false;
+        return destroyed;
     }
 
-    inline bool update(sset_entry* e)
+    size_t rank_of(const sset_rank_hook* n) const
+    {
+        size_t rank = count_of(n->_left);
+        for (; n->_parent != &_header; n = n->_parent) {
+            if (n->_parent->_right == n) {
+                rank += count_of(n->_parent->_left) + 1;
+            }
+        }
+        return rank;
+    }
+
+    const sset_rank_hook* select(size_t rank) const
+    {
+        auto n = root();
+        while (n != nullptr) {
+            auto left = count_of(n->_left);
+            if (rank < left) {
+                n = n->_left;
+            }
+            else if (rank == left) {
+                break;
+            }
+            else {
+                rank -= left + 1;
+                n = n->_right;
+            }
+        }
+        return n;
+    }
+
+    const sset_rank_hook* next(const sset_rank_hook* n) const
+    {
+        if (n->_right) {
+            for (n = n->_right; n->_left; n = n->_left) {}
+            return n;
+        }
+        while (n->_parent != &_header && n->_parent->_right == n) {
+            n = n->_parent;
+        }
+        return n->_parent != &_header ? n->_parent : nullptr;
+    }
+
+    const sset_rank_hook* prev(const sset_rank_hook* n) const
+    {
+        if (n->_left) {
+            for (n = n->_left; n->_right; n = n->_right) {}
+            return n;
+        }
+        while (n->_parent != &_header && n->_parent->_left == n) {
+            n = n->_parent;
+        }
+        return n->_parent != &_header ? n->_parent : nullptr;
+    }
+
+    // The first member with a score not less than `min`.
+    const sset_rank_hook* lower_bound(double min) const
+    {
+        const sset_rank_hook* result = nullptr;
+        for (auto n = root(); n != nullptr; ) {
+            if (entry_of(n)->score() >= min) {
+                result = n;
+                n = n->_left;
+            }
+            else {
+                n = n->_right;
+            }
+        }
+        return result;
+    }
+
+    // The last member with a score not greater than `max`.
+    const sset_rank_hook* upper_bound(double max) const
+    {
+        const sset_rank_hook* result = nullptr;
+        for (auto n = root(); n != nullptr; ) {
+            if (entry_of(n)->score() <= max) {
+                result = n;
+                n = n->_right;
+            }
+            else {
+                n = n->_left;
+            }
+        }
+        return result;
+    }
+
+    static inline int compare_member(const sset_entry& e, const bytes& member)
+    {
+        auto r = memcmp(e.key_data(), member.data(), std::min(e.key_size(), member.size()));
+        if (r == 0) {
+            return e.key_size() < member.size() ? -1 : e.key_size() > member.size() ? 1 : 0;
+        }
+        return r;
+    }
+
+    static bool above(const sset_entry& e, const lex_bound& min)
+    {
+        switch (min._kind) {
+        case lex_bound::kind::min: return true;
+        case lex_bound::kind::max: return false;
+        case lex_bound::kind::inclusive: return compare_member(e, min._member) >= 0;
+        default: return compare_member(e, min._member) > 0;
+        }
+    }
+
+    static bool below(const sset_entry& e, const lex_bound& max)
+    {
+        switch (max._kind) {
+        case lex_bound::kind::min: return false;
+        case lex_bound::kind::max: return true;
+        case lex_bound::kind::inclusive: return compare_member(e, max._member) <= 0;
+        default: return compare_member(e, max._member) < 0;
+        }
+    }
+
+    // The first member not below `min`.
+    const sset_rank_hook* lower_bound(const lex_bound& min) const
+    {
+        const sset_rank_hook* result = nullptr;
+        for (auto n = root(); n != nullptr; ) {
+            if (above(*entry_of(n), min)) {
+                result = n;
+                n = n->_left;
+            }
+            else {
+                n = n->_right;
+            }
+        }
+        return result;
+    }
+
+    // The last member not above `max`.
+    const sset_rank_hook* upper_bound(const lex_bound& max) const
+    {
+        const sset_rank_hook* result = nullptr;
+        for (auto n = root(); n != nullptr; ) {
+            if (below(*entry_of(n), max)) {
+                result = n;
+                n = n->_right;
+            }
+            else {
+                n = n->_left;
+            }
+        }
+        return result;
+    }
+
+    rank_range range_of(const sset_rank_hook* first, const sset_rank_hook* last) const
+    {
+        if (!first || !last) {
+            return rank_range {};
+        }
+        auto first_rank = rank_of(first), last_rank = rank_of(last);
+        return first_rank <= last_rank ? rank_range { first_rank, last_rank - first_rank + 1 } : rank_range {};
+    }
+
+    template <typename Func>
+    void for_each_by_rank(long begin, long end, bool reverse, Func&& func) const
     {
-        auto lit = list_type::s_iterator_to(*e);
-        _list.erase(lit);
-        return insert_ordered(e);
+        for_each_in(range_by_rank(begin, end, reverse), reverse, std::forward<Func>(func));
     }
 };
 }
@@ -0,0 +1,106 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#pragma once
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <queue>
+#include <utility>
+#include <vector>
+#include "utils/bytes.hh"
+#include "structures/sset_lsa.hh"
+namespace redis {
+
+// Members of a sorted set with their scores, as shipped between shards by
+// ZUNION, ZINTER, ZDIFF and their STORE variants.
+using zset_members = std::vector<std::pair<bytes, double>>;
+
+// The score of a source member times its WEIGHTS, 0 rather than NaN for
+// 0 * inf as in Redis.
+inline double weigh_score(double score, double weight)
+{
+    auto result = score * weight;
+    return std::isnan(result) ? 0 : result;
+}
+
+// Folds two scores of a member with AGGREGATE SUM, MIN or MAX. A sum of
+// opposite infinities is 0, as in Redis.
+inline double aggregate_score(double old, double score, int flag)
+{
+    if (flag == ZAGGREGATE_MIN) {
+        return std::min(old, score);
+    }
+    if (flag == ZAGGREGATE_MAX) {
+        return std::max(old, score);
+    }
+    auto result = old + score;
+    return std::isnan(result) ? 0 : result;
+}
+
+// K-way merge of runs sorted by member, each member appearing once per run.
+// Members found in several runs are folded with aggregate_score(), and
+// emit(member, score) sees every distinct member once, in order.
+template <typename Func>
+void merge_zset_runs(const std::vector<const zset_members*>& runs, int aggregate, Func&& emit)
+{
+    using cursor = std::pair<size_t, size_t>;
+    auto member_of = [&runs] (const cursor& c) -> const std::pair<bytes, double>& {
+        return (*runs[c.first])[c.second];
+    };
+    auto greater = [&member_of] (const cursor& l, const cursor& r) {
+        return member_of(r).first < member_of(l).first;
+    };
+    std::priority_queue<cursor, std::vector<cursor>, decltype(greater)> heads(greater);
+    auto advance = [&runs, &heads] (cursor c) {
+        if (++c.second < runs[c.first]->size()) {
+            heads.push(c);
+        }
+    };
+    for (size_t i = 0; i < runs.size(); ++i) {
+        if (!runs[i]->empty()) {
+            heads.emplace(i, 0);
+        }
+    }
+    while (!heads.empty()) {
+        auto c = heads.top();
+        heads.pop();
+        auto& head = member_of(c);
+        auto score = head.second;
+        while (!heads.empty() && member_of(heads.top()).first == head.first) {
+            auto same = heads.top();
+            heads.pop();
+            score = aggregate_score(score, member_of(same).second, aggregate);
+            advance(same);
+        }
+        emit(head.first, score);
+        advance(c);
+    }
+}
+
+// The reply order of ZUNION, ZINTER and ZDIFF: by score, then by member.
+inline void sort_by_score(zset_members& members)
+{
+    std::sort(members.begin(), members.end(), [] (const auto& l, const auto& r) {
+        return l.second < r.second || (l.second == r.second && l.first < r.first);
+    });
+}
+
+}
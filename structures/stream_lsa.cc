@@ -0,0 +1,373 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#include "structures/stream_lsa.hh"
+#include <algorithm>
+#include <cstring>
+namespace redis {
+
+constexpr size_t stream_id::max_size;
+constexpr size_t stream_lsa::max_block_entries;
+constexpr size_t stream_lsa::max_block_bytes;
+
+// An entry of a block:
+//   flags: 1 deleted, 2 with the fields of the first entry of the block
+//   varint: its ms less the ms of the first entry of the block
+//   varint: its seq, less the seq of the first entry if their ms is equal
+//   with the fields of the first entry: varint size and bytes of each value
+//   else: varint count, then varint size and bytes of each field and value
+static constexpr uint8_t entry_deleted = 1;
+static constexpr uint8_t entry_same_fields = 2;
+
+namespace stream_encoding {
+uint64_t read_varint(const char*& p)
+{
+    uint64_t v = 0;
+    for (unsigned shift = 0; ; shift += 7) {
+        auto b = static_cast<uint8_t>(*p++);
+        v |= uint64_t(b & 0x7f) << shift;
+        if ((b & 0x80) == 0) {
+            return v;
+        }
+    }
+}
+}
+
+static void put_varint(bytes& out, uint64_t v)
+{
+    char buffer[10];
+    size_t n = 0;
+    while (v >= 0x80) {
+        buffer[n++] = static_cast<char>((v & 0x7f) | 0x80);
+        v >>= 7;
+    }
+    buffer[n++] = static_cast<char>(v);
+    out.append(buffer, n);
+}
+
+static void put_string(bytes& out, const bytes& s)
+{
+    put_varint(out, s.size());
+    out.append(s.data(), s.size());
+}
+
+static bool parse_uint64(const char* data, size_t size, uint64_t& value)
+{
+    if (size == 0 || size > 20) {
+        return false;
+    }
+    uint64_t v = 0;
+    for (size_t i = 0; i < size; ++i) {
+        if (data[i] < '0' || data[i] > '9') {
+            return false;
+        }
+        auto digit = static_cast<uint64_t>(data[i] - '0');
+        if (v > (std::numeric_limits<uint64_t>::max() - digit) / 10) {
+            return false;
+        }
+        v = v * 10 + digit;
+    }
+    value = v;
+    return true;
+}
+
+static size_t format_uint64(uint64_t v, char* out)
+{
+    char digits[20];
+    size_t n = 0;
+    do {
+        digits[n++] = static_cast<char>('0' + v % 10);
+        v /= 10;
+    } while (v > 0);
+    std::reverse_copy(digits, digits + n, out);
+    return n;
+}
+
+bool stream_id::parse(const char* data, size_t size, stream_id& id, uint64_t missing_seq)
+{
+    auto dash = static_cast<const char*>(std::memchr(data, '-', size));
+    if (dash == nullptr) {
+        id._seq = missing_seq;
+        return parse_uint64(data, size, id._ms);
+    }
+    return parse_uint64(data, dash - data, id._ms) && parse_uint64(dash + 1, data + size - dash - 1, id._seq);
+}
+
+size_t stream_id::format(char* out) const
+{
+    auto n = format_uint64(_ms, out);
+    out[n++] = '-';
+    return n + format_uint64(_seq, out + n);
+}
+
+bool stream_id::next(stream_id& id) const
+{
+    if (_seq < std::numeric_limits<uint64_t>::max()) {
+        id = stream_id { _ms, _seq + 1 };
+        return true;
+    }
+    if (_ms < std::numeric_limits<uint64_t>::max()) {
+        id = stream_id { _ms + 1, 0 };
+        return true;
+    }
+    return false;
+}
+
+stream_consumer& stream_group::consumer(const bytes& name, uint64_t now_ms)
+{
+    auto& c = _consumers[name];
+    c._seen_ms = now_ms;
+    return c;
+}
+
+void stream_group::deliver(const bytes& consumer_name, stream_id id, uint64_t now_ms)
+{
+    auto& p = _pending[id];
+    if (p._deliveries > 0) {
+        // claimed again, from the consumer it was pending for.
+        auto c = _consumers.find(p._consumer);
+        if (c != _consumers.end() && c->second._pending > 0) {
+            --c->second._pending;
+        }
+    }
+    p._consumer = consumer_name;
+    p._delivered_ms = now_ms;
+    ++p._deliveries;
+    ++consumer(consumer_name, now_ms)._pending;
+}
+
+bool stream_group::ack(stream_id id)
+{
+    auto i = _pending.find(id);
+    if (i == _pending.end()) {
+        return false;
+    }
+    auto c = _consumers.find(i->second._consumer);
+    if (c != _consumers.end() && c->second._pending > 0) {
+        --c->second._pending;
+    }
+    _pending.erase(i);
+    return true;
+}
+
+size_t stream_group::remove_consumer(const bytes& name)
+{
+    auto c = _consumers.find(name);
+    if (c == _consumers.end()) {
+        return 0;
+    }
+    size_t dropped = 0;
+    for (auto i = _pending.begin(); i != _pending.end(); ) {
+        if (i->second._consumer == name) {
+            i = _pending.erase(i);
+            ++dropped;
+        }
+        else {
+            ++i;
+        }
+    }
+    _consumers.erase(c);
+    return dropped;
+}
+
+stream_lsa::~stream_lsa()
+{
+    _blocks.clear_and_dispose(current_deleter<block>());
+}
+
+bool stream_lsa::next_id(uint64_t now_ms, const uint64_t* ms, stream_id& id) const
+{
+    if (ms != nullptr) {
+        if (*ms < _last_id._ms) {
+            return false;
+        }
+        if (*ms > _last_id._ms) {
+            id = stream_id { *ms, 0 };
+            return true;
+        }
+        return _last_id.next(id);
+    }
+    // the clock may go backwards, the IDs do not.
+    if (now_ms > _last_id._ms) {
+        id = stream_id { now_ms, 0 };
+        return true;
+    }
+    return _last_id.next(id);
+}
+
+void stream_lsa::append(stream_id id, const std::vector<bytes>& args, size_t first)
+{
+    size_t fields = (args.size() - first) / 2;
+    auto same_fields_as = [&args, first, fields] (const block& b) {
+        return with_linearized_managed_bytes([&] {
+            auto p = b._data.begin();
+            if (stream_encoding::read_varint(p) != fields) {
+                return false;
+            }
+            for (size_t i = 0; i < fields; ++i) {
+                auto size = stream_encoding::read_varint(p);
+                auto& field = args[first + i * 2];
+                if (size != field.size() || std::memcmp(p, field.data(), size) != 0) {
+                    return false;
+                }
+                p += size;
+            }
+            return true;
+        });
+    };
+    block* last = _blocks.empty() ? nullptr : &*_blocks.rbegin();
+    if (last && (last->_entries >= max_block_entries || last->_data.size() >= max_block_bytes)) {
+        last = nullptr;
+    }
+    bool same_fields = last == nullptr || same_fields_as(*last);
+    bytes entry;
+    char flags = same_fields ? entry_same_fields : 0;
+    entry.append(&flags, 1);
+    auto base = last ? last->_first : id;
+    put_varint(entry, id._ms - base._ms);
+    put_varint(entry, id._ms == base._ms ? id._seq - base._seq : id._seq);
+    if (!same_fields) {
+        put_varint(entry, fields);
+    }
+    for (size_t i = 0; i < fields; ++i) {
+        if (!same_fields) {
+            put_string(entry, args[first + i * 2]);
+        }
+        put_string(entry, args[first + i * 2 + 1]);
+    }
+    if (last == nullptr) {
+        bytes head;
+        put_varint(head, fields);
+        for (size_t i = 0; i < fields; ++i) {
+            put_string(head, args[first + i * 2]);
+        }
+        head.append(entry.data(), entry.size());
+        last = current_allocator().construct<block>(id, managed_bytes(bytes_view { head.data(), head.size() }));
+        _blocks.insert(_blocks.end(), *last);
+    }
+    else {
+        last->_data.append(bytes_view { entry.data(), entry.size() });
+    }
+    last->_last = id;
+    ++last->_entries;
+    ++last->_live;
+    ++_length;
+    _last_id = id;
+}
+
+void stream_lsa::erase_block(block& b)
+{
+    _blocks.erase_and_dispose(_blocks.iterator_to(b), current_deleter<block>());
+}
+
+void stream_lsa::delete_at(block& b, size_t offset)
+{
+    b._data[offset] |= entry_deleted;
+    --_length;
+    if (--b._live == 0) {
+        erase_block(b);
+    }
+}
+
+bool stream_lsa::remove(stream_id id)
+{
+    auto i = _blocks.upper_bound(id, block::compare());
+    if (i == _blocks.begin()) {
+        return false;
+    }
+    --i;
+    if (id > i->_last) {
+        return false;
+    }
+    bool found = false;
+    size_t at = 0;
+    for_each_in_block(*i, [id, &found, &at] (const stream_entry_view& e, size_t offset) {
+        if (e._id == id) {
+            found = true;
+            at = offset;
+        }
+        return e._id < id;
+    });
+    if (found) {
+        delete_at(*i, at);
+    }
+    return found;
+}
+
+size_t stream_lsa::trim(size_t max_length, bool approximate)
+{
+    size_t deleted = 0;
+    while (!_blocks.empty() && _length > max_length) {
+        auto& b = *_blocks.begin();
+        if (_length - b._live >= max_length) {
+            deleted += b._live;
+            _length -= b._live;
+            erase_block(b);
+            continue;
+        }
+        if (approximate) {
+            break;
+        }
+        std::vector<size_t> offsets;
+        auto excess = _length - max_length;
+        for_each_in_block(b, [&offsets, excess] (const stream_entry_view&, size_t offset) {
+            offsets.push_back(offset);
+            return offsets.size() < excess;
+        });
+        for (auto offset : offsets) {
+            b._data[offset] |= entry_deleted;
+            --b._live;
+        }
+        _length -= offsets.size();
+        deleted += offsets.size();
+        break;
+    }
+    return deleted;
+}
+
+size_t stream_lsa::flush_some(size_t count)
+{
+    size_t flushed = 0;
+    while (!_blocks.empty() && flushed < count) {
+        auto& b = *_blocks.begin();
+        flushed += b._live;
+        _length -= b._live;
+        erase_block(b);
+    }
+    if (_blocks.empty()) {
+        _length = 0;
+    }
+    return flushed;
+}
+
+size_t stream_lsa::memory_usage() const
+{
+    size_t n = 0;
+    for (auto& b : _blocks) {
+        n += current_allocator().object_memory_size_in_allocator(&b) + b._data.external_memory_usage();
+    }
+    for (auto& g : _groups) {
+        n += g.first.size() + sizeof(g.second);
+        n += g.second._pending.size() * (sizeof(stream_id) + sizeof(stream_pending) + 32);
+        n += g.second._consumers.size() * (sizeof(stream_consumer) + 64);
+    }
+    return n;
+}
+}
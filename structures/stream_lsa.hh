@@ -0,0 +1,342 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#pragma once
+#include <boost/intrusive/set.hpp>
+#include "utils/allocation_strategy.hh"
+#include "utils/managed_bytes.hh"
+#include "utils/bytes.hh"
+#include <cstdint>
+#include <limits>
+#include <map>
+#include <utility>
+#include <vector>
+namespace redis {
+
+// The ID of a stream entry, `<ms>-<seq>`.
+struct stream_id {
+    uint64_t _ms = 0;
+    uint64_t _seq = 0;
+
+    // "-" and "+" of XRANGE.
+    static stream_id min() { return stream_id {}; }
+    static stream_id max()
+    {
+        return stream_id { std::numeric_limits<uint64_t>::max(), std::numeric_limits<uint64_t>::max() };
+    }
+    // `<ms>-<seq>`, or `<ms>` with `missing_seq` as its sequence.
+    static bool parse(const char* data, size_t size, stream_id& id, uint64_t missing_seq = 0);
+    // Writes `<ms>-<seq>` to `out`, which has room for max_size bytes.
+    static constexpr size_t max_size = 41;
+    size_t format(char* out) const;
+    // The ID right after this one, false if there is none.
+    bool next(stream_id& id) const;
+
+    friend bool operator == (const stream_id& a, const stream_id& b) { return a._ms == b._ms && a._seq == b._seq; }
+    friend bool operator != (const stream_id& a, const stream_id& b) { return !(a == b); }
+    friend bool operator < (const stream_id& a, const stream_id& b)
+    {
+        return a._ms < b._ms || (a._ms == b._ms && a._seq < b._seq);
+    }
+    friend bool operator > (const stream_id& a, const stream_id& b) { return b < a; }
+    friend bool operator <= (const stream_id& a, const stream_id& b) { return !(b < a); }
+    friend bool operator >= (const stream_id& a, const stream_id& b) { return !(a < b); }
+};
+
+// An entry as it is read: views into its block, valid until the stream
+// changes.
+struct stream_entry_view {
+    stream_id _id;
+    std::vector<std::pair<bytes_view, bytes_view>> _fields;
+};
+
+// An entry delivered to a consumer of a group and not yet acknowledged.
+struct stream_pending {
+    bytes _consumer;
+    uint64_t _delivered_ms = 0;
+    uint64_t _deliveries = 0;
+};
+
+struct stream_consumer {
+    uint64_t _seen_ms = 0;
+    size_t _pending = 0;
+};
+
+// A consumer group: the last entry delivered to its consumers and the
+// entries they have not acknowledged, its pending entries list.
+struct stream_group {
+    stream_id _last_delivered;
+    std::map<stream_id, stream_pending> _pending;
+    std::map<bytes, stream_consumer> _consumers;
+
+    stream_consumer& consumer(const bytes& name, uint64_t now_ms);
+    // Delivers the entry to the consumer, pending until it is acknowledged.
+    void deliver(const bytes& consumer, stream_id id, uint64_t now_ms);
+    // Whether the entry was pending.
+    bool ack(stream_id id);
+    // The pending entries of the consumer it drops.
+    size_t remove_consumer(const bytes& name);
+};
+
+// A stream in blocks of entries, each an object of the region, ordered by
+// the ID of their first entry, after the listpacks of the radix tree of
+// Redis. The ID of an entry is stored as its distance to the first ID of
+// its block, and the fields of the first entry of a block are stored once,
+// at its head, an entry with the same fields storing only their values. A
+// block takes max_block_entries entries, or its entries up to about
+// max_block_bytes, so that an XADD appends to the last block, growing it as
+// managed_bytes::append() does.
+//
+// XDEL only flags the entry in its block, which is freed once its entries
+// are all deleted. Trimming removes the whole blocks at the head, then
+// flags the entries of the next one unless the trim is approximate.
+//
+// The consumer groups are small next to the entries, and are kept out of
+// the region in standard containers.
+class stream_lsa {
+public:
+    static constexpr size_t max_block_entries = 100;
+    static constexpr size_t max_block_bytes = 4096;
+    using groups_type = std::map<bytes, stream_group>;
+private:
+    struct block {
+        boost::intrusive::set_member_hook<> _link;
+        stream_id _first;
+        stream_id _last;
+        uint32_t _entries = 0;
+        uint32_t _live = 0;
+        // The fields of the first entry, then the entries.
+        managed_bytes _data;
+
+        block(stream_id first, managed_bytes data) noexcept : _link(), _first(first), _last(first), _data(std::move(data)) {}
+        block(block&& o) noexcept
+            : _link()
+            , _first(o._first)
+            , _last(o._last)
+            , _entries(o._entries)
+            , _live(o._live)
+            , _data(std::move(o._data))
+        {
+            _link.swap_nodes(o._link);
+        }
+        struct compare {
+            bool operator () (const block& l, const block& r) const { return l._first < r._first; }
+            bool operator () (const stream_id& l, const block& r) const { return l < r._first; }
+            bool operator () (const block& l, const stream_id& r) const { return l._first < r; }
+        };
+    };
+    using block_set_type = boost::intrusive::set<block,
+        boost::intrusive::member_hook<block, boost::intrusive::set_member_hook<>, &block::_link>,
+        boost::intrusive::compare<block::compare>,
+        boost::intrusive::constant_time_size<true>>;
+    block_set_type _blocks;
+    size_t _length = 0;
+    stream_id _last_id;
+    groups_type _groups;
+
+    // Calls func(const stream_entry_view&, size_t offset) for the entries of
+    // the block not deleted, in order, until it returns false. Returns false
+    // if it did.
+    template <typename Func>
+    static bool for_each_in_block(const block& b, Func&& func);
+    void erase_block(block& b);
+    // Flags the entry at `offset` of the block deleted.
+    void delete_at(block& b, size_t offset);
+public:
+    stream_lsa() noexcept {}
+    stream_lsa(stream_lsa&& o) noexcept
+        : _blocks(std::move(o._blocks))
+        , _length(o._length)
+        , _last_id(o._last_id)
+        , _groups(std::move(o._groups))
+    {
+        o._length = 0;
+    }
+    ~stream_lsa();
+
+    size_t size() const { return _length; }
+    size_t blocks() const { return _blocks.size(); }
+    stream_id last_id() const { return _last_id; }
+    // The ID XADD gives the entry for `*`, or for `<ms>-*` when `ms` is
+    // set: false if it would not be greater than last_id().
+    bool next_id(uint64_t now_ms, const uint64_t* ms, stream_id& id) const;
+    // Appends the entry, whose ID must be greater than last_id(), with the
+    // fields and values of `args` from `first` on.
+    void append(stream_id id, const std::vector<bytes>& args, size_t first);
+    // Moves last_id() forward, as XSETID and loading a snapshot do.
+    void set_last_id(stream_id id)
+    {
+        if (id > _last_id) {
+            _last_id = id;
+        }
+    }
+    // Calls func(const stream_entry_view&) for the entries in [start, end],
+    // from the last when `reverse`, until it returns false.
+    template <typename Func>
+    void range(stream_id start, stream_id end, bool reverse, Func&& func) const;
+    // Whether any entry has an ID greater than `id`.
+    bool has_after(stream_id id) const;
+    // Deletes the entry, false if there is none.
+    bool remove(stream_id id);
+    // Deletes the first entries until there are at most `max_length`, or
+    // when `approximate` only the whole blocks which leave at least
+    // `max_length`. Returns the entries deleted.
+    size_t trim(size_t max_length, bool approximate);
+    // Destroys whole blocks from the first until at least `count` entries
+    // are gone, returns how many were. The stream is only fit to be
+    // flushed or destroyed afterwards.
+    size_t flush_some(size_t count);
+
+    groups_type& groups() { return _groups; }
+    const groups_type& groups() const { return _groups; }
+    stream_group* find_group(const bytes& name)
+    {
+        auto i = _groups.find(name);
+        return i == _groups.end() ? nullptr : &i->second;
+    }
+
+    // Bytes the blocks take in the current allocator, and about what the
+    // groups take out of it.
+    size_t memory_usage() const;
+};
+
+namespace stream_encoding {
+uint64_t read_varint(const char*& p);
+}
+
+template <typename Func>
+bool stream_lsa::for_each_in_block(const block& b, Func&& func)
+{
+    return with_linearized_managed_bytes([&b, &func] {
+        auto base = b._data.begin();
+        auto p = base;
+        auto master_fields = stream_encoding::read_varint(p);
+        std::vector<bytes_view> master;
+        master.reserve(master_fields);
+        for (uint64_t i = 0; i < master_fields; ++i) {
+            auto size = stream_encoding::read_varint(p);
+            master.emplace_back(p, size);
+            p += size;
+        }
+        stream_entry_view e;
+        for (uint32_t n = 0; n < b._entries; ++n) {
+            size_t offset = p - base;
+            auto flags = static_cast<uint8_t>(*p++);
+            auto ms = stream_encoding::read_varint(p);
+            auto seq = stream_encoding::read_varint(p);
+            e._id._ms = b._first._ms + ms;
+            e._id._seq = ms == 0 ? b._first._seq + seq : seq;
+            e._fields.clear();
+            bool same_fields = flags & 2;
+            size_t fields = same_fields ? master.size() : stream_encoding::read_varint(p);
+            for (size_t i = 0; i < fields; ++i) {
+                bytes_view field;
+                if (same_fields) {
+                    field = master[i];
+                }
+                else {
+                    auto size = stream_encoding::read_varint(p);
+                    field = bytes_view { p, size };
+                    p += size;
+                }
+                auto size = stream_encoding::read_varint(p);
+                e._fields.emplace_back(field, bytes_view { p, size });
+                p += size;
+            }
+            if ((flags & 1) == 0 && !func(static_cast<const stream_entry_view&>(e), offset)) {
+                return false;
+            }
+        }
+        return true;
+    });
+}
+
+template <typename Func>
+void stream_lsa::range(stream_id start, stream_id end, bool reverse, Func&& func) const
+{
+    if (start > end || _blocks.empty()) {
+        return;
+    }
+    // the block holding `start` is the last one starting at or before it.
+    auto i = _blocks.upper_bound(start, block::compare());
+    if (i != _blocks.begin()) {
+        --i;
+    }
+    if (!reverse) {
+        for (; i != _blocks.end() && i->_first <= end; ++i) {
+            if (i->_last < start) {
+                continue;
+            }
+            bool more = for_each_in_block(*i, [&] (const stream_entry_view& e, size_t) {
+                if (e._id < start) {
+                    return true;
+                }
+                return e._id <= end && func(e);
+            });
+            if (!more) {
+                return;
+            }
+        }
+        return;
+    }
+    auto j = _blocks.upper_bound(end, block::compare());
+    while (j != _blocks.begin()) {
+        --j;
+        if (j->_last < start) {
+            return;
+        }
+        // the entries of a block only read forwards, their views stay valid
+        // while the block is linearized.
+        bool more = with_linearized_managed_bytes([&] {
+            std::vector<stream_entry_view> entries;
+            for_each_in_block(*j, [&] (const stream_entry_view& e, size_t) {
+                if (e._id >= start && e._id <= end) {
+                    entries.push_back(e);
+                }
+                return e._id <= end;
+            });
+            for (auto k = entries.rbegin(); k != entries.rend(); ++k) {
+                if (!func(static_cast<const stream_entry_view&>(*k))) {
+                    return false;
+                }
+            }
+            return true;
+        });
+        if (!more) {
+            return;
+        }
+    }
+}
+
+inline bool stream_lsa::has_after(stream_id id) const
+{
+    stream_id start;
+    if (_length == 0 || !id.next(start)) {
+        return false;
+    }
+    // the last ID may be that of a deleted entry.
+    bool found = false;
+    range(start, stream_id::max(), false, [&found] (const stream_entry_view&) {
+        found = true;
+        return false;
+    });
+    return found;
+}
+}
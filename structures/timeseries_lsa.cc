@@ -0,0 +1,218 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#include "structures/timeseries_lsa.hh"
+#include <strings.h>
+namespace redis {
+
+constexpr size_t timeseries_lsa::max_chunk_bytes;
+
+static inline uint64_t low_bits(uint64_t value, unsigned n)
+{
+    return n == 64 ? value : value & ((uint64_t(1) << n) - 1);
+}
+
+// Whether the delta of delta fits `width` bits, sign included.
+static inline bool fits(int64_t dod, unsigned width)
+{
+    auto bound = int64_t(1) << (width - 1);
+    return dod >= -bound && dod < bound;
+}
+
+bool parse_ts_aggregation(const char* data, size_t size, ts_aggregation& type)
+{
+    static const std::pair<const char*, ts_aggregation> names[] = {
+        { "avg", ts_aggregation::avg },
+        { "sum", ts_aggregation::sum },
+        { "min", ts_aggregation::min },
+        { "max", ts_aggregation::max },
+        { "count", ts_aggregation::count },
+        { "first", ts_aggregation::first },
+        { "last", ts_aggregation::last },
+        { "range", ts_aggregation::range },
+    };
+    for (auto& n : names) {
+        if (std::strlen(n.first) == size && strncasecmp(n.first, data, size) == 0) {
+            type = n.second;
+            return true;
+        }
+    }
+    return false;
+}
+
+void timeseries_lsa::chunk::put_bits(uint64_t value, unsigned n)
+{
+    while (n > 0) {
+        auto take = std::min<unsigned>(n, 64 - _pending_bits);
+        auto part = low_bits(value, n) >> (n - take);
+        _pending = take == 64 ? part : (_pending << take) | part;
+        _pending_bits += take;
+        n -= take;
+        if (_pending_bits == 64) {
+            char word[8];
+            for (int i = 7; i >= 0; --i) {
+                word[i] = static_cast<char>(_pending & 0xff);
+                _pending >>= 8;
+            }
+            _data.append(bytes_view { word, sizeof(word) });
+            _pending = 0;
+            _pending_bits = 0;
+        }
+    }
+}
+
+uint64_t timeseries_lsa::bit_reader::get(unsigned n)
+{
+    uint64_t v = 0;
+    while (n > 0) {
+        if (_avail == 0) {
+            if (_p < _end) {
+                _word = static_cast<uint8_t>(*_p++);
+                _avail = 8;
+            }
+            else {
+                // a chunk holds the bits of its count of samples, this only
+                // guards against reading past them.
+                _word = _pending;
+                _avail = _pending_bits;
+                _pending_bits = 0;
+                if (_avail == 0) {
+                    return v;
+                }
+            }
+        }
+        auto take = std::min(n, _avail);
+        auto part = low_bits(_word >> (_avail - take), take);
+        v = take == 64 ? part : (v << take) | part;
+        _avail -= take;
+        n -= take;
+    }
+    return v;
+}
+
+timeseries_lsa::~timeseries_lsa()
+{
+    _chunks.clear_and_dispose(current_deleter<chunk>());
+}
+
+void timeseries_lsa::append_to(chunk& c, uint64_t ts, double value)
+{
+    uint64_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    if (c._count == 0) {
+        c.put_bits(bits, 64);
+    }
+    else {
+        auto delta = static_cast<int64_t>(ts - c._last);
+        auto dod = delta - c._last_delta;
+        if (dod == 0) {
+            c.put_bits(0, 1);
+        }
+        else if (fits(dod, 7)) {
+            c.put_bits(0x2, 2);
+            c.put_bits(static_cast<uint64_t>(dod), 7);
+        }
+        else if (fits(dod, 9)) {
+            c.put_bits(0x6, 3);
+            c.put_bits(static_cast<uint64_t>(dod), 9);
+        }
+        else if (fits(dod, 12)) {
+            c.put_bits(0xe, 4);
+            c.put_bits(static_cast<uint64_t>(dod), 12);
+        }
+        else {
+            c.put_bits(0xf, 4);
+            c.put_bits(static_cast<uint64_t>(dod), 64);
+        }
+        c._last_delta = delta;
+        auto x = bits ^ c._last_bits;
+        if (x == 0) {
+            c.put_bits(0, 1);
+        }
+        else {
+            unsigned leading = __builtin_clzll(x);
+            unsigned trailing = __builtin_ctzll(x);
+            if (c._leading < 64 && leading >= c._leading && trailing >= c._trailing) {
+                c.put_bits(0x2, 2);
+                c.put_bits(x >> c._trailing, 64 - c._leading - c._trailing);
+            }
+            else {
+                auto length = 64 - leading - trailing;
+                c.put_bits(0x3, 2);
+                c.put_bits(leading, 6);
+                c.put_bits(length - 1, 6);
+                c.put_bits(x >> trailing, length);
+                c._leading = leading;
+                c._trailing = trailing;
+            }
+        }
+    }
+    c._last_bits = bits;
+    c._last = ts;
+    ++c._count;
+}
+
+bool timeseries_lsa::append(uint64_t ts, double value)
+{
+    if (!_chunks.empty() && ts <= last_timestamp()) {
+        return false;
+    }
+    chunk* last = _chunks.empty() ? nullptr : &*_chunks.rbegin();
+    if (last == nullptr || last->_data.size() >= max_chunk_bytes) {
+        last = current_allocator().construct<chunk>(ts);
+        _chunks.insert(_chunks.end(), *last);
+    }
+    append_to(*last, ts, value);
+    ++_size;
+    if (_retention_ms > 0 && ts > _retention_ms) {
+        auto oldest = ts - _retention_ms;
+        while (_chunks.begin()->_last < oldest) {
+            auto& c = *_chunks.begin();
+            _size -= c._count;
+            _chunks.erase_and_dispose(_chunks.iterator_to(c), current_deleter<chunk>());
+        }
+    }
+    return true;
+}
+
+size_t timeseries_lsa::flush_some(size_t count)
+{
+    size_t flushed = 0;
+    while (!_chunks.empty() && flushed < count) {
+        auto& c = *_chunks.begin();
+        flushed += c._count;
+        _size -= std::min<size_t>(_size, c._count);
+        _chunks.erase_and_dispose(_chunks.iterator_to(c), current_deleter<chunk>());
+    }
+    if (_chunks.empty()) {
+        _size = 0;
+    }
+    return flushed;
+}
+
+size_t timeseries_lsa::memory_usage() const
+{
+    size_t n = 0;
+    for (auto& c : _chunks) {
+        n += current_allocator().object_memory_size_in_allocator(&c) + c._data.external_memory_usage();
+    }
+    return n;
+}
+}
@@ -0,0 +1,330 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#pragma once
+#include <boost/intrusive/set.hpp>
+#include "utils/allocation_strategy.hh"
+#include "utils/managed_bytes.hh"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+namespace redis {
+
+// How TS.RANGE folds the samples of a bucket into one.
+enum class ts_aggregation {
+    none,
+    avg,
+    sum,
+    min,
+    max,
+    count,
+    first,
+    last,
+    range,
+};
+
+// `avg`, `sum` and the others, in any case.
+bool parse_ts_aggregation(const char* data, size_t size, ts_aggregation& type);
+
+// Folds samples in timestamp order into the buckets of `bucket_ms`
+// milliseconds they fall in, aligned on the epoch, handing each to emit(start
+// of the bucket, value) once the next one begins, the last at finish().
+class ts_aggregator {
+    ts_aggregation _type;
+    uint64_t _bucket_ms;
+    bool _open = false;
+    uint64_t _start = 0;
+    uint64_t _count = 0;
+    double _sum = 0;
+    double _min = 0;
+    double _max = 0;
+    double _first = 0;
+    double _last = 0;
+
+    double result() const
+    {
+        switch (_type) {
+        case ts_aggregation::avg: return _sum / _count;
+        case ts_aggregation::sum: return _sum;
+        case ts_aggregation::min: return _min;
+        case ts_aggregation::max: return _max;
+        case ts_aggregation::count: return _count;
+        case ts_aggregation::first: return _first;
+        case ts_aggregation::range: return _max - _min;
+        default: return _last;
+        }
+    }
+public:
+    ts_aggregator(ts_aggregation type, uint64_t bucket_ms) : _type(type), _bucket_ms(std::max<uint64_t>(bucket_ms, 1)) {}
+
+    // Returns what emit() did, true when no bucket was closed.
+    template <typename Emit>
+    bool add(uint64_t ts, double value, Emit&& emit)
+    {
+        auto start = ts - ts % _bucket_ms;
+        bool more = true;
+        if (_open && start != _start) {
+            more = emit(_start, result());
+            _open = false;
+        }
+        if (!_open) {
+            _open = true;
+            _start = start;
+            _count = 0;
+            _sum = 0;
+            _min = _max = _first = value;
+        }
+        ++_count;
+        _sum += value;
+        _min = std::min(_min, value);
+        _max = std::max(_max, value);
+        _last = value;
+        return more;
+    }
+    template <typename Emit>
+    void finish(Emit&& emit)
+    {
+        if (_open) {
+            emit(_start, result());
+            _open = false;
+        }
+    }
+};
+
+// A time series: samples of a timestamp in milliseconds and a double, in
+// increasing timestamp order, compressed as Gorilla does in chunks of about
+// max_chunk_bytes, each an object of the region ordered by its first
+// timestamp. A timestamp is stored as the difference of its delta to the
+// previous one with the delta before, in a bucket of a few bits for the
+// regular intervals most series have:
+//
+//   0                        the same delta
+//   10   + 7 bits            in [-64, 63]
+//   110  + 9 bits            in [-256, 255]
+//   1110 + 12 bits           in [-2048, 2047]
+//   1111 + 64 bits           any other
+//
+// and a value as its XOR with the previous one:
+//
+//   0                        the same value
+//   10 + meaningful bits     within the leading and trailing zeroes of the
+//                            previous XOR
+//   11 + 6 bits leading zeroes, 6 bits length less one, meaningful bits
+//
+// The first value of a chunk takes its 64 bits, its first timestamp is
+// kept beside the bits. The bits are written to a 64 bit word of the
+// chunk, appended to its bytes once full, so that TS.ADD appends to the
+// last chunk as managed_bytes::append() does.
+//
+// Samples only append: a timestamp must be greater than the last. The
+// retention drops the whole chunks whose samples are all older than it
+// allows, and a range decodes only the chunks it overlaps.
+class timeseries_lsa {
+public:
+    static constexpr size_t max_chunk_bytes = 4096;
+private:
+    struct chunk {
+        boost::intrusive::set_member_hook<> _link;
+        uint64_t _first;
+        uint64_t _last;
+        uint32_t _count = 0;
+        // What the next sample is encoded against.
+        int64_t _last_delta = 0;
+        uint64_t _last_bits = 0;
+        uint8_t _leading = 64;
+        uint8_t _trailing = 0;
+        // The bits not yet in _data, the latest in its low bits.
+        uint8_t _pending_bits = 0;
+        uint64_t _pending = 0;
+        managed_bytes _data;
+
+        explicit chunk(uint64_t first) noexcept : _link(), _first(first), _last(first) {}
+        chunk(chunk&& o) noexcept
+            : _link()
+            , _first(o._first)
+            , _last(o._last)
+            , _count(o._count)
+            , _last_delta(o._last_delta)
+            , _last_bits(o._last_bits)
+            , _leading(o._leading)
+            , _trailing(o._trailing)
+            , _pending_bits(o._pending_bits)
+            , _pending(o._pending)
+            , _data(std::move(o._data))
+        {
+            _link.swap_nodes(o._link);
+        }
+        void put_bits(uint64_t value, unsigned n);
+        struct compare {
+            bool operator () (const chunk& l, const chunk& r) const { return l._first < r._first; }
+            bool operator () (uint64_t l, const chunk& r) const { return l < r._first; }
+            bool operator () (const chunk& l, uint64_t r) const { return l._first < r; }
+        };
+    };
+    using chunk_set_type = boost::intrusive::set<chunk,
+        boost::intrusive::member_hook<chunk, boost::intrusive::set_member_hook<>, &chunk::_link>,
+        boost::intrusive::compare<chunk::compare>,
+        boost::intrusive::constant_time_size<true>>;
+
+    // Reads the bits of a chunk, those of its bytes then those pending.
+    class bit_reader {
+        const char* _p;
+        const char* _end;
+        uint64_t _pending;
+        unsigned _pending_bits;
+        uint64_t _word = 0;
+        unsigned _avail = 0;
+    public:
+        bit_reader(const char* p, size_t size, uint64_t pending, unsigned pending_bits)
+            : _p(p), _end(p + size), _pending(pending), _pending_bits(pending_bits) {}
+        uint64_t get(unsigned n);
+        bool bit() { return get(1) != 0; }
+    };
+
+    chunk_set_type _chunks;
+    size_t _size = 0;
+    // 0 keeps the samples for good.
+    uint64_t _retention_ms = 0;
+
+    // Calls func(ts, value) for the samples of the chunk, in order, until it
+    // returns false. Returns false if it did.
+    template <typename Func>
+    static bool for_each_in_chunk(const chunk& c, Func&& func);
+    void append_to(chunk& c, uint64_t ts, double value);
+public:
+    timeseries_lsa() noexcept {}
+    timeseries_lsa(timeseries_lsa&& o) noexcept
+        : _chunks(std::move(o._chunks))
+        , _size(o._size)
+        , _retention_ms(o._retention_ms)
+    {
+        o._size = 0;
+    }
+    ~timeseries_lsa();
+
+    size_t size() const { return _size; }
+    size_t chunks() const { return _chunks.size(); }
+    bool empty() const { return _size == 0; }
+    uint64_t first_timestamp() const { return _chunks.empty() ? 0 : _chunks.begin()->_first; }
+    uint64_t last_timestamp() const { return _chunks.empty() ? 0 : _chunks.rbegin()->_last; }
+    uint64_t retention() const { return _retention_ms; }
+    void set_retention(uint64_t ms) { _retention_ms = ms; }
+
+    // Appends the sample, false if its timestamp is not greater than the
+    // last one. Then drops the chunks past the retention.
+    bool append(uint64_t ts, double value);
+    // Calls func(ts, value) for the samples in [from, to], in order, until
+    // it returns false.
+    template <typename Func>
+    void range(uint64_t from, uint64_t to, Func&& func) const;
+    // Destroys whole chunks from the first until at least `count` samples
+    // are gone, returns how many were. The series is only fit to be
+    // flushed or destroyed afterwards.
+    size_t flush_some(size_t count);
+
+    // Bytes the chunks take in the current allocator.
+    size_t memory_usage() const;
+};
+
+template <typename Func>
+bool timeseries_lsa::for_each_in_chunk(const chunk& c, Func&& func)
+{
+    return with_linearized_managed_bytes([&c, &func] {
+        bit_reader in(c._data.begin(), c._data.size(), c._pending, c._pending_bits);
+        uint64_t ts = c._first;
+        int64_t delta = 0;
+        uint64_t bits = in.get(64);
+        unsigned leading = 0, trailing = 0;
+        for (uint32_t n = 0; n < c._count; ++n) {
+            if (n > 0) {
+                int64_t dod = 0;
+                unsigned width = 0;
+                if (!in.bit()) {
+                    width = 0;
+                }
+                else if (!in.bit()) {
+                    width = 7;
+                }
+                else if (!in.bit()) {
+                    width = 9;
+                }
+                else if (!in.bit()) {
+                    width = 12;
+                }
+                else {
+                    width = 64;
+                }
+                if (width == 64) {
+                    dod = static_cast<int64_t>(in.get(64));
+                }
+                else if (width > 0) {
+                    // sign extended from its width.
+                    auto v = in.get(width);
+                    dod = static_cast<int64_t>(v << (64 - width)) >> (64 - width);
+                }
+                delta += dod;
+                ts += delta;
+                if (in.bit()) {
+                    if (in.bit()) {
+                        leading = in.get(6);
+                        auto length = in.get(6) + 1;
+                        trailing = 64 - leading - length;
+                    }
+                    bits ^= in.get(64 - leading - trailing) << trailing;
+                }
+            }
+            double value;
+            std::memcpy(&value, &bits, sizeof(value));
+            if (!func(ts, value)) {
+                return false;
+            }
+        }
+        return true;
+    });
+}
+
+template <typename Func>
+void timeseries_lsa::range(uint64_t from, uint64_t to, Func&& func) const
+{
+    if (from > to || _chunks.empty()) {
+        return;
+    }
+    // the chunk holding `from` is the last one starting at or before it.
+    auto i = _chunks.upper_bound(from, chunk::compare());
+    if (i != _chunks.begin()) {
+        --i;
+    }
+    for (; i != _chunks.end() && i->_first <= to; ++i) {
+        if (i->_last < from) {
+            continue;
+        }
+        bool more = for_each_in_chunk(*i, [&] (uint64_t ts, double value) {
+            if (ts < from) {
+                return true;
+            }
+            return ts <= to && func(ts, value);
+        });
+        if (!more) {
+            return;
+        }
+    }
+}
+}
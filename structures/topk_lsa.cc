@@ -0,0 +1,160 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#include "structures/topk_lsa.hh"
+#include "utils/murmur_hash.hh"
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <limits>
+namespace redis {
+
+constexpr uint32_t topk_lsa::default_width;
+constexpr uint32_t topk_lsa::default_depth;
+constexpr double topk_lsa::default_decay;
+constexpr size_t topk_lsa::buckets_per_page;
+constexpr uint64_t topk_lsa::max_buckets;
+
+topk_lsa::~topk_lsa()
+{
+    _by_count.clear();
+    _by_fingerprint.clear_and_dispose(current_deleter<item>());
+}
+
+topk_lsa::hashed topk_lsa::hash_of(bytes_view name)
+{
+    std::array<uint64_t, 2> h;
+    utils::murmur_hash::hash3_x64_128(name, 0, h);
+    return hashed { static_cast<uint32_t>(h[0] >> 32), h[1], (h[0] << 32 | h[0] >> 32) | 1 };
+}
+
+topk_lsa::item* topk_lsa::find(const hashed& h, bytes_view name) const
+{
+    auto range = _by_fingerprint.equal_range(h._fingerprint, item::fingerprint_compare());
+    for (auto i = range.first; i != range.second; ++i) {
+        if (i->equals(name)) {
+            return const_cast<item*>(&*i);
+        }
+    }
+    return nullptr;
+}
+
+uint32_t topk_lsa::random32()
+{
+    _random ^= _random << 13;
+    _random ^= _random >> 7;
+    _random ^= _random << 17;
+    return static_cast<uint32_t>(_random >> 32);
+}
+
+uint32_t topk_lsa::count_in(uint32_t row, const hashed& h, uint32_t increment)
+{
+    auto index = uint64_t(row) * _width + (h._h1 + row * h._h2) % _width;
+    auto p = _buckets.get(index / buckets_per_page) + (index % buckets_per_page) * sizeof(bucket);
+    bucket b;
+    std::memcpy(&b, p, sizeof(b));
+    if (b._count == 0 || b._fingerprint == h._fingerprint) {
+        b._fingerprint = h._fingerprint;
+        auto max = std::numeric_limits<uint32_t>::max();
+        b._count = b._count > max - increment ? max : b._count + increment;
+    }
+    else {
+        // each of the increments decays the bucket with the probability
+        // decay^count, which is 0 to 32 bits once the count is large.
+        for (; increment > 0; --increment) {
+            auto chance = std::pow(_decay, b._count) * 4294967296.0;
+            if (chance < 1) {
+                break;
+            }
+            if (random32() < chance && --b._count == 0) {
+                b._fingerprint = h._fingerprint;
+                b._count = increment;
+                break;
+            }
+        }
+    }
+    std::memcpy(p, &b, sizeof(b));
+    return b._fingerprint == h._fingerprint ? b._count : 0;
+}
+
+void topk_lsa::insert_item(uint32_t fingerprint, uint32_t count, bytes_view name)
+{
+    auto i = current_allocator().construct<item>(fingerprint, count, name);
+    _by_fingerprint.insert(*i);
+    _by_count.insert(*i);
+}
+
+void topk_lsa::set_count(item& i, uint32_t count)
+{
+    _by_count.erase(_by_count.iterator_to(i));
+    i._count = count;
+    _by_count.insert(i);
+}
+
+bool topk_lsa::add(bytes_view name, uint32_t increment, bytes& expelled)
+{
+    auto h = hash_of(name);
+    uint32_t estimate = 0;
+    for (uint32_t row = 0; row < _depth; ++row) {
+        estimate = std::max(estimate, count_in(row, h, increment));
+    }
+    bool full = _by_fingerprint.size() >= _k;
+    uint32_t least = full ? _by_count.begin()->_count : 0;
+    if (estimate < least || estimate == 0) {
+        return false;
+    }
+    if (auto i = find(h, name)) {
+        set_count(*i, std::max(i->_count, estimate));
+        return false;
+    }
+    if (!full) {
+        insert_item(h._fingerprint, estimate, name);
+        return false;
+    }
+    if (estimate == least) {
+        return false;
+    }
+    auto& min = *_by_count.begin();
+    expelled = bytes { min._name.data(), min._name.size() };
+    _by_count.erase(_by_count.iterator_to(min));
+    _by_fingerprint.erase_and_dispose(_by_fingerprint.iterator_to(min), current_deleter<item>());
+    insert_item(h._fingerprint, estimate, name);
+    return true;
+}
+
+bool topk_lsa::contains(bytes_view name) const
+{
+    return find(hash_of(name), name) != nullptr;
+}
+
+void topk_lsa::restore_item(bytes_view name, uint32_t count)
+{
+    insert_item(hash_of(name)._fingerprint, count, name);
+}
+
+size_t topk_lsa::memory_usage() const
+{
+    size_t n = _buckets.memory_usage();
+    for (auto& i : _by_fingerprint) {
+        n += current_allocator().object_memory_size_in_allocator(&i) + i._name.external_memory_usage();
+    }
+    return n;
+}
+}
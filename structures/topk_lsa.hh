@@ -0,0 +1,165 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#pragma once
+#include <boost/intrusive/set.hpp>
+#include "structures/page_set.hh"
+#include "utils/bytes.hh"
+#include <cstdint>
+#include <cstring>
+namespace redis {
+
+// The heavy hitters of a stream of items, as HeavyKeeper finds them, after
+// the Top-K of RedisBloom: `depth` rows of `width` buckets, each the
+// fingerprint of an item and its count, and the `k` items of the largest
+// counts.
+//
+// An item counts in one bucket of each row chosen by its hash. A bucket of
+// another fingerprint decays instead, by one with the probability decay^count,
+// and is taken over by the item once it reaches zero, so that the buckets
+// keep the large counts and let the small ones go. The largest count the
+// item has in its rows is its estimate, which enters the top k once it is
+// larger than the least of them, expelling that item.
+//
+// The buckets are in pages of the region, see lsa_page_set, and the top
+// items are objects of the region indexed by their fingerprint and ordered
+// by their count, so that a sketch takes a few kilobytes however many items
+// it sees.
+class topk_lsa {
+public:
+    static constexpr uint32_t default_width = 8;
+    static constexpr uint32_t default_depth = 7;
+    static constexpr double default_decay = 0.9;
+    struct bucket {
+        uint32_t _fingerprint;
+        uint32_t _count;
+    };
+    static constexpr size_t buckets_per_page = lsa_page_set::page_size / sizeof(bucket);
+    static constexpr uint64_t max_buckets = uint64_t(1) << 32;
+private:
+    struct item {
+        boost::intrusive::set_member_hook<> _by_fingerprint;
+        boost::intrusive::set_member_hook<> _by_count;
+        uint32_t _fingerprint;
+        uint32_t _count;
+        managed_bytes _name;
+
+        item(uint32_t fingerprint, uint32_t count, bytes_view name) noexcept
+            : _by_fingerprint(), _by_count(), _fingerprint(fingerprint), _count(count), _name(name) {}
+        item(item&& o) noexcept
+            : _by_fingerprint()
+            , _by_count()
+            , _fingerprint(o._fingerprint)
+            , _count(o._count)
+            , _name(std::move(o._name))
+        {
+            _by_fingerprint.swap_nodes(o._by_fingerprint);
+            _by_count.swap_nodes(o._by_count);
+        }
+        bool equals(bytes_view name) const
+        {
+            return _name.size() == name.size() && std::memcmp(_name.data(), name.data(), name.size()) == 0;
+        }
+        struct fingerprint_compare {
+            bool operator () (const item& l, const item& r) const { return l._fingerprint < r._fingerprint; }
+            bool operator () (uint32_t l, const item& r) const { return l < r._fingerprint; }
+            bool operator () (const item& l, uint32_t r) const { return l._fingerprint < r; }
+        };
+        struct count_compare {
+            bool operator () (const item& l, const item& r) const { return l._count < r._count; }
+        };
+    };
+    using fingerprint_set_type = boost::intrusive::multiset<item,
+        boost::intrusive::member_hook<item, boost::intrusive::set_member_hook<>, &item::_by_fingerprint>,
+        boost::intrusive::compare<item::fingerprint_compare>,
+        boost::intrusive::constant_time_size<true>>;
+    using count_set_type = boost::intrusive::multiset<item,
+        boost::intrusive::member_hook<item, boost::intrusive::set_member_hook<>, &item::_by_count>,
+        boost::intrusive::compare<item::count_compare>,
+        boost::intrusive::constant_time_size<false>>;
+
+    lsa_page_set _buckets;
+    fingerprint_set_type _by_fingerprint;
+    count_set_type _by_count;
+    uint32_t _k;
+    uint32_t _width;
+    uint32_t _depth;
+    double _decay;
+    // xorshift64 state of the decays.
+    uint64_t _random = 0x9e3779b97f4a7c15ull;
+
+    struct hashed {
+        uint32_t _fingerprint;
+        uint64_t _h1;
+        uint64_t _h2;
+    };
+    static hashed hash_of(bytes_view name);
+    item* find(const hashed& h, bytes_view name) const;
+    uint32_t random32();
+    // Counts the item in its bucket of the row, returns the count of the
+    // bucket if it is the item's, else 0.
+    uint32_t count_in(uint32_t row, const hashed& h, uint32_t increment);
+    void insert_item(uint32_t fingerprint, uint32_t count, bytes_view name);
+    void set_count(item& i, uint32_t count);
+public:
+    topk_lsa(uint32_t k, uint32_t width, uint32_t depth, double decay) noexcept
+        : _k(k), _width(width), _depth(depth), _decay(decay) {}
+    topk_lsa(topk_lsa&& o) noexcept
+        : _buckets(std::move(o._buckets))
+        , _by_fingerprint(std::move(o._by_fingerprint))
+        , _by_count(std::move(o._by_count))
+        , _k(o._k)
+        , _width(o._width)
+        , _depth(o._depth)
+        , _decay(o._decay)
+        , _random(o._random)
+    {
+    }
+    ~topk_lsa();
+
+    // Counts the item `increment` more times. Returns true if it entered the
+    // top k in place of another, whose name is then in `expelled`.
+    bool add(bytes_view name, uint32_t increment, bytes& expelled);
+    // Whether the item is among the top k.
+    bool contains(bytes_view name) const;
+    // Calls func(bytes_view name, uint32_t count) for the top items, the
+    // largest count first.
+    template <typename Func>
+    void list(Func&& func) const
+    {
+        for (auto i = _by_count.rbegin(); i != _by_count.rend(); ++i) {
+            func(bytes_view { i->_name.data(), i->_name.size() }, i->_count);
+        }
+    }
+    // Puts back a top item, as a snapshot is loaded, its buckets being set
+    // through buckets().
+    void restore_item(bytes_view name, uint32_t count);
+
+    uint32_t k() const { return _k; }
+    uint32_t width() const { return _width; }
+    uint32_t depth() const { return _depth; }
+    double decay() const { return _decay; }
+    size_t size() const { return _by_fingerprint.size(); }
+    const lsa_page_set& buckets() const { return _buckets; }
+    lsa_page_set& buckets() { return _buckets; }
+    // Bytes the buckets and the items take in the current allocator.
+    size_t memory_usage() const;
+};
+}
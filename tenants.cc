@@ -0,0 +1,72 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#include "tenants.hh"
+#include "core/reactor.hh"
+namespace redis {
+
+constexpr size_t tenant_table::max_tenants;
+
+// The share of a shard of a limit of all shards.
+static std::unique_ptr<utils::rate_limiter> make_limiter(uint64_t per_sec)
+{
+    if (per_sec == 0) {
+        return nullptr;
+    }
+    return std::make_unique<utils::rate_limiter>(std::max<uint64_t>(per_sec / smp::count, 1));
+}
+
+tenant_table::tenant& tenant_table::get(const bytes& name)
+{
+    auto i = _tenants.find(name);
+    if (i != _tenants.end()) {
+        return i->second;
+    }
+    if (_tenants.size() >= max_tenants && !name.empty()) {
+        return get(bytes {});
+    }
+    auto j = _limits.find(name);
+    auto& limits = j != _limits.end() ? j->second : _defaults;
+    auto& t = _tenants[name];
+    t._requests = make_limiter(limits._requests_per_sec);
+    t._bytes = make_limiter(limits._bytes_per_sec);
+    return t;
+}
+
+future<> tenant_table::admit(tenant& t, size_t size)
+{
+    auto requests = t._requests ? t._requests->reserve(1) : make_ready_future<>();
+    if (t._bytes) {
+        t._stats._bytes += size;
+        if (requests.available()) {
+            requests = t._bytes->reserve(size);
+        }
+        else {
+            requests = requests.then([&t, size] {
+                return t._bytes->reserve(size);
+            });
+        }
+    }
+    if (!requests.available()) {
+        ++t._stats._throttled;
+    }
+    return requests;
+}
+}
@@ -0,0 +1,91 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#pragma once
+#include <memory>
+#include <unordered_map>
+#include "core/future.hh"
+#include "utils/bytes.hh"
+#include "utils/rate_limiter.hh"
+namespace redis {
+using namespace seastar;
+
+// The requests and bytes of requests per second a tenant may send to all
+// shards, 0 for no limit.
+struct tenant_limits {
+    uint64_t _requests_per_sec = 0;
+    uint64_t _bytes_per_sec = 0;
+};
+
+struct tenant_stats {
+    uint64_t _calls = 0;
+    // Time in the commands, from their dispatch to their reply, as
+    // commandstats counts it.
+    uint64_t _usec = 0;
+    // Bytes of the requests of a tenant with a bytes limit.
+    uint64_t _bytes = 0;
+    // Commands which waited for the limits of the tenant.
+    uint64_t _throttled = 0;
+
+    tenant_stats& operator += (const tenant_stats& o)
+    {
+        _calls += o._calls;
+        _usec += o._usec;
+        _bytes += o._bytes;
+        _throttled += o._throttled;
+        return *this;
+    }
+};
+
+// The tenants of the connections of a shard: the clients of the same user
+// of HELLO AUTH, or else of the same name, those without either being the
+// tenant "". Each shard enforces an even share of the limits of a tenant on
+// its connections, with no word to the others, and INFO tenants sums the
+// stats of all shards.
+class tenant_table {
+public:
+    // Past this many, the names of a shard go to the tenant "".
+    static constexpr size_t max_tenants = 1024;
+    struct tenant {
+        tenant_stats _stats;
+        // Null without a limit.
+        std::unique_ptr<utils::rate_limiter> _requests;
+        std::unique_ptr<utils::rate_limiter> _bytes;
+
+        bool limited() const { return _requests || _bytes; }
+    };
+private:
+    tenant_limits _defaults;
+    std::unordered_map<bytes, tenant_limits> _limits;
+    // Never erased: the connections keep pointers to their tenant.
+    std::unordered_map<bytes, tenant> _tenants;
+public:
+    // The limits of the named tenants, and of the others.
+    void configure(tenant_limits defaults, std::unordered_map<bytes, tenant_limits> limits)
+    {
+        _defaults = defaults;
+        _limits = std::move(limits);
+    }
+    tenant& get(const bytes& name);
+    // Resolves once the tenant may run a request of `size` bytes.
+    future<> admit(tenant& t, size_t size);
+    const std::unordered_map<bytes, tenant>& tenants() const { return _tenants; }
+};
+}
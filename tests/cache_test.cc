@@ -2,6 +2,11 @@
 #include "cache.hh"
 
 #include "util/log.hh"
+#include "core/sleep.hh"
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <vector>
 using logger =  seastar::logger;
 static logger tlog ("test");
 
@@ -48,6 +53,199 @@ public:
         BOOST_CHECK(_c.empty());
         return make_ready_future<>();
     }
+    // The entries present when the snapshot began are saved once each,
+    // before they change or go away or when the walk reaches them, and the
+    // entries inserted since are not.
+    future<> snapshot() {
+        auto make = [this] (const char* key) {
+            sstring k { key };
+            redis_key rk { std::ref(k) };
+            bytes v { "value" };
+            _c.insert(current_allocator().construct<cache_entry>(rk.key(), rk.hash(), v));
+        };
+        std::vector<sstring> saved;
+        with_allocator(allocator(), [this, &make, &saved] {
+            make("a");
+            make("b");
+            make("c");
+            _c.begin_snapshot([&saved] (const cache_entry& e) {
+                saved.emplace_back(e.key_data(), e.key_size());
+            });
+            sstring a {"a"}, b {"b"};
+            redis_key ra { std::ref(a) }, rb { std::ref(b) };
+            BOOST_REQUIRE(_c.find(ra) != nullptr);
+            BOOST_CHECK(saved.size() == 1);
+            BOOST_REQUIRE(_c.find(ra) != nullptr);
+            BOOST_CHECK(_c.erase(rb));
+            BOOST_CHECK(saved.size() == 2);
+            make("d");
+            size_t cursor = 0;
+            do {
+                cursor = _c.scan(cursor, [this] (const cache_entry& e) {
+                    _c.save_for_snapshot(e);
+                });
+            } while (cursor != 0);
+            _c.end_snapshot();
+        });
+        std::sort(saved.begin(), saved.end());
+        BOOST_CHECK(saved == (std::vector<sstring> { "a", "b", "c" }));
+        return make_ready_future<>();
+    }
+    // Only the entries which expire have an expiry record, which goes with
+    // PERSIST and with the entry.
+    future<> expiry() {
+        auto make = [this] (const char* key, long ttl) {
+            sstring k { key };
+            redis_key rk { std::ref(k) };
+            bytes v { "value" };
+            _c.insert_if(current_allocator().construct<cache_entry>(rk.key(), rk.hash(), v), ttl, false, false);
+        };
+        with_allocator(allocator(), [this, &make] {
+            make("a", 10000);
+            make("b", 0);
+            sstring a {"a"}, b {"b"};
+            redis_key ra { std::ref(a) }, rb { std::ref(b) };
+            BOOST_CHECK(_c.expiring_size() == 1);
+            _c.run_with_entry(ra, [] (const cache_entry* e) {
+                BOOST_REQUIRE(e != nullptr);
+                BOOST_CHECK(e->ever_expires());
+                BOOST_CHECK(e->time_of_live() <= 10000);
+            });
+            _c.run_with_entry(rb, [] (const cache_entry* e) {
+                BOOST_REQUIRE(e != nullptr);
+                BOOST_CHECK(!e->ever_expires());
+            });
+            BOOST_CHECK(_c.never_expired(ra));
+            BOOST_CHECK(!_c.never_expired(rb));
+            BOOST_CHECK(_c.expiring_size() == 0);
+            BOOST_CHECK(_c.expire(rb, 5000));
+            BOOST_CHECK(_c.expiring_size() == 1);
+            BOOST_CHECK(_c.erase(rb));
+            BOOST_CHECK(_c.expiring_size() == 0);
+            BOOST_CHECK(_c.erase(ra));
+        });
+        return make_ready_future<>();
+    }
+    // A watched entry is reported as it changes and goes away, a new entry
+    // while watching, until the notifier no longer watches its key.
+    future<> watch() {
+        auto make = [this] (const char* key) {
+            sstring k { key };
+            redis_key rk { std::ref(k) };
+            bytes v { "value" };
+            _c.insert(current_allocator().construct<cache_entry>(rk.key(), rk.hash(), v));
+        };
+        std::vector<sstring> notified;
+        bool watched = true;
+        _c.set_watch_notifier([&notified, &watched] (const cache_entry& e) {
+            notified.emplace_back(e.key_data(), e.key_size());
+            return watched;
+        });
+        with_allocator(allocator(), [this, &make, &notified, &watched] {
+            make("a");
+            sstring a {"a"}, b {"b"};
+            redis_key ra { std::ref(a) }, rb { std::ref(b) };
+            BOOST_REQUIRE(_c.find(ra) != nullptr);
+            BOOST_CHECK(notified.empty());
+            _c.watch(ra);
+            BOOST_REQUIRE(_c.find(ra) != nullptr);
+            BOOST_CHECK(_c.erase(ra));
+            BOOST_CHECK(notified == (std::vector<sstring> { "a", "a" }));
+            _c.set_watching(true);
+            make("b");
+            _c.set_watching(false);
+            watched = false;
+            BOOST_REQUIRE(_c.find(rb) != nullptr);
+            BOOST_REQUIRE(_c.find(rb) != nullptr);
+            BOOST_CHECK(notified == (std::vector<sstring> { "a", "a", "b", "b" }));
+        });
+        return make_ready_future<>();
+    }
+    // A tracked entry is reported once, as it next changes, a new entry
+    // while tracking, and every change while tracking all.
+    future<> tracking() {
+        auto make = [this] (const char* key) {
+            sstring k { key };
+            redis_key rk { std::ref(k) };
+            bytes v { "value" };
+            _c.insert(current_allocator().construct<cache_entry>(rk.key(), rk.hash(), v));
+        };
+        std::vector<sstring> notified;
+        _c.set_tracking_notifier([&notified] (const cache_entry& e) {
+            notified.emplace_back(e.key_data(), e.key_size());
+        });
+        with_allocator(allocator(), [this, &make, &notified] {
+            make("a");
+            sstring a {"a"}, b {"b"};
+            redis_key ra { std::ref(a) }, rb { std::ref(b) };
+            _c.track(ra);
+            BOOST_REQUIRE(_c.find(ra) != nullptr);
+            BOOST_REQUIRE(_c.find(ra) != nullptr);
+            BOOST_CHECK(notified == (std::vector<sstring> { "a" }));
+            _c.set_tracking(true, false);
+            make("b");
+            BOOST_CHECK(notified == (std::vector<sstring> { "a", "b" }));
+            _c.set_tracking(true, true);
+            BOOST_REQUIRE(_c.find(rb) != nullptr);
+            BOOST_CHECK(_c.erase(ra));
+            BOOST_CHECK(notified == (std::vector<sstring> { "a", "b", "b", "a" }));
+            _c.set_tracking(false, false);
+            BOOST_CHECK(_c.erase(rb));
+            BOOST_CHECK(notified.size() == 4);
+        });
+        return make_ready_future<>();
+    }
+    // A large stream deleted is freed in the background, a block at a
+    // time, rather than hanging the release of the lazily freed entries.
+    future<> lazy_free_stream() {
+        _c.set_allocator(allocator());
+        sstring k { "events" };
+        redis_key rk { std::ref(k) };
+        with_allocator(allocator(), [this, &rk] {
+            auto e = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), cache_entry::stream_initializer());
+            auto& s = e->value_stream();
+            for (size_t i = 0; i < 1000; ++i) {
+                stream_id id;
+                BOOST_REQUIRE(s.next_id(1000, nullptr, id));
+                s.append(id, std::vector<bytes> { "field", "value" }, 0);
+            }
+            _c.insert(e);
+            auto found = _c.find(rk);
+            BOOST_REQUIRE(found != nullptr);
+            BOOST_CHECK(found->value_elements() == 1000);
+            BOOST_CHECK(_c.erase_lazily(*found));
+        });
+        BOOST_CHECK(_c.size() == 0);
+        BOOST_CHECK(_c.lazy_free_entries() == 1);
+        return do_until([this] { return _c.lazy_free_entries() == 0; }, [] {
+            return sleep(std::chrono::milliseconds(1));
+        });
+    }
+    // Every key is drawn now and then, and none from an empty cache.
+    future<> random() {
+        auto make = [this] (const char* key) {
+            sstring k { key };
+            redis_key rk { std::ref(k) };
+            bytes v { "value" };
+            _c.insert(current_allocator().construct<cache_entry>(rk.key(), rk.hash(), v));
+        };
+        with_allocator(allocator(), [this, &make] {
+            BOOST_CHECK(_c.random_entry() == nullptr);
+            make("a");
+            make("b");
+            make("c");
+            std::vector<sstring> drawn;
+            for (int i = 0; i < 1000; ++i) {
+                auto e = _c.random_entry();
+                BOOST_REQUIRE(e != nullptr);
+                drawn.emplace_back(e->key_data(), e->key_size());
+            }
+            std::sort(drawn.begin(), drawn.end());
+            drawn.erase(std::unique(drawn.begin(), drawn.end()), drawn.end());
+            BOOST_CHECK(drawn == (std::vector<sstring> { "a", "b", "c" }));
+        });
+        return make_ready_future<>();
+    }
 protected:
     cache _c;
 };
@@ -55,3 +253,270 @@ SEASTAR_TEST_CASE(cache_insert) {
     cache_holder h;
     return h.insert();
 }
+
+SEASTAR_TEST_CASE(cache_snapshot) {
+    cache_holder h;
+    return h.snapshot();
+}
+
+SEASTAR_TEST_CASE(cache_expiry) {
+    cache_holder h;
+    return h.expiry();
+}
+
+SEASTAR_TEST_CASE(cache_watch) {
+    cache_holder h;
+    return h.watch();
+}
+
+SEASTAR_TEST_CASE(cache_tracking) {
+    cache_holder h;
+    return h.tracking();
+}
+
+SEASTAR_TEST_CASE(cache_lazy_free_stream) {
+    auto h = make_lw_shared<cache_holder>();
+    return h->lazy_free_stream().finally([h] {});
+}
+
+SEASTAR_TEST_CASE(cache_random_entry) {
+    cache_holder h;
+    return h.random();
+}
+
+namespace redis {
+// Where the fields of cache_entry are, see the layout comment there.
+struct cache_entry_layout {
+    static size_t offset(const cache_entry& e, const void* field) {
+        return static_cast<const char*>(field) - reinterpret_cast<const char*>(&e);
+    }
+    static void check(const cache_entry& e) {
+        static constexpr size_t line = 64;
+        BOOST_CHECK(offset(e, &e._key_hash) + sizeof(e._key_hash) <= line);
+        BOOST_CHECK(offset(e, &e._type) + sizeof(e._type) <= line);
+        BOOST_CHECK(offset(e, &e._encoding) + sizeof(e._encoding) <= line);
+        BOOST_CHECK(offset(e, &e._inline_key) + sizeof(e._inline_key) <= line);
+        BOOST_CHECK(offset(e, &e._expires) + sizeof(e._expires) <= line);
+        BOOST_CHECK(offset(e, &e._key) + sizeof(e._key) <= line);
+        // the pointer of the value, or the first bytes of an inline one.
+        BOOST_CHECK(offset(e, &e._u) + sizeof(void*) <= line);
+        BOOST_CHECK(offset(e, &e._dirty_link) >= line);
+        BOOST_CHECK(offset(e, &e._lru_link) >= line);
+    }
+};
+}
+
+SEASTAR_TEST_CASE(cache_entry_hot_fields) {
+    // the expiry is out of the entry, see expiry_index.
+    BOOST_CHECK(sizeof(cache_entry) <= 136);
+    logalloc::region r;
+    with_allocator(r.allocator(), [] {
+        sstring key {"redis"}, val {"test"};
+        redis_key rk { std::ref(key) };
+        auto e = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), val);
+        cache_entry_layout::check(*e);
+        current_allocator().destroy<cache_entry>(e);
+    });
+    return make_ready_future<>();
+}
+
+SEASTAR_TEST_CASE(cache_entry_encodings) {
+    logalloc::region r;
+    with_allocator(r.allocator(), [] {
+        auto make = [] (const char* key, const char* val) {
+            sstring k { key };
+            redis_key rk { std::ref(k) };
+            bytes v { val };
+            return current_allocator().construct<cache_entry>(rk.key(), rk.hash(), v);
+        };
+        auto check_value = [] (const cache_entry* e, const char* val) {
+            BOOST_CHECK(e->value_bytes_size() == strlen(val));
+            BOOST_CHECK(memcmp(e->value_bytes_data(), val, strlen(val)) == 0);
+        };
+        auto integer = make("counter", "-9223372036854775808");
+        BOOST_CHECK(integer->integer_value());
+        BOOST_CHECK(integer->string_integer() == std::numeric_limits<int64_t>::min());
+        check_value(integer, "-9223372036854775808");
+        integer->assign_integer(42);
+        check_value(integer, "42");
+        for (auto val : { "01", "-0", "+1", " 1", "9223372036854775808", "" }) {
+            auto e = make("string", val);
+            BOOST_CHECK(!e->integer_value());
+            BOOST_CHECK(e->inline_value());
+            check_value(e, val);
+            current_allocator().destroy<cache_entry>(e);
+        }
+        auto long_value = make("a key longer than twenty three bytes", "a value longer than thirty one bytes");
+        BOOST_CHECK(!long_value->inline_value());
+        BOOST_CHECK(long_value->key_size() == 36);
+        check_value(long_value, "a value longer than thirty one bytes");
+        long_value->unshare_value();
+        integer->unshare_value();
+        check_value(integer, "42");
+        current_allocator().destroy<cache_entry>(integer);
+        current_allocator().destroy<cache_entry>(long_value);
+    });
+    return make_ready_future<>();
+}
+
+// APPEND grows a value in place past the inline size and the first
+// fragment, SETRANGE writes within it and pads it with zeroes.
+SEASTAR_TEST_CASE(cache_entry_append) {
+    logalloc::region r;
+    with_allocator(r.allocator(), [] {
+        sstring k { "log" };
+        redis_key rk { std::ref(k) };
+        bytes v { "1" };
+        auto e = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), v);
+        std::string expected = "1";
+        auto value = [e] {
+            std::string s;
+            e->for_each_value_fragment([&s] (bytes_view f) {
+                s.append(f.data(), f.size());
+            });
+            return s;
+        };
+        for (int i = 0; i < 20000; ++i) {
+            auto piece = to_sstring(i) + ",";
+            e->append_value(bytes_view { piece.data(), piece.size() });
+            expected.append(piece.data(), piece.size());
+        }
+        BOOST_CHECK(e->value_bytes_size() == expected.size());
+        BOOST_CHECK(value() == expected);
+        e->write_value(3, bytes_view { "xyz", 3 });
+        expected.replace(3, 3, "xyz");
+        e->write_value(expected.size() + 2, bytes_view { "end", 3 });
+        expected.append(std::string(2, '\0')).append("end");
+        BOOST_CHECK(value() == expected);
+        current_allocator().destroy<cache_entry>(e);
+    });
+    return make_ready_future<>();
+}
+
+// A repetitive value is held compressed and reads back whole, one which
+// does not shrink is held as it is, and writes decompress it first.
+SEASTAR_TEST_CASE(cache_entry_compressed) {
+    logalloc::region r;
+    with_allocator(r.allocator(), [] {
+        sstring k { "blob" };
+        redis_key rk { std::ref(k) };
+        std::string expected;
+        for (int i = 0; i < 1000; ++i) {
+            expected.append("value-").append(std::to_string(i % 10));
+        }
+        auto value = [] (const cache_entry* e) {
+            std::string s;
+            e->for_each_value_fragment([&s] (bytes_view f) {
+                s.append(f.data(), f.size());
+            });
+            return s;
+        };
+        auto raw = cache_entry::value_compression_stats()._raw_bytes;
+        auto e = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), cache_entry::compressed_initializer { bytes_view { expected.data(), expected.size() } });
+        BOOST_CHECK(e->compressed_value());
+        BOOST_CHECK(e->value_bytes_size() == expected.size());
+        BOOST_CHECK(value(e) == expected);
+        BOOST_CHECK(cache_entry::value_compression_stats()._raw_bytes == raw + expected.size());
+        e->append_value(bytes_view { "end", 3 });
+        expected.append("end");
+        BOOST_CHECK(!e->compressed_value());
+        BOOST_CHECK(value(e) == expected);
+        BOOST_CHECK(cache_entry::value_compression_stats()._raw_bytes == raw);
+        current_allocator().destroy<cache_entry>(e);
+        std::string noise;
+        for (int i = 0; i < 256; ++i) {
+            noise.push_back(static_cast<char>((i * 167 + 13) ^ (i >> 3)));
+        }
+        e = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), cache_entry::compressed_initializer { bytes_view { noise.data(), noise.size() } });
+        BOOST_CHECK(!e->compressed_value());
+        BOOST_CHECK(value(e) == noise);
+        current_allocator().destroy<cache_entry>(e);
+    });
+    return make_ready_future<>();
+}
+
+// Entries fill blocks in ID order, read back in both directions, and trim
+// and delete as XTRIM and XDEL do.
+SEASTAR_TEST_CASE(stream_blocks) {
+    logalloc::region r;
+    with_allocator(r.allocator(), [] {
+        sstring k { "events" };
+        redis_key rk { std::ref(k) };
+        auto e = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), cache_entry::stream_initializer());
+        auto& s = e->value_stream();
+        auto number = [] (size_t n) {
+            auto digits = to_sstring(n);
+            return bytes { digits.data(), digits.size() };
+        };
+        const size_t entries = 1000;
+        for (size_t i = 0; i < entries; ++i) {
+            stream_id id;
+            BOOST_REQUIRE(s.next_id(1000, nullptr, id));
+            // every tenth entry with fields of its own.
+            std::vector<bytes> args { "name", number(i), "value", number(i * 2) };
+            if (i % 10 == 0) {
+                args.push_back("extra");
+                args.push_back("x");
+            }
+            s.append(id, args, 0);
+        }
+        BOOST_CHECK(s.size() == entries);
+        BOOST_CHECK(s.last_id() == (stream_id { 1000, entries - 1 }));
+        BOOST_CHECK(s.blocks() >= entries / stream_lsa::max_block_entries);
+        std::vector<uint64_t> seqs;
+        s.range(stream_id { 1000, 250 }, stream_id { 1000, 260 }, false, [&seqs, &number] (const stream_entry_view& entry) {
+            auto doubled = number(entry._id._seq * 2);
+            BOOST_CHECK(entry._fields[0].first == bytes_view("name", 4));
+            BOOST_CHECK(entry._fields[1].second == bytes_view(doubled.data(), doubled.size()));
+            BOOST_CHECK(entry._fields.size() == (entry._id._seq % 10 == 0 ? 3u : 2u));
+            seqs.push_back(entry._id._seq);
+            return true;
+        });
+        BOOST_CHECK(seqs.size() == 11 && seqs.front() == 250 && seqs.back() == 260);
+        seqs.clear();
+        s.range(stream_id::min(), stream_id::max(), true, [&seqs] (const stream_entry_view& entry) {
+            seqs.push_back(entry._id._seq);
+            return seqs.size() < 3;
+        });
+        BOOST_CHECK((seqs == std::vector<uint64_t> { entries - 1, entries - 2, entries - 3 }));
+        BOOST_CHECK(s.remove(stream_id { 1000, 999 }));
+        BOOST_CHECK(!s.remove(stream_id { 1000, 999 }));
+        BOOST_CHECK(!s.has_after(stream_id { 1000, 998 }));
+        BOOST_CHECK(s.trim(500, true) <= 499);
+        BOOST_CHECK(s.size() >= 500);
+        s.trim(500, false);
+        BOOST_CHECK(s.size() == 500);
+        seqs.clear();
+        s.range(stream_id::min(), stream_id::max(), false, [&seqs] (const stream_entry_view& entry) {
+            seqs.push_back(entry._id._seq);
+            return false;
+        });
+        BOOST_CHECK(seqs.size() == 1 && seqs.front() == 499);
+        current_allocator().destroy<cache_entry>(e);
+    });
+    return make_ready_future<>();
+}
+
+// The hint holds every key added to it, and few others.
+SEASTAR_TEST_CASE(tier_hint_keys) {
+    tier_hint hint;
+    BOOST_CHECK(!hint.may_contain(std::hash<bytes>()(bytes { "key" })));
+    hint.resize(64 * 1024);
+    for (int i = 0; i < 1000; ++i) {
+        hint.add(std::hash<bytes>()(to_sstring<bytes>(i)));
+    }
+    size_t false_positives = 0;
+    for (int i = 0; i < 2000; ++i) {
+        auto present = hint.may_contain(std::hash<bytes>()(to_sstring<bytes>(i)));
+        if (i < 1000) {
+            BOOST_CHECK(present);
+        }
+        else if (present) {
+            ++false_positives;
+        }
+    }
+    BOOST_CHECK(false_positives < 10);
+    hint.set_all();
+    BOOST_CHECK(hint.may_contain(std::hash<bytes>()(bytes { "key" })));
+    return make_ready_future<>();
+}
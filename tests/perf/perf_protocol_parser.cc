@@ -0,0 +1,83 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pengjian.uestc@gmail.com. All rights reserved.
+*
+*/
+#include <chrono>
+#include <iostream>
+#include "core/app-template.hh"
+#include "core/thread.hh"
+#include "protocol_parser.hh"
+
+using namespace redis;
+
+// Feeds a pipeline of SET requests to the parser, split into fixed size
+// buffers as they would come from the socket, and reports requests/s.
+static double run(protocol_parser parser, const sstring& input, size_t chunk_size, size_t rounds)
+{
+    size_t parsed = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t r = 0; r < rounds; ++r) {
+        parser.init();
+        for (size_t offset = 0; offset < input.size(); offset += chunk_size) {
+            auto size = std::min(chunk_size, input.size() - offset);
+            temporary_buffer<char> buf(input.data() + offset, size);
+            while (!buf.empty()) {
+                auto remainder = parser(std::move(buf)).get0();
+                if (!remainder) {
+                    break;
+                }
+                ++parsed;
+                parser.init();
+                buf = std::move(*remainder);
+            }
+        }
+    }
+    auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return parsed / elapsed;
+}
+
+int main(int ac, char** av) {
+    namespace bpo = boost::program_options;
+    app_template app;
+    app.add_options()
+        ("requests", bpo::value<size_t>()->default_value(10000), "Pipelined requests per round")
+        ("value_size", bpo::value<size_t>()->default_value(64), "Size of the SET value")
+        ("chunk_size", bpo::value<size_t>()->default_value(16 * 1024), "Size of the buffers fed to the parser")
+        ("rounds", bpo::value<size_t>()->default_value(100), "Number of rounds")
+        ;
+    return app.run(ac, av, [&app] {
+        return seastar::async([&app] {
+            auto&& config = app.configuration();
+            auto requests = config["requests"].as<size_t>();
+            auto value_size = config["value_size"].as<size_t>();
+            auto chunk_size = config["chunk_size"].as<size_t>();
+            auto rounds = config["rounds"].as<size_t>();
+
+            sstring value(sstring::initialized_later(), value_size);
+            std::fill(value.begin(), value.end(), 'x');
+            sstring input;
+            for (size_t i = 0; i < requests; ++i) {
+                auto key = "key:" + to_sstring(i);
+                input += "*3\r\n$3\r\nSET\r\n$" + to_sstring(key.size()) + "\r\n" + key + "\r\n$" + to_sstring(value_size) + "\r\n" + value + "\r\n";
+            }
+            std::cout << "ragel:  " << run(make_ragel_protocol_parser(), input, chunk_size, rounds) << " requests/s\n";
+            std::cout << "native: " << run(make_native_protocol_parser(), input, chunk_size, rounds) << " requests/s\n";
+        });
+    });
+}
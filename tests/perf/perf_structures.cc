@@ -0,0 +1,291 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pengjian.uestc@gmail.com. All rights reserved.
+*
+*/
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <unordered_map>
+#include <vector>
+#include "core/app-template.hh"
+#include "core/thread.hh"
+#include "utils/logalloc.hh"
+#include "structures/dict_lsa.hh"
+#include "structures/sset_lsa.hh"
+#include "structures/list_lsa.hh"
+#include "structures/hll.hh"
+#include "structures/bits_operation.hh"
+#include "utils/float_string.hh"
+
+using namespace redis;
+
+// Every structure is built in its own LSA region, as the database keeps its
+// values, so the numbers include the allocator. Each line reports one
+// operation at one size in operations/s; the output is one line per result
+// so that runs of two commits can be diffed.
+static void report(const char* structure, const char* op, size_t size, size_t ops, std::chrono::steady_clock::time_point start)
+{
+    auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << structure << " " << op << " size=" << size << ": " << static_cast<uint64_t>(ops / elapsed) << " ops/s\n";
+}
+
+// Results are added here so that the measured reads are not optimized away.
+static volatile size_t sink;
+
+static std::vector<bytes> make_keys(size_t count, std::mt19937_64& random)
+{
+    std::vector<bytes> keys;
+    keys.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        keys.emplace_back(to_sstring(random()));
+    }
+    return keys;
+}
+
+static void run_dict(size_t size, const std::vector<bytes>& keys, const bytes& value)
+{
+    logalloc::region r;
+    with_allocator(r.allocator(), [&] {
+        dict_lsa d;
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < size; ++i) {
+            d.put(keys[i], value);
+        }
+        report("dict_lsa", "insert", size, size, start);
+
+        size_t found = 0;
+        start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < size; ++i) {
+            found += d.run_with_entry(keys[i], [] (const dict_entry* e) { return e != nullptr; });
+        }
+        report("dict_lsa", "lookup", size, found, start);
+
+        start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < size; ++i) {
+            d.erase(keys[i]);
+        }
+        report("dict_lsa", "erase", size, size, start);
+    });
+}
+
+static void run_sset(size_t size, const std::vector<bytes>& keys, size_t range)
+{
+    logalloc::region r;
+    with_allocator(r.allocator(), [&] {
+        sset_lsa s;
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < size; ++i) {
+            s.insert_or_update(keys[i], static_cast<double>(i));
+        }
+        report("sset_lsa", "insert", size, size, start);
+
+        size_t ranked = 0;
+        start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < size; ++i) {
+            ranked += bool(s.rank(keys[i]));
+        }
+        report("sset_lsa", "rank", size, ranked, start);
+
+        std::vector<const sset_entry*> entries;
+        auto rounds = std::max<size_t>(1, size / range);
+        start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < rounds; ++i) {
+            entries.clear();
+            auto begin = static_cast<long>((i * range) % size);
+            s.fetch_by_rank(begin, begin + static_cast<long>(range) - 1, entries);
+        }
+        report("sset_lsa", "range_by_rank", size, rounds, start);
+
+        start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < rounds; ++i) {
+            auto min = static_cast<double>((i * range) % size);
+            entries.clear();
+            s.fetch_by_score(min, min + range - 1, entries);
+        }
+        report("sset_lsa", "range_by_score", size, rounds, start);
+
+        std::vector<bytes> members(keys.begin(), keys.begin() + size);
+        start = std::chrono::steady_clock::now();
+        s.erase(members);
+        report("sset_lsa", "erase", size, size, start);
+    });
+}
+
+static void run_list(size_t size, const bytes& value, size_t range)
+{
+    logalloc::region r;
+    with_allocator(r.allocator(), [&] {
+        list_lsa l;
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < size; ++i) {
+            if (i & 1) {
+                l.insert_tail(value);
+            } else {
+                l.insert_head(value);
+            }
+        }
+        report("list_lsa", "insert", size, size, start);
+
+        size_t bytes_seen = 0;
+        auto lookups = std::min<size_t>(size, 100000);
+        start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < lookups; ++i) {
+            bytes_seen += l.at((i * 7919) % size).size();
+        }
+        report("list_lsa", "index", size, lookups, start);
+
+        std::vector<const managed_bytes*> data;
+        auto rounds = std::max<size_t>(1, size / range);
+        start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < rounds; ++i) {
+            data.clear();
+            auto begin = (i * range) % size;
+            l.fetch(begin, std::min(begin + range, size) - 1, data);
+        }
+        report("list_lsa", "range", size, rounds, start);
+
+        start = std::chrono::steady_clock::now();
+        while (!l.empty()) {
+            l.pop_front();
+        }
+        report("list_lsa", "pop", size, size, start);
+        sink += bytes_seen;
+    });
+}
+
+static void run_hll(size_t size, const std::vector<bytes>& keys, size_t batch)
+{
+    logalloc::region r;
+    with_allocator(r.allocator(), [&] {
+        auto h = hll::make(true);
+        std::vector<bytes> elements;
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < size; i += batch) {
+            elements.assign(keys.begin() + i, keys.begin() + std::min(i + batch, size));
+            hll::append(h, elements);
+        }
+        report("hll", "add", size, size, start);
+
+        size_t card = 0;
+        size_t rounds = 1000;
+        start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < rounds; ++i) {
+            card += hll::count(h);
+        }
+        report("hll", "count", size, rounds, start);
+
+        // The source is a flat copy of the value, as PFMERGE gathers the
+        // sources from the other shards.
+        bytes source(bytes::initialized_later(), h.size());
+        size_t offset = 0;
+        h.for_each_fragment([&source, &offset] (bytes_view fragment) {
+            std::copy(fragment.begin(), fragment.end(), source.begin() + offset);
+            offset += fragment.size();
+        });
+        auto dest = hll::make(false);
+        start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < rounds; ++i) {
+            hll::merge(dest, reinterpret_cast<const uint8_t*>(source.data()), source.size());
+        }
+        report("hll", "merge", size, rounds, start);
+        sink += card;
+    });
+}
+
+static void run_bitcount(size_t size, std::mt19937_64& random)
+{
+    logalloc::region r;
+    with_allocator(r.allocator(), [&] {
+        auto bitmap = bits_operation::make_bitmap(size);
+        for (size_t i = 0; i < size; i += 7) {
+            bits_operation::set(bitmap, (i * 8 + random() % 8), true);
+        }
+        size_t bits = 0;
+        size_t rounds = std::max<size_t>(1, (64 << 20) / size);
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < rounds; ++i) {
+            bits += bits_operation::count(bitmap, 0, -1);
+        }
+        report("bits", "bitcount", size, rounds, start);
+        sink += bits;
+    });
+}
+
+// The scores of ZADD and the replies of ZSCORE, as strings of two decimals.
+static void run_scores(size_t size, std::mt19937_64& random)
+{
+    std::vector<bytes> texts;
+    texts.reserve(size);
+    for (size_t i = 0; i < size; ++i) {
+        char buf[max_float_string];
+        texts.emplace_back(buf, format_float_string(static_cast<double>(random() % 100000000) / 100, buf));
+    }
+    std::vector<double> scores(size);
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < size; ++i) {
+        parse_float_string(texts[i].data(), texts[i].size(), scores[i]);
+    }
+    report("float", "parse", size, size, start);
+    size_t written = 0;
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < size; ++i) {
+        char buf[max_float_string];
+        written += format_float_string(scores[i], buf);
+    }
+    report("float", "format", size, size, start);
+    sink += written;
+}
+
+int main(int ac, char** av) {
+    namespace bpo = boost::program_options;
+    app_template app;
+    app.add_options()
+        ("max_size", bpo::value<size_t>()->default_value(1000000), "Largest number of elements, sizes go from 10 up by 10x")
+        ("value_size", bpo::value<size_t>()->default_value(16), "Size of the dict and list values")
+        ("range", bpo::value<size_t>()->default_value(100), "Elements fetched by a range")
+        ("hll_batch", bpo::value<size_t>()->default_value(16), "Elements added by a PFADD")
+        ("bitmap_size", bpo::value<size_t>()->default_value(64 * 1024 * 1024), "Largest bitmap in bytes, sizes go from 1KB up by 16x")
+        ("seed", bpo::value<uint64_t>()->default_value(0), "Seed of the keys, fixed so that runs compare")
+        ;
+    return app.run(ac, av, [&app] {
+        return seastar::async([&app] {
+            auto&& config = app.configuration();
+            auto max_size = config["max_size"].as<size_t>();
+            auto value_size = config["value_size"].as<size_t>();
+            auto range = std::max<size_t>(1, config["range"].as<size_t>());
+            auto hll_batch = std::max<size_t>(1, config["hll_batch"].as<size_t>());
+            auto bitmap_size = config["bitmap_size"].as<size_t>();
+            std::mt19937_64 random(config["seed"].as<uint64_t>());
+
+            auto keys = make_keys(max_size, random);
+            bytes value(bytes::initialized_later(), value_size);
+            std::fill(value.begin(), value.end(), 'x');
+            for (size_t size = 10; size <= max_size; size *= 10) {
+                run_dict(size, keys, value);
+                run_sset(size, keys, range);
+                run_list(size, value, range);
+                run_hll(size, keys, hll_batch);
+                run_scores(size, random);
+            }
+            for (size_t size = 1024; size <= bitmap_size; size *= 16) {
+                run_bitcount(size, random);
+            }
+        });
+    });
+}
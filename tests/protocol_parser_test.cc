@@ -0,0 +1,55 @@
+#include "tests/test-utils.hh"
+#include "protocol_parser.hh"
+#include "exceptions/exceptions.hh"
+
+#include <cstring>
+
+using namespace redis;
+
+// Feeds the input to the parser in buffers of chunk_size bytes, returns
+// whether a whole request was parsed.
+static bool feed(protocol_parser& parser, const sstring& input, size_t chunk_size)
+{
+    parser.init();
+    for (size_t offset = 0; offset < input.size(); offset += chunk_size) {
+        auto size = std::min(chunk_size, input.size() - offset);
+        if (parser.parse(temporary_buffer<char>(input.data() + offset, size))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// A request split anywhere reads the same.
+SEASTAR_TEST_CASE(parse_split_request) {
+    auto parser = make_native_protocol_parser();
+    sstring input = "*3\r\n$3\r\nSET\r\n$3\r\nkey\r\n$5\r\nvalue\r\n";
+    for (size_t chunk_size : { size_t(1), size_t(5), input.size() }) {
+        BOOST_REQUIRE(feed(parser, input, chunk_size));
+        auto& req = parser.request();
+        BOOST_CHECK(req._command == "SET");
+        BOOST_CHECK(req._args_count == 2);
+        BOOST_CHECK(req._args.size() == 2);
+        BOOST_CHECK(req.arg_view(0) == bytes_view("key", 3));
+        BOOST_CHECK(req.arg_view(1) == bytes_view("value", 5));
+    }
+    return make_ready_future<>();
+}
+
+// The counts and lengths past the limits of Redis are refused from their
+// header, before anything is allocated for them. A parser which failed is
+// not used again, as the connection is closed.
+SEASTAR_TEST_CASE(parse_limits) {
+    for (auto input : { "*4000000000\r\n", "*1048577\r\n", "*2\r\n$3\r\nGET\r\n$4000000000\r\n", "*2\r\n$3\r\nGET\r\n$536870913\r\n" }) {
+        auto parser = make_native_protocol_parser();
+        BOOST_CHECK_THROW(feed(parser, input, std::strlen(input)), protocol_exception);
+    }
+    // a large count is taken, its arguments are reserved as they come.
+    auto parser = make_native_protocol_parser();
+    BOOST_CHECK(!feed(parser, "*1048576\r\n$3\r\nDEL\r\n$1\r\na\r\n", 64));
+    BOOST_CHECK(parser.request()._args.size() == 1);
+    BOOST_CHECK(parser.request()._args.capacity() <= 64);
+    auto large = make_native_protocol_parser();
+    BOOST_CHECK(!feed(large, "*2\r\n$3\r\nGET\r\n$536870912\r\n", 64));
+    return make_ready_future<>();
+}
@@ -1,8 +1,10 @@
 #include "token.hh"
+#include <functional>
+#include <ostream>
 namespace redis {
 
-static const token min_token{ token::kind::before_all_keys, {} };
-static const token max_token{ token::kind::after_all_keys, {} };
+static const token min_token{ token::kind::before_all_keys, 0 };
+static const token max_token{ token::kind::after_all_keys, 0 };
 
 const token&
     minimum_token() {
@@ -15,61 +17,44 @@ const token&
     }
 
 token token::from_bytes(const bytes& key) {
-   return minimum_token();
+   return from_bytes(bytes_view { key.data(), key.size() });
 }
+
+// The token of a key is its hash, so that tokens order keys by hash.
 token token::from_bytes(const bytes_view& key) {
-   return minimum_token();
+   return from_value(std::hash<bytes_view>()(key));
 }
-bool operator==(const token& t1, const token& t2)
+
+int tri_compare(const token& t1, const token& t2)
 {
-    /*
     if (t1._kind != t2._kind) {
-        return false;
-    } else if (t1._kind == token::kind::key) {
-        return global_partitioner().is_equal(t1, t2);
+        return t1._kind < t2._kind ? -1 : 1;
+    }
+    if (t1._kind != token::kind::key) {
+        return 0;
     }
-    */
-    return true;
+    return (t1._data > t2._data) - (t1._data < t2._data);
+}
+
+bool operator==(const token& t1, const token& t2)
+{
+    return tri_compare(t1, t2) == 0;
 }
 
 bool operator<(const token& t1, const token& t2)
 {
-    /*
-    if (t1._kind < t2._kind) {
-        return true;
-    } else if (t1._kind == token::kind::key && t2._kind == token::kind::key) {
-        return global_partitioner().is_less(t1, t2);
-    }
-    */
-    return false;
+    return tri_compare(t1, t2) < 0;
 }
 
 std::ostream& operator<<(std::ostream& out, const token& t) {
-    /* 
     if (t._kind == token::kind::after_all_keys) {
         out << "maximum token";
     } else if (t._kind == token::kind::before_all_keys) {
         out << "minimum token";
     } else {
-        out << global_partitioner().to_sstring(t);
+        out << t._data;
     }
-    */
     return out;
 }
 
 }
-
-namespace std {
-
-size_t
-hash<redis::token>::hash_large_token(const managed_bytes& b) const {
-    /*
-    auto read_bytes = boost::irange<size_t>(0, b.size())
-            | boost::adaptors::transformed([&b] (size_t idx) { return b[idx]; });
-    std::array<uint64_t, 2> result;
-    utils::murmur_hash::hash3_x64_128(read_bytes.begin(), b.size(), 0, result);
-    return result[0];
-    */
-    return 0;
-}
-}
@@ -1,5 +1,10 @@
 #pragma once
-#include "utils/managed_bytes.hh"
+#include <cstdint>
+#include <functional>
+#include <iosfwd>
+#include <limits>
+#include <utility>
+#include "utils/bytes.hh"
 namespace redis {
 class token {
 public:
@@ -9,20 +14,16 @@ public:
         after_all_keys,
     };
     kind _kind;
-    // _data can be interpreted as a big endian binary fraction
-    // in the range [0.0, 1.0).
-    //
-    // So, [] == 0.0
-    //     [0x00] == 0.0
-    //     [0x80] == 0.5
-    //     [0x00, 0x80] == 1/512
-    //     [0xff, 0x80] == 1 - 1/512
-    managed_bytes _data;
+    // A signed 64 bit integer, as the murmur3 partitioner of Scylla has it,
+    // so that a token takes no allocation and two compare as integers. The
+    // ring works on the position of the token in [0, 2^64), see
+    // token_value(), which the integer is biased from.
+    int64_t _data = 0;
 
     token() : _kind(kind::before_all_keys) {
     }
 
-    token(kind k, managed_bytes d) : _kind(std::move(k)), _data(std::move(d)) {
+    token(kind k, int64_t d) : _kind(k), _data(d) {
     }
 
     bool is_minimum() const {
@@ -35,7 +36,20 @@ public:
 
     static token from_bytes(const bytes& key);
     static token from_bytes(const bytes_view& key);
+    // The token at the position `v` of the ring.
+    static token from_value(uint64_t v) {
+        return token { kind::key, static_cast<int64_t>(v - (uint64_t(1) << 63)) };
+    }
 };
+
+// The position of the token on the ring, 0 before all keys.
+inline uint64_t token_value(const token& t) {
+    if (t._kind != token::kind::key) {
+        return t._kind == token::kind::before_all_keys ? 0 : std::numeric_limits<uint64_t>::max();
+    }
+    return static_cast<uint64_t>(t._data) + (uint64_t(1) << 63);
+}
+
 token midpoint_unsigned(const token& t1, const token& t2);
 const token& minimum_token();
 const token& maximum_token();
@@ -53,16 +67,8 @@ std::ostream& operator<<(std::ostream& out, const token& t);
 namespace std {
     template<> struct hash<redis::token> {
         size_t operator()(const redis::token& t) const {
-            size_t ret = 0;
-            const auto& b = t._data;
-            if (b.size() <= sizeof(ret)) { // practically always
-                std::copy_n(b.data(), b.size(), reinterpret_cast<int8_t*>(&ret));
-            } else {
-                ret = hash_large_token(b);
-            }
-            return ret;
+            // the token is a hash already.
+            return static_cast<size_t>(t._data);
         }
-    private:
-        size_t hash_large_token(const managed_bytes& b) const;
     };
 }
@@ -0,0 +1,124 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+* 
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <vector>
+#include "core/shared_ptr.hh"
+#include "redis_command_code.hh"
+namespace redis {
+using namespace seastar;
+
+using trace_clock = std::chrono::steady_clock;
+
+// The timestamps of one sampled request, from the end of its parsing to the
+// flush of its reply. The clock is the same on every core, so the stamps
+// of the owning shard compare with those of the shard of the connection.
+// Stamps left zero were skipped, as the execution of a command which does
+// not go through redis_service's routing to one owner.
+struct request_trace {
+    uint64_t _id = 0;
+    command_code _command = command_code::unknown;
+    unsigned _shard = 0;
+    unsigned _owner = 0;
+    trace_clock::time_point _parsed;
+    trace_clock::time_point _dispatched;
+    trace_clock::time_point _execute_start;
+    trace_clock::time_point _execute_end;
+    trace_clock::time_point _replied;
+    trace_clock::time_point _flushed;
+};
+
+// Samples the requests of its shard and keeps the last traces in a ring,
+// touched by that shard only; TRACING GET gathers the rings of all shards.
+class request_tracer {
+    double _probability = 0;
+    std::vector<request_trace> _ring;
+    // Traces recorded since the last reset, the next one goes to
+    // _recorded % _ring.size().
+    uint64_t _recorded = 0;
+    uint64_t _sampled = 0;
+    std::minstd_rand _random;
+    std::uniform_real_distribution<double> _unit { 0.0, 1.0 };
+public:
+    explicit request_tracer(size_t capacity) : _ring(std::max<size_t>(1, capacity)) {}
+
+    // 0 disables the tracing, 1 traces every request.
+    void set_probability(double probability) { _probability = probability; }
+    double probability() const { return _probability; }
+
+    // A trace for the request, nullptr if it is not sampled.
+    lw_shared_ptr<request_trace> sample(command_code code, unsigned shard)
+    {
+        if (_probability <= 0 || (_probability < 1 && _unit(_random) >= _probability)) {
+            return nullptr;
+        }
+        auto trace = make_lw_shared<request_trace>();
+        trace->_id = ++_sampled;
+        trace->_command = code;
+        trace->_shard = shard;
+        trace->_owner = shard;
+        trace->_parsed = trace_clock::now();
+        return trace;
+    }
+
+    void record(const request_trace& trace)
+    {
+        _ring[_recorded++ % _ring.size()] = trace;
+    }
+
+    size_t size() const { return std::min<uint64_t>(_recorded, _ring.size()); }
+
+    // The last `count` traces, newest first.
+    std::vector<request_trace> last(size_t count) const
+    {
+        std::vector<request_trace> traces;
+        count = std::min(count, size());
+        traces.reserve(count);
+        for (size_t i = 1; i <= count; ++i) {
+            traces.push_back(_ring[(_recorded - i) % _ring.size()]);
+        }
+        return traces;
+    }
+
+    void reset() { _recorded = 0; }
+};
+
+// The trace of the request whose handler is running on this shard, if it
+// is sampled: the routing of redis_service stamps the dispatch and the
+// execution on the owner into it. Set by trace_scope for the synchronous
+// part of the handler, which is where the routing happens.
+inline request_trace*& current_trace()
+{
+    static thread_local request_trace* trace = nullptr;
+    return trace;
+}
+
+class trace_scope {
+    request_trace* _previous;
+public:
+    explicit trace_scope(request_trace* trace) : _previous(current_trace()) { current_trace() = trace; }
+    ~trace_scope() { current_trace() = _previous; }
+    trace_scope(const trace_scope&) = delete;
+    trace_scope& operator = (const trace_scope&) = delete;
+};
+}
@@ -0,0 +1,88 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#include "tracking.hh"
+#include "core/reactor.hh"
+namespace redis {
+
+client_tracking::client_tracking()
+    : _outbox(smp::count)
+{
+}
+
+uint64_t client_tracking::add_client(tracking_client* c)
+{
+    auto id = ++_next_id * smp::count + engine().cpu_id();
+    _clients.emplace(id, c);
+    return id;
+}
+
+void client_tracking::remove_client(uint64_t id)
+{
+    _clients.erase(id);
+}
+
+unsigned client_tracking::shard_of_client(uint64_t id)
+{
+    return id % smp::count;
+}
+
+void client_tracking::invalidate(const std::vector<uint64_t>& clients, const bytes& key)
+{
+    for (auto id : clients) {
+        auto cpu = shard_of_client(id);
+        auto& b = _outbox[cpu];
+        if (!b) {
+            b = make_lw_shared<std::vector<invalidation>>();
+            later().then([this, cpu] {
+                send_batch(cpu);
+            });
+        }
+        b->emplace_back(id, key);
+        ++_stats._invalidations;
+    }
+}
+
+void client_tracking::send_batch(unsigned cpu)
+{
+    auto b = std::move(_outbox[cpu]);
+    ++_stats._batches_sent;
+    smp::submit_to(cpu, [invalidations = b.get()] {
+        local_tracking().deliver(*invalidations);
+    }).finally([b] {});
+}
+
+void client_tracking::deliver(const std::vector<invalidation>& invalidations)
+{
+    std::unordered_map<uint64_t, std::vector<bytes>> keys;
+    for (auto& i : invalidations) {
+        keys[i.first].push_back(i.second);
+    }
+    for (auto& k : keys) {
+        // the client may be gone since it read the keys.
+        auto c = _clients.find(k.first);
+        if (c == _clients.end()) {
+            continue;
+        }
+        ++_stats._deliveries;
+        c->second->invalidate(k.second);
+    }
+}
+}
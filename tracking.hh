@@ -0,0 +1,92 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#pragma once
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "core/future.hh"
+#include "core/shared_ptr.hh"
+#include "utils/bytes.hh"
+namespace redis {
+using namespace seastar;
+
+// A connection as the invalidations of the keys it read reach its shard.
+class tracking_client {
+public:
+    virtual ~tracking_client() {}
+    // The keys changed since the client read them.
+    virtual void invalidate(const std::vector<bytes>& keys) = 0;
+};
+
+// Client-side caching, CLIENT TRACKING: the connections of a shard by their
+// ids, and the invalidations sent to them.
+//
+// The shard owning a key keeps the ids of the clients which read it, see
+// database::track(), and sends them an invalidation on its next change,
+// forgetting them. The invalidations for a shard wait for the end of the
+// task and go there as one batch, as PUBLISH does, and a client gets the
+// keys of a batch in one message.
+class client_tracking {
+public:
+    struct stats {
+        // Keys invalidated for a client, sent from this shard.
+        uint64_t _invalidations = 0;
+        uint64_t _batches_sent = 0;
+        // Messages of invalidations written to the clients of this shard.
+        uint64_t _deliveries = 0;
+    };
+private:
+    using invalidation = std::pair<uint64_t, bytes>;
+    std::unordered_map<uint64_t, tracking_client*> _clients;
+    uint64_t _next_id = 0;
+    // By shard.
+    std::vector<lw_shared_ptr<std::vector<invalidation>>> _outbox;
+    stats _stats;
+
+    void send_batch(unsigned cpu);
+public:
+    client_tracking();
+    client_tracking(const client_tracking&) = delete;
+    client_tracking& operator = (const client_tracking&) = delete;
+
+    // The id of a new connection, unique on all shards, which tell the
+    // shard of the connection.
+    uint64_t add_client(tracking_client* c);
+    void remove_client(uint64_t id);
+    bool has_client(uint64_t id) const
+    {
+        return _clients.count(id) > 0;
+    }
+    static unsigned shard_of_client(uint64_t id);
+    // The key changed, on the shard owning it.
+    void invalidate(const std::vector<uint64_t>& clients, const bytes& key);
+    // A batch of invalidations from a shard, for the clients of this one.
+    void deliver(const std::vector<invalidation>& invalidations);
+    size_t client_count() const { return _clients.size(); }
+    const stats& get_stats() const { return _stats; }
+};
+
+inline client_tracking& local_tracking()
+{
+    static thread_local client_tracking t;
+    return t;
+}
+}
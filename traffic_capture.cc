@@ -0,0 +1,259 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#include "traffic_capture.hh"
+#include "cluster.hh"
+#include "request_wrapper.hh"
+#include "store/util/coding.hh"
+#include "utils/murmur_hash.hh"
+#include "core/print.hh"
+#include "core/reactor.hh"
+#include "util/log.hh"
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <strings.h>
+namespace redis {
+
+using logger = seastar::logger;
+static logger capture_log ("capture");
+
+constexpr size_t traffic_capture::write_size;
+constexpr size_t traffic_capture::max_writing;
+
+// The longest argument other than a key which may be kept as it is.
+static constexpr size_t max_verbatim_bytes = 20;
+
+sstring capture_file_name(const sstring& dir, unsigned shard)
+{
+    return sprint("%s/capture-%u.trace", dir, shard);
+}
+
+// A score, a count, an index or a range bound such as "(1.5" or "-inf".
+static bool is_number(bytes_view v)
+{
+    size_t i = 0;
+    if (i < v.size() && (v[i] == '(' || v[i] == '[')) {
+        ++i;
+    }
+    if (i < v.size() && (v[i] == '-' || v[i] == '+')) {
+        ++i;
+    }
+    if (v.size() - i == 3 && strncasecmp(v.data() + i, "inf", 3) == 0) {
+        return true;
+    }
+    bool digit = false;
+    for (; i < v.size(); ++i) {
+        auto c = v[i];
+        if (std::isdigit(static_cast<unsigned char>(c))) {
+            digit = true;
+        }
+        else if (c != '.' && c != 'e' && c != 'E' && c != '-' && c != '+') {
+            return false;
+        }
+    }
+    return digit;
+}
+
+// The ids of streams and the bounds of lex ranges: "*", "$", ">", "-", "+".
+static bool is_symbol(bytes_view v)
+{
+    return v.size() == 1 && std::strchr("*$>-+", v[0]) != nullptr;
+}
+
+static bool is_word(bytes_view v)
+{
+    return std::all_of(v.begin(), v.end(), [] (char c) { return std::isalpha(static_cast<unsigned char>(c)); });
+}
+
+// The options of the commands, which an anonymized capture keeps.
+static bool is_option(bytes_view v)
+{
+    static const char* options[] = {
+        "ex", "px", "exat", "pxat", "nx", "xx", "gt", "lt", "ch", "incr", "keepttl", "get", "persist",
+        "withscores", "withvalues", "limit", "byscore", "bylex", "rev", "match", "count", "type",
+        "aggregate", "weights", "sum", "min", "max", "left", "right", "before", "after", "block",
+        "streams", "maxlen", "minid", "nomkstream", "justid", "idle", "group", "consumer", "noack",
+        "fields", "store", "storedist", "withcoord", "withdist", "withhash", "fromlonlat", "frommember",
+        "byradius", "bybox", "asc", "desc", "any", "m", "km", "ft", "mi", "rank", "len", "idx",
+        "withmatchlen", "minmatchlen", "and", "or", "xor", "not", "bit", "byte", "overflow", "wrap",
+        "sat", "fail", "set", "incrby", "on", "off", "reset", "retention", "labels", "aggregation",
+    };
+    for (auto o : options) {
+        if (std::strlen(o) == v.size() && strncasecmp(o, v.data(), v.size()) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void traffic_capture::put_count(uint64_t count)
+{
+    char varint[10];
+    auto end = store::encode_varint64(varint, count);
+    _buffer.insert(_buffer.end(), varint, end);
+}
+
+void traffic_capture::put_bytes(const char* data, size_t size)
+{
+    put_count(size);
+    _buffer.insert(_buffer.end(), data, data + size);
+}
+
+void traffic_capture::put_fixed64(uint64_t value)
+{
+    char fixed[8];
+    store::encode_fixed64(fixed, value);
+    _buffer.insert(_buffer.end(), fixed, fixed + sizeof(fixed));
+}
+
+future<> traffic_capture::start(capture_options options)
+{
+    return with_semaphore(_lock, 1, [this, options = std::move(options)] () mutable {
+        return close().then([this, options = std::move(options)] () mutable {
+            auto name = capture_file_name(options._dir, engine().cpu_id());
+            return open_file_dma(name, open_flags::wo | open_flags::create | open_flags::truncate).then([this, options = std::move(options)] (file f) mutable {
+                _out.emplace(make_file_output_stream(std::move(f)));
+                _options = std::move(options);
+                _stats = capture_stats {};
+                _buffer.clear();
+                _buffer.reserve(write_size * 2);
+                _buffer.insert(_buffer.end(), capture_magic, capture_magic + capture_magic_size);
+                char shard[4];
+                store::encode_fixed32(shard, engine().cpu_id());
+                _buffer.insert(_buffer.end(), shard, shard + sizeof(shard));
+                _buffer.push_back(_options._anonymize ? 1 : 0);
+                _last = clock_type::now();
+                put_fixed64(std::chrono::duration_cast<std::chrono::microseconds>(_last.time_since_epoch()).count());
+                _stats._bytes = _buffer.size();
+                ++_generation;
+                _active = true;
+                capture_log.info("capturing {} of the connections to {}", _options._probability, name);
+            });
+        });
+    });
+}
+
+bool traffic_capture::sample()
+{
+    return _options._probability >= 1 || std::uniform_real_distribution<double>(0, 1)(_random) < _options._probability;
+}
+
+void traffic_capture::record(uint64_t connection, const request_wrapper& req)
+{
+    if (!_active) {
+        return;
+    }
+    if (_writing >= max_writing) {
+        ++_stats._dropped;
+        return;
+    }
+    auto now = clock_type::now();
+    auto before = _buffer.size();
+    put_count(std::chrono::duration_cast<std::chrono::microseconds>(now - _last).count());
+    put_count(connection);
+    put_bytes(req._command.data(), req._command.size());
+    put_count(req._args_count);
+    auto keys = command_key_positions(req);
+    for (size_t i = 0; i < req._args_count; ++i) {
+        auto size = req.arg_size(i);
+        if (std::find(keys.begin(), keys.end(), i) != keys.end()) {
+            auto key = req.arg_view(i);
+            if (_options._anonymize) {
+                put_count(size << 2 | static_cast<uint8_t>(capture_arg::hashed_key));
+                put_fixed64(utils::murmur_hash::hash2_64(key, _options._salt));
+            }
+            else {
+                put_count(size << 2 | static_cast<uint8_t>(capture_arg::key));
+                _buffer.insert(_buffer.end(), key.begin(), key.end());
+            }
+            continue;
+        }
+        // a large value is never kept, so it is not linearized either.
+        if (size > 0 && size <= max_verbatim_bytes && !req.fragmented(i)) {
+            auto v = req.arg_view(i);
+            if (is_number(v) || is_symbol(v) || (_options._anonymize ? is_option(v) : is_word(v))) {
+                put_count(size << 2 | static_cast<uint8_t>(capture_arg::verbatim));
+                _buffer.insert(_buffer.end(), v.begin(), v.end());
+                continue;
+            }
+        }
+        put_count(size << 2 | static_cast<uint8_t>(capture_arg::filler));
+    }
+    _last = now;
+    ++_stats._records;
+    _stats._bytes += _buffer.size() - before;
+    if (_stats._bytes >= _options._max_bytes) {
+        capture_log.info("the capture reached {} bytes, it ends", _stats._bytes);
+        _active = false;
+    }
+    if (_buffer.size() >= write_size || !_active) {
+        write_out();
+    }
+}
+
+void traffic_capture::write_out()
+{
+    auto data = std::move(_buffer);
+    _buffer = std::vector<char>();
+    _buffer.reserve(write_size * 2);
+    _writing += data.size();
+    _writes = _writes.then([this, data = std::move(data)] () mutable {
+        return do_with(std::move(data), [this] (std::vector<char>& data) {
+            return _out->write(data.data(), data.size()).finally([this, &data] {
+                _writing -= data.size();
+            });
+        });
+    }).handle_exception([this] (std::exception_ptr ep) {
+        capture_log.warn("failed to write the capture, it ends: {}", ep);
+        _active = false;
+    });
+}
+
+future<> traffic_capture::close()
+{
+    _active = false;
+    if (!_out) {
+        return make_ready_future<>();
+    }
+    if (!_buffer.empty()) {
+        write_out();
+    }
+    auto writes = std::move(_writes);
+    _writes = make_ready_future<>();
+    return writes.then([this] {
+        return _out->flush();
+    }).then([this] {
+        return _out->close();
+    }).handle_exception([] (std::exception_ptr ep) {
+        capture_log.warn("failed to close the capture: {}", ep);
+    }).finally([this] {
+        _out = std::experimental::nullopt;
+        capture_log.info("captured {} requests, {} bytes, {} dropped", _stats._records, _stats._bytes, _stats._dropped);
+    });
+}
+
+future<> traffic_capture::stop()
+{
+    return with_semaphore(_lock, 1, [this] {
+        return close();
+    });
+}
+}
@@ -0,0 +1,142 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#pragma once
+#include "core/fstream.hh"
+#include "core/future.hh"
+#include "core/semaphore.hh"
+#include "core/sstring.hh"
+#include <chrono>
+#include <cstdint>
+#include <experimental/optional>
+#include <random>
+#include <vector>
+namespace redis {
+using namespace seastar;
+struct request_wrapper;
+
+// The layout of a capture file, which pedis_replay reads:
+//
+//   "PDSCAP01"                magic
+//   fixed32                   shard
+//   byte                      1 if the keys are hashed
+//   fixed64                   start, in microseconds of the steady clock,
+//                             which all shards share
+//
+// then a record per request:
+//
+//   varint                    microseconds since the previous record, or
+//                             since the start for the first
+//   varint                    id of the connection, as CLIENT ID
+//   varint, bytes             the command
+//   varint                    count of arguments
+//   per argument:
+//     varint                  size << 2 | kind, see capture_arg
+//     bytes                   its size of bytes for `verbatim` and `key`
+//     fixed64                 the hash for `hashed_key`
+//
+// A record stops short when the node stops, the reader drops it.
+static constexpr char capture_magic[] = "PDSCAP01";
+static constexpr size_t capture_magic_size = 8;
+
+enum class capture_arg : uint8_t {
+    // Only the size, a value.
+    filler = 0,
+    // Numbers and the words of options, kept as they are.
+    verbatim = 1,
+    key = 2,
+    // The key of an anonymized capture, its salted hash.
+    hashed_key = 3,
+};
+
+sstring capture_file_name(const sstring& dir, unsigned shard);
+
+struct capture_options {
+    sstring _dir = ".";
+    // The share of the connections whose requests are captured, decided
+    // once per connection, so that each one captured is so whole.
+    double _probability = 1;
+    // Keys are recorded as a hash salted with _salt, the same on every
+    // shard, and only the numbers and the options are kept of the others.
+    bool _anonymize = false;
+    uint64_t _salt = 0;
+    // The capture of a shard ends once its file reaches this size.
+    size_t _max_bytes = size_t(1) << 30;
+};
+
+struct capture_stats {
+    uint64_t _records = 0;
+    uint64_t _bytes = 0;
+    // Requests not captured while the disk was behind.
+    uint64_t _dropped = 0;
+};
+
+// Captures the requests of the sampled connections of one shard to
+// "capture-<shard>.trace" for pedis_replay, as CAPTURE START asks. A
+// request is encoded where the connection parses it, into a buffer written
+// out in the background as it fills: the connections never wait for the
+// disk, the requests which find it too far behind are dropped instead.
+class traffic_capture {
+public:
+    using clock_type = std::chrono::steady_clock;
+    static constexpr size_t write_size = 128 * 1024;
+    // Buffers written out but not yet on disk, past which requests drop.
+    static constexpr size_t max_writing = 8 * write_size;
+private:
+    capture_options _options;
+    capture_stats _stats;
+    bool _active = false;
+    // Bumped by each start, the connections sample themselves again.
+    uint64_t _generation = 0;
+    std::minstd_rand _random;
+    std::vector<char> _buffer;
+    clock_type::time_point _last;
+    std::experimental::optional<output_stream<char>> _out;
+    // The buffers written out, in order.
+    future<> _writes = make_ready_future<>();
+    size_t _writing = 0;
+    // Start and stop take the file in turn.
+    semaphore _lock { 1 };
+
+    void put_count(uint64_t count);
+    void put_bytes(const char* data, size_t size);
+    void put_fixed64(uint64_t value);
+    void write_out();
+    future<> close();
+public:
+    traffic_capture() : _random(std::random_device {}()) {}
+    traffic_capture(const traffic_capture&) = delete;
+    traffic_capture& operator = (const traffic_capture&) = delete;
+
+    bool active() const { return _active; }
+    uint64_t generation() const { return _generation; }
+    const capture_options& options() const { return _options; }
+    const capture_stats& stats() const { return _stats; }
+
+    // Ends the capture running, if any, and starts one to a new file.
+    future<> start(capture_options options);
+    // Whether a connection is captured, drawn once it first sees the
+    // capture of generation().
+    bool sample();
+    void record(uint64_t connection, const request_wrapper& req);
+    // Writes what is left and closes the file.
+    future<> stop();
+};
+}
@@ -33,5 +33,29 @@ enum class data_type : unsigned {
     sset    = 9,
     bitmap  = 10,
     hll     = 11,
+    stream  = 12,
+    timeseries = 13,
+    bloom   = 14,
+    cms     = 15,
+    topk    = 16,
 };
 
+
+// The name TYPE replies for a value of this type.
+inline const char* data_type_name(data_type type)
+{
+    switch (type) {
+    case data_type::list: return "list";
+    case data_type::dict: return "hash";
+    case data_type::set: return "set";
+    case data_type::sset: return "zset";
+    case data_type::hll: return "hyperloglog";
+    case data_type::stream: return "stream";
+    case data_type::timeseries: return "TSDB-TYPE";
+    case data_type::bloom: return "MBbloom--";
+    case data_type::cms: return "CMSk-TYPE";
+    case data_type::topk: return "TopK-TYPE";
+    case data_type::deleted: return "none";
+    default: return "string";
+    }
+}
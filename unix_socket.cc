@@ -0,0 +1,133 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#include "pubsub.hh"
+#include "unix_socket.hh"
+#include "core/reactor.hh"
+#include "net/stack.hh"
+#include "net/posix-stack.hh"
+#include <cstring>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+namespace redis {
+
+namespace {
+// Waits for the socket to be readable before it takes a buffer, where the
+// posix stack takes one for the read it waits on.
+class unix_data_source_impl final : public data_source_impl {
+    lw_shared_ptr<pollable_fd> _fd;
+    size_t _buf_size;
+public:
+    unix_data_source_impl(lw_shared_ptr<pollable_fd> fd, size_t buf_size) : _fd(std::move(fd)), _buf_size(buf_size) {}
+    future<temporary_buffer<char>> get() override
+    {
+        return _fd->readable().then([this] {
+            temporary_buffer<char> buf(_buf_size);
+            auto n = _fd->get_file_desc().read(buf.get_write(), buf.size());
+            if (!n) {
+                // woken up, but another read took the data.
+                return get();
+            }
+            buf.trim(*n);
+            return make_ready_future<temporary_buffer<char>>(std::move(buf));
+        });
+    }
+};
+
+class unix_connected_socket_impl final : public net::connected_socket_impl {
+    lw_shared_ptr<pollable_fd> _fd;
+    size_t _input_buffer_size;
+public:
+    unix_connected_socket_impl(lw_shared_ptr<pollable_fd> fd, size_t input_buffer_size)
+        : _fd(std::move(fd))
+        , _input_buffer_size(input_buffer_size)
+    {
+    }
+    data_source source() override
+    {
+        return data_source(std::make_unique<unix_data_source_impl>(_fd, _input_buffer_size));
+    }
+    data_sink sink() override
+    {
+        return data_sink(std::make_unique<net::posix_data_sink_impl>(_fd));
+    }
+    void shutdown_input() override { _fd->shutdown(SHUT_RD); }
+    void shutdown_output() override { _fd->shutdown(SHUT_WR); }
+    void set_nodelay(bool) override {}
+    bool get_nodelay() const override { return true; }
+    void set_keepalive(bool) override {}
+    bool get_keepalive() const override { return false; }
+    void set_keepalive_parameters(const net::keepalive_params&) override {}
+    net::keepalive_params get_keepalive_parameters() const override
+    {
+        return net::tcp_keepalive_params { std::chrono::seconds(0), std::chrono::seconds(0), 0 };
+    }
+};
+
+class unix_server_socket_impl final : public net::server_socket_impl {
+    pollable_fd _fd;
+    size_t _input_buffer_size;
+public:
+    unix_server_socket_impl(file_desc fd, size_t input_buffer_size) : _fd(std::move(fd)), _input_buffer_size(input_buffer_size) {}
+    future<connected_socket, socket_address> accept() override
+    {
+        return _fd.accept().then([this] (pollable_fd fd, socket_address) {
+            auto impl = std::make_unique<unix_connected_socket_impl>(make_lw_shared<pollable_fd>(std::move(fd)), _input_buffer_size);
+            socket_address peer;
+            peer.u.sa.sa_family = AF_UNIX;
+            return make_ready_future<connected_socket, socket_address>(connected_socket(std::move(impl)), peer);
+        });
+    }
+    void abort_accept() override
+    {
+        _fd.abort_reader(std::make_exception_ptr(std::system_error(ECONNABORTED, std::system_category())));
+    }
+};
+}
+
+file_desc bind_unix_socket(const sstring& path, mode_t perm, int backlog)
+{
+    ::sockaddr_un sa {};
+    if (path.empty() || path.size() >= sizeof(sa.sun_path)) {
+        throw std::invalid_argument("bad unix socket path: " + std::string(path.c_str()));
+    }
+    sa.sun_family = AF_UNIX;
+    std::memcpy(sa.sun_path, path.c_str(), path.size() + 1);
+    // only a socket is replaced, not a file the path names by mistake.
+    struct ::stat st;
+    if (::stat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+        ::unlink(path.c_str());
+    }
+    auto fd = file_desc::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    fd.bind(reinterpret_cast<::sockaddr&>(sa), sizeof(sa));
+    if (perm != 0 && ::chmod(path.c_str(), perm) != 0) {
+        throw std::system_error(errno, std::system_category(), "chmod " + std::string(path.c_str()));
+    }
+    fd.listen(backlog);
+    return fd;
+}
+
+server_socket listen_unix_socket(const file_desc& socket, size_t input_buffer_size)
+{
+    return server_socket(std::make_unique<unix_server_socket_impl>(socket.dup(), input_buffer_size));
+}
+}
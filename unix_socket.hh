@@ -0,0 +1,42 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#pragma once
+#pragma once
+#include <sys/stat.h>
+#include "core/posix.hh"
+#include "core/sstring.hh"
+#include "net/api.hh"
+namespace redis {
+using namespace seastar;
+
+// Binds the AF_UNIX socket of the path and listens on it, replacing the
+// socket file an earlier run left there. The file gets the permissions
+// `perm` unless it is 0.
+file_desc bind_unix_socket(const sstring& path, mode_t perm, int backlog = 1024);
+
+// Accepts the connections to the socket on this shard, from its own
+// duplicate of it: every shard accepts from the same socket, as the network
+// stacks of seastar only listen on IP addresses. The connections have no
+// Nagle nor keepalive to set, and an unnamed peer of family AF_UNIX. A
+// connection reads into buffers of input_buffer_size, allocated once data
+// is there, so that an idle one holds none.
+server_socket listen_unix_socket(const file_desc& socket, size_t input_buffer_size = 8192);
+}
@@ -41,7 +41,11 @@
 
 #pragma once
 
-#include "exceptions/exceptions.hh"
+#include <cassert>
+#include <stdexcept>
+#include <vector>
+#include "core/sstring.hh"
+#include "core/print.hh"
 
 namespace utils {
 
@@ -103,7 +107,7 @@ namespace bloom_calculations {
      * @param max_false_pos_prob The maximum tolerable false positive rate.
      * @return A Bloom Specification which would result in a false positive rate
      * less than specified by the function call
-     * @throws unsupported_operation_exception if a filter satisfying the parameters cannot be met
+     * @throws std::invalid_argument if a filter satisfying the parameters cannot be met
      */
     inline bloom_specification compute_bloom_spec(int max_buckets_per_element, double max_false_pos_prob) {
         assert(max_buckets_per_element >= 1);
@@ -117,7 +121,7 @@ namespace bloom_calculations {
         }
 
         if (max_false_pos_prob < probs[max_buckets_per_element][max_k]) {
-            throw exceptions::unsupported_operation_exception(sprint("Unable to satisfy %f with %d buckets per element", max_false_pos_prob, max_buckets_per_element));
+            throw std::invalid_argument(sprint("Unable to satisfy %f with %d buckets per element", max_false_pos_prob, max_buckets_per_element));
         }
 
         // First find the minimal required number of buckets:
@@ -149,7 +153,7 @@ namespace bloom_calculations {
         v = v / num_elements;
 
         if (v < 1.0) {
-            throw exceptions::unsupported_operation_exception(sprint("Cannot compute probabilities for %ld elements.", num_elements));
+            throw std::invalid_argument(sprint("Cannot compute probabilities for %ld elements.", num_elements));
         }
         return std::min(probs.size() - 1, size_t(v));
     }
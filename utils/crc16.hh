@@ -0,0 +1,48 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#pragma once
+#include <array>
+#include <cstddef>
+#include <cstdint>
+namespace utils {
+
+// CRC16-CCITT (XMODEM), as Redis Cluster hashes keys to slots.
+inline uint16_t crc16(const char* data, size_t size)
+{
+    static const std::array<uint16_t, 256> table = [] {
+        std::array<uint16_t, 256> t;
+        for (unsigned i = 0; i < t.size(); ++i) {
+            uint16_t crc = i << 8;
+            for (int k = 0; k < 8; ++k) {
+                crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+            }
+            t[i] = crc;
+        }
+        return t;
+    }();
+    uint16_t crc = 0;
+    for (size_t i = 0; i < size; ++i) {
+        crc = (crc << 8) ^ table[((crc >> 8) ^ static_cast<uint8_t>(data[i])) & 0xff];
+    }
+    return crc;
+}
+
+}
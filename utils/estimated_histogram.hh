@@ -41,6 +41,7 @@
 
 #pragma once
 
+#include <cassert>
 #include <cmath>
 #include <algorithm>
 #include <vector>
@@ -165,14 +166,33 @@ public:
      * @param n
      */
     void add(int64_t n) {
+        buckets.at(bucket_of(n))++;
+        _count++;
+    }
+
+    /**
+     * @return the bucket add(n) increments
+     */
+    size_t bucket_of(int64_t n) const {
         auto low = std::lower_bound(bucket_offsets.begin(), bucket_offsets.end(), n);
         if (low == bucket_offsets.end()) {
             low--;
         }
-        auto pos = std::distance(bucket_offsets.begin(), low);
-        buckets.at(pos)++;
+        return std::distance(bucket_offsets.begin(), low);
+    }
+
+    /**
+     * Counts a value in the bucket, as given by bucket_of(), or takes one
+     * back, so that the histogram follows values which change over time.
+     */
+    void add_to_bucket(size_t bucket) {
+        buckets.at(bucket)++;
         _count++;
     }
+    void remove_from_bucket(size_t bucket) {
+        buckets.at(bucket)--;
+        _count--;
+    }
 
     /**
      * Increments the count of the bucket closest to n, rounding UP.
@@ -230,6 +250,27 @@ public:
         return 0;
     }
 
+    /**
+     * @return estimated value at given percentile, the largest bucket offset
+     *         when the histogram overflowed
+     */
+    int64_t percentile(double p) const {
+        assert(p >= 0 && p <= 1.0);
+        auto last_bucket = buckets.size() - 1;
+        int64_t pcount = int64_t(std::floor(_count * p));
+        if (pcount == 0) {
+            return 0;
+        }
+        int64_t elements = 0;
+        for (size_t i = 0; i < last_bucket; i++) {
+            elements += buckets[i];
+            if (elements >= pcount) {
+                return bucket_offsets[i];
+            }
+        }
+        return bucket_offsets.back();
+    }
+
     /**
      * merge a histogram to the current one.
      */
@@ -242,6 +283,7 @@ public:
         for (auto p: b.buckets) {
             buckets[i++] += p;
         }
+        _count += b._count;
         return *this;
     }
 
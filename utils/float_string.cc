@@ -0,0 +1,379 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#include "utils/float_string.hh"
+#include <cerrno>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <string>
+namespace redis {
+
+namespace {
+
+// The powers of ten exactly representable as doubles.
+const double exact_powers[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+bool parse_slow(const char* s, size_t size, double& value)
+{
+    char buffer[128];
+    std::string copy;
+    const char* text = buffer;
+    if (size < sizeof(buffer)) {
+        std::memcpy(buffer, s, size);
+        buffer[size] = '\0';
+    }
+    else {
+        copy.assign(s, size);
+        text = copy.c_str();
+    }
+    char* end = nullptr;
+    errno = 0;
+    value = std::strtod(text, &end);
+    if (end != text + size || std::isnan(value)) {
+        return false;
+    }
+    // Out of range like Redis: what overflows to inf or underflows to zero.
+    return errno != ERANGE || (!std::isinf(value) && value != 0);
+}
+
+// A floating point number f * 2^e with a 64-bit significand, after Grisu
+// (Loitsch, "Printing floating-point numbers quickly and accurately with
+// integers").
+struct diy_fp {
+    uint64_t f;
+    int e;
+
+    diy_fp(uint64_t f, int e) : f(f), e(e) {}
+    diy_fp operator - (const diy_fp& o) const
+    {
+        return diy_fp(f - o.f, e);
+    }
+    // The product, its significand rounded to the upper 64 bits.
+    diy_fp operator * (const diy_fp& o) const
+    {
+        auto p = static_cast<unsigned __int128>(f) * o.f;
+        auto h = static_cast<uint64_t>(p >> 64);
+        h += static_cast<uint64_t>(p) >> 63;
+        return diy_fp(h, e + o.e + 64);
+    }
+    diy_fp normalize() const
+    {
+        auto shift = __builtin_clzll(f);
+        return diy_fp(f << shift, e - shift);
+    }
+};
+
+constexpr uint64_t hidden_bit = uint64_t(1) << 52;
+constexpr uint64_t fraction_mask = hidden_bit - 1;
+
+// 10^k normalized, for k = -348 + 8 * i.
+const struct { uint64_t f; int e; } cached_powers[] = {
+    { 0xfa8fd5a0081c0288, -1220 }, { 0xbaaee17fa23ebf76, -1193 }, { 0x8b16fb203055ac76, -1166 },
+    { 0xcf42894a5dce35ea, -1140 }, { 0x9a6bb0aa55653b2d, -1113 }, { 0xe61acf033d1a45df, -1087 },
+    { 0xab70fe17c79ac6ca, -1060 }, { 0xff77b1fcbebcdc4f, -1034 }, { 0xbe5691ef416bd60c, -1007 },
+    { 0x8dd01fad907ffc3c, -980 }, { 0xd3515c2831559a83, -954 }, { 0x9d71ac8fada6c9b5, -927 },
+    { 0xea9c227723ee8bcb, -901 }, { 0xaecc49914078536d, -874 }, { 0x823c12795db6ce57, -847 },
+    { 0xc21094364dfb5637, -821 }, { 0x9096ea6f3848984f, -794 }, { 0xd77485cb25823ac7, -768 },
+    { 0xa086cfcd97bf97f4, -741 }, { 0xef340a98172aace5, -715 }, { 0xb23867fb2a35b28e, -688 },
+    { 0x84c8d4dfd2c63f3b, -661 }, { 0xc5dd44271ad3cdba, -635 }, { 0x936b9fcebb25c996, -608 },
+    { 0xdbac6c247d62a584, -582 }, { 0xa3ab66580d5fdaf6, -555 }, { 0xf3e2f893dec3f126, -529 },
+    { 0xb5b5ada8aaff80b8, -502 }, { 0x87625f056c7c4a8b, -475 }, { 0xc9bcff6034c13053, -449 },
+    { 0x964e858c91ba2655, -422 }, { 0xdff9772470297ebd, -396 }, { 0xa6dfbd9fb8e5b88f, -369 },
+    { 0xf8a95fcf88747d94, -343 }, { 0xb94470938fa89bcf, -316 }, { 0x8a08f0f8bf0f156b, -289 },
+    { 0xcdb02555653131b6, -263 }, { 0x993fe2c6d07b7fac, -236 }, { 0xe45c10c42a2b3b06, -210 },
+    { 0xaa242499697392d3, -183 }, { 0xfd87b5f28300ca0e, -157 }, { 0xbce5086492111aeb, -130 },
+    { 0x8cbccc096f5088cc, -103 }, { 0xd1b71758e219652c, -77 }, { 0x9c40000000000000, -50 },
+    { 0xe8d4a51000000000, -24 }, { 0xad78ebc5ac620000, 3 }, { 0x813f3978f8940984, 30 },
+    { 0xc097ce7bc90715b3, 56 }, { 0x8f7e32ce7bea5c70, 83 }, { 0xd5d238a4abe98068, 109 },
+    { 0x9f4f2726179a2245, 136 }, { 0xed63a231d4c4fb27, 162 }, { 0xb0de65388cc8ada8, 189 },
+    { 0x83c7088e1aab65db, 216 }, { 0xc45d1df942711d9a, 242 }, { 0x924d692ca61be758, 269 },
+    { 0xda01ee641a708dea, 295 }, { 0xa26da3999aef774a, 322 }, { 0xf209787bb47d6b85, 348 },
+    { 0xb454e4a179dd1877, 375 }, { 0x865b86925b9bc5c2, 402 }, { 0xc83553c5c8965d3d, 428 },
+    { 0x952ab45cfa97a0b3, 455 }, { 0xde469fbd99a05fe3, 481 }, { 0xa59bc234db398c25, 508 },
+    { 0xf6c69a72a3989f5c, 534 }, { 0xb7dcbf5354e9bece, 561 }, { 0x88fcf317f22241e2, 588 },
+    { 0xcc20ce9bd35c78a5, 614 }, { 0x98165af37b2153df, 641 }, { 0xe2a0b5dc971f303a, 667 },
+    { 0xa8d9d1535ce3b396, 694 }, { 0xfb9b7cd9a4a7443c, 720 }, { 0xbb764c4ca7a44410, 747 },
+    { 0x8bab8eefb6409c1a, 774 }, { 0xd01fef10a657842c, 800 }, { 0x9b10a4e5e9913129, 827 },
+    { 0xe7109bfba19c0c9d, 853 }, { 0xac2820d9623bf429, 880 }, { 0x80444b5e7aa7cf85, 907 },
+    { 0xbf21e44003acdd2d, 933 }, { 0x8e679c2f5e44ff8f, 960 }, { 0xd433179d9c8cb841, 986 },
+    { 0x9e19db92b4e31ba9, 1013 }, { 0xeb96bf6ebadf77d9, 1039 }, { 0xaf87023b9bf0ee6b, 1066 },
+};
+
+const uint32_t powers_of_10[] = {
+    1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000
+};
+
+// The cached power c with w.e + c.e + 64 in [-60, -32], and its decimal
+// exponent as -k.
+diy_fp cached_power(int e, int& k)
+{
+    double dk = (-61 - e) * 0.30102999566398114 + 347;
+    int ik = static_cast<int>(dk);
+    if (dk - ik > 0.0) {
+        ++ik;
+    }
+    unsigned index = static_cast<unsigned>((ik >> 3) + 1);
+    k = -(-348 + static_cast<int>(index << 3));
+    return diy_fp(cached_powers[index].f, cached_powers[index].e);
+}
+
+void round_weed(char* digits, int size, uint64_t delta, uint64_t rest, uint64_t ten_kappa, uint64_t distance)
+{
+    while (rest < distance && delta - rest >= ten_kappa
+           && (rest + ten_kappa < distance || distance - rest > rest + ten_kappa - distance)) {
+        digits[size - 1]--;
+        rest += ten_kappa;
+    }
+}
+
+int count_digits(uint32_t n)
+{
+    int d = 1;
+    while (d < 10 && n >= powers_of_10[d]) {
+        ++d;
+    }
+    return d;
+}
+
+// Generates the digits of w as few as can be told apart from the values
+// out of [w - delta, w] scaled by the cached power, appending to k the
+// exponent of the last.
+int generate_digits(const diy_fp& w, const diy_fp& upper, uint64_t delta, char* digits, int& k)
+{
+    const diy_fp one(uint64_t(1) << -upper.e, upper.e);
+    const uint64_t distance = (upper - w).f;
+    auto p1 = static_cast<uint32_t>(upper.f >> -one.e);
+    uint64_t p2 = upper.f & (one.f - 1);
+    int kappa = count_digits(p1);
+    int size = 0;
+    while (kappa > 0) {
+        auto divisor = powers_of_10[kappa - 1];
+        auto d = p1 / divisor;
+        p1 %= divisor;
+        if (d || size) {
+            digits[size++] = static_cast<char>('0' + d);
+        }
+        --kappa;
+        uint64_t rest = (static_cast<uint64_t>(p1) << -one.e) + p2;
+        if (rest <= delta) {
+            k += kappa;
+            round_weed(digits, size, delta, rest, static_cast<uint64_t>(powers_of_10[kappa]) << -one.e, distance);
+            return size;
+        }
+    }
+    for (;;) {
+        p2 *= 10;
+        delta *= 10;
+        auto d = static_cast<char>(p2 >> -one.e);
+        if (d || size) {
+            digits[size++] = static_cast<char>('0' + d);
+        }
+        p2 &= one.f - 1;
+        --kappa;
+        if (p2 < delta) {
+            k += kappa;
+            auto index = -kappa;
+            round_weed(digits, size, delta, p2, one.f, distance * (index < 10 ? powers_of_10[index] : 0));
+            return size;
+        }
+    }
+}
+
+// Grisu2: the digits of a positive finite value, which reads back as
+// value, and the shortest for all but a few.
+int grisu2(double value, char* digits, int& k)
+{
+    uint64_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    auto biased_e = static_cast<int>((bits >> 52) & 0x7ff);
+    uint64_t fraction = bits & fraction_mask;
+    diy_fp v = biased_e != 0 ? diy_fp(fraction + hidden_bit, biased_e - 1075) : diy_fp(fraction, -1074);
+
+    // The boundaries halfway to the neighbours of v, on the same exponent.
+    diy_fp upper((v.f << 1) + 1, v.e - 1);
+    while (!(upper.f & (hidden_bit << 1))) {
+        upper.f <<= 1;
+        upper.e--;
+    }
+    upper.f <<= 10;
+    upper.e -= 10;
+    diy_fp lower = v.f == hidden_bit ? diy_fp((v.f << 2) - 1, v.e - 2) : diy_fp((v.f << 1) - 1, v.e - 1);
+    lower.f <<= lower.e - upper.e;
+    lower.e = upper.e;
+
+    auto c = cached_power(upper.e, k);
+    auto w = v.normalize() * c;
+    auto w_upper = upper * c;
+    auto w_lower = lower * c;
+    w_lower.f++;
+    w_upper.f--;
+    return generate_digits(w, w_upper, w_upper.f - w_lower.f, digits, k);
+}
+
+char* write_exponent(int e, char* out)
+{
+    *out++ = 'e';
+    if (e < 0) {
+        *out++ = '-';
+        e = -e;
+    }
+    else {
+        *out++ = '+';
+    }
+    if (e >= 100) {
+        *out++ = static_cast<char>('0' + e / 100);
+        e %= 100;
+    }
+    *out++ = static_cast<char>('0' + e / 10);
+    *out++ = static_cast<char>('0' + e % 10);
+    return out;
+}
+
+}
+
+bool parse_float_string(const char* s, size_t size, double& value)
+{
+    if (size == 0) {
+        return false;
+    }
+    size_t i = 0;
+    bool negative = false;
+    if (s[i] == '-' || s[i] == '+') {
+        negative = s[i] == '-';
+        ++i;
+    }
+    uint64_t mantissa = 0;
+    int digits = 0;
+    int exponent = 0;
+    bool any = false;
+    for (; i < size && s[i] >= '0' && s[i] <= '9'; ++i) {
+        any = true;
+        if (mantissa != 0 || s[i] != '0') {
+            mantissa = mantissa * 10 + static_cast<uint64_t>(s[i] - '0');
+            ++digits;
+        }
+    }
+    if (i < size && s[i] == '.') {
+        for (++i; i < size && s[i] >= '0' && s[i] <= '9'; ++i) {
+            any = true;
+            if (mantissa != 0 || s[i] != '0') {
+                mantissa = mantissa * 10 + static_cast<uint64_t>(s[i] - '0');
+                ++digits;
+            }
+            --exponent;
+        }
+    }
+    if (any && i < size && (s[i] == 'e' || s[i] == 'E')) {
+        size_t j = i + 1;
+        bool negative_exponent = false;
+        if (j < size && (s[j] == '-' || s[j] == '+')) {
+            negative_exponent = s[j] == '-';
+            ++j;
+        }
+        int e = 0;
+        size_t first = j;
+        for (; j < size && s[j] >= '0' && s[j] <= '9' && e < 10000; ++j) {
+            e = e * 10 + (s[j] - '0');
+        }
+        if (j == first) {
+            return false;
+        }
+        exponent += negative_exponent ? -e : e;
+        i = j;
+    }
+    // Clinger's fast path: an exact mantissa times or over an exact power
+    // of ten is rounded once.
+    if (any && i == size && digits <= 19 && mantissa <= (uint64_t(1) << 53) && exponent >= -22 && exponent <= 22) {
+        double v = static_cast<double>(mantissa);
+        v = exponent < 0 ? v / exact_powers[-exponent] : v * exact_powers[exponent];
+        value = negative ? -v : v;
+        return true;
+    }
+    if (s[0] == ' ' || (s[0] >= '\t' && s[0] <= '\r')) {
+        return false;
+    }
+    return parse_slow(s, size, value);
+}
+
+size_t format_float_string(double value, char* out)
+{
+    char* p = out;
+    if (std::isnan(value)) {
+        std::memcpy(p, "nan", 3);
+        return 3;
+    }
+    if (std::signbit(value)) {
+        *p++ = '-';
+        value = -value;
+    }
+    if (std::isinf(value)) {
+        std::memcpy(p, "inf", 3);
+        return p - out + 3;
+    }
+    if (value == 0) {
+        *p++ = '0';
+        return p - out;
+    }
+    char digits[20];
+    int k = 0;
+    int size = grisu2(value, digits, k);
+    // The exponent of the first digit, which "%.17g" writes in scientific
+    // notation below -4 or from 17.
+    int exponent = size + k - 1;
+    if (exponent < -4 || exponent >= 17) {
+        *p++ = digits[0];
+        if (size > 1) {
+            *p++ = '.';
+            std::memcpy(p, digits + 1, size - 1);
+            p += size - 1;
+        }
+        p = write_exponent(exponent, p);
+    }
+    else if (k >= 0) {
+        std::memcpy(p, digits, size);
+        p += size;
+        std::memset(p, '0', k);
+        p += k;
+    }
+    else if (exponent >= 0) {
+        std::memcpy(p, digits, exponent + 1);
+        p += exponent + 1;
+        *p++ = '.';
+        std::memcpy(p, digits + exponent + 1, size - exponent - 1);
+        p += size - exponent - 1;
+    }
+    else {
+        *p++ = '0';
+        *p++ = '.';
+        std::memset(p, '0', -exponent - 1);
+        p += -exponent - 1;
+        std::memcpy(p, digits, size);
+        p += size;
+    }
+    return p - out;
+}
+
+}
@@ -0,0 +1,39 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#pragma once
+#include <cstddef>
+namespace redis {
+
+// The longest double format_float_string writes, "-1.2345678901234567e-308".
+static constexpr size_t max_float_string = 24;
+
+// Parses s as Redis reads strings as doubles: the whole of it, without
+// leading spaces, "inf" and "-inf" included but not "nan". Decimals of at
+// most 19 significant digits and exponents small enough to be exact are
+// computed inline; the others go through strtod.
+bool parse_float_string(const char* s, size_t size, double& value);
+
+// Writes the shortest decimal digits reading back as value to out, which
+// has room for max_float_string characters, laid out as "%.17g" would lay
+// them out, and returns how many it wrote.
+size_t format_float_string(double value, char* out);
+
+}
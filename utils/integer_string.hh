@@ -0,0 +1,95 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+namespace redis {
+
+// The longest decimal int64, "-9223372036854775808".
+static constexpr size_t max_integer_string = 20;
+
+// Parses s as Redis reads strings as integers: an optional minus sign and
+// digits without leading zeros, in the range of int64. "+1", "01", "-0"
+// and " 1" are not integers, so that the string formats back to itself.
+inline bool parse_integer_string(const char* s, size_t size, int64_t& value)
+{
+    if (size == 0 || size > max_integer_string) {
+        return false;
+    }
+    if (size == 1 && s[0] == '0') {
+        value = 0;
+        return true;
+    }
+    bool negative = s[0] == '-';
+    size_t i = negative ? 1 : 0;
+    if (i == size || s[i] < '1' || s[i] > '9') {
+        return false;
+    }
+    uint64_t v = 0;
+    for (; i < size; ++i) {
+        if (s[i] < '0' || s[i] > '9') {
+            return false;
+        }
+        auto digit = static_cast<uint64_t>(s[i] - '0');
+        if (v > (std::numeric_limits<uint64_t>::max() - digit) / 10) {
+            return false;
+        }
+        v = v * 10 + digit;
+    }
+    auto limit = static_cast<uint64_t>(std::numeric_limits<int64_t>::max());
+    if (negative) {
+        if (v > limit + 1) {
+            return false;
+        }
+        value = static_cast<int64_t>(0 - v);
+    }
+    else {
+        if (v > limit) {
+            return false;
+        }
+        value = static_cast<int64_t>(v);
+    }
+    return true;
+}
+
+// Writes the decimal digits of value to out, which has room for
+// max_integer_string characters, and returns how many it wrote.
+inline size_t format_integer_string(int64_t value, char* out)
+{
+    char digits[max_integer_string];
+    size_t n = 0;
+    auto v = value < 0 ? 0 - static_cast<uint64_t>(value) : static_cast<uint64_t>(value);
+    do {
+        digits[n++] = static_cast<char>('0' + v % 10);
+        v /= 10;
+    } while (v != 0);
+    size_t size = 0;
+    if (value < 0) {
+        out[size++] = '-';
+    }
+    while (n > 0) {
+        out[size++] = digits[--n];
+    }
+    return size;
+}
+
+}
@@ -0,0 +1,160 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#pragma once
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include "core/metrics_types.hh"
+namespace utils {
+
+// Internal operations which may hold the reactor, or the replies waiting on
+// them, for long.
+enum class latency_event {
+    rehash,
+    expire_cycle,
+    lsa_reclaim,
+    commit_log_write,
+    commit_log_sync,
+    // keep it last.
+    count,
+};
+
+// The name LATENCY replies, in the manner of the events of Redis.
+inline const char* latency_event_name(latency_event e)
+{
+    switch (e) {
+    case latency_event::rehash: return "rehash";
+    case latency_event::expire_cycle: return "expire-cycle";
+    case latency_event::lsa_reclaim: return "lsa-reclaim";
+    case latency_event::commit_log_write: return "commit-log-write";
+    case latency_event::commit_log_sync: return "commit-log-sync";
+    default: return nullptr;
+    }
+}
+
+// The durations of the internal events of one shard, as the latency monitor
+// of Redis: every duration goes to a histogram, and those of at least the
+// threshold to a history of the last samples, one per second (the largest).
+// Recording allocates nothing, since the LSA reclaimer records too.
+class latency_monitor {
+public:
+    static constexpr size_t history_size = 160;
+    // Bucket i counts durations below 2^i microseconds, the last one the rest.
+    static constexpr size_t histogram_buckets = 24;
+    static constexpr size_t events = static_cast<size_t>(latency_event::count);
+    struct sample {
+        int64_t _time = 0;
+        uint32_t _latency_ms = 0;
+    };
+    struct event_state {
+        std::array<sample, history_size> _history {};
+        // Samples since the last reset, the next one goes to
+        // _samples % history_size.
+        size_t _samples = 0;
+        uint32_t _max_ms = 0;
+        std::array<uint64_t, histogram_buckets> _buckets {};
+        uint64_t _count = 0;
+
+        const sample* latest() const
+        {
+            return _samples ? &_history[(_samples - 1) % history_size] : nullptr;
+        }
+    };
+private:
+    // 0 keeps no history, only the histograms.
+    uint32_t _threshold_ms = 0;
+    std::array<event_state, events> _events {};
+public:
+    void set_threshold(uint32_t ms) { _threshold_ms = ms; }
+    uint32_t threshold() const { return _threshold_ms; }
+
+    void record(latency_event e, std::chrono::steady_clock::duration d) noexcept
+    {
+        auto& s = _events[static_cast<size_t>(e)];
+        auto us = std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+        size_t bucket = 0;
+        while (bucket + 1 < histogram_buckets && (int64_t(1) << bucket) <= us) {
+            ++bucket;
+        }
+        ++s._buckets[bucket];
+        ++s._count;
+        auto ms = static_cast<uint32_t>(us / 1000);
+        if (_threshold_ms == 0 || ms < _threshold_ms) {
+            return;
+        }
+        auto now = static_cast<int64_t>(std::time(nullptr));
+        s._max_ms = std::max(s._max_ms, ms);
+        auto last = s.latest();
+        if (last && last->_time == now) {
+            s._history[(s._samples - 1) % history_size]._latency_ms = std::max(last->_latency_ms, ms);
+            return;
+        }
+        s._history[s._samples++ % history_size] = sample { now, ms };
+    }
+
+    const event_state& of(latency_event e) const { return _events[static_cast<size_t>(e)]; }
+    const std::array<event_state, events>& all() const { return _events; }
+
+    // Drops the history of the event, the histogram is kept as counters are.
+    void reset(latency_event e)
+    {
+        auto& s = _events[static_cast<size_t>(e)];
+        s._samples = 0;
+        s._max_ms = 0;
+    }
+
+    seastar::metrics::histogram histogram(latency_event e) const
+    {
+        auto& s = of(e);
+        seastar::metrics::histogram h;
+        h.sample_count = s._count;
+        h.buckets.resize(histogram_buckets);
+        for (size_t i = 0; i < histogram_buckets; ++i) {
+            h.buckets[i].upper_bound = double(uint64_t(1) << i);
+            h.buckets[i].count = s._buckets[i];
+        }
+        return h;
+    }
+};
+
+inline latency_monitor& local_latency_monitor()
+{
+    static thread_local latency_monitor monitor;
+    return monitor;
+}
+
+// Records the time from its construction to its destruction.
+class latency_timer {
+    latency_event _event;
+    std::chrono::steady_clock::time_point _start;
+public:
+    explicit latency_timer(latency_event e) : _event(e), _start(std::chrono::steady_clock::now()) {}
+    ~latency_timer()
+    {
+        local_latency_monitor().record(_event, std::chrono::steady_clock::now() - _start);
+    }
+    latency_timer(const latency_timer&) = delete;
+    latency_timer& operator = (const latency_timer&) = delete;
+};
+
+}
@@ -28,6 +28,7 @@
 #include <boost/intrusive/slist.hpp>
 #include <boost/range/adaptors.hpp>
 #include <stack>
+#include <cstring>
 
 #include <seastar/core/memory.hh>
 #include <seastar/core/align.hh>
@@ -38,6 +39,7 @@
 #include "log.hh"
 #include "utils/dynamic_bitset.hh"
 #include "utils/log_histogram.hh"
+#include "utils/latency_monitor.hh"
 
 namespace bi = boost::intrusive;
 
@@ -85,7 +87,15 @@ class tracker::impl {
     bool _reclaiming_enabled = true;
     size_t _reclamation_step = 1;
     bool _abort_on_bad_alloc = false;
+public:
+    // Reclamation cycles run for the allocator or by an explicit request,
+    // and the time they took: the allocation they serve waits as long.
+    struct reclaim_stats {
+        uint64_t _cycles = 0;
+        clock::duration _time = clock::duration::zero();
+    };
 private:
+    reclaim_stats _reclaim_stats;
     // Prevents tracker's reclaimer from running while live. Reclaimer may be
     // invoked synchronously with allocator. This guard ensures that this
     // object is not re-entered while inside one of the tracker's methods.
@@ -114,12 +124,14 @@ public:
     size_t compact_and_evict_locked(size_t bytes);
     void full_compaction();
     void reclaim_all_free_segments();
+    size_t prefault_segments(size_t count);
     occupancy_stats region_occupancy();
     occupancy_stats occupancy();
     void set_reclamation_step(size_t step_in_segments) { _reclamation_step = step_in_segments; }
     size_t reclamation_step() const { return _reclamation_step; }
     void enable_abort_on_bad_alloc() { _abort_on_bad_alloc = true; }
     bool should_abort_on_bad_alloc() const { return _abort_on_bad_alloc; }
+    reclaim_stats& reclaim_statistics() { return _reclaim_stats; }
 };
 
 class tracker_reclaimer_lock {
@@ -160,6 +172,10 @@ void tracker::reclaim_all_free_segments() {
     return _impl->reclaim_all_free_segments();
 }
 
+size_t tracker::prefault_segments(size_t count) {
+    return _impl->prefault_segments(count);
+}
+
 tracker& shard_tracker() {
     return tracker_instance;
 }
@@ -518,10 +534,13 @@ public:
     void reclaim_all_free_segments() {
         reclaim_segments(std::numeric_limits<size_t>::max());
     }
+    size_t prefault_segments(size_t count);
 
     struct stats {
         size_t segments_migrated;
         size_t segments_compacted;
+        // Bytes of live objects moved by compaction.
+        size_t memory_compacted;
     };
 private:
     stats _stats{};
@@ -529,7 +548,10 @@ public:
     size_t zone_count() const { return _all_zones.size(); }
     const stats& statistics() const { return _stats; }
     void on_segment_migration() { _stats.segments_migrated++; }
-    void on_segment_compaction() { _stats.segments_compacted++; }
+    void on_segment_compaction(size_t used) {
+        _stats.segments_compacted++;
+        _stats.memory_compacted += used;
+    }
     size_t free_segments_in_zones() const { return _free_segments_in_zones; }
     size_t free_segments() const { return _free_segments_in_zones + _emergency_reserve.size(); }
 };
@@ -667,6 +689,23 @@ void segment_pool::deallocate_segment(segment* seg)
     _free_segments_in_zones++;
 }
 
+size_t segment_pool::prefault_segments(size_t count) {
+    std::vector<segment*> segments;
+    segments.reserve(count);
+    while (segments.size() < count) {
+        auto seg = allocate_segment();
+        if (!seg) {
+            break;
+        }
+        segments.push_back(seg);
+    }
+    for (auto seg : segments) {
+        std::memset(seg->data, 0, segment::size);
+        deallocate_segment(seg);
+    }
+    return segments.size();
+}
+
 void segment_pool::refill_emergency_reserve() {
     while (_emergency_reserve.size() < _emergency_reserve_max) {
         auto seg = allocate_segment();
@@ -854,10 +893,13 @@ public:
     }
     size_t reclaim_segments(size_t target) { return 0; }
     void reclaim_all_free_segments() { }
+    size_t prefault_segments(size_t count) { return 0; }
 
     struct stats {
         size_t segments_migrated;
         size_t segments_compacted;
+        // Bytes of live objects moved by compaction.
+        size_t memory_compacted;
     };
 private:
     stats _stats{};
@@ -865,7 +907,10 @@ public:
     size_t zone_count() const { return 0; }
     const stats& statistics() const { return _stats; }
     void on_segment_migration() { _stats.segments_migrated++; }
-    void on_segment_compaction() { _stats.segments_compacted++; }
+    void on_segment_compaction(size_t used) {
+        _stats.segments_compacted++;
+        _stats.memory_compacted += used;
+    }
     size_t free_segments_in_zones() const { return 0; }
     size_t free_segments() const { return 0; }
 public:
@@ -1421,9 +1466,10 @@ public:
         _segment_descs.pop_one_of_largest();
         _closed_occupancy -= desc.occupancy();
         segment* seg = shard_segment_pool.segment_from(desc);
+        auto used = desc.occupancy().used_space();
         llogger.debug("Compacting segment {} from region {}, {}", seg, id(), seg->occupancy());
         compact(seg, desc);
-        shard_segment_pool.on_segment_compaction();
+        shard_segment_pool.on_segment_compaction(used);
     }
 
     // Compacts a single segment
@@ -1679,6 +1725,13 @@ occupancy_stats tracker::impl::occupancy() {
     return occ;
 }
 
+size_t tracker::impl::prefault_segments(size_t count)
+{
+    auto reserved = shard_segment_pool.prefault_segments(count);
+    llogger.debug("Prefaulted {} segments", reserved);
+    return reserved;
+}
+
 void tracker::impl::reclaim_all_free_segments()
 {
     llogger.debug("Reclaiming all free segments");
@@ -1729,20 +1782,20 @@ static void reclaim_from_evictable(region::impl& r, size_t target_mem_in_use) {
     }
 }
 
+// Always timed: the duration goes to the reclaim statistics of the tracker.
 struct reclaim_timer {
+    tracker::impl::reclaim_stats& stats;
     clock::time_point start;
     bool enabled;
-    reclaim_timer() {
-        if (timing_logger.is_enabled(logging::log_level::debug)) {
-            start = clock::now();
-            enabled = true;
-        } else {
-            enabled = false;
-        }
+    reclaim_timer(tracker::impl::reclaim_stats& s) : stats(s), start(clock::now()) {
+        enabled = timing_logger.is_enabled(logging::log_level::debug);
     }
     ~reclaim_timer() {
+        auto duration = clock::now() - start;
+        ++stats._cycles;
+        stats._time += duration;
+        utils::local_latency_monitor().record(utils::latency_event::lsa_reclaim, duration);
         if (enabled) {
-            auto duration = clock::now() - start;
             timing_logger.debug("Reclamation cycle took {} us.",
                 std::chrono::duration_cast<std::chrono::duration<double, std::micro>>(duration).count());
         }
@@ -1802,7 +1855,7 @@ size_t tracker::impl::reclaim(size_t memory_to_release) {
         return 0;
     }
     reclaiming_lock rl(*this);
-    reclaim_timer timing_guard;
+    reclaim_timer timing_guard(_reclaim_stats);
 
     size_t mem_released;
     {
@@ -1823,7 +1876,7 @@ size_t tracker::impl::compact_and_evict(size_t memory_to_release) {
         return 0;
     }
     reclaiming_lock rl(*this);
-    reclaim_timer timing_guard;
+    reclaim_timer timing_guard(_reclaim_stats);
     return compact_and_evict_locked(memory_to_release);
 }
 
@@ -2020,6 +2073,9 @@ tracker::impl::impl() {
         sm::make_gauge("free_space_in_zones", [this] { return shard_segment_pool.free_segments_in_zones() * segment_size; },
                        sm::description("Holds a current amount of free memory in zones.")),
 
+        sm::make_gauge("free_space_bytes", [this] { return region_occupancy().free_space(); },
+                       sm::description("Holds a current amount of free memory in the segments of regions.")),
+
         sm::make_gauge("occupancy", [this] { return region_occupancy().used_fraction() * 100; },
                        sm::description("Holds a current portion (in percents) of the used memory.")),
 
@@ -2031,6 +2087,15 @@ tracker::impl::impl() {
 
         sm::make_derive("segments_compacted", [this] { return shard_segment_pool.statistics().segments_compacted; },
                         sm::description("Counts a number of compacted segments.")),
+
+        sm::make_derive("memory_compacted", [this] { return shard_segment_pool.statistics().memory_compacted; },
+                        sm::description("Counts a number of bytes of live objects moved by compaction.")),
+
+        sm::make_derive("reclaims", [this] { return _reclaim_stats._cycles; },
+                        sm::description("Counts a number of reclamation cycles.")),
+
+        sm::make_derive("reclaim_time_us", [this] { return std::chrono::duration_cast<std::chrono::microseconds>(_reclaim_stats._time).count(); },
+                        sm::description("Counts microseconds spent in reclamation cycles, which the allocation waiting for them stalls for.")),
     });
 }
 
@@ -449,6 +449,11 @@ public:
 
     void reclaim_all_free_segments();
 
+    // Takes up to `count` segments from the allocator and writes them, so
+    // that their pages are faulted in before any region needs them, then
+    // leaves them free in the pool. Returns the segments so reserved.
+    size_t prefault_segments(size_t count);
+
     // Returns aggregate statistics for all pools.
     occupancy_stats region_occupancy();
 
@@ -39,8 +39,11 @@ managed_bytes::do_linearize() const {
     if (i == lc._state.end()) {
         auto data = std::unique_ptr<bytes_view::value_type[]>(new bytes_view::value_type[b->size]);
         auto e = data.get();
-        while (b) {
-            e = std::copy_n(b->data, b->frag_size, e);
+        auto remaining = b->size;
+        while (b && remaining) {
+            auto n = std::min(remaining, b->frag_size);
+            e = std::copy_n(b->data, n, e);
+            remaining -= n;
             b = b->next;
         }
         i = lc._state.emplace(_u.ptr, std::move(data)).first;
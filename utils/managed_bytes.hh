@@ -23,6 +23,7 @@
 #pragma once
 
 #include <stdint.h>
+#include <algorithm>
 #include <memory>
 #include "bytes.hh"
 #include "utils/allocation_strategy.hh"
@@ -75,6 +76,9 @@ struct blob_storage {
 
 // A managed version of "bytes" (can be used with LSA).
 class managed_bytes {
+public:
+    using size_type = blob_storage::size_type;
+private:
     struct linearization_context {
         unsigned _nesting = 0;
         // Map from first blob_storage address to linearized version
@@ -153,8 +157,16 @@ private:
         return a->data[index];
     }
     const bytes_view::value_type* do_linearize() const;
+    blob_storage* alloc_blob(allocation_strategy& alctr, blob_storage::ref_type* backref, size_type size, size_type frag_size) {
+        void* p = alctr.alloc(&standard_migrator<blob_storage>::object,
+            sizeof(blob_storage) + frag_size, alignof(blob_storage));
+        return new (p) blob_storage(backref, size, frag_size);
+    }
+    // Appends `n` bytes which fill(char_type* data, size_type size) writes,
+    // fragment by fragment, see append().
+    template <typename Fill>
+    void append_with(size_type n, Fill&& fill);
 public:
-    using size_type = blob_storage::size_type;
     struct initialized_later {};
 
     managed_bytes() {
@@ -252,7 +264,8 @@ public:
             offs_src += now; size_src -= now;
             offs_dst += now; size_dst -= now;
         }
-        assert(size_src == 0 && size_dst == 0);
+        // the source may have room left in its last fragment, see append().
+        assert(size_dst == 0);
     }
 
     managed_bytes(managed_bytes&& o) noexcept
@@ -298,8 +311,10 @@ public:
             auto b_data = b->data;
             auto b_remain = b->frag_size;
             b = b->next;
-            while (a_remain || b_remain) {
-                auto now = std::min(a_remain, b_remain);
+            auto s = size();
+            while (s) {
+                auto now = std::min({a_remain, b_remain, s});
+                s -= now;
                 if (bytes_view(a_data, now) != bytes_view(b_data, now)) {
                     return false;
                 }
@@ -390,6 +405,72 @@ public:
         return read_linearize();
     }
 
+    // Calls func(bytes_view) for every fragment, in order, so that large
+    // values can be read without being linearized.
+    template <typename Func>
+    void for_each_fragment(Func&& func) const {
+        if (!external()) {
+            func(bytes_view(_u.small.data, _u.small.size));
+            return;
+        }
+        auto remaining = _u.ptr->size;
+        for (const blob_storage* b = _u.ptr; b && remaining; b = b->next) {
+            auto n = std::min(remaining, b->frag_size);
+            func(bytes_view(b->data, n));
+            remaining -= n;
+        }
+    }
+
+    // Like for_each_fragment(), calling func(char_type* data, size_type size).
+    template <typename Func>
+    void for_each_mutable_fragment(Func&& func) {
+        if (!external()) {
+            func(_u.small.data, static_cast<size_type>(_u.small.size));
+            return;
+        }
+        auto remaining = _u.ptr->size;
+        for (blob_storage* b = _u.ptr; b && remaining; b = b->next) {
+            auto n = std::min(remaining, b->frag_size);
+            func(b->data, n);
+            remaining -= n;
+        }
+    }
+
+    // Appends `v`. The last fragment is reallocated twice as large, up to
+    // the largest fragment, once it has no room left, and its room filled
+    // by the appends which follow, so that a value built by small appends
+    // copies each byte a constant number of times.
+    void append(bytes_view v) {
+        append_with(v.size(), [&v] (blob_storage::char_type* data, size_type n) {
+            memcpy(data, v.data(), n);
+            v.remove_prefix(n);
+        });
+    }
+
+    // Grows the value to `size` bytes, as append() does, with zeroes.
+    void grow(size_type size) {
+        if (size > this->size()) {
+            append_with(size - this->size(), [] (blob_storage::char_type* data, size_type n) {
+                memset(data, 0, n);
+            });
+        }
+    }
+
+    // Overwrites the bytes from `offset` with `v`, which must end within
+    // the value.
+    void write(size_type offset, bytes_view v) {
+        size_type position = 0;
+        for_each_mutable_fragment([&] (blob_storage::char_type* data, size_type size) {
+            if (!v.empty() && position + size > offset) {
+                auto from = offset > position ? offset - position : 0;
+                auto n = std::min<size_t>(size - from, v.size());
+                memcpy(data + from, v.data(), n);
+                v.remove_prefix(n);
+            }
+            position += size;
+        });
+    }
+
     // Returns the amount of external memory used.
     size_t external_memory_usage() const {
         if (external()) {
@@ -408,6 +489,61 @@ public:
     friend std::result_of_t<Func()> with_linearized_managed_bytes(Func&& func);
 };
 
+template <typename Fill>
+void managed_bytes::append_with(size_type n, Fill&& fill) {
+    if (!n) {
+        return;
+    }
+    auto& alctr = current_allocator();
+    if (!external()) {
+        size_type old = _u.small.size;
+        if (old + n <= max_inline_size) {
+            fill(_u.small.data + old, n);
+            _u.small.size += n;
+            return;
+        }
+        small_blob small = _u.small;
+        auto b = alloc_blob(alctr, &_u.ptr, old, old);
+        memcpy(b->data, small.data, old);
+        _u.small.size = -1;
+    }
+    if (_linearization_context._nesting) {
+        _linearization_context.forget(_u.ptr);
+    }
+    // only the last fragment has room left, after the bytes it holds.
+    auto maxseg = max_seg(alctr);
+    blob_storage::ref_type* ref = &_u.ptr;
+    size_type before = 0;
+    while ((*ref)->next) {
+        before += (*ref)->frag_size;
+        ref = &(*ref)->next;
+    }
+    blob_storage* last = *ref;
+    size_type used = _u.ptr->size - before;
+    while (n) {
+        if (used == last->frag_size) {
+            if (last->frag_size < maxseg) {
+                auto frag_size = std::min<size_t>(maxseg, std::max<size_t>(size_t(last->frag_size) * 2, size_t(used) + n));
+                auto b = alloc_blob(alctr, ref, last->size, frag_size);
+                memcpy(b->data, last->data, used);
+                alctr.destroy(last);
+                last = b;
+            }
+            else {
+                auto b = alloc_blob(alctr, &last->next, 0, std::min<size_t>(maxseg, n));
+                ref = &last->next;
+                last = b;
+                used = 0;
+            }
+        }
+        auto now = std::min<size_type>(n, last->frag_size - used);
+        fill(last->data + used, now);
+        used += now;
+        n -= now;
+        _u.ptr->size += now;
+    }
+}
+
 // Run func() while ensuring that reads of managed_bytes objects are
 // temporarlily linearized
 template <typename Func>
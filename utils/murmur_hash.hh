@@ -40,6 +40,7 @@
 
 #include <cstdint>
 #include <array>
+#include <algorithm>
 
 #include "bytes.hh"
 
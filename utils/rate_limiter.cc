@@ -24,6 +24,7 @@
 utils::rate_limiter::rate_limiter(size_t rate)
         : _units_per_s(rate) {
     if (_units_per_s != 0) {
+        _sem.signal(_units_per_s);
         _timer.set_callback(std::bind(&rate_limiter::on_timer, this));
         _timer.arm(lowres_clock::now() + std::chrono::seconds(1),
                 std::experimental::optional<lowres_clock::duration> {
@@ -32,7 +33,15 @@ utils::rate_limiter::rate_limiter(size_t rate)
 }
 
 void utils::rate_limiter::on_timer() {
-    _sem.signal(_units_per_s - _sem.current());
+    if (_sem.current() < _units_per_s) {
+        _sem.signal(_units_per_s - _sem.current());
+    }
+}
+
+void utils::rate_limiter::set_rate(size_t rate) {
+    if (_units_per_s != 0 && rate != 0) {
+        _units_per_s = rate;
+    }
 }
 
 future<> utils::rate_limiter::reserve(size_t u) {
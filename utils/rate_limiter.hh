@@ -43,6 +43,10 @@ private:
 public:
     rate_limiter(size_t rate);
     future<> reserve(size_t u);
+    // The units per second from the next second on. A limiter without a
+    // limit keeps none, and one with a limit keeps one.
+    void set_rate(size_t rate);
+    size_t rate() const { return _units_per_s; }
 };
 
 }
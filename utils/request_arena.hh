@@ -0,0 +1,134 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+namespace utils {
+
+// A bump allocator for what one request holds until it replied, such as
+// the arguments the parser copies: nothing is freed alone, reset() drops
+// it all before the next request. The first chunk is kept from request to
+// request, so that a connection running small commands stops allocating
+// after its first one; the chunks taken past it, and those of the larger
+// allocations, are freed by reset().
+class request_arena {
+    struct chunk {
+        chunk* _next;
+        size_t _size;
+        char* data() { return reinterpret_cast<char*>(this + 1); }
+    };
+    chunk* _kept = nullptr;
+    // The chunks taken since the last reset, freed by the next one.
+    chunk* _extra = nullptr;
+    char* _next = nullptr;
+    char* _end = nullptr;
+    size_t _allocated = 0;
+
+    static chunk* new_chunk(size_t size, chunk* next)
+    {
+        auto c = static_cast<chunk*>(std::malloc(sizeof(chunk) + size));
+        if (!c) {
+            throw std::bad_alloc();
+        }
+        c->_next = next;
+        c->_size = size;
+        return c;
+    }
+    void free_extra()
+    {
+        while (_extra) {
+            auto next = _extra->_next;
+            std::free(_extra);
+            _extra = next;
+        }
+    }
+public:
+    static constexpr size_t chunk_size = 4096 - sizeof(chunk);
+
+    request_arena() noexcept {}
+    request_arena(request_arena&& o) noexcept
+        : _kept(o._kept), _extra(o._extra), _next(o._next), _end(o._end), _allocated(o._allocated)
+    {
+        o._kept = o._extra = nullptr;
+        o._next = o._end = nullptr;
+        o._allocated = 0;
+    }
+    request_arena& operator = (request_arena&& o) noexcept
+    {
+        if (this != &o) {
+            this->~request_arena();
+            new (this) request_arena(std::move(o));
+        }
+        return *this;
+    }
+    request_arena(const request_arena&) = delete;
+    request_arena& operator = (const request_arena&) = delete;
+    ~request_arena()
+    {
+        free_extra();
+        std::free(_kept);
+    }
+
+    char* allocate(size_t size, size_t align = alignof(std::max_align_t))
+    {
+        if (_next) {
+            auto p = reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(_next) + align - 1) & ~(uintptr_t(align) - 1));
+            if (p + size <= _end) {
+                _next = p + size;
+                _allocated += size;
+                return p;
+            }
+        }
+        _allocated += size;
+        if (size > chunk_size / 4) {
+            // a chunk of its own: the rest of the current one stays for
+            // the next small allocations.
+            _extra = new_chunk(size, _extra);
+            return _extra->data();
+        }
+        auto c = new_chunk(chunk_size, nullptr);
+        if (!_kept) {
+            _kept = c;
+        }
+        else {
+            c->_next = _extra;
+            _extra = c;
+        }
+        _next = c->data() + size;
+        _end = c->data() + c->_size;
+        return c->data();
+    }
+
+    // Bytes handed out since the last reset.
+    size_t allocated() const { return _allocated; }
+
+    void reset()
+    {
+        free_extra();
+        _next = _kept ? _kept->data() : nullptr;
+        _end = _kept ? _kept->data() + _kept->_size : nullptr;
+        _allocated = 0;
+    }
+};
+}
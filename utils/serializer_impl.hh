@@ -106,6 +106,15 @@ struct container_traits<std::array<T, N>> {
     void resize(std::array<T, N>& c, size_t size) {}
 };
 
+// The bytes every T takes when its serializer says, as those the IDL
+// compiler makes for final classes of integral members do, 0 otherwise.
+template<typename T, typename = void>
+struct fixed_serialized_size : std::integral_constant<size_t, 0> {};
+
+template<typename T>
+struct fixed_serialized_size<T, decltype(void(serializer<T>::fixed_size))>
+    : std::integral_constant<size_t, serializer<T>::fixed_size> {};
+
 template<bool Fast, typename T>
 struct deserialize_array_helper;
 
@@ -134,6 +143,10 @@ struct deserialize_array_helper<false, T> {
     }
     template<typename Input>
     static void skip(Input& in, size_t sz) {
+        if (fixed_serialized_size<T>::value) {
+            in.skip(sz * fixed_serialized_size<T>::value);
+            return;
+        }
         while (sz--) {
             serializer<T>::skip(in);
         }
@@ -0,0 +1,117 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+namespace utils {
+
+// The most frequent keys of a stream in bounded memory, by the Space-Saving
+// algorithm of Metwally, Agrawal and El Abbadi: a key not counted yet takes
+// the counter of the least counted one and starts from its count, so a
+// count overestimates the occurrences of its key by at most the count it
+// inherited, and any key seen more than total / capacity times is counted.
+template <typename Key, typename Hash = std::hash<Key>>
+class space_saving {
+    struct counter {
+        Key _key;
+        uint64_t _count;
+        uint64_t _error;
+    };
+    size_t _capacity;
+    std::vector<counter> _counters;
+    std::unordered_map<Key, size_t, Hash> _index;
+public:
+    explicit space_saving(size_t capacity) : _capacity(std::max<size_t>(capacity, 1)) {
+        _counters.reserve(_capacity);
+    }
+
+    // Counts one occurrence of key, returns its estimated count. Replacing
+    // the least counted key scans the counters, the capacity is meant to be
+    // small.
+    uint64_t offer(const Key& key) {
+        auto i = _index.find(key);
+        if (i != _index.end()) {
+            return ++_counters[i->second]._count;
+        }
+        if (_counters.size() < _capacity) {
+            _index.emplace(key, _counters.size());
+            _counters.push_back(counter { key, 1, 0 });
+            return 1;
+        }
+        auto min = std::min_element(_counters.begin(), _counters.end(), [] (auto& l, auto& r) {
+            return l._count < r._count;
+        });
+        _index.erase(min->_key);
+        _index.emplace(key, min - _counters.begin());
+        min->_key = key;
+        min->_error = min->_count;
+        return ++min->_count;
+    }
+
+    // Halves every count, so that the counts follow the recent occurrences.
+    // The keys whose count drops to zero are forgotten.
+    void decay() {
+        size_t n = 0;
+        for (auto& c : _counters) {
+            c._count /= 2;
+            c._error /= 2;
+            if (c._count > 0) {
+                if (&_counters[n] != &c) {
+                    _counters[n] = std::move(c);
+                }
+                ++n;
+            }
+        }
+        _counters.erase(_counters.begin() + n, _counters.end());
+        _index.clear();
+        for (size_t i = 0; i < n; ++i) {
+            _index.emplace(_counters[i]._key, i);
+        }
+    }
+
+    // The n most counted keys with their estimated counts, most counted first.
+    std::vector<std::pair<Key, uint64_t>> top(size_t n) const {
+        std::vector<std::pair<Key, uint64_t>> result;
+        result.reserve(_counters.size());
+        for (auto& c : _counters) {
+            result.emplace_back(c._key, c._count);
+        }
+        std::sort(result.begin(), result.end(), [] (auto& l, auto& r) { return l.second > r.second; });
+        if (result.size() > n) {
+            result.resize(n);
+        }
+        return result;
+    }
+
+    // The estimated count of key, 0 when it is not counted.
+    uint64_t count(const Key& key) const {
+        auto i = _index.find(key);
+        return i != _index.end() ? _counters[i->second]._count : 0;
+    }
+
+    size_t size() const { return _counters.size(); }
+    bool empty() const { return _counters.empty(); }
+};
+}
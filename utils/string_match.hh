@@ -0,0 +1,120 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#pragma once
+#include <cctype>
+#include <cstddef>
+#include <utility>
+namespace redis {
+
+// Glob-style matching as in the MATCH option of the SCAN family and KEYS:
+// `*`, `?`, `[abc]`, `[^a-z]` and `\` escapes.
+inline bool string_match(const char* pattern, size_t pattern_size, const char* s, size_t size, bool nocase = false)
+{
+    auto fold = [nocase] (char c) {
+        return nocase ? static_cast<char>(std::tolower(static_cast<unsigned char>(c))) : c;
+    };
+    while (pattern_size > 0) {
+        switch (pattern[0]) {
+        case '*':
+            while (pattern_size > 1 && pattern[1] == '*') {
+                ++pattern;
+                --pattern_size;
+            }
+            if (pattern_size == 1) {
+                return true;
+            }
+            for (; size > 0; ++s, --size) {
+                if (string_match(pattern + 1, pattern_size - 1, s, size, nocase)) {
+                    return true;
+                }
+            }
+            return false;
+        case '?':
+            if (size == 0) {
+                return false;
+            }
+            ++s;
+            --size;
+            break;
+        case '[': {
+            if (size == 0) {
+                return false;
+            }
+            ++pattern;
+            --pattern_size;
+            bool negate = pattern_size > 0 && pattern[0] == '^';
+            if (negate) {
+                ++pattern;
+                --pattern_size;
+            }
+            bool matched = false;
+            for (; pattern_size > 0 && pattern[0] != ']'; ++pattern, --pattern_size) {
+                if (pattern[0] == '\\' && pattern_size >= 2) {
+                    ++pattern;
+                    --pattern_size;
+                    matched |= pattern[0] == s[0];
+                }
+                else if (pattern_size >= 3 && pattern[1] == '-') {
+                    auto lo = fold(pattern[0]), hi = fold(pattern[2]), c = fold(s[0]);
+                    if (lo > hi) {
+                        std::swap(lo, hi);
+                    }
+                    matched |= c >= lo && c <= hi;
+                    pattern += 2;
+                    pattern_size -= 2;
+                }
+                else {
+                    matched |= fold(pattern[0]) == fold(s[0]);
+                }
+            }
+            if (pattern_size == 0) {
+                // unterminated class, the last character closes it.
+                ++pattern_size;
+                --pattern;
+            }
+            if (matched == negate) {
+                return false;
+            }
+            ++s;
+            --size;
+            break;
+        }
+        case '\\':
+            if (pattern_size >= 2) {
+                ++pattern;
+                --pattern_size;
+            }
+            // fall through
+        default:
+            if (size == 0 || fold(pattern[0]) != fold(s[0])) {
+                return false;
+            }
+            ++s;
+            --size;
+            break;
+        }
+        ++pattern;
+        --pattern_size;
+    }
+    return size == 0;
+}
+
+}
@@ -0,0 +1,221 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#pragma once
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <numeric>
+#include "core/future.hh"
+#include "core/future-util.hh"
+#include "core/timer.hh"
+namespace utils {
+
+// The work of a shard, by how long one unit of it may hold the reactor.
+enum class work_class {
+    // single-key commands, and the first chunk of a collection.
+    point,
+    // the later chunks of a large collection, and the commands over several
+    // collections: the set algebra and the stores.
+    heavy,
+    // expiry, lazy freeing, flushes and snapshots.
+    background,
+    // keep it last.
+    count,
+};
+
+inline const char* work_class_name(work_class c)
+{
+    switch (c) {
+    case work_class::point: return "point";
+    case work_class::heavy: return "heavy";
+    case work_class::background: return "background";
+    default: return nullptr;
+    }
+}
+
+// Shares of the reactor of a shard between the classes of work, as the
+// scheduling groups of later seastars give them. Point work always runs.
+// While there is point work, heavy and background work take at most their
+// part of each period, by their shares over the shares of all, and what
+// comes over it waits for a later period; without point work they run
+// unthrottled.
+//
+// Only the synchronous part of a unit is accounted, which is where a
+// command, or a slice of the expiry, holds the reactor.
+class work_scheduler {
+public:
+    using clock_type = std::chrono::steady_clock;
+    static constexpr size_t classes = static_cast<size_t>(work_class::count);
+    struct class_stats {
+        uint64_t _runs = 0;
+        // Runs which waited for a later period.
+        uint64_t _deferred = 0;
+        uint64_t _usec = 0;
+    };
+private:
+    std::array<unsigned, classes> _shares {{ 1000, 200, 100 }};
+    clock_type::duration _period = std::chrono::milliseconds(1);
+    clock_type::time_point _period_start;
+    std::array<clock_type::duration, classes> _used {};
+    // Whether point work ran in the current and in the previous period.
+    bool _point = false;
+    bool _point_before = false;
+    std::array<std::deque<seastar::promise<>>, classes> _waiting;
+    std::array<class_stats, classes> _stats {};
+    seastar::timer<clock_type> _timer;
+
+    void roll(clock_type::time_point now)
+    {
+        if (now - _period_start < _period) {
+            return;
+        }
+        _period_start = now;
+        _used = {};
+        _point_before = _point;
+        _point = false;
+    }
+    bool contended() const { return _point || _point_before; }
+    clock_type::duration quota(work_class c) const
+    {
+        auto total = std::accumulate(_shares.begin(), _shares.end(), 0u);
+        return _period * _shares[static_cast<size_t>(c)] / std::max(total, 1u);
+    }
+    bool may_run(work_class c)
+    {
+        roll(clock_type::now());
+        return c == work_class::point || !contended() || _used[static_cast<size_t>(c)] < quota(c);
+    }
+    // Lets the waiting work in, one unit per class and period while there
+    // is point work.
+    void on_timer()
+    {
+        for (size_t i = 0; i < classes; ++i) {
+            auto& waiting = _waiting[i];
+            while (!waiting.empty() && may_run(static_cast<work_class>(i))) {
+                auto p = std::move(waiting.front());
+                waiting.pop_front();
+                p.set_value();
+                if (contended()) {
+                    break;
+                }
+            }
+        }
+        if (std::any_of(_waiting.begin(), _waiting.end(), [] (auto& w) { return !w.empty(); })) {
+            _timer.arm(next_period());
+        }
+    }
+public:
+    work_scheduler()
+    {
+        _timer.set_callback([this] { on_timer(); });
+    }
+    work_scheduler(const work_scheduler&) = delete;
+    work_scheduler& operator = (const work_scheduler&) = delete;
+
+    void set_shares(work_class c, unsigned shares) { _shares[static_cast<size_t>(c)] = std::max(shares, 1u); }
+    unsigned shares(work_class c) const { return _shares[static_cast<size_t>(c)]; }
+    void set_period(clock_type::duration period) { _period = period; }
+    clock_type::time_point next_period() const { return _period_start + _period; }
+
+    void note_point() { _point = true; }
+    void account(work_class c, clock_type::duration d)
+    {
+        roll(clock_type::now());
+        _used[static_cast<size_t>(c)] += d;
+        _stats[static_cast<size_t>(c)]._usec += std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+    }
+
+    // For the work of timers: whether a unit of the class may run now. If
+    // not, its timer is armed for next_period().
+    bool try_run(work_class c)
+    {
+        auto& stats = _stats[static_cast<size_t>(c)];
+        if (c == work_class::point) {
+            note_point();
+        }
+        if (may_run(c)) {
+            ++stats._runs;
+            return true;
+        }
+        ++stats._deferred;
+        return false;
+    }
+    // Resolves when a unit of the class may run.
+    seastar::future<> admit(work_class c)
+    {
+        if (try_run(c)) {
+            return seastar::make_ready_future<>();
+        }
+        ++_stats[static_cast<size_t>(c)]._runs;
+        auto& waiting = _waiting[static_cast<size_t>(c)];
+        waiting.emplace_back();
+        if (!_timer.armed()) {
+            _timer.arm(next_period());
+        }
+        return waiting.back().get_future();
+    }
+    // Runs func() as a unit of the class once it is admitted.
+    template <typename Func>
+    seastar::futurize_t<std::result_of_t<Func()>> run(work_class c, Func&& func)
+    {
+        if (c == work_class::point) {
+            note_point();
+            ++_stats[static_cast<size_t>(c)]._runs;
+            return seastar::futurize_apply(std::forward<Func>(func));
+        }
+        return admit(c).then([this, c, func = std::forward<Func>(func)] () mutable {
+            auto start = clock_type::now();
+            auto f = seastar::futurize_apply(func);
+            account(c, clock_type::now() - start);
+            return f;
+        });
+    }
+
+    const class_stats& stats(work_class c) const { return _stats[static_cast<size_t>(c)]; }
+};
+
+inline work_scheduler& local_work_scheduler()
+{
+    static thread_local work_scheduler scheduler;
+    return scheduler;
+}
+
+// The class of the command whose handler is running on this shard, set by
+// work_class_scope for the synchronous part of the handler, as
+// current_trace(). The owner runs the command's calls in this class.
+inline work_class& current_work_class()
+{
+    static thread_local work_class c = work_class::point;
+    return c;
+}
+
+class work_class_scope {
+    work_class _previous;
+public:
+    explicit work_class_scope(work_class c) : _previous(current_work_class()) { current_work_class() = c; }
+    ~work_class_scope() { current_work_class() = _previous; }
+    work_class_scope(const work_class_scope&) = delete;
+    work_class_scope& operator = (const work_class_scope&) = delete;
+};
+
+}